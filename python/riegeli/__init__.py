@@ -33,7 +33,7 @@ __all__ = ('RiegeliError', 'CancelledError', 'UnknownError',
            'UnimplementedError', 'InternalError', 'UnavailableError',
            'DataLossError', 'FlushType', 'RecordPosition', 'SkippedRegion',
            'RecordsMetadata', 'set_record_type', 'RecordWriter',
-           'EXISTENCE_ONLY', 'get_record_type', 'RecordReader')
+           'EXISTENCE_ONLY', 'get_record_type', 'split_file', 'RecordReader')
 
 # pylint: disable=invalid-name
 RiegeliError = riegeli_error.RiegeliError
@@ -61,4 +61,5 @@ set_record_type = record_writer.set_record_type
 RecordWriter = record_writer.RecordWriter
 EXISTENCE_ONLY = record_reader.EXISTENCE_ONLY
 get_record_type = record_reader.get_record_type
+split_file = record_reader.split_file
 RecordReader = record_reader.RecordReader
@@ -25,6 +25,7 @@
 
 #include <stddef.h>
 #include <stdint.h>
+#include <sys/stat.h>
 
 #include <limits>
 #include <memory>
@@ -402,5 +403,48 @@ bool PositionFromPython(PyObject* object, Position* value) {
   return true;
 }
 
+PythonPtr OpenIfPath(PyObject* object, absl::string_view mode) {
+  bool is_path = PyUnicode_Check(object) || PyBytes_Check(object);
+  if (!is_path) {
+    static constexpr Identifier id_fspath("__fspath__");
+    const int has_fspath = PyObject_HasAttr(object, id_fspath.get());
+    is_path = has_fspath > 0;
+  }
+  if (!is_path) {
+    Py_INCREF(object);
+    return PythonPtr(object);
+  }
+  // return io.open(object, mode)
+  static constexpr ImportedConstant kOpen("io", "open");
+  if (ABSL_PREDICT_FALSE(!kOpen.Verify())) return nullptr;
+  const PythonPtr mode_object = StringToPython(mode);
+  if (ABSL_PREDICT_FALSE(mode_object == nullptr)) return nullptr;
+  return PythonPtr(PyObject_CallFunctionObjArgs(kOpen.get(), object,
+                                                mode_object.get(), nullptr));
+}
+
+int RegularFileDescriptor(PyObject* file) {
+  static constexpr Identifier id_fileno("fileno");
+  const PythonPtr fileno_result(
+      PyObject_CallMethodObjArgs(file, id_fileno.get(), nullptr));
+  if (fileno_result == nullptr) {
+    // The file has no `fileno()`, or it is not backed by a file descriptor,
+    // e.g. `io.BytesIO`.
+    PyErr_Clear();
+    return -1;
+  }
+  const long fd = PyLong_AsLong(fileno_result.get());
+  if (fd == -1 && PyErr_Occurred()) {
+    PyErr_Clear();
+    return -1;
+  }
+  if (fd < 0 || fd > std::numeric_limits<int>::max()) return -1;
+  struct stat stat_info;
+  if (fstat(IntCast<int>(fd), &stat_info) < 0 || !S_ISREG(stat_info.st_mode)) {
+    return -1;
+  }
+  return IntCast<int>(fd);
+}
+
 }  // namespace python
 }  // namespace riegeli
@@ -532,6 +532,19 @@ PythonPtr PositionToPython(Position value);
 // Returns `false` on failure (with Python exception set).
 bool PositionFromPython(PyObject* object, Position* value);
 
+// If `object` is a file path (`str`, `bytes`, or an object with
+// `__fspath__()`), opens it with `io.open(object, mode)`, otherwise returns a
+// new reference to `object`.
+//
+// Returns `nullptr` on failure (with Python exception set).
+PythonPtr OpenIfPath(PyObject* object, absl::string_view mode);
+
+// Returns the file descriptor of a Python file object if its `fileno()` refers
+// to a regular file, so that it can be read or written directly with `pread()`
+// or `pwrite()` without the GIL. Otherwise returns -1 (without Python exception
+// set).
+int RegularFileDescriptor(PyObject* file);
+
 // Implementation details follow.
 
 inline Exception::Exception(const Exception& that) noexcept { *this = that; }
@@ -24,7 +24,11 @@
 // clang-format: do not reorder the above include.
 
 #include <stddef.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
 
+#include <cerrno>
 #include <cstring>
 #include <limits>
 #include <memory>
@@ -36,6 +40,7 @@
 #include "python/riegeli/base/utils.h"
 #include "riegeli/base/base.h"
 #include "riegeli/base/canonical_errors.h"
+#include "riegeli/base/errno_mapping.h"
 #include "riegeli/base/status.h"
 #include "riegeli/bytes/buffered_reader.h"
 
@@ -65,6 +70,7 @@ PythonReader::PythonReader(PyObject* src, Options options)
       return;
     }
     limit_pos_ = file_pos;
+    fd_ = RegularFileDescriptor(src_.get());
   }
 }
 
@@ -117,6 +123,7 @@ bool PythonReader::ReadInternal(char* dest, size_t min_length,
                          std::numeric_limits<Position>::max() - limit_pos_)) {
     return FailOverflow();
   }
+  if (fd_ >= 0) return ReadFromFd(dest, min_length, max_length);
   PythonLock lock;
   // Find a read function to use, preferring in order: `readinto1()`,
   // `readinto()`, `read1()`, `read()`.
@@ -264,6 +271,34 @@ bool PythonReader::ReadInternal(char* dest, size_t min_length,
   }
 }
 
+inline bool PythonReader::ReadFromFd(char* dest, size_t min_length,
+                                     size_t max_length) {
+  if (ABSL_PREDICT_FALSE(max_length >
+                         Position{std::numeric_limits<off_t>::max()} -
+                             limit_pos_)) {
+    return FailOverflow();
+  }
+  for (;;) {
+  again:
+    const ssize_t length_read = pread(
+        fd_, dest,
+        UnsignedMin(max_length, size_t{std::numeric_limits<ssize_t>::max()}),
+        IntCast<off_t>(limit_pos_));
+    if (ABSL_PREDICT_FALSE(length_read < 0)) {
+      if (errno == EINTR) goto again;
+      return Fail(ErrnoToCanonicalStatus(errno, "pread() failed"));
+    }
+    if (ABSL_PREDICT_FALSE(length_read == 0)) return false;
+    RIEGELI_ASSERT_LE(IntCast<size_t>(length_read), max_length)
+        << "pread() read more than requested";
+    limit_pos_ += IntCast<size_t>(length_read);
+    if (IntCast<size_t>(length_read) >= min_length) return true;
+    dest += length_read;
+    min_length -= IntCast<size_t>(length_read);
+    max_length -= IntCast<size_t>(length_read);
+  }
+}
+
 bool PythonReader::SeekSlow(Position new_pos) {
   RIEGELI_ASSERT(new_pos < start_pos() || new_pos > limit_pos_)
       << "Failed precondition of Reader::SeekSlow(): "
@@ -273,6 +308,20 @@ bool PythonReader::SeekSlow(Position new_pos) {
     return BufferedReader::SeekSlow(new_pos);
   }
   ClearBuffer();
+  if (fd_ >= 0) {
+    if (new_pos > limit_pos_) {
+      // Seeking forwards.
+      Position size;
+      if (ABSL_PREDICT_FALSE(!SizeInternal(&size))) return false;
+      if (ABSL_PREDICT_FALSE(new_pos > size)) {
+        // File ends.
+        limit_pos_ = size;
+        return false;
+      }
+    }
+    limit_pos_ = new_pos;
+    return true;
+  }
   PythonLock lock;
   if (new_pos > limit_pos_) {
     // Seeking forwards.
@@ -303,6 +352,7 @@ bool PythonReader::Size(Position* size) {
   if (ABSL_PREDICT_FALSE(!random_access_)) {
     return Fail(UnimplementedError("PythonReader::Size() not supported"));
   }
+  if (fd_ >= 0) return SizeInternal(size);
   PythonLock lock;
   if (ABSL_PREDICT_FALSE(!SizeInternal(size))) return false;
   const PythonPtr file_pos = PositionToPython(limit_pos_);
@@ -324,6 +374,14 @@ inline bool PythonReader::SizeInternal(Position* size) {
   RIEGELI_ASSERT(random_access_)
       << "Failed precondition of PythonReader::SizeInternal(): "
          "random access not supported";
+  if (fd_ >= 0) {
+    struct stat stat_info;
+    if (ABSL_PREDICT_FALSE(fstat(fd_, &stat_info) < 0)) {
+      return Fail(ErrnoToCanonicalStatus(errno, "fstat() failed"));
+    }
+    *size = IntCast<Position>(stat_info.st_size);
+    return true;
+  }
   PythonLock::AssertHeld();
   absl::string_view operation;
   const PythonPtr file_pos = PositionToPython(0);
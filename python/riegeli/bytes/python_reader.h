@@ -47,6 +47,10 @@ namespace python {
 //                         or for `Seek()` or `Size()`
 //  * `tell()`           - unless `Options::set_assumed_pos(pos)`,
 //                         or for `Seek()` or `Size()`
+//
+// If random access is used and `fileno()` refers to a regular file, data are
+// read from the file descriptor with `pread()` without taking the GIL, and the
+// file position is updated only by `Close()`.
 class PythonReader : public BufferedReader {
  public:
   class Options {
@@ -132,9 +136,13 @@ class PythonReader : public BufferedReader {
   ABSL_ATTRIBUTE_COLD bool FailOperation(absl::string_view operation);
   bool SizeInternal(Position* size);
 
+  bool ReadFromFd(char* dest, size_t min_length, size_t max_length);
+
   PythonPtrLocking src_;
   bool close_ = false;
   bool random_access_ = false;
+  // If not -1, the file descriptor of `src_`, which is read directly.
+  int fd_ = -1;
   Exception exception_;
   PythonPtrLocking read_function_;
   absl::string_view read_function_name_;
@@ -146,6 +154,7 @@ inline PythonReader::PythonReader(PythonReader&& that) noexcept
       src_(std::move(that.src_)),
       close_(that.close_),
       random_access_(that.random_access_),
+      fd_(that.fd_),
       exception_(std::move(that.exception_)),
       read_function_(std::move(that.read_function_)),
       read_function_name_(that.read_function_name_),
@@ -156,6 +165,7 @@ inline PythonReader& PythonReader::operator=(PythonReader&& that) noexcept {
   src_ = std::move(that.src_);
   close_ = that.close_;
   random_access_ = that.random_access_;
+  fd_ = that.fd_;
   exception_ = std::move(that.exception_);
   read_function_ = std::move(that.read_function_);
   read_function_name_ = that.read_function_name_;
@@ -23,8 +23,13 @@
 #include "python/riegeli/bytes/python_writer.h"
 // clang-format: do not reorder the above include.
 
+#include <fcntl.h>
 #include <stddef.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
 
+#include <cerrno>
 #include <limits>
 #include <memory>
 
@@ -35,6 +40,7 @@
 #include "python/riegeli/base/utils.h"
 #include "riegeli/base/base.h"
 #include "riegeli/base/canonical_errors.h"
+#include "riegeli/base/errno_mapping.h"
 #include "riegeli/base/status.h"
 #include "riegeli/bytes/buffered_writer.h"
 
@@ -64,6 +70,22 @@ PythonWriter::PythonWriter(PyObject* dest, Options options)
       return;
     }
     start_pos_ = file_pos;
+    const int fd = RegularFileDescriptor(dest_.get());
+    if (fd >= 0) {
+      const int flags = fcntl(fd, F_GETFL);
+      if (flags >= 0 && (flags & O_ACCMODE) != O_RDONLY &&
+          (flags & O_APPEND) == 0) {
+        // Write data buffered by the file object before writing to `fd`.
+        static constexpr Identifier id_flush("flush");
+        const PythonPtr flush_result(
+            PyObject_CallMethodObjArgs(dest_.get(), id_flush.get(), nullptr));
+        if (ABSL_PREDICT_FALSE(flush_result == nullptr)) {
+          FailOperation("flush()");
+          return;
+        }
+        fd_ = fd;
+      }
+    }
   }
 }
 
@@ -81,6 +103,18 @@ bool PythonWriter::FailOperation(absl::string_view operation) {
 
 void PythonWriter::Done() {
   PushInternal();
+  if (ABSL_PREDICT_TRUE(healthy()) && fd_ >= 0) {
+    PythonLock lock;
+    const PythonPtr file_pos = PositionToPython(start_pos_);
+    if (ABSL_PREDICT_FALSE(file_pos == nullptr)) {
+      FailOperation("PositionToPython()");
+    } else {
+      static constexpr Identifier id_seek("seek");
+      const PythonPtr seek_result(PyObject_CallMethodObjArgs(
+          dest_.get(), id_seek.get(), file_pos.get(), nullptr));
+      if (ABSL_PREDICT_FALSE(seek_result == nullptr)) FailOperation("seek()");
+    }
+  }
   BufferedWriter::Done();
   if (close_ && dest_ != nullptr) {
     PythonLock lock;
@@ -104,6 +138,7 @@ bool PythonWriter::WriteInternal(absl::string_view src) {
                          std::numeric_limits<Position>::max() - start_pos_)) {
     return FailOverflow();
   }
+  if (fd_ >= 0) return WriteToFd(src);
   PythonLock lock;
   if (ABSL_PREDICT_FALSE(write_function_ == nullptr)) {
     static constexpr Identifier id_write("write");
@@ -214,6 +249,31 @@ bool PythonWriter::WriteInternal(absl::string_view src) {
   return true;
 }
 
+inline bool PythonWriter::WriteToFd(absl::string_view src) {
+  if (ABSL_PREDICT_FALSE(src.size() >
+                         Position{std::numeric_limits<off_t>::max()} -
+                             start_pos_)) {
+    return FailOverflow();
+  }
+  do {
+  again:
+    const ssize_t length_written = pwrite(
+        fd_, src.data(),
+        UnsignedMin(src.size(), size_t{std::numeric_limits<ssize_t>::max()}),
+        IntCast<off_t>(start_pos_));
+    if (ABSL_PREDICT_FALSE(length_written < 0)) {
+      if (errno == EINTR) goto again;
+      return Fail(ErrnoToCanonicalStatus(errno, "pwrite() failed"));
+    }
+    RIEGELI_ASSERT_GT(length_written, 0) << "pwrite() wrote nothing";
+    RIEGELI_ASSERT_LE(IntCast<size_t>(length_written), src.size())
+        << "pwrite() wrote more than requested";
+    start_pos_ += IntCast<size_t>(length_written);
+    src.remove_prefix(IntCast<size_t>(length_written));
+  } while (!src.empty());
+  return true;
+}
+
 bool PythonWriter::Flush(FlushType flush_type) {
   if (ABSL_PREDICT_FALSE(!PushInternal())) return false;
   switch (flush_type) {
@@ -244,6 +304,20 @@ bool PythonWriter::SeekSlow(Position new_pos) {
   if (ABSL_PREDICT_FALSE(!PushInternal())) return false;
   RIEGELI_ASSERT_EQ(written_to_buffer(), 0u)
       << "BufferedWriter::PushInternal() did not empty the buffer";
+  if (fd_ >= 0) {
+    if (new_pos >= start_pos_) {
+      // Seeking forwards.
+      Position size;
+      if (ABSL_PREDICT_FALSE(!SizeInternal(&size))) return false;
+      if (ABSL_PREDICT_FALSE(new_pos > size)) {
+        // File ends.
+        start_pos_ = size;
+        return false;
+      }
+    }
+    start_pos_ = new_pos;
+    return true;
+  }
   PythonLock lock;
   if (new_pos >= start_pos_) {
     // Seeking forwards.
@@ -274,6 +348,7 @@ bool PythonWriter::Size(Position* size) {
   if (ABSL_PREDICT_FALSE(!random_access_)) {
     return Fail(UnimplementedError("PythonWriter::Size() not supported"));
   }
+  if (fd_ >= 0) return SizeInternal(size);
   PythonLock lock;
   if (ABSL_PREDICT_FALSE(!SizeInternal(size))) return false;
   const PythonPtr file_pos = PositionToPython(start_pos_);
@@ -295,6 +370,14 @@ inline bool PythonWriter::SizeInternal(Position* size) {
   RIEGELI_ASSERT(random_access_)
       << "Failed precondition of PythonWriter::SizeInternal(): "
          "random access not supported";
+  if (fd_ >= 0) {
+    struct stat stat_info;
+    if (ABSL_PREDICT_FALSE(fstat(fd_, &stat_info) < 0)) {
+      return Fail(ErrnoToCanonicalStatus(errno, "fstat() failed"));
+    }
+    *size = UnsignedMax(IntCast<Position>(stat_info.st_size), pos());
+    return true;
+  }
   PythonLock::AssertHeld();
   absl::string_view operation;
   const PythonPtr file_pos = PositionToPython(0);
@@ -334,6 +417,22 @@ bool PythonWriter::Truncate(Position new_size) {
     return Fail(UnimplementedError("PythonWriter::Truncate() not supported"));
   }
   if (ABSL_PREDICT_FALSE(!PushInternal())) return false;
+  if (fd_ >= 0) {
+    Position size;
+    if (ABSL_PREDICT_FALSE(!SizeInternal(&size))) return false;
+    if (ABSL_PREDICT_FALSE(new_size > size)) {
+      // File ends.
+      start_pos_ = size;
+      return false;
+    }
+  again:
+    if (ABSL_PREDICT_FALSE(ftruncate(fd_, IntCast<off_t>(new_size)) < 0)) {
+      if (errno == EINTR) goto again;
+      return Fail(ErrnoToCanonicalStatus(errno, "ftruncate() failed"));
+    }
+    start_pos_ = new_size;
+    return true;
+  }
   PythonLock lock;
   Position size;
   if (ABSL_PREDICT_FALSE(!SizeInternal(&size))) return false;
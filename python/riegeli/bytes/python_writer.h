@@ -48,6 +48,10 @@ namespace python {
 //  * `tell()`           - unless `Options::set_assumed_pos(pos)`,
 //                         or for `Seek()`, `Size()`, or `Truncate()`
 //  * `truncate()`       - for `Truncate()`
+//
+// If random access is used and `fileno()` refers to a regular file not opened
+// for appending, data are written to the file descriptor with `pwrite()`
+// without taking the GIL, and the file position is updated only by `Close()`.
 class PythonWriter : public BufferedWriter {
  public:
   class Options {
@@ -132,10 +136,13 @@ class PythonWriter : public BufferedWriter {
  private:
   ABSL_ATTRIBUTE_COLD bool FailOperation(absl::string_view operation);
   bool SizeInternal(Position* size);
+  bool WriteToFd(absl::string_view src);
 
   PythonPtrLocking dest_;
   bool close_ = false;
   bool random_access_ = false;
+  // If not -1, the file descriptor of `dest_`, which is written directly.
+  int fd_ = -1;
   Exception exception_;
   PythonPtrLocking write_function_;
   bool use_bytes_ = false;
@@ -146,6 +153,7 @@ inline PythonWriter::PythonWriter(PythonWriter&& that) noexcept
       dest_(std::move(that.dest_)),
       close_(that.close_),
       random_access_(that.random_access_),
+      fd_(that.fd_),
       exception_(std::move(that.exception_)),
       write_function_(std::move(that.write_function_)),
       use_bytes_(that.use_bytes_) {}
@@ -155,6 +163,7 @@ inline PythonWriter& PythonWriter::operator=(PythonWriter&& that) noexcept {
   dest_ = std::move(that.dest_);
   close_ = that.close_;
   random_access_ = that.random_access_;
+  fd_ = that.fd_;
   exception_ = std::move(that.exception_);
   write_function_ = std::move(that.write_function_);
   use_bytes_ = that.use_bytes_;
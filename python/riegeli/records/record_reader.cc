@@ -23,10 +23,15 @@
 #include <stddef.h>
 #include <stdint.h>
 
+#include <limits>
 #include <memory>
+#include <string>
 #include <utility>
+#include <vector>
 
 #include "absl/base/optimization.h"
+#include "absl/strings/string_view.h"
+#include "absl/types/span.h"
 #include "python/riegeli/base/utils.h"
 #include "python/riegeli/bytes/python_reader.h"
 #include "python/riegeli/records/record_position.h"
@@ -135,6 +140,17 @@ struct PyRecordIterObject {
 
 extern PyTypeObject PyRecordIter_Type;
 
+struct PyRecordsBufferObject {
+  // clang-format off
+  PyObject_HEAD
+  static_assert(true, "");  // clang-format workaround.
+  // clang-format on
+
+  PythonWrapped<std::string> data;
+};
+
+extern PyTypeObject PyRecordsBuffer_Type;
+
 bool RecordReaderHasException(PyRecordReaderObject* self) {
   return self->recovery_exception.has_value() ||
          !self->record_reader->healthy();
@@ -224,16 +240,91 @@ bool TagFromPython(PyObject* object, uint32_t* value) {
   return VerifyTag(tag_value, value);
 }
 
+// Converts a `(begin, end)` pair to `FileRange`. `end` can be `None`, meaning
+// the end of the file.
+bool FileRangeFromPython(PyObject* object, FileRange* value) {
+  const PythonPtr pair(
+      PySequence_Fast(object, "Expected a (begin, end) pair for range"));
+  if (ABSL_PREDICT_FALSE(pair == nullptr)) return false;
+  if (ABSL_PREDICT_FALSE(PySequence_Fast_GET_SIZE(pair.get()) != 2)) {
+    PyErr_Format(PyExc_ValueError,
+                 "Expected a (begin, end) pair for range, not %zd elements",
+                 PySequence_Fast_GET_SIZE(pair.get()));
+    return false;
+  }
+  FileRange range;
+  if (ABSL_PREDICT_FALSE(!PositionFromPython(
+          PySequence_Fast_GET_ITEM(pair.get(), 0), &range.begin))) {
+    return false;
+  }
+  PyObject* const end_object = PySequence_Fast_GET_ITEM(pair.get(), 1);
+  if (end_object != Py_None) {
+    if (ABSL_PREDICT_FALSE(!PositionFromPython(end_object, &range.end))) {
+      return false;
+    }
+  }
+  if (ABSL_PREDICT_FALSE(range.begin > range.end)) {
+    PyErr_Format(PyExc_ValueError, "Range begin after end: [%llu..%llu)",
+                 static_cast<unsigned long long>(range.begin),
+                 static_cast<unsigned long long>(range.end));
+    return false;
+  }
+  *value = range;
+  return true;
+}
+
+extern "C" PyObject* SplitFileRanges(PyObject* self, PyObject* args,
+                                     PyObject* kwargs) {
+  static constexpr const char* keywords[] = {"size", "num_ranges", nullptr};
+  PyObject* size_arg;
+  PyObject* num_ranges_arg;
+  if (ABSL_PREDICT_FALSE(!PyArg_ParseTupleAndKeywords(
+          args, kwargs, "OO:split_file", const_cast<char**>(keywords),
+          &size_arg, &num_ranges_arg))) {
+    return nullptr;
+  }
+  Position size;
+  if (ABSL_PREDICT_FALSE(!PositionFromPython(size_arg, &size))) return nullptr;
+  size_t num_ranges;
+  if (ABSL_PREDICT_FALSE(!SizeFromPython(num_ranges_arg, &num_ranges))) {
+    return nullptr;
+  }
+  if (ABSL_PREDICT_FALSE(num_ranges == 0)) {
+    PyErr_SetString(PyExc_ValueError, "num_ranges must be positive");
+    return nullptr;
+  }
+  const std::vector<FileRange> ranges = SplitFile(size, num_ranges);
+  PythonPtr result(PyList_New(IntCast<Py_ssize_t>(ranges.size())));
+  if (ABSL_PREDICT_FALSE(result == nullptr)) return nullptr;
+  for (size_t i = 0; i < ranges.size(); ++i) {
+    const PythonPtr begin_object = PositionToPython(ranges[i].begin);
+    if (ABSL_PREDICT_FALSE(begin_object == nullptr)) return nullptr;
+    const PythonPtr end_object = PositionToPython(ranges[i].end);
+    if (ABSL_PREDICT_FALSE(end_object == nullptr)) return nullptr;
+    PyObject* const range_object =
+        PyTuple_Pack(2, begin_object.get(), end_object.get());
+    if (ABSL_PREDICT_FALSE(range_object == nullptr)) return nullptr;
+    PyList_SET_ITEM(result.get(), IntCast<Py_ssize_t>(i), range_object);
+  }
+  return result.release();
+}
+
 extern "C" int RecordReaderInit(PyRecordReaderObject* self, PyObject* args,
                                 PyObject* kwargs) {
-  static constexpr const char* keywords[] = {
-      "src",      "close", "assumed_pos", "buffer_size", "field_projection",
-      "recovery", nullptr};
+  static constexpr const char* keywords[] = {"src",
+                                             "close",
+                                             "assumed_pos",
+                                             "buffer_size",
+                                             "field_projection",
+                                             "range",
+                                             "recovery",
+                                             nullptr};
   PyObject* src_arg;
   PyObject* close_arg = nullptr;
   PyObject* assumed_pos_arg = nullptr;
   PyObject* buffer_size_arg = nullptr;
   PyObject* field_projection_arg = nullptr;
+  PyObject* range_arg = nullptr;
   PyObject* recovery_arg = nullptr;
   if (ABSL_PREDICT_FALSE(!PyArg_ParseTupleAndKeywords(
           args, kwargs,
@@ -241,9 +332,10 @@ extern "C" int RecordReaderInit(PyRecordReaderObject* self, PyObject* args,
 #if PY_VERSION_HEX >= 0x03030000
           "$"
 #endif
-          "OOOOO:RecordReader",
+          "OOOOOO:RecordReader",
           const_cast<char**>(keywords), &src_arg, &close_arg, &assumed_pos_arg,
-          &buffer_size_arg, &field_projection_arg, &recovery_arg))) {
+          &buffer_size_arg, &field_projection_arg, &range_arg,
+          &recovery_arg))) {
     return -1;
   }
 
@@ -291,6 +383,11 @@ extern "C" int RecordReaderInit(PyRecordReaderObject* self, PyObject* args,
     if (ABSL_PREDICT_FALSE(PyErr_Occurred() != nullptr)) return -1;
     record_reader_options.set_field_projection(std::move(field_projection));
   }
+  if (range_arg != nullptr && range_arg != Py_None) {
+    FileRange range;
+    if (ABSL_PREDICT_FALSE(!FileRangeFromPython(range_arg, &range))) return -1;
+    record_reader_options.set_range(range);
+  }
   if (recovery_arg != nullptr && recovery_arg != Py_None) {
     Py_INCREF(recovery_arg);
     Py_XDECREF(self->recovery);
@@ -342,7 +439,11 @@ extern "C" int RecordReaderInit(PyRecordReaderObject* self, PyObject* args,
         });
   }
 
-  PythonReader python_reader(src_arg, std::move(python_reader_options));
+  const PythonPtr src = OpenIfPath(src_arg, "rb");
+  if (ABSL_PREDICT_FALSE(src == nullptr)) return -1;
+  // A file opened from a path is owned.
+  if (src.get() != src_arg) python_reader_options.set_close(true);
+  PythonReader python_reader(src.get(), std::move(python_reader_options));
   PythonUnlocked([&] {
     self->record_reader.emplace(std::move(python_reader),
                                 std::move(record_reader_options));
@@ -511,6 +612,110 @@ extern "C" PyObject* RecordReaderReadRecordWithKey(PyRecordReaderObject* self,
   return PyTuple_Pack(2, key_object.get(), record_object.get());
 }
 
+extern "C" PyObject* RecordReaderReadRecordsBatch(PyRecordReaderObject* self,
+                                                  PyObject* args,
+                                                  PyObject* kwargs) {
+  static constexpr const char* keywords[] = {"max_num_records", "copy",
+                                             nullptr};
+  PyObject* max_num_records_arg = nullptr;
+  PyObject* copy_arg = nullptr;
+  if (ABSL_PREDICT_FALSE(!PyArg_ParseTupleAndKeywords(
+          args, kwargs, "|OO:read_records_batch", const_cast<char**>(keywords),
+          &max_num_records_arg, &copy_arg))) {
+    return nullptr;
+  }
+  size_t max_num_records = std::numeric_limits<size_t>::max();
+  if (max_num_records_arg != nullptr && max_num_records_arg != Py_None) {
+    if (ABSL_PREDICT_FALSE(
+            !SizeFromPython(max_num_records_arg, &max_num_records))) {
+      return nullptr;
+    }
+  }
+  bool copy = true;
+  if (copy_arg != nullptr) {
+    const int copy_value = PyObject_IsTrue(copy_arg);
+    if (ABSL_PREDICT_FALSE(copy_value < 0)) return nullptr;
+    copy = copy_value != 0;
+  }
+  if (ABSL_PREDICT_FALSE(!self->record_reader.Verify())) return nullptr;
+  if (copy) {
+    // Decode the records without the GIL, then copy them to `bytes` objects.
+    // `records` remains valid because `self->record_reader` is not used until
+    // then.
+    absl::Span<const absl::string_view> records;
+    const bool ok = PythonUnlocked([&] {
+      return self->record_reader->ReadRecords(&records, max_num_records);
+    });
+    if (ABSL_PREDICT_FALSE(!ok)) {
+      if (ABSL_PREDICT_FALSE(RecordReaderHasException(self))) {
+        SetExceptionFromRecordReader(self);
+        return nullptr;
+      }
+      return PyList_New(0);
+    }
+    PythonPtr result(PyList_New(IntCast<Py_ssize_t>(records.size())));
+    if (ABSL_PREDICT_FALSE(result == nullptr)) return nullptr;
+    for (size_t i = 0; i < records.size(); ++i) {
+      PythonPtr record_object = BytesToPython(records[i]);
+      if (ABSL_PREDICT_FALSE(record_object == nullptr)) return nullptr;
+      PyList_SET_ITEM(result.get(), IntCast<Py_ssize_t>(i),
+                      record_object.release());
+    }
+    return result.release();
+  }
+  // Records of a batch are a contiguous range of decoded chunk data. Move them
+  // without the GIL to a single buffer owned by a `RecordsBuffer`, and return
+  // `memoryview`s into it, which keep it alive.
+  std::unique_ptr<PyRecordsBufferObject, Deleter> buffer(
+      reinterpret_cast<PyRecordsBufferObject*>(
+          PyRecordsBuffer_Type.tp_alloc(&PyRecordsBuffer_Type, 0)));
+  if (ABSL_PREDICT_FALSE(buffer == nullptr)) return nullptr;
+  buffer->data.emplace();
+  std::vector<size_t> limits;
+  const bool ok = PythonUnlocked([&] {
+    absl::Span<const absl::string_view> records;
+    if (ABSL_PREDICT_FALSE(
+            !self->record_reader->ReadRecords(&records, max_num_records))) {
+      return false;
+    }
+    const char* const data = records.front().data();
+    limits.reserve(records.size());
+    for (const absl::string_view record : records) {
+      limits.push_back(PtrDistance(data, record.data() + record.size()));
+    }
+    buffer->data->assign(data, limits.back());
+    return true;
+  });
+  if (ABSL_PREDICT_FALSE(!ok)) {
+    if (ABSL_PREDICT_FALSE(RecordReaderHasException(self))) {
+      SetExceptionFromRecordReader(self);
+      return nullptr;
+    }
+    return PyList_New(0);
+  }
+  const PythonPtr view(
+      PyMemoryView_FromObject(reinterpret_cast<PyObject*>(buffer.get())));
+  if (ABSL_PREDICT_FALSE(view == nullptr)) return nullptr;
+  PythonPtr result(PyList_New(IntCast<Py_ssize_t>(limits.size())));
+  if (ABSL_PREDICT_FALSE(result == nullptr)) return nullptr;
+  size_t record_begin = 0;
+  for (size_t i = 0; i < limits.size(); ++i) {
+    // view[record_begin:limits[i]]
+    const PythonPtr begin_object = SizeToPython(record_begin);
+    if (ABSL_PREDICT_FALSE(begin_object == nullptr)) return nullptr;
+    const PythonPtr end_object = SizeToPython(limits[i]);
+    if (ABSL_PREDICT_FALSE(end_object == nullptr)) return nullptr;
+    const PythonPtr slice(
+        PySlice_New(begin_object.get(), end_object.get(), nullptr));
+    if (ABSL_PREDICT_FALSE(slice == nullptr)) return nullptr;
+    PyObject* const record_object = PyObject_GetItem(view.get(), slice.get());
+    if (ABSL_PREDICT_FALSE(record_object == nullptr)) return nullptr;
+    PyList_SET_ITEM(result.get(), IntCast<Py_ssize_t>(i), record_object);
+    record_begin = limits[i];
+  }
+  return result.release();
+}
+
 extern "C" PyObject* RecordReaderReadMessage(PyRecordReaderObject* self,
                                              PyObject* args, PyObject* kwargs) {
   static constexpr const char* keywords[] = {"message_type", nullptr};
@@ -784,7 +989,9 @@ Returns file metadata.
 Record type in metadata can be conveniently interpreted by get_record_type().
 
 read_metadata() must be called while the RecordReader is at the beginning of the
-file (calling check_file_format() before is allowed).
+file (calling check_file_format() before is allowed), unless the file supports
+random access. Then read_metadata() can be called at any time, without changing
+the current position.
 
 Returns:
   File metadata as parsed RecordsMetadata message, or None at end of file.
@@ -821,6 +1028,30 @@ Reads the next record.
 Returns:
   If successful, a tuple of canonical record position and the record read as
   bytes. Returns None at end of file.
+)doc"},
+    {"read_records_batch",
+     reinterpret_cast<PyCFunction>(RecordReaderReadRecordsBatch),
+     METH_VARARGS | METH_KEYWORDS, R"doc(
+read_records_batch(
+    self, max_num_records: Optional[int] = None, copy: bool = True
+) -> Union[List[bytes], List[memoryview]]
+
+Reads up to max_num_records next records of the current chunk, all its
+remaining records by default, reading the next chunk if the current chunk ends.
+
+The GIL is released while the records are decoded, which avoids per-record
+overhead of read_record() when records are processed in batches anyway.
+
+Args:
+  max_num_records: The maximum number of records to read, or None for all
+    remaining records of the current chunk.
+  copy: If True, records are copied to separate bytes objects. If False,
+    records are read-only memoryviews into a single buffer shared by the batch,
+    which is kept alive while any of them exists. This avoids copying records
+    under the GIL, e.g. when they are passed directly to NumPy or a parser.
+
+Returns:
+  The records read, at least one record, or an empty list at end of file.
 )doc"},
     {"read_message", reinterpret_cast<PyCFunction>(RecordReaderReadMessage),
      METH_VARARGS | METH_KEYWORDS, R"doc(
@@ -990,18 +1221,21 @@ PyTypeObject PyRecordReader_Type = {
     Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE | Py_TPFLAGS_HAVE_GC,  // tp_flags
     R"doc(
 def RecordReader(
-    src: BinaryIO,
+    src: Union[BinaryIO, str, bytes, os.PathLike],
     *,
     close: bool = True,
     assumed_pos: Optional[int] = None,
     buffer_size: int = 64 << 10,
     field_projection: Optional[Iterable[Iterable[int]]] = None,
+    range: Optional[Tuple[int, Optional[int]]] = None,
     recovery: Optional[Callable[[SkippedRegion], Any]] = None) -> RecordReader
 
 Will read from the given file.
 
 Args:
-  src: Binary IO stream to read from.
+  src: Binary IO stream to read from, or a file path to open. If src is backed
+    by a regular file and assumed_pos is None, the file descriptor is read
+    directly without the GIL.
   close: If True, src is owned, and close() or __exit__() will call src.close().
   assumed_pos: If None, src must support random access, RecordReader will
     support random access, and RecordReader will set the position of src on
@@ -1019,6 +1253,11 @@ Args:
     tag value EXISTENCE_ONLY can be added to the end of the path; it preserves
     field existence but ignores its value; warning: for a repeated field this
     preserves the field count only if the field is not packed.
+  range: If not None, a (begin, end) pair of byte positions; only records of
+    chunks beginning in [begin..end) are read, and end can be None for the end
+    of the file. Ranges sharing an endpoint, e.g. returned by split_file(),
+    select each record exactly once, so they can be read by different workers.
+    This requires src to support random access.
   recovery: If None, then invalid file contents cause RecordReader to raise
     RiegeliError. If not None, then invalid file contents cause RecordReader to
     skip over the invalid region and call this recovery function with a
@@ -1164,6 +1403,92 @@ PyTypeObject PyRecordIter_Type = {
 #endif
 };
 
+extern "C" void RecordsBufferDestructor(PyRecordsBufferObject* self) {
+  self->data.reset();
+  Py_TYPE(self)->tp_free(self);
+}
+
+extern "C" int RecordsBufferGetBuffer(PyRecordsBufferObject* self,
+                                      Py_buffer* view, int flags) {
+  return PyBuffer_FillInfo(view, reinterpret_cast<PyObject*>(self),
+                           const_cast<char*>(self->data->data()),
+                           IntCast<Py_ssize_t>(self->data->size()), 1, flags);
+}
+
+PyBufferProcs RecordsBufferAsBuffer = {
+#if PY_MAJOR_VERSION < 3
+    nullptr,  // bf_getreadbuffer
+    nullptr,  // bf_getwritebuffer
+    nullptr,  // bf_getsegcount
+    nullptr,  // bf_getcharbuffer
+#endif
+    reinterpret_cast<getbufferproc>(RecordsBufferGetBuffer),  // bf_getbuffer
+    nullptr,  // bf_releasebuffer
+};
+
+PyTypeObject PyRecordsBuffer_Type = {
+    // clang-format off
+    PyVarObject_HEAD_INIT(&PyType_Type, 0)
+    // clang-format on
+    "RecordsBuffer",                                        // tp_name
+    sizeof(PyRecordsBufferObject),                          // tp_basicsize
+    0,                                                      // tp_itemsize
+    reinterpret_cast<destructor>(RecordsBufferDestructor),  // tp_dealloc
+    nullptr,                                                // tp_print
+    nullptr,                                                // tp_getattr
+    nullptr,                                                // tp_setattr
+#if PY_MAJOR_VERSION >= 3
+    nullptr,  // tp_as_async
+#else
+    nullptr,  // tp_compare
+#endif
+    nullptr,                 // tp_repr
+    nullptr,                 // tp_as_number
+    nullptr,                 // tp_as_sequence
+    nullptr,                 // tp_as_mapping
+    nullptr,                 // tp_hash
+    nullptr,                 // tp_call
+    nullptr,                 // tp_str
+    nullptr,                 // tp_getattro
+    nullptr,                 // tp_setattro
+    &RecordsBufferAsBuffer,  // tp_as_buffer
+#if PY_MAJOR_VERSION >= 3
+    Py_TPFLAGS_DEFAULT,  // tp_flags
+#else
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_NEWBUFFER,  // tp_flags
+#endif
+    nullptr,  // tp_doc
+    nullptr,  // tp_traverse
+    nullptr,  // tp_clear
+    nullptr,  // tp_richcompare
+    0,        // tp_weaklistoffset
+    nullptr,  // tp_iter
+    nullptr,  // tp_iternext
+    nullptr,  // tp_methods
+    nullptr,  // tp_members
+    nullptr,  // tp_getset
+    nullptr,  // tp_base
+    nullptr,  // tp_dict
+    nullptr,  // tp_descr_get
+    nullptr,  // tp_descr_set
+    0,        // tp_dictoffset
+    nullptr,  // tp_init
+    nullptr,  // tp_alloc
+    nullptr,  // tp_new
+    nullptr,  // tp_free
+    nullptr,  // tp_is_gc
+    nullptr,  // tp_bases
+    nullptr,  // tp_mro
+    nullptr,  // tp_cache
+    nullptr,  // tp_subclasses
+    nullptr,  // tp_weaklist
+    nullptr,  // tp_del
+    0,        // tp_version_tag
+#if PY_VERSION_HEX >= 0x030400a1
+    nullptr,  // tp_finalize
+#endif
+};
+
 const char* const kModuleName = "riegeli.records.record_reader";
 const char kModuleDoc[] = R"doc(Reads records from a Riegeli/records file.)doc";
 
@@ -1182,6 +1507,25 @@ Args:
 Returns:
   A generated message type corresponding to the type of records, or None if that
   information is not available in metadata.
+)doc"},
+    {"split_file", reinterpret_cast<PyCFunction>(SplitFileRanges),
+     METH_VARARGS | METH_KEYWORDS,
+     R"doc(
+split_file(size: int, num_ranges: int) -> List[Tuple[int, int]]
+
+Splits a file into ranges of roughly equal sizes, for reading them
+independently, e.g. by different workers, with the range argument of
+RecordReader.
+
+Ranges are balanced by bytes, so a range smaller than a chunk can contain no
+records.
+
+Args:
+  size: File size in bytes.
+  num_ranges: The number of ranges, which must be positive.
+
+Returns:
+  A list of num_ranges (begin, end) pairs.
 )doc"},
     {nullptr, nullptr, 0, nullptr},
 };
@@ -1207,6 +1551,9 @@ PyObject* InitModule() {
   if (ABSL_PREDICT_FALSE(PyType_Ready(&PyRecordIter_Type) < 0)) {
     return nullptr;
   }
+  if (ABSL_PREDICT_FALSE(PyType_Ready(&PyRecordsBuffer_Type) < 0)) {
+    return nullptr;
+  }
 #if PY_MAJOR_VERSION >= 3
   PythonPtr module(PyModule_Create(&kModuleDef));
 #else
@@ -22,7 +22,9 @@
 
 #include <stddef.h>
 
+#include <deque>
 #include <utility>
+#include <vector>
 
 #include "absl/base/optimization.h"
 #include "absl/strings/string_view.h"
@@ -320,7 +322,11 @@ extern "C" int RecordWriterInit(PyRecordWriterObject* self, PyObject* args,
     }
   }
 
-  PythonWriter python_writer(dest_arg, std::move(python_writer_options));
+  const PythonPtr dest = OpenIfPath(dest_arg, "wb");
+  if (ABSL_PREDICT_FALSE(dest == nullptr)) return -1;
+  // A file opened from a path is owned.
+  if (dest.get() != dest_arg) python_writer_options.set_close(true);
+  PythonWriter python_writer(dest.get(), std::move(python_writer_options));
   PythonUnlocked([&] {
     self->record_writer.emplace(std::move(python_writer),
                                 std::move(record_writer_options));
@@ -536,6 +542,73 @@ extern "C" PyObject* RecordWriterWriteRecords(PyRecordWriterObject* self,
   Py_RETURN_NONE;
 }
 
+extern "C" PyObject* RecordWriterWriteRecordsBatch(PyRecordWriterObject* self,
+                                                   PyObject* args,
+                                                   PyObject* kwargs) {
+  static constexpr const char* keywords[] = {"records", "offsets", nullptr};
+  PyObject* records_arg;
+  PyObject* offsets_arg = nullptr;
+  if (ABSL_PREDICT_FALSE(!PyArg_ParseTupleAndKeywords(
+          args, kwargs, "O|O:write_records_batch", const_cast<char**>(keywords),
+          &records_arg, &offsets_arg))) {
+    return nullptr;
+  }
+  // Buffers of the records are held until the batch is written, so that the
+  // records can be written without the GIL and without copying them.
+  std::deque<BytesLike> buffers;
+  std::vector<absl::string_view> records;
+  if (offsets_arg == nullptr || offsets_arg == Py_None) {
+    const PythonPtr iter(PyObject_GetIter(records_arg));
+    if (ABSL_PREDICT_FALSE(iter == nullptr)) return nullptr;
+    while (const PythonPtr record_object{PyIter_Next(iter.get())}) {
+      buffers.emplace_back();
+      if (ABSL_PREDICT_FALSE(!buffers.back().FromPython(record_object.get()))) {
+        return nullptr;
+      }
+      records.push_back(absl::string_view(buffers.back()));
+    }
+    if (ABSL_PREDICT_FALSE(PyErr_Occurred() != nullptr)) return nullptr;
+  } else {
+    buffers.emplace_back();
+    if (ABSL_PREDICT_FALSE(!buffers.back().FromPython(records_arg))) {
+      return nullptr;
+    }
+    const absl::string_view data(buffers.back());
+    const PythonPtr iter(PyObject_GetIter(offsets_arg));
+    if (ABSL_PREDICT_FALSE(iter == nullptr)) return nullptr;
+    size_t record_begin = 0;
+    bool first = true;
+    while (const PythonPtr offset_object{PyIter_Next(iter.get())}) {
+      size_t offset;
+      if (ABSL_PREDICT_FALSE(!SizeFromPython(offset_object.get(), &offset))) {
+        return nullptr;
+      }
+      if (ABSL_PREDICT_FALSE(offset < record_begin || offset > data.size())) {
+        PyErr_Format(PyExc_ValueError,
+                     "Offsets must be non-decreasing and at most the length "
+                     "of records (%zd), got %zu after %zu",
+                     IntCast<Py_ssize_t>(data.size()), offset, record_begin);
+        return nullptr;
+      }
+      if (first) {
+        first = false;
+      } else {
+        records.push_back(data.substr(record_begin, offset - record_begin));
+      }
+      record_begin = offset;
+    }
+    if (ABSL_PREDICT_FALSE(PyErr_Occurred() != nullptr)) return nullptr;
+  }
+  if (ABSL_PREDICT_FALSE(!self->record_writer.Verify())) return nullptr;
+  const bool ok = PythonUnlocked(
+      [&] { return self->record_writer->WriteRecords(records); });
+  if (ABSL_PREDICT_FALSE(!ok)) {
+    SetExceptionFromRecordWriter(self);
+    return nullptr;
+  }
+  Py_RETURN_NONE;
+}
+
 extern "C" PyObject* RecordWriterWriteRecordsWithKeys(
     PyRecordWriterObject* self, PyObject* args, PyObject* kwargs) {
   static constexpr const char* keywords[] = {"records", nullptr};
@@ -779,6 +852,29 @@ Writes a number of records.
 
 Args:
   records: Records to write as an iterable of bytes-like objects.
+)doc"},
+    {"write_records_batch",
+     reinterpret_cast<PyCFunction>(RecordWriterWriteRecordsBatch),
+     METH_VARARGS | METH_KEYWORDS, R"doc(
+write_records_batch(
+    self,
+    records: Union[Iterable[Union[bytes, bytearray, memoryview]],
+                   bytes, bytearray, memoryview],
+    offsets: Optional[Iterable[int]] = None) -> None
+
+Writes a number of records as a single batch.
+
+The records are collected first, and then written with the GIL released, so
+that encoding overlaps with other Python threads. This is faster than
+write_records() for many small records.
+
+Args:
+  records: If offsets is None, records to write as an iterable of bytes-like
+    objects. Otherwise a single bytes-like object containing concatenated
+    records, e.g. a NumPy array or the data buffer of an Arrow binary array.
+  offsets: If not None, boundaries of records in records, starting with the
+    beginning of the first record and ending with the end of the last record,
+    i.e. record i is records[offsets[i]:offsets[i + 1]].
 )doc"},
     {"write_records_with_keys",
      reinterpret_cast<PyCFunction>(RecordWriterWriteRecordsWithKeys),
@@ -894,7 +990,7 @@ PyTypeObject PyRecordWriter_Type = {
     Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE | Py_TPFLAGS_HAVE_GC,  // tp_flags
     R"doc(
 RecordWriter(
-    dest: BinaryIO,
+    dest: Union[BinaryIO, str, bytes, os.PathLike],
     *,
     close: bool = True,
     assumed_pos: Optional[int] = None,
@@ -907,7 +1003,9 @@ RecordWriter(
 Will write to the given file.
 
 Args:
-  dest: Binary IO stream to write to.
+  dest: Binary IO stream to write to, or a file path to create. If dest is
+    backed by a regular file not opened for appending and assumed_pos is None,
+    the file descriptor is written directly without the GIL.
   close: If True, dest is owned, and close() or __exit__() will call
     dest.close().
   assumed_pos: If None, dest must support random access. If an int, it is enough
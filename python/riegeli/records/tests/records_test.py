@@ -20,6 +20,7 @@ import abc
 import contextlib
 import io
 import itertools
+import os
 
 from absl import logging
 from absl.testing import absltest
@@ -285,6 +286,39 @@ class RecordsTest(parameterized.TestCase):
           close=False) as reader:
         reader.read_record()
 
+  @parameterized.named_parameters(*_PARALLELISM_VALUES)
+  def test_write_read_path(self, parallelism):
+    filename = self.create_tempfile().full_path
+    with riegeli.RecordWriter(
+        filename, options=record_writer_options(parallelism)) as writer:
+      for i in range(23):
+        writer.write_record(sample_string(i, 10000))
+    with riegeli.RecordReader(filename) as reader:
+      for i in range(23):
+        self.assertEqual(reader.read_record(), sample_string(i, 10000))
+      self.assertIsNone(reader.read_record())
+
+  @parameterized.named_parameters(*_PARALLELISM_VALUES)
+  def test_read_ranges(self, parallelism):
+    filename = self.create_tempfile().full_path
+    with riegeli.RecordWriter(
+        filename, options=record_writer_options(parallelism)) as writer:
+      for i in range(230):
+        writer.write_record(sample_string(i, 1000))
+    size = os.path.getsize(filename)
+    for num_ranges in (1, 3, 7, 100):
+      ranges = riegeli.split_file(size, num_ranges)
+      self.assertLen(ranges, num_ranges)
+      records = []
+      for begin, end in ranges:
+        with riegeli.RecordReader(filename, range=(begin, end)) as reader:
+          records.extend(reader.read_records())
+      self.assertEqual(records, [sample_string(i, 1000) for i in range(230)])
+    with riegeli.RecordReader(filename, range=(0, None)) as reader:
+      self.assertLen(list(reader.read_records()), 230)
+    with self.assertRaises(ValueError):
+      riegeli.split_file(size, 0)
+
   @_PARAMETERIZE_BY_FILE_SPEC_AND_RANDOM_ACCESS_AND_PARALLELISM
   def test_write_read_record(self, file_spec, random_access, parallelism):
     with contextlib.closing(file_spec(self.create_tempfile,
@@ -413,6 +447,82 @@ class RecordsTest(parameterized.TestCase):
             list(reader.read_records()),
             [sample_string(i, 10000) for i in range(23)])
 
+  @_PARAMETERIZE_BY_FILE_SPEC_AND_RANDOM_ACCESS_AND_PARALLELISM
+  def test_write_read_records_batch(self, file_spec, random_access,
+                                    parallelism):
+    with contextlib.closing(file_spec(self.create_tempfile,
+                                      random_access)) as files:
+      with riegeli.RecordWriter(
+          files.writing_open(),
+          close=files.writing_should_close,
+          assumed_pos=files.writing_assumed_pos,
+          options=record_writer_options(parallelism)) as writer:
+        writer.write_records(sample_string(i, 10000) for i in range(23))
+      with riegeli.RecordReader(
+          files.reading_open(),
+          close=files.reading_should_close,
+          assumed_pos=files.reading_assumed_pos) as reader:
+        records = []
+        while True:
+          batch = reader.read_records_batch(5)
+          if not batch:
+            break
+          self.assertLessEqual(len(batch), 5)
+          records.extend(batch)
+        self.assertEqual(records, [sample_string(i, 10000) for i in range(23)])
+        self.assertEqual(reader.read_records_batch(), [])
+
+  @_PARAMETERIZE_BY_FILE_SPEC_AND_RANDOM_ACCESS_AND_PARALLELISM
+  def test_write_read_records_batch_without_copy(self, file_spec,
+                                                 random_access, parallelism):
+    with contextlib.closing(file_spec(self.create_tempfile,
+                                      random_access)) as files:
+      with riegeli.RecordWriter(
+          files.writing_open(),
+          close=files.writing_should_close,
+          assumed_pos=files.writing_assumed_pos,
+          options=record_writer_options(parallelism)) as writer:
+        writer.write_records(sample_string(i, 10000) for i in range(23))
+      with riegeli.RecordReader(
+          files.reading_open(),
+          close=files.reading_should_close,
+          assumed_pos=files.reading_assumed_pos) as reader:
+        records = []
+        while True:
+          batch = reader.read_records_batch(5, copy=False)
+          if not batch:
+            break
+          for record in batch:
+            self.assertIsInstance(record, memoryview)
+            self.assertTrue(record.readonly)
+          records.extend(batch)
+        self.assertEqual([record.tobytes() for record in records],
+                         [sample_string(i, 10000) for i in range(23)])
+
+  @_PARAMETERIZE_BY_FILE_SPEC_AND_RANDOM_ACCESS_AND_PARALLELISM
+  def test_write_records_batch(self, file_spec, random_access, parallelism):
+    with contextlib.closing(file_spec(self.create_tempfile,
+                                      random_access)) as files:
+      with riegeli.RecordWriter(
+          files.writing_open(),
+          close=files.writing_should_close,
+          assumed_pos=files.writing_assumed_pos,
+          options=record_writer_options(parallelism)) as writer:
+        writer.write_records_batch(
+            [sample_string(i, 10000) for i in range(11)])
+        records = [sample_string(i, 10000) for i in range(11, 23)]
+        offsets = [0]
+        for record in records:
+          offsets.append(offsets[-1] + len(record))
+        writer.write_records_batch(b''.join(records), offsets)
+      with riegeli.RecordReader(
+          files.reading_open(),
+          close=files.reading_should_close,
+          assumed_pos=files.reading_assumed_pos) as reader:
+        self.assertEqual(
+            list(reader.read_records()),
+            [sample_string(i, 10000) for i in range(23)])
+
   @_PARAMETERIZE_BY_FILE_SPEC_AND_RANDOM_ACCESS_AND_PARALLELISM
   def test_write_read_records_with_keys(self, file_spec, random_access,
                                         parallelism):
@@ -242,6 +242,28 @@ class RiegeliDatasetTest(DatasetTestBase):
           [self._record(j, i) for i in range(self._num_records)])
     self.assertDatasetProduces(dataset, expected_output=expected_output * 10)
 
+  def test_read_in_parallel(self):
+    dataset = riegeli_dataset_ops.RiegeliDataset(
+        self.test_filenames, num_parallel_reads=2, block_length=3,
+        buffer_size=4)
+    expected_output = []
+    for i in range(0, self._num_records, 3):
+      for j in range(self._num_files):
+        expected_output.extend([
+            self._record(j, k)
+            for k in range(i, min(i + 3, self._num_records))
+        ])
+    self.assertDatasetProduces(dataset, expected_output=expected_output)
+
+  def test_read_batched(self):
+    dataset = riegeli_dataset_ops.RiegeliDataset(
+        self.test_filenames, batched=True)
+    expected_output = []
+    for j in range(self._num_files):
+      expected_output.append(
+          [self._record(j, i) for i in range(self._num_records)])
+    self.assertDatasetProduces(dataset, expected_output=expected_output)
+
 
 if __name__ == '__main__':
   tf.test.main()
@@ -29,21 +29,67 @@ gen_riegeli_dataset_ops = load_library.load_op_library(
 __all__ = ('RiegeliDataset',)
 
 
+def _field_projection_to_attr(field_projection):
+  if field_projection is None:
+    return []
+  return ['.'.join(str(tag) for tag in field) for field in field_projection]
+
+
 class RiegeliDataset(dataset_ops.DatasetSource):
-  """A `Dataset` comprising records from one or more Riegeli/records files."""
+  """A `Dataset` comprising records from one or more Riegeli/records files.
+
+  By default files are read one after another. With `num_parallel_reads > 1`
+  files are read in a cycle, like with `tf.data.Dataset.interleave()`, and with
+  `buffer_size > 0` they are read ahead concurrently in background threads:
+
+  ```python
+  dataset = RiegeliDataset(filenames, num_parallel_reads=4, buffer_size=256)
+  ```
+  """
 
-  __slots__ = ('_filenames',)
+  __slots__ = ('_filenames', '_batched')
 
-  def __init__(self, filenames):
+  def __init__(self,
+               filenames,
+               num_parallel_reads=1,
+               block_length=1,
+               buffer_size=0,
+               batched=False,
+               field_projection=None):
     """Creates a `RiegeliDataset`.
 
     Args:
       filenames: A `tf.string` tensor containing one or more filenames.
+      num_parallel_reads: The number of files read in a cycle. Elements are
+        taken from files of the cycle in turn, and a file which ends is replaced
+        with the next file.
+      block_length: The number of consecutive elements taken from a file of the
+        cycle before moving on to the next file.
+      buffer_size: If positive, each file of the cycle is read ahead in a
+        background thread, buffering up to this many elements.
+      batched: If `False`, each element is a scalar containing a record. If
+        `True`, each element is a vector containing records of a chunk, which
+        avoids per-record overhead.
+      field_projection: If not None, the set of fields to be included in
+        returned records, allowing to exclude the remaining fields (but does not
+        guarantee that they will be excluded). Projection is effective if files
+        have been written with "transpose" in RecordWriter options. Specified
+        like for `riegeli.RecordReader`, as an iterable of field paths, each an
+        iterable of proto field tags descending from the root message.
     """
     self._filenames = tf.convert_to_tensor(filenames, name='filenames')
-    variant_tensor = gen_riegeli_dataset_ops.riegeli_dataset(self._filenames)
+    self._batched = batched
+    variant_tensor = gen_riegeli_dataset_ops.riegeli_dataset(
+        self._filenames,
+        num_parallel_reads=num_parallel_reads,
+        block_length=block_length,
+        buffer_size=buffer_size,
+        batched=batched,
+        field_projection=_field_projection_to_attr(field_projection))
     super(RiegeliDataset, self).__init__(variant_tensor)
 
   @property
   def element_spec(self):
+    if self._batched:
+      return tf.TensorSpec([None], tf.dtypes.string)
     return tf.TensorSpec([], tf.dtypes.string)
@@ -0,0 +1,110 @@
+# Copyright 2019 Google LLC
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#      http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+"""PyTorch dataset for Riegeli/records files."""
+
+from __future__ import absolute_import
+from __future__ import division
+from __future__ import print_function
+
+import os
+
+from riegeli.records import record_reader
+from torch.utils import data
+
+__all__ = ('RiegeliDataset',)
+
+
+class RiegeliDataset(data.IterableDataset):
+  """An `IterableDataset` comprising records from Riegeli/records files.
+
+  Each file is split into byte ranges with `riegeli.split_file()`, and ranges
+  are divided among `DataLoader` workers, so that with `num_workers > 0` workers
+  decode different chunks in parallel, also of a single file. Records are
+  decoded by the native `RecordReader` without the GIL.
+
+  ```python
+  dataset = RiegeliDataset(filenames, batch_size=256)
+  loader = torch.utils.data.DataLoader(dataset, batch_size=None, num_workers=8)
+  ```
+
+  Files must be local files, because their sizes are needed to split them.
+  """
+
+  def __init__(self,
+               filenames,
+               ranges_per_file=None,
+               batch_size=None,
+               copy=True,
+               buffer_size=64 << 10,
+               field_projection=None):
+    """Creates a `RiegeliDataset`.
+
+    Args:
+      filenames: A filename or an iterable of filenames.
+      ranges_per_file: The number of ranges each file is split into. If None,
+        the number of `DataLoader` workers, or 1 without workers. More ranges
+        balance the work better, but a range smaller than a chunk contains no
+        records.
+      batch_size: If None, each element is a record. If an int, each element is
+        a list of up to this many records of one chunk, like returned by
+        `RecordReader.read_records_batch()`, which avoids per-record overhead.
+      copy: If `True`, records of batches are `bytes`. If `False`, they are
+        read-only `memoryview`s sharing a buffer with other records of their
+        batch, which avoids copying them, e.g. for `torch.frombuffer()`.
+        Ignored if `batch_size` is None.
+      buffer_size: Tunes how much data is buffered after reading from a file.
+      field_projection: If not None, the set of fields to be included in
+        returned records. Specified like for `riegeli.RecordReader`.
+    """
+    super(RiegeliDataset, self).__init__()
+    if isinstance(filenames, (str, bytes, os.PathLike)):
+      filenames = (filenames,)
+    self._filenames = tuple(filenames)
+    self._ranges_per_file = ranges_per_file
+    self._batch_size = batch_size
+    self._copy = copy
+    self._buffer_size = buffer_size
+    self._field_projection = (None if field_projection is None else tuple(
+        tuple(field) for field in field_projection))
+
+  def _shards(self, worker_info):
+    """Returns (filename, range) pairs to be read by the current worker."""
+    ranges_per_file = self._ranges_per_file
+    if ranges_per_file is None:
+      ranges_per_file = 1 if worker_info is None else worker_info.num_workers
+    shards = []
+    for filename in self._filenames:
+      for file_range in record_reader.split_file(
+          os.path.getsize(filename), ranges_per_file):
+        shards.append((filename, file_range))
+    if worker_info is None:
+      return shards
+    return shards[worker_info.id::worker_info.num_workers]
+
+  def __iter__(self):
+    for filename, file_range in self._shards(data.get_worker_info()):
+      with record_reader.RecordReader(
+          filename,
+          buffer_size=self._buffer_size,
+          field_projection=self._field_projection,
+          range=file_range) as reader:
+        if self._batch_size is None:
+          for record in reader.read_records():
+            yield record
+          continue
+        while True:
+          batch = reader.read_records_batch(self._batch_size, copy=self._copy)
+          if not batch:
+            break
+          yield batch
@@ -0,0 +1,82 @@
+# Copyright 2019 Google LLC
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#      http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+"""Tests for RiegeliDataset."""
+
+from __future__ import absolute_import
+from __future__ import division
+from __future__ import print_function
+
+from absl.testing import absltest
+from absl.testing import parameterized
+import riegeli
+from riegeli.torch import riegeli_dataset
+import torch
+
+
+class RiegeliDatasetTest(parameterized.TestCase):
+
+  def setUp(self):
+    super(RiegeliDatasetTest, self).setUp()
+    self._num_files = 2
+    self._num_records = 1000
+    self._filenames = []
+    for i in range(self._num_files):
+      filename = self.create_tempfile().full_path
+      self._filenames.append(filename)
+      with riegeli.RecordWriter(
+          filename, options='uncompressed,chunk_size:2000') as writer:
+        for j in range(self._num_records):
+          writer.write_record(self._record(i, j))
+
+  def _record(self, f, r):
+    return 'Record {} of file {}'.format(r, f).encode()
+
+  def _all_records(self):
+    return [
+        self._record(i, j)
+        for i in range(self._num_files)
+        for j in range(self._num_records)
+    ]
+
+  def test_read_without_workers(self):
+    dataset = riegeli_dataset.RiegeliDataset(self._filenames)
+    self.assertEqual(list(dataset), self._all_records())
+
+  @parameterized.parameters(1, 3, 50)
+  def test_read_ranges(self, ranges_per_file):
+    dataset = riegeli_dataset.RiegeliDataset(
+        self._filenames, ranges_per_file=ranges_per_file)
+    self.assertEqual(list(dataset), self._all_records())
+
+  @parameterized.parameters(1, 4)
+  def test_read_with_workers(self, num_workers):
+    dataset = riegeli_dataset.RiegeliDataset(self._filenames)
+    loader = torch.utils.data.DataLoader(
+        dataset, batch_size=None, num_workers=num_workers)
+    self.assertCountEqual(list(loader), self._all_records())
+
+  @parameterized.parameters(True, False)
+  def test_read_batches(self, copy):
+    dataset = riegeli_dataset.RiegeliDataset(
+        self._filenames, ranges_per_file=3, batch_size=7, copy=copy)
+    records = []
+    for batch in dataset:
+      self.assertNotEmpty(batch)
+      self.assertLessEqual(len(batch), 7)
+      records.extend(bytes(record) for record in batch)
+    self.assertEqual(records, self._all_records())
+
+
+if __name__ == '__main__':
+  absltest.main()
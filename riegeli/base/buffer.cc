@@ -0,0 +1,64 @@
+// Copyright 2019 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "riegeli/base/buffer.h"
+
+#include <stddef.h>
+
+#include <atomic>
+#include <memory>
+
+#include "riegeli/base/memory.h"
+#include "riegeli/base/owned_memory.h"
+#include "riegeli/base/recycling_pool.h"
+
+namespace riegeli {
+
+namespace {
+
+std::atomic<bool> buffer_recycling_enabled(false);
+
+// Buffers with sizes in this range are recycled if recycling is enabled.
+constexpr size_t kMinRecycledSize = size_t{4} << 10;
+constexpr size_t kMaxRecycledSize = size_t{1} << 20;
+
+}  // namespace
+
+void Buffer::SetRecycling(bool enabled) {
+  buffer_recycling_enabled.store(enabled, std::memory_order_relaxed);
+}
+
+void Buffer::AllocateBuffer() {
+  if (buffer_recycling_enabled.load(std::memory_order_relaxed) &&
+      size_ <= kMaxRecycledSize) {
+    size_t capacity = kMinRecycledSize;
+    if (size_ >= capacity) {
+      while (capacity < size_) capacity <<= 1;
+      recycled_ = Pool::global().Get(capacity, [capacity] {
+        return std::unique_ptr<char, internal::BufferDeleter>(
+            static_cast<char*>(operator new(capacity)));
+      });
+      data_ = recycled_.get();
+      size_ = capacity;
+      internal::AddOwnedMemory(&internal::owned_buffer_memory, size_);
+      return;
+    }
+  }
+  const size_t capacity = EstimatedAllocatedSize(size_);
+  data_ = static_cast<char*>(operator new(capacity));
+  size_ = capacity;
+  internal::AddOwnedMemory(&internal::owned_buffer_memory, size_);
+}
+
+}  // namespace riegeli
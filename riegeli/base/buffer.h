@@ -22,9 +22,20 @@
 #include "absl/base/optimization.h"
 #include "riegeli/base/base.h"
 #include "riegeli/base/memory.h"
+#include "riegeli/base/owned_memory.h"
+#include "riegeli/base/recycling_pool.h"
 
 namespace riegeli {
 
+namespace internal {
+
+// Deletes memory of a `Buffer` kept in the recycling pool.
+struct BufferDeleter {
+  void operator()(char* ptr) const { operator delete(ptr); }
+};
+
+}  // namespace internal
+
 // Lazily allocated buffer of a fixed size.
 class Buffer {
  public:
@@ -39,6 +50,22 @@ class Buffer {
 
   ~Buffer() { DeleteBuffer(); }
 
+  // Enables or disables recycling memory of buffers allocated by all
+  // `Buffer`s.
+  //
+  // If enabled, sizes of buffers between 4K and 1M are rounded up to a power of
+  // 2, and freed buffers of these sizes are kept in a global `RecyclingPool`
+  // with per-thread shards, to be reused by later allocations. This avoids
+  // `mmap()`/`munmap()` churn of large allocations when many short-lived
+  // `Buffer`s are allocated, e.g. by `BufferedWriter`s of small files. Buffers
+  // kept in the pool are not included in `GetOwnedMemory()`.
+  //
+  // Blocks of `Chain`, also used by `BufferedReader`, are recycled separately,
+  // see `Chain::SetBlockRecycling()`.
+  //
+  // Default: `false`
+  static void SetRecycling(bool enabled);
+
   // If the buffer is not allocated, allocates it; this can increase the stored
   // size to account for size rounding by the memory allocator. Returns the data
   // pointer.
@@ -61,45 +88,64 @@ class Buffer {
   void Resize(size_t size);
 
   // Releases the ownership of the data pointer, which must be deleted using
-  // `DeleteReleased()` if not nullptr.
+  // `DeleteReleased()` if not nullptr. Released memory is no longer included in
+  // `GetOwnedMemory()`.
   char* Release();
 
   // Deletes the pointer obtained by `Release()`.
   static void DeleteReleased(char* ptr);
 
  private:
-  // If the buffer is allocated, deletes it.
+  using Pool = RecyclingPool<char, internal::BufferDeleter, size_t>;
+
+  // Allocates the buffer, rounding `size_` up.
+  void AllocateBuffer();
+
+  // If the buffer is allocated, deletes it or puts it back into the pool.
   void DeleteBuffer();
 
   char* data_ = nullptr;
   size_t size_ = 0;
+  // If not `nullptr`, owns `data_`, which is put back into `Pool::global()`
+  // when the buffer is deleted.
+  Pool::Handle recycled_;
 };
 
 // Implementation details follow.
 
 inline Buffer::Buffer(Buffer&& that) noexcept
-    : data_(std::exchange(that.data_, nullptr)), size_(that.size_) {}
+    : data_(std::exchange(that.data_, nullptr)),
+      size_(that.size_),
+      recycled_(std::move(that.recycled_)) {}
 
 inline Buffer& Buffer::operator=(Buffer&& that) noexcept {
-  // Exchange `that.data_` early to support self-assignment.
+  // Exchange `that.data_` and `that.recycled_` early to support
+  // self-assignment.
   char* const data = std::exchange(that.data_, nullptr);
+  Pool::Handle recycled = std::move(that.recycled_);
   DeleteBuffer();
   data_ = data;
   size_ = that.size_;
+  recycled_ = std::move(recycled);
   return *this;
 }
 
 inline void Buffer::DeleteBuffer() {
-  if (data_ != nullptr) operator delete(data_, size_);
+  if (data_ != nullptr) {
+    internal::SubtractOwnedMemory(&internal::owned_buffer_memory, size_);
+    if (recycled_ != nullptr) {
+      recycled_.reset();
+    } else {
+      operator delete(data_, size_);
+    }
+  }
 }
 
 inline char* Buffer::GetData() {
   if (ABSL_PREDICT_FALSE(data_ == nullptr)) {
     RIEGELI_ASSERT_GT(size_, 0u)
         << "Failed precondition of Buffer::GetData(): no buffer size specified";
-    const size_t capacity = EstimatedAllocatedSize(size_);
-    data_ = static_cast<char*>(operator new(capacity));
-    size_ = capacity;
+    AllocateBuffer();
   }
   return data_;
 }
@@ -114,7 +160,15 @@ inline void Buffer::Resize(size_t new_size) {
   }
 }
 
-inline char* Buffer::Release() { return std::exchange(data_, nullptr); }
+inline char* Buffer::Release() {
+  if (data_ != nullptr) {
+    internal::SubtractOwnedMemory(&internal::owned_buffer_memory, size_);
+    // A recycled buffer is allocated with `operator new()` too, so it can be
+    // deleted by `DeleteReleased()`.
+    recycled_.release();
+  }
+  return std::exchange(data_, nullptr);
+}
 
 inline void Buffer::DeleteReleased(char* ptr) { operator delete(ptr); }
 
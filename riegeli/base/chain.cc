@@ -27,11 +27,14 @@
 #include <utility>
 
 #include "absl/base/optimization.h"
+#include "absl/strings/cord.h"
 #include "absl/strings/string_view.h"
+#include "absl/types/optional.h"
 #include "absl/types/span.h"
 #include "riegeli/base/base.h"
 #include "riegeli/base/memory.h"
 #include "riegeli/base/memory_estimator.h"
+#include "riegeli/base/owned_memory.h"
 
 namespace riegeli {
 
@@ -142,12 +145,209 @@ inline void Chain::StringRef::DumpStructure(std::ostream& out) const {
   out << "[string] { capacity: " << src_.capacity() << " }";
 }
 
+class Chain::CordRef {
+ public:
+  explicit CordRef(const absl::Cord& src) : src_(src) {}
+  explicit CordRef(absl::Cord&& src) : src_(std::move(src)) {}
+
+  CordRef(const CordRef&) = delete;
+  CordRef& operator=(const CordRef&) = delete;
+
+  void DumpStructure(absl::string_view data, std::ostream& out) const;
+
+ private:
+  absl::Cord src_;
+};
+
+inline void Chain::CordRef::DumpStructure(absl::string_view data,
+                                          std::ostream& out) const {
+  out << "[cord] { size: " << src_.size() << " }";
+}
+
+namespace {
+
+std::atomic<bool> block_recycling_enabled(false);
+
+}  // namespace
+
+void Chain::SetBlockRecycling(bool enabled) {
+  block_recycling_enabled.store(enabled, std::memory_order_relaxed);
+}
+
+class Chain::RawBlock::FreeLists {
+ public:
+  // Size class `i` holds blocks with capacity `Capacity(i)`, which is
+  // `kMinBufferSize << i` rounded up to what the allocation of such a block
+  // provides anyway.
+  static constexpr size_t kNumSizeClasses = 9;
+  static_assert(kMinBufferSize << (kNumSizeClasses - 1) == kMaxBufferSize,
+                "Size classes must cover kMinBufferSize..kMaxBufferSize");
+
+  // Returns the free lists of the current thread, or `nullptr` if they are
+  // already destroyed because the thread is exiting.
+  static FreeLists* ForCurrentThread();
+
+  FreeLists(const FreeLists&) = delete;
+  FreeLists& operator=(const FreeLists&) = delete;
+
+  ~FreeLists();
+
+  static size_t Capacity(size_t size_class);
+
+  // Returns the size class for a block with at least `min_capacity`, or
+  // `kNumSizeClasses` if blocks with that capacity are not recycled.
+  static size_t SizeClassForAllocation(size_t min_capacity);
+
+  // Returns the size class of a block with `capacity`, or `kNumSizeClasses` if
+  // the block was not allocated for a size class.
+  static size_t SizeClassOf(size_t capacity);
+
+  // Returns a block of the given size class, to be reinitialized, or `nullptr`
+  // if the free list is empty.
+  RawBlock* Get(size_t size_class);
+
+  // Puts a block of the given size class in its free list. Returns `false` if
+  // the free lists are full.
+  bool Put(size_t size_class, RawBlock* block);
+
+ private:
+  // Limits of blocks kept by each thread.
+  static constexpr size_t kMaxBlocksPerSizeClass = 16;
+  static constexpr size_t kMaxTotalCapacity = size_t{512} << 10;
+
+  explicit FreeLists(bool* destroyed) : destroyed_(destroyed) {}
+
+  bool* destroyed_;
+  RawBlock* blocks_[kNumSizeClasses][kMaxBlocksPerSizeClass];
+  size_t num_blocks_[kNumSizeClasses] = {};
+  size_t total_capacity_ = 0;
+};
+
+#if __cplusplus < 201703
+constexpr size_t Chain::RawBlock::FreeLists::kNumSizeClasses;
+constexpr size_t Chain::RawBlock::FreeLists::kMaxBlocksPerSizeClass;
+constexpr size_t Chain::RawBlock::FreeLists::kMaxTotalCapacity;
+#endif
+
+Chain::RawBlock::FreeLists* Chain::RawBlock::FreeLists::ForCurrentThread() {
+  // `destroyed` is trivially destructible, so it remains valid after
+  // `free_lists` is destroyed during thread exit, while other thread-local
+  // objects might still free blocks.
+  static thread_local bool destroyed = false;
+  if (ABSL_PREDICT_FALSE(destroyed)) return nullptr;
+  static thread_local FreeLists free_lists(&destroyed);
+  return &free_lists;
+}
+
+Chain::RawBlock::FreeLists::~FreeLists() {
+  *destroyed_ = true;
+  for (size_t size_class = 0; size_class < kNumSizeClasses; ++size_class) {
+    for (size_t i = 0; i < num_blocks_[size_class]; ++i) {
+      internal::SubtractOwnedMemory(
+          &internal::owned_chain_block_memory,
+          kInternalAllocatedOffset() + Capacity(size_class));
+      DeleteAligned<RawBlock>(
+          blocks_[size_class][i],
+          kInternalAllocatedOffset() + Capacity(size_class));
+    }
+  }
+}
+
+inline size_t Chain::RawBlock::FreeLists::Capacity(size_t size_class) {
+  return EstimatedAllocatedSize(kInternalAllocatedOffset() +
+                                (kMinBufferSize << size_class)) -
+         kInternalAllocatedOffset();
+}
+
+inline size_t Chain::RawBlock::FreeLists::SizeClassForAllocation(
+    size_t min_capacity) {
+  size_t size_class = 0;
+  while (Capacity(size_class) < min_capacity) {
+    if (++size_class == kNumSizeClasses) return kNumSizeClasses;
+  }
+  // Do not make a block wasteful when it gets filled to `min_capacity`.
+  if (Capacity(size_class) - min_capacity >
+      UnsignedMax(min_capacity, kMinBufferSize)) {
+    return kNumSizeClasses;
+  }
+  return size_class;
+}
+
+inline size_t Chain::RawBlock::FreeLists::SizeClassOf(size_t capacity) {
+  for (size_t size_class = 0; size_class < kNumSizeClasses; ++size_class) {
+    const size_t class_capacity = Capacity(size_class);
+    if (capacity <= class_capacity) {
+      return capacity == class_capacity ? size_class : kNumSizeClasses;
+    }
+  }
+  return kNumSizeClasses;
+}
+
+inline Chain::RawBlock* Chain::RawBlock::FreeLists::Get(size_t size_class) {
+  if (num_blocks_[size_class] == 0) return nullptr;
+  total_capacity_ -= Capacity(size_class);
+  return blocks_[size_class][--num_blocks_[size_class]];
+}
+
+inline bool Chain::RawBlock::FreeLists::Put(size_t size_class,
+                                            RawBlock* block) {
+  const size_t capacity = Capacity(size_class);
+  if (num_blocks_[size_class] == kMaxBlocksPerSizeClass ||
+      capacity > kMaxTotalCapacity - total_capacity_) {
+    return false;
+  }
+  total_capacity_ += capacity;
+  blocks_[size_class][num_blocks_[size_class]++] = block;
+  return true;
+}
+
 inline Chain::RawBlock* Chain::RawBlock::NewInternal(size_t min_capacity) {
   RIEGELI_ASSERT_GT(min_capacity, 0u)
       << "Failed precondition of Chain::RawBlock::NewInternal(): zero capacity";
   size_t raw_capacity;
-  return SizeReturningNewAligned<RawBlock>(
+  if (block_recycling_enabled.load(std::memory_order_relaxed)) {
+    const size_t size_class = FreeLists::SizeClassForAllocation(min_capacity);
+    if (size_class < FreeLists::kNumSizeClasses) {
+      raw_capacity =
+          kInternalAllocatedOffset() + FreeLists::Capacity(size_class);
+      FreeLists* const free_lists = FreeLists::ForCurrentThread();
+      if (ABSL_PREDICT_TRUE(free_lists != nullptr)) {
+        RawBlock* const block = free_lists->Get(size_class);
+        if (block != nullptr) {
+          block->~RawBlock();
+          return new (block) RawBlock(&raw_capacity);
+        }
+      }
+      RawBlock* const block = SizeReturningNewAligned<RawBlock>(
+          raw_capacity, &raw_capacity, &raw_capacity);
+      internal::AddOwnedMemory(&internal::owned_chain_block_memory,
+                               raw_capacity);
+      return block;
+    }
+  }
+  RawBlock* const block = SizeReturningNewAligned<RawBlock>(
       kInternalAllocatedOffset() + min_capacity, &raw_capacity, &raw_capacity);
+  internal::AddOwnedMemory(&internal::owned_chain_block_memory, raw_capacity);
+  return block;
+}
+
+void Chain::RawBlock::DeleteInternal() {
+  RIEGELI_ASSERT(is_internal())
+      << "Failed precondition of Chain::RawBlock::DeleteInternal(): "
+         "block not internal";
+  if (block_recycling_enabled.load(std::memory_order_relaxed)) {
+    const size_t size_class = FreeLists::SizeClassOf(capacity());
+    if (size_class < FreeLists::kNumSizeClasses) {
+      FreeLists* const free_lists = FreeLists::ForCurrentThread();
+      if (ABSL_PREDICT_TRUE(free_lists != nullptr) &&
+          free_lists->Put(size_class, this)) {
+        return;
+      }
+    }
+  }
+  internal::SubtractOwnedMemory(&internal::owned_chain_block_memory,
+                                kInternalAllocatedOffset() + capacity());
+  DeleteAligned<RawBlock>(this, kInternalAllocatedOffset() + capacity());
 }
 
 inline Chain::RawBlock::RawBlock(const size_t* raw_capacity)
@@ -178,13 +378,6 @@ inline size_t Chain::RawBlock::space_before() const {
   return PtrDistance(allocated_begin_, empty() ? allocated_end_ : data_begin());
 }
 
-inline size_t Chain::RawBlock::space_after() const {
-  RIEGELI_ASSERT(is_internal())
-      << "Failed precondition of Chain::RawBlock::space_after(): "
-         "block not internal";
-  return PtrDistance(empty() ? allocated_begin_ : data_end(), allocated_end_);
-}
-
 inline size_t Chain::RawBlock::raw_space_before() const {
   RIEGELI_ASSERT(is_internal())
       << "Failed precondition of Chain::RawBlock::raw_space_before(): "
@@ -260,10 +453,6 @@ inline void Chain::RawBlock::DumpStructure(std::ostream& out) const {
   out << " }";
 }
 
-inline bool Chain::RawBlock::can_append(size_t length) const {
-  return is_internal() && has_unique_owner() && space_after() >= length;
-}
-
 inline bool Chain::RawBlock::can_prepend(size_t length) const {
   return is_internal() && has_unique_owner() && space_before() >= length;
 }
@@ -317,25 +506,6 @@ inline absl::Span<char> Chain::RawBlock::PrependBuffer(size_t max_length) {
   return buffer;
 }
 
-inline void Chain::RawBlock::Append(absl::string_view src) {
-  if (empty()) data_ = absl::string_view(allocated_begin_, 0);
-  return AppendWithExplicitSizeToCopy(src, src.size());
-}
-
-inline void Chain::RawBlock::AppendWithExplicitSizeToCopy(absl::string_view src,
-                                                          size_t size_to_copy) {
-  RIEGELI_ASSERT_GE(size_to_copy, src.size())
-      << "Failed precondition of "
-         "Chain::RawBlock::AppendWithExplicitSizeToCopy(): "
-         "size to copy too small";
-  RIEGELI_ASSERT(can_append(size_to_copy))
-      << "Failed precondition of "
-         "Chain::RawBlock::AppendWithExplicitSizeToCopy(): "
-         "not enough space";
-  std::memcpy(const_cast<char*>(data_end()), src.data(), size_to_copy);
-  data_ = absl::string_view(data_begin(), size() + src.size());
-}
-
 inline void Chain::RawBlock::Prepend(absl::string_view src) {
   RIEGELI_ASSERT(can_prepend(src.size()))
       << "Failed precondition of Chain::RawBlock::Prepend(): "
@@ -560,6 +730,32 @@ Chain::operator std::string() const& {
   return dest;
 }
 
+void Chain::AppendTo(absl::Cord* dest) const {
+  RIEGELI_CHECK_LE(size_, std::numeric_limits<size_t>::max() - dest->size())
+      << "Failed precondition of Chain::AppendTo(Cord*): "
+         "Cord size overflow";
+  if (begin_ == end_) {
+    dest->Append(short_data());
+    return;
+  }
+  for (RawBlock* const* iter = begin_; iter != end_; ++iter) {
+    RawBlock* const block = *iter;
+    if (block->size() <= kMaxBytesToCopy || block->wasteful()) {
+      dest->Append(absl::string_view(*block));
+    } else {
+      block->Ref();
+      dest->Append(absl::MakeCordFromExternal(absl::string_view(*block),
+                                              [block] { block->Unref(); }));
+    }
+  }
+}
+
+Chain::operator absl::Cord() const {
+  absl::Cord dest;
+  AppendTo(&dest);
+  return dest;
+}
+
 Chain::operator std::string() && {
   if (PtrDistance(begin_, end_) == 1) {
     RawBlock* const block = front();
@@ -1002,7 +1198,7 @@ absl::Span<char> Chain::PrependBuffer(size_t min_length,
   return buffer;
 }
 
-void Chain::Append(absl::string_view src, size_t size_hint) {
+void Chain::AppendSlow(absl::string_view src, size_t size_hint) {
   RIEGELI_CHECK_LE(src.size(), std::numeric_limits<size_t>::max() - size_)
       << "Failed precondition of Chain::Append(string_view): "
          "Chain size overflow";
@@ -1036,6 +1232,40 @@ void Chain::Append(Chain&& src, size_t size_hint) {
   AppendImpl<Ownership::kSteal>(std::move(src), size_hint);
 }
 
+void Chain::Append(const absl::Cord& src, size_t size_hint) {
+  RIEGELI_CHECK_LE(src.size(), std::numeric_limits<size_t>::max() - size_)
+      << "Failed precondition of Chain::Append(Cord): "
+         "Chain size overflow";
+  for (const absl::string_view fragment : src.Chunks()) {
+    if (fragment.size() <= kMaxBytesToCopy) {
+      Append(fragment, size_hint);
+    } else {
+      // Each block shares the whole `src`, which is cheap because copying an
+      // `absl::Cord` only increments reference counts.
+      Append(ChainBlock::FromExternal<CordRef>(std::forward_as_tuple(src),
+                                               fragment),
+             size_hint);
+    }
+  }
+}
+
+void Chain::Append(absl::Cord&& src, size_t size_hint) {
+  RIEGELI_CHECK_LE(src.size(), std::numeric_limits<size_t>::max() - size_)
+      << "Failed precondition of Chain::Append(Cord&&): "
+         "Chain size overflow";
+  const absl::optional<absl::string_view> flat = src.TryFlat();
+  if (flat != absl::nullopt && flat->size() > kMaxBytesToCopy) {
+    // A flat `absl::Cord` of this size does not hold its data inline, so its
+    // data remain valid after moving it.
+    Append(ChainBlock::FromExternal<CordRef>(
+               std::forward_as_tuple(std::move(src)), *flat),
+           size_hint);
+    return;
+  }
+  // Not `std::move(src)`: forward to `Append(const absl::Cord&)`.
+  Append(src, size_hint);
+}
+
 template <Chain::Ownership ownership, typename ChainRef>
 inline void Chain::AppendImpl(ChainRef&& src, size_t size_hint) {
   RIEGELI_CHECK_LE(src.size(), std::numeric_limits<size_t>::max() - size_)
@@ -1194,6 +1424,21 @@ void Chain::Prepend(Chain&& src, size_t size_hint) {
   PrependImpl<Ownership::kSteal>(std::move(src), size_hint);
 }
 
+void Chain::Prepend(const absl::Cord& src, size_t size_hint) {
+  RIEGELI_CHECK_LE(src.size(), std::numeric_limits<size_t>::max() - size_)
+      << "Failed precondition of Chain::Prepend(Cord): "
+         "Chain size overflow";
+  // Fragments of an `absl::Cord` can be iterated only forwards.
+  Prepend(Chain(src), size_hint);
+}
+
+void Chain::Prepend(absl::Cord&& src, size_t size_hint) {
+  RIEGELI_CHECK_LE(src.size(), std::numeric_limits<size_t>::max() - size_)
+      << "Failed precondition of Chain::Prepend(Cord&&): "
+         "Chain size overflow";
+  Prepend(Chain(std::move(src)), size_hint);
+}
+
 template <Chain::Ownership ownership, typename ChainRef>
 inline void Chain::PrependImpl(ChainRef&& src, size_t size_hint) {
   RIEGELI_CHECK_LE(src.size(), std::numeric_limits<size_t>::max() - size_)
@@ -1593,6 +1838,52 @@ void Chain::RemovePrefixSlow(size_t length, size_t size_hint) {
       size_hint);
 }
 
+void Chain::Compact(size_t target_block_size) {
+  // Keep merged blocks and blocks surrounding merged runs from being tiny.
+  target_block_size =
+      UnsignedMin(UnsignedMax(target_block_size, 2 * kMinBufferSize),
+                  RawBlock::kMaxCapacity);
+  const size_t small_size = target_block_size / 2;
+  // Merged blocks are written over block pointers already consumed: a run of
+  // blocks smaller than `target_block_size / 2` is replaced with fewer than
+  // half as many blocks.
+  RawBlock** src_iter = begin_;
+  RawBlock** dest_iter = begin_;
+  while (src_iter != end_) {
+    if (src_iter[0]->size() >= small_size || src_iter + 1 == end_ ||
+        src_iter[1]->size() >= small_size) {
+      *dest_iter++ = *src_iter++;
+      continue;
+    }
+    RawBlock** run_end = src_iter + 2;
+    size_t remaining = src_iter[0]->size() + src_iter[1]->size();
+    while (run_end != end_ && run_end[0]->size() < small_size) {
+      remaining += (*run_end++)->size();
+    }
+    RawBlock* merged = nullptr;
+    do {
+      absl::string_view data(**src_iter);
+      while (!data.empty()) {
+        if (merged == nullptr) {
+          merged = RawBlock::NewInternal(
+              UnsignedMin(remaining, target_block_size));
+        }
+        const absl::Span<char> buffer = merged->AppendBuffer(data.size());
+        std::memcpy(buffer.data(), data.data(), buffer.size());
+        data.remove_prefix(buffer.size());
+        remaining -= buffer.size();
+        if (!merged->can_append(1)) {
+          *dest_iter++ = merged;
+          merged = nullptr;
+        }
+      }
+      (*src_iter++)->Unref();
+    } while (src_iter != run_end);
+    if (merged != nullptr) *dest_iter++ = merged;
+  }
+  end_ = dest_iter;
+}
+
 void swap(Chain& a, Chain& b) noexcept {
   using std::swap;
   if (a.has_here()) {
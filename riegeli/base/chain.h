@@ -32,6 +32,7 @@
 #include "absl/base/attributes.h"
 #include "absl/base/optimization.h"
 #include "absl/meta/type_traits.h"
+#include "absl/strings/cord.h"
 #include "absl/strings/string_view.h"
 #include "absl/types/optional.h"
 #include "absl/types/span.h"
@@ -67,6 +68,19 @@ class Chain {
   // `AppendBuffer()`/`PrependBuffer()`.
   static constexpr size_t kAnyLength = std::numeric_limits<size_t>::max();
 
+  // Enables or disables recycling memory of blocks allocated by all `Chain`s.
+  //
+  // If enabled, capacities of blocks between `kMinBufferSize` and
+  // `kMaxBufferSize` are rounded up to a power of 2, and freed blocks of these
+  // size classes are kept in per-thread free lists of bounded size, to be
+  // reused by later allocations in the same thread. This reduces allocator
+  // pressure and fragmentation when many short-lived blocks are allocated.
+  // Blocks kept in free lists are not accounted by `MemoryEstimator` since
+  // they belong to no `Chain`, but they are included in `GetOwnedMemory()`.
+  //
+  // Default: `false`
+  static void SetBlockRecycling(bool enabled);
+
   // Given an object which owns a byte array, converts it to a `Chain` by
   // attaching the object, avoiding copying the bytes.
   //
@@ -123,6 +137,8 @@ class Chain {
   explicit Chain(const char* src);
   explicit Chain(const ChainBlock& src);
   explicit Chain(ChainBlock&& src);
+  explicit Chain(const absl::Cord& src);
+  explicit Chain(absl::Cord&& src);
 
   Chain(const Chain& that);
   Chain& operator=(const Chain& that);
@@ -144,6 +160,8 @@ class Chain {
   void Reset(const char* src);
   void Reset(const ChainBlock& src);
   void Reset(ChainBlock&& src);
+  void Reset(const absl::Cord& src);
+  void Reset(absl::Cord&& src);
 
   void Clear();
 
@@ -159,6 +177,11 @@ class Chain {
   explicit operator std::string() const&;
   explicit operator std::string() &&;
 
+  // Appends/converts the `Chain` to an `absl::Cord`. Blocks which are not tiny
+  // nor wasteful are shared with the `absl::Cord` instead of being copied.
+  void AppendTo(absl::Cord* dest) const;
+  explicit operator absl::Cord() const;
+
   // If the `Chain` contents are flat, returns them, otherwise returns
   // `absl::nullopt`.
   absl::optional<absl::string_view> TryFlat() const;
@@ -205,6 +228,10 @@ class Chain {
   void Append(ChainBlock&& src, size_t size_hint = 0);
   void Append(const Chain& src, size_t size_hint = 0);
   void Append(Chain&& src, size_t size_hint = 0);
+  // Fragments of an `absl::Cord` which are not tiny are shared with the `Chain`
+  // instead of being copied.
+  void Append(const absl::Cord& src, size_t size_hint = 0);
+  void Append(absl::Cord&& src, size_t size_hint = 0);
   void Prepend(absl::string_view src, size_t size_hint = 0);
   void Prepend(std::string&& src, size_t size_hint = 0);
   void Prepend(const char* src, size_t size_hint = 0);
@@ -212,10 +239,21 @@ class Chain {
   void Prepend(ChainBlock&& src, size_t size_hint = 0);
   void Prepend(const Chain& src, size_t size_hint = 0);
   void Prepend(Chain&& src, size_t size_hint = 0);
+  void Prepend(const absl::Cord& src, size_t size_hint = 0);
+  void Prepend(absl::Cord&& src, size_t size_hint = 0);
 
   void RemoveSuffix(size_t length, size_t size_hint = 0);
   void RemovePrefix(size_t length, size_t size_hint = 0);
 
+  // Coalesces runs of adjacent blocks smaller than half of
+  // `target_block_size` into blocks of about `target_block_size`, so that more
+  // of the contents is contiguous. Larger blocks are kept as they are. Each
+  // byte is copied at most once, and nothing is done if there are no such
+  // runs.
+  //
+  // This invalidates pointers to data of the `Chain` and block iterators.
+  void Compact(size_t target_block_size = kDefaultBufferSize);
+
   friend void swap(Chain& a, Chain& b) noexcept;
 
   int Compare(absl::string_view that) const;
@@ -254,6 +292,7 @@ class Chain {
   struct BlockPtrPtr;
   class BlockRef;
   class StringRef;
+  class CordRef;
 
   friend ptrdiff_t operator-(BlockPtrPtr a, BlockPtrPtr b);
   friend bool operator==(BlockPtrPtr a, BlockPtrPtr b);
@@ -313,6 +352,7 @@ class Chain {
   static constexpr size_t kAllocationCost = 256;
 
   void ClearSlow();
+  void AppendSlow(absl::string_view src, size_t size_hint);
 
   bool has_here() const { return begin_ == block_ptrs_.here; }
   bool has_allocated() const { return begin_ != block_ptrs_.here; }
@@ -805,8 +845,15 @@ class Chain::RawBlock {
   void ConstructExternal(std::tuple<Args...> args,
                          std::index_sequence<Indices...>);
 
+  // Per-thread free lists of internal blocks, used if
+  // `Chain::SetBlockRecycling(true)`.
+  class FreeLists;
+
   bool has_unique_owner() const;
 
+  // Deletes an internal block, or puts it in `FreeLists`.
+  void DeleteInternal();
+
   bool is_internal() const { return allocated_end_ != nullptr; }
   bool is_external() const { return allocated_end_ == nullptr; }
 
@@ -1069,7 +1116,7 @@ void Chain::RawBlock::Unref() {
       (has_unique_owner() ||
        ref_count_.fetch_sub(1, std::memory_order_acq_rel) == 1)) {
     if (is_internal()) {
-      DeleteAligned<RawBlock>(this, kInternalAllocatedOffset() + capacity());
+      DeleteInternal();
     } else {
       external_.methods->delete_block(this);
     }
@@ -1095,6 +1142,36 @@ inline size_t Chain::RawBlock::capacity() const {
   return PtrDistance(allocated_begin_, allocated_end_);
 }
 
+inline size_t Chain::RawBlock::space_after() const {
+  RIEGELI_ASSERT(is_internal())
+      << "Failed precondition of Chain::RawBlock::space_after(): "
+         "block not internal";
+  return PtrDistance(empty() ? allocated_begin_ : data_end(), allocated_end_);
+}
+
+inline bool Chain::RawBlock::can_append(size_t length) const {
+  return is_internal() && has_unique_owner() && space_after() >= length;
+}
+
+inline void Chain::RawBlock::Append(absl::string_view src) {
+  if (empty()) data_ = absl::string_view(allocated_begin_, 0);
+  return AppendWithExplicitSizeToCopy(src, src.size());
+}
+
+inline void Chain::RawBlock::AppendWithExplicitSizeToCopy(absl::string_view src,
+                                                          size_t size_to_copy) {
+  RIEGELI_ASSERT_GE(size_to_copy, src.size())
+      << "Failed precondition of "
+         "Chain::RawBlock::AppendWithExplicitSizeToCopy(): "
+         "size to copy too small";
+  RIEGELI_ASSERT(can_append(size_to_copy))
+      << "Failed precondition of "
+         "Chain::RawBlock::AppendWithExplicitSizeToCopy(): "
+         "not enough space";
+  std::memcpy(const_cast<char*>(data_end()), src.data(), size_to_copy);
+  data_ = absl::string_view(data_begin(), size() + src.size());
+}
+
 template <typename T>
 inline T* Chain::RawBlock::unchecked_external_object() {
   RIEGELI_ASSERT(is_external())
@@ -1566,6 +1643,10 @@ inline Chain::Chain(ChainBlock&& src) {
   }
 }
 
+inline Chain::Chain(const absl::Cord& src) { Append(src, src.size()); }
+
+inline Chain::Chain(absl::Cord&& src) { Append(std::move(src), src.size()); }
+
 inline Chain::Chain(Chain&& that) noexcept
     : size_(std::exchange(that.size_, 0)) {
   // Use `std::memcpy()` instead of copy constructor to silence
@@ -1641,6 +1722,16 @@ inline void Chain::Reset(ChainBlock&& src) {
   Append(std::move(src), src.size());
 }
 
+inline void Chain::Reset(const absl::Cord& src) {
+  Clear();
+  Append(src, src.size());
+}
+
+inline void Chain::Reset(absl::Cord&& src) {
+  Clear();
+  Append(std::move(src), src.size());
+}
+
 inline void Chain::Clear() {
   if (begin_ != end_) ClearSlow();
   size_ = 0;
@@ -1689,6 +1780,21 @@ inline absl::Span<char> Chain::PrependFixedBuffer(size_t length,
   return PrependBuffer(length, length, length, size_hint);
 }
 
+inline void Chain::Append(absl::string_view src, size_t size_hint) {
+  // Fast path for a small piece which fits in the last block, which is common
+  // when many small pieces are appended one by one. It cannot overflow the
+  // size because the block memory already exists.
+  if (begin_ != end_) {
+    RawBlock* const last = back();
+    if (last->can_append(src.size())) {
+      last->Append(src);
+      size_ += src.size();
+      return;
+    }
+  }
+  AppendSlow(src, size_hint);
+}
+
 inline void Chain::Append(const char* src, size_t size_hint) {
   Append(absl::string_view(src), size_hint);
 }
@@ -0,0 +1,39 @@
+// Copyright 2019 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "riegeli/base/owned_memory.h"
+
+#include <stddef.h>
+
+#include <atomic>
+
+namespace riegeli {
+
+namespace internal {
+
+std::atomic<size_t> owned_chain_block_memory{0};
+std::atomic<size_t> owned_buffer_memory{0};
+
+}  // namespace internal
+
+OwnedMemory GetOwnedMemory() {
+  OwnedMemory owned_memory;
+  owned_memory.chain_blocks =
+      internal::owned_chain_block_memory.load(std::memory_order_relaxed);
+  owned_memory.buffers =
+      internal::owned_buffer_memory.load(std::memory_order_relaxed);
+  return owned_memory;
+}
+
+}  // namespace riegeli
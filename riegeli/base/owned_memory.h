@@ -0,0 +1,68 @@
+// Copyright 2019 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef RIEGELI_BASE_OWNED_MEMORY_H_
+#define RIEGELI_BASE_OWNED_MEMORY_H_
+
+#include <stddef.h>
+
+#include <atomic>
+
+#include "riegeli/base/base.h"
+
+namespace riegeli {
+
+// Process-wide amounts of memory currently allocated by Riegeli, summed over
+// all objects and threads.
+//
+// These are the allocations which dominate memory usage of readers and writers.
+// Memory allocated by compression libraries and by standard containers is not
+// included.
+struct OwnedMemory {
+  // Memory of `Chain` blocks, including blocks kept in free lists for reuse.
+  size_t chain_blocks = 0;
+  // Memory of `Buffer` contents, e.g. buffers of `BufferedReader` and
+  // `BufferedWriter`.
+  size_t buffers = 0;
+
+  size_t total() const { return SaturatingAdd(chain_blocks, buffers); }
+};
+
+// Returns the amounts of memory currently allocated by Riegeli.
+//
+// Counters of different kinds are read independently, so they do not
+// necessarily form a consistent snapshot if memory is being allocated
+// concurrently.
+OwnedMemory GetOwnedMemory();
+
+// Implementation details follow.
+
+namespace internal {
+
+extern std::atomic<size_t> owned_chain_block_memory;
+extern std::atomic<size_t> owned_buffer_memory;
+
+inline void AddOwnedMemory(std::atomic<size_t>* counter, size_t memory) {
+  counter->fetch_add(memory, std::memory_order_relaxed);
+}
+
+inline void SubtractOwnedMemory(std::atomic<size_t>* counter, size_t memory) {
+  counter->fetch_sub(memory, std::memory_order_relaxed);
+}
+
+}  // namespace internal
+
+}  // namespace riegeli
+
+#endif  // RIEGELI_BASE_OWNED_MEMORY_H_
@@ -14,61 +14,377 @@
 
 #include "riegeli/base/parallelism.h"
 
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
 #include <stddef.h>
 
+#include <atomic>
+#include <cmath>
 #include <deque>
+#include <fstream>
 #include <functional>
+#include <limits>
+#include <memory>
+#include <string>
 #include <thread>
 #include <utility>
+#include <vector>
 
 #include "absl/base/thread_annotations.h"
+#include "absl/strings/match.h"
+#include "absl/strings/numbers.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/str_split.h"
+#include "absl/strings/strip.h"
+#include "absl/strings/string_view.h"
 #include "absl/synchronization/mutex.h"
 #include "absl/time/time.h"
 #include "riegeli/base/base.h"
 #include "riegeli/base/memory.h"
 
 namespace riegeli {
-namespace internal {
+
+namespace {
+
+// The thread pool and the home queue of the current worker thread, if any.
+thread_local ThreadPool* current_thread_pool = nullptr;
+thread_local size_t current_home = 0;
+
+#ifdef __linux__
+
+// Parses a list of numbers and ranges in the format of Linux sysfs, e.g.
+// "0-3,8-11".
+bool ParseCpuList(absl::string_view text, std::vector<int>* cpus) {
+  for (const absl::string_view range :
+       absl::StrSplit(text, ',', absl::SkipWhitespace())) {
+    const std::pair<absl::string_view, absl::string_view> bounds =
+        absl::StrSplit(range, absl::MaxSplits('-', 1));
+    int first, last;
+    if (ABSL_PREDICT_FALSE(!absl::SimpleAtoi(bounds.first, &first))) {
+      return false;
+    }
+    last = first;
+    if (!bounds.second.empty() &&
+        ABSL_PREDICT_FALSE(!absl::SimpleAtoi(bounds.second, &last))) {
+      return false;
+    }
+    if (ABSL_PREDICT_FALSE(first < 0 || last < first)) return false;
+    for (int cpu = first; cpu <= last; ++cpu) cpus->push_back(cpu);
+  }
+  return true;
+}
+
+// Reads a list in the format of `ParseCpuList()` from a file.
+bool ReadCpuList(const std::string& filename, std::vector<int>* cpus) {
+  std::ifstream file(filename);
+  std::string text;
+  if (ABSL_PREDICT_FALSE(!std::getline(file, text))) return false;
+  return ParseCpuList(text, cpus);
+}
+
+// Reads the CPU quota of the cgroup of this process, in CPUs. Returns `false`
+// if there is no quota or it cannot be determined.
+bool CgroupCpuQuota(double* quota) {
+  // cgroup v2: "cpu.max" contains "<quota> <period>" or "max <period>", in
+  // the directory given by the "0::<path>" line of "/proc/self/cgroup". In a
+  // container whose cgroup namespace starts at its own cgroup, that path is
+  // "/".
+  std::string cgroup_dir = "/sys/fs/cgroup";
+  {
+    std::ifstream file("/proc/self/cgroup");
+    std::string line;
+    while (std::getline(file, line)) {
+      if (absl::StartsWith(line, "0::")) {
+        absl::StrAppend(&cgroup_dir, absl::StripSuffix(line.substr(3), "/"));
+        break;
+      }
+    }
+  }
+  for (const std::string& dir : {cgroup_dir, std::string("/sys/fs/cgroup")}) {
+    std::ifstream file(absl::StrCat(dir, "/cpu.max"));
+    std::string text;
+    if (!std::getline(file, text)) continue;
+    const std::pair<absl::string_view, absl::string_view> fields =
+        absl::StrSplit(text, absl::MaxSplits(' ', 1));
+    double max, period;
+    if (!absl::SimpleAtod(fields.first, &max) ||
+        !absl::SimpleAtod(fields.second, &period) || max <= 0.0 ||
+        period <= 0.0) {
+      // "max" means no quota.
+      return false;
+    }
+    *quota = max / period;
+    return true;
+  }
+  // cgroup v1: "cpu.cfs_quota_us" is -1 if there is no quota.
+  std::ifstream quota_file("/sys/fs/cgroup/cpu/cpu.cfs_quota_us");
+  std::ifstream period_file("/sys/fs/cgroup/cpu/cpu.cfs_period_us");
+  double max, period;
+  if (!(quota_file >> max) || !(period_file >> period) || max <= 0.0 ||
+      period <= 0.0) {
+    return false;
+  }
+  *quota = max / period;
+  return true;
+}
+
+#endif
+
+}  // namespace
+
+size_t AvailableCpus() {
+  static const size_t available_cpus = [] {
+    size_t cpus = size_t{std::thread::hardware_concurrency()};
+#ifdef __linux__
+    cpu_set_t cpu_set;
+    if (sched_getaffinity(0, sizeof(cpu_set), &cpu_set) == 0) {
+      cpus = IntCast<size_t>(CPU_COUNT(&cpu_set));
+    }
+    double quota;
+    if (CgroupCpuQuota(&quota)) {
+      cpus = UnsignedMin(cpus, static_cast<size_t>(std::ceil(quota)));
+    }
+#endif
+    return UnsignedMax(cpus, size_t{1});
+  }();
+  return available_cpus;
+}
+
+ThreadPool::ThreadPool(Options options)
+    : max_threads_(options.max_threads_ == 0
+                       ? std::numeric_limits<size_t>::max()
+                       : options.max_threads_),
+      nodes_(options.numa_aware_ ? NumaNodes() : std::vector<Node>()),
+      num_queues_(
+          nodes_.empty()
+              ? UnsignedMin(max_threads_,
+                            UnsignedMax(
+                                size_t{std::thread::hardware_concurrency()},
+                                size_t{1}))
+              : nodes_.back().queue_end),
+      queues_(new Queue[num_queues_]) {
+  if (nodes_.empty()) {
+    for (size_t i = 0; i < num_queues_; ++i) {
+      queues_[i].node_begin = 0;
+      queues_[i].node_end = num_queues_;
+    }
+    return;
+  }
+  for (size_t node = 0; node < nodes_.size(); ++node) {
+    for (size_t i = nodes_[node].queue_begin; i < nodes_[node].queue_end;
+         ++i) {
+      queues_[i].node_begin = nodes_[node].queue_begin;
+      queues_[i].node_end = nodes_[node].queue_end;
+      queues_[i].node = node;
+    }
+    for (const int cpu : nodes_[node].cpus) {
+      if (IntCast<size_t>(cpu) >= cpu_nodes_.size()) {
+        cpu_nodes_.resize(IntCast<size_t>(cpu) + 1, nodes_.size());
+      }
+      cpu_nodes_[IntCast<size_t>(cpu)] = node;
+    }
+  }
+}
+
+std::vector<ThreadPool::Node> ThreadPool::NumaNodes() {
+  std::vector<Node> nodes;
+#ifdef __linux__
+  std::vector<int> node_numbers;
+  if (!ReadCpuList("/sys/devices/system/node/online", &node_numbers)) {
+    return nodes;
+  }
+  if (node_numbers.size() <= 1) return nodes;
+  size_t num_queues = 0;
+  for (const int node_number : node_numbers) {
+    Node node;
+    if (!ReadCpuList(absl::StrCat("/sys/devices/system/node/node",
+                                  node_number, "/cpulist"),
+                     &node.cpus)) {
+      return std::vector<Node>();
+    }
+    // A node without CPUs, e.g. only with memory, has no worker threads.
+    if (node.cpus.empty()) continue;
+    node.queue_begin = num_queues;
+    num_queues += node.cpus.size();
+    node.queue_end = num_queues;
+    nodes.push_back(std::move(node));
+  }
+  if (nodes.size() <= 1) nodes.clear();
+#endif
+  return nodes;
+}
+
+inline size_t ThreadPool::CurrentNode() const {
+#ifdef __linux__
+  const int cpu = sched_getcpu();
+  if (cpu >= 0 && IntCast<size_t>(cpu) < cpu_nodes_.size()) {
+    return cpu_nodes_[IntCast<size_t>(cpu)];
+  }
+#endif
+  return nodes_.size();
+}
 
 ThreadPool::~ThreadPool() {
   absl::MutexLock lock(&mutex_);
-  exiting_ = true;
+  exiting_.store(true, std::memory_order_relaxed);
   mutex_.Await(absl::Condition(
-      +[](size_t* num_threads) { return *num_threads == 0; }, &num_threads_));
+      +[](std::atomic<size_t>* num_threads) {
+        return num_threads->load(std::memory_order_relaxed) == 0;
+      },
+      &num_threads_));
 }
 
-void ThreadPool::Schedule(std::function<void()> task) {
+void ThreadPool::Schedule(std::function<void()> task, Priority priority) {
+  // `num_tasks_` is incremented before the task is put in a queue, so that it
+  // never underflows when the task is taken.
+  num_tasks_.fetch_add(1);
+  size_t queue_index;
+  if (current_thread_pool == this) {
+    queue_index = current_home;
+  } else {
+    const size_t next = next_queue_.fetch_add(1, std::memory_order_relaxed);
+    const size_t node = nodes_.empty() ? size_t{0} : CurrentNode();
+    if (node < nodes_.size()) {
+      queue_index =
+          nodes_[node].queue_begin +
+          next % (nodes_[node].queue_end - nodes_[node].queue_begin);
+    } else {
+      queue_index = next % num_queues_;
+    }
+  }
+  switch (priority) {
+    case Priority::kLow: {
+      absl::MutexLock lock(&low_priority_queue_.mutex);
+      low_priority_queue_.tasks.push_back(std::move(task));
+      num_low_priority_tasks_.fetch_add(1);
+    } break;
+    case Priority::kNormal: {
+      Queue& queue = queues_[queue_index];
+      absl::MutexLock lock(&queue.mutex);
+      queue.tasks.push_back(std::move(task));
+    } break;
+    case Priority::kHigh: {
+      absl::MutexLock lock(&high_priority_queue_.mutex);
+      high_priority_queue_.tasks.push_back(std::move(task));
+      num_high_priority_tasks_.fetch_add(1);
+    } break;
+  }
+  if (num_idle_threads_.load() == 0 && num_threads_.load() >= max_threads_) {
+    // All threads are busy. One of them will take the task when it finishes
+    // its current task.
+    return;
+  }
+  size_t home;
   {
     absl::MutexLock lock(&mutex_);
-    RIEGELI_ASSERT(!exiting_)
-        << "Failed precondition of ThreadPool::Schedule(): no new threads may "
+    RIEGELI_ASSERT(!exiting_.load(std::memory_order_relaxed))
+        << "Failed precondition of ThreadPool::Schedule(): no new tasks may "
            "be scheduled while the thread pool is exiting";
-    tasks_.push_back(std::move(task));
-    if (num_idle_threads_ >= tasks_.size()) return;
-    ++num_threads_;
-  }
-  std::thread([this] {
-    for (;;) {
-      absl::ReleasableMutexLock lock(&mutex_);
-      ++num_idle_threads_;
-      mutex_.AwaitWithTimeout(
-          absl::Condition(
-              +[](ThreadPool* self) ABSL_EXCLUSIVE_LOCKS_REQUIRED(mutex_) {
-                return !self->tasks_.empty() || self->exiting_;
-              },
-              this),
-          absl::Seconds(60));
-      --num_idle_threads_;
-      if (tasks_.empty() || exiting_) {
-        --num_threads_;
-        return;
-      }
-      const std::function<void()> task = std::move(tasks_.front());
-      tasks_.pop_front();
-      lock.Release();
+    // Idle threads are woken up when `mutex_` is unlocked.
+    if (num_idle_threads_.load() >= num_tasks_.load()) return;
+    if (num_threads_.load() >= max_threads_) return;
+    num_threads_.fetch_add(1);
+    // A NUMA-aware thread pool creates the thread on the node of the task.
+    home = nodes_.empty() ? next_home_++ % num_queues_ : queue_index;
+  }
+  std::thread([this, home] { WorkerThread(home); }).detach();
+}
+
+void ThreadPool::WorkerThread(size_t home) {
+  current_thread_pool = this;
+  current_home = home;
+#ifdef __linux__
+  if (!nodes_.empty()) {
+    cpu_set_t cpu_set;
+    CPU_ZERO(&cpu_set);
+    for (const int cpu : nodes_[queues_[home].node].cpus) {
+      if (cpu < CPU_SETSIZE) CPU_SET(cpu, &cpu_set);
+    }
+    // On failure the thread is left unrestricted, which still works.
+    pthread_setaffinity_np(pthread_self(), sizeof(cpu_set), &cpu_set);
+  }
+#endif
+  for (;;) {
+    std::function<void()> task;
+    while (!exiting_.load(std::memory_order_relaxed) &&
+           TakeTask(home, &task)) {
       task();
+      task = nullptr;
     }
-  }).detach();
+    absl::MutexLock lock(&mutex_);
+    num_idle_threads_.fetch_add(1);
+    mutex_.AwaitWithTimeout(
+        absl::Condition(
+            +[](ThreadPool* self) {
+              return self->num_tasks_.load() > 0 ||
+                     self->exiting_.load(std::memory_order_relaxed);
+            },
+            this),
+        absl::Seconds(60));
+    num_idle_threads_.fetch_sub(1);
+    if (num_tasks_.load() == 0 || exiting_.load(std::memory_order_relaxed)) {
+      num_threads_.fetch_sub(1);
+      return;
+    }
+  }
+}
+
+bool ThreadPool::TakeTask(size_t home, std::function<void()>* task) {
+  if (num_tasks_.load() == 0) return false;
+  if (num_high_priority_tasks_.load() > 0) {
+    absl::MutexLock lock(&high_priority_queue_.mutex);
+    if (!high_priority_queue_.tasks.empty()) {
+      *task = std::move(high_priority_queue_.tasks.front());
+      high_priority_queue_.tasks.pop_front();
+      num_high_priority_tasks_.fetch_sub(1);
+      goto taken;
+    }
+  }
+  {
+    Queue& queue = queues_[home];
+    absl::MutexLock lock(&queue.mutex);
+    if (!queue.tasks.empty()) {
+      // Tasks from the own queue are taken in the order of scheduling.
+      *task = std::move(queue.tasks.front());
+      queue.tasks.pop_front();
+      goto taken;
+    }
+  }
+  {
+    // Tasks are stolen from queues of the same NUMA node first.
+    const size_t node_begin = queues_[home].node_begin;
+    const size_t node_size = queues_[home].node_end - node_begin;
+    for (size_t i = 1; i < num_queues_; ++i) {
+      const size_t index =
+          i < node_size ? node_begin + (home - node_begin + i) % node_size
+                        : (node_begin + i) % num_queues_;
+      Queue& queue = queues_[index];
+      absl::MutexLock lock(&queue.mutex);
+      if (!queue.tasks.empty()) {
+        // Tasks are stolen from the other end of the queue, to reduce
+        // contention with the thread which owns the queue.
+        *task = std::move(queue.tasks.back());
+        queue.tasks.pop_back();
+        goto taken;
+      }
+    }
+  }
+  if (num_low_priority_tasks_.load() > 0) {
+    absl::MutexLock lock(&low_priority_queue_.mutex);
+    if (!low_priority_queue_.tasks.empty()) {
+      *task = std::move(low_priority_queue_.tasks.front());
+      low_priority_queue_.tasks.pop_front();
+      num_low_priority_tasks_.fetch_sub(1);
+      goto taken;
+    }
+  }
+  return false;
+
+taken:
+  num_tasks_.fetch_sub(1);
+  return true;
 }
 
 ThreadPool& ThreadPool::global() {
@@ -76,5 +392,4 @@ ThreadPool& ThreadPool::global() {
   return *kStaticThreadPool;
 }
 
-}  // namespace internal
 }  // namespace riegeli
@@ -17,39 +17,192 @@
 
 #include <stddef.h>
 
+#include <atomic>
 #include <deque>
 #include <functional>
+#include <memory>
+#include <utility>
+#include <vector>
 
 #include "absl/base/thread_annotations.h"
 #include "absl/synchronization/mutex.h"
 
 namespace riegeli {
-namespace internal {
 
-// A thread pool with lazily created worker threads, without a thread count
-// limit. Worker threads exit after being idle for one minute.
+// A thread pool with lazily created worker threads, optionally with a thread
+// count limit. Worker threads exit after being idle for one minute.
+//
+// Each worker thread has its own queue of tasks, where tasks scheduled from
+// that thread are put. Tasks scheduled from other threads are distributed among
+// the queues. A worker thread takes tasks from its own queue first, and steals
+// tasks from other queues when its own queue is empty. This avoids contention
+// on a single queue.
+//
+// Tasks can have a priority. A worker thread takes any high priority task
+// before tasks of normal priority, and takes low priority tasks only if there
+// are no other tasks. Tasks which started are not interrupted.
+//
+// If the number of threads is limited, tasks should not block waiting for
+// other tasks scheduled in the same thread pool, because this can deadlock.
+//
+// A NUMA-aware thread pool (see `Options::set_numa_aware()`) groups queues by
+// NUMA node, restricts worker threads of a node to its CPUs, puts tasks
+// scheduled from outside of worker threads to the queues of the node the
+// scheduling thread runs on, and steals tasks from queues of the same node
+// first. Memory is typically allocated from the node of the thread which
+// touches it first, so a task processing data prepared by the thread which
+// schedules it tends to run on the node holding the data.
 class ThreadPool {
  public:
-  ThreadPool() {}
+  // The order in which worker threads take tasks, see above.
+  enum class Priority {
+    // Batch work which can wait, e.g. encoding by background writers.
+    kLow,
+    kNormal,
+    // Latency-sensitive work, e.g. decoding for foreground reads.
+    kHigh,
+  };
+
+  class Options {
+   public:
+    Options() noexcept {}
+
+    // Sets the maximum number of worker threads. 0 means no limit.
+    //
+    // Default: 0
+    Options& set_max_threads(size_t max_threads) & {
+      max_threads_ = max_threads;
+      return *this;
+    }
+    Options&& set_max_threads(size_t max_threads) && {
+      return std::move(set_max_threads(max_threads));
+    }
+
+    // If `true`, worker threads are grouped by NUMA node, as described above.
+    //
+    // This has an effect only on Linux with more than one NUMA node, which are
+    // found in `/sys/devices/system/node`. Otherwise the thread pool behaves
+    // as if this was `false`.
+    //
+    // Default: `false`
+    Options& set_numa_aware(bool numa_aware) & {
+      numa_aware_ = numa_aware;
+      return *this;
+    }
+    Options&& set_numa_aware(bool numa_aware) && {
+      return std::move(set_numa_aware(numa_aware));
+    }
+
+   private:
+    friend class ThreadPool;
+
+    size_t max_threads_ = 0;
+    bool numa_aware_ = false;
+  };
+
+  explicit ThreadPool(Options options = Options());
 
   ThreadPool(const ThreadPool&) = delete;
   ThreadPool& operator=(const ThreadPool&) = delete;
 
+  // Waits for worker threads to finish their current tasks and exit. Tasks
+  // which have not started yet are abandoned.
   ~ThreadPool();
 
+  // Returns a thread pool without a thread count limit, shared by default by
+  // users of `ThreadPool` in Riegeli.
   static ThreadPool& global();
 
-  void Schedule(std::function<void()> task);
+  // Schedules a task to be run on a worker thread.
+  void Schedule(std::function<void()> task,
+                Priority priority = Priority::kNormal);
+
+  // Returns the number of NUMA nodes which worker threads are grouped by, or 0
+  // if the thread pool is not NUMA-aware.
+  size_t num_numa_nodes() const { return nodes_.size(); }
 
  private:
+  struct Node {
+    // CPUs which worker threads of this node are restricted to.
+    std::vector<int> cpus;
+    // Queues of this node are `queues_[queue_begin..queue_end)`.
+    size_t queue_begin = 0;
+    size_t queue_end = 0;
+  };
+
+  struct Queue {
+    absl::Mutex mutex;
+    std::deque<std::function<void()>> tasks ABSL_GUARDED_BY(mutex);
+    // Queues of the node of this queue are `queues_[node_begin..node_end)`.
+    // Without NUMA awareness, this covers all queues.
+    size_t node_begin = 0;
+    size_t node_end = 0;
+    // The index of the node of this queue in `nodes_`, if `!nodes_.empty()`.
+    size_t node = 0;
+  };
+
+  // Reads NUMA nodes of the machine with their CPUs, assigning one queue per
+  // CPU. Returns an empty vector if there is at most one node, or if nodes
+  // cannot be determined.
+  static std::vector<Node> NumaNodes();
+
+  // Returns the index in `nodes_` of the node of the CPU the current thread
+  // runs on, or `nodes_.size()` if unknown.
+  size_t CurrentNode() const;
+
+  // Body of a worker thread which takes tasks primarily from `queues_[home]`.
+  void WorkerThread(size_t home);
+
+  // Takes a task from `high_priority_queue_`, `queues_[home]`, another queue
+  // in `queues_`, or `low_priority_queue_`, in this order of preference.
+  //
+  // Return values:
+  //  * `true`  - success (`*task` is set)
+  //  * `false` - all queues are empty
+  bool TakeTask(size_t home, std::function<void()>* task);
+
+  // Invariant: `max_threads_ > 0`
+  const size_t max_threads_;
+  // NUMA nodes, non-empty only if the thread pool is NUMA-aware.
+  const std::vector<Node> nodes_;
+  // The index in `nodes_` of the node of each CPU, indexed by CPU number.
+  std::vector<size_t> cpu_nodes_;
+  const size_t num_queues_;
+  // Invariant: `queues_` has `num_queues_` elements
+  const std::unique_ptr<Queue[]> queues_;
+  // The queue where the next task scheduled from outside of worker threads is
+  // put, modulo `num_queues_`.
+  std::atomic<size_t> next_queue_{0};
+  // Tasks of priorities other than `Priority::kNormal`, shared by all worker
+  // threads.
+  Queue high_priority_queue_;
+  Queue low_priority_queue_;
+  // The number of tasks in `high_priority_queue_` and `low_priority_queue_`,
+  // which lets the common case of only normal priority tasks avoid locking
+  // them.
+  std::atomic<size_t> num_high_priority_tasks_{0};
+  std::atomic<size_t> num_low_priority_tasks_{0};
+  // The number of tasks in all queues.
+  std::atomic<size_t> num_tasks_{0};
+
+  // Guards changes of the fields below. Idle worker threads wait on `mutex_`,
+  // so it is locked by `Schedule()` only when some threads are idle or more
+  // threads can be created.
   absl::Mutex mutex_;
-  bool exiting_ ABSL_GUARDED_BY(mutex_) = false;
-  size_t num_threads_ ABSL_GUARDED_BY(mutex_) = 0;
-  size_t num_idle_threads_ ABSL_GUARDED_BY(mutex_) = 0;
-  std::deque<std::function<void()>> tasks_ ABSL_GUARDED_BY(mutex_);
+  std::atomic<bool> exiting_{false};
+  std::atomic<size_t> num_threads_{0};
+  std::atomic<size_t> num_idle_threads_{0};
+  // The home queue of the next worker thread, modulo `num_queues_`.
+  size_t next_home_ ABSL_GUARDED_BY(mutex_) = 0;
 };
 
-}  // namespace internal
+// Returns the number of CPUs this process can use, at least 1: CPUs it is
+// allowed to run on, limited by the CPU quota of its cgroup (cgroup v2
+// `cpu.max` or cgroup v1 `cpu.cfs_quota_us`) rounded up.
+//
+// This is determined once and cached.
+size_t AvailableCpus();
+
 }  // namespace riegeli
 
 #endif  // RIEGELI_BASE_PARALLELISM_H_
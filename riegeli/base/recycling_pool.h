@@ -17,6 +17,8 @@
 
 #include <stddef.h>
 
+#include <array>
+#include <atomic>
 #include <deque>
 #include <list>
 #include <memory>
@@ -43,6 +45,13 @@ namespace riegeli {
 // objects, which should be assigned the same key. The `Key` type must be
 // equality comparable, hashable (by `absl::Hash`), default constructible, and
 // copyable. If `Key` is `void`, all objects are considered compatible.
+//
+// To reduce contention when many threads use the same pool, each thread first
+// looks at one of `kNumShards` shards, selected by the thread, each holding at
+// most one object. Only if that misses, a pool-wide list of up to `max_size`
+// objects is consulted under a pool-wide mutex. An object put back by a thread
+// goes to its shard, pushing the previous occupant of the shard, if any, to the
+// pool-wide list, where the oldest objects are evicted.
 template <typename T, typename Deleter = std::default_delete<T>,
           typename Key = void>
 class RecyclingPool {
@@ -83,7 +92,12 @@ class RecyclingPool {
   // The default value of the constructor argument.
   static constexpr size_t kDefaultMaxSize = 16;
 
-  // Creates a pool with the given maximal number of objects to keep.
+  // The number of per-thread shards in front of the pool-wide list.
+  static constexpr size_t kNumShards = 16;
+
+  // Creates a pool with the given maximal number of objects to keep in the
+  // pool-wide list, in addition to objects kept in shards. If `max_size == 0`,
+  // shards are not used either.
   explicit RecyclingPool(size_t max_size = kDefaultMaxSize)
       : max_size_(max_size), cache_(by_key_.end()) {}
 
@@ -105,6 +119,14 @@ class RecyclingPool {
   Handle Get(Key key, Factory factory,
              Refurbisher refurbisher = DefaultRefurbisher());
 
+  // Calls `function` with a `const T&` argument for each object kept in the
+  // pool, e.g. to estimate their memory usage.
+  //
+  // `function` is called under a mutex of the pool, so it must not use the
+  // pool.
+  template <typename Function>
+  void ForEach(Function function) const;
+
  private:
   // Adding or removing elements in `ByFreshness` must not invalidate other
   // iterators.
@@ -124,10 +146,21 @@ class RecyclingPool {
 
   using ByKey = absl::flat_hash_map<Key, Entries>;
 
+  struct Shard {
+    mutable absl::Mutex mutex;
+    // `nullptr` if the shard is empty.
+    std::unique_ptr<T, Deleter> object ABSL_GUARDED_BY(mutex);
+    // The key of `object`, valid if `object != nullptr`.
+    Key key ABSL_GUARDED_BY(mutex);
+  };
+
   void Put(const Key& key, std::unique_ptr<T, Deleter> object);
+  // Puts an object into the pool-wide list, bypassing shards.
+  void PutToList(const Key& key, std::unique_ptr<T, Deleter> object);
 
   size_t max_size_;
-  absl::Mutex mutex_;
+  std::array<Shard, kNumShards> shards_;
+  mutable absl::Mutex mutex_;
   // The key of each object, ordered by the freshness of the object (older to
   // newer).
   ByFreshness by_freshness_ ABSL_GUARDED_BY(mutex_);
@@ -174,6 +207,8 @@ class RecyclingPool<T, Deleter, void> {
 
   static constexpr size_t kDefaultMaxSize = 16;
 
+  static constexpr size_t kNumShards = 16;
+
   explicit RecyclingPool(size_t max_size = kDefaultMaxSize)
       : max_size_(max_size) {}
 
@@ -185,17 +220,58 @@ class RecyclingPool<T, Deleter, void> {
   template <typename Factory, typename Refurbisher = DefaultRefurbisher>
   Handle Get(Factory factory, Refurbisher refurbisher = DefaultRefurbisher());
 
+  template <typename Function>
+  void ForEach(Function function) const;
+
  private:
+  struct Shard {
+    mutable absl::Mutex mutex;
+    // `nullptr` if the shard is empty.
+    std::unique_ptr<T, Deleter> object ABSL_GUARDED_BY(mutex);
+  };
+
   void Put(std::unique_ptr<T, Deleter> object);
 
   size_t max_size_;
-  absl::Mutex mutex_;
+  std::array<Shard, kNumShards> shards_;
+  mutable absl::Mutex mutex_;
   // All objects, ordered by freshness (older to newer).
   std::deque<std::unique_ptr<T, Deleter>> by_freshness_ ABSL_GUARDED_BY(mutex_);
 };
 
 // Implementation details follow.
 
+namespace internal {
+
+// Returns a number identifying the current thread, assigned consecutively to
+// threads in the order of the first call, so that threads spread evenly over
+// shards of `RecyclingPool`.
+inline size_t RecyclingPoolThreadIndex() {
+  static std::atomic<size_t> next_thread_index(0);
+  thread_local const size_t thread_index =
+      next_thread_index.fetch_add(1, std::memory_order_relaxed);
+  return thread_index;
+}
+
+}  // namespace internal
+
+// Before C++17 if a constexpr static data member is ODR-used, its definition at
+// namespace scope is required. Since C++17 these definitions are deprecated:
+// http://en.cppreference.com/w/cpp/language/static
+#if __cplusplus < 201703
+template <typename T, typename Deleter, typename Key>
+constexpr size_t RecyclingPool<T, Deleter, Key>::kDefaultMaxSize;
+
+template <typename T, typename Deleter, typename Key>
+constexpr size_t RecyclingPool<T, Deleter, Key>::kNumShards;
+
+template <typename T, typename Deleter>
+constexpr size_t RecyclingPool<T, Deleter>::kDefaultMaxSize;
+
+template <typename T, typename Deleter>
+constexpr size_t RecyclingPool<T, Deleter>::kNumShards;
+#endif
+
 template <typename T, typename Deleter, typename Key>
 inline void RecyclingPool<T, Deleter, Key>::Recycler::operator()(T* ptr) const {
   RIEGELI_ASSERT(pool_ != nullptr)
@@ -216,7 +292,15 @@ typename RecyclingPool<T, Deleter, Key>::Handle
 RecyclingPool<T, Deleter, Key>::Get(Key key, Factory factory,
                                     Refurbisher refurbisher) {
   std::unique_ptr<T, Deleter> returned;
-  {
+  if (ABSL_PREDICT_TRUE(max_size_ > 0)) {
+    Shard& shard =
+        shards_[internal::RecyclingPoolThreadIndex() % kNumShards];
+    absl::MutexLock lock(&shard.mutex);
+    if (shard.object != nullptr && shard.key == key) {
+      returned = std::move(shard.object);
+    }
+  }
+  if (returned == nullptr) {
     absl::MutexLock lock(&mutex_);
     if (cache_ != by_key_.end()) {
       // Finish erasing the cached entry.
@@ -253,9 +337,43 @@ RecyclingPool<T, Deleter, Key>::Get(Key key, Factory factory,
       Recycler(this, std::move(key), std::move(returned.get_deleter())));
 }
 
+template <typename T, typename Deleter, typename Key>
+template <typename Function>
+void RecyclingPool<T, Deleter, Key>::ForEach(Function function) const {
+  for (const Shard& shard : shards_) {
+    absl::MutexLock lock(&shard.mutex);
+    if (shard.object != nullptr) function(*shard.object);
+  }
+  absl::MutexLock lock(&mutex_);
+  for (const typename ByKey::value_type& entries : by_key_) {
+    for (const Entry& entry : entries.second) {
+      // The object pointed to by `cache_` can be `nullptr`.
+      if (entry.object != nullptr) function(*entry.object);
+    }
+  }
+}
+
 template <typename T, typename Deleter, typename Key>
 void RecyclingPool<T, Deleter, Key>::Put(const Key& key,
                                          std::unique_ptr<T, Deleter> object) {
+  Key object_key = key;
+  if (ABSL_PREDICT_TRUE(max_size_ > 0)) {
+    // Keep the newest object in the shard, and move its previous occupant, if
+    // any, to the pool-wide list.
+    Shard& shard =
+        shards_[internal::RecyclingPoolThreadIndex() % kNumShards];
+    absl::MutexLock lock(&shard.mutex);
+    using std::swap;
+    swap(shard.object, object);
+    swap(shard.key, object_key);
+    if (object == nullptr) return;
+  }
+  PutToList(object_key, std::move(object));
+}
+
+template <typename T, typename Deleter, typename Key>
+void RecyclingPool<T, Deleter, Key>::PutToList(
+    const Key& key, std::unique_ptr<T, Deleter> object) {
   std::unique_ptr<T, Deleter> evicted;
   absl::MutexLock lock(&mutex_);
   // Add a newest entry with this key.
@@ -323,7 +441,13 @@ template <typename Factory, typename Refurbisher>
 typename RecyclingPool<T, Deleter>::Handle RecyclingPool<T, Deleter>::Get(
     Factory factory, Refurbisher refurbisher) {
   std::unique_ptr<T, Deleter> returned;
-  {
+  if (ABSL_PREDICT_TRUE(max_size_ > 0)) {
+    Shard& shard =
+        shards_[internal::RecyclingPoolThreadIndex() % kNumShards];
+    absl::MutexLock lock(&shard.mutex);
+    returned = std::move(shard.object);
+  }
+  if (returned == nullptr) {
     absl::MutexLock lock(&mutex_);
     if (ABSL_PREDICT_TRUE(!by_freshness_.empty())) {
       // Return the newest entry.
@@ -340,8 +464,30 @@ typename RecyclingPool<T, Deleter>::Handle RecyclingPool<T, Deleter>::Get(
                 Recycler(this, std::move(returned.get_deleter())));
 }
 
+template <typename T, typename Deleter>
+template <typename Function>
+void RecyclingPool<T, Deleter>::ForEach(Function function) const {
+  for (const Shard& shard : shards_) {
+    absl::MutexLock lock(&shard.mutex);
+    if (shard.object != nullptr) function(*shard.object);
+  }
+  absl::MutexLock lock(&mutex_);
+  for (const std::unique_ptr<T, Deleter>& object : by_freshness_) {
+    function(*object);
+  }
+}
+
 template <typename T, typename Deleter>
 void RecyclingPool<T, Deleter>::Put(std::unique_ptr<T, Deleter> object) {
+  if (ABSL_PREDICT_TRUE(max_size_ > 0)) {
+    // Keep the newest object in the shard, and move its previous occupant, if
+    // any, to the pool-wide list.
+    Shard& shard =
+        shards_[internal::RecyclingPoolThreadIndex() % kNumShards];
+    absl::MutexLock lock(&shard.mutex);
+    std::swap(shard.object, object);
+    if (object == nullptr) return;
+  }
   std::unique_ptr<T, Deleter> evicted;
   absl::MutexLock lock(&mutex_);
   // Add a newest entry.
@@ -0,0 +1,101 @@
+// Copyright 2019 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef RIEGELI_BASE_TRACING_H_
+#define RIEGELI_BASE_TRACING_H_
+
+#include <atomic>
+
+#include "absl/base/optimization.h"
+
+namespace riegeli {
+
+// Receives begin and end events of operations performed by Riegeli, for
+// attributing latency, e.g. "ReadChunk", "DecodeChunk", "TransposeDecode",
+// "Decompress", "EncodeChunk", "WriteChunk".
+//
+// Events of one thread are properly nested: `End()` ends the operation most
+// recently begun in the same thread. Events can come from many threads
+// concurrently, including threads of `ThreadPool::global()`, so a `Tracer` must
+// be thread-safe.
+//
+// `ChromeTracer` writes events in the Chrome trace event format, which can also
+// be viewed in Perfetto.
+class Tracer {
+ public:
+  virtual ~Tracer();
+
+  // Called when the operation `name` begins in the current thread.
+  //
+  // `name` is a string literal.
+  virtual void Begin(const char* name) = 0;
+
+  // Called when the operation `name`, most recently begun in the current
+  // thread, ends.
+  virtual void End(const char* name) = 0;
+};
+
+// Installs `tracer` to receive events from all threads, replacing the previous
+// tracer. `nullptr` disables tracing, which is the default.
+//
+// The tracer is not owned, and must be valid until events can no longer be
+// reported to it, i.e. until operations begun while it was installed end.
+void SetTracer(Tracer* tracer);
+
+// Returns the installed tracer, or `nullptr` if tracing is disabled.
+Tracer* GetTracer();
+
+// Reports the beginning of the operation `name` to the installed tracer, if
+// any, and its end when the `TraceScope` is destroyed. With tracing disabled
+// this costs one atomic load.
+//
+// `name` is a string literal.
+class TraceScope {
+ public:
+  explicit TraceScope(const char* name);
+
+  TraceScope(const TraceScope&) = delete;
+  TraceScope& operator=(const TraceScope&) = delete;
+
+  ~TraceScope();
+
+ private:
+  Tracer* tracer_;
+  const char* name_;
+};
+
+// Implementation details follow.
+
+namespace internal {
+
+extern std::atomic<Tracer*> global_tracer;
+
+}  // namespace internal
+
+inline Tracer* GetTracer() {
+  return internal::global_tracer.load(std::memory_order_acquire);
+}
+
+inline TraceScope::TraceScope(const char* name)
+    : tracer_(GetTracer()), name_(name) {
+  if (ABSL_PREDICT_FALSE(tracer_ != nullptr)) tracer_->Begin(name_);
+}
+
+inline TraceScope::~TraceScope() {
+  if (ABSL_PREDICT_FALSE(tracer_ != nullptr)) tracer_->End(name_);
+}
+
+}  // namespace riegeli
+
+#endif  // RIEGELI_BASE_TRACING_H_
@@ -0,0 +1,195 @@
+// Copyright 2019 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "riegeli/bytes/async_writer.h"
+
+#include <stddef.h>
+
+#include <limits>
+#include <utility>
+
+#include "absl/base/optimization.h"
+#include "absl/synchronization/mutex.h"
+#include "absl/types/span.h"
+#include "riegeli/base/base.h"
+#include "riegeli/base/chain.h"
+#include "riegeli/base/parallelism.h"
+#include "riegeli/bytes/writer.h"
+
+namespace riegeli {
+
+void AsyncWriterBase::Done() {
+  if (ABSL_PREDICT_TRUE(healthy())) {
+    Writer* const dest = dest_writer();
+    SyncBuffer();
+    if (ABSL_PREDICT_TRUE(HandOver(dest)) &&
+        ABSL_PREDICT_FALSE(!WaitForWrites())) {
+      Fail(*dest);
+    }
+  }
+  WaitForWrites();
+  chain_ = Chain();
+  Writer::Done();
+}
+
+bool AsyncWriterBase::PushSlow(size_t min_length, size_t recommended_length) {
+  RIEGELI_ASSERT_GT(min_length, available())
+      << "Failed precondition of Writer::PushSlow(): "
+         "length too small, use Push() instead";
+  if (ABSL_PREDICT_FALSE(!healthy())) return false;
+  if (ABSL_PREDICT_FALSE(min_length >
+                         std::numeric_limits<Position>::max() - pos())) {
+    return FailOverflow();
+  }
+  SyncBuffer();
+  if (chain_.size() >= buffer_size_ ||
+      min_length > buffer_size_ - chain_.size()) {
+    if (ABSL_PREDICT_FALSE(!HandOver(dest_writer()))) return false;
+  }
+  MakeBuffer(min_length, recommended_length);
+  return true;
+}
+
+bool AsyncWriterBase::WriteSlow(const Chain& src) {
+  RIEGELI_ASSERT_GT(src.size(), UnsignedMin(available(), kMaxBytesToCopy))
+      << "Failed precondition of Writer::WriteSlow(Chain): "
+         "length too small, use Write(Chain) instead";
+  if (ABSL_PREDICT_FALSE(!healthy())) return false;
+  if (ABSL_PREDICT_FALSE(src.size() >
+                         std::numeric_limits<Position>::max() - pos())) {
+    return FailOverflow();
+  }
+  SyncBuffer();
+  start_pos_ += src.size();
+  chain_.Append(src, buffer_size_);
+  if (chain_.size() >= buffer_size_) return HandOver(dest_writer());
+  return true;
+}
+
+bool AsyncWriterBase::WriteSlow(Chain&& src) {
+  RIEGELI_ASSERT_GT(src.size(), UnsignedMin(available(), kMaxBytesToCopy))
+      << "Failed precondition of Writer::WriteSlow(Chain&&): "
+         "length too small, use Write(Chain&&) instead";
+  if (ABSL_PREDICT_FALSE(!healthy())) return false;
+  if (ABSL_PREDICT_FALSE(src.size() >
+                         std::numeric_limits<Position>::max() - pos())) {
+    return FailOverflow();
+  }
+  SyncBuffer();
+  start_pos_ += src.size();
+  chain_.Append(std::move(src), buffer_size_);
+  if (chain_.size() >= buffer_size_) return HandOver(dest_writer());
+  return true;
+}
+
+bool AsyncWriterBase::Flush(FlushType flush_type) {
+  if (ABSL_PREDICT_FALSE(!healthy())) return false;
+  Writer* const dest = dest_writer();
+  SyncBuffer();
+  if (ABSL_PREDICT_FALSE(!HandOver(dest))) return false;
+  if (ABSL_PREDICT_FALSE(!WaitForWrites())) return Fail(*dest);
+  if (ABSL_PREDICT_FALSE(!dest->Flush(flush_type))) {
+    if (ABSL_PREDICT_FALSE(!dest->healthy())) return Fail(*dest);
+    return false;
+  }
+  return true;
+}
+
+inline void AsyncWriterBase::SyncBuffer() {
+  if (start_ == nullptr) return;
+  start_pos_ = pos();
+  chain_.RemoveSuffix(available());
+  start_ = nullptr;
+  cursor_ = nullptr;
+  limit_ = nullptr;
+}
+
+inline void AsyncWriterBase::MakeBuffer(size_t min_length,
+                                        size_t recommended_length) {
+  const size_t remaining =
+      chain_.size() < buffer_size_ ? buffer_size_ - chain_.size() : 0;
+  const absl::Span<char> buffer = chain_.AppendBuffer(
+      min_length, UnsignedMax(recommended_length, remaining),
+      UnsignedMax(min_length, remaining), buffer_size_);
+  start_ = buffer.data();
+  cursor_ = start_;
+  limit_ = start_ + buffer.size();
+}
+
+bool AsyncWriterBase::HandOver(Writer* dest) {
+  RIEGELI_ASSERT(start_ == nullptr)
+      << "Failed precondition of AsyncWriterBase::HandOver(): "
+         "buffer not synced";
+  if (chain_.empty()) return true;
+  SharedState* const state = state_.get();
+  bool failed;
+  bool start_writing = false;
+  {
+    absl::MutexLock lock(&state->mutex);
+    state->mutex.Await(absl::Condition(state, &SharedState::HasRoom));
+    failed = state->failed;
+    if (ABSL_PREDICT_TRUE(!failed)) {
+      state->pending.push_back(std::move(chain_));
+      ++state->num_in_flight;
+      start_writing = !state->writing;
+      state->writing = true;
+    }
+  }
+  chain_ = Chain();
+  if (ABSL_PREDICT_FALSE(failed)) {
+    // Wait until the background thread is no longer using `*dest`.
+    WaitForWrites();
+    return Fail(*dest);
+  }
+  if (start_writing) {
+    ThreadPool::global().Schedule(
+        [state, dest] { WritePending(state, dest); });
+  }
+  return true;
+}
+
+void AsyncWriterBase::WritePending(SharedState* state, Writer* dest) {
+  for (;;) {
+    Chain data;
+    {
+      absl::MutexLock lock(&state->mutex);
+      if (state->pending.empty()) {
+        state->writing = false;
+        return;
+      }
+      data = std::move(state->pending.front());
+      state->pending.pop_front();
+    }
+    const bool ok = dest->Write(std::move(data));
+    absl::MutexLock lock(&state->mutex);
+    --state->num_in_flight;
+    if (ABSL_PREDICT_FALSE(!ok)) {
+      state->failed = true;
+      state->num_in_flight -= state->pending.size();
+      state->pending.clear();
+      state->writing = false;
+      return;
+    }
+  }
+}
+
+bool AsyncWriterBase::WaitForWrites() {
+  if (state_ == nullptr) return true;
+  SharedState* const state = state_.get();
+  absl::MutexLock lock(&state->mutex);
+  state->mutex.Await(absl::Condition(state, &SharedState::Idle));
+  return !state->failed;
+}
+
+}  // namespace riegeli
@@ -0,0 +1,385 @@
+// Copyright 2019 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef RIEGELI_BYTES_ASYNC_WRITER_H_
+#define RIEGELI_BYTES_ASYNC_WRITER_H_
+
+#include <stddef.h>
+
+#include <deque>
+#include <memory>
+#include <tuple>
+#include <utility>
+
+#include "absl/base/optimization.h"
+#include "absl/base/thread_annotations.h"
+#include "absl/synchronization/mutex.h"
+#include "riegeli/base/base.h"
+#include "riegeli/base/chain.h"
+#include "riegeli/base/dependency.h"
+#include "riegeli/base/object.h"
+#include "riegeli/base/resetter.h"
+#include "riegeli/bytes/writer.h"
+
+namespace riegeli {
+
+// Template parameter independent part of `AsyncWriter`.
+class AsyncWriterBase : public Writer {
+ public:
+  class Options {
+   public:
+    Options() noexcept {}
+
+    // Tunes how much data is buffered before handing it to the background
+    // thread.
+    //
+    // Default: 64K
+    Options& set_buffer_size(size_t buffer_size) & {
+      RIEGELI_ASSERT_GT(buffer_size, 0u)
+          << "Failed precondition of "
+             "AsyncWriterBase::Options::set_buffer_size(): "
+             "zero buffer size";
+      buffer_size_ = buffer_size;
+      return *this;
+    }
+    Options&& set_buffer_size(size_t buffer_size) && {
+      return std::move(set_buffer_size(buffer_size));
+    }
+
+    // Up to this many full buffers are handed to the background thread and not
+    // yet written to the destination `Writer`, including the one being written.
+    // When this many buffers are in flight, filling another buffer waits.
+    //
+    // 1 gives double buffering: one buffer is filled while another is written.
+    //
+    // Default: 2
+    Options& set_max_pending(size_t max_pending) & {
+      RIEGELI_ASSERT_GT(max_pending, 0u)
+          << "Failed precondition of "
+             "AsyncWriterBase::Options::set_max_pending(): "
+             "zero max_pending";
+      max_pending_ = max_pending;
+      return *this;
+    }
+    Options&& set_max_pending(size_t max_pending) && {
+      return std::move(set_max_pending(max_pending));
+    }
+
+   private:
+    template <typename Dest>
+    friend class AsyncWriter;
+
+    size_t buffer_size_ = kDefaultBufferSize;
+    size_t max_pending_ = 2;
+  };
+
+  // Returns the destination `Writer`. Unchanged by `Close()`.
+  virtual Writer* dest_writer() = 0;
+  virtual const Writer* dest_writer() const = 0;
+
+  // Waits until buffers in flight are written, then flushes the destination
+  // `Writer`.
+  bool Flush(FlushType flush_type) override;
+
+ protected:
+  AsyncWriterBase() noexcept : Writer(kInitiallyClosed) {}
+
+  explicit AsyncWriterBase(size_t buffer_size, size_t max_pending);
+
+  AsyncWriterBase(AsyncWriterBase&& that) noexcept;
+  AsyncWriterBase& operator=(AsyncWriterBase&& that) noexcept;
+
+  void Reset();
+  void Reset(size_t buffer_size, size_t max_pending);
+  void Initialize(Writer* dest);
+
+  // Waits until the background thread is no longer using the destination
+  // `Writer`, discarding buffers in flight if writing them failed.
+  //
+  // Return values:
+  //  * `true`  - all buffers were written
+  //  * `false` - writing failed (the destination `Writer` is not healthy)
+  bool WaitForWrites();
+
+  void Done() override;
+  bool PushSlow(size_t min_length, size_t recommended_length) override;
+  using Writer::WriteSlow;
+  bool WriteSlow(const Chain& src) override;
+  bool WriteSlow(Chain&& src) override;
+
+ private:
+  // State shared with the background thread. It has a stable address across
+  // moves of the `AsyncWriterBase`.
+  struct SharedState {
+    explicit SharedState(size_t max_pending) : max_pending(max_pending) {}
+
+    // Conditions for `absl::Mutex::Await()`.
+    bool HasRoom() ABSL_EXCLUSIVE_LOCKS_REQUIRED(mutex) {
+      return num_in_flight < max_pending || failed;
+    }
+    bool Idle() ABSL_EXCLUSIVE_LOCKS_REQUIRED(mutex) { return !writing; }
+
+    const size_t max_pending;
+    absl::Mutex mutex;
+    // Full buffers waiting to be written, in the order of writing.
+    std::deque<Chain> pending ABSL_GUARDED_BY(mutex);
+    // The number of buffers in `pending` or being written.
+    size_t num_in_flight ABSL_GUARDED_BY(mutex) = 0;
+    // `true` if a background task writes buffers from `pending`.
+    bool writing ABSL_GUARDED_BY(mutex) = false;
+    // `true` if writing failed. Buffers in flight are discarded then.
+    bool failed ABSL_GUARDED_BY(mutex) = false;
+  };
+
+  // Writes buffers from `state->pending` to `*dest` until there are none.
+  static void WritePending(SharedState* state, Writer* dest);
+
+  // Ends the buffer, leaving written data in `chain_`.
+  void SyncBuffer();
+
+  // Appends a new buffer of at least `min_length` to `chain_`.
+  void MakeBuffer(size_t min_length = 0, size_t recommended_length = 0);
+
+  // Hands `chain_` to the background thread if it is not empty, waiting for
+  // room among buffers in flight.
+  //
+  // Return values:
+  //  * `true`  - success (`healthy()`)
+  //  * `false` - failure (`!healthy()`)
+  bool HandOver(Writer* dest);
+
+  size_t buffer_size_ = 0;
+  // Data written but not yet handed to the background thread, ending with the
+  // buffer.
+  //
+  // Invariant: if `start_ != nullptr` then the buffer ends at the end of
+  //            `chain_`
+  Chain chain_;
+  std::unique_ptr<SharedState> state_;
+};
+
+// A `Writer` which hands full buffers to a background thread writing them to
+// another `Writer`, so that producing data overlaps with writing them, e.g.
+// with compression or I/O performed by the other `Writer`.
+//
+// Errors of the destination `Writer` are reported by a later write, by
+// `Flush()`, or by `Close()`.
+//
+// `AsyncWriter` does not support random access even if the destination `Writer`
+// does.
+//
+// The `Dest` template parameter specifies the type of the object providing and
+// possibly owning the destination `Writer`. `Dest` must support
+// `Dependency<Writer*, Dest>`, e.g. `Writer*` (not owned, default),
+// `std::unique_ptr<Writer>` (owned), `ZstdWriter<FdWriter<>>` (owned).
+//
+// The destination `Writer` must not be accessed until the `AsyncWriter` is
+// closed or no longer used, except that it is allowed to read the destination
+// of the destination `Writer` immediately after `Flush()`.
+template <typename Dest = Writer*>
+class AsyncWriter : public AsyncWriterBase {
+ public:
+  // Creates a closed `AsyncWriter`.
+  AsyncWriter() noexcept {}
+
+  // Will write to the destination `Writer` provided by `dest`.
+  explicit AsyncWriter(const Dest& dest, Options options = Options());
+  explicit AsyncWriter(Dest&& dest, Options options = Options());
+
+  // Will write to the destination `Writer` provided by a `Dest` constructed
+  // from elements of `dest_args`. This avoids constructing a temporary `Dest`
+  // and moving from it.
+  template <typename... DestArgs>
+  explicit AsyncWriter(std::tuple<DestArgs...> dest_args,
+                       Options options = Options());
+
+  AsyncWriter(AsyncWriter&& that) noexcept;
+  AsyncWriter& operator=(AsyncWriter&& that) noexcept;
+
+  // Waits for the background thread before the destination `Writer` can be
+  // destroyed.
+  ~AsyncWriter();
+
+  // Makes `*this` equivalent to a newly constructed `AsyncWriter`. This avoids
+  // constructing a temporary `AsyncWriter` and moving from it.
+  void Reset();
+  void Reset(const Dest& dest, Options options = Options());
+  void Reset(Dest&& dest, Options options = Options());
+  template <typename... DestArgs>
+  void Reset(std::tuple<DestArgs...> dest_args, Options options = Options());
+
+  // Returns the object providing and possibly owning the destination `Writer`.
+  // Unchanged by `Close()`.
+  Dest& dest() { return dest_.manager(); }
+  const Dest& dest() const { return dest_.manager(); }
+  Writer* dest_writer() override { return dest_.get(); }
+  const Writer* dest_writer() const override { return dest_.get(); }
+
+ protected:
+  void Done() override;
+
+ private:
+  // The object providing and possibly owning the destination `Writer`.
+  Dependency<Writer*, Dest> dest_;
+};
+
+// Implementation details follow.
+
+inline AsyncWriterBase::AsyncWriterBase(size_t buffer_size, size_t max_pending)
+    : Writer(kInitiallyOpen),
+      buffer_size_(buffer_size),
+      state_(std::make_unique<SharedState>(max_pending)) {}
+
+inline AsyncWriterBase::AsyncWriterBase(AsyncWriterBase&& that) noexcept
+    : Writer(std::move(that)),
+      buffer_size_(that.buffer_size_),
+      state_(std::move(that.state_)) {
+  // The background thread must not use the destination `Writer` while it is
+  // being moved.
+  WaitForWrites();
+  // `chain_` can hold the buffer in its short data, which would move, so end
+  // the buffer before moving `chain_`.
+  if (start_ != nullptr) {
+    start_pos_ = pos();
+    that.chain_.RemoveSuffix(available());
+    start_ = nullptr;
+    cursor_ = nullptr;
+    limit_ = nullptr;
+  }
+  chain_ = std::move(that.chain_);
+}
+
+inline AsyncWriterBase& AsyncWriterBase::operator=(
+    AsyncWriterBase&& that) noexcept {
+  WaitForWrites();
+  Writer::operator=(std::move(that));
+  buffer_size_ = that.buffer_size_;
+  state_ = std::move(that.state_);
+  WaitForWrites();
+  if (start_ != nullptr) {
+    start_pos_ = pos();
+    that.chain_.RemoveSuffix(available());
+    start_ = nullptr;
+    cursor_ = nullptr;
+    limit_ = nullptr;
+  }
+  chain_ = std::move(that.chain_);
+  return *this;
+}
+
+inline void AsyncWriterBase::Reset() {
+  WaitForWrites();
+  Writer::Reset(kInitiallyClosed);
+  buffer_size_ = 0;
+  chain_.Clear();
+  state_.reset();
+}
+
+inline void AsyncWriterBase::Reset(size_t buffer_size, size_t max_pending) {
+  WaitForWrites();
+  Writer::Reset(kInitiallyOpen);
+  buffer_size_ = buffer_size;
+  chain_.Clear();
+  state_ = std::make_unique<SharedState>(max_pending);
+}
+
+inline void AsyncWriterBase::Initialize(Writer* dest) {
+  RIEGELI_ASSERT(dest != nullptr)
+      << "Failed precondition of AsyncWriter: null Writer pointer";
+  if (ABSL_PREDICT_FALSE(!dest->healthy())) Fail(*dest);
+}
+
+template <typename Dest>
+inline AsyncWriter<Dest>::AsyncWriter(const Dest& dest, Options options)
+    : AsyncWriterBase(options.buffer_size_, options.max_pending_),
+      dest_(dest) {
+  Initialize(dest_.get());
+}
+
+template <typename Dest>
+inline AsyncWriter<Dest>::AsyncWriter(Dest&& dest, Options options)
+    : AsyncWriterBase(options.buffer_size_, options.max_pending_),
+      dest_(std::move(dest)) {
+  Initialize(dest_.get());
+}
+
+template <typename Dest>
+template <typename... DestArgs>
+inline AsyncWriter<Dest>::AsyncWriter(std::tuple<DestArgs...> dest_args,
+                                      Options options)
+    : AsyncWriterBase(options.buffer_size_, options.max_pending_),
+      dest_(std::move(dest_args)) {
+  Initialize(dest_.get());
+}
+
+template <typename Dest>
+inline AsyncWriter<Dest>::AsyncWriter(AsyncWriter&& that) noexcept
+    : AsyncWriterBase(std::move(that)), dest_(std::move(that.dest_)) {}
+
+template <typename Dest>
+inline AsyncWriter<Dest>& AsyncWriter<Dest>::operator=(
+    AsyncWriter&& that) noexcept {
+  AsyncWriterBase::operator=(std::move(that));
+  dest_ = std::move(that.dest_);
+  return *this;
+}
+
+template <typename Dest>
+inline AsyncWriter<Dest>::~AsyncWriter() {
+  WaitForWrites();
+}
+
+template <typename Dest>
+inline void AsyncWriter<Dest>::Reset() {
+  AsyncWriterBase::Reset();
+  dest_.Reset();
+}
+
+template <typename Dest>
+inline void AsyncWriter<Dest>::Reset(const Dest& dest, Options options) {
+  AsyncWriterBase::Reset(options.buffer_size_, options.max_pending_);
+  dest_.Reset(dest);
+  Initialize(dest_.get());
+}
+
+template <typename Dest>
+inline void AsyncWriter<Dest>::Reset(Dest&& dest, Options options) {
+  AsyncWriterBase::Reset(options.buffer_size_, options.max_pending_);
+  dest_.Reset(std::move(dest));
+  Initialize(dest_.get());
+}
+
+template <typename Dest>
+template <typename... DestArgs>
+inline void AsyncWriter<Dest>::Reset(std::tuple<DestArgs...> dest_args,
+                                     Options options) {
+  AsyncWriterBase::Reset(options.buffer_size_, options.max_pending_);
+  dest_.Reset(std::move(dest_args));
+  Initialize(dest_.get());
+}
+
+template <typename Dest>
+void AsyncWriter<Dest>::Done() {
+  AsyncWriterBase::Done();
+  if (dest_.is_owning()) {
+    if (ABSL_PREDICT_FALSE(!dest_->Close())) Fail(*dest_);
+  }
+}
+
+template <typename Dest>
+struct Resetter<AsyncWriter<Dest>> : ResetterByReset<AsyncWriter<Dest>> {};
+
+}  // namespace riegeli
+
+#endif  // RIEGELI_BYTES_ASYNC_WRITER_H_
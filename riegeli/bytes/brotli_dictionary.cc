@@ -0,0 +1,52 @@
+// Copyright 2019 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "riegeli/bytes/brotli_dictionary.h"
+
+#include <stdint.h>
+
+#include <memory>
+#include <utility>
+
+#include "absl/base/optimization.h"
+#include "absl/synchronization/mutex.h"
+#include "brotli/encode.h"
+#include "brotli/shared_dictionary.h"
+#include "riegeli/base/base.h"
+
+namespace riegeli {
+
+std::shared_ptr<const BrotliEncoderPreparedDictionary>
+BrotliDictionary::PrepareCompressionDictionary(int compression_level) const {
+  RIEGELI_ASSERT(!empty())
+      << "Failed precondition of "
+         "BrotliDictionary::PrepareCompressionDictionary(): "
+         "empty dictionary";
+  absl::MutexLock lock(&repr_->mutex);
+  if (repr_->compression_dictionary == nullptr ||
+      repr_->compression_level != compression_level) {
+    std::unique_ptr<BrotliEncoderPreparedDictionary,
+                    BrotliEncoderPreparedDictionaryDeleter>
+        compression_dictionary(BrotliEncoderPrepareDictionary(
+            BROTLI_SHARED_DICTIONARY_RAW, repr_->data.size(),
+            reinterpret_cast<const uint8_t*>(repr_->data.data()),
+            compression_level, nullptr, nullptr, nullptr));
+    if (ABSL_PREDICT_FALSE(compression_dictionary == nullptr)) return nullptr;
+    repr_->compression_level = compression_level;
+    repr_->compression_dictionary = std::move(compression_dictionary);
+  }
+  return repr_->compression_dictionary;
+}
+
+}  // namespace riegeli
@@ -0,0 +1,125 @@
+// Copyright 2019 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef RIEGELI_BYTES_BROTLI_DICTIONARY_H_
+#define RIEGELI_BYTES_BROTLI_DICTIONARY_H_
+
+#include <memory>
+#include <string>
+#include <utility>
+
+#include "absl/base/thread_annotations.h"
+#include "absl/strings/string_view.h"
+#include "absl/synchronization/mutex.h"
+#include "brotli/encode.h"
+
+namespace riegeli {
+
+// Data which improve compression density of small inputs similar to the data,
+// shared by `BrotliWriter` and `BrotliReader`. The same dictionary must be used
+// for compression and decompression.
+//
+// A dictionary is raw content which compressed data can refer to as if it
+// preceded each compressed input, e.g. typical records concatenated, or a
+// dictionary trained with `TrainZstdDictionary()`.
+//
+// Copying a `BrotliDictionary` is cheap: copies share the data and the
+// prepared Brotli dictionary objects, which are created lazily and reused
+// afterwards. A `BrotliDictionary` can be used concurrently by multiple
+// threads.
+class BrotliDictionary {
+ public:
+  // Creates an empty `BrotliDictionary`, which means no dictionary.
+  BrotliDictionary() noexcept {}
+
+  // Creates a `BrotliDictionary` with the given contents. Empty `data` means no
+  // dictionary.
+  explicit BrotliDictionary(std::string data);
+
+  // Creates a `BrotliDictionary` referring to `data` owned by `owner`, which is
+  // kept alive by the `BrotliDictionary` and its copies. This avoids copying
+  // data owned elsewhere. Empty `data` means no dictionary.
+  explicit BrotliDictionary(absl::string_view data,
+                            std::shared_ptr<const void> owner);
+
+  BrotliDictionary(const BrotliDictionary&) = default;
+  BrotliDictionary& operator=(const BrotliDictionary&) = default;
+
+  BrotliDictionary(BrotliDictionary&&) noexcept = default;
+  BrotliDictionary& operator=(BrotliDictionary&&) noexcept = default;
+
+  // Returns `true` if no dictionary is used.
+  bool empty() const { return repr_ == nullptr; }
+
+  // Returns the contents of the dictionary.
+  absl::string_view data() const;
+
+ private:
+  friend class BrotliWriterBase;
+
+  struct BrotliEncoderPreparedDictionaryDeleter {
+    void operator()(BrotliEncoderPreparedDictionary* ptr) const {
+      BrotliEncoderDestroyPreparedDictionary(ptr);
+    }
+  };
+
+  struct Repr {
+    explicit Repr(std::string data)
+        : storage(std::move(data)), data(storage) {}
+    explicit Repr(absl::string_view data, std::shared_ptr<const void> owner)
+        : owner(std::move(owner)), data(data) {}
+
+    // Either `storage` or `owner` owns `data`.
+    const std::string storage;
+    const std::shared_ptr<const void> owner;
+    const absl::string_view data;
+    absl::Mutex mutex;
+    // The compression level of `compression_dictionary`.
+    int compression_level ABSL_GUARDED_BY(mutex) = 0;
+    std::shared_ptr<const BrotliEncoderPreparedDictionary>
+        compression_dictionary ABSL_GUARDED_BY(mutex);
+  };
+
+  // Returns the dictionary prepared for compression at `compression_level`,
+  // or `nullptr` if `BrotliEncoderPrepareDictionary()` failed.
+  //
+  // The result refers to `data()`, so it must be used while `*this` or a copy
+  // of `*this` is alive.
+  //
+  // Precondition: `!empty()`
+  std::shared_ptr<const BrotliEncoderPreparedDictionary>
+  PrepareCompressionDictionary(int compression_level) const;
+
+  std::shared_ptr<Repr> repr_;
+};
+
+// Implementation details follow.
+
+inline BrotliDictionary::BrotliDictionary(std::string data) {
+  if (!data.empty()) repr_ = std::make_shared<Repr>(std::move(data));
+}
+
+inline BrotliDictionary::BrotliDictionary(absl::string_view data,
+                                          std::shared_ptr<const void> owner) {
+  if (!data.empty()) repr_ = std::make_shared<Repr>(data, std::move(owner));
+}
+
+inline absl::string_view BrotliDictionary::data() const {
+  if (repr_ == nullptr) return absl::string_view();
+  return repr_->data;
+}
+
+}  // namespace riegeli
+
+#endif  // RIEGELI_BYTES_BROTLI_DICTIONARY_H_
@@ -19,35 +19,114 @@
 
 #include <limits>
 #include <memory>
+#include <utility>
 
 #include "absl/base/optimization.h"
 #include "absl/strings/str_cat.h"
+#include "absl/strings/string_view.h"
+#include "absl/types/span.h"
 #include "brotli/decode.h"
+#include "brotli/shared_dictionary.h"
 #include "riegeli/base/base.h"
 #include "riegeli/base/canonical_errors.h"
+#include "riegeli/base/status.h"
+#include "riegeli/bytes/brotli_dictionary.h"
 #include "riegeli/bytes/pullable_reader.h"
 #include "riegeli/bytes/reader.h"
 
 namespace riegeli {
 
-void BrotliReaderBase::Initialize(Reader* src) {
+namespace {
+
+Status SetUpDecompressor(BrotliDecoderState* decompressor,
+                         const BrotliDictionary& dictionary) {
+  if (ABSL_PREDICT_FALSE(!BrotliDecoderSetParameter(
+          decompressor, BROTLI_DECODER_PARAM_LARGE_WINDOW, uint32_t{true}))) {
+    return InternalError(
+        "BrotliDecoderSetParameter(BROTLI_DECODER_PARAM_LARGE_WINDOW) failed");
+  }
+  if (!dictionary.empty()) {
+    if (ABSL_PREDICT_FALSE(!BrotliDecoderAttachDictionary(
+            decompressor, BROTLI_SHARED_DICTIONARY_RAW,
+            dictionary.data().size(),
+            reinterpret_cast<const uint8_t*>(dictionary.data().data())))) {
+      return InternalError("BrotliDecoderAttachDictionary() failed");
+    }
+  }
+  return OkStatus();
+}
+
+}  // namespace
+
+Status BrotliReaderBase::DecompressFlat(absl::string_view src,
+                                        absl::Span<char> dest,
+                                        const BrotliDictionary& dictionary) {
+  size_t available_in = src.size();
+  const uint8_t* next_in = reinterpret_cast<const uint8_t*>(src.data());
+  size_t available_out = dest.size();
+  uint8_t* next_out = reinterpret_cast<uint8_t*>(dest.data());
+  for (;;) {
+    const std::unique_ptr<BrotliDecoderState, BrotliDecoderStateDeleter>
+        decompressor(BrotliDecoderCreateInstance(nullptr, nullptr, nullptr));
+    if (ABSL_PREDICT_FALSE(decompressor == nullptr)) {
+      return InternalError("BrotliDecoderCreateInstance() failed");
+    }
+    {
+      const Status status = SetUpDecompressor(decompressor.get(), dictionary);
+      if (ABSL_PREDICT_FALSE(!status.ok())) return status;
+    }
+    const BrotliDecoderResult result =
+        BrotliDecoderDecompressStream(decompressor.get(), &available_in,
+                                      &next_in, &available_out, &next_out,
+                                      nullptr);
+    switch (result) {
+      case BROTLI_DECODER_RESULT_ERROR:
+        return DataLossError(
+            absl::StrCat("BrotliDecoderDecompressStream() failed: ",
+                         BrotliDecoderErrorString(
+                             BrotliDecoderGetErrorCode(decompressor.get()))));
+      case BROTLI_DECODER_RESULT_SUCCESS:
+        // Another stream may follow.
+        if (available_in > 0) continue;
+        if (ABSL_PREDICT_FALSE(available_out > 0)) {
+          return DataLossError(absl::StrCat(
+              "Brotli-compressed stream has uncompressed size ",
+              dest.size() - available_out, " instead of ", dest.size()));
+        }
+        return OkStatus();
+      case BROTLI_DECODER_RESULT_NEEDS_MORE_INPUT:
+        return DataLossError("Truncated Brotli-compressed stream");
+      case BROTLI_DECODER_RESULT_NEEDS_MORE_OUTPUT:
+        return DataLossError(absl::StrCat(
+            "Brotli-compressed stream has uncompressed size larger than ",
+            dest.size()));
+    }
+    RIEGELI_ASSERT_UNREACHABLE()
+        << "Unknown BrotliDecoderResult: " << static_cast<int>(result);
+  }
+}
+
+void BrotliReaderBase::Initialize(Reader* src, BrotliDictionary&& dictionary,
+                                  bool concatenated) {
   RIEGELI_ASSERT(src != nullptr)
       << "Failed precondition of BrotliReader: null Reader pointer";
+  dictionary_ = std::move(dictionary);
+  concatenated_ = concatenated;
   if (ABSL_PREDICT_FALSE(!src->healthy()) && src->available() == 0) {
     Fail(*src);
     return;
   }
+  CreateDecompressor();
+}
+
+inline bool BrotliReaderBase::CreateDecompressor() {
   decompressor_.reset(BrotliDecoderCreateInstance(nullptr, nullptr, nullptr));
   if (ABSL_PREDICT_FALSE(decompressor_ == nullptr)) {
-    Fail(InternalError("BrotliDecoderCreateInstance() failed"));
-    return;
-  }
-  if (ABSL_PREDICT_FALSE(!BrotliDecoderSetParameter(
-          decompressor_.get(), BROTLI_DECODER_PARAM_LARGE_WINDOW,
-          uint32_t{true}))) {
-    Fail(InternalError(
-        "BrotliDecoderSetParameter(BROTLI_DECODER_PARAM_LARGE_WINDOW) failed"));
+    return Fail(InternalError("BrotliDecoderCreateInstance() failed"));
   }
+  const Status status = SetUpDecompressor(decompressor_.get(), dictionary_);
+  if (ABSL_PREDICT_FALSE(!status.ok())) return Fail(status);
+  return true;
 }
 
 void BrotliReaderBase::Done() {
@@ -55,6 +134,7 @@ void BrotliReaderBase::Done() {
     Fail(DataLossError("Truncated Brotli-compressed stream"));
   }
   decompressor_.reset();
+  dictionary_ = BrotliDictionary();
   PullableReader::Done();
 }
 
@@ -66,8 +146,16 @@ bool BrotliReaderBase::PullSlow(size_t min_length, size_t recommended_length) {
     return available() >= min_length;
   }
   if (ABSL_PREDICT_FALSE(!healthy())) return false;
-  if (ABSL_PREDICT_FALSE(decompressor_ == nullptr)) return false;
   Reader* const src = src_reader();
+  if (ABSL_PREDICT_FALSE(decompressor_ == nullptr)) {
+    // All data have been decompressed, unless another stream follows.
+    if (!concatenated_) return false;
+    if (!src->Pull()) {
+      if (ABSL_PREDICT_FALSE(!src->healthy())) return Fail(*src);
+      return false;
+    }
+    if (ABSL_PREDICT_FALSE(!CreateDecompressor())) return false;
+  }
   truncated_ = false;
   size_t available_out = 0;
   for (;;) {
@@ -85,7 +173,13 @@ bool BrotliReaderBase::PullSlow(size_t min_length, size_t recommended_length) {
                              BrotliDecoderGetErrorCode(decompressor_.get())))));
       case BROTLI_DECODER_RESULT_SUCCESS:
         decompressor_.reset();
-        return false;
+        if (!concatenated_) return false;
+        if (!src->Pull()) {
+          if (ABSL_PREDICT_FALSE(!src->healthy())) return Fail(*src);
+          return false;
+        }
+        if (ABSL_PREDICT_FALSE(!CreateDecompressor())) return false;
+        continue;
       case BROTLI_DECODER_RESULT_NEEDS_MORE_INPUT:
       case BROTLI_DECODER_RESULT_NEEDS_MORE_OUTPUT: {
         // Take the output first even if `BrotliDecoderDecompressStream()`
@@ -22,10 +22,14 @@
 #include <utility>
 
 #include "absl/base/optimization.h"
+#include "absl/strings/string_view.h"
+#include "absl/types/span.h"
 #include "brotli/decode.h"
 #include "riegeli/base/dependency.h"
 #include "riegeli/base/object.h"
 #include "riegeli/base/resetter.h"
+#include "riegeli/base/status.h"
+#include "riegeli/bytes/brotli_dictionary.h"
 #include "riegeli/bytes/pullable_reader.h"
 #include "riegeli/bytes/reader.h"
 
@@ -34,12 +38,64 @@ namespace riegeli {
 // Template parameter independent part of `BrotliReader`.
 class BrotliReaderBase : public PullableReader {
  public:
-  class Options {};
+  class Options {
+   public:
+    Options() noexcept {}
+
+    // Brotli dictionary. This must be the same dictionary which was used for
+    // compression.
+    //
+    // Default: `BrotliDictionary()` (no dictionary)
+    Options& set_dictionary(BrotliDictionary dictionary) & {
+      dictionary_ = std::move(dictionary);
+      return *this;
+    }
+    Options&& set_dictionary(BrotliDictionary dictionary) && {
+      return std::move(set_dictionary(std::move(dictionary)));
+    }
+
+    // If `true`, a concatenation of Brotli streams is read as the
+    // concatenation of their decompressed data, e.g. data written by
+    // `BrotliWriter` with `BrotliWriterBase::Options::set_num_workers()`
+    // positive.
+    //
+    // If `false`, reading ends at the end of the first Brotli stream, and the
+    // compressed `Reader` is left positioned after it.
+    //
+    // Default: `false`
+    Options& set_concatenated(bool concatenated) & {
+      concatenated_ = concatenated;
+      return *this;
+    }
+    Options&& set_concatenated(bool concatenated) && {
+      return std::move(set_concatenated(concatenated));
+    }
+
+   private:
+    template <typename Src>
+    friend class BrotliReader;
+
+    BrotliDictionary dictionary_;
+    bool concatenated_ = false;
+  };
 
   // Returns the compressed `Reader`. Unchanged by `Close()`.
   virtual Reader* src_reader() = 0;
   virtual const Reader* src_reader() const = 0;
 
+  // Decompresses a whole concatenation of Brotli streams `src` at once into
+  // `dest`, whose size must be the uncompressed size. This avoids the overhead
+  // of streaming and of copying from the internal buffer of the decoder when
+  // the compressed data are flat and the uncompressed size is known.
+  //
+  // `dictionary` must be the same dictionary which was used for compression.
+  //
+  // Returns status:
+  //  * `status.ok()`  - success
+  //  * `!status.ok()` - failure
+  static Status DecompressFlat(absl::string_view src, absl::Span<char> dest,
+                               const BrotliDictionary& dictionary);
+
  protected:
   explicit BrotliReaderBase(InitiallyClosed) noexcept
       : PullableReader(kInitiallyClosed) {}
@@ -51,7 +107,8 @@ class BrotliReaderBase : public PullableReader {
 
   void Reset(InitiallyClosed);
   void Reset(InitiallyOpen);
-  void Initialize(Reader* src);
+  void Initialize(Reader* src, BrotliDictionary&& dictionary,
+                  bool concatenated);
 
   void Done() override;
   bool PullSlow(size_t min_length, size_t recommended_length) override;
@@ -63,6 +120,11 @@ class BrotliReaderBase : public PullableReader {
     }
   };
 
+  bool CreateDecompressor();
+
+  // Referenced by `decompressor_` if a dictionary is used.
+  BrotliDictionary dictionary_;
+  bool concatenated_ = false;
   // If `true`, the source is truncated (without a clean end of the compressed
   // stream) at the current position. If the source does not grow, `Close()`
   // will fail.
@@ -135,39 +197,50 @@ class BrotliReader : public BrotliReaderBase {
 
 inline BrotliReaderBase::BrotliReaderBase(BrotliReaderBase&& that) noexcept
     : PullableReader(std::move(that)),
+      dictionary_(std::move(that.dictionary_)),
+      concatenated_(that.concatenated_),
       truncated_(that.truncated_),
       decompressor_(std::move(that.decompressor_)) {}
 
 inline BrotliReaderBase& BrotliReaderBase::operator=(
     BrotliReaderBase&& that) noexcept {
   PullableReader::operator=(std::move(that));
+  concatenated_ = that.concatenated_;
   truncated_ = that.truncated_;
+  // Destroy `decompressor_` before `dictionary_` which it refers to.
   decompressor_ = std::move(that.decompressor_);
+  dictionary_ = std::move(that.dictionary_);
   return *this;
 }
 
 inline void BrotliReaderBase::Reset(InitiallyClosed) {
   PullableReader::Reset(kInitiallyClosed);
+  concatenated_ = false;
   truncated_ = false;
   decompressor_.reset();
+  dictionary_ = BrotliDictionary();
 }
 
 inline void BrotliReaderBase::Reset(InitiallyOpen) {
   PullableReader::Reset(kInitiallyOpen);
+  concatenated_ = false;
   truncated_ = false;
   decompressor_.reset();
+  dictionary_ = BrotliDictionary();
 }
 
 template <typename Src>
 inline BrotliReader<Src>::BrotliReader(const Src& src, Options options)
     : BrotliReaderBase(kInitiallyOpen), src_(src) {
-  Initialize(src_.get());
+  Initialize(src_.get(), std::move(options.dictionary_),
+             options.concatenated_);
 }
 
 template <typename Src>
 inline BrotliReader<Src>::BrotliReader(Src&& src, Options options)
     : BrotliReaderBase(kInitiallyOpen), src_(std::move(src)) {
-  Initialize(src_.get());
+  Initialize(src_.get(), std::move(options.dictionary_),
+             options.concatenated_);
 }
 
 template <typename Src>
@@ -175,7 +248,8 @@ template <typename... SrcArgs>
 inline BrotliReader<Src>::BrotliReader(std::tuple<SrcArgs...> src_args,
                                        Options options)
     : BrotliReaderBase(kInitiallyOpen), src_(std::move(src_args)) {
-  Initialize(src_.get());
+  Initialize(src_.get(), std::move(options.dictionary_),
+             options.concatenated_);
 }
 
 template <typename Src>
@@ -200,14 +274,16 @@ template <typename Src>
 inline void BrotliReader<Src>::Reset(const Src& src, Options options) {
   BrotliReaderBase::Reset(kInitiallyOpen);
   src_.Reset(src);
-  Initialize(src_.get());
+  Initialize(src_.get(), std::move(options.dictionary_),
+             options.concatenated_);
 }
 
 template <typename Src>
 inline void BrotliReader<Src>::Reset(Src&& src, Options options) {
   BrotliReaderBase::Reset(kInitiallyOpen);
   src_.Reset(std::move(src));
-  Initialize(src_.get());
+  Initialize(src_.get(), std::move(options.dictionary_),
+             options.concatenated_);
 }
 
 template <typename Src>
@@ -216,7 +292,8 @@ inline void BrotliReader<Src>::Reset(std::tuple<SrcArgs...> src_args,
                                      Options options) {
   BrotliReaderBase::Reset(kInitiallyOpen);
   src_.Reset(std::move(src_args));
-  Initialize(src_.get());
+  Initialize(src_.get(), std::move(options.dictionary_),
+             options.concatenated_);
 }
 
 template <typename Src>
@@ -17,15 +17,20 @@
 #include <stddef.h>
 #include <stdint.h>
 
+#include <future>
 #include <limits>
 #include <memory>
+#include <string>
+#include <utility>
 
 #include "absl/base/optimization.h"
 #include "absl/strings/string_view.h"
 #include "brotli/encode.h"
 #include "riegeli/base/base.h"
 #include "riegeli/base/canonical_errors.h"
+#include "riegeli/base/parallelism.h"
 #include "riegeli/base/status.h"
+#include "riegeli/bytes/brotli_dictionary.h"
 #include "riegeli/bytes/buffered_writer.h"
 #include "riegeli/bytes/writer.h"
 
@@ -43,45 +48,122 @@ constexpr int BrotliWriterBase::Options::kMaxWindowLog;
 constexpr int BrotliWriterBase::Options::kDefaultWindowLog;
 #endif
 
-void BrotliWriterBase::Initialize(Writer* dest, int compression_level,
-                                  int window_log, Position size_hint) {
-  RIEGELI_ASSERT(dest != nullptr)
-      << "Failed precondition of BrotliWriter: null Writer pointer";
-  if (ABSL_PREDICT_FALSE(!dest->healthy())) {
-    Fail(*dest);
-    return;
-  }
-  compressor_.reset(BrotliEncoderCreateInstance(nullptr, nullptr, nullptr));
-  if (ABSL_PREDICT_FALSE(compressor_ == nullptr)) {
-    Fail(InternalError("BrotliEncoderCreateInstance() failed"));
-    return;
+namespace {
+
+struct BrotliEncoderStateDeleter {
+  void operator()(BrotliEncoderState* ptr) const {
+    BrotliEncoderDestroyInstance(ptr);
   }
+};
+
+Status SetParameters(BrotliEncoderState* compressor, int compression_level,
+                     int window_log,
+                     const BrotliEncoderPreparedDictionary* dictionary,
+                     Position size_hint) {
   if (ABSL_PREDICT_FALSE(
-          !BrotliEncoderSetParameter(compressor_.get(), BROTLI_PARAM_QUALITY,
+          !BrotliEncoderSetParameter(compressor, BROTLI_PARAM_QUALITY,
                                      IntCast<uint32_t>(compression_level)))) {
-    Fail(InternalError(
-        "BrotliEncoderSetParameter(BROTLI_PARAM_QUALITY) failed"));
-    return;
+    return InternalError(
+        "BrotliEncoderSetParameter(BROTLI_PARAM_QUALITY) failed");
   }
   if (ABSL_PREDICT_FALSE(!BrotliEncoderSetParameter(
-          compressor_.get(), BROTLI_PARAM_LARGE_WINDOW,
+          compressor, BROTLI_PARAM_LARGE_WINDOW,
           uint32_t{window_log > BROTLI_MAX_WINDOW_BITS}))) {
-    Fail(InternalError(
-        "BrotliEncoderSetParameter(BROTLI_PARAM_LARGE_WINDOW) failed"));
-    return;
+    return InternalError(
+        "BrotliEncoderSetParameter(BROTLI_PARAM_LARGE_WINDOW) failed");
   }
   if (ABSL_PREDICT_FALSE(
-          !BrotliEncoderSetParameter(compressor_.get(), BROTLI_PARAM_LGWIN,
+          !BrotliEncoderSetParameter(compressor, BROTLI_PARAM_LGWIN,
                                      IntCast<uint32_t>(window_log)))) {
-    Fail(InternalError("BrotliEncoderSetParameter(BROTLI_PARAM_LGWIN) failed"));
-    return;
+    return InternalError(
+        "BrotliEncoderSetParameter(BROTLI_PARAM_LGWIN) failed");
+  }
+  if (dictionary != nullptr) {
+    if (ABSL_PREDICT_FALSE(
+            !BrotliEncoderAttachPreparedDictionary(compressor, dictionary))) {
+      return InternalError("BrotliEncoderAttachPreparedDictionary() failed");
+    }
   }
   if (size_hint > 0) {
     // Ignore errors from tuning.
     BrotliEncoderSetParameter(
-        compressor_.get(), BROTLI_PARAM_SIZE_HINT,
+        compressor, BROTLI_PARAM_SIZE_HINT,
         UnsignedMin(size_hint, std::numeric_limits<uint32_t>::max()));
   }
+  return OkStatus();
+}
+
+// Compresses `src` as a complete Brotli stream, appending it to `*dest`.
+Status CompressJob(int compression_level, int window_log,
+                   const BrotliEncoderPreparedDictionary* dictionary,
+                   absl::string_view src, std::string* dest) {
+  const std::unique_ptr<BrotliEncoderState, BrotliEncoderStateDeleter>
+      compressor(BrotliEncoderCreateInstance(nullptr, nullptr, nullptr));
+  if (ABSL_PREDICT_FALSE(compressor == nullptr)) {
+    return InternalError("BrotliEncoderCreateInstance() failed");
+  }
+  {
+    const Status status = SetParameters(compressor.get(), compression_level,
+                                        window_log, dictionary, src.size());
+    if (ABSL_PREDICT_FALSE(!status.ok())) return status;
+  }
+  size_t available_in = src.size();
+  const uint8_t* next_in = reinterpret_cast<const uint8_t*>(src.data());
+  size_t available_out = 0;
+  for (;;) {
+    if (ABSL_PREDICT_FALSE(!BrotliEncoderCompressStream(
+            compressor.get(), BROTLI_OPERATION_FINISH, &available_in,
+            &next_in, &available_out, nullptr, nullptr))) {
+      return InternalError("BrotliEncoderCompressStream() failed");
+    }
+    size_t length = 0;
+    const char* const data = reinterpret_cast<const char*>(
+        BrotliEncoderTakeOutput(compressor.get(), &length));
+    if (length > 0) {
+      dest->append(data, length);
+    } else if (BrotliEncoderIsFinished(compressor.get())) {
+      return OkStatus();
+    }
+  }
+}
+
+}  // namespace
+
+void BrotliWriterBase::Initialize(Writer* dest, const Options& options) {
+  RIEGELI_ASSERT(dest != nullptr)
+      << "Failed precondition of BrotliWriter: null Writer pointer";
+  if (ABSL_PREDICT_FALSE(!dest->healthy())) {
+    Fail(*dest);
+    return;
+  }
+  if (!options.dictionary_.empty()) {
+    dictionary_ = options.dictionary_;
+    prepared_dictionary_ =
+        dictionary_.PrepareCompressionDictionary(options.compression_level_);
+    if (ABSL_PREDICT_FALSE(prepared_dictionary_ == nullptr)) {
+      Fail(InternalError("BrotliEncoderPrepareDictionary() failed"));
+      return;
+    }
+  }
+  if (options.num_workers_ > 0) {
+    compression_level_ = options.compression_level_;
+    window_log_ = options.window_log_;
+    num_workers_ = options.num_workers_;
+    job_size_ = options.job_size_ > 0
+                    ? options.job_size_
+                    : UnsignedMax(size_t{1} << options.window_log_,
+                                  size_t{1} << 20);
+    return;
+  }
+  compressor_.reset(BrotliEncoderCreateInstance(nullptr, nullptr, nullptr));
+  if (ABSL_PREDICT_FALSE(compressor_ == nullptr)) {
+    Fail(InternalError("BrotliEncoderCreateInstance() failed"));
+    return;
+  }
+  const Status status = SetParameters(
+      compressor_.get(), options.compression_level_, options.window_log_,
+      prepared_dictionary_.get(), options.size_hint_);
+  if (ABSL_PREDICT_FALSE(!status.ok())) Fail(status);
 }
 
 void BrotliWriterBase::Done() {
@@ -93,6 +175,10 @@ void BrotliWriterBase::Done() {
                   BROTLI_OPERATION_FINISH);
   }
   compressor_.reset();
+  job_ = std::string();
+  jobs_.clear();
+  prepared_dictionary_.reset();
+  dictionary_ = BrotliDictionary();
   BufferedWriter::Done();
 }
 
@@ -121,6 +207,7 @@ inline bool BrotliWriterBase::WriteInternal(absl::string_view src, Writer* dest,
                          std::numeric_limits<Position>::max() - limit_pos())) {
     return FailOverflow();
   }
+  if (num_workers_ > 0) return WriteParallel(src, dest, op);
   size_t available_in = src.size();
   const uint8_t* next_in = reinterpret_cast<const uint8_t*>(src.data());
   size_t available_out = 0;
@@ -144,6 +231,70 @@ inline bool BrotliWriterBase::WriteInternal(absl::string_view src, Writer* dest,
   }
 }
 
+bool BrotliWriterBase::WriteParallel(absl::string_view src, Writer* dest,
+                                     BrotliEncoderOperation op) {
+  while (!src.empty()) {
+    const size_t length = UnsignedMin(src.size(), job_size_ - job_.size());
+    job_.append(src.data(), length);
+    src.remove_prefix(length);
+    start_pos_ += length;
+    if (job_.size() == job_size_) {
+      if (ABSL_PREDICT_FALSE(!StartJob(dest))) return false;
+    }
+  }
+  if (op == BROTLI_OPERATION_PROCESS) return true;
+  // Even empty data need a job, so that the result is a valid Brotli stream.
+  if (!job_.empty() || (op == BROTLI_OPERATION_FINISH && start_pos_ == 0)) {
+    if (ABSL_PREDICT_FALSE(!StartJob(dest))) return false;
+  }
+  while (!jobs_.empty()) {
+    if (ABSL_PREDICT_FALSE(!WriteJob(dest))) return false;
+  }
+  return true;
+}
+
+bool BrotliWriterBase::StartJob(Writer* dest) {
+  std::promise<CompressedJob>* const compressed_job =
+      new std::promise<CompressedJob>();
+  jobs_.push_back(compressed_job->get_future());
+  std::string* const job = new std::string(std::move(job_));
+  job_ = std::string();
+  const int compression_level = compression_level_;
+  const int window_log = window_log_;
+  // The job keeps the dictionary alive, because `*this` can be closed while
+  // the job is pending.
+  const BrotliDictionary dictionary = dictionary_;
+  const std::shared_ptr<const BrotliEncoderPreparedDictionary>
+      prepared_dictionary = prepared_dictionary_;
+  ThreadPool::global().Schedule(
+      [compressed_job, job, compression_level, window_log, dictionary,
+       prepared_dictionary] {
+        CompressedJob result;
+        result.status = CompressJob(compression_level, window_log,
+                                    prepared_dictionary.get(), *job,
+                                    &result.data);
+        delete job;
+        compressed_job->set_value(std::move(result));
+        delete compressed_job;
+      });
+  while (jobs_.size() > IntCast<size_t>(num_workers_)) {
+    if (ABSL_PREDICT_FALSE(!WriteJob(dest))) return false;
+  }
+  return true;
+}
+
+bool BrotliWriterBase::WriteJob(Writer* dest) {
+  CompressedJob compressed_job = jobs_.front().get();
+  jobs_.pop_front();
+  if (ABSL_PREDICT_FALSE(!compressed_job.status.ok())) {
+    return Fail(compressed_job.status);
+  }
+  if (ABSL_PREDICT_FALSE(!dest->Write(std::move(compressed_job.data)))) {
+    return Fail(*dest);
+  }
+  return true;
+}
+
 bool BrotliWriterBase::Flush(FlushType flush_type) {
   if (ABSL_PREDICT_FALSE(!healthy())) return false;
   Writer* const dest = dest_writer();
@@ -17,7 +17,10 @@
 
 #include <stddef.h>
 
+#include <deque>
+#include <future>
 #include <memory>
+#include <string>
 #include <tuple>
 #include <utility>
 
@@ -27,6 +30,8 @@
 #include "riegeli/base/base.h"
 #include "riegeli/base/dependency.h"
 #include "riegeli/base/resetter.h"
+#include "riegeli/base/status.h"
+#include "riegeli/bytes/brotli_dictionary.h"
 #include "riegeli/bytes/buffered_writer.h"
 #include "riegeli/bytes/writer.h"
 
@@ -100,6 +105,55 @@ class BrotliWriterBase : public BufferedWriter {
       return std::move(set_size_hint(size_hint));
     }
 
+    // Brotli dictionary. The same dictionary must be used for decompression.
+    //
+    // Default: `BrotliDictionary()` (no dictionary)
+    Options& set_dictionary(BrotliDictionary dictionary) & {
+      dictionary_ = std::move(dictionary);
+      return *this;
+    }
+    Options&& set_dictionary(BrotliDictionary dictionary) && {
+      return std::move(set_dictionary(std::move(dictionary)));
+    }
+
+    // If 0, data are compressed in the calling thread as a single Brotli
+    // stream.
+    //
+    // If positive, data are split into jobs of `job_size()` bytes, which are
+    // compressed concurrently by up to `num_workers` background threads as
+    // independent Brotli streams, and written one after another. Each job is
+    // compressed without referring to data of previous jobs, which loses some
+    // compression density. `Flush()` ends the current job early.
+    //
+    // The result is a concatenation of Brotli streams. It must be read with
+    // `BrotliReaderBase::Options::set_concatenated(true)`; other Brotli
+    // decoders read only its first job.
+    //
+    // Default: 0
+    Options& set_num_workers(int num_workers) & {
+      RIEGELI_ASSERT_GE(num_workers, 0)
+          << "Failed precondition of "
+             "BrotliWriterBase::Options::set_num_workers(): "
+             "negative number of workers";
+      num_workers_ = num_workers;
+      return *this;
+    }
+    Options&& set_num_workers(int num_workers) && {
+      return std::move(set_num_workers(num_workers));
+    }
+
+    // Uncompressed size of a job if `num_workers()` is positive. 0 means the
+    // window size (see `set_window_log()`), but at least 1M.
+    //
+    // Default: 0
+    Options& set_job_size(size_t job_size) & {
+      job_size_ = job_size;
+      return *this;
+    }
+    Options&& set_job_size(size_t job_size) && {
+      return std::move(set_job_size(job_size));
+    }
+
     // Tunes how much data is buffered before calling the compression engine.
     //
     // Default: 64K
@@ -116,12 +170,16 @@ class BrotliWriterBase : public BufferedWriter {
     }
 
    private:
+    friend class BrotliWriterBase;
     template <typename Dest>
     friend class BrotliWriter;
 
     int compression_level_ = kDefaultCompressionLevel;
     int window_log_ = kDefaultWindowLog;
+    BrotliDictionary dictionary_;
     Position size_hint_ = 0;
+    int num_workers_ = 0;
+    size_t job_size_ = 0;
     size_t buffer_size_ = kDefaultBufferSize;
   };
 
@@ -141,8 +199,7 @@ class BrotliWriterBase : public BufferedWriter {
 
   void Reset();
   void Reset(size_t buffer_size, Position size_hint);
-  void Initialize(Writer* dest, int compression_level, int window_log,
-                  Position size_hint);
+  void Initialize(Writer* dest, const Options& options);
 
   void Done() override;
   bool WriteInternal(absl::string_view src) override;
@@ -154,10 +211,38 @@ class BrotliWriterBase : public BufferedWriter {
     }
   };
 
+  // The result of compressing a job if `num_workers_ > 0`.
+  struct CompressedJob {
+    std::string data;
+    Status status;
+  };
+
   bool WriteInternal(absl::string_view src, Writer* dest,
                      BrotliEncoderOperation op);
-
+  bool WriteParallel(absl::string_view src, Writer* dest,
+                     BrotliEncoderOperation op);
+  // Schedules compressing `job_`, and writes finished jobs while too many are
+  // pending.
+  bool StartJob(Writer* dest);
+  // Waits for the oldest pending job and writes it.
+  bool WriteJob(Writer* dest);
+
+  // Kept alive while `compressor_` or pending jobs refer to it.
+  BrotliDictionary dictionary_;
+  // Referenced by `compressor_` and pending jobs if a dictionary is used. Kept
+  // alive until they are no longer used.
+  std::shared_ptr<const BrotliEncoderPreparedDictionary> prepared_dictionary_;
   std::unique_ptr<BrotliEncoderState, BrotliEncoderStateDeleter> compressor_;
+
+  // Parameters used if `num_workers_ > 0`.
+  int compression_level_ = 0;
+  int window_log_ = 0;
+  int num_workers_ = 0;
+  size_t job_size_ = 0;
+  // Uncompressed data of the job being collected.
+  std::string job_;
+  // Jobs being compressed, in the order of writing.
+  std::deque<std::future<CompressedJob>> jobs_;
 };
 
 // A `Writer` which compresses data with Brotli before passing it to another
@@ -222,38 +307,63 @@ inline BrotliWriterBase::BrotliWriterBase(size_t buffer_size,
 
 inline BrotliWriterBase::BrotliWriterBase(BrotliWriterBase&& that) noexcept
     : BufferedWriter(std::move(that)),
-      compressor_(std::move(that.compressor_)) {}
+      dictionary_(std::move(that.dictionary_)),
+      prepared_dictionary_(std::move(that.prepared_dictionary_)),
+      compressor_(std::move(that.compressor_)),
+      compression_level_(that.compression_level_),
+      window_log_(that.window_log_),
+      num_workers_(that.num_workers_),
+      job_size_(that.job_size_),
+      job_(std::move(that.job_)),
+      jobs_(std::move(that.jobs_)) {}
 
 inline BrotliWriterBase& BrotliWriterBase::operator=(
     BrotliWriterBase&& that) noexcept {
   BufferedWriter::operator=(std::move(that));
+  // Destroy `compressor_` before `prepared_dictionary_` which it refers to.
   compressor_ = std::move(that.compressor_);
+  dictionary_ = std::move(that.dictionary_);
+  prepared_dictionary_ = std::move(that.prepared_dictionary_);
+  compression_level_ = that.compression_level_;
+  window_log_ = that.window_log_;
+  num_workers_ = that.num_workers_;
+  job_size_ = that.job_size_;
+  job_ = std::move(that.job_);
+  jobs_ = std::move(that.jobs_);
   return *this;
 }
 
 inline void BrotliWriterBase::Reset() {
   BufferedWriter::Reset();
   compressor_.reset();
+  prepared_dictionary_.reset();
+  dictionary_ = BrotliDictionary();
+  num_workers_ = 0;
+  job_ = std::string();
+  jobs_.clear();
 }
 
 inline void BrotliWriterBase::Reset(size_t buffer_size, Position size_hint) {
   BufferedWriter::Reset(buffer_size, size_hint);
   compressor_.reset();
+  prepared_dictionary_.reset();
+  dictionary_ = BrotliDictionary();
+  num_workers_ = 0;
+  job_ = std::string();
+  jobs_.clear();
 }
 
 template <typename Dest>
 inline BrotliWriter<Dest>::BrotliWriter(const Dest& dest, Options options)
     : BrotliWriterBase(options.buffer_size_, options.size_hint_), dest_(dest) {
-  Initialize(dest_.get(), options.compression_level_, options.window_log_,
-             options.size_hint_);
+  Initialize(dest_.get(), options);
 }
 
 template <typename Dest>
 inline BrotliWriter<Dest>::BrotliWriter(Dest&& dest, Options options)
     : BrotliWriterBase(options.buffer_size_, options.size_hint_),
       dest_(std::move(dest)) {
-  Initialize(dest_.get(), options.compression_level_, options.window_log_,
-             options.size_hint_);
+  Initialize(dest_.get(), options);
 }
 
 template <typename Dest>
@@ -262,8 +372,7 @@ inline BrotliWriter<Dest>::BrotliWriter(std::tuple<DestArgs...> dest_args,
                                         Options options)
     : BrotliWriterBase(options.buffer_size_, options.size_hint_),
       dest_(std::move(dest_args)) {
-  Initialize(dest_.get(), options.compression_level_, options.window_log_,
-             options.size_hint_);
+  Initialize(dest_.get(), options);
 }
 
 template <typename Dest>
@@ -282,16 +391,14 @@ template <typename Dest>
 inline void BrotliWriter<Dest>::Reset(const Dest& dest, Options options) {
   BrotliWriterBase::Reset(options.buffer_size_, options.size_hint_);
   dest_.Reset(dest);
-  Initialize(dest_.get(), options.compression_level_, options.window_log_,
-             options.size_hint_);
+  Initialize(dest_.get(), options);
 }
 
 template <typename Dest>
 inline void BrotliWriter<Dest>::Reset(Dest&& dest, Options options) {
   BrotliWriterBase::Reset(options.buffer_size_, options.size_hint_);
   dest_.Reset(std::move(dest));
-  Initialize(dest_.get(), options.compression_level_, options.window_log_,
-             options.size_hint_);
+  Initialize(dest_.get(), options);
 }
 
 template <typename Dest>
@@ -300,8 +407,7 @@ inline void BrotliWriter<Dest>::Reset(std::tuple<DestArgs...> dest_args,
                                       Options options) {
   BrotliWriterBase::Reset(options.buffer_size_, options.size_hint_);
   dest_.Reset(std::move(dest_args));
-  Initialize(dest_.get(), options.compression_level_, options.window_log_,
-             options.size_hint_);
+  Initialize(dest_.get(), options);
 }
 
 template <typename Dest>
@@ -49,6 +49,16 @@ inline size_t BufferedReader::LengthToReadDirectly() const {
   return SaturatingAdd(available(), BufferLength());
 }
 
+inline void BufferedReader::AdaptBufferSize() {
+  if (max_buffer_size_ <= initial_buffer_size_) return;
+  if (limit_pos_ == sequential_pos_) {
+    buffer_size_ = UnsignedMin(SaturatingAdd(buffer_size_, buffer_size_),
+                               max_buffer_size_);
+  } else {
+    buffer_size_ = initial_buffer_size_;
+  }
+}
+
 void BufferedReader::VerifyEnd() {
   // No more data are expected, so allocate a minimal non-empty buffer for
   // verifying that.
@@ -67,6 +77,7 @@ bool BufferedReader::PullSlow(size_t min_length, size_t recommended_length) {
     const size_t available_length = available();
     buffer_.RemoveSuffix(flat_buffer.size());
     buffer_.RemovePrefix(buffer_.size() - available_length);
+    AdaptBufferSize();
     flat_buffer = buffer_.AppendBuffer(BufferLength(min_length));
     start_ = buffer_.data();
     cursor_ = start_;
@@ -94,6 +105,7 @@ bool BufferedReader::PullSlow(size_t min_length, size_t recommended_length) {
       << "BufferedReader::ReadInternal() read more than requested";
   buffer_.RemoveSuffix(flat_buffer.size() - IntCast<size_t>(length_read));
   limit_ += length_read;
+  sequential_pos_ = limit_pos_;
   return ok;
 }
 
@@ -112,7 +124,9 @@ bool BufferedReader::ReadSlow(char* dest, size_t length) {
     }
     ClearBuffer();
     if (ABSL_PREDICT_FALSE(!healthy())) return false;
-    return ReadInternal(dest, length, length);
+    const bool ok = ReadInternal(dest, length, length);
+    sequential_pos_ = limit_pos_;
+    return ok;
   }
   return Reader::ReadSlow(dest, length);
 }
@@ -145,8 +159,10 @@ bool BufferedReader::ReadSlow(Chain* dest, size_t length) {
         RIEGELI_ASSERT_LE(length_read, flat_buffer.size())
             << "BufferedReader::ReadInternal() read more than requested";
         dest->RemoveSuffix(flat_buffer.size() - IntCast<size_t>(length_read));
+        sequential_pos_ = limit_pos_;
         return false;
       }
+      sequential_pos_ = limit_pos_;
       return true;
     }
     absl::Span<char> flat_buffer = buffer_.AppendBuffer(0);
@@ -157,6 +173,7 @@ bool BufferedReader::ReadSlow(Chain* dest, size_t length) {
                              dest);
       length -= available_length;
       buffer_.Clear();
+      AdaptBufferSize();
       flat_buffer = buffer_.AppendBuffer(BufferLength());
       start_ = flat_buffer.data();
       cursor_ = start_;
@@ -183,6 +200,7 @@ bool BufferedReader::ReadSlow(Chain* dest, size_t length) {
         << "BufferedReader::ReadInternal() read more than requested";
     buffer_.RemoveSuffix(flat_buffer.size() - IntCast<size_t>(length_read));
     limit_ += length_read;
+    sequential_pos_ = limit_pos_;
   }
   buffer_.AppendSubstrTo(absl::string_view(cursor_, length), dest);
   cursor_ += length;
@@ -223,6 +241,7 @@ bool BufferedReader::CopyToSlow(Writer* dest, Position length) {
         length -= available_length;
       }
       buffer_.Clear();
+      AdaptBufferSize();
       flat_buffer = buffer_.AppendBuffer(BufferLength());
       start_ = flat_buffer.data();
       cursor_ = start_;
@@ -249,6 +268,7 @@ bool BufferedReader::CopyToSlow(Writer* dest, Position length) {
         << "BufferedReader::ReadInternal() read more than requested";
     buffer_.RemoveSuffix(flat_buffer.size() - IntCast<size_t>(length_read));
     limit_ += length_read;
+    sequential_pos_ = limit_pos_;
   }
   bool write_ok = true;
   if (length > 0) {
@@ -17,6 +17,7 @@
 
 #include <stddef.h>
 
+#include <limits>
 #include <utility>
 
 #include "riegeli/base/base.h"
@@ -89,7 +90,25 @@ class BufferedReader : public Reader {
   // Changes the size hint after construction.
   void set_size_hint(Position size_hint) { size_hint_ = size_hint; }
 
+  // Changes the buffer size after construction. If the buffer size adapts to
+  // the access pattern, this is the size it starts from.
+  void set_buffer_size(size_t buffer_size);
+
+  // Makes the buffer size adapt to the access pattern: while reading is
+  // sequential, the buffer size doubles whenever a new buffer is allocated, up
+  // to `max_buffer_size`, and after a seek it returns to the size set by the
+  // constructor or by `set_buffer_size()`.
+  //
+  // If `max_buffer_size` is not larger than that size, the buffer size stays
+  // fixed.
+  void set_max_buffer_size(size_t max_buffer_size) {
+    max_buffer_size_ = max_buffer_size;
+  }
+
  private:
+  static constexpr Position kNoSequentialPos =
+      std::numeric_limits<Position>::max();
+
   // Preferred size of the buffer to use.
   size_t BufferLength(size_t min_length = 0) const;
 
@@ -98,8 +117,20 @@ class BufferedReader : public Reader {
   // through `buffer_`.
   size_t LengthToReadDirectly() const;
 
+  // Updates `buffer_size_` before allocating a new buffer, if it adapts to the
+  // access pattern.
+  void AdaptBufferSize();
+
   // Invariant: if `healthy()` then `buffer_size_ > 0`
   size_t buffer_size_ = 0;
+  // The buffer size set by the constructor or by `set_buffer_size()`.
+  size_t initial_buffer_size_ = 0;
+  // If larger than `initial_buffer_size_`, `buffer_size_` adapts to the access
+  // pattern between these bounds.
+  size_t max_buffer_size_ = 0;
+  // `limit_pos_` after the last read, or `kNoSequentialPos` if nothing was read
+  // yet. Reading is sequential if the next read starts there.
+  Position sequential_pos_ = kNoSequentialPos;
   Position size_hint_ = 0;
   // Buffered data, read directly before the physical source position which is
   // `limit_pos_`.
@@ -114,7 +145,10 @@ class BufferedReader : public Reader {
 
 inline BufferedReader::BufferedReader(size_t buffer_size,
                                       Position size_hint) noexcept
-    : Reader(kInitiallyOpen), buffer_size_(buffer_size), size_hint_(size_hint) {
+    : Reader(kInitiallyOpen),
+      buffer_size_(buffer_size),
+      initial_buffer_size_(buffer_size),
+      size_hint_(size_hint) {
   RIEGELI_ASSERT_GT(buffer_size, 0u)
       << "Failed precondition of BufferedReader::BufferedReader(size_t): "
          "zero buffer size";
@@ -123,6 +157,9 @@ inline BufferedReader::BufferedReader(size_t buffer_size,
 inline BufferedReader::BufferedReader(BufferedReader&& that) noexcept
     : Reader(std::move(that)),
       buffer_size_(that.buffer_size_),
+      initial_buffer_size_(that.initial_buffer_size_),
+      max_buffer_size_(that.max_buffer_size_),
+      sequential_pos_(that.sequential_pos_),
       size_hint_(that.size_hint_),
       buffer_(std::move(that.buffer_)) {}
 
@@ -130,6 +167,9 @@ inline BufferedReader& BufferedReader::operator=(
     BufferedReader&& that) noexcept {
   Reader::operator=(std::move(that));
   buffer_size_ = that.buffer_size_;
+  initial_buffer_size_ = that.initial_buffer_size_;
+  max_buffer_size_ = that.max_buffer_size_;
+  sequential_pos_ = that.sequential_pos_;
   size_hint_ = that.size_hint_;
   buffer_ = std::move(that.buffer_);
   return *this;
@@ -138,6 +178,9 @@ inline BufferedReader& BufferedReader::operator=(
 inline void BufferedReader::Reset() {
   Reader::Reset(kInitiallyClosed);
   buffer_size_ = 0;
+  initial_buffer_size_ = 0;
+  max_buffer_size_ = 0;
+  sequential_pos_ = kNoSequentialPos;
   size_hint_ = 0;
   buffer_.Clear();
 }
@@ -147,10 +190,21 @@ inline void BufferedReader::Reset(size_t buffer_size, Position size_hint) {
       << "Failed precondition of BufferedReader::Reset(): zero buffer size";
   Reader::Reset(kInitiallyOpen);
   buffer_size_ = buffer_size;
+  initial_buffer_size_ = buffer_size;
+  max_buffer_size_ = 0;
+  sequential_pos_ = kNoSequentialPos;
   size_hint_ = size_hint;
   buffer_.Clear();
 }
 
+inline void BufferedReader::set_buffer_size(size_t buffer_size) {
+  RIEGELI_ASSERT_GT(buffer_size, 0u)
+      << "Failed precondition of BufferedReader::set_buffer_size(): "
+         "zero buffer size";
+  buffer_size_ = buffer_size;
+  initial_buffer_size_ = buffer_size;
+}
+
 }  // namespace riegeli
 
 #endif  // RIEGELI_BYTES_BUFFERED_READER_H_
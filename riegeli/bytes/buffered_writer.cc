@@ -58,6 +58,16 @@ inline size_t BufferedWriter::LengthToWriteDirectly() const {
   return length;
 }
 
+inline void BufferedWriter::AdaptBufferSize() {
+  if (max_buffer_size_ <= initial_buffer_size_) return;
+  if (start_pos_ == sequential_pos_) {
+    buffer_size_ = UnsignedMin(SaturatingAdd(buffer_size_, buffer_size_),
+                               max_buffer_size_);
+  } else {
+    buffer_size_ = initial_buffer_size_;
+  }
+}
+
 bool BufferedWriter::PushSlow(size_t min_length, size_t recommended_length) {
   RIEGELI_ASSERT_GT(min_length, available())
       << "Failed precondition of Writer::PushSlow(): "
@@ -67,12 +77,14 @@ bool BufferedWriter::PushSlow(size_t min_length, size_t recommended_length) {
                          std::numeric_limits<Position>::max() - start_pos_)) {
     return FailOverflow();
   }
+  AdaptBufferSize();
   buffer_.Resize(BufferLength(min_length));
   start_ = buffer_.GetData();
   cursor_ = start_;
   limit_ =
       start_ + UnsignedMin(buffer_.size(),
                            std::numeric_limits<Position>::max() - start_pos_);
+  sequential_pos_ = limit_pos();
   return true;
 }
 
@@ -90,7 +102,9 @@ bool BufferedWriter::WriteSlow(absl::string_view src) {
          "length too small, use Write(string_view) instead";
   if (src.size() >= LengthToWriteDirectly()) {
     if (ABSL_PREDICT_FALSE(!PushInternal())) return false;
-    return WriteInternal(src);
+    const bool ok = WriteInternal(src);
+    sequential_pos_ = start_pos_;
+    return ok;
   }
   return Writer::WriteSlow(src);
 }
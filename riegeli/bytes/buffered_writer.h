@@ -17,6 +17,7 @@
 
 #include <stddef.h>
 
+#include <limits>
 #include <utility>
 
 #include "absl/strings/string_view.h"
@@ -77,7 +78,25 @@ class BufferedWriter : public Writer {
   //   `written_to_buffer() == 0`
   virtual bool WriteInternal(absl::string_view src) = 0;
 
+  // Changes the buffer size after construction. If the buffer size adapts to
+  // the access pattern, this is the size it starts from.
+  void set_buffer_size(size_t buffer_size);
+
+  // Makes the buffer size adapt to the access pattern: while writing is
+  // sequential, the buffer size doubles whenever a full buffer is written, up
+  // to `max_buffer_size`, and after a seek or a partial write it returns to the
+  // size set by the constructor or by `set_buffer_size()`.
+  //
+  // If `max_buffer_size` is not larger than that size, the buffer size stays
+  // fixed.
+  void set_max_buffer_size(size_t max_buffer_size) {
+    max_buffer_size_ = max_buffer_size;
+  }
+
  private:
+  static constexpr Position kNoSequentialPos =
+      std::numeric_limits<Position>::max();
+
   // Preferred size of the buffer to use.
   size_t BufferLength(size_t min_length) const;
 
@@ -85,8 +104,20 @@ class BufferedWriter : public Writer {
   // and write the data directly than to write the data through `buffer_`.
   size_t LengthToWriteDirectly() const;
 
+  // Updates `buffer_size_` before allocating a new buffer, if it adapts to the
+  // access pattern.
+  void AdaptBufferSize();
+
   // Invariant: if `healthy()` then `buffer_size_ > 0`
   size_t buffer_size_ = 0;
+  // The buffer size set by the constructor or by `set_buffer_size()`.
+  size_t initial_buffer_size_ = 0;
+  // If larger than `initial_buffer_size_`, `buffer_size_` adapts to the access
+  // pattern between these bounds.
+  size_t max_buffer_size_ = 0;
+  // `start_pos_` expected at the next `PushSlow()` if the buffer gets filled,
+  // or `kNoSequentialPos` if no buffer was allocated yet.
+  Position sequential_pos_ = kNoSequentialPos;
   Position size_hint_ = 0;
   // Buffered data, to be written directly after the physical destination
   // position which is `start_pos_`.
@@ -99,6 +130,7 @@ inline BufferedWriter::BufferedWriter(size_t buffer_size,
                                       Position size_hint) noexcept
     : Writer(kInitiallyOpen),
       buffer_size_(buffer_size),
+      initial_buffer_size_(buffer_size),
       size_hint_(size_hint),
       buffer_(buffer_size) {
   RIEGELI_ASSERT_GT(buffer_size, 0u)
@@ -109,6 +141,9 @@ inline BufferedWriter::BufferedWriter(size_t buffer_size,
 inline BufferedWriter::BufferedWriter(BufferedWriter&& that) noexcept
     : Writer(std::move(that)),
       buffer_size_(that.buffer_size_),
+      initial_buffer_size_(that.initial_buffer_size_),
+      max_buffer_size_(that.max_buffer_size_),
+      sequential_pos_(that.sequential_pos_),
       size_hint_(that.size_hint_),
       buffer_(std::move(that.buffer_)) {}
 
@@ -116,6 +151,9 @@ inline BufferedWriter& BufferedWriter::operator=(
     BufferedWriter&& that) noexcept {
   Writer::operator=(std::move(that));
   buffer_size_ = that.buffer_size_;
+  initial_buffer_size_ = that.initial_buffer_size_;
+  max_buffer_size_ = that.max_buffer_size_;
+  sequential_pos_ = that.sequential_pos_;
   size_hint_ = that.size_hint_;
   buffer_ = std::move(that.buffer_);
   return *this;
@@ -124,6 +162,9 @@ inline BufferedWriter& BufferedWriter::operator=(
 inline void BufferedWriter::Reset() {
   Writer::Reset(kInitiallyClosed);
   buffer_size_ = 0;
+  initial_buffer_size_ = 0;
+  max_buffer_size_ = 0;
+  sequential_pos_ = kNoSequentialPos;
   size_hint_ = 0;
 }
 
@@ -132,10 +173,21 @@ inline void BufferedWriter::Reset(size_t buffer_size, Position size_hint) {
       << "Failed precondition of BufferedWriter::Reset(): zero buffer size";
   Writer::Reset(kInitiallyOpen);
   buffer_size_ = buffer_size;
+  initial_buffer_size_ = buffer_size;
+  max_buffer_size_ = 0;
+  sequential_pos_ = kNoSequentialPos;
   size_hint_ = size_hint;
   buffer_.Resize(buffer_size);
 }
 
+inline void BufferedWriter::set_buffer_size(size_t buffer_size) {
+  RIEGELI_ASSERT_GT(buffer_size, 0u)
+      << "Failed precondition of BufferedWriter::set_buffer_size(): "
+         "zero buffer size";
+  buffer_size_ = buffer_size;
+  initial_buffer_size_ = buffer_size;
+}
+
 }  // namespace riegeli
 
 #endif  // RIEGELI_BYTES_BUFFERED_WRITER_H_
@@ -0,0 +1,211 @@
+// Copyright 2019 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "riegeli/bytes/chain_pipe.h"
+
+#include <stddef.h>
+
+#include <limits>
+#include <utility>
+
+#include "absl/base/optimization.h"
+#include "absl/strings/string_view.h"
+#include "absl/synchronization/mutex.h"
+#include "absl/types/span.h"
+#include "riegeli/base/base.h"
+#include "riegeli/base/canonical_errors.h"
+#include "riegeli/base/chain.h"
+#include "riegeli/base/status.h"
+#include "riegeli/bytes/writer.h"
+
+namespace riegeli {
+
+bool ChainPipe::Send(Chain&& src) {
+  absl::MutexLock lock(&mutex_);
+  mutex_.Await(absl::Condition(this, &ChainPipe::HasRoom));
+  if (ABSL_PREDICT_FALSE(reader_closed_)) return false;
+  buffered_ += src.size();
+  chains_.push_back(std::move(src));
+  return true;
+}
+
+void ChainPipe::CloseWriter(Status status) {
+  absl::MutexLock lock(&mutex_);
+  writer_closed_ = true;
+  writer_status_ = std::move(status);
+}
+
+bool ChainPipe::Receive(Chain* dest, Status* writer_status) {
+  absl::MutexLock lock(&mutex_);
+  mutex_.Await(absl::Condition(this, &ChainPipe::HasDataOrEnded));
+  if (chains_.empty()) {
+    *writer_status = writer_status_;
+    return false;
+  }
+  *dest = std::move(chains_.front());
+  chains_.pop_front();
+  buffered_ -= dest->size();
+  return true;
+}
+
+void ChainPipe::CloseReader() {
+  absl::MutexLock lock(&mutex_);
+  reader_closed_ = true;
+  chains_.clear();
+  buffered_ = 0;
+}
+
+void ChainPipeWriter::Done() {
+  if (ABSL_PREDICT_TRUE(healthy())) {
+    SyncBuffer();
+    Send();
+  }
+  chain_ = Chain();
+  // Report the end of data, or the failure, to the `ChainPipeReader`.
+  pipe_->CloseWriter(healthy() ? OkStatus() : status());
+  Writer::Done();
+}
+
+bool ChainPipeWriter::PushSlow(size_t min_length, size_t recommended_length) {
+  RIEGELI_ASSERT_GT(min_length, available())
+      << "Failed precondition of Writer::PushSlow(): "
+         "length too small, use Push() instead";
+  if (ABSL_PREDICT_FALSE(!healthy())) return false;
+  if (ABSL_PREDICT_FALSE(min_length >
+                         std::numeric_limits<Position>::max() - pos())) {
+    return FailOverflow();
+  }
+  SyncBuffer();
+  if (chain_.size() >= buffer_size_ ||
+      min_length > buffer_size_ - chain_.size()) {
+    if (ABSL_PREDICT_FALSE(!Send())) return false;
+  }
+  MakeBuffer(min_length, recommended_length);
+  return true;
+}
+
+bool ChainPipeWriter::WriteSlow(const Chain& src) {
+  RIEGELI_ASSERT_GT(src.size(), UnsignedMin(available(), kMaxBytesToCopy))
+      << "Failed precondition of Writer::WriteSlow(Chain): "
+         "length too small, use Write(Chain) instead";
+  if (ABSL_PREDICT_FALSE(!healthy())) return false;
+  if (ABSL_PREDICT_FALSE(src.size() >
+                         std::numeric_limits<Position>::max() - pos())) {
+    return FailOverflow();
+  }
+  SyncBuffer();
+  start_pos_ += src.size();
+  chain_.Append(src, buffer_size_);
+  if (chain_.size() >= buffer_size_) return Send();
+  return true;
+}
+
+bool ChainPipeWriter::WriteSlow(Chain&& src) {
+  RIEGELI_ASSERT_GT(src.size(), UnsignedMin(available(), kMaxBytesToCopy))
+      << "Failed precondition of Writer::WriteSlow(Chain&&): "
+         "length too small, use Write(Chain&&) instead";
+  if (ABSL_PREDICT_FALSE(!healthy())) return false;
+  if (ABSL_PREDICT_FALSE(src.size() >
+                         std::numeric_limits<Position>::max() - pos())) {
+    return FailOverflow();
+  }
+  SyncBuffer();
+  start_pos_ += src.size();
+  chain_.Append(std::move(src), buffer_size_);
+  if (chain_.size() >= buffer_size_) return Send();
+  return true;
+}
+
+bool ChainPipeWriter::Flush(FlushType flush_type) {
+  if (ABSL_PREDICT_FALSE(!healthy())) return false;
+  SyncBuffer();
+  return Send();
+}
+
+inline void ChainPipeWriter::SyncBuffer() {
+  if (start_ == nullptr) return;
+  start_pos_ = pos();
+  chain_.RemoveSuffix(available());
+  start_ = nullptr;
+  cursor_ = nullptr;
+  limit_ = nullptr;
+}
+
+inline void ChainPipeWriter::MakeBuffer(size_t min_length,
+                                        size_t recommended_length) {
+  const size_t remaining =
+      chain_.size() < buffer_size_ ? buffer_size_ - chain_.size() : 0;
+  const absl::Span<char> buffer = chain_.AppendBuffer(
+      min_length, UnsignedMax(recommended_length, remaining),
+      UnsignedMax(min_length, remaining), buffer_size_);
+  start_ = buffer.data();
+  cursor_ = start_;
+  limit_ = start_ + buffer.size();
+}
+
+inline bool ChainPipeWriter::Send() {
+  RIEGELI_ASSERT(start_ == nullptr)
+      << "Failed precondition of ChainPipeWriter::Send(): "
+         "buffer not synced";
+  if (chain_.empty()) return true;
+  const bool ok = pipe_->Send(std::move(chain_));
+  chain_ = Chain();
+  if (ABSL_PREDICT_FALSE(!ok)) {
+    return Fail(FailedPreconditionError("ChainPipeReader closed"));
+  }
+  return true;
+}
+
+void ChainPipeReader::Done() {
+  pipe_->CloseReader();
+  current_ = Chain();
+  next_block_ = 0;
+  PullableReader::Done();
+}
+
+bool ChainPipeReader::PullSlow(size_t min_length, size_t recommended_length) {
+  RIEGELI_ASSERT_GT(min_length, available())
+      << "Failed precondition of Reader::PullSlow(): "
+         "length too small, use Pull() instead";
+  if (ABSL_PREDICT_FALSE(!PullUsingScratch(min_length))) {
+    return available() >= min_length;
+  }
+  if (ABSL_PREDICT_FALSE(!healthy())) return false;
+  for (;;) {
+    while (next_block_ < current_.blocks().size()) {
+      const absl::string_view block = current_.blocks()[next_block_++];
+      if (ABSL_PREDICT_TRUE(!block.empty())) {
+        start_ = block.data();
+        cursor_ = start_;
+        limit_ = start_ + block.size();
+        limit_pos_ += block.size();
+        return true;
+      }
+    }
+    start_ = nullptr;
+    cursor_ = nullptr;
+    limit_ = nullptr;
+    next_block_ = 0;
+    Status writer_status;
+    if (ABSL_PREDICT_FALSE(!pipe_->Receive(&current_, &writer_status))) {
+      current_ = Chain();
+      if (ABSL_PREDICT_FALSE(!writer_status.ok())) {
+        return Fail(std::move(writer_status));
+      }
+      return false;
+    }
+  }
+}
+
+}  // namespace riegeli
@@ -0,0 +1,357 @@
+// Copyright 2019 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef RIEGELI_BYTES_CHAIN_PIPE_H_
+#define RIEGELI_BYTES_CHAIN_PIPE_H_
+
+#include <stddef.h>
+
+#include <deque>
+#include <utility>
+
+#include "absl/base/optimization.h"
+#include "absl/base/thread_annotations.h"
+#include "absl/strings/string_view.h"
+#include "absl/synchronization/mutex.h"
+#include "riegeli/base/base.h"
+#include "riegeli/base/chain.h"
+#include "riegeli/base/object.h"
+#include "riegeli/base/status.h"
+#include "riegeli/bytes/pullable_reader.h"
+#include "riegeli/bytes/writer.h"
+
+namespace riegeli {
+
+// A bounded, thread-safe channel transferring data from a `ChainPipeWriter`
+// to a `ChainPipeReader`, typically used by different threads. Data are
+// transferred as `Chain` blocks shared by reference, without copying.
+//
+// The `ChainPipe` must outlive the `ChainPipeWriter` and the
+// `ChainPipeReader`. There must be at most one `ChainPipeWriter` and at most
+// one `ChainPipeReader` using a `ChainPipe`.
+class ChainPipe {
+ public:
+  class Options {
+   public:
+    Options() noexcept {}
+
+    // Writing waits while the amount of data written but not yet read reaches
+    // this amount.
+    //
+    // Default: 256K
+    Options& set_max_buffered(size_t max_buffered) & {
+      RIEGELI_ASSERT_GT(max_buffered, 0u)
+          << "Failed precondition of "
+             "ChainPipe::Options::set_max_buffered(): "
+             "zero max_buffered";
+      max_buffered_ = max_buffered;
+      return *this;
+    }
+    Options&& set_max_buffered(size_t max_buffered) && {
+      return std::move(set_max_buffered(max_buffered));
+    }
+
+   private:
+    friend class ChainPipe;
+
+    size_t max_buffered_ = size_t{4} * kDefaultBufferSize;
+  };
+
+  explicit ChainPipe(Options options = Options())
+      : max_buffered_(options.max_buffered_) {}
+
+  ChainPipe(const ChainPipe&) = delete;
+  ChainPipe& operator=(const ChainPipe&) = delete;
+
+ private:
+  friend class ChainPipeWriter;
+  friend class ChainPipeReader;
+
+  // Conditions for `absl::Mutex::Await()`.
+  bool HasRoom() ABSL_EXCLUSIVE_LOCKS_REQUIRED(mutex_) {
+    return buffered_ < max_buffered_ || reader_closed_;
+  }
+  bool HasDataOrEnded() ABSL_EXCLUSIVE_LOCKS_REQUIRED(mutex_) {
+    return !chains_.empty() || writer_closed_;
+  }
+
+  // Called by `ChainPipeWriter`. Waits for room, then appends `*src` unless
+  // the reader is closed.
+  //
+  // Return values:
+  //  * `true`  - success
+  //  * `false` - the reader is closed
+  bool Send(Chain&& src);
+
+  // Called by `ChainPipeWriter`. Marks the end of data. If `status` is not OK,
+  // the writer failed, and the reader fails with `status` after reading data
+  // sent before.
+  void CloseWriter(Status status);
+
+  // Called by `ChainPipeReader`. Waits for data, then moves them to `*dest`.
+  //
+  // Return values:
+  //  * `true`  - success (`*dest` is not empty)
+  //  * `false` - the writer is closed and all data were read,
+  //              `*writer_status` is set to the status of the writer
+  bool Receive(Chain* dest, Status* writer_status);
+
+  // Called by `ChainPipeReader`. Discards buffered data and makes further
+  // `Send()` calls fail instead of waiting.
+  void CloseReader();
+
+  const size_t max_buffered_;
+  absl::Mutex mutex_;
+  std::deque<Chain> chains_ ABSL_GUARDED_BY(mutex_);
+  // Total size of `chains_`.
+  size_t buffered_ ABSL_GUARDED_BY(mutex_) = 0;
+  bool writer_closed_ ABSL_GUARDED_BY(mutex_) = false;
+  Status writer_status_ ABSL_GUARDED_BY(mutex_);
+  bool reader_closed_ ABSL_GUARDED_BY(mutex_) = false;
+};
+
+// A `Writer` which sends data to a `ChainPipeReader` through a `ChainPipe`.
+//
+// Data are sent when a buffer of `buffer_size()` is full, by `Flush()`, and by
+// `Close()`. Closing the `ChainPipeWriter` marks the end of data for the
+// `ChainPipeReader`. If the `ChainPipeReader` is closed first, writing fails.
+//
+// `ChainPipeWriter` does not support random access.
+class ChainPipeWriter : public Writer {
+ public:
+  class Options {
+   public:
+    Options() noexcept {}
+
+    // Tunes how much data is buffered before sending them.
+    //
+    // Default: 64K
+    Options& set_buffer_size(size_t buffer_size) & {
+      RIEGELI_ASSERT_GT(buffer_size, 0u)
+          << "Failed precondition of "
+             "ChainPipeWriter::Options::set_buffer_size(): "
+             "zero buffer size";
+      buffer_size_ = buffer_size;
+      return *this;
+    }
+    Options&& set_buffer_size(size_t buffer_size) && {
+      return std::move(set_buffer_size(buffer_size));
+    }
+
+   private:
+    friend class ChainPipeWriter;
+
+    size_t buffer_size_ = kDefaultBufferSize;
+  };
+
+  // Creates a closed `ChainPipeWriter`.
+  ChainPipeWriter() noexcept : Writer(kInitiallyClosed) {}
+
+  // Will write to `*pipe`.
+  explicit ChainPipeWriter(ChainPipe* pipe, Options options = Options());
+
+  ChainPipeWriter(ChainPipeWriter&& that) noexcept;
+  ChainPipeWriter& operator=(ChainPipeWriter&& that) noexcept;
+
+  // Makes `*this` equivalent to a newly constructed `ChainPipeWriter`. This
+  // avoids constructing a temporary `ChainPipeWriter` and moving from it.
+  void Reset();
+  void Reset(ChainPipe* pipe, Options options = Options());
+
+  // Returns the `ChainPipe` being written to. Unchanged by `Close()`.
+  ChainPipe* pipe() const { return pipe_; }
+
+  // Sends buffered data to the `ChainPipeReader`. `flush_type` is ignored.
+  bool Flush(FlushType flush_type) override;
+
+ protected:
+  void Done() override;
+  bool PushSlow(size_t min_length, size_t recommended_length) override;
+  using Writer::WriteSlow;
+  bool WriteSlow(const Chain& src) override;
+  bool WriteSlow(Chain&& src) override;
+
+ private:
+  // Ends the buffer, leaving written data in `chain_`.
+  void SyncBuffer();
+
+  // Appends a new buffer of at least `min_length` to `chain_`.
+  void MakeBuffer(size_t min_length = 0, size_t recommended_length = 0);
+
+  // Sends `chain_` if it is not empty.
+  //
+  // Return values:
+  //  * `true`  - success (`healthy()`)
+  //  * `false` - failure (`!healthy()`)
+  bool Send();
+
+  ChainPipe* pipe_ = nullptr;
+  size_t buffer_size_ = 0;
+  // Data written but not yet sent, ending with the buffer.
+  //
+  // Invariant: if `start_ != nullptr` then the buffer ends at the end of
+  //            `chain_`
+  Chain chain_;
+};
+
+// A `Reader` which receives data from a `ChainPipeWriter` through a
+// `ChainPipe`, waiting for them if needed.
+//
+// The source ends when the `ChainPipeWriter` is closed and all data were read.
+// If the `ChainPipeWriter` failed, the `ChainPipeReader` fails then with the
+// same status.
+//
+// Closing the `ChainPipeReader` discards data not read yet.
+//
+// `ChainPipeReader` does not support random access. Seeking forwards skips
+// data.
+class ChainPipeReader : public PullableReader {
+ public:
+  // Creates a closed `ChainPipeReader`.
+  ChainPipeReader() noexcept : PullableReader(kInitiallyClosed) {}
+
+  // Will read from `*pipe`.
+  explicit ChainPipeReader(ChainPipe* pipe);
+
+  ChainPipeReader(ChainPipeReader&& that) noexcept;
+  ChainPipeReader& operator=(ChainPipeReader&& that) noexcept;
+
+  // Makes `*this` equivalent to a newly constructed `ChainPipeReader`. This
+  // avoids constructing a temporary `ChainPipeReader` and moving from it.
+  void Reset();
+  void Reset(ChainPipe* pipe);
+
+  // Returns the `ChainPipe` being read from. Unchanged by `Close()`.
+  ChainPipe* pipe() const { return pipe_; }
+
+ protected:
+  void Done() override;
+  bool PullSlow(size_t min_length, size_t recommended_length) override;
+
+ private:
+  void MoveCurrent(ChainPipeReader&& that);
+
+  ChainPipe* pipe_ = nullptr;
+  // Data received which are being read. `current_.blocks()[next_block_]` is
+  // exposed as the buffer after the current one.
+  Chain current_;
+  size_t next_block_ = 0;
+
+  // Invariant if scratch is not used and `start_ != nullptr`:
+  //   `start_ == current_.blocks()[next_block_ - 1].data()`
+};
+
+// Implementation details follow.
+
+inline ChainPipeWriter::ChainPipeWriter(ChainPipe* pipe, Options options)
+    : Writer(kInitiallyOpen),
+      pipe_(RIEGELI_ASSERT_NOTNULL(pipe)),
+      buffer_size_(options.buffer_size_) {}
+
+inline ChainPipeWriter::ChainPipeWriter(ChainPipeWriter&& that) noexcept
+    : Writer(std::move(that)),
+      pipe_(std::exchange(that.pipe_, nullptr)),
+      buffer_size_(that.buffer_size_) {
+  // `chain_` can hold the buffer in its short data, which would move, so end
+  // the buffer before moving `chain_`.
+  if (start_ != nullptr) {
+    start_pos_ = pos();
+    that.chain_.RemoveSuffix(available());
+    start_ = nullptr;
+    cursor_ = nullptr;
+    limit_ = nullptr;
+  }
+  chain_ = std::move(that.chain_);
+}
+
+inline ChainPipeWriter& ChainPipeWriter::operator=(
+    ChainPipeWriter&& that) noexcept {
+  Writer::operator=(std::move(that));
+  pipe_ = std::exchange(that.pipe_, nullptr);
+  buffer_size_ = that.buffer_size_;
+  if (start_ != nullptr) {
+    start_pos_ = pos();
+    that.chain_.RemoveSuffix(available());
+    start_ = nullptr;
+    cursor_ = nullptr;
+    limit_ = nullptr;
+  }
+  chain_ = std::move(that.chain_);
+  return *this;
+}
+
+inline void ChainPipeWriter::Reset() {
+  Writer::Reset(kInitiallyClosed);
+  pipe_ = nullptr;
+  buffer_size_ = 0;
+  chain_.Clear();
+}
+
+inline void ChainPipeWriter::Reset(ChainPipe* pipe, Options options) {
+  Writer::Reset(kInitiallyOpen);
+  pipe_ = RIEGELI_ASSERT_NOTNULL(pipe);
+  buffer_size_ = options.buffer_size_;
+  chain_.Clear();
+}
+
+inline ChainPipeReader::ChainPipeReader(ChainPipe* pipe)
+    : PullableReader(kInitiallyOpen), pipe_(RIEGELI_ASSERT_NOTNULL(pipe)) {}
+
+inline ChainPipeReader::ChainPipeReader(ChainPipeReader&& that) noexcept
+    : PullableReader(std::move(that)),
+      pipe_(std::exchange(that.pipe_, nullptr)) {
+  MoveCurrent(std::move(that));
+}
+
+inline ChainPipeReader& ChainPipeReader::operator=(
+    ChainPipeReader&& that) noexcept {
+  PullableReader::operator=(std::move(that));
+  pipe_ = std::exchange(that.pipe_, nullptr);
+  MoveCurrent(std::move(that));
+  return *this;
+}
+
+inline void ChainPipeReader::Reset() {
+  PullableReader::Reset(kInitiallyClosed);
+  pipe_ = nullptr;
+  current_.Clear();
+  next_block_ = 0;
+}
+
+inline void ChainPipeReader::Reset(ChainPipe* pipe) {
+  PullableReader::Reset(kInitiallyOpen);
+  pipe_ = RIEGELI_ASSERT_NOTNULL(pipe);
+  current_.Clear();
+  next_block_ = 0;
+}
+
+inline void ChainPipeReader::MoveCurrent(ChainPipeReader&& that) {
+  // `current_` can hold the buffer in its short data, which would move, so
+  // find the buffer again after moving `current_`.
+  SwapScratchBegin();
+  const size_t cursor_index = read_from_buffer();
+  current_ = std::move(that.current_);
+  next_block_ = std::exchange(that.next_block_, 0);
+  if (start_ != nullptr) {
+    const absl::string_view block = current_.blocks()[next_block_ - 1];
+    start_ = block.data();
+    cursor_ = start_ + cursor_index;
+    limit_ = start_ + block.size();
+  }
+  SwapScratchEnd();
+}
+
+}  // namespace riegeli
+
+#endif  // RIEGELI_BYTES_CHAIN_PIPE_H_
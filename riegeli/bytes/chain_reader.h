@@ -20,6 +20,7 @@
 #include <tuple>
 #include <utility>
 
+#include "absl/base/optimization.h"
 #include "riegeli/base/base.h"
 #include "riegeli/base/chain.h"
 #include "riegeli/base/dependency.h"
@@ -38,6 +39,14 @@ class ChainReaderBase : public PullableReader {
   // Returns the `Chain` being read from. Unchanged by `Close()`.
   virtual const Chain* src_chain() const = 0;
 
+  // Same as `Reader::Pull()`, but calls `ChainReaderBase::PullSlow()`
+  // non-virtually, so that it is inlined when the reader is statically known
+  // to be a `ChainReader`.
+  //
+  // A subclass which overrides `PullSlow()` must restore `Reader::Pull()` with
+  // `using Reader::Pull;`.
+  bool Pull(size_t min_length = 1, size_t recommended_length = 0);
+
   bool SupportsRandomAccess() const override { return true; }
   bool Size(Position* size) override;
 
@@ -124,6 +133,12 @@ class ChainReader : public ChainReaderBase {
 
 // Implementation details follow.
 
+inline bool ChainReaderBase::Pull(size_t min_length,
+                                  size_t recommended_length) {
+  if (ABSL_PREDICT_TRUE(available() >= min_length)) return true;
+  return ChainReaderBase::PullSlow(min_length, recommended_length);
+}
+
 inline ChainReaderBase::ChainReaderBase(ChainReaderBase&& that) noexcept
     : PullableReader(std::move(that)),
       iter_(std::exchange(that.iter_, Chain::BlockIterator())) {}
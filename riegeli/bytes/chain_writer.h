@@ -21,6 +21,7 @@
 #include <tuple>
 #include <utility>
 
+#include "absl/base/optimization.h"
 #include "riegeli/base/base.h"
 #include "riegeli/base/chain.h"
 #include "riegeli/base/dependency.h"
@@ -60,6 +61,10 @@ class ChainWriterBase : public Writer {
   virtual Chain* dest_chain() = 0;
   virtual const Chain* dest_chain() const = 0;
 
+  // Same as `Writer::Push()`, but calls `PushSlow()` non-virtually, so that it
+  // is inlined when the writer is statically known to be a `ChainWriter`.
+  bool Push(size_t min_length = 1, size_t recommended_length = 0);
+
   bool Flush(FlushType flush_type) override;
   bool SupportsTruncate() const override { return true; }
   bool Truncate(Position new_size) override;
@@ -77,7 +82,8 @@ class ChainWriterBase : public Writer {
   void Initialize(Chain* dest);
 
   void Done() override;
-  bool PushSlow(size_t min_length, size_t recommended_length) override;
+  // `final` because `Push()` calls it non-virtually.
+  bool PushSlow(size_t min_length, size_t recommended_length) final;
   using Writer::WriteSlow;
   bool WriteSlow(const Chain& src) override;
   bool WriteSlow(Chain&& src) override;
@@ -156,6 +162,12 @@ class ChainWriter : public ChainWriterBase {
 
 // Implementation details follow.
 
+inline bool ChainWriterBase::Push(size_t min_length,
+                                  size_t recommended_length) {
+  if (ABSL_PREDICT_TRUE(available() >= min_length)) return true;
+  return ChainWriterBase::PushSlow(min_length, recommended_length);
+}
+
 inline ChainWriterBase::ChainWriterBase(Position size_hint)
     : Writer(kInitiallyOpen),
       size_hint_(UnsignedMin(size_hint, std::numeric_limits<size_t>::max())) {}
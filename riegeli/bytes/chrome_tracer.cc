@@ -0,0 +1,79 @@
+// Copyright 2019 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "riegeli/bytes/chrome_tracer.h"
+
+#include <stdint.h>
+#include <atomic>
+
+#include "absl/base/optimization.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/string_view.h"
+#include "absl/synchronization/mutex.h"
+#include "absl/time/clock.h"
+#include "riegeli/base/base.h"
+#include "riegeli/base/object.h"
+#include "riegeli/bytes/writer.h"
+
+namespace riegeli {
+
+namespace {
+
+// Returns a small number identifying the current thread.
+uint32_t ThreadNumber() {
+  static std::atomic<uint32_t> next_thread_number{1};
+  thread_local const uint32_t thread_number =
+      next_thread_number.fetch_add(1, std::memory_order_relaxed);
+  return thread_number;
+}
+
+}  // namespace
+
+ChromeTracer::ChromeTracer(Writer* dest)
+    : Object(kInitiallyOpen),
+      dest_(RIEGELI_ASSERT_NOTNULL(dest)),
+      start_time_ns_(absl::GetCurrentTimeNanos()) {}
+
+void ChromeTracer::Begin(const char* name) { WriteEvent(name, 'B'); }
+
+void ChromeTracer::End(const char* name) { WriteEvent(name, 'E'); }
+
+void ChromeTracer::WriteEvent(const char* name, char phase) {
+  const int64_t time_ns = absl::GetCurrentTimeNanos() - start_time_ns_;
+  const uint32_t thread_number = ThreadNumber();
+  absl::MutexLock lock(&mutex_);
+  if (ABSL_PREDICT_FALSE(!healthy())) return;
+  // `name` is a string literal chosen by Riegeli, so it does not need to be
+  // escaped.
+  if (ABSL_PREDICT_FALSE(!dest_->Write(absl::StrCat(
+          wrote_event_ ? ",\n" : "[\n", "{\"name\":\"", name, "\",\"ph\":\"",
+          absl::string_view(&phase, 1), "\",\"ts\":", time_ns / 1000, ".",
+          absl::Dec(time_ns % 1000, absl::kZeroPad3),
+          ",\"pid\":1,\"tid\":", thread_number, "}")))) {
+    Fail(*dest_);
+    return;
+  }
+  wrote_event_ = true;
+}
+
+void ChromeTracer::Done() {
+  absl::MutexLock lock(&mutex_);
+  if (ABSL_PREDICT_FALSE(
+          !dest_->Write(wrote_event_ ? absl::string_view("\n]\n")
+                                     : absl::string_view("[\n]\n")))) {
+    Fail(*dest_);
+  }
+}
+
+}  // namespace riegeli
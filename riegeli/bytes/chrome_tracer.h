@@ -0,0 +1,80 @@
+// Copyright 2019 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef RIEGELI_BYTES_CHROME_TRACER_H_
+#define RIEGELI_BYTES_CHROME_TRACER_H_
+
+#include <stdint.h>
+
+#include "absl/base/thread_annotations.h"
+#include "absl/synchronization/mutex.h"
+#include "riegeli/base/base.h"
+#include "riegeli/base/object.h"
+#include "riegeli/base/tracing.h"
+#include "riegeli/bytes/writer.h"
+
+namespace riegeli {
+
+// A `Tracer` which writes events to a `Writer` in the JSON Array Format of the
+// Chrome trace event format, which can be loaded by chrome://tracing and by
+// Perfetto (https://ui.perfetto.dev).
+//
+// Timestamps are in microseconds since the `ChromeTracer` was created. Threads
+// are numbered sequentially in the order of their first event.
+//
+// Example:
+//
+// ```
+//   riegeli::FdWriter<> trace_writer("/tmp/trace.json",
+//                                    O_WRONLY | O_CREAT | O_TRUNC);
+//   riegeli::ChromeTracer tracer(&trace_writer);
+//   riegeli::SetTracer(&tracer);
+//   ...  // Read or write Riegeli/records files.
+//   riegeli::SetTracer(nullptr);
+//   RIEGELI_CHECK(tracer.Close()) << tracer.status();
+//   RIEGELI_CHECK(trace_writer.Close()) << trace_writer.status();
+// ```
+//
+// `Begin()` and `End()` may be called concurrently. The `ChromeTracer` must be
+// uninstalled with `SetTracer(nullptr)`, and operations being traced must end,
+// before it is closed.
+class ChromeTracer : public Object, public Tracer {
+ public:
+  // Will write to the `Writer` provided by `dest`, which is not owned and must
+  // be valid until `Close()`.
+  explicit ChromeTracer(Writer* dest);
+
+  ChromeTracer(const ChromeTracer&) = delete;
+  ChromeTracer& operator=(const ChromeTracer&) = delete;
+
+  void Begin(const char* name) override;
+  void End(const char* name) override;
+
+ protected:
+  void Done() override;
+
+ private:
+  void WriteEvent(const char* name, char phase);
+
+  absl::Mutex mutex_;
+  Writer* dest_ ABSL_GUARDED_BY(mutex_);
+  int64_t start_time_ns_;
+  // Whether an event has been written, i.e. whether the next event must be
+  // preceded by a comma.
+  bool wrote_event_ ABSL_GUARDED_BY(mutex_) = false;
+};
+
+}  // namespace riegeli
+
+#endif  // RIEGELI_BYTES_CHROME_TRACER_H_
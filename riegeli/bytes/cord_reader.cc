@@ -0,0 +1,141 @@
+// Copyright 2019 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "riegeli/bytes/cord_reader.h"
+
+#include <stddef.h>
+
+#include <limits>
+
+#include "absl/base/optimization.h"
+#include "absl/strings/cord.h"
+#include "riegeli/base/base.h"
+#include "riegeli/base/chain.h"
+
+namespace riegeli {
+
+void CordReaderBase::Done() {
+  iter_ = absl::Cord::ChunkIterator();
+  PullableReader::Done();
+}
+
+inline void CordReaderBase::MakeBuffer(const absl::Cord* src) {
+  if (iter_ == src->chunk_end()) {
+    start_ = nullptr;
+    cursor_ = nullptr;
+    limit_ = nullptr;
+    return;
+  }
+  RIEGELI_ASSERT_LE(iter_->size(), src->size() - limit_pos_)
+      << "CordReader source changed unexpectedly";
+  start_ = iter_->data();
+  cursor_ = start_;
+  limit_ = start_ + iter_->size();
+  limit_pos_ += iter_->size();
+}
+
+void CordReaderBase::RewindIter(const absl::Cord* src) {
+  iter_ = src->chunk_begin();
+  limit_pos_ = 0;
+  MakeBuffer(src);
+}
+
+void CordReaderBase::AdvanceIter(const absl::Cord* src, Position new_pos) {
+  RIEGELI_ASSERT_GE(new_pos, start_pos())
+      << "Failed precondition of CordReaderBase::AdvanceIter(): "
+         "position before the buffer";
+  RIEGELI_ASSERT_LE(new_pos, src->size())
+      << "Failed precondition of CordReaderBase::AdvanceIter(): "
+         "position after the end of source";
+  while (limit_pos_ < new_pos) {
+    ++iter_;
+    MakeBuffer(src);
+  }
+  cursor_ = limit_ - (limit_pos_ - new_pos);
+}
+
+bool CordReaderBase::PullSlow(size_t min_length, size_t recommended_length) {
+  RIEGELI_ASSERT_GT(min_length, available())
+      << "Failed precondition of Reader::PullSlow(): "
+         "length too small, use Pull() instead";
+  if (ABSL_PREDICT_FALSE(!PullUsingScratch(min_length))) {
+    return available() >= min_length;
+  }
+  if (ABSL_PREDICT_FALSE(!healthy())) return false;
+  const absl::Cord* const src = src_cord();
+  if (ABSL_PREDICT_FALSE(iter_ == src->chunk_end())) return false;
+  ++iter_;
+  MakeBuffer(src);
+  return iter_ != src->chunk_end();
+}
+
+bool CordReaderBase::ReadSlow(Chain* dest, size_t length) {
+  RIEGELI_ASSERT_GT(length, UnsignedMin(available(), kMaxBytesToCopy))
+      << "Failed precondition of Reader::ReadSlow(Chain*): "
+         "length too small, use Read(Chain*) instead";
+  RIEGELI_ASSERT_LE(length, std::numeric_limits<size_t>::max() - dest->size())
+      << "Failed precondition of Reader::ReadSlow(Chain*): "
+         "Chain size overflow";
+  if (ABSL_PREDICT_FALSE(!ReadScratch(dest, &length))) return length == 0;
+  if (ABSL_PREDICT_FALSE(!healthy())) return false;
+  const absl::Cord* const src = src_cord();
+  RIEGELI_ASSERT_LE(limit_pos_, src->size())
+      << "CordReader source changed unexpectedly";
+  const size_t length_to_read =
+      UnsignedMin(length, src->size() - IntCast<size_t>(pos()));
+  // Share fragments of the `absl::Cord` with `*dest` instead of copying them.
+  dest->Append(src->Subcord(IntCast<size_t>(pos()), length_to_read));
+  const Position new_pos = pos() + length_to_read;
+  if (new_pos <= limit_pos_) {
+    cursor_ = limit_ - (limit_pos_ - new_pos);
+  } else {
+    AdvanceIter(src, new_pos);
+  }
+  return length_to_read == length;
+}
+
+bool CordReaderBase::SeekSlow(Position new_pos) {
+  RIEGELI_ASSERT(new_pos < start_pos() || new_pos > limit_pos_)
+      << "Failed precondition of Reader::SeekSlow(): "
+         "position in the buffer, use Seek() instead";
+  if (ABSL_PREDICT_FALSE(!SeekUsingScratch(new_pos))) return true;
+  if (ABSL_PREDICT_FALSE(!healthy())) return false;
+  const absl::Cord* const src = src_cord();
+  RIEGELI_ASSERT_LE(limit_pos_, src->size())
+      << "CordReader source changed unexpectedly";
+  if (ABSL_PREDICT_FALSE(new_pos > src->size())) {
+    // Source ends.
+    iter_ = src->chunk_end();
+    start_ = nullptr;
+    cursor_ = nullptr;
+    limit_ = nullptr;
+    limit_pos_ = src->size();
+    return false;
+  }
+  if (new_pos < start_pos()) {
+    // Seeking backwards. Fragments can be iterated only forwards, so start
+    // from the beginning.
+    RewindIter(src);
+  }
+  AdvanceIter(src, new_pos);
+  return true;
+}
+
+bool CordReaderBase::Size(Position* size) {
+  if (ABSL_PREDICT_FALSE(!healthy())) return false;
+  *size = src_cord()->size();
+  return true;
+}
+
+}  // namespace riegeli
@@ -0,0 +1,128 @@
+// Copyright 2019 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "riegeli/bytes/cord_writer.h"
+
+#include <stddef.h>
+
+#include <limits>
+#include <utility>
+
+#include "absl/base/optimization.h"
+#include "absl/strings/cord.h"
+#include "absl/types/span.h"
+#include "riegeli/base/base.h"
+#include "riegeli/base/chain.h"
+#include "riegeli/bytes/writer.h"
+
+namespace riegeli {
+
+void CordWriterBase::Done() {
+  if (ABSL_PREDICT_TRUE(healthy())) {
+    SyncBuffer();
+    AppendChain(dest_cord());
+  }
+  chain_ = Chain();
+  Writer::Done();
+}
+
+bool CordWriterBase::PushSlow(size_t min_length, size_t recommended_length) {
+  RIEGELI_ASSERT_GT(min_length, available())
+      << "Failed precondition of Writer::PushSlow(): "
+         "length too small, use Push() instead";
+  if (ABSL_PREDICT_FALSE(!healthy())) return false;
+  if (ABSL_PREDICT_FALSE(min_length >
+                         std::numeric_limits<size_t>::max() - pos())) {
+    return FailOverflow();
+  }
+  SyncBuffer();
+  if (chain_.size() >= buffer_size_ ||
+      min_length > buffer_size_ - chain_.size()) {
+    AppendChain(dest_cord());
+  }
+  MakeBuffer(min_length, recommended_length);
+  return true;
+}
+
+bool CordWriterBase::WriteSlow(const Chain& src) {
+  RIEGELI_ASSERT_GT(src.size(), UnsignedMin(available(), kMaxBytesToCopy))
+      << "Failed precondition of Writer::WriteSlow(Chain): "
+         "length too small, use Write(Chain) instead";
+  if (ABSL_PREDICT_FALSE(!healthy())) return false;
+  if (ABSL_PREDICT_FALSE(src.size() >
+                         std::numeric_limits<size_t>::max() - pos())) {
+    return FailOverflow();
+  }
+  SyncBuffer();
+  start_pos_ += src.size();
+  chain_.Append(src, buffer_size_);
+  if (chain_.size() >= buffer_size_) AppendChain(dest_cord());
+  return true;
+}
+
+bool CordWriterBase::WriteSlow(Chain&& src) {
+  RIEGELI_ASSERT_GT(src.size(), UnsignedMin(available(), kMaxBytesToCopy))
+      << "Failed precondition of Writer::WriteSlow(Chain&&): "
+         "length too small, use Write(Chain&&) instead";
+  if (ABSL_PREDICT_FALSE(!healthy())) return false;
+  if (ABSL_PREDICT_FALSE(src.size() >
+                         std::numeric_limits<size_t>::max() - pos())) {
+    return FailOverflow();
+  }
+  SyncBuffer();
+  start_pos_ += src.size();
+  chain_.Append(std::move(src), buffer_size_);
+  if (chain_.size() >= buffer_size_) AppendChain(dest_cord());
+  return true;
+}
+
+bool CordWriterBase::Flush(FlushType flush_type) {
+  if (ABSL_PREDICT_FALSE(!healthy())) return false;
+  SyncBuffer();
+  AppendChain(dest_cord());
+  return true;
+}
+
+inline void CordWriterBase::SyncBuffer() {
+  if (start_ == nullptr) return;
+  start_pos_ = pos();
+  chain_.RemoveSuffix(available());
+  start_ = nullptr;
+  cursor_ = nullptr;
+  limit_ = nullptr;
+}
+
+inline void CordWriterBase::MakeBuffer(size_t min_length,
+                                       size_t recommended_length) {
+  const size_t remaining =
+      chain_.size() < buffer_size_ ? buffer_size_ - chain_.size() : 0;
+  const absl::Span<char> buffer = chain_.AppendBuffer(
+      min_length, UnsignedMax(recommended_length, remaining),
+      UnsignedMax(min_length, remaining), buffer_size_);
+  start_ = buffer.data();
+  cursor_ = start_;
+  limit_ = start_ + buffer.size();
+}
+
+inline void CordWriterBase::AppendChain(absl::Cord* dest) {
+  RIEGELI_ASSERT(start_ == nullptr)
+      << "Failed precondition of CordWriterBase::AppendChain(): "
+         "buffer not synced";
+  RIEGELI_ASSERT_EQ(start_pos_, dest->size() + chain_.size())
+      << "CordWriter destination changed unexpectedly";
+  chain_.AppendTo(dest);
+  chain_.Clear();
+}
+
+}  // namespace riegeli
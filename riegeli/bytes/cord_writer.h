@@ -0,0 +1,277 @@
+// Copyright 2019 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef RIEGELI_BYTES_CORD_WRITER_H_
+#define RIEGELI_BYTES_CORD_WRITER_H_
+
+#include <stddef.h>
+
+#include <tuple>
+#include <utility>
+
+#include "absl/strings/cord.h"
+#include "riegeli/base/base.h"
+#include "riegeli/base/chain.h"
+#include "riegeli/base/dependency.h"
+#include "riegeli/base/object.h"
+#include "riegeli/base/resetter.h"
+#include "riegeli/bytes/writer.h"
+
+namespace riegeli {
+
+// Template parameter independent part of `CordWriter`.
+class CordWriterBase : public Writer {
+ public:
+  class Options {
+   public:
+    Options() noexcept {}
+
+    // Tunes how much data is buffered before appending them to the
+    // `absl::Cord`. Full buffers are shared with the `absl::Cord` without
+    // copying.
+    //
+    // Default: 64K
+    Options& set_buffer_size(size_t buffer_size) & {
+      RIEGELI_ASSERT_GT(buffer_size, 0u)
+          << "Failed precondition of "
+             "CordWriterBase::Options::set_buffer_size(): "
+             "zero buffer size";
+      buffer_size_ = buffer_size;
+      return *this;
+    }
+    Options&& set_buffer_size(size_t buffer_size) && {
+      return std::move(set_buffer_size(buffer_size));
+    }
+
+   private:
+    template <typename Dest>
+    friend class CordWriter;
+
+    size_t buffer_size_ = kDefaultBufferSize;
+  };
+
+  // Returns the `absl::Cord` being written to. Unchanged by `Close()`.
+  virtual absl::Cord* dest_cord() = 0;
+  virtual const absl::Cord* dest_cord() const = 0;
+
+  // Appends buffered data to the `absl::Cord`. `flush_type` is ignored.
+  bool Flush(FlushType flush_type) override;
+
+ protected:
+  CordWriterBase() noexcept : Writer(kInitiallyClosed) {}
+
+  explicit CordWriterBase(size_t buffer_size);
+
+  CordWriterBase(CordWriterBase&& that) noexcept;
+  CordWriterBase& operator=(CordWriterBase&& that) noexcept;
+
+  void Reset();
+  void Reset(size_t buffer_size);
+  void Initialize(absl::Cord* dest);
+
+  void Done() override;
+  bool PushSlow(size_t min_length, size_t recommended_length) override;
+  using Writer::WriteSlow;
+  bool WriteSlow(const Chain& src) override;
+  bool WriteSlow(Chain&& src) override;
+
+ private:
+  // Ends the buffer, leaving written data in `chain_`.
+  void SyncBuffer();
+
+  // Appends a new buffer of at least `min_length` to `chain_`.
+  void MakeBuffer(size_t min_length = 0, size_t recommended_length = 0);
+
+  // Appends `chain_` to `*dest`, sharing its blocks, and clears it.
+  void AppendChain(absl::Cord* dest);
+
+  size_t buffer_size_ = 0;
+  // Data written but not yet appended to the `absl::Cord`, ending with the
+  // buffer.
+  //
+  // Invariant: if `start_ != nullptr` then the buffer ends at the end of
+  //            `chain_`
+  Chain chain_;
+};
+
+// A `Writer` which appends to an `absl::Cord`.
+//
+// The `Dest` template parameter specifies the type of the object providing and
+// possibly owning the `absl::Cord` being written to. `Dest` must support
+// `Dependency<absl::Cord*, Dest>`, e.g. `absl::Cord*` (not owned, default),
+// `absl::Cord` (owned).
+//
+// The `absl::Cord` must not be accessed until the `CordWriter` is closed or no
+// longer used, except that it is allowed to read the `absl::Cord` immediately
+// after `Flush()`.
+template <typename Dest = absl::Cord*>
+class CordWriter : public CordWriterBase {
+ public:
+  // Creates a closed `CordWriter`.
+  CordWriter() noexcept {}
+
+  // Will append to the `absl::Cord` provided by `dest`.
+  explicit CordWriter(const Dest& dest, Options options = Options());
+  explicit CordWriter(Dest&& dest, Options options = Options());
+
+  // Will append to the `absl::Cord` provided by a `Dest` constructed from
+  // elements of `dest_args`. This avoids constructing a temporary `Dest` and
+  // moving from it.
+  template <typename... DestArgs>
+  explicit CordWriter(std::tuple<DestArgs...> dest_args,
+                      Options options = Options());
+
+  CordWriter(CordWriter&& that) noexcept;
+  CordWriter& operator=(CordWriter&& that) noexcept;
+
+  // Makes `*this` equivalent to a newly constructed `CordWriter`. This avoids
+  // constructing a temporary `CordWriter` and moving from it.
+  void Reset();
+  void Reset(const Dest& dest, Options options = Options());
+  void Reset(Dest&& dest, Options options = Options());
+  template <typename... DestArgs>
+  void Reset(std::tuple<DestArgs...> dest_args, Options options = Options());
+
+  // Returns the object providing and possibly owning the `absl::Cord` being
+  // written to. Unchanged by `Close()`.
+  Dest& dest() { return dest_.manager(); }
+  const Dest& dest() const { return dest_.manager(); }
+  absl::Cord* dest_cord() override { return dest_.get(); }
+  const absl::Cord* dest_cord() const override { return dest_.get(); }
+
+ private:
+  // The object providing and possibly owning the `absl::Cord` being written
+  // to.
+  Dependency<absl::Cord*, Dest> dest_;
+};
+
+// Implementation details follow.
+
+inline CordWriterBase::CordWriterBase(size_t buffer_size)
+    : Writer(kInitiallyOpen), buffer_size_(buffer_size) {}
+
+inline CordWriterBase::CordWriterBase(CordWriterBase&& that) noexcept
+    : Writer(std::move(that)), buffer_size_(that.buffer_size_) {
+  // `chain_` can hold the buffer in its short data, which would move, so end
+  // the buffer before moving `chain_`.
+  if (start_ != nullptr) {
+    start_pos_ = pos();
+    that.chain_.RemoveSuffix(available());
+    start_ = nullptr;
+    cursor_ = nullptr;
+    limit_ = nullptr;
+  }
+  chain_ = std::move(that.chain_);
+}
+
+inline CordWriterBase& CordWriterBase::operator=(
+    CordWriterBase&& that) noexcept {
+  Writer::operator=(std::move(that));
+  buffer_size_ = that.buffer_size_;
+  if (start_ != nullptr) {
+    start_pos_ = pos();
+    that.chain_.RemoveSuffix(available());
+    start_ = nullptr;
+    cursor_ = nullptr;
+    limit_ = nullptr;
+  }
+  chain_ = std::move(that.chain_);
+  return *this;
+}
+
+inline void CordWriterBase::Reset() {
+  Writer::Reset(kInitiallyClosed);
+  buffer_size_ = 0;
+  chain_.Clear();
+}
+
+inline void CordWriterBase::Reset(size_t buffer_size) {
+  Writer::Reset(kInitiallyOpen);
+  buffer_size_ = buffer_size;
+  chain_.Clear();
+}
+
+inline void CordWriterBase::Initialize(absl::Cord* dest) {
+  RIEGELI_ASSERT(dest != nullptr)
+      << "Failed precondition of CordWriter: null Cord pointer";
+  start_pos_ = dest->size();
+}
+
+template <typename Dest>
+inline CordWriter<Dest>::CordWriter(const Dest& dest, Options options)
+    : CordWriterBase(options.buffer_size_), dest_(dest) {
+  Initialize(dest_.get());
+}
+
+template <typename Dest>
+inline CordWriter<Dest>::CordWriter(Dest&& dest, Options options)
+    : CordWriterBase(options.buffer_size_), dest_(std::move(dest)) {
+  Initialize(dest_.get());
+}
+
+template <typename Dest>
+template <typename... DestArgs>
+inline CordWriter<Dest>::CordWriter(std::tuple<DestArgs...> dest_args,
+                                    Options options)
+    : CordWriterBase(options.buffer_size_), dest_(std::move(dest_args)) {
+  Initialize(dest_.get());
+}
+
+template <typename Dest>
+inline CordWriter<Dest>::CordWriter(CordWriter&& that) noexcept
+    : CordWriterBase(std::move(that)), dest_(std::move(that.dest_)) {}
+
+template <typename Dest>
+inline CordWriter<Dest>& CordWriter<Dest>::operator=(
+    CordWriter&& that) noexcept {
+  CordWriterBase::operator=(std::move(that));
+  dest_ = std::move(that.dest_);
+  return *this;
+}
+
+template <typename Dest>
+inline void CordWriter<Dest>::Reset() {
+  CordWriterBase::Reset();
+  dest_.Reset();
+}
+
+template <typename Dest>
+inline void CordWriter<Dest>::Reset(const Dest& dest, Options options) {
+  CordWriterBase::Reset(options.buffer_size_);
+  dest_.Reset(dest);
+  Initialize(dest_.get());
+}
+
+template <typename Dest>
+inline void CordWriter<Dest>::Reset(Dest&& dest, Options options) {
+  CordWriterBase::Reset(options.buffer_size_);
+  dest_.Reset(std::move(dest));
+  Initialize(dest_.get());
+}
+
+template <typename Dest>
+template <typename... DestArgs>
+inline void CordWriter<Dest>::Reset(std::tuple<DestArgs...> dest_args,
+                                    Options options) {
+  CordWriterBase::Reset(options.buffer_size_);
+  dest_.Reset(std::move(dest_args));
+  Initialize(dest_.get());
+}
+
+template <typename Dest>
+struct Resetter<CordWriter<Dest>> : ResetterByReset<CordWriter<Dest>> {};
+
+}  // namespace riegeli
+
+#endif  // RIEGELI_BYTES_CORD_WRITER_H_
@@ -15,6 +15,7 @@
 #ifndef RIEGELI_BYTES_FD_DEPENDENCY_H_
 #define RIEGELI_BYTES_FD_DEPENDENCY_H_
 
+#include <stddef.h>
 #include <unistd.h>
 
 #include <cerrno>
@@ -25,6 +26,7 @@
 #include "absl/strings/string_view.h"
 #include "riegeli/base/base.h"
 #include "riegeli/base/dependency.h"
+#include "riegeli/base/memory.h"
 
 namespace riegeli {
 
@@ -37,6 +39,42 @@ int CloseFd(int fd);
 
 absl::string_view CloseFunctionName();
 
+// Alignment of file positions, lengths, and memory addresses of reads and
+// writes of a fd opened with `O_DIRECT`. This is the logical block size of
+// common storage devices.
+constexpr size_t kDirectIoAlignment = 4096;
+
+// Lazily allocated buffer of a fixed size, aligned to `kDirectIoAlignment`,
+// with the size rounded up to a multiple of `kDirectIoAlignment`.
+class DirectIoBuffer {
+ public:
+  DirectIoBuffer() noexcept {}
+
+  // Stores the minimal size to be allocated. Does not allocate the buffer yet.
+  explicit DirectIoBuffer(size_t size) noexcept
+      : size_(RoundUp<kDirectIoAlignment>(size)) {}
+
+  DirectIoBuffer(DirectIoBuffer&& that) noexcept;
+  DirectIoBuffer& operator=(DirectIoBuffer&& that) noexcept;
+
+  ~DirectIoBuffer() { DeleteBuffer(); }
+
+  // If the buffer is not allocated, allocates it. Returns the data pointer.
+  //
+  // Precondition: `size() > 0`
+  char* GetData();
+
+  // Returns the data size.
+  size_t size() const { return size_; }
+
+ private:
+  // If the buffer is allocated, deletes it.
+  void DeleteBuffer();
+
+  char* data_ = nullptr;
+  size_t size_ = 0;
+};
+
 }  // namespace internal
 
 // Owns a file descriptor (-1 means none).
@@ -152,6 +190,35 @@ inline absl::string_view CloseFunctionName() {
 #endif
 }
 
+inline DirectIoBuffer::DirectIoBuffer(DirectIoBuffer&& that) noexcept
+    : data_(std::exchange(that.data_, nullptr)),
+      size_(std::exchange(that.size_, 0)) {}
+
+inline DirectIoBuffer& DirectIoBuffer::operator=(
+    DirectIoBuffer&& that) noexcept {
+  // Exchange `that.data_` early to support self-assignment.
+  char* const data = std::exchange(that.data_, nullptr);
+  const size_t size = std::exchange(that.size_, 0);
+  DeleteBuffer();
+  data_ = data;
+  size_ = size;
+  return *this;
+}
+
+inline char* DirectIoBuffer::GetData() {
+  if (ABSL_PREDICT_FALSE(data_ == nullptr)) {
+    RIEGELI_ASSERT_GT(size_, 0u)
+        << "Failed precondition of DirectIoBuffer::GetData(): "
+           "no buffer size specified";
+    data_ = NewAligned<char, kDirectIoAlignment>(size_);
+  }
+  return data_;
+}
+
+inline void DirectIoBuffer::DeleteBuffer() {
+  if (data_ != nullptr) DeleteAligned<char, kDirectIoAlignment>(data_, size_);
+}
+
 }  // namespace internal
 
 inline OwnedFd::OwnedFd(OwnedFd&& that) noexcept
@@ -12,10 +12,15 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 
-// Make `pread()` available.
-#if !defined(_XOPEN_SOURCE) || _XOPEN_SOURCE < 500
+// Make `pread()` and `posix_fadvise()` available.
+#if !defined(_XOPEN_SOURCE) || _XOPEN_SOURCE < 600
 #undef _XOPEN_SOURCE
-#define _XOPEN_SOURCE 500
+#define _XOPEN_SOURCE 600
+#endif
+
+// Make `O_DIRECT` available.
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
 #endif
 
 // Make `off_t` 64-bit even on 32-bit systems.
@@ -25,29 +30,41 @@
 #include "riegeli/bytes/fd_reader.h"
 
 #include <fcntl.h>
+#include <limits.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
 #include <cerrno>
+#include <cstring>
+#include <future>
 #include <limits>
+#include <memory>
 #include <string>
 #include <tuple>
+#include <utility>
+#include <vector>
 
 #include "absl/base/optimization.h"
 #include "absl/strings/str_cat.h"
 #include "absl/strings/string_view.h"
 #include "absl/types/optional.h"
 #include "riegeli/base/base.h"
+#include "riegeli/base/buffer.h"
 #include "riegeli/base/canonical_errors.h"
 #include "riegeli/base/chain.h"
 #include "riegeli/base/errno_mapping.h"
 #include "riegeli/base/memory_estimator.h"
+#include "riegeli/base/parallelism.h"
 #include "riegeli/base/status.h"
 #include "riegeli/bytes/chain_reader.h"
+#include "riegeli/bytes/fd_dependency.h"
+#include "riegeli/bytes/fd_writer.h"
+#include "riegeli/bytes/writer.h"
 
 namespace riegeli {
 
@@ -74,6 +91,54 @@ void MMapRef::RegisterSubobjects(MemoryEstimator* memory_estimator) const {}
 
 void MMapRef::DumpStructure(std::ostream& out) const { out << "[mmap] { }"; }
 
+// Owns a mapped file divided into several `ChainBlock`s.
+class MMapRegion {
+ public:
+  explicit MMapRegion(absl::string_view data) noexcept : data_(data) {}
+
+  MMapRegion(const MMapRegion&) = delete;
+  MMapRegion& operator=(const MMapRegion&) = delete;
+
+  ~MMapRegion();
+
+ private:
+  absl::string_view data_;
+};
+
+MMapRegion::~MMapRegion() {
+  RIEGELI_CHECK_EQ(munmap(const_cast<char*>(data_.data()), data_.size()), 0)
+      << ErrnoToCanonicalStatus(errno, "munmap() failed").message();
+}
+
+// Refers to a part of a mapped file owned by a shared `MMapRegion`.
+class MMapWindowRef {
+ public:
+  explicit MMapWindowRef(std::shared_ptr<const MMapRegion> region) noexcept
+      : region_(std::move(region)) {}
+
+  MMapWindowRef(const MMapWindowRef&) = delete;
+  MMapWindowRef& operator=(const MMapWindowRef&) = delete;
+
+  void operator()(absl::string_view data) const {}
+  void RegisterSubobjects(MemoryEstimator* memory_estimator) const {}
+  void DumpStructure(std::ostream& out) const { out << "[mmap] { }"; }
+
+ private:
+  std::shared_ptr<const MMapRegion> region_;
+};
+
+// Hints that `length` bytes at `pos` of `src` will be read soon. Failures of
+// `posix_fadvise()` are ignored because the advice does not affect the data
+// being read.
+void AdviseWillNeed(int src, Position pos, Position length) {
+  constexpr Position kMaxOffset =
+      Position{std::numeric_limits<off_t>::max()};
+  if (ABSL_PREDICT_FALSE(pos >= kMaxOffset) || length == 0) return;
+  posix_fadvise(src, IntCast<off_t>(pos),
+                IntCast<off_t>(UnsignedMin(length, kMaxOffset - pos)),
+                POSIX_FADV_WILLNEED);
+}
+
 }  // namespace
 
 namespace internal {
@@ -130,6 +195,37 @@ void FdReaderBase::InitializePos(int src,
   }
 }
 
+void FdReaderBase::InitializeDirectIo(int src) {
+  if (!direct_io_) return;
+#ifdef O_DIRECT
+  const int flags = fcntl(src, F_GETFL);
+  if (ABSL_PREDICT_FALSE(flags < 0)) {
+    FailOperation("fcntl()");
+    return;
+  }
+  if ((flags & O_DIRECT) == 0 &&
+      ABSL_PREDICT_FALSE(fcntl(src, F_SETFL, flags | O_DIRECT) < 0)) {
+    FailOperation("fcntl()");
+  }
+#else
+  Fail(UnimplementedError("O_DIRECT is not supported on this platform"));
+#endif
+}
+
+void FdReaderBase::InitializeBufferSize(int src) {
+  if (max_buffer_size_ <= read_ahead_length_) return;
+  struct stat stat_info;
+  if (ABSL_PREDICT_FALSE(fstat(src, &stat_info) < 0)) {
+    FailOperation("fstat()");
+    return;
+  }
+  if (stat_info.st_blksize > 0 &&
+      IntCast<size_t>(stat_info.st_blksize) > read_ahead_length_) {
+    set_buffer_size(
+        UnsignedMin(IntCast<size_t>(stat_info.st_blksize), max_buffer_size_));
+  }
+}
+
 void FdReaderBase::SyncPos(int src) {
   if (sync_pos_) {
     if (ABSL_PREDICT_FALSE(lseek(src, IntCast<off_t>(pos()), SEEK_SET) < 0)) {
@@ -154,6 +250,8 @@ bool FdReaderBase::ReadInternal(char* dest, size_t min_length,
                              limit_pos_)) {
     return FailOverflow();
   }
+  if (direct_io_) return ReadDirect(dest, min_length, max_length);
+  if (parallelism_ > 0) return ReadFromReadAhead(dest, min_length, max_length);
   for (;;) {
   again:
     const ssize_t length_read = pread(
@@ -175,6 +273,251 @@ bool FdReaderBase::ReadInternal(char* dest, size_t min_length,
   }
 }
 
+bool FdReaderBase::ReadFromReadAhead(char* dest, size_t min_length,
+                                     size_t max_length) {
+  for (;;) {
+    if (current_.length == 0 || limit_pos_ < current_pos_ ||
+        limit_pos_ >= current_pos_ + current_.length) {
+      if (!read_ahead_.empty() && read_ahead_.front().pos != limit_pos_) {
+        // Reading is not sequential, or a block was read partially.
+        CancelReadAhead();
+      }
+      ScheduleReadAhead(src_fd());
+      ReadAheadRequest& request = read_ahead_.front();
+      current_pos_ = request.pos;
+      current_ = request.block.get();
+      read_ahead_.pop_front();
+      if (ABSL_PREDICT_FALSE(current_.error_number != 0)) {
+        const int error_number = current_.error_number;
+        CancelReadAhead();
+        errno = error_number;
+        return FailOperation("pread()");
+      }
+      if (ABSL_PREDICT_FALSE(current_.length == 0)) {
+        // The file ends. Blocks read ahead beyond this are not useful, and the
+        // file might grow before it is read again.
+        CancelReadAhead();
+        return false;
+      }
+    }
+    const size_t offset = IntCast<size_t>(limit_pos_ - current_pos_);
+    const size_t length_read =
+        UnsignedMin(current_.length - offset, max_length);
+    std::memcpy(dest, current_.data.GetData() + offset, length_read);
+    limit_pos_ += length_read;
+    if (length_read >= min_length) return true;
+    dest += length_read;
+    min_length -= length_read;
+    max_length -= length_read;
+  }
+}
+
+bool FdReaderBase::ReadDirect(char* dest, size_t min_length,
+                              size_t max_length) {
+  char* const buffer = direct_buffer_.GetData();
+  for (;;) {
+    if (limit_pos_ < direct_pos_ ||
+        limit_pos_ >= direct_pos_ + direct_length_) {
+      // Read whole blocks beginning with the block containing `limit_pos_`.
+      const int src = src_fd();
+      direct_pos_ = RoundDown<internal::kDirectIoAlignment>(limit_pos_);
+      direct_length_ = 0;
+      while (direct_length_ < direct_buffer_.size()) {
+        const ssize_t length_read =
+            pread(src, buffer + direct_length_,
+                  direct_buffer_.size() - direct_length_,
+                  IntCast<off_t>(direct_pos_ + direct_length_));
+        if (ABSL_PREDICT_FALSE(length_read < 0)) {
+          if (errno == EINTR) continue;
+          return FailOperation("pread()");
+        }
+        if (length_read == 0) break;
+        direct_length_ += IntCast<size_t>(length_read);
+        if (direct_length_ % internal::kDirectIoAlignment != 0) {
+          // A partial block can be read only at the end of the file.
+          break;
+        }
+      }
+      if (ABSL_PREDICT_FALSE(limit_pos_ >= direct_pos_ + direct_length_)) {
+        // The file ends.
+        return false;
+      }
+    }
+    const size_t offset = IntCast<size_t>(limit_pos_ - direct_pos_);
+    const size_t length_read = UnsignedMin(direct_length_ - offset, max_length);
+    std::memcpy(dest, buffer + offset, length_read);
+    limit_pos_ += length_read;
+    if (length_read >= min_length) return true;
+    dest += length_read;
+    min_length -= length_read;
+    max_length -= length_read;
+  }
+}
+
+bool FdReaderBase::ReadSlow(Chain* dest, size_t length) {
+  RIEGELI_ASSERT_GT(length, UnsignedMin(available(), kMaxBytesToCopy))
+      << "Failed precondition of Reader::ReadSlow(Chain*): "
+         "length too small, use Read(Chain*) instead";
+  RIEGELI_ASSERT_LE(length, std::numeric_limits<size_t>::max() - dest->size())
+      << "Failed precondition of Reader::ReadSlow(Chain*): "
+         "Chain size overflow";
+#if defined(__linux__) && defined(IOV_MAX)
+  if (direct_io_ || parallelism_ > 0 || !healthy() || length <= available() ||
+      length - available() < UnsignedMax(read_ahead_length_, kMaxBufferSize)) {
+    return BufferedReader::ReadSlow(dest, length);
+  }
+  // Take buffered data, then read the rest directly into new blocks of
+  // `*dest` with a single `preadv()`, instead of reading through the buffer.
+  const size_t available_length = available();
+  if (available_length > 0) {
+    if (ABSL_PREDICT_FALSE(!Read(dest, available_length))) return false;
+    length -= available_length;
+  }
+  ClearBuffer();
+  if (ABSL_PREDICT_FALSE(length >
+                         Position{std::numeric_limits<off_t>::max()} -
+                             limit_pos_)) {
+    return FailOverflow();
+  }
+  // Blocks are bounded to avoid a single huge allocation, and large enough to
+  // keep the number of `iovec`s small.
+  constexpr size_t kBlockSize = size_t{1} << 20;
+  std::vector<iovec> iov;
+  iov.reserve((length - 1) / kBlockSize + 1);
+  for (size_t remaining = length; remaining > 0;) {
+    const absl::Span<char> flat_buffer =
+        dest->AppendFixedBuffer(UnsignedMin(remaining, kBlockSize));
+    iov.push_back(iovec{flat_buffer.data(), flat_buffer.size()});
+    remaining -= flat_buffer.size();
+  }
+  const int src = src_fd();
+  size_t length_read = 0;
+  size_t iov_index = 0;
+  while (length_read < length) {
+    const ssize_t result =
+        preadv(src, &iov[iov_index],
+               IntCast<int>(UnsignedMin(iov.size() - iov_index,
+                                        size_t{IOV_MAX})),
+               IntCast<off_t>(limit_pos_));
+    if (ABSL_PREDICT_FALSE(result <= 0)) {
+      if (result < 0 && errno == EINTR) continue;
+      dest->RemoveSuffix(length - length_read);
+      if (result < 0) return FailOperation("preadv()");
+      return false;
+    }
+    size_t remaining = IntCast<size_t>(result);
+    RIEGELI_ASSERT_LE(remaining, length - length_read)
+        << "preadv() read more than requested";
+    length_read += remaining;
+    limit_pos_ += remaining;
+    while (remaining > 0) {
+      if (remaining < iov[iov_index].iov_len) {
+        iov[iov_index].iov_base =
+            static_cast<char*>(iov[iov_index].iov_base) + remaining;
+        iov[iov_index].iov_len -= remaining;
+        break;
+      }
+      remaining -= iov[iov_index].iov_len;
+      ++iov_index;
+    }
+  }
+  return true;
+#else
+  return BufferedReader::ReadSlow(dest, length);
+#endif
+}
+
+bool FdReaderBase::CopyToSlow(Writer* dest, Position length) {
+  RIEGELI_ASSERT_GT(length, UnsignedMin(available(), kMaxBytesToCopy))
+      << "Failed precondition of Reader::CopyToSlow(Writer*): "
+         "length too small, use CopyTo(Writer*) instead";
+  if (direct_io_ || parallelism_ > 0 || !healthy() || length <= available() ||
+      length - available() < UnsignedMax(read_ahead_length_, kMaxBufferSize) ||
+      dest->GetTypeId() != TypeId::For<internal::FdWriterCommon>()) {
+    return BufferedReader::CopyToSlow(dest, length);
+  }
+  // Write buffered data, then let the kernel copy the rest from fd to fd,
+  // instead of reading and writing it through buffers.
+  const size_t available_length = available();
+  if (available_length > 0) {
+    const absl::string_view data(cursor_, available_length);
+    cursor_ = limit_;
+    if (ABSL_PREDICT_FALSE(!dest->Write(data))) return false;
+    length -= available_length;
+  }
+  ClearBuffer();
+  if (ABSL_PREDICT_FALSE(length >
+                         Position{std::numeric_limits<off_t>::max()} -
+                             limit_pos_)) {
+    return FailOverflow();
+  }
+  internal::FdWriterCommon* const fd_dest =
+      static_cast<internal::FdWriterCommon*>(dest);
+  const Position length_copied =
+      fd_dest->CopyFromFd(src_fd(), limit_pos_, length);
+  RIEGELI_ASSERT_LE(length_copied, length)
+      << "FdWriterCommon::CopyFromFd() copied more than requested";
+  limit_pos_ += length_copied;
+  if (ABSL_PREDICT_FALSE(!dest->healthy())) return false;
+  if (length_copied == length) return true;
+  // Copy the rest in the usual way, which also detects the end of the source.
+  return BufferedReader::CopyToSlow(dest, length - length_copied);
+}
+
+void FdReaderBase::ScheduleReadAhead(int src) {
+  Position pos = read_ahead_.empty()
+                     ? limit_pos_
+                     : read_ahead_.back().pos + read_ahead_length_;
+  while (read_ahead_.size() < IntCast<size_t>(parallelism_)) {
+    const size_t length = UnsignedMin(
+        read_ahead_length_, Position{std::numeric_limits<off_t>::max()} - pos);
+    if (ABSL_PREDICT_FALSE(length == 0)) break;
+    std::promise<ReadAheadBlock>* const promise =
+        new std::promise<ReadAheadBlock>();
+    read_ahead_.push_back(ReadAheadRequest{pos, promise->get_future()});
+    ThreadPool::global().Schedule([src, pos, length, promise] {
+      ReadAheadBlock block;
+      block.data = Buffer(length);
+      char* const data = block.data.GetData();
+      while (block.length < length) {
+        const ssize_t length_read = pread(
+            src, data + block.length,
+            UnsignedMin(length - block.length,
+                        size_t{std::numeric_limits<ssize_t>::max()}),
+            IntCast<off_t>(pos + block.length));
+        if (ABSL_PREDICT_FALSE(length_read < 0)) {
+          if (errno == EINTR) continue;
+          // If some data were read, they are returned, and the failure will be
+          // reported by reading the remaining data again.
+          if (block.length == 0) block.error_number = errno;
+          break;
+        }
+        if (length_read == 0) break;
+        block.length += IntCast<size_t>(length_read);
+      }
+      promise->set_value(std::move(block));
+      delete promise;
+    });
+    pos += length;
+  }
+  RIEGELI_ASSERT(!read_ahead_.empty())
+      << "Failed postcondition of FdReaderBase::ScheduleReadAhead(): "
+         "nothing scheduled";
+}
+
+void FdReaderBase::CancelReadAhead() {
+  // Background reads refer to the fd, which must not be closed while they are
+  // in flight.
+  for (ReadAheadRequest& request : read_ahead_) request.block.wait();
+  read_ahead_.clear();
+  current_ = ReadAheadBlock();
+}
+
+void FdReaderBase::Done() {
+  CancelReadAhead();
+  FdReaderCommon::Done();
+}
+
 bool FdReaderBase::SeekSlow(Position new_pos) {
   RIEGELI_ASSERT(new_pos < start_pos() || new_pos > limit_pos_)
       << "Failed precondition of Reader::SeekSlow(): "
@@ -209,6 +552,11 @@ bool FdReaderBase::Size(Position* size) {
   return true;
 }
 
+void FdReaderBase::Prefetch(Position pos, Position length) {
+  if (ABSL_PREDICT_FALSE(!healthy())) return;
+  AdviseWillNeed(src_fd(), pos, length);
+}
+
 bool FdStreamReaderBase::ReadInternal(char* dest, size_t min_length,
                                       size_t max_length) {
   RIEGELI_ASSERT_GT(min_length, 0u)
@@ -289,19 +637,49 @@ void FdMMapReaderBase::InitializePos(int src,
     return;
   }
   if (stat_info.st_size == 0) return;
-  void* const data = mmap(nullptr, IntCast<size_t>(stat_info.st_size),
-                          PROT_READ, MAP_SHARED, src, 0);
+  const size_t size = IntCast<size_t>(stat_info.st_size);
+  int flags = MAP_SHARED;
+#ifdef MAP_POPULATE
+  if (populate_) flags |= MAP_POPULATE;
+#endif
+  void* const data = mmap(nullptr, size, PROT_READ, flags, src, 0);
   if (ABSL_PREDICT_FALSE(data == MAP_FAILED)) {
     FailOperation("mmap()");
     return;
   }
+  // Failures of `madvise()` are ignored because the advice does not affect
+  // the data being read.
+  if (sequential_) madvise(data, size, MADV_SEQUENTIAL);
+#ifdef MADV_HUGEPAGE
+  if (huge_pages_) madvise(data, size, MADV_HUGEPAGE);
+#endif
   // `FdMMapReaderBase` derives from `ChainReader<Chain>` but the `Chain` to
   // read from was not known in `FdMMapReaderBase` constructor. This sets the
   // `Chain` and updates the `ChainReader` to read from it.
-  ChainReader::Reset(std::forward_as_tuple(ChainBlock::FromExternal<MMapRef>(
-      std::forward_as_tuple(),
-      absl::string_view(static_cast<const char*>(data),
-                        IntCast<size_t>(stat_info.st_size)))));
+  if (prefetch_window_ == 0) {
+    ChainReader::Reset(std::forward_as_tuple(ChainBlock::FromExternal<MMapRef>(
+        std::forward_as_tuple(),
+        absl::string_view(static_cast<const char*>(data), size))));
+  } else {
+    // Round the window up to a multiple of the page size, so that windows
+    // can be passed to `madvise()`.
+    const size_t page_size = IntCast<size_t>(sysconf(_SC_PAGESIZE));
+    prefetch_window_ =
+        (UnsignedMin(prefetch_window_, size) + page_size - 1) / page_size *
+        page_size;
+    mapped_data_ = static_cast<const char*>(data);
+    mapped_size_ = size;
+    const auto region = std::make_shared<const MMapRegion>(
+        absl::string_view(mapped_data_, size));
+    Chain windows;
+    for (size_t window = 0; window < size; window += prefetch_window_) {
+      windows.Append(ChainBlock::FromExternal<MMapWindowRef>(
+          std::forward_as_tuple(region),
+          absl::string_view(mapped_data_ + window,
+                            UnsignedMin(prefetch_window_, size - window))));
+    }
+    ChainReader::Reset(std::forward_as_tuple(std::move(windows)));
+  }
   if (initial_pos.has_value()) {
     cursor_ += UnsignedMin(*initial_pos, available());
   } else {
@@ -312,6 +690,55 @@ void FdMMapReaderBase::InitializePos(int src,
     }
     cursor_ += UnsignedMin(IntCast<Position>(file_pos), available());
   }
+  if (mapped_data_ != nullptr) {
+    advised_window_ = IntCast<size_t>(pos()) / prefetch_window_ *
+                      prefetch_window_;
+    AdviseWindows();
+  }
+}
+
+bool FdMMapReaderBase::PullSlow(size_t min_length,
+                                size_t recommended_length) {
+  const bool ok = ChainReader::PullSlow(min_length, recommended_length);
+  if (mapped_data_ != nullptr && ABSL_PREDICT_TRUE(healthy())) {
+    AdviseWindows();
+  }
+  return ok;
+}
+
+bool FdMMapReaderBase::SeekSlow(Position new_pos) {
+  const bool ok = ChainReader::SeekSlow(new_pos);
+  if (mapped_data_ != nullptr && ABSL_PREDICT_TRUE(healthy())) {
+    AdviseWindows();
+  }
+  return ok;
+}
+
+void FdMMapReaderBase::AdviseWindows() {
+  const size_t current_pos = IntCast<size_t>(UnsignedMin(pos(), mapped_size_));
+  const size_t current_window =
+      current_pos / prefetch_window_ * prefetch_window_;
+  // Failures of `madvise()` and `posix_fadvise()` are ignored because the
+  // advice does not affect the data being read.
+  if (drop_behind_ && current_window > advised_window_) {
+    madvise(const_cast<char*>(mapped_data_ + advised_window_),
+            current_window - advised_window_, MADV_DONTNEED);
+    posix_fadvise(src_fd(), IntCast<off_t>(advised_window_),
+                  IntCast<off_t>(current_window - advised_window_),
+                  POSIX_FADV_DONTNEED);
+  }
+  advised_window_ = current_window;
+  const size_t next_window = current_window + prefetch_window_;
+  if (next_window < mapped_size_) {
+    madvise(const_cast<char*>(mapped_data_ + next_window),
+            UnsignedMin(prefetch_window_, mapped_size_ - next_window),
+            MADV_WILLNEED);
+  }
+}
+
+void FdMMapReaderBase::Prefetch(Position pos, Position length) {
+  if (ABSL_PREDICT_FALSE(!healthy())) return;
+  AdviseWillNeed(src_fd(), pos, length);
 }
 
 void FdMMapReaderBase::SyncPos(int src) {
@@ -18,6 +18,8 @@
 #include <fcntl.h>
 #include <stddef.h>
 
+#include <deque>
+#include <future>
 #include <string>
 #include <tuple>
 #include <utility>
@@ -27,6 +29,7 @@
 #include "absl/strings/string_view.h"
 #include "absl/types/optional.h"
 #include "riegeli/base/base.h"
+#include "riegeli/base/buffer.h"
 #include "riegeli/base/chain.h"
 #include "riegeli/base/dependency.h"
 #include "riegeli/base/resetter.h"
@@ -105,37 +108,161 @@ class FdReaderBase : public internal::FdReaderCommon {
       return std::move(set_buffer_size(buffer_size));
     }
 
+    // If greater than `buffer_size()`, the buffer size adapts to the access
+    // pattern: while reading is sequential, it doubles with each refill up to
+    // `max_buffer_size()`, and after a seek it returns to `buffer_size()`. The
+    // buffer starts at the block size reported by `fstat()` if that is larger
+    // than `buffer_size()`.
+    //
+    // Ignored if `parallelism() > 0` or `direct_io()`.
+    //
+    // Default: 0 (the buffer size is fixed)
+    Options& set_max_buffer_size(size_t max_buffer_size) & {
+      max_buffer_size_ = max_buffer_size;
+      return *this;
+    }
+    Options&& set_max_buffer_size(size_t max_buffer_size) && {
+      return std::move(set_max_buffer_size(max_buffer_size));
+    }
+
+    // If 0, data are read synchronously with `pread()` when requested.
+    //
+    // If greater than 0, up to this many blocks of `buffer_size()` following
+    // the current position are read ahead in parallel in background threads.
+    // This keeps several reads in flight, which improves throughput of storage
+    // with high latency, at the cost of memory and of reading data which might
+    // not be needed. Reading ahead assumes mostly sequential access: seeking
+    // outside of the data read ahead discards them.
+    //
+    // Default: 0
+    Options& set_parallelism(int parallelism) & {
+      RIEGELI_ASSERT_GE(parallelism, 0)
+          << "Failed precondition of FdReaderBase::Options::set_parallelism(): "
+             "negative parallelism";
+      parallelism_ = parallelism;
+      return *this;
+    }
+    Options&& set_parallelism(int parallelism) && {
+      return std::move(set_parallelism(parallelism));
+    }
+
+    // If `true`, the file is read with `O_DIRECT`, bypassing the page cache.
+    // `O_DIRECT` is set with `fcntl()` on the fd after opening it, or on the fd
+    // given to the constructor.
+    //
+    // Data are read in whole blocks of 4096 bytes into a buffer aligned to 4096
+    // bytes, of `buffer_size()` rounded up to a multiple of 4096, and copied
+    // from there. `parallelism()` is ignored.
+    //
+    // Default: `false`
+    Options& set_direct_io(bool direct_io) & {
+      direct_io_ = direct_io;
+      return *this;
+    }
+    Options&& set_direct_io(bool direct_io) && {
+      return std::move(set_direct_io(direct_io));
+    }
+
    private:
     template <typename Src>
     friend class FdReader;
 
     absl::optional<Position> initial_pos_;
     size_t buffer_size_ = kDefaultBufferSize;
+    size_t max_buffer_size_ = 0;
+    int parallelism_ = 0;
+    bool direct_io_ = false;
   };
 
   bool SupportsRandomAccess() const override { return true; }
   bool Size(Position* size) override;
+  // Uses `posix_fadvise(POSIX_FADV_WILLNEED)`.
+  void Prefetch(Position pos, Position length) override;
 
  protected:
   FdReaderBase() noexcept {}
 
-  explicit FdReaderBase(size_t buffer_size, bool sync_pos);
+  explicit FdReaderBase(size_t buffer_size, size_t max_buffer_size,
+                        bool sync_pos, int parallelism, bool direct_io);
 
   FdReaderBase(FdReaderBase&& that) noexcept;
   FdReaderBase& operator=(FdReaderBase&& that) noexcept;
 
   void Reset();
-  void Reset(size_t buffer_size, bool sync_pos);
+  void Reset(size_t buffer_size, size_t max_buffer_size, bool sync_pos,
+             int parallelism, bool direct_io);
   void Initialize(int src, absl::optional<Position> initial_pos);
+  // Raises the starting buffer size to the block size of `src` if the buffer
+  // size adapts to the access pattern.
+  void InitializeBufferSize(int src);
   void InitializePos(int src, absl::optional<Position> initial_pos);
+  // Sets `O_DIRECT` on `src` if `direct_io_`.
+  void InitializeDirectIo(int src);
   void SyncPos(int src);
+  // Waits for blocks being read ahead and discards them, together with
+  // `current_`.
+  void CancelReadAhead();
 
+  void Done() override;
   bool ReadInternal(char* dest, size_t min_length, size_t max_length) override;
+  using BufferedReader::ReadSlow;
+  bool ReadSlow(Chain* dest, size_t length) override;
+  using BufferedReader::CopyToSlow;
+  bool CopyToSlow(Writer* dest, Position length) override;
   bool SeekSlow(Position new_pos) override;
 
   bool sync_pos_ = false;
 
   // Invariant: `limit_pos_ <= std::numeric_limits<off_t>::max()`
+
+ private:
+  // Result of reading a block ahead in the background.
+  struct ReadAheadBlock {
+    Buffer data;
+    // The length read, 0 at end of file.
+    size_t length = 0;
+    // If not 0, reading failed with this `errno` value.
+    int error_number = 0;
+  };
+
+  struct ReadAheadRequest {
+    Position pos;
+    std::future<ReadAheadBlock> block;
+  };
+
+  // Implements `ReadInternal()` if `parallelism_ > 0`.
+  bool ReadFromReadAhead(char* dest, size_t min_length, size_t max_length);
+
+  // Schedules reading blocks following the last block being read ahead, or
+  // following `limit_pos_` if nothing is being read ahead, until `parallelism_`
+  // blocks are being read ahead.
+  void ScheduleReadAhead(int src);
+
+  // The buffer size from `Options`, also the length of blocks read ahead.
+  size_t read_ahead_length_ = 0;
+  // If greater than `read_ahead_length_`, the buffer size adapts to the access
+  // pattern up to this size.
+  size_t max_buffer_size_ = 0;
+  int parallelism_ = 0;
+  // Blocks being read ahead, in the order of positions, each beginning where
+  // the previous one ends.
+  std::deque<ReadAheadRequest> read_ahead_;
+  // The block read ahead which is being consumed, beginning at `current_pos_`.
+  //
+  // Invariant: if `current_.length > 0` then
+  //            `current_pos_ <= limit_pos_ <= current_pos_ + current_.length`
+  ReadAheadBlock current_;
+  Position current_pos_ = 0;
+
+  // Implements `ReadInternal()` if `direct_io_`.
+  bool ReadDirect(char* dest, size_t min_length, size_t max_length);
+
+  bool direct_io_ = false;
+  // Data read with `O_DIRECT`, beginning at `direct_pos_`, which is a multiple
+  // of `internal::kDirectIoAlignment`.
+  internal::DirectIoBuffer direct_buffer_;
+  Position direct_pos_ = 0;
+  size_t direct_length_ = 0;
 };
 
 // Template parameter independent part of `FdStreamReader`.
@@ -221,11 +348,89 @@ class FdMMapReaderBase : public ChainReader<Chain> {
       return std::move(set_initial_pos(initial_pos));
     }
 
+    // If `true`, the whole file is read into memory by `mmap()`
+    // (`MAP_POPULATE`), avoiding page faults later at the cost of reading the
+    // file at once. Ignored where `MAP_POPULATE` is not available.
+    //
+    // Default: `false`
+    Options& set_populate(bool populate) & {
+      populate_ = populate;
+      return *this;
+    }
+    Options&& set_populate(bool populate) && {
+      return std::move(set_populate(populate));
+    }
+
+    // If `true`, the file is expected to be read sequentially
+    // (`MADV_SEQUENTIAL`), which makes the kernel read ahead aggressively and
+    // free pages soon after they are read.
+    //
+    // Default: `false`
+    Options& set_sequential(bool sequential) & {
+      sequential_ = sequential;
+      return *this;
+    }
+    Options&& set_sequential(bool sequential) && {
+      return std::move(set_sequential(sequential));
+    }
+
+    // If `true`, the mapping is backed by huge pages where the kernel and the
+    // filesystem support this (`MADV_HUGEPAGE`), which reduces the number of
+    // page faults and TLB misses.
+    //
+    // Default: `false`
+    Options& set_huge_pages(bool huge_pages) & {
+      huge_pages_ = huge_pages;
+      return *this;
+    }
+    Options&& set_huge_pages(bool huge_pages) && {
+      return std::move(set_huge_pages(huge_pages));
+    }
+
+    // If positive, the file is divided into windows of this size (rounded up
+    // to the page size), and when reading enters a window, the next window is
+    // prefetched (`MADV_WILLNEED`).
+    //
+    // Windows are separate blocks of the `Chain` being read, so a read crossing
+    // a window boundary might need to copy data.
+    //
+    // Default: 0 (no prefetching)
+    Options& set_prefetch_window(size_t prefetch_window) & {
+      prefetch_window_ = prefetch_window;
+      return *this;
+    }
+    Options&& set_prefetch_window(size_t prefetch_window) && {
+      return std::move(set_prefetch_window(prefetch_window));
+    }
+
+    // If `true`, when reading enters a window after a preceding window, pages
+    // of windows behind the current one are released from the mapping
+    // (`MADV_DONTNEED`) and from the page cache (`POSIX_FADV_DONTNEED`). This
+    // bounds memory used by a streaming scan of a large file. Data are read
+    // again if a released part is accessed later.
+    //
+    // Has no effect unless `set_prefetch_window()` is positive.
+    //
+    // Default: `false`
+    Options& set_drop_behind(bool drop_behind) & {
+      drop_behind_ = drop_behind;
+      return *this;
+    }
+    Options&& set_drop_behind(bool drop_behind) && {
+      return std::move(set_drop_behind(drop_behind));
+    }
+
    private:
+    friend class FdMMapReaderBase;
     template <typename Src>
     friend class FdMMapReader;
 
     absl::optional<Position> initial_pos_;
+    bool populate_ = false;
+    bool sequential_ = false;
+    bool huge_pages_ = false;
+    size_t prefetch_window_ = 0;
+    bool drop_behind_ = false;
   };
 
   // Returns the fd being read from. If the fd is owned then changed to -1 by
@@ -236,16 +441,22 @@ class FdMMapReaderBase : public ChainReader<Chain> {
   // "/proc/self/fd/<fd>" if fd was given). Unchanged by `Close()`.
   const std::string& filename() const { return filename_; }
 
+  // `PullSlow()` is overridden, so `ChainReaderBase::Pull()` does not apply.
+  using Reader::Pull;
+
+  // Uses `posix_fadvise(POSIX_FADV_WILLNEED)`.
+  void Prefetch(Position pos, Position length) override;
+
  protected:
   FdMMapReaderBase() noexcept {}
 
-  explicit FdMMapReaderBase(bool sync_pos);
+  explicit FdMMapReaderBase(bool sync_pos, const Options& options);
 
   FdMMapReaderBase(FdMMapReaderBase&& that) noexcept;
   FdMMapReaderBase& operator=(FdMMapReaderBase&& that) noexcept;
 
   void Reset();
-  void Reset(bool sync_pos);
+  void Reset(bool sync_pos, const Options& options);
   void Initialize(int src, absl::optional<Position> initial_pos);
   void SetFilename(int src);
   int OpenFd(absl::string_view filename, int flags);
@@ -253,8 +464,29 @@ class FdMMapReaderBase : public ChainReader<Chain> {
   void InitializePos(int src, absl::optional<Position> initial_pos);
   void SyncPos(int src);
 
+  bool PullSlow(size_t min_length, size_t recommended_length) override;
+  bool SeekSlow(Position new_pos) override;
+
   std::string filename_;
   bool sync_pos_ = false;
+  bool populate_ = false;
+  bool sequential_ = false;
+  bool huge_pages_ = false;
+  size_t prefetch_window_ = 0;
+  bool drop_behind_ = false;
+
+ private:
+  // Prefetches the window after the window containing the current position,
+  // and releases windows behind it if `drop_behind_`.
+  void AdviseWindows();
+
+  // The beginning of the mapped file, or `nullptr` if nothing is mapped or
+  // windows are not used.
+  const char* mapped_data_ = nullptr;
+  // The size of the mapped file.
+  size_t mapped_size_ = 0;
+  // The beginning of the window for which `AdviseWindows()` was last called.
+  size_t advised_window_ = 0;
 };
 
 // A `Reader` which reads from a file descriptor. It supports random access.
@@ -303,6 +535,10 @@ class FdReader : public FdReaderBase {
   FdReader(FdReader&& that) noexcept;
   FdReader& operator=(FdReader&& that) noexcept;
 
+  // Waits for blocks being read ahead if the `FdReader` was not closed, before
+  // the fd can be closed.
+  ~FdReader();
+
   // Makes `*this` equivalent to a newly constructed `FdReader`. This avoids
   // constructing a temporary `FdReader` and moving from it.
   void Reset();
@@ -424,6 +660,9 @@ class FdStreamReader : public FdStreamReaderBase {
 // possibly owning the fd being read from. `Src` must support
 // `Dependency<int, Src>`, e.g. `OwnedFd` (owned, default), `int` (not owned).
 //
+// Reading to a `Chain` shares the mapped memory instead of copying it, except
+// for short lengths.
+//
 // The fd must not be closed until the `FdMMapReader` is closed or no longer
 // used. `File` contents must not be changed while data read from the file is
 // accessed without a memory copy.
@@ -517,26 +756,77 @@ inline void FdReaderCommon::Reset(size_t buffer_size) {
 
 }  // namespace internal
 
-inline FdReaderBase::FdReaderBase(size_t buffer_size, bool sync_pos)
-    : FdReaderCommon(buffer_size), sync_pos_(sync_pos) {}
+inline FdReaderBase::FdReaderBase(size_t buffer_size, size_t max_buffer_size,
+                                  bool sync_pos, int parallelism,
+                                  bool direct_io)
+    : FdReaderCommon(buffer_size),
+      sync_pos_(sync_pos),
+      read_ahead_length_(buffer_size),
+      max_buffer_size_(parallelism > 0 || direct_io ? 0 : max_buffer_size),
+      parallelism_(parallelism),
+      direct_io_(direct_io),
+      direct_buffer_(direct_io ? buffer_size : 0) {
+  set_max_buffer_size(max_buffer_size_);
+}
 
 inline FdReaderBase::FdReaderBase(FdReaderBase&& that) noexcept
-    : FdReaderCommon(std::move(that)), sync_pos_(that.sync_pos_) {}
+    : FdReaderCommon(std::move(that)),
+      sync_pos_(that.sync_pos_),
+      read_ahead_length_(that.read_ahead_length_),
+      max_buffer_size_(that.max_buffer_size_),
+      parallelism_(that.parallelism_),
+      read_ahead_(std::move(that.read_ahead_)),
+      current_(std::move(that.current_)),
+      current_pos_(that.current_pos_),
+      direct_io_(that.direct_io_),
+      direct_buffer_(std::move(that.direct_buffer_)),
+      direct_pos_(that.direct_pos_),
+      direct_length_(std::exchange(that.direct_length_, 0)) {}
 
 inline FdReaderBase& FdReaderBase::operator=(FdReaderBase&& that) noexcept {
+  CancelReadAhead();
   FdReaderCommon::operator=(std::move(that));
   sync_pos_ = that.sync_pos_;
+  read_ahead_length_ = that.read_ahead_length_;
+  max_buffer_size_ = that.max_buffer_size_;
+  parallelism_ = that.parallelism_;
+  read_ahead_ = std::move(that.read_ahead_);
+  current_ = std::move(that.current_);
+  current_pos_ = that.current_pos_;
+  direct_io_ = that.direct_io_;
+  direct_buffer_ = std::move(that.direct_buffer_);
+  direct_pos_ = that.direct_pos_;
+  direct_length_ = std::exchange(that.direct_length_, 0);
   return *this;
 }
 
 inline void FdReaderBase::Reset() {
+  CancelReadAhead();
   FdReaderCommon::Reset();
   sync_pos_ = false;
+  read_ahead_length_ = 0;
+  max_buffer_size_ = 0;
+  parallelism_ = 0;
+  direct_io_ = false;
+  direct_buffer_ = internal::DirectIoBuffer();
+  direct_pos_ = 0;
+  direct_length_ = 0;
 }
 
-inline void FdReaderBase::Reset(size_t buffer_size, bool sync_pos) {
+inline void FdReaderBase::Reset(size_t buffer_size, size_t max_buffer_size,
+                                bool sync_pos, int parallelism,
+                                bool direct_io) {
+  CancelReadAhead();
   FdReaderCommon::Reset(buffer_size);
   sync_pos_ = sync_pos;
+  read_ahead_length_ = buffer_size;
+  max_buffer_size_ = parallelism > 0 || direct_io ? 0 : max_buffer_size;
+  set_max_buffer_size(max_buffer_size_);
+  parallelism_ = parallelism;
+  direct_io_ = direct_io;
+  direct_buffer_ = internal::DirectIoBuffer(direct_io ? buffer_size : 0);
+  direct_pos_ = 0;
+  direct_length_ = 0;
 }
 
 inline void FdReaderBase::Initialize(int src,
@@ -544,6 +834,8 @@ inline void FdReaderBase::Initialize(int src,
   RIEGELI_ASSERT_GE(src, 0)
       << "Failed precondition of FdReader: negative file descriptor";
   SetFilename(src);
+  InitializeDirectIo(src);
+  InitializeBufferSize(src);
   InitializePos(src, initial_pos);
 }
 
@@ -569,21 +861,44 @@ inline void FdStreamReaderBase::Initialize(
   limit_pos_ = *assumed_pos;
 }
 
-inline FdMMapReaderBase::FdMMapReaderBase(bool sync_pos)
+inline FdMMapReaderBase::FdMMapReaderBase(bool sync_pos,
+                                          const Options& options)
     // Empty `Chain` as the `ChainReader` source is a placeholder, it will be
     // set by `Initialize()`.
-    : ChainReader(std::forward_as_tuple()), sync_pos_(sync_pos) {}
+    : ChainReader(std::forward_as_tuple()),
+      sync_pos_(sync_pos),
+      populate_(options.populate_),
+      sequential_(options.sequential_),
+      huge_pages_(options.huge_pages_),
+      prefetch_window_(options.prefetch_window_),
+      drop_behind_(options.drop_behind_) {}
 
 inline FdMMapReaderBase::FdMMapReaderBase(FdMMapReaderBase&& that) noexcept
     : ChainReader(std::move(that)),
       filename_(std::move(that.filename_)),
-      sync_pos_(that.sync_pos_) {}
+      sync_pos_(that.sync_pos_),
+      populate_(that.populate_),
+      sequential_(that.sequential_),
+      huge_pages_(that.huge_pages_),
+      prefetch_window_(that.prefetch_window_),
+      drop_behind_(that.drop_behind_),
+      mapped_data_(std::exchange(that.mapped_data_, nullptr)),
+      mapped_size_(std::exchange(that.mapped_size_, 0)),
+      advised_window_(std::exchange(that.advised_window_, 0)) {}
 
 inline FdMMapReaderBase& FdMMapReaderBase::operator=(
     FdMMapReaderBase&& that) noexcept {
   ChainReader::operator=(std::move(that));
   filename_ = std::move(that.filename_);
   sync_pos_ = that.sync_pos_;
+  populate_ = that.populate_;
+  sequential_ = that.sequential_;
+  huge_pages_ = that.huge_pages_;
+  prefetch_window_ = that.prefetch_window_;
+  drop_behind_ = that.drop_behind_;
+  mapped_data_ = std::exchange(that.mapped_data_, nullptr);
+  mapped_size_ = std::exchange(that.mapped_size_, 0);
+  advised_window_ = std::exchange(that.advised_window_, 0);
   return *this;
 }
 
@@ -591,14 +906,30 @@ inline void FdMMapReaderBase::Reset() {
   ChainReader::Reset();
   filename_.clear();
   sync_pos_ = false;
+  populate_ = false;
+  sequential_ = false;
+  huge_pages_ = false;
+  prefetch_window_ = 0;
+  drop_behind_ = false;
+  mapped_data_ = nullptr;
+  mapped_size_ = 0;
+  advised_window_ = 0;
 }
 
-inline void FdMMapReaderBase::Reset(bool sync_pos) {
+inline void FdMMapReaderBase::Reset(bool sync_pos, const Options& options) {
   // Empty `Chain` as the `ChainReader` source is a placeholder, it will be set
   // by `Initialize()`.
   ChainReader::Reset(std::forward_as_tuple());
   // `filename_` will be set by `Initialize()`.
   sync_pos_ = sync_pos;
+  populate_ = options.populate_;
+  sequential_ = options.sequential_;
+  huge_pages_ = options.huge_pages_;
+  prefetch_window_ = options.prefetch_window_;
+  drop_behind_ = options.drop_behind_;
+  mapped_data_ = nullptr;
+  mapped_size_ = 0;
+  advised_window_ = 0;
 }
 
 inline void FdMMapReaderBase::Initialize(int src,
@@ -612,7 +943,9 @@ inline void FdMMapReaderBase::Initialize(int src,
 template <typename Src>
 inline FdReader<Src>::FdReader(const internal::type_identity_t<Src>& src,
                                Options options)
-    : FdReaderBase(options.buffer_size_, !options.initial_pos_.has_value()),
+    : FdReaderBase(options.buffer_size_, options.max_buffer_size_,
+                   !options.initial_pos_.has_value(), options.parallelism_,
+                   options.direct_io_),
       src_(src) {
   Initialize(src_.get(), options.initial_pos_);
 }
@@ -620,7 +953,9 @@ inline FdReader<Src>::FdReader(const internal::type_identity_t<Src>& src,
 template <typename Src>
 inline FdReader<Src>::FdReader(internal::type_identity_t<Src>&& src,
                                Options options)
-    : FdReaderBase(options.buffer_size_, !options.initial_pos_.has_value()),
+    : FdReaderBase(options.buffer_size_, options.max_buffer_size_,
+                   !options.initial_pos_.has_value(), options.parallelism_,
+                   options.direct_io_),
       src_(std::move(src)) {
   Initialize(src_.get(), options.initial_pos_);
 }
@@ -628,7 +963,9 @@ inline FdReader<Src>::FdReader(internal::type_identity_t<Src>&& src,
 template <typename Src>
 template <typename... SrcArgs>
 inline FdReader<Src>::FdReader(std::tuple<SrcArgs...> src_args, Options options)
-    : FdReaderBase(options.buffer_size_, !options.initial_pos_.has_value()),
+    : FdReaderBase(options.buffer_size_, options.max_buffer_size_,
+                   !options.initial_pos_.has_value(), options.parallelism_,
+                   options.direct_io_),
       src_(std::move(src_args)) {
   Initialize(src_.get(), options.initial_pos_);
 }
@@ -636,7 +973,9 @@ inline FdReader<Src>::FdReader(std::tuple<SrcArgs...> src_args, Options options)
 template <typename Src>
 inline FdReader<Src>::FdReader(absl::string_view filename, int flags,
                                Options options)
-    : FdReaderBase(options.buffer_size_, !options.initial_pos_.has_value()) {
+    : FdReaderBase(options.buffer_size_, options.max_buffer_size_,
+                   !options.initial_pos_.has_value(), options.parallelism_,
+                   options.direct_io_) {
   Initialize(filename, flags, options.initial_pos_);
 }
 
@@ -651,6 +990,11 @@ inline FdReader<Src>& FdReader<Src>::operator=(FdReader&& that) noexcept {
   return *this;
 }
 
+template <typename Src>
+inline FdReader<Src>::~FdReader() {
+  CancelReadAhead();
+}
+
 template <typename Src>
 inline void FdReader<Src>::Reset() {
   FdReaderBase::Reset();
@@ -659,14 +1003,18 @@ inline void FdReader<Src>::Reset() {
 
 template <typename Src>
 inline void FdReader<Src>::Reset(const Src& src, Options options) {
-  FdReaderBase::Reset(options.buffer_size_, !options.initial_pos_.has_value());
+  FdReaderBase::Reset(options.buffer_size_, options.max_buffer_size_,
+                      !options.initial_pos_.has_value(), options.parallelism_,
+                      options.direct_io_);
   src_.Reset(src);
   Initialize(src_.get(), options.initial_pos_);
 }
 
 template <typename Src>
 inline void FdReader<Src>::Reset(Src&& src, Options options) {
-  FdReaderBase::Reset(options.buffer_size_, !options.initial_pos_.has_value());
+  FdReaderBase::Reset(options.buffer_size_, options.max_buffer_size_,
+                      !options.initial_pos_.has_value(), options.parallelism_,
+                      options.direct_io_);
   src_.Reset(std::move(src));
   Initialize(src_.get(), options.initial_pos_);
 }
@@ -675,7 +1023,9 @@ template <typename Src>
 template <typename... SrcArgs>
 inline void FdReader<Src>::Reset(std::tuple<SrcArgs...> src_args,
                                  Options options) {
-  FdReaderBase::Reset(options.buffer_size_, !options.initial_pos_.has_value());
+  FdReaderBase::Reset(options.buffer_size_, options.max_buffer_size_,
+                      !options.initial_pos_.has_value(), options.parallelism_,
+                      options.direct_io_);
   src_.Reset(std::move(src_args));
   Initialize(src_.get(), options.initial_pos_);
 }
@@ -683,7 +1033,9 @@ inline void FdReader<Src>::Reset(std::tuple<SrcArgs...> src_args,
 template <typename Src>
 inline void FdReader<Src>::Reset(absl::string_view filename, int flags,
                                  Options options) {
-  FdReaderBase::Reset(options.buffer_size_, !options.initial_pos_.has_value());
+  FdReaderBase::Reset(options.buffer_size_, options.max_buffer_size_,
+                      !options.initial_pos_.has_value(), options.parallelism_,
+                      options.direct_io_);
   src_.Reset();  // In case `OpenFd()` fails.
   Initialize(filename, flags, options.initial_pos_);
 }
@@ -698,6 +1050,8 @@ inline void FdReader<Src>::Initialize(absl::string_view filename, int flags,
   const int src = OpenFd(filename, flags);
   if (ABSL_PREDICT_FALSE(src < 0)) return;
   src_.Reset(std::forward_as_tuple(src));
+  InitializeDirectIo(src_.get());
+  InitializeBufferSize(src_.get());
   InitializePos(src_.get(), initial_pos);
 }
 
@@ -821,14 +1175,14 @@ void FdStreamReader<Src>::Done() {
 template <typename Src>
 inline FdMMapReader<Src>::FdMMapReader(
     const internal::type_identity_t<Src>& src, Options options)
-    : FdMMapReaderBase(!options.initial_pos_.has_value()), src_(src) {
+    : FdMMapReaderBase(!options.initial_pos_.has_value(), options), src_(src) {
   Initialize(src_.get(), options.initial_pos_);
 }
 
 template <typename Src>
 inline FdMMapReader<Src>::FdMMapReader(internal::type_identity_t<Src>&& src,
                                        Options options)
-    : FdMMapReaderBase(!options.initial_pos_.has_value()),
+    : FdMMapReaderBase(!options.initial_pos_.has_value(), options),
       src_(std::move(src)) {
   Initialize(src_.get(), options.initial_pos_);
 }
@@ -837,7 +1191,7 @@ template <typename Src>
 template <typename... SrcArgs>
 inline FdMMapReader<Src>::FdMMapReader(std::tuple<SrcArgs...> src_args,
                                        Options options)
-    : FdMMapReaderBase(!options.initial_pos_.has_value()),
+    : FdMMapReaderBase(!options.initial_pos_.has_value(), options),
       src_(std::move(src_args)) {
   Initialize(src_.get(), options.initial_pos_);
 }
@@ -845,7 +1199,7 @@ inline FdMMapReader<Src>::FdMMapReader(std::tuple<SrcArgs...> src_args,
 template <typename Src>
 inline FdMMapReader<Src>::FdMMapReader(absl::string_view filename, int flags,
                                        Options options)
-    : FdMMapReaderBase(!options.initial_pos_.has_value()) {
+    : FdMMapReaderBase(!options.initial_pos_.has_value(), options) {
   Initialize(filename, flags, options.initial_pos_);
 }
 
@@ -869,14 +1223,14 @@ inline void FdMMapReader<Src>::Reset() {
 
 template <typename Src>
 inline void FdMMapReader<Src>::Reset(const Src& src, Options options) {
-  FdMMapReaderBase::Reset(!options.initial_pos_.has_value());
+  FdMMapReaderBase::Reset(!options.initial_pos_.has_value(), options);
   src_.Reset(src);
   Initialize(src_.get(), options.initial_pos_);
 }
 
 template <typename Src>
 inline void FdMMapReader<Src>::Reset(Src&& src, Options options) {
-  FdMMapReaderBase::Reset(!options.initial_pos_.has_value());
+  FdMMapReaderBase::Reset(!options.initial_pos_.has_value(), options);
   src_.Reset(std::move(src));
   Initialize(src_.get(), options.initial_pos_);
 }
@@ -885,7 +1239,7 @@ template <typename Src>
 template <typename... SrcArgs>
 inline void FdMMapReader<Src>::Reset(std::tuple<SrcArgs...> src_args,
                                      Options options) {
-  FdMMapReaderBase::Reset(!options.initial_pos_.has_value());
+  FdMMapReaderBase::Reset(!options.initial_pos_.has_value(), options);
   src_.Reset(std::move(src_args));
   Initialize(src_.get(), options.initial_pos_);
 }
@@ -893,7 +1247,7 @@ inline void FdMMapReader<Src>::Reset(std::tuple<SrcArgs...> src_args,
 template <typename Src>
 inline void FdMMapReader<Src>::Reset(absl::string_view filename, int flags,
                                      Options options) {
-  FdMMapReaderBase::Reset(!options.initial_pos_.has_value());
+  FdMMapReaderBase::Reset(!options.initial_pos_.has_value(), options);
   src_.Reset();  // In case `OpenFd()` fails.
   Initialize(filename, flags, options.initial_pos_);
 }
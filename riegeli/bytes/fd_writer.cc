@@ -18,6 +18,12 @@
 #define _XOPEN_SOURCE 500
 #endif
 
+// Make `O_DIRECT`, `fallocate()`, `sync_file_range()`, and
+// `copy_file_range()` available.
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 // Make `off_t` 64-bit even on 32-bit systems.
 #undef _FILE_OFFSET_BITS
 #define _FILE_OFFSET_BITS 64
@@ -25,26 +31,61 @@
 #include "riegeli/bytes/fd_writer.h"
 
 #include <fcntl.h>
+#include <limits.h>
 #include <stddef.h>
 #include <stdio.h>
+#include <sys/mman.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
 #include <cerrno>
+#include <cstring>
+#include <future>
 #include <limits>
+#include <memory>
 #include <string>
+#include <utility>
+#include <vector>
 
 #include "absl/base/optimization.h"
+#include "absl/base/thread_annotations.h"
 #include "absl/strings/str_cat.h"
 #include "absl/strings/string_view.h"
+#include "absl/synchronization/mutex.h"
 #include "absl/types/optional.h"
 #include "riegeli/base/base.h"
+#include "riegeli/base/canonical_errors.h"
+#include "riegeli/base/chain.h"
 #include "riegeli/base/errno_mapping.h"
+#include "riegeli/base/parallelism.h"
 #include "riegeli/base/status.h"
+#include "riegeli/bytes/fd_dependency.h"
 
 namespace riegeli {
 
+namespace {
+
+// Makes data written to `dest` durable with `fdatasync()` if `data_sync`,
+// otherwise with `fsync()`.
+Status SyncFd(int dest, absl::string_view filename, bool data_sync) {
+again:
+  if (ABSL_PREDICT_FALSE((data_sync ? fdatasync(dest) : fsync(dest)) < 0)) {
+    if (errno == EINTR) goto again;
+    const int error_number = errno;
+    return ErrnoToCanonicalStatus(
+        error_number, absl::StrCat(data_sync ? "fdatasync()" : "fsync()",
+                                   " failed writing ", filename));
+  }
+  return OkStatus();
+}
+
+}  // namespace
+
 namespace internal {
 
 void FdWriterCommon::SetFilename(int dest) {
@@ -72,6 +113,10 @@ again:
   return dest;
 }
 
+TypeId FdWriterCommon::GetTypeId() const {
+  return TypeId::For<FdWriterCommon>();
+}
+
 bool FdWriterCommon::FailOperation(absl::string_view operation) {
   const int error_number = errno;
   RIEGELI_ASSERT_NE(error_number, 0)
@@ -81,8 +126,50 @@ bool FdWriterCommon::FailOperation(absl::string_view operation) {
       error_number, absl::StrCat(operation, " failed writing ", filename_)));
 }
 
+Position FdWriterCommon::CopyFromFd(int src, Position src_pos,
+                                    Position length) {
+  return 0;
+}
+
+// Returns `true` if a kernel copy failed with `errno` meaning that it is not
+// supported for these fds, rather than that writing failed.
+inline bool CopyNotSupported() {
+  return errno == EXDEV || errno == EINVAL || errno == ENOSYS ||
+         errno == EOPNOTSUPP || errno == EBADF;
+}
+
 }  // namespace internal
 
+struct FdWriterBase::SyncState {
+  // Body of a background task which syncs `dest` until no requests are
+  // waiting.
+  void RunSyncs(int dest, const std::string& filename, bool data_sync);
+
+  absl::Mutex mutex;
+  // If `true`, a background task is running `RunSyncs()`.
+  bool running ABSL_GUARDED_BY(mutex) = false;
+  // Requests waiting for the next sync.
+  std::vector<std::promise<Status>> waiting ABSL_GUARDED_BY(mutex);
+};
+
+void FdWriterBase::SyncState::RunSyncs(int dest, const std::string& filename,
+                                       bool data_sync) {
+  std::vector<std::promise<Status>> requests;
+  mutex.Lock();
+  while (!waiting.empty()) {
+    requests.swap(waiting);
+    mutex.Unlock();
+    // All `requests` were made before this sync started, so one sync
+    // satisfies all of them.
+    const Status status = SyncFd(dest, filename, data_sync);
+    for (std::promise<Status>& request : requests) request.set_value(status);
+    requests.clear();
+    mutex.Lock();
+  }
+  running = false;
+  mutex.Unlock();
+}
+
 void FdWriterBase::InitializePos(int dest,
                                  absl::optional<Position> initial_pos) {
   int flags = 0;
@@ -116,6 +203,40 @@ void FdWriterBase::InitializePos(int dest, int flags,
     }
     start_pos_ = IntCast<Position>(file_pos);
   }
+  if (write_behind_ > 0) {
+    write_behind_pos_ = start_pos_ - start_pos_ % write_behind_;
+  }
+}
+
+void FdWriterBase::InitializeDirectIo(int dest) {
+  if (!direct_io_) return;
+#ifdef O_DIRECT
+  const int flags = fcntl(dest, F_GETFL);
+  if (ABSL_PREDICT_FALSE(flags < 0)) {
+    FailOperation("fcntl()");
+    return;
+  }
+  if ((flags & O_DIRECT) == 0 &&
+      ABSL_PREDICT_FALSE(fcntl(dest, F_SETFL, flags | O_DIRECT) < 0)) {
+    FailOperation("fcntl()");
+  }
+#else
+  Fail(UnimplementedError("O_DIRECT is not supported on this platform"));
+#endif
+}
+
+void FdWriterBase::InitializeBufferSize(int dest) {
+  if (max_buffer_size_ <= buffer_size_) return;
+  struct stat stat_info;
+  if (ABSL_PREDICT_FALSE(fstat(dest, &stat_info) < 0)) {
+    FailOperation("fstat()");
+    return;
+  }
+  if (stat_info.st_blksize > 0 &&
+      IntCast<size_t>(stat_info.st_blksize) > buffer_size_) {
+    set_buffer_size(
+        UnsignedMin(IntCast<size_t>(stat_info.st_blksize), max_buffer_size_));
+  }
 }
 
 bool FdWriterBase::SyncPos(int dest) {
@@ -145,6 +266,52 @@ bool FdWriterBase::WriteInternal(absl::string_view src) {
                              start_pos_)) {
     return FailOverflow();
   }
+  Preallocate(dest, start_pos_ + src.size());
+  if (direct_io_) return WriteDirect(src);
+  if (parallelism_ > 0) {
+    struct WritingBlock {
+      std::string data;
+      std::promise<int> error_number;
+    };
+
+    if (ABSL_PREDICT_FALSE(
+            !WaitForWrites(IntCast<size_t>(parallelism_) - 1))) {
+      return false;
+    }
+    WritingBlock* const writing_block = new WritingBlock();
+    // TODO: When `absl::string_view` becomes C++17 `std::string_view`:
+    // writing_block->data = src;
+    writing_block->data.assign(src.data(), src.size());
+    pending_writes_.push_back(writing_block->error_number.get_future());
+    const Position pos = start_pos_;
+    ThreadPool::global().Schedule([dest, pos, writing_block] {
+      int error_number = 0;
+      absl::string_view data = writing_block->data;
+      Position data_pos = pos;
+      while (!data.empty()) {
+        const ssize_t length_written = pwrite(
+            dest, data.data(),
+            UnsignedMin(data.size(),
+                        size_t{std::numeric_limits<ssize_t>::max()}),
+            IntCast<off_t>(data_pos));
+        if (ABSL_PREDICT_FALSE(length_written < 0)) {
+          if (errno == EINTR) continue;
+          error_number = errno;
+          break;
+        }
+        RIEGELI_ASSERT_GT(length_written, 0) << "pwrite() returned 0";
+        RIEGELI_ASSERT_LE(IntCast<size_t>(length_written), data.size())
+            << "pwrite() wrote more than requested";
+        data_pos += IntCast<size_t>(length_written);
+        data.remove_prefix(IntCast<size_t>(length_written));
+      }
+      writing_block->error_number.set_value(error_number);
+      delete writing_block;
+    });
+    start_pos_ += src.size();
+    WriteBehind(dest);
+    return true;
+  }
   do {
   again:
     const ssize_t length_written = pwrite(
@@ -161,22 +328,359 @@ bool FdWriterBase::WriteInternal(absl::string_view src) {
     start_pos_ += IntCast<size_t>(length_written);
     src.remove_prefix(IntCast<size_t>(length_written));
   } while (!src.empty());
+  WriteBehind(dest);
+  return true;
+}
+
+bool FdWriterBase::WriteSlow(const Chain& src) {
+  RIEGELI_ASSERT_GT(src.size(), UnsignedMin(available(), kMaxBytesToCopy))
+      << "Failed precondition of Writer::WriteSlow(Chain): "
+         "length too small, use Write(Chain) instead";
+#ifdef IOV_MAX
+  if (direct_io_ || parallelism_ > 0 || src.size() < kMaxBufferSize) {
+    return BufferedWriter::WriteSlow(src);
+  }
+  // Write blocks of `src` directly with `pwritev()`, instead of copying them
+  // to the buffer first.
+  if (ABSL_PREDICT_FALSE(!PushInternal())) return false;
+  const int dest = dest_fd();
+  if (ABSL_PREDICT_FALSE(src.size() >
+                         Position{std::numeric_limits<off_t>::max()} -
+                             start_pos_)) {
+    return FailOverflow();
+  }
+  Preallocate(dest, start_pos_ + src.size());
+  std::vector<iovec> iov;
+  iov.reserve(src.blocks().size());
+  for (const absl::string_view fragment : src.blocks()) {
+    iov.push_back(iovec{const_cast<char*>(fragment.data()), fragment.size()});
+  }
+  size_t iov_index = 0;
+  while (iov_index < iov.size()) {
+    const ssize_t length_written = pwritev(
+        dest, &iov[iov_index],
+        IntCast<int>(UnsignedMin(iov.size() - iov_index, size_t{IOV_MAX})),
+        IntCast<off_t>(start_pos_));
+    if (ABSL_PREDICT_FALSE(length_written < 0)) {
+      if (errno == EINTR) continue;
+      return FailOperation("pwritev()");
+    }
+    RIEGELI_ASSERT_GT(length_written, 0) << "pwritev() returned 0";
+    size_t remaining = IntCast<size_t>(length_written);
+    start_pos_ += remaining;
+    while (remaining > 0) {
+      RIEGELI_ASSERT_LT(iov_index, iov.size())
+          << "pwritev() wrote more than requested";
+      if (remaining < iov[iov_index].iov_len) {
+        iov[iov_index].iov_base =
+            static_cast<char*>(iov[iov_index].iov_base) + remaining;
+        iov[iov_index].iov_len -= remaining;
+        break;
+      }
+      remaining -= iov[iov_index].iov_len;
+      ++iov_index;
+    }
+  }
+  WriteBehind(dest);
+  return true;
+#else
+  return BufferedWriter::WriteSlow(src);
+#endif
+}
+
+Position FdWriterBase::CopyFromFd(int src, Position src_pos,
+                                  Position length) {
+#if defined(__linux__) && defined(__GLIBC__) && \
+    (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 27))
+  if (direct_io_ || parallelism_ > 0) return 0;
+  if (ABSL_PREDICT_FALSE(!PushInternal())) return 0;
+  const int dest = dest_fd();
+  if (ABSL_PREDICT_FALSE(
+          length > Position{std::numeric_limits<off_t>::max()} - start_pos_ ||
+          length > Position{std::numeric_limits<off_t>::max()} - src_pos)) {
+    return 0;
+  }
+  Preallocate(dest, start_pos_ + length);
+  Position length_copied = 0;
+  while (length_copied < length) {
+    off_t src_offset = IntCast<off_t>(src_pos + length_copied);
+    off_t dest_offset = IntCast<off_t>(start_pos_);
+    const ssize_t result = copy_file_range(
+        src, &src_offset, dest, &dest_offset,
+        IntCast<size_t>(
+            UnsignedMin(length - length_copied,
+                        Position{std::numeric_limits<ssize_t>::max()})),
+        0);
+    if (ABSL_PREDICT_FALSE(result < 0)) {
+      if (errno == EINTR) continue;
+      if (!internal::CopyNotSupported()) FailOperation("copy_file_range()");
+      break;
+    }
+    // Source ends.
+    if (result == 0) break;
+    length_copied += IntCast<size_t>(result);
+    start_pos_ += IntCast<size_t>(result);
+  }
+  WriteBehind(dest);
+  return length_copied;
+#else
+  return 0;
+#endif
+}
+
+void FdWriterBase::Preallocate(int dest, Position end) {
+#ifdef __linux__
+  if (preallocate_ == 0 || end <= preallocated_end_) return;
+  const Position offset = UnsignedMax(preallocated_end_, start_pos_);
+  const Position new_end =
+      end + UnsignedMin(preallocate_,
+                        Position{std::numeric_limits<off_t>::max()} - end);
+again:
+  if (ABSL_PREDICT_FALSE(fallocate(dest, FALLOC_FL_KEEP_SIZE,
+                                   IntCast<off_t>(offset),
+                                   IntCast<off_t>(new_end - offset)) < 0)) {
+    if (errno == EINTR) goto again;
+    // Preallocation is advisory. If it is not supported or there is not enough
+    // space, writing reports failures itself.
+    preallocate_ = 0;
+    return;
+  }
+  preallocated_end_ = new_end;
+#endif
+}
+
+void FdWriterBase::WriteBehind(int dest) {
+#ifdef __linux__
+  if (write_behind_ == 0 || direct_io_) return;
+  while (start_pos_ >= write_behind_pos_ &&
+         start_pos_ - write_behind_pos_ >= write_behind_) {
+    // Failures are ignored: this is only a hint for writeback, and write
+    // errors are reported by `fsync()`.
+    sync_file_range(dest, IntCast<off_t>(write_behind_pos_),
+                    IntCast<off_t>(write_behind_), SYNC_FILE_RANGE_WRITE);
+    if (write_behind_pos_ >= write_behind_) {
+      sync_file_range(dest, IntCast<off_t>(write_behind_pos_ - write_behind_),
+                      IntCast<off_t>(write_behind_),
+                      SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+                          SYNC_FILE_RANGE_WAIT_AFTER);
+    }
+    write_behind_pos_ += write_behind_;
+  }
+#endif
+}
+
+bool FdWriterBase::TrimPreallocation(int dest) {
+  if (preallocated_end_ == 0) return true;
+  struct stat stat_info;
+  if (ABSL_PREDICT_FALSE(fstat(dest, &stat_info) < 0)) {
+    return FailOperation("fstat()");
+  }
+  if (preallocated_end_ > IntCast<Position>(stat_info.st_size)) {
+    // Truncating to the current size releases space allocated beyond it.
+  again:
+    if (ABSL_PREDICT_FALSE(ftruncate(dest, stat_info.st_size) < 0)) {
+      if (errno == EINTR) goto again;
+      return FailOperation("ftruncate()");
+    }
+  }
+  preallocated_end_ = 0;
+  return true;
+}
+
+bool FdWriterBase::WriteFully(int dest, const char* src, size_t length,
+                              Position pos) {
+  while (length > 0) {
+    const ssize_t length_written =
+        pwrite(dest, src,
+               UnsignedMin(length, size_t{std::numeric_limits<ssize_t>::max()}),
+               IntCast<off_t>(pos));
+    if (ABSL_PREDICT_FALSE(length_written < 0)) {
+      if (errno == EINTR) continue;
+      return FailOperation("pwrite()");
+    }
+    RIEGELI_ASSERT_GT(length_written, 0) << "pwrite() returned 0";
+    RIEGELI_ASSERT_LE(IntCast<size_t>(length_written), length)
+        << "pwrite() wrote more than requested";
+    src += IntCast<size_t>(length_written);
+    length -= IntCast<size_t>(length_written);
+    pos += IntCast<size_t>(length_written);
+  }
+  return true;
+}
+
+bool FdWriterBase::WriteDirect(absl::string_view src) {
+  const int dest = dest_fd();
+  char* const buffer = direct_buffer_.GetData();
+  if (!direct_active_) {
+    // Collect data from the beginning of the block containing `start_pos_`,
+    // reading the part of the block preceding `start_pos_` from the file.
+    direct_pos_ = RoundDown<internal::kDirectIoAlignment>(start_pos_);
+    direct_length_ = IntCast<size_t>(start_pos_ - direct_pos_);
+    if (direct_length_ > 0) {
+      size_t length_read = 0;
+      while (length_read < direct_length_) {
+        const ssize_t result =
+            pread(dest, buffer + length_read,
+                  internal::kDirectIoAlignment - length_read,
+                  IntCast<off_t>(direct_pos_ + length_read));
+        if (ABSL_PREDICT_FALSE(result < 0)) {
+          if (errno == EINTR) continue;
+          return FailOperation("pread()");
+        }
+        if (result == 0) {
+          // The file ends before `start_pos_`, so the gap reads as zeros.
+          std::memset(buffer + length_read, 0, direct_length_ - length_read);
+          break;
+        }
+        length_read += IntCast<size_t>(result);
+      }
+    }
+    direct_active_ = true;
+  }
+  do {
+    const size_t length =
+        UnsignedMin(src.size(), direct_buffer_.size() - direct_length_);
+    std::memcpy(buffer + direct_length_, src.data(), length);
+    direct_length_ += length;
+    start_pos_ += length;
+    src.remove_prefix(length);
+    if (direct_length_ == direct_buffer_.size()) {
+      if (ABSL_PREDICT_FALSE(
+              !WriteFully(dest, buffer, direct_length_, direct_pos_))) {
+        return false;
+      }
+      direct_pos_ += direct_length_;
+      direct_length_ = 0;
+    }
+  } while (!src.empty());
+  return true;
+}
+
+bool FdWriterBase::FlushDirect() {
+  if (!direct_active_ || direct_length_ == 0) return healthy();
+  const int dest = dest_fd();
+  char* const buffer = direct_buffer_.GetData();
+  const size_t aligned_length =
+      RoundDown<internal::kDirectIoAlignment>(direct_length_);
+  if (aligned_length > 0) {
+    if (ABSL_PREDICT_FALSE(
+            !WriteFully(dest, buffer, aligned_length, direct_pos_))) {
+      return false;
+    }
+    direct_pos_ += aligned_length;
+    direct_length_ -= aligned_length;
+    std::memmove(buffer, buffer + aligned_length, direct_length_);
+  }
+  if (direct_length_ > 0) {
+#ifdef O_DIRECT
+    // `O_DIRECT` requires whole blocks, so the tail is written through the
+    // page cache. It stays collected in `direct_buffer_`, and its block is
+    // written again with `O_DIRECT` when it is filled.
+    const int flags = fcntl(dest, F_GETFL);
+    if (ABSL_PREDICT_FALSE(flags < 0)) return FailOperation("fcntl()");
+    if (ABSL_PREDICT_FALSE(fcntl(dest, F_SETFL, flags & ~O_DIRECT) < 0)) {
+      return FailOperation("fcntl()");
+    }
+    const bool ok = WriteFully(dest, buffer, direct_length_, direct_pos_);
+    if (ABSL_PREDICT_FALSE(fcntl(dest, F_SETFL, flags) < 0) &&
+        ABSL_PREDICT_TRUE(healthy())) {
+      return FailOperation("fcntl()");
+    }
+    return ok;
+#else
+    return WriteFully(dest, buffer, direct_length_, direct_pos_);
+#endif
+  }
   return true;
 }
 
+bool FdWriterBase::StopDirect() {
+  if (!direct_active_) return healthy();
+  const bool ok = FlushDirect();
+  direct_active_ = false;
+  direct_length_ = 0;
+  return ok;
+}
+
+bool FdWriterBase::WaitForWrites(size_t max_pending) {
+  while (pending_writes_.size() > max_pending) {
+    const int error_number = pending_writes_.front().get();
+    pending_writes_.pop_front();
+    if (ABSL_PREDICT_FALSE(error_number != 0) && ABSL_PREDICT_TRUE(healthy())) {
+      errno = error_number;
+      FailOperation("pwrite()");
+    }
+  }
+  return healthy();
+}
+
+std::future<Status> FdWriterBase::RequestSync() {
+  if (sync_state_ == nullptr) sync_state_ = std::make_shared<SyncState>();
+  std::promise<Status> request;
+  std::future<Status> result = request.get_future();
+  absl::MutexLock lock(&sync_state_->mutex);
+  sync_state_->waiting.push_back(std::move(request));
+  if (!sync_state_->running) {
+    sync_state_->running = true;
+    ThreadPool::global().Schedule([state = sync_state_, dest = dest_fd(),
+                                   filename = filename(),
+                                   data_sync = data_sync_] {
+      state->RunSyncs(dest, filename, data_sync);
+    });
+  }
+  return result;
+}
+
+void FdWriterBase::WaitForSyncs() {
+  if (sync_state_ == nullptr) return;
+  absl::MutexLock lock(&sync_state_->mutex);
+  sync_state_->mutex.Await(absl::Condition(
+      +[](SyncState* state) ABSL_EXCLUSIVE_LOCKS_REQUIRED(state->mutex) {
+        return !state->running;
+      },
+      sync_state_.get()));
+}
+
+void FdWriterBase::WaitForBackgroundOperations() {
+  WaitForWrites(0);
+  WaitForSyncs();
+}
+
+void FdWriterBase::Done() {
+  // Background writes and syncs refer to the fd, which must not be closed while
+  // they are in flight.
+  WaitForWrites(0);
+  if (ABSL_PREDICT_TRUE(healthy()) && ABSL_PREDICT_TRUE(StopDirect())) {
+    TrimPreallocation(dest_fd());
+  }
+  WaitForSyncs();
+  FdWriterCommon::Done();
+}
+
+std::future<Status> FdWriterBase::FlushAsync() {
+  if (ABSL_PREDICT_FALSE(!Flush(FlushType::kFromProcess))) {
+    std::promise<Status> failed;
+    failed.set_value(status());
+    return failed.get_future();
+  }
+  return RequestSync();
+}
+
 bool FdWriterBase::Flush(FlushType flush_type) {
   if (ABSL_PREDICT_FALSE(!PushInternal())) return false;
+  if (ABSL_PREDICT_FALSE(!WaitForWrites(0))) return false;
+  if (ABSL_PREDICT_FALSE(!FlushDirect())) return false;
   const int dest = dest_fd();
   if (ABSL_PREDICT_FALSE(!SyncPos(dest))) return false;
   switch (flush_type) {
     case FlushType::kFromObject:
     case FlushType::kFromProcess:
       return true;
-    case FlushType::kFromMachine:
-      if (ABSL_PREDICT_FALSE(fsync(dest) < 0)) {
-        return FailOperation("fsync()");
-      }
+    case FlushType::kFromMachine: {
+      Status status = RequestSync().get();
+      if (ABSL_PREDICT_FALSE(!status.ok())) return Fail(std::move(status));
       return true;
+    }
   }
   RIEGELI_ASSERT_UNREACHABLE()
       << "Unknown flush type: " << static_cast<int>(flush_type);
@@ -189,6 +693,8 @@ bool FdWriterBase::SeekSlow(Position new_pos) {
   if (ABSL_PREDICT_FALSE(!PushInternal())) return false;
   RIEGELI_ASSERT_EQ(written_to_buffer(), 0u)
       << "BufferedWriter::PushInternal() did not empty the buffer";
+  if (ABSL_PREDICT_FALSE(!WaitForWrites(0))) return false;
+  if (ABSL_PREDICT_FALSE(!StopDirect())) return false;
   if (new_pos >= start_pos_) {
     // Seeking forwards.
     const int dest = dest_fd();
@@ -203,6 +709,9 @@ bool FdWriterBase::SeekSlow(Position new_pos) {
     }
   }
   start_pos_ = new_pos;
+  if (write_behind_ > 0) {
+    write_behind_pos_ = start_pos_ - start_pos_ % write_behind_;
+  }
   return true;
 }
 
@@ -221,6 +730,8 @@ bool FdWriterBase::Truncate(Position new_size) {
   if (ABSL_PREDICT_FALSE(!PushInternal())) return false;
   RIEGELI_ASSERT_EQ(written_to_buffer(), 0u)
       << "BufferedWriter::PushInternal() did not empty the buffer";
+  if (ABSL_PREDICT_FALSE(!WaitForWrites(0))) return false;
+  if (ABSL_PREDICT_FALSE(!StopDirect())) return false;
   const int dest = dest_fd();
   if (new_size >= start_pos_) {
     // Seeking forwards.
@@ -240,6 +751,11 @@ again:
     return FailOperation("ftruncate()");
   }
   start_pos_ = new_size;
+  // Truncation released space preallocated beyond `new_size`.
+  preallocated_end_ = 0;
+  if (write_behind_ > 0) {
+    write_behind_pos_ = start_pos_ - start_pos_ % write_behind_;
+  }
   return true;
 }
 
@@ -289,6 +805,90 @@ bool FdStreamWriterBase::WriteInternal(absl::string_view src) {
   return true;
 }
 
+bool FdStreamWriterBase::WriteSlow(const Chain& src) {
+  RIEGELI_ASSERT_GT(src.size(), UnsignedMin(available(), kMaxBytesToCopy))
+      << "Failed precondition of Writer::WriteSlow(Chain): "
+         "length too small, use Write(Chain) instead";
+#ifdef IOV_MAX
+  if (src.size() < kMaxBufferSize) return BufferedWriter::WriteSlow(src);
+  // Write blocks of `src` directly with `writev()`, instead of copying them to
+  // the buffer first. This matters for sockets, which receive whole chunks.
+  if (ABSL_PREDICT_FALSE(!PushInternal())) return false;
+  const int dest = dest_fd();
+  if (ABSL_PREDICT_FALSE(src.size() >
+                         std::numeric_limits<Position>::max() - start_pos_)) {
+    return FailOverflow();
+  }
+  std::vector<iovec> iov;
+  iov.reserve(src.blocks().size());
+  for (const absl::string_view fragment : src.blocks()) {
+    iov.push_back(iovec{const_cast<char*>(fragment.data()), fragment.size()});
+  }
+  size_t iov_index = 0;
+  while (iov_index < iov.size()) {
+    const ssize_t length_written = writev(
+        dest, &iov[iov_index],
+        IntCast<int>(UnsignedMin(iov.size() - iov_index, size_t{IOV_MAX})));
+    if (ABSL_PREDICT_FALSE(length_written < 0)) {
+      if (errno == EINTR) continue;
+      return FailOperation("writev()");
+    }
+    RIEGELI_ASSERT_GT(length_written, 0) << "writev() returned 0";
+    size_t remaining = IntCast<size_t>(length_written);
+    start_pos_ += remaining;
+    while (remaining > 0) {
+      RIEGELI_ASSERT_LT(iov_index, iov.size())
+          << "writev() wrote more than requested";
+      if (remaining < iov[iov_index].iov_len) {
+        iov[iov_index].iov_base =
+            static_cast<char*>(iov[iov_index].iov_base) + remaining;
+        iov[iov_index].iov_len -= remaining;
+        break;
+      }
+      remaining -= iov[iov_index].iov_len;
+      ++iov_index;
+    }
+  }
+  return true;
+#else
+  return BufferedWriter::WriteSlow(src);
+#endif
+}
+
+Position FdStreamWriterBase::CopyFromFd(int src, Position src_pos,
+                                        Position length) {
+#ifdef __linux__
+  if (ABSL_PREDICT_FALSE(!PushInternal())) return 0;
+  const int dest = dest_fd();
+  if (ABSL_PREDICT_FALSE(
+          length > std::numeric_limits<Position>::max() - start_pos_ ||
+          length > Position{std::numeric_limits<off_t>::max()} - src_pos)) {
+    return 0;
+  }
+  Position length_copied = 0;
+  while (length_copied < length) {
+    off_t src_offset = IntCast<off_t>(src_pos + length_copied);
+    const ssize_t result = sendfile(
+        dest, src, &src_offset,
+        IntCast<size_t>(
+            UnsignedMin(length - length_copied,
+                        Position{std::numeric_limits<ssize_t>::max()})));
+    if (ABSL_PREDICT_FALSE(result < 0)) {
+      if (errno == EINTR) continue;
+      if (!internal::CopyNotSupported()) FailOperation("sendfile()");
+      break;
+    }
+    // Source ends.
+    if (result == 0) break;
+    length_copied += IntCast<size_t>(result);
+    start_pos_ += IntCast<size_t>(result);
+  }
+  return length_copied;
+#else
+  return 0;
+#endif
+}
+
 bool FdStreamWriterBase::Flush(FlushType flush_type) {
   if (ABSL_PREDICT_FALSE(!PushInternal())) return false;
   const int dest = dest_fd();
@@ -306,4 +906,235 @@ bool FdStreamWriterBase::Flush(FlushType flush_type) {
       << "Unknown flush type: " << static_cast<int>(flush_type);
 }
 
+FdMMapWriterBase::~FdMMapWriterBase() { DiscardMapping(); }
+
+void FdMMapWriterBase::SetFilename(int dest) {
+  filename_ = absl::StrCat("/proc/self/fd/", dest);
+}
+
+int FdMMapWriterBase::OpenFd(absl::string_view filename, int flags,
+                             mode_t permissions) {
+  // TODO: When `absl::string_view` becomes C++17 `std::string_view`:
+  // filename_ = filename;
+  filename_.assign(filename.data(), filename.size());
+again:
+  const int dest = open(filename_.c_str(), flags, permissions);
+  if (ABSL_PREDICT_FALSE(dest < 0)) {
+    if (errno == EINTR) goto again;
+    FailOperation("open()");
+    return -1;
+  }
+  return dest;
+}
+
+bool FdMMapWriterBase::FailOperation(absl::string_view operation) {
+  const int error_number = errno;
+  RIEGELI_ASSERT_NE(error_number, 0)
+      << "Failed precondition of FdMMapWriterBase::FailOperation(): "
+         "zero errno";
+  return Fail(ErrnoToCanonicalStatus(
+      error_number, absl::StrCat(operation, " failed writing ", filename_)));
+}
+
+void FdMMapWriterBase::InitializePos(int dest,
+                                     absl::optional<Position> initial_pos) {
+  int flags = 0;
+  if (!initial_pos.has_value()) {
+    // If `initial_pos.has_value()` then `flags` are not needed, so avoid
+    // `fcntl()`.
+    flags = fcntl(dest, F_GETFL);
+    if (ABSL_PREDICT_FALSE(flags < 0)) {
+      FailOperation("fcntl()");
+      return;
+    }
+  }
+  return InitializePos(dest, flags, initial_pos);
+}
+
+void FdMMapWriterBase::InitializePos(int dest, int flags,
+                                     absl::optional<Position> initial_pos) {
+  struct stat stat_info;
+  if (ABSL_PREDICT_FALSE(fstat(dest, &stat_info) < 0)) {
+    FailOperation("fstat()");
+    return;
+  }
+  file_size_ = IntCast<Position>(stat_info.st_size);
+  min_size_ = file_size_;
+  if (initial_pos.has_value()) {
+    if (ABSL_PREDICT_FALSE(*initial_pos >
+                           Position{std::numeric_limits<off_t>::max()})) {
+      FailOverflow();
+      return;
+    }
+    start_pos_ = *initial_pos;
+  } else if ((flags & O_APPEND) != 0) {
+    // Writing through the mapping does not append, so start at the end.
+    start_pos_ = file_size_;
+  } else {
+    const off_t file_pos = lseek(dest, 0, SEEK_CUR);
+    if (ABSL_PREDICT_FALSE(file_pos < 0)) {
+      FailOperation("lseek()");
+      return;
+    }
+    start_pos_ = IntCast<Position>(file_pos);
+  }
+}
+
+void FdMMapWriterBase::Done() {
+  Unmap();
+  if (ABSL_PREDICT_TRUE(healthy())) {
+    const int dest = dest_fd();
+    if (ABSL_PREDICT_TRUE(TrimFile(dest))) SyncPos(dest);
+  }
+  Writer::Done();
+}
+
+void FdMMapWriterBase::DiscardMapping() {
+  if (mapped_data_ == nullptr) return;
+  munmap(mapped_data_, mapped_size_);
+  mapped_data_ = nullptr;
+  mapped_size_ = 0;
+}
+
+inline bool FdMMapWriterBase::Unmap() {
+  if (mapped_data_ == nullptr) return healthy();
+  start_pos_ = pos();
+  const int result = munmap(mapped_data_, mapped_size_);
+  start_ = nullptr;
+  cursor_ = nullptr;
+  limit_ = nullptr;
+  mapped_data_ = nullptr;
+  mapped_size_ = 0;
+  if (ABSL_PREDICT_FALSE(result < 0)) return FailOperation("munmap()");
+  return healthy();
+}
+
+inline bool FdMMapWriterBase::ExtendFile(int dest, Position size) {
+  if (size <= file_size_) return true;
+again:
+  if (ABSL_PREDICT_FALSE(ftruncate(dest, IntCast<off_t>(size)) < 0)) {
+    if (errno == EINTR) goto again;
+    return FailOperation("ftruncate()");
+  }
+  file_size_ = size;
+  return true;
+}
+
+inline bool FdMMapWriterBase::TrimFile(int dest) {
+  const Position size = UnsignedMax(pos(), min_size_);
+  if (size != file_size_) {
+  again:
+    if (ABSL_PREDICT_FALSE(ftruncate(dest, IntCast<off_t>(size)) < 0)) {
+      if (errno == EINTR) goto again;
+      return FailOperation("ftruncate()");
+    }
+    file_size_ = size;
+  }
+  if (mapped_data_ != nullptr) {
+    // Pages of the mapping beyond the end of the file must not be accessed.
+    limit_ = start_ + IntCast<size_t>(
+                          UnsignedMin(Position{mapped_size_},
+                                      file_size_ - start_pos_));
+  }
+  return true;
+}
+
+inline bool FdMMapWriterBase::SyncPos(int dest) {
+  if (sync_pos_) {
+    if (ABSL_PREDICT_FALSE(lseek(dest, IntCast<off_t>(pos()), SEEK_SET) < 0)) {
+      return FailOperation("lseek()");
+    }
+  }
+  return true;
+}
+
+bool FdMMapWriterBase::PushSlow(size_t min_length, size_t recommended_length) {
+  RIEGELI_ASSERT_GT(min_length, available())
+      << "Failed precondition of Writer::PushSlow(): "
+         "length too small, use Push() instead";
+  if (ABSL_PREDICT_FALSE(!healthy())) return false;
+  const int dest = dest_fd();
+  const Position current_pos = pos();
+  if (ABSL_PREDICT_FALSE(min_length >
+                         Position{std::numeric_limits<off_t>::max()} -
+                             current_pos)) {
+    return FailOverflow();
+  }
+  if (mapped_data_ != nullptr &&
+      current_pos + min_length <= start_pos_ + mapped_size_) {
+    // The mapped region is large enough, but the file was truncated by
+    // `Flush()`.
+    if (ABSL_PREDICT_FALSE(!ExtendFile(dest, start_pos_ + mapped_size_))) {
+      return false;
+    }
+    limit_ = mapped_data_ + mapped_size_;
+    return true;
+  }
+  if (ABSL_PREDICT_FALSE(!Unmap())) return false;
+  const Position page_size = IntCast<Position>(sysconf(_SC_PAGESIZE));
+  const Position region_begin = current_pos - current_pos % page_size;
+  const Position length = UnsignedMin(
+      UnsignedMax(min_length, mapping_size_),
+      Position{std::numeric_limits<off_t>::max()} - current_pos);
+  const Position region_end =
+      (current_pos + length + (page_size - 1)) / page_size * page_size;
+  if (ABSL_PREDICT_FALSE(region_end - region_begin >
+                         std::numeric_limits<size_t>::max())) {
+    return FailOverflow();
+  }
+  const size_t region_size = IntCast<size_t>(region_end - region_begin);
+  if (ABSL_PREDICT_FALSE(!ExtendFile(dest, region_end))) return false;
+  void* const data = mmap(nullptr, region_size, PROT_READ | PROT_WRITE,
+                          MAP_SHARED, dest, IntCast<off_t>(region_begin));
+  if (ABSL_PREDICT_FALSE(data == MAP_FAILED)) return FailOperation("mmap()");
+  mapped_data_ = static_cast<char*>(data);
+  mapped_size_ = region_size;
+  start_ = mapped_data_;
+  cursor_ = start_ + IntCast<size_t>(current_pos - region_begin);
+  limit_ = start_ + mapped_size_;
+  start_pos_ = region_begin;
+  return true;
+}
+
+bool FdMMapWriterBase::Flush(FlushType flush_type) {
+  if (ABSL_PREDICT_FALSE(!healthy())) return false;
+  const int dest = dest_fd();
+  if (ABSL_PREDICT_FALSE(!TrimFile(dest))) return false;
+  if (ABSL_PREDICT_FALSE(!SyncPos(dest))) return false;
+  switch (flush_type) {
+    case FlushType::kFromObject:
+    case FlushType::kFromProcess:
+      // The mapping is shared with the page cache.
+      return true;
+    case FlushType::kFromMachine:
+      if (start_ != nullptr && limit_ > start_ &&
+          ABSL_PREDICT_FALSE(
+              msync(start_, IntCast<size_t>(limit_ - start_), MS_SYNC) < 0)) {
+        return FailOperation("msync()");
+      }
+      // Regions mapped before and the file size are made durable by
+      // `fsync()`.
+      if (ABSL_PREDICT_FALSE(fsync(dest) < 0)) return FailOperation("fsync()");
+      return true;
+  }
+  RIEGELI_ASSERT_UNREACHABLE()
+      << "Unknown flush type: " << static_cast<int>(flush_type);
+}
+
+bool FdMMapWriterBase::Truncate(Position new_size) {
+  if (ABSL_PREDICT_FALSE(!healthy())) return false;
+  if (ABSL_PREDICT_FALSE(new_size > UnsignedMax(pos(), min_size_))) {
+    return false;
+  }
+  min_size_ = UnsignedMin(min_size_, new_size);
+  if (mapped_data_ != nullptr && new_size >= start_pos_ &&
+      new_size - start_pos_ <= IntCast<size_t>(limit_ - start_)) {
+    cursor_ = start_ + IntCast<size_t>(new_size - start_pos_);
+    return true;
+  }
+  if (ABSL_PREDICT_FALSE(!Unmap())) return false;
+  start_pos_ = new_size;
+  return true;
+}
+
 }  // namespace riegeli
@@ -19,6 +19,9 @@
 #include <stddef.h>
 #include <sys/types.h>
 
+#include <deque>
+#include <future>
+#include <memory>
 #include <string>
 #include <tuple>
 #include <utility>
@@ -28,13 +31,19 @@
 #include "absl/strings/string_view.h"
 #include "absl/types/optional.h"
 #include "riegeli/base/base.h"
+#include "riegeli/base/chain.h"
 #include "riegeli/base/dependency.h"
+#include "riegeli/base/object.h"
 #include "riegeli/base/resetter.h"
+#include "riegeli/base/status.h"
 #include "riegeli/bytes/buffered_writer.h"
 #include "riegeli/bytes/fd_dependency.h"
+#include "riegeli/bytes/writer.h"
 
 namespace riegeli {
 
+class FdReaderBase;
+
 namespace internal {
 
 // Implementation shared between `FdWriter` and `FdStreamWriter`.
@@ -49,6 +58,8 @@ class FdWriterCommon : public BufferedWriter {
   // `Close()`.
   const std::string& filename() const { return filename_; }
 
+  TypeId GetTypeId() const override;
+
  protected:
   FdWriterCommon() noexcept {}
 
@@ -63,7 +74,22 @@ class FdWriterCommon : public BufferedWriter {
   int OpenFd(absl::string_view filename, int flags, mode_t permissions);
   ABSL_ATTRIBUTE_COLD bool FailOperation(absl::string_view operation);
 
+  // Copies up to `length` bytes from the fd `src` at `src_pos` to the fd being
+  // written to, in the kernel without passing data through user space, e.g.
+  // with `copy_file_range()`, which can share extents on filesystems supporting
+  // reflinks.
+  //
+  // Returns the length copied. It is smaller than `length` if `src` ends, or if
+  // copying this way is not supported for these fds; the rest should be copied
+  // in the usual way then. If copying fails, `*this` fails.
+  //
+  // By default copies nothing.
+  virtual Position CopyFromFd(int src, Position src_pos, Position length);
+
   std::string filename_;
+
+ private:
+  friend class riegeli::FdReaderBase;
 };
 
 }  // namespace internal
@@ -117,16 +143,153 @@ class FdWriterBase : public internal::FdWriterCommon {
       return std::move(set_buffer_size(buffer_size));
     }
 
+    // If greater than `buffer_size()`, the buffer size adapts to the access
+    // pattern: while writing is sequential, it doubles with each full buffer
+    // written up to `max_buffer_size()`, and after a seek or a flush it returns
+    // to `buffer_size()`. The buffer starts at the block size reported by
+    // `fstat()` if that is larger than `buffer_size()`.
+    //
+    // Ignored if `parallelism() > 0` or `direct_io()`.
+    //
+    // Default: 0 (the buffer size is fixed)
+    Options& set_max_buffer_size(size_t max_buffer_size) & {
+      max_buffer_size_ = max_buffer_size;
+      return *this;
+    }
+    Options&& set_max_buffer_size(size_t max_buffer_size) && {
+      return std::move(set_max_buffer_size(max_buffer_size));
+    }
+
+    // If 0, data are written synchronously with `pwrite()` when the buffer is
+    // full.
+    //
+    // If greater than 0, up to this many buffers are written in parallel in
+    // background threads, so that writing does not wait for the storage and
+    // several writes are in flight, which improves throughput of storage with
+    // high latency. Data are copied before being written in the background.
+    // A write failure is reported by a later operation, at the latest by
+    // `Flush()` or `Close()`.
+    //
+    // Default: 0
+    Options& set_parallelism(int parallelism) & {
+      RIEGELI_ASSERT_GE(parallelism, 0)
+          << "Failed precondition of FdWriterBase::Options::set_parallelism(): "
+             "negative parallelism";
+      parallelism_ = parallelism;
+      return *this;
+    }
+    Options&& set_parallelism(int parallelism) && {
+      return std::move(set_parallelism(parallelism));
+    }
+
+    // If `true`, the file is written with `O_DIRECT`, bypassing the page
+    // cache. `O_DIRECT` is set with `fcntl()` on the fd after opening it, or on
+    // the fd given to the constructor.
+    //
+    // Data are collected in a buffer aligned to 4096 bytes, of `buffer_size()`
+    // rounded up to a multiple of 4096, and written in whole aligned blocks.
+    // `Flush()` and `Close()` write a tail which is not a whole block with
+    // `O_DIRECT` temporarily cleared, and the tail is written again with the
+    // following data. `parallelism()` is ignored.
+    //
+    // If writing starts at a position which is not a multiple of 4096, e.g.
+    // when appending, or after `Seek()`, the preceding part of the block is
+    // read from the file, which requires the fd to be readable.
+    //
+    // Default: `false`
+    Options& set_direct_io(bool direct_io) & {
+      direct_io_ = direct_io;
+      return *this;
+    }
+    Options&& set_direct_io(bool direct_io) && {
+      return std::move(set_direct_io(direct_io));
+    }
+
+    // If `false`, `Flush(FlushType::kFromMachine)` and `FlushAsync()` use
+    // `fsync()`, which makes file data and metadata durable.
+    //
+    // If `true`, they use `fdatasync()`, which skips metadata not needed to
+    // read the data back, e.g. modification time, and is usually cheaper.
+    //
+    // Default: `false`
+    Options& set_data_sync(bool data_sync) & {
+      data_sync_ = data_sync;
+      return *this;
+    }
+    Options&& set_data_sync(bool data_sync) && {
+      return std::move(set_data_sync(data_sync));
+    }
+
+    // If greater than 0, when writing reaches the end of space preallocated so
+    // far, space for this many more bytes is allocated with `fallocate()`,
+    // without changing the file size. This reduces fragmentation and the cost
+    // of allocating extents while appending. `Close()` releases the space
+    // preallocated beyond the end of the file with `ftruncate()`.
+    //
+    // Preallocation is advisory: if `fallocate()` fails, e.g. because the
+    // filesystem does not support it, preallocation stops. It is supported only
+    // on Linux.
+    //
+    // Default: 0
+    Options& set_preallocate(Position preallocate) & {
+      preallocate_ = preallocate;
+      return *this;
+    }
+    Options&& set_preallocate(Position preallocate) && {
+      return std::move(set_preallocate(preallocate));
+    }
+
+    // If greater than 0, after each this many bytes are written, the kernel is
+    // asked with `sync_file_range()` to start writing them to storage, and
+    // writeback of the previous block of this many bytes is waited for. This
+    // smooths writeback and bounds the amount of dirty data in the page cache,
+    // instead of bursts of writeback of large amounts of data.
+    //
+    // This does not make data durable, use `Flush(FlushType::kFromMachine)`
+    // for that. It is supported only on Linux, and it is ignored with
+    // `set_direct_io(true)`.
+    //
+    // Default: 0
+    Options& set_write_behind(Position write_behind) & {
+      write_behind_ = write_behind;
+      return *this;
+    }
+    Options&& set_write_behind(Position write_behind) && {
+      return std::move(set_write_behind(write_behind));
+    }
+
    private:
+    friend class FdWriterBase;
     template <typename Dest>
     friend class FdWriter;
 
     mode_t permissions_ = 0666;
     absl::optional<Position> initial_pos_;
     size_t buffer_size_ = kDefaultBufferSize;
+    size_t max_buffer_size_ = 0;
+    int parallelism_ = 0;
+    bool direct_io_ = false;
+    bool data_sync_ = false;
+    Position preallocate_ = 0;
+    Position write_behind_ = 0;
   };
 
   bool Flush(FlushType flush_type) override;
+
+  // Writes buffered data to the fd like `Flush(FlushType::kFromProcess)`, and
+  // makes them durable like `Flush(FlushType::kFromMachine)` in a background
+  // thread. The returned future becomes ready when a sync started after this
+  // call finishes.
+  //
+  // Syncs requested while another sync is in flight are coalesced into one
+  // sync following it (group commit), so the rate of durable flushes is
+  // limited by the latency of one sync rather than by a sync per request.
+  // `Flush(FlushType::kFromMachine)` joins the same group and waits for it.
+  //
+  // If writing buffered data fails, `*this` fails and the future is ready
+  // immediately. If the sync fails, only the future reports this; the failure
+  // is not reflected in `status()`.
+  std::future<Status> FlushAsync();
   bool SupportsRandomAccess() const override { return true; }
   bool Size(Position* size) override;
   bool SupportsTruncate() const override { return true; }
@@ -135,24 +298,125 @@ class FdWriterBase : public internal::FdWriterCommon {
  protected:
   FdWriterBase() noexcept {}
 
-  explicit FdWriterBase(size_t buffer_size, bool sync_pos);
+  explicit FdWriterBase(bool sync_pos, const Options& options);
 
   FdWriterBase(FdWriterBase&& that) noexcept;
   FdWriterBase& operator=(FdWriterBase&& that) noexcept;
 
   void Reset();
-  void Reset(size_t buffer_size, bool sync_pos);
+  void Reset(bool sync_pos, const Options& options);
   void Initialize(int dest, absl::optional<Position> initial_pos);
   void InitializePos(int dest, absl::optional<Position> initial_pos);
   void InitializePos(int dest, int flags, absl::optional<Position> initial_pos);
+  // Sets `O_DIRECT` on `dest` if `direct_io_`.
+  void InitializeDirectIo(int dest);
+  // Raises the starting buffer size to the block size of `dest` if the buffer
+  // size adapts to the access pattern.
+  void InitializeBufferSize(int dest);
   bool SyncPos(int dest);
+  // Waits for background writes and syncs, which refer to the fd and must not
+  // outlive it.
+  void WaitForBackgroundOperations();
 
+  void Done() override;
   bool WriteInternal(absl::string_view src) override;
+  using BufferedWriter::WriteSlow;
+  bool WriteSlow(const Chain& src) override;
   bool SeekSlow(Position new_pos) override;
+  Position CopyFromFd(int src, Position src_pos, Position length) override;
 
   bool sync_pos_ = false;
 
   // Invariant: `start_pos_ <= std::numeric_limits<off_t>::max()`
+
+ private:
+  struct SyncState;
+
+  // Waits until at most `max_pending` background writes are in flight. Fails
+  // `*this` if a finished write failed.
+  //
+  // Return values:
+  //  * `true`  - success (`healthy()`)
+  //  * `false` - failure (`!healthy()`)
+  bool WaitForWrites(size_t max_pending);
+
+  // Writes `length` bytes from `src` at `pos`.
+  //
+  // Return values:
+  //  * `true`  - success (`healthy()`)
+  //  * `false` - failure (`!healthy()`)
+  bool WriteFully(int dest, const char* src, size_t length, Position pos);
+
+  // Implements `WriteInternal()` if `direct_io_`.
+  bool WriteDirect(absl::string_view src);
+
+  // Writes data collected in `direct_buffer_`, keeping the tail which is not a
+  // whole block in `direct_buffer_`, to be written again with following data.
+  //
+  // Return values:
+  //  * `true`  - success (`healthy()`)
+  //  * `false` - failure (`!healthy()`)
+  bool FlushDirect();
+
+  // Like `FlushDirect()`, and then stops collecting data in `direct_buffer_`,
+  // so that writing can continue from another position.
+  bool StopDirect();
+
+  // Requests a sync of data already written to the fd, coalescing it with
+  // other requests made while a sync is in flight.
+  std::future<Status> RequestSync();
+
+  // Waits until background syncs stop interacting with `*sync_state_`.
+  void WaitForSyncs();
+
+  // Ensures that space is allocated up to at least `end` if `preallocate_ > 0`.
+  void Preallocate(int dest, Position end);
+
+  // Starts writeback of whole blocks of `write_behind_` before `start_pos_`,
+  // and waits for writeback of the block before each started block, if
+  // `write_behind_ > 0`.
+  void WriteBehind(int dest);
+
+  // Releases space preallocated beyond the end of the file.
+  //
+  // Return values:
+  //  * `true`  - success (`healthy()`)
+  //  * `false` - failure (`!healthy()`)
+  bool TrimPreallocation(int dest);
+
+  // The buffer size from `Options`.
+  size_t buffer_size_ = 0;
+  // If greater than `buffer_size_`, the buffer size adapts to the access
+  // pattern up to this size.
+  size_t max_buffer_size_ = 0;
+  int parallelism_ = 0;
+  // Background writes in flight, each returning 0 or an `errno` value.
+  std::deque<std::future<int>> pending_writes_;
+
+  bool direct_io_ = false;
+  // Data to be written with `O_DIRECT`, beginning at `direct_pos_`, which is a
+  // multiple of `internal::kDirectIoAlignment`.
+  //
+  // Invariant: if `direct_active_` then
+  //            `direct_pos_ + direct_length_ == start_pos_`
+  internal::DirectIoBuffer direct_buffer_;
+  bool direct_active_ = false;
+  Position direct_pos_ = 0;
+  size_t direct_length_ = 0;
+
+  bool data_sync_ = false;
+  // Allocated when a sync is requested. Shared with background syncs, which
+  // can outlive `*this` if it is destroyed without `Close()`.
+  std::shared_ptr<SyncState> sync_state_;
+
+  Position preallocate_ = 0;
+  Position write_behind_ = 0;
+  // The end of the range allocated with `fallocate()`, or 0 if nothing was
+  // preallocated since opening or `Truncate()`.
+  Position preallocated_end_ = 0;
+  // The position up to which writeback was started with `sync_file_range()`,
+  // a multiple of `write_behind_`.
+  Position write_behind_pos_ = 0;
 };
 
 // Template parameter independent part of `FdStreamWriter`.
@@ -231,6 +495,9 @@ class FdStreamWriterBase : public internal::FdWriterCommon {
   void InitializePos(int dest, int flags, absl::optional<Position> assumed_pos);
 
   bool WriteInternal(absl::string_view src) override;
+  using BufferedWriter::WriteSlow;
+  bool WriteSlow(const Chain& src) override;
+  Position CopyFromFd(int src, Position src_pos, Position length) override;
 };
 
 // A `Writer` which writes to a file descriptor. It supports random access.
@@ -242,8 +509,10 @@ class FdStreamWriterBase : public internal::FdWriterCommon {
 //  * `pwrite()`
 //  * `lseek()`     - unless `Options::set_initial_pos(pos)`
 //  * `fstat()`     - for `Seek()`, `Size()`, or `Truncate()`
-//  * `fsync()`     - for `Flush(FlushType::kFromMachine)`
-//  * `ftruncate()` - for `Truncate()`
+//  * `fsync()`     - for `Flush(FlushType::kFromMachine)` or `FlushAsync()`
+//                    (`fdatasync()` if `Options::set_data_sync()`)
+//  * `ftruncate()` - for `Truncate()`, or for `Close()` if
+//                    `Options::set_preallocate()`
 //
 // The `Dest` template parameter specifies the type of the object providing and
 // possibly owning the fd being written to. `Dest` must support
@@ -286,6 +555,10 @@ class FdWriter : public FdWriterBase {
   FdWriter(FdWriter&& that) noexcept;
   FdWriter& operator=(FdWriter&& that) noexcept;
 
+  // Waits for background writes and syncs if the `FdWriter` was not closed,
+  // before the fd can be closed.
+  ~FdWriter();
+
   // Makes `*this` equivalent to a newly constructed `FdWriter`. This avoids
   // constructing a temporary `FdWriter` and moving from it.
   void Reset();
@@ -317,11 +590,17 @@ class FdWriter : public FdWriterBase {
 // A `Writer` which writes to a fd which does not have to support random access.
 //
 // The fd should support:
-//  * `close()` - if the fd is owned
+//  * `close()`  - if the fd is owned
 //  * `write()`
-//  * `fstat()` - when opening for appending
-//                unless `Options::set_assumed_pos(pos)`
-//  * `fsync()` - for Flush(FlushType::kFromMachine)`
+//  * `writev()` - for writing a large `Chain`
+//  * `fstat()`  - when opening for appending
+//                 unless `Options::set_assumed_pos(pos)`
+//  * `fsync()`  - for Flush(FlushType::kFromMachine)`
+//
+// This includes sockets and pipes, e.g. for streaming records between
+// processes with `RecordWriter<FdStreamWriter<>>`. A large `Chain`, like a
+// chunk written by `DefaultChunkWriter`, is written with `writev()` directly
+// from its blocks instead of being copied to the buffer.
 //
 // The `Dest` template parameter specifies the type of the object providing and
 // possibly owning the fd being written to. `Dest` must support
@@ -398,6 +677,256 @@ class FdStreamWriter : public FdStreamWriterBase {
   Dependency<int, Dest> dest_;
 };
 
+// Template parameter independent part of `FdMMapWriter`.
+class FdMMapWriterBase : public Writer {
+ public:
+  class Options {
+   public:
+    Options() noexcept {}
+
+    // Permissions to use in case a new file is created (9 bits). The effective
+    // permissions are modified by the process's umask.
+    //
+    // Default: `0666`
+    Options& set_permissions(mode_t permissions) & {
+      permissions_ = permissions;
+      return *this;
+    }
+    Options&& set_permissions(mode_t permissions) && {
+      return std::move(set_permissions(permissions));
+    }
+
+    // If `absl::nullopt`, `FdMMapWriter` will initially get the current fd
+    // position, and will set the fd position on `Close()` and `Flush()`.
+    //
+    // If not `absl::nullopt`, writing will start from this position. The
+    // current fd position will not be gotten or set.
+    //
+    // Default: `absl::nullopt`.
+    Options& set_initial_pos(absl::optional<Position> initial_pos) & {
+      initial_pos_ = initial_pos;
+      return *this;
+    }
+    Options&& set_initial_pos(absl::optional<Position> initial_pos) && {
+      return std::move(set_initial_pos(initial_pos));
+    }
+
+    // Tunes the size of a region of the file mapped at a time (rounded up to
+    // the page size). When writing reaches the end of a region, the file is
+    // extended with `ftruncate()` to cover the next region, which is mapped
+    // instead.
+    //
+    // Larger regions need fewer `ftruncate()` and `mmap()` calls, at the cost
+    // of more address space.
+    //
+    // Default: 64M
+    Options& set_mapping_size(size_t mapping_size) & {
+      RIEGELI_ASSERT_GT(mapping_size, 0u)
+          << "Failed precondition of "
+             "FdMMapWriterBase::Options::set_mapping_size(): "
+             "zero mapping size";
+      mapping_size_ = mapping_size;
+      return *this;
+    }
+    Options&& set_mapping_size(size_t mapping_size) && {
+      return std::move(set_mapping_size(mapping_size));
+    }
+
+   private:
+    friend class FdMMapWriterBase;
+    template <typename Dest>
+    friend class FdMMapWriter;
+
+    mode_t permissions_ = 0666;
+    absl::optional<Position> initial_pos_;
+    size_t mapping_size_ = size_t{64} << 20;
+  };
+
+  // Returns the fd being written to. If the fd is owned then changed to -1 by
+  // `Close()`, otherwise unchanged.
+  virtual int dest_fd() const = 0;
+
+  // Returns the original name of the file being written to (or
+  // "/proc/self/fd/<fd>" if fd was given). Unchanged by `Close()`.
+  const std::string& filename() const { return filename_; }
+
+  bool Flush(FlushType flush_type) override;
+  bool SupportsTruncate() const override { return true; }
+  bool Truncate(Position new_size) override;
+
+ protected:
+  FdMMapWriterBase() noexcept : Writer(kInitiallyClosed) {}
+
+  explicit FdMMapWriterBase(bool sync_pos, const Options& options);
+
+  FdMMapWriterBase(FdMMapWriterBase&& that) noexcept;
+  FdMMapWriterBase& operator=(FdMMapWriterBase&& that) noexcept;
+
+  ~FdMMapWriterBase();
+
+  void Reset();
+  void Reset(bool sync_pos, const Options& options);
+  void Initialize(int dest, absl::optional<Position> initial_pos);
+  void SetFilename(int dest);
+  int OpenFd(absl::string_view filename, int flags, mode_t permissions);
+  ABSL_ATTRIBUTE_COLD bool FailOperation(absl::string_view operation);
+  void InitializePos(int dest, absl::optional<Position> initial_pos);
+  void InitializePos(int dest, int flags, absl::optional<Position> initial_pos);
+
+  void Done() override;
+  bool PushSlow(size_t min_length, size_t recommended_length) override;
+
+ private:
+  // Unmaps the current region without touching the buffer or the status, e.g.
+  // if the `FdMMapWriter` is destroyed or reset without being closed.
+  void DiscardMapping();
+
+  // Unmaps the current region, leaving the buffer empty at the same position.
+  //
+  // Return values:
+  //  * `true`  - success (`healthy()`)
+  //  * `false` - failure (`!healthy()`)
+  bool Unmap();
+
+  // Extends the file to at least `size` with `ftruncate()`.
+  //
+  // Return values:
+  //  * `true`  - success (`healthy()`)
+  //  * `false` - failure (`!healthy()`)
+  bool ExtendFile(int dest, Position size);
+
+  // Truncates the file to the written data, but not below `min_size_`, and
+  // limits the buffer to the file.
+  //
+  // Return values:
+  //  * `true`  - success (`healthy()`)
+  //  * `false` - failure (`!healthy()`)
+  bool TrimFile(int dest);
+
+  // Sets the fd position to `pos()` if `sync_pos_`.
+  //
+  // Return values:
+  //  * `true`  - success (`healthy()`)
+  //  * `false` - failure (`!healthy()`)
+  bool SyncPos(int dest);
+
+  std::string filename_;
+  bool sync_pos_ = false;
+  size_t mapping_size_ = 0;
+  // The current size of the file, which can include zeros beyond written data
+  // if the file was extended ahead of writing.
+  Position file_size_ = 0;
+  // The size of the file written over, below which the file is not truncated.
+  // This is the original size of the file, lowered by `Truncate()`.
+  Position min_size_ = 0;
+  // The mapped region, beginning at `start_pos_`, or `nullptr` if nothing is
+  // mapped.
+  //
+  // Invariants:
+  //   if `mapped_data_ == nullptr` then `start_ == nullptr`
+  //   if `mapped_data_ != nullptr` then `start_ == mapped_data_` and
+  //                                     `limit_ <= mapped_data_ + mapped_size_`
+  char* mapped_data_ = nullptr;
+  size_t mapped_size_ = 0;
+};
+
+// A `Writer` which writes to a file descriptor by mapping consecutive regions
+// of the file to memory and writing data there, like `ArrayWriter` over the
+// mapping. Before a region is mapped, the file is extended with `ftruncate()`
+// to cover it. This avoids a system call and a copy per buffer of data, e.g.
+// for files on tmpfs.
+//
+// While writing, the file can be longer than the data written, with zeros at
+// the end, up to the end of the mapped region. `Flush()` and `Close()`
+// truncate the file to the data written (but not below its original size,
+// unless `Truncate()` is used).
+//
+// `Flush(FlushType::kFromObject)` and `Flush(FlushType::kFromProcess)` do not
+// need to write anything, because the mapping is shared with the page cache.
+// `Flush(FlushType::kFromMachine)` makes data durable with `msync()` of the
+// mapped region and `fsync()` of the rest of the file and its size.
+//
+// The fd should support:
+//  * `fcntl()`     - for the constructor from fd
+//                    unless `Options::set_initial_pos(pos)`
+//  * `close()`     - if the fd is owned
+//  * `lseek()`     - unless `Options::set_initial_pos(pos)`
+//  * `fstat()`
+//  * `ftruncate()`
+//  * `mmap()`      - with `PROT_WRITE` and `MAP_SHARED`, which requires the fd
+//                    to be opened for reading and writing
+//  * `msync()`, `fsync()` - for `Flush(FlushType::kFromMachine)`
+//
+// The `Dest` template parameter specifies the type of the object providing and
+// possibly owning the fd being written to. `Dest` must support
+// `Dependency<int, Dest>`, e.g. `OwnedFd` (owned, default), `int` (not owned).
+//
+// The fd must not be closed until the `FdMMapWriter` is closed or no longer
+// used. The file must not be truncated by others while it is being written.
+template <typename Dest = OwnedFd>
+class FdMMapWriter : public FdMMapWriterBase {
+ public:
+  // Creates a closed `FdMMapWriter`.
+  FdMMapWriter() noexcept {}
+
+  // Will write to the fd provided by `dest`.
+  //
+  // `internal::type_identity_t<Dest>` disables template parameter deduction
+  // (C++17), letting `FdMMapWriter(fd)` mean `FdMMapWriter<OwnedFd>(fd)`
+  // rather than `FdMMapWriter<int>(fd)`.
+  explicit FdMMapWriter(const internal::type_identity_t<Dest>& dest,
+                        Options options = Options());
+  explicit FdMMapWriter(internal::type_identity_t<Dest>&& dest,
+                        Options options = Options());
+
+  // Will write to the fd provided by a `Dest` constructed from elements of
+  // `dest_args`. This avoids constructing a temporary `Dest` and moving from
+  // it.
+  template <typename... DestArgs>
+  explicit FdMMapWriter(std::tuple<DestArgs...> dest_args,
+                        Options options = Options());
+
+  // Opens a file for writing.
+  //
+  // `flags` is the second argument of `open()`, typically one of:
+  //  * `O_RDWR | O_CREAT | O_TRUNC`
+  //  * `O_RDWR | O_CREAT | O_APPEND`
+  //
+  // `flags` must include `O_RDWR`.
+  explicit FdMMapWriter(absl::string_view filename, int flags,
+                        Options options = Options());
+
+  FdMMapWriter(FdMMapWriter&& that) noexcept;
+  FdMMapWriter& operator=(FdMMapWriter&& that) noexcept;
+
+  // Makes `*this` equivalent to a newly constructed `FdMMapWriter`. This avoids
+  // constructing a temporary `FdMMapWriter` and moving from it.
+  void Reset();
+  void Reset(const Dest& dest, Options options = Options());
+  void Reset(Dest&& dest, Options options = Options());
+  template <typename... DestArgs>
+  void Reset(std::tuple<DestArgs...> dest_args, Options options = Options());
+  void Reset(absl::string_view filename, int flags,
+             Options options = Options());
+
+  // Returns the object providing and possibly owning the fd being written to.
+  // If the fd is owned then changed to -1 by `Close()`, otherwise unchanged.
+  Dest& dest() { return dest_.manager(); }
+  const Dest& dest() const { return dest_.manager(); }
+  int dest_fd() const override { return dest_.get(); }
+
+ protected:
+  void Done() override;
+
+ private:
+  using FdMMapWriterBase::Initialize;
+  void Initialize(absl::string_view filename, int flags, mode_t permissions,
+                  absl::optional<Position> initial_pos);
+
+  // The object providing and possibly owning the fd being written to.
+  Dependency<int, Dest> dest_;
+};
+
 // Implementation details follow.
 
 namespace internal {
@@ -427,26 +956,106 @@ inline void FdWriterCommon::Reset(size_t buffer_size) {
 
 }  // namespace internal
 
-inline FdWriterBase::FdWriterBase(size_t buffer_size, bool sync_pos)
-    : FdWriterCommon(buffer_size), sync_pos_(sync_pos) {}
+inline FdWriterBase::FdWriterBase(bool sync_pos, const Options& options)
+    : FdWriterCommon(options.buffer_size_),
+      sync_pos_(sync_pos),
+      buffer_size_(options.buffer_size_),
+      max_buffer_size_(options.parallelism_ > 0 || options.direct_io_
+                           ? 0
+                           : options.max_buffer_size_),
+      parallelism_(options.parallelism_),
+      direct_io_(options.direct_io_),
+      direct_buffer_(options.direct_io_ ? options.buffer_size_ : 0),
+      data_sync_(options.data_sync_),
+      preallocate_(options.preallocate_),
+      write_behind_(options.write_behind_) {
+  set_max_buffer_size(max_buffer_size_);
+}
 
 inline FdWriterBase::FdWriterBase(FdWriterBase&& that) noexcept
-    : FdWriterCommon(std::move(that)), sync_pos_(that.sync_pos_) {}
+    : FdWriterCommon(std::move(that)),
+      sync_pos_(that.sync_pos_),
+      buffer_size_(that.buffer_size_),
+      max_buffer_size_(that.max_buffer_size_),
+      parallelism_(that.parallelism_),
+      pending_writes_(std::move(that.pending_writes_)),
+      direct_io_(that.direct_io_),
+      direct_buffer_(std::move(that.direct_buffer_)),
+      direct_active_(std::exchange(that.direct_active_, false)),
+      direct_pos_(that.direct_pos_),
+      direct_length_(std::exchange(that.direct_length_, 0)),
+      data_sync_(that.data_sync_),
+      sync_state_(std::move(that.sync_state_)),
+      preallocate_(that.preallocate_),
+      write_behind_(that.write_behind_),
+      preallocated_end_(that.preallocated_end_),
+      write_behind_pos_(that.write_behind_pos_) {}
 
 inline FdWriterBase& FdWriterBase::operator=(FdWriterBase&& that) noexcept {
+  WaitForWrites(0);
+  WaitForSyncs();
   FdWriterCommon::operator=(std::move(that));
   sync_pos_ = that.sync_pos_;
+  buffer_size_ = that.buffer_size_;
+  max_buffer_size_ = that.max_buffer_size_;
+  parallelism_ = that.parallelism_;
+  pending_writes_ = std::move(that.pending_writes_);
+  direct_io_ = that.direct_io_;
+  direct_buffer_ = std::move(that.direct_buffer_);
+  direct_active_ = std::exchange(that.direct_active_, false);
+  direct_pos_ = that.direct_pos_;
+  direct_length_ = std::exchange(that.direct_length_, 0);
+  data_sync_ = that.data_sync_;
+  sync_state_ = std::move(that.sync_state_);
+  preallocate_ = that.preallocate_;
+  write_behind_ = that.write_behind_;
+  preallocated_end_ = that.preallocated_end_;
+  write_behind_pos_ = that.write_behind_pos_;
   return *this;
 }
 
 inline void FdWriterBase::Reset() {
+  WaitForWrites(0);
+  WaitForSyncs();
   FdWriterCommon::Reset();
   sync_pos_ = false;
+  buffer_size_ = 0;
+  max_buffer_size_ = 0;
+  parallelism_ = 0;
+  direct_io_ = false;
+  direct_buffer_ = internal::DirectIoBuffer();
+  direct_active_ = false;
+  direct_pos_ = 0;
+  direct_length_ = 0;
+  data_sync_ = false;
+  preallocate_ = 0;
+  write_behind_ = 0;
+  preallocated_end_ = 0;
+  write_behind_pos_ = 0;
 }
 
-inline void FdWriterBase::Reset(size_t buffer_size, bool sync_pos) {
-  FdWriterCommon::Reset(buffer_size);
+inline void FdWriterBase::Reset(bool sync_pos, const Options& options) {
+  WaitForWrites(0);
+  WaitForSyncs();
+  FdWriterCommon::Reset(options.buffer_size_);
   sync_pos_ = sync_pos;
+  buffer_size_ = options.buffer_size_;
+  max_buffer_size_ = options.parallelism_ > 0 || options.direct_io_
+                         ? 0
+                         : options.max_buffer_size_;
+  set_max_buffer_size(max_buffer_size_);
+  parallelism_ = options.parallelism_;
+  direct_io_ = options.direct_io_;
+  direct_buffer_ = internal::DirectIoBuffer(
+      options.direct_io_ ? options.buffer_size_ : 0);
+  direct_active_ = false;
+  direct_pos_ = 0;
+  direct_length_ = 0;
+  data_sync_ = options.data_sync_;
+  preallocate_ = options.preallocate_;
+  write_behind_ = options.write_behind_;
+  preallocated_end_ = 0;
+  write_behind_pos_ = 0;
 }
 
 inline void FdWriterBase::Initialize(int dest,
@@ -454,6 +1063,8 @@ inline void FdWriterBase::Initialize(int dest,
   RIEGELI_ASSERT_GE(dest, 0)
       << "Failed precondition of FdWriter: negative file descriptor";
   SetFilename(dest);
+  InitializeDirectIo(dest);
+  InitializeBufferSize(dest);
   InitializePos(dest, initial_pos);
 }
 
@@ -479,10 +1090,68 @@ inline void FdStreamWriterBase::Initialize(
   start_pos_ = *assumed_pos;
 }
 
+inline FdMMapWriterBase::FdMMapWriterBase(bool sync_pos,
+                                          const Options& options)
+    : Writer(kInitiallyOpen),
+      sync_pos_(sync_pos),
+      mapping_size_(options.mapping_size_) {}
+
+inline FdMMapWriterBase::FdMMapWriterBase(FdMMapWriterBase&& that) noexcept
+    : Writer(std::move(that)),
+      filename_(std::move(that.filename_)),
+      sync_pos_(that.sync_pos_),
+      mapping_size_(that.mapping_size_),
+      file_size_(that.file_size_),
+      min_size_(that.min_size_),
+      mapped_data_(std::exchange(that.mapped_data_, nullptr)),
+      mapped_size_(std::exchange(that.mapped_size_, 0)) {}
+
+inline FdMMapWriterBase& FdMMapWriterBase::operator=(
+    FdMMapWriterBase&& that) noexcept {
+  DiscardMapping();
+  Writer::operator=(std::move(that));
+  filename_ = std::move(that.filename_);
+  sync_pos_ = that.sync_pos_;
+  mapping_size_ = that.mapping_size_;
+  file_size_ = that.file_size_;
+  min_size_ = that.min_size_;
+  mapped_data_ = std::exchange(that.mapped_data_, nullptr);
+  mapped_size_ = std::exchange(that.mapped_size_, 0);
+  return *this;
+}
+
+inline void FdMMapWriterBase::Reset() {
+  DiscardMapping();
+  Writer::Reset(kInitiallyClosed);
+  filename_.clear();
+  sync_pos_ = false;
+  mapping_size_ = 0;
+  file_size_ = 0;
+  min_size_ = 0;
+}
+
+inline void FdMMapWriterBase::Reset(bool sync_pos, const Options& options) {
+  DiscardMapping();
+  Writer::Reset(kInitiallyOpen);
+  // `filename_` will be set by `Initialize()`.
+  sync_pos_ = sync_pos;
+  mapping_size_ = options.mapping_size_;
+  file_size_ = 0;
+  min_size_ = 0;
+}
+
+inline void FdMMapWriterBase::Initialize(int dest,
+                                         absl::optional<Position> initial_pos) {
+  RIEGELI_ASSERT_GE(dest, 0)
+      << "Failed precondition of FdMMapWriter: negative file descriptor";
+  SetFilename(dest);
+  InitializePos(dest, initial_pos);
+}
+
 template <typename Dest>
 inline FdWriter<Dest>::FdWriter(const internal::type_identity_t<Dest>& dest,
                                 Options options)
-    : FdWriterBase(options.buffer_size_, !options.initial_pos_.has_value()),
+    : FdWriterBase(!options.initial_pos_.has_value(), options),
       dest_(dest) {
   Initialize(dest_.get(), options.initial_pos_);
 }
@@ -490,7 +1159,7 @@ inline FdWriter<Dest>::FdWriter(const internal::type_identity_t<Dest>& dest,
 template <typename Dest>
 inline FdWriter<Dest>::FdWriter(internal::type_identity_t<Dest>&& dest,
                                 Options options)
-    : FdWriterBase(options.buffer_size_, !options.initial_pos_.has_value()),
+    : FdWriterBase(!options.initial_pos_.has_value(), options),
       dest_(std::move(dest)) {
   Initialize(dest_.get(), options.initial_pos_);
 }
@@ -499,7 +1168,7 @@ template <typename Dest>
 template <typename... DestArgs>
 inline FdWriter<Dest>::FdWriter(std::tuple<DestArgs...> dest_args,
                                 Options options)
-    : FdWriterBase(options.buffer_size_, !options.initial_pos_.has_value()),
+    : FdWriterBase(!options.initial_pos_.has_value(), options),
       dest_(std::move(dest_args)) {
   Initialize(dest_.get(), options.initial_pos_);
 }
@@ -507,7 +1176,7 @@ inline FdWriter<Dest>::FdWriter(std::tuple<DestArgs...> dest_args,
 template <typename Dest>
 inline FdWriter<Dest>::FdWriter(absl::string_view filename, int flags,
                                 Options options)
-    : FdWriterBase(options.buffer_size_, !options.initial_pos_.has_value()) {
+    : FdWriterBase(!options.initial_pos_.has_value(), options) {
   Initialize(filename, flags, options.permissions_, options.initial_pos_);
 }
 
@@ -522,6 +1191,11 @@ inline FdWriter<Dest>& FdWriter<Dest>::operator=(FdWriter&& that) noexcept {
   return *this;
 }
 
+template <typename Dest>
+inline FdWriter<Dest>::~FdWriter() {
+  WaitForBackgroundOperations();
+}
+
 template <typename Dest>
 inline void FdWriter<Dest>::Reset() {
   FdWriterBase::Reset();
@@ -530,14 +1204,14 @@ inline void FdWriter<Dest>::Reset() {
 
 template <typename Dest>
 inline void FdWriter<Dest>::Reset(const Dest& dest, Options options) {
-  FdWriterBase::Reset(options.buffer_size_, !options.initial_pos_.has_value());
+  FdWriterBase::Reset(!options.initial_pos_.has_value(), options);
   dest_.Reset(dest);
   Initialize(dest_.get(), options.initial_pos_);
 }
 
 template <typename Dest>
 inline void FdWriter<Dest>::Reset(Dest&& dest, Options options) {
-  FdWriterBase::Reset(options.buffer_size_, !options.initial_pos_.has_value());
+  FdWriterBase::Reset(!options.initial_pos_.has_value(), options);
   dest_.Reset(std::move(dest));
   Initialize(dest_.get(), options.initial_pos_);
 }
@@ -546,7 +1220,7 @@ template <typename Dest>
 template <typename... DestArgs>
 inline void FdWriter<Dest>::Reset(std::tuple<DestArgs...> dest_args,
                                   Options options) {
-  FdWriterBase::Reset(options.buffer_size_, !options.initial_pos_.has_value());
+  FdWriterBase::Reset(!options.initial_pos_.has_value(), options);
   dest_.Reset(std::move(dest_args));
   Initialize(dest_.get(), options.initial_pos_);
 }
@@ -554,7 +1228,7 @@ inline void FdWriter<Dest>::Reset(std::tuple<DestArgs...> dest_args,
 template <typename Dest>
 inline void FdWriter<Dest>::Reset(absl::string_view filename, int flags,
                                   Options options) {
-  FdWriterBase::Reset(options.buffer_size_, !options.initial_pos_.has_value());
+  FdWriterBase::Reset(!options.initial_pos_.has_value(), options);
   dest_.Reset();  // In case `OpenFd()` fails.
   Initialize(filename, flags, options.permissions_, options.initial_pos_);
 }
@@ -570,6 +1244,8 @@ inline void FdWriter<Dest>::Initialize(absl::string_view filename, int flags,
   const int dest = OpenFd(filename, flags, permissions);
   if (ABSL_PREDICT_FALSE(dest < 0)) return;
   dest_.Reset(std::forward_as_tuple(dest));
+  InitializeDirectIo(dest_.get());
+  InitializeBufferSize(dest_.get());
   InitializePos(dest_.get(), flags, initial_pos);
 }
 
@@ -691,11 +1367,118 @@ void FdStreamWriter<Dest>::Done() {
   }
 }
 
+template <typename Dest>
+inline FdMMapWriter<Dest>::FdMMapWriter(
+    const internal::type_identity_t<Dest>& dest, Options options)
+    : FdMMapWriterBase(!options.initial_pos_.has_value(), options),
+      dest_(dest) {
+  Initialize(dest_.get(), options.initial_pos_);
+}
+
+template <typename Dest>
+inline FdMMapWriter<Dest>::FdMMapWriter(internal::type_identity_t<Dest>&& dest,
+                                        Options options)
+    : FdMMapWriterBase(!options.initial_pos_.has_value(), options),
+      dest_(std::move(dest)) {
+  Initialize(dest_.get(), options.initial_pos_);
+}
+
+template <typename Dest>
+template <typename... DestArgs>
+inline FdMMapWriter<Dest>::FdMMapWriter(std::tuple<DestArgs...> dest_args,
+                                        Options options)
+    : FdMMapWriterBase(!options.initial_pos_.has_value(), options),
+      dest_(std::move(dest_args)) {
+  Initialize(dest_.get(), options.initial_pos_);
+}
+
+template <typename Dest>
+inline FdMMapWriter<Dest>::FdMMapWriter(absl::string_view filename, int flags,
+                                        Options options)
+    : FdMMapWriterBase(!options.initial_pos_.has_value(), options) {
+  Initialize(filename, flags, options.permissions_, options.initial_pos_);
+}
+
+template <typename Dest>
+inline FdMMapWriter<Dest>::FdMMapWriter(FdMMapWriter&& that) noexcept
+    : FdMMapWriterBase(std::move(that)), dest_(std::move(that.dest_)) {}
+
+template <typename Dest>
+inline FdMMapWriter<Dest>& FdMMapWriter<Dest>::operator=(
+    FdMMapWriter&& that) noexcept {
+  FdMMapWriterBase::operator=(std::move(that));
+  dest_ = std::move(that.dest_);
+  return *this;
+}
+
+template <typename Dest>
+inline void FdMMapWriter<Dest>::Reset() {
+  FdMMapWriterBase::Reset();
+  dest_.Reset();
+}
+
+template <typename Dest>
+inline void FdMMapWriter<Dest>::Reset(const Dest& dest, Options options) {
+  FdMMapWriterBase::Reset(!options.initial_pos_.has_value(), options);
+  dest_.Reset(dest);
+  Initialize(dest_.get(), options.initial_pos_);
+}
+
+template <typename Dest>
+inline void FdMMapWriter<Dest>::Reset(Dest&& dest, Options options) {
+  FdMMapWriterBase::Reset(!options.initial_pos_.has_value(), options);
+  dest_.Reset(std::move(dest));
+  Initialize(dest_.get(), options.initial_pos_);
+}
+
+template <typename Dest>
+template <typename... DestArgs>
+inline void FdMMapWriter<Dest>::Reset(std::tuple<DestArgs...> dest_args,
+                                      Options options) {
+  FdMMapWriterBase::Reset(!options.initial_pos_.has_value(), options);
+  dest_.Reset(std::move(dest_args));
+  Initialize(dest_.get(), options.initial_pos_);
+}
+
+template <typename Dest>
+inline void FdMMapWriter<Dest>::Reset(absl::string_view filename, int flags,
+                                      Options options) {
+  FdMMapWriterBase::Reset(!options.initial_pos_.has_value(), options);
+  dest_.Reset();  // In case `OpenFd()` fails.
+  Initialize(filename, flags, options.permissions_, options.initial_pos_);
+}
+
+template <typename Dest>
+inline void FdMMapWriter<Dest>::Initialize(
+    absl::string_view filename, int flags, mode_t permissions,
+    absl::optional<Position> initial_pos) {
+  RIEGELI_ASSERT((flags & O_ACCMODE) == O_RDWR)
+      << "Failed precondition of FdMMapWriter: flags must include O_RDWR";
+  const int dest = OpenFd(filename, flags, permissions);
+  if (ABSL_PREDICT_FALSE(dest < 0)) return;
+  dest_.Reset(std::forward_as_tuple(dest));
+  InitializePos(dest_.get(), flags, initial_pos);
+}
+
+template <typename Dest>
+void FdMMapWriter<Dest>::Done() {
+  FdMMapWriterBase::Done();
+  if (dest_.is_owning()) {
+    const int dest = dest_.Release();
+    if (ABSL_PREDICT_FALSE(internal::CloseFd(dest) < 0) &&
+        ABSL_PREDICT_TRUE(healthy())) {
+      FailOperation(internal::CloseFunctionName());
+    }
+  }
+}
+
 template <typename Dest>
 struct Resetter<FdWriter<Dest>> : ResetterByReset<FdWriter<Dest>> {};
 template <typename Dest>
 struct Resetter<FdStreamWriter<Dest>> : ResetterByReset<FdStreamWriter<Dest>> {
 };
+template <typename Dest>
+struct Resetter<FdMMapWriter<Dest>> : ResetterByReset<FdMMapWriter<Dest>> {};
 
 }  // namespace riegeli
 
@@ -18,7 +18,9 @@
 #include <stdint.h>
 
 #include <cstring>
+#include <future>
 #include <limits>
+#include <utility>
 
 #include "absl/base/optimization.h"
 #include "absl/strings/string_view.h"
@@ -27,6 +29,8 @@
 #include "riegeli/base/buffer.h"
 #include "riegeli/base/canonical_errors.h"
 #include "riegeli/base/endian.h"
+#include "riegeli/base/parallelism.h"
+#include "riegeli/base/status.h"
 #include "riegeli/bytes/pullable_reader.h"
 #include "riegeli/bytes/reader.h"
 #include "snappy.h"
@@ -40,11 +44,105 @@ inline uint32_t MaskChecksum(uint32_t x) {
   return ((x >> 15) | (x << 17)) + 0xa282ead8;
 }
 
+constexpr size_t kChunkHeaderSize = sizeof(uint32_t);
+
+// Decodes a frame with data, verifying its checksum. `chunk` points to the
+// frame after its header, `chunk_length` long.
+//
+// Compressed data are decompressed to `*uncompressed`. Uncompressed data are
+// left in place. `*data` and `*length` are set to the uncompressed data.
+//
+// Returns status:
+//  * `status.ok()`  - success
+//  * `!status.ok()` - invalid data
+Status DecodeFrame(uint8_t chunk_type, const char* chunk, size_t chunk_length,
+                   Buffer* uncompressed, const char** data, size_t* length) {
+  uint32_t checksum;
+  if (ABSL_PREDICT_FALSE(chunk_length < sizeof(checksum))) {
+    return DataLossError(chunk_type == 0x00
+                             ? "Invalid Snappy-compressed stream: "
+                               "compressed data too short"
+                             : "Invalid Snappy-compressed stream: "
+                               "uncompressed data too short");
+  }
+  std::memcpy(&checksum, chunk, sizeof(checksum));
+  const char* const chunk_data = chunk + sizeof(checksum);
+  const size_t chunk_data_length = chunk_length - sizeof(checksum);
+  if (chunk_type == 0x00) {  // Compressed data.
+    size_t uncompressed_length;
+    if (ABSL_PREDICT_FALSE(!snappy::GetUncompressedLength(
+            chunk_data, chunk_data_length, &uncompressed_length))) {
+      return DataLossError(
+          "Invalid Snappy-compressed stream: invalid uncompressed length");
+    }
+    if (ABSL_PREDICT_FALSE(uncompressed_length > snappy::kBlockSize)) {
+      return DataLossError(
+          "Invalid Snappy-compressed stream: uncompressed length too large");
+    }
+    uncompressed->Resize(uncompressed_length);
+    char* const uncompressed_data = uncompressed->GetData();
+    if (ABSL_PREDICT_FALSE(!snappy::RawUncompress(
+            chunk_data, chunk_data_length, uncompressed_data))) {
+      return DataLossError(
+          "Invalid Snappy-compressed stream: invalid compressed data");
+    }
+    *data = uncompressed_data;
+    *length = uncompressed_length;
+  } else {  // Uncompressed data.
+    if (ABSL_PREDICT_FALSE(chunk_data_length > snappy::kBlockSize)) {
+      return DataLossError(
+          "Invalid Snappy-compressed stream: uncompressed length too large");
+    }
+    *data = chunk_data;
+    *length = chunk_data_length;
+  }
+  if (ABSL_PREDICT_FALSE(MaskChecksum(crc32c::Crc32c(*data, *length)) !=
+                         ReadLittleEndian32(checksum))) {
+    return DataLossError("Invalid Snappy-compressed stream: wrong checksum");
+  }
+  return OkStatus();
+}
+
+// Finds the length of uncompressed data of a frame with data, without
+// decompressing them and without verifying the checksum. `chunk` points to the
+// frame after its header, `chunk_length` long.
+//
+// Returns status:
+//  * `status.ok()`  - success
+//  * `!status.ok()` - invalid data
+Status DataFrameLength(uint8_t chunk_type, const char* chunk,
+                       size_t chunk_length, size_t* length) {
+  if (ABSL_PREDICT_FALSE(chunk_length < sizeof(uint32_t))) {
+    return DataLossError(chunk_type == 0x00
+                             ? "Invalid Snappy-compressed stream: "
+                               "compressed data too short"
+                             : "Invalid Snappy-compressed stream: "
+                               "uncompressed data too short");
+  }
+  const char* const chunk_data = chunk + sizeof(uint32_t);
+  const size_t chunk_data_length = chunk_length - sizeof(uint32_t);
+  if (chunk_type == 0x00) {  // Compressed data.
+    if (ABSL_PREDICT_FALSE(!snappy::GetUncompressedLength(
+            chunk_data, chunk_data_length, length))) {
+      return DataLossError(
+          "Invalid Snappy-compressed stream: invalid uncompressed length");
+    }
+  } else {  // Uncompressed data.
+    *length = chunk_data_length;
+  }
+  if (ABSL_PREDICT_FALSE(*length > snappy::kBlockSize)) {
+    return DataLossError(
+        "Invalid Snappy-compressed stream: uncompressed length too large");
+  }
+  return OkStatus();
+}
+
 }  // namespace
 
-void FramedSnappyReaderBase::Initialize(Reader* src) {
+void FramedSnappyReaderBase::Initialize(Reader* src, int parallelism) {
   RIEGELI_ASSERT(src != nullptr)
       << "Failed precondition of FramedSnappyReader: null Reader pointer";
+  parallelism_ = parallelism;
   if (ABSL_PREDICT_FALSE(!src->healthy()) && src->available() == 0) {
     Fail(*src);
     return;
@@ -55,9 +153,82 @@ void FramedSnappyReaderBase::Done() {
   if (ABSL_PREDICT_FALSE(truncated_)) {
     Fail(DataLossError("Truncated Snappy-compressed stream"));
   }
+  read_ahead_.clear();
   PullableReader::Done();
 }
 
+inline bool FramedSnappyReaderBase::FindDataFrame(Reader* src,
+                                                  uint8_t* chunk_type,
+                                                  size_t* chunk_length,
+                                                  Status* status) {
+  truncated_ = false;
+  for (;;) {
+    uint32_t chunk_header;
+    if (ABSL_PREDICT_FALSE(!src->Pull(sizeof(chunk_header)))) {
+      if (ABSL_PREDICT_FALSE(src->healthy() && src->available() > 0)) {
+        truncated_ = true;
+      }
+      return false;
+    }
+    std::memcpy(&chunk_header, src->cursor(), sizeof(chunk_header));
+    *chunk_type = static_cast<uint8_t>(ReadLittleEndian32(chunk_header));
+    *chunk_length = IntCast<size_t>(ReadLittleEndian32(chunk_header) >> 8);
+    if (ABSL_PREDICT_FALSE(!src->Pull(sizeof(chunk_header) + *chunk_length))) {
+      if (ABSL_PREDICT_FALSE(src->healthy() && src->available() > 0)) {
+        truncated_ = true;
+      }
+      return false;
+    }
+    const char* const compressed_chunk = src->cursor();
+    if (ABSL_PREDICT_FALSE(src->pos() == 0 &&
+                           *chunk_type != 0xff /* Stream identifier */)) {
+      *status = DataLossError(
+          "Invalid Snappy-compressed stream: missing stream identifier");
+      return false;
+    }
+    switch (*chunk_type) {
+      case 0x00:  // Compressed data.
+      case 0x01:  // Uncompressed data.
+        return true;
+      case 0xff:  // Stream identifier.
+        if (ABSL_PREDICT_FALSE(
+                absl::string_view(compressed_chunk + sizeof(chunk_header),
+                                  *chunk_length) !=
+                absl::string_view("sNaPpY", 6))) {
+          *status = DataLossError(
+              "Invalid Snappy-compressed stream: invalid stream identifier");
+          return false;
+        }
+        src->set_cursor(compressed_chunk + sizeof(chunk_header) +
+                        *chunk_length);
+        continue;
+      default:
+        if (ABSL_PREDICT_FALSE(*chunk_type < 0x80)) {
+          *status = DataLossError(
+              "Invalid Snappy-compressed stream: reserved unskippable chunk");
+          return false;
+        }
+        src->set_cursor(compressed_chunk + sizeof(chunk_header) +
+                        *chunk_length);
+        continue;
+    }
+  }
+}
+
+inline bool FramedSnappyReaderBase::SetBuffer(const char* data,
+                                              size_t length) {
+  start_ = data;
+  cursor_ = data;
+  if (ABSL_PREDICT_FALSE(length >
+                         std::numeric_limits<Position>::max() - limit_pos_)) {
+    limit_ = data;
+    return FailOverflow();
+  }
+  limit_ = data + length;
+  limit_pos_ += length;
+  return true;
+}
+
 bool FramedSnappyReaderBase::PullSlow(size_t min_length,
                                       size_t recommended_length) {
   RIEGELI_ASSERT_GT(min_length, available())
@@ -68,135 +239,199 @@ bool FramedSnappyReaderBase::PullSlow(size_t min_length,
   }
   if (ABSL_PREDICT_FALSE(!healthy())) return false;
   Reader* const src = src_reader();
-  truncated_ = false;
-  uint32_t chunk_header;
+  if (parallelism_ > 0) return PullFromReadAhead(src);
   for (;;) {
-    if (ABSL_PREDICT_FALSE(!src->Pull(sizeof(chunk_header)))) {
+    uint8_t chunk_type;
+    size_t chunk_length;
+    Status status;
+    if (ABSL_PREDICT_FALSE(
+            !FindDataFrame(src, &chunk_type, &chunk_length, &status))) {
+      if (ABSL_PREDICT_FALSE(!status.ok())) return Fail(std::move(status));
       if (ABSL_PREDICT_FALSE(!src->healthy())) return Fail(*src);
-      if (ABSL_PREDICT_FALSE(src->available() > 0)) truncated_ = true;
       return false;
     }
-    std::memcpy(&chunk_header, src->cursor(), sizeof(chunk_header));
-    const uint8_t chunk_type =
-        static_cast<uint8_t>(ReadLittleEndian32(chunk_header));
-    const size_t chunk_length =
-        IntCast<size_t>(ReadLittleEndian32(chunk_header) >> 8);
-    if (ABSL_PREDICT_FALSE(!src->Pull(sizeof(chunk_header) + chunk_length))) {
+    const char* const compressed_chunk = src->cursor();
+    const char* data;
+    size_t length;
+    status = DecodeFrame(chunk_type, compressed_chunk + kChunkHeaderSize,
+                         chunk_length, &uncompressed_, &data, &length);
+    if (ABSL_PREDICT_FALSE(!status.ok())) return Fail(std::move(status));
+    src->set_cursor(compressed_chunk + kChunkHeaderSize + chunk_length);
+    if (ABSL_PREDICT_FALSE(length == 0)) continue;
+    return SetBuffer(data, length);
+  }
+}
+
+bool FramedSnappyReaderBase::PullFromReadAhead(Reader* src) {
+  struct DecodingFrame {
+    uint8_t chunk_type;
+    Buffer chunk;
+    size_t chunk_length;
+    std::promise<DecodedFrame> decoded_frame;
+  };
+
+  for (;;) {
+    Status status;
+    while (read_ahead_.size() < IntCast<size_t>(parallelism_)) {
+      uint8_t chunk_type;
+      size_t chunk_length;
+      if (ABSL_PREDICT_FALSE(
+              !FindDataFrame(src, &chunk_type, &chunk_length, &status))) {
+        break;
+      }
+      DecodingFrame* const decoding_frame = new DecodingFrame();
+      decoding_frame->chunk_type = chunk_type;
+      decoding_frame->chunk_length = chunk_length;
+      if (chunk_length > 0) {
+        decoding_frame->chunk.Resize(chunk_length);
+        std::memcpy(decoding_frame->chunk.GetData(),
+                    src->cursor() + kChunkHeaderSize, chunk_length);
+      }
+      src->set_cursor(src->cursor() + kChunkHeaderSize + chunk_length);
+      read_ahead_.push_back(decoding_frame->decoded_frame.get_future());
+      ThreadPool::global().Schedule([decoding_frame] {
+        DecodedFrame decoded_frame;
+        const char* data = nullptr;
+        decoded_frame.status = DecodeFrame(
+            decoding_frame->chunk_type,
+            decoding_frame->chunk_length == 0
+                ? nullptr
+                : decoding_frame->chunk.GetData(),
+            decoding_frame->chunk_length, &decoded_frame.uncompressed, &data,
+            &decoded_frame.uncompressed_length);
+        if (decoded_frame.status.ok() &&
+            decoding_frame->chunk_type == 0x01 /* Uncompressed data */ &&
+            decoded_frame.uncompressed_length > 0) {
+          // Uncompressed data were left in `decoding_frame->chunk`.
+          decoded_frame.uncompressed.Resize(decoded_frame.uncompressed_length);
+          std::memcpy(decoded_frame.uncompressed.GetData(), data,
+                      decoded_frame.uncompressed_length);
+        }
+        decoding_frame->decoded_frame.set_value(std::move(decoded_frame));
+        delete decoding_frame;
+      });
+    }
+    if (read_ahead_.empty()) {
+      // The source ended or failed, or has invalid data after all frames read
+      // ahead were consumed.
+      if (ABSL_PREDICT_FALSE(!status.ok())) return Fail(std::move(status));
       if (ABSL_PREDICT_FALSE(!src->healthy())) return Fail(*src);
-      if (ABSL_PREDICT_FALSE(src->available() > 0)) truncated_ = true;
       return false;
     }
-    const char* const compressed_chunk = src->cursor();
-    if (ABSL_PREDICT_FALSE(src->pos() == 0 &&
-                           chunk_type != 0xff /* Stream identifier */)) {
-      return Fail(DataLossError(
-          "Invalid Snappy-compressed stream: missing stream identifier"));
-    }
-    switch (chunk_type) {
-      case 0x00: {  // Compressed data.
-        uint32_t checksum;
-        if (ABSL_PREDICT_FALSE(chunk_length < sizeof(checksum))) {
-          return Fail(DataLossError(
-              "Invalid Snappy-compressed stream: compressed data too short"));
-        }
-        const char* const compressed_data =
-            compressed_chunk + sizeof(chunk_header) + sizeof(checksum);
-        const size_t compressed_length = chunk_length - sizeof(checksum);
-        size_t uncompressed_length;
-        if (ABSL_PREDICT_FALSE(!snappy::GetUncompressedLength(
-                compressed_data, compressed_length, &uncompressed_length))) {
-          return Fail(DataLossError(
-              "Invalid Snappy-compressed stream: invalid uncompressed length"));
-        }
-        if (ABSL_PREDICT_FALSE(uncompressed_length > snappy::kBlockSize)) {
-          return Fail(
-              DataLossError("Invalid Snappy-compressed stream: "
-                            "uncompressed length too large"));
-        }
-        uncompressed_.Resize(uncompressed_length);
-        char* const uncompressed_data = uncompressed_.GetData();
-        if (ABSL_PREDICT_FALSE(!snappy::RawUncompress(
-                compressed_data, compressed_length, uncompressed_data))) {
-          return Fail(DataLossError(
-              "Invalid Snappy-compressed stream: invalid compressed data"));
-        }
-        std::memcpy(&checksum, compressed_chunk + sizeof(chunk_header),
-                    sizeof(checksum));
-        if (ABSL_PREDICT_FALSE(MaskChecksum(crc32c::Crc32c(
-                                   uncompressed_data, uncompressed_length)) !=
-                               ReadLittleEndian32(checksum))) {
-          return Fail(DataLossError(
-              "Invalid Snappy-compressed stream: wrong checksum"));
-        }
-        src->set_cursor(compressed_chunk + sizeof(chunk_header) + chunk_length);
-        if (ABSL_PREDICT_FALSE(uncompressed_length == 0)) continue;
-        start_ = uncompressed_data;
-        cursor_ = uncompressed_data;
-        if (ABSL_PREDICT_FALSE(uncompressed_length >
-                               std::numeric_limits<Position>::max() -
-                                   limit_pos_)) {
-          limit_ = uncompressed_data;
-          return FailOverflow();
-        }
-        limit_ = uncompressed_data + uncompressed_length;
-        limit_pos_ += uncompressed_length;
-        return true;
+    DecodedFrame decoded_frame = read_ahead_.front().get();
+    read_ahead_.pop_front();
+    if (ABSL_PREDICT_FALSE(!decoded_frame.status.ok())) {
+      read_ahead_.clear();
+      return Fail(std::move(decoded_frame.status));
+    }
+    if (ABSL_PREDICT_FALSE(decoded_frame.uncompressed_length == 0)) continue;
+    uncompressed_ = std::move(decoded_frame.uncompressed);
+    return SetBuffer(uncompressed_.GetData(),
+                     decoded_frame.uncompressed_length);
+  }
+}
+
+bool FramedSnappyReaderBase::SupportsRandomAccess() const {
+  const Reader* const src = src_reader();
+  return src != nullptr && src->SupportsRandomAccess();
+}
+
+bool FramedSnappyReaderBase::SeekSlow(Position new_pos) {
+  RIEGELI_ASSERT(new_pos < start_pos() || new_pos > limit_pos_)
+      << "Failed precondition of Reader::SeekSlow(): "
+         "position in the buffer, use Seek() instead";
+  if (ABSL_PREDICT_FALSE(!SeekUsingScratch(new_pos))) return true;
+  if (ABSL_PREDICT_FALSE(!healthy())) return false;
+  Reader* const src = src_reader();
+  if (new_pos <= limit_pos_) {
+    // Seeking backwards.
+    if (ABSL_PREDICT_FALSE(!src->SupportsRandomAccess())) {
+      return PullableReader::SeekSlow(new_pos);
+    }
+    // The buffer can point to the buffer of `*src`, so it must be discarded
+    // before moving `*src`.
+    start_ = nullptr;
+    cursor_ = nullptr;
+    limit_ = nullptr;
+    read_ahead_.clear();
+    truncated_ = false;
+    if (ABSL_PREDICT_FALSE(!src->Seek(0))) {
+      if (ABSL_PREDICT_FALSE(!src->healthy())) return Fail(*src);
+      return Fail(
+          DataLossError("Snappy-compressed stream shrank unexpectedly"));
+    }
+    limit_pos_ = 0;
+  } else {
+    // Seeking forwards. Frames read ahead are already being decompressed, so
+    // they are consumed rather than skipped.
+    start_ = nullptr;
+    cursor_ = nullptr;
+    limit_ = nullptr;
+    while (!read_ahead_.empty()) {
+      DecodedFrame decoded_frame = read_ahead_.front().get();
+      read_ahead_.pop_front();
+      if (ABSL_PREDICT_FALSE(!decoded_frame.status.ok())) {
+        read_ahead_.clear();
+        return Fail(std::move(decoded_frame.status));
       }
-      case 0x01: {  // Uncompressed data.
-        uint32_t checksum;
-        if (ABSL_PREDICT_FALSE(chunk_length < sizeof(checksum))) {
-          return Fail(DataLossError(
-              "Invalid Snappy-compressed stream: uncompressed data too short"));
-        }
-        const char* const uncompressed_data =
-            compressed_chunk + sizeof(chunk_header) + sizeof(checksum);
-        const size_t uncompressed_length = chunk_length - sizeof(checksum);
-        if (ABSL_PREDICT_FALSE(uncompressed_length > snappy::kBlockSize)) {
-          return Fail(
-              DataLossError("Invalid Snappy-compressed stream: "
-                            "uncompressed length too large"));
-        }
-        std::memcpy(&checksum, compressed_chunk + sizeof(chunk_header),
-                    sizeof(checksum));
-        if (ABSL_PREDICT_FALSE(MaskChecksum(crc32c::Crc32c(
-                                   uncompressed_data, uncompressed_length)) !=
-                               ReadLittleEndian32(checksum))) {
-          return Fail(DataLossError(
-              "Invalid Snappy-compressed stream: wrong checksum"));
-        }
-        src->set_cursor(compressed_chunk + sizeof(chunk_header) + chunk_length);
-        if (ABSL_PREDICT_FALSE(uncompressed_length == 0)) continue;
-        start_ = uncompressed_data;
-        cursor_ = uncompressed_data;
-        if (ABSL_PREDICT_FALSE(uncompressed_length >
-                               std::numeric_limits<Position>::max() -
-                                   limit_pos_)) {
-          limit_ = uncompressed_data;
-          return FailOverflow();
+      if (new_pos - limit_pos_ < decoded_frame.uncompressed_length) {
+        uncompressed_ = std::move(decoded_frame.uncompressed);
+        if (ABSL_PREDICT_FALSE(
+                !SetBuffer(uncompressed_.GetData(),
+                           decoded_frame.uncompressed_length))) {
+          return false;
         }
-        limit_ = uncompressed_data + uncompressed_length;
-        limit_pos_ += uncompressed_length;
+        cursor_ = limit_ - IntCast<size_t>(limit_pos_ - new_pos);
         return true;
       }
-      case 0xff:  // Stream identifier.
-        if (ABSL_PREDICT_FALSE(
-                absl::string_view(compressed_chunk + sizeof(chunk_header),
-                                  chunk_length) !=
-                absl::string_view("sNaPpY", 6))) {
-          return Fail(DataLossError(
-              "Invalid Snappy-compressed stream: invalid stream identifier"));
-        }
-        src->set_cursor(compressed_chunk + sizeof(chunk_header) + chunk_length);
-        continue;
-      default:
-        if (ABSL_PREDICT_FALSE(chunk_type < 0x80)) {
-          return Fail(DataLossError(
-              "Invalid Snappy-compressed stream: reserved unskippable chunk"));
-        }
-        src->set_cursor(compressed_chunk + sizeof(chunk_header) + chunk_length);
-        continue;
+      limit_pos_ += decoded_frame.uncompressed_length;
+    }
+  }
+  if (ABSL_PREDICT_FALSE(!SkipDataFrames(src, new_pos))) return false;
+  if (new_pos == limit_pos_) return true;
+  return PullableReader::SeekSlow(new_pos);
+}
+
+inline bool FramedSnappyReaderBase::SkipDataFrames(Reader* src,
+                                                   Position new_pos) {
+  RIEGELI_ASSERT_EQ(available(), 0u)
+      << "Failed precondition of FramedSnappyReaderBase::SkipDataFrames(): "
+         "buffer not empty";
+  while (limit_pos_ < new_pos) {
+    uint8_t chunk_type;
+    size_t chunk_length;
+    Status status;
+    if (ABSL_PREDICT_FALSE(
+            !FindDataFrame(src, &chunk_type, &chunk_length, &status))) {
+      if (ABSL_PREDICT_FALSE(!status.ok())) return Fail(std::move(status));
+      if (ABSL_PREDICT_FALSE(!src->healthy())) return Fail(*src);
+      return false;
     }
+    size_t length;
+    status = DataFrameLength(chunk_type, src->cursor() + kChunkHeaderSize,
+                             chunk_length, &length);
+    if (ABSL_PREDICT_FALSE(!status.ok())) return Fail(std::move(status));
+    if (new_pos - limit_pos_ < length) break;
+    src->set_cursor(src->cursor() + kChunkHeaderSize + chunk_length);
+    limit_pos_ += length;
+  }
+  return true;
+}
+
+bool FramedSnappyReaderBase::Size(Position* size) {
+  if (ABSL_PREDICT_FALSE(!healthy())) return false;
+  if (ABSL_PREDICT_FALSE(!src_reader()->SupportsRandomAccess())) {
+    return PullableReader::Size(size);
+  }
+  const Position pos_before = pos();
+  Seek(std::numeric_limits<Position>::max());
+  if (ABSL_PREDICT_FALSE(!healthy())) return false;
+  *size = pos();
+  if (ABSL_PREDICT_FALSE(!Seek(pos_before))) {
+    if (ABSL_PREDICT_FALSE(!healthy())) return false;
+    return Fail(DataLossError("Snappy-compressed stream shrank unexpectedly"));
   }
+  return true;
 }
 
 }  // namespace riegeli
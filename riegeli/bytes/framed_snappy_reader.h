@@ -16,15 +16,20 @@
 #define RIEGELI_BYTES_FRAMED_SNAPPY_READER_H_
 
 #include <stddef.h>
+#include <stdint.h>
 
+#include <deque>
+#include <future>
 #include <tuple>
 #include <utility>
 
 #include "absl/base/optimization.h"
+#include "riegeli/base/base.h"
 #include "riegeli/base/buffer.h"
 #include "riegeli/base/dependency.h"
 #include "riegeli/base/object.h"
 #include "riegeli/base/resetter.h"
+#include "riegeli/base/status.h"
 #include "riegeli/bytes/pullable_reader.h"
 #include "riegeli/bytes/reader.h"
 
@@ -33,12 +38,50 @@ namespace riegeli {
 // Template parameter independent part of `FramedSnappyReader`.
 class FramedSnappyReaderBase : public PullableReader {
  public:
-  class Options {};
+  class Options {
+   public:
+    Options() noexcept {}
+
+    // Sets the maximum number of frames being decompressed in parallel in
+    // background. Larger parallelism can increase throughput, up to a point
+    // where it no longer matters; smaller parallelism reduces memory usage.
+    //
+    // If `parallelism > 0`, frames are read ahead from the compressed `Reader`
+    // and decompressed and verified on `ThreadPool::global()`, and their data
+    // are returned in order.
+    //
+    // Default: 0
+    Options& set_parallelism(int parallelism) & {
+      RIEGELI_ASSERT_GE(parallelism, 0)
+          << "Failed precondition of "
+             "FramedSnappyReaderBase::Options::set_parallelism(): "
+             "negative parallelism";
+      parallelism_ = parallelism;
+      return *this;
+    }
+    Options&& set_parallelism(int parallelism) && {
+      return std::move(set_parallelism(parallelism));
+    }
+
+   private:
+    template <typename Src>
+    friend class FramedSnappyReader;
+
+    int parallelism_ = 0;
+  };
 
   // Returns the compressed `Reader`. Unchanged by `Close()`.
   virtual Reader* src_reader() = 0;
   virtual const Reader* src_reader() const = 0;
 
+  // Random access is supported if the compressed `Reader` supports it. Frames
+  // do not record their uncompressed positions, so seeking skips frames from
+  // the beginning of the compressed stream (for seeking backwards) or from the
+  // current position (for seeking forwards) without decompressing them, and
+  // `Size()` skips all frames.
+  bool SupportsRandomAccess() const override;
+  bool Size(Position* size) override;
+
  protected:
   explicit FramedSnappyReaderBase(InitiallyClosed) noexcept
       : PullableReader(kInitiallyClosed) {}
@@ -50,18 +93,64 @@ class FramedSnappyReaderBase : public PullableReader {
 
   void Reset(InitiallyClosed);
   void Reset(InitiallyOpen);
-  void Initialize(Reader* src);
+  void Initialize(Reader* src, int parallelism);
 
   void Done() override;
   bool PullSlow(size_t min_length, size_t recommended_length) override;
+  bool SeekSlow(Position new_pos) override;
 
  private:
+  // A frame decompressed in background.
+  struct DecodedFrame {
+    // If `!status.ok()`, the frame is invalid.
+    Status status;
+    Buffer uncompressed;
+    size_t uncompressed_length = 0;
+  };
+
+  // Finds the next frame with data in `*src`, skipping other frames. The frame
+  // begins at `src->cursor()` and is available in the buffer of `*src`.
+  //
+  // Return values:
+  //  * `true`  - success (`*chunk_type` and `*chunk_length` are set)
+  //  * `false` - the source ends (`status->ok()`, `truncated_` tells whether
+  //              it ends in the middle of a frame), the source failed
+  //              (`status->ok()`, `!src->healthy()`), or data are invalid
+  //              (`!status->ok()`)
+  bool FindDataFrame(Reader* src, uint8_t* chunk_type, size_t* chunk_length,
+                     Status* status);
+
+  // Skips frames with data in `*src` which end before `new_pos`, without
+  // decompressing them, and updates `limit_pos_` accordingly. The buffer must
+  // be empty.
+  //
+  // Return values:
+  //  * `true`  - success (`limit_pos_ <= new_pos`, the frame containing
+  //              `new_pos` if any begins at `src->cursor()`)
+  //  * `false` - the source ends before `new_pos` (`healthy()`), or failure
+  //              (`!healthy()`)
+  bool SkipDataFrames(Reader* src, Position new_pos);
+
+  // Makes the buffer point to `length` bytes of `data`.
+  //
+  // Return values:
+  //  * `true`  - success
+  //  * `false` - failure (`!healthy()`)
+  bool SetBuffer(const char* data, size_t length);
+
+  // Implementation of `PullSlow()` if `parallelism_ > 0`.
+  bool PullFromReadAhead(Reader* src);
+
+  int parallelism_ = 0;
   // If `true`, the source is truncated (without a clean end of the compressed
   // stream) at the current position. If the source does not grow, `Close()`
   // will fail.
   bool truncated_ = false;
   // Buffered uncompressed data.
   Buffer uncompressed_;
+  // Frames read ahead, being decompressed in background, if
+  // `parallelism_ > 0`.
+  std::deque<std::future<DecodedFrame>> read_ahead_;
 
   // Invariant if scratch is not used:
   //   `start_ == nullptr` or `start_ == uncompressed_.GetData()` or
@@ -131,34 +220,41 @@ class FramedSnappyReader : public FramedSnappyReaderBase {
 inline FramedSnappyReaderBase::FramedSnappyReaderBase(
     FramedSnappyReaderBase&& that) noexcept
     : PullableReader(std::move(that)),
-      uncompressed_(std::move(that.uncompressed_)) {}
+      parallelism_(that.parallelism_),
+      uncompressed_(std::move(that.uncompressed_)),
+      read_ahead_(std::move(that.read_ahead_)) {}
 
 inline FramedSnappyReaderBase& FramedSnappyReaderBase::operator=(
     FramedSnappyReaderBase&& that) noexcept {
   PullableReader::operator=(std::move(that));
+  parallelism_ = that.parallelism_;
   uncompressed_ = std::move(that.uncompressed_);
+  read_ahead_ = std::move(that.read_ahead_);
   return *this;
 }
 
 inline void FramedSnappyReaderBase::Reset(InitiallyClosed) {
   PullableReader::Reset(kInitiallyClosed);
+  parallelism_ = 0;
+  read_ahead_.clear();
 }
 
 inline void FramedSnappyReaderBase::Reset(InitiallyOpen) {
   PullableReader::Reset(kInitiallyOpen);
+  read_ahead_.clear();
 }
 
 template <typename Src>
 inline FramedSnappyReader<Src>::FramedSnappyReader(const Src& src,
                                                    Options options)
     : FramedSnappyReaderBase(kInitiallyOpen), src_(src) {
-  Initialize(src_.get());
+  Initialize(src_.get(), options.parallelism_);
 }
 
 template <typename Src>
 inline FramedSnappyReader<Src>::FramedSnappyReader(Src&& src, Options options)
     : FramedSnappyReaderBase(kInitiallyOpen), src_(std::move(src)) {
-  Initialize(src_.get());
+  Initialize(src_.get(), options.parallelism_);
 }
 
 template <typename Src>
@@ -166,7 +262,7 @@ template <typename... SrcArgs>
 inline FramedSnappyReader<Src>::FramedSnappyReader(
     std::tuple<SrcArgs...> src_args, Options options)
     : FramedSnappyReaderBase(kInitiallyOpen), src_(std::move(src_args)) {
-  Initialize(src_.get());
+  Initialize(src_.get(), options.parallelism_);
 }
 
 template <typename Src>
@@ -194,14 +290,14 @@ template <typename Src>
 inline void FramedSnappyReader<Src>::Reset(const Src& src, Options options) {
   FramedSnappyReaderBase::Reset(kInitiallyOpen);
   src_.Reset(src);
-  Initialize(src_.get());
+  Initialize(src_.get(), options.parallelism_);
 }
 
 template <typename Src>
 inline void FramedSnappyReader<Src>::Reset(Src&& src, Options options) {
   FramedSnappyReaderBase::Reset(kInitiallyOpen);
   src_.Reset(std::move(src));
-  Initialize(src_.get());
+  Initialize(src_.get(), options.parallelism_);
 }
 
 template <typename Src>
@@ -210,7 +306,7 @@ inline void FramedSnappyReader<Src>::Reset(std::tuple<SrcArgs...> src_args,
                                            Options options) {
   FramedSnappyReaderBase::Reset(kInitiallyOpen);
   src_.Reset(std::move(src_args));
-  Initialize(src_.get());
+  Initialize(src_.get(), options.parallelism_);
 }
 
 template <typename Src>
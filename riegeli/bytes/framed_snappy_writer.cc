@@ -18,7 +18,9 @@
 #include <stdint.h>
 
 #include <cstring>
+#include <future>
 #include <limits>
+#include <utility>
 
 #include "absl/base/optimization.h"
 #include "absl/strings/string_view.h"
@@ -26,6 +28,7 @@
 #include "riegeli/base/base.h"
 #include "riegeli/base/buffer.h"
 #include "riegeli/base/endian.h"
+#include "riegeli/base/parallelism.h"
 #include "riegeli/bytes/pushable_writer.h"
 #include "riegeli/bytes/writer.h"
 #include "snappy.h"
@@ -39,6 +42,41 @@ inline uint32_t MaskChecksum(uint32_t x) {
   return ((x >> 15) | (x << 17)) + 0xa282ead8;
 }
 
+struct FrameHeader {
+  uint32_t chunk_header, checksum;
+};
+
+// Returns the maximum length of a frame holding `uncompressed_length` bytes.
+inline size_t MaxFrameLength(size_t uncompressed_length) {
+  return sizeof(FrameHeader) + snappy::MaxCompressedLength(uncompressed_length);
+}
+
+// Writes a frame holding `uncompressed_length` bytes of `uncompressed_data` to
+// `dest`, which must have space for `MaxFrameLength(uncompressed_length)`
+// bytes. Returns the length of the frame.
+size_t WriteFrame(const char* uncompressed_data, size_t uncompressed_length,
+                  char* dest) {
+  FrameHeader header;
+  size_t compressed_length;
+  snappy::RawCompress(uncompressed_data, uncompressed_length,
+                      dest + sizeof(header), &compressed_length);
+  if (compressed_length < uncompressed_length) {
+    header.chunk_header = WriteLittleEndian32(
+        0x00 /* Compressed data */ +
+        ((sizeof(header.checksum) + compressed_length) << 8));
+  } else {
+    std::memcpy(dest + sizeof(header), uncompressed_data, uncompressed_length);
+    compressed_length = uncompressed_length;
+    header.chunk_header = WriteLittleEndian32(
+        0x01 /* Uncompressed data */ +
+        ((sizeof(header.checksum) + compressed_length) << 8));
+  }
+  header.checksum = WriteLittleEndian32(
+      MaskChecksum(crc32c::Crc32c(uncompressed_data, uncompressed_length)));
+  std::memcpy(dest, &header, sizeof(header));
+  return sizeof(header) + compressed_length;
+}
+
 }  // namespace
 
 void FramedSnappyWriterBase::Initialize(Writer* dest) {
@@ -60,9 +98,10 @@ void FramedSnappyWriterBase::Done() {
   if (ABSL_PREDICT_TRUE(healthy())) {
     if (ABSL_PREDICT_TRUE(SyncScratch())) {
       Writer* const dest = dest_writer();
-      PushInternal(dest);
+      if (ABSL_PREDICT_TRUE(PushInternal(dest))) WritePendingFrames(dest, 0);
     }
   }
+  pending_frames_.clear();
   PushableWriter::Done();
 }
 
@@ -95,44 +134,71 @@ bool FramedSnappyWriterBase::PushSlow(size_t min_length,
 inline bool FramedSnappyWriterBase::PushInternal(Writer* dest) {
   const size_t uncompressed_length = written_to_buffer();
   if (uncompressed_length == 0) return true;
+  if (parallelism_ > 0) {
+    struct CompressingFrame {
+      Buffer uncompressed;
+      size_t uncompressed_length;
+      std::promise<CompressedFrame> compressed_frame;
+    };
+    if (ABSL_PREDICT_FALSE(!WritePendingFrames(
+            dest, IntCast<size_t>(parallelism_) - 1))) {
+      return false;
+    }
+    // Hand the buffer over to the background task. `PushSlow()` will allocate
+    // a new buffer.
+    CompressingFrame* const compressing_frame = new CompressingFrame();
+    compressing_frame->uncompressed = std::move(uncompressed_);
+    compressing_frame->uncompressed_length = uncompressed_length;
+    start_ = nullptr;
+    cursor_ = nullptr;
+    limit_ = nullptr;
+    pending_frames_.push_back(
+        compressing_frame->compressed_frame.get_future());
+    ThreadPool::global().Schedule([compressing_frame] {
+      CompressedFrame compressed_frame;
+      compressed_frame.data.Resize(
+          MaxFrameLength(compressing_frame->uncompressed_length));
+      compressed_frame.length =
+          WriteFrame(compressing_frame->uncompressed.GetData(),
+                     compressing_frame->uncompressed_length,
+                     compressed_frame.data.GetData());
+      compressing_frame->compressed_frame.set_value(
+          std::move(compressed_frame));
+      delete compressing_frame;
+    });
+    start_pos_ += uncompressed_length;
+    return true;
+  }
   cursor_ = start_;
-  const char* const uncompressed_data = cursor_;
-  struct {
-    uint32_t chunk_header, checksum;
-  } header;
-  if (ABSL_PREDICT_FALSE(!dest->Push(
-          sizeof(header) + snappy::MaxCompressedLength(uncompressed_length)))) {
+  if (ABSL_PREDICT_FALSE(!dest->Push(MaxFrameLength(uncompressed_length)))) {
     return Fail(*dest);
   }
-  char* const compressed_chunk = dest->cursor();
-  size_t compressed_length;
-  snappy::RawCompress(uncompressed_data, uncompressed_length,
-                      compressed_chunk + sizeof(header), &compressed_length);
-  if (compressed_length < uncompressed_length) {
-    header.chunk_header = WriteLittleEndian32(
-        0x00 /* Compressed data */ +
-        ((sizeof(header.checksum) + compressed_length) << 8));
-  } else {
-    std::memcpy(compressed_chunk + sizeof(header), uncompressed_data,
-                uncompressed_length);
-    compressed_length = uncompressed_length;
-    header.chunk_header = WriteLittleEndian32(
-        0x01 /* Uncompressed data */ +
-        ((sizeof(header.checksum) + compressed_length) << 8));
-  }
-  header.checksum = WriteLittleEndian32(
-      MaskChecksum(crc32c::Crc32c(uncompressed_data, uncompressed_length)));
-  std::memcpy(compressed_chunk, &header, sizeof(header));
-  dest->set_cursor(compressed_chunk + sizeof(header) + compressed_length);
+  dest->set_cursor(dest->cursor() + WriteFrame(start_, uncompressed_length,
+                                               dest->cursor()));
   start_pos_ += uncompressed_length;
   return true;
 }
 
+inline bool FramedSnappyWriterBase::WritePendingFrames(
+    Writer* dest, size_t max_pending_frames) {
+  while (pending_frames_.size() > max_pending_frames) {
+    CompressedFrame compressed_frame = pending_frames_.front().get();
+    pending_frames_.pop_front();
+    if (ABSL_PREDICT_FALSE(!dest->Write(absl::string_view(
+            compressed_frame.data.GetData(), compressed_frame.length)))) {
+      pending_frames_.clear();
+      return Fail(*dest);
+    }
+  }
+  return true;
+}
+
 bool FramedSnappyWriterBase::Flush(FlushType flush_type) {
   if (ABSL_PREDICT_FALSE(!SyncScratch())) return false;
   if (ABSL_PREDICT_FALSE(!healthy())) return false;
   Writer* const dest = dest_writer();
   if (ABSL_PREDICT_FALSE(!PushInternal(dest))) return false;
+  if (ABSL_PREDICT_FALSE(!WritePendingFrames(dest, 0))) return false;
   if (ABSL_PREDICT_FALSE(!dest->Flush(flush_type))) return Fail(*dest);
   return true;
 }
@@ -17,6 +17,8 @@
 
 #include <stddef.h>
 
+#include <deque>
+#include <future>
 #include <limits>
 #include <tuple>
 #include <utility>
@@ -51,11 +53,33 @@ class FramedSnappyWriterBase : public PushableWriter {
       return std::move(set_size_hint(size_hint));
     }
 
+    // Sets the maximum number of frames being compressed in parallel in
+    // background. Larger parallelism can increase throughput, up to a point
+    // where it no longer matters; smaller parallelism reduces memory usage.
+    //
+    // If `parallelism > 0`, frames are compressed on `ThreadPool::global()`,
+    // and are written to the compressed `Writer` in order when `parallelism`
+    // frames are pending, and by `Flush()` and `Close()`.
+    //
+    // Default: 0
+    Options& set_parallelism(int parallelism) & {
+      RIEGELI_ASSERT_GE(parallelism, 0)
+          << "Failed precondition of "
+             "FramedSnappyWriterBase::Options::set_parallelism(): "
+             "negative parallelism";
+      parallelism_ = parallelism;
+      return *this;
+    }
+    Options&& set_parallelism(int parallelism) && {
+      return std::move(set_parallelism(parallelism));
+    }
+
    private:
     template <typename Dest>
     friend class FramedSnappyWriter;
 
     Position size_hint_ = 0;
+    int parallelism_ = 0;
   };
 
   // Returns the compressed `Writer`. Unchanged by `Close()`.
@@ -67,13 +91,13 @@ class FramedSnappyWriterBase : public PushableWriter {
  protected:
   FramedSnappyWriterBase() noexcept : PushableWriter(kInitiallyClosed) {}
 
-  explicit FramedSnappyWriterBase(Position size_hint);
+  explicit FramedSnappyWriterBase(Position size_hint, int parallelism);
 
   FramedSnappyWriterBase(FramedSnappyWriterBase&& that) noexcept;
   FramedSnappyWriterBase& operator=(FramedSnappyWriterBase&& that) noexcept;
 
   void Reset();
-  void Reset(Position size_hint);
+  void Reset(Position size_hint, int parallelism);
   void Initialize(Writer* dest);
 
   void Done() override;
@@ -88,9 +112,26 @@ class FramedSnappyWriterBase : public PushableWriter {
   // Postcondition: `written_to_buffer() == 0`
   bool PushInternal(Writer* dest);
 
+  // Writes frames compressed in background to `*dest`, waiting for them,
+  // until at most `max_pending_frames` frames remain pending.
+  //
+  // Return values:
+  //  * `true`  - success
+  //  * `false` - failure (`!healthy()`)
+  bool WritePendingFrames(Writer* dest, size_t max_pending_frames);
+
+  // A frame compressed in background.
+  struct CompressedFrame {
+    Buffer data;
+    size_t length = 0;
+  };
+
   Position size_hint_ = 0;
+  int parallelism_ = 0;
   // Buffered uncompressed data.
   Buffer uncompressed_;
+  // Frames being compressed in background, if `parallelism_ > 0`.
+  std::deque<std::future<CompressedFrame>> pending_frames_;
 };
 
 // A `Writer` which compresses data with framed Snappy format before passing it
@@ -149,44 +190,58 @@ class FramedSnappyWriter : public FramedSnappyWriterBase {
 
 // Implementation details follow.
 
-inline FramedSnappyWriterBase::FramedSnappyWriterBase(Position size_hint)
-    : PushableWriter(kInitiallyOpen), size_hint_(size_hint) {}
+inline FramedSnappyWriterBase::FramedSnappyWriterBase(Position size_hint,
+                                                      int parallelism)
+    : PushableWriter(kInitiallyOpen),
+      size_hint_(size_hint),
+      parallelism_(parallelism) {}
 
 inline FramedSnappyWriterBase::FramedSnappyWriterBase(
     FramedSnappyWriterBase&& that) noexcept
     : PushableWriter(std::move(that)),
       size_hint_(that.size_hint_),
-      uncompressed_(std::move(that.uncompressed_)) {}
+      parallelism_(that.parallelism_),
+      uncompressed_(std::move(that.uncompressed_)),
+      pending_frames_(std::move(that.pending_frames_)) {}
 
 inline FramedSnappyWriterBase& FramedSnappyWriterBase::operator=(
     FramedSnappyWriterBase&& that) noexcept {
   PushableWriter::operator=(std::move(that));
   size_hint_ = that.size_hint_;
+  parallelism_ = that.parallelism_;
   uncompressed_ = std::move(that.uncompressed_);
+  pending_frames_ = std::move(that.pending_frames_);
   return *this;
 }
 
 inline void FramedSnappyWriterBase::Reset() {
   PushableWriter::Reset(kInitiallyClosed);
   size_hint_ = 0;
+  parallelism_ = 0;
+  pending_frames_.clear();
 }
 
-inline void FramedSnappyWriterBase::Reset(Position size_hint) {
+inline void FramedSnappyWriterBase::Reset(Position size_hint,
+                                          int parallelism) {
   PushableWriter::Reset(kInitiallyOpen);
   size_hint_ = UnsignedMin(size_hint, std::numeric_limits<size_t>::max());
+  parallelism_ = parallelism;
+  pending_frames_.clear();
 }
 
 template <typename Dest>
 inline FramedSnappyWriter<Dest>::FramedSnappyWriter(const Dest& dest,
                                                     Options options)
-    : FramedSnappyWriterBase(options.size_hint_), dest_(dest) {
+    : FramedSnappyWriterBase(options.size_hint_, options.parallelism_),
+      dest_(dest) {
   Initialize(dest_.get());
 }
 
 template <typename Dest>
 inline FramedSnappyWriter<Dest>::FramedSnappyWriter(Dest&& dest,
                                                     Options options)
-    : FramedSnappyWriterBase(options.size_hint_), dest_(std::move(dest)) {
+    : FramedSnappyWriterBase(options.size_hint_, options.parallelism_),
+      dest_(std::move(dest)) {
   Initialize(dest_.get());
 }
 
@@ -194,7 +249,8 @@ template <typename Dest>
 template <typename... DestArgs>
 inline FramedSnappyWriter<Dest>::FramedSnappyWriter(
     std::tuple<DestArgs...> dest_args, Options options)
-    : FramedSnappyWriterBase(options.size_hint_), dest_(std::move(dest_args)) {
+    : FramedSnappyWriterBase(options.size_hint_, options.parallelism_),
+      dest_(std::move(dest_args)) {
   Initialize(dest_.get());
 }
 
@@ -219,14 +275,14 @@ inline void FramedSnappyWriter<Dest>::Reset() {
 
 template <typename Dest>
 inline void FramedSnappyWriter<Dest>::Reset(const Dest& dest, Options options) {
-  FramedSnappyWriterBase::Reset(options.size_hint_);
+  FramedSnappyWriterBase::Reset(options.size_hint_, options.parallelism_);
   dest_.Reset(dest);
   Initialize(dest_.get());
 }
 
 template <typename Dest>
 inline void FramedSnappyWriter<Dest>::Reset(Dest&& dest, Options options) {
-  FramedSnappyWriterBase::Reset(options.size_hint_);
+  FramedSnappyWriterBase::Reset(options.size_hint_, options.parallelism_);
   dest_.Reset(std::move(dest));
   Initialize(dest_.get());
 }
@@ -235,7 +291,7 @@ template <typename Dest>
 template <typename... DestArgs>
 inline void FramedSnappyWriter<Dest>::Reset(std::tuple<DestArgs...> dest_args,
                                             Options options) {
-  FramedSnappyWriterBase::Reset(options.size_hint_);
+  FramedSnappyWriterBase::Reset(options.size_hint_, options.parallelism_);
   dest_.Reset(std::move(dest_args));
   Initialize(dest_.get());
 }
@@ -0,0 +1,279 @@
+// Copyright 2017 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef RIEGELI_BYTES_LZ4_READER_H_
+#define RIEGELI_BYTES_LZ4_READER_H_
+
+#include <stddef.h>
+
+#include <memory>
+#include <tuple>
+#include <utility>
+
+#include "absl/base/optimization.h"
+#include "lz4frame.h"
+#include "riegeli/base/base.h"
+#include "riegeli/base/dependency.h"
+#include "riegeli/base/recycling_pool.h"
+#include "riegeli/base/resetter.h"
+#include "riegeli/bytes/buffered_reader.h"
+#include "riegeli/bytes/reader.h"
+
+namespace riegeli {
+
+// Template parameter independent part of `Lz4Reader`.
+class Lz4ReaderBase : public BufferedReader {
+ public:
+  class Options {
+   public:
+    Options() noexcept {}
+
+    // Expected uncompressed size, or 0 if unknown. This may improve
+    // performance.
+    //
+    // If the size hint turns out to not match reality, nothing breaks.
+    Options& set_size_hint(Position size_hint) & {
+      size_hint_ = size_hint;
+      return *this;
+    }
+    Options&& set_size_hint(Position size_hint) && {
+      return std::move(set_size_hint(size_hint));
+    }
+
+    // Tunes how much data is buffered after calling the decompression engine.
+    //
+    // Default: 64K
+    static size_t DefaultBufferSize() { return size_t{64} << 10; }
+    Options& set_buffer_size(size_t buffer_size) & {
+      RIEGELI_ASSERT_GT(buffer_size, 0u)
+          << "Failed precondition of "
+             "Lz4ReaderBase::Options::set_buffer_size(): "
+             "zero buffer size";
+      buffer_size_ = buffer_size;
+      return *this;
+    }
+    Options&& set_buffer_size(size_t buffer_size) && {
+      return std::move(set_buffer_size(buffer_size));
+    }
+
+   private:
+    template <typename Src>
+    friend class Lz4Reader;
+
+    Position size_hint_ = 0;
+    size_t buffer_size_ = DefaultBufferSize();
+  };
+
+  // Returns the compressed `Reader`. Unchanged by `Close()`.
+  virtual Reader* src_reader() = 0;
+  virtual const Reader* src_reader() const = 0;
+
+ protected:
+  Lz4ReaderBase() noexcept {}
+
+  explicit Lz4ReaderBase(size_t buffer_size, Position size_hint);
+
+  Lz4ReaderBase(Lz4ReaderBase&& that) noexcept;
+  Lz4ReaderBase& operator=(Lz4ReaderBase&& that) noexcept;
+
+  void Reset();
+  void Reset(size_t buffer_size, Position size_hint);
+  void Initialize(Reader* src);
+
+  void Done() override;
+  bool PullSlow(size_t min_length, size_t recommended_length) override;
+  bool ReadInternal(char* dest, size_t min_length, size_t max_length) override;
+
+ private:
+  struct LZ4F_dctxDeleter {
+    void operator()(LZ4F_dctx* ptr) const {
+      LZ4F_freeDecompressionContext(ptr);
+    }
+  };
+
+  // If `true`, the source is truncated (without a clean end of the compressed
+  // stream) at the current position. If the source does not grow, `Close()`
+  // will fail.
+  bool truncated_ = false;
+  // If `healthy()` but `decompressor_ == nullptr` then all data have been
+  // decompressed. In this case `LZ4F_decompress()` must not be called again.
+  RecyclingPool<LZ4F_dctx, LZ4F_dctxDeleter>::Handle decompressor_;
+};
+
+// A `Reader` which decompresses data with LZ4 (in the LZ4 frame format) after
+// getting it from another `Reader`.
+//
+// The `Src` template parameter specifies the type of the object providing and
+// possibly owning the compressed `Reader`. `Src` must support
+// `Dependency<Reader*, Src>`, e.g. `Reader*` (not owned, default),
+// `std::unique_ptr<Reader>` (owned), `ChainReader<>` (owned).
+//
+// The compressed `Reader` must not be accessed until the `Lz4Reader` is closed
+// or no longer used.
+template <typename Src = Reader*>
+class Lz4Reader : public Lz4ReaderBase {
+ public:
+  // Creates a closed `Lz4Reader`.
+  Lz4Reader() noexcept {}
+
+  // Will read from the compressed `Reader` provided by `src`.
+  explicit Lz4Reader(const Src& src, Options options = Options());
+  explicit Lz4Reader(Src&& src, Options options = Options());
+
+  // Will read from the compressed `Reader` provided by a `Src` constructed from
+  // elements of `src_args`. This avoids constructing a temporary `Src` and
+  // moving from it.
+  template <typename... SrcArgs>
+  explicit Lz4Reader(std::tuple<SrcArgs...> src_args,
+                     Options options = Options());
+
+  Lz4Reader(Lz4Reader&& that) noexcept;
+  Lz4Reader& operator=(Lz4Reader&& that) noexcept;
+
+  // Makes `*this` equivalent to a newly constructed `Lz4Reader`. This avoids
+  // constructing a temporary `Lz4Reader` and moving from it.
+  void Reset();
+  void Reset(const Src& src, Options options = Options());
+  void Reset(Src&& src, Options options = Options());
+  template <typename... SrcArgs>
+  void Reset(std::tuple<SrcArgs...> src_args, Options options = Options());
+
+  // Returns the object providing and possibly owning the compressed `Reader`.
+  // Unchanged by `Close()`.
+  Src& src() { return src_.manager(); }
+  const Src& src() const { return src_.manager(); }
+  Reader* src_reader() override { return src_.get(); }
+  const Reader* src_reader() const override { return src_.get(); }
+
+  void VerifyEnd() override;
+
+ protected:
+  void Done() override;
+
+ private:
+  // The object providing and possibly owning the compressed `Reader`.
+  Dependency<Reader*, Src> src_;
+};
+
+// Implementation details follow.
+
+inline Lz4ReaderBase::Lz4ReaderBase(size_t buffer_size, Position size_hint)
+    : BufferedReader(buffer_size, size_hint) {}
+
+inline Lz4ReaderBase::Lz4ReaderBase(Lz4ReaderBase&& that) noexcept
+    : BufferedReader(std::move(that)),
+      truncated_(that.truncated_),
+      decompressor_(std::move(that.decompressor_)) {}
+
+inline Lz4ReaderBase& Lz4ReaderBase::operator=(Lz4ReaderBase&& that) noexcept {
+  BufferedReader::operator=(std::move(that));
+  truncated_ = that.truncated_;
+  decompressor_ = std::move(that.decompressor_);
+  return *this;
+}
+
+inline void Lz4ReaderBase::Reset() {
+  BufferedReader::Reset();
+  truncated_ = false;
+  decompressor_.reset();
+}
+
+inline void Lz4ReaderBase::Reset(size_t buffer_size, Position size_hint) {
+  BufferedReader::Reset(buffer_size, size_hint);
+  truncated_ = false;
+  decompressor_.reset();
+}
+
+template <typename Src>
+inline Lz4Reader<Src>::Lz4Reader(const Src& src, Options options)
+    : Lz4ReaderBase(options.buffer_size_, options.size_hint_), src_(src) {
+  Initialize(src_.get());
+}
+
+template <typename Src>
+inline Lz4Reader<Src>::Lz4Reader(Src&& src, Options options)
+    : Lz4ReaderBase(options.buffer_size_, options.size_hint_),
+      src_(std::move(src)) {
+  Initialize(src_.get());
+}
+
+template <typename Src>
+template <typename... SrcArgs>
+inline Lz4Reader<Src>::Lz4Reader(std::tuple<SrcArgs...> src_args,
+                                 Options options)
+    : Lz4ReaderBase(options.buffer_size_, options.size_hint_),
+      src_(std::move(src_args)) {
+  Initialize(src_.get());
+}
+
+template <typename Src>
+inline Lz4Reader<Src>::Lz4Reader(Lz4Reader&& that) noexcept
+    : Lz4ReaderBase(std::move(that)), src_(std::move(that.src_)) {}
+
+template <typename Src>
+inline Lz4Reader<Src>& Lz4Reader<Src>::operator=(Lz4Reader&& that) noexcept {
+  Lz4ReaderBase::operator=(std::move(that));
+  src_ = std::move(that.src_);
+  return *this;
+}
+
+template <typename Src>
+inline void Lz4Reader<Src>::Reset() {
+  Lz4ReaderBase::Reset();
+  src_.Reset();
+}
+
+template <typename Src>
+inline void Lz4Reader<Src>::Reset(const Src& src, Options options) {
+  Lz4ReaderBase::Reset(options.buffer_size_, options.size_hint_);
+  src_.Reset(src);
+  Initialize(src_.get());
+}
+
+template <typename Src>
+inline void Lz4Reader<Src>::Reset(Src&& src, Options options) {
+  Lz4ReaderBase::Reset(options.buffer_size_, options.size_hint_);
+  src_.Reset(std::move(src));
+  Initialize(src_.get());
+}
+
+template <typename Src>
+template <typename... SrcArgs>
+inline void Lz4Reader<Src>::Reset(std::tuple<SrcArgs...> src_args,
+                                  Options options) {
+  Lz4ReaderBase::Reset(options.buffer_size_, options.size_hint_);
+  src_.Reset(std::move(src_args));
+  Initialize(src_.get());
+}
+
+template <typename Src>
+void Lz4Reader<Src>::Done() {
+  Lz4ReaderBase::Done();
+  if (src_.is_owning()) {
+    if (ABSL_PREDICT_FALSE(!src_->Close())) Fail(*src_);
+  }
+}
+
+template <typename Src>
+void Lz4Reader<Src>::VerifyEnd() {
+  Lz4ReaderBase::VerifyEnd();
+  if (src_.is_owning() && ABSL_PREDICT_TRUE(healthy())) src_->VerifyEnd();
+}
+
+template <typename Src>
+struct Resetter<Lz4Reader<Src>> : ResetterByReset<Lz4Reader<Src>> {};
+
+}  // namespace riegeli
+
+#endif  // RIEGELI_BYTES_LZ4_READER_H_
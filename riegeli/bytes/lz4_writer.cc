@@ -0,0 +1,185 @@
+// Copyright 2017 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "riegeli/bytes/lz4_writer.h"
+
+#include <stddef.h>
+
+#include <limits>
+#include <memory>
+
+#include "absl/base/optimization.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/string_view.h"
+#include "absl/types/optional.h"
+#include "lz4frame.h"
+#include "riegeli/base/base.h"
+#include "riegeli/base/canonical_errors.h"
+#include "riegeli/base/recycling_pool.h"
+#include "riegeli/base/status.h"
+#include "riegeli/bytes/buffered_writer.h"
+#include "riegeli/bytes/writer.h"
+
+namespace riegeli {
+
+// Before C++17 if a constexpr static data member is ODR-used, its definition at
+// namespace scope is required. Since C++17 these definitions are deprecated:
+// http://en.cppreference.com/w/cpp/language/static
+#if __cplusplus < 201703
+constexpr int Lz4WriterBase::Options::kMinCompressionLevel;
+constexpr int Lz4WriterBase::Options::kMaxCompressionLevel;
+constexpr int Lz4WriterBase::Options::kMinHighCompressionLevel;
+constexpr int Lz4WriterBase::Options::kDefaultCompressionLevel;
+#endif
+
+namespace {
+
+// Uncompressed data are passed to `LZ4F_compressUpdate()` in pieces of at most
+// this length, so that the space reserved in the compressed `Writer` is
+// bounded.
+constexpr size_t kMaxInputLength = size_t{64} << 10;
+
+}  // namespace
+
+void Lz4WriterBase::Initialize(Writer* dest, int compression_level,
+                               absl::optional<Position> final_size,
+                               bool store_checksum) {
+  RIEGELI_ASSERT(dest != nullptr)
+      << "Failed precondition of Lz4Writer: null Writer pointer";
+  if (ABSL_PREDICT_FALSE(!dest->healthy())) {
+    Fail(*dest);
+    return;
+  }
+  compressor_ = RecyclingPool<LZ4F_cctx, LZ4F_cctxDeleter>::global().Get([] {
+    LZ4F_cctx* compressor = nullptr;
+    const LZ4F_errorCode_t result =
+        LZ4F_createCompressionContext(&compressor, LZ4F_VERSION);
+    if (ABSL_PREDICT_FALSE(LZ4F_isError(result))) compressor = nullptr;
+    return std::unique_ptr<LZ4F_cctx, LZ4F_cctxDeleter>(compressor);
+  });
+  if (ABSL_PREDICT_FALSE(compressor_ == nullptr)) {
+    Fail(InternalError("LZ4F_createCompressionContext() failed"));
+    return;
+  }
+  preferences_ = LZ4F_preferences_t{};
+  preferences_.compressionLevel = compression_level;
+  preferences_.frameInfo.contentChecksumFlag =
+      store_checksum ? LZ4F_contentChecksumEnabled : LZ4F_noContentChecksum;
+  if (final_size.has_value()) {
+    preferences_.frameInfo.contentSize =
+        IntCast<unsigned long long>(*final_size);
+  }
+  if (ABSL_PREDICT_FALSE(!dest->Push(LZ4F_HEADER_SIZE_MAX))) {
+    Fail(*dest);
+    return;
+  }
+  const size_t result = LZ4F_compressBegin(compressor_.get(), dest->cursor(),
+                                           dest->available(), &preferences_);
+  if (ABSL_PREDICT_FALSE(LZ4F_isError(result))) {
+    Fail(InternalError(absl::StrCat("LZ4F_compressBegin() failed: ",
+                                    LZ4F_getErrorName(result))));
+    return;
+  }
+  dest->set_cursor(dest->cursor() + result);
+}
+
+void Lz4WriterBase::Done() {
+  if (ABSL_PREDICT_TRUE(healthy())) {
+    Writer* const dest = dest_writer();
+    const size_t buffered_length = written_to_buffer();
+    cursor_ = start_;
+    if (ABSL_PREDICT_TRUE(
+            WriteInternal(absl::string_view(start_, buffered_length), dest))) {
+      if (ABSL_PREDICT_FALSE(
+              !dest->Push(LZ4F_compressBound(0, &preferences_)))) {
+        Fail(*dest);
+      } else {
+        const size_t result =
+            LZ4F_compressEnd(compressor_.get(), dest->cursor(),
+                             dest->available(), nullptr);
+        if (ABSL_PREDICT_FALSE(LZ4F_isError(result))) {
+          Fail(InternalError(absl::StrCat("LZ4F_compressEnd() failed: ",
+                                          LZ4F_getErrorName(result))));
+        } else {
+          dest->set_cursor(dest->cursor() + result);
+        }
+      }
+    }
+  }
+  compressor_.reset();
+  BufferedWriter::Done();
+}
+
+bool Lz4WriterBase::WriteInternal(absl::string_view src) {
+  RIEGELI_ASSERT(!src.empty())
+      << "Failed precondition of BufferedWriter::WriteInternal(): "
+         "nothing to write";
+  RIEGELI_ASSERT(healthy())
+      << "Failed precondition of BufferedWriter::WriteInternal(): " << status();
+  RIEGELI_ASSERT_EQ(written_to_buffer(), 0u)
+      << "Failed precondition of BufferedWriter::WriteInternal(): "
+         "buffer not empty";
+  Writer* const dest = dest_writer();
+  return WriteInternal(src, dest);
+}
+
+bool Lz4WriterBase::WriteInternal(absl::string_view src, Writer* dest) {
+  if (ABSL_PREDICT_FALSE(src.size() >
+                         std::numeric_limits<Position>::max() - limit_pos())) {
+    return FailOverflow();
+  }
+  while (!src.empty()) {
+    const size_t length = UnsignedMin(src.size(), kMaxInputLength);
+    if (ABSL_PREDICT_FALSE(
+            !dest->Push(LZ4F_compressBound(length, &preferences_)))) {
+      return Fail(*dest);
+    }
+    const size_t result =
+        LZ4F_compressUpdate(compressor_.get(), dest->cursor(),
+                            dest->available(), src.data(), length, nullptr);
+    if (ABSL_PREDICT_FALSE(LZ4F_isError(result))) {
+      return Fail(InternalError(absl::StrCat("LZ4F_compressUpdate() failed: ",
+                                             LZ4F_getErrorName(result))));
+    }
+    dest->set_cursor(dest->cursor() + result);
+    start_pos_ += length;
+    src.remove_prefix(length);
+  }
+  return true;
+}
+
+bool Lz4WriterBase::Flush(FlushType flush_type) {
+  if (ABSL_PREDICT_FALSE(!healthy())) return false;
+  Writer* const dest = dest_writer();
+  const size_t buffered_length = written_to_buffer();
+  cursor_ = start_;
+  if (ABSL_PREDICT_FALSE(
+          !WriteInternal(absl::string_view(start_, buffered_length), dest))) {
+    return false;
+  }
+  if (ABSL_PREDICT_FALSE(!dest->Push(LZ4F_compressBound(0, &preferences_)))) {
+    return Fail(*dest);
+  }
+  const size_t result = LZ4F_flush(compressor_.get(), dest->cursor(),
+                                   dest->available(), nullptr);
+  if (ABSL_PREDICT_FALSE(LZ4F_isError(result))) {
+    return Fail(InternalError(
+        absl::StrCat("LZ4F_flush() failed: ", LZ4F_getErrorName(result))));
+  }
+  dest->set_cursor(dest->cursor() + result);
+  if (ABSL_PREDICT_FALSE(!dest->Flush(flush_type))) return Fail(*dest);
+  return true;
+}
+
+}  // namespace riegeli
@@ -0,0 +1,344 @@
+// Copyright 2017 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef RIEGELI_BYTES_LZ4_WRITER_H_
+#define RIEGELI_BYTES_LZ4_WRITER_H_
+
+#include <stddef.h>
+
+#include <memory>
+#include <tuple>
+#include <utility>
+
+#include "absl/base/optimization.h"
+#include "absl/strings/string_view.h"
+#include "absl/types/optional.h"
+#include "lz4frame.h"
+#include "riegeli/base/base.h"
+#include "riegeli/base/dependency.h"
+#include "riegeli/base/recycling_pool.h"
+#include "riegeli/base/resetter.h"
+#include "riegeli/bytes/buffered_writer.h"
+#include "riegeli/bytes/writer.h"
+
+namespace riegeli {
+
+// Template parameter independent part of `Lz4Writer`.
+class Lz4WriterBase : public BufferedWriter {
+ public:
+  class Options {
+   public:
+    Options() noexcept {}
+
+    // Tunes the tradeoff between compression density and compression speed
+    // (higher = better density but slower).
+    //
+    // Negative levels trade density for speed further ("acceleration").
+    // Levels from `kMinHighCompressionLevel` (3) select LZ4-HC, which
+    // compresses much slower but decompresses as fast as LZ4.
+    //
+    // `compression_level` must be between `kMinCompressionLevel` (-65536) and
+    // `kMaxCompressionLevel` (12). Default: `kDefaultCompressionLevel` (0).
+    static constexpr int kMinCompressionLevel = -(1 << 16);
+    static constexpr int kMaxCompressionLevel = 12;  // `LZ4HC_CLEVEL_MAX`
+    static constexpr int kMinHighCompressionLevel = 3;  // `LZ4HC_CLEVEL_MIN`
+    static constexpr int kDefaultCompressionLevel = 0;
+    Options& set_compression_level(int compression_level) & {
+      RIEGELI_ASSERT_GE(compression_level, kMinCompressionLevel)
+          << "Failed precondition of "
+             "Lz4WriterBase::Options::set_compression_level(): "
+             "compression level out of range";
+      RIEGELI_ASSERT_LE(compression_level, kMaxCompressionLevel)
+          << "Failed precondition of "
+             "Lz4WriterBase::Options::set_compression_level(): "
+             "compression level out of range";
+      compression_level_ = compression_level;
+      return *this;
+    }
+    Options&& set_compression_level(int compression_level) && {
+      return std::move(set_compression_level(compression_level));
+    }
+
+    // Exact uncompressed size. This causes the size to be stored in the
+    // compressed stream header.
+    //
+    // If the size hint turns out to not match reality, compression fails.
+    Options& set_final_size(absl::optional<Position> final_size) & {
+      final_size_ = final_size;
+      return *this;
+    }
+    Options&& set_final_size(absl::optional<Position> final_size) && {
+      return std::move(set_final_size(final_size));
+    }
+
+    // Expected uncompressed size, or 0 if unknown. This may improve
+    // performance.
+    //
+    // If the size hint turns out to not match reality, nothing breaks.
+    //
+    // `set_final_size()` overrides `set_size_hint()`.
+    Options& set_size_hint(Position size_hint) & {
+      size_hint_ = size_hint;
+      return *this;
+    }
+    Options&& set_size_hint(Position size_hint) && {
+      return std::move(set_size_hint(size_hint));
+    }
+
+    // If `true`, computes checksum of uncompressed data and stores it in the
+    // compressed stream. This lets decompression verify the checksum.
+    //
+    // Default: `false`
+    Options& set_store_checksum(bool store_checksum) & {
+      store_checksum_ = store_checksum;
+      return *this;
+    }
+    Options&& set_store_checksum(bool store_checksum) && {
+      return std::move(set_store_checksum(store_checksum));
+    }
+
+    // Tunes how much data is buffered before calling the compression engine.
+    //
+    // Default: 64K
+    static size_t DefaultBufferSize() { return size_t{64} << 10; }
+    Options& set_buffer_size(size_t buffer_size) & {
+      RIEGELI_ASSERT_GT(buffer_size, 0u)
+          << "Failed precondition of "
+             "Lz4WriterBase::Options::set_buffer_size(): "
+             "zero buffer size";
+      buffer_size_ = buffer_size;
+      return *this;
+    }
+    Options&& set_buffer_size(size_t buffer_size) && {
+      return std::move(set_buffer_size(buffer_size));
+    }
+
+   private:
+    template <typename Dest>
+    friend class Lz4Writer;
+
+    int compression_level_ = kDefaultCompressionLevel;
+    absl::optional<Position> final_size_;
+    Position size_hint_ = 0;
+    bool store_checksum_ = false;
+    size_t buffer_size_ = DefaultBufferSize();
+  };
+
+  // Returns the compressed `Writer`. Unchanged by `Close()`.
+  virtual Writer* dest_writer() = 0;
+  virtual const Writer* dest_writer() const = 0;
+
+  bool Flush(FlushType flush_type) override;
+
+ protected:
+  Lz4WriterBase() noexcept {}
+
+  explicit Lz4WriterBase(size_t buffer_size, Position size_hint);
+
+  Lz4WriterBase(Lz4WriterBase&& that) noexcept;
+  Lz4WriterBase& operator=(Lz4WriterBase&& that) noexcept;
+
+  void Reset();
+  void Reset(size_t buffer_size, Position size_hint);
+  void Initialize(Writer* dest, int compression_level,
+                  absl::optional<Position> final_size, bool store_checksum);
+
+  void Done() override;
+  bool WriteInternal(absl::string_view src) override;
+
+ private:
+  struct LZ4F_cctxDeleter {
+    void operator()(LZ4F_cctx* ptr) const {
+      LZ4F_freeCompressionContext(ptr);
+    }
+  };
+
+  bool WriteInternal(absl::string_view src, Writer* dest);
+
+  LZ4F_preferences_t preferences_{};
+  RecyclingPool<LZ4F_cctx, LZ4F_cctxDeleter>::Handle compressor_;
+};
+
+// A `Writer` which compresses data with LZ4 (in the LZ4 frame format) before
+// passing it to another `Writer`.
+//
+// The `Dest` template parameter specifies the type of the object providing and
+// possibly owning the compressed `Writer`. `Dest` must support
+// `Dependency<Writer*, Dest>`, e.g. `Writer*` (not owned, default),
+// `std::unique_ptr<Writer>` (owned), `ChainWriter<>` (owned).
+//
+// The compressed `Writer` must not be accessed until the `Lz4Writer` is closed
+// or no longer used, except that it is allowed to read the destination of the
+// compressed `Writer` immediately after `Flush()`.
+template <typename Dest = Writer*>
+class Lz4Writer : public Lz4WriterBase {
+ public:
+  // Creates a closed `Lz4Writer`.
+  Lz4Writer() noexcept {}
+
+  // Will write to the compressed `Writer` provided by `dest`.
+  explicit Lz4Writer(const Dest& dest, Options options = Options());
+  explicit Lz4Writer(Dest&& dest, Options options = Options());
+
+  // Will write to the compressed `Writer` provided by a `Dest` constructed from
+  // elements of `dest_args`. This avoids constructing a temporary `Dest` and
+  // moving from it.
+  template <typename... DestArgs>
+  explicit Lz4Writer(std::tuple<DestArgs...> dest_args,
+                     Options options = Options());
+
+  Lz4Writer(Lz4Writer&& that) noexcept;
+  Lz4Writer& operator=(Lz4Writer&& that) noexcept;
+
+  // Makes `*this` equivalent to a newly constructed `Lz4Writer`. This avoids
+  // constructing a temporary `Lz4Writer` and moving from it.
+  void Reset();
+  void Reset(const Dest& dest, Options options = Options());
+  void Reset(Dest&& dest, Options options = Options());
+  template <typename... DestArgs>
+  void Reset(std::tuple<DestArgs...> dest_args, Options options = Options());
+
+  // Returns the object providing and possibly owning the compressed `Writer`.
+  // Unchanged by `Close()`.
+  Dest& dest() { return dest_.manager(); }
+  const Dest& dest() const { return dest_.manager(); }
+  Writer* dest_writer() override { return dest_.get(); }
+  const Writer* dest_writer() const override { return dest_.get(); }
+
+ protected:
+  void Done() override;
+
+ private:
+  // The object providing and possibly owning the compressed `Writer`.
+  Dependency<Writer*, Dest> dest_;
+};
+
+// Implementation details follow.
+
+inline Lz4WriterBase::Lz4WriterBase(size_t buffer_size, Position size_hint)
+    : BufferedWriter(buffer_size, size_hint) {}
+
+inline Lz4WriterBase::Lz4WriterBase(Lz4WriterBase&& that) noexcept
+    : BufferedWriter(std::move(that)),
+      preferences_(that.preferences_),
+      compressor_(std::move(that.compressor_)) {}
+
+inline Lz4WriterBase& Lz4WriterBase::operator=(Lz4WriterBase&& that) noexcept {
+  BufferedWriter::operator=(std::move(that));
+  preferences_ = that.preferences_;
+  compressor_ = std::move(that.compressor_);
+  return *this;
+}
+
+inline void Lz4WriterBase::Reset() {
+  BufferedWriter::Reset();
+  preferences_ = LZ4F_preferences_t{};
+  compressor_.reset();
+}
+
+inline void Lz4WriterBase::Reset(size_t buffer_size, Position size_hint) {
+  BufferedWriter::Reset(buffer_size, size_hint);
+  preferences_ = LZ4F_preferences_t{};
+  compressor_.reset();
+}
+
+template <typename Dest>
+inline Lz4Writer<Dest>::Lz4Writer(const Dest& dest, Options options)
+    : Lz4WriterBase(options.buffer_size_,
+                    options.final_size_.value_or(options.size_hint_)),
+      dest_(dest) {
+  Initialize(dest_.get(), options.compression_level_, options.final_size_,
+             options.store_checksum_);
+}
+
+template <typename Dest>
+inline Lz4Writer<Dest>::Lz4Writer(Dest&& dest, Options options)
+    : Lz4WriterBase(options.buffer_size_,
+                    options.final_size_.value_or(options.size_hint_)),
+      dest_(std::move(dest)) {
+  Initialize(dest_.get(), options.compression_level_, options.final_size_,
+             options.store_checksum_);
+}
+
+template <typename Dest>
+template <typename... DestArgs>
+inline Lz4Writer<Dest>::Lz4Writer(std::tuple<DestArgs...> dest_args,
+                                  Options options)
+    : Lz4WriterBase(options.buffer_size_,
+                    options.final_size_.value_or(options.size_hint_)),
+      dest_(std::move(dest_args)) {
+  Initialize(dest_.get(), options.compression_level_, options.final_size_,
+             options.store_checksum_);
+}
+
+template <typename Dest>
+inline Lz4Writer<Dest>::Lz4Writer(Lz4Writer&& that) noexcept
+    : Lz4WriterBase(std::move(that)), dest_(std::move(that.dest_)) {}
+
+template <typename Dest>
+inline Lz4Writer<Dest>& Lz4Writer<Dest>::operator=(Lz4Writer&& that) noexcept {
+  Lz4WriterBase::operator=(std::move(that));
+  dest_ = std::move(that.dest_);
+  return *this;
+}
+
+template <typename Dest>
+inline void Lz4Writer<Dest>::Reset() {
+  Lz4WriterBase::Reset();
+  dest_.Reset();
+}
+
+template <typename Dest>
+inline void Lz4Writer<Dest>::Reset(const Dest& dest, Options options) {
+  Lz4WriterBase::Reset(options.buffer_size_,
+                       options.final_size_.value_or(options.size_hint_));
+  dest_.Reset(dest);
+  Initialize(dest_.get(), options.compression_level_, options.final_size_,
+             options.store_checksum_);
+}
+
+template <typename Dest>
+inline void Lz4Writer<Dest>::Reset(Dest&& dest, Options options) {
+  Lz4WriterBase::Reset(options.buffer_size_,
+                       options.final_size_.value_or(options.size_hint_));
+  dest_.Reset(std::move(dest));
+  Initialize(dest_.get(), options.compression_level_, options.final_size_,
+             options.store_checksum_);
+}
+
+template <typename Dest>
+template <typename... DestArgs>
+inline void Lz4Writer<Dest>::Reset(std::tuple<DestArgs...> dest_args,
+                                   Options options) {
+  Lz4WriterBase::Reset(options.buffer_size_,
+                       options.final_size_.value_or(options.size_hint_));
+  dest_.Reset(std::move(dest_args));
+  Initialize(dest_.get(), options.compression_level_, options.final_size_,
+             options.store_checksum_);
+}
+
+template <typename Dest>
+void Lz4Writer<Dest>::Done() {
+  Lz4WriterBase::Done();
+  if (dest_.is_owning()) {
+    if (ABSL_PREDICT_FALSE(!dest_->Close())) Fail(*dest_);
+  }
+}
+
+template <typename Dest>
+struct Resetter<Lz4Writer<Dest>> : ResetterByReset<Lz4Writer<Dest>> {};
+
+}  // namespace riegeli
+
+#endif  // RIEGELI_BYTES_LZ4_WRITER_H_
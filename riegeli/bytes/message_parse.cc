@@ -21,6 +21,7 @@
 
 #include "absl/base/optimization.h"
 #include "absl/strings/str_cat.h"
+#include "absl/strings/string_view.h"
 #include "absl/types/optional.h"
 #include "google/protobuf/io/zero_copy_stream.h"
 #include "google/protobuf/message_lite.h"
@@ -131,14 +132,14 @@ Status ParseFromReaderImpl(google::protobuf::MessageLite* dest, Reader* src) {
 Status ParsePartialFromReaderImpl(google::protobuf::MessageLite* dest,
                                   Reader* src) {
   src->Pull();
-  if (src->available() <= kMaxBytesToCopy && src->SupportsRandomAccess()) {
+  if (src->SupportsRandomAccess()) {
     Position size;
     if (ABSL_PREDICT_FALSE(!src->Size(&size))) return src->status();
     if (src->pos() + src->available() == size &&
         ABSL_PREDICT_TRUE(src->available() <=
                           size_t{std::numeric_limits<int>::max()})) {
-      // The data are flat. `ParsePartialFromArray()` is faster than
-      // `ParsePartialFromZeroCopyStream()`.
+      // The remaining data are flat in the buffer. `ParsePartialFromArray()`
+      // is faster than `ParsePartialFromZeroCopyStream()`.
       bool ok = dest->ParsePartialFromArray(src->cursor(),
                                             IntCast<int>(src->available()));
       src->set_cursor(src->cursor() + src->available());
@@ -183,6 +184,39 @@ Status ParsePartialFromReaderUsingInputStream(
 
 }  // namespace internal
 
+Status ParseFromString(google::protobuf::MessageLite* dest,
+                       absl::string_view src) {
+  {
+    const Status status = ParsePartialFromString(dest, src);
+    if (ABSL_PREDICT_FALSE(!status.ok())) {
+      return status;
+    }
+  }
+  if (ABSL_PREDICT_FALSE(!dest->IsInitialized())) {
+    return DataLossError(
+        absl::StrCat("Failed to parse message of type ", dest->GetTypeName(),
+                     " because it is missing required fields: ",
+                     dest->InitializationErrorString()));
+  }
+  return OkStatus();
+}
+
+Status ParsePartialFromString(google::protobuf::MessageLite* dest,
+                              absl::string_view src) {
+  if (ABSL_PREDICT_FALSE(src.size() >
+                         size_t{std::numeric_limits<int>::max()})) {
+    return ResourceExhaustedError(absl::StrCat(
+        "Failed to parse message of type ", dest->GetTypeName(),
+        " because it exceeds maximum protobuf size of 2GB: ", src.size()));
+  }
+  if (ABSL_PREDICT_FALSE(
+          !dest->ParsePartialFromArray(src.data(), IntCast<int>(src.size())))) {
+    return DataLossError(
+        absl::StrCat("Failed to parse message of type ", dest->GetTypeName()));
+  }
+  return OkStatus();
+}
+
 Status ParseFromChain(google::protobuf::MessageLite* dest, const Chain& src) {
   {
     const Status status = ParsePartialFromChain(dest, src);
@@ -201,20 +235,14 @@ Status ParseFromChain(google::protobuf::MessageLite* dest, const Chain& src) {
 
 Status ParsePartialFromChain(google::protobuf::MessageLite* dest,
                              const Chain& src) {
-  if (src.size() <= kMaxBytesToCopy) {
-    if (absl::optional<absl::string_view> flat = src.TryFlat()) {
-      // The data are flat. `ParsePartialFromArray()` is faster than
-      // `ParsePartialFromZeroCopyStream()`.
-      if (ABSL_PREDICT_FALSE(!dest->ParsePartialFromArray(
-              flat->data(), IntCast<int>(flat->size())))) {
-        return DataLossError(absl::StrCat("Failed to parse message of type ",
-                                          dest->GetTypeName()));
-      }
-      return OkStatus();
-    }
+  if (const absl::optional<absl::string_view> flat = src.TryFlat()) {
+    // The data are flat. `ParsePartialFromArray()` is faster than
+    // `ParsePartialFromZeroCopyStream()`.
+    return ParsePartialFromString(dest, *flat);
   }
+  // Blocks are passed to the parser one by one, without copying them.
   ChainReader<> reader(&src);
-  return internal::ParsePartialFromReaderImpl(dest, &reader);
+  return internal::ParsePartialFromReaderUsingInputStream(dest, &reader);
   // Do not bother closing the `ChainReader<>`, it can never fail.
 }
 
@@ -20,6 +20,7 @@
 #include <utility>
 
 #include "absl/base/optimization.h"
+#include "absl/strings/string_view.h"
 #include "google/protobuf/message_lite.h"
 #include "riegeli/base/chain.h"
 #include "riegeli/base/dependency.h"
@@ -55,6 +56,19 @@ template <typename Src, typename... SrcArgs>
 Status ParsePartialFromReader(google::protobuf::MessageLite* dest,
                               std::tuple<SrcArgs...> src_args);
 
+// Reads a message in binary format from the given flat array. If successful,
+// the entire input will be consumed.
+//
+// `ParsePartialFromString()` allows missing required fields.
+//
+// Returns status:
+//  * `status.ok()`  - success (`*dest` is filled)
+//  * `!status.ok()` - failure (`*dest` is unspecified)
+Status ParseFromString(google::protobuf::MessageLite* dest,
+                       absl::string_view src);
+Status ParsePartialFromString(google::protobuf::MessageLite* dest,
+                              absl::string_view src);
+
 // Reads a message in binary format from the given `Chain`. If successful, the
 // entire input will be consumed.
 //
@@ -18,10 +18,10 @@
 #include <stdint.h>
 
 #include <limits>
-#include <tuple>
 
 #include "absl/base/optimization.h"
 #include "absl/strings/str_cat.h"
+#include "google/protobuf/io/coded_stream.h"
 #include "google/protobuf/io/zero_copy_stream.h"
 #include "google/protobuf/message_lite.h"
 #include "riegeli/base/base.h"
@@ -35,6 +35,12 @@ namespace riegeli {
 
 namespace {
 
+// Messages up to this size are serialized directly to the buffer of the
+// `Writer`, pushing it first if needed. Larger messages are serialized through
+// `WriterOutputStream` unless they fit in the current buffer, so that they do
+// not require that much contiguous space.
+constexpr size_t kMaxFlatSerializedSize = size_t{64} << 10;
+
 // Adapts a `Writer` to a `google::protobuf::io::ZeroCopyOutputStream`.
 class WriterOutputStream : public google::protobuf::io::ZeroCopyOutputStream {
  public:
@@ -111,38 +117,86 @@ Status SerializeToWriterImpl(const google::protobuf::MessageLite& src,
 
 Status SerializePartialToWriterImpl(const google::protobuf::MessageLite& src,
                                     Writer* dest) {
-  const size_t size = src.ByteSizeLong();
+  return SerializePartialWithCachedSizesToWriter(src, src.ByteSizeLong(), dest);
+}
+
+Status SerializeWithCachedSizesToWriter(
+    const google::protobuf::MessageLite& src, size_t size, Writer* dest) {
+  if (ABSL_PREDICT_FALSE(!src.IsInitialized())) {
+    return InvalidArgumentError(
+        absl::StrCat("Failed to serialize message of type ", src.GetTypeName(),
+                     " because it is missing required fields: ",
+                     src.InitializationErrorString()));
+  }
+  return SerializePartialWithCachedSizesToWriter(src, size, dest);
+}
+
+Status SerializePartialWithCachedSizesToWriter(
+    const google::protobuf::MessageLite& src, size_t size, Writer* dest) {
   if (ABSL_PREDICT_FALSE(size > size_t{std::numeric_limits<int>::max()})) {
     return ResourceExhaustedError(absl::StrCat(
         "Failed to serialize message of type ", src.GetTypeName(),
         " because it exceeds maximum protobuf size of 2GB: ", size));
   }
+  RIEGELI_ASSERT_EQ(size, IntCast<size_t>(src.GetCachedSize()))
+      << "Failed precondition of SerializePartialWithCachedSizesToWriter(): "
+         "size does not match the cached size";
+  if (ABSL_PREDICT_TRUE(size <= dest->available()) ||
+      size <= kMaxFlatSerializedSize) {
+    if (ABSL_PREDICT_FALSE(!dest->Push(size))) return dest->status();
+    // Serialize directly to the buffer, avoiding `WriterOutputStream`.
+    src.SerializeWithCachedSizesToArray(
+        reinterpret_cast<google::protobuf::uint8*>(dest->cursor()));
+    dest->set_cursor(dest->cursor() + size);
+    return OkStatus();
+  }
   WriterOutputStream output_stream(dest);
-  if (ABSL_PREDICT_FALSE(
-          !src.SerializePartialToZeroCopyStream(&output_stream))) {
+  google::protobuf::io::CodedOutputStream coded_stream(&output_stream);
+  // Unlike `SerializePartialToZeroCopyStream()`, this does not compute sizes
+  // again.
+  src.SerializeWithCachedSizes(&coded_stream);
+  if (ABSL_PREDICT_FALSE(coded_stream.HadError())) {
     RIEGELI_ASSERT(!dest->healthy())
         << "Failed to serialize message of type " << src.GetTypeName()
-        << ": SerializePartialToZeroCopyStream() failed for an unknown reason";
+        << ": SerializeWithCachedSizes() failed for an unknown reason";
     return dest->status();
   }
   return OkStatus();
 }
 
+Status SerializeWithCachedSizesToChain(const google::protobuf::MessageLite& src,
+                                       size_t size, Chain* dest) {
+  if (ABSL_PREDICT_FALSE(!src.IsInitialized())) {
+    return InvalidArgumentError(
+        absl::StrCat("Failed to serialize message of type ", src.GetTypeName(),
+                     " because it is missing required fields: ",
+                     src.InitializationErrorString()));
+  }
+  return SerializePartialWithCachedSizesToChain(src, size, dest);
+}
+
+Status SerializePartialWithCachedSizesToChain(
+    const google::protobuf::MessageLite& src, size_t size, Chain* dest) {
+  dest->Clear();
+  ChainWriter<> writer(dest, ChainWriterBase::Options().set_size_hint(size));
+  Status status = SerializePartialWithCachedSizesToWriter(src, size, &writer);
+  if (ABSL_PREDICT_FALSE(!writer.Close())) {
+    if (ABSL_PREDICT_TRUE(status.ok())) status = writer.status();
+  }
+  return status;
+}
+
 }  // namespace internal
 
 Status SerializeToChain(const google::protobuf::MessageLite& src, Chain* dest) {
-  dest->Clear();
-  return SerializeToWriter<ChainWriter<>>(
-      src, std::forward_as_tuple(dest, ChainWriterBase::Options().set_size_hint(
-                                           src.ByteSizeLong())));
+  return internal::SerializeWithCachedSizesToChain(src, src.ByteSizeLong(),
+                                                   dest);
 }
 
 Status SerializePartialToChain(const google::protobuf::MessageLite& src,
                                Chain* dest) {
-  dest->Clear();
-  return SerializePartialToWriter<ChainWriter<>>(
-      src, std::forward_as_tuple(dest, ChainWriterBase::Options().set_size_hint(
-                                           src.ByteSizeLong())));
+  return internal::SerializePartialWithCachedSizesToChain(
+      src, src.ByteSizeLong(), dest);
 }
 
 }  // namespace riegeli
@@ -15,6 +15,8 @@
 #ifndef RIEGELI_BYTES_MESSAGE_SERIALIZE_H_
 #define RIEGELI_BYTES_MESSAGE_SERIALIZE_H_
 
+#include <stddef.h>
+
 #include <tuple>
 #include <type_traits>
 #include <utility>
@@ -75,6 +77,23 @@ Status SerializeToWriterImpl(const google::protobuf::MessageLite& src,
 Status SerializePartialToWriterImpl(const google::protobuf::MessageLite& src,
                                     Writer* dest);
 
+// Variants of `SerializeToWriterImpl()` and `SerializePartialToWriterImpl()`
+// for callers which already computed `size = src.ByteSizeLong()` and did not
+// modify `src` since then. Sizes cached by `ByteSizeLong()` are reused instead
+// of being computed again, and if `size` bytes fit in the buffer of `*dest`,
+// the message is serialized directly there.
+Status SerializeWithCachedSizesToWriter(
+    const google::protobuf::MessageLite& src, size_t size, Writer* dest);
+Status SerializePartialWithCachedSizesToWriter(
+    const google::protobuf::MessageLite& src, size_t size, Writer* dest);
+
+// Variants of `SerializeToChain()` and `SerializePartialToChain()` with the
+// same precondition as `SerializeWithCachedSizesToWriter()`.
+Status SerializeWithCachedSizesToChain(const google::protobuf::MessageLite& src,
+                                       size_t size, Chain* dest);
+Status SerializePartialWithCachedSizesToChain(
+    const google::protobuf::MessageLite& src, size_t size, Chain* dest);
+
 }  // namespace internal
 
 template <typename Dest>
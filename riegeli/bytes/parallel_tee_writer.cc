@@ -0,0 +1,163 @@
+// Copyright 2019 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "riegeli/bytes/parallel_tee_writer.h"
+
+#include <stddef.h>
+
+#include <limits>
+#include <utility>
+
+#include "absl/base/optimization.h"
+#include "absl/types/span.h"
+#include "riegeli/base/base.h"
+#include "riegeli/base/chain.h"
+#include "riegeli/bytes/writer.h"
+
+namespace riegeli {
+
+void ParallelTeeWriterBase::Initialize() {
+  for (size_t index = 0; index < num_dests(); ++index) {
+    Writer* const dest = async_dest(index);
+    if (ABSL_PREDICT_FALSE(!dest->healthy())) {
+      Fail(*dest);
+      return;
+    }
+  }
+}
+
+void ParallelTeeWriterBase::Done() {
+  if (ABSL_PREDICT_TRUE(healthy())) {
+    SyncBuffer();
+    HandOver();
+  }
+  chain_ = Chain();
+  // Closing each `AsyncWriter` waits for its writes. All of them have been
+  // handed their data already, so they are written concurrently.
+  for (size_t index = 0; index < num_dests(); ++index) {
+    Writer* const dest = async_dest(index);
+    if (ABSL_PREDICT_FALSE(!dest->Close())) Fail(*dest);
+  }
+  Writer::Done();
+}
+
+bool ParallelTeeWriterBase::PushSlow(size_t min_length,
+                                     size_t recommended_length) {
+  RIEGELI_ASSERT_GT(min_length, available())
+      << "Failed precondition of Writer::PushSlow(): "
+         "length too small, use Push() instead";
+  if (ABSL_PREDICT_FALSE(!healthy())) return false;
+  if (ABSL_PREDICT_FALSE(min_length >
+                         std::numeric_limits<Position>::max() - pos())) {
+    return FailOverflow();
+  }
+  SyncBuffer();
+  if (chain_.size() >= buffer_size_ ||
+      min_length > buffer_size_ - chain_.size()) {
+    if (ABSL_PREDICT_FALSE(!HandOver())) return false;
+  }
+  MakeBuffer(min_length, recommended_length);
+  return true;
+}
+
+bool ParallelTeeWriterBase::WriteSlow(const Chain& src) {
+  RIEGELI_ASSERT_GT(src.size(), UnsignedMin(available(), kMaxBytesToCopy))
+      << "Failed precondition of Writer::WriteSlow(Chain): "
+         "length too small, use Write(Chain) instead";
+  if (ABSL_PREDICT_FALSE(!healthy())) return false;
+  if (ABSL_PREDICT_FALSE(src.size() >
+                         std::numeric_limits<Position>::max() - pos())) {
+    return FailOverflow();
+  }
+  SyncBuffer();
+  start_pos_ += src.size();
+  chain_.Append(src, buffer_size_);
+  if (chain_.size() >= buffer_size_) return HandOver();
+  return true;
+}
+
+bool ParallelTeeWriterBase::WriteSlow(Chain&& src) {
+  RIEGELI_ASSERT_GT(src.size(), UnsignedMin(available(), kMaxBytesToCopy))
+      << "Failed precondition of Writer::WriteSlow(Chain&&): "
+         "length too small, use Write(Chain&&) instead";
+  if (ABSL_PREDICT_FALSE(!healthy())) return false;
+  if (ABSL_PREDICT_FALSE(src.size() >
+                         std::numeric_limits<Position>::max() - pos())) {
+    return FailOverflow();
+  }
+  SyncBuffer();
+  start_pos_ += src.size();
+  chain_.Append(std::move(src), buffer_size_);
+  if (chain_.size() >= buffer_size_) return HandOver();
+  return true;
+}
+
+bool ParallelTeeWriterBase::Flush(FlushType flush_type) {
+  if (ABSL_PREDICT_FALSE(!healthy())) return false;
+  SyncBuffer();
+  if (ABSL_PREDICT_FALSE(!HandOver())) return false;
+  bool ok = true;
+  for (size_t index = 0; index < num_dests(); ++index) {
+    Writer* const dest = async_dest(index);
+    if (ABSL_PREDICT_FALSE(!dest->Flush(flush_type))) {
+      if (ABSL_PREDICT_FALSE(!dest->healthy())) return Fail(*dest);
+      ok = false;
+    }
+  }
+  return ok;
+}
+
+inline void ParallelTeeWriterBase::SyncBuffer() {
+  if (start_ == nullptr) return;
+  start_pos_ = pos();
+  chain_.RemoveSuffix(available());
+  start_ = nullptr;
+  cursor_ = nullptr;
+  limit_ = nullptr;
+}
+
+inline void ParallelTeeWriterBase::MakeBuffer(size_t min_length,
+                                              size_t recommended_length) {
+  const size_t remaining =
+      chain_.size() < buffer_size_ ? buffer_size_ - chain_.size() : 0;
+  const absl::Span<char> buffer = chain_.AppendBuffer(
+      min_length, UnsignedMax(recommended_length, remaining),
+      UnsignedMax(min_length, remaining), buffer_size_);
+  start_ = buffer.data();
+  cursor_ = start_;
+  limit_ = start_ + buffer.size();
+}
+
+bool ParallelTeeWriterBase::HandOver() {
+  RIEGELI_ASSERT(start_ == nullptr)
+      << "Failed precondition of ParallelTeeWriterBase::HandOver(): "
+         "buffer not synced";
+  if (chain_.empty()) return true;
+  const size_t num_dests = this->num_dests();
+  for (size_t index = 0; index < num_dests; ++index) {
+    Writer* const dest = async_dest(index);
+    // Writing a copy of `chain_` shares its blocks. The last destination takes
+    // `chain_` itself.
+    const bool ok = index + 1 < num_dests ? dest->Write(chain_)
+                                          : dest->Write(std::move(chain_));
+    if (ABSL_PREDICT_FALSE(!ok)) {
+      chain_ = Chain();
+      return Fail(*dest);
+    }
+  }
+  chain_ = Chain();
+  return true;
+}
+
+}  // namespace riegeli
@@ -0,0 +1,306 @@
+// Copyright 2019 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef RIEGELI_BYTES_PARALLEL_TEE_WRITER_H_
+#define RIEGELI_BYTES_PARALLEL_TEE_WRITER_H_
+
+#include <stddef.h>
+
+#include <utility>
+#include <vector>
+
+#include "riegeli/base/base.h"
+#include "riegeli/base/chain.h"
+#include "riegeli/base/object.h"
+#include "riegeli/base/resetter.h"
+#include "riegeli/bytes/async_writer.h"
+#include "riegeli/bytes/writer.h"
+
+namespace riegeli {
+
+// Template parameter independent part of `ParallelTeeWriter`.
+class ParallelTeeWriterBase : public Writer {
+ public:
+  class Options {
+   public:
+    Options() noexcept {}
+
+    // Tunes how much data is buffered before handing it to all destination
+    // `Writer`s.
+    //
+    // Default: 64K
+    Options& set_buffer_size(size_t buffer_size) & {
+      RIEGELI_ASSERT_GT(buffer_size, 0u)
+          << "Failed precondition of "
+             "ParallelTeeWriterBase::Options::set_buffer_size(): "
+             "zero buffer size";
+      buffer_size_ = buffer_size;
+      return *this;
+    }
+    Options&& set_buffer_size(size_t buffer_size) && {
+      return std::move(set_buffer_size(buffer_size));
+    }
+
+    // Up to this many full buffers are handed to each destination `Writer` and
+    // not yet written to it. When this many buffers are in flight for some
+    // destination `Writer`, filling another buffer waits.
+    //
+    // Default: 2
+    Options& set_max_pending(size_t max_pending) & {
+      RIEGELI_ASSERT_GT(max_pending, 0u)
+          << "Failed precondition of "
+             "ParallelTeeWriterBase::Options::set_max_pending(): "
+             "zero max_pending";
+      max_pending_ = max_pending;
+      return *this;
+    }
+    Options&& set_max_pending(size_t max_pending) && {
+      return std::move(set_max_pending(max_pending));
+    }
+
+   private:
+    template <typename Dest>
+    friend class ParallelTeeWriter;
+
+    size_t buffer_size_ = kDefaultBufferSize;
+    size_t max_pending_ = 2;
+  };
+
+  // Returns the number of destination `Writer`s.
+  virtual size_t num_dests() const = 0;
+
+  // Returns the destination `Writer` with the given index. Unchanged by
+  // `Close()`.
+  //
+  // Precondition: `index < num_dests()`
+  virtual Writer* dest_writer(size_t index) = 0;
+  virtual const Writer* dest_writer(size_t index) const = 0;
+
+  // Hands buffered data to all destination `Writer`s, then waits until they
+  // are written and flushes each destination `Writer`.
+  bool Flush(FlushType flush_type) override;
+
+ protected:
+  ParallelTeeWriterBase() noexcept : Writer(kInitiallyClosed) {}
+
+  explicit ParallelTeeWriterBase(size_t buffer_size);
+
+  ParallelTeeWriterBase(ParallelTeeWriterBase&& that) noexcept;
+  ParallelTeeWriterBase& operator=(ParallelTeeWriterBase&& that) noexcept;
+
+  void Reset();
+  void Reset(size_t buffer_size);
+  void Initialize();
+
+  // Returns the `AsyncWriter` writing to `dest_writer(index)`.
+  //
+  // Precondition: `index < num_dests()`
+  virtual Writer* async_dest(size_t index) = 0;
+
+  void Done() override;
+  bool PushSlow(size_t min_length, size_t recommended_length) override;
+  using Writer::WriteSlow;
+  bool WriteSlow(const Chain& src) override;
+  bool WriteSlow(Chain&& src) override;
+
+ private:
+  // Ends the buffer, leaving written data in `chain_`.
+  void SyncBuffer();
+
+  // Appends a new buffer of at least `min_length` to `chain_`.
+  void MakeBuffer(size_t min_length = 0, size_t recommended_length = 0);
+
+  // Writes `chain_` to all `AsyncWriter`s, sharing its blocks, and clears it.
+  //
+  // Return values:
+  //  * `true`  - success (`healthy()`)
+  //  * `false` - failure (`!healthy()`)
+  bool HandOver();
+
+  size_t buffer_size_ = 0;
+  // Data written but not yet handed to the `AsyncWriter`s, ending with the
+  // buffer.
+  //
+  // Invariant: if `start_ != nullptr` then the buffer ends at the end of
+  //            `chain_`
+  Chain chain_;
+};
+
+// A `Writer` which writes the same data to several destination `Writer`s
+// concurrently. Full buffers are shared by all destination `Writer`s without
+// copying and written to each of them by its own background thread, as if by
+// `AsyncWriter`, so that the latency of writing is the maximum rather than the
+// sum of latencies of the destination `Writer`s.
+//
+// Errors of a destination `Writer` are reported by a later write, by
+// `Flush()`, or by `Close()`.
+//
+// `ParallelTeeWriter` does not support random access even if the destination
+// `Writer`s do.
+//
+// The `Dest` template parameter specifies the type of the objects providing
+// and possibly owning the destination `Writer`s. `Dest` must support
+// `Dependency<Writer*, Dest>`, e.g. `Writer*` (not owned, default),
+// `std::unique_ptr<Writer>` (owned), `FdWriter<>` (owned).
+//
+// The destination `Writer`s must not be accessed until the `ParallelTeeWriter`
+// is closed or no longer used, except that it is allowed to read the
+// destinations of the destination `Writer`s immediately after `Flush()`.
+template <typename Dest = Writer*>
+class ParallelTeeWriter : public ParallelTeeWriterBase {
+ public:
+  // Creates a closed `ParallelTeeWriter`.
+  ParallelTeeWriter() noexcept {}
+
+  // Will write to the destination `Writer`s provided by `dests`.
+  explicit ParallelTeeWriter(std::vector<Dest> dests,
+                             Options options = Options());
+
+  ParallelTeeWriter(ParallelTeeWriter&& that) noexcept;
+  ParallelTeeWriter& operator=(ParallelTeeWriter&& that) noexcept;
+
+  // Makes `*this` equivalent to a newly constructed `ParallelTeeWriter`. This
+  // avoids constructing a temporary `ParallelTeeWriter` and moving from it.
+  void Reset();
+  void Reset(std::vector<Dest> dests, Options options = Options());
+
+  size_t num_dests() const override { return dests_.size(); }
+
+  // Returns the object providing and possibly owning the destination `Writer`
+  // with the given index. Unchanged by `Close()`.
+  //
+  // Precondition: `index < num_dests()`
+  Dest& dest(size_t index) { return dests_[index].dest(); }
+  const Dest& dest(size_t index) const { return dests_[index].dest(); }
+  Writer* dest_writer(size_t index) override {
+    return dests_[index].dest_writer();
+  }
+  const Writer* dest_writer(size_t index) const override {
+    return dests_[index].dest_writer();
+  }
+
+ protected:
+  Writer* async_dest(size_t index) override { return &dests_[index]; }
+
+ private:
+  void InitializeDests(std::vector<Dest> dests, Options options);
+
+  // `AsyncWriter`s providing and possibly owning the destination `Writer`s.
+  // Their addresses are stable across moves of the `ParallelTeeWriter`.
+  std::vector<AsyncWriter<Dest>> dests_;
+};
+
+// Implementation details follow.
+
+inline ParallelTeeWriterBase::ParallelTeeWriterBase(size_t buffer_size)
+    : Writer(kInitiallyOpen), buffer_size_(buffer_size) {}
+
+inline ParallelTeeWriterBase::ParallelTeeWriterBase(
+    ParallelTeeWriterBase&& that) noexcept
+    : Writer(std::move(that)), buffer_size_(that.buffer_size_) {
+  // `chain_` can hold the buffer in its short data, which would move, so end
+  // the buffer before moving `chain_`.
+  if (start_ != nullptr) {
+    start_pos_ = pos();
+    that.chain_.RemoveSuffix(available());
+    start_ = nullptr;
+    cursor_ = nullptr;
+    limit_ = nullptr;
+  }
+  chain_ = std::move(that.chain_);
+}
+
+inline ParallelTeeWriterBase& ParallelTeeWriterBase::operator=(
+    ParallelTeeWriterBase&& that) noexcept {
+  Writer::operator=(std::move(that));
+  buffer_size_ = that.buffer_size_;
+  if (start_ != nullptr) {
+    start_pos_ = pos();
+    that.chain_.RemoveSuffix(available());
+    start_ = nullptr;
+    cursor_ = nullptr;
+    limit_ = nullptr;
+  }
+  chain_ = std::move(that.chain_);
+  return *this;
+}
+
+inline void ParallelTeeWriterBase::Reset() {
+  Writer::Reset(kInitiallyClosed);
+  buffer_size_ = 0;
+  chain_.Clear();
+}
+
+inline void ParallelTeeWriterBase::Reset(size_t buffer_size) {
+  Writer::Reset(kInitiallyOpen);
+  buffer_size_ = buffer_size;
+  chain_.Clear();
+}
+
+template <typename Dest>
+inline ParallelTeeWriter<Dest>::ParallelTeeWriter(std::vector<Dest> dests,
+                                                  Options options)
+    : ParallelTeeWriterBase(options.buffer_size_) {
+  InitializeDests(std::move(dests), options);
+}
+
+template <typename Dest>
+inline ParallelTeeWriter<Dest>::ParallelTeeWriter(
+    ParallelTeeWriter&& that) noexcept
+    : ParallelTeeWriterBase(std::move(that)), dests_(std::move(that.dests_)) {}
+
+template <typename Dest>
+inline ParallelTeeWriter<Dest>& ParallelTeeWriter<Dest>::operator=(
+    ParallelTeeWriter&& that) noexcept {
+  ParallelTeeWriterBase::operator=(std::move(that));
+  dests_ = std::move(that.dests_);
+  return *this;
+}
+
+template <typename Dest>
+inline void ParallelTeeWriter<Dest>::Reset() {
+  ParallelTeeWriterBase::Reset();
+  dests_.clear();
+}
+
+template <typename Dest>
+inline void ParallelTeeWriter<Dest>::Reset(std::vector<Dest> dests,
+                                           Options options) {
+  ParallelTeeWriterBase::Reset(options.buffer_size_);
+  dests_.clear();
+  InitializeDests(std::move(dests), options);
+}
+
+template <typename Dest>
+inline void ParallelTeeWriter<Dest>::InitializeDests(std::vector<Dest> dests,
+                                                     Options options) {
+  // Each `AsyncWriter` receives full buffers from `ParallelTeeWriter` and
+  // hands them over without buffering them again.
+  AsyncWriterBase::Options async_options;
+  async_options.set_buffer_size(options.buffer_size_)
+      .set_max_pending(options.max_pending_);
+  dests_.reserve(dests.size());
+  for (Dest& dest : dests) {
+    dests_.emplace_back(std::move(dest), async_options);
+  }
+  Initialize();
+}
+
+template <typename Dest>
+struct Resetter<ParallelTeeWriter<Dest>>
+    : ResetterByReset<ParallelTeeWriter<Dest>> {};
+
+}  // namespace riegeli
+
+#endif  // RIEGELI_BYTES_PARALLEL_TEE_WRITER_H_
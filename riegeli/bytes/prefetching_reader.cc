@@ -0,0 +1,193 @@
+// Copyright 2019 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "riegeli/bytes/prefetching_reader.h"
+
+#include <stddef.h>
+
+#include <utility>
+
+#include "absl/base/optimization.h"
+#include "absl/strings/string_view.h"
+#include "absl/synchronization/mutex.h"
+#include "riegeli/base/base.h"
+#include "riegeli/base/chain.h"
+#include "riegeli/base/parallelism.h"
+#include "riegeli/bytes/reader.h"
+
+namespace riegeli {
+
+void PrefetchingReaderBase::Initialize(Reader* src) {
+  RIEGELI_ASSERT(src != nullptr)
+      << "Failed precondition of PrefetchingReader<Src>::PrefetchingReader(Src)"
+         ": null Reader pointer";
+  if (ABSL_PREDICT_FALSE(!src->healthy())) {
+    Fail(*src);
+    return;
+  }
+  supports_random_access_ = src->SupportsRandomAccess();
+  limit_pos_ = src->pos();
+}
+
+void PrefetchingReaderBase::Done() {
+  StopReading();
+  if (ABSL_PREDICT_TRUE(healthy()) && supports_random_access_) {
+    Reader* const src = src_reader();
+    const Position new_pos = pos();
+    if (ABSL_PREDICT_FALSE(!src->Seek(new_pos))) {
+      if (ABSL_PREDICT_FALSE(!src->healthy())) Fail(*src);
+    }
+  }
+  if (state_ != nullptr) DiscardReadAhead();
+  PullableReader::Done();
+}
+
+bool PrefetchingReaderBase::PullSlow(size_t min_length,
+                                     size_t recommended_length) {
+  RIEGELI_ASSERT_GT(min_length, available())
+      << "Failed precondition of Reader::PullSlow(): "
+         "length too small, use Pull() instead";
+  if (ABSL_PREDICT_FALSE(!PullUsingScratch(min_length))) {
+    return available() >= min_length;
+  }
+  if (ABSL_PREDICT_FALSE(!healthy())) return false;
+  Reader* const src = src_reader();
+  for (;;) {
+    while (next_block_ < current_.blocks().size()) {
+      const absl::string_view block = current_.blocks()[next_block_++];
+      if (ABSL_PREDICT_TRUE(!block.empty())) {
+        start_ = block.data();
+        cursor_ = start_;
+        limit_ = start_ + block.size();
+        limit_pos_ += block.size();
+        return true;
+      }
+    }
+    start_ = nullptr;
+    cursor_ = nullptr;
+    limit_ = nullptr;
+    if (ABSL_PREDICT_FALSE(!NextChain(src))) {
+      if (ABSL_PREDICT_FALSE(!src->healthy())) return Fail(*src);
+      return false;
+    }
+  }
+}
+
+bool PrefetchingReaderBase::SeekSlow(Position new_pos) {
+  RIEGELI_ASSERT(new_pos < start_pos() || new_pos > limit_pos_)
+      << "Failed precondition of Reader::SeekSlow(): "
+         "position in the buffer, use Seek() instead";
+  if (ABSL_PREDICT_FALSE(!SeekUsingScratch(new_pos))) return true;
+  if (ABSL_PREDICT_FALSE(!healthy())) return false;
+  if (new_pos > limit_pos_ && !supports_random_access_) {
+    // Seeking forwards without random access. Skip data read ahead.
+    return Reader::SeekSlow(new_pos);
+  }
+  Reader* const src = src_reader();
+  StopReading();
+  DiscardReadAhead();
+  const bool ok = src->Seek(new_pos);
+  limit_pos_ = src->pos();
+  if (ABSL_PREDICT_FALSE(!ok)) {
+    if (ABSL_PREDICT_FALSE(!src->healthy())) return Fail(*src);
+    return false;
+  }
+  return true;
+}
+
+bool PrefetchingReaderBase::Size(Position* size) {
+  if (ABSL_PREDICT_FALSE(!healthy())) return false;
+  Reader* const src = src_reader();
+  StopReading();
+  if (ABSL_PREDICT_FALSE(!src->Size(size))) {
+    if (ABSL_PREDICT_FALSE(!src->healthy())) return Fail(*src);
+    return false;
+  }
+  return true;
+}
+
+void PrefetchingReaderBase::StopReading() {
+  if (state_ == nullptr) return;
+  SharedState* const state = state_.get();
+  absl::MutexLock lock(&state->mutex);
+  state->stopping = true;
+  state->mutex.Await(absl::Condition(state, &SharedState::Idle));
+  state->stopping = false;
+}
+
+inline void PrefetchingReaderBase::DiscardReadAhead() {
+  {
+    absl::MutexLock lock(&state_->mutex);
+    RIEGELI_ASSERT(!state_->reading)
+        << "Failed precondition of PrefetchingReaderBase::DiscardReadAhead(): "
+           "background thread is reading";
+    state_->ready.clear();
+    state_->ended = false;
+  }
+  current_ = Chain();
+  next_block_ = 0;
+  start_ = nullptr;
+  cursor_ = nullptr;
+  limit_ = nullptr;
+}
+
+inline void PrefetchingReaderBase::StartReadingLocked(Reader* src) {
+  SharedState* const state = state_.get();
+  if (state->reading || state->ended ||
+      state->ready.size() >= state->max_pending) {
+    return;
+  }
+  state->reading = true;
+  const size_t buffer_size = buffer_size_;
+  ThreadPool::global().Schedule(
+      [state, src, buffer_size] { ReadAhead(state, src, buffer_size); });
+}
+
+bool PrefetchingReaderBase::NextChain(Reader* src) {
+  SharedState* const state = state_.get();
+  absl::MutexLock lock(&state->mutex);
+  StartReadingLocked(src);
+  state->mutex.Await(absl::Condition(state, &SharedState::HasDataOrIdle));
+  if (state->ready.empty()) {
+    current_ = Chain();
+    next_block_ = 0;
+    return false;
+  }
+  current_ = std::move(state->ready.front());
+  state->ready.pop_front();
+  next_block_ = 0;
+  StartReadingLocked(src);
+  return true;
+}
+
+void PrefetchingReaderBase::ReadAhead(SharedState* state, Reader* src,
+                                      size_t buffer_size) {
+  for (;;) {
+    {
+      absl::MutexLock lock(&state->mutex);
+      if (state->stopping || state->ended ||
+          state->ready.size() >= state->max_pending) {
+        state->reading = false;
+        return;
+      }
+    }
+    Chain data;
+    const bool ok = src->Read(&data, buffer_size);
+    absl::MutexLock lock(&state->mutex);
+    if (!data.empty()) state->ready.push_back(std::move(data));
+    if (!ok) state->ended = true;
+  }
+}
+
+}  // namespace riegeli
@@ -0,0 +1,404 @@
+// Copyright 2019 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef RIEGELI_BYTES_PREFETCHING_READER_H_
+#define RIEGELI_BYTES_PREFETCHING_READER_H_
+
+#include <stddef.h>
+
+#include <deque>
+#include <memory>
+#include <tuple>
+#include <utility>
+
+#include "absl/base/optimization.h"
+#include "absl/base/thread_annotations.h"
+#include "absl/synchronization/mutex.h"
+#include "riegeli/base/base.h"
+#include "riegeli/base/chain.h"
+#include "riegeli/base/dependency.h"
+#include "riegeli/base/object.h"
+#include "riegeli/base/resetter.h"
+#include "riegeli/bytes/pullable_reader.h"
+#include "riegeli/bytes/reader.h"
+
+namespace riegeli {
+
+// Template parameter independent part of `PrefetchingReader`.
+class PrefetchingReaderBase : public PullableReader {
+ public:
+  class Options {
+   public:
+    Options() noexcept {}
+
+    // Tunes how much data is read from the source `Reader` at a time by the
+    // background thread.
+    //
+    // Default: 64K
+    Options& set_buffer_size(size_t buffer_size) & {
+      RIEGELI_ASSERT_GT(buffer_size, 0u)
+          << "Failed precondition of "
+             "PrefetchingReaderBase::Options::set_buffer_size(): "
+             "zero buffer size";
+      buffer_size_ = buffer_size;
+      return *this;
+    }
+    Options&& set_buffer_size(size_t buffer_size) && {
+      return std::move(set_buffer_size(buffer_size));
+    }
+
+    // Up to this many buffers of `buffer_size()` following the buffer being
+    // consumed are read ahead by the background thread.
+    //
+    // Default: 2
+    Options& set_max_pending(size_t max_pending) & {
+      RIEGELI_ASSERT_GT(max_pending, 0u)
+          << "Failed precondition of "
+             "PrefetchingReaderBase::Options::set_max_pending(): "
+             "zero max_pending";
+      max_pending_ = max_pending;
+      return *this;
+    }
+    Options&& set_max_pending(size_t max_pending) && {
+      return std::move(set_max_pending(max_pending));
+    }
+
+   private:
+    template <typename Src>
+    friend class PrefetchingReader;
+
+    size_t buffer_size_ = kDefaultBufferSize;
+    size_t max_pending_ = 2;
+  };
+
+  // Returns the source `Reader`. Unchanged by `Close()`.
+  virtual Reader* src_reader() = 0;
+  virtual const Reader* src_reader() const = 0;
+
+  bool SupportsRandomAccess() const override { return supports_random_access_; }
+  bool Size(Position* size) override;
+
+ protected:
+  PrefetchingReaderBase() noexcept : PullableReader(kInitiallyClosed) {}
+
+  explicit PrefetchingReaderBase(size_t buffer_size, size_t max_pending);
+
+  PrefetchingReaderBase(PrefetchingReaderBase&& that) noexcept;
+  PrefetchingReaderBase& operator=(PrefetchingReaderBase&& that) noexcept;
+
+  void Reset();
+  void Reset(size_t buffer_size, size_t max_pending);
+  void Initialize(Reader* src);
+
+  // Waits until the background thread is no longer using the source `Reader`.
+  // Data already read ahead are kept.
+  void StopReading();
+
+  void Done() override;
+  bool PullSlow(size_t min_length, size_t recommended_length) override;
+  bool SeekSlow(Position new_pos) override;
+
+ private:
+  // State shared with the background thread. It has a stable address across
+  // moves of the `PrefetchingReaderBase`.
+  struct SharedState {
+    explicit SharedState(size_t max_pending) : max_pending(max_pending) {}
+
+    // Conditions for `absl::Mutex::Await()`.
+    bool HasDataOrIdle() ABSL_EXCLUSIVE_LOCKS_REQUIRED(mutex) {
+      return !ready.empty() || !reading;
+    }
+    bool Idle() ABSL_EXCLUSIVE_LOCKS_REQUIRED(mutex) { return !reading; }
+
+    const size_t max_pending;
+    absl::Mutex mutex;
+    // Data read ahead, in the order of positions, each beginning where the
+    // previous one ends.
+    std::deque<Chain> ready ABSL_GUARDED_BY(mutex);
+    // `true` if a background task reads data into `ready`.
+    bool reading ABSL_GUARDED_BY(mutex) = false;
+    // `true` if the background task should stop reading soon.
+    bool stopping ABSL_GUARDED_BY(mutex) = false;
+    // `true` if the source ended or failed, so nothing more is read ahead.
+    bool ended ABSL_GUARDED_BY(mutex) = false;
+  };
+
+  // Reads buffers from `*src` into `state->ready` until there is no room.
+  static void ReadAhead(SharedState* state, Reader* src, size_t buffer_size);
+
+  // Starts a background task reading ahead if there is room and none runs.
+  //
+  // Precondition: `state_->mutex` is held
+  void StartReadingLocked(Reader* src);
+
+  // Replaces `current_` with the next data read ahead, waiting for them if
+  // needed. Returns `false` if the source ended or failed.
+  bool NextChain(Reader* src);
+
+  // Discards data read ahead and `current_`.
+  //
+  // Precondition: the background thread is not reading
+  void DiscardReadAhead();
+
+  size_t buffer_size_ = 0;
+  bool supports_random_access_ = false;
+  // Data read ahead which are being consumed. `current_.blocks()[next_block_]`
+  // is exposed as the buffer after the current one.
+  Chain current_;
+  size_t next_block_ = 0;
+  std::unique_ptr<SharedState> state_;
+
+  // Invariant if scratch is not used and `start_ != nullptr`:
+  //   `start_ == current_.blocks()[next_block_ - 1].data()`
+};
+
+// A `Reader` which reads ahead from another `Reader` in a background thread,
+// so that consuming data overlaps with reading them, e.g. with decompression
+// or I/O performed by the other `Reader`.
+//
+// Seeking backwards, or forwards if the source `Reader` supports random
+// access, discards data read ahead and seeks the source `Reader`. Otherwise
+// seeking forwards skips data read ahead.
+//
+// `PrefetchingReader` supports random access if the source `Reader` does.
+//
+// The `Src` template parameter specifies the type of the object providing and
+// possibly owning the source `Reader`. `Src` must support
+// `Dependency<Reader*, Src>`, e.g. `Reader*` (not owned, default),
+// `std::unique_ptr<Reader>` (owned), `ZstdReader<FdReader<>>` (owned).
+//
+// The source `Reader` must not be accessed until the `PrefetchingReader` is
+// closed or no longer used. When the `PrefetchingReader` is closed, the
+// position of the source `Reader` is set to the position of the
+// `PrefetchingReader` if the source supports random access; otherwise it is
+// unspecified how much the source was read ahead.
+template <typename Src = Reader*>
+class PrefetchingReader : public PrefetchingReaderBase {
+ public:
+  // Creates a closed `PrefetchingReader`.
+  PrefetchingReader() noexcept {}
+
+  // Will read from the source `Reader` provided by `src`.
+  explicit PrefetchingReader(const Src& src, Options options = Options());
+  explicit PrefetchingReader(Src&& src, Options options = Options());
+
+  // Will read from the source `Reader` provided by a `Src` constructed from
+  // elements of `src_args`. This avoids constructing a temporary `Src` and
+  // moving from it.
+  template <typename... SrcArgs>
+  explicit PrefetchingReader(std::tuple<SrcArgs...> src_args,
+                             Options options = Options());
+
+  PrefetchingReader(PrefetchingReader&& that) noexcept;
+  PrefetchingReader& operator=(PrefetchingReader&& that) noexcept;
+
+  // Waits for the background thread before the source `Reader` can be
+  // destroyed.
+  ~PrefetchingReader();
+
+  // Makes `*this` equivalent to a newly constructed `PrefetchingReader`. This
+  // avoids constructing a temporary `PrefetchingReader` and moving from it.
+  void Reset();
+  void Reset(const Src& src, Options options = Options());
+  void Reset(Src&& src, Options options = Options());
+  template <typename... SrcArgs>
+  void Reset(std::tuple<SrcArgs...> src_args, Options options = Options());
+
+  // Returns the object providing and possibly owning the source `Reader`.
+  // Unchanged by `Close()`.
+  Src& src() { return src_.manager(); }
+  const Src& src() const { return src_.manager(); }
+  Reader* src_reader() override { return src_.get(); }
+  const Reader* src_reader() const override { return src_.get(); }
+
+  void VerifyEnd() override;
+
+ protected:
+  void Done() override;
+
+ private:
+  // The object providing and possibly owning the source `Reader`.
+  Dependency<Reader*, Src> src_;
+};
+
+// Implementation details follow.
+
+inline PrefetchingReaderBase::PrefetchingReaderBase(size_t buffer_size,
+                                                    size_t max_pending)
+    : PullableReader(kInitiallyOpen),
+      buffer_size_(buffer_size),
+      state_(std::make_unique<SharedState>(max_pending)) {}
+
+inline PrefetchingReaderBase::PrefetchingReaderBase(
+    PrefetchingReaderBase&& that) noexcept
+    : PullableReader(std::move(that)),
+      buffer_size_(that.buffer_size_),
+      supports_random_access_(that.supports_random_access_),
+      next_block_(std::exchange(that.next_block_, 0)),
+      state_(std::move(that.state_)) {
+  // The background thread must not use the source `Reader` while it is being
+  // moved.
+  StopReading();
+  // `current_` can hold the buffer in its short data, which would move, so
+  // find the buffer again after moving `current_`.
+  SwapScratchBegin();
+  const size_t cursor_index = read_from_buffer();
+  current_ = std::move(that.current_);
+  if (start_ != nullptr) {
+    const absl::string_view block = current_.blocks()[next_block_ - 1];
+    start_ = block.data();
+    cursor_ = start_ + cursor_index;
+    limit_ = start_ + block.size();
+  }
+  SwapScratchEnd();
+}
+
+inline PrefetchingReaderBase& PrefetchingReaderBase::operator=(
+    PrefetchingReaderBase&& that) noexcept {
+  StopReading();
+  PullableReader::operator=(std::move(that));
+  buffer_size_ = that.buffer_size_;
+  supports_random_access_ = that.supports_random_access_;
+  next_block_ = std::exchange(that.next_block_, 0);
+  state_ = std::move(that.state_);
+  StopReading();
+  SwapScratchBegin();
+  const size_t cursor_index = read_from_buffer();
+  current_ = std::move(that.current_);
+  if (start_ != nullptr) {
+    const absl::string_view block = current_.blocks()[next_block_ - 1];
+    start_ = block.data();
+    cursor_ = start_ + cursor_index;
+    limit_ = start_ + block.size();
+  }
+  SwapScratchEnd();
+  return *this;
+}
+
+inline void PrefetchingReaderBase::Reset() {
+  StopReading();
+  PullableReader::Reset(kInitiallyClosed);
+  buffer_size_ = 0;
+  supports_random_access_ = false;
+  current_.Clear();
+  next_block_ = 0;
+  state_.reset();
+}
+
+inline void PrefetchingReaderBase::Reset(size_t buffer_size,
+                                         size_t max_pending) {
+  StopReading();
+  PullableReader::Reset(kInitiallyOpen);
+  buffer_size_ = buffer_size;
+  supports_random_access_ = false;
+  current_.Clear();
+  next_block_ = 0;
+  state_ = std::make_unique<SharedState>(max_pending);
+}
+
+template <typename Src>
+inline PrefetchingReader<Src>::PrefetchingReader(const Src& src,
+                                                 Options options)
+    : PrefetchingReaderBase(options.buffer_size_, options.max_pending_),
+      src_(src) {
+  Initialize(src_.get());
+}
+
+template <typename Src>
+inline PrefetchingReader<Src>::PrefetchingReader(Src&& src, Options options)
+    : PrefetchingReaderBase(options.buffer_size_, options.max_pending_),
+      src_(std::move(src)) {
+  Initialize(src_.get());
+}
+
+template <typename Src>
+template <typename... SrcArgs>
+inline PrefetchingReader<Src>::PrefetchingReader(
+    std::tuple<SrcArgs...> src_args, Options options)
+    : PrefetchingReaderBase(options.buffer_size_, options.max_pending_),
+      src_(std::move(src_args)) {
+  Initialize(src_.get());
+}
+
+template <typename Src>
+inline PrefetchingReader<Src>::PrefetchingReader(
+    PrefetchingReader&& that) noexcept
+    : PrefetchingReaderBase(std::move(that)), src_(std::move(that.src_)) {}
+
+template <typename Src>
+inline PrefetchingReader<Src>& PrefetchingReader<Src>::operator=(
+    PrefetchingReader&& that) noexcept {
+  PrefetchingReaderBase::operator=(std::move(that));
+  src_ = std::move(that.src_);
+  return *this;
+}
+
+template <typename Src>
+inline PrefetchingReader<Src>::~PrefetchingReader() {
+  StopReading();
+}
+
+template <typename Src>
+inline void PrefetchingReader<Src>::Reset() {
+  PrefetchingReaderBase::Reset();
+  src_.Reset();
+}
+
+template <typename Src>
+inline void PrefetchingReader<Src>::Reset(const Src& src, Options options) {
+  PrefetchingReaderBase::Reset(options.buffer_size_, options.max_pending_);
+  src_.Reset(src);
+  Initialize(src_.get());
+}
+
+template <typename Src>
+inline void PrefetchingReader<Src>::Reset(Src&& src, Options options) {
+  PrefetchingReaderBase::Reset(options.buffer_size_, options.max_pending_);
+  src_.Reset(std::move(src));
+  Initialize(src_.get());
+}
+
+template <typename Src>
+template <typename... SrcArgs>
+inline void PrefetchingReader<Src>::Reset(std::tuple<SrcArgs...> src_args,
+                                          Options options) {
+  PrefetchingReaderBase::Reset(options.buffer_size_, options.max_pending_);
+  src_.Reset(std::move(src_args));
+  Initialize(src_.get());
+}
+
+template <typename Src>
+void PrefetchingReader<Src>::Done() {
+  PrefetchingReaderBase::Done();
+  if (src_.is_owning()) {
+    if (ABSL_PREDICT_FALSE(!src_->Close())) Fail(*src_);
+  }
+}
+
+template <typename Src>
+void PrefetchingReader<Src>::VerifyEnd() {
+  PrefetchingReaderBase::VerifyEnd();
+  if (src_.is_owning() && ABSL_PREDICT_TRUE(healthy())) {
+    StopReading();
+    src_->VerifyEnd();
+  }
+}
+
+template <typename Src>
+struct Resetter<PrefetchingReader<Src>>
+    : ResetterByReset<PrefetchingReader<Src>> {};
+
+}  // namespace riegeli
+
+#endif  // RIEGELI_BYTES_PREFETCHING_READER_H_
@@ -218,6 +218,14 @@ class Reader : public Object {
   //  * `false` - failure (`!healthy()`)
   virtual bool Size(Position* size);
 
+  // Hints that `length` bytes beginning at `pos` are going to be read soon,
+  // e.g. after `Seek(pos)`, so that the source can start fetching them in
+  // background.
+  //
+  // This does not change the position and does not report failures. By
+  // default this does nothing.
+  virtual void Prefetch(Position pos, Position length) {}
+
  protected:
   // Creates a `Reader` with the given initial state.
   explicit Reader(InitiallyClosed) noexcept : Object(kInitiallyClosed) {}
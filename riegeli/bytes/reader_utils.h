@@ -17,6 +17,8 @@
 
 #include <stdint.h>
 
+#include <type_traits>
+
 #include "absl/base/optimization.h"
 #include "riegeli/base/base.h"
 #include "riegeli/bytes/reader.h"
@@ -50,6 +52,32 @@ char* CopyVarint32(Reader* src, char* dest);
 // At least `kMaxLengthVarint64` bytes of space at `dest[]` must be available.
 char* CopyVarint64(Reader* src, char* dest);
 
+// Variants of the above for a `Reader` subclass known at compile time, e.g.
+// `ChainReader<>`. They call `Src::Pull()`, which avoids a virtual call to
+// `PullSlow()` if the subclass provides its own `Pull()`, as `ChainReader<>`
+// does.
+template <typename Src>
+std::enable_if_t<std::is_base_of<Reader, Src>::value, bool> ReadByte(
+    Src* src, uint8_t* data);
+template <typename Src>
+std::enable_if_t<std::is_base_of<Reader, Src>::value, bool> ReadVarint32(
+    Src* src, uint32_t* data);
+template <typename Src>
+std::enable_if_t<std::is_base_of<Reader, Src>::value, bool> ReadVarint64(
+    Src* src, uint64_t* data);
+template <typename Src>
+std::enable_if_t<std::is_base_of<Reader, Src>::value, bool>
+ReadCanonicalVarint32(Src* src, uint32_t* data);
+template <typename Src>
+std::enable_if_t<std::is_base_of<Reader, Src>::value, bool>
+ReadCanonicalVarint64(Src* src, uint64_t* data);
+template <typename Src>
+std::enable_if_t<std::is_base_of<Reader, Src>::value, char*> CopyVarint32(
+    Src* src, char* dest);
+template <typename Src>
+std::enable_if_t<std::is_base_of<Reader, Src>::value, char*> CopyVarint64(
+    Src* src, char* dest);
+
 // Low level variants which read from an array.
 
 bool ReadVarint32(const char** src, const char* limit, uint32_t* data);
@@ -60,7 +88,9 @@ char* CopyVarint64(const char** src, const char* limit, char* dest);
 
 // Implementation details follow.
 
-inline bool ReadByte(Reader* src, uint8_t* data) {
+template <typename Src>
+inline std::enable_if_t<std::is_base_of<Reader, Src>::value, bool> ReadByte(
+    Src* src, uint8_t* data) {
   if (ABSL_PREDICT_FALSE(!src->Pull())) return false;
   const char* cursor = src->cursor();
   *data = static_cast<uint8_t>(*cursor++);
@@ -68,7 +98,9 @@ inline bool ReadByte(Reader* src, uint8_t* data) {
   return true;
 }
 
-inline bool ReadVarint32(Reader* src, uint32_t* data) {
+template <typename Src>
+inline std::enable_if_t<std::is_base_of<Reader, Src>::value, bool> ReadVarint32(
+    Src* src, uint32_t* data) {
   src->Pull(kMaxLengthVarint32);
   const char* cursor = src->cursor();
   if (ABSL_PREDICT_FALSE(!ReadVarint32(&cursor, src->limit(), data))) {
@@ -78,7 +110,9 @@ inline bool ReadVarint32(Reader* src, uint32_t* data) {
   return true;
 }
 
-inline bool ReadVarint64(Reader* src, uint64_t* data) {
+template <typename Src>
+inline std::enable_if_t<std::is_base_of<Reader, Src>::value, bool> ReadVarint64(
+    Src* src, uint64_t* data) {
   src->Pull(kMaxLengthVarint64);
   const char* cursor = src->cursor();
   if (ABSL_PREDICT_FALSE(!ReadVarint64(&cursor, src->limit(), data))) {
@@ -88,7 +122,9 @@ inline bool ReadVarint64(Reader* src, uint64_t* data) {
   return true;
 }
 
-inline bool ReadCanonicalVarint32(Reader* src, uint32_t* data) {
+template <typename Src>
+inline std::enable_if_t<std::is_base_of<Reader, Src>::value, bool>
+ReadCanonicalVarint32(Src* src, uint32_t* data) {
   src->Pull(kMaxLengthVarint32);
   const char* cursor = src->cursor();
   if (ABSL_PREDICT_FALSE(cursor == src->limit())) return false;
@@ -108,7 +144,9 @@ inline bool ReadCanonicalVarint32(Reader* src, uint32_t* data) {
   return true;
 }
 
-inline bool ReadCanonicalVarint64(Reader* src, uint64_t* data) {
+template <typename Src>
+inline std::enable_if_t<std::is_base_of<Reader, Src>::value, bool>
+ReadCanonicalVarint64(Src* src, uint64_t* data) {
   src->Pull(kMaxLengthVarint64);
   const char* cursor = src->cursor();
   if (ABSL_PREDICT_FALSE(cursor == src->limit())) return false;
@@ -128,7 +166,9 @@ inline bool ReadCanonicalVarint64(Reader* src, uint64_t* data) {
   return true;
 }
 
-inline char* CopyVarint32(Reader* src, char* dest) {
+template <typename Src>
+inline std::enable_if_t<std::is_base_of<Reader, Src>::value, char*>
+CopyVarint32(Src* src, char* dest) {
   src->Pull(kMaxLengthVarint32);
   const char* cursor = src->cursor();
   dest = CopyVarint32(&cursor, src->limit(), dest);
@@ -136,7 +176,9 @@ inline char* CopyVarint32(Reader* src, char* dest) {
   return dest;
 }
 
-inline char* CopyVarint64(Reader* src, char* dest) {
+template <typename Src>
+inline std::enable_if_t<std::is_base_of<Reader, Src>::value, char*>
+CopyVarint64(Src* src, char* dest) {
   src->Pull(kMaxLengthVarint64);
   const char* cursor = src->cursor();
   dest = CopyVarint64(&cursor, src->limit(), dest);
@@ -144,6 +186,34 @@ inline char* CopyVarint64(Reader* src, char* dest) {
   return dest;
 }
 
+inline bool ReadByte(Reader* src, uint8_t* data) {
+  return ReadByte<Reader>(src, data);
+}
+
+inline bool ReadVarint32(Reader* src, uint32_t* data) {
+  return ReadVarint32<Reader>(src, data);
+}
+
+inline bool ReadVarint64(Reader* src, uint64_t* data) {
+  return ReadVarint64<Reader>(src, data);
+}
+
+inline bool ReadCanonicalVarint32(Reader* src, uint32_t* data) {
+  return ReadCanonicalVarint32<Reader>(src, data);
+}
+
+inline bool ReadCanonicalVarint64(Reader* src, uint64_t* data) {
+  return ReadCanonicalVarint64<Reader>(src, data);
+}
+
+inline char* CopyVarint32(Reader* src, char* dest) {
+  return CopyVarint32<Reader>(src, dest);
+}
+
+inline char* CopyVarint64(Reader* src, char* dest) {
+  return CopyVarint64<Reader>(src, dest);
+}
+
 inline bool ReadVarint32(const char** src, const char* limit, uint32_t* data) {
   const char* cursor = *src;
   uint32_t acc = 0;
@@ -0,0 +1,386 @@
+// Copyright 2019 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Make `memfd_create()` available.
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+// Make `off_t` 64-bit even on 32-bit systems.
+#undef _FILE_OFFSET_BITS
+#define _FILE_OFFSET_BITS 64
+
+#include "riegeli/bytes/shared_memory_pipe.h"
+
+#include <limits.h>
+#include <linux/futex.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cerrno>
+#include <limits>
+
+#include "absl/base/optimization.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/string_view.h"
+#include "riegeli/base/base.h"
+#include "riegeli/base/canonical_errors.h"
+#include "riegeli/base/errno_mapping.h"
+#include "riegeli/bytes/reader.h"
+#include "riegeli/bytes/writer.h"
+
+namespace riegeli {
+
+namespace {
+
+constexpr uint64_t kMagic = uint64_t{0x6570697070616873};  // "shappipe"
+
+// Bits of `SharedMemoryPipe::Header::state`.
+constexpr uint32_t kWriterClosed = 1;
+constexpr uint32_t kWriterFailed = 2;
+constexpr uint32_t kReaderClosed = 4;
+
+// Waits until `*word` is woken, unless it is no longer `value`. Spurious
+// wakeups are possible.
+void FutexWait(std::atomic<uint32_t>* word, uint32_t value) {
+  // Not `FUTEX_PRIVATE_FLAG`, because `*word` is shared between processes.
+  syscall(SYS_futex, reinterpret_cast<uint32_t*>(word), FUTEX_WAIT, value,
+          nullptr, nullptr, 0);
+}
+
+// Wakes all waiters on `*word`.
+void FutexWake(std::atomic<uint32_t>* word) {
+  syscall(SYS_futex, reinterpret_cast<uint32_t*>(word), FUTEX_WAKE, INT_MAX,
+          nullptr, nullptr, 0);
+}
+
+}  // namespace
+
+// Shared state of a pipe, at the beginning of the memfd. Positions are
+// absolute; the ring buffer holds data in [`read_pos`, `write_pos`).
+//
+// A side waiting for the other one sets its `*_waiting` flag and sleeps on the
+// other side's `*_seq`, which is incremented after changing the positions or
+// `state`. With sequentially consistent atomics this does not miss wakeups,
+// and skips `FUTEX_WAKE` when nobody waits.
+struct SharedMemoryPipe::Header {
+  uint64_t magic;
+  uint64_t capacity;
+  std::atomic<uint64_t> write_pos;
+  std::atomic<uint64_t> read_pos;
+  std::atomic<uint32_t> write_seq;
+  std::atomic<uint32_t> read_seq;
+  std::atomic<uint32_t> writer_waiting;
+  std::atomic<uint32_t> reader_waiting;
+  std::atomic<uint32_t> state;
+};
+
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2 && ATOMIC_INT_LOCK_FREE == 2,
+              "SharedMemoryPipe requires lock-free atomics");
+
+SharedMemoryPipe::SharedMemoryPipe(Options options) : Object(kInitiallyOpen) {
+  const int fd = memfd_create("riegeli_shared_memory_pipe", MFD_CLOEXEC);
+  if (ABSL_PREDICT_FALSE(fd < 0)) {
+    FailOperation("memfd_create()");
+    return;
+  }
+  fd_ = fd;
+  owns_fd_ = true;
+  const size_t page_size = IntCast<size_t>(sysconf(_SC_PAGESIZE));
+  if (ABSL_PREDICT_FALSE(options.capacity_ >
+                         (std::numeric_limits<size_t>::max() - page_size) / 2 -
+                             page_size)) {
+    Fail(ResourceExhaustedError("SharedMemoryPipe capacity overflow"));
+    return;
+  }
+  const size_t capacity =
+      (options.capacity_ + (page_size - 1)) / page_size * page_size;
+  if (ABSL_PREDICT_FALSE(
+          ftruncate(fd, IntCast<off_t>(page_size + capacity)) < 0)) {
+    FailOperation("ftruncate()");
+    return;
+  }
+  if (ABSL_PREDICT_FALSE(!Map(fd, capacity))) return;
+  // The memfd is initially filled with zeros, which initializes the atomics.
+  header_->magic = kMagic;
+  header_->capacity = capacity;
+}
+
+SharedMemoryPipe::SharedMemoryPipe(int fd) : Object(kInitiallyOpen) {
+  RIEGELI_ASSERT_GE(fd, 0)
+      << "Failed precondition of SharedMemoryPipe: negative file descriptor";
+  fd_ = fd;
+  const size_t page_size = IntCast<size_t>(sysconf(_SC_PAGESIZE));
+  struct stat stat_info;
+  if (ABSL_PREDICT_FALSE(fstat(fd, &stat_info) < 0)) {
+    FailOperation("fstat()");
+    return;
+  }
+  const Position file_size = IntCast<Position>(stat_info.st_size);
+  if (ABSL_PREDICT_FALSE(file_size <= page_size ||
+                         file_size - page_size >
+                             (std::numeric_limits<size_t>::max() - page_size) /
+                                 2)) {
+    Fail(InvalidArgumentError(
+        absl::StrCat("Not a SharedMemoryPipe: unexpected size ", file_size)));
+    return;
+  }
+  const size_t capacity = IntCast<size_t>(file_size - page_size);
+  if (ABSL_PREDICT_FALSE(!Map(fd, capacity))) return;
+  if (ABSL_PREDICT_FALSE(header_->magic != kMagic ||
+                         header_->capacity != capacity)) {
+    Fail(InvalidArgumentError("Not a SharedMemoryPipe: invalid header"));
+  }
+}
+
+SharedMemoryPipe::~SharedMemoryPipe() { Unmap(); }
+
+void SharedMemoryPipe::Done() {
+  Unmap();
+  Object::Done();
+}
+
+bool SharedMemoryPipe::Map(int fd, size_t capacity) {
+  const size_t page_size = IntCast<size_t>(sysconf(_SC_PAGESIZE));
+  const size_t mapping_size = page_size + 2 * capacity;
+  // Reserve address space for the whole mapping, then map the memfd over it
+  // twice.
+  void* const reserved = mmap(nullptr, mapping_size, PROT_NONE,
+                              MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (ABSL_PREDICT_FALSE(reserved == MAP_FAILED)) {
+    return FailOperation("mmap()");
+  }
+  char* const mapping = static_cast<char*>(reserved);
+  if (ABSL_PREDICT_FALSE(
+          mmap(mapping, page_size + capacity, PROT_READ | PROT_WRITE,
+               MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED ||
+          mmap(mapping + page_size + capacity, capacity, PROT_READ | PROT_WRITE,
+               MAP_SHARED | MAP_FIXED, fd,
+               IntCast<off_t>(page_size)) == MAP_FAILED)) {
+    FailOperation("mmap()");
+    munmap(mapping, mapping_size);
+    return false;
+  }
+  capacity_ = capacity;
+  mapping_ = mapping;
+  mapping_size_ = mapping_size;
+  header_ = reinterpret_cast<Header*>(mapping);
+  data_ = mapping + page_size;
+  return true;
+}
+
+void SharedMemoryPipe::Unmap() {
+  if (mapping_ != nullptr) {
+    munmap(mapping_, mapping_size_);
+    mapping_ = nullptr;
+    mapping_size_ = 0;
+    header_ = nullptr;
+    data_ = nullptr;
+  }
+  if (owns_fd_) {
+    close(fd_);
+    fd_ = -1;
+    owns_fd_ = false;
+  }
+}
+
+bool SharedMemoryPipe::FailOperation(absl::string_view operation) {
+  const int error_number = errno;
+  RIEGELI_ASSERT_NE(error_number, 0)
+      << "Failed precondition of SharedMemoryPipe::FailOperation(): "
+         "zero errno";
+  return Fail(ErrnoToCanonicalStatus(
+      error_number, absl::StrCat(operation, " failed for SharedMemoryPipe")));
+}
+
+Position SharedMemoryPipe::write_pos() const {
+  return header_->write_pos.load();
+}
+
+Position SharedMemoryPipe::read_pos() const { return header_->read_pos.load(); }
+
+bool SharedMemoryPipe::WaitForRoom(Position pos, size_t length) {
+  RIEGELI_ASSERT_LE(length, capacity_)
+      << "Failed precondition of SharedMemoryPipe::WaitForRoom(): "
+         "length exceeds capacity";
+  for (;;) {
+    const uint32_t seq = header_->read_seq.load();
+    if (ABSL_PREDICT_FALSE((header_->state.load() & kReaderClosed) != 0)) {
+      return false;
+    }
+    if (pos - header_->read_pos.load() <= capacity_ - length) return true;
+    header_->writer_waiting.store(1);
+    if (header_->read_seq.load() == seq) FutexWait(&header_->read_seq, seq);
+  }
+}
+
+void SharedMemoryPipe::Publish(Position pos) {
+  header_->write_pos.store(pos);
+  header_->write_seq.fetch_add(1);
+  if (header_->reader_waiting.exchange(0) != 0) {
+    FutexWake(&header_->write_seq);
+  }
+}
+
+void SharedMemoryPipe::CloseWriter(bool failed) {
+  header_->state.fetch_or(failed ? kWriterClosed | kWriterFailed
+                                 : kWriterClosed);
+  header_->write_seq.fetch_add(1);
+  FutexWake(&header_->write_seq);
+}
+
+bool SharedMemoryPipe::WaitForData(Position pos, size_t length,
+                                   bool* writer_failed) {
+  RIEGELI_ASSERT_LE(length, capacity_)
+      << "Failed precondition of SharedMemoryPipe::WaitForData(): "
+         "length exceeds capacity";
+  for (;;) {
+    const uint32_t seq = header_->write_seq.load();
+    const uint32_t state = header_->state.load();
+    if (header_->write_pos.load() - pos >= length) return true;
+    if (ABSL_PREDICT_FALSE((state & kWriterClosed) != 0)) {
+      *writer_failed = (state & kWriterFailed) != 0;
+      return false;
+    }
+    header_->reader_waiting.store(1);
+    if (header_->write_seq.load() == seq) FutexWait(&header_->write_seq, seq);
+  }
+}
+
+void SharedMemoryPipe::Consume(Position pos) {
+  header_->read_pos.store(pos);
+  header_->read_seq.fetch_add(1);
+  if (header_->writer_waiting.exchange(0) != 0) {
+    FutexWake(&header_->read_seq);
+  }
+}
+
+void SharedMemoryPipe::CloseReader() {
+  header_->state.fetch_or(kReaderClosed);
+  header_->read_seq.fetch_add(1);
+  FutexWake(&header_->read_seq);
+}
+
+void SharedMemoryPipeWriter::Initialize(SharedMemoryPipe* pipe) {
+  pipe_ = RIEGELI_ASSERT_NOTNULL(pipe);
+  if (ABSL_PREDICT_FALSE(!pipe_->healthy())) {
+    Fail(*pipe_);
+    return;
+  }
+  start_pos_ = pipe_->write_pos();
+}
+
+void SharedMemoryPipeWriter::Done() {
+  if (pipe_->healthy()) {
+    if (ABSL_PREDICT_TRUE(healthy())) pipe_->Publish(pos());
+    // Report the end of data, or the failure, to the `SharedMemoryPipeReader`.
+    pipe_->CloseWriter(!healthy());
+  }
+  start_pos_ = pos();
+  start_ = nullptr;
+  cursor_ = nullptr;
+  limit_ = nullptr;
+  Writer::Done();
+}
+
+bool SharedMemoryPipeWriter::PushSlow(size_t min_length,
+                                      size_t recommended_length) {
+  RIEGELI_ASSERT_GT(min_length, available())
+      << "Failed precondition of Writer::PushSlow(): "
+         "length too small, use Push() instead";
+  if (ABSL_PREDICT_FALSE(!healthy())) return false;
+  if (ABSL_PREDICT_FALSE(min_length >
+                         std::numeric_limits<Position>::max() - pos())) {
+    return FailOverflow();
+  }
+  if (ABSL_PREDICT_FALSE(min_length > pipe_->capacity())) {
+    return Fail(ResourceExhaustedError(
+        absl::StrCat("SharedMemoryPipeWriter can push at most ",
+                     pipe_->capacity(), " bytes at once")));
+  }
+  const Position current_pos = pos();
+  // Let the reader proceed while waiting for room.
+  pipe_->Publish(current_pos);
+  if (ABSL_PREDICT_FALSE(!pipe_->WaitForRoom(current_pos, min_length))) {
+    return Fail(FailedPreconditionError("SharedMemoryPipeReader closed"));
+  }
+  start_ = pipe_->data_at(current_pos);
+  cursor_ = start_;
+  limit_ = start_ + (pipe_->capacity() -
+                     IntCast<size_t>(current_pos - pipe_->read_pos()));
+  start_pos_ = current_pos;
+  return true;
+}
+
+bool SharedMemoryPipeWriter::Flush(FlushType flush_type) {
+  if (ABSL_PREDICT_FALSE(!healthy())) return false;
+  pipe_->Publish(pos());
+  return true;
+}
+
+void SharedMemoryPipeReader::Initialize(SharedMemoryPipe* pipe) {
+  pipe_ = RIEGELI_ASSERT_NOTNULL(pipe);
+  if (ABSL_PREDICT_FALSE(!pipe_->healthy())) {
+    Fail(*pipe_);
+    return;
+  }
+  limit_pos_ = pipe_->read_pos();
+}
+
+void SharedMemoryPipeReader::Done() {
+  if (pipe_->healthy()) pipe_->CloseReader();
+  limit_pos_ = pos();
+  start_ = nullptr;
+  cursor_ = nullptr;
+  limit_ = nullptr;
+  Reader::Done();
+}
+
+bool SharedMemoryPipeReader::PullSlow(size_t min_length,
+                                      size_t recommended_length) {
+  RIEGELI_ASSERT_GT(min_length, available())
+      << "Failed precondition of Reader::PullSlow(): "
+         "length too small, use Pull() instead";
+  if (ABSL_PREDICT_FALSE(!healthy())) return false;
+  if (ABSL_PREDICT_FALSE(min_length > pipe_->capacity())) {
+    return Fail(ResourceExhaustedError(
+        absl::StrCat("SharedMemoryPipeReader can pull at most ",
+                     pipe_->capacity(), " bytes at once")));
+  }
+  const Position current_pos = pos();
+  // Let the writer proceed while waiting for data.
+  pipe_->Consume(current_pos);
+  bool writer_failed = false;
+  const bool ok = pipe_->WaitForData(current_pos, min_length, &writer_failed);
+  const Position write_pos = pipe_->write_pos();
+  start_ = pipe_->data_at(current_pos);
+  cursor_ = start_;
+  limit_ = start_ + IntCast<size_t>(write_pos - current_pos);
+  limit_pos_ = write_pos;
+  if (ABSL_PREDICT_FALSE(!ok)) {
+    if (ABSL_PREDICT_FALSE(writer_failed)) {
+      return Fail(DataLossError("SharedMemoryPipeWriter failed"));
+    }
+    return false;
+  }
+  return true;
+}
+
+}  // namespace riegeli
@@ -0,0 +1,321 @@
+// Copyright 2019 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef RIEGELI_BYTES_SHARED_MEMORY_PIPE_H_
+#define RIEGELI_BYTES_SHARED_MEMORY_PIPE_H_
+
+#include <stddef.h>
+
+#include <utility>
+
+#include "absl/base/attributes.h"
+#include "absl/strings/string_view.h"
+#include "riegeli/base/base.h"
+#include "riegeli/base/object.h"
+#include "riegeli/bytes/reader.h"
+#include "riegeli/bytes/writer.h"
+
+namespace riegeli {
+
+// A bounded channel transferring data from a `SharedMemoryPipeWriter` to a
+// `SharedMemoryPipeReader`, typically in different processes. Data are written
+// directly to a ring buffer in shared memory and read directly from there,
+// without copying. Waiting for data or for room uses futexes.
+//
+// The ring buffer is backed by a memfd. One process creates the
+// `SharedMemoryPipe` with `SharedMemoryPipe(Options)` and passes `fd()` to
+// another process (inherited by `fork()` or sent with `SCM_RIGHTS`), which
+// attaches to it with `SharedMemoryPipe(fd)`.
+//
+// This carries a Riegeli/records stream between processes with low latency:
+// a `RecordReader` reading from a `SharedMemoryPipeReader` waits for chunks as
+// they are written, following the stream until the `SharedMemoryPipeWriter` is
+// closed, without polling a file. Records are visible to the reader after
+// `RecordWriterBase::Flush()`.
+//
+// The `SharedMemoryPipe` must outlive the `SharedMemoryPipeWriter` or
+// `SharedMemoryPipeReader` using it. There must be at most one
+// `SharedMemoryPipeWriter` and at most one `SharedMemoryPipeReader` among all
+// processes attached to the pipe. If a process exits without closing its side,
+// the other side can wait forever.
+//
+// Available on Linux.
+class SharedMemoryPipe : public Object {
+ public:
+  class Options {
+   public:
+    Options() noexcept {}
+
+    // Sets the size of the ring buffer (rounded up to the page size). This
+    // bounds the amount of data written but not yet read, and the length
+    // which can be pulled or pushed at once.
+    //
+    // Default: 1M
+    Options& set_capacity(size_t capacity) & {
+      RIEGELI_ASSERT_GT(capacity, 0u)
+          << "Failed precondition of "
+             "SharedMemoryPipe::Options::set_capacity(): "
+             "zero capacity";
+      capacity_ = capacity;
+      return *this;
+    }
+    Options&& set_capacity(size_t capacity) && {
+      return std::move(set_capacity(capacity));
+    }
+
+   private:
+    friend class SharedMemoryPipe;
+
+    size_t capacity_ = size_t{1} << 20;
+  };
+
+  // Creates a closed `SharedMemoryPipe`.
+  SharedMemoryPipe() noexcept : Object(kInitiallyClosed) {}
+
+  // Creates a new pipe backed by a new memfd, which is owned.
+  explicit SharedMemoryPipe(Options options);
+
+  // Attaches to a pipe created by another `SharedMemoryPipe`, whose `fd()` is
+  // given. The fd is not owned.
+  explicit SharedMemoryPipe(int fd);
+
+  SharedMemoryPipe(const SharedMemoryPipe&) = delete;
+  SharedMemoryPipe& operator=(const SharedMemoryPipe&) = delete;
+
+  ~SharedMemoryPipe();
+
+  // Returns the memfd backing the pipe. If the fd is owned then changed to -1
+  // by `Close()`, otherwise unchanged.
+  int fd() const { return fd_; }
+
+  // Returns the size of the ring buffer.
+  size_t capacity() const { return capacity_; }
+
+ protected:
+  void Done() override;
+
+ private:
+  friend class SharedMemoryPipeWriter;
+  friend class SharedMemoryPipeReader;
+
+  struct Header;
+
+  // Maps the memfd twice in a row after the header, so that any range of
+  // `capacity_` bytes of the ring buffer is contiguous.
+  //
+  // Return values:
+  //  * `true`  - success (`healthy()`)
+  //  * `false` - failure (`!healthy()`)
+  bool Map(int fd, size_t capacity);
+
+  // Unmaps the pipe and closes the fd if it is owned.
+  void Unmap();
+
+  ABSL_ATTRIBUTE_COLD bool FailOperation(absl::string_view operation);
+
+  // Returns the address in the ring buffer of data at `pos`.
+  char* data_at(Position pos) const { return data_ + pos % capacity_; }
+
+  Position write_pos() const;
+  Position read_pos() const;
+
+  // Called by `SharedMemoryPipeWriter`. Waits until at least `length` bytes
+  // are free after `pos`, or the reader is closed.
+  //
+  // Return values:
+  //  * `true`  - success
+  //  * `false` - the reader is closed
+  bool WaitForRoom(Position pos, size_t length);
+
+  // Called by `SharedMemoryPipeWriter`. Makes data up to `pos` visible to the
+  // reader.
+  void Publish(Position pos);
+
+  // Called by `SharedMemoryPipeWriter`. Marks the end of data. If `failed`,
+  // the reader fails after reading data published before.
+  void CloseWriter(bool failed);
+
+  // Called by `SharedMemoryPipeReader`. Waits until at least `length` bytes
+  // are published after `pos`, or the writer is closed.
+  //
+  // Return values:
+  //  * `true`  - success
+  //  * `false` - the writer is closed, `*writer_failed` is set to whether it
+  //              failed
+  bool WaitForData(Position pos, size_t length, bool* writer_failed);
+
+  // Called by `SharedMemoryPipeReader`. Releases data up to `pos` to be
+  // overwritten by the writer.
+  void Consume(Position pos);
+
+  // Called by `SharedMemoryPipeReader`. Makes further `WaitForRoom()` calls
+  // fail instead of waiting.
+  void CloseReader();
+
+  int fd_ = -1;
+  bool owns_fd_ = false;
+  size_t capacity_ = 0;
+  // The whole mapping, consisting of a page with `Header`, and the ring
+  // buffer mapped twice.
+  char* mapping_ = nullptr;
+  size_t mapping_size_ = 0;
+  Header* header_ = nullptr;
+  char* data_ = nullptr;
+};
+
+// A `Writer` which writes to a `SharedMemoryPipeReader`, usually in another
+// process, through a `SharedMemoryPipe`.
+//
+// The buffer is the free space of the ring buffer. Data become visible to the
+// reader when the buffer is full, by `Flush()`, and by `Close()`. Closing the
+// `SharedMemoryPipeWriter` marks the end of data for the reader. If the reader
+// is closed first, writing fails.
+//
+// `SharedMemoryPipeWriter` does not support random access.
+class SharedMemoryPipeWriter : public Writer {
+ public:
+  // Creates a closed `SharedMemoryPipeWriter`.
+  SharedMemoryPipeWriter() noexcept : Writer(kInitiallyClosed) {}
+
+  // Will write to `*pipe`.
+  explicit SharedMemoryPipeWriter(SharedMemoryPipe* pipe);
+
+  SharedMemoryPipeWriter(SharedMemoryPipeWriter&& that) noexcept;
+  SharedMemoryPipeWriter& operator=(SharedMemoryPipeWriter&& that) noexcept;
+
+  // Makes `*this` equivalent to a newly constructed `SharedMemoryPipeWriter`.
+  // This avoids constructing a temporary `SharedMemoryPipeWriter` and moving
+  // from it.
+  void Reset();
+  void Reset(SharedMemoryPipe* pipe);
+
+  // Returns the `SharedMemoryPipe` being written to. Unchanged by `Close()`.
+  SharedMemoryPipe* pipe() const { return pipe_; }
+
+  // Makes data written so far visible to the reader. `flush_type` is ignored.
+  bool Flush(FlushType flush_type) override;
+
+ protected:
+  void Done() override;
+  bool PushSlow(size_t min_length, size_t recommended_length) override;
+
+ private:
+  void Initialize(SharedMemoryPipe* pipe);
+
+  SharedMemoryPipe* pipe_ = nullptr;
+
+  // Invariant if `start_ != nullptr`: `start_ == pipe_->data_at(start_pos_)`
+};
+
+// A `Reader` which reads from a `SharedMemoryPipeWriter`, usually in another
+// process, through a `SharedMemoryPipe`, waiting for data if needed.
+//
+// The buffer is the published part of the ring buffer. Data before `pos()`
+// are released to the writer when more data are pulled.
+//
+// The source ends when the `SharedMemoryPipeWriter` is closed and all data
+// were read. If the `SharedMemoryPipeWriter` failed, the
+// `SharedMemoryPipeReader` fails then.
+//
+// Closing the `SharedMemoryPipeReader` makes further writing fail.
+//
+// `SharedMemoryPipeReader` does not support random access. Seeking forwards
+// skips data.
+class SharedMemoryPipeReader : public Reader {
+ public:
+  // Creates a closed `SharedMemoryPipeReader`.
+  SharedMemoryPipeReader() noexcept : Reader(kInitiallyClosed) {}
+
+  // Will read from `*pipe`.
+  explicit SharedMemoryPipeReader(SharedMemoryPipe* pipe);
+
+  SharedMemoryPipeReader(SharedMemoryPipeReader&& that) noexcept;
+  SharedMemoryPipeReader& operator=(SharedMemoryPipeReader&& that) noexcept;
+
+  // Makes `*this` equivalent to a newly constructed `SharedMemoryPipeReader`.
+  // This avoids constructing a temporary `SharedMemoryPipeReader` and moving
+  // from it.
+  void Reset();
+  void Reset(SharedMemoryPipe* pipe);
+
+  // Returns the `SharedMemoryPipe` being read from. Unchanged by `Close()`.
+  SharedMemoryPipe* pipe() const { return pipe_; }
+
+ protected:
+  void Done() override;
+  bool PullSlow(size_t min_length, size_t recommended_length) override;
+
+ private:
+  void Initialize(SharedMemoryPipe* pipe);
+
+  SharedMemoryPipe* pipe_ = nullptr;
+};
+
+// Implementation details follow.
+
+inline SharedMemoryPipeWriter::SharedMemoryPipeWriter(SharedMemoryPipe* pipe)
+    : Writer(kInitiallyOpen) {
+  Initialize(pipe);
+}
+
+inline SharedMemoryPipeWriter::SharedMemoryPipeWriter(
+    SharedMemoryPipeWriter&& that) noexcept
+    : Writer(std::move(that)), pipe_(std::exchange(that.pipe_, nullptr)) {}
+
+inline SharedMemoryPipeWriter& SharedMemoryPipeWriter::operator=(
+    SharedMemoryPipeWriter&& that) noexcept {
+  Writer::operator=(std::move(that));
+  pipe_ = std::exchange(that.pipe_, nullptr);
+  return *this;
+}
+
+inline void SharedMemoryPipeWriter::Reset() {
+  Writer::Reset(kInitiallyClosed);
+  pipe_ = nullptr;
+}
+
+inline void SharedMemoryPipeWriter::Reset(SharedMemoryPipe* pipe) {
+  Writer::Reset(kInitiallyOpen);
+  Initialize(pipe);
+}
+
+inline SharedMemoryPipeReader::SharedMemoryPipeReader(SharedMemoryPipe* pipe)
+    : Reader(kInitiallyOpen) {
+  Initialize(pipe);
+}
+
+inline SharedMemoryPipeReader::SharedMemoryPipeReader(
+    SharedMemoryPipeReader&& that) noexcept
+    : Reader(std::move(that)), pipe_(std::exchange(that.pipe_, nullptr)) {}
+
+inline SharedMemoryPipeReader& SharedMemoryPipeReader::operator=(
+    SharedMemoryPipeReader&& that) noexcept {
+  Reader::operator=(std::move(that));
+  pipe_ = std::exchange(that.pipe_, nullptr);
+  return *this;
+}
+
+inline void SharedMemoryPipeReader::Reset() {
+  Reader::Reset(kInitiallyClosed);
+  pipe_ = nullptr;
+}
+
+inline void SharedMemoryPipeReader::Reset(SharedMemoryPipe* pipe) {
+  Reader::Reset(kInitiallyOpen);
+  Initialize(pipe);
+}
+
+}  // namespace riegeli
+
+#endif  // RIEGELI_BYTES_SHARED_MEMORY_PIPE_H_
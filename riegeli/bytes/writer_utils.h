@@ -19,6 +19,7 @@
 #include <stdint.h>
 
 #include <cstring>
+#include <type_traits>
 
 #include "absl/base/optimization.h"
 #include "riegeli/base/base.h"
@@ -43,6 +44,20 @@ bool WriteVarint64(Writer* dest, uint64_t data);
 
 bool WriteZeros(Writer* dest, Position length);
 
+// Variants of the above for a `Writer` subclass known at compile time, e.g.
+// `ChainWriter<>`. They call `Dest::Push()`, which avoids a virtual call to
+// `PushSlow()` if the subclass provides its own `Push()`, as `ChainWriter<>`
+// does.
+template <typename Dest>
+std::enable_if_t<std::is_base_of<Writer, Dest>::value, bool> WriteByte(
+    Dest* dest, uint8_t data);
+template <typename Dest>
+std::enable_if_t<std::is_base_of<Writer, Dest>::value, bool> WriteVarint32(
+    Dest* dest, uint32_t data);
+template <typename Dest>
+std::enable_if_t<std::is_base_of<Writer, Dest>::value, bool> WriteVarint64(
+    Dest* dest, uint64_t data);
+
 // Implementation details follow.
 
 namespace internal {
@@ -51,7 +66,9 @@ bool WriteZerosSlow(Writer* dest, Position length);
 
 }  // namespace internal
 
-inline bool WriteByte(Writer* dest, uint8_t data) {
+template <typename Dest>
+inline std::enable_if_t<std::is_base_of<Writer, Dest>::value, bool> WriteByte(
+    Dest* dest, uint8_t data) {
   if (ABSL_PREDICT_FALSE(!dest->Push())) return false;
   char* cursor = dest->cursor();
   *cursor++ = static_cast<char>(data);
@@ -114,7 +131,9 @@ inline char* WriteVarint64(char* dest, uint64_t data) {
   return dest;
 }
 
-inline bool WriteVarint32(Writer* dest, uint32_t data) {
+template <typename Dest>
+inline std::enable_if_t<std::is_base_of<Writer, Dest>::value, bool>
+WriteVarint32(Dest* dest, uint32_t data) {
   if (ABSL_PREDICT_FALSE(dest->available() < kMaxLengthVarint32)) {
     if (ABSL_PREDICT_FALSE(!dest->Push(LengthVarint32(data)))) return false;
   }
@@ -122,7 +141,9 @@ inline bool WriteVarint32(Writer* dest, uint32_t data) {
   return true;
 }
 
-inline bool WriteVarint64(Writer* dest, uint64_t data) {
+template <typename Dest>
+inline std::enable_if_t<std::is_base_of<Writer, Dest>::value, bool>
+WriteVarint64(Dest* dest, uint64_t data) {
   if (ABSL_PREDICT_FALSE(dest->available() < kMaxLengthVarint64)) {
     if (ABSL_PREDICT_FALSE(!dest->Push(LengthVarint64(data)))) return false;
   }
@@ -130,6 +151,18 @@ inline bool WriteVarint64(Writer* dest, uint64_t data) {
   return true;
 }
 
+inline bool WriteByte(Writer* dest, uint8_t data) {
+  return WriteByte<Writer>(dest, data);
+}
+
+inline bool WriteVarint32(Writer* dest, uint32_t data) {
+  return WriteVarint32<Writer>(dest, data);
+}
+
+inline bool WriteVarint64(Writer* dest, uint64_t data) {
+  return WriteVarint64<Writer>(dest, data);
+}
+
 inline bool WriteZeros(Writer* dest, Position length) {
   if (ABSL_PREDICT_TRUE(length <= dest->available())) {
     if (ABSL_PREDICT_TRUE(
@@ -0,0 +1,152 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "riegeli/bytes/zlib_index.h"
+
+#include <stdint.h>
+
+#include <algorithm>
+#include <iterator>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "absl/base/optimization.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/string_view.h"
+#include "riegeli/base/base.h"
+#include "riegeli/base/canonical_errors.h"
+#include "riegeli/base/status.h"
+#include "riegeli/bytes/reader.h"
+#include "riegeli/bytes/reader_utils.h"
+#include "riegeli/bytes/writer.h"
+#include "riegeli/bytes/writer_utils.h"
+
+namespace riegeli {
+
+namespace {
+
+// The maximum size of the deflate history.
+constexpr size_t kMaxWindowSize = size_t{1} << 15;
+
+// Identifies the serialized format of `ZlibIndex`.
+constexpr uint64_t kFormatVersion = 0;
+
+Status ReadFailed(Reader* src, absl::string_view what) {
+  if (ABSL_PREDICT_FALSE(!src->healthy())) return src->status();
+  return DataLossError(absl::StrCat("Reading ZlibIndex ", what, " failed"));
+}
+
+}  // namespace
+
+// Before C++17 if a constexpr static data member is ODR-used, its definition at
+// namespace scope is required. Since C++17 these definitions are deprecated:
+// http://en.cppreference.com/w/cpp/language/static
+#if __cplusplus < 201703
+constexpr Position ZlibIndex::kDefaultSpan;
+#endif
+
+const ZlibIndex::AccessPoint* ZlibIndex::Find(Position uncompressed_pos) const {
+  const auto iter = std::upper_bound(
+      access_points_.begin(), access_points_.end(), uncompressed_pos,
+      [](Position pos, const AccessPoint& access_point) {
+        return pos < access_point.uncompressed_pos;
+      });
+  if (iter == access_points_.begin()) return nullptr;
+  return &*std::prev(iter);
+}
+
+bool ZlibIndex::WriteTo(Writer* dest) const {
+  if (ABSL_PREDICT_FALSE(!WriteVarint64(dest, kFormatVersion) ||
+                         !WriteVarint64(dest, span_) ||
+                         !WriteByte(dest, complete_ ? 1 : 0) ||
+                         !WriteVarint64(dest, uncompressed_size_) ||
+                         !WriteVarint64(dest, access_points_.size()))) {
+    return false;
+  }
+  for (const AccessPoint& access_point : access_points_) {
+    if (ABSL_PREDICT_FALSE(
+            !WriteVarint64(dest, access_point.uncompressed_pos) ||
+            !WriteVarint64(dest, access_point.compressed_pos) ||
+            !WriteByte(dest, IntCast<uint8_t>(access_point.bits)) ||
+            !WriteVarint32(dest,
+                           IntCast<uint32_t>(access_point.window.size())) ||
+            !dest->Write(access_point.window))) {
+      return false;
+    }
+  }
+  return true;
+}
+
+Status ZlibIndex::ReadFrom(Reader* src) {
+  uint64_t format_version;
+  if (ABSL_PREDICT_FALSE(!ReadVarint64(src, &format_version))) {
+    return ReadFailed(src, "format version");
+  }
+  if (ABSL_PREDICT_FALSE(format_version != kFormatVersion)) {
+    return DataLossError(absl::StrCat(
+        "Unsupported ZlibIndex format version: ", format_version));
+  }
+  uint64_t span;
+  uint8_t complete;
+  uint64_t uncompressed_size;
+  uint64_t num_access_points;
+  if (ABSL_PREDICT_FALSE(!ReadVarint64(src, &span) ||
+                         !ReadByte(src, &complete) ||
+                         !ReadVarint64(src, &uncompressed_size) ||
+                         !ReadVarint64(src, &num_access_points))) {
+    return ReadFailed(src, "header");
+  }
+  if (ABSL_PREDICT_FALSE(span == 0 || complete > 1 ||
+                         (complete == 0 && uncompressed_size != 0))) {
+    return DataLossError("Invalid ZlibIndex header");
+  }
+  Reset(span);
+  while (access_points_.size() < num_access_points) {
+    AccessPoint access_point;
+    uint64_t uncompressed_pos, compressed_pos;
+    uint8_t bits;
+    uint32_t window_size;
+    if (ABSL_PREDICT_FALSE(!ReadVarint64(src, &uncompressed_pos) ||
+                           !ReadVarint64(src, &compressed_pos) ||
+                           !ReadByte(src, &bits) ||
+                           !ReadVarint32(src, &window_size))) {
+      return ReadFailed(
+          src, absl::StrCat("access point ", access_points_.size()));
+    }
+    const Position last_pos = access_points_.empty()
+                                  ? Position{0}
+                                  : access_points_.back().uncompressed_pos;
+    if (ABSL_PREDICT_FALSE(uncompressed_pos <= last_pos || bits > 7 ||
+                           (bits > 0 && compressed_pos == 0) ||
+                           window_size > kMaxWindowSize ||
+                           (complete != 0 &&
+                            uncompressed_pos > uncompressed_size))) {
+      return DataLossError(absl::StrCat("Invalid ZlibIndex access point ",
+                                        access_points_.size()));
+    }
+    if (ABSL_PREDICT_FALSE(!src->Read(&access_point.window, window_size))) {
+      return ReadFailed(
+          src, absl::StrCat("access point ", access_points_.size()));
+    }
+    access_point.uncompressed_pos = uncompressed_pos;
+    access_point.compressed_pos = compressed_pos;
+    access_point.bits = bits;
+    access_points_.push_back(std::move(access_point));
+  }
+  if (complete != 0) MarkComplete(uncompressed_size);
+  return OkStatus();
+}
+
+}  // namespace riegeli
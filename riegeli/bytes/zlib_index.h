@@ -0,0 +1,195 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef RIEGELI_BYTES_ZLIB_INDEX_H_
+#define RIEGELI_BYTES_ZLIB_INDEX_H_
+
+#include <stdint.h>
+
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "riegeli/base/base.h"
+#include "riegeli/base/status.h"
+#include "riegeli/bytes/reader.h"
+#include "riegeli/bytes/writer.h"
+
+namespace riegeli {
+
+// Access points into a zlib, gzip, or raw deflate stream, allowing `ZlibReader`
+// to seek without decompressing the stream from its beginning.
+//
+// An access point is a deflate block boundary, together with the last 32K of
+// data decompressed before it, which is the history needed to resume
+// decompression there.
+//
+// The index is filled by a `ZlibReader` given the index in
+// `ZlibReaderBase::Options::set_index()`, while it decompresses the stream for
+// the first time. It is complete when the end of the stream was reached. It can
+// be stored alongside the compressed stream with `WriteTo()` and restored with
+// `ReadFrom()`.
+//
+// `ZlibIndex` is not thread-safe while it is being filled. A complete index can
+// be shared by `ZlibReader`s across threads.
+class ZlibIndex {
+ public:
+  struct AccessPoint {
+    // Position in the decompressed data.
+    Position uncompressed_pos = 0;
+    // Position in the compressed stream of the first byte fully belonging to
+    // the deflate block.
+    Position compressed_pos = 0;
+    // The number of bits of the byte before `compressed_pos` belonging to the
+    // deflate block, between 0 and 7.
+    int bits = 0;
+    // Up to 32K of data decompressed before the access point.
+    std::string window;
+  };
+
+  // Creates an empty index which will have access points about every `span`
+  // bytes of decompressed data.
+  //
+  // A smaller span makes seeking faster, at the cost of 32K of memory for each
+  // access point.
+  static constexpr Position kDefaultSpan = Position{1} << 20;
+  explicit ZlibIndex(Position span = kDefaultSpan);
+
+  ZlibIndex(ZlibIndex&& that) noexcept;
+  ZlibIndex& operator=(ZlibIndex&& that) noexcept;
+
+  // Makes `*this` equivalent to a newly constructed `ZlibIndex`.
+  void Reset(Position span = kDefaultSpan);
+
+  // Returns the requested distance between access points.
+  Position span() const { return span_; }
+
+  // Returns access points, ordered by their positions.
+  const std::vector<AccessPoint>& access_points() const {
+    return access_points_;
+  }
+
+  // Returns `true` if the end of the stream was reached while filling the
+  // index, i.e. no more access points will be added.
+  bool complete() const { return complete_; }
+
+  // Returns the size of the decompressed data.
+  //
+  // Precondition: `complete()`
+  Position uncompressed_size() const;
+
+  // Returns the last access point at or before `uncompressed_pos`, or `nullptr`
+  // if there is none, i.e. decompression must start at the beginning of the
+  // stream.
+  const AccessPoint* Find(Position uncompressed_pos) const;
+
+  // Writes the index to `*dest`.
+  //
+  // Return values:
+  //  * `true`  - success
+  //  * `false` - failure (`!dest->healthy()`)
+  bool WriteTo(Writer* dest) const;
+
+  // Replaces the index with one read from `*src`, written by `WriteTo()`.
+  //
+  // Returns status:
+  //  * `status.ok()`  - success
+  //  * `!status.ok()` - failure (`*this` is unspecified)
+  Status ReadFrom(Reader* src);
+
+ private:
+  friend class ZlibReaderBase;
+
+  // Adds an access point if `uncompressed_pos` is at least `span()` after the
+  // last access point, or after the beginning if there are no access points.
+  //
+  // `window` is called to fill the history only if the access point is added.
+  template <typename WindowFunction>
+  void MaybeAdd(Position uncompressed_pos, Position compressed_pos, int bits,
+                WindowFunction window);
+
+  // Marks the index as complete.
+  void MarkComplete(Position uncompressed_size);
+
+  Position span_;
+  std::vector<AccessPoint> access_points_;
+  bool complete_ = false;
+  // Invariant: if `!complete_` then `uncompressed_size_ == 0`
+  Position uncompressed_size_ = 0;
+};
+
+// Implementation details follow.
+
+inline ZlibIndex::ZlibIndex(Position span) : span_(span) {
+  RIEGELI_ASSERT_GT(span, 0u)
+      << "Failed precondition of ZlibIndex::ZlibIndex(): zero span";
+}
+
+inline ZlibIndex::ZlibIndex(ZlibIndex&& that) noexcept
+    : span_(that.span_),
+      access_points_(std::move(that.access_points_)),
+      complete_(std::exchange(that.complete_, false)),
+      uncompressed_size_(std::exchange(that.uncompressed_size_, 0)) {}
+
+inline ZlibIndex& ZlibIndex::operator=(ZlibIndex&& that) noexcept {
+  span_ = that.span_;
+  access_points_ = std::move(that.access_points_);
+  complete_ = std::exchange(that.complete_, false);
+  uncompressed_size_ = std::exchange(that.uncompressed_size_, 0);
+  return *this;
+}
+
+inline void ZlibIndex::Reset(Position span) {
+  RIEGELI_ASSERT_GT(span, 0u)
+      << "Failed precondition of ZlibIndex::Reset(): zero span";
+  span_ = span;
+  access_points_.clear();
+  complete_ = false;
+  uncompressed_size_ = 0;
+}
+
+inline Position ZlibIndex::uncompressed_size() const {
+  RIEGELI_ASSERT(complete_)
+      << "Failed precondition of ZlibIndex::uncompressed_size(): "
+         "index incomplete";
+  return uncompressed_size_;
+}
+
+template <typename WindowFunction>
+inline void ZlibIndex::MaybeAdd(Position uncompressed_pos,
+                                Position compressed_pos, int bits,
+                                WindowFunction window) {
+  if (complete_) return;
+  const Position last_pos = access_points_.empty()
+                                ? Position{0}
+                                : access_points_.back().uncompressed_pos;
+  if (uncompressed_pos <= last_pos || uncompressed_pos - last_pos < span_) {
+    return;
+  }
+  AccessPoint access_point;
+  access_point.uncompressed_pos = uncompressed_pos;
+  access_point.compressed_pos = compressed_pos;
+  access_point.bits = bits;
+  window(&access_point.window);
+  access_points_.push_back(std::move(access_point));
+}
+
+inline void ZlibIndex::MarkComplete(Position uncompressed_size) {
+  complete_ = true;
+  uncompressed_size_ = uncompressed_size;
+}
+
+}  // namespace riegeli
+
+#endif  // RIEGELI_BYTES_ZLIB_INDEX_H_
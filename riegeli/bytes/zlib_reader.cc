@@ -15,10 +15,16 @@
 #include "riegeli/bytes/zlib_reader.h"
 
 #include <stddef.h>
+#include <stdint.h>
 
+#include <deque>
+#include <functional>
+#include <future>
 #include <limits>
 #include <memory>
 #include <string>
+#include <utility>
+#include <vector>
 
 #include "absl/base/macros.h"
 #include "absl/base/optimization.h"
@@ -26,10 +32,15 @@
 #include "absl/strings/string_view.h"
 #include "riegeli/base/base.h"
 #include "riegeli/base/canonical_errors.h"
+#include "riegeli/base/chain.h"
+#include "riegeli/base/parallelism.h"
 #include "riegeli/base/recycling_pool.h"
 #include "riegeli/base/status.h"
 #include "riegeli/bytes/buffered_reader.h"
 #include "riegeli/bytes/reader.h"
+#include "riegeli/bytes/reader_utils.h"
+#include "riegeli/bytes/writer.h"
+#include "riegeli/bytes/zlib_index.h"
 #include "zconf.h"
 #include "zlib.h"
 
@@ -45,13 +56,28 @@ constexpr int ZlibReaderBase::Options::kDefaultWindowLog;
 constexpr ZlibReaderBase::Header ZlibReaderBase::Options::kDefaultHeader;
 #endif
 
-void ZlibReaderBase::Initialize(Reader* src, int window_bits) {
+void ZlibReaderBase::Initialize(Reader* src, int window_bits,
+                                ZlibIndex* index) {
   RIEGELI_ASSERT(src != nullptr)
       << "Failed precondition of ZlibReader: null Reader pointer";
   if (ABSL_PREDICT_FALSE(!src->healthy()) && src->available() == 0) {
     Fail(*src);
     return;
   }
+  window_bits_ = window_bits;
+  initial_compressed_pos_ = src->pos();
+  index_ = index;
+  InitializeDecompressor(window_bits);
+}
+
+bool ZlibReaderBase::InitializeDecompressor(int window_bits) {
+  if (decompressor_ != nullptr) {
+    if (ABSL_PREDICT_FALSE(inflateReset2(decompressor_.get(), window_bits) !=
+                           Z_OK)) {
+      return FailOperation(StatusCode::kInternal, "inflateReset2()");
+    }
+    return true;
+  }
   decompressor_ = RecyclingPool<z_stream, ZStreamDeleter>::global().Get(
       [&] {
         std::unique_ptr<z_stream, ZStreamDeleter> ptr(new z_stream());
@@ -65,6 +91,7 @@ void ZlibReaderBase::Initialize(Reader* src, int window_bits) {
           FailOperation(StatusCode::kInternal, "inflateReset2()");
         }
       });
+  return healthy();
 }
 
 void ZlibReaderBase::Done() {
@@ -107,6 +134,10 @@ bool ZlibReaderBase::ReadInternal(char* dest, size_t min_length,
   if (ABSL_PREDICT_FALSE(decompressor_ == nullptr)) return false;
   Reader* const src = src_reader();
   truncated_ = false;
+  // While the index is being filled, stop at deflate block boundaries to
+  // record access points there.
+  const int flush =
+      index_ != nullptr && !index_->complete() ? Z_BLOCK : Z_NO_FLUSH;
   decompressor_->next_out = reinterpret_cast<Bytef*>(dest);
   for (;;) {
     decompressor_->avail_out = UnsignedMin(
@@ -117,13 +148,20 @@ bool ZlibReaderBase::ReadInternal(char* dest, size_t min_length,
         reinterpret_cast<const Bytef*>(src->cursor()));
     decompressor_->avail_in =
         UnsignedMin(src->available(), std::numeric_limits<uInt>::max());
-    const int result = inflate(decompressor_.get(), Z_NO_FLUSH);
+    const int result = inflate(decompressor_.get(), flush);
     src->set_cursor(reinterpret_cast<const char*>(decompressor_->next_in));
     const size_t length_read =
         PtrDistance(dest, reinterpret_cast<char*>(decompressor_->next_out));
+    if (flush == Z_BLOCK && result == Z_OK &&
+        (decompressor_->data_type & 128) != 0 &&
+        (decompressor_->data_type & 64) == 0) {
+      AddAccessPoint(limit_pos_ + length_read, src->pos());
+    }
     switch (result) {
       case Z_OK:
         if (length_read >= min_length) break;
+        // `inflate()` stopped at a deflate block boundary.
+        if (decompressor_->avail_in > 0) continue;
         ABSL_FALLTHROUGH_INTENDED;
       case Z_BUF_ERROR:
         RIEGELI_ASSERT_EQ(decompressor_->avail_in, 0u)
@@ -136,6 +174,9 @@ bool ZlibReaderBase::ReadInternal(char* dest, size_t min_length,
         }
         continue;
       case Z_STREAM_END:
+        if (index_ != nullptr && !index_->complete()) {
+          index_->MarkComplete(limit_pos_ + length_read);
+        }
         decompressor_.reset();
         break;
       default:
@@ -147,4 +188,184 @@ bool ZlibReaderBase::ReadInternal(char* dest, size_t min_length,
   }
 }
 
+inline void ZlibReaderBase::AddAccessPoint(Position uncompressed_pos,
+                                           Position compressed_pos) {
+  index_->MaybeAdd(
+      uncompressed_pos, compressed_pos, decompressor_->data_type & 7,
+      [&](std::string* window) {
+        window->resize(size_t{1} << Options::kMaxWindowLog);
+        uInt window_length = IntCast<uInt>(window->size());
+        if (ABSL_PREDICT_FALSE(
+                inflateGetDictionary(decompressor_.get(),
+                                     reinterpret_cast<Bytef*>(&(*window)[0]),
+                                     &window_length) != Z_OK)) {
+          window_length = 0;
+        }
+        window->resize(window_length);
+      });
+}
+
+bool ZlibReaderBase::SupportsRandomAccess() const {
+  return index_ != nullptr && src_reader() != nullptr &&
+         src_reader()->SupportsRandomAccess();
+}
+
+bool ZlibReaderBase::SeekSlow(Position new_pos) {
+  RIEGELI_ASSERT(new_pos < start_pos() || new_pos > limit_pos_)
+      << "Failed precondition of Reader::SeekSlow(): "
+         "position in the buffer, use Seek() instead";
+  if (index_ == nullptr || !src_reader()->SupportsRandomAccess()) {
+    return BufferedReader::SeekSlow(new_pos);
+  }
+  if (ABSL_PREDICT_FALSE(!healthy())) return false;
+  const ZlibIndex::AccessPoint* const access_point = index_->Find(new_pos);
+  const Position access_point_pos =
+      access_point == nullptr ? Position{0} : access_point->uncompressed_pos;
+  if (new_pos > limit_pos_ && access_point_pos <= limit_pos_) {
+    // Decompressing from the current position is not slower.
+    return BufferedReader::SeekSlow(new_pos);
+  }
+  ClearBuffer();
+  truncated_ = false;
+  limit_pos_ = access_point_pos;
+  if (ABSL_PREDICT_FALSE(!SeekToAccessPoint(access_point))) return false;
+  if (new_pos == limit_pos_) return true;
+  return BufferedReader::SeekSlow(new_pos);
+}
+
+bool ZlibReaderBase::SeekToAccessPoint(
+    const ZlibIndex::AccessPoint* access_point) {
+  Reader* const src = src_reader();
+  const Position compressed_pos =
+      access_point == nullptr
+          ? initial_compressed_pos_
+          : access_point->compressed_pos - (access_point->bits > 0 ? 1 : 0);
+  if (ABSL_PREDICT_FALSE(!src->Seek(compressed_pos))) {
+    if (ABSL_PREDICT_FALSE(!src->healthy())) return Fail(*src);
+    return Fail(DataLossError("Zlib-compressed stream shorter than its index"));
+  }
+  if (access_point == nullptr) return InitializeDecompressor(window_bits_);
+  // Resume decompression in the middle of the stream as raw deflate.
+  if (ABSL_PREDICT_FALSE(!InitializeDecompressor(-Options::kMaxWindowLog))) {
+    return false;
+  }
+  if (access_point->bits > 0) {
+    uint8_t byte;
+    if (ABSL_PREDICT_FALSE(!ReadByte(src, &byte))) {
+      if (ABSL_PREDICT_FALSE(!src->healthy())) return Fail(*src);
+      return Fail(
+          DataLossError("Zlib-compressed stream shorter than its index"));
+    }
+    if (ABSL_PREDICT_FALSE(inflatePrime(decompressor_.get(), access_point->bits,
+                                        byte >> (8 - access_point->bits)) !=
+                           Z_OK)) {
+      return FailOperation(StatusCode::kInternal, "inflatePrime()");
+    }
+  }
+  if (!access_point->window.empty() &&
+      ABSL_PREDICT_FALSE(
+          inflateSetDictionary(
+              decompressor_.get(),
+              reinterpret_cast<const Bytef*>(access_point->window.data()),
+              IntCast<uInt>(access_point->window.size())) != Z_OK)) {
+    return FailOperation(StatusCode::kInternal, "inflateSetDictionary()");
+  }
+  return true;
+}
+
+bool ZlibReaderBase::Size(Position* size) {
+  if (ABSL_PREDICT_FALSE(!healthy())) return false;
+  if (index_ == nullptr) return BufferedReader::Size(size);
+  if (!index_->complete()) {
+    // Decompress the rest of the stream to find its end, filling the index.
+    const Position pos_before = pos();
+    Seek(std::numeric_limits<Position>::max());
+    if (ABSL_PREDICT_FALSE(!healthy())) return false;
+    if (ABSL_PREDICT_FALSE(!index_->complete())) {
+      return Fail(DataLossError("Truncated zlib-compressed stream"));
+    }
+    if (ABSL_PREDICT_FALSE(!Seek(pos_before))) return false;
+  }
+  *size = index_->uncompressed_size();
+  return true;
+}
+
+Status ZlibDecompressInParallel(
+    const ZlibIndex& index, std::function<std::unique_ptr<Reader>()> open_src,
+    Writer* dest, int parallelism, ZlibReaderBase::Options options) {
+  RIEGELI_ASSERT(index.complete())
+      << "Failed precondition of ZlibDecompressInParallel(): "
+         "index incomplete";
+  RIEGELI_ASSERT_GT(parallelism, 0)
+      << "Failed precondition of ZlibDecompressInParallel(): "
+         "non-positive parallelism";
+  struct DecompressedRange {
+    Status status;
+    Chain data;
+  };
+  struct DecompressingRange {
+    Position begin;
+    Position end;
+    std::promise<DecompressedRange> decompressed_range;
+  };
+
+  // A complete index is not modified by `ZlibReader`.
+  options.set_index(const_cast<ZlibIndex*>(&index));
+  const std::vector<ZlibIndex::AccessPoint>& access_points =
+      index.access_points();
+  std::deque<std::future<DecompressedRange>> pending_ranges;
+  size_t next_range = 0;
+  for (;;) {
+    while (pending_ranges.size() < IntCast<size_t>(parallelism) &&
+           next_range <= access_points.size()) {
+      DecompressingRange* const decompressing_range = new DecompressingRange();
+      decompressing_range->begin =
+          next_range == 0 ? Position{0}
+                          : access_points[next_range - 1].uncompressed_pos;
+      decompressing_range->end =
+          next_range == access_points.size()
+              ? index.uncompressed_size()
+              : access_points[next_range].uncompressed_pos;
+      ++next_range;
+      pending_ranges.push_back(
+          decompressing_range->decompressed_range.get_future());
+      ThreadPool::global().Schedule([decompressing_range, &open_src,
+                                     &options] {
+        DecompressedRange decompressed_range;
+        ZlibReader<std::unique_ptr<Reader>> reader(open_src(), options);
+        if (ABSL_PREDICT_FALSE(
+                !reader.Seek(decompressing_range->begin) ||
+                !reader.Read(&decompressed_range.data,
+                             IntCast<size_t>(decompressing_range->end -
+                                             decompressing_range->begin)))) {
+          decompressed_range.status =
+              reader.healthy()
+                  ? DataLossError(
+                        "Zlib-compressed stream shorter than its index")
+                  : reader.status();
+        } else if (ABSL_PREDICT_FALSE(!reader.Close())) {
+          decompressed_range.status = reader.status();
+        }
+        decompressing_range->decompressed_range.set_value(
+            std::move(decompressed_range));
+        delete decompressing_range;
+      });
+    }
+    if (pending_ranges.empty()) return OkStatus();
+    DecompressedRange decompressed_range = pending_ranges.front().get();
+    pending_ranges.pop_front();
+    if (ABSL_PREDICT_TRUE(decompressed_range.status.ok()) &&
+        ABSL_PREDICT_FALSE(!dest->Write(std::move(decompressed_range.data)))) {
+      decompressed_range.status = dest->status();
+    }
+    if (ABSL_PREDICT_FALSE(!decompressed_range.status.ok())) {
+      // Tasks refer to `open_src` and `options`.
+      for (std::future<DecompressedRange>& pending_range : pending_ranges) {
+        pending_range.wait();
+      }
+      return decompressed_range.status;
+    }
+  }
+}
+
 }  // namespace riegeli
@@ -17,6 +17,8 @@
 
 #include <stddef.h>
 
+#include <functional>
+#include <memory>
 #include <tuple>
 #include <utility>
 
@@ -30,6 +32,8 @@
 #include "riegeli/base/status.h"
 #include "riegeli/bytes/buffered_reader.h"
 #include "riegeli/bytes/reader.h"
+#include "riegeli/bytes/writer.h"
+#include "riegeli/bytes/zlib_index.h"
 #include "zconf.h"
 #include "zlib.h"
 
@@ -117,6 +121,27 @@ class ZlibReaderBase : public BufferedReader {
       return std::move(set_buffer_size(buffer_size));
     }
 
+    // If not `nullptr`, access points of the stream are recorded in `*index`
+    // while decompressing the stream beyond the last access point, and are used
+    // by `Seek()` to resume decompression near the target position. Then
+    // `SupportsRandomAccess()` is `true` if the compressed `Reader` supports
+    // random access.
+    //
+    // The index must correspond to this compressed stream: it can be empty, or
+    // partially or completely filled by another `ZlibReader` of this stream, or
+    // restored with `ZlibIndex::ReadFrom()`.
+    //
+    // `index` must outlive the `ZlibReader`.
+    //
+    // Default: `nullptr`
+    Options& set_index(ZlibIndex* index) & {
+      index_ = index;
+      return *this;
+    }
+    Options&& set_index(ZlibIndex* index) && {
+      return std::move(set_index(index));
+    }
+
    private:
     friend class ZlibReaderBase;
     template <typename Src>
@@ -126,12 +151,16 @@ class ZlibReaderBase : public BufferedReader {
     Header header_ = kDefaultHeader;
     Position size_hint_ = 0;
     size_t buffer_size_ = kDefaultBufferSize;
+    ZlibIndex* index_ = nullptr;
   };
 
   // Returns the compressed `Reader`. Unchanged by `Close()`.
   virtual Reader* src_reader() = 0;
   virtual const Reader* src_reader() const = 0;
 
+  bool SupportsRandomAccess() const override;
+  bool Size(Position* size) override;
+
  protected:
   ZlibReaderBase() noexcept {}
 
@@ -143,11 +172,12 @@ class ZlibReaderBase : public BufferedReader {
   void Reset();
   void Reset(size_t buffer_size, Position size_hint);
   static int GetWindowBits(const Options& options);
-  void Initialize(Reader* src, int window_bits);
+  void Initialize(Reader* src, int window_bits, ZlibIndex* index);
 
   void Done() override;
   bool PullSlow(size_t min_length, size_t recommended_length) override;
   bool ReadInternal(char* dest, size_t min_length, size_t max_length) override;
+  bool SeekSlow(Position new_pos) override;
 
  private:
   struct ZStreamDeleter {
@@ -161,10 +191,33 @@ class ZlibReaderBase : public BufferedReader {
   ABSL_ATTRIBUTE_COLD bool FailOperation(StatusCode code,
                                          absl::string_view operation);
 
+  // Obtains `decompressor_` if needed, and prepares it for a new stream.
+  //
+  // Return values:
+  //  * `true`  - success (`healthy()`)
+  //  * `false` - failure (`!healthy()`)
+  bool InitializeDecompressor(int window_bits);
+
+  // Positions the compressed `Reader` and `decompressor_` at `*access_point`,
+  // or at the beginning of the stream if `access_point == nullptr`.
+  //
+  // Return values:
+  //  * `true`  - success (`healthy()`)
+  //  * `false` - failure (`!healthy()`)
+  bool SeekToAccessPoint(const ZlibIndex::AccessPoint* access_point);
+
+  // Records an access point at the current deflate block boundary in `*index_`
+  // if it is due there.
+  void AddAccessPoint(Position uncompressed_pos, Position compressed_pos);
+
   // If `true`, the source is truncated (without a clean end of the compressed
   // stream) at the current position. If the source does not grow, `Close()`
   // will fail.
   bool truncated_ = false;
+  int window_bits_ = 0;
+  // The position of the compressed `Reader` where the stream begins.
+  Position initial_compressed_pos_ = 0;
+  ZlibIndex* index_ = nullptr;
   RecyclingPool<z_stream, ZStreamDeleter>::Handle decompressor_;
 };
 
@@ -223,6 +276,25 @@ class ZlibReader : public ZlibReaderBase {
   Dependency<Reader*, Src> src_;
 };
 
+// Decompresses a zlib, gzip, or raw deflate stream using its complete `index`,
+// writing the decompressed data to `dest`.
+//
+// Ranges between consecutive access points are decompressed concurrently, at
+// most `parallelism` at a time, and written in order. The compressed stream is
+// read through a separate `Reader` for each range, opened by `open_src` and
+// supporting random access. `options` apply to these `ZlibReader`s, except
+// for `set_index()`.
+//
+// `dest` is not closed.
+//
+// Returns status:
+//  * `status.ok()`  - success
+//  * `!status.ok()` - failure
+Status ZlibDecompressInParallel(
+    const ZlibIndex& index, std::function<std::unique_ptr<Reader>()> open_src,
+    Writer* dest, int parallelism,
+    ZlibReaderBase::Options options = ZlibReaderBase::Options());
+
 // Implementation details follow.
 
 inline ZlibReaderBase::ZlibReaderBase(size_t buffer_size, Position size_hint)
@@ -231,12 +303,18 @@ inline ZlibReaderBase::ZlibReaderBase(size_t buffer_size, Position size_hint)
 inline ZlibReaderBase::ZlibReaderBase(ZlibReaderBase&& that) noexcept
     : BufferedReader(std::move(that)),
       truncated_(that.truncated_),
+      window_bits_(that.window_bits_),
+      initial_compressed_pos_(that.initial_compressed_pos_),
+      index_(std::exchange(that.index_, nullptr)),
       decompressor_(std::move(that.decompressor_)) {}
 
 inline ZlibReaderBase& ZlibReaderBase::operator=(
     ZlibReaderBase&& that) noexcept {
   BufferedReader::operator=(std::move(that));
   truncated_ = that.truncated_;
+  window_bits_ = that.window_bits_;
+  initial_compressed_pos_ = that.initial_compressed_pos_;
+  index_ = std::exchange(that.index_, nullptr);
   decompressor_ = std::move(that.decompressor_);
   return *this;
 }
@@ -244,12 +322,18 @@ inline ZlibReaderBase& ZlibReaderBase::operator=(
 inline void ZlibReaderBase::Reset() {
   BufferedReader::Reset();
   truncated_ = false;
+  window_bits_ = 0;
+  initial_compressed_pos_ = 0;
+  index_ = nullptr;
   decompressor_.reset();
 }
 
 inline void ZlibReaderBase::Reset(size_t buffer_size, Position size_hint) {
   BufferedReader::Reset(buffer_size, size_hint);
   truncated_ = false;
+  window_bits_ = 0;
+  initial_compressed_pos_ = 0;
+  index_ = nullptr;
   decompressor_.reset();
 }
 
@@ -262,14 +346,14 @@ inline int ZlibReaderBase::GetWindowBits(const Options& options) {
 template <typename Src>
 inline ZlibReader<Src>::ZlibReader(const Src& src, Options options)
     : ZlibReaderBase(options.buffer_size_, options.size_hint_), src_(src) {
-  Initialize(src_.get(), GetWindowBits(options));
+  Initialize(src_.get(), GetWindowBits(options), options.index_);
 }
 
 template <typename Src>
 inline ZlibReader<Src>::ZlibReader(Src&& src, Options options)
     : ZlibReaderBase(options.buffer_size_, options.size_hint_),
       src_(std::move(src)) {
-  Initialize(src_.get(), GetWindowBits(options));
+  Initialize(src_.get(), GetWindowBits(options), options.index_);
 }
 
 template <typename Src>
@@ -278,7 +362,7 @@ inline ZlibReader<Src>::ZlibReader(std::tuple<SrcArgs...> src_args,
                                    Options options)
     : ZlibReaderBase(options.buffer_size_, options.size_hint_),
       src_(std::move(src_args)) {
-  Initialize(src_.get(), GetWindowBits(options));
+  Initialize(src_.get(), GetWindowBits(options), options.index_);
 }
 
 template <typename Src>
@@ -302,14 +386,14 @@ template <typename Src>
 inline void ZlibReader<Src>::Reset(const Src& src, Options options) {
   ZlibReaderBase::Reset(options.buffer_size_, options.size_hint_);
   src_.Reset(src);
-  Initialize(src_.get(), GetWindowBits(options));
+  Initialize(src_.get(), GetWindowBits(options), options.index_);
 }
 
 template <typename Src>
 inline void ZlibReader<Src>::Reset(Src&& src, Options options) {
   ZlibReaderBase::Reset(options.buffer_size_, options.size_hint_);
   src_.Reset(std::move(src));
-  Initialize(src_.get(), GetWindowBits(options));
+  Initialize(src_.get(), GetWindowBits(options), options.index_);
 }
 
 template <typename Src>
@@ -318,7 +402,7 @@ inline void ZlibReader<Src>::Reset(std::tuple<SrcArgs...> src_args,
                                    Options options) {
   ZlibReaderBase::Reset(options.buffer_size_, options.size_hint_);
   src_.Reset(std::move(src_args));
-  Initialize(src_.get(), GetWindowBits(options));
+  Initialize(src_.get(), GetWindowBits(options), options.index_);
 }
 
 template <typename Src>
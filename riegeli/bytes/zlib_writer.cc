@@ -15,16 +15,22 @@
 #include "riegeli/bytes/zlib_writer.h"
 
 #include <stddef.h>
+#include <stdint.h>
 
+#include <cstring>
+#include <future>
 #include <limits>
 #include <memory>
 #include <string>
+#include <utility>
 
 #include "absl/base/optimization.h"
 #include "absl/strings/str_cat.h"
 #include "absl/strings/string_view.h"
 #include "riegeli/base/base.h"
 #include "riegeli/base/canonical_errors.h"
+#include "riegeli/base/endian.h"
+#include "riegeli/base/parallelism.h"
 #include "riegeli/base/recycling_pool.h"
 #include "riegeli/base/status.h"
 #include "riegeli/bytes/buffered_writer.h"
@@ -47,14 +53,63 @@ constexpr int ZlibWriterBase::Options::kDefaultWindowLog;
 constexpr ZlibWriterBase::Header ZlibWriterBase::Options::kDefaultHeader;
 #endif
 
-void ZlibWriterBase::Initialize(Writer* dest, int compression_level,
-                                int window_bits) {
+void ZlibWriterBase::Initialize(Writer* dest, const Options& options) {
   RIEGELI_ASSERT(dest != nullptr)
       << "Failed precondition of ZlibWriter: null Writer pointer";
   if (ABSL_PREDICT_FALSE(!dest->healthy())) {
     Fail(*dest);
     return;
   }
+  compression_level_ = options.compression_level_;
+  window_log_ = options.window_log_;
+  header_ = options.header_;
+  if (options.parallelism_ > 0) {
+    parallelism_ = options.parallelism_;
+    block_size_ = UnsignedMin(options.buffer_size_,
+                              std::numeric_limits<uInt>::max());
+    // Write the header which `deflate()` would write, because blocks are
+    // compressed as raw deflate.
+    char header[10];
+    size_t header_length = 0;
+    switch (header_) {
+      case Header::kZlib: {
+        // https://tools.ietf.org/html/rfc1950#section-2.2
+        const uint16_t level_flags = compression_level_ < 2    ? 0
+                                     : compression_level_ < 6  ? 1
+                                     : compression_level_ == 6 ? 2
+                                                               : 3;
+        uint16_t zlib_header = IntCast<uint16_t>(
+            ((Z_DEFLATED + ((window_log_ - 8) << 4)) << 8) |
+            (level_flags << 6));
+        zlib_header += 31 - zlib_header % 31;
+        const uint16_t word = WriteBigEndian16(zlib_header);
+        std::memcpy(header, &word, sizeof(word));
+        header_length = sizeof(word);
+        checksum_ = IntCast<uint32_t>(adler32(0, nullptr, 0));
+      } break;
+      case Header::kGzip: {
+        // https://tools.ietf.org/html/rfc1952#section-2.3
+        const char gzip_header[10] = {
+            '\x1f', '\x8b', Z_DEFLATED, 0, 0, 0, 0, 0,
+            static_cast<char>(compression_level_ == 9  ? 2
+                              : compression_level_ < 2 ? 4
+                                                       : 0),
+            3 /* Unix */};
+        std::memcpy(header, gzip_header, sizeof(gzip_header));
+        header_length = sizeof(gzip_header);
+        checksum_ = IntCast<uint32_t>(crc32(0, nullptr, 0));
+      } break;
+      case Header::kRaw:
+        break;
+    }
+    if (ABSL_PREDICT_FALSE(
+            !dest->Write(absl::string_view(header, header_length)))) {
+      Fail(*dest);
+    }
+    return;
+  }
+  const int compression_level = options.compression_level_;
+  const int window_bits = GetWindowBits(options);
   compressor_ =
       RecyclingPool<z_stream, ZStreamDeleter, ZStreamKey>::global().Get(
           ZStreamKey{compression_level, window_bits},
@@ -79,9 +134,44 @@ void ZlibWriterBase::Done() {
     Writer* const dest = dest_writer();
     const size_t buffered_length = written_to_buffer();
     cursor_ = start_;
-    WriteInternal(absl::string_view(start_, buffered_length), dest, Z_FINISH);
+    if (parallelism_ > 0) {
+      if (ABSL_PREDICT_TRUE(
+              WriteInParallel(absl::string_view(start_, buffered_length),
+                              dest) &&
+              CompressBlockInBackground(dest, true) &&
+              WritePendingBlocks(dest, 0))) {
+        char trailer[8];
+        size_t trailer_length = 0;
+        switch (header_) {
+          case Header::kZlib: {
+            const uint32_t word = WriteBigEndian32(checksum_);
+            std::memcpy(trailer, &word, sizeof(word));
+            trailer_length = sizeof(word);
+          } break;
+          case Header::kGzip: {
+            const uint32_t words[2] = {
+                WriteLittleEndian32(checksum_),
+                WriteLittleEndian32(static_cast<uint32_t>(start_pos_))};
+            std::memcpy(trailer, words, sizeof(words));
+            trailer_length = sizeof(words);
+          } break;
+          case Header::kRaw:
+            break;
+        }
+        if (ABSL_PREDICT_FALSE(
+                !dest->Write(absl::string_view(trailer, trailer_length)))) {
+          Fail(*dest);
+        }
+      }
+    } else {
+      WriteInternal(absl::string_view(start_, buffered_length), dest,
+                    Z_FINISH);
+    }
   }
   compressor_.reset();
+  block_ = std::string();
+  dictionary_ = std::string();
+  pending_blocks_.clear();
   BufferedWriter::Done();
 }
 
@@ -103,6 +193,7 @@ bool ZlibWriterBase::WriteInternal(absl::string_view src) {
       << "Failed precondition of BufferedWriter::WriteInternal(): "
          "buffer not empty";
   Writer* const dest = dest_writer();
+  if (parallelism_ > 0) return WriteInParallel(src, dest);
   return WriteInternal(src, dest, Z_NO_FLUSH);
 }
 
@@ -162,11 +253,196 @@ inline bool ZlibWriterBase::WriteInternal(absl::string_view src, Writer* dest,
   }
 }
 
+inline bool ZlibWriterBase::WriteInParallel(absl::string_view src,
+                                            Writer* dest) {
+  if (ABSL_PREDICT_FALSE(src.size() >
+                         std::numeric_limits<Position>::max() - limit_pos())) {
+    return FailOverflow();
+  }
+  start_pos_ += src.size();
+  while (!src.empty()) {
+    const size_t length = UnsignedMin(src.size(), block_size_ - block_.size());
+    block_.append(src.data(), length);
+    src.remove_prefix(length);
+    if (block_.size() == block_size_ &&
+        ABSL_PREDICT_FALSE(!CompressBlockInBackground(dest, false))) {
+      return false;
+    }
+  }
+  return true;
+}
+
+inline bool ZlibWriterBase::CompressBlockInBackground(Writer* dest,
+                                                      bool last) {
+  struct CompressingBlock {
+    std::string dictionary;
+    std::string data;
+    std::promise<CompressedBlock> compressed_block;
+  };
+  if (ABSL_PREDICT_FALSE(
+          !WritePendingBlocks(dest, IntCast<size_t>(parallelism_) - 1))) {
+    return false;
+  }
+  CompressingBlock* const compressing_block = new CompressingBlock();
+  compressing_block->dictionary = dictionary_;
+  compressing_block->data = std::move(block_);
+  block_.clear();
+  const std::string& data = compressing_block->data;
+  const size_t window_size = size_t{1} << window_log_;
+  if (data.size() >= window_size) {
+    dictionary_.assign(data, data.size() - window_size, window_size);
+  } else {
+    dictionary_.append(data);
+    if (dictionary_.size() > window_size) {
+      dictionary_.erase(0, dictionary_.size() - window_size);
+    }
+  }
+  pending_blocks_.push_back(compressing_block->compressed_block.get_future());
+  const int compression_level = compression_level_;
+  const int window_log = window_log_;
+  const Header header = header_;
+  ThreadPool::global().Schedule([compressing_block, compression_level,
+                                 window_log, header, last] {
+    compressing_block->compressed_block.set_value(
+        CompressBlock(compression_level, window_log, header,
+                      compressing_block->dictionary, compressing_block->data,
+                      last));
+    delete compressing_block;
+  });
+  return true;
+}
+
+ZlibWriterBase::CompressedBlock ZlibWriterBase::CompressBlock(
+    int compression_level, int window_log, Header header,
+    const std::string& dictionary, const std::string& data, bool last) {
+  CompressedBlock compressed_block;
+  compressed_block.uncompressed_length = data.size();
+  const Bytef* const data_ptr = reinterpret_cast<const Bytef*>(data.data());
+  switch (header) {
+    case Header::kZlib:
+      compressed_block.checksum = IntCast<uint32_t>(adler32(
+          adler32(0, nullptr, 0), data_ptr, IntCast<uInt>(data.size())));
+      break;
+    case Header::kGzip:
+      compressed_block.checksum = IntCast<uint32_t>(
+          crc32(crc32(0, nullptr, 0), data_ptr, IntCast<uInt>(data.size())));
+      break;
+    case Header::kRaw:
+      break;
+  }
+  const auto fail = [&](absl::string_view operation, const z_stream* ptr) {
+    std::string message = absl::StrCat(operation, " failed");
+    if (ptr->msg != nullptr) absl::StrAppend(&message, ": ", ptr->msg);
+    compressed_block.status = InternalError(message);
+    return std::move(compressed_block);
+  };
+  const int window_bits = -window_log;
+  const char* failed_operation = nullptr;
+  RecyclingPool<z_stream, ZStreamDeleter, ZStreamKey>::Handle compressor =
+      RecyclingPool<z_stream, ZStreamDeleter, ZStreamKey>::global().Get(
+          ZStreamKey{compression_level, window_bits},
+          [&] {
+            std::unique_ptr<z_stream, ZStreamDeleter> ptr(new z_stream());
+            if (ABSL_PREDICT_FALSE(deflateInit2(ptr.get(), compression_level,
+                                                Z_DEFLATED, window_bits, 8,
+                                                Z_DEFAULT_STRATEGY) != Z_OK)) {
+              failed_operation = "deflateInit2()";
+            }
+            return ptr;
+          },
+          [&](z_stream* ptr) {
+            if (ABSL_PREDICT_FALSE(deflateReset(ptr) != Z_OK)) {
+              failed_operation = "deflateReset()";
+            }
+          });
+  if (ABSL_PREDICT_FALSE(failed_operation != nullptr)) {
+    return fail(failed_operation, compressor.get());
+  }
+  if (!dictionary.empty() &&
+      ABSL_PREDICT_FALSE(
+          deflateSetDictionary(
+              compressor.get(),
+              reinterpret_cast<const Bytef*>(dictionary.data()),
+              IntCast<uInt>(dictionary.size())) != Z_OK)) {
+    return fail("deflateSetDictionary()", compressor.get());
+  }
+  compressor->next_in = const_cast<z_const Bytef*>(data_ptr);
+  compressor->avail_in = IntCast<uInt>(data.size());
+  std::string& compressed = compressed_block.compressed;
+  // Leave space for the empty stored block ending a synchronization point.
+  compressed.resize(deflateBound(compressor.get(), data.size()) + 16);
+  size_t length = 0;
+  for (;;) {
+    compressor->next_out = reinterpret_cast<Bytef*>(&compressed[length]);
+    compressor->avail_out = UnsignedMin(compressed.size() - length,
+                                        std::numeric_limits<uInt>::max());
+    const int result =
+        deflate(compressor.get(), last ? Z_FINISH : Z_SYNC_FLUSH);
+    length = PtrDistance(compressed.data(),
+                         reinterpret_cast<const char*>(compressor->next_out));
+    if (result == Z_STREAM_END) break;
+    if (!last && (result == Z_BUF_ERROR ||
+                  (result == Z_OK && compressor->avail_out > 0))) {
+      // The data were compressed up to a byte boundary.
+      break;
+    }
+    if (ABSL_PREDICT_FALSE(result != Z_OK)) {
+      return fail("deflate()", compressor.get());
+    }
+    compressed.resize(compressed.size() * 2);
+  }
+  compressed.resize(length);
+  return compressed_block;
+}
+
+inline bool ZlibWriterBase::WritePendingBlocks(Writer* dest,
+                                               size_t max_pending_blocks) {
+  while (pending_blocks_.size() > max_pending_blocks) {
+    CompressedBlock compressed_block = pending_blocks_.front().get();
+    pending_blocks_.pop_front();
+    if (ABSL_PREDICT_FALSE(!compressed_block.status.ok())) {
+      pending_blocks_.clear();
+      return Fail(std::move(compressed_block.status));
+    }
+    switch (header_) {
+      case Header::kZlib:
+        checksum_ = IntCast<uint32_t>(adler32_combine(
+            checksum_, compressed_block.checksum,
+            IntCast<z_off_t>(compressed_block.uncompressed_length)));
+        break;
+      case Header::kGzip:
+        checksum_ = IntCast<uint32_t>(crc32_combine(
+            checksum_, compressed_block.checksum,
+            IntCast<z_off_t>(compressed_block.uncompressed_length)));
+        break;
+      case Header::kRaw:
+        break;
+    }
+    if (ABSL_PREDICT_FALSE(
+            !dest->Write(std::move(compressed_block.compressed)))) {
+      pending_blocks_.clear();
+      return Fail(*dest);
+    }
+  }
+  return true;
+}
+
 bool ZlibWriterBase::Flush(FlushType flush_type) {
   if (ABSL_PREDICT_FALSE(!healthy())) return false;
   Writer* const dest = dest_writer();
   const size_t buffered_length = written_to_buffer();
   cursor_ = start_;
+  if (parallelism_ > 0) {
+    if (ABSL_PREDICT_FALSE(
+            !WriteInParallel(absl::string_view(start_, buffered_length),
+                             dest) ||
+            (!block_.empty() && !CompressBlockInBackground(dest, false)) ||
+            !WritePendingBlocks(dest, 0))) {
+      return false;
+    }
+    if (ABSL_PREDICT_FALSE(!dest->Flush(flush_type))) return Fail(*dest);
+    return true;
+  }
   if (ABSL_PREDICT_FALSE(!WriteInternal(
           absl::string_view(start_, buffered_length), dest, Z_PARTIAL_FLUSH))) {
     return false;
@@ -16,7 +16,11 @@
 #define RIEGELI_BYTES_ZLIB_WRITER_H_
 
 #include <stddef.h>
+#include <stdint.h>
 
+#include <deque>
+#include <future>
+#include <string>
 #include <tuple>
 #include <utility>
 
@@ -27,6 +31,7 @@
 #include "riegeli/base/dependency.h"
 #include "riegeli/base/recycling_pool.h"
 #include "riegeli/base/resetter.h"
+#include "riegeli/base/status.h"
 #include "riegeli/bytes/buffered_writer.h"
 #include "riegeli/bytes/writer.h"
 #include "zconf.h"
@@ -122,6 +127,9 @@ class ZlibWriterBase : public BufferedWriter {
 
     // Tunes how much data is buffered before calling the compression engine.
     //
+    // If `set_parallelism()` is positive, this is also the size of blocks
+    // compressed in parallel.
+    //
     // Default: 64K
     Options& set_buffer_size(size_t buffer_size) & {
       RIEGELI_ASSERT_GT(buffer_size, 0u)
@@ -135,6 +143,30 @@ class ZlibWriterBase : public BufferedWriter {
       return std::move(set_buffer_size(buffer_size));
     }
 
+    // Sets the maximum number of blocks being compressed in parallel in
+    // background, like pigz does.
+    //
+    // If `parallelism > 0`, data are split into blocks of `set_buffer_size()`
+    // bytes, each compressed on `ThreadPool::global()` as deflate blocks ending
+    // at a byte boundary, with the last 32K of the preceding data as the
+    // dictionary. Compressed blocks are written to the compressed `Writer` in
+    // order when `parallelism` blocks are pending, and by `Flush()` and
+    // `Close()`. The result is a single standard zlib, gzip, or raw deflate
+    // stream, slightly larger than if compressed sequentially.
+    //
+    // Default: 0
+    Options& set_parallelism(int parallelism) & {
+      RIEGELI_ASSERT_GE(parallelism, 0)
+          << "Failed precondition of "
+             "ZlibWriterBase::Options::set_parallelism(): "
+             "negative parallelism";
+      parallelism_ = parallelism;
+      return *this;
+    }
+    Options&& set_parallelism(int parallelism) && {
+      return std::move(set_parallelism(parallelism));
+    }
+
    private:
     friend class ZlibWriterBase;
     template <typename Dest>
@@ -145,6 +177,7 @@ class ZlibWriterBase : public BufferedWriter {
     Header header_ = kDefaultHeader;
     Position size_hint_ = 0;
     size_t buffer_size_ = kDefaultBufferSize;
+    int parallelism_ = 0;
   };
 
   // Returns the compressed `Writer`. Unchanged by `Close()`.
@@ -164,7 +197,7 @@ class ZlibWriterBase : public BufferedWriter {
   void Reset();
   void Reset(size_t buffer_size, Position size_hint);
   static int GetWindowBits(const Options& options);
-  void Initialize(Writer* dest, int compression_level, int window_bits);
+  void Initialize(Writer* dest, const Options& options);
 
   void Done() override;
   bool WriteInternal(absl::string_view src) override;
@@ -197,10 +230,63 @@ class ZlibWriterBase : public BufferedWriter {
     int window_bits;
   };
 
+  struct CompressedBlock {
+    Status status;
+    std::string compressed;
+    // Checksum of the uncompressed block, if the header requires one.
+    uint32_t checksum = 0;
+    size_t uncompressed_length = 0;
+  };
+
   ABSL_ATTRIBUTE_COLD bool FailOperation(absl::string_view operation);
   bool WriteInternal(absl::string_view src, Writer* dest, int flush);
 
+  // Appends `src` to blocks to be compressed in parallel, and hands over full
+  // blocks to background tasks.
+  //
+  // Return values:
+  //  * `true`  - success (`healthy()`)
+  //  * `false` - failure (`!healthy()`)
+  bool WriteInParallel(absl::string_view src, Writer* dest);
+
+  // Hands over `block_` to a background task, which compresses it with
+  // `dictionary_`, ending the stream if `last`.
+  //
+  // Return values:
+  //  * `true`  - success (`healthy()`)
+  //  * `false` - failure (`!healthy()`)
+  bool CompressBlockInBackground(Writer* dest, bool last);
+
+  // Waits for compressed blocks and writes them to `*dest`, until at most
+  // `max_pending_blocks` blocks are pending.
+  //
+  // Return values:
+  //  * `true`  - success (`healthy()`)
+  //  * `false` - failure (`!healthy()`)
+  bool WritePendingBlocks(Writer* dest, size_t max_pending_blocks);
+
+  // Compresses `data` as raw deflate with `dictionary` as the history, ending
+  // the stream if `last`, or ending at a byte boundary otherwise.
+  static CompressedBlock CompressBlock(int compression_level, int window_log,
+                                       Header header,
+                                       const std::string& dictionary,
+                                       const std::string& data, bool last);
+
   RecyclingPool<z_stream, ZStreamDeleter, ZStreamKey>::Handle compressor_;
+  int compression_level_ = 0;
+  int window_log_ = 0;
+  Header header_ = Header::kZlib;
+  // If positive, blocks are compressed in parallel, as `pending_blocks_`.
+  int parallelism_ = 0;
+  size_t block_size_ = 0;
+  // Data not yet handed over to a background task.
+  std::string block_;
+  // The last 32K of data handed over to background tasks.
+  std::string dictionary_;
+  // Checksum of uncompressed data of blocks written so far.
+  uint32_t checksum_ = 0;
+  // Blocks being compressed in background, if `parallelism_ > 0`.
+  std::deque<std::future<CompressedBlock>> pending_blocks_;
 };
 
 // A `Writer` which compresses data with Zlib before passing it to another
@@ -264,23 +350,49 @@ inline ZlibWriterBase::ZlibWriterBase(size_t buffer_size, Position size_hint)
 
 inline ZlibWriterBase::ZlibWriterBase(ZlibWriterBase&& that) noexcept
     : BufferedWriter(std::move(that)),
-      compressor_(std::move(that.compressor_)) {}
+      compressor_(std::move(that.compressor_)),
+      compression_level_(that.compression_level_),
+      window_log_(that.window_log_),
+      header_(that.header_),
+      parallelism_(that.parallelism_),
+      block_size_(that.block_size_),
+      block_(std::move(that.block_)),
+      dictionary_(std::move(that.dictionary_)),
+      checksum_(that.checksum_),
+      pending_blocks_(std::move(that.pending_blocks_)) {}
 
 inline ZlibWriterBase& ZlibWriterBase::operator=(
     ZlibWriterBase&& that) noexcept {
   BufferedWriter::operator=(std::move(that));
   compressor_ = std::move(that.compressor_);
+  compression_level_ = that.compression_level_;
+  window_log_ = that.window_log_;
+  header_ = that.header_;
+  parallelism_ = that.parallelism_;
+  block_size_ = that.block_size_;
+  block_ = std::move(that.block_);
+  dictionary_ = std::move(that.dictionary_);
+  checksum_ = that.checksum_;
+  pending_blocks_ = std::move(that.pending_blocks_);
   return *this;
 }
 
 inline void ZlibWriterBase::Reset() {
   BufferedWriter::Reset();
   compressor_.reset();
+  parallelism_ = 0;
+  block_.clear();
+  dictionary_.clear();
+  pending_blocks_.clear();
 }
 
 inline void ZlibWriterBase::Reset(size_t buffer_size, Position size_hint) {
   BufferedWriter::Reset(buffer_size, size_hint);
   compressor_.reset();
+  parallelism_ = 0;
+  block_.clear();
+  dictionary_.clear();
+  pending_blocks_.clear();
 }
 
 inline int ZlibWriterBase::GetWindowBits(const Options& options) {
@@ -292,14 +404,14 @@ inline int ZlibWriterBase::GetWindowBits(const Options& options) {
 template <typename Dest>
 inline ZlibWriter<Dest>::ZlibWriter(const Dest& dest, Options options)
     : ZlibWriterBase(options.buffer_size_, options.size_hint_), dest_(dest) {
-  Initialize(dest_.get(), options.compression_level_, GetWindowBits(options));
+  Initialize(dest_.get(), options);
 }
 
 template <typename Dest>
 inline ZlibWriter<Dest>::ZlibWriter(Dest&& dest, Options options)
     : ZlibWriterBase(options.buffer_size_, options.size_hint_),
       dest_(std::move(dest)) {
-  Initialize(dest_.get(), options.compression_level_, GetWindowBits(options));
+  Initialize(dest_.get(), options);
 }
 
 template <typename Dest>
@@ -308,7 +420,7 @@ inline ZlibWriter<Dest>::ZlibWriter(std::tuple<DestArgs...> dest_args,
                                     Options options)
     : ZlibWriterBase(options.buffer_size_, options.size_hint_),
       dest_(std::move(dest_args)) {
-  Initialize(dest_.get(), options.compression_level_, GetWindowBits(options));
+  Initialize(dest_.get(), options);
 }
 
 template <typename Dest>
@@ -333,14 +445,14 @@ template <typename Dest>
 inline void ZlibWriter<Dest>::Reset(const Dest& dest, Options options) {
   ZlibWriterBase::Reset(options.buffer_size_, options.size_hint_);
   dest_.Reset(dest);
-  Initialize(dest_.get(), options.compression_level_, GetWindowBits(options));
+  Initialize(dest_.get(), options);
 }
 
 template <typename Dest>
 inline void ZlibWriter<Dest>::Reset(Dest&& dest, Options options) {
   ZlibWriterBase::Reset(options.buffer_size_, options.size_hint_);
   dest_.Reset(std::move(dest));
-  Initialize(dest_.get(), options.compression_level_, GetWindowBits(options));
+  Initialize(dest_.get(), options);
 }
 
 template <typename Dest>
@@ -349,7 +461,7 @@ inline void ZlibWriter<Dest>::Reset(std::tuple<DestArgs...> dest_args,
                                     Options options) {
   ZlibWriterBase::Reset(options.buffer_size_, options.size_hint_);
   dest_.Reset(std::move(dest_args));
-  Initialize(dest_.get(), options.compression_level_, GetWindowBits(options));
+  Initialize(dest_.get(), options);
 }
 
 template <typename Dest>
@@ -0,0 +1,95 @@
+// Copyright 2017 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "riegeli/bytes/zstd_dictionary.h"
+
+#include <stddef.h>
+
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "absl/base/optimization.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/string_view.h"
+#include "absl/synchronization/mutex.h"
+#include "riegeli/base/base.h"
+#include "riegeli/base/canonical_errors.h"
+#include "riegeli/base/status.h"
+#include "zdict.h"
+#include "zstd.h"
+
+namespace riegeli {
+
+std::shared_ptr<const ZSTD_CDict> ZstdDictionary::PrepareCompressionDictionary(
+    int compression_level) const {
+  RIEGELI_ASSERT(!empty())
+      << "Failed precondition of "
+         "ZstdDictionary::PrepareCompressionDictionary(): "
+         "empty dictionary";
+  absl::MutexLock lock(&repr_->mutex);
+  if (repr_->compression_dictionary == nullptr ||
+      repr_->compression_level != compression_level) {
+    std::unique_ptr<ZSTD_CDict, ZSTD_CDictDeleter> compression_dictionary(
+        ZSTD_createCDict(repr_->data.data(), repr_->data.size(),
+                         compression_level));
+    if (ABSL_PREDICT_FALSE(compression_dictionary == nullptr)) return nullptr;
+    repr_->compression_level = compression_level;
+    repr_->compression_dictionary = std::move(compression_dictionary);
+  }
+  return repr_->compression_dictionary;
+}
+
+std::shared_ptr<const ZSTD_DDict>
+ZstdDictionary::PrepareDecompressionDictionary() const {
+  RIEGELI_ASSERT(!empty())
+      << "Failed precondition of "
+         "ZstdDictionary::PrepareDecompressionDictionary(): "
+         "empty dictionary";
+  absl::MutexLock lock(&repr_->mutex);
+  if (repr_->decompression_dictionary == nullptr) {
+    std::unique_ptr<ZSTD_DDict, ZSTD_DDictDeleter> decompression_dictionary(
+        ZSTD_createDDict(repr_->data.data(), repr_->data.size()));
+    if (ABSL_PREDICT_FALSE(decompression_dictionary == nullptr)) {
+      return nullptr;
+    }
+    repr_->decompression_dictionary = std::move(decompression_dictionary);
+  }
+  return repr_->decompression_dictionary;
+}
+
+Status TrainZstdDictionary(const std::vector<absl::string_view>& samples,
+                           size_t max_size, ZstdDictionary* dictionary) {
+  std::string samples_buffer;
+  std::vector<size_t> sample_sizes;
+  sample_sizes.reserve(samples.size());
+  for (const absl::string_view sample : samples) {
+    samples_buffer.append(sample.data(), sample.size());
+    sample_sizes.push_back(sample.size());
+  }
+  std::string data(max_size, '\0');
+  const size_t result = ZDICT_trainFromBuffer(
+      &data[0], data.size(), samples_buffer.data(), sample_sizes.data(),
+      IntCast<unsigned>(sample_sizes.size()));
+  if (ABSL_PREDICT_FALSE(ZDICT_isError(result))) {
+    return InvalidArgumentError(absl::StrCat("ZDICT_trainFromBuffer() failed: ",
+                                             ZDICT_getErrorName(result)));
+  }
+  data.resize(result);
+  *dictionary = ZstdDictionary(std::move(data));
+  return OkStatus();
+}
+
+}  // namespace riegeli
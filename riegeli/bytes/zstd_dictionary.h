@@ -0,0 +1,131 @@
+// Copyright 2017 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef RIEGELI_BYTES_ZSTD_DICTIONARY_H_
+#define RIEGELI_BYTES_ZSTD_DICTIONARY_H_
+
+#include <stddef.h>
+
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "absl/base/thread_annotations.h"
+#include "absl/strings/string_view.h"
+#include "absl/synchronization/mutex.h"
+#include "riegeli/base/status.h"
+#include "zstd.h"
+
+namespace riegeli {
+
+// Data which improve compression density of small inputs similar to the data,
+// shared by `ZstdWriter` and `ZstdReader`. The same dictionary must be used for
+// compression and decompression.
+//
+// A dictionary is either in the zstd dictionary format (e.g. produced by
+// `TrainZstdDictionary()`), or raw content to be used as a prefix of each
+// compressed input.
+//
+// Copying a `ZstdDictionary` is cheap: copies share the data and the prepared
+// zstd dictionary objects, which are created lazily and reused afterwards.
+// A `ZstdDictionary` can be used concurrently by multiple threads.
+class ZstdDictionary {
+ public:
+  // Creates an empty `ZstdDictionary`, which means no dictionary.
+  ZstdDictionary() noexcept {}
+
+  // Creates a `ZstdDictionary` with the given contents. Empty `data` means no
+  // dictionary.
+  explicit ZstdDictionary(std::string data);
+
+  ZstdDictionary(const ZstdDictionary&) = default;
+  ZstdDictionary& operator=(const ZstdDictionary&) = default;
+
+  ZstdDictionary(ZstdDictionary&&) noexcept = default;
+  ZstdDictionary& operator=(ZstdDictionary&&) noexcept = default;
+
+  // Returns `true` if no dictionary is used.
+  bool empty() const { return repr_ == nullptr; }
+
+  // Returns the contents of the dictionary.
+  absl::string_view data() const;
+
+ private:
+  friend class ZstdWriterBase;
+  friend class ZstdReaderBase;
+
+  struct ZSTD_CDictDeleter {
+    void operator()(ZSTD_CDict* ptr) const { ZSTD_freeCDict(ptr); }
+  };
+  struct ZSTD_DDictDeleter {
+    void operator()(ZSTD_DDict* ptr) const { ZSTD_freeDDict(ptr); }
+  };
+
+  struct Repr {
+    explicit Repr(std::string data) : data(std::move(data)) {}
+
+    const std::string data;
+    absl::Mutex mutex;
+    // The compression level of `compression_dictionary`.
+    int compression_level ABSL_GUARDED_BY(mutex) = 0;
+    std::shared_ptr<const ZSTD_CDict> compression_dictionary
+        ABSL_GUARDED_BY(mutex);
+    std::shared_ptr<const ZSTD_DDict> decompression_dictionary
+        ABSL_GUARDED_BY(mutex);
+  };
+
+  // Returns the dictionary prepared for compression at `compression_level`,
+  // or `nullptr` if `ZSTD_createCDict()` failed.
+  //
+  // Precondition: `!empty()`
+  std::shared_ptr<const ZSTD_CDict> PrepareCompressionDictionary(
+      int compression_level) const;
+
+  // Returns the dictionary prepared for decompression, or `nullptr` if
+  // `ZSTD_createDDict()` failed.
+  //
+  // Precondition: `!empty()`
+  std::shared_ptr<const ZSTD_DDict> PrepareDecompressionDictionary() const;
+
+  std::shared_ptr<Repr> repr_;
+};
+
+// Trains a dictionary of at most `max_size` bytes for compressing data similar
+// to `samples`, and stores it in `*dictionary`.
+//
+// Samples should be representative of the data to be compressed, e.g. a few
+// thousand records. A dictionary of about 100 KiB trained on about 100 times
+// more sample data works well in practice.
+//
+// Returns status:
+//  * `status.ok()`  - success
+//  * `!status.ok()` - failure (e.g. too few samples)
+Status TrainZstdDictionary(const std::vector<absl::string_view>& samples,
+                           size_t max_size, ZstdDictionary* dictionary);
+
+// Implementation details follow.
+
+inline ZstdDictionary::ZstdDictionary(std::string data) {
+  if (!data.empty()) repr_ = std::make_shared<Repr>(std::move(data));
+}
+
+inline absl::string_view ZstdDictionary::data() const {
+  if (repr_ == nullptr) return absl::string_view();
+  return repr_->data;
+}
+
+}  // namespace riegeli
+
+#endif  // RIEGELI_BYTES_ZSTD_DICTIONARY_H_
@@ -15,30 +15,49 @@
 #include "riegeli/bytes/zstd_reader.h"
 
 #include <stddef.h>
+#include <stdint.h>
 
+#include <algorithm>
+#include <cstring>
 #include <limits>
 #include <memory>
+#include <vector>
 
 #include "absl/base/optimization.h"
 #include "absl/strings/str_cat.h"
 #include "riegeli/base/base.h"
 #include "riegeli/base/canonical_errors.h"
+#include "riegeli/base/endian.h"
 #include "riegeli/base/recycling_pool.h"
 #include "riegeli/base/status.h"
 #include "riegeli/bytes/buffered_reader.h"
 #include "riegeli/bytes/reader.h"
+#include "riegeli/bytes/zstd_dictionary.h"
 #include "zstd.h"
 
 namespace riegeli {
 
-void ZstdReaderBase::Initialize(Reader* src) {
-  RIEGELI_ASSERT(src != nullptr)
-      << "Failed precondition of ZstdReader: null Reader pointer";
-  if (ABSL_PREDICT_FALSE(!src->healthy()) && src->available() == 0) {
-    Fail(*src);
-    return;
-  }
-  decompressor_ = RecyclingPool<ZSTD_DCtx, ZSTD_DCtxDeleter>::global().Get(
+namespace {
+
+// https://github.com/facebook/zstd/blob/dev/contrib/seekable_format/zstd_seekable_compression_format.md
+constexpr uint32_t kSeekableMagicNumber = 0x8F92EAB1;
+constexpr uint32_t kSeekTableMagicNumber = 0x184D2A5E;
+// `Number_Of_Frames`, `Seek_Table_Descriptor`, `Seekable_Magic_Number`.
+constexpr size_t kSeekTableFooterSize = 4 + 1 + 4;
+// `Magic_Number`, `Frame_Size` of the skippable frame.
+constexpr size_t kSeekTableHeaderSize = 4 + 4;
+
+inline uint32_t ReadUint32At(const char* src) {
+  uint32_t word;
+  std::memcpy(&word, src, sizeof(word));
+  return ReadLittleEndian32(word);
+}
+
+}  // namespace
+
+inline RecyclingPool<ZSTD_DCtx, ZstdReaderBase::ZSTD_DCtxDeleter>::Handle
+ZstdReaderBase::GetDecompressor() {
+  return RecyclingPool<ZSTD_DCtx, ZSTD_DCtxDeleter>::global().Get(
       [] {
         return std::unique_ptr<ZSTD_DCtx, ZSTD_DCtxDeleter>(ZSTD_createDCtx());
       },
@@ -48,10 +67,76 @@ void ZstdReaderBase::Initialize(Reader* src) {
         RIEGELI_ASSERT(!ZSTD_isError(result))
             << "ZSTD_DCtx_reset() failed: " << ZSTD_getErrorName(result);
       });
-  if (ABSL_PREDICT_FALSE(decompressor_ == nullptr)) {
-    Fail(InternalError("ZSTD_createDCtx() failed"));
+}
+
+Status ZstdReaderBase::DecompressFlat(absl::string_view src,
+                                      absl::Span<char> dest,
+                                      const ZstdDictionary& dictionary) {
+  const RecyclingPool<ZSTD_DCtx, ZSTD_DCtxDeleter>::Handle decompressor =
+      GetDecompressor();
+  if (ABSL_PREDICT_FALSE(decompressor == nullptr)) {
+    return InternalError("ZSTD_createDCtx() failed");
+  }
+  std::shared_ptr<const ZSTD_DDict> prepared_dictionary;
+  if (!dictionary.empty()) {
+    prepared_dictionary = dictionary.PrepareDecompressionDictionary();
+    if (ABSL_PREDICT_FALSE(prepared_dictionary == nullptr)) {
+      return InternalError("ZSTD_createDDict() failed");
+    }
+  }
+  const size_t result = ZSTD_decompress_usingDDict(
+      decompressor.get(), dest.data(), dest.size(), src.data(), src.size(),
+      prepared_dictionary.get());
+  if (ABSL_PREDICT_FALSE(ZSTD_isError(result))) {
+    return DataLossError(absl::StrCat("ZSTD_decompress_usingDDict() failed: ",
+                                      ZSTD_getErrorName(result)));
+  }
+  if (ABSL_PREDICT_FALSE(result != dest.size())) {
+    return DataLossError(
+        absl::StrCat("Zstd-compressed frame has uncompressed size ", result,
+                     " instead of ", dest.size()));
+  }
+  return OkStatus();
+}
+
+void ZstdReaderBase::Initialize(Reader* src, const ZstdDictionary& dictionary,
+                                bool seekable) {
+  RIEGELI_ASSERT(src != nullptr)
+      << "Failed precondition of ZstdReader: null Reader pointer";
+  if (ABSL_PREDICT_FALSE(!src->healthy()) && src->available() == 0) {
+    Fail(*src);
     return;
   }
+  if (!dictionary.empty()) {
+    dictionary_ = dictionary.PrepareDecompressionDictionary();
+    if (ABSL_PREDICT_FALSE(dictionary_ == nullptr)) {
+      Fail(InternalError("ZSTD_createDDict() failed"));
+      return;
+    }
+  }
+  if (ABSL_PREDICT_FALSE(!InitializeDecompressor())) return;
+  if (seekable && src->SupportsRandomAccess()) {
+    if (ABSL_PREDICT_FALSE(!ReadSeekTable(src))) return;
+    if (!frames_.empty()) {
+      set_size_hint(UnsignedMax(Position{1}, frames_.back().uncompressed_pos));
+      return;
+    }
+  }
+  src->Pull(18 /* `ZSTD_FRAMEHEADERSIZE_MAX` */);
+  // Tune the buffer size if the uncompressed size is known.
+  unsigned long long uncompressed_size =
+      ZSTD_getFrameContentSize(src->cursor(), src->available());
+  if (uncompressed_size != ZSTD_CONTENTSIZE_UNKNOWN &&
+      uncompressed_size != ZSTD_CONTENTSIZE_ERROR) {
+    set_size_hint(UnsignedMax(size_t{1}, uncompressed_size));
+  }
+}
+
+bool ZstdReaderBase::InitializeDecompressor() {
+  decompressor_ = GetDecompressor();
+  if (ABSL_PREDICT_FALSE(decompressor_ == nullptr)) {
+    return Fail(InternalError("ZSTD_createDCtx() failed"));
+  }
   {
     // Maximum window size could also be found with
     // `ZSTD_dParam_getBounds(ZSTD_d_windowLogMax)`.
@@ -59,20 +144,85 @@ void ZstdReaderBase::Initialize(Reader* src) {
         ZSTD_DCtx_setParameter(decompressor_.get(), ZSTD_d_windowLogMax,
                                sizeof(size_t) == 4 ? 30 : 31);
     if (ABSL_PREDICT_FALSE(ZSTD_isError(result))) {
-      Fail(InternalError(
+      return Fail(InternalError(
           absl::StrCat("ZSTD_DCtx_setParameter(ZSTD_d_windowLogMax) failed: ",
                        ZSTD_getErrorName(result))));
-      return;
     }
   }
-  src->Pull(18 /* `ZSTD_FRAMEHEADERSIZE_MAX` */);
-  // Tune the buffer size if the uncompressed size is known.
-  unsigned long long uncompressed_size =
-      ZSTD_getFrameContentSize(src->cursor(), src->available());
-  if (uncompressed_size != ZSTD_CONTENTSIZE_UNKNOWN &&
-      uncompressed_size != ZSTD_CONTENTSIZE_ERROR) {
-    set_size_hint(UnsignedMax(size_t{1}, uncompressed_size));
+  if (dictionary_ != nullptr) {
+    const size_t result =
+        ZSTD_DCtx_refDDict(decompressor_.get(), dictionary_.get());
+    if (ABSL_PREDICT_FALSE(ZSTD_isError(result))) {
+      return Fail(InternalError(absl::StrCat("ZSTD_DCtx_refDDict() failed: ",
+                                             ZSTD_getErrorName(result))));
+    }
+  }
+  return true;
+}
+
+bool ZstdReaderBase::ReadSeekTable(Reader* src) {
+  const Position initial_pos = src->pos();
+  Position size;
+  if (ABSL_PREDICT_FALSE(!src->Size(&size))) return Fail(*src);
+  if (size < initial_pos ||
+      size - initial_pos < kSeekTableHeaderSize + kSeekTableFooterSize) {
+    return true;
+  }
+  char footer[kSeekTableFooterSize];
+  if (ABSL_PREDICT_FALSE(!src->Seek(size - kSeekTableFooterSize) ||
+                         !src->Read(footer, kSeekTableFooterSize))) {
+    if (ABSL_PREDICT_FALSE(!src->healthy())) return Fail(*src);
+    return Fail(DataLossError("Zstd-compressed stream shrank unexpectedly"));
+  }
+  const uint32_t num_frames = ReadUint32At(footer);
+  const uint8_t descriptor = static_cast<uint8_t>(footer[4]);
+  if (ReadUint32At(footer + 5) != kSeekableMagicNumber ||
+      (descriptor & 0x7f) != 0) {
+    // Not the seekable format, or reserved bits are set.
+    if (ABSL_PREDICT_FALSE(!src->Seek(initial_pos))) return Fail(*src);
+    return true;
+  }
+  const size_t entry_size = (descriptor & 0x80) != 0 ? 12 : 8;
+  const Position table_size = Position{num_frames} * entry_size;
+  if (ABSL_PREDICT_FALSE(size - initial_pos - kSeekTableHeaderSize -
+                             kSeekTableFooterSize <
+                         table_size)) {
+    return Fail(DataLossError("Invalid Zstd seek table: too many frames"));
+  }
+  const Position table_pos =
+      size - kSeekTableFooterSize - table_size - kSeekTableHeaderSize;
+  char header[kSeekTableHeaderSize];
+  if (ABSL_PREDICT_FALSE(!src->Seek(table_pos) ||
+                         !src->Read(header, kSeekTableHeaderSize))) {
+    if (ABSL_PREDICT_FALSE(!src->healthy())) return Fail(*src);
+    return Fail(DataLossError("Zstd-compressed stream shrank unexpectedly"));
+  }
+  if (ABSL_PREDICT_FALSE(ReadUint32At(header) != kSeekTableMagicNumber ||
+                         ReadUint32At(header + 4) !=
+                             table_size + kSeekTableFooterSize)) {
+    return Fail(DataLossError("Invalid Zstd seek table: wrong frame header"));
+  }
+  std::vector<Frame> frames;
+  frames.reserve(size_t{num_frames} + 1);
+  Frame frame = {initial_pos, 0};
+  for (uint32_t i = 0; i < num_frames; ++i) {
+    char entry[12];
+    if (ABSL_PREDICT_FALSE(!src->Read(entry, entry_size))) {
+      if (ABSL_PREDICT_FALSE(!src->healthy())) return Fail(*src);
+      return Fail(DataLossError("Zstd-compressed stream shrank unexpectedly"));
+    }
+    frames.push_back(frame);
+    frame.compressed_pos += ReadUint32At(entry);
+    frame.uncompressed_pos += ReadUint32At(entry + 4);
+  }
+  if (ABSL_PREDICT_FALSE(frame.compressed_pos != table_pos)) {
+    return Fail(DataLossError(
+        "Invalid Zstd seek table: frame sizes do not match the stream"));
   }
+  frames.push_back(frame);
+  if (ABSL_PREDICT_FALSE(!src->Seek(initial_pos))) return Fail(*src);
+  frames_ = std::move(frames);
+  return true;
 }
 
 void ZstdReaderBase::Done() {
@@ -80,6 +230,7 @@ void ZstdReaderBase::Done() {
     Fail(DataLossError("Truncated Zstd-compressed stream"));
   }
   decompressor_.reset();
+  dictionary_.reset();
   BufferedReader::Done();
 }
 
@@ -117,17 +268,24 @@ bool ZstdReaderBase::ReadInternal(char* dest, size_t min_length,
         ZSTD_decompressStream(decompressor_.get(), &output, &input);
     src->set_cursor(static_cast<const char*>(input.src) + input.pos);
     if (ABSL_PREDICT_FALSE(result == 0)) {
-      decompressor_.reset();
-      limit_pos_ += output.pos;
-      return output.pos >= min_length;
-    }
-    if (ABSL_PREDICT_FALSE(ZSTD_isError(result))) {
+      if (!frames_.empty() && src->pos() < frames_.back().compressed_pos) {
+        // A frame of the seekable format ended, and another one follows.
+        if (output.pos >= min_length) {
+          limit_pos_ += output.pos;
+          return true;
+        }
+        if (src->available() > 0) continue;
+      } else {
+        decompressor_.reset();
+        limit_pos_ += output.pos;
+        return output.pos >= min_length;
+      }
+    } else if (ABSL_PREDICT_FALSE(ZSTD_isError(result))) {
       Fail(DataLossError(absl::StrCat("ZSTD_decompressStream() failed: ",
                                       ZSTD_getErrorName(result))));
       limit_pos_ += output.pos;
       return output.pos >= min_length;
-    }
-    if (output.pos >= min_length) {
+    } else if (output.pos >= min_length) {
       limit_pos_ += output.pos;
       return true;
     }
@@ -143,4 +301,61 @@ bool ZstdReaderBase::ReadInternal(char* dest, size_t min_length,
   }
 }
 
+bool ZstdReaderBase::SeekSlow(Position new_pos) {
+  RIEGELI_ASSERT(new_pos < start_pos() || new_pos > limit_pos_)
+      << "Failed precondition of Reader::SeekSlow(): "
+         "position in the buffer, use Seek() instead";
+  if (frames_.empty()) return BufferedReader::SeekSlow(new_pos);
+  if (ABSL_PREDICT_FALSE(!healthy())) return false;
+  const auto frame_after = [this](Position pos) {
+    return std::upper_bound(
+        frames_.begin(), frames_.end(), pos,
+        [](Position pos, const Frame& frame) {
+          return pos < frame.uncompressed_pos;
+        });
+  };
+  const std::vector<Frame>::const_iterator frame = frame_after(new_pos);
+  if (new_pos > limit_pos_ && decompressor_ != nullptr &&
+      frame == frame_after(limit_pos_)) {
+    // Seeking forwards within the current frame.
+    return BufferedReader::SeekSlow(new_pos);
+  }
+  ClearBuffer();
+  truncated_ = false;
+  const Position size = frames_.back().uncompressed_pos;
+  if (frame == frames_.end()) {
+    // Seeking to the end or past it.
+    decompressor_.reset();
+    limit_pos_ = size;
+    return new_pos == size;
+  }
+  // Decompression restarts at the beginning of the frame containing `new_pos`.
+  const Frame& frame_begin = *(frame - 1);
+  Reader* const src = src_reader();
+  if (ABSL_PREDICT_FALSE(!src->Seek(frame_begin.compressed_pos))) {
+    if (ABSL_PREDICT_FALSE(!src->healthy())) return Fail(*src);
+    return Fail(DataLossError("Zstd-compressed stream shrank unexpectedly"));
+  }
+  if (decompressor_ == nullptr) {
+    if (ABSL_PREDICT_FALSE(!InitializeDecompressor())) return false;
+  } else {
+    const size_t result =
+        ZSTD_DCtx_reset(decompressor_.get(), ZSTD_reset_session_only);
+    if (ABSL_PREDICT_FALSE(ZSTD_isError(result))) {
+      return Fail(InternalError(absl::StrCat("ZSTD_DCtx_reset() failed: ",
+                                             ZSTD_getErrorName(result))));
+    }
+  }
+  limit_pos_ = frame_begin.uncompressed_pos;
+  if (new_pos == limit_pos_) return true;
+  return BufferedReader::SeekSlow(new_pos);
+}
+
+bool ZstdReaderBase::Size(Position* size) {
+  if (frames_.empty()) return BufferedReader::Size(size);
+  if (ABSL_PREDICT_FALSE(!healthy())) return false;
+  *size = frames_.back().uncompressed_pos;
+  return true;
+}
+
 }  // namespace riegeli
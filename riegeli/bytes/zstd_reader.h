@@ -17,16 +17,22 @@
 
 #include <stddef.h>
 
+#include <memory>
 #include <tuple>
 #include <utility>
+#include <vector>
 
 #include "absl/base/optimization.h"
+#include "absl/strings/string_view.h"
+#include "absl/types/span.h"
 #include "riegeli/base/base.h"
 #include "riegeli/base/dependency.h"
 #include "riegeli/base/recycling_pool.h"
 #include "riegeli/base/resetter.h"
+#include "riegeli/base/status.h"
 #include "riegeli/bytes/buffered_reader.h"
 #include "riegeli/bytes/reader.h"
+#include "riegeli/bytes/zstd_dictionary.h"
 #include "zstd.h"
 
 namespace riegeli {
@@ -38,6 +44,18 @@ class ZstdReaderBase : public BufferedReader {
    public:
     Options() noexcept {}
 
+    // Zstd dictionary. This must be the same dictionary which was used for
+    // compression.
+    //
+    // Default: `ZstdDictionary()` (no dictionary)
+    Options& set_dictionary(ZstdDictionary dictionary) & {
+      dictionary_ = std::move(dictionary);
+      return *this;
+    }
+    Options&& set_dictionary(ZstdDictionary dictionary) && {
+      return std::move(set_dictionary(std::move(dictionary)));
+    }
+
     // Expected uncompressed size, or 0 if unknown. This may improve
     // performance.
     //
@@ -66,18 +84,59 @@ class ZstdReaderBase : public BufferedReader {
       return std::move(set_buffer_size(buffer_size));
     }
 
+    // If `true` and the compressed `Reader` supports random access, the
+    // compressed data may be in the Zstd seekable format, i.e. a sequence of
+    // independently compressed frames followed by a seek table listing their
+    // sizes in a skippable frame. If the seek table is found, all frames are
+    // read, and `SupportsRandomAccess()` is `true`: `Seek()` decompresses only
+    // from the beginning of the frame containing the new position, and
+    // `Size()` is taken from the seek table.
+    //
+    // If `false`, or if there is no seek table, only the first frame is read.
+    //
+    // Default: `false`
+    Options& set_seekable(bool seekable) & {
+      seekable_ = seekable;
+      return *this;
+    }
+    Options&& set_seekable(bool seekable) && {
+      return std::move(set_seekable(seekable));
+    }
+
    private:
     template <typename Src>
     friend class ZstdReader;
 
+    ZstdDictionary dictionary_;
     Position size_hint_ = 0;
     size_t buffer_size_ = DefaultBufferSize();
+    bool seekable_ = false;
   };
 
   // Returns the compressed `Reader`. Unchanged by `Close()`.
   virtual Reader* src_reader() = 0;
   virtual const Reader* src_reader() const = 0;
 
+  // Random access is supported if a seek table was found, see
+  // `Options::set_seekable()`.
+  bool SupportsRandomAccess() const override { return !frames_.empty(); }
+  bool Size(Position* size) override;
+
+  // Decompresses a whole Zstd frame `src` at once into `dest`, whose size must
+  // be the uncompressed size. This avoids the overhead of streaming when the
+  // compressed data are flat and the uncompressed size is known.
+  //
+  // The decompression context is shared with `ZstdReader`s of the same
+  // thread.
+  //
+  // `dictionary` must be the same dictionary which was used for compression.
+  //
+  // Returns status:
+  //  * `status.ok()`  - success
+  //  * `!status.ok()` - failure
+  static Status DecompressFlat(absl::string_view src, absl::Span<char> dest,
+                               const ZstdDictionary& dictionary);
+
  protected:
   ZstdReaderBase() noexcept {}
 
@@ -88,25 +147,61 @@ class ZstdReaderBase : public BufferedReader {
 
   void Reset();
   void Reset(size_t buffer_size, Position size_hint);
-  void Initialize(Reader* src);
+  void Initialize(Reader* src, const ZstdDictionary& dictionary,
+                  bool seekable);
 
   void Done() override;
   bool PullSlow(size_t min_length, size_t recommended_length) override;
   bool ReadInternal(char* dest, size_t min_length, size_t max_length) override;
+  bool SeekSlow(Position new_pos) override;
 
  private:
   struct ZSTD_DCtxDeleter {
     void operator()(ZSTD_DCtx* ptr) const { ZSTD_freeDCtx(ptr); }
   };
 
+  // Positions of the beginning of a frame of the Zstd seekable format.
+  struct Frame {
+    // Position in the compressed `Reader`.
+    Position compressed_pos;
+    // Position in the uncompressed data.
+    Position uncompressed_pos;
+  };
+
+  // Returns a decompression context from the pool, or `nullptr` if
+  // `ZSTD_createDCtx()` failed.
+  static RecyclingPool<ZSTD_DCtx, ZSTD_DCtxDeleter>::Handle GetDecompressor();
+
+  // Sets `decompressor_` to a fresh decompression context using
+  // `dictionary_`.
+  //
+  // Return values:
+  //  * `true`  - success
+  //  * `false` - failure (`!healthy()`)
+  bool InitializeDecompressor();
+
+  // Fills `frames_` if `*src` is in the Zstd seekable format, leaving the
+  // position of `*src` unchanged.
+  //
+  // Return values:
+  //  * `true`  - success (`frames_` may remain empty if there is no seek table)
+  //  * `false` - failure (`!healthy()`)
+  bool ReadSeekTable(Reader* src);
+
   // If `true`, the source is truncated (without a clean end of the compressed
   // stream) at the current position. If the source does not grow, `Close()`
   // will fail.
   bool truncated_ = false;
+  // Referenced by `decompressor_` if a dictionary is used. Kept alive until
+  // `decompressor_` is no longer used.
+  std::shared_ptr<const ZSTD_DDict> dictionary_;
   // If `healthy()` but `decompressor_ == nullptr` then all data have been
   // decompressed. In this case `ZSTD_decompressStream()` must not be called
   // again.
   RecyclingPool<ZSTD_DCtx, ZSTD_DCtxDeleter>::Handle decompressor_;
+  // Frames of the Zstd seekable format, followed by a sentinel with positions
+  // of the end of the last frame, or empty if the format is not seekable.
+  std::vector<Frame> frames_;
 };
 
 // A `Reader` which decompresses data with Zstd after getting it from another
@@ -172,13 +267,17 @@ inline ZstdReaderBase::ZstdReaderBase(size_t buffer_size, Position size_hint)
 inline ZstdReaderBase::ZstdReaderBase(ZstdReaderBase&& that) noexcept
     : BufferedReader(std::move(that)),
       truncated_(that.truncated_),
-      decompressor_(std::move(that.decompressor_)) {}
+      dictionary_(std::move(that.dictionary_)),
+      decompressor_(std::move(that.decompressor_)),
+      frames_(std::move(that.frames_)) {}
 
 inline ZstdReaderBase& ZstdReaderBase::operator=(
     ZstdReaderBase&& that) noexcept {
   BufferedReader::operator=(std::move(that));
   truncated_ = that.truncated_;
   decompressor_ = std::move(that.decompressor_);
+  dictionary_ = std::move(that.dictionary_);
+  frames_ = std::move(that.frames_);
   return *this;
 }
 
@@ -186,25 +285,29 @@ inline void ZstdReaderBase::Reset() {
   BufferedReader::Reset();
   truncated_ = false;
   decompressor_.reset();
+  dictionary_.reset();
+  frames_.clear();
 }
 
 inline void ZstdReaderBase::Reset(size_t buffer_size, Position size_hint) {
   BufferedReader::Reset(buffer_size, size_hint);
   truncated_ = false;
   decompressor_.reset();
+  dictionary_.reset();
+  frames_.clear();
 }
 
 template <typename Src>
 inline ZstdReader<Src>::ZstdReader(const Src& src, Options options)
     : ZstdReaderBase(options.buffer_size_, options.size_hint_), src_(src) {
-  Initialize(src_.get());
+  Initialize(src_.get(), options.dictionary_, options.seekable_);
 }
 
 template <typename Src>
 inline ZstdReader<Src>::ZstdReader(Src&& src, Options options)
     : ZstdReaderBase(options.buffer_size_, options.size_hint_),
       src_(std::move(src)) {
-  Initialize(src_.get());
+  Initialize(src_.get(), options.dictionary_, options.seekable_);
 }
 
 template <typename Src>
@@ -213,7 +316,7 @@ inline ZstdReader<Src>::ZstdReader(std::tuple<SrcArgs...> src_args,
                                    Options options)
     : ZstdReaderBase(options.buffer_size_, options.size_hint_),
       src_(std::move(src_args)) {
-  Initialize(src_.get());
+  Initialize(src_.get(), options.dictionary_, options.seekable_);
 }
 
 template <typename Src>
@@ -237,14 +340,14 @@ template <typename Src>
 inline void ZstdReader<Src>::Reset(const Src& src, Options options) {
   ZstdReaderBase::Reset(options.buffer_size_, options.size_hint_);
   src_.Reset(src);
-  Initialize(src_.get());
+  Initialize(src_.get(), options.dictionary_, options.seekable_);
 }
 
 template <typename Src>
 inline void ZstdReader<Src>::Reset(Src&& src, Options options) {
   ZstdReaderBase::Reset(options.buffer_size_, options.size_hint_);
   src_.Reset(std::move(src));
-  Initialize(src_.get());
+  Initialize(src_.get(), options.dictionary_, options.seekable_);
 }
 
 template <typename Src>
@@ -253,7 +356,7 @@ inline void ZstdReader<Src>::Reset(std::tuple<SrcArgs...> src_args,
                                    Options options) {
   ZstdReaderBase::Reset(options.buffer_size_, options.size_hint_);
   src_.Reset(std::move(src_args));
-  Initialize(src_.get());
+  Initialize(src_.get(), options.dictionary_, options.seekable_);
 }
 
 template <typename Src>
@@ -14,15 +14,18 @@
 
 // Enables the experimental zstd API:
 //  * `ZSTD_c_srcSizeHint`
+//  * `ZSTD_c_targetCBlockSize`
 //
 // Using the experimental zstd API is optional. If this gets removed,
 // `size_hint` is ignored by zstd if `final_size` is not set (`size_hint`
-// remains used only for `BufferedWriter` tuning).
+// remains used only for `BufferedWriter` tuning), and `target_block_size` is
+// ignored.
 #define ZSTD_STATIC_LINKING_ONLY
 
 #include "riegeli/bytes/zstd_writer.h"
 
 #include <stddef.h>
+#include <stdint.h>
 
 #include <limits>
 #include <memory>
@@ -37,6 +40,7 @@
 #include "riegeli/base/status.h"
 #include "riegeli/bytes/buffered_writer.h"
 #include "riegeli/bytes/writer.h"
+#include "riegeli/bytes/zstd_dictionary.h"
 #include "zstd.h"
 
 namespace riegeli {
@@ -51,6 +55,15 @@ constexpr int ZstdWriterBase::Options::kDefaultCompressionLevel;
 constexpr int ZstdWriterBase::Options::kMinWindowLog;
 constexpr int ZstdWriterBase::Options::kMaxWindowLog;
 constexpr int ZstdWriterBase::Options::kDefaultWindowLog;
+constexpr int ZstdWriterBase::Options::kMaxNumWorkers;
+constexpr uint64_t ZstdWriterBase::Options::kMaxJobSize;
+constexpr int ZstdWriterBase::Options::kDefaultStrategy;
+constexpr int ZstdWriterBase::Options::kMinStrategy;
+constexpr int ZstdWriterBase::Options::kMaxStrategy;
+constexpr int ZstdWriterBase::Options::kMinLdmHashLog;
+constexpr int ZstdWriterBase::Options::kMaxLdmHashLog;
+constexpr int ZstdWriterBase::Options::kDefaultLdmHashLog;
+constexpr size_t ZstdWriterBase::Options::kMaxTargetBlockSize;
 #endif
 
 namespace {
@@ -63,10 +76,7 @@ struct ZSTD_CCtxParamsDeleter {
 
 }  // namespace
 
-void ZstdWriterBase::Initialize(Writer* dest, int compression_level,
-                                int window_log,
-                                absl::optional<Position> final_size,
-                                Position size_hint, bool store_checksum) {
+void ZstdWriterBase::Initialize(Writer* dest, const Options& options) {
   RIEGELI_ASSERT(dest != nullptr)
       << "Failed precondition of ZstdWriter: null Writer pointer";
   if (ABSL_PREDICT_FALSE(!dest->healthy())) {
@@ -88,8 +98,9 @@ void ZstdWriterBase::Initialize(Writer* dest, int compression_level,
     return;
   }
   {
-    const size_t result = ZSTD_CCtx_setParameter(
-        compressor_.get(), ZSTD_c_compressionLevel, compression_level);
+    const size_t result =
+        ZSTD_CCtx_setParameter(compressor_.get(), ZSTD_c_compressionLevel,
+                               options.compression_level_);
     if (ABSL_PREDICT_FALSE(ZSTD_isError(result))) {
       Fail(InternalError(absl::StrCat(
           "ZSTD_CCtx_setParameter(ZSTD_c_compressionLevel) failed: ",
@@ -97,9 +108,9 @@ void ZstdWriterBase::Initialize(Writer* dest, int compression_level,
       return;
     }
   }
-  if (window_log != Options::kDefaultWindowLog) {
-    const size_t result =
-        ZSTD_CCtx_setParameter(compressor_.get(), ZSTD_c_windowLog, window_log);
+  if (options.window_log_ != Options::kDefaultWindowLog) {
+    const size_t result = ZSTD_CCtx_setParameter(
+        compressor_.get(), ZSTD_c_windowLog, options.window_log_);
     if (ABSL_PREDICT_FALSE(ZSTD_isError(result))) {
       Fail(InternalError(
           absl::StrCat("ZSTD_CCtx_setParameter(ZSTD_c_windowLog) failed: ",
@@ -107,9 +118,68 @@ void ZstdWriterBase::Initialize(Writer* dest, int compression_level,
       return;
     }
   }
-  {
+  if (options.strategy_ != Options::kDefaultStrategy) {
     const size_t result = ZSTD_CCtx_setParameter(
-        compressor_.get(), ZSTD_c_checksumFlag, store_checksum ? 1 : 0);
+        compressor_.get(), ZSTD_c_strategy, options.strategy_);
+    if (ABSL_PREDICT_FALSE(ZSTD_isError(result))) {
+      Fail(InternalError(
+          absl::StrCat("ZSTD_CCtx_setParameter(ZSTD_c_strategy) failed: ",
+                       ZSTD_getErrorName(result))));
+      return;
+    }
+  }
+  if (options.long_distance_matching_) {
+    const size_t result = ZSTD_CCtx_setParameter(
+        compressor_.get(), ZSTD_c_enableLongDistanceMatching, 1);
+    if (ABSL_PREDICT_FALSE(ZSTD_isError(result))) {
+      Fail(InternalError(absl::StrCat(
+          "ZSTD_CCtx_setParameter(ZSTD_c_enableLongDistanceMatching) failed: ",
+          ZSTD_getErrorName(result))));
+      return;
+    }
+    if (options.ldm_hash_log_ != Options::kDefaultLdmHashLog) {
+      const size_t result = ZSTD_CCtx_setParameter(
+          compressor_.get(), ZSTD_c_ldmHashLog, options.ldm_hash_log_);
+      if (ABSL_PREDICT_FALSE(ZSTD_isError(result))) {
+        Fail(InternalError(
+            absl::StrCat("ZSTD_CCtx_setParameter(ZSTD_c_ldmHashLog) failed: ",
+                         ZSTD_getErrorName(result))));
+        return;
+      }
+    }
+  }
+#ifdef ZSTD_STATIC_LINKING_ONLY
+  if (options.target_block_size_ > 0) {
+    const size_t result =
+        ZSTD_CCtx_setParameter(compressor_.get(), ZSTD_c_targetCBlockSize,
+                               IntCast<int>(options.target_block_size_));
+    if (ABSL_PREDICT_FALSE(ZSTD_isError(result))) {
+      Fail(InternalError(absl::StrCat(
+          "ZSTD_CCtx_setParameter(ZSTD_c_targetCBlockSize) failed: ",
+          ZSTD_getErrorName(result))));
+      return;
+    }
+  }
+#endif
+  if (!options.dictionary_.empty()) {
+    dictionary_ = options.dictionary_.PrepareCompressionDictionary(
+        options.compression_level_);
+    if (ABSL_PREDICT_FALSE(dictionary_ == nullptr)) {
+      Fail(InternalError("ZSTD_createCDict() failed"));
+      return;
+    }
+    const size_t result =
+        ZSTD_CCtx_refCDict(compressor_.get(), dictionary_.get());
+    if (ABSL_PREDICT_FALSE(ZSTD_isError(result))) {
+      Fail(InternalError(absl::StrCat("ZSTD_CCtx_refCDict() failed: ",
+                                      ZSTD_getErrorName(result))));
+      return;
+    }
+  }
+  {
+    const size_t result =
+        ZSTD_CCtx_setParameter(compressor_.get(), ZSTD_c_checksumFlag,
+                               options.store_checksum_ ? 1 : 0);
     if (ABSL_PREDICT_FALSE(ZSTD_isError(result))) {
       Fail(InternalError(
           absl::StrCat("ZSTD_CCtx_setParameter(ZSTD_c_checksumFlag) failed: ",
@@ -117,9 +187,29 @@ void ZstdWriterBase::Initialize(Writer* dest, int compression_level,
       return;
     }
   }
-  if (final_size.has_value()) {
+  if (options.num_workers_ > 0) {
+    const size_t result = ZSTD_CCtx_setParameter(
+        compressor_.get(), ZSTD_c_nbWorkers, options.num_workers_);
+    if (ABSL_PREDICT_FALSE(ZSTD_isError(result))) {
+      Fail(InternalError(
+          absl::StrCat("ZSTD_CCtx_setParameter(ZSTD_c_nbWorkers) failed: ",
+                       ZSTD_getErrorName(result))));
+      return;
+    }
+    if (options.job_size_ > 0) {
+      const size_t result = ZSTD_CCtx_setParameter(
+          compressor_.get(), ZSTD_c_jobSize, IntCast<int>(options.job_size_));
+      if (ABSL_PREDICT_FALSE(ZSTD_isError(result))) {
+        Fail(InternalError(
+            absl::StrCat("ZSTD_CCtx_setParameter(ZSTD_c_jobSize) failed: ",
+                         ZSTD_getErrorName(result))));
+        return;
+      }
+    }
+  }
+  if (options.final_size_.has_value()) {
     const size_t result = ZSTD_CCtx_setPledgedSrcSize(
-        compressor_.get(), IntCast<unsigned long long>(*final_size));
+        compressor_.get(), IntCast<unsigned long long>(*options.final_size_));
     if (ABSL_PREDICT_FALSE(ZSTD_isError(result))) {
       Fail(InternalError(absl::StrCat("ZSTD_CCtx_setPledgedSrcSize() failed: ",
                                       ZSTD_getErrorName(result))));
@@ -127,11 +217,11 @@ void ZstdWriterBase::Initialize(Writer* dest, int compression_level,
     }
   }
 #ifdef ZSTD_STATIC_LINKING_ONLY
-  else if (size_hint > 0) {
+  else if (options.size_hint_ > 0) {
     const size_t result = ZSTD_CCtx_setParameter(
         compressor_.get(), ZSTD_c_srcSizeHint,
-        IntCast<int>(
-            UnsignedMin(size_hint, Position{std::numeric_limits<int>::max()})));
+        IntCast<int>(UnsignedMin(options.size_hint_,
+                                 Position{std::numeric_limits<int>::max()})));
     if (ABSL_PREDICT_FALSE(ZSTD_isError(result))) {
       Fail(InternalError(
           absl::StrCat("ZSTD_CCtx_setParameter(ZSTD_c_srcSizeHint) failed: ",
@@ -150,6 +240,7 @@ void ZstdWriterBase::Done() {
     WriteInternal(absl::string_view(start_, buffered_length), dest, ZSTD_e_end);
   }
   compressor_.reset();
+  dictionary_.reset();
   BufferedWriter::Done();
 }
 
@@ -189,9 +280,10 @@ bool ZstdWriterBase::WriteInternal(absl::string_view src, Writer* dest,
                                              ZSTD_getErrorName(result))));
     }
     if (output.pos < output.size) {
-      RIEGELI_ASSERT_EQ(input.pos, input.size)
-          << "ZSTD_compressStream2() returned but there are still input data "
-             "and output space";
+      // With workers, `ZSTD_compressStream2()` may return before consuming
+      // all input data, or before flushing all output data for
+      // `ZSTD_e_flush` and `ZSTD_e_end`.
+      if (input.pos < input.size || end_op != ZSTD_e_continue) continue;
       start_pos_ += input.pos;
       return true;
     }
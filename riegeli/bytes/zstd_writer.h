@@ -16,7 +16,9 @@
 #define RIEGELI_BYTES_ZSTD_WRITER_H_
 
 #include <stddef.h>
+#include <stdint.h>
 
+#include <memory>
 #include <tuple>
 #include <utility>
 
@@ -29,6 +31,7 @@
 #include "riegeli/base/resetter.h"
 #include "riegeli/bytes/buffered_writer.h"
 #include "riegeli/bytes/writer.h"
+#include "riegeli/bytes/zstd_dictionary.h"
 #include "zstd.h"
 
 namespace riegeli {
@@ -98,6 +101,114 @@ class ZstdWriterBase : public BufferedWriter {
       return std::move(set_window_log(window_log));
     }
 
+    // Match finding strategy. This tunes the tradeoff between compression
+    // density and compression speed independently from `compression_level`,
+    // which otherwise determines the strategy.
+    //
+    // Special value `kDefaultStrategy` (0) means to derive `strategy` from
+    // `compression_level`.
+    //
+    // `strategy` must be `kDefaultStrategy` (0) or between `kMinStrategy`
+    // (1, `ZSTD_fast`) and `kMaxStrategy` (9, `ZSTD_btultra2`).
+    // Default: `kDefaultStrategy` (0).
+    static constexpr int kDefaultStrategy = 0;
+    static constexpr int kMinStrategy = 1;  // `ZSTD_fast`
+    static constexpr int kMaxStrategy = 9;  // `ZSTD_btultra2`
+    Options& set_strategy(int strategy) & {
+      if (strategy != kDefaultStrategy) {
+        RIEGELI_ASSERT_GE(strategy, kMinStrategy)
+            << "Failed precondition of "
+               "ZstdWriterBase::Options::set_strategy(): "
+               "strategy out of range";
+        RIEGELI_ASSERT_LE(strategy, kMaxStrategy)
+            << "Failed precondition of "
+               "ZstdWriterBase::Options::set_strategy(): "
+               "strategy out of range";
+      }
+      strategy_ = strategy;
+      return *this;
+    }
+    Options&& set_strategy(int strategy) && {
+      return std::move(set_strategy(strategy));
+    }
+
+    // If `true`, finds matches also far in the past, which helps data with
+    // long repetitions, especially with a large `window_log`. If `window_log`
+    // is `kDefaultWindowLog`, it becomes 27.
+    //
+    // Default: `false`
+    Options& set_long_distance_matching(bool long_distance_matching) & {
+      long_distance_matching_ = long_distance_matching;
+      return *this;
+    }
+    Options&& set_long_distance_matching(bool long_distance_matching) && {
+      return std::move(set_long_distance_matching(long_distance_matching));
+    }
+
+    // Logarithm of the size of the hash table used for long distance matching,
+    // if `long_distance_matching` is `true`. This tunes the tradeoff between
+    // compression density and memory usage (higher = better density but more
+    // memory).
+    //
+    // Special value `kDefaultLdmHashLog` (0) means to derive `ldm_hash_log`
+    // from `window_log`.
+    //
+    // `ldm_hash_log` must be `kDefaultLdmHashLog` (0) or between
+    // `kMinLdmHashLog` (6) and `kMaxLdmHashLog` (30).
+    // Default: `kDefaultLdmHashLog` (0).
+    static constexpr int kMinLdmHashLog = 6;   // `ZSTD_LDM_HASHLOG_MIN`
+    static constexpr int kMaxLdmHashLog = 30;  // `ZSTD_LDM_HASHLOG_MAX`
+    static constexpr int kDefaultLdmHashLog = 0;
+    Options& set_ldm_hash_log(int ldm_hash_log) & {
+      if (ldm_hash_log != kDefaultLdmHashLog) {
+        RIEGELI_ASSERT_GE(ldm_hash_log, kMinLdmHashLog)
+            << "Failed precondition of "
+               "ZstdWriterBase::Options::set_ldm_hash_log(): "
+               "LDM hash log out of range";
+        RIEGELI_ASSERT_LE(ldm_hash_log, kMaxLdmHashLog)
+            << "Failed precondition of "
+               "ZstdWriterBase::Options::set_ldm_hash_log(): "
+               "LDM hash log out of range";
+      }
+      ldm_hash_log_ = ldm_hash_log;
+      return *this;
+    }
+    Options&& set_ldm_hash_log(int ldm_hash_log) && {
+      return std::move(set_ldm_hash_log(ldm_hash_log));
+    }
+
+    // Desired size of compressed blocks, or 0 to let blocks be as large as
+    // possible. Smaller blocks let a streaming decompressor start producing
+    // data sooner, at some cost in compression density. Zstd may increase
+    // very small sizes.
+    //
+    // `target_block_size` must be between 0 and `kMaxTargetBlockSize` (128K).
+    // Default: 0.
+    static constexpr size_t kMaxTargetBlockSize =
+        size_t{128} << 10;  // `ZSTD_TARGETCBLOCKSIZE_MAX`
+    Options& set_target_block_size(size_t target_block_size) & {
+      RIEGELI_ASSERT_LE(target_block_size, kMaxTargetBlockSize)
+          << "Failed precondition of "
+             "ZstdWriterBase::Options::set_target_block_size(): "
+             "target block size out of range";
+      target_block_size_ = target_block_size;
+      return *this;
+    }
+    Options&& set_target_block_size(size_t target_block_size) && {
+      return std::move(set_target_block_size(target_block_size));
+    }
+
+    // Zstd dictionary. The same dictionary must be used for decompression.
+    //
+    // Default: `ZstdDictionary()` (no dictionary)
+    Options& set_dictionary(ZstdDictionary dictionary) & {
+      dictionary_ = std::move(dictionary);
+      return *this;
+    }
+    Options&& set_dictionary(ZstdDictionary dictionary) && {
+      return std::move(set_dictionary(std::move(dictionary)));
+    }
+
     // Exact uncompressed size. This may improve compression density and
     // performance, and causes the size to be stored in the compressed stream
     // header.
@@ -137,6 +248,55 @@ class ZstdWriterBase : public BufferedWriter {
       return std::move(set_store_checksum(store_checksum));
     }
 
+    // Number of background threads compressing data in parallel. If 0,
+    // compression is performed in the calling thread.
+    //
+    // With workers, data are split into jobs compressed independently, which
+    // makes compression density slightly worse. This pays off for large data,
+    // at least several times the job size. It requires zstd built with
+    // `ZSTD_MULTITHREAD`.
+    //
+    // `num_workers` must be between 0 and `kMaxNumWorkers` (64 in 32-bit build,
+    // 200 in 64-bit build). Default: 0.
+    static constexpr int kMaxNumWorkers =
+        sizeof(size_t) == 4 ? 64 : 200;  // `ZSTDMT_NBWORKERS_MAX`
+    Options& set_num_workers(int num_workers) & {
+      RIEGELI_ASSERT_GE(num_workers, 0)
+          << "Failed precondition of "
+             "ZstdWriterBase::Options::set_num_workers(): "
+             "negative number of workers";
+      RIEGELI_ASSERT_LE(num_workers, kMaxNumWorkers)
+          << "Failed precondition of "
+             "ZstdWriterBase::Options::set_num_workers(): "
+             "number of workers out of range";
+      num_workers_ = num_workers;
+      return *this;
+    }
+    Options&& set_num_workers(int num_workers) && {
+      return std::move(set_num_workers(num_workers));
+    }
+
+    // Uncompressed size of a job compressed by one worker, if `num_workers` is
+    // positive. 0 means to derive it from compression parameters. Smaller
+    // sizes are increased to 1M.
+    //
+    // `job_size` must be between 0 and `kMaxJobSize` (512M in 32-bit build,
+    // 1G in 64-bit build). Default: 0.
+    static constexpr uint64_t kMaxJobSize =
+        sizeof(size_t) == 4 ? uint64_t{512} << 20
+                            : uint64_t{1} << 30;  // `ZSTDMT_JOBSIZE_MAX`
+    Options& set_job_size(uint64_t job_size) & {
+      RIEGELI_ASSERT_LE(job_size, kMaxJobSize)
+          << "Failed precondition of "
+             "ZstdWriterBase::Options::set_job_size(): "
+             "job size out of range";
+      job_size_ = job_size;
+      return *this;
+    }
+    Options&& set_job_size(uint64_t job_size) && {
+      return std::move(set_job_size(job_size));
+    }
+
     // Tunes how much data is buffered before calling the compression engine.
     //
     // Default: `ZSTD_CStreamInSize()`
@@ -154,14 +314,22 @@ class ZstdWriterBase : public BufferedWriter {
     }
 
    private:
+    friend class ZstdWriterBase;
     template <typename Dest>
     friend class ZstdWriter;
 
     int compression_level_ = kDefaultCompressionLevel;
     int window_log_ = kDefaultWindowLog;
+    int strategy_ = kDefaultStrategy;
+    bool long_distance_matching_ = false;
+    int ldm_hash_log_ = kDefaultLdmHashLog;
+    size_t target_block_size_ = 0;
+    ZstdDictionary dictionary_;
     absl::optional<Position> final_size_;
     Position size_hint_ = 0;
     bool store_checksum_ = false;
+    int num_workers_ = 0;
+    uint64_t job_size_ = 0;
     size_t buffer_size_ = DefaultBufferSize();
   };
 
@@ -181,9 +349,7 @@ class ZstdWriterBase : public BufferedWriter {
 
   void Reset();
   void Reset(size_t buffer_size, Position size_hint);
-  void Initialize(Writer* dest, int compression_level, int window_log,
-                  absl::optional<Position> final_size, Position size_hint,
-                  bool store_checksum);
+  void Initialize(Writer* dest, const Options& options);
 
   void Done() override;
   bool WriteInternal(absl::string_view src) override;
@@ -196,6 +362,9 @@ class ZstdWriterBase : public BufferedWriter {
   bool WriteInternal(absl::string_view src, Writer* dest,
                      ZSTD_EndDirective end_op);
 
+  // Referenced by `compressor_` if a dictionary is used. Kept alive until
+  // `compressor_` is no longer used.
+  std::shared_ptr<const ZSTD_CDict> dictionary_;
   RecyclingPool<ZSTD_CCtx, ZSTD_CCtxDeleter>::Handle compressor_;
 };
 
@@ -260,23 +429,27 @@ inline ZstdWriterBase::ZstdWriterBase(size_t buffer_size, Position size_hint)
 
 inline ZstdWriterBase::ZstdWriterBase(ZstdWriterBase&& that) noexcept
     : BufferedWriter(std::move(that)),
+      dictionary_(std::move(that.dictionary_)),
       compressor_(std::move(that.compressor_)) {}
 
 inline ZstdWriterBase& ZstdWriterBase::operator=(
     ZstdWriterBase&& that) noexcept {
   BufferedWriter::operator=(std::move(that));
   compressor_ = std::move(that.compressor_);
+  dictionary_ = std::move(that.dictionary_);
   return *this;
 }
 
 inline void ZstdWriterBase::Reset() {
   BufferedWriter::Reset();
   compressor_.reset();
+  dictionary_.reset();
 }
 
 inline void ZstdWriterBase::Reset(size_t buffer_size, Position size_hint) {
   BufferedWriter::Reset(buffer_size, size_hint);
   compressor_.reset();
+  dictionary_.reset();
 }
 
 template <typename Dest>
@@ -284,10 +457,7 @@ inline ZstdWriter<Dest>::ZstdWriter(const Dest& dest, Options options)
     : ZstdWriterBase(options.buffer_size_,
                      options.final_size_.value_or(options.size_hint_)),
       dest_(dest) {
-  Initialize(dest_.get(), options.compression_level_, options.window_log_,
-             options.final_size_,
-             options.final_size_.value_or(options.size_hint_),
-             options.store_checksum_);
+  Initialize(dest_.get(), options);
 }
 
 template <typename Dest>
@@ -295,10 +465,7 @@ inline ZstdWriter<Dest>::ZstdWriter(Dest&& dest, Options options)
     : ZstdWriterBase(options.buffer_size_,
                      options.final_size_.value_or(options.size_hint_)),
       dest_(std::move(dest)) {
-  Initialize(dest_.get(), options.compression_level_, options.window_log_,
-             options.final_size_,
-             options.final_size_.value_or(options.size_hint_),
-             options.store_checksum_);
+  Initialize(dest_.get(), options);
 }
 
 template <typename Dest>
@@ -308,10 +475,7 @@ inline ZstdWriter<Dest>::ZstdWriter(std::tuple<DestArgs...> dest_args,
     : ZstdWriterBase(options.buffer_size_,
                      options.final_size_.value_or(options.size_hint_)),
       dest_(std::move(dest_args)) {
-  Initialize(dest_.get(), options.compression_level_, options.window_log_,
-             options.final_size_,
-             options.final_size_.value_or(options.size_hint_),
-             options.store_checksum_);
+  Initialize(dest_.get(), options);
 }
 
 template <typename Dest>
@@ -337,10 +501,7 @@ inline void ZstdWriter<Dest>::Reset(const Dest& dest, Options options) {
   ZstdWriterBase::Reset(options.buffer_size_,
                         options.final_size_.value_or(options.size_hint_));
   dest_.Reset(dest);
-  Initialize(dest_.get(), options.compression_level_, options.window_log_,
-             options.final_size_,
-             options.final_size_.value_or(options.size_hint_),
-             options.store_checksum_);
+  Initialize(dest_.get(), options);
 }
 
 template <typename Dest>
@@ -348,10 +509,7 @@ inline void ZstdWriter<Dest>::Reset(Dest&& dest, Options options) {
   ZstdWriterBase::Reset(options.buffer_size_,
                         options.final_size_.value_or(options.size_hint_));
   dest_.Reset(std::move(dest));
-  Initialize(dest_.get(), options.compression_level_, options.window_log_,
-             options.final_size_,
-             options.final_size_.value_or(options.size_hint_),
-             options.store_checksum_);
+  Initialize(dest_.get(), options);
 }
 
 template <typename Dest>
@@ -361,10 +519,7 @@ inline void ZstdWriter<Dest>::Reset(std::tuple<DestArgs...> dest_args,
   ZstdWriterBase::Reset(options.buffer_size_,
                         options.final_size_.value_or(options.size_hint_));
   dest_.Reset(std::move(dest_args));
-  Initialize(dest_.get(), options.compression_level_, options.window_log_,
-             options.final_size_,
-             options.final_size_.value_or(options.size_hint_),
-             options.store_checksum_);
+  Initialize(dest_.get(), options);
 }
 
 template <typename Dest>
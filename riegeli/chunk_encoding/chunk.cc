@@ -28,12 +28,18 @@
 namespace riegeli {
 
 ChunkHeader::ChunkHeader(const Chain& data, ChunkType chunk_type,
-                         uint64_t num_records, uint64_t decoded_data_size) {
+                         uint64_t num_records, uint64_t decoded_data_size)
+    : ChunkHeader(data, chunk_type, num_records, decoded_data_size,
+                  HashType::kHighwayHash) {}
+
+ChunkHeader::ChunkHeader(const Chain& data, ChunkType chunk_type,
+                         uint64_t num_records, uint64_t decoded_data_size,
+                         HashType hash_type) {
   RIEGELI_ASSERT_LE(num_records, kMaxNumRecords)
       << "Failed precondition of ChunkHeader::ChunkHeader(): "
          "number of records out of range";
   set_data_size(data.size());
-  set_data_hash(internal::Hash(data));
+  set_data_hash(internal::Hash(hash_type, data));
   set_chunk_type_and_num_records(chunk_type, num_records);
   set_decoded_data_size(decoded_data_size);
   set_header_hash(computed_header_hash());
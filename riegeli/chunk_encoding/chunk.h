@@ -33,8 +33,13 @@ class ChunkHeader {
  public:
   ChunkHeader() noexcept {}
 
+  // Computes `data_hash` with `hash_type`, which must match the hash type
+  // stored in the file signature. By default `HashType::kHighwayHash`.
   explicit ChunkHeader(const Chain& data, ChunkType chunk_type,
                        uint64_t num_records, uint64_t decoded_data_size);
+  explicit ChunkHeader(const Chain& data, ChunkType chunk_type,
+                       uint64_t num_records, uint64_t decoded_data_size,
+                       HashType hash_type);
 
   ChunkHeader(const ChunkHeader& that) noexcept {
     std::memcpy(words_, that.words_, sizeof(words_));
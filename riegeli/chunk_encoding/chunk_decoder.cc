@@ -17,23 +17,36 @@
 #include <stddef.h>
 #include <stdint.h>
 
+#include <limits>
+#include <memory>
+#include <string>
 #include <tuple>
 #include <utility>
 #include <vector>
 
 #include "absl/base/optimization.h"
+#include "absl/strings/match.h"
 #include "absl/strings/str_cat.h"
+#include "absl/strings/string_view.h"
 #include "google/protobuf/message_lite.h"
 #include "riegeli/base/base.h"
 #include "riegeli/base/canonical_errors.h"
 #include "riegeli/base/chain.h"
+#include "riegeli/base/memory.h"
+#include "riegeli/base/memory_estimator.h"
 #include "riegeli/base/status.h"
+#include "riegeli/base/tracing.h"
+#include "riegeli/bytes/array_backward_writer.h"
+#include "riegeli/bytes/backward_writer.h"
 #include "riegeli/bytes/chain_backward_writer.h"
 #include "riegeli/bytes/chain_reader.h"
 #include "riegeli/bytes/limiting_reader.h"
 #include "riegeli/bytes/message_parse.h"
 #include "riegeli/bytes/reader.h"
+#include "riegeli/bytes/reader_utils.h"
+#include "riegeli/bytes/zstd_dictionary.h"
 #include "riegeli/chunk_encoding/chunk.h"
+#include "riegeli/chunk_encoding/compiled_field_projection.h"
 #include "riegeli/chunk_encoding/constants.h"
 #include "riegeli/chunk_encoding/field_projection.h"
 #include "riegeli/chunk_encoding/simple_decoder.h"
@@ -41,38 +54,182 @@
 
 namespace riegeli {
 
+namespace {
+
+// The maximum size of the Zstd dictionary computed by
+// `ChunkDecoder::ChunkPrefix()`. This value is frozen in the file format.
+constexpr size_t kMaxChunkPrefixSize = size_t{256} << 10;
+
+// The magic number beginning a Zstd dictionary in the zstd dictionary format,
+// little endian. A chunk prefix beginning with it would not be used as raw
+// content.
+constexpr absl::string_view kZstdDictionaryMagic("\x37\xa4\x30\xec", 4);
+
+// Decoded data of a transposed chunk are decoded into a single preallocated
+// block only if their size, read from possibly corrupted data, is at most
+// `kMaxFlatDecodedSize` or at most `kMaxFlatDecodedRatio` times the size of
+// chunk data.
+constexpr uint64_t kMaxFlatDecodedSize = uint64_t{16} << 20;
+constexpr uint64_t kMaxFlatDecodedRatio = 64;
+
+// Returns `true` if `chunk` is a simple chunk with uncompressed record values.
+// Its records can be read in place from chunk data, seeking directly to any of
+// them.
+bool SimpleValuesUncompressed(const Chunk& chunk) {
+  if (chunk.header.chunk_type() != ChunkType::kSimple) return false;
+  ChainReader<> data_reader(&chunk.data);
+  uint8_t compression_type_byte;
+  return ReadByte(&data_reader, &compression_type_byte) &&
+         static_cast<CompressionType>(compression_type_byte) ==
+             CompressionType::kNone;
+}
+
+bool IsSimpleChunkType(ChunkType chunk_type) {
+  return chunk_type == ChunkType::kSimple ||
+         chunk_type == ChunkType::kSimpleWithBlocks ||
+         chunk_type == ChunkType::kSimpleWithReferences ||
+         chunk_type == ChunkType::kSimpleWithPrefix;
+}
+
+}  // namespace
+
+std::shared_ptr<const CompiledFieldProjection>
+ChunkDecoder::CompileFieldProjection(Options& options) {
+  if (options.compiled_field_projection_ != nullptr) {
+    return std::move(options.compiled_field_projection_);
+  }
+  if (options.field_projection_.includes_all()) {
+    // Share the projection including all fields, which is the most common.
+    static const NoDestructor<std::shared_ptr<const CompiledFieldProjection>>
+        kIncludeAll(std::make_shared<const CompiledFieldProjection>());
+    return *kIncludeAll;
+  }
+  return std::make_shared<const CompiledFieldProjection>(
+      options.field_projection_);
+}
+
 void ChunkDecoder::Done() { recoverable_ = false; }
 
 bool ChunkDecoder::Decode(const Chunk& chunk) {
+  return Decode(chunk, nullptr, nullptr);
+}
+
+bool ChunkDecoder::Decode(const Chunk& chunk,
+                          const Chain& shared_transpose_header) {
+  return Decode(chunk, &shared_transpose_header, nullptr);
+}
+
+bool ChunkDecoder::Decode(const Chunk& chunk,
+                          const Chain& shared_transpose_header,
+                          const ZstdDictionary& chunk_prefix) {
+  return Decode(chunk, &shared_transpose_header, &chunk_prefix);
+}
+
+bool ChunkDecoder::SharedTransposeHeaderDistance(const Chunk& chunk,
+                                                 uint64_t* distance) {
+  if (chunk.header.chunk_type() != ChunkType::kTransposedWithSharedHeader) {
+    return false;
+  }
+  ChainReader<> data_reader(&chunk.data);
+  return ReadVarint64(&data_reader, distance);
+}
+
+bool ChunkDecoder::ChunkPrefixDistance(const Chunk& chunk,
+                                       uint64_t* distance) {
+  if (chunk.header.chunk_type() != ChunkType::kSimpleWithPrefix) {
+    return false;
+  }
+  ChainReader<> data_reader(&chunk.data);
+  return ReadVarint64(&data_reader, distance);
+}
+
+bool ChunkDecoder::ChunkPrefix(const Chunk& chunk,
+                               const ZstdDictionary& zstd_dictionary,
+                               ZstdDictionary* chunk_prefix) {
+  if (chunk.header.chunk_type() != ChunkType::kSimple ||
+      chunk.header.num_records() == 0) {
+    return false;
+  }
+  ChainReader<> data_reader(&chunk.data);
+  SimpleDecoder simple_decoder;
+  std::vector<size_t> limits;
+  if (ABSL_PREDICT_FALSE(!simple_decoder.Decode(
+          &data_reader, chunk.header.chunk_type(), chunk.header.num_records(),
+          chunk.header.decoded_data_size(), zstd_dictionary, &limits))) {
+    return false;
+  }
+  const size_t values_size = limits.empty() ? size_t{0} : limits.back();
+  const size_t prefix_size = UnsignedMin(values_size, kMaxChunkPrefixSize);
+  std::string prefix;
+  if (ABSL_PREDICT_FALSE(
+          !simple_decoder.reader()->Skip(values_size - prefix_size)) ||
+      ABSL_PREDICT_FALSE(
+          !simple_decoder.reader()->Read(&prefix, prefix_size)) ||
+      ABSL_PREDICT_FALSE(!simple_decoder.VerifyEndAndClose())) {
+    return false;
+  }
+  if (absl::StartsWith(prefix, kZstdDictionaryMagic)) prefix.erase(0, 1);
+  *chunk_prefix = ZstdDictionary(std::move(prefix));
+  return true;
+}
+
+inline bool ChunkDecoder::Decode(const Chunk& chunk,
+                                 const Chain* shared_transpose_header,
+                                 const ZstdDictionary* chunk_prefix) {
+  const TraceScope trace("DecodeChunk");
   Clear();
   ChainReader<> data_reader(&chunk.data);
   if (ABSL_PREDICT_FALSE(chunk.header.num_records() > limits_.max_size())) {
     return Fail(ResourceExhaustedError("Too many records"));
   }
+  const bool project_records =
+      project_simple_chunks_ && !field_projection_->includes_all() &&
+      IsSimpleChunkType(chunk.header.chunk_type());
+  if (chunk.header.num_records() > 0 && !project_records &&
+      ((chunk.header.chunk_type() == ChunkType::kSimple &&
+        (chunk.header.decoded_data_size() >= streaming_threshold_ ||
+         SimpleValuesUncompressed(chunk))) ||
+       chunk.header.chunk_type() == ChunkType::kSimpleWithBlocks)) {
+    streaming_ = std::make_unique<Streaming>(chunk);
+    if (ABSL_PREDICT_FALSE(!StartStreaming())) {
+      limits_.clear();  // Ensure that `index() == num_records()`.
+      return false;
+    }
+    return true;
+  }
   Chain values;
-  if (ABSL_PREDICT_FALSE(!Parse(chunk.header, &data_reader, &values))) {
+  if (ABSL_PREDICT_FALSE(!Parse(chunk.header, shared_transpose_header,
+                                chunk_prefix,
+                                &data_reader, &values))) {
     limits_.clear();  // Ensure that `index() == num_records()`.
     return false;
   }
+  if (project_records) ProjectSimpleRecords(&values);
   RIEGELI_ASSERT_EQ(limits_.size(), chunk.header.num_records())
       << "Wrong number of record end positions";
   RIEGELI_ASSERT_EQ(limits_.empty() ? size_t{0} : limits_.back(), values.size())
       << "Wrong last record end position";
   if (chunk.header.num_records() == 0) {
     RIEGELI_ASSERT_EQ(values.size(), 0u) << "Wrong decoded data size";
-  } else if (field_projection_.includes_all()) {
+  } else if (field_projection_->includes_all()) {
     RIEGELI_ASSERT_EQ(values.size(), chunk.header.decoded_data_size())
         << "Wrong decoded data size";
   } else {
     RIEGELI_ASSERT_LE(values.size(), chunk.header.decoded_data_size())
         << "Wrong decoded data size";
   }
+  // Decompression can leave `values` fragmented into many small blocks, which
+  // would make `ReadRecord(absl::string_view*)` copy records spanning block
+  // boundaries. Coalesce them once here.
+  values.Compact();
   values_reader_.Reset(std::move(values));
   return true;
 }
 
-inline bool ChunkDecoder::Parse(const ChunkHeader& header, Reader* src,
-                                Chain* dest) {
+inline bool ChunkDecoder::Parse(const ChunkHeader& header,
+                                const Chain* shared_transpose_header,
+                                const ZstdDictionary* chunk_prefix,
+                                Reader* src, Chain* dest) {
   switch (header.chunk_type()) {
     case ChunkType::kFileSignature:
       if (ABSL_PREDICT_FALSE(header.data_size() != 0)) {
@@ -85,9 +242,11 @@ inline bool ChunkDecoder::Parse(const ChunkHeader& header, Reader* src,
             "Invalid file signature chunk: number of records is not zero: ",
             header.num_records())));
       }
-      if (ABSL_PREDICT_FALSE(header.decoded_data_size() != 0)) {
+      // `decoded_data_size` stores the hash type, verified by `ChunkReader`.
+      if (ABSL_PREDICT_FALSE(header.decoded_data_size() >
+                             static_cast<uint64_t>(kMaxHashType))) {
         return Fail(DataLossError(absl::StrCat(
-            "Invalid file signature chunk: decoded data size is not zero: ",
+            "Invalid file signature chunk: unknown hash type: ",
             header.decoded_data_size())));
       }
       return true;
@@ -110,18 +269,60 @@ inline bool ChunkDecoder::Parse(const ChunkHeader& header, Reader* src,
             header.decoded_data_size())));
       }
       return true;
-    case ChunkType::kSimple: {
+    case ChunkType::kIndex:
+      if (ABSL_PREDICT_FALSE(header.num_records() != 0)) {
+        return Fail(DataLossError(absl::StrCat(
+            "Invalid index chunk: number of records is not zero: ",
+            header.num_records())));
+      }
+      return true;
+    case ChunkType::kDictionary:
+      if (ABSL_PREDICT_FALSE(header.num_records() != 0)) {
+        return Fail(DataLossError(absl::StrCat(
+            "Invalid dictionary chunk: number of records is not zero: ",
+            header.num_records())));
+      }
+      return true;
+    case ChunkType::kStatistics:
+      if (ABSL_PREDICT_FALSE(header.num_records() != 0)) {
+        return Fail(DataLossError(absl::StrCat(
+            "Invalid statistics chunk: number of records is not zero: ",
+            header.num_records())));
+      }
+      return true;
+    case ChunkType::kKeyFilters:
+      if (ABSL_PREDICT_FALSE(header.num_records() != 0)) {
+        return Fail(DataLossError(absl::StrCat(
+            "Invalid key filter chunk: number of records is not zero: ",
+            header.num_records())));
+      }
+      return true;
+    case ChunkType::kFirstKeys:
+      if (ABSL_PREDICT_FALSE(header.num_records() != 0)) {
+        return Fail(DataLossError(absl::StrCat(
+            "Invalid first key chunk: number of records is not zero: ",
+            header.num_records())));
+      }
+      return true;
+    case ChunkType::kSharedTransposeHeader:
+      if (ABSL_PREDICT_FALSE(header.num_records() != 0)) {
+        return Fail(DataLossError(absl::StrCat(
+            "Invalid shared transposition header chunk: "
+            "number of records is not zero: ",
+            header.num_records())));
+      }
+      return true;
+    case ChunkType::kSimple:
+    case ChunkType::kSimpleWithBlocks:
+    case ChunkType::kSimpleWithReferences: {
       SimpleDecoder simple_decoder;
-      if (ABSL_PREDICT_FALSE(!simple_decoder.Decode(src, header.num_records(),
-                                                    header.decoded_data_size(),
-                                                    &limits_))) {
+      if (ABSL_PREDICT_FALSE(!simple_decoder.Decode(
+              src, header.chunk_type(), header.num_records(),
+              header.decoded_data_size(), zstd_dictionary_, &limits_))) {
         return Fail(simple_decoder);
       }
-      dest->Clear();
-      if (ABSL_PREDICT_FALSE(!simple_decoder.reader()->Read(
-              dest, IntCast<size_t>(header.decoded_data_size())))) {
-        return Fail(*simple_decoder.reader(),
-                    DataLossError("Reading record values failed"));
+      if (ABSL_PREDICT_FALSE(!simple_decoder.ReadValues(limits_, dest))) {
+        return Fail(simple_decoder);
       }
       if (ABSL_PREDICT_FALSE(!simple_decoder.VerifyEndAndClose())) {
         return Fail(simple_decoder);
@@ -129,22 +330,46 @@ inline bool ChunkDecoder::Parse(const ChunkHeader& header, Reader* src,
       if (ABSL_PREDICT_FALSE(!src->VerifyEndAndClose())) return Fail(*src);
       return true;
     }
-    case ChunkType::kTransposed: {
-      TransposeDecoder transpose_decoder;
-      dest->Clear();
-      ChainBackwardWriter<> dest_writer(
-          dest,
-          ChainBackwardWriterBase::Options().set_size_hint(
-              field_projection_.includes_all() ? header.decoded_data_size()
-                                               : uint64_t{0}));
-      const bool ok = transpose_decoder.Decode(
-          src, header.num_records(), header.decoded_data_size(),
-          field_projection_, &dest_writer, &limits_);
-      if (ABSL_PREDICT_FALSE(!dest_writer.Close())) return Fail(dest_writer);
-      if (ABSL_PREDICT_FALSE(!ok)) return Fail(transpose_decoder);
+    case ChunkType::kSimpleWithPrefix: {
+      uint64_t distance;
+      if (ABSL_PREDICT_FALSE(!ReadVarint64(src, &distance))) {
+        return Fail(*src,
+                    DataLossError("Reading chunk prefix distance failed"));
+      }
+      if (ABSL_PREDICT_FALSE(chunk_prefix == nullptr ||
+                             chunk_prefix->empty())) {
+        return Fail(DataLossError("Missing chunk prefix"));
+      }
+      SimpleDecoder simple_decoder;
+      if (ABSL_PREDICT_FALSE(!simple_decoder.Decode(
+              src, ChunkType::kSimple, header.num_records(),
+              header.decoded_data_size(), *chunk_prefix, &limits_))) {
+        return Fail(simple_decoder);
+      }
+      if (ABSL_PREDICT_FALSE(!simple_decoder.ReadValues(limits_, dest))) {
+        return Fail(simple_decoder);
+      }
+      if (ABSL_PREDICT_FALSE(!simple_decoder.VerifyEndAndClose())) {
+        return Fail(simple_decoder);
+      }
       if (ABSL_PREDICT_FALSE(!src->VerifyEndAndClose())) return Fail(*src);
       return true;
     }
+    case ChunkType::kTransposed:
+    case ChunkType::kTransposedWithBufferEncodings:
+      return ParseTransposed(header, nullptr, src, dest);
+    case ChunkType::kTransposedWithSharedHeader: {
+      uint64_t distance;
+      if (ABSL_PREDICT_FALSE(!ReadVarint64(src, &distance))) {
+        return Fail(*src,
+                    DataLossError("Reading shared header distance failed"));
+      }
+      if (ABSL_PREDICT_FALSE(shared_transpose_header == nullptr ||
+                             shared_transpose_header->empty())) {
+        return Fail(DataLossError("Missing shared transposition header"));
+      }
+      return ParseTransposed(header, shared_transpose_header, src, dest);
+    }
   }
   if (header.num_records() == 0) {
     // Ignore chunks with no records, even if the type is unknown.
@@ -154,19 +379,98 @@ inline bool ChunkDecoder::Parse(const ChunkHeader& header, Reader* src,
       "Unknown chunk type: ", static_cast<uint64_t>(header.chunk_type()))));
 }
 
+inline void ChunkDecoder::ProjectSimpleRecords(Chain* values) {
+  const TraceScope trace("ProjectSimpleRecords");
+  ChainReader<> values_reader(values);
+  std::string projected;
+  size_t begin = 0;
+  for (size_t& limit : limits_) {
+    absl::string_view record;
+    if (!values_reader.Read(&record, limit - begin)) {
+      RIEGELI_ASSERT_UNREACHABLE()
+          << "Reading record values failed: " << values_reader.status();
+    }
+    begin = limit;
+    if (!field_projection_->ProjectRecord(record, &projected)) {
+      // Not a serialized message. Keep the record unchanged.
+      projected.append(record.data(), record.size());
+    }
+    limit = projected.size();
+  }
+  values->Clear();
+  values->Append(std::move(projected));
+}
+
+inline bool ChunkDecoder::ParseTransposed(
+    const ChunkHeader& header, const Chain* shared_transpose_header,
+    Reader* src, Chain* dest) {
+  const auto decode = [&](BackwardWriter* dest_writer) {
+    if (shared_transpose_header != nullptr) {
+      return transpose_decoder_.Decode(
+          *shared_transpose_header, src, header.num_records(),
+          header.decoded_data_size(), *field_projection_, zstd_dictionary_,
+          dest_writer, &limits_);
+    }
+    if (header.chunk_type() == ChunkType::kTransposedWithBufferEncodings) {
+      return transpose_decoder_.DecodeWithBufferEncodings(
+          src, header.num_records(), header.decoded_data_size(),
+          *field_projection_, zstd_dictionary_, dest_writer, &limits_);
+    }
+    return transpose_decoder_.Decode(src, header.num_records(),
+                                     header.decoded_data_size(),
+                                     *field_projection_, zstd_dictionary_,
+                                     dest_writer, &limits_);
+  };
+  dest->Clear();
+  if (field_projection_->includes_all() &&
+      header.decoded_data_size() <= std::numeric_limits<size_t>::max() &&
+      (header.decoded_data_size() <= kMaxFlatDecodedSize ||
+       header.decoded_data_size() / kMaxFlatDecodedRatio <=
+           header.data_size())) {
+    // The size of decoded data is known, so it is decoded into a single
+    // preallocated block. This avoids `PushSlow()` calls, and records never
+    // straddle block boundaries, so reading them does not copy.
+    ArrayBackwardWriter<> dest_writer(
+        dest->AppendFixedBuffer(IntCast<size_t>(header.decoded_data_size())));
+    const bool ok = decode(&dest_writer);
+    if (ABSL_PREDICT_FALSE(!dest_writer.Close())) return Fail(dest_writer);
+    if (ABSL_PREDICT_FALSE(!ok)) return Fail(transpose_decoder_);
+  } else {
+    ChainBackwardWriter<> dest_writer(dest);
+    const bool ok = decode(&dest_writer);
+    if (ABSL_PREDICT_FALSE(!dest_writer.Close())) return Fail(dest_writer);
+    if (ABSL_PREDICT_FALSE(!ok)) return Fail(transpose_decoder_);
+  }
+  if (ABSL_PREDICT_FALSE(!src->VerifyEndAndClose())) return Fail(*src);
+  return true;
+}
+
 bool ChunkDecoder::ReadRecord(google::protobuf::MessageLite* record) {
+  SyncRecordReader();
   if (ABSL_PREDICT_FALSE(!healthy() || index() == num_records())) return false;
-  const size_t start = IntCast<size_t>(values_reader_.pos());
+  Reader& values = values_reader();
+  const size_t start = IntCast<size_t>(values.pos() - values_base_);
   const size_t limit = limits_[IntCast<size_t>(index_)];
   RIEGELI_ASSERT_LE(start, limit)
       << "Failed invariant of ChunkDecoder: record end positions not sorted";
   {
-    Status status = ParseFromReader<LimitingReader<>>(
-        record, std::forward_as_tuple(&values_reader_, limit));
+    Status status;
+    if (values.available() >= limit - start) {
+      // The record is flat in the current buffer of `values`. Parse it
+      // directly, without wrapping `values` in a `LimitingReader`.
+      status = ParseFromString(
+          record, absl::string_view(values.cursor(), limit - start));
+      if (ABSL_PREDICT_TRUE(status.ok())) {
+        values.set_cursor(values.cursor() + (limit - start));
+      }
+    } else {
+      status = ParseFromReader<LimitingReader<>>(
+          record, std::forward_as_tuple(&values, values_base_ + limit));
+      if (ABSL_PREDICT_FALSE(!values.healthy())) return FailReading(values);
+    }
     if (ABSL_PREDICT_FALSE(!status.ok())) {
-      if (!values_reader_.Seek(limit)) {
-        RIEGELI_ASSERT_UNREACHABLE()
-            << "Seeking record values failed: " << values_reader_.status();
+      if (ABSL_PREDICT_FALSE(!values.Seek(values_base_ + limit))) {
+        return FailReading(values);
       }
       recoverable_ = true;
       return Fail(std::move(status));
@@ -176,6 +480,104 @@ bool ChunkDecoder::ReadRecord(google::protobuf::MessageLite* record) {
   return true;
 }
 
+bool ChunkDecoder::StartStreaming() {
+  RIEGELI_ASSERT(streaming_ != nullptr)
+      << "Failed precondition of ChunkDecoder::StartStreaming(): "
+         "chunk not decompressed incrementally";
+  if (!streaming_->data_reader.Seek(0)) {
+    RIEGELI_ASSERT_UNREACHABLE() << "Seeking chunk data failed: "
+                                 << streaming_->data_reader.status();
+  }
+  if (ABSL_PREDICT_FALSE(!streaming_->simple_decoder.Decode(
+          &streaming_->data_reader, streaming_->header.chunk_type(),
+          streaming_->header.num_records(),
+          streaming_->header.decoded_data_size(), zstd_dictionary_,
+          &limits_))) {
+    return Fail(streaming_->simple_decoder);
+  }
+  values_base_ = streaming_->simple_decoder.reader()->pos();
+  return true;
+}
+
+void ChunkDecoder::SeekStreaming(size_t start) {
+  Reader* values = streaming_->simple_decoder.reader();
+  if (start < values->pos() - values_base_ &&
+      !values->SupportsRandomAccess()) {
+    // Decompressed data cannot be read backwards. Decompress the chunk again.
+    if (ABSL_PREDICT_FALSE(!StartStreaming())) return;
+    values = streaming_->simple_decoder.reader();
+  }
+  if (ABSL_PREDICT_FALSE(!values->Seek(values_base_ + start))) {
+    FailReading(*values);
+  }
+}
+
+size_t ChunkDecoder::EstimateMemory() const {
+  MemoryEstimator memory_estimator;
+  memory_estimator.RegisterMemory(sizeof(ChunkDecoder));
+  RegisterSubobjects(&memory_estimator);
+  return memory_estimator.TotalMemory();
+}
+
+void ChunkDecoder::RegisterSubobjects(MemoryEstimator* memory_estimator) const {
+  transpose_decoder_.RegisterSubobjects(memory_estimator);
+  memory_estimator->RegisterDynamicMemory(limits_.capacity() * sizeof(size_t));
+  values_reader_.src().RegisterSubobjects(memory_estimator);
+  if (streaming_ != nullptr) {
+    memory_estimator->RegisterDynamicMemory(sizeof(Streaming));
+    streaming_->data_reader.src().RegisterSubobjects(memory_estimator);
+  }
+  memory_estimator->RegisterDynamicMemory(record_views_.capacity() *
+                                          sizeof(absl::string_view));
+}
+
+DecodedChunk ChunkDecoder::DecodeStreaming() const {
+  DecodedChunk decoded_chunk;
+  ChainReader<> data_reader(&streaming_->data_reader.src());
+  SimpleDecoder simple_decoder;
+  if (ABSL_PREDICT_FALSE(!simple_decoder.Decode(
+          &data_reader, streaming_->header.chunk_type(),
+          streaming_->header.num_records(),
+          streaming_->header.decoded_data_size(), zstd_dictionary_,
+          &decoded_chunk.limits))) {
+    decoded_chunk.limits.clear();
+    return decoded_chunk;
+  }
+  if (ABSL_PREDICT_FALSE(!simple_decoder.reader()->Read(
+          &decoded_chunk.values,
+          IntCast<size_t>(streaming_->header.decoded_data_size())))) {
+    // Keep only records whose values were decompressed.
+    while (!decoded_chunk.limits.empty() &&
+           decoded_chunk.limits.back() > decoded_chunk.values.size()) {
+      decoded_chunk.limits.pop_back();
+    }
+    decoded_chunk.values.RemoveSuffix(
+        decoded_chunk.values.size() -
+        (decoded_chunk.limits.empty() ? size_t{0}
+                                      : decoded_chunk.limits.back()));
+  }
+  return decoded_chunk;
+}
+
+void ChunkDecoder::CloseRecordReader() {
+  record_reader_active_ = false;
+  record_reader_.Close();
+  if (ABSL_PREDICT_FALSE(!healthy())) return;
+  Reader& values = values_reader();
+  if (ABSL_PREDICT_FALSE(!values.healthy())) {
+    FailReading(values);
+    return;
+  }
+  // Skip the rest of the record if it was not read to its end.
+  SetIndex(index_);
+}
+
+bool ChunkDecoder::FailReading(const Reader& values) {
+  RIEGELI_ASSERT(streaming_ != nullptr)
+      << "Failed reading record from values reader: " << values.status();
+  return Fail(values, DataLossError("Reading record values failed"));
+}
+
 bool ChunkDecoder::Recover() {
   if (!recoverable_) return false;
   RIEGELI_ASSERT(!healthy()) << "Failed invariant of ChunkDecoder: "
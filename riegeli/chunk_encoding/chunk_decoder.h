@@ -18,6 +18,8 @@
 #include <stddef.h>
 #include <stdint.h>
 
+#include <limits>
+#include <memory>
 #include <string>
 #include <tuple>
 #include <utility>
@@ -25,19 +27,38 @@
 
 #include "absl/base/optimization.h"
 #include "absl/strings/string_view.h"
+#include "absl/types/span.h"
 #include "google/protobuf/message_lite.h"
 #include "riegeli/base/base.h"
 #include "riegeli/base/chain.h"
+#include "riegeli/base/memory_estimator.h"
 #include "riegeli/base/object.h"
 #include "riegeli/base/resetter.h"
 #include "riegeli/base/status.h"
 #include "riegeli/bytes/chain_reader.h"
+#include "riegeli/bytes/limiting_reader.h"
 #include "riegeli/bytes/reader.h"
+#include "riegeli/bytes/zstd_dictionary.h"
 #include "riegeli/chunk_encoding/chunk.h"
+#include "riegeli/chunk_encoding/compiled_field_projection.h"
 #include "riegeli/chunk_encoding/field_projection.h"
+#include "riegeli/chunk_encoding/simple_decoder.h"
+#include "riegeli/chunk_encoding/transpose_decoder.h"
 
 namespace riegeli {
 
+// Records of a decoded chunk, in a form which can be shared between
+// `ChunkDecoder`s, e.g. by a cache of decoded chunks.
+struct DecodedChunk {
+  // Registers subobjects with `MemoryEstimator`.
+  void RegisterSubobjects(MemoryEstimator* memory_estimator) const;
+
+  // Concatenated records.
+  Chain values;
+  // End positions of records in `values`, sorted.
+  std::vector<size_t> limits;
+};
+
 class ChunkDecoder : public Object {
  public:
   class Options {
@@ -55,10 +76,104 @@ class ChunkDecoder : public Object {
       return std::move(set_field_projection(std::move(field_projection)));
     }
 
+    // Like `set_field_projection()`, but takes the projection already compiled,
+    // so that `ChunkDecoder`s created for many chunks share it instead of
+    // compiling it again. If not `nullptr`, this overrides
+    // `set_field_projection()`.
+    //
+    // Default: `nullptr`
+    Options& set_compiled_field_projection(
+        std::shared_ptr<const CompiledFieldProjection>
+            compiled_field_projection) & {
+      compiled_field_projection_ = std::move(compiled_field_projection);
+      return *this;
+    }
+    Options&& set_compiled_field_projection(
+        std::shared_ptr<const CompiledFieldProjection>
+            compiled_field_projection) && {
+      return std::move(
+          set_compiled_field_projection(std::move(compiled_field_projection)));
+    }
+
+    // If `true`, the field projection is applied also to records of simple
+    // chunks, by parsing each record as a serialized message, so that they
+    // contain the same fields as transposed records would. Records which are
+    // not valid serialized messages are returned unchanged.
+    //
+    // This makes reading simple chunks with a projection slower, but the
+    // returned records smaller.
+    //
+    // Default: `false`
+    Options& set_project_simple_chunks(bool project_simple_chunks) & {
+      project_simple_chunks_ = project_simple_chunks;
+      return *this;
+    }
+    Options&& set_project_simple_chunks(bool project_simple_chunks) && {
+      return std::move(set_project_simple_chunks(project_simple_chunks));
+    }
+
+    // Zstd dictionary used for chunks compressed with Zstd. This must be the
+    // dictionary stored in the dictionary chunk of the file, if any.
+    //
+    // Default: `ZstdDictionary()` (no dictionary)
+    Options& set_zstd_dictionary(ZstdDictionary zstd_dictionary) & {
+      zstd_dictionary_ = std::move(zstd_dictionary);
+      return *this;
+    }
+    Options&& set_zstd_dictionary(ZstdDictionary zstd_dictionary) && {
+      return std::move(set_zstd_dictionary(std::move(zstd_dictionary)));
+    }
+
+    // Sets the decoded data size of a simple chunk from which its records are
+    // decompressed incrementally while they are read, instead of by
+    // `Decode()`.
+    //
+    // This bounds memory used by chunks with a large decoded data size and
+    // makes their first record available sooner. The chunk's compressed data
+    // are kept instead, `SetIndex()` backwards decompresses the chunk again
+    // unless decompressed data support random access, and `decoded_chunk()`
+    // decompresses the whole chunk.
+    //
+    // Simple chunks with uncompressed record values are always read in place
+    // from the chunk data, so that `SetIndex()` jumps directly to any record
+    // without reading the preceding ones. Simple chunks with record values
+    // compressed in blocks are always decompressed incrementally, block by
+    // block, so that `SetIndex()` decompresses only the block containing the
+    // record.
+    //
+    // Default: `std::numeric_limits<uint64_t>::max()` (never)
+    Options& set_streaming_threshold(uint64_t streaming_threshold) & {
+      streaming_threshold_ = streaming_threshold;
+      return *this;
+    }
+    Options&& set_streaming_threshold(uint64_t streaming_threshold) && {
+      return std::move(set_streaming_threshold(streaming_threshold));
+    }
+
+    // Sets bounds on resources spent on decoding a transposed chunk, so that
+    // decoding an untrusted chunk which would be expensive fails early.
+    //
+    // Default: `TransposeDecoder::ResourceLimits()` (no limits)
+    Options& set_transpose_resource_limits(
+        const TransposeDecoder::ResourceLimits& transpose_resource_limits) & {
+      transpose_resource_limits_ = transpose_resource_limits;
+      return *this;
+    }
+    Options&& set_transpose_resource_limits(
+        const TransposeDecoder::ResourceLimits& transpose_resource_limits) && {
+      return std::move(
+          set_transpose_resource_limits(transpose_resource_limits));
+    }
+
    private:
     friend class ChunkDecoder;
 
     FieldProjection field_projection_ = FieldProjection::All();
+    std::shared_ptr<const CompiledFieldProjection> compiled_field_projection_;
+    bool project_simple_chunks_ = false;
+    ZstdDictionary zstd_dictionary_;
+    uint64_t streaming_threshold_ = std::numeric_limits<uint64_t>::max();
+    TransposeDecoder::ResourceLimits transpose_resource_limits_;
   };
 
   // Creates an empty `ChunkDecoder`.
@@ -81,6 +196,65 @@ class ChunkDecoder : public Object {
   //  * `false` - failure (`!healthy()`)
   bool Decode(const Chunk& chunk);
 
+  // Like `Decode()` above, but a chunk of type
+  // `ChunkType::kTransposedWithSharedHeader` is decoded using
+  // `shared_transpose_header`, which should be the data of the
+  // `ChunkType::kSharedTransposeHeader` chunk it refers to (see
+  // `SharedTransposeHeaderDistance()`).
+  bool Decode(const Chunk& chunk, const Chain& shared_transpose_header);
+
+  // Like `Decode()` above, but also a chunk of type
+  // `ChunkType::kSimpleWithPrefix` is decoded using `chunk_prefix`, which
+  // should be computed by `ChunkPrefix()` from the chunk it refers to (see
+  // `ChunkPrefixDistance()`).
+  bool Decode(const Chunk& chunk, const Chain& shared_transpose_header,
+              const ZstdDictionary& chunk_prefix);
+
+  // For a chunk of type `ChunkType::kTransposedWithSharedHeader`, reads the
+  // distance from the beginning of the `ChunkType::kSharedTransposeHeader`
+  // chunk it refers to, to the beginning of this chunk.
+  //
+  // Return values:
+  //  * `true`  - success (`*distance` is set)
+  //  * `false` - the chunk is not of this type or its data are corrupted
+  static bool SharedTransposeHeaderDistance(const Chunk& chunk,
+                                            uint64_t* distance);
+
+  // For a chunk of type `ChunkType::kSimpleWithPrefix`, reads the distance from
+  // the beginning of the `ChunkType::kSimple` chunk whose records it is
+  // compressed against, to the beginning of this chunk.
+  //
+  // Return values:
+  //  * `true`  - success (`*distance` is set)
+  //  * `false` - the chunk is not of this type or its data are corrupted
+  static bool ChunkPrefixDistance(const Chunk& chunk, uint64_t* distance);
+
+  // Computes the Zstd dictionary with which chunks of type
+  // `ChunkType::kSimpleWithPrefix` referring to `chunk` are compressed: raw
+  // content made of the last records of `chunk`, which must be of type
+  // `ChunkType::kSimple`. `zstd_dictionary` is used if `chunk` is compressed
+  // with Zstd.
+  //
+  // Return values:
+  //  * `true`  - success (`*chunk_prefix` is set)
+  //  * `false` - the chunk is not of this type or its data are corrupted
+  static bool ChunkPrefix(const Chunk& chunk,
+                          const ZstdDictionary& zstd_dictionary,
+                          ZstdDictionary* chunk_prefix);
+
+  // Returns all records of the decoded chunk, sharing their data with `*this`.
+  //
+  // If the chunk is decompressed incrementally
+  // (`Options::set_streaming_threshold()`), this decompresses it again, and
+  // omits records which cannot be decompressed.
+  //
+  // Precondition: `healthy()`
+  DecodedChunk decoded_chunk() const;
+
+  // Resets the `ChunkDecoder` to records of a chunk decoded before, e.g. by a
+  // `ChunkDecoder` with the same options. Keeps options unchanged.
+  void SetDecodedChunk(const DecodedChunk& decoded_chunk);
+
   // Reads the next record.
   //
   // `ReadRecord(google::protobuf::MessageLite*)` parses raw bytes to a proto
@@ -100,6 +274,44 @@ class ChunkDecoder : public Object {
   bool ReadRecord(std::string* record);
   bool ReadRecord(Chain* record);
 
+  // Reads the next record as a stream: `*record` is set to a `Reader` of the
+  // record contents, which is valid until the next non-const operation on this
+  // `ChunkDecoder`. The `Reader` must not be closed.
+  //
+  // If the record is not read to its end, the rest of it is skipped by the
+  // next operation. Positions of the `Reader` begin at an unspecified offset,
+  // so only their differences are meaningful.
+  //
+  // The record is not held in memory at once if the chunk is decompressed
+  // incrementally (`Options::set_streaming_threshold()`).
+  //
+  // Return values:
+  //  * `true`                      - success (`*record` is set, `healthy()`)
+  //  * `false` (when `healthy()`)  - chunk ends
+  //  * `false` (when `!healthy()`) - failure
+  bool ReadRecord(Reader** record);
+
+  // Reads up to `max_num_records` next records, all remaining records of the
+  // chunk by default.
+  //
+  // For `ReadRecords(absl::Span<const absl::string_view>*)` the array and the
+  // `absl::string_view`s are valid until the next non-const operation on this
+  // `ChunkDecoder`. Records are read as a single contiguous range, which
+  // requires copying them unless the range is already contiguous in memory.
+  // For `ReadRecords(std::vector<Chain>*)` existing elements of `*records` are
+  // reused.
+  //
+  // Return values:
+  //  * `true`                      - success (`*records` is set to at least
+  //                                  one record, `healthy()`)
+  //  * `false` (when `healthy()`)  - chunk ends
+  //  * `false` (when `!healthy()`) - failure
+  bool ReadRecords(
+      absl::Span<const absl::string_view>* records,
+      size_t max_num_records = std::numeric_limits<size_t>::max());
+  bool ReadRecords(std::vector<Chain>* records,
+                   size_t max_num_records = std::numeric_limits<size_t>::max());
+
   // If `!healthy()` and the failure was caused by an unparsable message, then
   // `Recover()` allows reading again by skipping the unparsable message.
   //
@@ -118,27 +330,113 @@ class ChunkDecoder : public Object {
   //
   // If `index > num_records()`, the current index is set to `num_records()`.
   //
+  // Record values preceding `index` are not read if they can be skipped by
+  // seeking, e.g. in a simple chunk with uncompressed record values.
+  //
   // Precondition: `healthy()`
   void SetIndex(uint64_t index);
 
   // Returns the number of records. Unchanged by `Close()`.
   uint64_t num_records() const { return IntCast<uint64_t>(limits_.size()); }
 
+  // Estimates the amount of memory used by this `ChunkDecoder`, including
+  // decoded records and storage kept for decoding later chunks.
+  size_t EstimateMemory() const;
+  // Registers this `ChunkDecoder` with `MemoryEstimator`.
+  void RegisterSubobjects(MemoryEstimator* memory_estimator) const;
+
  protected:
   void Done() override;
 
  private:
-  bool Parse(const ChunkHeader& header, Reader* src, Chain* dest);
+  // State of a simple chunk decompressed incrementally.
+  struct Streaming {
+    explicit Streaming(const Chunk& chunk)
+        : header(chunk.header), data_reader(chunk.data) {}
+
+    ChunkHeader header;
+    ChainReader<Chain> data_reader;
+    // Reads from `data_reader`.
+    SimpleDecoder simple_decoder;
+  };
+
+  bool Decode(const Chunk& chunk, const Chain* shared_transpose_header,
+              const ZstdDictionary* chunk_prefix);
+
+  bool Parse(const ChunkHeader& header, const Chain* shared_transpose_header,
+             const ZstdDictionary* chunk_prefix, Reader* src, Chain* dest);
 
-  FieldProjection field_projection_;
+  // Implements `Parse()` for transposed chunks, with `shared_transpose_header`
+  // being `nullptr` for `ChunkType::kTransposed` and
+  // `ChunkType::kTransposedWithBufferEncodings`.
+  bool ParseTransposed(const ChunkHeader& header,
+                       const Chain* shared_transpose_header, Reader* src,
+                       Chain* dest);
+
+  // Starts decompressing `*streaming_` from the beginning.
+  //
+  // Return values:
+  //  * `true`  - success (`healthy()`)
+  //  * `false` - failure (`!healthy()`)
+  bool StartStreaming();
+
+  // Implements `SetIndex()` if `streaming_ != nullptr`.
+  void SeekStreaming(size_t start);
+
+  // Implements `decoded_chunk()` if `streaming_ != nullptr`.
+  DecodedChunk DecodeStreaming() const;
+
+  // Fails `*this` after reading from `values` failed, which is possible only
+  // if `streaming_ != nullptr`.
+  bool FailReading(const Reader& values);
+
+  // Returns the `Reader` of concatenated record values.
+  Reader& values_reader();
+
+  // If a record is read by `ReadRecord(Reader**)`, closes its `Reader` and
+  // skips the rest of the record.
+  void SyncRecordReader();
+  void CloseRecordReader();
+
+  // Returns `options.compiled_field_projection_`, or compiles
+  // `options.field_projection_`.
+  static std::shared_ptr<const CompiledFieldProjection> CompileFieldProjection(
+      Options& options);
+
+  // Applies `*field_projection_` to records of a simple chunk in `*values`,
+  // updating `limits_`.
+  void ProjectSimpleRecords(Chain* values);
+
+  // Invariant: `field_projection_ != nullptr`
+  std::shared_ptr<const CompiledFieldProjection> field_projection_;
+  bool project_simple_chunks_ = false;
+  ZstdDictionary zstd_dictionary_;
+  uint64_t streaming_threshold_ = std::numeric_limits<uint64_t>::max();
+  // Decoder of transposed chunks, kept between chunks to reuse its storage.
+  TransposeDecoder transpose_decoder_;
   // Invariants if `healthy()`:
   //   `limits_` are sorted
-  //   `(limits_.empty() ? 0 : limits_.back())` == size of `values_reader_`
-  //   `(index_ == 0 ? 0 : limits_[index_ - 1]) == values_reader_.pos()`
+  //   `(limits_.empty() ? 0 : limits_.back())` == size of record values
+  //   `(index_ == 0 ? 0 : limits_[index_ - 1]) ==
+  //       values_reader().pos() - values_base_`
   std::vector<size_t> limits_;
+  // Record values if `streaming_ == nullptr`.
   ChainReader<Chain> values_reader_;
+  // If not `nullptr`, record values are read from
+  // `streaming_->simple_decoder.reader()` instead of `values_reader_`.
+  std::unique_ptr<Streaming> streaming_;
+  // Position of `values_reader()` where record values begin.
+  Position values_base_ = 0;
   // Invariant: if `healthy()` then `index_ <= num_records()`
   uint64_t index_ = 0;
+  // Storage of records returned by
+  // `ReadRecords(absl::Span<const absl::string_view>*)`.
+  std::vector<absl::string_view> record_views_;
+  // The record returned by `ReadRecord(Reader**)`, reading from
+  // `values_reader()` up to the end of the record at `index_ - 1`.
+  LimitingReader<> record_reader_;
+  // Whether `record_reader_` is in use.
+  bool record_reader_active_ = false;
   // Whether `Recover()` is applicable.
   //
   // Invariant: if `recoverable_` then `!healthy()`
@@ -149,96 +447,247 @@ class ChunkDecoder : public Object {
 
 inline ChunkDecoder::ChunkDecoder(Options options)
     : Object(kInitiallyOpen),
-      field_projection_(std::move(options.field_projection_)),
-      values_reader_(std::forward_as_tuple()) {}
+      field_projection_(CompileFieldProjection(options)),
+      project_simple_chunks_(options.project_simple_chunks_),
+      zstd_dictionary_(std::move(options.zstd_dictionary_)),
+      streaming_threshold_(options.streaming_threshold_),
+      values_reader_(std::forward_as_tuple()) {
+  transpose_decoder_.set_resource_limits(options.transpose_resource_limits_);
+}
 
+// `that.SyncRecordReader()` is called first, because `that.record_reader_`
+// cannot be moved together with `that.values_reader_`.
 inline ChunkDecoder::ChunkDecoder(ChunkDecoder&& that) noexcept
-    : Object(std::move(that)),
-      field_projection_(std::move(that.field_projection_)),
+    : Object((that.SyncRecordReader(), std::move(that))),
+      field_projection_(that.field_projection_),
+      project_simple_chunks_(that.project_simple_chunks_),
+      zstd_dictionary_(std::move(that.zstd_dictionary_)),
+      streaming_threshold_(that.streaming_threshold_),
+      transpose_decoder_(std::move(that.transpose_decoder_)),
       limits_(std::move(that.limits_)),
       values_reader_(std::move(that.values_reader_)),
+      streaming_(std::move(that.streaming_)),
+      values_base_(std::exchange(that.values_base_, 0)),
       index_(that.index_),
       recoverable_(std::exchange(that.recoverable_, false)) {}
 
 inline ChunkDecoder& ChunkDecoder::operator=(ChunkDecoder&& that) noexcept {
+  that.SyncRecordReader();
+  record_reader_.Reset();
+  record_reader_active_ = false;
   Object::operator=(std::move(that));
-  field_projection_ = std::move(that.field_projection_);
+  field_projection_ = that.field_projection_;
+  project_simple_chunks_ = that.project_simple_chunks_;
+  zstd_dictionary_ = std::move(that.zstd_dictionary_);
+  streaming_threshold_ = that.streaming_threshold_;
+  transpose_decoder_ = std::move(that.transpose_decoder_);
   limits_ = std::move(that.limits_);
   values_reader_ = std::move(that.values_reader_);
+  streaming_ = std::move(that.streaming_);
+  values_base_ = std::exchange(that.values_base_, 0);
   index_ = that.index_;
   recoverable_ = std::exchange(that.recoverable_, false);
   return *this;
 }
 
 inline void ChunkDecoder::Reset(Options options) {
-  field_projection_ = std::move(options.field_projection_);
+  field_projection_ = CompileFieldProjection(options);
+  project_simple_chunks_ = options.project_simple_chunks_;
+  zstd_dictionary_ = std::move(options.zstd_dictionary_);
+  streaming_threshold_ = options.streaming_threshold_;
+  transpose_decoder_.set_resource_limits(options.transpose_resource_limits_);
   Clear();
 }
 
 inline void ChunkDecoder::Clear() {
+  record_reader_.Reset();
+  record_reader_active_ = false;
   Object::Reset(kInitiallyOpen);
   limits_.clear();
   values_reader_.Reset(std::forward_as_tuple());
+  streaming_.reset();
+  values_base_ = 0;
   index_ = 0;
+  record_views_.clear();
   recoverable_ = false;
 }
 
 inline bool ChunkDecoder::ReadRecord(absl::string_view* record) {
+  SyncRecordReader();
   if (ABSL_PREDICT_FALSE(!healthy() || index() == num_records())) return false;
-  const size_t start = IntCast<size_t>(values_reader_.pos());
+  Reader& values = values_reader();
+  const size_t start = IntCast<size_t>(values.pos() - values_base_);
   const size_t limit = limits_[IntCast<size_t>(index_)];
   RIEGELI_ASSERT_LE(start, limit)
       << "Failed invariant of ChunkDecoder: record end positions not sorted";
-  if (!values_reader_.Read(record, limit - start)) {
-    RIEGELI_ASSERT_UNREACHABLE() << "Failed reading record from values reader: "
-                                 << values_reader_.status();
+  if (ABSL_PREDICT_FALSE(!values.Read(record, limit - start))) {
+    return FailReading(values);
   }
   ++index_;
   return true;
 }
 
 inline bool ChunkDecoder::ReadRecord(std::string* record) {
+  SyncRecordReader();
   if (ABSL_PREDICT_FALSE(!healthy() || index() == num_records())) return false;
-  const size_t start = IntCast<size_t>(values_reader_.pos());
+  Reader& values = values_reader();
+  const size_t start = IntCast<size_t>(values.pos() - values_base_);
   const size_t limit = limits_[IntCast<size_t>(index_)];
   RIEGELI_ASSERT_LE(start, limit)
       << "Failed invariant of ChunkDecoder: record end positions not sorted";
   record->clear();
-  if (!values_reader_.Read(record, limit - start)) {
-    RIEGELI_ASSERT_UNREACHABLE() << "Failed reading record from values reader: "
-                                 << values_reader_.status();
+  if (ABSL_PREDICT_FALSE(!values.Read(record, limit - start))) {
+    return FailReading(values);
   }
   ++index_;
   return true;
 }
 
 inline bool ChunkDecoder::ReadRecord(Chain* record) {
+  SyncRecordReader();
   if (ABSL_PREDICT_FALSE(!healthy() || index() == num_records())) return false;
-  const size_t start = IntCast<size_t>(values_reader_.pos());
+  Reader& values = values_reader();
+  const size_t start = IntCast<size_t>(values.pos() - values_base_);
   const size_t limit = limits_[IntCast<size_t>(index_)];
   RIEGELI_ASSERT_LE(start, limit)
       << "Failed invariant of ChunkDecoder: record end positions not sorted";
   record->Clear();
-  if (!values_reader_.Read(record, limit - start)) {
-    RIEGELI_ASSERT_UNREACHABLE() << "Failed reading record from values reader: "
-                                 << values_reader_.status();
+  if (ABSL_PREDICT_FALSE(!values.Read(record, limit - start))) {
+    return FailReading(values);
   }
   ++index_;
   return true;
 }
 
+inline bool ChunkDecoder::ReadRecord(Reader** record) {
+  SyncRecordReader();
+  if (ABSL_PREDICT_FALSE(!healthy() || index() == num_records())) return false;
+  Reader& values = values_reader();
+  const size_t limit = limits_[IntCast<size_t>(index_)];
+  RIEGELI_ASSERT_LE(values.pos(), values_base_ + limit)
+      << "Failed invariant of ChunkDecoder: record end positions not sorted";
+  record_reader_.Reset(&values, values_base_ + limit);
+  record_reader_active_ = true;
+  ++index_;
+  *record = &record_reader_;
+  return true;
+}
+
+inline bool ChunkDecoder::ReadRecords(
+    absl::Span<const absl::string_view>* records, size_t max_num_records) {
+  SyncRecordReader();
+  if (ABSL_PREDICT_FALSE(!healthy() || index() == num_records() ||
+                         max_num_records == 0)) {
+    return false;
+  }
+  const size_t begin_index = IntCast<size_t>(index_);
+  const size_t end_index =
+      begin_index + UnsignedMin(max_num_records, limits_.size() - begin_index);
+  Reader& values_src = values_reader();
+  const size_t start = IntCast<size_t>(values_src.pos() - values_base_);
+  const size_t limit = limits_[end_index - 1];
+  RIEGELI_ASSERT_LE(start, limit)
+      << "Failed invariant of ChunkDecoder: record end positions not sorted";
+  absl::string_view values;
+  if (ABSL_PREDICT_FALSE(!values_src.Read(&values, limit - start))) {
+    return FailReading(values_src);
+  }
+  record_views_.clear();
+  record_views_.reserve(end_index - begin_index);
+  size_t record_start = 0;
+  for (size_t i = begin_index; i < end_index; ++i) {
+    const size_t record_limit = limits_[i] - start;
+    RIEGELI_ASSERT_LE(record_start, record_limit)
+        << "Failed invariant of ChunkDecoder: record end positions not sorted";
+    record_views_.push_back(
+        values.substr(record_start, record_limit - record_start));
+    record_start = record_limit;
+  }
+  index_ = IntCast<uint64_t>(end_index);
+  *records = record_views_;
+  return true;
+}
+
+inline bool ChunkDecoder::ReadRecords(std::vector<Chain>* records,
+                                      size_t max_num_records) {
+  SyncRecordReader();
+  if (ABSL_PREDICT_FALSE(!healthy() || index() == num_records() ||
+                         max_num_records == 0)) {
+    return false;
+  }
+  const size_t begin_index = IntCast<size_t>(index_);
+  const size_t end_index =
+      begin_index + UnsignedMin(max_num_records, limits_.size() - begin_index);
+  records->resize(end_index - begin_index);
+  Reader& values = values_reader();
+  size_t start = IntCast<size_t>(values.pos() - values_base_);
+  for (size_t i = begin_index; i < end_index; ++i) {
+    const size_t limit = limits_[i];
+    RIEGELI_ASSERT_LE(start, limit)
+        << "Failed invariant of ChunkDecoder: record end positions not sorted";
+    Chain& record = (*records)[i - begin_index];
+    record.Clear();
+    if (ABSL_PREDICT_FALSE(!values.Read(&record, limit - start))) {
+      index_ = IntCast<uint64_t>(i);
+      return FailReading(values);
+    }
+    start = limit;
+  }
+  index_ = IntCast<uint64_t>(end_index);
+  return true;
+}
+
 inline void ChunkDecoder::SetIndex(uint64_t index) {
   RIEGELI_ASSERT(healthy())
       << "Failed precondition of ChunkDecoder::SetIndex(): " << status();
+  SyncRecordReader();
+  if (ABSL_PREDICT_FALSE(!healthy())) return;
   index_ = UnsignedMin(index, num_records());
   const size_t start =
       index_ == 0 ? size_t{0} : limits_[IntCast<size_t>(index_ - 1)];
+  if (ABSL_PREDICT_FALSE(streaming_ != nullptr)) {
+    SeekStreaming(start);
+    return;
+  }
   if (!values_reader_.Seek(start)) {
     RIEGELI_ASSERT_UNREACHABLE()
         << "Failed seeking values reader: " << values_reader_.status();
   }
 }
 
+inline void DecodedChunk::RegisterSubobjects(
+    MemoryEstimator* memory_estimator) const {
+  values.RegisterSubobjects(memory_estimator);
+  memory_estimator->RegisterDynamicMemory(limits.capacity() * sizeof(size_t));
+}
+
+inline void ChunkDecoder::SyncRecordReader() {
+  if (ABSL_PREDICT_FALSE(record_reader_active_)) CloseRecordReader();
+}
+
+inline DecodedChunk ChunkDecoder::decoded_chunk() const {
+  RIEGELI_ASSERT(healthy())
+      << "Failed precondition of ChunkDecoder::decoded_chunk(): " << status();
+  if (ABSL_PREDICT_FALSE(streaming_ != nullptr)) return DecodeStreaming();
+  DecodedChunk decoded_chunk;
+  decoded_chunk.values = values_reader_.src();
+  decoded_chunk.limits = limits_;
+  return decoded_chunk;
+}
+
+inline void ChunkDecoder::SetDecodedChunk(const DecodedChunk& decoded_chunk) {
+  Clear();
+  limits_ = decoded_chunk.limits;
+  values_reader_.Reset(decoded_chunk.values);
+}
+
+inline Reader& ChunkDecoder::values_reader() {
+  if (ABSL_PREDICT_FALSE(streaming_ != nullptr)) {
+    return *streaming_->simple_decoder.reader();
+  }
+  return values_reader_;
+}
+
 template <>
 struct Resetter<ChunkDecoder> : ResetterByReset<ChunkDecoder> {};
 
@@ -14,11 +14,16 @@
 
 #include "riegeli/chunk_encoding/chunk_encoder.h"
 
+#include <stddef.h>
+
 #include <utility>
 
 #include "absl/base/optimization.h"
+#include "absl/strings/string_view.h"
+#include "absl/types/span.h"
 #include "google/protobuf/message_lite.h"
 #include "riegeli/base/chain.h"
+#include "riegeli/base/memory_estimator.h"
 #include "riegeli/base/status.h"
 #include "riegeli/bytes/message_serialize.h"
 
@@ -29,11 +34,13 @@ void ChunkEncoder::Done() {
   decoded_data_size_ = 0;
 }
 
-bool ChunkEncoder::AddRecord(const google::protobuf::MessageLite& record) {
+bool ChunkEncoder::AddRecordWithCachedSize(
+    const google::protobuf::MessageLite& record, size_t size) {
   if (ABSL_PREDICT_FALSE(!healthy())) return false;
   Chain serialized;
   {
-    Status status = SerializeToChain(record, &serialized);
+    Status status =
+        internal::SerializeWithCachedSizesToChain(record, size, &serialized);
     if (ABSL_PREDICT_FALSE(!status.ok())) {
       return Fail(std::move(status));
     }
@@ -46,4 +53,17 @@ bool ChunkEncoder::AddRecord(Chain&& record) {
   return AddRecord(record);
 }
 
+bool ChunkEncoder::AddRecords(absl::Span<const absl::string_view> records) {
+  for (const absl::string_view record : records) {
+    if (ABSL_PREDICT_FALSE(!AddRecord(record))) return false;
+  }
+  return true;
+}
+
+size_t ChunkEncoder::EstimateMemory() const {
+  MemoryEstimator memory_estimator;
+  RegisterUnique(&memory_estimator);
+  return memory_estimator.TotalMemory();
+}
+
 }  // namespace riegeli
@@ -22,8 +22,10 @@
 #include <vector>
 
 #include "absl/strings/string_view.h"
+#include "absl/types/span.h"
 #include "google/protobuf/message_lite.h"
 #include "riegeli/base/chain.h"
+#include "riegeli/base/memory_estimator.h"
 #include "riegeli/base/object.h"
 #include "riegeli/bytes/writer.h"
 #include "riegeli/chunk_encoding/constants.h"
@@ -49,13 +51,24 @@ class ChunkEncoder : public Object {
   // Return values:
   //  * `true`  - success (`healthy()`)
   //  * `false` - failure (`!healthy()`)
-  virtual bool AddRecord(const google::protobuf::MessageLite& record);
+  bool AddRecord(const google::protobuf::MessageLite& record);
   virtual bool AddRecord(absl::string_view record) = 0;
   virtual bool AddRecord(std::string&& record) = 0;
   bool AddRecord(const char* record);
   virtual bool AddRecord(const Chain& record) = 0;
   virtual bool AddRecord(Chain&& record);
 
+  // Variant of `AddRecord(google::protobuf::MessageLite)` for callers which
+  // already computed `size = record.ByteSizeLong()` and did not modify `record`
+  // since then. Sizes cached by `ByteSizeLong()` are reused instead of being
+  // computed again.
+  //
+  // Return values:
+  //  * `true`  - success (`healthy()`)
+  //  * `false` - failure (`!healthy()`)
+  virtual bool AddRecordWithCachedSize(
+      const google::protobuf::MessageLite& record, size_t size);
+
   // Add multiple records, expressed as concatenated record values and sorted
   // record end positions.
   //
@@ -68,12 +81,37 @@ class ChunkEncoder : public Object {
   //  * `false` - failure (`!healthy()`)
   virtual bool AddRecords(Chain records, std::vector<size_t> limits) = 0;
 
+  // Adds multiple records. Equivalent to calling `AddRecord()` for each, but
+  // the `ChunkEncoder` may handle the batch faster, which matters for many
+  // small records.
+  //
+  // Return values:
+  //  * `true`  - success (`healthy()`)
+  //  * `false` - failure (`!healthy()`)
+  virtual bool AddRecords(absl::Span<const absl::string_view> records);
+
   // Returns the number of records added so far.
   uint64_t num_records() const { return num_records_; }
 
   // Returns the sum of record sizes added so far.
   uint64_t decoded_data_size() const { return decoded_data_size_; }
 
+  // Returns an approximate size of the chunk data before compression, if the
+  // chunk was encoded now.
+  //
+  // This is computed in constant time, so it can be checked after each record.
+  virtual uint64_t ApproximateEncodedSize() const = 0;
+
+  // Returns an approximate amount of memory used by this `ChunkEncoder`,
+  // including records added so far, which accounts for per-field structures
+  // of a transposed chunk. Memory used internally by compression libraries is
+  // not included, nor is capacity retained from earlier chunks after
+  // `Clear()`, which closing the chunk does not reduce.
+  //
+  // Unlike `EstimateMemory()`, this is computed in constant time, so it can
+  // be checked after each record.
+  virtual size_t ApproximateMemory() const = 0;
+
   // Encodes the chunk to `*dest`, setting `*chunk_type`, `*num_records`, and
   // `*decoded_data_size`. Closes the `ChunkEncoder`.
   //
@@ -85,6 +123,14 @@ class ChunkEncoder : public Object {
                               uint64_t* num_records,
                               uint64_t* decoded_data_size) = 0;
 
+  // Estimates the amount of memory used by this `ChunkEncoder`, including
+  // records added so far. Memory used internally by compression libraries is
+  // not included.
+  size_t EstimateMemory() const;
+  // Registers this `ChunkEncoder` (`sizeof(*this)` of the derived class) and
+  // its subobjects with `MemoryEstimator`.
+  virtual void RegisterUnique(MemoryEstimator* memory_estimator) const = 0;
+
  protected:
   void Done() override;
 
@@ -100,6 +146,11 @@ inline void ChunkEncoder::Clear() {
   decoded_data_size_ = 0;
 }
 
+inline bool ChunkEncoder::AddRecord(
+    const google::protobuf::MessageLite& record) {
+  return AddRecordWithCachedSize(record, record.ByteSizeLong());
+}
+
 inline bool ChunkEncoder::AddRecord(const char* record) {
   return AddRecord(absl::string_view(record));
 }
@@ -0,0 +1,326 @@
+// Copyright 2019 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "riegeli/chunk_encoding/compiled_field_projection.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <algorithm>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "absl/base/optimization.h"
+#include "absl/container/flat_hash_map.h"
+#include "absl/strings/string_view.h"
+#include "riegeli/base/base.h"
+#include "riegeli/base/memory_estimator.h"
+#include "riegeli/bytes/reader_utils.h"
+#include "riegeli/bytes/varint.h"
+#include "riegeli/bytes/writer_utils.h"
+#include "riegeli/chunk_encoding/field_projection.h"
+#include "riegeli/chunk_encoding/transpose_internal.h"
+
+namespace riegeli {
+
+namespace {
+
+void AppendVarint32(uint32_t data, std::string* dest) {
+  char buffer[kMaxLengthVarint32];
+  char* const end = WriteVarint32(buffer, data);
+  dest->append(buffer, PtrDistance(buffer, end));
+}
+
+// Skips the value of a field which is not a group.
+//
+// Return values:
+//  * `true`  - success
+//  * `false` - the value is invalid, or the field is a group
+bool SkipValue(internal::WireType wire_type, const char** cursor,
+               const char* limit) {
+  switch (wire_type) {
+    case internal::WireType::kVarint: {
+      uint64_t value;
+      return ReadVarint64(cursor, limit, &value);
+    }
+    case internal::WireType::kFixed32:
+      if (ABSL_PREDICT_FALSE(PtrDistance(*cursor, limit) < sizeof(uint32_t))) {
+        return false;
+      }
+      *cursor += sizeof(uint32_t);
+      return true;
+    case internal::WireType::kFixed64:
+      if (ABSL_PREDICT_FALSE(PtrDistance(*cursor, limit) < sizeof(uint64_t))) {
+        return false;
+      }
+      *cursor += sizeof(uint64_t);
+      return true;
+    case internal::WireType::kLengthDelimited: {
+      uint32_t length;
+      if (ABSL_PREDICT_FALSE(!ReadVarint32(cursor, limit, &length) ||
+                             length > PtrDistance(*cursor, limit))) {
+        return false;
+      }
+      *cursor += length;
+      return true;
+    }
+    case internal::WireType::kStartGroup:
+    case internal::WireType::kEndGroup:
+    case internal::WireType::kSubmessage:
+      return false;
+  }
+  return false;
+}
+
+// Skips fields of a group up to and including `end_group_tag`.
+//
+// Return values:
+//  * `true`  - success
+//  * `false` - the group is invalid
+bool SkipGroup(const char** cursor, const char* limit,
+               uint32_t end_group_tag) {
+  // Groups are skipped iteratively, so that deeply nested groups do not
+  // overflow the stack.
+  std::vector<uint32_t> end_group_tags = {end_group_tag};
+  do {
+    uint32_t tag;
+    if (ABSL_PREDICT_FALSE(!ReadVarint32(cursor, limit, &tag) ||
+                           (tag >> 3) == 0)) {
+      return false;
+    }
+    const internal::WireType wire_type =
+        static_cast<internal::WireType>(tag & 7);
+    if (wire_type == internal::WireType::kStartGroup) {
+      end_group_tags.push_back((tag & ~uint32_t{7}) |
+                               internal::WireType::kEndGroup);
+    } else if (wire_type == internal::WireType::kEndGroup) {
+      if (ABSL_PREDICT_FALSE(tag != end_group_tags.back())) return false;
+      end_group_tags.pop_back();
+    } else if (ABSL_PREDICT_FALSE(!SkipValue(wire_type, cursor, limit))) {
+      return false;
+    }
+  } while (!end_group_tags.empty());
+  return true;
+}
+
+}  // namespace
+
+#if __cplusplus < 201703
+constexpr uint32_t CompiledFieldProjection::kRootId;
+#endif
+
+CompiledFieldProjection::CompiledFieldProjection(
+    const FieldProjection& field_projection)
+    : includes_all_(field_projection.includes_all()) {
+  if (includes_all_) return;
+  child_masks_.push_back(0);
+  for (const Field& include_field : field_projection.fields()) {
+    size_t path_len = include_field.path().size();
+    const bool existence_only =
+        include_field.path()[path_len - 1] == Field::kExistenceOnly;
+    if (existence_only) {
+      --path_len;
+      if (path_len == 0) continue;
+    }
+    uint32_t current_id = kRootId;
+    for (size_t i = 0; i < path_len; ++i) {
+      const uint32_t tag = include_field.path()[i];
+      if (ABSL_PREDICT_FALSE(tag == Field::kExistenceOnly)) {
+        valid_ = false;
+        break;
+      }
+      const uint32_t next_id = IntCast<uint32_t>(include_fields_.size());
+      IncludeType include_type = IncludeType::kIncludeChild;
+      if (i + 1 == path_len) {
+        include_type = existence_only ? IncludeType::kExistenceOnly
+                                      : IncludeType::kIncludeFully;
+      }
+      const std::pair<absl::flat_hash_map<std::pair<uint32_t, uint32_t>,
+                                          IncludedField>::iterator,
+                      bool>
+          inserted = include_fields_.emplace(
+              std::make_pair(current_id, tag),
+              IncludedField{next_id, include_type});
+      if (inserted.second) {
+        if (tag < 64) {
+          child_masks_[MaskIndex(current_id)] |= uint64_t{1} << tag;
+        }
+        child_masks_.push_back(0);
+      }
+      IncludedField& val = inserted.first->second;
+      current_id = val.field_id;
+      static_assert(IncludeType::kExistenceOnly > IncludeType::kIncludeChild &&
+                        IncludeType::kIncludeChild > IncludeType::kIncludeFully,
+                    "Statement below assumes this ordering");
+      val.include_type = std::min(val.include_type, include_type);
+    }
+  }
+}
+
+CompiledFieldProjection::CompiledFieldProjection(
+    const CompiledFieldProjection& that)
+    : includes_all_(that.includes_all_),
+      valid_(that.valid_),
+      include_fields_(that.include_fields_),
+      child_masks_(that.child_masks_) {}
+
+CompiledFieldProjection& CompiledFieldProjection::operator=(
+    const CompiledFieldProjection& that) {
+  includes_all_ = that.includes_all_;
+  valid_ = that.valid_;
+  include_fields_ = that.include_fields_;
+  child_masks_ = that.child_masks_;
+  return *this;
+}
+
+CompiledFieldProjection::CompiledFieldProjection(
+    CompiledFieldProjection&& that) noexcept
+    : includes_all_(std::exchange(that.includes_all_, true)),
+      valid_(std::exchange(that.valid_, true)),
+      include_fields_(std::move(that.include_fields_)),
+      child_masks_(std::move(that.child_masks_)) {}
+
+CompiledFieldProjection& CompiledFieldProjection::operator=(
+    CompiledFieldProjection&& that) noexcept {
+  includes_all_ = std::exchange(that.includes_all_, true);
+  valid_ = std::exchange(that.valid_, true);
+  include_fields_ = std::move(that.include_fields_);
+  child_masks_ = std::move(that.child_masks_);
+  return *this;
+}
+
+bool CompiledFieldProjection::ProjectRecord(absl::string_view record,
+                                            std::string* dest) const {
+  if (includes_all_) {
+    dest->append(record.data(), record.size());
+    return true;
+  }
+  const size_t dest_size = dest->size();
+  const char* cursor = record.data();
+  if (ABSL_PREDICT_FALSE(!ProjectMessage(kRootId, &cursor,
+                                         record.data() + record.size(), 0,
+                                         dest))) {
+    dest->resize(dest_size);
+    return false;
+  }
+  return true;
+}
+
+bool CompiledFieldProjection::ProjectMessage(uint32_t parent_id,
+                                             const char** cursor,
+                                             const char* limit,
+                                             uint32_t end_group_tag,
+                                             std::string* dest) const {
+  while (*cursor < limit) {
+    const char* const field_begin = *cursor;
+    uint32_t tag;
+    if (ABSL_PREDICT_FALSE(!ReadVarint32(cursor, limit, &tag) ||
+                           (tag >> 3) == 0)) {
+      return false;
+    }
+    const char* const value_begin = *cursor;
+    const internal::WireType wire_type =
+        static_cast<internal::WireType>(tag & 7);
+    if (wire_type == internal::WireType::kEndGroup) {
+      return tag == end_group_tag;
+    }
+    const uint32_t group_end_tag =
+        (tag & ~uint32_t{7}) | internal::WireType::kEndGroup;
+    const IncludedField* const included_field = Find(parent_id, tag >> 3);
+    if (included_field != nullptr &&
+        included_field->include_type == IncludeType::kIncludeChild) {
+      // Only some children of the field are included. The field is projected
+      // if it is a submessage or a group. The path of a field included
+      // partially is a proper prefix of a path in the projection, which bounds
+      // the recursion depth.
+      if (wire_type == internal::WireType::kLengthDelimited) {
+        uint32_t length;
+        if (ABSL_PREDICT_FALSE(!ReadVarint32(cursor, limit, &length) ||
+                               length > PtrDistance(*cursor, limit))) {
+          return false;
+        }
+        const char* submessage_cursor = *cursor;
+        *cursor += length;
+        std::string submessage;
+        if (ProjectMessage(included_field->field_id, &submessage_cursor,
+                           *cursor, 0, &submessage)) {
+          dest->append(field_begin, PtrDistance(field_begin, value_begin));
+          AppendVarint32(IntCast<uint32_t>(submessage.size()), dest);
+          dest->append(submessage);
+        } else {
+          // Not a submessage, e.g. a string. Include it fully.
+          dest->append(field_begin, PtrDistance(field_begin, *cursor));
+        }
+        continue;
+      }
+      if (wire_type == internal::WireType::kStartGroup) {
+        dest->append(field_begin, PtrDistance(field_begin, value_begin));
+        if (ABSL_PREDICT_FALSE(!ProjectMessage(included_field->field_id,
+                                               cursor, limit, group_end_tag,
+                                               dest))) {
+          return false;
+        }
+        AppendVarint32(group_end_tag, dest);
+        continue;
+      }
+    }
+    if (wire_type == internal::WireType::kStartGroup) {
+      if (ABSL_PREDICT_FALSE(!SkipGroup(cursor, limit, group_end_tag))) {
+        return false;
+      }
+    } else if (ABSL_PREDICT_FALSE(!SkipValue(wire_type, cursor, limit))) {
+      return false;
+    }
+    if (included_field == nullptr) continue;
+    if (included_field->include_type != IncludeType::kExistenceOnly) {
+      dest->append(field_begin, PtrDistance(field_begin, *cursor));
+      continue;
+    }
+    // Preserve the existence of the field, replacing its value with a default
+    // value.
+    dest->append(field_begin, PtrDistance(field_begin, value_begin));
+    switch (wire_type) {
+      case internal::WireType::kVarint:
+      case internal::WireType::kLengthDelimited:
+        dest->push_back('\0');
+        break;
+      case internal::WireType::kFixed32:
+        dest->append(sizeof(uint32_t), '\0');
+        break;
+      case internal::WireType::kFixed64:
+        dest->append(sizeof(uint64_t), '\0');
+        break;
+      case internal::WireType::kStartGroup:
+        AppendVarint32(group_end_tag, dest);
+        break;
+      case internal::WireType::kEndGroup:
+      case internal::WireType::kSubmessage:
+        RIEGELI_ASSERT_UNREACHABLE() << "Invalid wire type";
+    }
+  }
+  // The end of a group must be marked explicitly.
+  return end_group_tag == 0;
+}
+
+void CompiledFieldProjection::RegisterSubobjects(
+    MemoryEstimator* memory_estimator) const {
+  memory_estimator->RegisterDynamicMemory(
+      include_fields_.bucket_count() *
+      (sizeof(decltype(include_fields_)::value_type) + 1));
+  memory_estimator->RegisterDynamicMemory(child_masks_.capacity() *
+                                          sizeof(uint64_t));
+}
+
+}  // namespace riegeli
@@ -0,0 +1,144 @@
+// Copyright 2019 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef RIEGELI_CHUNK_ENCODING_COMPILED_FIELD_PROJECTION_H_
+#define RIEGELI_CHUNK_ENCODING_COMPILED_FIELD_PROJECTION_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <limits>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "absl/container/flat_hash_map.h"
+#include "absl/strings/string_view.h"
+#include "riegeli/base/memory_estimator.h"
+#include "riegeli/chunk_encoding/field_projection.h"
+
+namespace riegeli {
+
+// `FieldProjection` compiled into a trie of field numbers, which can be
+// evaluated for a field in constant time regardless of the number of fields in
+// the projection.
+//
+// A `CompiledFieldProjection` does not change after it is constructed, so it
+// can be compiled once and shared by threads decoding chunks.
+class CompiledFieldProjection {
+ public:
+  enum class IncludeType : uint8_t {
+    // Field is included.
+    kIncludeFully,
+    // Some child fields are included.
+    kIncludeChild,
+    // Field is existence only.
+    kExistenceOnly,
+  };
+
+  // A node of the trie, corresponding to a field at a particular path.
+  struct IncludedField {
+    // ID of the node, sequentially assigned to distinct path prefixes, used to
+    // find children of the field.
+    uint32_t field_id;
+    IncludeType include_type;
+  };
+
+  // ID of the root message, i.e. the parent of top level fields.
+  static constexpr uint32_t kRootId = std::numeric_limits<uint32_t>::max();
+
+  // Includes all fields.
+  CompiledFieldProjection() noexcept {}
+
+  // Compiles `field_projection`.
+  /*implicit*/ CompiledFieldProjection(const FieldProjection& field_projection);
+
+  CompiledFieldProjection(const CompiledFieldProjection& that);
+  CompiledFieldProjection& operator=(const CompiledFieldProjection& that);
+
+  CompiledFieldProjection(CompiledFieldProjection&& that) noexcept;
+  CompiledFieldProjection& operator=(CompiledFieldProjection&& that) noexcept;
+
+  // Returns `true` if all fields are included.
+  bool includes_all() const { return includes_all_; }
+
+  // Returns `false` if a field path of the projection contains
+  // `Field::kExistenceOnly` other than at its end.
+  bool valid() const { return valid_; }
+
+  // Returns the child of the field with ID `parent_id` (`kRootId` for top
+  // level fields) having the given field number, or `nullptr` if it is not
+  // included.
+  //
+  // Precondition: `!includes_all()`
+  const IncludedField* Find(uint32_t parent_id, uint32_t field_number) const;
+
+  // Applies the projection to a serialized message, appending the result to
+  // `*dest`. This implements projection of records which are not transposed,
+  // with the same results as for transposed records.
+  //
+  // Return values:
+  //  * `true`  - success
+  //  * `false` - `record` is not a valid serialized message (`*dest` is
+  //              unchanged)
+  bool ProjectRecord(absl::string_view record, std::string* dest) const;
+
+  // Registers subobjects with `MemoryEstimator`.
+  void RegisterSubobjects(MemoryEstimator* memory_estimator) const;
+
+ private:
+  // Bit masks of field numbers below 64 of children of a node are stored at
+  // this index.
+  static size_t MaskIndex(uint32_t field_id) {
+    return field_id == kRootId ? size_t{0} : size_t{field_id} + 1;
+  }
+
+  // Projects fields of a message or group whose field ID is `parent_id`,
+  // reading them from `*cursor` up to `limit`, or up to and including
+  // `end_group_tag` if it is not 0.
+  bool ProjectMessage(uint32_t parent_id, const char** cursor,
+                      const char* limit, uint32_t end_group_tag,
+                      std::string* dest) const;
+
+  bool includes_all_ = true;
+  bool valid_ = true;
+  // If `p` is the ID of a parent field then
+  // `include_fields_[std::make_pair(p, f)]` holds the child with field number
+  // `f`.
+  absl::flat_hash_map<std::pair<uint32_t, uint32_t>, IncludedField>
+      include_fields_;
+  // For each node, indexed by `MaskIndex()`, a bit mask of field numbers below
+  // 64 of its children. Most fields absent from the projection are rejected by
+  // the mask without a lookup in `include_fields_`.
+  std::vector<uint64_t> child_masks_;
+};
+
+// Implementation details follow.
+
+inline const CompiledFieldProjection::IncludedField*
+CompiledFieldProjection::Find(uint32_t parent_id, uint32_t field_number) const {
+  if (field_number < 64 &&
+      (child_masks_[MaskIndex(parent_id)] & (uint64_t{1} << field_number)) ==
+          0) {
+    return nullptr;
+  }
+  const absl::flat_hash_map<std::pair<uint32_t, uint32_t>,
+                            IncludedField>::const_iterator iter =
+      include_fields_.find(std::make_pair(parent_id, field_number));
+  return iter == include_fields_.end() ? nullptr : &iter->second;
+}
+
+}  // namespace riegeli
+
+#endif  // RIEGELI_CHUNK_ENCODING_COMPILED_FIELD_PROJECTION_H_
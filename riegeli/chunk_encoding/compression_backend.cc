@@ -0,0 +1,142 @@
+// Copyright 2019 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "riegeli/chunk_encoding/compression_backend.h"
+
+#include <stdint.h>
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <utility>
+
+#include "absl/base/optimization.h"
+#include "absl/base/thread_annotations.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/string_view.h"
+#include "absl/synchronization/mutex.h"
+#include "riegeli/base/canonical_errors.h"
+#include "riegeli/base/memory.h"
+#include "riegeli/base/status.h"
+#include "riegeli/chunk_encoding/constants.h"
+
+namespace riegeli {
+
+namespace {
+
+struct CompressionBackends {
+  // Set once any backend is registered, so that looking up a backend when none
+  // was registered avoids locking `mutex`.
+  std::atomic<bool> used{false};
+  absl::Mutex mutex;
+  // Indexed by `CompressionType`.
+  std::shared_ptr<CompressionBackend> backends[256] ABSL_GUARDED_BY(mutex);
+  // Names of custom codecs, indexed by `CompressionType`, empty if none is
+  // registered.
+  std::string names[256] ABSL_GUARDED_BY(mutex);
+};
+
+CompressionBackends& GlobalCompressionBackends() {
+  static NoDestructor<CompressionBackends> kCompressionBackends;
+  return *kCompressionBackends;
+}
+
+}  // namespace
+
+CompressionBackend::~CompressionBackend() {}
+
+Status RegisterCompressionBackend(CompressionType compression_type,
+                                  std::shared_ptr<CompressionBackend> backend) {
+  switch (compression_type) {
+    case CompressionType::kBrotli:
+    case CompressionType::kZstd:
+    case CompressionType::kSnappy: {
+      CompressionBackends& compression_backends = GlobalCompressionBackends();
+      absl::MutexLock lock(&compression_backends.mutex);
+      compression_backends.backends[static_cast<uint8_t>(compression_type)] =
+          std::move(backend);
+      compression_backends.used.store(true, std::memory_order_release);
+      return OkStatus();
+    }
+    case CompressionType::kNone:
+    case CompressionType::kLz4:
+      break;
+  }
+  // This includes custom codecs, which are registered with
+  // `RegisterCustomCompression()`.
+  return InvalidArgumentError(
+      absl::StrCat("Compression type does not support backends: ",
+                   static_cast<unsigned>(compression_type)));
+}
+
+Status RegisterCustomCompression(CompressionType compression_type,
+                                 absl::string_view name,
+                                 std::shared_ptr<CompressionBackend> backend) {
+  if (ABSL_PREDICT_FALSE(!IsCustomCompressionType(compression_type))) {
+    return InvalidArgumentError(
+        absl::StrCat("Compression type not reserved for custom codecs: ",
+                     static_cast<unsigned>(compression_type)));
+  }
+  if (ABSL_PREDICT_FALSE(name.empty())) {
+    return InvalidArgumentError("Empty custom codec name");
+  }
+  CompressionBackends& compression_backends = GlobalCompressionBackends();
+  absl::MutexLock lock(&compression_backends.mutex);
+  const uint8_t index = static_cast<uint8_t>(compression_type);
+  for (int other = kMinCustomCompressionType;
+       other <= kMaxCustomCompressionType; ++other) {
+    if (ABSL_PREDICT_FALSE(other != index &&
+                           compression_backends.names[other] == name)) {
+      return InvalidArgumentError(
+          absl::StrCat("Custom codec name already registered: ", name));
+    }
+  }
+  if (backend == nullptr) {
+    compression_backends.names[index].clear();
+  } else {
+    compression_backends.names[index] = std::string(name);
+  }
+  compression_backends.backends[index] = std::move(backend);
+  compression_backends.used.store(true, std::memory_order_release);
+  return OkStatus();
+}
+
+bool CustomCompressionFromName(absl::string_view name,
+                               CompressionType* compression_type) {
+  if (name.empty()) return false;
+  CompressionBackends& compression_backends = GlobalCompressionBackends();
+  if (!compression_backends.used.load(std::memory_order_acquire)) return false;
+  absl::MutexLock lock(&compression_backends.mutex);
+  for (int index = kMinCustomCompressionType;
+       index <= kMaxCustomCompressionType; ++index) {
+    if (compression_backends.names[index] == name) {
+      *compression_type = static_cast<CompressionType>(index);
+      return true;
+    }
+  }
+  return false;
+}
+
+std::shared_ptr<CompressionBackend> GetCompressionBackend(
+    CompressionType compression_type) {
+  CompressionBackends& compression_backends = GlobalCompressionBackends();
+  if (ABSL_PREDICT_TRUE(
+          !compression_backends.used.load(std::memory_order_acquire))) {
+    return nullptr;
+  }
+  absl::MutexLock lock(&compression_backends.mutex);
+  return compression_backends.backends[static_cast<uint8_t>(compression_type)];
+}
+
+}  // namespace riegeli
@@ -0,0 +1,127 @@
+// Copyright 2019 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef RIEGELI_CHUNK_ENCODING_COMPRESSION_BACKEND_H_
+#define RIEGELI_CHUNK_ENCODING_COMPRESSION_BACKEND_H_
+
+#include <memory>
+
+#include "absl/strings/string_view.h"
+#include "absl/types/span.h"
+#include "riegeli/base/chain.h"
+#include "riegeli/base/status.h"
+#include "riegeli/bytes/zstd_dictionary.h"
+#include "riegeli/chunk_encoding/constants.h"
+
+namespace riegeli {
+
+class CompressorOptions;
+
+// An implementation of a compression algorithm used by `Compressor` and
+// `Decompressor` instead of the built-in one, e.g. offloading to a hardware
+// accelerator. Compressed data must have the same format, so that files remain
+// readable by the built-in implementation. A backend can also implement a new
+// compression format, registered with `RegisterCustomCompression()`.
+//
+// A backend compresses and decompresses whole buffers at once. Its methods are
+// called concurrently from threads encoding and decoding chunks, e.g. with
+// `RecordWriterBase::Options::set_parallelism()` and
+// `RecordReaderBase::Options::set_parallelism()`, so a backend can keep
+// several requests submitted to the accelerator at a time.
+//
+// If a backend does not support particular data, e.g. compression options or
+// a dictionary, it can return `UnimplementedError()`, and the built-in
+// implementation is used instead.
+class CompressionBackend {
+ public:
+  virtual ~CompressionBackend();
+
+  // Compresses `src` with `compressor_options`, appending the compressed stream
+  // (without the uncompressed size which precedes it in a chunk) to `*dest`.
+  //
+  // Returns status:
+  //  * `status.ok()`             - success
+  //  * `IsUnimplemented(status)` - unsupported (`*dest` is unchanged)
+  //  * other `!status.ok()`      - failure
+  virtual Status Compress(const CompressorOptions& compressor_options,
+                          const Chain& src, Chain* dest) = 0;
+
+  // Decompresses the whole compressed stream `src` of `compression_type` to
+  // `dest`, whose size is the size of decompressed data.
+  //
+  // `zstd_dictionary` is the dictionary used for compression, or empty. It is
+  // the raw dictionary data also for `CompressionType::kBrotli`.
+  //
+  // Returns status:
+  //  * `status.ok()`             - success
+  //  * `IsUnimplemented(status)` - unsupported
+  //  * other `!status.ok()`      - failure
+  virtual Status Decompress(CompressionType compression_type,
+                            absl::string_view src,
+                            const ZstdDictionary& zstd_dictionary,
+                            absl::Span<char> dest) = 0;
+};
+
+// Makes `backend` compress and decompress data of `compression_type` for
+// `Compressor`s and `Decompressor`s created afterwards, replacing the backend
+// registered before, if any. `nullptr` restores the built-in implementation.
+//
+// `compression_type` must be `CompressionType::kBrotli`,
+// `CompressionType::kZstd`, or `CompressionType::kSnappy`. Backends are usually
+// registered at startup. Streams with a very large decompressed size are
+// decompressed by the built-in implementation.
+//
+// Returns status:
+//  * `status.ok()`  - success
+//  * `!status.ok()` - failure (`compression_type` does not support backends)
+Status RegisterCompressionBackend(CompressionType compression_type,
+                                  std::shared_ptr<CompressionBackend> backend);
+
+// Registers a custom codec under `compression_type`, which must be between
+// `kMinCustomCompressionType` and `kMaxCustomCompressionType`, replacing the
+// codec registered before under this `compression_type`, if any.
+//
+// `name` selects the codec in options text (`"custom:name"`), and must not be
+// empty nor used by a codec registered under another `compression_type`.
+// `nullptr` `backend` unregisters the codec.
+//
+// Files written with a custom codec are readable only by programs registering
+// the same codec under the same `compression_type`. A custom codec has no
+// built-in fallback, so its backend must not return `UnimplementedError()`,
+// and it decompresses each stream at once, including very large ones.
+//
+// Returns status:
+//  * `status.ok()`  - success
+//  * `!status.ok()` - failure (`compression_type` is not reserved for custom
+//                     codecs or `name` is invalid)
+Status RegisterCustomCompression(CompressionType compression_type,
+                                 absl::string_view name,
+                                 std::shared_ptr<CompressionBackend> backend);
+
+// Finds the custom codec registered with `name`.
+//
+// Return values:
+//  * `true`  - found (`*compression_type` is set)
+//  * `false` - not found
+bool CustomCompressionFromName(absl::string_view name,
+                               CompressionType* compression_type);
+
+// Returns the backend registered for `compression_type`, or `nullptr` if the
+// built-in implementation is used or no custom codec is registered.
+std::shared_ptr<CompressionBackend> GetCompressionBackend(
+    CompressionType compression_type);
+
+}  // namespace riegeli
+
+#endif  // RIEGELI_CHUNK_ENCODING_COMPRESSION_BACKEND_H_
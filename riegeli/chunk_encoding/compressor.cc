@@ -14,29 +14,75 @@
 
 #include "riegeli/chunk_encoding/compressor.h"
 
+#include <stddef.h>
 #include <stdint.h>
 
 #include <tuple>
 #include <utility>
 
 #include "absl/base/optimization.h"
+#include "absl/strings/str_cat.h"
 #include "absl/types/optional.h"
 #include "absl/types/variant.h"
 #include "riegeli/base/base.h"
+#include "riegeli/base/canonical_errors.h"
 #include "riegeli/base/chain.h"
+#include "riegeli/base/memory_estimator.h"
 #include "riegeli/base/object.h"
+#include "riegeli/base/status.h"
 #include "riegeli/bytes/brotli_writer.h"
+#include "riegeli/bytes/chain_reader.h"
 #include "riegeli/bytes/chain_writer.h"
+#include "riegeli/bytes/lz4_writer.h"
+#include "riegeli/bytes/null_writer.h"
 #include "riegeli/bytes/snappy_writer.h"
 #include "riegeli/bytes/writer.h"
 #include "riegeli/bytes/writer_utils.h"
 #include "riegeli/bytes/zstd_writer.h"
+#include "riegeli/chunk_encoding/compression_backend.h"
 #include "riegeli/chunk_encoding/compressor_options.h"
 #include "riegeli/chunk_encoding/constants.h"
 
 namespace riegeli {
 namespace internal {
 
+namespace {
+
+// Automatic selection of the compression algorithm compresses this many
+// evenly spaced slices of data, each of this size.
+constexpr size_t kNumSampleSlices = 4;
+constexpr size_t kSampleSliceSize = size_t{16} << 10;
+
+Chain SampleData(const Chain& data) {
+  if (data.size() <= kNumSampleSlices * kSampleSliceSize) return data;
+  const size_t stride =
+      (data.size() - kSampleSliceSize) / (kNumSampleSlices - 1);
+  Chain sample;
+  ChainReader<> reader(&data);
+  for (size_t i = 0; i < kNumSampleSlices; ++i) {
+    reader.Seek(IntCast<Position>(i * stride));
+    reader.Read(&sample, kSampleSliceSize);
+  }
+  return sample;
+}
+
+// Returns the size of `sample` compressed with `compressor_options`, or
+// `sample.size()` if compression failed.
+Position CompressedSize(const CompressorOptions& compressor_options,
+                        const Chain& sample) {
+  Compressor compressor(
+      compressor_options,
+      Compressor::TuningOptions().set_final_size(sample.size()));
+  NullWriter dest(NullWriter::kInitiallyOpen);
+  if (ABSL_PREDICT_FALSE(!compressor.writer()->Write(sample)) ||
+      ABSL_PREDICT_FALSE(!compressor.EncodeAndClose(&dest))) {
+    return sample.size();
+  }
+  return dest.pos();
+}
+
+}  // namespace
+
 Compressor::Compressor(CompressorOptions compressor_options,
                        TuningOptions tuning_options)
     : Object(kInitiallyOpen),
@@ -57,6 +103,25 @@ void Compressor::Clear() {
 }
 
 void Compressor::Initialize() {
+  backend_ = GetCompressionBackend(compressor_options_.compression_type());
+  if (backend_ != nullptr ||
+      IsCustomCompressionType(compressor_options_.compression_type())) {
+    // The backend compresses data at once, so they are collected until then.
+    writer_.emplace<ChainWriter<>>(&compressed_,
+                                   ChainWriterBase::Options().set_size_hint(
+                                       tuning_options_.final_size_.value_or(
+                                           tuning_options_.size_hint_)));
+    if (ABSL_PREDICT_FALSE(backend_ == nullptr)) {
+      Fail(FailedPreconditionError(absl::StrCat(
+          "Custom compression type not registered: ",
+          static_cast<unsigned>(compressor_options_.compression_type()))));
+    }
+    return;
+  }
+  InitializeBuiltin();
+}
+
+void Compressor::InitializeBuiltin() {
   switch (compressor_options_.compression_type()) {
     case CompressionType::kNone:
       writer_.emplace<ChainWriter<>>(&compressed_,
@@ -70,6 +135,8 @@ void Compressor::Initialize() {
           BrotliWriterBase::Options()
               .set_compression_level(compressor_options_.compression_level())
               .set_window_log(compressor_options_.window_log())
+              .set_dictionary(compressor_options_.brotli_dictionary())
+              .set_num_workers(compressor_options_.brotli_workers())
               .set_size_hint(tuning_options_.final_size_.value_or(
                   tuning_options_.size_hint_)));
       return;
@@ -79,6 +146,15 @@ void Compressor::Initialize() {
           ZstdWriterBase::Options()
               .set_compression_level(compressor_options_.compression_level())
               .set_window_log(compressor_options_.window_log())
+              .set_dictionary(compressor_options_.zstd_dictionary())
+              .set_num_workers(compressor_options_.zstd_workers())
+              .set_job_size(compressor_options_.zstd_job_size())
+              .set_strategy(compressor_options_.zstd_strategy())
+              .set_long_distance_matching(
+                  compressor_options_.zstd_long_distance_matching())
+              .set_ldm_hash_log(compressor_options_.zstd_ldm_hash_log())
+              .set_target_block_size(IntCast<size_t>(
+                  compressor_options_.zstd_target_block_size()))
               .set_final_size(tuning_options_.final_size_)
               .set_size_hint(tuning_options_.size_hint_));
       return;
@@ -88,16 +164,71 @@ void Compressor::Initialize() {
           SnappyWriterBase::Options().set_size_hint(
               tuning_options_.size_hint_));
       return;
+    case CompressionType::kLz4:
+      writer_.emplace<Lz4Writer<ChainWriter<>>>(
+          std::forward_as_tuple(&compressed_),
+          Lz4WriterBase::Options()
+              .set_compression_level(compressor_options_.compression_level())
+              .set_final_size(tuning_options_.final_size_)
+              .set_size_hint(tuning_options_.size_hint_));
+      return;
   }
   RIEGELI_ASSERT_UNREACHABLE()
       << "Unknown compression type: "
       << static_cast<unsigned>(compressor_options_.compression_type());
 }
 
+size_t Compressor::ApproximateMemory() const {
+  size_t memory = compressed_.size();
+  // See `RegisterSubobjects()`.
+  if (!absl::holds_alternative<ChainWriter<>>(writer_) &&
+      !absl::holds_alternative<SnappyWriter<ChainWriter<>>>(writer_)) {
+    const Writer& writer = absl::visit(
+        [](const Writer& writer) -> const Writer& { return writer; }, writer_);
+    memory += PtrDistance(writer.start(), writer.limit());
+  }
+  return memory;
+}
+
+void Compressor::RegisterSubobjects(MemoryEstimator* memory_estimator) const {
+  compressed_.RegisterSubobjects(memory_estimator);
+  // `ChainWriter` and `SnappyWriter` write to blocks of `compressed_` or of an
+  // internal `Chain`; other writers have a separate buffer.
+  if (!absl::holds_alternative<ChainWriter<>>(writer_) &&
+      !absl::holds_alternative<SnappyWriter<ChainWriter<>>>(writer_)) {
+    const Writer& writer =
+        absl::visit([](const Writer& writer) -> const Writer& { return writer; },
+                    writer_);
+    memory_estimator->RegisterDynamicMemory(
+        PtrDistance(writer.start(), writer.limit()));
+  }
+}
+
 bool Compressor::EncodeAndClose(Writer* dest) {
   if (ABSL_PREDICT_FALSE(!healthy())) return false;
   const Position uncompressed_size = writer()->pos();
   if (ABSL_PREDICT_FALSE(!writer()->Close())) return Fail(*writer());
+  if (backend_ != nullptr) {
+    Chain compressed;
+    Status status =
+        backend_->Compress(compressor_options_, compressed_, &compressed);
+    if (ABSL_PREDICT_FALSE(IsUnimplemented(status)) &&
+        !IsCustomCompressionType(compressor_options_.compression_type())) {
+      // Fall back to the built-in implementation.
+      const Chain uncompressed = std::move(compressed_);
+      compressed_.Clear();
+      backend_ = nullptr;
+      InitializeBuiltin();
+      if (ABSL_PREDICT_FALSE(!writer()->Write(uncompressed))) {
+        return Fail(*writer());
+      }
+      if (ABSL_PREDICT_FALSE(!writer()->Close())) return Fail(*writer());
+    } else if (ABSL_PREDICT_FALSE(!status.ok())) {
+      return Fail(std::move(status));
+    } else {
+      compressed_ = std::move(compressed);
+    }
+  }
   if (compressor_options_.compression_type() != CompressionType::kNone) {
     if (ABSL_PREDICT_FALSE(
             !WriteVarint64(dest, IntCast<uint64_t>(uncompressed_size)))) {
@@ -110,5 +241,47 @@ bool Compressor::EncodeAndClose(Writer* dest) {
   return Close();
 }
 
+CompressorOptions ChooseCompressorOptions(
+    const CompressorOptions& compressor_options, const Chain& data) {
+  if (compressor_options.auto_select() == absl::nullopt) {
+    return compressor_options;
+  }
+  CompressorOptions chosen = compressor_options;
+  chosen.set_auto_select(absl::nullopt);
+  if (compressor_options.compression_type() == CompressionType::kNone) {
+    return chosen;
+  }
+  const Chain sample = SampleData(data);
+  const long double min_gain =
+      static_cast<long double>(*compressor_options.auto_select()) *
+      static_cast<long double>(sample.size());
+  // Candidates are considered from the fastest. `best_size` is the compressed
+  // size for the last chosen candidate.
+  Position best_size = sample.size();
+  CompressionType best_type = CompressionType::kNone;
+  if (compressor_options.compression_type() != CompressionType::kSnappy &&
+      compressor_options.compression_type() != CompressionType::kLz4) {
+    const Position snappy_size =
+        CompressedSize(CompressorOptions().set_snappy(), sample);
+    if (snappy_size < best_size &&
+        static_cast<long double>(best_size - snappy_size) >= min_gain) {
+      best_size = snappy_size;
+      best_type = CompressionType::kSnappy;
+    }
+  }
+  const Position configured_size = CompressedSize(chosen, sample);
+  if (configured_size < best_size &&
+      static_cast<long double>(best_size - configured_size) >= min_gain) {
+    return chosen;
+  }
+  chosen.set_window_log(CompressorOptions::kDefaultWindowLog);
+  if (best_type == CompressionType::kSnappy) {
+    chosen.set_snappy();
+  } else {
+    chosen.set_uncompressed();
+  }
+  return chosen;
+}
+
 }  // namespace internal
 }  // namespace riegeli
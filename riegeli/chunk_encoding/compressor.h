@@ -15,19 +15,25 @@
 #ifndef RIEGELI_CHUNK_ENCODING_COMPRESSOR_H_
 #define RIEGELI_CHUNK_ENCODING_COMPRESSOR_H_
 
+#include <stddef.h>
+
+#include <memory>
 #include <utility>
 
 #include "absl/types/optional.h"
 #include "absl/types/variant.h"
 #include "riegeli/base/base.h"
 #include "riegeli/base/chain.h"
+#include "riegeli/base/memory_estimator.h"
 #include "riegeli/base/object.h"
 #include "riegeli/base/status.h"
 #include "riegeli/bytes/brotli_writer.h"
 #include "riegeli/bytes/chain_writer.h"
+#include "riegeli/bytes/lz4_writer.h"
 #include "riegeli/bytes/snappy_writer.h"
 #include "riegeli/bytes/writer.h"
 #include "riegeli/bytes/zstd_writer.h"
+#include "riegeli/chunk_encoding/compression_backend.h"
 #include "riegeli/chunk_encoding/compressor_options.h"
 
 namespace riegeli {
@@ -106,20 +112,54 @@ class Compressor : public Object {
   //  * `false` - failure (`!healthy()`)
   bool EncodeAndClose(Writer* dest);
 
+  // Returns the number of uncompressed bytes written to `writer()` so far.
+  Position uncompressed_size() const;
+
+  // Returns the amount of memory used by data written so far, compressed or
+  // buffered before compression, like `RegisterSubobjects()` but computed in
+  // constant time. Memory used internally by compression libraries is not
+  // included.
+  size_t ApproximateMemory() const;
+
+  // Registers data written so far, compressed or buffered before compression,
+  // with `MemoryEstimator`. Memory used internally by compression libraries is
+  // not included.
+  void RegisterSubobjects(MemoryEstimator* memory_estimator) const;
+
  private:
   void Initialize();
+  // Makes `writer_` compress with the built-in implementation.
+  void InitializeBuiltin();
 
   CompressorOptions compressor_options_;
   TuningOptions tuning_options_;
+  // The backend registered for `compressor_options_.compression_type()`, or
+  // `nullptr` to use the built-in implementation.
+  std::shared_ptr<CompressionBackend> backend_;
+  // Compressed data, or uncompressed data if `backend_ != nullptr`, which are
+  // compressed by `EncodeAndClose()`.
   Chain compressed_;
   // Invariant:
-  //   `options_.compression_type()` is consistent with
+  //   if `backend_ != nullptr` or `compressor_options_.compression_type()` is
+  //       a custom codec then `writer_` holds `ChainWriter<>`,
+  //   otherwise `options_.compression_type()` is consistent with
   //       the active member of `writer_`
   absl::variant<ChainWriter<>, BrotliWriter<ChainWriter<>>,
-                ZstdWriter<ChainWriter<>>, SnappyWriter<ChainWriter<>>>
+                ZstdWriter<ChainWriter<>>, SnappyWriter<ChainWriter<>>,
+                Lz4Writer<ChainWriter<>>>
       writer_;
 };
 
+// Chooses the compressor options for `data` when
+// `compressor_options.auto_select()` is set, by compressing a sample of `data`
+// with each candidate algorithm. Returns options for a fixed algorithm, with
+// `auto_select()` cleared.
+//
+// If `compressor_options.auto_select()` is not set, returns
+// `compressor_options` unchanged.
+CompressorOptions ChooseCompressorOptions(
+    const CompressorOptions& compressor_options, const Chain& data);
+
 // Implementation details follow.
 
 inline Writer* Compressor::writer() {
@@ -128,6 +168,11 @@ inline Writer* Compressor::writer() {
   return absl::visit([](Writer& writer) { return &writer; }, writer_);
 }
 
+inline Position Compressor::uncompressed_size() const {
+  return absl::visit([](const Writer& writer) { return writer.pos(); },
+                     writer_);
+}
+
 }  // namespace internal
 }  // namespace riegeli
 
@@ -14,6 +14,8 @@
 
 #include "riegeli/chunk_encoding/compressor_options.h"
 
+#include <stdint.h>
+
 #include <string>
 #include <utility>
 
@@ -23,7 +25,9 @@
 #include "riegeli/base/options_parser.h"
 #include "riegeli/base/status.h"
 #include "riegeli/bytes/brotli_writer.h"
+#include "riegeli/bytes/lz4_writer.h"
 #include "riegeli/bytes/zstd_writer.h"
+#include "riegeli/chunk_encoding/compression_backend.h"
 #include "riegeli/chunk_encoding/constants.h"
 
 namespace riegeli {
@@ -38,9 +42,23 @@ constexpr int CompressorOptions::kDefaultBrotli;
 constexpr int CompressorOptions::kMinZstd;
 constexpr int CompressorOptions::kMaxZstd;
 constexpr int CompressorOptions::kDefaultZstd;
+constexpr int CompressorOptions::kMinLz4;
+constexpr int CompressorOptions::kMaxLz4;
+constexpr int CompressorOptions::kMinLz4Hc;
+constexpr int CompressorOptions::kDefaultLz4;
 constexpr int CompressorOptions::kMinWindowLog;
 constexpr int CompressorOptions::kMaxWindowLog;
 constexpr int CompressorOptions::kDefaultWindowLog;
+constexpr int CompressorOptions::kMaxBrotliWorkers;
+constexpr int CompressorOptions::kMaxZstdWorkers;
+constexpr uint64_t CompressorOptions::kMaxZstdJobSize;
+constexpr int CompressorOptions::kDefaultZstdStrategy;
+constexpr int CompressorOptions::kMinZstdStrategy;
+constexpr int CompressorOptions::kMaxZstdStrategy;
+constexpr int CompressorOptions::kMinZstdLdmHashLog;
+constexpr int CompressorOptions::kMaxZstdLdmHashLog;
+constexpr int CompressorOptions::kDefaultZstdLdmHashLog;
+constexpr uint64_t CompressorOptions::kMaxZstdTargetBlockSize;
 #endif
 
 Status CompressorOptions::FromString(absl::string_view text) {
@@ -50,34 +68,80 @@ Status CompressorOptions::FromString(absl::string_view text) {
     OptionsParser options_parser;
     options_parser.AddOption(
         "uncompressed",
-        ValueParser::And(ValueParser::FailIfSeen("brotli", "zstd", "snappy"),
-                         [this](ValueParser* value_parser) {
-                           compression_type_ = CompressionType::kNone;
-                           return true;
-                         }));
+        ValueParser::And(
+            ValueParser::FailIfSeen("brotli", "zstd", "snappy", "lz4",
+                                    "custom"),
+            [this](ValueParser* value_parser) {
+              compression_type_ = CompressionType::kNone;
+              return true;
+            }));
+    options_parser.AddOption(
+        "brotli",
+        ValueParser::And(
+            ValueParser::FailIfSeen("uncompressed", "zstd", "snappy", "lz4",
+                                    "custom"),
+            [this](ValueParser* value_parser) {
+              compression_type_ = CompressionType::kBrotli;
+              return true;
+            }));
+    options_parser.AddOption(
+        "zstd",
+        ValueParser::And(
+            ValueParser::FailIfSeen("uncompressed", "brotli", "snappy", "lz4",
+                                    "custom"),
+            [this](ValueParser* value_parser) {
+              compression_type_ = CompressionType::kZstd;
+              return true;
+            }));
     options_parser.AddOption(
-        "brotli", ValueParser::And(
-                      ValueParser::FailIfSeen("uncompressed", "zstd", "snappy"),
-                      [this](ValueParser* value_parser) {
-                        compression_type_ = CompressionType::kBrotli;
-                        return true;
-                      }));
+        "snappy",
+        ValueParser::And(
+            ValueParser::FailIfSeen("uncompressed", "brotli", "zstd", "lz4",
+                                    "custom"),
+            [this](ValueParser* value_parser) {
+              compression_type_ = CompressionType::kSnappy;
+              return true;
+            }));
     options_parser.AddOption(
-        "zstd", ValueParser::And(
-                    ValueParser::FailIfSeen("uncompressed", "brotli", "snappy"),
-                    [this](ValueParser* value_parser) {
-                      compression_type_ = CompressionType::kZstd;
-                      return true;
-                    }));
+        "lz4",
+        ValueParser::And(
+            ValueParser::FailIfSeen("uncompressed", "brotli", "zstd", "snappy",
+                                    "custom"),
+            [this](ValueParser* value_parser) {
+              compression_type_ = CompressionType::kLz4;
+              return true;
+            }));
     options_parser.AddOption(
-        "snappy", ValueParser::And(
-                      ValueParser::FailIfSeen("uncompressed", "brotli", "zstd"),
-                      [this](ValueParser* value_parser) {
-                        compression_type_ = CompressionType::kSnappy;
-                        return true;
-                      }));
+        "custom",
+        ValueParser::And(
+            ValueParser::FailIfSeen("uncompressed", "brotli", "zstd", "snappy",
+                                    "lz4"),
+            [this](ValueParser* value_parser) {
+              if (ABSL_PREDICT_FALSE(!CustomCompressionFromName(
+                      value_parser->value(), &compression_type_))) {
+                return value_parser->InvalidValue(
+                    "name of a registered custom codec");
+              }
+              return true;
+            }));
     options_parser.AddOption("window_log",
                              [](ValueParser* value_parser) { return true; });
+    options_parser.AddOption("auto_select",
+                             [](ValueParser* value_parser) { return true; });
+    options_parser.AddOption("brotli_workers",
+                             [](ValueParser* value_parser) { return true; });
+    options_parser.AddOption("zstd_workers",
+                             [](ValueParser* value_parser) { return true; });
+    options_parser.AddOption("zstd_job_size",
+                             [](ValueParser* value_parser) { return true; });
+    options_parser.AddOption("zstd_strategy",
+                             [](ValueParser* value_parser) { return true; });
+    options_parser.AddOption("zstd_long",
+                             [](ValueParser* value_parser) { return true; });
+    options_parser.AddOption("zstd_ldm_hash_log",
+                             [](ValueParser* value_parser) { return true; });
+    options_parser.AddOption("zstd_target_block_size",
+                             [](ValueParser* value_parser) { return true; });
     if (ABSL_PREDICT_FALSE(!options_parser.FromString(text))) {
       return options_parser.status();
     }
@@ -107,7 +171,28 @@ Status CompressorOptions::FromString(absl::string_view text) {
   options_parser.AddOption(
       "snappy", ValueParser::And(ValueParser::FailIfSeen("window_log"),
                                  ValueParser::Empty(&compression_level_, 0)));
+  options_parser.AddOption(
+      "lz4",
+      ValueParser::And(
+          ValueParser::FailIfSeen("window_log"),
+          ValueParser::Or(
+              ValueParser::Empty(
+                  &compression_level_,
+                  Lz4WriterBase::Options::kDefaultCompressionLevel),
+              ValueParser::Int(
+                  &compression_level_,
+                  Lz4WriterBase::Options::kMinCompressionLevel,
+                  Lz4WriterBase::Options::kMaxCompressionLevel))));
+  options_parser.AddOption(
+      "custom", ValueParser::And(ValueParser::FailIfSeen("window_log"),
+                                 [this](ValueParser* value_parser) {
+                                   compression_level_ = 0;
+                                   return true;
+                                 }));
   options_parser.AddOption("window_log", [&] {
+    if (IsCustomCompressionType(compression_type_)) {
+      return ValueParser::FailIfSeen("custom");
+    }
     switch (compression_type_) {
       case CompressionType::kNone:
         return ValueParser::FailIfSeen("uncompressed");
@@ -125,10 +210,96 @@ Status CompressorOptions::FromString(absl::string_view text) {
                              ZstdWriterBase::Options::kMaxWindowLog));
       case CompressionType::kSnappy:
         return ValueParser::FailIfSeen("snappy");
+      case CompressionType::kLz4:
+        return ValueParser::FailIfSeen("lz4");
     }
     RIEGELI_ASSERT_UNREACHABLE() << "Unknown compression type: "
                                  << static_cast<unsigned>(compression_type_);
   }());
+  const auto brotli_only = [&](ValueParser::Function function) {
+    if (IsCustomCompressionType(compression_type_)) {
+      return ValueParser::FailIfSeen("custom");
+    }
+    switch (compression_type_) {
+      case CompressionType::kNone:
+        return ValueParser::FailIfSeen("uncompressed");
+      case CompressionType::kBrotli:
+        return function;
+      case CompressionType::kZstd:
+        return ValueParser::FailIfSeen("zstd");
+      case CompressionType::kSnappy:
+        return ValueParser::FailIfSeen("snappy");
+      case CompressionType::kLz4:
+        return ValueParser::FailIfSeen("lz4");
+    }
+    RIEGELI_ASSERT_UNREACHABLE() << "Unknown compression type: "
+                                 << static_cast<unsigned>(compression_type_);
+  };
+  options_parser.AddOption(
+      "brotli_workers",
+      brotli_only(ValueParser::Int(&brotli_workers_, 0, kMaxBrotliWorkers)));
+  const auto zstd_only = [&](ValueParser::Function function) {
+    if (IsCustomCompressionType(compression_type_)) {
+      return ValueParser::FailIfSeen("custom");
+    }
+    switch (compression_type_) {
+      case CompressionType::kNone:
+        return ValueParser::FailIfSeen("uncompressed");
+      case CompressionType::kBrotli:
+        return ValueParser::FailIfSeen("brotli");
+      case CompressionType::kZstd:
+        return function;
+      case CompressionType::kSnappy:
+        return ValueParser::FailIfSeen("snappy");
+      case CompressionType::kLz4:
+        return ValueParser::FailIfSeen("lz4");
+    }
+    RIEGELI_ASSERT_UNREACHABLE() << "Unknown compression type: "
+                                 << static_cast<unsigned>(compression_type_);
+  };
+  options_parser.AddOption(
+      "zstd_workers",
+      zstd_only(ValueParser::Int(&zstd_workers_, 0, kMaxZstdWorkers)));
+  options_parser.AddOption(
+      "zstd_job_size",
+      zstd_only(ValueParser::Bytes(&zstd_job_size_, 0, kMaxZstdJobSize)));
+  options_parser.AddOption(
+      "zstd_strategy",
+      zstd_only(ValueParser::Enum(&zstd_strategy_,
+                                  {{"auto", kDefaultZstdStrategy},
+                                   {"fast", 1},
+                                   {"dfast", 2},
+                                   {"greedy", 3},
+                                   {"lazy", 4},
+                                   {"lazy2", 5},
+                                   {"btlazy2", 6},
+                                   {"btopt", 7},
+                                   {"btultra", 8},
+                                   {"btultra2", 9}})));
+  options_parser.AddOption(
+      "zstd_long",
+      zstd_only(ValueParser::Enum(
+          &zstd_long_distance_matching_,
+          {{"", true}, {"true", true}, {"false", false}})));
+  options_parser.AddOption(
+      "zstd_ldm_hash_log",
+      zstd_only(ValueParser::Or(
+          ValueParser::Enum(&zstd_ldm_hash_log_,
+                            {{"auto", kDefaultZstdLdmHashLog}}),
+          ValueParser::Int(&zstd_ldm_hash_log_, kMinZstdLdmHashLog,
+                           kMaxZstdLdmHashLog))));
+  options_parser.AddOption(
+      "zstd_target_block_size",
+      zstd_only(ValueParser::Bytes(&zstd_target_block_size_, 0,
+                                   kMaxZstdTargetBlockSize)));
+  double min_gain = 0.0;
+  options_parser.AddOption(
+      "auto_select",
+      ValueParser::And(ValueParser::Real(&min_gain, 0.0, 1.0),
+                       [&](ValueParser* value_parser) {
+                         auto_select_ = min_gain;
+                         return true;
+                       }));
   if (ABSL_PREDICT_FALSE(!options_parser.FromString(text))) {
     return options_parser.status();
   }
@@ -136,6 +307,9 @@ Status CompressorOptions::FromString(absl::string_view text) {
 }
 
 int CompressorOptions::window_log() const {
+  RIEGELI_ASSERT(!IsCustomCompressionType(compression_type_))
+      << "Failed precondition of CompressorOptions::window_log(): "
+         "custom codec";
   switch (compression_type_) {
     case CompressionType::kNone:
       RIEGELI_ASSERT_UNREACHABLE()
@@ -169,6 +343,10 @@ int CompressorOptions::window_log() const {
       RIEGELI_ASSERT_UNREACHABLE()
           << "Failed precondition of CompressorOptions::window_log(): "
              "snappy";
+    case CompressionType::kLz4:
+      RIEGELI_ASSERT_UNREACHABLE()
+          << "Failed precondition of CompressorOptions::window_log(): "
+             "lz4";
   }
   RIEGELI_ASSERT_UNREACHABLE() << "Unknown compression type: "
                                << static_cast<unsigned>(compression_type_);
@@ -15,12 +15,18 @@
 #ifndef RIEGELI_CHUNK_ENCODING_COMPRESSOR_OPTIONS_H_
 #define RIEGELI_CHUNK_ENCODING_COMPRESSOR_OPTIONS_H_
 
+#include <stdint.h>
+
 #include <utility>
 
 #include "absl/strings/string_view.h"
+#include "absl/types/optional.h"
 #include "riegeli/base/base.h"
 #include "riegeli/base/status.h"
+#include "riegeli/bytes/brotli_dictionary.h"
 #include "riegeli/bytes/brotli_writer.h"
+#include "riegeli/bytes/lz4_writer.h"
+#include "riegeli/bytes/zstd_dictionary.h"
 #include "riegeli/bytes/zstd_writer.h"
 #include "riegeli/chunk_encoding/constants.h"
 
@@ -38,10 +44,30 @@ class CompressorOptions {
   //     "brotli" (":" brotli_level)? |
   //     "zstd" (":" zstd_level)? |
   //     "snappy" |
-  //     "window_log" ":" window_log
+  //     "lz4" (":" lz4_level)? |
+  //     "window_log" ":" window_log |
+  //     "brotli_workers" ":" brotli_workers |
+  //     "zstd_workers" ":" zstd_workers |
+  //     "zstd_job_size" ":" zstd_job_size |
+  //     "zstd_strategy" ":" zstd_strategy |
+  //     "zstd_long" (":" ("true" | "false"))? |
+  //     "zstd_ldm_hash_log" ":" zstd_ldm_hash_log |
+  //     "zstd_target_block_size" ":" zstd_target_block_size |
+  //     "auto_select" ":" min_gain
   //   brotli_level ::= integer 0..11 (default 9)
   //   zstd_level ::= integer -131072..22 (default 9)
+  //   lz4_level ::= integer -65536..12 (default 0)
   //   window_log ::= "auto" or integer 10..31
+  //   brotli_workers ::= integer 0..200
+  //   zstd_workers ::= integer 0..200
+  //   zstd_job_size ::=
+  //     integer expressed as real with optional suffix [BkKMGTPE], 0..1G
+  //   zstd_strategy ::= "auto" | "fast" | "dfast" | "greedy" | "lazy" |
+  //     "lazy2" | "btlazy2" | "btopt" | "btultra" | "btultra2"
+  //   zstd_ldm_hash_log ::= "auto" or integer 6..30
+  //   zstd_target_block_size ::=
+  //     integer expressed as real with optional suffix [BkKMGTPE], 0..128K
+  //   min_gain ::= real 0..1
   // ```
   //
   // Returns status:
@@ -114,6 +140,211 @@ class CompressorOptions {
     return std::move(set_zstd(compression_level));
   }
 
+  // Brotli dictionary used if compression algorithm is Brotli. This improves
+  // compression density of small chunks similar to the dictionary. The same
+  // dictionary must be used for decompression.
+  //
+  // Default: `BrotliDictionary()` (no dictionary)
+  CompressorOptions& set_brotli_dictionary(
+      BrotliDictionary brotli_dictionary) & {
+    brotli_dictionary_ = std::move(brotli_dictionary);
+    return *this;
+  }
+  CompressorOptions&& set_brotli_dictionary(
+      BrotliDictionary brotli_dictionary) && {
+    return std::move(set_brotli_dictionary(std::move(brotli_dictionary)));
+  }
+  const BrotliDictionary& brotli_dictionary() const {
+    return brotli_dictionary_;
+  }
+
+  // Zstd dictionary used if compression algorithm is Zstd. This improves
+  // compression density of small chunks similar to the dictionary. The same
+  // dictionary must be used for decompression.
+  //
+  // Default: `ZstdDictionary()` (no dictionary)
+  CompressorOptions& set_zstd_dictionary(ZstdDictionary zstd_dictionary) & {
+    zstd_dictionary_ = std::move(zstd_dictionary);
+    return *this;
+  }
+  CompressorOptions&& set_zstd_dictionary(ZstdDictionary zstd_dictionary) && {
+    return std::move(set_zstd_dictionary(std::move(zstd_dictionary)));
+  }
+  const ZstdDictionary& zstd_dictionary() const { return zstd_dictionary_; }
+
+  // Number of background threads compressing a chunk in parallel if
+  // compression algorithm is Brotli. If 0, a chunk is compressed in the thread
+  // encoding it.
+  //
+  // Jobs of the window size (but at least 1M) are compressed independently
+  // (see `BrotliWriterBase::Options::set_num_workers()`), which loses some
+  // compression density. This pays off for chunks at least several times
+  // larger than the window size, especially when chunks are not encoded in
+  // parallel anyway.
+  //
+  // Chunks compressed this way cannot be read by versions of Riegeli which do
+  // not support this option.
+  //
+  // `brotli_workers` must be between 0 and `kMaxBrotliWorkers` (200).
+  // Default: 0.
+  static constexpr int kMaxBrotliWorkers = 200;
+  CompressorOptions& set_brotli_workers(int brotli_workers) & {
+    RIEGELI_ASSERT_GE(brotli_workers, 0)
+        << "Failed precondition of CompressorOptions::set_brotli_workers(): "
+           "negative number of workers";
+    RIEGELI_ASSERT_LE(brotli_workers, kMaxBrotliWorkers)
+        << "Failed precondition of CompressorOptions::set_brotli_workers(): "
+           "number of workers out of range";
+    brotli_workers_ = brotli_workers;
+    return *this;
+  }
+  CompressorOptions&& set_brotli_workers(int brotli_workers) && {
+    return std::move(set_brotli_workers(brotli_workers));
+  }
+  int brotli_workers() const { return brotli_workers_; }
+
+  // Number of background threads compressing a chunk in parallel if
+  // compression algorithm is Zstd. If 0, a chunk is compressed in the thread
+  // encoding it.
+  //
+  // This pays off for chunks at least several times larger than the job size,
+  // especially when chunks are not encoded in parallel anyway.
+  //
+  // `zstd_workers` must be between 0 and `kMaxZstdWorkers` (64 in 32-bit
+  // build, 200 in 64-bit build). Default: 0.
+  static constexpr int kMaxZstdWorkers =
+      ZstdWriterBase::Options::kMaxNumWorkers;
+  CompressorOptions& set_zstd_workers(int zstd_workers) & {
+    RIEGELI_ASSERT_GE(zstd_workers, 0)
+        << "Failed precondition of CompressorOptions::set_zstd_workers(): "
+           "negative number of workers";
+    RIEGELI_ASSERT_LE(zstd_workers, kMaxZstdWorkers)
+        << "Failed precondition of CompressorOptions::set_zstd_workers(): "
+           "number of workers out of range";
+    zstd_workers_ = zstd_workers;
+    return *this;
+  }
+  CompressorOptions&& set_zstd_workers(int zstd_workers) && {
+    return std::move(set_zstd_workers(zstd_workers));
+  }
+  int zstd_workers() const { return zstd_workers_; }
+
+  // Uncompressed size of a job compressed by one worker, if `zstd_workers` is
+  // positive. 0 means to derive it from compression parameters. Smaller sizes
+  // are increased to 1M.
+  //
+  // `zstd_job_size` must be between 0 and `kMaxZstdJobSize` (512M in 32-bit
+  // build, 1G in 64-bit build). Default: 0.
+  static constexpr uint64_t kMaxZstdJobSize =
+      ZstdWriterBase::Options::kMaxJobSize;
+  CompressorOptions& set_zstd_job_size(uint64_t zstd_job_size) & {
+    RIEGELI_ASSERT_LE(zstd_job_size, kMaxZstdJobSize)
+        << "Failed precondition of CompressorOptions::set_zstd_job_size(): "
+           "job size out of range";
+    zstd_job_size_ = zstd_job_size;
+    return *this;
+  }
+  CompressorOptions&& set_zstd_job_size(uint64_t zstd_job_size) && {
+    return std::move(set_zstd_job_size(zstd_job_size));
+  }
+  uint64_t zstd_job_size() const { return zstd_job_size_; }
+
+  // Match finding strategy if compression algorithm is Zstd, between
+  // `kMinZstdStrategy` (1, `ZSTD_fast`) and `kMaxZstdStrategy` (9,
+  // `ZSTD_btultra2`), or `kDefaultZstdStrategy` (0) to derive it from
+  // compression level. Default: `kDefaultZstdStrategy` (0).
+  static constexpr int kDefaultZstdStrategy =
+      ZstdWriterBase::Options::kDefaultStrategy;
+  static constexpr int kMinZstdStrategy = ZstdWriterBase::Options::kMinStrategy;
+  static constexpr int kMaxZstdStrategy = ZstdWriterBase::Options::kMaxStrategy;
+  CompressorOptions& set_zstd_strategy(int zstd_strategy) & {
+    if (zstd_strategy != kDefaultZstdStrategy) {
+      RIEGELI_ASSERT_GE(zstd_strategy, kMinZstdStrategy)
+          << "Failed precondition of CompressorOptions::set_zstd_strategy(): "
+             "strategy out of range";
+      RIEGELI_ASSERT_LE(zstd_strategy, kMaxZstdStrategy)
+          << "Failed precondition of CompressorOptions::set_zstd_strategy(): "
+             "strategy out of range";
+    }
+    zstd_strategy_ = zstd_strategy;
+    return *this;
+  }
+  CompressorOptions&& set_zstd_strategy(int zstd_strategy) && {
+    return std::move(set_zstd_strategy(zstd_strategy));
+  }
+  int zstd_strategy() const { return zstd_strategy_; }
+
+  // If `true` and compression algorithm is Zstd, enables long distance
+  // matching, which finds matches also far in the past. This helps chunks with
+  // long repetitions, especially together with a large `window_log`.
+  //
+  // Default: `false`.
+  CompressorOptions& set_zstd_long_distance_matching(
+      bool zstd_long_distance_matching) & {
+    zstd_long_distance_matching_ = zstd_long_distance_matching;
+    return *this;
+  }
+  CompressorOptions&& set_zstd_long_distance_matching(
+      bool zstd_long_distance_matching) && {
+    return std::move(
+        set_zstd_long_distance_matching(zstd_long_distance_matching));
+  }
+  bool zstd_long_distance_matching() const {
+    return zstd_long_distance_matching_;
+  }
+
+  // Logarithm of the size of the hash table used for Zstd long distance
+  // matching, between `kMinZstdLdmHashLog` (6) and `kMaxZstdLdmHashLog` (30),
+  // or `kDefaultZstdLdmHashLog` (0) to derive it from `window_log`.
+  // Default: `kDefaultZstdLdmHashLog` (0).
+  static constexpr int kMinZstdLdmHashLog =
+      ZstdWriterBase::Options::kMinLdmHashLog;
+  static constexpr int kMaxZstdLdmHashLog =
+      ZstdWriterBase::Options::kMaxLdmHashLog;
+  static constexpr int kDefaultZstdLdmHashLog =
+      ZstdWriterBase::Options::kDefaultLdmHashLog;
+  CompressorOptions& set_zstd_ldm_hash_log(int zstd_ldm_hash_log) & {
+    if (zstd_ldm_hash_log != kDefaultZstdLdmHashLog) {
+      RIEGELI_ASSERT_GE(zstd_ldm_hash_log, kMinZstdLdmHashLog)
+          << "Failed precondition of "
+             "CompressorOptions::set_zstd_ldm_hash_log(): "
+             "LDM hash log out of range";
+      RIEGELI_ASSERT_LE(zstd_ldm_hash_log, kMaxZstdLdmHashLog)
+          << "Failed precondition of "
+             "CompressorOptions::set_zstd_ldm_hash_log(): "
+             "LDM hash log out of range";
+    }
+    zstd_ldm_hash_log_ = zstd_ldm_hash_log;
+    return *this;
+  }
+  CompressorOptions&& set_zstd_ldm_hash_log(int zstd_ldm_hash_log) && {
+    return std::move(set_zstd_ldm_hash_log(zstd_ldm_hash_log));
+  }
+  int zstd_ldm_hash_log() const { return zstd_ldm_hash_log_; }
+
+  // Desired size of compressed Zstd blocks, or 0 to let blocks be as large as
+  // possible. Smaller blocks let a streaming reader start decompressing
+  // sooner, at some cost in compression density.
+  //
+  // `zstd_target_block_size` must be between 0 and `kMaxZstdTargetBlockSize`
+  // (128K). Default: 0.
+  static constexpr uint64_t kMaxZstdTargetBlockSize =
+      ZstdWriterBase::Options::kMaxTargetBlockSize;
+  CompressorOptions& set_zstd_target_block_size(
+      uint64_t zstd_target_block_size) & {
+    RIEGELI_ASSERT_LE(zstd_target_block_size, kMaxZstdTargetBlockSize)
+        << "Failed precondition of "
+           "CompressorOptions::set_zstd_target_block_size(): "
+           "target block size out of range";
+    zstd_target_block_size_ = zstd_target_block_size;
+    return *this;
+  }
+  CompressorOptions&& set_zstd_target_block_size(
+      uint64_t zstd_target_block_size) && {
+    return std::move(set_zstd_target_block_size(zstd_target_block_size));
+  }
+  uint64_t zstd_target_block_size() const { return zstd_target_block_size_; }
+
   // Changes compression algorithm to Snappy.
   //
   // There are no Snappy compression levels to tune.
@@ -124,6 +355,57 @@ class CompressorOptions {
   }
   CompressorOptions&& set_snappy() && { return std::move(set_snappy()); }
 
+  // Changes compression algorithm to LZ4. Sets compression level which tunes
+  // the tradeoff between compression density and compression speed (higher =
+  // better density but slower). Levels from `kMinLz4Hc` (3) select LZ4-HC,
+  // which compresses much slower but decompresses as fast as LZ4.
+  //
+  // `compression_level` must be between `kMinLz4` (-65536) and `kMaxLz4` (12).
+  // Default: `kDefaultLz4` (0).
+  static constexpr int kMinLz4 = Lz4WriterBase::Options::kMinCompressionLevel;
+  static constexpr int kMaxLz4 = Lz4WriterBase::Options::kMaxCompressionLevel;
+  static constexpr int kMinLz4Hc =
+      Lz4WriterBase::Options::kMinHighCompressionLevel;
+  static constexpr int kDefaultLz4 =
+      Lz4WriterBase::Options::kDefaultCompressionLevel;
+  CompressorOptions& set_lz4(int compression_level = kDefaultLz4) & {
+    RIEGELI_ASSERT_GE(compression_level, kMinLz4)
+        << "Failed precondition of CompressorOptions::set_lz4(): "
+           "compression level out of range";
+    RIEGELI_ASSERT_LE(compression_level, kMaxLz4)
+        << "Failed precondition of CompressorOptions::set_lz4(): "
+           "compression level out of range";
+    compression_type_ = CompressionType::kLz4;
+    compression_level_ = compression_level;
+    return *this;
+  }
+  CompressorOptions&& set_lz4(int compression_level = kDefaultLz4) && {
+    return std::move(set_lz4(compression_level));
+  }
+
+  // Changes compression algorithm to a custom codec registered with
+  // `RegisterCustomCompression()`. Sets compression level which is passed to
+  // the codec.
+  //
+  // `compression_type` must be between `kMinCustomCompressionType` and
+  // `kMaxCustomCompressionType`. The codec must be registered when data are
+  // compressed and decompressed.
+  CompressorOptions& set_custom_compression(CompressionType compression_type,
+                                            int compression_level = 0) & {
+    RIEGELI_ASSERT(IsCustomCompressionType(compression_type))
+        << "Failed precondition of "
+           "CompressorOptions::set_custom_compression(): "
+           "compression type not reserved for custom codecs";
+    compression_type_ = compression_type;
+    compression_level_ = compression_level;
+    return *this;
+  }
+  CompressorOptions&& set_custom_compression(CompressionType compression_type,
+                                             int compression_level = 0) && {
+    return std::move(
+        set_custom_compression(compression_type, compression_level));
+  }
+
   CompressionType compression_type() const { return compression_type_; }
 
   int compression_level() const { return compression_level_; }
@@ -135,7 +417,8 @@ class CompressorOptions {
   // Special value `kDefaultWindowLog` (-1) means to keep the default
   // (brotli: 22, zstd: derived from compression level and chunk size).
   //
-  // For uncompressed and snappy, `window_log` must be `kDefaultWindowLog` (-1).
+  // For uncompressed, snappy, lz4, and custom codecs, `window_log` must be
+  // `kDefaultWindowLog` (-1).
   //
   // For brotli, `window_log` must be `kDefaultWindowLog` (-1) or between
   // `BrotliWriterBase::Options::kMinWindowLog` (10) and
@@ -172,13 +455,53 @@ class CompressorOptions {
 
   // Returns `window_log` translated for `BrotliWriter` or `ZstdWriter`.
   //
-  // Precondition: `compression_type_ != CompressionType::kNone`
+  // Precondition: `compression_type_` is `CompressionType::kBrotli` or
+  //               `CompressionType::kZstd`
   int window_log() const;
 
+  // If not `absl::nullopt`, each chunk is compressed either with the
+  // compression algorithm set above, or with a faster alternative: Snappy or
+  // none, depending on a sample of its data. A slower algorithm is chosen only
+  // if it makes the sample smaller than the next faster one by at least
+  // `min_gain` times the uncompressed size, so `min_gain` expresses how much
+  // density is worth the additional compression and decompression cost.
+  //
+  // This avoids paying for strong compression of incompressible data in files
+  // with mixed contents. The chosen algorithm is recorded in each chunk.
+  //
+  // `min_gain` must be between 0.0 and 1.0.
+  // Default: `absl::nullopt` (always use the algorithm set above).
+  CompressorOptions& set_auto_select(absl::optional<double> min_gain) & {
+    if (min_gain != absl::nullopt) {
+      RIEGELI_ASSERT_GE(*min_gain, 0.0)
+          << "Failed precondition of CompressorOptions::set_auto_select(): "
+             "minimum gain out of range";
+      RIEGELI_ASSERT_LE(*min_gain, 1.0)
+          << "Failed precondition of CompressorOptions::set_auto_select(): "
+             "minimum gain out of range";
+    }
+    auto_select_ = min_gain;
+    return *this;
+  }
+  CompressorOptions&& set_auto_select(absl::optional<double> min_gain) && {
+    return std::move(set_auto_select(min_gain));
+  }
+  absl::optional<double> auto_select() const { return auto_select_; }
+
  private:
   CompressionType compression_type_ = CompressionType::kBrotli;
   int compression_level_ = kDefaultBrotli;
   int window_log_ = kDefaultWindowLog;
+  BrotliDictionary brotli_dictionary_;
+  ZstdDictionary zstd_dictionary_;
+  int brotli_workers_ = 0;
+  int zstd_workers_ = 0;
+  uint64_t zstd_job_size_ = 0;
+  int zstd_strategy_ = kDefaultZstdStrategy;
+  bool zstd_long_distance_matching_ = false;
+  int zstd_ldm_hash_log_ = kDefaultZstdLdmHashLog;
+  uint64_t zstd_target_block_size_ = 0;
+  absl::optional<double> auto_select_;
 };
 
 }  // namespace riegeli
@@ -15,6 +15,7 @@
 #ifndef RIEGELI_CHUNK_ENCODING_CONSTANTS_H_
 #define RIEGELI_CHUNK_ENCODING_CONSTANTS_H_
 
+#include <stddef.h>
 #include <stdint.h>
 
 #include <limits>
@@ -29,7 +30,18 @@ enum class ChunkType : uint8_t {
   kFileMetadata = 'm',
   kPadding = 'p',
   kSimple = 'r',
+  kSimpleWithBlocks = 'b',
+  kSimpleWithReferences = 'e',
   kTransposed = 't',
+  kIndex = 'i',
+  kDictionary = 'd',
+  kStatistics = 'c',
+  kKeyFilters = 'k',
+  kFirstKeys = 'f',
+  kSharedTransposeHeader = 'h',
+  kTransposedWithSharedHeader = 'u',
+  kTransposedWithBufferEncodings = 'n',
+  kSimpleWithPrefix = 'x',
 };
 
 // These values are frozen in the file format.
@@ -38,8 +50,41 @@ enum class CompressionType : uint8_t {
   kBrotli = 'b',
   kZstd = 'z',
   kSnappy = 's',
+  kLz4 = 'l',
 };
 
+// Compression types from `kMinCustomCompressionType` to
+// `kMaxCustomCompressionType` are reserved for codecs registered by
+// applications with `RegisterCustomCompression()`. They are never assigned to
+// built-in codecs.
+RIEGELI_INTERNAL_INLINE_CONSTEXPR(uint8_t, kMinCustomCompressionType, 0xf0);
+RIEGELI_INTERNAL_INLINE_CONSTEXPR(uint8_t, kMaxCustomCompressionType, 0xff);
+
+// Returns `true` if `compression_type` is reserved for a custom codec.
+inline bool IsCustomCompressionType(CompressionType compression_type) {
+  // `kMaxCustomCompressionType` is the largest `uint8_t`.
+  return static_cast<uint8_t>(compression_type) >= kMinCustomCompressionType;
+}
+
+// Algorithm computing `data_hash` in chunk headers of a file, stored in its
+// file signature. Hashes of block headers and chunk headers always use
+// HighwayHash.
+//
+// These values are frozen in the file format.
+enum class HashType : uint8_t {
+  kHighwayHash = 0,
+  kCrc32c = 1,
+  kHighwayHashTree = 2,
+};
+
+// The largest `HashType` understood by this version.
+RIEGELI_INTERNAL_INLINE_CONSTEXPR(HashType, kMaxHashType,
+                                  HashType::kHighwayHashTree);
+
+// The size of segments hashed independently by `HashType::kHighwayHashTree`.
+RIEGELI_INTERNAL_INLINE_CONSTEXPR(size_t, kHashTreeSegmentSize,
+                                  size_t{1} << 20);
+
 RIEGELI_INTERNAL_INLINE_CONSTEXPR(uint64_t, kMaxNumRecords,
                                   std::numeric_limits<uint64_t>::max() >> 8);
 
@@ -14,16 +14,181 @@
 
 #include "riegeli/chunk_encoding/decompressor.h"
 
+#include <stddef.h>
 #include <stdint.h>
 
+#include <memory>
+#include <string>
+#include <utility>
+
+#include "absl/base/optimization.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/string_view.h"
+#include "absl/types/span.h"
+#include "riegeli/base/base.h"
+#include "riegeli/base/canonical_errors.h"
 #include "riegeli/base/chain.h"
+#include "riegeli/base/status.h"
+#include "riegeli/base/tracing.h"
+#include "riegeli/bytes/brotli_dictionary.h"
+#include "riegeli/bytes/brotli_reader.h"
 #include "riegeli/bytes/chain_reader.h"
+#include "riegeli/bytes/reader.h"
 #include "riegeli/bytes/reader_utils.h"
+#include "riegeli/bytes/zstd_dictionary.h"
+#include "riegeli/bytes/zstd_reader.h"
+#include "riegeli/chunk_encoding/compression_backend.h"
 #include "riegeli/chunk_encoding/constants.h"
+#include "snappy.h"
+#include "zstd.h"
 
 namespace riegeli {
 namespace internal {
 
+namespace {
+
+// Larger streams are decompressed by streaming, to avoid allocating a large
+// flat buffer at once based on a size read from possibly corrupted data.
+constexpr uint64_t kMaxFlatDecompressedSize = uint64_t{16} << 20;
+
+// A custom codec has no streaming fallback, so a larger stream of a custom
+// codec is decompressed at once only if its decompressed size is at most this
+// many times its compressed size.
+constexpr uint64_t kMaxCustomCompressionRatio = 1024;
+
+bool DecompressFlatZstd(Reader* src, const ZstdDictionary& zstd_dictionary,
+                        size_t decompressed_size, Chain* dest,
+                        Status* status) {
+  src->Pull(18 /* `ZSTD_FRAMEHEADERSIZE_MAX` */);
+  const size_t compressed_size =
+      ZSTD_findFrameCompressedSize(src->cursor(), src->available());
+  if (ZSTD_isError(compressed_size)) return false;
+  const unsigned long long frame_content_size =
+      ZSTD_getFrameContentSize(src->cursor(), src->available());
+  if (frame_content_size != ZSTD_CONTENTSIZE_UNKNOWN &&
+      frame_content_size != decompressed_size) {
+    return false;
+  }
+  const absl::Span<char> buffer = dest->AppendFixedBuffer(decompressed_size);
+  *status = ZstdReaderBase::DecompressFlat(
+      absl::string_view(src->cursor(), compressed_size), buffer,
+      zstd_dictionary);
+  if (ABSL_PREDICT_TRUE(status->ok())) {
+    src->set_cursor(src->cursor() + compressed_size);
+  }
+  return true;
+}
+
+bool DecompressFlatBrotli(Reader* src, const ZstdDictionary& zstd_dictionary,
+                          size_t decompressed_size, Chain* dest,
+                          Status* status) {
+  // Brotli-compressed stream extends until the end of the source.
+  Position size;
+  if (!src->SupportsRandomAccess() || !src->Size(&size) ||
+      size != src->pos() + src->available()) {
+    return false;
+  }
+  const absl::Span<char> buffer = dest->AppendFixedBuffer(decompressed_size);
+  *status = BrotliReaderBase::DecompressFlat(
+      absl::string_view(src->cursor(), src->available()), buffer,
+      ToBrotliDictionary(zstd_dictionary));
+  if (ABSL_PREDICT_TRUE(status->ok())) src->set_cursor(src->limit());
+  return true;
+}
+
+bool DecompressFlatSnappy(Reader* src, size_t decompressed_size, Chain* dest,
+                          Status* status) {
+  // Snappy-compressed stream extends until the end of the source.
+  Position size;
+  if (!src->SupportsRandomAccess() || !src->Size(&size) ||
+      size != src->pos() + src->available()) {
+    return false;
+  }
+  size_t uncompressed_length;
+  if (!snappy::GetUncompressedLength(src->cursor(), src->available(),
+                                     &uncompressed_length) ||
+      uncompressed_length != decompressed_size) {
+    return false;
+  }
+  const absl::Span<char> buffer = dest->AppendFixedBuffer(decompressed_size);
+  if (ABSL_PREDICT_FALSE(!snappy::RawUncompress(
+          src->cursor(), src->available(), buffer.data()))) {
+    *status = DataLossError("Invalid snappy-compressed stream");
+    return true;
+  }
+  src->set_cursor(src->limit());
+  *status = OkStatus();
+  return true;
+}
+
+bool DecompressFlatBackend(Reader* src, CompressionType compression_type,
+                           const ZstdDictionary& zstd_dictionary,
+                           CompressionBackend* backend,
+                           size_t decompressed_size, Chain* dest,
+                           Status* status) {
+  absl::string_view compressed;
+  // If not empty, `compressed` points to this copy of the source instead of to
+  // its buffer.
+  std::string compressed_copy;
+  if (compression_type == CompressionType::kZstd) {
+    src->Pull(18 /* `ZSTD_FRAMEHEADERSIZE_MAX` */);
+    const size_t compressed_size =
+        ZSTD_findFrameCompressedSize(src->cursor(), src->available());
+    if (ZSTD_isError(compressed_size)) return false;
+    compressed = absl::string_view(src->cursor(), compressed_size);
+  } else {
+    // Brotli-compressed, Snappy-compressed, and custom streams extend until
+    // the end of the source.
+    Position size;
+    if (src->SupportsRandomAccess() && src->Size(&size) &&
+        size == src->pos() + src->available()) {
+      compressed = absl::string_view(src->cursor(), src->available());
+    } else if (IsCustomCompressionType(compression_type)) {
+      // A custom codec has no streaming fallback.
+      if (ABSL_PREDICT_FALSE(!src->ReadAll(&compressed_copy))) {
+        *status = src->status();
+        return true;
+      }
+      compressed = compressed_copy;
+    } else {
+      return false;
+    }
+  }
+  if (ABSL_PREDICT_FALSE(decompressed_size > kMaxFlatDecompressedSize &&
+                         decompressed_size / kMaxCustomCompressionRatio >
+                             compressed.size())) {
+    // Only a custom codec gets here with a large `decompressed_size`.
+    *status = ResourceExhaustedError(absl::StrCat(
+        "Decompressed size too large for the compressed size: ",
+        decompressed_size, " > ", compressed.size(), " * ",
+        kMaxCustomCompressionRatio));
+    return true;
+  }
+  const absl::Span<char> buffer = dest->AppendFixedBuffer(decompressed_size);
+  Status backend_status = backend->Decompress(compression_type, compressed,
+                                              zstd_dictionary, buffer);
+  if (ABSL_PREDICT_FALSE(IsUnimplemented(backend_status)) &&
+      compressed_copy.empty() && !IsCustomCompressionType(compression_type)) {
+    // Fall back to the built-in implementation.
+    dest->RemoveSuffix(decompressed_size);
+    return false;
+  }
+  *status = std::move(backend_status);
+  if (ABSL_PREDICT_TRUE(status->ok()) && compressed_copy.empty()) {
+    src->set_cursor(src->cursor() + compressed.size());
+  }
+  return true;
+}
+
+}  // namespace
+
+BrotliDictionary ToBrotliDictionary(ZstdDictionary zstd_dictionary) {
+  if (zstd_dictionary.empty()) return BrotliDictionary();
+  const absl::string_view data = zstd_dictionary.data();
+  return BrotliDictionary(
+      data, std::make_shared<const ZstdDictionary>(std::move(zstd_dictionary)));
+}
+
 bool UncompressedSize(const Chain& compressed_data,
                       CompressionType compression_type,
                       uint64_t* uncompressed_size) {
@@ -35,5 +200,42 @@ bool UncompressedSize(const Chain& compressed_data,
   return ReadVarint64(&compressed_data_reader, uncompressed_size);
 }
 
+bool DecompressFlat(Reader* src, CompressionType compression_type,
+                    const ZstdDictionary& zstd_dictionary,
+                    uint64_t decompressed_size, Chain* dest, Status* status) {
+  if (decompressed_size > kMaxFlatDecompressedSize &&
+      !IsCustomCompressionType(compression_type)) {
+    return false;
+  }
+  const TraceScope trace("Decompress");
+  if (compression_type != CompressionType::kNone) {
+    const std::shared_ptr<CompressionBackend> backend =
+        GetCompressionBackend(compression_type);
+    if (backend != nullptr &&
+        DecompressFlatBackend(src, compression_type, zstd_dictionary,
+                              backend.get(), IntCast<size_t>(decompressed_size),
+                              dest, status)) {
+      return true;
+    }
+  }
+  switch (compression_type) {
+    case CompressionType::kZstd:
+      return DecompressFlatZstd(src, zstd_dictionary,
+                                IntCast<size_t>(decompressed_size), dest,
+                                status);
+    case CompressionType::kSnappy:
+      return DecompressFlatSnappy(src, IntCast<size_t>(decompressed_size),
+                                  dest, status);
+    case CompressionType::kBrotli:
+      return DecompressFlatBrotli(src, zstd_dictionary,
+                                  IntCast<size_t>(decompressed_size), dest,
+                                  status);
+    case CompressionType::kNone:
+    case CompressionType::kLz4:
+      return false;
+  }
+  return false;
+}
+
 }  // namespace internal
 }  // namespace riegeli
@@ -30,10 +30,14 @@
 #include "riegeli/base/object.h"
 #include "riegeli/base/resetter.h"
 #include "riegeli/base/status.h"
+#include "riegeli/bytes/brotli_dictionary.h"
 #include "riegeli/bytes/brotli_reader.h"
+#include "riegeli/bytes/chain_reader.h"
+#include "riegeli/bytes/lz4_reader.h"
 #include "riegeli/bytes/reader.h"
 #include "riegeli/bytes/reader_utils.h"
 #include "riegeli/bytes/snappy_reader.h"
+#include "riegeli/bytes/zstd_dictionary.h"
 #include "riegeli/bytes/zstd_reader.h"
 #include "riegeli/chunk_encoding/constants.h"
 
@@ -54,10 +58,49 @@ bool UncompressedSize(const Chain& compressed_data,
                       CompressionType compression_type,
                       uint64_t* uncompressed_size);
 
+// Returns the contents of the dictionary chunk `zstd_dictionary` as a
+// `BrotliDictionary`, sharing the data instead of copying them for each chunk
+// or bucket.
+BrotliDictionary ToBrotliDictionary(ZstdDictionary zstd_dictionary);
+
+// Decompresses at once the compressed stream which begins at the current
+// position of `*src`, if `Decompressor` supports this for `compression_type`,
+// the stream is entirely available in the buffer of `*src`, and its
+// `decompressed_size` is moderate. This avoids the overhead of streaming.
+//
+// A stream of a registered custom codec, which has no streaming `Reader`, is
+// always decompressed here, reading the rest of `*src` if needed. If its
+// `decompressed_size` is large and implausible for its compressed size,
+// decompression fails with `absl::StatusCode::kResourceExhausted` instead of
+// allocating the buffer.
+//
+// Return values:
+//  * `true`  - the stream was decompressed (`*status` is ok, `*dest` is filled,
+//              `*src` is positioned after the stream) or decompression failed
+//              (`!status->ok()`)
+//  * `false` - the stream should be decompressed by a streaming `Reader`
+//              (`*src` is unchanged)
+bool DecompressFlat(Reader* src, CompressionType compression_type,
+                    const ZstdDictionary& zstd_dictionary,
+                    uint64_t decompressed_size, Chain* dest, Status* status);
+
 // Decompresses a compressed stream.
 //
 // If `compression_type` is not `kNone`, reads uncompressed size as a varint
 // from the beginning of compressed data.
+//
+// `zstd_dictionary` is the contents of the dictionary chunk of the file. It is
+// used if `compression_type` is `kZstd`, and as a `BrotliDictionary` if
+// `compression_type` is `kBrotli`. It must be the same dictionary which was
+// used for compression.
+//
+// If the compressed stream is flat and not too large, it is decompressed at
+// once by `DecompressFlat()` instead of by a streaming `Reader`.
+//
+// `Reset()` with the same `compression_type` reuses the decompressing `Reader`
+// together with its buffer, instead of constructing a new one. Decompression
+// contexts themselves are recycled by the `Reader` through `RecyclingPool`, so
+// a thread decompressing many chunks or buckets reuses the same contexts.
 template <typename Src = Reader*>
 class Decompressor : public Object {
  public:
@@ -65,15 +108,18 @@ class Decompressor : public Object {
   Decompressor() noexcept : Object(kInitiallyClosed) {}
 
   // Will read from the compressed stream provided by `src`.
-  explicit Decompressor(const Src& src, CompressionType compression_type);
-  explicit Decompressor(Src&& src, CompressionType compression_type);
+  explicit Decompressor(const Src& src, CompressionType compression_type,
+                        ZstdDictionary zstd_dictionary = ZstdDictionary());
+  explicit Decompressor(Src&& src, CompressionType compression_type,
+                        ZstdDictionary zstd_dictionary = ZstdDictionary());
 
   // Will read from the compressed stream provided by a `Src` constructed from
   // elements of `src_args`. This avoids constructing a temporary `Src` and
   // moving from it.
   template <typename... SrcArgs>
   explicit Decompressor(std::tuple<SrcArgs...> src_args,
-                        CompressionType compression_type);
+                        CompressionType compression_type,
+                        ZstdDictionary zstd_dictionary = ZstdDictionary());
 
   Decompressor(Decompressor&& that) noexcept;
   Decompressor& operator=(Decompressor&& that) noexcept;
@@ -81,10 +127,13 @@ class Decompressor : public Object {
   // Makes `*this` equivalent to a newly constructed `Decompressor`. This avoids
   // constructing a temporary `Decompressor` and moving from it.
   void Reset();
-  void Reset(const Src& src, CompressionType compression_type);
-  void Reset(Src&& src, CompressionType compression_type);
+  void Reset(const Src& src, CompressionType compression_type,
+             ZstdDictionary zstd_dictionary = ZstdDictionary());
+  void Reset(Src&& src, CompressionType compression_type,
+             ZstdDictionary zstd_dictionary = ZstdDictionary());
   template <typename... SrcArgs>
-  void Reset(std::tuple<SrcArgs...> src_args, CompressionType compression_type);
+  void Reset(std::tuple<SrcArgs...> src_args, CompressionType compression_type,
+             ZstdDictionary zstd_dictionary = ZstdDictionary());
 
   // Returns the `Reader` from which uncompressed data should be read.
   //
@@ -112,10 +161,22 @@ class Decompressor : public Object {
 
  private:
   template <typename SrcInit>
-  void Initialize(SrcInit&& src_init, CompressionType compression_type);
+  void Initialize(SrcInit&& src_init, CompressionType compression_type,
+                  ZstdDictionary zstd_dictionary);
+
+  // Makes `reader_` hold a `CompressedReader` constructed from `args`, or
+  // resets the `CompressedReader` already held there.
+  template <typename CompressedReader, typename... Args>
+  void EmplaceReader(Args&&... args);
+
+  // The compressed `Reader` together with data decompressed from it at once.
+  struct FlatReader {
+    Dependency<Reader*, Src> src;
+    ChainReader<Chain> decompressed;
+  };
 
   absl::variant<Dependency<Reader*, Src>, BrotliReader<Src>, ZstdReader<Src>,
-                SnappyReader<Src>>
+                SnappyReader<Src>, Lz4Reader<Src>, FlatReader>
       reader_;
 };
 
@@ -123,24 +184,28 @@ class Decompressor : public Object {
 
 template <typename Src>
 inline Decompressor<Src>::Decompressor(const Src& src,
-                                       CompressionType compression_type)
+                                       CompressionType compression_type,
+                                       ZstdDictionary zstd_dictionary)
     : Object(kInitiallyOpen) {
-  Initialize(src, compression_type);
+  Initialize(src, compression_type, std::move(zstd_dictionary));
 }
 
 template <typename Src>
 inline Decompressor<Src>::Decompressor(Src&& src,
-                                       CompressionType compression_type)
+                                       CompressionType compression_type,
+                                       ZstdDictionary zstd_dictionary)
     : Object(kInitiallyOpen) {
-  Initialize(std::move(src), compression_type);
+  Initialize(std::move(src), compression_type, std::move(zstd_dictionary));
 }
 
 template <typename Src>
 template <typename... SrcArgs>
 inline Decompressor<Src>::Decompressor(std::tuple<SrcArgs...> src_args,
-                                       CompressionType compression_type)
+                                       CompressionType compression_type,
+                                       ZstdDictionary zstd_dictionary)
     : Object(kInitiallyOpen) {
-  Initialize(std::move(src_args), compression_type);
+  Initialize(std::move(src_args), compression_type,
+             std::move(zstd_dictionary));
 }
 
 template <typename Src>
@@ -163,30 +228,35 @@ inline void Decompressor<Src>::Reset() {
 
 template <typename Src>
 inline void Decompressor<Src>::Reset(const Src& src,
-                                     CompressionType compression_type) {
+                                     CompressionType compression_type,
+                                     ZstdDictionary zstd_dictionary) {
   Object::Reset(kInitiallyOpen);
-  Initialize(src, compression_type);
+  Initialize(src, compression_type, std::move(zstd_dictionary));
 }
 
 template <typename Src>
 inline void Decompressor<Src>::Reset(Src&& src,
-                                     CompressionType compression_type) {
+                                     CompressionType compression_type,
+                                     ZstdDictionary zstd_dictionary) {
   Object::Reset(kInitiallyOpen);
-  Initialize(std::move(src), compression_type);
+  Initialize(std::move(src), compression_type, std::move(zstd_dictionary));
 }
 
 template <typename Src>
 template <typename... SrcArgs>
 inline void Decompressor<Src>::Reset(std::tuple<SrcArgs...> src_args,
-                                     CompressionType compression_type) {
+                                     CompressionType compression_type,
+                                     ZstdDictionary zstd_dictionary) {
   Object::Reset(kInitiallyOpen);
-  Initialize(std::move(src_args), compression_type);
+  Initialize(std::move(src_args), compression_type,
+             std::move(zstd_dictionary));
 }
 
 template <typename Src>
 template <typename SrcInit>
 void Decompressor<Src>::Initialize(SrcInit&& src_init,
-                                   CompressionType compression_type) {
+                                   CompressionType compression_type,
+                                   ZstdDictionary zstd_dictionary) {
   if (compression_type == CompressionType::kNone) {
     reader_.template emplace<Dependency<Reader*, Src>>(
         std::forward<SrcInit>(src_init));
@@ -199,27 +269,70 @@ void Decompressor<Src>::Initialize(SrcInit&& src_init,
     Fail(*compressed_reader, DataLossError("Reading decompressed size failed"));
     return;
   }
+  {
+    Chain decompressed;
+    Status status;
+    if (DecompressFlat(compressed_reader.get(), compression_type,
+                       zstd_dictionary, decompressed_size, &decompressed,
+                       &status)) {
+      if (ABSL_PREDICT_FALSE(!status.ok())) {
+        Fail(std::move(status));
+        return;
+      }
+      FlatReader& reader = reader_.template emplace<FlatReader>();
+      reader.src = std::move(compressed_reader);
+      reader.decompressed.Reset(std::move(decompressed));
+      return;
+    }
+  }
+  if (ABSL_PREDICT_FALSE(IsCustomCompressionType(compression_type))) {
+    // `DecompressFlat()` handles registered custom codecs.
+    Fail(FailedPreconditionError(
+        absl::StrCat("Custom compression type not registered: ",
+                     static_cast<unsigned>(compression_type))));
+    return;
+  }
   switch (compression_type) {
     case CompressionType::kNone:
       RIEGELI_ASSERT_UNREACHABLE() << "kNone handled above";
     case CompressionType::kBrotli:
-      reader_.template emplace<BrotliReader<Src>>(
-          std::move(compressed_reader.manager()));
+      EmplaceReader<BrotliReader<Src>>(
+          std::move(compressed_reader.manager()),
+          BrotliReaderBase::Options()
+              .set_dictionary(ToBrotliDictionary(std::move(zstd_dictionary)))
+              .set_concatenated(true));
       return;
     case CompressionType::kZstd:
-      reader_.template emplace<ZstdReader<Src>>(
+      EmplaceReader<ZstdReader<Src>>(
           std::move(compressed_reader.manager()),
-          ZstdReaderBase::Options().set_size_hint(decompressed_size));
+          ZstdReaderBase::Options()
+              .set_dictionary(std::move(zstd_dictionary))
+              .set_size_hint(decompressed_size));
       return;
     case CompressionType::kSnappy:
-      reader_.template emplace<SnappyReader<Src>>(
-          std::move(compressed_reader.manager()));
+      EmplaceReader<SnappyReader<Src>>(std::move(compressed_reader.manager()));
+      return;
+    case CompressionType::kLz4:
+      EmplaceReader<Lz4Reader<Src>>(
+          std::move(compressed_reader.manager()),
+          Lz4ReaderBase::Options().set_size_hint(decompressed_size));
       return;
   }
   Fail(DataLossError(absl::StrCat("Unknown compression type: ",
                                   static_cast<unsigned>(compression_type))));
 }
 
+template <typename Src>
+template <typename CompressedReader, typename... Args>
+inline void Decompressor<Src>::EmplaceReader(Args&&... args) {
+  CompressedReader* const reader = absl::get_if<CompressedReader>(&reader_);
+  if (reader != nullptr) {
+    reader->Reset(std::forward<Args>(args)...);
+  } else {
+    reader_.template emplace<CompressedReader>(std::forward<Args>(args)...);
+  }
+}
+
 template <typename Src>
 inline Reader* Decompressor<Src>::reader() {
   struct Visitor {
@@ -227,6 +340,9 @@ inline Reader* Decompressor<Src>::reader() {
       return reader.get();
     }
     Reader* operator()(Reader& reader) const { return &reader; }
+    Reader* operator()(FlatReader& reader) const {
+      return &reader.decompressed;
+    }
   };
   RIEGELI_ASSERT(healthy())
       << "Failed precondition of Decompressor::reader(): " << status();
@@ -244,6 +360,14 @@ void Decompressor<Src>::Done() {
     void operator()(Reader& reader) const {
       if (ABSL_PREDICT_FALSE(!reader.Close())) self->Fail(reader);
     }
+    void operator()(FlatReader& reader) const {
+      if (ABSL_PREDICT_FALSE(!reader.decompressed.Close())) {
+        self->Fail(reader.decompressed);
+      }
+      if (reader.src.is_owning()) {
+        if (ABSL_PREDICT_FALSE(!reader.src->Close())) self->Fail(*reader.src);
+      }
+    }
     Decompressor* self;
   };
   absl::visit(Visitor{this}, reader_);
@@ -262,6 +386,13 @@ inline void Decompressor<Src>::VerifyEnd() {
       if (reader.is_owning()) reader->VerifyEnd();
     }
     void operator()(Reader& reader) const { reader.VerifyEnd(); }
+    void operator()(FlatReader& reader) const {
+      reader.decompressed.VerifyEnd();
+      if (reader.src.is_owning() &&
+          ABSL_PREDICT_TRUE(reader.decompressed.healthy())) {
+        reader.src->VerifyEnd();
+      }
+    }
   };
   if (ABSL_PREDICT_TRUE(healthy())) absl::visit(Visitor(), reader_);
 }
@@ -30,6 +30,7 @@
 #include "riegeli/base/base.h"
 #include "riegeli/base/canonical_errors.h"
 #include "riegeli/base/chain.h"
+#include "riegeli/base/memory_estimator.h"
 #include "riegeli/base/status.h"
 #include "riegeli/bytes/chain_writer.h"
 #include "riegeli/bytes/message_serialize.h"
@@ -41,14 +42,18 @@ namespace riegeli {
 
 void DeferredEncoder::Clear() {
   ChunkEncoder::Clear();
-  base_encoder_->Clear();
+  if (base_encoder_factory_ != nullptr) {
+    base_encoder_.reset();
+  } else {
+    base_encoder_->Clear();
+  }
   records_writer_.Reset(std::forward_as_tuple());
   limits_.clear();
 }
 
-bool DeferredEncoder::AddRecord(const google::protobuf::MessageLite& record) {
+bool DeferredEncoder::AddRecordWithCachedSize(
+    const google::protobuf::MessageLite& record, size_t size) {
   if (ABSL_PREDICT_FALSE(!healthy())) return false;
-  const size_t size = record.ByteSizeLong();
   if (ABSL_PREDICT_FALSE(num_records_ ==
                          UnsignedMin(limits_.max_size(), kMaxNumRecords))) {
     return Fail(ResourceExhaustedError("Too many records"));
@@ -60,7 +65,8 @@ bool DeferredEncoder::AddRecord(const google::protobuf::MessageLite& record) {
   ++num_records_;
   decoded_data_size_ += IntCast<uint64_t>(size);
   {
-    Status status = SerializeToWriter(record, &records_writer_);
+    Status status = internal::SerializeWithCachedSizesToWriter(
+        record, size, &records_writer_);
     if (ABSL_PREDICT_FALSE(!status.ok())) {
       return Fail(std::move(status));
     }
@@ -138,6 +144,9 @@ bool DeferredEncoder::EncodeAndClose(Writer* dest, ChunkType* chunk_type,
   if (ABSL_PREDICT_FALSE(!records_writer_.Close())) {
     return Fail(records_writer_);
   }
+  if (base_encoder_factory_ != nullptr) {
+    base_encoder_ = base_encoder_factory_(records_writer_.dest());
+  }
   if (ABSL_PREDICT_FALSE(!base_encoder_->AddRecords(
           std::move(records_writer_.dest()), std::move(limits_))) ||
       ABSL_PREDICT_FALSE(!base_encoder_->EncodeAndClose(
@@ -147,4 +156,22 @@ bool DeferredEncoder::EncodeAndClose(Writer* dest, ChunkType* chunk_type,
   return Close();
 }
 
+uint64_t DeferredEncoder::ApproximateEncodedSize() const {
+  // Each record is assumed to need about one byte besides its value.
+  return SaturatingAdd(decoded_data_size_, num_records_);
+}
+
+size_t DeferredEncoder::ApproximateMemory() const {
+  return sizeof(*this) + records_writer_.dest().size() +
+         limits_.size() * sizeof(size_t);
+}
+
+void DeferredEncoder::RegisterUnique(
+    MemoryEstimator* memory_estimator) const {
+  memory_estimator->RegisterDynamicMemory(sizeof(*this));
+  if (base_encoder_ != nullptr) base_encoder_->RegisterUnique(memory_estimator);
+  records_writer_.dest().RegisterSubobjects(memory_estimator);
+  memory_estimator->RegisterDynamicMemory(limits_.capacity() * sizeof(size_t));
+}
+
 }  // namespace riegeli
@@ -18,6 +18,7 @@
 #include <stddef.h>
 #include <stdint.h>
 
+#include <functional>
 #include <memory>
 #include <string>
 #include <tuple>
@@ -27,6 +28,7 @@
 #include "absl/strings/string_view.h"
 #include "google/protobuf/message_lite.h"
 #include "riegeli/base/chain.h"
+#include "riegeli/base/memory_estimator.h"
 #include "riegeli/bytes/chain_writer.h"
 #include "riegeli/bytes/writer.h"
 #include "riegeli/chunk_encoding/chunk_encoder.h"
@@ -39,27 +41,45 @@ namespace riegeli {
 // It does more memory copying than the base encoder though.
 class DeferredEncoder : public ChunkEncoder {
  public:
+  // Creates the base encoder when the chunk is encoded, given concatenated
+  // record values, so that it can be configured depending on the data.
+  using BaseEncoderFactory =
+      std::function<std::unique_ptr<ChunkEncoder>(const Chain& records)>;
+
   explicit DeferredEncoder(std::unique_ptr<ChunkEncoder> base_encoder);
+  explicit DeferredEncoder(BaseEncoderFactory base_encoder_factory);
 
   void Clear() override;
 
   using ChunkEncoder::AddRecord;
-  bool AddRecord(const google::protobuf::MessageLite& record) override;
   bool AddRecord(absl::string_view record) override;
   bool AddRecord(std::string&& record) override;
   bool AddRecord(const Chain& record) override;
   bool AddRecord(Chain&& record) override;
+  bool AddRecordWithCachedSize(const google::protobuf::MessageLite& record,
+                               size_t size) override;
 
+  using ChunkEncoder::AddRecords;
   bool AddRecords(Chain records, std::vector<size_t> limits) override;
 
   bool EncodeAndClose(Writer* dest, ChunkType* chunk_type,
                       uint64_t* num_records,
                       uint64_t* decoded_data_size) override;
 
+  // The size and memory of the base encoder are not known until the chunk is
+  // encoded, so these are estimated from concatenated record values and their
+  // positions.
+  uint64_t ApproximateEncodedSize() const override;
+  size_t ApproximateMemory() const override;
+  void RegisterUnique(MemoryEstimator* memory_estimator) const override;
+
  private:
   template <typename Record>
   bool AddRecordImpl(Record&& record);
 
+  // If not `nullptr`, `base_encoder_` is created by `base_encoder_factory_` in
+  // `EncodeAndClose()`.
+  BaseEncoderFactory base_encoder_factory_;
   std::unique_ptr<ChunkEncoder> base_encoder_;
   // `Writer` of concatenated record values.
   ChainWriter<Chain> records_writer_;
@@ -79,6 +99,11 @@ inline DeferredEncoder::DeferredEncoder(
     : base_encoder_(std::move(base_encoder)),
       records_writer_(std::forward_as_tuple()) {}
 
+inline DeferredEncoder::DeferredEncoder(
+    BaseEncoderFactory base_encoder_factory)
+    : base_encoder_factory_(std::move(base_encoder_factory)),
+      records_writer_(std::forward_as_tuple()) {}
+
 }  // namespace riegeli
 
 #endif  // RIEGELI_CHUNK_ENCODING_DEFERRED_ENCODER_H_
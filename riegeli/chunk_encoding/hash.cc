@@ -14,15 +14,28 @@
 
 #include "riegeli/chunk_encoding/hash.h"
 
+#include <stddef.h>
 #include <stdint.h>
 
+#include <atomic>
+#include <cstring>
+#include <string>
+#include <vector>
+
 #include "absl/container/inlined_vector.h"
 #include "absl/strings/string_view.h"
+#include "absl/synchronization/blocking_counter.h"
 #include "absl/types/optional.h"
+#include "absl/types/span.h"
+#include "crc32c/crc32c.h"
 #include "highwayhash/hh_types.h"
 #include "highwayhash/highwayhash_target.h"
 #include "highwayhash/instruction_sets.h"
+#include "riegeli/base/base.h"
 #include "riegeli/base/chain.h"
+#include "riegeli/base/endian.h"
+#include "riegeli/base/parallelism.h"
+#include "riegeli/chunk_encoding/constants.h"
 
 namespace riegeli {
 namespace internal {
@@ -36,6 +49,61 @@ const highwayhash::HHKey kHashKey HH_ALIGNAS(32) = {
     0x0a7364726f636572,  // 'records\n'
 };
 
+// Implements `HashType::kHighwayHashTree` for data consisting of `fragments`.
+uint64_t TreeHash(absl::Span<const absl::string_view> fragments) {
+  // Split data into segments, each being a sequence of fragments or their
+  // parts.
+  std::vector<absl::InlinedVector<highwayhash::StringView, 2>> segments;
+  size_t remaining_in_segment = 0;
+  for (absl::string_view fragment : fragments) {
+    while (!fragment.empty()) {
+      if (remaining_in_segment == 0) {
+        segments.emplace_back();
+        remaining_in_segment = kHashTreeSegmentSize;
+      }
+      const size_t length = UnsignedMin(fragment.size(), remaining_in_segment);
+      segments.back().push_back(
+          highwayhash::StringView{fragment.data(), length});
+      fragment.remove_prefix(length);
+      remaining_in_segment -= length;
+    }
+  }
+
+  std::vector<uint64_t> segment_hashes(segments.size());
+  const auto hash_segments = [&](std::atomic<size_t>* next_segment) {
+    for (;;) {
+      const size_t index =
+          next_segment->fetch_add(1, std::memory_order_relaxed);
+      if (index >= segments.size()) return;
+      highwayhash::HHResult64 result;
+      highwayhash::InstructionSets::Run<highwayhash::HighwayHashCat>(
+          kHashKey, segments[index].data(), segments[index].size(), &result);
+      segment_hashes[index] = WriteLittleEndian64(result);
+    }
+  };
+  std::atomic<size_t> next_segment{0};
+  const size_t num_helpers =
+      segments.size() <= 1
+          ? size_t{0}
+          : UnsignedMin(AvailableCpus(), segments.size()) - 1;
+  if (num_helpers == 0) {
+    hash_segments(&next_segment);
+  } else {
+    absl::BlockingCounter helpers_done(IntCast<int>(num_helpers));
+    for (size_t i = 0; i < num_helpers; ++i) {
+      ThreadPool::global().Schedule([&] {
+        hash_segments(&next_segment);
+        helpers_done.DecrementCount();
+      });
+    }
+    hash_segments(&next_segment);
+    helpers_done.Wait();
+  }
+  return Hash(absl::string_view(
+      reinterpret_cast<const char*>(segment_hashes.data()),
+      segment_hashes.size() * sizeof(uint64_t)));
+}
+
 }  // namespace
 
 uint64_t Hash(absl::string_view data) {
@@ -61,5 +129,41 @@ uint64_t Hash(const Chain& data) {
   return result;
 }
 
+uint64_t Hash(HashType hash_type, absl::string_view data) {
+  switch (hash_type) {
+    case HashType::kHighwayHash:
+      return Hash(data);
+    case HashType::kCrc32c:
+      return crc32c::Crc32c(data.data(), data.size());
+    case HashType::kHighwayHashTree:
+      return TreeHash({data});
+  }
+  RIEGELI_ASSERT_UNREACHABLE()
+      << "Unknown hash type: " << static_cast<unsigned>(hash_type);
+}
+
+uint64_t Hash(HashType hash_type, const Chain& data) {
+  switch (hash_type) {
+    case HashType::kHighwayHash:
+      return Hash(data);
+    case HashType::kCrc32c: {
+      uint32_t crc = 0;
+      for (const absl::string_view fragment : data.blocks()) {
+        crc = crc32c::Extend(crc,
+                             reinterpret_cast<const uint8_t*>(fragment.data()),
+                             fragment.size());
+      }
+      return crc;
+    }
+    case HashType::kHighwayHashTree: {
+      absl::InlinedVector<absl::string_view, 16> fragments(
+          data.blocks().begin(), data.blocks().end());
+      return TreeHash(fragments);
+    }
+  }
+  RIEGELI_ASSERT_UNREACHABLE()
+      << "Unknown hash type: " << static_cast<unsigned>(hash_type);
+}
+
 }  // namespace internal
 }  // namespace riegeli
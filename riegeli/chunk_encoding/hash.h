@@ -19,6 +19,7 @@
 
 #include "absl/strings/string_view.h"
 #include "riegeli/base/chain.h"
+#include "riegeli/chunk_encoding/constants.h"
 
 namespace riegeli {
 namespace internal {
@@ -26,6 +27,15 @@ namespace internal {
 uint64_t Hash(absl::string_view data);
 uint64_t Hash(const Chain& data);
 
+// Computes `data_hash` of a chunk header.
+//
+// `HashType::kHighwayHash` is equivalent to `Hash()`. `HashType::kCrc32c`
+// yields a CRC32C zero-extended to 64 bits. `HashType::kHighwayHashTree`
+// hashes segments of `kHashTreeSegmentSize` bytes in parallel, and then hashes
+// the concatenation of their Little-Endian hashes.
+uint64_t Hash(HashType hash_type, absl::string_view data);
+uint64_t Hash(HashType hash_type, const Chain& data);
+
 }  // namespace internal
 }  // namespace riegeli
 
@@ -0,0 +1,218 @@
+// Copyright 2017 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "riegeli/chunk_encoding/record_columns.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <cstring>
+#include <vector>
+
+#include "absl/base/optimization.h"
+#include "absl/container/flat_hash_map.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/string_view.h"
+#include "absl/types/span.h"
+#include "riegeli/base/base.h"
+#include "riegeli/base/canonical_errors.h"
+#include "riegeli/base/endian.h"
+#include "riegeli/base/status.h"
+#include "riegeli/bytes/reader_utils.h"
+#include "riegeli/chunk_encoding/chunk_decoder.h"
+#include "riegeli/chunk_encoding/transpose_internal.h"
+
+namespace riegeli {
+
+namespace {
+
+// Skips the value of a field with the given wire type, or the remaining
+// fields of a group if `wire_type` is `kStartGroup`.
+//
+// Returns `false` on invalid data.
+bool SkipField(internal::WireType wire_type, const char** cursor,
+               const char* limit) {
+  switch (wire_type) {
+    case internal::WireType::kVarint: {
+      uint64_t value;
+      return ReadVarint64(cursor, limit, &value);
+    }
+    case internal::WireType::kFixed32:
+      if (ABSL_PREDICT_FALSE(PtrDistance(*cursor, limit) < sizeof(uint32_t))) {
+        return false;
+      }
+      *cursor += sizeof(uint32_t);
+      return true;
+    case internal::WireType::kFixed64:
+      if (ABSL_PREDICT_FALSE(PtrDistance(*cursor, limit) < sizeof(uint64_t))) {
+        return false;
+      }
+      *cursor += sizeof(uint64_t);
+      return true;
+    case internal::WireType::kLengthDelimited: {
+      uint32_t length;
+      if (ABSL_PREDICT_FALSE(!ReadVarint32(cursor, limit, &length) ||
+                             length > PtrDistance(*cursor, limit))) {
+        return false;
+      }
+      *cursor += length;
+      return true;
+    }
+    case internal::WireType::kStartGroup: {
+      size_t depth = 1;
+      while (depth > 0) {
+        uint32_t tag;
+        if (ABSL_PREDICT_FALSE(!ReadVarint32(cursor, limit, &tag))) {
+          return false;
+        }
+        const internal::WireType field_wire_type =
+            static_cast<internal::WireType>(tag & 7);
+        if (field_wire_type == internal::WireType::kStartGroup) {
+          ++depth;
+        } else if (field_wire_type == internal::WireType::kEndGroup) {
+          --depth;
+        } else if (ABSL_PREDICT_FALSE(
+                       !SkipField(field_wire_type, cursor, limit))) {
+          return false;
+        }
+      }
+      return true;
+    }
+    default:
+      return false;
+  }
+}
+
+}  // namespace
+
+Status ReadRecordColumns(ChunkDecoder* src,
+                         absl::Span<const uint32_t> field_numbers,
+                         std::vector<RecordColumn>* columns) {
+  const size_t num_records =
+      IntCast<size_t>(src->num_records() - src->index());
+  columns->clear();
+  columns->resize(field_numbers.size());
+  absl::flat_hash_map<uint32_t, size_t> column_indices;
+  column_indices.reserve(field_numbers.size());
+  for (size_t i = 0; i < field_numbers.size(); ++i) {
+    (*columns)[i].field_number = field_numbers[i];
+    (*columns)[i].present.resize(num_records);
+    column_indices.emplace(field_numbers[i], i);
+  }
+
+  absl::Span<const absl::string_view> records;
+  if (num_records > 0 && ABSL_PREDICT_FALSE(!src->ReadRecords(&records))) {
+    return src->status();
+  }
+  RIEGELI_ASSERT_EQ(records.size(), num_records)
+      << "ChunkDecoder::ReadRecords() did not read all records";
+  for (size_t record_index = 0; record_index < num_records; ++record_index) {
+    const char* cursor = records[record_index].data();
+    const char* const limit = cursor + records[record_index].size();
+    while (cursor < limit) {
+      uint32_t tag;
+      if (ABSL_PREDICT_FALSE(!ReadVarint32(&cursor, limit, &tag))) {
+        return DataLossError(
+            absl::StrCat("Invalid field tag at record ", record_index));
+      }
+      const internal::WireType wire_type =
+          static_cast<internal::WireType>(tag & 7);
+      const auto column_iter = column_indices.find(tag >> 3);
+      if (column_iter == column_indices.end()) {
+        if (ABSL_PREDICT_FALSE(!SkipField(wire_type, &cursor, limit))) {
+          return DataLossError(absl::StrCat("Invalid value of field ",
+                                            tag >> 3, " at record ",
+                                            record_index));
+        }
+        continue;
+      }
+      RecordColumn& column = (*columns)[column_iter->second];
+      RecordColumn::Type type;
+      uint64_t numeric_value = 0;
+      absl::string_view string_value;
+      bool ok = true;
+      switch (wire_type) {
+        case internal::WireType::kVarint:
+          type = RecordColumn::Type::kNumeric;
+          ok = ReadVarint64(&cursor, limit, &numeric_value);
+          break;
+        case internal::WireType::kFixed32:
+          type = RecordColumn::Type::kNumeric;
+          if (ABSL_PREDICT_FALSE(PtrDistance(cursor, limit) <
+                                 sizeof(uint32_t))) {
+            ok = false;
+          } else {
+            uint32_t word;
+            std::memcpy(&word, cursor, sizeof(word));
+            numeric_value = ReadLittleEndian32(word);
+            cursor += sizeof(uint32_t);
+          }
+          break;
+        case internal::WireType::kFixed64:
+          type = RecordColumn::Type::kNumeric;
+          if (ABSL_PREDICT_FALSE(PtrDistance(cursor, limit) <
+                                 sizeof(uint64_t))) {
+            ok = false;
+          } else {
+            uint64_t word;
+            std::memcpy(&word, cursor, sizeof(word));
+            numeric_value = ReadLittleEndian64(word);
+            cursor += sizeof(uint64_t);
+          }
+          break;
+        case internal::WireType::kLengthDelimited: {
+          type = RecordColumn::Type::kLengthDelimited;
+          uint32_t length;
+          if (ABSL_PREDICT_FALSE(!ReadVarint32(&cursor, limit, &length) ||
+                                 length > PtrDistance(cursor, limit))) {
+            ok = false;
+          } else {
+            string_value = absl::string_view(cursor, length);
+            cursor += length;
+          }
+        } break;
+        default:
+          return InvalidArgumentError(
+              absl::StrCat("Field ", tag >> 3, " at record ", record_index,
+                           " has unsupported wire type ",
+                           static_cast<uint32_t>(wire_type)));
+      }
+      if (ABSL_PREDICT_FALSE(!ok)) {
+        return DataLossError(absl::StrCat("Invalid value of field ", tag >> 3,
+                                          " at record ", record_index));
+      }
+      if (column.type == RecordColumn::Type::kNone) {
+        column.type = type;
+        if (type == RecordColumn::Type::kNumeric) {
+          column.numeric_values.resize(num_records);
+        } else {
+          column.string_values.resize(num_records);
+        }
+      } else if (ABSL_PREDICT_FALSE(column.type != type)) {
+        return InvalidArgumentError(
+            absl::StrCat("Field ", tag >> 3, " at record ", record_index,
+                         " has a wire type inconsistent with other records"));
+      }
+      column.present[record_index] = 1;
+      if (type == RecordColumn::Type::kNumeric) {
+        column.numeric_values[record_index] = numeric_value;
+      } else {
+        column.string_values[record_index] = string_value;
+      }
+    }
+  }
+  return OkStatus();
+}
+
+}  // namespace riegeli
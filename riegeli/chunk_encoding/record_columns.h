@@ -0,0 +1,84 @@
+// Copyright 2017 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef RIEGELI_CHUNK_ENCODING_RECORD_COLUMNS_H_
+#define RIEGELI_CHUNK_ENCODING_RECORD_COLUMNS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+
+#include "absl/strings/string_view.h"
+#include "absl/types/span.h"
+#include "riegeli/base/base.h"
+#include "riegeli/base/status.h"
+#include "riegeli/chunk_encoding/chunk_decoder.h"
+
+namespace riegeli {
+
+// Values of one top-level field of proto records, one entry per record.
+//
+// Numeric fields (varint, fixed32, fixed64 wire types) fill `numeric_values`
+// with raw wire values: `sint32` and `sint64` are left ZigZag encoded, and
+// `float` and `double` are left as their bit patterns. Length-delimited fields
+// (strings, bytes, submessages, packed repeated fields) fill `string_values`.
+// The vector not corresponding to the wire type of the field is left empty.
+//
+// If a record contains the field several times, the last occurrence is taken,
+// which matches proto semantics for singular scalar and string fields.
+struct RecordColumn {
+  enum class Type {
+    // The field was not present in any record.
+    kNone,
+    // The field has varint, fixed32, or fixed64 wire type.
+    kNumeric,
+    // The field has length-delimited wire type.
+    kLengthDelimited,
+  };
+
+  // Field number of the field.
+  uint32_t field_number = 0;
+  // Kind of values of the field.
+  Type type = Type::kNone;
+  // `present[i]` is 1 if record `i` contains the field, otherwise 0.
+  std::vector<uint8_t> present;
+  // Values of a numeric field, or 0 where the field is absent.
+  std::vector<uint64_t> numeric_values;
+  // Values of a length-delimited field, or empty where the field is absent.
+  // They point to records in the `ChunkDecoder`.
+  std::vector<absl::string_view> string_values;
+};
+
+// Reads the remaining records of `*src` as proto messages, and extracts the
+// given top-level fields into columns, in the order of `field_numbers`.
+//
+// This scans the wire format of each record once, without parsing whole
+// messages, and is suitable for flat schemas whose consumers prefer columnar
+// data. Nested fields can be extracted by reading their submessage column as
+// records in turn.
+//
+// `RecordColumn::string_values` are valid until the next non-const operation
+// on `*src`.
+//
+// Returns status:
+//  * `status.ok()`  - success (`*columns` are filled, `*src` ended)
+//  * `!status.ok()` - failure (`*columns` are unspecified)
+Status ReadRecordColumns(ChunkDecoder* src,
+                         absl::Span<const uint32_t> field_numbers,
+                         std::vector<RecordColumn>* columns);
+
+}  // namespace riegeli
+
+#endif  // RIEGELI_CHUNK_ENCODING_RECORD_COLUMNS_H_
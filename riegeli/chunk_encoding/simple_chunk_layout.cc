@@ -0,0 +1,198 @@
+// Copyright 2019 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "riegeli/chunk_encoding/simple_chunk_layout.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <tuple>
+#include <vector>
+
+#include "absl/base/optimization.h"
+#include "absl/strings/str_cat.h"
+#include "riegeli/base/base.h"
+#include "riegeli/base/canonical_errors.h"
+#include "riegeli/base/status.h"
+#include "riegeli/bytes/chain_reader.h"
+#include "riegeli/bytes/limiting_reader.h"
+#include "riegeli/bytes/reader.h"
+#include "riegeli/bytes/reader_utils.h"
+#include "riegeli/bytes/zstd_dictionary.h"
+#include "riegeli/chunk_encoding/chunk.h"
+#include "riegeli/chunk_encoding/constants.h"
+#include "riegeli/chunk_encoding/decompressor.h"
+
+namespace riegeli {
+
+namespace {
+
+// Sets `*stream` to the layout of the compressed stream of `compressed_size`
+// which begins at the current position of `*src`, and skips the stream.
+Status DescribeStream(Reader* src, CompressionType compression_type,
+                      uint64_t compressed_size,
+                      SimpleChunkLayout::Stream* stream) {
+  const Position stream_end = src->pos() + compressed_size;
+  if (compression_type == CompressionType::kNone) {
+    stream->decompressed_size = compressed_size;
+  } else if (ABSL_PREDICT_FALSE(
+                 !ReadVarint64(src, &stream->decompressed_size) ||
+                 src->pos() > stream_end)) {
+    return DataLossError("Reading uncompressed size failed");
+  }
+  stream->compressed_begin = src->pos();
+  stream->compressed_size = stream_end - src->pos();
+  if (ABSL_PREDICT_FALSE(!src->Seek(stream_end))) {
+    return DataLossError("Compressed record values truncated");
+  }
+  return OkStatus();
+}
+
+}  // namespace
+
+// Based on `SimpleDecoder::Decode()`.
+Status DescribeSimpleChunkLayout(const Chunk& chunk,
+                                 const ZstdDictionary& zstd_dictionary,
+                                 SimpleChunkLayout* layout) {
+  const ChunkType chunk_type = chunk.header.chunk_type();
+  if (ABSL_PREDICT_FALSE(chunk_type != ChunkType::kSimple &&
+                         chunk_type != ChunkType::kSimpleWithBlocks &&
+                         chunk_type != ChunkType::kSimpleWithReferences)) {
+    return UnimplementedError(
+        absl::StrCat("Chunk type not supported: ",
+                     static_cast<unsigned>(chunk_type)));
+  }
+  const bool with_references = chunk_type == ChunkType::kSimpleWithReferences;
+  const uint64_t num_records = chunk.header.num_records();
+  layout->streams.clear();
+  layout->records.clear();
+  if (ABSL_PREDICT_FALSE(num_records > layout->records.max_size())) {
+    return ResourceExhaustedError("Too many records");
+  }
+  ChainReader<> src(&chunk.data);
+  uint8_t compression_type_byte;
+  if (ABSL_PREDICT_FALSE(!ReadByte(&src, &compression_type_byte))) {
+    return DataLossError("Reading compression type failed");
+  }
+  layout->compression_type =
+      static_cast<CompressionType>(compression_type_byte);
+  uint64_t sizes_size;
+  if (ABSL_PREDICT_FALSE(!ReadVarint64(&src, &sizes_size))) {
+    return DataLossError("Reading size of sizes failed");
+  }
+  if (ABSL_PREDICT_FALSE(sizes_size > chunk.data.size() - src.pos())) {
+    return DataLossError("Size of sizes too large");
+  }
+
+  internal::Decompressor<LimitingReader<>> sizes_decompressor(
+      std::forward_as_tuple(&src, src.pos() + sizes_size),
+      layout->compression_type, zstd_dictionary);
+  if (ABSL_PREDICT_FALSE(!sizes_decompressor.healthy())) {
+    return sizes_decompressor.status();
+  }
+  uint64_t decoded_data_size = 0;
+  uint64_t values_size = 0;
+  while (layout->records.size() != num_records) {
+    uint64_t size;
+    if (ABSL_PREDICT_FALSE(!ReadVarint64(sizes_decompressor.reader(), &size))) {
+      return DataLossError("Reading record size failed");
+    }
+    SimpleChunkLayout::Record record;
+    if (with_references && (size & 1) != 0) {
+      const uint64_t distance = (size >> 1) + 1;
+      if (ABSL_PREDICT_FALSE(distance > layout->records.size())) {
+        return DataLossError("Record reference out of range");
+      }
+      record = layout->records[layout->records.size() -
+                               IntCast<size_t>(distance)];
+    } else {
+      if (with_references) size >>= 1;
+      record.begin = values_size;
+      record.size = size;
+      values_size += size;
+    }
+    if (ABSL_PREDICT_FALSE(record.size > chunk.header.decoded_data_size() -
+                                             decoded_data_size)) {
+      return DataLossError("Decoded data size larger than expected");
+    }
+    decoded_data_size += record.size;
+    layout->records.push_back(record);
+  }
+  if (ABSL_PREDICT_FALSE(!sizes_decompressor.VerifyEndAndClose())) {
+    return sizes_decompressor.status();
+  }
+  if (ABSL_PREDICT_FALSE(decoded_data_size !=
+                         chunk.header.decoded_data_size())) {
+    return DataLossError("Decoded data size smaller than expected");
+  }
+
+  if (chunk_type == ChunkType::kSimpleWithBlocks) {
+    uint64_t block_size;
+    if (ABSL_PREDICT_FALSE(!ReadVarint64(&src, &block_size))) {
+      return DataLossError("Reading block size failed");
+    }
+    if (ABSL_PREDICT_FALSE(block_size == 0)) {
+      return DataLossError("Zero block size");
+    }
+    const uint64_t num_blocks =
+        values_size / block_size + (values_size % block_size == 0 ? 0 : 1);
+    std::vector<uint64_t> compressed_sizes;
+    // Do not reserve `num_blocks` in advance: it is not validated yet, but
+    // reading sizes of nonexistent blocks fails soon.
+    while (compressed_sizes.size() != num_blocks) {
+      uint64_t compressed_size;
+      if (ABSL_PREDICT_FALSE(!ReadVarint64(&src, &compressed_size))) {
+        return DataLossError("Reading compressed block size failed");
+      }
+      if (ABSL_PREDICT_FALSE(compressed_size >
+                             chunk.data.size() - src.pos())) {
+        return DataLossError("Compressed block size too large");
+      }
+      compressed_sizes.push_back(compressed_size);
+    }
+    for (const uint64_t compressed_size : compressed_sizes) {
+      if (ABSL_PREDICT_FALSE(compressed_size >
+                             chunk.data.size() - src.pos())) {
+        return DataLossError("Compressed record values truncated");
+      }
+      SimpleChunkLayout::Stream stream;
+      const Status status = DescribeStream(&src, layout->compression_type,
+                                           compressed_size, &stream);
+      if (ABSL_PREDICT_FALSE(!status.ok())) return status;
+      layout->streams.push_back(stream);
+    }
+  } else {
+    SimpleChunkLayout::Stream stream;
+    const Status status =
+        DescribeStream(&src, layout->compression_type,
+                       chunk.data.size() - src.pos(), &stream);
+    if (ABSL_PREDICT_FALSE(!status.ok())) return status;
+    layout->streams.push_back(stream);
+  }
+
+  uint64_t decompressed_size = 0;
+  for (const SimpleChunkLayout::Stream& stream : layout->streams) {
+    if (ABSL_PREDICT_FALSE(stream.decompressed_size >
+                           values_size - decompressed_size)) {
+      return DataLossError("Record values larger than expected");
+    }
+    decompressed_size += stream.decompressed_size;
+  }
+  if (ABSL_PREDICT_FALSE(decompressed_size != values_size)) {
+    return DataLossError("Record values smaller than expected");
+  }
+  return OkStatus();
+}
+
+}  // namespace riegeli
@@ -0,0 +1,80 @@
+// Copyright 2019 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef RIEGELI_CHUNK_ENCODING_SIMPLE_CHUNK_LAYOUT_H_
+#define RIEGELI_CHUNK_ENCODING_SIMPLE_CHUNK_LAYOUT_H_
+
+#include <stdint.h>
+
+#include <vector>
+
+#include "riegeli/base/status.h"
+#include "riegeli/bytes/zstd_dictionary.h"
+#include "riegeli/chunk_encoding/chunk.h"
+#include "riegeli/chunk_encoding/constants.h"
+
+namespace riegeli {
+
+// Where the compressed record values of a simple chunk are in its data, and
+// where each record is in the decompressed values, so that the values can be
+// decompressed outside of Riegeli, e.g. by a batch decompressor on a GPU,
+// without decoding records on the CPU.
+//
+// Values are stored as one compressed stream, or as several independently
+// compressed streams with `RecordWriterBase::Options::set_values_block_size()`,
+// which can be decompressed in parallel. Decompressed values are the
+// concatenation of decompressed streams.
+struct SimpleChunkLayout {
+  struct Stream {
+    // Position of compressed data in chunk data. Unless `compression_type` is
+    // `CompressionType::kNone`, this excludes the uncompressed size which
+    // precedes them, so that compressed data are a complete stream of the
+    // compression format, e.g. a Zstd frame.
+    uint64_t compressed_begin = 0;
+    uint64_t compressed_size = 0;
+    uint64_t decompressed_size = 0;
+  };
+
+  struct Record {
+    // Position of the record in decompressed values. With
+    // `RecordWriterBase::Options::set_dedup_window()`, a repeated record
+    // refers to the values of an earlier one.
+    uint64_t begin = 0;
+    uint64_t size = 0;
+  };
+
+  CompressionType compression_type = CompressionType::kNone;
+  std::vector<Stream> streams;
+  std::vector<Record> records;
+};
+
+// Parses the layout of the data of a chunk of type `ChunkType::kSimple`,
+// `ChunkType::kSimpleWithBlocks`, or `ChunkType::kSimpleWithReferences`.
+// Record sizes are decompressed, record values are not.
+//
+// `zstd_dictionary` is used if the chunk is compressed with Zstd. Compressed
+// values need the same dictionary to be decompressed.
+//
+// Returns status:
+//  * `status.ok()`             - success
+//  * `IsUnimplemented(status)` - chunk type not supported, e.g. a transposed
+//                                chunk or a chunk compressed with a prefix
+//  * other `!status.ok()`      - failure
+Status DescribeSimpleChunkLayout(const Chunk& chunk,
+                                 const ZstdDictionary& zstd_dictionary,
+                                 SimpleChunkLayout* layout);
+
+}  // namespace riegeli
+
+#endif  // RIEGELI_CHUNK_ENCODING_SIMPLE_CHUNK_LAYOUT_H_
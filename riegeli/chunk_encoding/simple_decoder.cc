@@ -17,32 +17,205 @@
 #include <stddef.h>
 #include <stdint.h>
 
+#include <cstring>
 #include <limits>
 #include <tuple>
+#include <utility>
 #include <vector>
 
 #include "absl/base/optimization.h"
+#include "absl/strings/string_view.h"
 #include "riegeli/base/base.h"
 #include "riegeli/base/canonical_errors.h"
+#include "riegeli/base/chain.h"
 #include "riegeli/base/object.h"
 #include "riegeli/bytes/limiting_reader.h"
+#include "riegeli/bytes/pullable_reader.h"
 #include "riegeli/bytes/reader.h"
 #include "riegeli/bytes/reader_utils.h"
+#include "riegeli/bytes/zstd_dictionary.h"
 #include "riegeli/chunk_encoding/constants.h"
 #include "riegeli/chunk_encoding/decompressor.h"
 
 namespace riegeli {
 
+namespace {
+
+// The number of record sizes decoded at once by the fast path reading
+// single-byte sizes.
+constexpr size_t kSizesPerWord = sizeof(uint64_t);
+
+}  // namespace
+
+namespace internal {
+
+void ValueBlocksReader::Reset(Reader* src, Position blocks_begin,
+                              CompressionType compression_type,
+                              const ZstdDictionary& zstd_dictionary,
+                              uint64_t block_size,
+                              std::vector<Position> compressed_limits,
+                              Position size) {
+  RIEGELI_ASSERT_GT(block_size, 0u)
+      << "Failed precondition of ValueBlocksReader::Reset(): zero block size";
+  PullableReader::Reset(kInitiallyOpen);
+  src_ = src;
+  blocks_begin_ = blocks_begin;
+  compression_type_ = compression_type;
+  zstd_dictionary_ = zstd_dictionary;
+  block_size_ = block_size;
+  compressed_limits_ = std::move(compressed_limits);
+  size_ = size;
+  next_block_index_ = 0;
+  block_.Clear();
+  next_fragment_ = 0;
+}
+
+void ValueBlocksReader::Done() {
+  src_ = nullptr;
+  zstd_dictionary_ = ZstdDictionary();
+  compressed_limits_ = std::vector<Position>();
+  block_ = Chain();
+  PullableReader::Done();
+}
+
+bool ValueBlocksReader::SupportsRandomAccess() const {
+  return src_ != nullptr && src_->SupportsRandomAccess();
+}
+
+bool ValueBlocksReader::Size(Position* size) {
+  if (ABSL_PREDICT_FALSE(!healthy())) return false;
+  *size = size_;
+  return true;
+}
+
+bool ValueBlocksReader::PullSlow(size_t min_length,
+                                 size_t recommended_length) {
+  RIEGELI_ASSERT_GT(min_length, available())
+      << "Failed precondition of Reader::PullSlow(): "
+         "length too small, use Pull() instead";
+  if (ABSL_PREDICT_FALSE(!PullUsingScratch(min_length))) {
+    return available() >= min_length;
+  }
+  if (ABSL_PREDICT_FALSE(!healthy())) return false;
+  for (;;) {
+    while (next_fragment_ < block_.blocks().size()) {
+      const absl::string_view fragment = block_.blocks()[next_fragment_++];
+      if (ABSL_PREDICT_TRUE(!fragment.empty())) {
+        start_ = fragment.data();
+        cursor_ = start_;
+        limit_ = start_ + fragment.size();
+        limit_pos_ += fragment.size();
+        return true;
+      }
+    }
+    if (next_block_index_ == compressed_limits_.size()) return false;
+    if (ABSL_PREDICT_FALSE(!ReadBlock(next_block_index_))) return false;
+  }
+}
+
+bool ValueBlocksReader::SeekSlow(Position new_pos) {
+  RIEGELI_ASSERT(new_pos < start_pos() || new_pos > limit_pos_)
+      << "Failed precondition of Reader::SeekSlow(): "
+         "position in the buffer, use Seek() instead";
+  if (ABSL_PREDICT_FALSE(!SeekUsingScratch(new_pos))) return true;
+  if (ABSL_PREDICT_FALSE(!healthy())) return false;
+  const size_t block_index =
+      IntCast<size_t>(UnsignedMin(new_pos, size_) / block_size_);
+  if (block_index == compressed_limits_.size()) {
+    // Seeking to the end, or after the end if `new_pos > size_`, which is at
+    // a block boundary.
+    start_ = nullptr;
+    cursor_ = nullptr;
+    limit_ = nullptr;
+    limit_pos_ = size_;
+    next_block_index_ = compressed_limits_.size();
+    block_.Clear();
+    next_fragment_ = 0;
+    return new_pos == size_;
+  }
+  if (block_index + 1 == next_block_index_) {
+    // The block is already decompressed. Find the fragment from its beginning.
+    start_ = nullptr;
+    cursor_ = nullptr;
+    limit_ = nullptr;
+    limit_pos_ = IntCast<Position>(block_index) * block_size_;
+    next_fragment_ = 0;
+  } else if (ABSL_PREDICT_FALSE(!ReadBlock(block_index))) {
+    return false;
+  }
+  const Position pos_in_block = UnsignedMin(new_pos, size_);
+  while (limit_pos_ < pos_in_block) {
+    RIEGELI_ASSERT_LT(next_fragment_, block_.blocks().size())
+        << "Decompressed block shorter than expected";
+    const absl::string_view fragment = block_.blocks()[next_fragment_++];
+    start_ = fragment.data();
+    cursor_ = start_;
+    limit_ = start_ + fragment.size();
+    limit_pos_ += fragment.size();
+  }
+  cursor_ = limit_ - (limit_pos_ - pos_in_block);
+  return new_pos <= size_;
+}
+
+inline bool ValueBlocksReader::ReadBlock(size_t block_index) {
+  RIEGELI_ASSERT_LT(block_index, compressed_limits_.size())
+      << "Failed precondition of ValueBlocksReader::ReadBlock(): "
+         "block index out of range";
+  start_ = nullptr;
+  cursor_ = nullptr;
+  limit_ = nullptr;
+  limit_pos_ = IntCast<Position>(block_index) * block_size_;
+  next_block_index_ = block_index + 1;
+  block_.Clear();
+  next_fragment_ = 0;
+  const Position compressed_begin =
+      blocks_begin_ +
+      (block_index == 0 ? Position{0} : compressed_limits_[block_index - 1]);
+  if (ABSL_PREDICT_FALSE(!src_->Seek(compressed_begin))) {
+    return Fail(*src_, DataLossError("Seeking record values block failed"));
+  }
+  Decompressor<LimitingReader<>> decompressor(
+      std::forward_as_tuple(src_,
+                            blocks_begin_ + compressed_limits_[block_index]),
+      compression_type_, zstd_dictionary_);
+  if (ABSL_PREDICT_FALSE(!decompressor.healthy())) return Fail(decompressor);
+  const Position length = UnsignedMin(block_size_, size_ - limit_pos_);
+  if (ABSL_PREDICT_FALSE(
+          !decompressor.reader()->Read(&block_, IntCast<size_t>(length)))) {
+    return Fail(*decompressor.reader(),
+                DataLossError("Reading record values block failed"));
+  }
+  if (ABSL_PREDICT_FALSE(!decompressor.VerifyEndAndClose())) {
+    return Fail(decompressor);
+  }
+  return true;
+}
+
+}  // namespace internal
+
 void SimpleDecoder::Done() {
   if (ABSL_PREDICT_FALSE(!values_decompressor_.Close())) {
     Fail(values_decompressor_);
   }
+  if (ABSL_PREDICT_FALSE(!value_blocks_reader_.Close())) {
+    Fail(value_blocks_reader_);
+  }
 }
 
-bool SimpleDecoder::Decode(Reader* src, uint64_t num_records,
-                           uint64_t decoded_data_size,
+bool SimpleDecoder::Decode(Reader* src, ChunkType chunk_type,
+                           uint64_t num_records, uint64_t decoded_data_size,
+                           const ZstdDictionary& zstd_dictionary,
                            std::vector<size_t>* limits) {
+  RIEGELI_ASSERT(chunk_type == ChunkType::kSimple ||
+                 chunk_type == ChunkType::kSimpleWithBlocks ||
+                 chunk_type == ChunkType::kSimpleWithReferences)
+      << "Failed precondition of SimpleDecoder::Decode(): "
+         "not a simple chunk type";
   Object::Reset(kInitiallyOpen);
+  values_in_blocks_ = false;
+  distances_.clear();
+  const bool with_references =
+      chunk_type == ChunkType::kSimpleWithReferences;
   if (ABSL_PREDICT_FALSE(num_records > limits->max_size())) {
     return Fail(ResourceExhaustedError("Too many records"));
   }
@@ -68,17 +241,62 @@ bool SimpleDecoder::Decode(Reader* src, uint64_t num_records,
     return Fail(ResourceExhaustedError("Size of sizes too large"));
   }
   internal::Decompressor<LimitingReader<>> sizes_decompressor(
-      std::forward_as_tuple(src, src->pos() + sizes_size), compression_type);
+      std::forward_as_tuple(src, src->pos() + sizes_size), compression_type,
+      zstd_dictionary);
   if (ABSL_PREDICT_FALSE(!sizes_decompressor.healthy())) {
     return Fail(sizes_decompressor);
   }
   limits->clear();
   size_t limit = 0;
+  values_size_ = 0;
+  Reader* const sizes_reader = sizes_decompressor.reader();
   while (limits->size() != num_records) {
+    if (!with_references && num_records - limits->size() >= kSizesPerWord &&
+        sizes_reader->Pull(kSizesPerWord)) {
+      // Fast path for many small records: if the next `kSizesPerWord` sizes
+      // are single-byte varints, their limits are a prefix sum of the bytes.
+      uint64_t word;
+      std::memcpy(&word, sizes_reader->cursor(), sizeof(word));
+      if ((word & uint64_t{0x8080808080808080}) == 0) {
+        size_t new_limits[kSizesPerWord];
+        size_t sum = 0;
+        for (size_t i = 0; i < kSizesPerWord; ++i) {
+          sum += static_cast<uint8_t>(sizes_reader->cursor()[i]);
+          new_limits[i] = sum;
+        }
+        if (ABSL_PREDICT_FALSE(sum > decoded_data_size - limit)) {
+          return Fail(DataLossError("Decoded data size larger than expected"));
+        }
+        for (size_t i = 0; i < kSizesPerWord; ++i) {
+          limits->push_back(limit + new_limits[i]);
+        }
+        limit += sum;
+        values_size_ += sum;
+        sizes_reader->set_cursor(sizes_reader->cursor() + kSizesPerWord);
+        continue;
+      }
+    }
     uint64_t size;
-    if (ABSL_PREDICT_FALSE(!ReadVarint64(sizes_decompressor.reader(), &size))) {
-      return Fail(*sizes_decompressor.reader(),
-                  DataLossError("Reading record size failed"));
+    if (ABSL_PREDICT_FALSE(!ReadVarint64(sizes_reader, &size))) {
+      return Fail(*sizes_reader, DataLossError("Reading record size failed"));
+    }
+    if (with_references) {
+      uint64_t distance = 0;
+      if ((size & 1) == 0) {
+        size >>= 1;
+        values_size_ += size;
+      } else {
+        distance = (size >> 1) + 1;
+        if (ABSL_PREDICT_FALSE(distance > limits->size())) {
+          return Fail(DataLossError("Record reference out of range"));
+        }
+        const size_t index = limits->size() - IntCast<size_t>(distance);
+        size = (*limits)[index] -
+               (index == 0 ? size_t{0} : (*limits)[index - 1]);
+      }
+      distances_.push_back(distance);
+    } else {
+      values_size_ += size;
     }
     if (ABSL_PREDICT_FALSE(size > decoded_data_size - limit)) {
       return Fail(DataLossError("Decoded data size larger than expected"));
@@ -93,15 +311,95 @@ bool SimpleDecoder::Decode(Reader* src, uint64_t num_records,
     return Fail(DataLossError("Decoded data size smaller than expected"));
   }
 
-  values_decompressor_.Reset(src, compression_type);
+  if (chunk_type == ChunkType::kSimpleWithBlocks) {
+    return DecodeValueBlocks(src, compression_type, decoded_data_size,
+                             zstd_dictionary);
+  }
+  values_decompressor_.Reset(src, compression_type, zstd_dictionary);
   if (ABSL_PREDICT_FALSE(!values_decompressor_.healthy())) {
     return Fail(values_decompressor_);
   }
   return true;
 }
 
+inline bool SimpleDecoder::DecodeValueBlocks(
+    Reader* src, CompressionType compression_type, uint64_t decoded_data_size,
+    const ZstdDictionary& zstd_dictionary) {
+  uint64_t block_size;
+  if (ABSL_PREDICT_FALSE(!ReadVarint64(src, &block_size))) {
+    return Fail(*src, DataLossError("Reading block size failed"));
+  }
+  if (ABSL_PREDICT_FALSE(block_size == 0)) {
+    return Fail(DataLossError("Zero block size"));
+  }
+  const uint64_t num_blocks = decoded_data_size / block_size +
+                              (decoded_data_size % block_size == 0 ? 0 : 1);
+  std::vector<Position> compressed_limits;
+  if (ABSL_PREDICT_FALSE(num_blocks > compressed_limits.max_size())) {
+    return Fail(ResourceExhaustedError("Too many blocks"));
+  }
+  Position compressed_limit = 0;
+  // Do not reserve `num_blocks` in advance: it is not validated yet, but
+  // reading sizes of nonexistent blocks fails soon.
+  while (compressed_limits.size() != num_blocks) {
+    uint64_t compressed_size;
+    if (ABSL_PREDICT_FALSE(!ReadVarint64(src, &compressed_size))) {
+      return Fail(*src, DataLossError("Reading compressed block size failed"));
+    }
+    if (ABSL_PREDICT_FALSE(compressed_size >
+                           std::numeric_limits<Position>::max() - src->pos() -
+                               compressed_limit)) {
+      return Fail(ResourceExhaustedError("Compressed blocks too large"));
+    }
+    compressed_limit += compressed_size;
+    compressed_limits.push_back(compressed_limit);
+  }
+  values_in_blocks_ = true;
+  value_blocks_reader_.Reset(src, src->pos(), compression_type,
+                             zstd_dictionary, block_size,
+                             std::move(compressed_limits), decoded_data_size);
+  return true;
+}
+
+bool SimpleDecoder::ReadValues(const std::vector<size_t>& limits,
+                               Chain* dest) {
+  RIEGELI_ASSERT(healthy())
+      << "Failed precondition of SimpleDecoder::ReadValues(): " << status();
+  dest->Clear();
+  if (distances_.empty()) {
+    if (ABSL_PREDICT_FALSE(
+            !reader()->Read(dest, IntCast<size_t>(values_size_)))) {
+      return Fail(*reader(), DataLossError("Reading record values failed"));
+    }
+    return true;
+  }
+  RIEGELI_ASSERT_EQ(distances_.size(), limits.size())
+      << "Failed precondition of SimpleDecoder::ReadValues(): "
+         "record end positions do not match the chunk";
+  // Records are kept separately, so that a reference copies only the record
+  // it refers to, sharing its memory if it is large.
+  std::vector<Chain> records(limits.size());
+  size_t start = 0;
+  for (size_t i = 0; i < limits.size(); ++i) {
+    if (distances_[i] == 0) {
+      if (ABSL_PREDICT_FALSE(!reader()->Read(&records[i], limits[i] - start))) {
+        return Fail(*reader(), DataLossError("Reading record values failed"));
+      }
+    } else {
+      records[i] = records[i - IntCast<size_t>(distances_[i])];
+    }
+    start = limits[i];
+  }
+  for (const Chain& record : records) dest->Append(record);
+  return true;
+}
+
 bool SimpleDecoder::VerifyEndAndClose() {
-  values_decompressor_.VerifyEnd();
+  if (values_in_blocks_) {
+    value_blocks_reader_.VerifyEnd();
+  } else {
+    values_decompressor_.VerifyEnd();
+  }
   return Close();
 }
 
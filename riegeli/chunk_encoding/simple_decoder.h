@@ -21,12 +21,72 @@
 #include <vector>
 
 #include "riegeli/base/base.h"
+#include "riegeli/base/chain.h"
 #include "riegeli/base/object.h"
 #include "riegeli/base/status.h"
+#include "riegeli/bytes/pullable_reader.h"
 #include "riegeli/bytes/reader.h"
+#include "riegeli/bytes/zstd_dictionary.h"
+#include "riegeli/chunk_encoding/constants.h"
 #include "riegeli/chunk_encoding/decompressor.h"
 
 namespace riegeli {
+namespace internal {
+
+// A `Reader` of record values of a `ChunkType::kSimpleWithBlocks` chunk, which
+// are compressed in independent blocks. Seeking decompresses only the block
+// containing the new position.
+//
+// It supports random access if the source supports random access.
+class ValueBlocksReader : public PullableReader {
+ public:
+  // Creates a closed `ValueBlocksReader`.
+  ValueBlocksReader() noexcept : PullableReader(kInitiallyClosed) {}
+
+  ValueBlocksReader(const ValueBlocksReader&) = delete;
+  ValueBlocksReader& operator=(const ValueBlocksReader&) = delete;
+
+  // Will read `size` bytes from blocks of `*src` beginning at `blocks_begin`.
+  // Each block except the last decompresses to `block_size` bytes, and
+  // `compressed_limits` are end positions of compressed blocks relative to
+  // `blocks_begin`.
+  //
+  // `src` is not owned by this `ValueBlocksReader` and must be kept alive but
+  // not accessed until closing the `ValueBlocksReader`.
+  void Reset(Reader* src, Position blocks_begin,
+             CompressionType compression_type,
+             const ZstdDictionary& zstd_dictionary, uint64_t block_size,
+             std::vector<Position> compressed_limits, Position size);
+
+  bool SupportsRandomAccess() const override;
+  bool Size(Position* size) override;
+
+ protected:
+  void Done() override;
+  bool PullSlow(size_t min_length, size_t recommended_length) override;
+  bool SeekSlow(Position new_pos) override;
+
+ private:
+  // Decompresses the block with index `block_index` to `block_`, and sets the
+  // buffer to its first fragment.
+  bool ReadBlock(size_t block_index);
+
+  Reader* src_ = nullptr;
+  Position blocks_begin_ = 0;
+  CompressionType compression_type_ = CompressionType::kNone;
+  ZstdDictionary zstd_dictionary_;
+  uint64_t block_size_ = 0;
+  std::vector<Position> compressed_limits_;
+  Position size_ = 0;
+  // Index of the block after the block in `block_`.
+  size_t next_block_index_ = 0;
+  // The block being read.
+  Chain block_;
+  // Index of the fragment of `block_` after the buffer.
+  size_t next_fragment_ = 0;
+};
+
+}  // namespace internal
 
 class SimpleDecoder : public Object {
  public:
@@ -41,13 +101,23 @@ class SimpleDecoder : public Object {
   // Makes concatenated record values available for reading from `reader()`.
   // Sets `*limits` to sorted record end positions.
   //
+  // `chunk_type` must be `ChunkType::kSimple`, `ChunkType::kSimpleWithBlocks`,
+  // or `ChunkType::kSimpleWithReferences`. In the second case `reader()` seeks
+  // by decompressing only the block containing the new position if `*src`
+  // supports random access. In the third case `reader()` reads only values of
+  // records not stored as references, and `ReadValues()` expands references.
+  //
+  // `zstd_dictionary` is used if the chunk is compressed with Zstd.
+  //
   // `src` is not owned by this `SimpleDecoder` and must be kept alive but not
   // accessed until closing the `SimpleDecoder`.
   //
   // Return values:
   //  * `true`  - success (`healthy()`)
   //  * `false` - failure (`!healthy()`)
-  bool Decode(Reader* src, uint64_t num_records, uint64_t decoded_data_size,
+  bool Decode(Reader* src, ChunkType chunk_type, uint64_t num_records,
+              uint64_t decoded_data_size,
+              const ZstdDictionary& zstd_dictionary,
               std::vector<size_t>* limits);
 
   // Returns the `Reader` from which concatenated record values should be read.
@@ -55,6 +125,17 @@ class SimpleDecoder : public Object {
   // Precondition: `healthy()`
   Reader* reader();
 
+  // Reads concatenated record values from `reader()` to `*dest`, which is
+  // cleared first. Records stored as references are expanded to copies of
+  // records they refer to.
+  //
+  // `limits` must be the record end positions set by `Decode()`.
+  //
+  // Return values:
+  //  * `true`  - success (`*dest` is set)
+  //  * `false` - failure (`!healthy()`)
+  bool ReadValues(const std::vector<size_t>& limits, Chain* dest);
+
   // Verifies that the concatenated record values end at the current position,
   // failing the `SimpleDecoder` if not. Closes the `SimpleDecoder`.
   //
@@ -70,7 +151,23 @@ class SimpleDecoder : public Object {
   void Done() override;
 
  private:
+  // Reads the block size and the compressed sizes of blocks of a
+  // `ChunkType::kSimpleWithBlocks` chunk, and starts reading the blocks.
+  bool DecodeValueBlocks(Reader* src, CompressionType compression_type,
+                         uint64_t decoded_data_size,
+                         const ZstdDictionary& zstd_dictionary);
+
+  // Whether record values are read from `value_blocks_reader_` instead of
+  // `values_decompressor_`.
+  bool values_in_blocks_ = false;
+  // The size of record values read from `reader()`.
+  uint64_t values_size_ = 0;
+  // For `ChunkType::kSimpleWithReferences`, for each record, how many records
+  // earlier is the record it is equal to, or 0 if it is read from `reader()`.
+  // Empty for other chunk types.
+  std::vector<uint64_t> distances_;
   internal::Decompressor<> values_decompressor_;
+  internal::ValueBlocksReader value_blocks_reader_;
 };
 
 // Implementation details follow.
@@ -78,6 +175,7 @@ class SimpleDecoder : public Object {
 inline Reader* SimpleDecoder::reader() {
   RIEGELI_ASSERT(healthy())
       << "Failed precondition of SimpleDecoder::reader(): " << status();
+  if (values_in_blocks_) return &value_blocks_reader_;
   return values_decompressor_.reader();
 }
 
@@ -17,6 +17,7 @@
 #include <stddef.h>
 #include <stdint.h>
 
+#include <deque>
 #include <limits>
 #include <string>
 #include <tuple>
@@ -25,11 +26,14 @@
 
 #include "absl/base/optimization.h"
 #include "absl/strings/string_view.h"
+#include "absl/types/span.h"
 #include "google/protobuf/message_lite.h"
 #include "riegeli/base/base.h"
 #include "riegeli/base/canonical_errors.h"
 #include "riegeli/base/chain.h"
+#include "riegeli/base/memory_estimator.h"
 #include "riegeli/base/status.h"
+#include "riegeli/bytes/chain_reader.h"
 #include "riegeli/bytes/chain_writer.h"
 #include "riegeli/bytes/message_serialize.h"
 #include "riegeli/bytes/writer.h"
@@ -38,25 +42,50 @@
 #include "riegeli/chunk_encoding/compressor.h"
 #include "riegeli/chunk_encoding/compressor_options.h"
 #include "riegeli/chunk_encoding/constants.h"
+#include "riegeli/chunk_encoding/hash.h"
 
 namespace riegeli {
 
-SimpleEncoder::SimpleEncoder(CompressorOptions options, uint64_t size_hint)
+SimpleEncoder::SimpleEncoder(CompressorOptions options, uint64_t size_hint,
+                             uint64_t block_size, uint64_t dedup_window)
     : compression_type_(options.compression_type()),
+      block_size_(compression_type_ == CompressionType::kNone ? uint64_t{0}
+                                                              : block_size),
       sizes_compressor_(options),
       values_compressor_(
-          options,
-          internal::Compressor::TuningOptions().set_size_hint(size_hint)) {}
+          block_size_ == 0 ? options
+                           : CompressorOptions(options).set_uncompressed(),
+          internal::Compressor::TuningOptions().set_size_hint(size_hint)),
+      block_compressor_options_(std::move(options)),
+      dedup_window_(block_size_ == 0 ? dedup_window : uint64_t{0}) {}
 
 void SimpleEncoder::Clear() {
   ChunkEncoder::Clear();
   sizes_compressor_.Clear();
   values_compressor_.Clear();
+  size_codes_.clear();
+  has_references_ = false;
+  recent_records_.clear();
+  recent_order_.clear();
+  record_open_ = false;
+  record_begin_ = 0;
 }
 
-bool SimpleEncoder::AddRecord(const google::protobuf::MessageLite& record) {
+bool SimpleEncoder::AddRecordWithCachedSize(
+    const google::protobuf::MessageLite& record, size_t size) {
   if (ABSL_PREDICT_FALSE(!healthy())) return false;
-  const size_t size = record.ByteSizeLong();
+  if (dedup_window_ > 0) {
+    // Duplicates are found by their serialized contents.
+    Chain serialized;
+    ChainWriter<> serialized_writer(&serialized);
+    Status status = internal::SerializeWithCachedSizesToWriter(
+        record, size, &serialized_writer);
+    if (ABSL_PREDICT_FALSE(!status.ok())) return Fail(std::move(status));
+    if (ABSL_PREDICT_FALSE(!serialized_writer.Close())) {
+      return Fail(serialized_writer);
+    }
+    return AddRecordImpl(std::move(serialized));
+  }
   if (ABSL_PREDICT_FALSE(num_records_ == kMaxNumRecords)) {
     return Fail(ResourceExhaustedError("Too many records"));
   }
@@ -71,7 +100,8 @@ bool SimpleEncoder::AddRecord(const google::protobuf::MessageLite& record) {
     return Fail(*sizes_compressor_.writer());
   }
   {
-    Status status = SerializeToWriter(record, values_compressor_.writer());
+    Status status = internal::SerializeWithCachedSizesToWriter(
+        record, size, values_compressor_.writer());
     if (ABSL_PREDICT_FALSE(!status.ok())) {
       return Fail(std::move(status));
     }
@@ -107,8 +137,11 @@ bool SimpleEncoder::AddRecordImpl(Record&& record) {
   }
   ++num_records_;
   decoded_data_size_ += IntCast<uint64_t>(record.size());
-  if (ABSL_PREDICT_FALSE(!WriteVarint64(sizes_compressor_.writer(),
-                                        IntCast<uint64_t>(record.size())))) {
+  if (dedup_window_ > 0) {
+    if (AddSizeCode(record)) return true;
+  } else if (ABSL_PREDICT_FALSE(
+                 !WriteVarint64(sizes_compressor_.writer(),
+                                IntCast<uint64_t>(record.size())))) {
     return Fail(*sizes_compressor_.writer());
   }
   if (ABSL_PREDICT_FALSE(
@@ -123,6 +156,21 @@ bool SimpleEncoder::AddRecords(Chain records, std::vector<size_t> limits) {
       << "Failed precondition of ChunkEncoder::AddRecords(): "
          "record end positions do not match concatenated record values";
   if (ABSL_PREDICT_FALSE(!healthy())) return false;
+  if (dedup_window_ > 0) {
+    // Duplicates are found among individual records.
+    ChainReader<> records_reader(&records);
+    size_t start = 0;
+    for (const size_t limit : limits) {
+      Chain record;
+      if (!records_reader.Read(&record, limit - start)) {
+        RIEGELI_ASSERT_UNREACHABLE()
+            << "Reading record values failed: " << records_reader.status();
+      }
+      if (ABSL_PREDICT_FALSE(!AddRecordImpl(std::move(record)))) return false;
+      start = limit;
+    }
+    return true;
+  }
   if (ABSL_PREDICT_FALSE(limits.size() > kMaxNumRecords - num_records_)) {
     return Fail(ResourceExhaustedError("Too many records"));
   }
@@ -133,15 +181,15 @@ bool SimpleEncoder::AddRecords(Chain records, std::vector<size_t> limits) {
   num_records_ += IntCast<uint64_t>(limits.size());
   decoded_data_size_ += IntCast<uint64_t>(records.size());
   size_t start = 0;
-  for (const size_t limit : limits) {
+  for (size_t i = 0; i < limits.size(); ++i) {
+    const size_t limit = limits[i];
     RIEGELI_ASSERT_GE(limit, start)
         << "Failed precondition of ChunkEncoder::AddRecords(): "
            "record end positions not sorted";
     RIEGELI_ASSERT_LE(limit, records.size())
         << "Failed precondition of ChunkEncoder::AddRecords(): "
            "record end positions do not match concatenated record values";
-    if (ABSL_PREDICT_FALSE(!WriteVarint64(sizes_compressor_.writer(),
-                                          IntCast<uint64_t>(limit - start)))) {
+    if (ABSL_PREDICT_FALSE(!WriteSize(limit - start, limits.size() - i))) {
       return Fail(*sizes_compressor_.writer());
     }
     start = limit;
@@ -153,11 +201,150 @@ bool SimpleEncoder::AddRecords(Chain records, std::vector<size_t> limits) {
   return true;
 }
 
+bool SimpleEncoder::AddRecords(absl::Span<const absl::string_view> records) {
+  if (ABSL_PREDICT_FALSE(!healthy())) return false;
+  if (dedup_window_ > 0) {
+    // Duplicates are found among individual records.
+    for (const absl::string_view record : records) {
+      if (ABSL_PREDICT_FALSE(!AddRecordImpl(record))) return false;
+    }
+    return true;
+  }
+  if (ABSL_PREDICT_FALSE(records.size() > kMaxNumRecords - num_records_)) {
+    return Fail(ResourceExhaustedError("Too many records"));
+  }
+  uint64_t size = 0;
+  for (const absl::string_view record : records) {
+    if (ABSL_PREDICT_FALSE(record.size() >
+                           std::numeric_limits<uint64_t>::max() -
+                               decoded_data_size_ - size)) {
+      return Fail(ResourceExhaustedError("Decoded data size too large"));
+    }
+    size += IntCast<uint64_t>(record.size());
+  }
+  num_records_ += IntCast<uint64_t>(records.size());
+  decoded_data_size_ += size;
+  Writer* const values_writer = values_compressor_.writer();
+  for (size_t i = 0; i < records.size(); ++i) {
+    if (ABSL_PREDICT_FALSE(!WriteSize(records[i].size(), records.size() - i))) {
+      return Fail(*sizes_compressor_.writer());
+    }
+    if (ABSL_PREDICT_FALSE(!values_writer->Write(records[i]))) {
+      return Fail(*values_writer);
+    }
+  }
+  return true;
+}
+
+Writer* SimpleEncoder::OpenRecord() {
+  RIEGELI_ASSERT(!record_open_)
+      << "Failed precondition of SimpleEncoder::OpenRecord(): "
+         "record already open";
+  if (ABSL_PREDICT_FALSE(!healthy())) return nullptr;
+  if (ABSL_PREDICT_FALSE(num_records_ == kMaxNumRecords)) {
+    Fail(ResourceExhaustedError("Too many records"));
+    return nullptr;
+  }
+  Writer* const values_writer = values_compressor_.writer();
+  record_open_ = true;
+  record_begin_ = values_writer->pos();
+  return values_writer;
+}
+
+bool SimpleEncoder::CloseRecord() {
+  RIEGELI_ASSERT(record_open_)
+      << "Failed precondition of SimpleEncoder::CloseRecord(): "
+         "no record open";
+  record_open_ = false;
+  if (ABSL_PREDICT_FALSE(!healthy())) return false;
+  Writer* const values_writer = values_compressor_.writer();
+  if (ABSL_PREDICT_FALSE(!values_writer->healthy())) {
+    return Fail(*values_writer);
+  }
+  RIEGELI_ASSERT_GE(values_writer->pos(), record_begin_)
+      << "Failed precondition of SimpleEncoder::CloseRecord(): "
+         "record Writer moved backwards";
+  const Position size = values_writer->pos() - record_begin_;
+  if (ABSL_PREDICT_FALSE(size > std::numeric_limits<uint64_t>::max() -
+                                    decoded_data_size_)) {
+    return Fail(ResourceExhaustedError("Decoded data size too large"));
+  }
+  ++num_records_;
+  decoded_data_size_ += IntCast<uint64_t>(size);
+  if (dedup_window_ > 0) {
+    size_codes_.push_back(IntCast<uint64_t>(size) << 1);
+  } else if (ABSL_PREDICT_FALSE(!WriteVarint64(sizes_compressor_.writer(),
+                                               IntCast<uint64_t>(size)))) {
+    return Fail(*sizes_compressor_.writer());
+  }
+  return true;
+}
+
+template <typename Record>
+bool SimpleEncoder::AddSizeCode(const Record& record) {
+  RIEGELI_ASSERT_GT(dedup_window_, 0u)
+      << "Failed precondition of SimpleEncoder::AddSizeCode(): "
+         "deduplication disabled";
+  RIEGELI_ASSERT_GT(num_records_, 0u)
+      << "Failed precondition of SimpleEncoder::AddSizeCode(): "
+         "record not counted";
+  const uint64_t index = num_records_ - 1;
+  while (!recent_order_.empty() &&
+         index - recent_order_.front().second > dedup_window_) {
+    const auto iter = recent_records_.find(recent_order_.front().first);
+    // The entry could have been replaced by a more recent record.
+    if (iter != recent_records_.end() &&
+        iter->second.index == recent_order_.front().second) {
+      recent_records_.erase(iter);
+    }
+    recent_order_.pop_front();
+  }
+  const uint64_t hash = internal::Hash(record);
+  recent_order_.emplace_back(hash, index);
+  const std::pair<absl::flat_hash_map<uint64_t, RecentRecord>::iterator, bool>
+      insert_result = recent_records_.emplace(hash, RecentRecord());
+  RecentRecord& recent = insert_result.first->second;
+  if (!insert_result.second && recent.record == record) {
+    size_codes_.push_back(((index - recent.index - 1) << 1) | 1);
+    recent.index = index;
+    has_references_ = true;
+    return true;
+  }
+  // A new record, or a different record with the same hash which replaces the
+  // older one.
+  recent.index = index;
+  recent.record = Chain(record);
+  size_codes_.push_back(IntCast<uint64_t>(record.size()) << 1);
+  return false;
+}
+
+inline bool SimpleEncoder::WriteSize(size_t size, size_t num_remaining) {
+  Writer* const sizes_writer = sizes_compressor_.writer();
+  if (ABSL_PREDICT_FALSE(sizes_writer->available() < kMaxLengthVarint64)) {
+    if (ABSL_PREDICT_FALSE(!sizes_writer->Push(
+            kMaxLengthVarint64,
+            UnsignedMin(num_remaining, kMaxBufferSize) *
+                LengthVarint64(IntCast<uint64_t>(size))))) {
+      return false;
+    }
+  }
+  sizes_writer->set_cursor(
+      WriteVarint64(sizes_writer->cursor(), IntCast<uint64_t>(size)));
+  return true;
+}
+
 bool SimpleEncoder::EncodeAndClose(Writer* dest, ChunkType* chunk_type,
                                    uint64_t* num_records,
                                    uint64_t* decoded_data_size) {
+  RIEGELI_ASSERT(!record_open_)
+      << "Failed precondition of ChunkEncoder::EncodeAndClose(): "
+         "record opened by SimpleEncoder::OpenRecord() not closed";
   if (ABSL_PREDICT_FALSE(!healthy())) return false;
-  *chunk_type = ChunkType::kSimple;
+  *chunk_type = has_references_
+                    ? ChunkType::kSimpleWithReferences
+                    : block_size_ > 0 && decoded_data_size_ > block_size_
+                          ? ChunkType::kSimpleWithBlocks
+                          : ChunkType::kSimple;
   *num_records = num_records_;
   *decoded_data_size = decoded_data_size_;
 
@@ -166,6 +353,17 @@ bool SimpleEncoder::EncodeAndClose(Writer* dest, ChunkType* chunk_type,
     return Fail(*dest);
   }
 
+  // Record codes were buffered, so that a chunk without references is written
+  // with plain record sizes.
+  for (size_t i = 0; i < size_codes_.size(); ++i) {
+    const uint64_t code =
+        has_references_ ? size_codes_[i] : size_codes_[i] >> 1;
+    if (ABSL_PREDICT_FALSE(
+            !WriteSize(IntCast<size_t>(code), size_codes_.size() - i))) {
+      return Fail(*sizes_compressor_.writer());
+    }
+  }
+
   ChainWriter<Chain> compressed_sizes_writer(std::forward_as_tuple());
   if (ABSL_PREDICT_FALSE(
           !sizes_compressor_.EncodeAndClose(&compressed_sizes_writer))) {
@@ -181,10 +379,94 @@ bool SimpleEncoder::EncodeAndClose(Writer* dest, ChunkType* chunk_type,
     return Fail(*dest);
   }
 
-  if (ABSL_PREDICT_FALSE(!values_compressor_.EncodeAndClose(dest))) {
+  if (block_size_ > 0) {
+    if (ABSL_PREDICT_FALSE(!EncodeValueBlocks(dest))) return false;
+  } else if (ABSL_PREDICT_FALSE(!values_compressor_.EncodeAndClose(dest))) {
     return Fail(values_compressor_);
   }
   return Close();
 }
 
+inline bool SimpleEncoder::EncodeValueBlocks(Writer* dest) {
+  ChainWriter<Chain> values_writer(std::forward_as_tuple());
+  if (ABSL_PREDICT_FALSE(!values_compressor_.EncodeAndClose(&values_writer))) {
+    return Fail(values_compressor_);
+  }
+  if (ABSL_PREDICT_FALSE(!values_writer.Close())) return Fail(values_writer);
+  ChainReader<> values_reader(&values_writer.dest());
+  ChainWriter<Chain> blocks_writer(std::forward_as_tuple());
+  std::vector<Position> compressed_sizes;
+  internal::Compressor block_compressor(block_compressor_options_);
+  Chain block;
+  // Empty record values are compressed as a single empty block.
+  do {
+    const size_t length = IntCast<size_t>(UnsignedMin(
+        values_writer.dest().size() - values_reader.pos(), block_size_));
+    block.Clear();
+    if (!values_reader.Read(&block, length)) {
+      RIEGELI_ASSERT_UNREACHABLE()
+          << "Reading record values failed: " << values_reader.status();
+    }
+    block_compressor.Clear(
+        internal::Compressor::TuningOptions().set_final_size(length));
+    if (ABSL_PREDICT_FALSE(
+            !block_compressor.writer()->Write(std::move(block)))) {
+      return Fail(*block_compressor.writer());
+    }
+    const Position compressed_begin = blocks_writer.pos();
+    if (ABSL_PREDICT_FALSE(!block_compressor.EncodeAndClose(&blocks_writer))) {
+      return Fail(block_compressor);
+    }
+    compressed_sizes.push_back(blocks_writer.pos() - compressed_begin);
+  } while (values_reader.pos() < values_writer.dest().size());
+  if (ABSL_PREDICT_FALSE(!blocks_writer.Close())) return Fail(blocks_writer);
+  if (compressed_sizes.size() > 1) {
+    if (ABSL_PREDICT_FALSE(!WriteVarint64(dest, block_size_))) {
+      return Fail(*dest);
+    }
+    for (const Position compressed_size : compressed_sizes) {
+      if (ABSL_PREDICT_FALSE(
+              !WriteVarint64(dest, IntCast<uint64_t>(compressed_size)))) {
+        return Fail(*dest);
+      }
+    }
+  }
+  if (ABSL_PREDICT_FALSE(!dest->Write(std::move(blocks_writer.dest())))) {
+    return Fail(*dest);
+  }
+  return true;
+}
+
+uint64_t SimpleEncoder::ApproximateEncodedSize() const {
+  // If `dedup_window_ > 0`, record codes are written to `sizes_compressor_`
+  // when the chunk is encoded, taking about one byte each.
+  return sizes_compressor_.uncompressed_size() +
+         values_compressor_.uncompressed_size() +
+         IntCast<uint64_t>(size_codes_.size());
+}
+
+size_t SimpleEncoder::ApproximateMemory() const {
+  size_t memory = sizeof(*this) + sizes_compressor_.ApproximateMemory() +
+                  values_compressor_.ApproximateMemory() +
+                  size_codes_.size() * sizeof(uint64_t);
+  if (!recent_records_.empty()) {
+    // Recent records are assumed to have the average size of records.
+    const size_t average_record_size = IntCast<size_t>(
+        UnsignedMin(decoded_data_size_ / num_records_,
+                    uint64_t{std::numeric_limits<size_t>::max()}));
+    memory += recent_records_.size() *
+                  (sizeof(decltype(recent_records_)::value_type) + 1) +
+              recent_records_.size() * average_record_size +
+              recent_order_.size() *
+                  sizeof(decltype(recent_order_)::value_type);
+  }
+  return memory;
+}
+
+void SimpleEncoder::RegisterUnique(MemoryEstimator* memory_estimator) const {
+  memory_estimator->RegisterDynamicMemory(sizeof(*this));
+  sizes_compressor_.RegisterSubobjects(memory_estimator);
+  values_compressor_.RegisterSubobjects(memory_estimator);
+}
+
 }  // namespace riegeli
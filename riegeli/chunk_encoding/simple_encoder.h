@@ -18,12 +18,18 @@
 #include <stddef.h>
 #include <stdint.h>
 
+#include <deque>
 #include <string>
+#include <utility>
 #include <vector>
 
+#include "absl/container/flat_hash_map.h"
 #include "absl/strings/string_view.h"
+#include "absl/types/span.h"
 #include "google/protobuf/message_lite.h"
+#include "riegeli/base/base.h"
 #include "riegeli/base/chain.h"
+#include "riegeli/base/memory_estimator.h"
 #include "riegeli/bytes/writer.h"
 #include "riegeli/chunk_encoding/chunk_encoder.h"
 #include "riegeli/chunk_encoding/compressor.h"
@@ -42,33 +48,144 @@ namespace riegeli {
 //
 // If compression is used, a compressed block is prefixed by its varint-encoded
 // uncompressed size.
+//
+// Format with record values compressed in blocks
+// (`ChunkType::kSimpleWithBlocks`):
+//  - Compression type
+//  - Size of record sizes (compressed if applicable)
+//  - Record sizes (possibly compressed):
+//    - Array of `num_records` varints: sizes of records
+//  - Block size: uncompressed size of each block of record values except the
+//    last one
+//  - Array of varints: compressed sizes of blocks of record values
+//  - Blocks of record values, each compressed independently:
+//    - Concatenated record data (bytes)
+//
+// Format with duplicate records stored as references
+// (`ChunkType::kSimpleWithReferences`):
+//  - Compression type
+//  - Size of record codes (compressed if applicable)
+//  - Record codes (possibly compressed):
+//    - Array of `num_records` varints: `size << 1` for a record stored in
+//      record values, or `(distance - 1) << 1 | 1` for a record equal to the
+//      record `distance` records earlier in the chunk
+//  - Record values (possibly compressed):
+//    - Concatenated data of records not stored as references (bytes)
 class SimpleEncoder : public ChunkEncoder {
  public:
   // Creates an empty `SimpleEncoder`.
-  explicit SimpleEncoder(CompressorOptions options, uint64_t size_hint);
+  //
+  // If `block_size > 0` and compression is used, record values are compressed
+  // in independent blocks of `block_size` uncompressed bytes, which allows to
+  // decompress only the block containing a record when seeking to it, at the
+  // cost of compression density. A chunk whose record values fit in a single
+  // block is encoded as if `block_size` was 0.
+  //
+  // If `dedup_window > 0` and `block_size` is not used, a record equal to one
+  // of `dedup_window` preceding records of the chunk is stored as a reference
+  // to it. Records are found by `internal::Hash()` and compared afterwards. A
+  // chunk without such records is encoded as if `dedup_window` was 0.
+  explicit SimpleEncoder(CompressorOptions options, uint64_t size_hint,
+                         uint64_t block_size = 0, uint64_t dedup_window = 0);
 
   void Clear() override;
 
   using ChunkEncoder::AddRecord;
-  bool AddRecord(const google::protobuf::MessageLite& record) override;
   bool AddRecord(absl::string_view record) override;
   bool AddRecord(std::string&& record) override;
   bool AddRecord(const Chain& record) override;
   bool AddRecord(Chain&& record) override;
+  bool AddRecordWithCachedSize(const google::protobuf::MessageLite& record,
+                               size_t size) override;
 
   bool AddRecords(Chain records, std::vector<size_t> limits) override;
+  bool AddRecords(absl::Span<const absl::string_view> records) override;
+
+  // Begins adding a record whose contents are written to the returned `Writer`
+  // instead of being passed at once. The record is added by `CloseRecord()`.
+  //
+  // Record values are compressed while they are written, so unless
+  // `block_size` was used, a large record is never held uncompressed.
+  //
+  // The `Writer` is valid until `CloseRecord()`. Other records must not be
+  // added in the meantime, and the `Writer` must not be closed. A record
+  // added this way is never stored as a reference, nor referred to.
+  //
+  // Returns `nullptr` on failure (`!healthy()`).
+  //
+  // Precondition: no record was opened or it was closed
+  Writer* OpenRecord();
+
+  // Adds the record opened by `OpenRecord()`, consisting of data written to
+  // its `Writer`.
+  //
+  // Return values:
+  //  * `true`  - success (`healthy()`)
+  //  * `false` - failure (`!healthy()`)
+  //
+  // Precondition: a record was opened and not closed
+  bool CloseRecord();
 
   bool EncodeAndClose(Writer* dest, ChunkType* chunk_type,
                       uint64_t* num_records,
                       uint64_t* decoded_data_size) override;
 
+  uint64_t ApproximateEncodedSize() const override;
+  size_t ApproximateMemory() const override;
+  void RegisterUnique(MemoryEstimator* memory_estimator) const override;
+
  private:
   template <typename Record>
   bool AddRecordImpl(Record&& record);
 
+  // A record which can be referred to by following equal records.
+  struct RecentRecord {
+    // Index of the last record equal to `record` in the chunk.
+    uint64_t index;
+    Chain record;
+  };
+
+  // Adds the size of a record, or a reference to a recent equal record, to
+  // `size_codes_`. Returns `true` if a reference was added, in which case
+  // record values should not be written.
+  //
+  // Precondition: `dedup_window_ > 0`, `num_records_` includes `record`
+  template <typename Record>
+  bool AddSizeCode(const Record& record);
+
+  // Writes the size of a record to `sizes_compressor_.writer()`. When more
+  // space is needed, it is requested for `num_remaining` sizes at once.
+  bool WriteSize(size_t size, size_t num_remaining);
+
+  // Compresses record values buffered uncompressed in `values_compressor_` in
+  // blocks of `block_size_`, and writes them to `*dest`, preceded by the block
+  // size and compressed sizes of blocks if there are several blocks.
+  bool EncodeValueBlocks(Writer* dest);
+
   CompressionType compression_type_;
+  // If not 0, record values are buffered uncompressed in `values_compressor_`
+  // and compressed in blocks of this size by `EncodeAndClose()`.
+  uint64_t block_size_;
   internal::Compressor sizes_compressor_;
   internal::Compressor values_compressor_;
+  // Options for compressing blocks of record values if `block_size_ > 0`.
+  CompressorOptions block_compressor_options_;
+  // If not 0, a record equal to one of this many preceding records is stored
+  // as a reference, and record codes are buffered in `size_codes_` instead of
+  // being written to `sizes_compressor_`.
+  uint64_t dedup_window_;
+  // Record codes of `ChunkType::kSimpleWithReferences`, if `dedup_window_ > 0`.
+  std::vector<uint64_t> size_codes_;
+  // Whether `size_codes_` contains a reference.
+  bool has_references_ = false;
+  // Distinct records among the last `dedup_window_` records, by their hashes.
+  absl::flat_hash_map<uint64_t, RecentRecord> recent_records_;
+  // Hashes and indices of the last `dedup_window_` records, oldest first.
+  std::deque<std::pair<uint64_t, uint64_t>> recent_order_;
+  // Whether a record was opened by `OpenRecord()` and not closed yet.
+  bool record_open_ = false;
+  // Position of `values_compressor_.writer()` where the open record begins.
+  Position record_begin_ = 0;
 };
 
 }  // namespace riegeli
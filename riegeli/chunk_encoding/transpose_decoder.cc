@@ -18,9 +18,11 @@
 #include <stdint.h>
 
 #include <algorithm>
+#include <atomic>
 #include <cstring>
 #include <iterator>
 #include <limits>
+#include <memory>
 #include <string>
 #include <tuple>
 #include <utility>
@@ -28,13 +30,18 @@
 
 #include "absl/base/attributes.h"
 #include "absl/base/optimization.h"
-#include "absl/container/flat_hash_map.h"
+#include "absl/strings/str_cat.h"
 #include "absl/strings/string_view.h"
+#include "absl/synchronization/blocking_counter.h"
 #include "riegeli/base/base.h"
 #include "riegeli/base/canonical_errors.h"
 #include "riegeli/base/chain.h"
 #include "riegeli/base/memory.h"
+#include "riegeli/base/memory_estimator.h"
 #include "riegeli/base/object.h"
+#include "riegeli/base/parallelism.h"
+#include "riegeli/base/status.h"
+#include "riegeli/base/tracing.h"
 #include "riegeli/bytes/backward_writer.h"
 #include "riegeli/bytes/backward_writer_utils.h"
 #include "riegeli/bytes/chain_reader.h"
@@ -43,6 +50,8 @@
 #include "riegeli/bytes/reader_utils.h"
 #include "riegeli/bytes/string_reader.h"
 #include "riegeli/bytes/writer_utils.h"
+#include "riegeli/bytes/zstd_dictionary.h"
+#include "riegeli/chunk_encoding/compiled_field_projection.h"
 #include "riegeli/chunk_encoding/constants.h"
 #include "riegeli/chunk_encoding/decompressor.h"
 #include "riegeli/chunk_encoding/field_projection.h"
@@ -74,8 +83,242 @@ struct DataBucket {
   internal::Decompressor<ChainReader<>> decompressor;
   // A prefix of decompressed data buffers, lazily extended.
   std::vector<ChainReader<Chain>> buffers;
+  // Index of the first data buffer in the bucket among all buffers.
+  uint32_t first_buffer_index = 0;
 };
 
+// A data buffer stored with a `internal::BufferEncoding`.
+struct EncodedBuffer {
+  uint32_t buffer_index;
+  internal::BufferEncoding encoding;
+  // The base of `internal::BufferEncoding::kFrameOfReference`, otherwise 0.
+  uint64_t base;
+};
+
+// Returns the encoding of the buffer with `buffer_index`, or `nullptr` if it
+// is not encoded. `encoded_buffers` are sorted by `buffer_index`.
+const EncodedBuffer* FindEncodedBuffer(
+    const std::vector<EncodedBuffer>& encoded_buffers, uint32_t buffer_index) {
+  const std::vector<EncodedBuffer>::const_iterator iter = std::lower_bound(
+      encoded_buffers.begin(), encoded_buffers.end(), buffer_index,
+      [](const EncodedBuffer& encoded_buffer, uint32_t buffer_index) {
+        return encoded_buffer.buffer_index < buffer_index;
+      });
+  if (iter == encoded_buffers.end() || iter->buffer_index != buffer_index) {
+    return nullptr;
+  }
+  return &*iter;
+}
+
+// Returns the value stored as `encoded_value` with a numeric `encoding` and
+// `base`, following `previous` unless `first`.
+inline uint64_t DecodeNumericValue(internal::BufferEncoding encoding,
+                                   uint64_t base, bool first,
+                                   uint64_t previous, uint64_t encoded_value) {
+  switch (encoding) {
+    case internal::BufferEncoding::kDelta:
+      return first ? encoded_value : previous - encoded_value;
+    case internal::BufferEncoding::kZigZagDelta:
+      return first ? encoded_value
+                   : previous - internal::DecodeZigZag64(encoded_value);
+    case internal::BufferEncoding::kFrameOfReference:
+      return encoded_value + base;
+    default:
+      RIEGELI_ASSERT_UNREACHABLE()
+          << "Not a numeric encoding: " << static_cast<int>(encoding);
+  }
+}
+
+// Replaces `*buffer` stored with `encoded_buffer.encoding` with varints
+// without continuation bits of the values it encodes, which is the form the
+// state machine reads.
+//
+// This is a single sequential pass, because each value depends on the
+// previous one, and the boundaries of varints are known only after reading
+// them.
+Status DecodeNumericBuffer(const EncodedBuffer& encoded_buffer,
+                           Chain* buffer) {
+  const std::string encoded(*buffer);
+  std::string decoded;
+  decoded.reserve(encoded.size());
+  const char* cursor = encoded.data();
+  const char* const limit = encoded.data() + encoded.size();
+  uint64_t value = 0;
+  bool first = true;
+  while (cursor != limit) {
+    uint64_t encoded_value;
+    if (ABSL_PREDICT_FALSE(!ReadVarint64(&cursor, limit, &encoded_value))) {
+      return DataLossError("Invalid varint in encoded buffer");
+    }
+    value = DecodeNumericValue(encoded_buffer.encoding, encoded_buffer.base,
+                               first, value, encoded_value);
+    first = false;
+    char varint[kMaxLengthVarint64];
+    char* varint_end = varint;
+    uint64_t remaining = value;
+    do {
+      *varint_end++ = static_cast<char>(remaining & 0x7f);
+      remaining >>= 7;
+    } while (remaining != 0);
+    decoded.append(varint, PtrDistance(varint, varint_end));
+  }
+  buffer->Reset(std::move(decoded));
+  return OkStatus();
+}
+
+// Replaces `*buffer` stored with `internal::BufferEncoding::kDictionary` with
+// the strings it encodes, each preceded by its length, which is the form the
+// state machine reads. Fails if the result would exceed `max_size`, which
+// prevents a small buffer from expanding without a bound.
+Status DecodeDictionaryBuffer(uint64_t max_size, Chain* buffer) {
+  const std::string encoded(*buffer);
+  const char* cursor = encoded.data();
+  const char* const limit = encoded.data() + encoded.size();
+  uint32_t num_entries;
+  if (ABSL_PREDICT_FALSE(!ReadVarint32(&cursor, limit, &num_entries))) {
+    return DataLossError("Reading dictionary size failed");
+  }
+  // Each entry takes at least one byte for its length.
+  if (ABSL_PREDICT_FALSE(num_entries > PtrDistance(cursor, limit))) {
+    return DataLossError("Dictionary size too large");
+  }
+  // Entries, each with its length.
+  std::vector<absl::string_view> entries;
+  entries.reserve(num_entries);
+  for (uint32_t i = 0; i < num_entries; ++i) {
+    const char* const entry_begin = cursor;
+    uint32_t length;
+    if (ABSL_PREDICT_FALSE(!ReadVarint32(&cursor, limit, &length) ||
+                           length > PtrDistance(cursor, limit))) {
+      return DataLossError("Reading dictionary entry failed");
+    }
+    cursor += length;
+    entries.emplace_back(entry_begin, PtrDistance(entry_begin, cursor));
+  }
+  std::string decoded;
+  while (cursor != limit) {
+    uint32_t index;
+    if (ABSL_PREDICT_FALSE(!ReadVarint32(&cursor, limit, &index))) {
+      return DataLossError("Reading dictionary index failed");
+    }
+    if (ABSL_PREDICT_FALSE(index >= entries.size())) {
+      return DataLossError("Dictionary index out of range");
+    }
+    if (ABSL_PREDICT_FALSE(entries[index].size() > max_size - decoded.size())) {
+      return ResourceExhaustedError("Decoded dictionary buffer too large");
+    }
+    decoded.append(entries[index].data(), entries[index].size());
+  }
+  buffer->Reset(std::move(decoded));
+  return OkStatus();
+}
+
+// Replaces `*buffer` stored with `internal::BufferEncoding::kPackedVarints`
+// with the strings of varints it encodes, each preceded by its length, which
+// is the form the state machine reads. Fails if the result would exceed
+// `max_size`.
+Status DecodePackedBuffer(uint64_t max_size, Chain* buffer) {
+  const std::string encoded(*buffer);
+  const char* cursor = encoded.data();
+  const char* const limit = encoded.data() + encoded.size();
+  if (ABSL_PREDICT_FALSE(cursor == limit)) {
+    return DataLossError("Reading element encoding failed");
+  }
+  const uint8_t encoding_byte = static_cast<uint8_t>(*cursor++);
+  const internal::BufferEncoding element_encoding =
+      static_cast<internal::BufferEncoding>(encoding_byte);
+  uint64_t base = 0;
+  switch (encoding_byte) {
+    case 0:
+    case static_cast<uint8_t>(internal::BufferEncoding::kDelta):
+    case static_cast<uint8_t>(internal::BufferEncoding::kZigZagDelta):
+      break;
+    case static_cast<uint8_t>(internal::BufferEncoding::kFrameOfReference):
+      if (ABSL_PREDICT_FALSE(!ReadVarint64(&cursor, limit, &base))) {
+        return DataLossError("Reading element encoding base failed");
+      }
+      break;
+    default:
+      return DataLossError(absl::StrCat("Unknown element encoding: ",
+                                        uint32_t{encoding_byte}));
+  }
+  uint64_t num_strings;
+  if (ABSL_PREDICT_FALSE(!ReadVarint64(&cursor, limit, &num_strings))) {
+    return DataLossError("Reading number of packed strings failed");
+  }
+  // Each count takes at least one byte.
+  if (ABSL_PREDICT_FALSE(num_strings > PtrDistance(cursor, limit))) {
+    return DataLossError("Number of packed strings too large");
+  }
+  std::vector<uint32_t> counts(IntCast<size_t>(num_strings));
+  uint64_t num_elements = 0;
+  for (uint32_t& count : counts) {
+    if (ABSL_PREDICT_FALSE(!ReadVarint32(&cursor, limit, &count))) {
+      return DataLossError("Reading number of packed elements failed");
+    }
+    num_elements += count;
+  }
+  // Each element takes at least one byte.
+  if (ABSL_PREDICT_FALSE(num_elements > PtrDistance(cursor, limit))) {
+    return DataLossError("Number of packed elements too large");
+  }
+  std::string decoded;
+  uint64_t value = 0;
+  bool first = true;
+  std::vector<uint64_t> elements;
+  for (const uint32_t count : counts) {
+    elements.clear();
+    size_t length = 0;
+    for (uint32_t i = 0; i < count; ++i) {
+      uint64_t encoded_value;
+      if (ABSL_PREDICT_FALSE(!ReadVarint64(&cursor, limit, &encoded_value))) {
+        return DataLossError("Reading packed element failed");
+      }
+      value = encoding_byte == 0
+                  ? encoded_value
+                  : DecodeNumericValue(element_encoding, base, first, value,
+                                       encoded_value);
+      first = false;
+      elements.push_back(value);
+      length += LengthVarint64(value);
+    }
+    if (ABSL_PREDICT_FALSE(length > std::numeric_limits<uint32_t>::max())) {
+      return DataLossError("Packed string too long");
+    }
+    if (ABSL_PREDICT_FALSE(LengthVarint32(IntCast<uint32_t>(length)) +
+                               length >
+                           max_size - decoded.size())) {
+      return ResourceExhaustedError("Decoded packed buffer too large");
+    }
+    char varint[kMaxLengthVarint64];
+    char* varint_end = WriteVarint32(varint, IntCast<uint32_t>(length));
+    decoded.append(varint, PtrDistance(varint, varint_end));
+    for (const uint64_t element : elements) {
+      varint_end = WriteVarint64(varint, element);
+      decoded.append(varint, PtrDistance(varint, varint_end));
+    }
+  }
+  if (ABSL_PREDICT_FALSE(cursor != limit)) {
+    return DataLossError("Packed buffer longer than its elements");
+  }
+  buffer->Reset(std::move(decoded));
+  return OkStatus();
+}
+
+// Replaces `*buffer` stored with `encoded_buffer.encoding` with its decoded
+// form, of size at most `max_size`.
+Status DecodeBuffer(const EncodedBuffer& encoded_buffer, uint64_t max_size,
+                    Chain* buffer) {
+  switch (encoded_buffer.encoding) {
+    case internal::BufferEncoding::kDictionary:
+      return DecodeDictionaryBuffer(max_size, buffer);
+    case internal::BufferEncoding::kPackedVarints:
+      return DecodePackedBuffer(max_size, buffer);
+    default:
+      return DecodeNumericBuffer(encoded_buffer, buffer);
+  }
+}
+
 // Should the data content of the field be decoded?
 enum class FieldIncluded {
   kYes,
@@ -98,6 +341,42 @@ bool ValidTag(uint32_t tag) {
   }
 }
 
+// Sets the continuation bit in all bytes of a varint of `data_length` bytes
+// except the last one.
+//
+// The transposed format stores varints without continuation bits. Since the
+// same bit is set in each byte, bytes can be processed a machine word at a
+// time regardless of endianness. `data_length` is a compile time constant, so
+// all branches are resolved statically.
+template <size_t data_length>
+inline void SetVarintContinuationBits(char* data) {
+  static_assert(data_length > 0 && data_length <= kMaxLengthVarint64,
+                "Invalid varint length");
+  constexpr size_t kLength = data_length - 1;
+  size_t i = 0;
+  for (; i + sizeof(uint64_t) <= kLength; i += sizeof(uint64_t)) {
+    uint64_t word;
+    std::memcpy(&word, data + i, sizeof(uint64_t));
+    word |= uint64_t{0x8080808080808080};
+    std::memcpy(data + i, &word, sizeof(uint64_t));
+  }
+  if (kLength - i >= sizeof(uint32_t)) {
+    uint32_t word;
+    std::memcpy(&word, data + i, sizeof(uint32_t));
+    word |= uint32_t{0x80808080};
+    std::memcpy(data + i, &word, sizeof(uint32_t));
+    i += sizeof(uint32_t);
+  }
+  if (kLength - i >= sizeof(uint16_t)) {
+    uint16_t word;
+    std::memcpy(&word, data + i, sizeof(uint16_t));
+    word |= uint16_t{0x8080};
+    std::memcpy(data + i, &word, sizeof(uint16_t));
+    i += sizeof(uint16_t);
+  }
+  if (kLength - i >= 1) data[i] |= 0x80;
+}
+
 }  // namespace
 
 namespace internal {
@@ -367,14 +646,62 @@ inline bool IsImplicit(CallbackType callback_type) {
 
 }  // namespace internal
 
+struct TransposeDecoder::ParsedNode {
+  // Tag for the field decoded by this node.
+  TagData tag_data;
+  // `CallbackType` of the node, including `CallbackType::kImplicit`.
+  internal::CallbackType callback_type;
+  // Whether the node is finalized in decoding phase based on a
+  // `StateMachineNodeTemplate`. Then `tag` and `subtype` are set.
+  bool uses_template;
+  // Tag subtype.
+  internal::Subtype subtype;
+  // Proto tag of the node template.
+  uint32_t tag;
+  // Index of the buffer to read data from, or `kInvalidPos` if none.
+  uint32_t buffer_index;
+  // Index of the node to move to after finishing the callback for this node.
+  uint32_t next_node;
+};
+
+struct TransposeDecoder::ParsedStateMachine {
+  // Whether `nodes` were parsed for projection.
+  bool projection_enabled = false;
+  // Whether buffer indices in `nodes` are buffer slots, i.e. `nodes` were
+  // parsed from a shared header.
+  bool uses_buffer_slots = false;
+  // The part of the decompressed header `nodes` were parsed from, or empty if
+  // nothing has been parsed successfully.
+  std::string header;
+  // The shared header `nodes` were parsed from, or empty if none.
+  Chain shared_header;
+  // Nodes of the state machine, without additional failure nodes.
+  std::vector<ParsedNode> nodes;
+  // Whether any node is `kNonProto`.
+  bool has_nonproto_op = false;
+  // Node to start decoding from.
+  uint32_t first_node = 0;
+};
+
 struct TransposeDecoder::Context {
   // Compression type of the input.
   CompressionType compression_type = CompressionType::kNone;
+  // Zstd dictionary used if `compression_type` is `kZstd`.
+  ZstdDictionary zstd_dictionary;
   // Buffer containing all the data.
   // Note: Used only when projection is disabled.
   std::vector<ChainReader<Chain>> buffers;
   // Buffer for lengths of nonproto messages.
   Reader* nonproto_lengths = nullptr;
+  // If `true`, the chunk has type `ChunkType::kTransposedWithBufferEncodings`.
+  bool buffer_encodings = false;
+  // Encoded data buffers, sorted by `buffer_index`.
+  std::vector<EncodedBuffer> encoded_buffers;
+  // Decoded size of the chunk, which bounds the decoded size of each buffer.
+  uint64_t decoded_data_size = 0;
+  // Remaining total uncompressed size of data buckets allowed by
+  // `ResourceLimits::max_decoded_data_ratio()`.
+  uint64_t remaining_uncompressed_size = std::numeric_limits<uint64_t>::max();
   // State machine read from the input.
   std::vector<StateMachineNode> state_machine_nodes;
   // Node to start decoding from.
@@ -382,40 +709,141 @@ struct TransposeDecoder::Context {
   // State machine transitions. One byte = one transition.
   internal::Decompressor<> transitions;
 
-  enum class IncludeType : uint8_t {
-    // Field is included.
-    kIncludeFully,
-    // Some child fields are included.
-    kIncludeChild,
-    // Field is existence only.
-    kExistenceOnly,
-  };
-
-  // --- Fields used in projection. ---
-  // Holds information about included field.
-  struct IncludedField {
-    // IDs are sequentially assigned to fields from FieldProjection.
-    uint32_t field_id;
-    IncludeType include_type;
-  };
-  // Fields form a tree structure stored in `include_fields` map. If `p` is
-  // the ID of parent submessage then `include_fields[std::make_pair(p, f)]`
-  // holds the include information of the child with field number `f`. The root
-  // ID is assumed to be `kInvalidPos` and the root `IncludeType` is assumed to
-  // be `kIncludeChild`.
-  absl::flat_hash_map<std::pair<uint32_t, uint32_t>, IncludedField>
-      include_fields;
+  // Fields included by the projection, valid while the chunk is decoded. The
+  // root `IncludeType` is assumed to be `kIncludeChild`.
+  const CompiledFieldProjection* field_projection = nullptr;
   // Data buckets.
   std::vector<DataBucket> buckets;
   // Template that can later be used later to finalize `StateMachineNode`.
   std::vector<StateMachineNodeTemplate> node_templates;
+
+  // Stack of all open sub-messages, used in decoding phase.
+  std::vector<SubmessageStackElement> submessage_stack;
+
+  // State machine parsed most recently. It is kept across chunks.
+  ParsedStateMachine parsed_state_machine;
+  // Scratch buffer for the part of the header describing the state machine.
+  std::string state_machine_header;
+  // Scratch buffer for buffers of slots, if the state machine is shared.
+  std::vector<uint32_t> buffer_slots;
+
+  // Resets `*this` for decoding another chunk, keeping allocated storage.
+  void Clear();
 };
 
+void TransposeDecoder::Context::Clear() {
+  compression_type = CompressionType::kNone;
+  buffers.clear();
+  nonproto_lengths = nullptr;
+  buffer_encodings = false;
+  encoded_buffers.clear();
+  decoded_data_size = 0;
+  remaining_uncompressed_size = std::numeric_limits<uint64_t>::max();
+  // `state_machine_nodes` and `node_templates` are resized by
+  // `InstantiateStateMachine()`, which sets all fields used later.
+  // `parsed_state_machine` is kept to be reused by the next chunk.
+  first_node = 0;
+  transitions.Reset();
+  field_projection = nullptr;
+  buckets.clear();
+  submessage_stack.clear();
+}
+
+void TransposeDecoder::RegisterSubobjects(
+    MemoryEstimator* memory_estimator) const {
+  if (context_ == nullptr) return;
+  memory_estimator->RegisterDynamicMemory(sizeof(Context));
+  memory_estimator->RegisterDynamicMemory(context_->buffers.capacity() *
+                                          sizeof(ChainReader<Chain>));
+  for (const ChainReader<Chain>& buffer : context_->buffers) {
+    buffer.src().RegisterSubobjects(memory_estimator);
+  }
+  memory_estimator->RegisterDynamicMemory(
+      context_->state_machine_nodes.capacity() * sizeof(StateMachineNode));
+  memory_estimator->RegisterDynamicMemory(context_->buckets.capacity() *
+                                          sizeof(DataBucket));
+  for (const DataBucket& bucket : context_->buckets) {
+    bucket.compressed_data.RegisterSubobjects(memory_estimator);
+    memory_estimator->RegisterDynamicMemory(bucket.buffer_sizes.capacity() *
+                                            sizeof(size_t));
+    memory_estimator->RegisterDynamicMemory(bucket.buffers.capacity() *
+                                            sizeof(ChainReader<Chain>));
+    for (const ChainReader<Chain>& buffer : bucket.buffers) {
+      buffer.src().RegisterSubobjects(memory_estimator);
+    }
+  }
+  memory_estimator->RegisterDynamicMemory(context_->node_templates.capacity() *
+                                          sizeof(StateMachineNodeTemplate));
+  memory_estimator->RegisterDynamicMemory(
+      context_->submessage_stack.capacity() * sizeof(SubmessageStackElement));
+  memory_estimator->RegisterDynamicMemory(
+      context_->parsed_state_machine.header.capacity() + 1);
+  context_->parsed_state_machine.shared_header.RegisterSubobjects(
+      memory_estimator);
+  memory_estimator->RegisterDynamicMemory(
+      context_->parsed_state_machine.nodes.capacity() * sizeof(ParsedNode));
+  memory_estimator->RegisterDynamicMemory(
+      context_->state_machine_header.capacity() + 1);
+  memory_estimator->RegisterDynamicMemory(context_->buffer_slots.capacity() *
+                                          sizeof(uint32_t));
+  memory_estimator->RegisterDynamicMemory(
+      context_->encoded_buffers.capacity() * sizeof(EncodedBuffer));
+}
+
+TransposeDecoder::TransposeDecoder() noexcept : Object(kInitiallyClosed) {}
+
+TransposeDecoder::TransposeDecoder(TransposeDecoder&& that) noexcept
+    : Object(std::move(that)),
+      context_(std::move(that.context_)),
+      resource_limits_(that.resource_limits_) {}
+
+TransposeDecoder& TransposeDecoder::operator=(
+    TransposeDecoder&& that) noexcept {
+  Object::operator=(std::move(that));
+  context_ = std::move(that.context_);
+  resource_limits_ = that.resource_limits_;
+  return *this;
+}
+
+TransposeDecoder::~TransposeDecoder() {}
+
 bool TransposeDecoder::Decode(Reader* src, uint64_t num_records,
                               uint64_t decoded_data_size,
-                              const FieldProjection& field_projection,
+                              const CompiledFieldProjection& field_projection,
+                              const ZstdDictionary& zstd_dictionary,
+                              BackwardWriter* dest,
+                              std::vector<size_t>* limits) {
+  return Decode(nullptr, false, src, num_records, decoded_data_size,
+                field_projection, zstd_dictionary, dest, limits);
+}
+
+bool TransposeDecoder::Decode(const Chain& shared_header, Reader* src,
+                              uint64_t num_records,
+                              uint64_t decoded_data_size,
+                              const CompiledFieldProjection& field_projection,
+                              const ZstdDictionary& zstd_dictionary,
                               BackwardWriter* dest,
                               std::vector<size_t>* limits) {
+  return Decode(&shared_header, false, src, num_records, decoded_data_size,
+                field_projection, zstd_dictionary, dest, limits);
+}
+
+bool TransposeDecoder::DecodeWithBufferEncodings(
+    Reader* src, uint64_t num_records, uint64_t decoded_data_size,
+    const CompiledFieldProjection& field_projection,
+    const ZstdDictionary& zstd_dictionary, BackwardWriter* dest,
+    std::vector<size_t>* limits) {
+  return Decode(nullptr, true, src, num_records, decoded_data_size,
+                field_projection, zstd_dictionary, dest, limits);
+}
+
+inline bool TransposeDecoder::Decode(
+    const Chain* shared_header, bool buffer_encodings, Reader* src,
+    uint64_t num_records, uint64_t decoded_data_size,
+    const CompiledFieldProjection& field_projection,
+    const ZstdDictionary& zstd_dictionary, BackwardWriter* dest,
+    std::vector<size_t>* limits) {
+  const TraceScope trace("TransposeDecode");
   RIEGELI_ASSERT_EQ(dest->pos(), 0u)
       << "Failed precondition of TransposeDecoder::Reset(): "
          "non-zero destination position";
@@ -427,12 +855,42 @@ bool TransposeDecoder::Decode(Reader* src, uint64_t num_records,
                          std::numeric_limits<size_t>::max())) {
     return Fail(ResourceExhaustedError("Records too large"));
   }
+  uint64_t max_uncompressed_size = std::numeric_limits<uint64_t>::max();
+  if (resource_limits_.max_decoded_data_ratio() <
+      std::numeric_limits<double>::infinity()) {
+    Position src_size;
+    if (src->SupportsRandomAccess() && src->Size(&src_size)) {
+      const double max_size =
+          static_cast<double>(SaturatingSub(src_size, src->pos())) *
+          resource_limits_.max_decoded_data_ratio();
+      if (max_size < static_cast<double>(max_uncompressed_size)) {
+        max_uncompressed_size = static_cast<uint64_t>(max_size);
+      }
+      if (ABSL_PREDICT_FALSE(decoded_data_size > max_uncompressed_size)) {
+        return Fail(ResourceExhaustedError(
+            absl::StrCat("Decoded data size too large for the encoded size: ",
+                         decoded_data_size, " > ", max_uncompressed_size)));
+      }
+    }
+  }
 
-  Context context;
-  if (ABSL_PREDICT_FALSE(!Parse(&context, src, field_projection))) return false;
+  if (context_ == nullptr) {
+    context_ = std::make_unique<Context>();
+  } else {
+    context_->Clear();
+  }
+  Context* const context = context_.get();
+  context->zstd_dictionary = zstd_dictionary;
+  context->buffer_encodings = buffer_encodings;
+  context->decoded_data_size = decoded_data_size;
+  context->remaining_uncompressed_size = max_uncompressed_size;
+  if (ABSL_PREDICT_FALSE(
+          !Parse(context, shared_header, src, field_projection))) {
+    return false;
+  }
   LimitingBackwardWriter<> limiting_dest(dest, decoded_data_size);
   if (ABSL_PREDICT_FALSE(
-          !Decode(&context, num_records, &limiting_dest, limits))) {
+          !Decode(context, num_records, &limiting_dest, limits))) {
     limiting_dest.Close();
     return false;
   }
@@ -446,47 +904,16 @@ bool TransposeDecoder::Decode(Reader* src, uint64_t num_records,
   return true;
 }
 
-inline bool TransposeDecoder::Parse(Context* context, Reader* src,
-                                    const FieldProjection& field_projection) {
-  bool projection_enabled = true;
-  for (const Field& include_field : field_projection.fields()) {
-    if (include_field.path().empty()) {
-      projection_enabled = false;
-      break;
-    }
-    size_t path_len = include_field.path().size();
-    bool existence_only =
-        include_field.path()[path_len - 1] == Field::kExistenceOnly;
-    if (existence_only) {
-      --path_len;
-      if (path_len == 0) continue;
-    }
-    uint32_t current_id = kInvalidPos;
-    for (size_t i = 0; i < path_len; ++i) {
-      const uint32_t tag = include_field.path()[i];
-      if (tag == Field::kExistenceOnly) {
-        return false;
-      }
-      uint32_t next_id = context->include_fields.size();
-      Context::IncludeType include_type = Context::IncludeType::kIncludeChild;
-      if (i + 1 == path_len) {
-        include_type = existence_only ? Context::IncludeType::kExistenceOnly
-                                      : Context::IncludeType::kIncludeFully;
-      }
-      Context::IncludedField& val =
-          context->include_fields
-              .emplace(std::make_pair(current_id, tag),
-                       Context::IncludedField{next_id, include_type})
-              .first->second;
-      current_id = val.field_id;
-      static_assert(Context::IncludeType::kExistenceOnly >
-                            Context::IncludeType::kIncludeChild &&
-                        Context::IncludeType::kIncludeChild >
-                            Context::IncludeType::kIncludeFully,
-                    "Statement below assumes this ordering");
-      val.include_type = std::min(val.include_type, include_type);
-    }
+inline bool TransposeDecoder::Parse(
+    Context* context, const Chain* shared_header, Reader* src,
+    const CompiledFieldProjection& field_projection) {
+  if (ABSL_PREDICT_FALSE(!field_projection.valid())) {
+    return Fail(InvalidArgumentError(
+        "Invalid field projection: Field::kExistenceOnly before the end of a "
+        "path"));
   }
+  const bool projection_enabled = !field_projection.includes_all();
+  context->field_projection = &field_projection;
 
   uint8_t compression_type_byte;
   if (ABSL_PREDICT_FALSE(!ReadByte(src, &compression_type_byte))) {
@@ -504,7 +931,8 @@ inline bool TransposeDecoder::Parse(Context* context, Reader* src,
     return Fail(*src, DataLossError("Reading header failed"));
   }
   internal::Decompressor<ChainReader<>> header_decompressor(
-      std::forward_as_tuple(&header), context->compression_type);
+      std::forward_as_tuple(&header), context->compression_type,
+      context->zstd_dictionary);
   if (ABSL_PREDICT_FALSE(!header_decompressor.healthy())) {
     return Fail(header_decompressor);
   }
@@ -527,27 +955,161 @@ inline bool TransposeDecoder::Parse(Context* context, Reader* src,
     num_buffers = IntCast<uint32_t>(context->buffers.size());
   }
 
-  uint32_t state_machine_size;
+  ParsedStateMachine& parsed_state_machine = context->parsed_state_machine;
+  std::string& state_machine_header = context->state_machine_header;
+  std::vector<uint32_t>* buffer_slots = nullptr;
+  bool reuse_state_machine;
+  if (shared_header == nullptr) {
+    // The rest of the header describes the state machine. Consecutive chunks
+    // often have the same state machine even if their buffers differ, so it is
+    // parsed again only if it differs from the one parsed most recently.
+    state_machine_header.clear();
+    if (ABSL_PREDICT_FALSE(
+            !header_decompressor.reader()->ReadAll(&state_machine_header))) {
+      return Fail(*header_decompressor.reader(),
+                  DataLossError("Reading state machine failed"));
+    }
+    if (ABSL_PREDICT_FALSE(!header_decompressor.VerifyEndAndClose())) {
+      return Fail(header_decompressor);
+    }
+    reuse_state_machine =
+        parsed_state_machine.projection_enabled == projection_enabled &&
+        !parsed_state_machine.uses_buffer_slots &&
+        parsed_state_machine.header == state_machine_header;
+  } else {
+    // The rest of the header maps buffer slots of the shared state machine to
+    // buffers. The shared state machine is decompressed and parsed again only
+    // if it differs from the one parsed most recently.
+    buffer_slots = &context->buffer_slots;
+    uint32_t num_slots;
+    if (ABSL_PREDICT_FALSE(
+            !ReadVarint32(header_decompressor.reader(), &num_slots))) {
+      return Fail(*header_decompressor.reader(),
+                  DataLossError("Reading number of buffer slots failed"));
+    }
+    if (ABSL_PREDICT_FALSE(num_slots > num_buffers)) {
+      return Fail(DataLossError("Too many buffer slots"));
+    }
+    buffer_slots->resize(num_slots);
+    for (uint32_t& buffer_index : *buffer_slots) {
+      if (ABSL_PREDICT_FALSE(
+              !ReadVarint32(header_decompressor.reader(), &buffer_index))) {
+        return Fail(*header_decompressor.reader(),
+                    DataLossError("Reading buffer index failed"));
+      }
+      if (ABSL_PREDICT_FALSE(buffer_index >= num_buffers)) {
+        return Fail(DataLossError("Buffer index too large"));
+      }
+    }
+    if (ABSL_PREDICT_FALSE(!header_decompressor.VerifyEndAndClose())) {
+      return Fail(header_decompressor);
+    }
+    reuse_state_machine =
+        parsed_state_machine.projection_enabled == projection_enabled &&
+        parsed_state_machine.uses_buffer_slots &&
+        !parsed_state_machine.header.empty() &&
+        parsed_state_machine.shared_header == *shared_header;
+    if (!reuse_state_machine &&
+        ABSL_PREDICT_FALSE(!ReadSharedHeader(context, *shared_header,
+                                             &state_machine_header))) {
+      return false;
+    }
+  }
+  if (!reuse_state_machine) {
+    // Forget the previous state machine until the new one is known to be
+    // valid.
+    parsed_state_machine.header.clear();
+    parsed_state_machine.shared_header.Clear();
+    StringReader<> header_reader(state_machine_header);
+    if (ABSL_PREDICT_FALSE(!ParseStateMachine(
+            &header_reader, projection_enabled, &parsed_state_machine))) {
+      return false;
+    }
+    if (ABSL_PREDICT_FALSE(!header_reader.VerifyEndAndClose())) {
+      return Fail(header_reader);
+    }
+  }
+  if (ABSL_PREDICT_FALSE(!InstantiateStateMachine(
+          context, projection_enabled, num_buffers, buffer_slots,
+          first_buffer_indices, bucket_indices))) {
+    return false;
+  }
+  if (!reuse_state_machine) {
+    // This depends only on the parsed state machine, so it needs to be
+    // checked only once.
+    if (ABSL_PREDICT_FALSE(
+            ContainsImplicitLoop(&context->state_machine_nodes))) {
+      return Fail(DataLossError("Nodes contain an implicit loop"));
+    }
+    parsed_state_machine.projection_enabled = projection_enabled;
+    parsed_state_machine.uses_buffer_slots = shared_header != nullptr;
+    std::swap(parsed_state_machine.header, state_machine_header);
+    if (shared_header != nullptr) {
+      parsed_state_machine.shared_header = *shared_header;
+    }
+  }
+
+  context->transitions.Reset(src, context->compression_type,
+                             context->zstd_dictionary);
+  if (ABSL_PREDICT_FALSE(!context->transitions.healthy())) {
+    return Fail(context->transitions);
+  }
+  return true;
+}
+
+inline bool TransposeDecoder::ReadSharedHeader(
+    Context* context, const Chain& shared_header,
+    std::string* state_machine_header) {
+  ChainReader<> shared_header_reader(&shared_header);
+  uint8_t compression_type_byte;
+  if (ABSL_PREDICT_FALSE(
+          !ReadByte(&shared_header_reader, &compression_type_byte))) {
+    return Fail(shared_header_reader,
+                DataLossError("Reading shared header compression type failed"));
+  }
+  internal::Decompressor<> states_decompressor(
+      &shared_header_reader,
+      static_cast<CompressionType>(compression_type_byte),
+      context->zstd_dictionary);
+  if (ABSL_PREDICT_FALSE(!states_decompressor.healthy())) {
+    return Fail(states_decompressor);
+  }
+  state_machine_header->clear();
   if (ABSL_PREDICT_FALSE(
-          !ReadVarint32(header_decompressor.reader(), &state_machine_size))) {
-    return Fail(*header_decompressor.reader(),
+          !states_decompressor.reader()->ReadAll(state_machine_header))) {
+    return Fail(*states_decompressor.reader(),
+                DataLossError("Reading shared state machine failed"));
+  }
+  if (ABSL_PREDICT_FALSE(!states_decompressor.VerifyEndAndClose())) {
+    return Fail(states_decompressor);
+  }
+  return true;
+}
+
+inline bool TransposeDecoder::ParseStateMachine(
+    Reader* header_reader, bool projection_enabled,
+    ParsedStateMachine* parsed_state_machine) {
+  uint32_t state_machine_size;
+  if (ABSL_PREDICT_FALSE(!ReadVarint32(header_reader, &state_machine_size))) {
+    return Fail(*header_reader,
                 DataLossError("Reading state machine size failed"));
   }
-  // Additional `0xff` nodes to correctly handle invalid/malicious inputs.
-  // TODO: Handle overflow.
-  context->state_machine_nodes.resize(state_machine_size + 0xff);
-  if (projection_enabled) context->node_templates.resize(state_machine_size);
-  std::vector<StateMachineNode>& state_machine_nodes =
-      context->state_machine_nodes;
+  if (ABSL_PREDICT_FALSE(state_machine_size >
+                         resource_limits_.max_state_machine_size())) {
+    return Fail(ResourceExhaustedError(absl::StrCat(
+        "State machine too large: ", state_machine_size, " > ",
+        resource_limits_.max_state_machine_size())));
+  }
+  std::vector<ParsedNode>& parsed_nodes = parsed_state_machine->nodes;
+  parsed_nodes.resize(state_machine_size);
   bool has_nonproto_op = false;
   size_t num_subtypes = 0;
   std::vector<uint32_t> tags;
   tags.reserve(state_machine_size);
   for (size_t i = 0; i < state_machine_size; ++i) {
     uint32_t tag;
-    if (ABSL_PREDICT_FALSE(!ReadVarint32(header_decompressor.reader(), &tag))) {
-      return Fail(*header_decompressor.reader(),
-                  DataLossError("Reading field tag failed"));
+    if (ABSL_PREDICT_FALSE(!ReadVarint32(header_reader, &tag))) {
+      return Fail(*header_reader, DataLossError("Reading field tag failed"));
     }
     tags.push_back(tag);
     if (ValidTag(tag) && internal::HasSubtype(tag)) ++num_subtypes;
@@ -556,65 +1118,46 @@ inline bool TransposeDecoder::Parse(Context* context, Reader* src,
   next_node_indices.reserve(state_machine_size);
   for (size_t i = 0; i < state_machine_size; ++i) {
     uint32_t next_node;
-    if (ABSL_PREDICT_FALSE(
-            !ReadVarint32(header_decompressor.reader(), &next_node))) {
-      return Fail(*header_decompressor.reader(),
+    if (ABSL_PREDICT_FALSE(!ReadVarint32(header_reader, &next_node))) {
+      return Fail(*header_reader,
                   DataLossError("Reading next node index failed"));
     }
     next_node_indices.push_back(next_node);
   }
   std::string subtypes;
-  if (ABSL_PREDICT_FALSE(
-          !header_decompressor.reader()->Read(&subtypes, num_subtypes))) {
-    return Fail(*header_decompressor.reader(),
-                DataLossError("Reading subtypes failed"));
+  if (ABSL_PREDICT_FALSE(!header_reader->Read(&subtypes, num_subtypes))) {
+    return Fail(*header_reader, DataLossError("Reading subtypes failed"));
   }
   size_t subtype_index = 0;
   for (size_t i = 0; i < state_machine_size; ++i) {
     uint32_t tag = tags[i];
-    StateMachineNode& state_machine_node = state_machine_nodes[i];
-    state_machine_node.buffer = nullptr;
+    ParsedNode& parsed_node = parsed_nodes[i];
+    parsed_node.buffer_index = kInvalidPos;
+    parsed_node.uses_template = false;
     switch (static_cast<internal::MessageId>(tag)) {
       case internal::MessageId::kNoOp:
-        state_machine_node.callback_type = internal::CallbackType::kNoOp;
+        parsed_node.callback_type = internal::CallbackType::kNoOp;
         break;
       case internal::MessageId::kNonProto: {
-        state_machine_node.callback_type = internal::CallbackType::kNonProto;
-        uint32_t buffer_index;
+        parsed_node.callback_type = internal::CallbackType::kNonProto;
         if (ABSL_PREDICT_FALSE(
-                !ReadVarint32(header_decompressor.reader(), &buffer_index))) {
-          return Fail(*header_decompressor.reader(),
+                !ReadVarint32(header_reader, &parsed_node.buffer_index))) {
+          return Fail(*header_reader,
                       DataLossError("Reading buffer index failed"));
         }
-        if (ABSL_PREDICT_FALSE(buffer_index >= num_buffers)) {
-          return Fail(DataLossError("Buffer index too large"));
-        }
-        if (projection_enabled) {
-          const uint32_t bucket = bucket_indices[buffer_index];
-          state_machine_node.buffer = GetBuffer(
-              context, bucket, buffer_index - first_buffer_indices[bucket]);
-          if (ABSL_PREDICT_FALSE(state_machine_node.buffer == nullptr)) {
-            return false;
-          }
-        } else {
-          state_machine_node.buffer = &context->buffers[buffer_index];
-        }
         has_nonproto_op = true;
       } break;
       case internal::MessageId::kStartOfMessage:
-        state_machine_node.callback_type =
-            internal::CallbackType::kMessageStart;
+        parsed_node.callback_type = internal::CallbackType::kMessageStart;
         break;
       case internal::MessageId::kStartOfSubmessage:
         if (projection_enabled) {
-          context->node_templates[i].tag =
+          parsed_node.tag =
               static_cast<uint32_t>(internal::MessageId::kStartOfSubmessage);
-          state_machine_node.node_template = &context->node_templates[i];
-          state_machine_node.callback_type =
-              internal::CallbackType::kSelectCallback;
+          parsed_node.uses_template = true;
+          parsed_node.callback_type = internal::CallbackType::kSelectCallback;
         } else {
-          state_machine_node.callback_type =
-              internal::CallbackType::kSubmessageStart;
+          parsed_node.callback_type = internal::CallbackType::kSubmessageStart;
         }
         break;
       default: {
@@ -633,54 +1176,29 @@ inline bool TransposeDecoder::Parse(Context* context, Reader* src,
         if (ABSL_PREDICT_FALSE((!ValidTag(tag)))) {
           return Fail(DataLossError("Invalid tag"));
         }
-        char* const tag_end =
-            WriteVarint32(state_machine_node.tag_data.data, tag);
+        char* const tag_end = WriteVarint32(parsed_node.tag_data.data, tag);
         const size_t tag_length =
-            PtrDistance(state_machine_node.tag_data.data, tag_end);
+            PtrDistance(parsed_node.tag_data.data, tag_end);
         if (internal::HasSubtype(tag)) {
           subtype = static_cast<internal::Subtype>(subtypes[subtype_index++]);
         }
-        if (projection_enabled) {
-          if (internal::HasDataBuffer(tag, subtype)) {
-            uint32_t buffer_index;
-            if (ABSL_PREDICT_FALSE(!ReadVarint32(header_decompressor.reader(),
-                                                 &buffer_index))) {
-              return Fail(*header_decompressor.reader(),
-                          DataLossError("Reading buffer index failed"));
-            }
-            if (ABSL_PREDICT_FALSE(buffer_index >= num_buffers)) {
-              return Fail(DataLossError("Buffer index too large"));
-            }
-            const uint32_t bucket = bucket_indices[buffer_index];
-            context->node_templates[i].bucket_index = bucket;
-            context->node_templates[i].buffer_within_bucket_index =
-                buffer_index - first_buffer_indices[bucket];
-          } else {
-            context->node_templates[i].bucket_index = kInvalidPos;
+        if (internal::HasDataBuffer(tag, subtype)) {
+          if (ABSL_PREDICT_FALSE(
+                  !ReadVarint32(header_reader, &parsed_node.buffer_index))) {
+            return Fail(*header_reader,
+                        DataLossError("Reading buffer index failed"));
           }
-          context->node_templates[i].tag = tag;
-          context->node_templates[i].subtype = subtype;
-          context->node_templates[i].tag_length = IntCast<uint8_t>(tag_length);
-          state_machine_node.node_template = &context->node_templates[i];
-          state_machine_node.callback_type =
-              internal::CallbackType::kSelectCallback;
+        }
+        if (projection_enabled) {
+          parsed_node.tag = tag;
+          parsed_node.subtype = subtype;
+          parsed_node.uses_template = true;
+          parsed_node.callback_type = internal::CallbackType::kSelectCallback;
         } else {
-          if (internal::HasDataBuffer(tag, subtype)) {
-            uint32_t buffer_index;
-            if (ABSL_PREDICT_FALSE(!ReadVarint32(header_decompressor.reader(),
-                                                 &buffer_index))) {
-              return Fail(*header_decompressor.reader(),
-                          DataLossError("Reading buffer index failed"));
-            }
-            if (ABSL_PREDICT_FALSE(buffer_index >= num_buffers)) {
-              return Fail(DataLossError("Buffer index too large"));
-            }
-            state_machine_node.buffer = &context->buffers[buffer_index];
-          }
-          state_machine_node.callback_type =
+          parsed_node.callback_type =
               internal::GetCallbackType(FieldIncluded::kYes, tag, subtype,
                                         tag_length, projection_enabled);
-          if (ABSL_PREDICT_FALSE(state_machine_node.callback_type ==
+          if (ABSL_PREDICT_FALSE(parsed_node.callback_type ==
                                  internal::CallbackType::kUnknown)) {
             return Fail(DataLossError("Invalid node"));
           }
@@ -689,29 +1207,102 @@ inline bool TransposeDecoder::Parse(Context* context, Reader* src,
         if (static_cast<internal::WireType>(tag & 7) ==
                 internal::WireType::kVarint &&
             subtype >= internal::Subtype::kVarintInline0) {
-          state_machine_node.tag_data.data[tag_length] =
+          parsed_node.tag_data.data[tag_length] =
               subtype - internal::Subtype::kVarintInline0;
         } else {
-          state_machine_node.tag_data.data[tag_length] = 0;
+          parsed_node.tag_data.data[tag_length] = 0;
         }
-        state_machine_node.tag_data.size = IntCast<uint8_t>(tag_length);
+        parsed_node.tag_data.size = IntCast<uint8_t>(tag_length);
       }
     }
     uint32_t next_node_id = next_node_indices[i];
     if (next_node_id >= state_machine_size) {
       // Callback is implicit.
       next_node_id -= state_machine_size;
-      state_machine_node.callback_type =
-          state_machine_node.callback_type | internal::CallbackType::kImplicit;
+      parsed_node.callback_type =
+          parsed_node.callback_type | internal::CallbackType::kImplicit;
     }
     if (ABSL_PREDICT_FALSE(next_node_id >= state_machine_size)) {
       return Fail(DataLossError("Node index too large"));
     }
+    parsed_node.next_node = next_node_id;
+  }
+  parsed_state_machine->has_nonproto_op = has_nonproto_op;
 
-    state_machine_node.next_node = &state_machine_nodes[next_node_id];
+  if (ABSL_PREDICT_FALSE(
+          !ReadVarint32(header_reader, &parsed_state_machine->first_node))) {
+    return Fail(*header_reader,
+                DataLossError("Reading first node index failed"));
   }
+  if (ABSL_PREDICT_FALSE(parsed_state_machine->first_node >=
+                         state_machine_size)) {
+    return Fail(DataLossError("First node index too large"));
+  }
+  return true;
+}
 
-  if (has_nonproto_op) {
+inline bool TransposeDecoder::InstantiateStateMachine(
+    Context* context, bool projection_enabled, uint32_t num_buffers,
+    const std::vector<uint32_t>* buffer_slots,
+    const std::vector<uint32_t>& first_buffer_indices,
+    const std::vector<uint32_t>& bucket_indices) {
+  const ParsedStateMachine& parsed_state_machine =
+      context->parsed_state_machine;
+  const std::vector<ParsedNode>& parsed_nodes = parsed_state_machine.nodes;
+  const size_t state_machine_size = parsed_nodes.size();
+  // Additional `0xff` nodes to correctly handle invalid/malicious inputs.
+  // TODO: Handle overflow.
+  context->state_machine_nodes.resize(state_machine_size + 0xff);
+  if (projection_enabled) context->node_templates.resize(state_machine_size);
+  std::vector<StateMachineNode>& state_machine_nodes =
+      context->state_machine_nodes;
+  for (size_t i = 0; i < state_machine_size; ++i) {
+    const ParsedNode& parsed_node = parsed_nodes[i];
+    StateMachineNode& state_machine_node = state_machine_nodes[i];
+    state_machine_node.tag_data = parsed_node.tag_data;
+    state_machine_node.callback_type = parsed_node.callback_type;
+    state_machine_node.buffer = nullptr;
+    state_machine_node.next_node = &state_machine_nodes[parsed_node.next_node];
+    uint32_t buffer_index = parsed_node.buffer_index;
+    if (buffer_slots != nullptr && buffer_index != kInvalidPos) {
+      if (ABSL_PREDICT_FALSE(buffer_index >= buffer_slots->size())) {
+        return Fail(DataLossError("Buffer slot index too large"));
+      }
+      buffer_index = (*buffer_slots)[buffer_index];
+    }
+    if (buffer_index != kInvalidPos &&
+        ABSL_PREDICT_FALSE(buffer_index >= num_buffers)) {
+      return Fail(DataLossError("Buffer index too large"));
+    }
+    if (parsed_node.uses_template) {
+      StateMachineNodeTemplate& node_template = context->node_templates[i];
+      if (buffer_index != kInvalidPos) {
+        const uint32_t bucket = bucket_indices[buffer_index];
+        node_template.bucket_index = bucket;
+        node_template.buffer_within_bucket_index =
+            buffer_index - first_buffer_indices[bucket];
+      } else {
+        node_template.bucket_index = kInvalidPos;
+      }
+      node_template.tag = parsed_node.tag;
+      node_template.subtype = parsed_node.subtype;
+      node_template.tag_length = parsed_node.tag_data.size;
+      state_machine_node.node_template = &node_template;
+    } else if (buffer_index != kInvalidPos) {
+      if (projection_enabled) {
+        const uint32_t bucket = bucket_indices[buffer_index];
+        state_machine_node.buffer = GetBuffer(
+            context, bucket, buffer_index - first_buffer_indices[bucket]);
+        if (ABSL_PREDICT_FALSE(state_machine_node.buffer == nullptr)) {
+          return false;
+        }
+      } else {
+        state_machine_node.buffer = &context->buffers[buffer_index];
+      }
+    }
+  }
+
+  if (parsed_state_machine.has_nonproto_op) {
     // If non-proto state exists then the last buffer is the
     // `nonproto_lengths` buffer.
     if (ABSL_PREDICT_FALSE(num_buffers == 0)) {
@@ -729,31 +1320,12 @@ inline bool TransposeDecoder::Parse(Context* context, Reader* src,
     }
   }
 
-  if (ABSL_PREDICT_FALSE(
-          !ReadVarint32(header_decompressor.reader(), &context->first_node))) {
-    return Fail(*header_decompressor.reader(),
-                DataLossError("Reading first node index failed"));
-  }
-  if (ABSL_PREDICT_FALSE(context->first_node >= state_machine_size)) {
-    return Fail(DataLossError("First node index too large"));
-  }
+  context->first_node = parsed_state_machine.first_node;
 
   // Add `0xff` failure nodes so we never overflow this array.
-  for (uint64_t i = state_machine_size; i < state_machine_size + 0xff; ++i) {
+  for (size_t i = state_machine_size; i < state_machine_size + 0xff; ++i) {
     state_machine_nodes[i].callback_type = internal::CallbackType::kFailure;
   }
-
-  if (ABSL_PREDICT_FALSE(ContainsImplicitLoop(&state_machine_nodes))) {
-    return Fail(DataLossError("Nodes contain an implicit loop"));
-  }
-
-  if (ABSL_PREDICT_FALSE(!header_decompressor.VerifyEndAndClose())) {
-    return Fail(header_decompressor);
-  }
-  context->transitions.Reset(src, context->compression_type);
-  if (ABSL_PREDICT_FALSE(!context->transitions.healthy())) {
-    return Fail(context->transitions);
-  }
   return true;
 }
 
@@ -776,14 +1348,15 @@ inline bool TransposeDecoder::ParseBuffers(Context* context,
     if (ABSL_PREDICT_FALSE(num_buffers != 0)) {
       return Fail(DataLossError("Too few buckets"));
     }
-    return true;
+    return ParseBufferEncodings(context, header_reader, 0);
   }
-  context->buffers.reserve(num_buffers);
-  std::vector<internal::Decompressor<ChainReader<Chain>>> bucket_decompressors;
-  if (ABSL_PREDICT_FALSE(num_buckets > bucket_decompressors.max_size())) {
+  std::vector<Chain> buckets;
+  if (ABSL_PREDICT_FALSE(num_buckets > buckets.max_size())) {
     return Fail(ResourceExhaustedError("Too many buckets"));
   }
-  bucket_decompressors.reserve(num_buckets);
+  buckets.reserve(num_buckets);
+  std::vector<uint64_t> uncompressed_bucket_sizes;
+  uncompressed_bucket_sizes.reserve(num_buckets);
   for (uint32_t bucket_index = 0; bucket_index < num_buckets; ++bucket_index) {
     uint64_t bucket_length;
     if (ABSL_PREDICT_FALSE(!ReadVarint64(header_reader, &bucket_length))) {
@@ -794,20 +1367,35 @@ inline bool TransposeDecoder::ParseBuffers(Context* context,
                            std::numeric_limits<size_t>::max())) {
       return Fail(ResourceExhaustedError("Bucket too large"));
     }
-    Chain bucket;
+    buckets.emplace_back();
     if (ABSL_PREDICT_FALSE(
-            !src->Read(&bucket, IntCast<size_t>(bucket_length)))) {
+            !src->Read(&buckets.back(), IntCast<size_t>(bucket_length)))) {
       return Fail(*src, DataLossError("Reading bucket failed"));
     }
-    bucket_decompressors.emplace_back(std::forward_as_tuple(std::move(bucket)),
-                                      context->compression_type);
-    if (ABSL_PREDICT_FALSE(!bucket_decompressors.back().healthy())) {
-      return Fail(bucket_decompressors.back());
+    uint64_t uncompressed_size;
+    if (ABSL_PREDICT_FALSE(!internal::UncompressedSize(
+            buckets.back(), context->compression_type, &uncompressed_size))) {
+      return Fail(DataLossError("Reading uncompressed size failed"));
+    }
+    if (ABSL_PREDICT_FALSE(!ReserveUncompressedSize(context,
+                                                    uncompressed_size))) {
+      return false;
     }
+    uncompressed_bucket_sizes.push_back(uncompressed_size);
   }
 
+  // Assign buffers to buckets using uncompressed bucket sizes, so that buckets
+  // can be decompressed independently. Buffers of bucket `bucket_index` are
+  // `[first_buffer_indices[bucket_index], first_buffer_indices[bucket_index +
+  // 1])`.
+  std::vector<size_t> buffer_sizes;
+  buffer_sizes.reserve(num_buffers);
+  std::vector<uint32_t> first_buffer_indices;
+  first_buffer_indices.reserve(num_buckets + size_t{1});
+  first_buffer_indices.push_back(0);
   uint32_t bucket_index = 0;
-  for (size_t buffer_index = 0; buffer_index < num_buffers; ++buffer_index) {
+  uint64_t remaining_bucket_size = uncompressed_bucket_sizes[0];
+  for (uint32_t buffer_index = 0; buffer_index < num_buffers; ++buffer_index) {
     uint64_t buffer_length;
     if (ABSL_PREDICT_FALSE(!ReadVarint64(header_reader, &buffer_length))) {
       return Fail(*header_reader,
@@ -817,32 +1405,114 @@ inline bool TransposeDecoder::ParseBuffers(Context* context,
                            std::numeric_limits<size_t>::max())) {
       return Fail(ResourceExhaustedError("Buffer too large"));
     }
-    Chain buffer;
-    if (ABSL_PREDICT_FALSE(!bucket_decompressors[bucket_index].reader()->Read(
-            &buffer, IntCast<size_t>(buffer_length)))) {
-      return Fail(*bucket_decompressors[bucket_index].reader(),
-                  DataLossError("Reading buffer failed"));
+    if (ABSL_PREDICT_FALSE(buffer_length > remaining_bucket_size)) {
+      return Fail(DataLossError("Buffer does not fit in bucket"));
     }
-    context->buffers.emplace_back(std::move(buffer));
-    while (!bucket_decompressors[bucket_index].reader()->Pull() &&
-           bucket_index + 1 < num_buckets) {
-      if (ABSL_PREDICT_FALSE(
-              !bucket_decompressors[bucket_index].VerifyEndAndClose())) {
-        return Fail(bucket_decompressors[bucket_index].status());
-      }
+    buffer_sizes.push_back(IntCast<size_t>(buffer_length));
+    remaining_bucket_size -= buffer_length;
+    while (remaining_bucket_size == 0 && bucket_index + 1 < num_buckets) {
       ++bucket_index;
+      first_buffer_indices.push_back(buffer_index + 1);
+      remaining_bucket_size = uncompressed_bucket_sizes[bucket_index];
     }
   }
   if (ABSL_PREDICT_FALSE(bucket_index + 1 < num_buckets)) {
     return Fail(DataLossError("Too few buckets"));
   }
+  if (ABSL_PREDICT_FALSE(remaining_bucket_size > 0)) {
+    return Fail(DataLossError("End of data expected"));
+  }
+  first_buffer_indices.push_back(num_buffers);
   if (ABSL_PREDICT_FALSE(
-          !bucket_decompressors[bucket_index].VerifyEndAndClose())) {
-    return Fail(bucket_decompressors[bucket_index]);
+          !ParseBufferEncodings(context, header_reader, num_buffers))) {
+    return false;
+  }
+
+  // Buckets are independent, so they are decompressed concurrently. Failures
+  // are collected per bucket and reported afterwards from this thread.
+  std::vector<Chain> buffers(num_buffers);
+  std::vector<Status> bucket_statuses(num_buckets);
+  const auto decompress_buckets = [&](std::atomic<uint32_t>* next_bucket) {
+    const TraceScope trace("Decompress");
+    for (;;) {
+      const uint32_t index =
+          next_bucket->fetch_add(1, std::memory_order_relaxed);
+      if (index >= num_buckets) return;
+      internal::Decompressor<ChainReader<>> decompressor(
+          std::forward_as_tuple(&buckets[index]), context->compression_type,
+          context->zstd_dictionary);
+      if (ABSL_PREDICT_FALSE(!decompressor.healthy())) {
+        bucket_statuses[index] = decompressor.status();
+        continue;
+      }
+      for (uint32_t buffer_index = first_buffer_indices[index];
+           buffer_index < first_buffer_indices[index + 1]; ++buffer_index) {
+        if (ABSL_PREDICT_FALSE(!decompressor.reader()->Read(
+                &buffers[buffer_index], buffer_sizes[buffer_index]))) {
+          bucket_statuses[index] =
+              decompressor.reader()->healthy()
+                  ? DataLossError("Reading buffer failed")
+                  : decompressor.reader()->status();
+          break;
+        }
+        const EncodedBuffer* const encoded_buffer =
+            FindEncodedBuffer(context->encoded_buffers, buffer_index);
+        if (encoded_buffer != nullptr) {
+          Status status =
+              DecodeBuffer(*encoded_buffer, context->decoded_data_size,
+                           &buffers[buffer_index]);
+          if (ABSL_PREDICT_FALSE(!status.ok())) {
+            bucket_statuses[index] = std::move(status);
+            break;
+          }
+        }
+      }
+      if (ABSL_PREDICT_FALSE(!bucket_statuses[index].ok())) continue;
+      if (ABSL_PREDICT_FALSE(!decompressor.VerifyEndAndClose())) {
+        bucket_statuses[index] = decompressor.status();
+      }
+    }
+  };
+  std::atomic<uint32_t> next_bucket{0};
+  // With no compression there is nothing worth parallelizing.
+  const size_t num_helpers =
+      num_buckets <= 1 || context->compression_type == CompressionType::kNone
+          ? size_t{0}
+          : UnsignedMin(AvailableCpus(), size_t{num_buckets}) - 1;
+  if (num_helpers == 0) {
+    decompress_buckets(&next_bucket);
+  } else {
+    absl::BlockingCounter helpers_done(IntCast<int>(num_helpers));
+    for (size_t i = 0; i < num_helpers; ++i) {
+      ThreadPool::global().Schedule([&] {
+        decompress_buckets(&next_bucket);
+        helpers_done.DecrementCount();
+      });
+    }
+    decompress_buckets(&next_bucket);
+    helpers_done.Wait();
+  }
+  for (const Status& status : bucket_statuses) {
+    if (ABSL_PREDICT_FALSE(!status.ok())) return Fail(status);
+  }
+  context->buffers.reserve(num_buffers);
+  for (Chain& buffer : buffers) {
+    context->buffers.emplace_back(std::move(buffer));
   }
   return true;
 }
 
+inline bool TransposeDecoder::ReserveUncompressedSize(
+    Context* context, uint64_t uncompressed_size) {
+  if (ABSL_PREDICT_FALSE(uncompressed_size >
+                         context->remaining_uncompressed_size)) {
+    return Fail(ResourceExhaustedError(
+        "Uncompressed bucket sizes too large for the encoded size"));
+  }
+  context->remaining_uncompressed_size -= uncompressed_size;
+  return true;
+}
+
 inline bool TransposeDecoder::ParseBuffersForFitering(
     Context* context, Reader* header_reader, Reader* src,
     std::vector<uint32_t>* first_buffer_indices,
@@ -867,11 +1537,13 @@ inline bool TransposeDecoder::ParseBuffersForFitering(
     if (ABSL_PREDICT_FALSE(num_buffers != 0)) {
       return Fail(DataLossError("Too few buckets"));
     }
-    return true;
+    return ParseBufferEncodings(context, header_reader, 0);
   }
   first_buffer_indices->reserve(num_buckets);
   bucket_indices->reserve(num_buffers);
   context->buckets.reserve(num_buckets);
+  std::vector<uint64_t> uncompressed_bucket_sizes;
+  uncompressed_bucket_sizes.reserve(num_buckets);
   for (uint32_t bucket_index = 0; bucket_index < num_buckets; ++bucket_index) {
     uint64_t bucket_length;
     if (ABSL_PREDICT_FALSE(!ReadVarint64(header_reader, &bucket_length))) {
@@ -883,20 +1555,27 @@ inline bool TransposeDecoder::ParseBuffersForFitering(
       return Fail(ResourceExhaustedError("Bucket too large"));
     }
     context->buckets.emplace_back();
-    if (ABSL_PREDICT_FALSE(!src->Read(&context->buckets.back().compressed_data,
+    DataBucket& bucket = context->buckets.back();
+    if (ABSL_PREDICT_FALSE(!src->Read(&bucket.compressed_data,
                                       IntCast<size_t>(bucket_length)))) {
       return Fail(*src, DataLossError("Reading bucket failed"));
     }
+    uint64_t uncompressed_size;
+    if (ABSL_PREDICT_FALSE(!internal::UncompressedSize(
+            bucket.compressed_data, context->compression_type,
+            &uncompressed_size))) {
+      return Fail(DataLossError("Reading uncompressed size failed"));
+    }
+    if (ABSL_PREDICT_FALSE(!ReserveUncompressedSize(context,
+                                                    uncompressed_size))) {
+      return false;
+    }
+    uncompressed_bucket_sizes.push_back(uncompressed_size);
   }
 
   uint32_t bucket_index = 0;
-  uint64_t remaining_bucket_size = 0;
+  uint64_t remaining_bucket_size = uncompressed_bucket_sizes[0];
   first_buffer_indices->push_back(0);
-  if (ABSL_PREDICT_FALSE(!internal::UncompressedSize(
-          context->buckets[0].compressed_data, context->compression_type,
-          &remaining_bucket_size))) {
-    return Fail(DataLossError("Reading uncompressed size failed"));
-  }
   for (uint32_t buffer_index = 0; buffer_index < num_buffers; ++buffer_index) {
     uint64_t buffer_length;
     if (ABSL_PREDICT_FALSE(!ReadVarint64(header_reader, &buffer_length))) {
@@ -917,11 +1596,8 @@ inline bool TransposeDecoder::ParseBuffersForFitering(
     while (remaining_bucket_size == 0 && bucket_index + 1 < num_buckets) {
       ++bucket_index;
       first_buffer_indices->push_back(buffer_index + 1);
-      if (ABSL_PREDICT_FALSE(!internal::UncompressedSize(
-              context->buckets[bucket_index].compressed_data,
-              context->compression_type, &remaining_bucket_size))) {
-        return Fail(DataLossError("Reading uncompressed size failed"));
-      }
+      context->buckets[bucket_index].first_buffer_index = buffer_index + 1;
+      remaining_bucket_size = uncompressed_bucket_sizes[bucket_index];
     }
   }
   if (ABSL_PREDICT_FALSE(bucket_index + 1 < num_buckets)) {
@@ -930,6 +1606,60 @@ inline bool TransposeDecoder::ParseBuffersForFitering(
   if (ABSL_PREDICT_FALSE(remaining_bucket_size > 0)) {
     return Fail(DataLossError("End of data expected"));
   }
+  return ParseBufferEncodings(context, header_reader, num_buffers);
+}
+
+inline bool TransposeDecoder::ParseBufferEncodings(Context* context,
+                                                   Reader* header_reader,
+                                                   uint32_t num_buffers) {
+  if (!context->buffer_encodings) return true;
+  uint32_t num_encoded_buffers;
+  if (ABSL_PREDICT_FALSE(!ReadVarint32(header_reader, &num_encoded_buffers))) {
+    return Fail(*header_reader,
+                DataLossError("Reading number of encoded buffers failed"));
+  }
+  if (ABSL_PREDICT_FALSE(num_encoded_buffers > num_buffers)) {
+    return Fail(DataLossError("Too many encoded buffers"));
+  }
+  context->encoded_buffers.reserve(num_encoded_buffers);
+  for (uint32_t i = 0; i < num_encoded_buffers; ++i) {
+    uint32_t buffer_index;
+    uint8_t encoding_byte;
+    if (ABSL_PREDICT_FALSE(!ReadVarint32(header_reader, &buffer_index) ||
+                           !ReadByte(header_reader, &encoding_byte))) {
+      return Fail(*header_reader,
+                  DataLossError("Reading buffer encoding failed"));
+    }
+    if (ABSL_PREDICT_FALSE(buffer_index >= num_buffers)) {
+      return Fail(DataLossError("Encoded buffer index out of range"));
+    }
+    if (ABSL_PREDICT_FALSE(!context->encoded_buffers.empty() &&
+                           buffer_index <=
+                               context->encoded_buffers.back().buffer_index)) {
+      return Fail(DataLossError("Encoded buffer indices not increasing"));
+    }
+    const internal::BufferEncoding encoding =
+        static_cast<internal::BufferEncoding>(encoding_byte);
+    uint64_t base = 0;
+    switch (encoding) {
+      case internal::BufferEncoding::kDelta:
+      case internal::BufferEncoding::kZigZagDelta:
+      case internal::BufferEncoding::kDictionary:
+      case internal::BufferEncoding::kPackedVarints:
+        break;
+      case internal::BufferEncoding::kFrameOfReference:
+        if (ABSL_PREDICT_FALSE(!ReadVarint64(header_reader, &base))) {
+          return Fail(*header_reader,
+                      DataLossError("Reading encoding base failed"));
+        }
+        break;
+      default:
+        return Fail(DataLossError(absl::StrCat(
+            "Unknown buffer encoding: ", uint32_t{encoding_byte})));
+    }
+    context->encoded_buffers.push_back(
+        EncodedBuffer{buffer_index, encoding, base});
+  }
   return true;
 }
 
@@ -943,11 +1673,16 @@ inline Reader* TransposeDecoder::GetBuffer(Context* context,
                                              ? bucket.buffer_sizes.size()
                                              : bucket.buffers.size())
       << "Index within bucket out of range";
+  if (index_within_bucket < bucket.buffers.size()) {
+    return &bucket.buffers[index_within_bucket];
+  }
+  const TraceScope trace("Decompress");
   while (index_within_bucket >= bucket.buffers.size()) {
     if (bucket.buffers.empty()) {
       // This is the first buffer to be decompressed from this bucket.
       bucket.decompressor.Reset(std::forward_as_tuple(&bucket.compressed_data),
-                                context->compression_type);
+                                context->compression_type,
+                                context->zstd_dictionary);
       if (ABSL_PREDICT_FALSE(!bucket.decompressor.healthy())) {
         Fail(bucket.decompressor);
         return nullptr;
@@ -962,6 +1697,17 @@ inline Reader* TransposeDecoder::GetBuffer(Context* context,
            DataLossError("Reading buffer failed"));
       return nullptr;
     }
+    const EncodedBuffer* const encoded_buffer = FindEncodedBuffer(
+        context->encoded_buffers,
+        bucket.first_buffer_index + IntCast<uint32_t>(bucket.buffers.size()));
+    if (encoded_buffer != nullptr) {
+      Status status = DecodeBuffer(*encoded_buffer,
+                                   context->decoded_data_size, &buffer);
+      if (ABSL_PREDICT_FALSE(!status.ok())) {
+        Fail(std::move(status));
+        return nullptr;
+      }
+    }
     bucket.buffers.emplace_back(std::move(buffer));
     if (bucket.buffers.size() == bucket.buffer_sizes.size()) {
       // This was the last decompressed buffer from this bucket.
@@ -1018,9 +1764,7 @@ inline bool TransposeDecoder::ContainsImplicitLoop(
       return Fail(*node->buffer,                                      \
                   DataLossError("Reading varint field failed"));      \
     }                                                                 \
-    for (size_t i = 0; i < data_length - 1; ++i) {                    \
-      buffer[tag_length + i] |= 0x80;                                 \
-    }                                                                 \
+    SetVarintContinuationBits<data_length>(buffer + tag_length);      \
     std::memcpy(buffer, node->tag_data.data, tag_length);             \
   } while (false)
 
@@ -1095,8 +1839,10 @@ inline bool TransposeDecoder::Decode(Context* context, uint64_t num_records,
 
   Reader* const transitions_reader = context->transitions.reader();
   // Stack of all open sub-messages.
-  std::vector<SubmessageStackElement> submessage_stack;
+  std::vector<SubmessageStackElement>& submessage_stack =
+      context->submessage_stack;
   submessage_stack.reserve(16);
+  const size_t max_nesting_depth = resource_limits_.max_nesting_depth();
   // Number of following iteration that go directly to `node->next_node`
   // without reading transition byte.
   int num_iters = 0;
@@ -1156,6 +1902,11 @@ select_callback:
   goto * node->callback;
 
 skipped_submessage_end:
+  if (ABSL_PREDICT_FALSE(submessage_stack.size() +
+                             IntCast<size_t>(skipped_submessage_level) >=
+                         max_nesting_depth)) {
+    goto nesting_too_deep;
+  }
   ++skipped_submessage_level;
   goto do_transition;
 
@@ -1167,12 +1918,20 @@ skipped_submessage_start:
   goto do_transition;
 
 submessage_end:
+  if (ABSL_PREDICT_FALSE(submessage_stack.size() >= max_nesting_depth)) {
+    goto nesting_too_deep;
+  }
   submessage_stack.push_back({IntCast<size_t>(dest->pos()), node->tag_data});
   goto do_transition;
 
 failure:
   return Fail(DataLossError("Invalid node index"));
 
+nesting_too_deep:
+  return Fail(ResourceExhaustedError(
+      absl::StrCat("Submessages nested too deeply: more than ",
+                   max_nesting_depth)));
+
 submessage_start : {
   if (ABSL_PREDICT_FALSE(submessage_stack.empty())) {
     return Fail(DataLossError("Submessage stack underflow"));
@@ -1236,8 +1995,11 @@ submessage_start : {
   COPY_TAG_CALLBACK(tag_length);                                            \
   goto do_transition;                                                       \
   end_projection_group_##tag_length                                         \
-      : submessage_stack.push_back(                                         \
-            {IntCast<size_t>(dest->pos()), node->tag_data});                \
+      : if (ABSL_PREDICT_FALSE(submessage_stack.size() >=                   \
+                               max_nesting_depth)) {                        \
+    goto nesting_too_deep;                                                  \
+  }                                                                         \
+  submessage_stack.push_back({IntCast<size_t>(dest->pos()), node->tag_data}); \
   COPY_TAG_CALLBACK(tag_length);                                            \
   goto do_transition
 
@@ -1346,7 +2108,7 @@ ABSL_ATTRIBUTE_NOINLINE inline bool TransposeDecoder::SetCallbackType(
     }
   } else {
     FieldIncluded field_included = FieldIncluded::kNo;
-    uint32_t field_id = kInvalidPos;
+    uint32_t field_id = CompiledFieldProjection::kRootId;
     if (skipped_submessage_level == 0) {
       field_included = FieldIncluded::kExistenceOnly;
       for (const SubmessageStackElement& elem : submessage_stack) {
@@ -1356,18 +2118,18 @@ ABSL_ATTRIBUTE_NOINLINE inline bool TransposeDecoder::SetCallbackType(
                           &tag)) {
           RIEGELI_ASSERT_UNREACHABLE() << "Invalid tag";
         }
-        const absl::flat_hash_map<std::pair<uint32_t, uint32_t>,
-                                  Context::IncludedField>::const_iterator iter =
-            context->include_fields.find(std::make_pair(field_id, tag >> 3));
-        if (iter == context->include_fields.end()) {
+        const CompiledFieldProjection::IncludedField* const included_field =
+            context->field_projection->Find(field_id, tag >> 3);
+        if (included_field == nullptr) {
           field_included = FieldIncluded::kNo;
           break;
         }
-        if (iter->second.include_type == Context::IncludeType::kIncludeFully) {
+        if (included_field->include_type ==
+            CompiledFieldProjection::IncludeType::kIncludeFully) {
           field_included = FieldIncluded::kYes;
           break;
         }
-        field_id = iter->second.field_id;
+        field_id = included_field->field_id;
       }
     }
     // If tag is a `kStartGroup`, there are two options:
@@ -1376,7 +2138,7 @@ ABSL_ATTRIBUTE_NOINLINE inline bool TransposeDecoder::SetCallbackType(
     //    In this case `field_included` is already set to `kNo`.
     // 2. If `kEndGroup` was not skipped, then its tag is on the top of the
     //    `submessage_stack` and in that case we already checked its tag in
-    //    `include_fields` in the loop above.
+    //    the projection in the loop above.
     const bool start_group_tag =
         static_cast<internal::WireType>(node_template->tag & 7) ==
         internal::WireType::kStartGroup;
@@ -1387,16 +2149,15 @@ ABSL_ATTRIBUTE_NOINLINE inline bool TransposeDecoder::SetCallbackType(
                         &tag)) {
         RIEGELI_ASSERT_UNREACHABLE() << "Invalid tag";
       }
-      const absl::flat_hash_map<std::pair<uint32_t, uint32_t>,
-                                Context::IncludedField>::const_iterator iter =
-          context->include_fields.find(std::make_pair(field_id, tag >> 3));
-      if (iter == context->include_fields.end()) {
+      const CompiledFieldProjection::IncludedField* const included_field =
+          context->field_projection->Find(field_id, tag >> 3);
+      if (included_field == nullptr) {
         field_included = FieldIncluded::kNo;
-      } else {
-        if (iter->second.include_type == Context::IncludeType::kIncludeFully ||
-            iter->second.include_type == Context::IncludeType::kIncludeChild) {
-          field_included = FieldIncluded::kYes;
-        }
+      } else if (included_field->include_type ==
+                     CompiledFieldProjection::IncludeType::kIncludeFully ||
+                 included_field->include_type ==
+                     CompiledFieldProjection::IncludeType::kIncludeChild) {
+        field_included = FieldIncluded::kYes;
       }
     }
     if (node_template->bucket_index != kInvalidPos) {
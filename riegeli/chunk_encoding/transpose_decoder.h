@@ -18,12 +18,21 @@
 #include <stddef.h>
 #include <stdint.h>
 
+#include <limits>
+#include <memory>
+#include <string>
+#include <utility>
 #include <vector>
 
+#include "riegeli/base/base.h"
+#include "riegeli/base/chain.h"
+#include "riegeli/base/memory_estimator.h"
 #include "riegeli/base/object.h"
 #include "riegeli/bytes/backward_writer.h"
 #include "riegeli/bytes/reader.h"
 #include "riegeli/bytes/reader_utils.h"
+#include "riegeli/bytes/zstd_dictionary.h"
+#include "riegeli/chunk_encoding/compiled_field_projection.h"
 #include "riegeli/chunk_encoding/field_projection.h"
 #include "riegeli/chunk_encoding/transpose_internal.h"
 
@@ -35,17 +44,100 @@ enum class CallbackType : uint8_t;
 
 class TransposeDecoder : public Object {
  public:
+  // Bounds on resources spent on decoding a chunk, checked before the work
+  // they bound is done, so that decoding an untrusted chunk which would be
+  // expensive fails early with `absl::StatusCode::kResourceExhausted`.
+  class ResourceLimits {
+   public:
+    ResourceLimits() noexcept {}
+
+    // Sets the maximum number of nodes of the state machine.
+    //
+    // Default: `std::numeric_limits<uint32_t>::max()` (no limit)
+    ResourceLimits& set_max_state_machine_size(
+        uint32_t max_state_machine_size) & {
+      max_state_machine_size_ = max_state_machine_size;
+      return *this;
+    }
+    ResourceLimits&& set_max_state_machine_size(
+        uint32_t max_state_machine_size) && {
+      return std::move(set_max_state_machine_size(max_state_machine_size));
+    }
+    uint32_t max_state_machine_size() const { return max_state_machine_size_; }
+
+    // Sets the maximum depth of nested submessages in a record.
+    //
+    // Default: `std::numeric_limits<size_t>::max()` (no limit)
+    ResourceLimits& set_max_nesting_depth(size_t max_nesting_depth) & {
+      max_nesting_depth_ = max_nesting_depth;
+      return *this;
+    }
+    ResourceLimits&& set_max_nesting_depth(size_t max_nesting_depth) && {
+      return std::move(set_max_nesting_depth(max_nesting_depth));
+    }
+    size_t max_nesting_depth() const { return max_nesting_depth_; }
+
+    // Sets the maximum ratio of the decoded data size of the chunk, and of the
+    // total uncompressed size of its data buckets, to the size of its encoded
+    // data.
+    //
+    // This bounds the work of decompressing and decoding a chunk by the size
+    // of the chunk, because a hostile chunk can claim sizes much larger than
+    // it actually decodes to.
+    //
+    // The ratio is checked only if the source supports `Size()`, which is the
+    // case for chunks decoded by `ChunkDecoder`.
+    //
+    // Default: `std::numeric_limits<double>::infinity()` (no limit)
+    ResourceLimits& set_max_decoded_data_ratio(
+        double max_decoded_data_ratio) & {
+      RIEGELI_ASSERT_GE(max_decoded_data_ratio, 0.0)
+          << "Failed precondition of "
+             "TransposeDecoder::ResourceLimits::set_max_decoded_data_ratio(): "
+             "negative ratio";
+      max_decoded_data_ratio_ = max_decoded_data_ratio;
+      return *this;
+    }
+    ResourceLimits&& set_max_decoded_data_ratio(
+        double max_decoded_data_ratio) && {
+      return std::move(set_max_decoded_data_ratio(max_decoded_data_ratio));
+    }
+    double max_decoded_data_ratio() const { return max_decoded_data_ratio_; }
+
+   private:
+    uint32_t max_state_machine_size_ = std::numeric_limits<uint32_t>::max();
+    size_t max_nesting_depth_ = std::numeric_limits<size_t>::max();
+    double max_decoded_data_ratio_ = std::numeric_limits<double>::infinity();
+  };
+
   // Creates a closed `TransposeDecoder`.
-  TransposeDecoder() noexcept : Object(kInitiallyClosed) {}
+  TransposeDecoder() noexcept;
 
-  TransposeDecoder(const TransposeDecoder&) = delete;
-  TransposeDecoder& operator=(const TransposeDecoder&) = delete;
+  TransposeDecoder(TransposeDecoder&& that) noexcept;
+  TransposeDecoder& operator=(TransposeDecoder&& that) noexcept;
+
+  ~TransposeDecoder();
+
+  // Sets resource limits applied to chunks decoded afterwards.
+  void set_resource_limits(const ResourceLimits& resource_limits) {
+    resource_limits_ = resource_limits;
+  }
+  const ResourceLimits& resource_limits() const { return resource_limits_; }
 
   // Resets the `TransposeDecoder` and parses the chunk.
   //
+  // Storage of the state machine and of other decoding structures is kept
+  // between calls, so decoding consecutive chunks with the same
+  // `TransposeDecoder` avoids allocating them again for each chunk.
+  //
   // Writes concatenated record values to `*dest`. Sets `*limits` to sorted
   // record end positions.
   //
+  // `zstd_dictionary` is used if the chunk is compressed with Zstd.
+  //
+  // `field_projection` can be a `FieldProjection`, which is then compiled for
+  // this chunk. Compiling it once avoids repeating that for each chunk.
+  //
   // Precondition: `dest->pos() == 0`
   //
   // Return values:
@@ -53,9 +145,36 @@ class TransposeDecoder : public Object {
   //  * `false` - failure (`!healthy()`);
   //              if `!dest->healthy()` then the problem was at `*dest`
   bool Decode(Reader* src, uint64_t num_records, uint64_t decoded_data_size,
-              const FieldProjection& field_projection, BackwardWriter* dest,
+              const CompiledFieldProjection& field_projection,
+              const ZstdDictionary& zstd_dictionary, BackwardWriter* dest,
+              std::vector<size_t>* limits);
+
+  // Like `Decode()` above, but for a chunk of type
+  // `ChunkType::kTransposedWithSharedHeader` with its leading distance already
+  // read, whose state machine is stored in `shared_header`: the data of the
+  // `ChunkType::kSharedTransposeHeader` chunk it refers to.
+  //
+  // The state machine is parsed again only if `shared_header` differs from
+  // the one used most recently.
+  bool Decode(const Chain& shared_header, Reader* src, uint64_t num_records,
+              uint64_t decoded_data_size,
+              const CompiledFieldProjection& field_projection,
+              const ZstdDictionary& zstd_dictionary, BackwardWriter* dest,
               std::vector<size_t>* limits);
 
+  // Like `Decode()` above, but for a chunk of type
+  // `ChunkType::kTransposedWithBufferEncodings`, whose encoded data buffers
+  // are decoded before the state machine reads them.
+  bool DecodeWithBufferEncodings(
+      Reader* src, uint64_t num_records, uint64_t decoded_data_size,
+      const CompiledFieldProjection& field_projection,
+      const ZstdDictionary& zstd_dictionary, BackwardWriter* dest,
+      std::vector<size_t>* limits);
+
+  // Registers decoding structures kept between `Decode()` calls with
+  // `MemoryEstimator`.
+  void RegisterSubobjects(MemoryEstimator* memory_estimator) const;
+
  private:
   // Information about one proto tag.
   struct TagData {
@@ -122,16 +241,50 @@ class TransposeDecoder : public Object {
   static_assert(sizeof(StateMachineNode) == 3 * sizeof(void*) + 8,
                 "Unexpected padding in StateMachineNode.");
 
+  struct ParsedNode;
+  struct ParsedStateMachine;
   struct Context;
 
-  bool Parse(Context* context, Reader* src,
-             const FieldProjection& field_projection);
+  bool Decode(const Chain* shared_header, bool buffer_encodings, Reader* src,
+              uint64_t num_records, uint64_t decoded_data_size,
+              const CompiledFieldProjection& field_projection,
+              const ZstdDictionary& zstd_dictionary, BackwardWriter* dest,
+              std::vector<size_t>* limits);
+
+  // If `shared_header != nullptr`, the state machine is read from it instead
+  // of from the header of `*src`.
+  bool Parse(Context* context, const Chain* shared_header, Reader* src,
+             const CompiledFieldProjection& field_projection);
+
+  // Decompress the state machine from `shared_header` into
+  // `*state_machine_header`.
+  bool ReadSharedHeader(Context* context, const Chain& shared_header,
+                        std::string* state_machine_header);
+
+  // Parse the part of the header describing the state machine from
+  // `header_reader` into `*parsed_state_machine`.
+  bool ParseStateMachine(Reader* header_reader, bool projection_enabled,
+                         ParsedStateMachine* parsed_state_machine);
+
+  // Fill `context->state_machine_nodes` (and `context->node_templates` if
+  // `projection_enabled`) from `context->parsed_state_machine`, assigning
+  // buffers of the current chunk. If `buffer_slots != nullptr`, buffer indices
+  // of the state machine are slots mapped to buffers by `*buffer_slots`.
+  bool InstantiateStateMachine(
+      Context* context, bool projection_enabled, uint32_t num_buffers,
+      const std::vector<uint32_t>* buffer_slots,
+      const std::vector<uint32_t>& first_buffer_indices,
+      const std::vector<uint32_t>& bucket_indices);
 
   // Parse data buffers in `header_reader` and `src` into `context->buffers`.
   // This method is used when projection is disabled and all buffers are
   // initially decompressed.
   bool ParseBuffers(Context* context, Reader* header_reader, Reader* src);
 
+  // Accounts for a data bucket with `uncompressed_size` against
+  // `ResourceLimits::max_decoded_data_ratio()`.
+  bool ReserveUncompressedSize(Context* context, uint64_t uncompressed_size);
+
   // Parse data buffers in `header_reader` and `src` into `context->buckets`.
   // When projection is enabled, buckets are decompressed on demand.
   // `bucket_indices` contains bucket index for each buffer.
@@ -141,6 +294,11 @@ class TransposeDecoder : public Object {
                                std::vector<uint32_t>* first_buffer_indices,
                                std::vector<uint32_t>* bucket_indices);
 
+  // Parse encodings of buffers in `header_reader` into
+  // `context->encoded_buffers`, if `context->buffer_encodings`.
+  bool ParseBufferEncodings(Context* context, Reader* header_reader,
+                            uint32_t num_buffers);
+
   // Precondition: `projection_enabled`.
   Reader* GetBuffer(Context* context, uint32_t bucket_index,
                     uint32_t index_within_bucket);
@@ -157,6 +315,11 @@ class TransposeDecoder : public Object {
       Context* context, int skipped_submessage_level,
       const std::vector<SubmessageStackElement>& submessage_stack,
       StateMachineNode* node);
+
+  // Decoding structures reused between `Decode()` calls, or `nullptr` before
+  // the first `Decode()`.
+  std::unique_ptr<Context> context_;
+  ResourceLimits resource_limits_;
 };
 
 }  // namespace riegeli
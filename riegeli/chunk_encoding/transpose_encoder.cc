@@ -18,6 +18,8 @@
 #include <stdint.h>
 
 #include <algorithm>
+#include <atomic>
+#include <cstring>
 #include <iterator>
 #include <limits>
 #include <memory>
@@ -27,14 +29,20 @@
 #include <utility>
 #include <vector>
 
+#include "absl/base/config.h"
 #include "absl/base/optimization.h"
 #include "absl/container/flat_hash_map.h"
-#include "absl/container/inlined_vector.h"
 #include "absl/strings/string_view.h"
+#include "absl/synchronization/blocking_counter.h"
 #include "absl/types/optional.h"
+#include "absl/types/span.h"
+#include "google/protobuf/message_lite.h"
 #include "riegeli/base/base.h"
 #include "riegeli/base/canonical_errors.h"
 #include "riegeli/base/chain.h"
+#include "riegeli/base/memory_estimator.h"
+#include "riegeli/base/parallelism.h"
+#include "riegeli/base/port.h"
 #include "riegeli/base/status.h"
 #include "riegeli/bytes/backward_writer.h"
 #include "riegeli/bytes/backward_writer_utils.h"
@@ -42,15 +50,18 @@
 #include "riegeli/bytes/chain_reader.h"
 #include "riegeli/bytes/chain_writer.h"
 #include "riegeli/bytes/limiting_reader.h"
+#include "riegeli/bytes/message_serialize.h"
 #include "riegeli/bytes/reader.h"
 #include "riegeli/bytes/reader_utils.h"
 #include "riegeli/bytes/string_reader.h"
+#include "riegeli/bytes/string_writer.h"
 #include "riegeli/bytes/writer.h"
 #include "riegeli/bytes/writer_utils.h"
 #include "riegeli/chunk_encoding/chunk_encoder.h"
 #include "riegeli/chunk_encoding/compressor.h"
 #include "riegeli/chunk_encoding/compressor_options.h"
 #include "riegeli/chunk_encoding/constants.h"
+#include "riegeli/chunk_encoding/field_projection.h"
 #include "riegeli/chunk_encoding/transpose_internal.h"
 
 namespace riegeli {
@@ -65,6 +76,12 @@ static_assert(kMaxVarintInline < 0x80,
               "Only one byte is used to store inline varint and its value must "
               "concide with its varint encoding");
 
+// Number of subtypes of a node for which positions are kept in
+// `encoded_tag_pos_`. `kVarint` nodes use the most.
+constexpr size_t kNumSubtypes =
+    static_cast<size_t>(internal::Subtype::kVarintInline0) +
+    kMaxVarintInline + 1;
+
 // Maximum depth of the nested message we break into columns. Submessages with
 // deeper nesting are encoded as strings.
 constexpr int kMaxRecursionDepth = 100;
@@ -145,11 +162,113 @@ bool operator<(PriorityQueueEntry a, PriorityQueueEntry b) {
   return a.dest_index < b.dest_index;
 }
 
+// Copies a varint64 from `src` to `dest`, like `CopyVarint64()`, but finds
+// where it ends a machine word at a time instead of a byte at a time: the
+// first byte with the highest bit clear is located among 8 bytes at once.
+//
+// Bytes of `dest[]` after the copied value are unspecified.
+//
+// Returns the updated `dest` after the copied value, or `nullptr` on failure.
+inline char* CopyVarint64Scanning(Reader* src, uint64_t (&dest)[2]) {
+  static_assert(sizeof(dest) >= kMaxLengthVarint64,
+                "dest too small to hold a varint64");
+#if defined(ABSL_IS_LITTLE_ENDIAN) &&                  \
+    (RIEGELI_INTERNAL_HAS_BUILTIN(__builtin_ctzll) || \
+     RIEGELI_INTERNAL_IS_GCC_VERSION(3, 4))
+  if (ABSL_PREDICT_TRUE(src->available() >= sizeof(dest))) {
+    std::memcpy(dest, src->cursor(), sizeof(dest));
+    // Highest bits of bytes which end a varint.
+    uint64_t ends = ~dest[0] & uint64_t{0x8080808080808080};
+    size_t length;
+    if (ABSL_PREDICT_TRUE(ends != 0)) {
+      length = IntCast<size_t>(__builtin_ctzll(ends)) / 8 + 1;
+    } else {
+      ends = ~dest[1] & uint64_t{0x8080808080808080};
+      if (ABSL_PREDICT_FALSE(ends == 0)) return nullptr;
+      length =
+          sizeof(uint64_t) + IntCast<size_t>(__builtin_ctzll(ends)) / 8 + 1;
+      if (ABSL_PREDICT_FALSE(
+              length > kMaxLengthVarint64 ||
+              (length == kMaxLengthVarint64 &&
+               reinterpret_cast<const unsigned char*>(
+                   dest)[kMaxLengthVarint64 - 1] >=
+                   uint8_t{1} << (64 - (kMaxLengthVarint64 - 1) * 7)))) {
+        // The representation is longer than `kMaxLengthVarint64`
+        // or the represented value does not fit in `uint64_t`.
+        return nullptr;
+      }
+    }
+    src->set_cursor(src->cursor() + length);
+    return reinterpret_cast<char*>(dest) + length;
+  }
+#endif
+  return CopyVarint64(src, reinterpret_cast<char*>(dest));
+}
+
+// Chooses the shortest numeric `internal::BufferEncoding` of `values`, in the
+// order of the buffer, setting `*encoding` and `*base`. Returns the encoded
+// size, including the length of `*base` for
+// `internal::BufferEncoding::kFrameOfReference`.
+//
+// Precondition: `!values.empty()`
+size_t ChooseNumericEncoding(const std::vector<uint64_t>& values,
+                             internal::BufferEncoding* encoding,
+                             uint64_t* base) {
+  uint64_t min_value = values[0];
+  for (const uint64_t value : values) min_value = UnsignedMin(min_value, value);
+  size_t delta_size = LengthVarint64(values[0]);
+  size_t zigzag_delta_size = delta_size;
+  size_t frame_of_reference_size = LengthVarint64(min_value);
+  for (size_t i = 0; i < values.size(); ++i) {
+    if (i > 0) {
+      const uint64_t delta = values[i - 1] - values[i];
+      delta_size += LengthVarint64(delta);
+      zigzag_delta_size += LengthVarint64(internal::EncodeZigZag64(delta));
+    }
+    frame_of_reference_size += LengthVarint64(values[i] - min_value);
+  }
+  if (delta_size <= zigzag_delta_size &&
+      delta_size <= frame_of_reference_size) {
+    *encoding = internal::BufferEncoding::kDelta;
+    *base = 0;
+    return delta_size;
+  }
+  if (zigzag_delta_size <= frame_of_reference_size) {
+    *encoding = internal::BufferEncoding::kZigZagDelta;
+    *base = 0;
+    return zigzag_delta_size;
+  }
+  *encoding = internal::BufferEncoding::kFrameOfReference;
+  *base = min_value;
+  return frame_of_reference_size;
+}
+
+// Returns `values[index]` encoded with `encoding` and `base`.
+inline uint64_t EncodeNumericValue(const std::vector<uint64_t>& values,
+                                   size_t index,
+                                   internal::BufferEncoding encoding,
+                                   uint64_t base) {
+  switch (encoding) {
+    case internal::BufferEncoding::kDelta:
+      return index == 0 ? values[0] : values[index - 1] - values[index];
+    case internal::BufferEncoding::kZigZagDelta:
+      return index == 0 ? values[0]
+                        : internal::EncodeZigZag64(values[index - 1] -
+                                                   values[index]);
+    case internal::BufferEncoding::kFrameOfReference:
+      return values[index] - base;
+    default:
+      RIEGELI_ASSERT_UNREACHABLE()
+          << "Not a numeric encoding: " << static_cast<int>(encoding);
+  }
+}
+
 }  // namespace
 
-inline TransposeEncoder::MessageNode::MessageNode(
-    internal::MessageId message_id)
-    : message_id(message_id) {}
+#if __cplusplus < 201703
+constexpr uint32_t TransposeEncoder::kNoNode;
+constexpr int TransposeEncoder::kNodeCacheSizeLog2;
+#endif
 
 inline TransposeEncoder::NodeId::NodeId(internal::MessageId parent_message_id,
                                         uint32_t tag)
@@ -174,15 +293,30 @@ inline TransposeEncoder::EncodedTagInfo::EncodedTagInfo(
       public_list_noop_pos(kInvalidPos),
       base(kInvalidPos) {}
 
-inline TransposeEncoder::BufferWithMetadata::BufferWithMetadata(NodeId node_id)
-    : buffer(std::make_unique<Chain>()), node_id(node_id) {}
+inline TransposeEncoder::NodeBuffer::NodeBuffer() : writer(&buffer) {}
+
+inline TransposeEncoder::BufferWithMetadata::BufferWithMetadata(Chain* buffer,
+                                                                NodeId node_id)
+    : buffer(buffer), node_id(node_id) {}
+
+inline TransposeEncoder::Bucket::Bucket(size_t uncompressed_size)
+    : uncompressed_size(uncompressed_size) {}
 
-TransposeEncoder::TransposeEncoder(CompressorOptions options,
-                                   uint64_t bucket_size)
+TransposeEncoder::TransposeEncoder(
+    CompressorOptions options, uint64_t bucket_size, int bucket_parallelism,
+    bool numeric_encodings, bool string_dictionaries, bool packed_fields,
+    std::shared_ptr<const TransposeSchema> schema,
+    std::vector<FieldProjection> field_groups)
     : compressor_options_(std::move(options)),
       bucket_size_(options.compression_type() == CompressionType::kNone
                        ? std::numeric_limits<uint64_t>::max()
                        : bucket_size),
+      bucket_parallelism_(bucket_parallelism),
+      numeric_encodings_(numeric_encodings),
+      string_dictionaries_(string_dictionaries),
+      packed_fields_(packed_fields),
+      schema_(std::move(schema)),
+      field_groups_(std::move(field_groups)),
       nonproto_lengths_writer_(std::forward_as_tuple()) {}
 
 TransposeEncoder::~TransposeEncoder() {}
@@ -193,9 +327,41 @@ void TransposeEncoder::Clear() {
   encoded_tags_.clear();
   for (std::vector<BufferWithMetadata>& buffers : data_) buffers.clear();
   group_stack_.clear();
-  message_nodes_.clear();
+  node_indices_.clear();
+  ClearNodeCache();
+  node_ids_.clear();
+  node_writers_.clear();
+  encoded_tag_pos_.clear();
+  num_node_buffers_ = 0;
   nonproto_lengths_writer_.Reset(std::forward_as_tuple());
-  next_message_id_ = internal::MessageId::kRoot + 1;
+}
+
+bool TransposeEncoder::AddRecordWithCachedSize(
+    const google::protobuf::MessageLite& record, size_t size) {
+  if (ABSL_PREDICT_FALSE(!healthy())) return false;
+  if (size > kMaxBufferSize) {
+    // Avoid keeping a large scratch buffer.
+    return ChunkEncoder::AddRecordWithCachedSize(record, size);
+  }
+  // Serialize to a flat buffer reused across records, instead of to a `Chain`
+  // allocated for each record.
+  serialized_record_.clear();
+  StringWriter<> writer(&serialized_record_,
+                        StringWriterBase::Options().set_size_hint(size));
+  if (ABSL_PREDICT_FALSE(!writer.Push(size))) {
+    RIEGELI_ASSERT_UNREACHABLE()
+        << "Writing to a string failed: " << writer.status();
+  }
+  {
+    Status status =
+        internal::SerializeWithCachedSizesToWriter(record, size, &writer);
+    if (ABSL_PREDICT_FALSE(!status.ok())) return Fail(std::move(status));
+  }
+  if (ABSL_PREDICT_FALSE(!writer.Close())) {
+    RIEGELI_ASSERT_UNREACHABLE()
+        << "Writing to a string failed: " << writer.status();
+  }
+  return AddRecord(absl::string_view(serialized_record_));
 }
 
 bool TransposeEncoder::AddRecord(absl::string_view record) {
@@ -270,9 +436,10 @@ inline bool TransposeEncoder::AddRecordInternal(Reader* record) {
         GetNode(NodeId(internal::MessageId::kStartOfMessage, 0)),
         internal::Subtype::kTrivial));
     LimitingReader<> message(record);
-    return AddMessage(&message, internal::MessageId::kRoot, 0);
+    return AddMessage(&message, internal::MessageId::kRoot,
+                      schema_ == nullptr ? nullptr : schema_->root(), 0);
   } else {
-    Node* node = GetNode(NodeId(internal::MessageId::kNonProto, 0));
+    const uint32_t node = GetNode(NodeId(internal::MessageId::kNonProto, 0));
     encoded_tags_.push_back(
         GetPosInTagsList(node, internal::Subtype::kTrivial));
     BackwardWriter* const buffer = GetBuffer(node, BufferType::kNonProto);
@@ -287,63 +454,93 @@ inline bool TransposeEncoder::AddRecordInternal(Reader* record) {
   }
 }
 
-inline BackwardWriter* TransposeEncoder::GetBuffer(Node* node,
+inline BackwardWriter* TransposeEncoder::GetBuffer(uint32_t node,
                                                    BufferType type) {
-  if (!node->second.writer) {
-    std::vector<BufferWithMetadata>& buffers =
-        data_[static_cast<uint32_t>(type)];
-    buffers.emplace_back(node->first);
-    node->second.writer =
-        std::make_unique<ChainBackwardWriter<>>(buffers.back().buffer.get());
-  }
-  return node->second.writer.get();
+  BackwardWriter*& writer = node_writers_[node];
+  if (writer == nullptr) {
+    if (num_node_buffers_ == node_buffers_.size()) {
+      node_buffers_.push_back(std::make_unique<NodeBuffer>());
+    }
+    NodeBuffer& node_buffer = *node_buffers_[num_node_buffers_++];
+    node_buffer.buffer.Clear();
+    node_buffer.writer.Reset(&node_buffer.buffer);
+    data_[static_cast<uint32_t>(type)].emplace_back(&node_buffer.buffer,
+                                                    node_ids_[node]);
+    writer = &node_buffer.writer;
+  }
+  return writer;
 }
 
-inline uint32_t TransposeEncoder::GetPosInTagsList(Node* node,
+inline uint32_t TransposeEncoder::GetPosInTagsList(uint32_t node,
                                                    internal::Subtype subtype) {
-  size_t pos = static_cast<size_t>(subtype);
-  if (node->second.encoded_tag_pos.size() <= pos) {
-    node->second.encoded_tag_pos.resize(pos + 1,
-                                        std::numeric_limits<uint32_t>::max());
+  const size_t pos = static_cast<size_t>(subtype);
+  RIEGELI_ASSERT_LT(pos, kNumSubtypes)
+      << "Failed precondition of TransposeEncoder::GetPosInTagsList(): "
+         "subtype out of range";
+  uint32_t& ret = encoded_tag_pos_[size_t{node} * kNumSubtypes + pos];
+  if (ret == kInvalidPos) {
+    ret = IntCast<uint32_t>(tags_list_.size());
+    tags_list_.emplace_back(node_ids_[node], subtype);
   }
-  uint32_t* ret = &node->second.encoded_tag_pos[pos];
-  if (*ret == std::numeric_limits<uint32_t>::max()) {
-    *ret = tags_list_.size();
-    tags_list_.emplace_back(node->first, subtype);
-  }
-  return *ret;
+  return ret;
+}
+
+inline size_t TransposeEncoder::NodeCacheIndex(NodeId node_id) {
+  // Multiplicative hashing: the highest bits of the product depend on all bits
+  // of `NodeId`.
+  const uint32_t hash =
+      (static_cast<uint32_t>(node_id.parent_message_id) * uint32_t{0x9e3779b1} +
+       node_id.tag) *
+      uint32_t{0x9e3779b1};
+  return size_t{hash >> (32 - kNodeCacheSizeLog2)};
+}
+
+inline void TransposeEncoder::ClearNodeCache() {
+  for (NodeCacheEntry& entry : node_cache_) entry.node = kNoNode;
 }
 
-inline TransposeEncoder::Node* TransposeEncoder::GetNode(NodeId node_id) {
-  auto it = message_nodes_.find(node_id);
-  if (it == message_nodes_.end()) {
-    it = message_nodes_.emplace(node_id, next_message_id_).first;
-    ++next_message_id_;
+inline uint32_t TransposeEncoder::GetNode(NodeId node_id) {
+  NodeCacheEntry& cache_entry = node_cache_[NodeCacheIndex(node_id)];
+  if (ABSL_PREDICT_TRUE(cache_entry.node != kNoNode &&
+                        cache_entry.node_id == node_id)) {
+    return cache_entry.node;
   }
-  return &*it;
+  const std::pair<absl::flat_hash_map<NodeId, uint32_t>::iterator, bool>
+      insert_result =
+          node_indices_.emplace(node_id, IntCast<uint32_t>(node_ids_.size()));
+  if (insert_result.second) {
+    node_ids_.push_back(node_id);
+    node_writers_.push_back(nullptr);
+    encoded_tag_pos_.resize(encoded_tag_pos_.size() + kNumSubtypes,
+                            kInvalidPos);
+  }
+  cache_entry.node_id = node_id;
+  cache_entry.node = insert_result.first->second;
+  return insert_result.first->second;
+}
+
+inline internal::MessageId TransposeEncoder::MessageIdOfNode(uint32_t node) {
+  return internal::MessageId::kRoot + 1 + node;
 }
 
 // Precondition: `IsProtoMessage` returns `true` for this record.
 // Note: Encoded tags are appended into `encoded_tags_` but data is prepended
 // into respective buffers. `encoded_tags_` will be later traversed backwards.
-inline bool TransposeEncoder::AddMessage(LimitingReaderBase* record,
-                                         internal::MessageId parent_message_id,
-                                         int depth) {
+inline bool TransposeEncoder::AddMessage(
+    LimitingReaderBase* record, internal::MessageId parent_message_id,
+    const TransposeSchema::Message* schema, int depth) {
   while (record->Pull()) {
     uint32_t tag;
     if (!ReadVarint32(record, &tag)) {
       RIEGELI_ASSERT_UNREACHABLE() << "Invalid tag: " << record->status();
     }
-    Node* node = GetNode(NodeId(parent_message_id, tag));
+    const uint32_t node = GetNode(NodeId(parent_message_id, tag));
     switch (static_cast<internal::WireType>(tag & 7)) {
       case internal::WireType::kVarint: {
         // Storing value as `uint64_t[2]` instead of `uint8_t[10]` lets Clang
         // and GCC generate better code for clearing high bit of each byte.
         uint64_t value[2];
-        static_assert(sizeof(value) >= kMaxLengthVarint64,
-                      "value too small to hold a varint64");
-        char* const value_end =
-            CopyVarint64(record, reinterpret_cast<char*>(value));
+        char* const value_end = CopyVarint64Scanning(record, value);
         if (value_end == nullptr) {
           RIEGELI_ASSERT_UNREACHABLE()
               << "Invalid varint: " << record->status();
@@ -396,6 +593,7 @@ inline bool TransposeEncoder::AddMessage(LimitingReaderBase* record,
         // Non-toplevel empty strings are treated as strings, not messages.
         // They have a simpler encoding this way (one node instead of two).
         if (depth < kMaxRecursionDepth && length != 0 &&
+            (schema == nullptr || !schema->IsNonMessageField(tag >> 3)) &&
             IsProtoMessage(record)) {
           encoded_tags_.push_back(GetPosInTagsList(
               node, internal::Subtype::kLengthDelimitedStartOfSubmessage));
@@ -405,12 +603,12 @@ inline bool TransposeEncoder::AddMessage(LimitingReaderBase* record,
           }
           auto end_of_submessage_pos = GetPosInTagsList(
               node, internal::Subtype::kLengthDelimitedEndOfSubmessage);
-          if (ABSL_PREDICT_FALSE(
-                  !AddMessage(record, node->second.message_id, depth + 1))) {
+          if (ABSL_PREDICT_FALSE(!AddMessage(
+                  record, MessageIdOfNode(node),
+                  schema == nullptr ? nullptr : schema->MessageField(tag >> 3),
+                  depth + 1))) {
             return false;
           }
-          // Call to `AddMessage()` invalidates `node`.
-          node = nullptr;
           encoded_tags_.push_back(end_of_submessage_pos);
         } else {
           encoded_tags_.push_back(GetPosInTagsList(
@@ -429,12 +627,14 @@ inline bool TransposeEncoder::AddMessage(LimitingReaderBase* record,
       case internal::WireType::kStartGroup: {
         encoded_tags_.push_back(
             GetPosInTagsList(node, internal::Subtype::kTrivial));
-        group_stack_.push_back(parent_message_id);
+        group_stack_.push_back(OpenGroup{parent_message_id, schema});
         ++depth;
-        parent_message_id = node->second.message_id;
+        parent_message_id = MessageIdOfNode(node);
+        if (schema != nullptr) schema = schema->MessageField(tag >> 3);
       } break;
       case internal::WireType::kEndGroup:
-        parent_message_id = group_stack_.back();
+        parent_message_id = group_stack_.back().parent_message_id;
+        schema = group_stack_.back().schema;
         group_stack_.pop_back();
         --depth;
         // Note that `parent_message_id` was updated above so the `node` does
@@ -453,42 +653,421 @@ inline bool TransposeEncoder::AddMessage(LimitingReaderBase* record,
   return true;
 }
 
-inline bool TransposeEncoder::AddBuffer(
-    absl::optional<size_t> new_uncompressed_bucket_size, const Chain& buffer,
-    internal::Compressor* bucket_compressor, Writer* data_writer,
-    std::vector<size_t>* compressed_bucket_sizes,
-    std::vector<size_t>* buffer_sizes) {
-  buffer_sizes->push_back(buffer.size());
+inline void TransposeEncoder::AddBuffer(
+    absl::optional<size_t> new_uncompressed_bucket_size, Chain* buffer,
+    std::vector<Bucket>* buckets, std::vector<size_t>* buffer_sizes) {
+  buffer_sizes->push_back(buffer->size());
   if (new_uncompressed_bucket_size.has_value()) {
-    if (bucket_compressor->writer()->pos() > 0) {
-      const Position pos_before = data_writer->pos();
-      if (ABSL_PREDICT_FALSE(!bucket_compressor->EncodeAndClose(data_writer))) {
-        return Fail(*bucket_compressor);
-      }
-      RIEGELI_ASSERT_GE(data_writer->pos(), pos_before)
-          << "Data writer position decreased";
-      compressed_bucket_sizes->push_back(
-          IntCast<size_t>(data_writer->pos() - pos_before));
+    buckets->emplace_back(*new_uncompressed_bucket_size);
+  }
+  RIEGELI_ASSERT(!buckets->empty()) << "No bucket to add a buffer to";
+  buckets->back().buffers.push_back(buffer);
+}
+
+Status TransposeEncoder::CompressBucket(
+    const Bucket& bucket, internal::Compressor* bucket_compressor,
+    Chain* dest) {
+  bucket_compressor->Clear(internal::Compressor::TuningOptions().set_final_size(
+      bucket.uncompressed_size));
+  for (Chain* buffer : bucket.buffers) {
+    if (ABSL_PREDICT_FALSE(
+            !bucket_compressor->writer()->Write(std::move(*buffer)))) {
+      return bucket_compressor->status();
     }
-    bucket_compressor->Clear(
-        internal::Compressor::TuningOptions().set_final_size(
-            *new_uncompressed_bucket_size));
+    // Leave `*buffer` in a defined state instead of relying on the moved-from
+    // state of `Chain`.
+    *buffer = Chain();
   }
-  if (ABSL_PREDICT_FALSE(!bucket_compressor->writer()->Write(buffer))) {
-    return Fail(*bucket_compressor);
+  ChainWriter<> dest_writer(dest);
+  if (ABSL_PREDICT_FALSE(!bucket_compressor->EncodeAndClose(&dest_writer))) {
+    return bucket_compressor->status();
+  }
+  if (ABSL_PREDICT_FALSE(!dest_writer.Close())) return dest_writer.status();
+  return OkStatus();
+}
+
+inline bool TransposeEncoder::WriteBuckets(
+    const std::vector<Bucket>& buckets, Writer* data_writer,
+    std::vector<size_t>* compressed_bucket_sizes) {
+  std::vector<const Bucket*> nonempty_buckets;
+  nonempty_buckets.reserve(buckets.size());
+  for (const Bucket& bucket : buckets) {
+    if (bucket.uncompressed_size > 0) nonempty_buckets.push_back(&bucket);
+  }
+  compressed_bucket_sizes->reserve(nonempty_buckets.size());
+  std::vector<Chain> compressed_buckets(nonempty_buckets.size());
+  std::vector<Status> statuses(nonempty_buckets.size());
+  // Compresses buckets with indices taken from `*next_bucket` until all are
+  // taken. Buckets are independent, so this can run in several threads.
+  const auto compress_buckets = [&](std::atomic<size_t>* next_bucket) {
+    internal::Compressor bucket_compressor(compressor_options_);
+    for (;;) {
+      const size_t index =
+          next_bucket->fetch_add(1, std::memory_order_relaxed);
+      if (index >= nonempty_buckets.size()) return;
+      statuses[index] = CompressBucket(*nonempty_buckets[index],
+                                       &bucket_compressor,
+                                       &compressed_buckets[index]);
+    }
+  };
+  std::atomic<size_t> next_bucket{0};
+  const size_t num_helpers =
+      bucket_parallelism_ == 0 || nonempty_buckets.size() <= 1
+          ? size_t{0}
+          : UnsignedMin(IntCast<size_t>(bucket_parallelism_),
+                        nonempty_buckets.size()) -
+                1;
+  if (num_helpers == 0) {
+    compress_buckets(&next_bucket);
+  } else {
+    absl::BlockingCounter helpers_done(IntCast<int>(num_helpers));
+    for (size_t i = 0; i < num_helpers; ++i) {
+      ThreadPool::global().Schedule([&] {
+        compress_buckets(&next_bucket);
+        helpers_done.DecrementCount();
+      });
+    }
+    compress_buckets(&next_bucket);
+    helpers_done.Wait();
+  }
+  for (size_t index = 0; index < nonempty_buckets.size(); ++index) {
+    if (ABSL_PREDICT_FALSE(!statuses[index].ok())) {
+      return Fail(std::move(statuses[index]));
+    }
+    compressed_bucket_sizes->push_back(compressed_buckets[index].size());
+    if (ABSL_PREDICT_FALSE(
+            !data_writer->Write(std::move(compressed_buckets[index])))) {
+      return Fail(*data_writer);
+    }
   }
   return true;
 }
 
+void TransposeEncoder::EncodeNumericBuffers(
+    absl::flat_hash_map<NodeId, EncodedBufferInfo>* encodings) {
+  const std::vector<BufferWithMetadata>& buffers =
+      data_[static_cast<uint32_t>(BufferType::kVarint)];
+  if (buffers.empty()) return;
+  // Values of varint buffers.
+  struct BufferValues {
+    std::string data;
+    size_t cursor = 0;
+    std::vector<uint64_t> values;
+  };
+  std::vector<BufferValues> buffer_values(buffers.size());
+  std::vector<uint32_t> node_slots(node_ids_.size(), kNoNode);
+  for (size_t slot = 0; slot < buffers.size(); ++slot) {
+    const absl::flat_hash_map<NodeId, uint32_t>::const_iterator iter =
+        node_indices_.find(buffers[slot].node_id);
+    RIEGELI_ASSERT(iter != node_indices_.end()) << "Buffer of unknown node";
+    node_slots[iter->second] = IntCast<uint32_t>(slot);
+    buffer_values[slot].data = std::string(*buffers[slot].buffer);
+  }
+  std::vector<uint32_t> tag_slots(tags_list_.size(), kNoNode);
+  for (size_t tag_index = 0; tag_index < tags_list_.size(); ++tag_index) {
+    const EncodedTagInfo& tag_info = tags_list_[tag_index];
+    if (tag_info.subtype > internal::Subtype::kVarintMax) continue;
+    const absl::flat_hash_map<NodeId, uint32_t>::const_iterator iter =
+        node_indices_.find(tag_info.node_id);
+    if (iter != node_indices_.end()) {
+      tag_slots[tag_index] = node_slots[iter->second];
+    }
+  }
+  // Varints in a buffer are not delimited, their lengths come from subtypes.
+  // Buffers are written backwards, so they are in the reverse order of
+  // `encoded_tags_`. `IsProtoMessage()` accepts only canonical varints, so
+  // decoding restores the lengths from values.
+  for (std::vector<uint32_t>::const_reverse_iterator iter =
+           encoded_tags_.crbegin();
+       iter != encoded_tags_.crend(); ++iter) {
+    const uint32_t slot = tag_slots[*iter];
+    if (slot == kNoNode) continue;
+    BufferValues& values = buffer_values[slot];
+    const size_t length =
+        size_t{tags_list_[*iter].subtype - internal::Subtype::kVarint1} + 1;
+    RIEGELI_ASSERT_LE(length, values.data.size() - values.cursor)
+        << "Varint buffer shorter than its varints";
+    uint64_t value = 0;
+    for (size_t i = 0; i < length; ++i) {
+      value |= uint64_t{static_cast<unsigned char>(
+                   values.data[values.cursor + i])}
+               << (7 * i);
+    }
+    RIEGELI_ASSERT_EQ(LengthVarint64(value), length)
+        << "Non-canonical varint in a proto message";
+    values.cursor += length;
+    values.values.push_back(value);
+  }
+  for (size_t slot = 0; slot < buffers.size(); ++slot) {
+    const BufferValues& values = buffer_values[slot];
+    if (values.values.empty()) continue;
+    RIEGELI_ASSERT_EQ(values.cursor, values.data.size())
+        << "Varint buffer longer than its varints";
+    EncodedBufferInfo encoding;
+    const size_t encoded_size = ChooseNumericEncoding(
+        values.values, &encoding.encoding, &encoding.base);
+    if (encoded_size >= values.data.size()) continue;
+    Chain& buffer = *buffers[slot].buffer;
+    buffer.Clear();
+    ChainWriter<> writer(&buffer, ChainWriterBase::Options().set_size_hint(
+                                      encoded_size));
+    for (size_t i = 0; i < values.values.size(); ++i) {
+      if (ABSL_PREDICT_FALSE(!WriteVarint64(
+              &writer, EncodeNumericValue(values.values, i, encoding.encoding,
+                                          encoding.base)))) {
+        RIEGELI_ASSERT_UNREACHABLE()
+            << "Writing to a chain failed: " << writer.status();
+      }
+    }
+    if (ABSL_PREDICT_FALSE(!writer.Close())) {
+      RIEGELI_ASSERT_UNREACHABLE()
+          << "Writing to a chain failed: " << writer.status();
+    }
+    encodings->emplace(buffers[slot].node_id, encoding);
+  }
+}
+
+void TransposeEncoder::EncodePackedBuffers(
+    absl::flat_hash_map<NodeId, EncodedBufferInfo>* encodings) {
+  for (const BufferWithMetadata& buffer_with_metadata :
+       data_[static_cast<uint32_t>(BufferType::kString)]) {
+    Chain& buffer = *buffer_with_metadata.buffer;
+    const std::string data(buffer);
+    // For each string of the buffer, the number of its elements.
+    std::vector<uint32_t> counts;
+    // Elements of all strings, in the order of the buffer.
+    std::vector<uint64_t> elements;
+    const char* cursor = data.data();
+    const char* const limit = data.data() + data.size();
+    bool packed = true;
+    while (cursor != limit) {
+      uint32_t length;
+      if (ABSL_PREDICT_FALSE(!ReadVarint32(&cursor, limit, &length))) {
+        RIEGELI_ASSERT_UNREACHABLE() << "Invalid string length in a buffer";
+      }
+      RIEGELI_ASSERT_LE(length, PtrDistance(cursor, limit))
+          << "String buffer shorter than its strings";
+      const char* const string_limit = cursor + length;
+      uint32_t count = 0;
+      while (cursor != string_limit) {
+        const char* const element_begin = cursor;
+        uint64_t element;
+        // Decoding writes canonical varints, so only they can be restored.
+        if (!ReadVarint64(&cursor, string_limit, &element) ||
+            LengthVarint64(element) != PtrDistance(element_begin, cursor)) {
+          packed = false;
+          break;
+        }
+        elements.push_back(element);
+        ++count;
+      }
+      if (!packed) break;
+      counts.push_back(count);
+    }
+    if (!packed || elements.empty()) continue;
+    size_t counts_size = LengthVarint64(counts.size());
+    for (const uint32_t count : counts) counts_size += LengthVarint32(count);
+    size_t plain_size = 0;
+    for (const uint64_t element : elements) {
+      plain_size += LengthVarint64(element);
+    }
+    internal::BufferEncoding element_encoding;
+    uint64_t base;
+    size_t elements_size =
+        ChooseNumericEncoding(elements, &element_encoding, &base);
+    const bool numeric = elements_size < plain_size;
+    if (!numeric) elements_size = plain_size;
+    const size_t encoded_size = 1 + counts_size + elements_size;
+    if (encoded_size >= data.size()) continue;
+    buffer.Clear();
+    ChainWriter<> writer(&buffer, ChainWriterBase::Options().set_size_hint(
+                                      encoded_size));
+    if (ABSL_PREDICT_FALSE(
+            !WriteByte(&writer, numeric ? static_cast<uint8_t>(element_encoding)
+                                        : uint8_t{0}))) {
+      RIEGELI_ASSERT_UNREACHABLE()
+          << "Writing to a chain failed: " << writer.status();
+    }
+    if (numeric &&
+        element_encoding == internal::BufferEncoding::kFrameOfReference &&
+        ABSL_PREDICT_FALSE(!WriteVarint64(&writer, base))) {
+      RIEGELI_ASSERT_UNREACHABLE()
+          << "Writing to a chain failed: " << writer.status();
+    }
+    if (ABSL_PREDICT_FALSE(
+            !WriteVarint64(&writer, IntCast<uint64_t>(counts.size())))) {
+      RIEGELI_ASSERT_UNREACHABLE()
+          << "Writing to a chain failed: " << writer.status();
+    }
+    for (const uint32_t count : counts) {
+      if (ABSL_PREDICT_FALSE(!WriteVarint32(&writer, count))) {
+        RIEGELI_ASSERT_UNREACHABLE()
+            << "Writing to a chain failed: " << writer.status();
+      }
+    }
+    for (size_t i = 0; i < elements.size(); ++i) {
+      if (ABSL_PREDICT_FALSE(!WriteVarint64(
+              &writer, numeric ? EncodeNumericValue(elements, i,
+                                                    element_encoding, base)
+                               : elements[i]))) {
+        RIEGELI_ASSERT_UNREACHABLE()
+            << "Writing to a chain failed: " << writer.status();
+      }
+    }
+    if (ABSL_PREDICT_FALSE(!writer.Close())) {
+      RIEGELI_ASSERT_UNREACHABLE()
+          << "Writing to a chain failed: " << writer.status();
+    }
+    encodings->emplace(
+        buffer_with_metadata.node_id,
+        EncodedBufferInfo{internal::BufferEncoding::kPackedVarints, 0});
+  }
+}
+
+void TransposeEncoder::EncodeStringBuffers(
+    absl::flat_hash_map<NodeId, EncodedBufferInfo>* encodings) {
+  for (const BufferWithMetadata& buffer_with_metadata :
+       data_[static_cast<uint32_t>(BufferType::kString)]) {
+    // A buffer encoded by `EncodePackedBuffers()` is no longer a buffer of
+    // strings.
+    if (encodings->find(buffer_with_metadata.node_id) != encodings->end()) {
+      continue;
+    }
+    Chain& buffer = *buffer_with_metadata.buffer;
+    const std::string data(buffer);
+    // Distinct strings, each with its length, in the order of their first
+    // occurrence, with the number of their occurrences.
+    struct Entry {
+      absl::string_view value;
+      size_t count;
+    };
+    std::vector<Entry> entries;
+    absl::flat_hash_map<absl::string_view, uint32_t> entry_indices;
+    // For each string of the buffer, its index in `entries`.
+    std::vector<uint32_t> indices;
+    const char* cursor = data.data();
+    const char* const limit = data.data() + data.size();
+    while (cursor != limit) {
+      const char* const value_begin = cursor;
+      uint32_t length;
+      if (ABSL_PREDICT_FALSE(!ReadVarint32(&cursor, limit, &length))) {
+        RIEGELI_ASSERT_UNREACHABLE() << "Invalid string length in a buffer";
+      }
+      RIEGELI_ASSERT_LE(length, PtrDistance(cursor, limit))
+          << "String buffer shorter than its strings";
+      cursor += length;
+      const absl::string_view value(value_begin,
+                                    PtrDistance(value_begin, cursor));
+      uint32_t& entry_index =
+          entry_indices.emplace(value, kNoNode).first->second;
+      if (entry_index == kNoNode) {
+        entry_index = IntCast<uint32_t>(entries.size());
+        entries.push_back(Entry{value, 0});
+      }
+      ++entries[entry_index].count;
+      indices.push_back(entry_index);
+    }
+    // A dictionary is worth considering only if strings repeat on average.
+    if (entries.size() * 2 > indices.size()) continue;
+    // Give frequent strings small indices, which have short varints.
+    std::vector<uint32_t> order(entries.size());
+    for (uint32_t i = 0; i < order.size(); ++i) order[i] = i;
+    std::stable_sort(order.begin(), order.end(),
+                     [&](uint32_t a, uint32_t b) {
+                       return entries[a].count > entries[b].count;
+                     });
+    std::vector<uint32_t> renumbered(entries.size());
+    size_t encoded_size = LengthVarint32(IntCast<uint32_t>(entries.size()));
+    for (uint32_t i = 0; i < order.size(); ++i) {
+      const Entry& entry = entries[order[i]];
+      renumbered[order[i]] = i;
+      encoded_size += entry.value.size() + entry.count * LengthVarint32(i);
+    }
+    if (encoded_size >= data.size()) continue;
+    buffer.Clear();
+    ChainWriter<> writer(&buffer, ChainWriterBase::Options().set_size_hint(
+                                      encoded_size));
+    if (ABSL_PREDICT_FALSE(
+            !WriteVarint32(&writer, IntCast<uint32_t>(entries.size())))) {
+      RIEGELI_ASSERT_UNREACHABLE()
+          << "Writing to a chain failed: " << writer.status();
+    }
+    for (const uint32_t entry_index : order) {
+      if (ABSL_PREDICT_FALSE(!writer.Write(entries[entry_index].value))) {
+        RIEGELI_ASSERT_UNREACHABLE()
+            << "Writing to a chain failed: " << writer.status();
+      }
+    }
+    for (const uint32_t entry_index : indices) {
+      if (ABSL_PREDICT_FALSE(
+              !WriteVarint32(&writer, renumbered[entry_index]))) {
+        RIEGELI_ASSERT_UNREACHABLE()
+            << "Writing to a chain failed: " << writer.status();
+      }
+    }
+    if (ABSL_PREDICT_FALSE(!writer.Close())) {
+      RIEGELI_ASSERT_UNREACHABLE()
+          << "Writing to a chain failed: " << writer.status();
+    }
+    encodings->emplace(buffer_with_metadata.node_id,
+                       EncodedBufferInfo{internal::BufferEncoding::kDictionary,
+                                         0});
+  }
+}
+
+size_t TransposeEncoder::FieldGroupOfNode(NodeId node_id) const {
+  // Reconstruct the path of field numbers from the root message.
+  Field::Path path;
+  for (;;) {
+    if (node_id.parent_message_id < internal::MessageId::kRoot) {
+      // Non-proto records belong to no field.
+      return field_groups_.size();
+    }
+    path.push_back(node_id.tag >> 3);
+    if (node_id.parent_message_id == internal::MessageId::kRoot) break;
+    node_id = node_ids_[static_cast<uint32_t>(node_id.parent_message_id) -
+                        (static_cast<uint32_t>(internal::MessageId::kRoot) +
+                         1)];
+  }
+  std::reverse(path.begin(), path.end());
+  for (size_t group = 0; group < field_groups_.size(); ++group) {
+    for (const Field& field : field_groups_[group].fields()) {
+      size_t field_size = field.path().size();
+      if (field_size > 0 &&
+          field.path()[field_size - 1] == Field::kExistenceOnly) {
+        --field_size;
+      }
+      // The field is included if it is in the subtree of `field`, and it is
+      // needed to reach `field` if `field` is in its subtree.
+      if (std::equal(field.path().begin(),
+                     field.path().begin() +
+                         UnsignedMin(field_size, path.size()),
+                     path.begin())) {
+        return group;
+      }
+    }
+  }
+  return field_groups_.size();
+}
+
 inline bool TransposeEncoder::WriteBuffers(
     Writer* header_writer, Writer* data_writer,
+    const absl::flat_hash_map<NodeId, EncodedBufferInfo>* encodings,
     absl::flat_hash_map<NodeId, uint32_t>* buffer_pos) {
   size_t num_buffers = 0;
   for (std::vector<BufferWithMetadata>& buffers : data_) {
-    // Sort buffers by length, smallest to largest.
+    if (!field_groups_.empty()) {
+      for (BufferWithMetadata& buffer : buffers) {
+        buffer.field_group = FieldGroupOfNode(buffer.node_id);
+      }
+    }
+    // Sort buffers by field group, then by length, smallest to largest.
     std::sort(
         buffers.begin(), buffers.end(),
         [](const BufferWithMetadata& a, const BufferWithMetadata& b) {
+          if (a.field_group != b.field_group) {
+            return a.field_group < b.field_group;
+          }
           if (a.buffer->size() != b.buffer->size()) {
             return a.buffer->size() < b.buffer->size();
           }
@@ -499,94 +1078,97 @@ inline bool TransposeEncoder::WriteBuffers(
         });
     num_buffers += buffers.size();
   }
-  const Chain& nonproto_lengths = nonproto_lengths_writer_.dest();
+  Chain& nonproto_lengths = nonproto_lengths_writer_.dest();
   if (!nonproto_lengths.empty()) ++num_buffers;
 
   std::vector<size_t> compressed_bucket_sizes;
   std::vector<size_t> buffer_sizes;
   buffer_sizes.reserve(num_buffers);
 
-  internal::Compressor bucket_compressor(compressor_options_);
-  for (const std::vector<BufferWithMetadata>& buffers : data_) {
-    // Split data into buckets.
-    size_t remaining_buffers_size = 0;
-    for (const BufferWithMetadata& buffer : buffers) {
-      remaining_buffers_size += buffer.buffer->size();
-    }
-
-    std::vector<size_t> uncompressed_bucket_sizes;
-    size_t current_bucket_size = 0;
-    for (std::vector<BufferWithMetadata>::const_reverse_iterator iter =
-             buffers.crbegin();
-         iter != buffers.crend(); ++iter) {
-      const size_t current_buffer_size = iter->buffer->size();
-      if (current_bucket_size > 0 &&
-          current_bucket_size + current_buffer_size / 2 >= bucket_size_) {
-        uncompressed_bucket_sizes.push_back(current_bucket_size);
-        current_bucket_size = 0;
+  std::vector<Bucket> buckets;
+  for (const std::vector<BufferWithMetadata>& all_buffers : data_) {
+    std::vector<BufferWithMetadata>::const_iterator group_begin =
+        all_buffers.cbegin();
+    while (group_begin != all_buffers.cend()) {
+      const size_t field_group = group_begin->field_group;
+      const std::vector<BufferWithMetadata>::const_iterator group_end =
+          std::find_if(group_begin, all_buffers.cend(),
+                       [&](const BufferWithMetadata& buffer) {
+                         return buffer.field_group != field_group;
+                       });
+      // Buffers of one field group are split into buckets independently of
+      // other groups.
+      const absl::Span<const BufferWithMetadata> buffers(
+          &*group_begin, IntCast<size_t>(group_end - group_begin));
+      group_begin = group_end;
+
+      // Split data into buckets.
+      size_t remaining_buffers_size = 0;
+      for (const BufferWithMetadata& buffer : buffers) {
+        remaining_buffers_size += buffer.buffer->size();
       }
-      current_bucket_size += current_buffer_size;
-      remaining_buffers_size -= current_buffer_size;
-      if (remaining_buffers_size <= bucket_size_ / 2) {
-        current_bucket_size += remaining_buffers_size;
-        break;
+
+      std::vector<size_t> uncompressed_bucket_sizes;
+      size_t current_bucket_size = 0;
+      for (absl::Span<const BufferWithMetadata>::const_reverse_iterator iter =
+               buffers.crbegin();
+           iter != buffers.crend(); ++iter) {
+        const size_t current_buffer_size = iter->buffer->size();
+        if (current_bucket_size > 0 &&
+            current_bucket_size + current_buffer_size / 2 >= bucket_size_) {
+          uncompressed_bucket_sizes.push_back(current_bucket_size);
+          current_bucket_size = 0;
+        }
+        current_bucket_size += current_buffer_size;
+        remaining_buffers_size -= current_buffer_size;
+        if (remaining_buffers_size <= bucket_size_ / 2) {
+          current_bucket_size += remaining_buffers_size;
+          break;
+        }
+      }
+      if (current_bucket_size > 0) {
+        uncompressed_bucket_sizes.push_back(current_bucket_size);
       }
-    }
-    if (current_bucket_size > 0) {
-      uncompressed_bucket_sizes.push_back(current_bucket_size);
-    }
 
-    current_bucket_size = 0;
-    for (const BufferWithMetadata& buffer : buffers) {
-      absl::optional<size_t> new_uncompressed_bucket_size;
-      if (current_bucket_size == 0) {
-        RIEGELI_ASSERT(!uncompressed_bucket_sizes.empty())
+      current_bucket_size = 0;
+      for (const BufferWithMetadata& buffer : buffers) {
+        absl::optional<size_t> new_uncompressed_bucket_size;
+        if (current_bucket_size == 0) {
+          RIEGELI_ASSERT(!uncompressed_bucket_sizes.empty())
+              << "Bucket sizes and buffer sizes do not match";
+          current_bucket_size = uncompressed_bucket_sizes.back();
+          uncompressed_bucket_sizes.pop_back();
+          new_uncompressed_bucket_size = current_bucket_size;
+        }
+        RIEGELI_ASSERT_GE(current_bucket_size, buffer.buffer->size())
             << "Bucket sizes and buffer sizes do not match";
-        current_bucket_size = uncompressed_bucket_sizes.back();
-        uncompressed_bucket_sizes.pop_back();
-        new_uncompressed_bucket_size = current_bucket_size;
+        current_bucket_size -= buffer.buffer->size();
+        AddBuffer(new_uncompressed_bucket_size, buffer.buffer, &buckets,
+                  &buffer_sizes);
+        const std::pair<absl::flat_hash_map<NodeId, uint32_t>::iterator, bool>
+            insert_result = buffer_pos->emplace(
+                buffer.node_id, IntCast<uint32_t>(buffer_pos->size()));
+        RIEGELI_ASSERT(insert_result.second)
+            << "Field already has buffer assigned: "
+            << static_cast<uint32_t>(buffer.node_id.parent_message_id) << "/"
+            << buffer.node_id.tag;
       }
-      RIEGELI_ASSERT_GE(current_bucket_size, buffer.buffer->size())
+      RIEGELI_ASSERT(uncompressed_bucket_sizes.empty())
           << "Bucket sizes and buffer sizes do not match";
-      current_bucket_size -= buffer.buffer->size();
-      if (ABSL_PREDICT_FALSE(!AddBuffer(
-              new_uncompressed_bucket_size, *buffer.buffer, &bucket_compressor,
-              data_writer, &compressed_bucket_sizes, &buffer_sizes))) {
-        return false;
-      }
-      const std::pair<absl::flat_hash_map<NodeId, uint32_t>::iterator, bool>
-          insert_result = buffer_pos->emplace(
-              buffer.node_id, IntCast<uint32_t>(buffer_pos->size()));
-      RIEGELI_ASSERT(insert_result.second)
-          << "Field already has buffer assigned: "
-          << static_cast<uint32_t>(buffer.node_id.parent_message_id) << "/"
-          << buffer.node_id.tag;
-    }
-    RIEGELI_ASSERT(uncompressed_bucket_sizes.empty())
-        << "Bucket sizes and buffer sizes do not match";
-    RIEGELI_ASSERT_EQ(current_bucket_size, 0u)
-        << "Bucket sizes and buffer sizes do not match";
+      RIEGELI_ASSERT_EQ(current_bucket_size, 0u)
+          << "Bucket sizes and buffer sizes do not match";
+    }
   }
   if (!nonproto_lengths.empty()) {
     // `nonproto_lengths` is the last buffer if non-empty.
-    if (ABSL_PREDICT_FALSE(!AddBuffer(
-            nonproto_lengths.size(), nonproto_lengths, &bucket_compressor,
-            data_writer, &compressed_bucket_sizes, &buffer_sizes))) {
-      return false;
-    }
+    AddBuffer(nonproto_lengths.size(), &nonproto_lengths, &buckets,
+              &buffer_sizes);
     // Note: `nonproto_lengths` needs no `buffer_pos`.
   }
 
-  if (bucket_compressor.writer()->pos() > 0) {
-    // Last bucket.
-    const Position pos_before = data_writer->pos();
-    if (ABSL_PREDICT_FALSE(!bucket_compressor.EncodeAndClose(data_writer))) {
-      return Fail(bucket_compressor);
-    }
-    RIEGELI_ASSERT_GE(data_writer->pos(), pos_before)
-        << "Data writer position decreased";
-    compressed_bucket_sizes.push_back(
-        IntCast<size_t>(data_writer->pos() - pos_before));
+  if (ABSL_PREDICT_FALSE(
+          !WriteBuckets(buckets, data_writer, &compressed_bucket_sizes))) {
+    return false;
   }
 
   if (ABSL_PREDICT_FALSE(!WriteVarint32(
@@ -607,12 +1189,49 @@ inline bool TransposeEncoder::WriteBuffers(
       return Fail(*header_writer);
     }
   }
+  if (encodings != nullptr) {
+    std::vector<std::pair<uint32_t, EncodedBufferInfo>> encoded_buffers;
+    encoded_buffers.reserve(encodings->size());
+    for (const std::pair<const NodeId, EncodedBufferInfo>& entry :
+         *encodings) {
+      const absl::flat_hash_map<NodeId, uint32_t>::const_iterator iter =
+          buffer_pos->find(entry.first);
+      RIEGELI_ASSERT(iter != buffer_pos->end())
+          << "Encoded buffer not written";
+      encoded_buffers.emplace_back(iter->second, entry.second);
+    }
+    std::sort(encoded_buffers.begin(), encoded_buffers.end(),
+              [](const std::pair<uint32_t, EncodedBufferInfo>& a,
+                 const std::pair<uint32_t, EncodedBufferInfo>& b) {
+                return a.first < b.first;
+              });
+    if (ABSL_PREDICT_FALSE(!WriteVarint32(
+            header_writer, IntCast<uint32_t>(encoded_buffers.size())))) {
+      return Fail(*header_writer);
+    }
+    for (const std::pair<uint32_t, EncodedBufferInfo>& encoded_buffer :
+         encoded_buffers) {
+      if (ABSL_PREDICT_FALSE(
+              !WriteVarint32(header_writer, encoded_buffer.first) ||
+              !WriteByte(header_writer, static_cast<uint8_t>(
+                                            encoded_buffer.second.encoding)))) {
+        return Fail(*header_writer);
+      }
+      if (encoded_buffer.second.encoding ==
+              internal::BufferEncoding::kFrameOfReference &&
+          ABSL_PREDICT_FALSE(
+              !WriteVarint64(header_writer, encoded_buffer.second.base))) {
+        return Fail(*header_writer);
+      }
+    }
+  }
   return true;
 }
 
 inline bool TransposeEncoder::WriteStatesAndData(
     uint32_t max_transition, const std::vector<StateInfo>& state_machine,
-    Writer* header_writer, Writer* data_writer) {
+    const absl::flat_hash_map<NodeId, EncodedBufferInfo>* encodings,
+    Writer* header_writer, Writer* states_writer, Writer* data_writer) {
   if (!encoded_tags_.empty() &&
       tags_list_[encoded_tags_[0]].dest_info.size() == 1) {
     // There should be no implicit transition from the last state. If there was
@@ -628,7 +1247,7 @@ inline bool TransposeEncoder::WriteStatesAndData(
   }
   absl::flat_hash_map<NodeId, uint32_t> buffer_pos;
   if (ABSL_PREDICT_FALSE(
-          !WriteBuffers(header_writer, data_writer, &buffer_pos))) {
+          !WriteBuffers(header_writer, data_writer, encodings, &buffer_pos))) {
     return false;
   }
 
@@ -639,16 +1258,16 @@ inline bool TransposeEncoder::WriteStatesAndData(
   base_to_write.reserve(state_machine.size());
 
   if (ABSL_PREDICT_FALSE(!WriteVarint32(
-          header_writer, IntCast<uint32_t>(state_machine.size())))) {
-    return Fail(*header_writer);
+          states_writer, IntCast<uint32_t>(state_machine.size())))) {
+    return Fail(*states_writer);
   }
   for (const StateInfo state_info : state_machine) {
     if (state_info.etag_index == kInvalidPos) {
       // `kNoOp` state.
       if (ABSL_PREDICT_FALSE(!WriteVarint32(
-              header_writer,
+              states_writer,
               static_cast<uint32_t>(internal::MessageId::kNoOp)))) {
-        return Fail(*header_writer);
+        return Fail(*states_writer);
       }
       base_to_write.push_back(state_info.base);
       continue;
@@ -662,9 +1281,9 @@ inline bool TransposeEncoder::WriteStatesAndData(
       if (is_string &&
           subtype == internal::Subtype::kLengthDelimitedStartOfSubmessage) {
         if (ABSL_PREDICT_FALSE(!WriteVarint32(
-                header_writer, static_cast<uint32_t>(
+                states_writer, static_cast<uint32_t>(
                                    internal::MessageId::kStartOfSubmessage)))) {
-          return Fail(*header_writer);
+          return Fail(*states_writer);
         }
       } else if (is_string &&
                  subtype ==
@@ -672,14 +1291,14 @@ inline bool TransposeEncoder::WriteStatesAndData(
         // End of submessage is encoded as `WireType::kSubmessage` instead of
         // `WireType::kLengthDelimited`.
         if (ABSL_PREDICT_FALSE(!WriteVarint32(
-                header_writer,
+                states_writer,
                 node_id.tag + (internal::WireType::kSubmessage -
                                internal::WireType::kLengthDelimited)))) {
-          return Fail(*header_writer);
+          return Fail(*states_writer);
         }
       } else {
-        if (ABSL_PREDICT_FALSE(!WriteVarint32(header_writer, node_id.tag))) {
-          return Fail(*header_writer);
+        if (ABSL_PREDICT_FALSE(!WriteVarint32(states_writer, node_id.tag))) {
+          return Fail(*states_writer);
         }
         if (internal::HasSubtype(node_id.tag)) {
           subtype_to_write.push_back(static_cast<char>(subtype));
@@ -697,9 +1316,9 @@ inline bool TransposeEncoder::WriteStatesAndData(
     } else {
       // `kNonProto` and `kStartOfMessage` special IDs.
       if (ABSL_PREDICT_FALSE(!WriteVarint32(
-              header_writer,
+              states_writer,
               static_cast<uint32_t>(node_id.parent_message_id)))) {
-        return Fail(*header_writer);
+        return Fail(*states_writer);
       }
       if (node_id.parent_message_id == internal::MessageId::kNonProto) {
         // `kNonProto` has data buffer.
@@ -728,17 +1347,40 @@ inline bool TransposeEncoder::WriteStatesAndData(
     }
   }
   for (const uint32_t value : base_to_write) {
-    if (ABSL_PREDICT_FALSE(!WriteVarint32(header_writer, value))) {
-      return Fail(*header_writer);
+    if (ABSL_PREDICT_FALSE(!WriteVarint32(states_writer, value))) {
+      return Fail(*states_writer);
     }
   }
-  if (ABSL_PREDICT_FALSE(!header_writer->Write(std::move(subtype_to_write)))) {
-    return Fail(*header_writer);
+  if (ABSL_PREDICT_FALSE(!states_writer->Write(std::move(subtype_to_write)))) {
+    return Fail(*states_writer);
   }
-  for (const uint32_t value : buffer_index_to_write) {
-    if (ABSL_PREDICT_FALSE(!WriteVarint32(header_writer, value))) {
+  if (states_writer != header_writer) {
+    // Replace buffer indices with slots numbered in the order of their first
+    // use, and write the buffers of slots to `header_writer`.
+    std::vector<uint32_t> buffer_slots(buffer_pos.size(), kInvalidPos);
+    std::vector<uint32_t> slot_buffers;
+    for (uint32_t& value : buffer_index_to_write) {
+      uint32_t& slot = buffer_slots[value];
+      if (slot == kInvalidPos) {
+        slot = IntCast<uint32_t>(slot_buffers.size());
+        slot_buffers.push_back(value);
+      }
+      value = slot;
+    }
+    if (ABSL_PREDICT_FALSE(!WriteVarint32(
+            header_writer, IntCast<uint32_t>(slot_buffers.size())))) {
       return Fail(*header_writer);
     }
+    for (const uint32_t value : slot_buffers) {
+      if (ABSL_PREDICT_FALSE(!WriteVarint32(header_writer, value))) {
+        return Fail(*header_writer);
+      }
+    }
+  }
+  for (const uint32_t value : buffer_index_to_write) {
+    if (ABSL_PREDICT_FALSE(!WriteVarint32(states_writer, value))) {
+      return Fail(*states_writer);
+    }
   }
 
   // Find the smallest index that has first tag.
@@ -750,8 +1392,8 @@ inline bool TransposeEncoder::WriteStatesAndData(
       ++first_tag_pos;
     }
   }
-  if (ABSL_PREDICT_FALSE(!WriteVarint32(header_writer, first_tag_pos))) {
-    return Fail(*header_writer);
+  if (ABSL_PREDICT_FALSE(!WriteVarint32(states_writer, first_tag_pos))) {
+    return Fail(*states_writer);
   }
 
   internal::Compressor transitions_compressor(compressor_options_);
@@ -1286,32 +1928,53 @@ constexpr uint32_t kMinCountForState = 10;
 bool TransposeEncoder::EncodeAndClose(Writer* dest, ChunkType* chunk_type,
                                       uint64_t* num_records,
                                       uint64_t* decoded_data_size) {
-  *chunk_type = ChunkType::kTransposed;
+  bool buffers_encoded = false;
+  if (ABSL_PREDICT_FALSE(!EncodeAndCloseInternal(
+          kMaxTransition, kMinCountForState, dest, nullptr, nullptr,
+          numeric_encodings_ || string_dictionaries_ || packed_fields_
+              ? &buffers_encoded
+              : nullptr,
+          num_records, decoded_data_size))) {
+    return false;
+  }
+  *chunk_type = buffers_encoded ? ChunkType::kTransposedWithBufferEncodings
+                                : ChunkType::kTransposed;
+  return true;
+}
+
+bool TransposeEncoder::EncodeAndCloseWithSharedHeader(
+    Writer* dest, std::string* state_machine, Chain* shared_header,
+    uint64_t* num_records, uint64_t* decoded_data_size) {
   return EncodeAndCloseInternal(kMaxTransition, kMinCountForState, dest,
+                                RIEGELI_ASSERT_NOTNULL(state_machine),
+                                RIEGELI_ASSERT_NOTNULL(shared_header), nullptr,
                                 num_records, decoded_data_size);
 }
 
-bool TransposeEncoder::EncodeAndCloseInternal(uint32_t max_transition,
-                                              uint32_t min_count_for_state,
-                                              Writer* dest,
-                                              uint64_t* num_records,
-                                              uint64_t* decoded_data_size) {
+bool TransposeEncoder::EncodeAndCloseInternal(
+    uint32_t max_transition, uint32_t min_count_for_state, Writer* dest,
+    std::string* state_machine, Chain* shared_header, bool* buffers_encoded,
+    uint64_t* num_records, uint64_t* decoded_data_size) {
   RIEGELI_ASSERT_LE(max_transition, 63u)
       << "Failed precondition of TransposeEncoder::EncodeAndCloseInternal(): "
          "maximum transition too large to encode";
   if (ABSL_PREDICT_FALSE(!healthy())) return false;
   *num_records = num_records_;
   *decoded_data_size = decoded_data_size_;
-  for (const std::pair<const NodeId, MessageNode>& entry : message_nodes_) {
-    if (entry.second.writer != nullptr) {
-      if (ABSL_PREDICT_FALSE(!entry.second.writer->Close())) {
-        return Fail(*entry.second.writer);
-      }
-    }
+  for (size_t i = 0; i < num_node_buffers_; ++i) {
+    BackwardWriter& writer = node_buffers_[i]->writer;
+    if (ABSL_PREDICT_FALSE(!writer.Close())) return Fail(writer);
   }
   if (ABSL_PREDICT_FALSE(!nonproto_lengths_writer_.Close())) {
     return Fail(nonproto_lengths_writer_);
   }
+  absl::flat_hash_map<NodeId, EncodedBufferInfo> encodings;
+  if (buffers_encoded != nullptr) {
+    if (numeric_encodings_) EncodeNumericBuffers(&encodings);
+    if (packed_fields_) EncodePackedBuffers(&encodings);
+    if (string_dictionaries_) EncodeStringBuffers(&encodings);
+    *buffers_encoded = !encodings.empty();
+  }
 
   if (ABSL_PREDICT_FALSE(!WriteByte(
           dest,
@@ -1319,17 +1982,50 @@ bool TransposeEncoder::EncodeAndCloseInternal(uint32_t max_transition,
     return Fail(*dest);
   }
 
-  const std::vector<StateInfo> state_machine =
+  const std::vector<StateInfo> states =
       CreateStateMachine(max_transition, min_count_for_state);
 
   ChainWriter<Chain> header_writer(std::forward_as_tuple());
   ChainWriter<Chain> data_writer(std::forward_as_tuple());
-  if (ABSL_PREDICT_FALSE(!WriteStatesAndData(max_transition, state_machine,
-                                             &header_writer, &data_writer))) {
+  StringWriter<std::string> states_writer(std::forward_as_tuple());
+  if (ABSL_PREDICT_FALSE(!WriteStatesAndData(
+          max_transition, states,
+          encodings.empty() ? nullptr : &encodings, &header_writer,
+          state_machine == nullptr ? static_cast<Writer*>(&header_writer)
+                                   : &states_writer,
+          &data_writer))) {
     return false;
   }
   if (ABSL_PREDICT_FALSE(!header_writer.Close())) return Fail(header_writer);
   if (ABSL_PREDICT_FALSE(!data_writer.Close())) return Fail(data_writer);
+  if (state_machine != nullptr) {
+    if (ABSL_PREDICT_FALSE(!states_writer.Close())) return Fail(states_writer);
+    shared_header->Clear();
+    if (states_writer.dest() != *state_machine) {
+      *state_machine = std::move(states_writer.dest());
+      ChainWriter<> shared_header_writer(shared_header);
+      internal::Compressor states_compressor(
+          compressor_options_,
+          internal::Compressor::TuningOptions().set_final_size(
+              state_machine->size()));
+      if (ABSL_PREDICT_FALSE(!WriteByte(
+              &shared_header_writer,
+              static_cast<uint8_t>(compressor_options_.compression_type())))) {
+        return Fail(shared_header_writer);
+      }
+      if (ABSL_PREDICT_FALSE(
+              !states_compressor.writer()->Write(*state_machine))) {
+        return Fail(*states_compressor.writer());
+      }
+      if (ABSL_PREDICT_FALSE(
+              !states_compressor.EncodeAndClose(&shared_header_writer))) {
+        return Fail(states_compressor);
+      }
+      if (ABSL_PREDICT_FALSE(!shared_header_writer.Close())) {
+        return Fail(shared_header_writer);
+      }
+    }
+  }
 
   ChainWriter<Chain> compressed_header_writer(std::forward_as_tuple());
   internal::Compressor header_compressor(
@@ -1358,4 +2054,72 @@ bool TransposeEncoder::EncodeAndCloseInternal(uint32_t max_transition,
   return Close();
 }
 
+uint64_t TransposeEncoder::ApproximateEncodedSize() const {
+  // Data buffers hold record values without tags, and transitions take about
+  // one byte per tag, so together they take about `decoded_data_size_`. The
+  // header takes a few bytes per state and per buffer.
+  static constexpr uint64_t kBytesPerState = 4;
+  static constexpr uint64_t kBytesPerBuffer = 3;
+  return SaturatingAdd(
+      decoded_data_size_,
+      nonproto_lengths_writer_.pos() +
+          IntCast<uint64_t>(tags_list_.size()) * kBytesPerState +
+          IntCast<uint64_t>(num_node_buffers_) * kBytesPerBuffer);
+}
+
+size_t TransposeEncoder::ApproximateMemory() const {
+  // Like `RegisterUnique()`, but sizes are counted instead of capacities, and
+  // data buffers are assumed to hold about `decoded_data_size_` in total, and
+  // at least `kMinBufferSize` each, which dominates for records with many
+  // fields. Structures filled only when the chunk is encoded are not included.
+  return sizeof(*this) +
+         IntCast<size_t>(UnsignedMin(
+             decoded_data_size_,
+             uint64_t{std::numeric_limits<size_t>::max()})) +
+         tags_list_.size() * sizeof(EncodedTagInfo) +
+         encoded_tags_.size() * sizeof(uint32_t) +
+         node_indices_.size() *
+             (sizeof(decltype(node_indices_)::value_type) + 1) +
+         node_ids_.size() * (sizeof(NodeId) + sizeof(BackwardWriter*)) +
+         encoded_tag_pos_.size() * sizeof(uint32_t) +
+         num_node_buffers_ * (sizeof(NodeBuffer) + kMinBufferSize);
+}
+
+void TransposeEncoder::RegisterUnique(
+    MemoryEstimator* memory_estimator) const {
+  memory_estimator->RegisterDynamicMemory(sizeof(*this));
+  memory_estimator->RegisterDynamicMemory(tags_list_.capacity() *
+                                          sizeof(EncodedTagInfo));
+  for (const EncodedTagInfo& tag_info : tags_list_) {
+    memory_estimator->RegisterDynamicMemory(
+        tag_info.dest_info.bucket_count() *
+        (sizeof(decltype(tag_info.dest_info)::value_type) + 1));
+  }
+  memory_estimator->RegisterDynamicMemory(encoded_tags_.capacity() *
+                                          sizeof(uint32_t));
+  for (const std::vector<BufferWithMetadata>& buffers : data_) {
+    memory_estimator->RegisterDynamicMemory(buffers.capacity() *
+                                            sizeof(BufferWithMetadata));
+  }
+  memory_estimator->RegisterDynamicMemory(group_stack_.capacity() *
+                                          sizeof(OpenGroup));
+  memory_estimator->RegisterDynamicMemory(
+      node_indices_.bucket_count() *
+      (sizeof(decltype(node_indices_)::value_type) + 1));
+  memory_estimator->RegisterDynamicMemory(node_ids_.capacity() *
+                                          sizeof(NodeId));
+  memory_estimator->RegisterDynamicMemory(node_writers_.capacity() *
+                                          sizeof(BackwardWriter*));
+  memory_estimator->RegisterDynamicMemory(encoded_tag_pos_.capacity() *
+                                          sizeof(uint32_t));
+  memory_estimator->RegisterDynamicMemory(node_buffers_.capacity() *
+                                          sizeof(std::unique_ptr<NodeBuffer>));
+  for (const std::unique_ptr<NodeBuffer>& node_buffer : node_buffers_) {
+    memory_estimator->RegisterDynamicMemory(sizeof(NodeBuffer));
+    node_buffer->buffer.RegisterSubobjects(memory_estimator);
+  }
+  nonproto_lengths_writer_.dest().RegisterSubobjects(memory_estimator);
+  memory_estimator->RegisterDynamicMemory(serialized_record_.capacity() + 1);
+}
+
 }  // namespace riegeli
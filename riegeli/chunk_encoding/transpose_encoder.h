@@ -18,16 +18,20 @@
 #include <stddef.h>
 #include <stdint.h>
 
+#include <array>
+#include <limits>
 #include <memory>
 #include <string>
 #include <utility>
 #include <vector>
 
 #include "absl/container/flat_hash_map.h"
-#include "absl/container/inlined_vector.h"
 #include "absl/strings/string_view.h"
 #include "absl/types/optional.h"
+#include "google/protobuf/message_lite.h"
 #include "riegeli/base/chain.h"
+#include "riegeli/base/memory_estimator.h"
+#include "riegeli/base/status.h"
 #include "riegeli/bytes/backward_writer.h"
 #include "riegeli/bytes/chain_backward_writer.h"
 #include "riegeli/bytes/writer.h"
@@ -35,7 +39,9 @@
 #include "riegeli/chunk_encoding/compressor.h"
 #include "riegeli/chunk_encoding/compressor_options.h"
 #include "riegeli/chunk_encoding/constants.h"
+#include "riegeli/chunk_encoding/field_projection.h"
 #include "riegeli/chunk_encoding/transpose_internal.h"
+#include "riegeli/chunk_encoding/transpose_schema.h"
 
 namespace riegeli {
 
@@ -64,10 +70,75 @@ class Reader;
 //      - Concatenated data buffers in this bucket (bytes)
 //  - Transitions (possibly compressed):
 //    - State machine transitions (bytes)
+//
+// A chunk of type `ChunkType::kTransposedWithSharedHeader` has the same format,
+// except that:
+//  - It starts with the distance from the beginning of the
+//    `ChunkType::kSharedTransposeHeader` chunk it refers to, to the beginning
+//    of this chunk
+//  - The header contains, instead of the state machine:
+//    - Number of buffer slots [`num_slots`]
+//    - Array of `num_slots` varints: data buffer indices of slots
+//
+// A chunk of type `ChunkType::kSharedTransposeHeader` contains:
+//  - Compression type (byte)
+//  - State machine (possibly compressed), as in the header above, except that
+//    data buffer indices stored there are buffer slot indices, which the chunk
+//    referring to this state machine maps to its data buffer indices
+//
+// A chunk of type `ChunkType::kTransposedWithBufferEncodings` has the same
+// format as `ChunkType::kTransposed`, except that the header contains, after
+// lengths of buffers:
+//  - Number of encoded buffers [`num_encoded_buffers`]
+//  - `num_encoded_buffers` times:
+//    - Data buffer index, increasing
+//    - `internal::BufferEncoding` (byte)
+//    - Base, only for `internal::BufferEncoding::kFrameOfReference`
+//
+// The contents of an encoded buffer are described for
+// `internal::BufferEncoding`.
 class TransposeEncoder : public ChunkEncoder {
  public:
   // Creates an empty `TransposeEncoder`.
-  explicit TransposeEncoder(CompressorOptions options, uint64_t bucket_size);
+  //
+  // If `bucket_parallelism > 0`, up to `bucket_parallelism` buckets of a chunk
+  // are compressed concurrently in background threads. This reduces the
+  // latency of encoding a single large chunk split into many buckets.
+  //
+  // If `numeric_encodings` is `true`, `EncodeAndClose()` stores each varint
+  // buffer with the `internal::BufferEncoding` which makes it the shortest,
+  // if any makes it shorter. The chunk type is then
+  // `ChunkType::kTransposedWithBufferEncodings` if some buffer is encoded.
+  //
+  // If `string_dictionaries` is `true`, `EncodeAndClose()` stores each buffer
+  // of strings whose strings repeat on average as
+  // `internal::BufferEncoding::kDictionary`, if this makes it shorter, with
+  // the same effect on the chunk type.
+  //
+  // If `packed_fields` is `true`, `EncodeAndClose()` stores each buffer of
+  // strings which all consist of canonical varints, e.g. values of a packed
+  // repeated integer field, as `internal::BufferEncoding::kPackedVarints`, if
+  // this makes it shorter, with the same effect on the chunk type. This takes
+  // precedence over `string_dictionaries`.
+  //
+  // If `schema != nullptr`, length-delimited fields which `*schema` declares
+  // not to be messages are stored as strings without checking whether they
+  // parse as messages. This makes encoding faster, especially of large binary
+  // values, and keeps e.g. bytes fields which happen to parse as messages from
+  // being split into columns. This does not change the chunk format.
+  //
+  // If `field_groups` are not empty, buffers of fields included in different
+  // groups are never compressed in the same bucket, and neither are buffers
+  // of fields included in a group and buffers of other fields. Reading with a
+  // field projection covering one group then decompresses only buckets of
+  // that group. A field included in several groups belongs to the first one.
+  // This does not change the chunk format.
+  explicit TransposeEncoder(
+      CompressorOptions options, uint64_t bucket_size,
+      int bucket_parallelism = 0, bool numeric_encodings = false,
+      bool string_dictionaries = false, bool packed_fields = false,
+      std::shared_ptr<const TransposeSchema> schema = nullptr,
+      std::vector<FieldProjection> field_groups = {});
 
   ~TransposeEncoder();
 
@@ -81,21 +152,52 @@ class TransposeEncoder : public ChunkEncoder {
   bool AddRecord(absl::string_view record) override;
   bool AddRecord(std::string&& record) override;
   bool AddRecord(const Chain& record) override;
+  bool AddRecordWithCachedSize(const google::protobuf::MessageLite& record,
+                               size_t size) override;
 
+  using ChunkEncoder::AddRecords;
   bool AddRecords(Chain records, std::vector<size_t> limits) override;
 
   bool EncodeAndClose(Writer* dest, ChunkType* chunk_type,
                       uint64_t* num_records,
                       uint64_t* decoded_data_size) override;
 
+  // Like `EncodeAndClose()` with `*chunk_type` being
+  // `ChunkType::kTransposedWithSharedHeader`, but the state machine is stored
+  // separately, so that consecutive chunks with the same state machine can
+  // share it.
+  //
+  // `*state_machine` is the state machine of the previous chunk encoded this
+  // way, or empty before the first chunk. If the state machine of this chunk
+  // is different, `*state_machine` is set to it and `*shared_header` is set to
+  // the data of a `ChunkType::kSharedTransposeHeader` chunk to write before
+  // this chunk. Otherwise `*shared_header` is cleared, and this chunk can refer
+  // to the previous shared header chunk.
+  //
+  // Data written to `*dest` must be preceded by the varint encoded distance
+  // from the beginning of the shared header chunk to the beginning of this
+  // chunk to form the data of this chunk.
+  bool EncodeAndCloseWithSharedHeader(Writer* dest, std::string* state_machine,
+                                      Chain* shared_header,
+                                      uint64_t* num_records,
+                                      uint64_t* decoded_data_size);
+
+  uint64_t ApproximateEncodedSize() const override;
+  size_t ApproximateMemory() const override;
+  void RegisterUnique(MemoryEstimator* memory_estimator) const override;
+
  private:
   bool AddRecordInternal(Reader* record);
 
   // Encode messages added with `AddRecord()` calls and write the result to
-  // `*dest`.
+  // `*dest`. If `state_machine != nullptr`, the state machine is stored
+  // separately as described for `EncodeAndCloseWithSharedHeader()`. If
+  // `buffers_encoded != nullptr`, data buffers may be encoded, and
+  // `*buffers_encoded` is set to whether some buffer was encoded.
   bool EncodeAndCloseInternal(uint32_t max_transition,
                               uint32_t min_count_for_state, Writer* dest,
-                              uint64_t* num_records,
+                              std::string* state_machine, Chain* shared_header,
+                              bool* buffers_encoded, uint64_t* num_records,
                               uint64_t* decoded_data_size);
 
   // Types of data buffers protocol buffer fields are split into.
@@ -119,19 +221,6 @@ class TransposeEncoder : public ChunkEncoder {
   static constexpr size_t kNumBufferTypes =
       static_cast<size_t>(BufferType::kNumBufferTypes);
 
-  // Information about a field with unique proto path.
-  struct MessageNode {
-    explicit MessageNode(internal::MessageId message_id);
-    // Some nodes (such as `kStartGroup`) contain no data. Buffer is assigned in
-    // the first `GetBuffer()` call when we have data to write.
-    std::unique_ptr<BackwardWriter> writer;
-    // Unique ID for every instance of this class within `TransposeEncoder`.
-    internal::MessageId message_id;
-    // Position of encoded tag in `tags_list_` per subtype.
-    // Size 14 works well with `kMaxVarintInline == 3`.
-    absl::InlinedVector<uint32_t, 14> encoded_tag_pos;
-  };
-
   // We build a tree structure of protocol buffer tags. `NodeId` uniquely
   // identifies a node in this tree.
   struct NodeId {
@@ -153,15 +242,59 @@ class TransposeEncoder : public ChunkEncoder {
   // Add message recursively to the internal data structures.
   // Precondition: `message` is a valid proto message, i.e. `IsProtoMessage()`
   // on this message returns `true`.
-  // `depth` is the recursion depth.
+  // `depth` is the recursion depth. `schema` is the type of the message, or
+  // `nullptr` if unknown.
   bool AddMessage(LimitingReaderBase* record,
-                  internal::MessageId parent_message_id, int depth);
+                  internal::MessageId parent_message_id,
+                  const TransposeSchema::Message* schema, int depth);
+
+  // A group being added by `AddMessage()`.
+  struct OpenGroup {
+    // `parent_message_id` of the message containing the group.
+    internal::MessageId parent_message_id;
+    // `schema` of the message containing the group.
+    const TransposeSchema::Message* schema;
+  };
+
+  // The encoding of a data buffer chosen by `EncodeNumericBuffers()`,
+  // `EncodePackedBuffers()`, or `EncodeStringBuffers()`.
+  struct EncodedBufferInfo {
+    internal::BufferEncoding encoding;
+    // The base of `internal::BufferEncoding::kFrameOfReference`, otherwise 0.
+    uint64_t base;
+  };
+
+  // Choose the shortest `internal::BufferEncoding` of each varint buffer in
+  // `data_`, and replace buffers for which it is shorter than the buffer with
+  // their encoded form, filling `*encodings`.
+  void EncodeNumericBuffers(
+      absl::flat_hash_map<NodeId, EncodedBufferInfo>* encodings);
+
+  // Replace buffers of strings in `data_` which all consist of canonical
+  // varints with their `internal::BufferEncoding::kPackedVarints` form, if it
+  // is shorter, filling `*encodings`.
+  void EncodePackedBuffers(
+      absl::flat_hash_map<NodeId, EncodedBufferInfo>* encodings);
+
+  // Replace buffers of strings in `data_` whose strings repeat on average,
+  // except for buffers already in `*encodings`, with their
+  // `internal::BufferEncoding::kDictionary` form, if it is shorter, filling
+  // `*encodings`.
+  void EncodeStringBuffers(
+      absl::flat_hash_map<NodeId, EncodedBufferInfo>* encodings);
+
+  // Returns the index in `field_groups_` of the first group including the
+  // field of the node with `node_id`, or `field_groups_.size()` if none.
+  size_t FieldGroupOfNode(NodeId node_id) const;
 
   // Write all buffer lengths to `header_writer` and data buffers in `data_` to
   // `data_writer` (compressed using `compressor_`). Fill map with the
-  // sequential position of each buffer written.
-  bool WriteBuffers(Writer* header_writer, Writer* data_writer,
-                    absl::flat_hash_map<NodeId, uint32_t>* buffer_pos);
+  // sequential position of each buffer written. If `encodings != nullptr`,
+  // write encodings of buffers after their lengths.
+  bool WriteBuffers(
+      Writer* header_writer, Writer* data_writer,
+      const absl::flat_hash_map<NodeId, EncodedBufferInfo>* encodings,
+      absl::flat_hash_map<NodeId, uint32_t>* buffer_pos);
 
   // One state of the state machine created in encoder.
   struct StateInfo {
@@ -180,15 +313,33 @@ class TransposeEncoder : public ChunkEncoder {
     uint32_t canonical_source;
   };
 
-  // Add `buffer` to `bucket_compressor->writer()`.
-  // If `new_uncompressed_bucket_size` is not `absl::nullopt`, flush the current
-  // bucket to `data_writer` first and create a new bucket of that size.
-  bool AddBuffer(absl::optional<size_t> new_uncompressed_bucket_size,
-                 const Chain& buffer, internal::Compressor* bucket_compressor,
-                 Writer* data_writer,
-                 std::vector<size_t>* compressed_bucket_sizes,
+  // Data buffers compressed together.
+  struct Bucket {
+    explicit Bucket(size_t uncompressed_size);
+    size_t uncompressed_size;
+    // Buffers are moved to the compressor when the bucket is compressed, so
+    // that their memory is released before the compressed chunk is complete.
+    std::vector<Chain*> buffers;
+  };
+
+  // Add `buffer` to the last bucket in `*buckets`.
+  // If `new_uncompressed_bucket_size` is not `absl::nullopt`, create a new
+  // bucket of that size first.
+  void AddBuffer(absl::optional<size_t> new_uncompressed_bucket_size,
+                 Chain* buffer, std::vector<Bucket>* buckets,
                  std::vector<size_t>* buffer_sizes);
 
+  // Compress `bucket` using `bucket_compressor` and write the result to
+  // `*dest`. Leaves buffers of `bucket` empty.
+  static Status CompressBucket(const Bucket& bucket,
+                               internal::Compressor* bucket_compressor,
+                               Chain* dest);
+
+  // Compress non-empty `buckets` (concurrently if `bucket_parallelism_ > 0`)
+  // and write them to `data_writer`, filling `compressed_bucket_sizes`.
+  bool WriteBuckets(const std::vector<Bucket>& buckets, Writer* data_writer,
+                    std::vector<size_t>* compressed_bucket_sizes);
+
   // Compute base indices for states in `state_machine` that don't have one yet.
   // `public_list_base` is the index of the start of the public list.
   // `public_list_noops` is the list of `kNoOp` states that don't have a base
@@ -206,11 +357,20 @@ class TransposeEncoder : public ChunkEncoder {
   std::vector<StateInfo> CreateStateMachine(uint32_t max_transition,
                                             uint32_t min_count_for_state);
 
-  // Write state machine states into `header_writer` and all data buffers and
-  // transitions into `data_writer` (compressed using `compressor_`).
-  bool WriteStatesAndData(uint32_t max_transition,
-                          const std::vector<StateInfo>& state_machine,
-                          Writer* header_writer, Writer* data_writer);
+  // Write buffer lengths into `header_writer`, state machine states into
+  // `states_writer`, and all data buffers and transitions into `data_writer`
+  // (compressed using `compressor_`).
+  //
+  // If `states_writer != header_writer`, states refer to buffer slots instead
+  // of buffers, so that they do not depend on the order of buffers, and the
+  // buffers of slots are written into `header_writer`.
+  //
+  // If `encodings != nullptr`, encodings of buffers are written as described
+  // for `ChunkType::kTransposedWithBufferEncodings`.
+  bool WriteStatesAndData(
+      uint32_t max_transition, const std::vector<StateInfo>& state_machine,
+      const absl::flat_hash_map<NodeId, EncodedBufferInfo>* encodings,
+      Writer* header_writer, Writer* states_writer, Writer* data_writer);
 
   // Write all state machine transitions from `encoded_tags_` into
   // `compressor_.writer()`.
@@ -218,19 +378,40 @@ class TransposeEncoder : public ChunkEncoder {
                         const std::vector<StateInfo>& state_machine,
                         Writer* transitions_writer);
 
-  // Value type of node in Nodes map.
-  using Node = absl::flat_hash_map<NodeId, MessageNode>::value_type;
+  // Marks an empty entry of `node_cache_`.
+  static constexpr uint32_t kNoNode = std::numeric_limits<uint32_t>::max();
+
+  // Returns the index of the node with `node_id` in per-node arrays, adding
+  // the node if not present yet.
+  uint32_t GetNode(NodeId node_id);
+
+  // Returns the unique message ID of the node with index `node`, which is the
+  // parent message ID of its children.
+  static internal::MessageId MessageIdOfNode(uint32_t node);
 
-  // Returns node pointer from `node_id`.
-  Node* GetNode(NodeId node_id);
+  // Entry of `node_cache_`.
+  struct NodeCacheEntry {
+    NodeId node_id = NodeId(internal::MessageId::kNoOp, 0);
+    // Node index, or `kNoNode` for an empty entry.
+    uint32_t node = kNoNode;
+  };
+
+  // Size of `node_cache_` is `size_t{1} << kNodeCacheSizeLog2`.
+  static constexpr int kNodeCacheSizeLog2 = 8;
+
+  // Returns the index of the entry of `node_cache_` for `node_id`.
+  static size_t NodeCacheIndex(NodeId node_id);
+
+  // Empties `node_cache_` when node indices are reassigned.
+  void ClearNodeCache();
 
   // Get possition of the (`node`, `subtype`) pair in `tags_list_`, adding it
   // if not in the list yet.
-  uint32_t GetPosInTagsList(Node* node, internal::Subtype subtype);
+  uint32_t GetPosInTagsList(uint32_t node, internal::Subtype subtype);
 
   // Get `BackwardWriter` for node. `type` is used to select the right category
   // for the buffer if not created yet.
-  BackwardWriter* GetBuffer(Node* node, BufferType type);
+  BackwardWriter* GetBuffer(uint32_t node, BufferType type);
 
   // Information about the state machine transition destination.
   struct DestInfo {
@@ -265,14 +446,26 @@ class TransposeEncoder : public ChunkEncoder {
     uint32_t base;
   };
 
+  // Data buffer of a node together with the writer prepending to it.
+  //
+  // Some nodes (such as `kStartGroup`) contain no data. Buffer is assigned in
+  // the first `GetBuffer()` call when we have data to write.
+  struct NodeBuffer {
+    NodeBuffer();
+    Chain buffer;
+    ChainBackwardWriter<> writer;
+  };
+
   // Information about the data buffer.
   struct BufferWithMetadata {
-    explicit BufferWithMetadata(NodeId node_id);
-    // Buffer itself, wrapped in `std::unique_ptr` so that its address remains
-    // constant when additional buffers are added.
-    std::unique_ptr<Chain> buffer;
+    explicit BufferWithMetadata(Chain* buffer, NodeId node_id);
+    // Buffer itself, owned by `node_buffers_`.
+    Chain* buffer;
     // `NodeId` this buffer belongs to.
     NodeId node_id;
+    // Index in `field_groups_` of the group of the field, or
+    // `field_groups_.size()` if none. Set by `WriteBuffers()`.
+    size_t field_group = 0;
   };
 
   CompressorOptions compressor_options_;
@@ -280,6 +473,22 @@ class TransposeEncoder : public ChunkEncoder {
   // Finer bucket granularity (i.e. smaller size) worsens compression density
   // but makes field projection more effective.
   uint64_t bucket_size_;
+  // The maximum number of buckets compressed concurrently, or 0 to compress
+  // them in the calling thread.
+  int bucket_parallelism_;
+  // If `true`, varint buffers may be stored with an
+  // `internal::BufferEncoding`.
+  bool numeric_encodings_;
+  // If `true`, buffers of strings may be stored with
+  // `internal::BufferEncoding::kDictionary`.
+  bool string_dictionaries_;
+  // If `true`, buffers of packed varints may be stored with
+  // `internal::BufferEncoding::kPackedVarints`.
+  bool packed_fields_;
+  // Types of fields of records, or `nullptr` if unknown.
+  std::shared_ptr<const TransposeSchema> schema_;
+  // Groups of fields whose buffers are kept in separate buckets.
+  std::vector<FieldProjection> field_groups_;
 
   // List of all distinct Encoded tags.
   std::vector<EncodedTagInfo> tags_list_;
@@ -289,12 +498,31 @@ class TransposeEncoder : public ChunkEncoder {
   std::vector<BufferWithMetadata> data_[kNumBufferTypes];
   // Every group creates a new message ID. We keep track of open groups in this
   // vector.
-  std::vector<internal::MessageId> group_stack_;
-  // Tree of message nodes.
-  absl::flat_hash_map<NodeId, MessageNode> message_nodes_;
+  std::vector<OpenGroup> group_stack_;
+  // Tree of message nodes, mapping `NodeId` to the node index in per-node
+  // arrays below. Nodes are numbered densely in the order of their creation.
+  absl::flat_hash_map<NodeId, uint32_t> node_indices_;
+  // Direct-mapped cache of `node_indices_` lookups performed by `GetNode()`.
+  // The same fields tend to repeat in consecutive records, so most lookups
+  // avoid hashing `NodeId` and probing `node_indices_`.
+  std::array<NodeCacheEntry, size_t{1} << kNodeCacheSizeLog2> node_cache_;
+  // Per-node arrays, indexed by node index.
+  //
+  // `NodeId` of each node.
+  std::vector<NodeId> node_ids_;
+  // Writer of the data buffer of each node, or `nullptr` if not assigned yet.
+  std::vector<BackwardWriter*> node_writers_;
+  // Position of encoded tag in `tags_list_` of each node per subtype, or
+  // `kInvalidPos` if absent, with a fixed number of subtypes per node.
+  std::vector<uint32_t> encoded_tag_pos_;
+  // Data buffers assigned to nodes. They are kept across chunks to avoid
+  // reallocating them; the first `num_node_buffers_` are in use.
+  std::vector<std::unique_ptr<NodeBuffer>> node_buffers_;
+  size_t num_node_buffers_ = 0;
   ChainBackwardWriter<Chain> nonproto_lengths_writer_;
-  // Counter used to assign unique IDs to the message nodes.
-  internal::MessageId next_message_id_ = internal::MessageId::kRoot + 1;
+  // Scratch buffer reused by `AddRecord(google::protobuf::MessageLite)` for
+  // serialized messages up to `kMaxBufferSize`.
+  std::string serialized_record_;
 };
 
 }  // namespace riegeli
@@ -90,6 +90,59 @@ inline uint8_t operator-(Subtype a, Subtype b) {
   return static_cast<uint8_t>(a) - static_cast<uint8_t>(b);
 }
 
+// Encoding of a data buffer in a chunk of type
+// `ChunkType::kTransposedWithBufferEncodings`.
+//
+// Numeric encodings apply to a buffer of varints without continuation bits.
+// The buffer of `n` values `w[0..n)`, in the order of the buffer, i.e. the
+// reverse order of records, stores `n` varints `e[0..n)` with continuation
+// bits, where arithmetic is modulo 2^64:
+//
+//  * `kDelta`            - `e[0] = w[0]`, `e[i] = w[i - 1] - w[i]`
+//  * `kZigZagDelta`      - like `kDelta`, but differences are ZigZag encoded
+//  * `kFrameOfReference` - `e[i] = w[i] - base`, with `base` stored in the
+//                          header
+//
+// `kDelta` suits values nondecreasing across records, `kZigZagDelta` values
+// close to their neighbors, and `kFrameOfReference` values in a narrow range.
+// Varints of transposed messages are canonical, so decoding restores the varint
+// lengths implied by subtypes.
+//
+// The remaining encodings apply to a buffer of strings, i.e. of
+// length-delimited values not transposed as submessages, each preceded by its
+// length as a varint.
+//
+// `kDictionary` stores the number of distinct strings `d` (varint), the `d`
+// distinct strings, each preceded by its length (varint), and then for each
+// string of the original buffer, in its order, the index of the string among
+// distinct strings (varint). It suits fields with few distinct values, e.g.
+// enumerations stored as strings.
+//
+// `kPackedVarints` applies if each string consists of canonical varints, e.g.
+// values of a packed repeated integer field. It stores the encoding of
+// elements (byte), which is 0 for no encoding or a numeric encoding, the base
+// of `kFrameOfReference` (varint, only for `kFrameOfReference`), the number of
+// strings (varint), for each string the number of its elements (varint), and
+// then all elements in the order of the buffer (varints), with the numeric
+// encoding applied to the whole sequence of elements.
+//
+// These values are frozen in the file format.
+enum class BufferEncoding : uint8_t {
+  kDelta = 1,
+  kZigZagDelta = 2,
+  kFrameOfReference = 3,
+  kDictionary = 4,
+  kPackedVarints = 5,
+};
+
+inline uint64_t EncodeZigZag64(uint64_t value) {
+  return (value << 1) ^ (uint64_t{0} - (value >> 63));
+}
+
+inline uint64_t DecodeZigZag64(uint64_t value) {
+  return (value >> 1) ^ (uint64_t{0} - (value & 1));
+}
+
 // Returns whether `tag`/`subtype` pair has a data buffer.
 // Precondition: `tag` is a valid proto tag.
 inline bool HasDataBuffer(uint32_t tag, Subtype subtype) {
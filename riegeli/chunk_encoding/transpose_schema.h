@@ -0,0 +1,116 @@
+// Copyright 2019 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef RIEGELI_CHUNK_ENCODING_TRANSPOSE_SCHEMA_H_
+#define RIEGELI_CHUNK_ENCODING_TRANSPOSE_SCHEMA_H_
+
+#include <stdint.h>
+
+#include <memory>
+#include <vector>
+
+#include "absl/container/flat_hash_map.h"
+
+namespace riegeli {
+
+// Field types of protocol buffer messages, which let `TransposeEncoder` avoid
+// guessing from the wire format whether a length-delimited field is a
+// submessage.
+//
+// This does not depend on `google::protobuf::Descriptor`, so that chunk
+// encoding needs only the lite protobuf runtime. It is typically built from a
+// descriptor by the caller.
+//
+// A schema is only a hint: a field declared wrongly is encoded less
+// efficiently but still correctly.
+class TransposeSchema {
+ public:
+  // Field types of one message type.
+  class Message {
+   public:
+    // Declares that length-delimited values of field `field_number` are not
+    // messages, e.g. because the field is a string, bytes, or a packed
+    // repeated scalar.
+    void AddNonMessageField(uint32_t field_number);
+
+    // Declares that field `field_number` is a submessage or a group of type
+    // `message`, which must be owned by the same `TransposeSchema`.
+    void AddMessageField(uint32_t field_number, const Message* message);
+
+    // Returns `true` if field `field_number` is known not to be a message.
+    bool IsNonMessageField(uint32_t field_number) const;
+
+    // Returns the type of field `field_number` if it is known to be a message,
+    // otherwise `nullptr`.
+    const Message* MessageField(uint32_t field_number) const;
+
+   private:
+    // Types of fields, with `nullptr` for non-message fields.
+    absl::flat_hash_map<uint32_t, const Message*> fields_;
+  };
+
+  TransposeSchema() noexcept {}
+
+  TransposeSchema(const TransposeSchema&) = delete;
+  TransposeSchema& operator=(const TransposeSchema&) = delete;
+
+  // Adds a message type owned by the schema. The result is valid as long as
+  // the schema is valid.
+  Message* AddMessage();
+
+  // Sets the type of the whole record.
+  void set_root(const Message* root) { root_ = root; }
+
+  // Returns the type of the whole record, or `nullptr` if unknown.
+  const Message* root() const { return root_; }
+
+ private:
+  std::vector<std::unique_ptr<Message>> messages_;
+  const Message* root_ = nullptr;
+};
+
+// Implementation details follow.
+
+inline void TransposeSchema::Message::AddNonMessageField(
+    uint32_t field_number) {
+  fields_[field_number] = nullptr;
+}
+
+inline void TransposeSchema::Message::AddMessageField(uint32_t field_number,
+                                                      const Message* message) {
+  fields_[field_number] = message;
+}
+
+inline bool TransposeSchema::Message::IsNonMessageField(
+    uint32_t field_number) const {
+  const absl::flat_hash_map<uint32_t, const Message*>::const_iterator iter =
+      fields_.find(field_number);
+  return iter != fields_.end() && iter->second == nullptr;
+}
+
+inline const TransposeSchema::Message* TransposeSchema::Message::MessageField(
+    uint32_t field_number) const {
+  const absl::flat_hash_map<uint32_t, const Message*>::const_iterator iter =
+      fields_.find(field_number);
+  return iter == fields_.end() ? nullptr : iter->second;
+}
+
+inline TransposeSchema::Message* TransposeSchema::AddMessage() {
+  messages_.push_back(std::make_unique<Message>());
+  return messages_.back().get();
+}
+
+}  // namespace riegeli
+
+#endif  // RIEGELI_CHUNK_ENCODING_TRANSPOSE_SCHEMA_H_
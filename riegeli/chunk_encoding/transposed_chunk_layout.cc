@@ -0,0 +1,309 @@
+// Copyright 2019 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "riegeli/chunk_encoding/transposed_chunk_layout.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <limits>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#include "absl/base/optimization.h"
+#include "absl/time/clock.h"
+#include "absl/time/time.h"
+#include "riegeli/base/base.h"
+#include "riegeli/base/canonical_errors.h"
+#include "riegeli/base/chain.h"
+#include "riegeli/base/status.h"
+#include "riegeli/bytes/chain_reader.h"
+#include "riegeli/bytes/reader.h"
+#include "riegeli/bytes/reader_utils.h"
+#include "riegeli/bytes/zstd_dictionary.h"
+#include "riegeli/chunk_encoding/constants.h"
+#include "riegeli/chunk_encoding/decompressor.h"
+#include "riegeli/chunk_encoding/transpose_internal.h"
+
+namespace riegeli {
+
+namespace {
+
+// Matches `ValidTag()` in transpose_decoder.cc.
+bool ValidTag(uint32_t tag) {
+  switch (static_cast<internal::WireType>(tag & 7)) {
+    case internal::WireType::kVarint:
+    case internal::WireType::kFixed32:
+    case internal::WireType::kFixed64:
+    case internal::WireType::kLengthDelimited:
+    case internal::WireType::kStartGroup:
+    case internal::WireType::kEndGroup:
+      return tag >= 8;
+    default:
+      return false;
+  }
+}
+
+// Decompresses `bucket`, setting its uncompressed size and decompression time
+// in `*bucket_layout`.
+Status DecompressBucket(const Chain& bucket, CompressionType compression_type,
+                        const ZstdDictionary& zstd_dictionary,
+                        TransposedChunkLayout::Bucket* bucket_layout) {
+  uint64_t uncompressed_size;
+  if (ABSL_PREDICT_FALSE(!internal::UncompressedSize(bucket, compression_type,
+                                                     &uncompressed_size))) {
+    return DataLossError("Reading uncompressed size failed");
+  }
+  if (ABSL_PREDICT_FALSE(uncompressed_size >
+                         std::numeric_limits<size_t>::max())) {
+    return ResourceExhaustedError("Bucket too large");
+  }
+  const absl::Time start_time = absl::Now();
+  internal::Decompressor<ChainReader<>> decompressor(
+      std::forward_as_tuple(&bucket), compression_type, zstd_dictionary);
+  Chain decompressed;
+  if (ABSL_PREDICT_FALSE(!decompressor.reader()->Read(
+          &decompressed, IntCast<size_t>(uncompressed_size)))) {
+    return !decompressor.reader()->healthy()
+               ? decompressor.reader()->status()
+               : DataLossError("Decompressing bucket failed");
+  }
+  if (ABSL_PREDICT_FALSE(!decompressor.VerifyEndAndClose())) {
+    return decompressor.status();
+  }
+  bucket_layout->decompression_time = absl::Now() - start_time;
+  bucket_layout->uncompressed_size = uncompressed_size;
+  return OkStatus();
+}
+
+// Based on `TransposeDecoder::ParseBufferEncodings()`: skips buffer encodings,
+// which do not change which buffer holds which field.
+Status SkipBufferEncodings(Reader* header_reader, uint32_t num_buffers) {
+  uint32_t num_encoded_buffers;
+  if (ABSL_PREDICT_FALSE(!ReadVarint32(header_reader, &num_encoded_buffers))) {
+    return DataLossError("Reading number of encoded buffers failed");
+  }
+  if (ABSL_PREDICT_FALSE(num_encoded_buffers > num_buffers)) {
+    return DataLossError("Too many encoded buffers");
+  }
+  for (uint32_t i = 0; i < num_encoded_buffers; ++i) {
+    uint32_t buffer_index;
+    uint8_t encoding_byte;
+    if (ABSL_PREDICT_FALSE(!ReadVarint32(header_reader, &buffer_index) ||
+                           !ReadByte(header_reader, &encoding_byte))) {
+      return DataLossError("Reading buffer encoding failed");
+    }
+    if (static_cast<internal::BufferEncoding>(encoding_byte) ==
+        internal::BufferEncoding::kFrameOfReference) {
+      uint64_t base;
+      if (ABSL_PREDICT_FALSE(!ReadVarint64(header_reader, &base))) {
+        return DataLossError("Reading encoding base failed");
+      }
+    }
+  }
+  return OkStatus();
+}
+
+// Based on `TransposeDecoder::ParseStateMachine()`: sets the tag of each
+// buffer read by a node.
+Status ParseBufferTags(Reader* header_reader, TransposedChunkLayout* layout) {
+  uint32_t state_machine_size;
+  if (ABSL_PREDICT_FALSE(!ReadVarint32(header_reader, &state_machine_size))) {
+    return DataLossError("Reading state machine size failed");
+  }
+  std::vector<uint32_t> tags;
+  size_t num_subtypes = 0;
+  for (uint32_t i = 0; i < state_machine_size; ++i) {
+    uint32_t tag;
+    if (ABSL_PREDICT_FALSE(!ReadVarint32(header_reader, &tag))) {
+      return DataLossError("Reading field tag failed");
+    }
+    tags.push_back(tag);
+    if (ValidTag(tag) && internal::HasSubtype(tag)) ++num_subtypes;
+  }
+  for (uint32_t i = 0; i < state_machine_size; ++i) {
+    uint32_t next_node;
+    if (ABSL_PREDICT_FALSE(!ReadVarint32(header_reader, &next_node))) {
+      return DataLossError("Reading next node index failed");
+    }
+  }
+  std::string subtypes;
+  if (ABSL_PREDICT_FALSE(!header_reader->Read(&subtypes, num_subtypes))) {
+    return DataLossError("Reading subtypes failed");
+  }
+  size_t subtype_index = 0;
+  for (uint32_t tag : tags) {
+    bool nonproto = false;
+    switch (static_cast<internal::MessageId>(tag)) {
+      case internal::MessageId::kNoOp:
+      case internal::MessageId::kStartOfMessage:
+      case internal::MessageId::kStartOfSubmessage:
+        continue;
+      case internal::MessageId::kNonProto:
+        nonproto = true;
+        break;
+      default: {
+        internal::Subtype subtype = internal::Subtype::kTrivial;
+        // End of submessage is encoded as `WireType::kSubmessage`.
+        if (static_cast<internal::WireType>(tag & 7) ==
+            internal::WireType::kSubmessage) {
+          tag -= internal::WireType::kSubmessage -
+                 internal::WireType::kLengthDelimited;
+          subtype = internal::Subtype::kLengthDelimitedEndOfSubmessage;
+        }
+        if (ABSL_PREDICT_FALSE(!ValidTag(tag))) {
+          return DataLossError("Invalid tag");
+        }
+        if (internal::HasSubtype(tag)) {
+          subtype = static_cast<internal::Subtype>(subtypes[subtype_index++]);
+        }
+        if (!internal::HasDataBuffer(tag, subtype)) continue;
+      }
+    }
+    uint32_t buffer_index;
+    if (ABSL_PREDICT_FALSE(!ReadVarint32(header_reader, &buffer_index))) {
+      return DataLossError("Reading buffer index failed");
+    }
+    if (ABSL_PREDICT_FALSE(buffer_index >= layout->buffers.size())) {
+      return DataLossError("Buffer index too large");
+    }
+    TransposedChunkLayout::Buffer& buffer = layout->buffers[buffer_index];
+    if (nonproto) {
+      buffer.nonproto = true;
+    } else {
+      buffer.tag = tag;
+    }
+  }
+  return OkStatus();
+}
+
+}  // namespace
+
+Status DescribeTransposedChunkLayout(const Chain& chunk_data,
+                                     bool buffer_encodings,
+                                     const ZstdDictionary& zstd_dictionary,
+                                     TransposedChunkLayout* layout) {
+  // Based on `TransposeDecoder::Parse()` and
+  // `TransposeDecoder::ParseBuffers()`.
+  *layout = TransposedChunkLayout();
+  ChainReader<> src(&chunk_data);
+  uint8_t compression_type_byte;
+  if (ABSL_PREDICT_FALSE(!ReadByte(&src, &compression_type_byte))) {
+    return DataLossError("Reading compression type failed");
+  }
+  layout->compression_type =
+      static_cast<CompressionType>(compression_type_byte);
+  uint64_t header_size;
+  if (ABSL_PREDICT_FALSE(!ReadVarint64(&src, &header_size))) {
+    return DataLossError("Reading header size failed");
+  }
+  if (ABSL_PREDICT_FALSE(header_size > std::numeric_limits<size_t>::max())) {
+    return ResourceExhaustedError("Header too large");
+  }
+  layout->header_size = header_size;
+  Chain header;
+  if (ABSL_PREDICT_FALSE(!src.Read(&header, IntCast<size_t>(header_size)))) {
+    return DataLossError("Reading header failed");
+  }
+  internal::Decompressor<ChainReader<>> header_decompressor(
+      std::forward_as_tuple(&header), layout->compression_type,
+      zstd_dictionary);
+  if (ABSL_PREDICT_FALSE(!header_decompressor.healthy())) {
+    return header_decompressor.status();
+  }
+  Reader* const header_reader = header_decompressor.reader();
+
+  uint32_t num_buckets;
+  if (ABSL_PREDICT_FALSE(!ReadVarint32(header_reader, &num_buckets))) {
+    return DataLossError("Reading number of buckets failed");
+  }
+  uint32_t num_buffers;
+  if (ABSL_PREDICT_FALSE(!ReadVarint32(header_reader, &num_buffers))) {
+    return DataLossError("Reading number of buffers failed");
+  }
+  if (ABSL_PREDICT_FALSE(num_buckets == 0 && num_buffers != 0)) {
+    return DataLossError("Too few buckets");
+  }
+  for (uint32_t bucket_index = 0; bucket_index < num_buckets; ++bucket_index) {
+    uint64_t bucket_length;
+    if (ABSL_PREDICT_FALSE(!ReadVarint64(header_reader, &bucket_length))) {
+      return DataLossError("Reading bucket length failed");
+    }
+    if (ABSL_PREDICT_FALSE(bucket_length >
+                           std::numeric_limits<size_t>::max())) {
+      return ResourceExhaustedError("Bucket too large");
+    }
+    Chain bucket;
+    if (ABSL_PREDICT_FALSE(
+            !src.Read(&bucket, IntCast<size_t>(bucket_length)))) {
+      return DataLossError("Reading bucket failed");
+    }
+    layout->buckets.emplace_back();
+    layout->buckets.back().compressed_size = bucket_length;
+    {
+      const Status status =
+          DecompressBucket(bucket, layout->compression_type, zstd_dictionary,
+                           &layout->buckets.back());
+      if (ABSL_PREDICT_FALSE(!status.ok())) return status;
+    }
+  }
+
+  // Buffers are assigned to buckets like in `TransposeDecoder::ParseBuffers()`.
+  uint32_t bucket_index = 0;
+  uint64_t remaining_bucket_size =
+      num_buckets == 0 ? 0 : layout->buckets[0].uncompressed_size;
+  for (uint32_t buffer_index = 0; buffer_index < num_buffers; ++buffer_index) {
+    uint64_t buffer_length;
+    if (ABSL_PREDICT_FALSE(!ReadVarint64(header_reader, &buffer_length))) {
+      return DataLossError("Reading buffer length failed");
+    }
+    if (ABSL_PREDICT_FALSE(buffer_length > remaining_bucket_size)) {
+      return DataLossError("Buffer does not fit in bucket");
+    }
+    layout->buffers.emplace_back();
+    layout->buffers.back().bucket_index = bucket_index;
+    layout->buffers.back().uncompressed_size = buffer_length;
+    remaining_bucket_size -= buffer_length;
+    while (remaining_bucket_size == 0 && bucket_index + 1 < num_buckets) {
+      ++bucket_index;
+      remaining_bucket_size = layout->buckets[bucket_index].uncompressed_size;
+    }
+  }
+  if (ABSL_PREDICT_FALSE(num_buckets > 0 && bucket_index + 1 < num_buckets)) {
+    return DataLossError("Too few buckets");
+  }
+  if (ABSL_PREDICT_FALSE(remaining_bucket_size > 0)) {
+    return DataLossError("End of data expected");
+  }
+  if (buffer_encodings) {
+    const Status status = SkipBufferEncodings(header_reader, num_buffers);
+    if (ABSL_PREDICT_FALSE(!status.ok())) return status;
+  }
+  {
+    const Status status = ParseBufferTags(header_reader, layout);
+    if (ABSL_PREDICT_FALSE(!status.ok())) return status;
+  }
+  uint32_t first_node;
+  if (ABSL_PREDICT_FALSE(!ReadVarint32(header_reader, &first_node))) {
+    return DataLossError("Reading first node index failed");
+  }
+  if (ABSL_PREDICT_FALSE(!header_decompressor.VerifyEndAndClose())) {
+    return header_decompressor.status();
+  }
+  layout->transitions_size = chunk_data.size() - src.pos();
+  return OkStatus();
+}
+
+}  // namespace riegeli
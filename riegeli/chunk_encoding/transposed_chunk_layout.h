@@ -0,0 +1,84 @@
+// Copyright 2019 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef RIEGELI_CHUNK_ENCODING_TRANSPOSED_CHUNK_LAYOUT_H_
+#define RIEGELI_CHUNK_ENCODING_TRANSPOSED_CHUNK_LAYOUT_H_
+
+#include <stdint.h>
+
+#include <vector>
+
+#include "absl/time/time.h"
+#include "riegeli/base/chain.h"
+#include "riegeli/base/status.h"
+#include "riegeli/bytes/zstd_dictionary.h"
+#include "riegeli/chunk_encoding/constants.h"
+
+namespace riegeli {
+
+// How the data of a transposed chunk are divided between buckets and buffers,
+// for finding which fields cost the most.
+//
+// Each data buffer holds values of one field at one position in the message
+// structure, so a field occurring in several submessage types has a buffer for
+// each of them. Buffers are grouped into buckets, which are compressed
+// independently.
+struct TransposedChunkLayout {
+  struct Bucket {
+    uint64_t compressed_size = 0;
+    uint64_t uncompressed_size = 0;
+    // Time spent decompressing the bucket while describing it.
+    absl::Duration decompression_time;
+  };
+
+  struct Buffer {
+    // Index of the bucket containing the buffer.
+    uint32_t bucket_index = 0;
+    uint64_t uncompressed_size = 0;
+    // Proto tag (field number and wire type) of the field whose values are in
+    // the buffer, or 0 if the buffer holds lengths of non-proto records or is
+    // not used by the state machine.
+    uint32_t tag = 0;
+    // Whether the buffer holds lengths of non-proto records.
+    bool nonproto = false;
+  };
+
+  CompressionType compression_type = CompressionType::kNone;
+  // Compressed size of the header, which describes buckets, buffers, and the
+  // state machine.
+  uint64_t header_size = 0;
+  // Compressed size of state machine transitions.
+  uint64_t transitions_size = 0;
+  std::vector<Bucket> buckets;
+  std::vector<Buffer> buffers;
+};
+
+// Parses the layout of the data of a chunk of type `ChunkType::kTransposed`,
+// or of type `ChunkType::kTransposedWithBufferEncodings` if
+// `buffer_encodings`. Each bucket is decompressed and its decompression is
+// timed.
+//
+// `zstd_dictionary` is used if the chunk is compressed with Zstd.
+//
+// Returns status:
+//  * `status.ok()`  - success
+//  * `!status.ok()` - failure
+Status DescribeTransposedChunkLayout(const Chain& chunk_data,
+                                     bool buffer_encodings,
+                                     const ZstdDictionary& zstd_dictionary,
+                                     TransposedChunkLayout* layout);
+
+}  // namespace riegeli
+
+#endif  // RIEGELI_CHUNK_ENCODING_TRANSPOSED_CHUNK_LAYOUT_H_
@@ -142,6 +142,34 @@ inline Position ChunkEnd(const ChunkHeader& header, Position chunk_begin) {
       RoundUpToPossibleChunkBoundary(chunk_begin + header.num_records()));
 }
 
+// The alignment of chunk data with
+// `RecordWriterBase::Options::set_align_chunk_data()`.
+RIEGELI_INTERNAL_INLINE_CONSTEXPR(Position, kChunkDataAlignment,
+                                  Position{1} << 12);
+
+// Whether data of a chunk beginning at `chunk_begin` begin at a multiple of
+// `kChunkDataAlignment`, not interrupted by a block header there.
+inline bool IsChunkDataAligned(Position chunk_begin) {
+  const Position data_begin = AddWithOverhead(chunk_begin, ChunkHeader::size());
+  return data_begin % kChunkDataAlignment == 0 && !IsBlockBoundary(data_begin);
+}
+
+// For a chunk which would begin at `pos`, the nearest position at or after
+// `pos` where a chunk can begin so that its data are aligned, leaving room for
+// a padding chunk between `pos` and that position.
+inline Position AlignedChunkBegin(Position pos) {
+  if (IsChunkDataAligned(pos)) return pos;
+  // Leave room for the padding chunk header, possibly interrupted by a block
+  // header, and for the chunk header.
+  Position data_begin =
+      pos + 2 * ChunkHeader::size() + BlockHeader::size() +
+      (kChunkDataAlignment - 1);
+  data_begin -= data_begin % kChunkDataAlignment;
+  // Chunk data at a block boundary would follow a block header.
+  if (IsBlockBoundary(data_begin)) data_begin += kChunkDataAlignment;
+  return data_begin - ChunkHeader::size();
+}
+
 }  // namespace internal
 }  // namespace riegeli
 
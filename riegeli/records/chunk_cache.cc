@@ -0,0 +1,79 @@
+// Copyright 2017 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "riegeli/records/chunk_cache.h"
+
+#include <stddef.h>
+
+#include <iterator>
+#include <list>
+#include <memory>
+#include <string>
+#include <utility>
+
+#include "absl/strings/string_view.h"
+#include "absl/synchronization/mutex.h"
+#include "riegeli/base/base.h"
+#include "riegeli/base/memory_estimator.h"
+
+namespace riegeli {
+
+std::shared_ptr<const CachedChunk> ChunkCache::Find(absl::string_view file_key,
+                                                    Position chunk_begin) {
+  absl::MutexLock lock(&mutex_);
+  const auto iter =
+      index_.find(Key(std::string(file_key.data(), file_key.size()),
+                      chunk_begin));
+  if (iter == index_.end()) return nullptr;
+  entries_.splice(entries_.begin(), entries_, iter->second);
+  return iter->second->chunk;
+}
+
+void ChunkCache::Insert(absl::string_view file_key, Position chunk_begin,
+                        std::shared_ptr<const CachedChunk> chunk) {
+  MemoryEstimator memory_estimator;
+  memory_estimator.RegisterDynamicMemory(sizeof(CachedChunk));
+  chunk->decoded.RegisterSubobjects(&memory_estimator);
+  const size_t memory = SaturatingAdd(memory_estimator.TotalMemory(),
+                                      sizeof(Entry) + file_key.size());
+  Key key(std::string(file_key.data(), file_key.size()), chunk_begin);
+  absl::MutexLock lock(&mutex_);
+  const auto iter = index_.find(key);
+  if (iter != index_.end()) Erase(iter->second);
+  if (memory > max_memory_) return;
+  while (memory_ > max_memory_ - memory) Erase(std::prev(entries_.end()));
+  entries_.push_front(Entry{key, std::move(chunk), memory});
+  index_.emplace(std::move(key), entries_.begin());
+  memory_ += memory;
+}
+
+void ChunkCache::Clear() {
+  absl::MutexLock lock(&mutex_);
+  index_.clear();
+  entries_.clear();
+  memory_ = 0;
+}
+
+size_t ChunkCache::memory() const {
+  absl::MutexLock lock(&mutex_);
+  return memory_;
+}
+
+inline void ChunkCache::Erase(std::list<Entry>::iterator entry) {
+  memory_ -= entry->memory;
+  index_.erase(entry->key);
+  entries_.erase(entry);
+}
+
+}  // namespace riegeli
@@ -0,0 +1,105 @@
+// Copyright 2017 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef RIEGELI_RECORDS_CHUNK_CACHE_H_
+#define RIEGELI_RECORDS_CHUNK_CACHE_H_
+
+#include <stddef.h>
+
+#include <list>
+#include <memory>
+#include <string>
+#include <utility>
+
+#include "absl/base/thread_annotations.h"
+#include "absl/container/flat_hash_map.h"
+#include "absl/strings/string_view.h"
+#include "absl/synchronization/mutex.h"
+#include "riegeli/base/base.h"
+#include "riegeli/chunk_encoding/chunk_decoder.h"
+
+namespace riegeli {
+
+// A decoded chunk stored in a `ChunkCache`.
+struct CachedChunk {
+  // The position after the chunk.
+  Position chunk_end = 0;
+  // Records of the chunk.
+  DecodedChunk decoded;
+};
+
+// A cache of decoded chunks, bounded by their memory usage, evicting least
+// recently used chunks first. It can be shared between `RecordReader`s with
+// `RecordReaderBase::Options::set_chunk_cache()`, also across threads.
+//
+// Chunks are identified by a key of the file, chosen by the user, e.g. the
+// filename, together with the chunk position.
+//
+// `ChunkCache` is thread-safe.
+class ChunkCache {
+ public:
+  // Creates a cache using up to `max_memory` bytes for chunks. Memory is
+  // estimated with `MemoryEstimator`.
+  explicit ChunkCache(size_t max_memory) : max_memory_(max_memory) {}
+
+  ChunkCache(const ChunkCache&) = delete;
+  ChunkCache& operator=(const ChunkCache&) = delete;
+
+  // Returns the chunk of the given file beginning at `chunk_begin`, or
+  // `nullptr` if it is not cached. Marks the chunk as most recently used.
+  std::shared_ptr<const CachedChunk> Find(absl::string_view file_key,
+                                          Position chunk_begin);
+
+  // Stores the chunk of the given file beginning at `chunk_begin`, replacing
+  // a chunk stored under the same key, and evicts least recently used chunks
+  // until the memory usage fits in `max_memory()`. A chunk larger than
+  // `max_memory()` is not stored.
+  void Insert(absl::string_view file_key, Position chunk_begin,
+              std::shared_ptr<const CachedChunk> chunk);
+
+  // Removes all chunks.
+  void Clear();
+
+  // Returns the maximum memory usage.
+  size_t max_memory() const { return max_memory_; }
+
+  // Returns the estimated memory usage of chunks currently stored.
+  size_t memory() const;
+
+ private:
+  using Key = std::pair<std::string, Position>;
+
+  struct Entry {
+    Key key;
+    std::shared_ptr<const CachedChunk> chunk;
+    size_t memory;
+  };
+
+  // Removes the given entry.
+  void Erase(std::list<Entry>::iterator entry)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(mutex_);
+
+  const size_t max_memory_;
+  mutable absl::Mutex mutex_;
+  // Entries in the order of usage, most recently used first.
+  std::list<Entry> entries_ ABSL_GUARDED_BY(mutex_);
+  absl::flat_hash_map<Key, std::list<Entry>::iterator> index_
+      ABSL_GUARDED_BY(mutex_);
+  // The sum of `Entry::memory`.
+  size_t memory_ ABSL_GUARDED_BY(mutex_) = 0;
+};
+
+}  // namespace riegeli
+
+#endif  // RIEGELI_RECORDS_CHUNK_CACHE_H_
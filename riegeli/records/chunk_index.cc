@@ -0,0 +1,195 @@
+// Copyright 2017 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "riegeli/records/chunk_index.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <algorithm>
+#include <iterator>
+#include <limits>
+#include <vector>
+
+#include "absl/base/optimization.h"
+#include "absl/strings/str_cat.h"
+#include "riegeli/base/base.h"
+#include "riegeli/base/canonical_errors.h"
+#include "riegeli/base/memory_estimator.h"
+#include "riegeli/base/status.h"
+#include "riegeli/bytes/chain_reader.h"
+#include "riegeli/bytes/chain_writer.h"
+#include "riegeli/bytes/reader_utils.h"
+#include "riegeli/bytes/writer_utils.h"
+#include "riegeli/chunk_encoding/chunk.h"
+#include "riegeli/chunk_encoding/constants.h"
+#include "riegeli/records/record_position.h"
+
+namespace riegeli {
+
+void ChunkIndex::Clear() {
+  chunk_begins_.clear();
+  records_before_.clear();
+  num_records_ = 0;
+  index_begin_ = 0;
+}
+
+void ChunkIndex::Add(Position chunk_begin, uint64_t num_records) {
+  RIEGELI_ASSERT(chunk_begins_.empty() || chunk_begin > chunk_begins_.back())
+      << "Failed precondition of ChunkIndex::Add(): "
+         "chunk beginnings not increasing";
+  if (num_records == 0) return;
+  chunk_begins_.push_back(chunk_begin);
+  records_before_.push_back(num_records_);
+  num_records_ += num_records;
+}
+
+Position ChunkIndex::chunk_begin(size_t chunk_index) const {
+  RIEGELI_ASSERT_LT(chunk_index, chunk_begins_.size())
+      << "Failed precondition of ChunkIndex::chunk_begin(): "
+         "chunk index out of range";
+  return chunk_begins_[chunk_index];
+}
+
+uint64_t ChunkIndex::chunk_num_records(size_t chunk_index) const {
+  RIEGELI_ASSERT_LT(chunk_index, records_before_.size())
+      << "Failed precondition of ChunkIndex::chunk_num_records(): "
+         "chunk index out of range";
+  return (chunk_index + 1 < records_before_.size()
+              ? records_before_[chunk_index + 1]
+              : num_records_) -
+         records_before_[chunk_index];
+}
+
+RecordPosition ChunkIndex::PositionOfRecord(uint64_t record_number) const {
+  RIEGELI_ASSERT_LT(record_number, num_records_)
+      << "Failed precondition of ChunkIndex::PositionOfRecord(): "
+         "record number out of range";
+  // Find the last chunk with `records_before_` not greater than
+  // `record_number`. It exists because `records_before_.front() == 0`.
+  const size_t chunk_index = IntCast<size_t>(
+      std::distance(records_before_.begin(),
+                    std::upper_bound(records_before_.begin(),
+                                     records_before_.end(), record_number)) -
+      1);
+  return RecordPosition(chunk_begins_[chunk_index],
+                        record_number - records_before_[chunk_index]);
+}
+
+void ChunkIndex::Encode(Position chunk_begin, HashType hash_type,
+                        Chunk* chunk) const {
+  RIEGELI_ASSERT(chunk_begins_.empty() || chunk_begin > chunk_begins_.back())
+      << "Failed precondition of ChunkIndex::Encode(): "
+         "index chunk not after indexed chunks";
+  chunk->data.Clear();
+  ChainWriter<> data_writer(&chunk->data);
+  WriteVarint64(&data_writer, chunk_begin);
+  WriteVarint64(&data_writer, IntCast<uint64_t>(chunk_begins_.size()));
+  Position previous_chunk_begin = 0;
+  for (size_t i = 0; i < chunk_begins_.size(); ++i) {
+    WriteVarint64(&data_writer, chunk_begins_[i] - previous_chunk_begin);
+    WriteVarint64(&data_writer, chunk_num_records(i));
+    previous_chunk_begin = chunk_begins_[i];
+  }
+  if (!data_writer.Close()) {
+    RIEGELI_ASSERT_UNREACHABLE()
+        << "Writing to a Chain failed: " << data_writer.status();
+  }
+  // `decoded_data_size` of the index chunk stores the number of records.
+  chunk->header = ChunkHeader(chunk->data, ChunkType::kIndex, 0, num_records_,
+                              hash_type);
+}
+
+Status ChunkIndex::DecodeNumRecords(const Chunk& chunk, Position* index_begin,
+                                    uint64_t* num_records) {
+  if (ABSL_PREDICT_FALSE(chunk.header.chunk_type() != ChunkType::kIndex)) {
+    return InvalidArgumentError(absl::StrCat(
+        "Not an index chunk, chunk type: ",
+        static_cast<uint64_t>(chunk.header.chunk_type())));
+  }
+  ChainReader<> data_reader(&chunk.data);
+  if (ABSL_PREDICT_FALSE(!ReadVarint64(&data_reader, index_begin))) {
+    return DataLossError("Invalid index chunk: reading header failed");
+  }
+  *num_records = chunk.header.decoded_data_size();
+  return OkStatus();
+}
+
+Status ChunkIndex::Decode(const Chunk& chunk) {
+  Clear();
+  if (ABSL_PREDICT_FALSE(chunk.header.chunk_type() != ChunkType::kIndex)) {
+    return InvalidArgumentError(absl::StrCat(
+        "Not an index chunk, chunk type: ",
+        static_cast<uint64_t>(chunk.header.chunk_type())));
+  }
+  ChainReader<> data_reader(&chunk.data);
+  uint64_t num_chunks;
+  if (ABSL_PREDICT_FALSE(!ReadVarint64(&data_reader, &index_begin_) ||
+                         !ReadVarint64(&data_reader, &num_chunks))) {
+    Clear();
+    return DataLossError("Invalid index chunk: reading header failed");
+  }
+  // Each chunk takes at least 2 bytes.
+  if (ABSL_PREDICT_FALSE(num_chunks > chunk.data.size() / 2)) {
+    Clear();
+    return DataLossError(
+        absl::StrCat("Invalid index chunk: too many chunks: ", num_chunks));
+  }
+  chunk_begins_.reserve(IntCast<size_t>(num_chunks));
+  records_before_.reserve(IntCast<size_t>(num_chunks));
+  Position chunk_begin = 0;
+  for (uint64_t i = 0; i < num_chunks; ++i) {
+    uint64_t chunk_begin_delta, num_records;
+    if (ABSL_PREDICT_FALSE(!ReadVarint64(&data_reader, &chunk_begin_delta) ||
+                           !ReadVarint64(&data_reader, &num_records))) {
+      Clear();
+      return DataLossError("Invalid index chunk: reading chunk failed");
+    }
+    if (ABSL_PREDICT_FALSE(
+            (i > 0 && chunk_begin_delta == 0) || num_records == 0 ||
+            chunk_begin_delta >= index_begin_ - chunk_begin ||
+            num_records > std::numeric_limits<uint64_t>::max() - num_records_)) {
+      Clear();
+      return DataLossError(
+          absl::StrCat("Invalid index chunk: invalid chunk at index ", i));
+    }
+    chunk_begin += chunk_begin_delta;
+    chunk_begins_.push_back(chunk_begin);
+    records_before_.push_back(num_records_);
+    num_records_ += num_records;
+  }
+  if (ABSL_PREDICT_FALSE(!data_reader.VerifyEndAndClose())) {
+    Clear();
+    return DataLossError("Invalid index chunk: unexpected data at end");
+  }
+  if (ABSL_PREDICT_FALSE(chunk.header.decoded_data_size() != 0 &&
+                         chunk.header.decoded_data_size() != num_records_)) {
+    const uint64_t stored_num_records = chunk.header.decoded_data_size();
+    const uint64_t num_records = num_records_;
+    Clear();
+    return DataLossError(absl::StrCat(
+        "Invalid index chunk: number of records mismatch (stored ",
+        stored_num_records, ", indexed ", num_records, ")"));
+  }
+  return OkStatus();
+}
+
+void ChunkIndex::RegisterSubobjects(MemoryEstimator* memory_estimator) const {
+  memory_estimator->RegisterDynamicMemory(chunk_begins_.capacity() *
+                                          sizeof(Position));
+  memory_estimator->RegisterDynamicMemory(records_before_.capacity() *
+                                          sizeof(uint64_t));
+}
+
+}  // namespace riegeli
@@ -0,0 +1,127 @@
+// Copyright 2017 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef RIEGELI_RECORDS_CHUNK_INDEX_H_
+#define RIEGELI_RECORDS_CHUNK_INDEX_H_
+
+#include <stdint.h>
+
+#include <vector>
+
+#include "riegeli/base/base.h"
+#include "riegeli/base/memory_estimator.h"
+#include "riegeli/base/status.h"
+#include "riegeli/chunk_encoding/chunk.h"
+#include "riegeli/chunk_encoding/constants.h"
+#include "riegeli/records/record_position.h"
+
+namespace riegeli {
+
+// Locations of chunks containing records, together with numbers of records
+// preceding each chunk. This is stored in an index chunk, which is written at
+// the end of the file by `RecordWriter` if `set_index()` is used.
+class ChunkIndex {
+ public:
+  ChunkIndex() noexcept {}
+
+  ChunkIndex(const ChunkIndex&) = default;
+  ChunkIndex& operator=(const ChunkIndex&) = default;
+
+  ChunkIndex(ChunkIndex&&) noexcept = default;
+  ChunkIndex& operator=(ChunkIndex&&) noexcept = default;
+
+  // Makes `*this` equivalent to a newly constructed `ChunkIndex`.
+  void Clear();
+
+  // Appends a chunk beginning at `chunk_begin` with `num_records` records.
+  // Chunks with no records are ignored.
+  //
+  // Precondition: `chunk_begin` is greater than beginnings of chunks added so
+  // far
+  void Add(Position chunk_begin, uint64_t num_records);
+
+  // Returns the total number of records in indexed chunks.
+  uint64_t num_records() const { return num_records_; }
+
+  // Returns the number of indexed chunks.
+  size_t num_chunks() const { return chunk_begins_.size(); }
+
+  // Returns the beginning of the indexed chunk with the given number, counting
+  // indexed chunks from 0.
+  //
+  // Precondition: `chunk_index < num_chunks()`
+  Position chunk_begin(size_t chunk_index) const;
+
+  // Returns the number of records in the indexed chunk with the given number.
+  //
+  // Precondition: `chunk_index < num_chunks()`
+  uint64_t chunk_num_records(size_t chunk_index) const;
+
+  // Returns the canonical position of the record with the given number,
+  // counting records from 0 in the whole file.
+  //
+  // Precondition: `record_number < num_records()`
+  RecordPosition PositionOfRecord(uint64_t record_number) const;
+
+  // Encodes the index as an index chunk beginning at `chunk_begin`.
+  //
+  // The beginning of the index chunk is stored in it, so that an index chunk
+  // which was moved, e.g. by concatenating files, is not mistaken for an index
+  // of the whole file. The total number of records is stored in the chunk
+  // header. `data_hash` is computed with `hash_type`.
+  //
+  // Precondition: `chunk_begin` is greater than beginnings of chunks added so
+  // far
+  void Encode(Position chunk_begin, HashType hash_type, Chunk* chunk) const;
+
+  // Decodes the index from an index chunk.
+  //
+  // Returns status:
+  //  * `status.ok()`  - success
+  //  * `!status.ok()` - failure (`*this` is cleared)
+  Status Decode(const Chunk& chunk);
+
+  // Decodes only the beginning of the index chunk stored by `Encode()` and the
+  // total number of records, without locations of chunks, which is cheaper
+  // than `Decode()` if only the number of records is needed.
+  //
+  // The number of records is stored in `decoded_data_size` of the chunk header.
+  // Index chunks written by older versions store 0 there, and then
+  // `*num_records` is set to 0 too.
+  //
+  // Returns status:
+  //  * `status.ok()`  - success (`*index_begin` and `*num_records` are set)
+  //  * `!status.ok()` - failure
+  static Status DecodeNumRecords(const Chunk& chunk, Position* index_begin,
+                                 uint64_t* num_records);
+
+  // Returns the beginning of the index chunk stored by `Encode()`, after
+  // `Decode()`. If this differs from the actual beginning of the index chunk,
+  // the index does not describe the file which contains it.
+  Position index_begin() const { return index_begin_; }
+
+  // Registers subobjects with `MemoryEstimator`.
+  void RegisterSubobjects(MemoryEstimator* memory_estimator) const;
+
+ private:
+  // Invariant: `chunk_begins_.size() == records_before_.size()`
+  std::vector<Position> chunk_begins_;
+  std::vector<uint64_t> records_before_;
+  uint64_t num_records_ = 0;
+  Position index_begin_ = 0;
+};
+
+}  // namespace riegeli
+
+#endif  // RIEGELI_RECORDS_CHUNK_INDEX_H_
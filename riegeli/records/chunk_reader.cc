@@ -17,16 +17,21 @@
 #include <stddef.h>
 #include <stdint.h>
 
+#include <future>
 #include <string>
 #include <utility>
 
 #include "absl/base/optimization.h"
 #include "absl/strings/str_cat.h"
 #include "absl/strings/string_view.h"
+#include "absl/types/span.h"
 #include "riegeli/base/base.h"
 #include "riegeli/base/canonical_errors.h"
 #include "riegeli/base/chain.h"
+#include "riegeli/base/memory_estimator.h"
+#include "riegeli/base/parallelism.h"
 #include "riegeli/base/status.h"
+#include "riegeli/base/tracing.h"
 #include "riegeli/bytes/reader.h"
 #include "riegeli/chunk_encoding/chunk.h"
 #include "riegeli/chunk_encoding/constants.h"
@@ -36,6 +41,19 @@
 
 namespace riegeli {
 
+namespace {
+
+Status DataHashMismatch(uint64_t computed_data_hash, uint64_t stored_data_hash,
+                        Position chunk_begin, Position chunk_end) {
+  return DataLossError(absl::StrCat(
+      "Corrupted Riegeli/records file: chunk data hash mismatch (computed 0x",
+      absl::Hex(computed_data_hash, absl::PadSpec::kZeroPad16), ", stored 0x",
+      absl::Hex(stored_data_hash, absl::PadSpec::kZeroPad16), "), chunk at ",
+      chunk_begin, " with length ", chunk_end - chunk_begin));
+}
+
+}  // namespace
+
 void DefaultChunkReaderBase::Initialize(Reader* src) {
   RIEGELI_ASSERT(src != nullptr)
       << "Failed precondition of DefaultChunkReader: null Reader pointer";
@@ -54,6 +72,7 @@ void DefaultChunkReaderBase::Initialize(Reader* src) {
 void DefaultChunkReaderBase::Done() {
   recoverable_ = Recoverable::kNo;
   recoverable_pos_ = 0;
+  FinishDataHashVerification();
   if (ABSL_PREDICT_FALSE(truncated_)) {
     Reader* const src = src_reader();
     RIEGELI_ASSERT_GT(src->pos(), pos_)
@@ -87,10 +106,29 @@ bool DefaultChunkReaderBase::CheckFileFormat() {
 }
 
 bool DefaultChunkReaderBase::ReadChunk(Chunk* chunk) {
+  const TraceScope trace("ReadChunk");
   if (ABSL_PREDICT_FALSE(!PullChunkHeader(nullptr))) return false;
   Reader* const src = src_reader();
   const Position chunk_end = internal::ChunkEnd(chunk_.header, pos_);
 
+  if (chunk_.data.empty() && chunk_.header.data_size() > 0 &&
+      internal::IsChunkDataAligned(pos_) &&
+      internal::RemainingInBlockHeader(src->pos()) == 0 &&
+      chunk_.header.data_size() <= internal::RemainingInBlock(src->pos())) {
+    // Chunk data aligned with
+    // `RecordWriterBase::Options::set_align_chunk_data()` are contiguous: read
+    // them into one flat buffer, so that `src` can read them directly from the
+    // file instead of copying them through its buffer.
+    const size_t length = IntCast<size_t>(chunk_.header.data_size());
+    const absl::Span<char> buffer = chunk_.data.AppendFixedBuffer(length);
+    const Position pos_before = src->pos();
+    if (ABSL_PREDICT_FALSE(!src->Read(buffer.data(), length))) {
+      chunk_.data.RemoveSuffix(
+          length - IntCast<size_t>(src->pos() - pos_before));
+      return ReadingFailed(src);
+    }
+  }
+
   while (chunk_.data.size() < chunk_.header.data_size()) {
     if (internal::RemainingInBlockHeader(src->pos()) > 0) {
       const Position block_begin =
@@ -137,18 +175,15 @@ bool DefaultChunkReaderBase::ReadChunk(Chunk* chunk) {
 
   if (ABSL_PREDICT_FALSE(!src->Seek(chunk_end))) return ReadingFailed(src);
 
-  const uint64_t computed_data_hash = internal::Hash(chunk_.data);
-  if (ABSL_PREDICT_FALSE(computed_data_hash != chunk_.header.data_hash())) {
-    // `Recoverable::kHaveChunk`, not `Recoverable::kFindChunk`, because while
-    // chunk data are invalid, chunk header has a correct hash, and thus the
-    // next chunk is believed to be present after this chunk.
-    recoverable_ = Recoverable::kHaveChunk;
-    recoverable_pos_ = chunk_end;
-    return Fail(DataLossError(absl::StrCat(
-        "Corrupted Riegeli/records file: chunk data hash mismatch (computed 0x",
-        absl::Hex(computed_data_hash, absl::PadSpec::kZeroPad16), ", stored 0x",
-        absl::Hex(chunk_.header.data_hash(), absl::PadSpec::kZeroPad16),
-        "), chunk at ", pos_, " with length ", chunk_end - pos_)));
+  if (verify_data_hashes_) {
+    if (ABSL_PREDICT_FALSE(!hash_type_known_)) {
+      if (ABSL_PREDICT_FALSE(!ReadHashType(chunk_end))) return false;
+    }
+    if (verify_data_hashes_in_background_) {
+      VerifyDataHashInBackground(chunk_end);
+    } else if (ABSL_PREDICT_FALSE(!VerifyDataHash(chunk_end))) {
+      return false;
+    }
   }
 
   *chunk = std::move(chunk_);
@@ -157,8 +192,21 @@ bool DefaultChunkReaderBase::ReadChunk(Chunk* chunk) {
   return true;
 }
 
+bool DefaultChunkReaderBase::NextChunkHeader(ChunkHeader* chunk_header,
+                                             Position* chunk_begin) {
+  if (ABSL_PREDICT_FALSE(!PullChunkHeader(nullptr))) return false;
+  Reader* const src = src_reader();
+  const Position chunk_end = internal::ChunkEnd(chunk_.header, pos_);
+  if (ABSL_PREDICT_FALSE(!src->Seek(chunk_end))) return ReadingFailed(src);
+  *chunk_header = chunk_.header;
+  if (chunk_begin != nullptr) *chunk_begin = pos_;
+  pos_ = chunk_end;
+  chunk_.Reset();
+  return true;
+}
+
 bool DefaultChunkReaderBase::PullChunkHeader(const ChunkHeader** chunk_header) {
-  if (ABSL_PREDICT_FALSE(!healthy())) return false;
+  if (ABSL_PREDICT_FALSE(!FinishDataHashVerification())) return false;
   Reader* const src = src_reader();
   truncated_ = false;
 
@@ -270,17 +318,114 @@ inline bool DefaultChunkReaderBase::ReadChunkHeader() {
     if (ABSL_PREDICT_FALSE(chunk_.header.data_size() != 0 ||
                            chunk_.header.chunk_type() !=
                                ChunkType::kFileSignature ||
-                           chunk_.header.num_records() != 0 ||
-                           chunk_.header.decoded_data_size() != 0)) {
+                           chunk_.header.num_records() != 0)) {
       recoverable_ = Recoverable::kFindChunk;
       recoverable_pos_ = src->pos();
       return Fail(DataLossError(
           "Invalid Riegeli/records file: missing file signature"));
     }
+    // `decoded_data_size` of the file signature stores the hash type.
+    if (ABSL_PREDICT_FALSE(chunk_.header.decoded_data_size() >
+                           static_cast<uint64_t>(kMaxHashType))) {
+      return Fail(UnimplementedError(absl::StrCat(
+          "Unsupported Riegeli/records file: unknown hash type: ",
+          chunk_.header.decoded_data_size())));
+    }
+    hash_type_ = static_cast<HashType>(chunk_.header.decoded_data_size());
+    hash_type_known_ = true;
+  }
+  return true;
+}
+
+bool DefaultChunkReaderBase::ReadHashType(Position restore_pos) {
+  Reader* const src = src_reader();
+  hash_type_ = HashType::kHighwayHash;
+  hash_type_known_ = true;
+  if (!src->SupportsRandomAccess()) return true;
+  // The file signature is the chunk header following the first block header.
+  // If it is absent, e.g. in a file fragment, `HashType::kHighwayHash` is
+  // assumed.
+  ChunkHeader signature;
+  if (src->Seek(internal::BlockHeader::size()) &&
+      src->Read(signature.bytes(), signature.size()) &&
+      signature.computed_header_hash() == signature.stored_header_hash() &&
+      signature.data_size() == 0 &&
+      signature.chunk_type() == ChunkType::kFileSignature &&
+      signature.num_records() == 0 &&
+      signature.decoded_data_size() <= static_cast<uint64_t>(kMaxHashType)) {
+    hash_type_ = static_cast<HashType>(signature.decoded_data_size());
+  }
+  if (ABSL_PREDICT_FALSE(!src->healthy())) return Fail(*src);
+  if (ABSL_PREDICT_FALSE(!src->Seek(restore_pos))) {
+    return SeekingFailed(src, restore_pos);
+  }
+  return true;
+}
+
+inline bool DefaultChunkReaderBase::VerifyDataHash(Position chunk_end) {
+  RIEGELI_ASSERT(hash_type_known_)
+      << "Failed precondition of DefaultChunkReaderBase::VerifyDataHash(): "
+         "hash type unknown";
+  const uint64_t computed_data_hash = internal::Hash(hash_type_, chunk_.data);
+  if (ABSL_PREDICT_FALSE(computed_data_hash != chunk_.header.data_hash())) {
+    // `Recoverable::kHaveChunk`, not `Recoverable::kFindChunk`, because while
+    // chunk data are invalid, chunk header has a correct hash, and thus the
+    // next chunk is believed to be present after this chunk.
+    recoverable_ = Recoverable::kHaveChunk;
+    recoverable_pos_ = chunk_end;
+    return Fail(DataHashMismatch(computed_data_hash, chunk_.header.data_hash(),
+                                 pos_, chunk_end));
   }
   return true;
 }
 
+inline void DefaultChunkReaderBase::VerifyDataHashInBackground(
+    Position chunk_end) {
+  RIEGELI_ASSERT(hash_type_known_)
+      << "Failed precondition of "
+         "DefaultChunkReaderBase::VerifyDataHashInBackground(): "
+         "hash type unknown";
+  struct HashingChunk {
+    HashType hash_type;
+    // Copying a `Chain` shares its large blocks.
+    Chain data;
+    std::promise<uint64_t> computed_data_hash;
+  };
+  HashingChunk* const hashing_chunk =
+      new HashingChunk{hash_type_, chunk_.data, {}};
+  pending_data_hash_.computed_data_hash =
+      hashing_chunk->computed_data_hash.get_future();
+  pending_data_hash_.stored_data_hash = chunk_.header.data_hash();
+  pending_data_hash_.chunk_begin = pos_;
+  pending_data_hash_.chunk_end = chunk_end;
+  ThreadPool::global().Schedule([hashing_chunk] {
+    hashing_chunk->computed_data_hash.set_value(
+        internal::Hash(hashing_chunk->hash_type, hashing_chunk->data));
+    delete hashing_chunk;
+  });
+}
+
+inline bool DefaultChunkReaderBase::FinishDataHashVerification() {
+  if (!pending_data_hash_.computed_data_hash.valid()) return healthy();
+  const uint64_t computed_data_hash =
+      pending_data_hash_.computed_data_hash.get();
+  if (ABSL_PREDICT_FALSE(computed_data_hash !=
+                         pending_data_hash_.stored_data_hash) &&
+      ABSL_PREDICT_TRUE(healthy())) {
+    // Fail as `ReadChunk()` would have failed if the chunk was verified in the
+    // calling thread. Nothing was read after the chunk yet.
+    truncated_ = false;
+    pos_ = pending_data_hash_.chunk_begin;
+    chunk_.Reset();
+    recoverable_ = Recoverable::kHaveChunk;
+    recoverable_pos_ = pending_data_hash_.chunk_end;
+    return Fail(DataHashMismatch(
+        computed_data_hash, pending_data_hash_.stored_data_hash,
+        pending_data_hash_.chunk_begin, pending_data_hash_.chunk_end));
+  }
+  return healthy();
+}
+
 inline bool DefaultChunkReaderBase::ReadBlockHeader() {
   Reader* const src = src_reader();
   const size_t remaining_length = internal::RemainingInBlockHeader(src->pos());
@@ -311,6 +456,7 @@ inline bool DefaultChunkReaderBase::ReadBlockHeader() {
 
 bool DefaultChunkReaderBase::Recover(SkippedRegion* skipped_region) {
   if (recoverable_ == Recoverable::kNo) return false;
+  verify_data_hashes_ = true;
   Reader* const src = src_reader();
   const Position region_begin = pos_;
 again:
@@ -389,7 +535,7 @@ find_chunk:
 }
 
 bool DefaultChunkReaderBase::Seek(Position new_pos) {
-  if (ABSL_PREDICT_FALSE(!healthy())) return false;
+  if (ABSL_PREDICT_FALSE(!FinishDataHashVerification())) return false;
   Reader* const src = src_reader();
   truncated_ = false;
   pos_ = new_pos;
@@ -429,7 +575,7 @@ bool DefaultChunkReaderBase::SeekToChunkAfter(Position new_pos) {
 
 template <DefaultChunkReaderBase::WhichChunk which_chunk>
 bool DefaultChunkReaderBase::SeekToChunk(Position new_pos) {
-  if (ABSL_PREDICT_FALSE(!healthy())) return false;
+  if (ABSL_PREDICT_FALSE(!FinishDataHashVerification())) return false;
   Reader* const src = src_reader();
   truncated_ = false;
   chunk_.Reset();
@@ -515,4 +661,9 @@ bool DefaultChunkReaderBase::SeekToChunk(Position new_pos) {
   }
 }
 
+void DefaultChunkReaderBase::RegisterSubobjects(
+    MemoryEstimator* memory_estimator) const {
+  chunk_.data.RegisterSubobjects(memory_estimator);
+}
+
 }  // namespace riegeli
@@ -15,16 +15,21 @@
 #ifndef RIEGELI_RECORDS_CHUNK_READER_H_
 #define RIEGELI_RECORDS_CHUNK_READER_H_
 
+#include <stdint.h>
+
+#include <future>
 #include <tuple>
 #include <utility>
 
 #include "absl/base/optimization.h"
 #include "riegeli/base/base.h"
 #include "riegeli/base/dependency.h"
+#include "riegeli/base/memory_estimator.h"
 #include "riegeli/base/object.h"
 #include "riegeli/base/resetter.h"
 #include "riegeli/bytes/reader.h"
 #include "riegeli/chunk_encoding/chunk.h"
+#include "riegeli/chunk_encoding/constants.h"
 #include "riegeli/records/block.h"
 #include "riegeli/records/skipped_region.h"
 
@@ -48,6 +53,45 @@ class DefaultChunkReaderBase : public Object {
   //  * `false` (when `!healthy()`) - failure
   bool CheckFileFormat();
 
+  // Sets whether `ReadChunk()` verifies hashes of chunk data. Hashes of block
+  // headers and chunk headers are always verified.
+  //
+  // Skipping verification of data hashes saves a pass over chunk data when
+  // corruption is detected by other means, e.g. by the storage layer. Corrupted
+  // data are then detected only if decoding them fails.
+  //
+  // `Recover()` turns verification back on, because the file is known to be
+  // corrupted.
+  //
+  // Default: `true`
+  void set_verify_data_hashes(bool verify_data_hashes) {
+    verify_data_hashes_ = verify_data_hashes;
+  }
+  bool verify_data_hashes() const { return verify_data_hashes_; }
+
+  // Sets whether `ReadChunk()` verifies hashes of chunk data in background on
+  // `ThreadPool::global()` instead of in the calling thread, if they are
+  // verified at all (see `set_verify_data_hashes()`).
+  //
+  // The chunk is then returned before its verification finishes, so that it
+  // can be decoded concurrently. A failed verification is reported by the next
+  // operation which passes the end of the chunk or moves elsewhere:
+  // `ReadChunk()`, `PullChunkHeader()`, `NextChunkHeader()`, seeking, or
+  // `Close()`. The `ChunkReader` fails then as if `ReadChunk()` of the chunk
+  // failed, with `pos()` at the chunk, so that `Recover()` skips it.
+  //
+  // This hides verification latency when chunks are decoded one at a time,
+  // at the cost of having already returned data of a corrupted chunk.
+  //
+  // Default: `false`
+  void set_verify_data_hashes_in_background(
+      bool verify_data_hashes_in_background) {
+    verify_data_hashes_in_background_ = verify_data_hashes_in_background;
+  }
+  bool verify_data_hashes_in_background() const {
+    return verify_data_hashes_in_background_;
+  }
+
   // Reads the next chunk.
   //
   // Return values:
@@ -68,6 +112,24 @@ class DefaultChunkReaderBase : public Object {
   //  * `false` (when `!healthy()`) - failure
   bool PullChunkHeader(const ChunkHeader** chunk_header);
 
+  // Reads the next chunk header and skips the chunk data by seeking over them,
+  // together with block headers interleaved with them, without reading them.
+  //
+  // This enumerates chunks reading only chunk headers and block headers which
+  // interrupt them, which is much cheaper than `ReadChunk()` if the source
+  // supports efficient seeking, e.g. a file or remote storage with range reads.
+  // Chunk data are not verified.
+  //
+  // If `chunk_begin != nullptr`, `*chunk_begin` is set to the position of the
+  // chunk, i.e. `pos()` before the call.
+  //
+  // Return values:
+  //  * `true`                      - success (`*chunk_header` is set)
+  //  * `false` (when `healthy()`)  - source ends
+  //  * `false` (when `!healthy()`) - failure
+  bool NextChunkHeader(ChunkHeader* chunk_header,
+                       Position* chunk_begin = nullptr);
+
   // If `!healthy()` and the failure was caused by invalid file contents, then
   // `Recover()` tries to recover from the failure and allow reading again by
   // skipping over the invalid region.
@@ -138,6 +200,10 @@ class DefaultChunkReaderBase : public Object {
   //  * `false` - failure (`!healthy()`)
   bool Size(Position* size);
 
+  // Registers the chunk being read with `MemoryEstimator`. Buffers of the
+  // source `Reader` are not included.
+  void RegisterSubobjects(MemoryEstimator* memory_estimator) const;
+
  protected:
   explicit DefaultChunkReaderBase(InitiallyClosed) : Object(kInitiallyClosed) {}
   explicit DefaultChunkReaderBase(InitiallyOpen) : Object(kInitiallyOpen) {}
@@ -155,6 +221,16 @@ class DefaultChunkReaderBase : public Object {
   enum class Recoverable { kNo, kHaveChunk, kFindChunk };
   enum class WhichChunk { kContaining, kBefore, kAfter };
 
+  // Verification of `data_hash` of a chunk already returned by `ReadChunk()`,
+  // running in background.
+  struct PendingDataHash {
+    // Computed `data_hash`, valid if verification is pending.
+    std::future<uint64_t> computed_data_hash;
+    uint64_t stored_data_hash = 0;
+    Position chunk_begin = 0;
+    Position chunk_end = 0;
+  };
+
   // Interprets a `false` result from `*src` reading or seeking function.
   //
   // End of file (i.e. if `healthy()`) is propagated, setting `truncated_` if it
@@ -173,6 +249,34 @@ class DefaultChunkReaderBase : public Object {
   // Reads or continues reading `chunk_.header`.
   bool ReadChunkHeader();
 
+  // Sets `hash_type_` from the file signature if `src_reader()` supports
+  // random access, otherwise assumes `HashType::kHighwayHash`. Leaves the
+  // position of `src_reader()` at `restore_pos`.
+  //
+  // Return values:
+  //  * `true`  - success (`hash_type_known_`)
+  //  * `false` - failure (`!healthy()`)
+  bool ReadHashType(Position restore_pos);
+
+  // Verifies `data_hash` of `chunk_`, which ends at `chunk_end`.
+  //
+  // Precondition: `hash_type_known_`
+  bool VerifyDataHash(Position chunk_end);
+
+  // Starts verifying `data_hash` of `chunk_`, which ends at `chunk_end`, in
+  // background.
+  //
+  // Precondition: `hash_type_known_`
+  void VerifyDataHashInBackground(Position chunk_end);
+
+  // Waits for verification started by `VerifyDataHashInBackground()` if any,
+  // and fails `*this` if it failed.
+  //
+  // Return values:
+  //  * `true`  - success (`healthy()`)
+  //  * `false` - failure (`!healthy()`)
+  bool FinishDataHashVerification();
+
   // Reads or continues reading `block_header_`.
   //
   // Precondition: `internal::RemainingInBlockHeader(src_reader()->pos()) > 0`
@@ -222,6 +326,15 @@ class DefaultChunkReaderBase : public Object {
   // Invariant:
   //   if `recoverable_ != Recoverable::kNo` then `recoverable_pos_ >= pos_`
   Position recoverable_pos_ = 0;
+
+  // Algorithm of `data_hash` in chunk headers, valid if `hash_type_known_`.
+  // Taken from the file signature.
+  HashType hash_type_ = HashType::kHighwayHash;
+  bool hash_type_known_ = false;
+
+  bool verify_data_hashes_ = true;
+  bool verify_data_hashes_in_background_ = false;
+  PendingDataHash pending_data_hash_;
 };
 
 // A `ChunkReader` reads chunks of a Riegeli/records file (rather than
@@ -299,7 +412,13 @@ inline DefaultChunkReaderBase::DefaultChunkReaderBase(
       chunk_(std::move(that.chunk_)),
       block_header_(that.block_header_),
       recoverable_(std::exchange(that.recoverable_, Recoverable::kNo)),
-      recoverable_pos_(that.recoverable_pos_) {}
+      recoverable_pos_(that.recoverable_pos_),
+      hash_type_(that.hash_type_),
+      hash_type_known_(std::exchange(that.hash_type_known_, false)),
+      verify_data_hashes_(that.verify_data_hashes_),
+      verify_data_hashes_in_background_(
+          that.verify_data_hashes_in_background_),
+      pending_data_hash_(std::move(that.pending_data_hash_)) {}
 
 inline DefaultChunkReaderBase& DefaultChunkReaderBase::operator=(
     DefaultChunkReaderBase&& that) noexcept {
@@ -310,6 +429,11 @@ inline DefaultChunkReaderBase& DefaultChunkReaderBase::operator=(
   block_header_ = that.block_header_;
   recoverable_ = std::exchange(that.recoverable_, Recoverable::kNo);
   recoverable_pos_ = that.recoverable_pos_;
+  hash_type_ = that.hash_type_;
+  hash_type_known_ = std::exchange(that.hash_type_known_, false);
+  verify_data_hashes_ = that.verify_data_hashes_;
+  verify_data_hashes_in_background_ = that.verify_data_hashes_in_background_;
+  pending_data_hash_ = std::move(that.pending_data_hash_);
   return *this;
 }
 
@@ -320,6 +444,11 @@ inline void DefaultChunkReaderBase::Reset(InitiallyClosed) {
   chunk_.Reset();
   recoverable_ = Recoverable::kNo;
   recoverable_pos_ = 0;
+  hash_type_ = HashType::kHighwayHash;
+  hash_type_known_ = false;
+  verify_data_hashes_ = true;
+  verify_data_hashes_in_background_ = false;
+  pending_data_hash_ = PendingDataHash();
 }
 
 inline void DefaultChunkReaderBase::Reset(InitiallyOpen) {
@@ -329,6 +458,11 @@ inline void DefaultChunkReaderBase::Reset(InitiallyOpen) {
   chunk_.Reset();
   recoverable_ = Recoverable::kNo;
   recoverable_pos_ = 0;
+  hash_type_ = HashType::kHighwayHash;
+  hash_type_known_ = false;
+  verify_data_hashes_ = true;
+  verify_data_hashes_in_background_ = false;
+  pending_data_hash_ = PendingDataHash();
 }
 
 template <typename Src>
@@ -0,0 +1,285 @@
+// Copyright 2017 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "riegeli/records/chunk_statistics.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "absl/base/optimization.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/string_view.h"
+#include "absl/types/optional.h"
+#include "riegeli/base/base.h"
+#include "riegeli/base/canonical_errors.h"
+#include "riegeli/base/chain.h"
+#include "riegeli/base/endian.h"
+#include "riegeli/base/status.h"
+#include "riegeli/bytes/chain_reader.h"
+#include "riegeli/bytes/chain_writer.h"
+#include "riegeli/bytes/reader_utils.h"
+#include "riegeli/bytes/writer_utils.h"
+#include "riegeli/chunk_encoding/chunk.h"
+#include "riegeli/chunk_encoding/constants.h"
+#include "riegeli/chunk_encoding/field_projection.h"
+
+namespace riegeli {
+
+namespace {
+
+// Proto wire types.
+constexpr uint32_t kVarint = 0;
+constexpr uint32_t kFixed64 = 1;
+constexpr uint32_t kLengthDelimited = 2;
+constexpr uint32_t kFixed32 = 5;
+
+inline void AddValue(uint64_t value,
+                     ChunkStatistics::FieldStatistics* field_statistics) {
+  const bool first = field_statistics->num_values == 0;
+  if (first || value < field_statistics->min_value) {
+    field_statistics->min_value = value;
+  }
+  if (first || value > field_statistics->max_value) {
+    field_statistics->max_value = value;
+  }
+  ++field_statistics->num_values;
+}
+
+// Adds values of the field with the path `field_statistics->field.path()`
+// beginning at `depth` found in `message`.
+//
+// Returns `false` if `message` is not a valid proto message. Groups are
+// treated as invalid.
+bool AddValues(absl::string_view message, size_t depth,
+               ChunkStatistics::FieldStatistics* field_statistics) {
+  const Field::Path& path = field_statistics->field.path();
+  const bool last = depth + 1 == path.size();
+  const char* cursor = message.data();
+  const char* const limit = message.data() + message.size();
+  while (cursor < limit) {
+    uint32_t tag;
+    if (ABSL_PREDICT_FALSE(!ReadVarint32(&cursor, limit, &tag))) return false;
+    const bool matches = (tag >> 3) == path[depth];
+    switch (tag & 7) {
+      case kVarint: {
+        uint64_t value;
+        if (ABSL_PREDICT_FALSE(!ReadVarint64(&cursor, limit, &value))) {
+          return false;
+        }
+        if (matches && last) AddValue(value, field_statistics);
+      } break;
+      case kFixed64: {
+        if (ABSL_PREDICT_FALSE(PtrDistance(cursor, limit) < sizeof(uint64_t))) {
+          return false;
+        }
+        if (matches && last) {
+          uint64_t value;
+          std::memcpy(&value, cursor, sizeof(value));
+          AddValue(ReadLittleEndian64(value), field_statistics);
+        }
+        cursor += sizeof(uint64_t);
+      } break;
+      case kFixed32: {
+        if (ABSL_PREDICT_FALSE(PtrDistance(cursor, limit) < sizeof(uint32_t))) {
+          return false;
+        }
+        if (matches && last) {
+          uint32_t value;
+          std::memcpy(&value, cursor, sizeof(value));
+          AddValue(ReadLittleEndian32(value), field_statistics);
+        }
+        cursor += sizeof(uint32_t);
+      } break;
+      case kLengthDelimited: {
+        uint32_t length;
+        if (ABSL_PREDICT_FALSE(!ReadVarint32(&cursor, limit, &length) ||
+                               length > PtrDistance(cursor, limit))) {
+          return false;
+        }
+        if (matches && !last) {
+          // A field with the matching tag which is not a valid submessage is
+          // ignored, parsing continues after it.
+          AddValues(absl::string_view(cursor, length), depth + 1,
+                    field_statistics);
+        }
+        cursor += length;
+      } break;
+      default:
+        return false;
+    }
+  }
+  return true;
+}
+
+}  // namespace
+
+ChunkStatistics::ChunkStatistics(const std::vector<Field>& fields) {
+  fields_.reserve(fields.size());
+  for (const Field& field : fields) {
+    RIEGELI_ASSERT(!field.path().empty())
+        << "Failed precondition of ChunkStatistics::ChunkStatistics(): "
+           "empty field path";
+    RIEGELI_ASSERT_NE(field.path().back(), Field::kExistenceOnly)
+        << "Failed precondition of ChunkStatistics::ChunkStatistics(): "
+           "field path ends with kExistenceOnly";
+    fields_.emplace_back(field);
+  }
+}
+
+void ChunkStatistics::ClearValues() {
+  for (FieldStatistics& field_statistics : fields_) {
+    field_statistics.num_values = 0;
+    field_statistics.min_value = 0;
+    field_statistics.max_value = 0;
+  }
+  num_records_ = 0;
+}
+
+void ChunkStatistics::AddRecord(absl::string_view record) {
+  ++num_records_;
+  for (FieldStatistics& field_statistics : fields_) {
+    AddValues(record, 0, &field_statistics);
+  }
+}
+
+void ChunkStatistics::AddRecord(const Chain& record) {
+  if (fields_.empty()) {
+    ++num_records_;
+    return;
+  }
+  const absl::optional<absl::string_view> flat = record.TryFlat();
+  if (flat != absl::nullopt) {
+    AddRecord(*flat);
+    return;
+  }
+  AddRecord(absl::string_view(std::string(record)));
+}
+
+const ChunkStatistics::FieldStatistics* ChunkStatistics::Find(
+    const Field& field) const {
+  for (const FieldStatistics& field_statistics : fields_) {
+    if (field_statistics.field.path() == field.path()) return &field_statistics;
+  }
+  return nullptr;
+}
+
+bool ChunkStatistics::MayContain(const Field& field, uint64_t min_value,
+                                 uint64_t max_value) const {
+  const FieldStatistics* const field_statistics = Find(field);
+  if (field_statistics == nullptr) return true;
+  return field_statistics->num_values > 0 &&
+         field_statistics->min_value <= max_value &&
+         field_statistics->max_value >= min_value;
+}
+
+void ChunkStatistics::Encode(HashType hash_type, Chunk* chunk) const {
+  chunk->data.Clear();
+  ChainWriter<> data_writer(&chunk->data);
+  WriteVarint64(&data_writer, num_records_);
+  WriteVarint64(&data_writer, IntCast<uint64_t>(fields_.size()));
+  for (const FieldStatistics& field_statistics : fields_) {
+    const Field::Path& path = field_statistics.field.path();
+    WriteVarint64(&data_writer, IntCast<uint64_t>(path.size()));
+    for (const uint32_t tag : path) WriteVarint32(&data_writer, tag);
+    WriteVarint64(&data_writer, field_statistics.num_values);
+    if (field_statistics.num_values > 0) {
+      WriteVarint64(&data_writer, field_statistics.min_value);
+      WriteVarint64(&data_writer, field_statistics.max_value);
+    }
+  }
+  if (!data_writer.Close()) {
+    RIEGELI_ASSERT_UNREACHABLE()
+        << "Writing to a Chain failed: " << data_writer.status();
+  }
+  chunk->header =
+      ChunkHeader(chunk->data, ChunkType::kStatistics, 0, 0, hash_type);
+}
+
+Status ChunkStatistics::Decode(const Chunk& chunk) {
+  fields_.clear();
+  num_records_ = 0;
+  if (ABSL_PREDICT_FALSE(chunk.header.chunk_type() !=
+                         ChunkType::kStatistics)) {
+    return InvalidArgumentError(absl::StrCat(
+        "Not a statistics chunk, chunk type: ",
+        static_cast<uint64_t>(chunk.header.chunk_type())));
+  }
+  ChainReader<> data_reader(&chunk.data);
+  uint64_t num_fields;
+  if (ABSL_PREDICT_FALSE(!ReadVarint64(&data_reader, &num_records_) ||
+                         !ReadVarint64(&data_reader, &num_fields))) {
+    num_records_ = 0;
+    return DataLossError("Invalid statistics chunk: reading header failed");
+  }
+  // Each field takes at least 3 bytes.
+  if (ABSL_PREDICT_FALSE(num_fields > chunk.data.size() / 3)) {
+    num_records_ = 0;
+    return DataLossError(absl::StrCat(
+        "Invalid statistics chunk: too many fields: ", num_fields));
+  }
+  fields_.reserve(IntCast<size_t>(num_fields));
+  for (uint64_t i = 0; i < num_fields; ++i) {
+    uint64_t path_size;
+    if (ABSL_PREDICT_FALSE(!ReadVarint64(&data_reader, &path_size) ||
+                           path_size == 0 ||
+                           path_size > chunk.data.size())) {
+      goto invalid_field;
+    }
+    {
+      Field field;
+      for (uint64_t j = 0; j < path_size; ++j) {
+        uint32_t tag;
+        if (ABSL_PREDICT_FALSE(!ReadVarint32(&data_reader, &tag) ||
+                               tag == 0 || tag > (uint32_t{1} << 29) - 1)) {
+          goto invalid_field;
+        }
+        field.AddTag(tag);
+      }
+      fields_.emplace_back(std::move(field));
+    }
+    {
+      FieldStatistics& field_statistics = fields_.back();
+      if (ABSL_PREDICT_FALSE(
+              !ReadVarint64(&data_reader, &field_statistics.num_values))) {
+        goto invalid_field;
+      }
+      if (field_statistics.num_values > 0 &&
+          ABSL_PREDICT_FALSE(
+              !ReadVarint64(&data_reader, &field_statistics.min_value) ||
+              !ReadVarint64(&data_reader, &field_statistics.max_value) ||
+              field_statistics.min_value > field_statistics.max_value)) {
+        goto invalid_field;
+      }
+    }
+    continue;
+
+  invalid_field:
+    fields_.clear();
+    num_records_ = 0;
+    return DataLossError(
+        absl::StrCat("Invalid statistics chunk: invalid field at index ", i));
+  }
+  if (ABSL_PREDICT_FALSE(!data_reader.VerifyEndAndClose())) {
+    fields_.clear();
+    num_records_ = 0;
+    return DataLossError("Invalid statistics chunk: unexpected data at end");
+  }
+  return OkStatus();
+}
+
+}  // namespace riegeli
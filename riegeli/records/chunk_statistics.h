@@ -0,0 +1,118 @@
+// Copyright 2017 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef RIEGELI_RECORDS_CHUNK_STATISTICS_H_
+#define RIEGELI_RECORDS_CHUNK_STATISTICS_H_
+
+#include <stdint.h>
+
+#include <utility>
+#include <vector>
+
+#include "absl/strings/string_view.h"
+#include "riegeli/base/base.h"
+#include "riegeli/base/chain.h"
+#include "riegeli/base/status.h"
+#include "riegeli/chunk_encoding/chunk.h"
+#include "riegeli/chunk_encoding/constants.h"
+#include "riegeli/chunk_encoding/field_projection.h"
+
+namespace riegeli {
+
+// Statistics of records of a chunk: the number of records, and the range of
+// values of selected proto fields. This is stored in a statistics chunk, which
+// is written by `RecordWriter` immediately before the chunk it describes if
+// `set_chunk_statistics()` is used, and allows `RecordReader` to skip chunks
+// without reading them if `set_chunk_filter()` is used.
+//
+// Field values are taken from fields with varint, fixed64, and fixed32 wire
+// types, and are compared as `uint64_t`. This orders non-negative integers,
+// `bool`, and enums as expected, but not negative `int32`/`int64` values (which
+// are greater than positive values), `sint32`/`sint64` (which are compared in
+// their zigzag encoding), nor floating point values. Fields with other wire
+// types, including packed repeated fields, are ignored. All occurrences of a
+// repeated field contribute to its range.
+class ChunkStatistics {
+ public:
+  // Statistics of values of one field.
+  struct FieldStatistics {
+    explicit FieldStatistics(Field field) : field(std::move(field)) {}
+
+    Field field;
+    // The number of values of the field in all records.
+    uint64_t num_values = 0;
+    // The minimum and maximum value, valid if `num_values > 0`.
+    uint64_t min_value = 0;
+    uint64_t max_value = 0;
+  };
+
+  // Creates `ChunkStatistics` with no fields.
+  ChunkStatistics() noexcept {}
+
+  // Creates `ChunkStatistics` collecting values of `fields`.
+  //
+  // Precondition: `fields` are not empty paths and do not end with
+  // `Field::kExistenceOnly`
+  explicit ChunkStatistics(const std::vector<Field>& fields);
+
+  ChunkStatistics(const ChunkStatistics&) = default;
+  ChunkStatistics& operator=(const ChunkStatistics&) = default;
+
+  ChunkStatistics(ChunkStatistics&&) noexcept = default;
+  ChunkStatistics& operator=(ChunkStatistics&&) noexcept = default;
+
+  // Forgets records added so far, keeping the set of fields.
+  void ClearValues();
+
+  // Updates statistics with the next record, a serialized proto message.
+  //
+  // Record contents which are not a valid proto message are ignored from the
+  // first invalid field.
+  void AddRecord(absl::string_view record);
+  void AddRecord(const Chain& record);
+
+  // Returns the number of records added so far.
+  uint64_t num_records() const { return num_records_; }
+
+  // Returns statistics of all fields.
+  const std::vector<FieldStatistics>& fields() const { return fields_; }
+
+  // Returns statistics of `field`, or `nullptr` if they are not collected.
+  const FieldStatistics* Find(const Field& field) const;
+
+  // Returns `false` if no record has a value of `field` in the range
+  // [`min_value`, `max_value`], or `true` if some record might have such value,
+  // including the case when statistics of `field` are not collected.
+  bool MayContain(const Field& field, uint64_t min_value,
+                  uint64_t max_value) const;
+
+  // Encodes statistics as a statistics chunk, computing `data_hash` with
+  // `hash_type`.
+  void Encode(HashType hash_type, Chunk* chunk) const;
+
+  // Decodes statistics from a statistics chunk.
+  //
+  // Returns status:
+  //  * `status.ok()`  - success
+  //  * `!status.ok()` - failure (`*this` has no fields)
+  Status Decode(const Chunk& chunk);
+
+ private:
+  std::vector<FieldStatistics> fields_;
+  uint64_t num_records_ = 0;
+};
+
+}  // namespace riegeli
+
+#endif  // RIEGELI_RECORDS_CHUNK_STATISTICS_H_
@@ -23,8 +23,10 @@
 #include "absl/strings/string_view.h"
 #include "absl/types/span.h"
 #include "riegeli/base/base.h"
+#include "riegeli/base/canonical_errors.h"
 #include "riegeli/base/chain.h"
 #include "riegeli/base/status.h"
+#include "riegeli/base/tracing.h"
 #include "riegeli/bytes/chain_reader.h"
 #include "riegeli/bytes/reader.h"
 #include "riegeli/bytes/string_reader.h"
@@ -37,8 +39,28 @@
 
 namespace riegeli {
 
+namespace {
+
+// Returns `true` if `data_hash` is the hash of `data` with some `HashType`.
+// The `HashType` of the file is not known to the `ChunkWriter`.
+bool IsPossibleDataHash(uint64_t data_hash, const Chain& data) {
+  for (int hash_type = 0; hash_type <= static_cast<int>(kMaxHashType);
+       ++hash_type) {
+    if (data_hash == internal::Hash(static_cast<HashType>(hash_type), data)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+}  // namespace
+
 ChunkWriter::~ChunkWriter() {}
 
+bool ChunkWriter::Truncate(Position new_pos) {
+  return Fail(UnimplementedError("ChunkWriter::Truncate() not supported"));
+}
+
 void DefaultChunkWriterBase::Initialize(Writer* dest, Position pos) {
   RIEGELI_ASSERT(dest != nullptr)
       << "Failed precondition of DefaultChunkWriter: null Writer pointer";
@@ -52,10 +74,11 @@ void DefaultChunkWriterBase::Initialize(Writer* dest, Position pos) {
 }
 
 bool DefaultChunkWriterBase::WriteChunk(const Chunk& chunk) {
-  RIEGELI_ASSERT_EQ(chunk.header.data_hash(), internal::Hash(chunk.data))
+  RIEGELI_ASSERT(IsPossibleDataHash(chunk.header.data_hash(), chunk.data))
       << "Failed precondition of ChunkWriter::WriteChunk(): "
          "Wrong chunk data hash";
   if (ABSL_PREDICT_FALSE(!healthy())) return false;
+  const TraceScope trace("WriteChunk");
   // Matches `FutureRecordPosition::FutureChunkBegin::Resolve()`.
   Writer* const dest = dest_writer();
   StringReader<> header_reader(
@@ -132,7 +155,7 @@ inline bool DefaultChunkWriterBase::WritePadding(Position chunk_begin,
   return true;
 }
 
-bool DefaultChunkWriterBase::PadToBlockBoundary() {
+bool DefaultChunkWriterBase::PadToBlockBoundary(HashType hash_type) {
   if (ABSL_PREDICT_FALSE(!healthy())) return false;
   // Matches `FutureRecordPosition::FutureChunkBegin::Resolve()`.
   size_t length = IntCast<size_t>(internal::RemainingInBlock(pos_));
@@ -145,7 +168,21 @@ bool DefaultChunkWriterBase::PadToBlockBoundary() {
   Chunk chunk;
   const absl::Span<char> buffer = chunk.data.AppendFixedBuffer(length, length);
   std::memset(buffer.data(), '\0', buffer.size());
-  chunk.header = ChunkHeader(chunk.data, ChunkType::kPadding, 0, 0);
+  chunk.header = ChunkHeader(chunk.data, ChunkType::kPadding, 0, 0, hash_type);
+  return WriteChunk(chunk);
+}
+
+bool DefaultChunkWriterBase::AlignChunkData(HashType hash_type) {
+  if (ABSL_PREDICT_FALSE(!healthy())) return false;
+  // Matches `FutureRecordPosition::FutureChunkBegin::Resolve()`.
+  const Position chunk_end = internal::AlignedChunkBegin(pos_);
+  if (chunk_end == pos_) return true;
+  const size_t length = IntCast<size_t>(
+      internal::DistanceWithoutOverhead(pos_, chunk_end) - ChunkHeader::size());
+  Chunk chunk;
+  const absl::Span<char> buffer = chunk.data.AppendFixedBuffer(length, length);
+  std::memset(buffer.data(), '\0', buffer.size());
+  chunk.header = ChunkHeader(chunk.data, ChunkType::kPadding, 0, 0, hash_type);
   return WriteChunk(chunk);
 }
 
@@ -156,4 +193,27 @@ bool DefaultChunkWriterBase::Flush(FlushType flush_type) {
   return true;
 }
 
+bool DefaultChunkWriterBase::SupportsTruncate() const {
+  const Writer* const dest = dest_writer();
+  return dest != nullptr && dest->SupportsTruncate();
+}
+
+bool DefaultChunkWriterBase::Truncate(Position new_pos) {
+  RIEGELI_ASSERT_LE(new_pos, pos_)
+      << "Failed precondition of ChunkWriter::Truncate(): "
+         "position after the end";
+  if (ABSL_PREDICT_FALSE(!healthy())) return false;
+  Writer* const dest = dest_writer();
+  // `pos_` can differ from `dest->pos()` by `Options::set_assumed_pos()`.
+  RIEGELI_ASSERT_LE(pos_ - new_pos, dest->pos())
+      << "Failed precondition of ChunkWriter::Truncate(): "
+         "position before the beginning of the destination";
+  if (ABSL_PREDICT_FALSE(!dest->Truncate(dest->pos() - (pos_ - new_pos)))) {
+    if (ABSL_PREDICT_FALSE(!dest->healthy())) return Fail(*dest);
+    return Fail(DataLossError("Riegeli/records file shrank unexpectedly"));
+  }
+  pos_ = new_pos;
+  return true;
+}
+
 }  // namespace riegeli
@@ -27,6 +27,7 @@
 #include "riegeli/bytes/reader.h"
 #include "riegeli/bytes/writer.h"
 #include "riegeli/chunk_encoding/chunk.h"
+#include "riegeli/chunk_encoding/constants.h"
 
 namespace riegeli {
 
@@ -55,10 +56,22 @@ class ChunkWriter : public Object {
 
   // Writes padding to reach a 64KB block boundary.
   //
+  // `hash_type` must match the hash type stored in the file signature.
+  //
+  // Return values:
+  //  * `true`  - success (`healthy()`)
+  //  * `false` - failure (`!healthy()`)
+  virtual bool PadToBlockBoundary(HashType hash_type) = 0;
+
+  // Writes padding so that data of the next chunk begin at a multiple of 4KB,
+  // outside of a block header.
+  //
+  // `hash_type` must match the hash type stored in the file signature.
+  //
   // Return values:
   //  * `true`  - success (`healthy()`)
   //  * `false` - failure (`!healthy()`)
-  virtual bool PadToBlockBoundary() = 0;
+  virtual bool AlignChunkData(HashType hash_type) = 0;
 
   // Pushes buffered data to the destination.
   //
@@ -77,6 +90,17 @@ class ChunkWriter : public Object {
   //  * `false` - failure (`!healthy()`)
   virtual bool Flush(FlushType flush_type) = 0;
 
+  // Returns `true` if this `ChunkWriter` supports `Truncate()`.
+  virtual bool SupportsTruncate() const { return false; }
+
+  // Discards the part of the destination after the given position, which
+  // should be a chunk boundary. Sets the current position to the new end.
+  //
+  // Return values:
+  //  * `true`  - success (`healthy()`)
+  //  * `false` - failure (`!healthy()`)
+  virtual bool Truncate(Position new_pos);
+
   // Returns the current byte position. Unchanged by `Close()`.
   Position pos() const { return pos_; }
 
@@ -121,8 +145,11 @@ class DefaultChunkWriterBase : public ChunkWriter {
   virtual const Writer* dest_writer() const = 0;
 
   bool WriteChunk(const Chunk& chunk) override;
-  bool PadToBlockBoundary() override;
+  bool PadToBlockBoundary(HashType hash_type) override;
+  bool AlignChunkData(HashType hash_type) override;
   bool Flush(FlushType flush_type) override;
+  bool SupportsTruncate() const override;
+  bool Truncate(Position new_pos) override;
 
  protected:
   explicit DefaultChunkWriterBase(InitiallyClosed)
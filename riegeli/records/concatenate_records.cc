@@ -0,0 +1,518 @@
+// Copyright 2019 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "riegeli/records/concatenate_records.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "absl/base/optimization.h"
+#include "absl/strings/str_cat.h"
+#include "absl/synchronization/blocking_counter.h"
+#include "absl/types/span.h"
+#include "riegeli/base/base.h"
+#include "riegeli/base/canonical_errors.h"
+#include "riegeli/base/chain.h"
+#include "riegeli/base/parallelism.h"
+#include "riegeli/base/status.h"
+#include "riegeli/bytes/chain_writer.h"
+#include "riegeli/bytes/brotli_dictionary.h"
+#include "riegeli/bytes/zstd_dictionary.h"
+#include "riegeli/chunk_encoding/chunk.h"
+#include "riegeli/chunk_encoding/chunk_decoder.h"
+#include "riegeli/chunk_encoding/chunk_encoder.h"
+#include "riegeli/chunk_encoding/compressor_options.h"
+#include "riegeli/chunk_encoding/constants.h"
+#include "riegeli/chunk_encoding/simple_encoder.h"
+#include "riegeli/chunk_encoding/transpose_encoder.h"
+#include "riegeli/records/chunk_index.h"
+#include "riegeli/records/chunk_reader.h"
+#include "riegeli/records/chunk_writer.h"
+
+namespace riegeli {
+
+namespace {
+
+// The maximum number of chunks held before writing them, which bounds memory
+// used by chunks copied while runs of small chunks are re-encoded.
+constexpr size_t kMaxQueuedChunks = 256;
+
+// A chunk to be written to the result, either copied from a source, or
+// re-encoded from a run of small chunks.
+struct PendingChunk {
+  // A chunk to be decoded and re-encoded, together with the dictionary it was
+  // encoded with and the shared transposition header and the chunk prefix it
+  // refers to, if any.
+  struct Input {
+    Chunk chunk;
+    ZstdDictionary zstd_dictionary;
+    Chain shared_transpose_header;
+    ZstdDictionary chunk_prefix;
+  };
+
+  // The chunk to write. If `!inputs.empty()`, this is set by `Reencode()`.
+  Chunk chunk;
+  std::vector<Input> inputs;
+  // The total `decoded_data_size` of `inputs`.
+  uint64_t inputs_size = 0;
+  // Failure of `Reencode()`.
+  Status status;
+};
+
+class Concatenator {
+ public:
+  explicit Concatenator(ChunkWriter* dest,
+                        const ConcatenateRecordsOptions& options);
+
+  Concatenator(const Concatenator&) = delete;
+  Concatenator& operator=(const Concatenator&) = delete;
+
+  // Writes the file signature.
+  Status Begin();
+
+  // Reads `*src` until it ends, writing or queueing its chunks.
+  Status AddSource(size_t src_index, ChunkReader* src);
+
+  // Writes remaining chunks, and the index chunk if requested.
+  Status End();
+
+ private:
+  Status AddDictionary(size_t src_index, const Chunk& chunk);
+  Status AddRecordsChunk(Chunk&& chunk, const ZstdDictionary& zstd_dictionary,
+                         const Chain& shared_transpose_header,
+                         const ZstdDictionary& chunk_prefix);
+
+  // Recomputes the header of a chunk from a source with `src_hash_type`, if
+  // that differs from the hash type of the result.
+  void Rehash(HashType src_hash_type, Chunk* chunk) const;
+
+  // Queues the run of small chunks being collected, if any.
+  Status CloseRun();
+  Status Enqueue(PendingChunk&& pending_chunk);
+
+  // Re-encodes queued runs of small chunks, possibly in parallel, and writes
+  // all queued chunks.
+  Status Flush();
+  void Reencode(PendingChunk* pending_chunk) const;
+  Status WriteChunk(const Chunk& chunk);
+
+  ChunkWriter* const dest_;
+  const HashType hash_type_;
+  const bool write_index_;
+  const uint64_t min_chunk_size_;
+  // Compressor options of re-encoded chunks, with the dictionary of the result.
+  CompressorOptions compressor_options_;
+  const bool transpose_;
+  const size_t parallelism_;
+
+  // Whether file metadata have been written or can no longer be written,
+  // because another chunk already follows the file signature.
+  bool metadata_done_ = false;
+  // Whether a chunk containing records has been seen. The dictionary of the
+  // result must precede it.
+  bool records_started_ = false;
+  bool has_dictionary_ = false;
+  // Contents of the dictionary chunk of the result, if `has_dictionary_`.
+  Chain dictionary_;
+  // A statistics chunk describing the next chunk. It is written only if that
+  // chunk is copied, because statistics of a re-encoded run are not known.
+  bool has_statistics_ = false;
+  Chunk statistics_;
+  // The run of small chunks being collected, if `!run_.inputs.empty()`.
+  PendingChunk run_;
+  // Chunks waiting for queued runs to be re-encoded.
+  std::vector<PendingChunk> queue_;
+  size_t num_queued_runs_ = 0;
+  ChunkIndex index_;
+};
+
+Concatenator::Concatenator(ChunkWriter* dest,
+                           const ConcatenateRecordsOptions& options)
+    : dest_(dest),
+      hash_type_(options.hash_type()),
+      write_index_(options.index()),
+      min_chunk_size_(options.min_chunk_size()),
+      compressor_options_(CompressorOptions(options.compressor_options())
+                              .set_brotli_dictionary(BrotliDictionary())
+                              .set_zstd_dictionary(ZstdDictionary())),
+      transpose_(options.transpose()),
+      parallelism_(IntCast<size_t>(options.parallelism())) {}
+
+Status Concatenator::Begin() {
+  // `decoded_data_size` of the file signature stores the hash type.
+  Chunk chunk;
+  chunk.header = ChunkHeader(chunk.data, ChunkType::kFileSignature, 0,
+                             static_cast<uint64_t>(hash_type_), hash_type_);
+  return WriteChunk(chunk);
+}
+
+Status Concatenator::AddSource(size_t src_index, ChunkReader* src) {
+  HashType src_hash_type = HashType::kHighwayHash;
+  ZstdDictionary src_zstd_dictionary;
+  Chain src_shared_transpose_header;
+  Position src_shared_transpose_header_pos = 0;
+  Chunk src_chunk_prefix_source;
+  Position src_chunk_prefix_source_pos = 0;
+  ZstdDictionary src_chunk_prefix;
+  Position src_chunk_prefix_pos = 0;
+  for (;;) {
+    const Position chunk_begin = src->pos();
+    Chunk chunk;
+    if (ABSL_PREDICT_FALSE(!src->ReadChunk(&chunk))) {
+      if (ABSL_PREDICT_FALSE(!src->healthy())) {
+        return Annotate(src->status(),
+                        absl::StrCat("reading source ", src_index));
+      }
+      break;
+    }
+    // `chunk` can be moved from below.
+    const ChunkType chunk_type = chunk.header.chunk_type();
+    switch (chunk_type) {
+      case ChunkType::kFileSignature:
+        if (chunk_begin == 0) {
+          src_hash_type =
+              static_cast<HashType>(chunk.header.decoded_data_size());
+        }
+        break;
+      case ChunkType::kFileMetadata:
+        if (!metadata_done_) {
+          metadata_done_ = true;
+          Rehash(src_hash_type, &chunk);
+          PendingChunk pending_chunk;
+          pending_chunk.chunk = std::move(chunk);
+          Status status = Enqueue(std::move(pending_chunk));
+          if (ABSL_PREDICT_FALSE(!status.ok())) return status;
+        }
+        break;
+      case ChunkType::kPadding:
+      case ChunkType::kIndex:
+      case ChunkType::kKeyFilters:
+      case ChunkType::kFirstKeys:
+        // These describe the layout of the source, and would be wrong in the
+        // result.
+        break;
+      case ChunkType::kDictionary: {
+        src_zstd_dictionary = ZstdDictionary(std::string(chunk.data));
+        Rehash(src_hash_type, &chunk);
+        Status status = AddDictionary(src_index, chunk);
+        if (ABSL_PREDICT_FALSE(!status.ok())) return status;
+      } break;
+      case ChunkType::kStatistics:
+        Rehash(src_hash_type, &chunk);
+        has_statistics_ = true;
+        statistics_ = std::move(chunk);
+        break;
+      case ChunkType::kSharedTransposeHeader:
+        // This is referred to by its position in the source, so it is not
+        // copied. Chunks referring to it are re-encoded instead.
+        src_shared_transpose_header = std::move(chunk.data);
+        src_shared_transpose_header_pos = chunk_begin;
+        break;
+      default: {
+        Rehash(src_hash_type, &chunk);
+        uint64_t distance;
+        const bool has_shared_transpose_header =
+            ChunkDecoder::SharedTransposeHeaderDistance(chunk, &distance) &&
+            !src_shared_transpose_header.empty() &&
+            distance == chunk_begin - src_shared_transpose_header_pos;
+        // A chunk with a prefix refers to an earlier simple chunk, which is
+        // decoded again to compute the prefix.
+        bool has_chunk_prefix = false;
+        if (chunk_type == ChunkType::kSimple) {
+          src_chunk_prefix_source = chunk;
+          src_chunk_prefix_source_pos = chunk_begin;
+        } else if (ChunkDecoder::ChunkPrefixDistance(chunk, &distance) &&
+                   distance == chunk_begin - src_chunk_prefix_source_pos) {
+          if (src_chunk_prefix.empty() ||
+              src_chunk_prefix_pos != src_chunk_prefix_source_pos) {
+            src_chunk_prefix = ZstdDictionary();
+            if (ChunkDecoder::ChunkPrefix(src_chunk_prefix_source,
+                                          src_zstd_dictionary,
+                                          &src_chunk_prefix)) {
+              src_chunk_prefix_pos = src_chunk_prefix_source_pos;
+            }
+          }
+          has_chunk_prefix = true;
+        }
+        Status status = AddRecordsChunk(
+            std::move(chunk), src_zstd_dictionary,
+            has_shared_transpose_header ? src_shared_transpose_header
+                                        : Chain(),
+            has_chunk_prefix ? src_chunk_prefix : ZstdDictionary());
+        if (ABSL_PREDICT_FALSE(!status.ok())) return status;
+      } break;
+    }
+    if (chunk_type != ChunkType::kFileSignature) {
+      metadata_done_ = true;
+    }
+  }
+  // Statistics not followed by a chunk in the same source are not useful.
+  has_statistics_ = false;
+  statistics_ = Chunk();
+  return OkStatus();
+}
+
+inline void Concatenator::Rehash(HashType src_hash_type, Chunk* chunk) const {
+  if (src_hash_type == hash_type_) return;
+  chunk->header = ChunkHeader(chunk->data, chunk->header.chunk_type(),
+                              chunk->header.num_records(),
+                              chunk->header.decoded_data_size(), hash_type_);
+}
+
+Status Concatenator::AddDictionary(size_t src_index, const Chunk& chunk) {
+  if (has_dictionary_) {
+    if (ABSL_PREDICT_TRUE(chunk.data == dictionary_)) return OkStatus();
+    return FailedPreconditionError(absl::StrCat(
+        "Source ", src_index, " uses a different Zstd dictionary"));
+  }
+  if (ABSL_PREDICT_FALSE(records_started_)) {
+    return FailedPreconditionError(
+        absl::StrCat("Source ", src_index,
+                     " uses a Zstd dictionary but earlier sources contain "
+                     "records without it"));
+  }
+  has_dictionary_ = true;
+  dictionary_ = chunk.data;
+  compressor_options_
+      .set_brotli_dictionary(BrotliDictionary(std::string(dictionary_)))
+      .set_zstd_dictionary(ZstdDictionary(std::string(dictionary_)));
+  PendingChunk pending_chunk;
+  pending_chunk.chunk = chunk;
+  return Enqueue(std::move(pending_chunk));
+}
+
+Status Concatenator::AddRecordsChunk(Chunk&& chunk,
+                                     const ZstdDictionary& zstd_dictionary,
+                                     const Chain& shared_transpose_header,
+                                     const ZstdDictionary& chunk_prefix) {
+  records_started_ = true;
+  // A chunk with a shared transposition header or a chunk prefix is always
+  // re-encoded, because it refers to another chunk by its position in the
+  // source.
+  if ((chunk.header.decoded_data_size() < min_chunk_size_ &&
+       chunk.header.num_records() > 0 &&
+       (chunk.header.chunk_type() == ChunkType::kSimple ||
+        chunk.header.chunk_type() == ChunkType::kSimpleWithBlocks ||
+        chunk.header.chunk_type() == ChunkType::kSimpleWithReferences ||
+        chunk.header.chunk_type() == ChunkType::kTransposed ||
+        chunk.header.chunk_type() ==
+            ChunkType::kTransposedWithBufferEncodings)) ||
+      chunk.header.chunk_type() == ChunkType::kTransposedWithSharedHeader ||
+      chunk.header.chunk_type() == ChunkType::kSimpleWithPrefix) {
+    has_statistics_ = false;
+    statistics_ = Chunk();
+    run_.inputs_size += chunk.header.decoded_data_size();
+    run_.inputs.push_back(PendingChunk::Input{std::move(chunk),
+                                              zstd_dictionary,
+                                              shared_transpose_header,
+                                              chunk_prefix});
+    if (run_.inputs_size >= min_chunk_size_) return CloseRun();
+    return OkStatus();
+  }
+  {
+    Status status = CloseRun();
+    if (ABSL_PREDICT_FALSE(!status.ok())) return status;
+  }
+  if (has_statistics_) {
+    has_statistics_ = false;
+    PendingChunk pending_statistics;
+    pending_statistics.chunk = std::move(statistics_);
+    statistics_ = Chunk();
+    Status status = Enqueue(std::move(pending_statistics));
+    if (ABSL_PREDICT_FALSE(!status.ok())) return status;
+  }
+  PendingChunk pending_chunk;
+  pending_chunk.chunk = std::move(chunk);
+  return Enqueue(std::move(pending_chunk));
+}
+
+Status Concatenator::CloseRun() {
+  if (run_.inputs.empty()) return OkStatus();
+  PendingChunk run = std::move(run_);
+  run_ = PendingChunk();
+  return Enqueue(std::move(run));
+}
+
+Status Concatenator::Enqueue(PendingChunk&& pending_chunk) {
+  if (pending_chunk.inputs.empty()) {
+    // A chunk which does not need re-encoding is written immediately unless
+    // it must wait for a queued run.
+    if (queue_.empty()) return WriteChunk(pending_chunk.chunk);
+  } else {
+    ++num_queued_runs_;
+  }
+  queue_.push_back(std::move(pending_chunk));
+  if (num_queued_runs_ > parallelism_ || queue_.size() >= kMaxQueuedChunks) {
+    return Flush();
+  }
+  return OkStatus();
+}
+
+Status Concatenator::Flush() {
+  std::vector<PendingChunk*> runs;
+  runs.reserve(num_queued_runs_);
+  for (PendingChunk& pending_chunk : queue_) {
+    if (!pending_chunk.inputs.empty()) runs.push_back(&pending_chunk);
+  }
+  const auto reencode_runs = [&](std::atomic<size_t>* next_run) {
+    for (;;) {
+      const size_t index = next_run->fetch_add(1, std::memory_order_relaxed);
+      if (index >= runs.size()) return;
+      Reencode(runs[index]);
+    }
+  };
+  std::atomic<size_t> next_run{0};
+  const size_t num_helpers =
+      runs.size() <= 1 ? size_t{0}
+                       : UnsignedMin(parallelism_, runs.size() - 1);
+  if (num_helpers == 0) {
+    reencode_runs(&next_run);
+  } else {
+    absl::BlockingCounter helpers_done(IntCast<int>(num_helpers));
+    for (size_t i = 0; i < num_helpers; ++i) {
+      ThreadPool::global().Schedule([&] {
+        reencode_runs(&next_run);
+        helpers_done.DecrementCount();
+      });
+    }
+    reencode_runs(&next_run);
+    helpers_done.Wait();
+  }
+  std::vector<PendingChunk> queue = std::move(queue_);
+  queue_.clear();
+  num_queued_runs_ = 0;
+  for (const PendingChunk& pending_chunk : queue) {
+    if (ABSL_PREDICT_FALSE(!pending_chunk.status.ok())) {
+      return pending_chunk.status;
+    }
+    Status status = WriteChunk(pending_chunk.chunk);
+    if (ABSL_PREDICT_FALSE(!status.ok())) return status;
+  }
+  return OkStatus();
+}
+
+void Concatenator::Reencode(PendingChunk* pending_chunk) const {
+  std::unique_ptr<ChunkEncoder> chunk_encoder;
+  if (transpose_) {
+    chunk_encoder = std::make_unique<TransposeEncoder>(
+        compressor_options_, std::numeric_limits<uint64_t>::max());
+  } else {
+    chunk_encoder = std::make_unique<SimpleEncoder>(
+        compressor_options_, pending_chunk->inputs_size);
+  }
+  ChunkDecoder chunk_decoder;
+  for (const PendingChunk::Input& input : pending_chunk->inputs) {
+    chunk_decoder.Reset(
+        ChunkDecoder::Options().set_zstd_dictionary(input.zstd_dictionary));
+    if (ABSL_PREDICT_FALSE(!chunk_decoder.Decode(
+            input.chunk, input.shared_transpose_header, input.chunk_prefix))) {
+      pending_chunk->status = chunk_decoder.status();
+      return;
+    }
+    absl::Span<const absl::string_view> records;
+    while (chunk_decoder.ReadRecords(&records)) {
+      if (ABSL_PREDICT_FALSE(!chunk_encoder->AddRecords(records))) {
+        pending_chunk->status = chunk_encoder->status();
+        return;
+      }
+    }
+    if (ABSL_PREDICT_FALSE(!chunk_decoder.healthy())) {
+      pending_chunk->status = chunk_decoder.status();
+      return;
+    }
+  }
+  pending_chunk->inputs = std::vector<PendingChunk::Input>();
+  ChainWriter<> data_writer(&pending_chunk->chunk.data);
+  ChunkType chunk_type;
+  uint64_t num_records;
+  uint64_t decoded_data_size;
+  if (ABSL_PREDICT_FALSE(!chunk_encoder->EncodeAndClose(
+          &data_writer, &chunk_type, &num_records, &decoded_data_size))) {
+    pending_chunk->status = chunk_encoder->status();
+    return;
+  }
+  if (ABSL_PREDICT_FALSE(!data_writer.Close())) {
+    pending_chunk->status = data_writer.status();
+    return;
+  }
+  pending_chunk->chunk.header =
+      ChunkHeader(pending_chunk->chunk.data, chunk_type, num_records,
+                  decoded_data_size, hash_type_);
+}
+
+Status Concatenator::WriteChunk(const Chunk& chunk) {
+  const Position chunk_begin = dest_->pos();
+  if (ABSL_PREDICT_FALSE(!dest_->WriteChunk(chunk))) return dest_->status();
+  if (write_index_) index_.Add(chunk_begin, chunk.header.num_records());
+  return OkStatus();
+}
+
+Status Concatenator::End() {
+  {
+    Status status = CloseRun();
+    if (ABSL_PREDICT_FALSE(!status.ok())) return status;
+  }
+  {
+    Status status = Flush();
+    if (ABSL_PREDICT_FALSE(!status.ok())) return status;
+  }
+  if (write_index_) {
+    Chunk index_chunk;
+    index_.Encode(dest_->pos(), hash_type_, &index_chunk);
+    if (ABSL_PREDICT_FALSE(!dest_->WriteChunk(index_chunk))) {
+      return dest_->status();
+    }
+  }
+  return OkStatus();
+}
+
+}  // namespace
+
+Status ConcatenateRecords(
+    size_t num_srcs,
+    std::function<std::unique_ptr<ChunkReader>(size_t src_index)> open_src,
+    ChunkWriter* dest, ConcatenateRecordsOptions options) {
+  if (ABSL_PREDICT_FALSE(!dest->healthy())) return dest->status();
+  Concatenator concatenator(dest, options);
+  {
+    Status status = concatenator.Begin();
+    if (ABSL_PREDICT_FALSE(!status.ok())) return status;
+  }
+  for (size_t src_index = 0; src_index < num_srcs; ++src_index) {
+    const std::unique_ptr<ChunkReader> src = open_src(src_index);
+    if (ABSL_PREDICT_FALSE(src == nullptr)) {
+      return InvalidArgumentError(
+          absl::StrCat("Opening source ", src_index, " failed"));
+    }
+    {
+      Status status = concatenator.AddSource(src_index, src.get());
+      if (ABSL_PREDICT_FALSE(!status.ok())) return status;
+    }
+    if (ABSL_PREDICT_FALSE(!src->Close())) {
+      return Annotate(src->status(),
+                      absl::StrCat("closing source ", src_index));
+    }
+  }
+  return concatenator.End();
+}
+
+}  // namespace riegeli
@@ -0,0 +1,173 @@
+// Copyright 2019 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef RIEGELI_RECORDS_CONCATENATE_RECORDS_H_
+#define RIEGELI_RECORDS_CONCATENATE_RECORDS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <functional>
+#include <memory>
+#include <utility>
+
+#include "riegeli/base/base.h"
+#include "riegeli/base/status.h"
+#include "riegeli/chunk_encoding/compressor_options.h"
+#include "riegeli/chunk_encoding/constants.h"
+#include "riegeli/records/chunk_reader.h"
+#include "riegeli/records/chunk_writer.h"
+
+namespace riegeli {
+
+class ConcatenateRecordsOptions {
+ public:
+  ConcatenateRecordsOptions() noexcept {}
+
+  // Sets the algorithm of `data_hash` in chunk headers of the result. Chunks of
+  // sources with a different hash type have their headers recomputed.
+  //
+  // Default: `HashType::kHighwayHash`
+  ConcatenateRecordsOptions& set_hash_type(HashType hash_type) & {
+    hash_type_ = hash_type;
+    return *this;
+  }
+  ConcatenateRecordsOptions&& set_hash_type(HashType hash_type) && {
+    return std::move(set_hash_type(hash_type));
+  }
+  HashType hash_type() const { return hash_type_; }
+
+  // If `true`, an index chunk describing the result is written at its end,
+  // like with `RecordWriterBase::Options::set_index()`.
+  //
+  // Index, key filter, and first key chunks of sources are always dropped,
+  // because they describe positions in the sources.
+  //
+  // Default: `false`
+  ConcatenateRecordsOptions& set_index(bool index) & {
+    index_ = index;
+    return *this;
+  }
+  ConcatenateRecordsOptions&& set_index(bool index) && {
+    return std::move(set_index(index));
+  }
+  bool index() const { return index_; }
+
+  // If positive, chunks containing records with `decoded_data_size` below
+  // `min_chunk_size` are decoded, and runs of consecutive such chunks, also
+  // across sources, are re-encoded together into chunks of about
+  // `min_chunk_size` bytes. Other chunks are copied without decoding, except
+  // for transposed chunks with a shared header, which refer to the header by
+  // its position in the source and are therefore always re-encoded.
+  //
+  // Default: 0 (no re-encoding other than of chunks with a shared header)
+  ConcatenateRecordsOptions& set_min_chunk_size(uint64_t min_chunk_size) & {
+    min_chunk_size_ = min_chunk_size;
+    return *this;
+  }
+  ConcatenateRecordsOptions&& set_min_chunk_size(uint64_t min_chunk_size) && {
+    return std::move(set_min_chunk_size(min_chunk_size));
+  }
+  uint64_t min_chunk_size() const { return min_chunk_size_; }
+
+  // Sets compression of re-encoded chunks. The Zstd dictionary is ignored;
+  // the dictionary of the sources is used instead.
+  //
+  // Default: `CompressorOptions()`
+  ConcatenateRecordsOptions& set_compressor_options(
+      CompressorOptions compressor_options) & {
+    compressor_options_ = std::move(compressor_options);
+    return *this;
+  }
+  ConcatenateRecordsOptions&& set_compressor_options(
+      CompressorOptions compressor_options) && {
+    return std::move(set_compressor_options(std::move(compressor_options)));
+  }
+  const CompressorOptions& compressor_options() const {
+    return compressor_options_;
+  }
+
+  // If `true`, re-encoded chunks are transposed, like with
+  // `RecordWriterBase::Options::set_transpose()`.
+  //
+  // Default: `false`
+  ConcatenateRecordsOptions& set_transpose(bool transpose) & {
+    transpose_ = transpose;
+    return *this;
+  }
+  ConcatenateRecordsOptions&& set_transpose(bool transpose) && {
+    return std::move(set_transpose(transpose));
+  }
+  bool transpose() const { return transpose_; }
+
+  // Sets the maximum number of chunks re-encoded concurrently in background
+  // threads. If 0, chunks are re-encoded in the calling thread.
+  //
+  // Default: 0
+  ConcatenateRecordsOptions& set_parallelism(int parallelism) & {
+    RIEGELI_ASSERT_GE(parallelism, 0)
+        << "Failed precondition of "
+           "ConcatenateRecordsOptions::set_parallelism(): "
+           "negative parallelism";
+    parallelism_ = parallelism;
+    return *this;
+  }
+  ConcatenateRecordsOptions&& set_parallelism(int parallelism) && {
+    return std::move(set_parallelism(parallelism));
+  }
+  int parallelism() const { return parallelism_; }
+
+ private:
+  HashType hash_type_ = HashType::kHighwayHash;
+  bool index_ = false;
+  uint64_t min_chunk_size_ = 0;
+  CompressorOptions compressor_options_;
+  bool transpose_ = false;
+  int parallelism_ = 0;
+};
+
+// Concatenates Riegeli/records files at the chunk level, writing to `dest` a
+// file containing records of all sources in order.
+//
+// Chunks are copied without decoding them, except for chunks re-encoded
+// because of `ConcatenateRecordsOptions::set_min_chunk_size()`. Block headers
+// of the result are written by `dest` for the new chunk positions. Only one
+// file signature is written, and only the file metadata of the first source
+// are kept. Padding, index, key filter, and first key chunks of sources are
+// dropped.
+//
+// Sources are opened by `open_src` one at a time, in the order of their
+// indices, `0 <= src_index < num_srcs`, and destroyed when they end, so any
+// number of sources can be concatenated. `open_src` may return a failed
+// `ChunkReader`.
+//
+// A Zstd dictionary applies to all chunks following it, so sources containing
+// records may either use no dictionary or the same dictionary, which must then
+// be used by the first source containing records. Otherwise concatenation
+// fails.
+//
+// `dest` is not closed.
+//
+// Returns status:
+//  * `status.ok()`  - success
+//  * `!status.ok()` - failure
+Status ConcatenateRecords(
+    size_t num_srcs,
+    std::function<std::unique_ptr<ChunkReader>(size_t src_index)> open_src,
+    ChunkWriter* dest,
+    ConcatenateRecordsOptions options = ConcatenateRecordsOptions());
+
+}  // namespace riegeli
+
+#endif  // RIEGELI_RECORDS_CONCATENATE_RECORDS_H_
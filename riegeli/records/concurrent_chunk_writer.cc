@@ -0,0 +1,236 @@
+// Copyright 2019 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Make `pwrite()` available.
+#if !defined(_XOPEN_SOURCE) || _XOPEN_SOURCE < 500
+#undef _XOPEN_SOURCE
+#define _XOPEN_SOURCE 500
+#endif
+
+// Make `off_t` 64-bit even on 32-bit systems.
+#undef _FILE_OFFSET_BITS
+#define _FILE_OFFSET_BITS 64
+
+#include "riegeli/records/concurrent_chunk_writer.h"
+
+#include <fcntl.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#include <future>
+#include <limits>
+#include <tuple>
+
+#include "absl/base/optimization.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/string_view.h"
+#include "absl/types/span.h"
+#include "riegeli/base/base.h"
+#include "riegeli/base/canonical_errors.h"
+#include "riegeli/base/chain.h"
+#include "riegeli/base/errno_mapping.h"
+#include "riegeli/base/parallelism.h"
+#include "riegeli/base/tracing.h"
+#include "riegeli/bytes/chain_writer.h"
+#include "riegeli/bytes/fd_writer.h"
+#include "riegeli/bytes/writer_utils.h"
+#include "riegeli/chunk_encoding/chunk.h"
+#include "riegeli/chunk_encoding/constants.h"
+#include "riegeli/records/block.h"
+#include "riegeli/records/chunk_writer.h"
+
+namespace riegeli {
+
+namespace {
+
+// Writes `src` to `dest` at `pos`.
+//
+// Returns 0 on success, otherwise `errno`.
+int WriteFully(int dest, const Chain& src, Position pos) {
+  for (absl::string_view fragment : src.blocks()) {
+    while (!fragment.empty()) {
+      const ssize_t length_written = pwrite(
+          dest, fragment.data(),
+          UnsignedMin(fragment.size(),
+                      size_t{std::numeric_limits<ssize_t>::max()}),
+          IntCast<off_t>(pos));
+      if (ABSL_PREDICT_FALSE(length_written < 0)) {
+        if (errno == EINTR) continue;
+        return errno;
+      }
+      RIEGELI_ASSERT_GT(length_written, 0) << "pwrite() returned 0";
+      RIEGELI_ASSERT_LE(IntCast<size_t>(length_written), fragment.size())
+          << "pwrite() wrote more than requested";
+      pos += IntCast<size_t>(length_written);
+      fragment.remove_prefix(IntCast<size_t>(length_written));
+    }
+  }
+  return 0;
+}
+
+}  // namespace
+
+void ConcurrentChunkWriterBase::Initialize(FdWriterBase* dest) {
+  RIEGELI_ASSERT(dest != nullptr)
+      << "Failed precondition of ConcurrentChunkWriter: null FdWriter pointer";
+  if (ABSL_PREDICT_FALSE(!dest->healthy())) {
+    Fail(*dest);
+    return;
+  }
+  const int flags = fcntl(dest->dest_fd(), F_GETFL);
+  if (ABSL_PREDICT_FALSE(flags < 0)) {
+    const int error_number = errno;
+    Fail(ErrnoToCanonicalStatus(
+        error_number, absl::StrCat("fcntl() failed: ", dest->filename())));
+    return;
+  }
+  if (ABSL_PREDICT_FALSE((flags & O_APPEND) != 0)) {
+    Fail(InvalidArgumentError(absl::StrCat(
+        "ConcurrentChunkWriter requires a file not opened with O_APPEND: ",
+        dest->filename())));
+    return;
+  }
+  // Matches `DefaultChunkWriterBase::Initialize()`.
+  Position pos = dest->pos();
+  if (ABSL_PREDICT_FALSE(!internal::IsPossibleChunkBoundary(pos))) {
+    const Position length = internal::RemainingInBlock(pos);
+    if (ABSL_PREDICT_FALSE(!WriteZeros(dest, length))) {
+      Fail(*dest);
+      return;
+    }
+    pos += length;
+  }
+  ChunkWriter::Initialize(pos);
+  // Data buffered in `*dest` must reach the fd before chunks are written
+  // after them with `pwrite()`.
+  if (ABSL_PREDICT_FALSE(!dest->Flush(FlushType::kFromObject))) Fail(*dest);
+}
+
+void ConcurrentChunkWriterBase::Done() {
+  // Background writes refer to the fd, which must not be closed while they are
+  // in flight.
+  WaitForWrites(0);
+  if (ABSL_PREDICT_TRUE(healthy())) SyncDestPos();
+  ChunkWriter::Done();
+}
+
+bool ConcurrentChunkWriterBase::WriteChunk(const Chunk& chunk) {
+  if (ABSL_PREDICT_FALSE(!healthy())) return false;
+  const TraceScope trace("WriteChunk");
+  FdWriterBase* const dest = dest_writer();
+  const Position chunk_begin = pos_;
+  const Position chunk_end = internal::ChunkEnd(chunk.header, chunk_begin);
+  if (ABSL_PREDICT_FALSE(chunk_end >
+                         Position{std::numeric_limits<off_t>::max()})) {
+    return Fail(ResourceExhaustedError("File position overflow"));
+  }
+  if (ABSL_PREDICT_FALSE(!WaitForWrites(parallelism_ - 1))) return false;
+  struct WritingChunk {
+    Chunk chunk;
+    std::promise<int> error_number;
+  };
+  WritingChunk* const writing_chunk = new WritingChunk{chunk, {}};
+  pending_writes_.push_back(writing_chunk->error_number.get_future());
+  ThreadPool::global().Schedule([fd = dest->dest_fd(), chunk_begin, chunk_end,
+                                 writing_chunk] {
+    // Interleave the chunk with block headers computed from its reserved
+    // position, exactly as `DefaultChunkWriter` would write it there.
+    Chain data;
+    {
+      DefaultChunkWriter<ChainWriter<>> chunk_writer(
+          std::forward_as_tuple(
+              &data, ChainWriterBase::Options().set_size_hint(chunk_end -
+                                                              chunk_begin)),
+          DefaultChunkWriterBase::Options().set_assumed_pos(chunk_begin));
+      if (!chunk_writer.WriteChunk(writing_chunk->chunk) ||
+          !chunk_writer.Close()) {
+        RIEGELI_ASSERT_UNREACHABLE()
+            << "Serializing a chunk failed: " << chunk_writer.status();
+      }
+    }
+    RIEGELI_ASSERT_EQ(data.size(), chunk_end - chunk_begin)
+        << "Unexpected size of a serialized chunk";
+    writing_chunk->error_number.set_value(WriteFully(fd, data, chunk_begin));
+    delete writing_chunk;
+  });
+  pos_ = chunk_end;
+  return true;
+}
+
+bool ConcurrentChunkWriterBase::PadToBlockBoundary(HashType hash_type) {
+  if (ABSL_PREDICT_FALSE(!healthy())) return false;
+  // Matches `DefaultChunkWriterBase::PadToBlockBoundary()`.
+  size_t length = IntCast<size_t>(internal::RemainingInBlock(pos_));
+  if (length == 0) return true;
+  if (length < ChunkHeader::size()) {
+    // Not enough space for a padding chunk in this block. Write one more block.
+    length += size_t{internal::kUsableBlockSize};
+  }
+  length -= ChunkHeader::size();
+  Chunk chunk;
+  const absl::Span<char> buffer = chunk.data.AppendFixedBuffer(length, length);
+  std::memset(buffer.data(), '\0', buffer.size());
+  chunk.header = ChunkHeader(chunk.data, ChunkType::kPadding, 0, 0, hash_type);
+  return WriteChunk(chunk);
+}
+
+bool ConcurrentChunkWriterBase::AlignChunkData(HashType hash_type) {
+  if (ABSL_PREDICT_FALSE(!healthy())) return false;
+  // Matches `DefaultChunkWriterBase::AlignChunkData()`.
+  const Position chunk_end = internal::AlignedChunkBegin(pos_);
+  if (chunk_end == pos_) return true;
+  const size_t length = IntCast<size_t>(
+      internal::DistanceWithoutOverhead(pos_, chunk_end) - ChunkHeader::size());
+  Chunk chunk;
+  const absl::Span<char> buffer = chunk.data.AppendFixedBuffer(length, length);
+  std::memset(buffer.data(), '\0', buffer.size());
+  chunk.header = ChunkHeader(chunk.data, ChunkType::kPadding, 0, 0, hash_type);
+  return WriteChunk(chunk);
+}
+
+bool ConcurrentChunkWriterBase::Flush(FlushType flush_type) {
+  if (ABSL_PREDICT_FALSE(!healthy())) return false;
+  if (ABSL_PREDICT_FALSE(!WaitForWrites(0))) return false;
+  if (ABSL_PREDICT_FALSE(!SyncDestPos())) return false;
+  FdWriterBase* const dest = dest_writer();
+  if (ABSL_PREDICT_FALSE(!dest->Flush(flush_type))) return Fail(*dest);
+  return true;
+}
+
+bool ConcurrentChunkWriterBase::WaitForWrites(size_t max_pending) {
+  while (pending_writes_.size() > max_pending) {
+    const int error_number = pending_writes_.front().get();
+    pending_writes_.pop_front();
+    if (ABSL_PREDICT_FALSE(error_number != 0) && ABSL_PREDICT_TRUE(healthy())) {
+      Fail(ErrnoToCanonicalStatus(
+          error_number,
+          absl::StrCat("pwrite() failed writing ", dest_writer()->filename())));
+    }
+  }
+  return healthy();
+}
+
+bool ConcurrentChunkWriterBase::SyncDestPos() {
+  FdWriterBase* const dest = dest_writer();
+  if (ABSL_PREDICT_FALSE(!dest->Seek(pos_))) {
+    if (ABSL_PREDICT_FALSE(!dest->healthy())) return Fail(*dest);
+    return Fail(DataLossError("Riegeli/records file shrank unexpectedly"));
+  }
+  return true;
+}
+
+}  // namespace riegeli
@@ -0,0 +1,318 @@
+// Copyright 2019 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef RIEGELI_RECORDS_CONCURRENT_CHUNK_WRITER_H_
+#define RIEGELI_RECORDS_CONCURRENT_CHUNK_WRITER_H_
+
+#include <stddef.h>
+
+#include <deque>
+#include <future>
+#include <tuple>
+#include <utility>
+
+#include "absl/base/optimization.h"
+#include "riegeli/base/base.h"
+#include "riegeli/base/dependency.h"
+#include "riegeli/base/object.h"
+#include "riegeli/base/resetter.h"
+#include "riegeli/bytes/fd_writer.h"
+#include "riegeli/chunk_encoding/chunk.h"
+#include "riegeli/chunk_encoding/constants.h"
+#include "riegeli/records/chunk_writer.h"
+
+namespace riegeli {
+
+// Template parameter independent part of `ConcurrentChunkWriter`.
+class ConcurrentChunkWriterBase : public ChunkWriter {
+ public:
+  class Options {
+   public:
+    Options() noexcept {}
+
+    // Sets the maximum number of chunks being written concurrently in
+    // background threads.
+    //
+    // Default: 4
+    Options& set_parallelism(int parallelism) & {
+      RIEGELI_ASSERT_GT(parallelism, 0)
+          << "Failed precondition of "
+             "ConcurrentChunkWriterBase::Options::set_parallelism(): "
+             "non-positive parallelism";
+      parallelism_ = parallelism;
+      return *this;
+    }
+    Options&& set_parallelism(int parallelism) && {
+      return std::move(set_parallelism(parallelism));
+    }
+
+   private:
+    template <typename Dest>
+    friend class ConcurrentChunkWriter;
+
+    int parallelism_ = 4;
+  };
+
+  // Returns the Riegeli/records file being written to. Unchanged by `Close()`.
+  virtual FdWriterBase* dest_writer() = 0;
+  virtual const FdWriterBase* dest_writer() const = 0;
+
+  bool WriteChunk(const Chunk& chunk) override;
+  bool PadToBlockBoundary(HashType hash_type) override;
+  bool AlignChunkData(HashType hash_type) override;
+  bool Flush(FlushType flush_type) override;
+
+ protected:
+  explicit ConcurrentChunkWriterBase(InitiallyClosed)
+      : ChunkWriter(kInitiallyClosed) {}
+  explicit ConcurrentChunkWriterBase(InitiallyOpen, int parallelism)
+      : ChunkWriter(kInitiallyOpen),
+        parallelism_(IntCast<size_t>(parallelism)) {}
+
+  ConcurrentChunkWriterBase(ConcurrentChunkWriterBase&& that) noexcept;
+  ConcurrentChunkWriterBase& operator=(
+      ConcurrentChunkWriterBase&& that) noexcept;
+
+  void Reset(InitiallyClosed);
+  void Reset(InitiallyOpen, int parallelism);
+  void Initialize(FdWriterBase* dest);
+
+  void Done() override;
+
+  // Waits until at most `max_pending` background writes are in flight. Fails
+  // `*this` if a finished write failed.
+  //
+  // Return values:
+  //  * `true`  - success (`healthy()`)
+  //  * `false` - failure (`!healthy()`)
+  bool WaitForWrites(size_t max_pending);
+
+ private:
+
+  // Moves the position of `*dest_writer()` to `pos_`, after all background
+  // writes finished.
+  //
+  // Return values:
+  //  * `true`  - success (`healthy()`)
+  //  * `false` - failure (`!healthy()`)
+  bool SyncDestPos();
+
+  size_t parallelism_ = 0;
+  // Results of background writes, in the order of scheduling: 0 on success,
+  // otherwise `errno`.
+  std::deque<std::future<int>> pending_writes_;
+};
+
+// A `ChunkWriter` which writes chunks to an `FdWriter` concurrently.
+//
+// `WriteChunk()` only reserves the range of the file which the chunk occupies,
+// which is known from its header, and schedules writing the chunk in a
+// background thread. There the chunk is interleaved with block headers
+// computed from its reserved position, and written with `pwrite()`, so that
+// several chunks are in flight at the same time, possibly out of order. This
+// avoids a single writing thread limiting throughput of fast storage, e.g. as
+// the destination of `RecordWriter` with `set_parallelism()`, where chunks are
+// encoded in parallel but written by one thread:
+//
+// ```
+//   RecordWriter<ConcurrentChunkWriter<FdWriter<>>> record_writer(
+//       std::forward_as_tuple(std::forward_as_tuple(filename, O_WRONLY)),
+//       RecordWriterBase::Options().set_parallelism(8));
+// ```
+//
+// The result is identical to writing with `DefaultChunkWriter`. A write
+// failure is reported by a later operation, at the latest by `Flush()` or
+// `Close()`.
+//
+// The `FdWriter` must not be opened with `O_APPEND`, because `pwrite()` would
+// ignore reserved positions then.
+//
+// The `Dest` template parameter specifies the type of the object providing and
+// possibly owning the `FdWriter`. `Dest` must support
+// `Dependency<FdWriterBase*, Dest>`, e.g. `FdWriterBase*` (not owned),
+// `FdWriter<>` (owned, default).
+//
+// The `FdWriter` and its fd must not be accessed until the
+// `ConcurrentChunkWriter` is closed or no longer used, except that it is
+// allowed to read the file immediately after `Flush()`.
+template <typename Dest = FdWriter<>>
+class ConcurrentChunkWriter : public ConcurrentChunkWriterBase {
+ public:
+  // Creates a closed `ConcurrentChunkWriter`.
+  ConcurrentChunkWriter() noexcept
+      : ConcurrentChunkWriterBase(kInitiallyClosed) {}
+
+  // Will write to the `FdWriter` provided by `dest`.
+  explicit ConcurrentChunkWriter(const Dest& dest, Options options = Options());
+  explicit ConcurrentChunkWriter(Dest&& dest, Options options = Options());
+
+  // Will write to the `FdWriter` provided by a `Dest` constructed from elements
+  // of `dest_args`. This avoids constructing a temporary `Dest` and moving
+  // from it.
+  template <typename... DestArgs>
+  explicit ConcurrentChunkWriter(std::tuple<DestArgs...> dest_args,
+                                 Options options = Options());
+
+  ConcurrentChunkWriter(ConcurrentChunkWriter&& that) noexcept;
+  ConcurrentChunkWriter& operator=(ConcurrentChunkWriter&& that) noexcept;
+
+  // Waits for background writes if the `ConcurrentChunkWriter` was not closed,
+  // because they refer to the fd.
+  ~ConcurrentChunkWriter();
+
+  // Makes `*this` equivalent to a newly constructed `ConcurrentChunkWriter`.
+  // This avoids constructing a temporary `ConcurrentChunkWriter` and moving
+  // from it.
+  void Reset();
+  void Reset(const Dest& dest, Options options = Options());
+  void Reset(Dest&& dest, Options options = Options());
+  template <typename... DestArgs>
+  void Reset(std::tuple<DestArgs...> dest_args, Options options = Options());
+
+  // Returns the object providing and possibly owning the `FdWriter`. Unchanged
+  // by `Close()`.
+  Dest& dest() { return dest_.manager(); }
+  const Dest& dest() const { return dest_.manager(); }
+  FdWriterBase* dest_writer() override { return dest_.get(); }
+  const FdWriterBase* dest_writer() const override { return dest_.get(); }
+
+ protected:
+  void Done() override;
+
+ private:
+  // The object providing and possibly owning the Riegeli/records file being
+  // written to.
+  Dependency<FdWriterBase*, Dest> dest_;
+};
+
+// Implementation details follow.
+
+inline ConcurrentChunkWriterBase::ConcurrentChunkWriterBase(
+    ConcurrentChunkWriterBase&& that) noexcept
+    : ChunkWriter(std::move(that)),
+      parallelism_(that.parallelism_),
+      pending_writes_(std::move(that.pending_writes_)) {}
+
+inline ConcurrentChunkWriterBase& ConcurrentChunkWriterBase::operator=(
+    ConcurrentChunkWriterBase&& that) noexcept {
+  WaitForWrites(0);
+  ChunkWriter::operator=(std::move(that));
+  parallelism_ = that.parallelism_;
+  pending_writes_ = std::move(that.pending_writes_);
+  return *this;
+}
+
+inline void ConcurrentChunkWriterBase::Reset(InitiallyClosed) {
+  WaitForWrites(0);
+  ChunkWriter::Reset(kInitiallyClosed);
+  parallelism_ = 0;
+  pending_writes_.clear();
+}
+
+inline void ConcurrentChunkWriterBase::Reset(InitiallyOpen, int parallelism) {
+  WaitForWrites(0);
+  ChunkWriter::Reset(kInitiallyOpen);
+  parallelism_ = IntCast<size_t>(parallelism);
+  pending_writes_.clear();
+}
+
+template <typename Dest>
+inline ConcurrentChunkWriter<Dest>::ConcurrentChunkWriter(const Dest& dest,
+                                                          Options options)
+    : ConcurrentChunkWriterBase(kInitiallyOpen, options.parallelism_),
+      dest_(dest) {
+  Initialize(dest_.get());
+}
+
+template <typename Dest>
+inline ConcurrentChunkWriter<Dest>::ConcurrentChunkWriter(Dest&& dest,
+                                                          Options options)
+    : ConcurrentChunkWriterBase(kInitiallyOpen, options.parallelism_),
+      dest_(std::move(dest)) {
+  Initialize(dest_.get());
+}
+
+template <typename Dest>
+template <typename... DestArgs>
+inline ConcurrentChunkWriter<Dest>::ConcurrentChunkWriter(
+    std::tuple<DestArgs...> dest_args, Options options)
+    : ConcurrentChunkWriterBase(kInitiallyOpen, options.parallelism_),
+      dest_(std::move(dest_args)) {
+  Initialize(dest_.get());
+}
+
+template <typename Dest>
+inline ConcurrentChunkWriter<Dest>::ConcurrentChunkWriter(
+    ConcurrentChunkWriter&& that) noexcept
+    : ConcurrentChunkWriterBase(std::move(that)),
+      dest_(std::move(that.dest_)) {}
+
+template <typename Dest>
+inline ConcurrentChunkWriter<Dest>& ConcurrentChunkWriter<Dest>::operator=(
+    ConcurrentChunkWriter&& that) noexcept {
+  ConcurrentChunkWriterBase::operator=(std::move(that));
+  dest_ = std::move(that.dest_);
+  return *this;
+}
+
+template <typename Dest>
+inline ConcurrentChunkWriter<Dest>::~ConcurrentChunkWriter() {
+  WaitForWrites(0);
+}
+
+template <typename Dest>
+inline void ConcurrentChunkWriter<Dest>::Reset() {
+  ConcurrentChunkWriterBase::Reset(kInitiallyClosed);
+  dest_.Reset();
+}
+
+template <typename Dest>
+inline void ConcurrentChunkWriter<Dest>::Reset(const Dest& dest,
+                                               Options options) {
+  ConcurrentChunkWriterBase::Reset(kInitiallyOpen, options.parallelism_);
+  dest_.Reset(dest);
+  Initialize(dest_.get());
+}
+
+template <typename Dest>
+inline void ConcurrentChunkWriter<Dest>::Reset(Dest&& dest, Options options) {
+  ConcurrentChunkWriterBase::Reset(kInitiallyOpen, options.parallelism_);
+  dest_.Reset(std::move(dest));
+  Initialize(dest_.get());
+}
+
+template <typename Dest>
+template <typename... DestArgs>
+inline void ConcurrentChunkWriter<Dest>::Reset(
+    std::tuple<DestArgs...> dest_args, Options options) {
+  ConcurrentChunkWriterBase::Reset(kInitiallyOpen, options.parallelism_);
+  dest_.Reset(std::move(dest_args));
+  Initialize(dest_.get());
+}
+
+template <typename Dest>
+void ConcurrentChunkWriter<Dest>::Done() {
+  ConcurrentChunkWriterBase::Done();
+  if (dest_.is_owning()) {
+    if (ABSL_PREDICT_FALSE(!dest_->Close())) Fail(*dest_);
+  }
+}
+
+template <typename Dest>
+struct Resetter<ConcurrentChunkWriter<Dest>>
+    : ResetterByReset<ConcurrentChunkWriter<Dest>> {};
+
+}  // namespace riegeli
+
+#endif  // RIEGELI_RECORDS_CONCURRENT_CHUNK_WRITER_H_
@@ -0,0 +1,316 @@
+// Copyright 2017 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "riegeli/records/concurrent_record_reader.h"
+
+#include <fcntl.h>
+#include <stddef.h>
+
+#include <memory>
+#include <string>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+#include "absl/base/optimization.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/string_view.h"
+#include "absl/synchronization/mutex.h"
+#include "google/protobuf/message_lite.h"
+#include "riegeli/base/base.h"
+#include "riegeli/base/canonical_errors.h"
+#include "riegeli/base/chain.h"
+#include "riegeli/base/object.h"
+#include "riegeli/base/parallelism.h"
+#include "riegeli/base/status.h"
+#include "riegeli/bytes/chain_reader.h"
+#include "riegeli/bytes/fd_dependency.h"
+#include "riegeli/bytes/fd_reader.h"
+#include "riegeli/bytes/limiting_reader.h"
+#include "riegeli/bytes/message_parse.h"
+#include "riegeli/bytes/zstd_dictionary.h"
+#include "riegeli/chunk_encoding/chunk.h"
+#include "riegeli/chunk_encoding/chunk_decoder.h"
+#include "riegeli/chunk_encoding/constants.h"
+#include "riegeli/records/chunk_cache.h"
+#include "riegeli/records/chunk_reader.h"
+#include "riegeli/records/record_position.h"
+
+namespace riegeli {
+
+ConcurrentRecordReader::ConcurrentRecordReader(absl::string_view filename,
+                                               Options options)
+    : Object(kInitiallyOpen),
+      // TODO: When `absl::string_view` becomes C++17 `std::string_view`:
+      // filename_(filename),
+      filename_(filename.data(), filename.size()),
+      field_projection_(std::move(options.field_projection_)),
+      chunk_cache_(std::move(options.chunk_cache_)),
+      chunk_cache_key_(options.chunk_cache_key_.empty()
+                           ? filename_
+                           : std::move(options.chunk_cache_key_)),
+      buffer_size_(options.buffer_size_),
+      thread_pool_(options.thread_pool_),
+      pending_reads_(std::make_unique<PendingReads>()) {
+  Initialize();
+}
+
+ConcurrentRecordReader::ConcurrentRecordReader(
+    ConcurrentRecordReader&& that) noexcept
+    : Object(std::move(that)),
+      filename_(std::move(that.filename_)),
+      fd_(std::move(that.fd_)),
+      field_projection_(std::move(that.field_projection_)),
+      chunk_cache_(std::move(that.chunk_cache_)),
+      chunk_cache_key_(std::move(that.chunk_cache_key_)),
+      buffer_size_(that.buffer_size_),
+      zstd_dictionary_(std::move(that.zstd_dictionary_)),
+      thread_pool_(that.thread_pool_),
+      pending_reads_(std::move(that.pending_reads_)) {}
+
+ConcurrentRecordReader& ConcurrentRecordReader::operator=(
+    ConcurrentRecordReader&& that) noexcept {
+  WaitForPendingReads();
+  Object::operator=(std::move(that));
+  filename_ = std::move(that.filename_);
+  fd_ = std::move(that.fd_);
+  field_projection_ = std::move(that.field_projection_);
+  chunk_cache_ = std::move(that.chunk_cache_);
+  chunk_cache_key_ = std::move(that.chunk_cache_key_);
+  buffer_size_ = that.buffer_size_;
+  zstd_dictionary_ = std::move(that.zstd_dictionary_);
+  thread_pool_ = that.thread_pool_;
+  pending_reads_ = std::move(that.pending_reads_);
+  return *this;
+}
+
+ConcurrentRecordReader::~ConcurrentRecordReader() { WaitForPendingReads(); }
+
+void ConcurrentRecordReader::Initialize() {
+  FdReader<OwnedFd> src(filename_, O_RDONLY,
+                        FdReaderBase::Options()
+                            .set_initial_pos(0)
+                            .set_buffer_size(buffer_size_));
+  DefaultChunkReader<> chunk_reader(&src);
+  // The dictionary chunk precedes all chunks containing records.
+  for (;;) {
+    const ChunkHeader* chunk_header;
+    if (!chunk_reader.PullChunkHeader(&chunk_header)) {
+      if (ABSL_PREDICT_FALSE(!chunk_reader.healthy())) {
+        Fail(chunk_reader);
+        return;
+      }
+      break;
+    }
+    if (chunk_header->num_records() > 0) break;
+    if (chunk_header->chunk_type() == ChunkType::kDictionary) {
+      Chunk chunk;
+      if (ABSL_PREDICT_FALSE(!chunk_reader.ReadChunk(&chunk))) {
+        Fail(chunk_reader);
+        return;
+      }
+      zstd_dictionary_ = ZstdDictionary(std::string(chunk.data));
+      break;
+    }
+    if (ABSL_PREDICT_FALSE(
+            !chunk_reader.SeekToChunkAfter(chunk_reader.pos() + 1))) {
+      Fail(chunk_reader);
+      return;
+    }
+  }
+  // Keep the fd open for `ReadRecordAt()`.
+  fd_ = OwnedFd(src.src().Release());
+}
+
+void ConcurrentRecordReader::Done() {
+  if (pending_reads_ != nullptr) {
+    WaitForPendingReads();
+    pending_reads_.reset();
+  }
+  fd_ = OwnedFd();
+}
+
+Status ConcurrentRecordReader::GetChunk(
+    Position chunk_begin, std::shared_ptr<const CachedChunk>* chunk) const {
+  if (chunk_cache_ != nullptr) {
+    *chunk = chunk_cache_->Find(chunk_cache_key_, chunk_begin);
+    if (*chunk != nullptr) return OkStatus();
+  }
+  // `set_initial_pos()` makes `FdReader` use `pread()` without changing the
+  // fd position, so that concurrent readers do not interfere.
+  FdReader<int> src(fd_.get(), FdReaderBase::Options()
+                                   .set_initial_pos(chunk_begin)
+                                   .set_buffer_size(buffer_size_));
+  DefaultChunkReader<> chunk_reader(&src);
+  Chunk encoded_chunk;
+  if (ABSL_PREDICT_FALSE(!chunk_reader.ReadChunk(&encoded_chunk))) {
+    if (ABSL_PREDICT_FALSE(!chunk_reader.healthy())) {
+      return chunk_reader.status();
+    }
+    return OutOfRangeError(
+        absl::StrCat("No chunk at ", chunk_begin, " in ", filename_));
+  }
+  Chain shared_transpose_header;
+  uint64_t distance;
+  if (ChunkDecoder::SharedTransposeHeaderDistance(encoded_chunk, &distance) &&
+      distance > 0 && distance <= chunk_begin) {
+    FdReader<int> header_src(fd_.get(),
+                             FdReaderBase::Options()
+                                 .set_initial_pos(chunk_begin - distance)
+                                 .set_buffer_size(buffer_size_));
+    DefaultChunkReader<> header_chunk_reader(&header_src);
+    Chunk header_chunk;
+    if (header_chunk_reader.ReadChunk(&header_chunk) &&
+        header_chunk.header.chunk_type() ==
+            ChunkType::kSharedTransposeHeader) {
+      shared_transpose_header = std::move(header_chunk.data);
+    }
+  }
+  ZstdDictionary chunk_prefix;
+  if (ChunkDecoder::ChunkPrefixDistance(encoded_chunk, &distance) &&
+      distance > 0 && distance <= chunk_begin) {
+    FdReader<int> prefix_src(fd_.get(),
+                             FdReaderBase::Options()
+                                 .set_initial_pos(chunk_begin - distance)
+                                 .set_buffer_size(buffer_size_));
+    DefaultChunkReader<> prefix_chunk_reader(&prefix_src);
+    Chunk prefix_chunk;
+    if (prefix_chunk_reader.ReadChunk(&prefix_chunk)) {
+      ChunkDecoder::ChunkPrefix(prefix_chunk, zstd_dictionary_, &chunk_prefix);
+    }
+  }
+  ChunkDecoder chunk_decoder(ChunkDecoder::Options()
+                                 .set_field_projection(field_projection_)
+                                 .set_zstd_dictionary(zstd_dictionary_));
+  if (ABSL_PREDICT_FALSE(!chunk_decoder.Decode(
+          encoded_chunk, shared_transpose_header, chunk_prefix))) {
+    return Annotate(chunk_decoder.status(),
+                    absl::StrCat("at chunk ", chunk_begin, " in ", filename_));
+  }
+  std::shared_ptr<CachedChunk> decoded_chunk = std::make_shared<CachedChunk>();
+  decoded_chunk->chunk_end = chunk_reader.pos();
+  decoded_chunk->decoded = chunk_decoder.decoded_chunk();
+  if (chunk_cache_ != nullptr) {
+    chunk_cache_->Insert(chunk_cache_key_, chunk_begin, decoded_chunk);
+  }
+  *chunk = std::move(decoded_chunk);
+  return OkStatus();
+}
+
+Status ConcurrentRecordReader::FindRecord(
+    RecordPosition pos, std::shared_ptr<const CachedChunk>* chunk,
+    size_t* start, size_t* limit) const {
+  if (ABSL_PREDICT_FALSE(!healthy())) return status();
+  {
+    Status status = GetChunk(pos.chunk_begin(), chunk);
+    if (ABSL_PREDICT_FALSE(!status.ok())) return status;
+  }
+  const std::vector<size_t>& limits = (*chunk)->decoded.limits;
+  if (ABSL_PREDICT_FALSE(pos.record_index() >= limits.size())) {
+    return OutOfRangeError(absl::StrCat("No record at ", pos.ToString(),
+                                        " in ", filename_, ", the chunk has ",
+                                        limits.size(), " records"));
+  }
+  const size_t index = IntCast<size_t>(pos.record_index());
+  *start = index == 0 ? size_t{0} : limits[index - 1];
+  *limit = limits[index];
+  return OkStatus();
+}
+
+Status ConcurrentRecordReader::ReadRecordAt(
+    RecordPosition pos, google::protobuf::MessageLite* record) const {
+  std::shared_ptr<const CachedChunk> chunk;
+  size_t start, limit;
+  {
+    Status status = FindRecord(pos, &chunk, &start, &limit);
+    if (ABSL_PREDICT_FALSE(!status.ok())) return status;
+  }
+  ChainReader<> values(&chunk->decoded.values);
+  if (ABSL_PREDICT_FALSE(!values.Seek(start))) return values.status();
+  Status status = ParseFromReader<LimitingReader<>>(
+      record, std::forward_as_tuple(&values, limit));
+  if (ABSL_PREDICT_FALSE(!status.ok())) {
+    return Annotate(status, absl::StrCat("at record ", pos.ToString(), " in ",
+                                         filename_));
+  }
+  return OkStatus();
+}
+
+Status ConcurrentRecordReader::ReadRecordAt(RecordPosition pos,
+                                            std::string* record) const {
+  std::shared_ptr<const CachedChunk> chunk;
+  size_t start, limit;
+  {
+    Status status = FindRecord(pos, &chunk, &start, &limit);
+    if (ABSL_PREDICT_FALSE(!status.ok())) return status;
+  }
+  ChainReader<> values(&chunk->decoded.values);
+  record->clear();
+  if (ABSL_PREDICT_FALSE(!values.Seek(start) ||
+                         !values.Read(record, limit - start))) {
+    return DataLossError(absl::StrCat("Record values truncated at ",
+                                      pos.ToString(), " in ", filename_));
+  }
+  return OkStatus();
+}
+
+Status ConcurrentRecordReader::ReadRecordAt(RecordPosition pos,
+                                            Chain* record) const {
+  std::shared_ptr<const CachedChunk> chunk;
+  size_t start, limit;
+  {
+    Status status = FindRecord(pos, &chunk, &start, &limit);
+    if (ABSL_PREDICT_FALSE(!status.ok())) return status;
+  }
+  ChainReader<> values(&chunk->decoded.values);
+  record->Clear();
+  if (ABSL_PREDICT_FALSE(!values.Seek(start) ||
+                         !values.Read(record, limit - start))) {
+    return DataLossError(absl::StrCat("Record values truncated at ",
+                                      pos.ToString(), " in ", filename_));
+  }
+  return OkStatus();
+}
+
+void ConcurrentRecordReader::ReadRecordAtAsync(RecordPosition pos,
+                                               ReadCallback callback) const {
+  if (ABSL_PREDICT_FALSE(!healthy())) {
+    callback(status(), Chain());
+    return;
+  }
+  {
+    absl::MutexLock lock(&pending_reads_->mutex);
+    ++pending_reads_->num_pending;
+  }
+  thread_pool_->Schedule([this, pos, callback = std::move(callback)] {
+    Chain record;
+    Status status = ReadRecordAt(pos, &record);
+    callback(std::move(status), std::move(record));
+    absl::MutexLock lock(&pending_reads_->mutex);
+    --pending_reads_->num_pending;
+  });
+}
+
+void ConcurrentRecordReader::WaitForPendingReads() const {
+  if (pending_reads_ == nullptr) return;
+  absl::MutexLock lock(&pending_reads_->mutex);
+  pending_reads_->mutex.Await(absl::Condition(
+      +[](PendingReads* pending_reads)
+           ABSL_EXCLUSIVE_LOCKS_REQUIRED(pending_reads->mutex) {
+             return pending_reads->num_pending == 0;
+           },
+      pending_reads_.get()));
+}
+
+}  // namespace riegeli
@@ -0,0 +1,236 @@
+// Copyright 2017 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef RIEGELI_RECORDS_CONCURRENT_RECORD_READER_H_
+#define RIEGELI_RECORDS_CONCURRENT_RECORD_READER_H_
+
+#include <stddef.h>
+
+#include <functional>
+#include <memory>
+#include <string>
+#include <utility>
+
+#include "absl/base/thread_annotations.h"
+#include "absl/strings/string_view.h"
+#include "absl/synchronization/mutex.h"
+#include "google/protobuf/message_lite.h"
+#include "riegeli/base/base.h"
+#include "riegeli/base/chain.h"
+#include "riegeli/base/object.h"
+#include "riegeli/base/parallelism.h"
+#include "riegeli/base/status.h"
+#include "riegeli/bytes/fd_dependency.h"
+#include "riegeli/bytes/zstd_dictionary.h"
+#include "riegeli/chunk_encoding/field_projection.h"
+#include "riegeli/records/chunk_cache.h"
+#include "riegeli/records/record_position.h"
+
+namespace riegeli {
+
+// `ConcurrentRecordReader` reads records of a Riegeli/records file at given
+// positions, and can be used concurrently by multiple threads.
+//
+// Unlike `RecordReader`, it keeps no current position: each `ReadRecordAt()`
+// reads the chunk containing the record with `pread()`, independently of other
+// calls, and decodes it. With `Options::set_chunk_cache()`, decoded chunks are
+// shared between calls, and with other `ConcurrentRecordReader`s and
+// `RecordReader`s using the same cache.
+//
+// `ReadRecordAtAsync()` performs the same work on a thread pool and reports
+// the result with a callback, so that a single event loop thread can keep many
+// reads in flight without blocking.
+//
+// Positions are usually obtained from `RecordReader::pos()` or
+// `RecordWriter::LastPos()`.
+class ConcurrentRecordReader : public Object {
+ public:
+  // Receives the result of `ReadRecordAtAsync()`: `record` is meaningful if
+  // `status.ok()`.
+  using ReadCallback = std::function<void(Status status, Chain record)>;
+
+  class Options {
+   public:
+    Options() noexcept {}
+
+    // Specifies the set of fields to be included in returned records, allowing
+    // to exclude the remaining fields (but does not guarantee exclusion).
+    // Excluding data makes reading faster.
+    //
+    // Default: `FieldProjection::All()`
+    Options& set_field_projection(FieldProjection field_projection) & {
+      field_projection_ = std::move(field_projection);
+      return *this;
+    }
+    Options&& set_field_projection(FieldProjection field_projection) && {
+      return std::move(set_field_projection(std::move(field_projection)));
+    }
+
+    // Sets a cache of decoded chunks, which can be shared with other
+    // `ConcurrentRecordReader`s and `RecordReader`s.
+    //
+    // Without a cache, each `ReadRecordAt()` reads and decodes the whole chunk
+    // containing the record.
+    //
+    // Default: `nullptr` (no cache)
+    Options& set_chunk_cache(std::shared_ptr<ChunkCache> chunk_cache) & {
+      chunk_cache_ = std::move(chunk_cache);
+      return *this;
+    }
+    Options&& set_chunk_cache(std::shared_ptr<ChunkCache> chunk_cache) && {
+      return std::move(set_chunk_cache(std::move(chunk_cache)));
+    }
+
+    // Identifies this file in `set_chunk_cache()`, with the same meaning as
+    // `RecordReaderBase::Options::set_chunk_cache_key()`.
+    //
+    // If empty, the filename is used.
+    //
+    // Default: ""
+    Options& set_chunk_cache_key(std::string chunk_cache_key) & {
+      chunk_cache_key_ = std::move(chunk_cache_key);
+      return *this;
+    }
+    Options&& set_chunk_cache_key(std::string chunk_cache_key) && {
+      return std::move(set_chunk_cache_key(std::move(chunk_cache_key)));
+    }
+
+    // Sets the size of the buffer used by each `ReadRecordAt()` which reads a
+    // chunk, i.e. the granularity of `pread()` calls.
+    //
+    // Default: `kDefaultBufferSize` (64K)
+    Options& set_buffer_size(size_t buffer_size) & {
+      RIEGELI_ASSERT_GT(buffer_size, 0u)
+          << "Failed precondition of "
+             "ConcurrentRecordReader::Options::set_buffer_size(): "
+             "zero buffer size";
+      buffer_size_ = buffer_size;
+      return *this;
+    }
+    Options&& set_buffer_size(size_t buffer_size) && {
+      return std::move(set_buffer_size(buffer_size));
+    }
+
+    // Sets the thread pool where `ReadRecordAtAsync()` reads records.
+    //
+    // The thread pool must outlive the `ConcurrentRecordReader`.
+    //
+    // Default: `&ThreadPool::global()`
+    Options& set_thread_pool(ThreadPool* thread_pool) & {
+      RIEGELI_ASSERT(thread_pool != nullptr)
+          << "Failed precondition of "
+             "ConcurrentRecordReader::Options::set_thread_pool(): "
+             "null thread pool";
+      thread_pool_ = thread_pool;
+      return *this;
+    }
+    Options&& set_thread_pool(ThreadPool* thread_pool) && {
+      return std::move(set_thread_pool(thread_pool));
+    }
+
+   private:
+    friend class ConcurrentRecordReader;
+
+    FieldProjection field_projection_ = FieldProjection::All();
+    std::shared_ptr<ChunkCache> chunk_cache_;
+    std::string chunk_cache_key_;
+    size_t buffer_size_ = kDefaultBufferSize;
+    ThreadPool* thread_pool_ = &ThreadPool::global();
+  };
+
+  // Creates a closed `ConcurrentRecordReader`.
+  ConcurrentRecordReader() noexcept : Object(kInitiallyClosed) {}
+
+  // Opens the file with the given name for reading, and looks for a Zstd
+  // dictionary near its beginning.
+  explicit ConcurrentRecordReader(absl::string_view filename,
+                                  Options options = Options());
+
+  // Precondition for moving: no `ReadRecordAtAsync()` is pending on `that`.
+  ConcurrentRecordReader(ConcurrentRecordReader&& that) noexcept;
+  ConcurrentRecordReader& operator=(ConcurrentRecordReader&& that) noexcept;
+
+  // Waits for pending `ReadRecordAtAsync()` calls, which refer to `*this`.
+  ~ConcurrentRecordReader();
+
+  // Returns the name of the file being read from. Unchanged by `Close()`.
+  const std::string& filename() const { return filename_; }
+
+  // Reads the record at `pos`.
+  //
+  // `ReadRecordAt(google::protobuf::MessageLite*)` parses raw bytes to a proto
+  // message after reading. The remaining overloads read raw bytes.
+  //
+  // This may be called concurrently from multiple threads. Failures do not
+  // fail the `ConcurrentRecordReader`.
+  //
+  // Returns status:
+  //  * `status.ok()`  - success (`*record` is set)
+  //  * `!status.ok()` - failure (`*record` is unspecified); the chunk or the
+  //                     record does not exist (`OutOfRangeError`), the file is
+  //                     invalid, or the `ConcurrentRecordReader` is not healthy
+  Status ReadRecordAt(RecordPosition pos,
+                      google::protobuf::MessageLite* record) const;
+  Status ReadRecordAt(RecordPosition pos, std::string* record) const;
+  Status ReadRecordAt(RecordPosition pos, Chain* record) const;
+
+  // Reads the record at `pos` in background, like `ReadRecordAt(Chain*)`, and
+  // calls `callback` with the result from a thread of the thread pool.
+  // `callback` may be called before `ReadRecordAtAsync()` returns, e.g. if the
+  // `ConcurrentRecordReader` is not healthy.
+  //
+  // This may be called concurrently from multiple threads. `Close()` and the
+  // destructor wait for pending reads.
+  void ReadRecordAtAsync(RecordPosition pos, ReadCallback callback) const;
+
+  // Waits until callbacks of all pending `ReadRecordAtAsync()` calls return.
+  void WaitForPendingReads() const;
+
+ protected:
+  void Done() override;
+
+ private:
+  // Opens `filename_` and fills `zstd_dictionary_`.
+  void Initialize();
+
+  // Finds the decoded chunk beginning at `chunk_begin`, reading and decoding
+  // it if it is not cached.
+  Status GetChunk(Position chunk_begin,
+                  std::shared_ptr<const CachedChunk>* chunk) const;
+
+  // Finds the record at `pos` and its range of `(*chunk)->decoded.values`.
+  Status FindRecord(RecordPosition pos,
+                    std::shared_ptr<const CachedChunk>* chunk, size_t* start,
+                    size_t* limit) const;
+
+  struct PendingReads {
+    absl::Mutex mutex;
+    size_t num_pending ABSL_GUARDED_BY(mutex) = 0;
+  };
+
+  std::string filename_;
+  OwnedFd fd_;
+  FieldProjection field_projection_ = FieldProjection::All();
+  std::shared_ptr<ChunkCache> chunk_cache_;
+  std::string chunk_cache_key_;
+  size_t buffer_size_ = kDefaultBufferSize;
+  ZstdDictionary zstd_dictionary_;
+  ThreadPool* thread_pool_ = &ThreadPool::global();
+  // Non-null if `healthy()`.
+  std::unique_ptr<PendingReads> pending_reads_;
+};
+
+}  // namespace riegeli
+
+#endif  // RIEGELI_RECORDS_CONCURRENT_RECORD_READER_H_
@@ -0,0 +1,311 @@
+// Copyright 2019 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "riegeli/records/filter_records.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <deque>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "absl/base/optimization.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/string_view.h"
+#include "absl/synchronization/blocking_counter.h"
+#include "absl/types/span.h"
+#include "riegeli/base/base.h"
+#include "riegeli/base/chain.h"
+#include "riegeli/base/parallelism.h"
+#include "riegeli/base/status.h"
+#include "riegeli/bytes/zstd_dictionary.h"
+#include "riegeli/chunk_encoding/chunk.h"
+#include "riegeli/chunk_encoding/chunk_decoder.h"
+#include "riegeli/chunk_encoding/constants.h"
+#include "riegeli/records/chunk_reader.h"
+#include "riegeli/records/record_position.h"
+#include "riegeli/records/record_writer.h"
+
+namespace riegeli {
+
+namespace {
+
+// A chunk of records read from the source, and the result of filtering it.
+struct FilteredChunk {
+  Chunk chunk;
+  Position chunk_begin = 0;
+  ZstdDictionary zstd_dictionary;
+  Chain shared_transpose_header;
+  ZstdDictionary chunk_prefix;
+  // Whether the chunk can be copied if its records are unchanged.
+  bool copyable = false;
+
+  // The remaining fields are set by `FilterChunk()`.
+
+  // If `true`, the chunk is copied, otherwise `records` are written.
+  bool copy = false;
+  // Owns records which are kept.
+  ChunkDecoder chunk_decoder;
+  // Records to write.
+  std::vector<absl::string_view> records;
+  // Owns records which are replaced. `std::deque` keeps them in place when
+  // more are added.
+  std::deque<std::string> replacements;
+  Status status;
+};
+
+class Filter {
+ public:
+  explicit Filter(const RecordFilter* filter, RecordWriterBase* dest,
+                  const FilterRecordsOptions& options)
+      : filter_(filter),
+        dest_(dest),
+        copy_unchanged_chunks_(options.copy_unchanged_chunks()),
+        preserve_chunk_boundaries_(options.preserve_chunk_boundaries()),
+        parallelism_(IntCast<size_t>(options.parallelism())) {}
+
+  Filter(const Filter&) = delete;
+  Filter& operator=(const Filter&) = delete;
+
+  // Reads `*src` until it ends, filtering and writing its chunks.
+  Status AddSource(ChunkReader* src);
+
+ private:
+  // Filters queued chunks, possibly in parallel, and writes them.
+  Status Flush();
+  void FilterChunk(FilteredChunk* filtered_chunk) const;
+  Status WriteChunk(const FilteredChunk& filtered_chunk);
+
+  const RecordFilter* const filter_;
+  RecordWriterBase* const dest_;
+  const bool copy_unchanged_chunks_;
+  const bool preserve_chunk_boundaries_;
+  const size_t parallelism_;
+
+  // Chunks waiting to be filtered. At most `parallelism_ + 1` chunks are
+  // queued, so that each thread filters one chunk.
+  std::vector<FilteredChunk> queue_;
+};
+
+Status Filter::AddSource(ChunkReader* src) {
+  ZstdDictionary zstd_dictionary;
+  bool has_zstd_dictionary = false;
+  Chain shared_transpose_header;
+  Position shared_transpose_header_pos = 0;
+  Chunk chunk_prefix_source;
+  Position chunk_prefix_source_pos = 0;
+  ZstdDictionary chunk_prefix;
+  Position chunk_prefix_pos = 0;
+  queue_.reserve(parallelism_ + 1);
+  for (;;) {
+    const Position chunk_begin = src->pos();
+    Chunk chunk;
+    if (ABSL_PREDICT_FALSE(!src->ReadChunk(&chunk))) {
+      if (ABSL_PREDICT_FALSE(!src->healthy())) return src->status();
+      break;
+    }
+    switch (chunk.header.chunk_type()) {
+      case ChunkType::kFileSignature:
+      case ChunkType::kFileMetadata:
+      case ChunkType::kPadding:
+      case ChunkType::kIndex:
+      case ChunkType::kKeyFilters:
+      case ChunkType::kFirstKeys:
+      case ChunkType::kStatistics:
+        // Metadata are set by options of `*dest_`, and the remaining chunks
+        // describe the layout of the source, which would be wrong in the
+        // result.
+        break;
+      case ChunkType::kDictionary:
+        zstd_dictionary = ZstdDictionary(std::string(chunk.data));
+        has_zstd_dictionary = true;
+        break;
+      case ChunkType::kSharedTransposeHeader:
+        shared_transpose_header = std::move(chunk.data);
+        shared_transpose_header_pos = chunk_begin;
+        break;
+      default: {
+        if (chunk.header.num_records() == 0) break;
+        uint64_t distance;
+        const bool has_shared_transpose_header =
+            ChunkDecoder::SharedTransposeHeaderDistance(chunk, &distance) &&
+            !shared_transpose_header.empty() &&
+            distance == chunk_begin - shared_transpose_header_pos;
+        FilteredChunk filtered_chunk;
+        // A chunk with a prefix refers to an earlier simple chunk, which is
+        // decoded again to compute the prefix.
+        if (chunk.header.chunk_type() == ChunkType::kSimple) {
+          chunk_prefix_source = chunk;
+          chunk_prefix_source_pos = chunk_begin;
+        } else if (ChunkDecoder::ChunkPrefixDistance(chunk, &distance) &&
+                   distance == chunk_begin - chunk_prefix_source_pos) {
+          if (chunk_prefix.empty() ||
+              chunk_prefix_pos != chunk_prefix_source_pos) {
+            chunk_prefix = ZstdDictionary();
+            if (ChunkDecoder::ChunkPrefix(chunk_prefix_source, zstd_dictionary,
+                                          &chunk_prefix)) {
+              chunk_prefix_pos = chunk_prefix_source_pos;
+            }
+          }
+          filtered_chunk.chunk_prefix = chunk_prefix;
+        }
+        filtered_chunk.copyable =
+            copy_unchanged_chunks_ && !has_zstd_dictionary &&
+            (chunk.header.chunk_type() == ChunkType::kSimple ||
+             chunk.header.chunk_type() == ChunkType::kSimpleWithBlocks ||
+             chunk.header.chunk_type() == ChunkType::kSimpleWithReferences ||
+             chunk.header.chunk_type() == ChunkType::kTransposed ||
+             chunk.header.chunk_type() ==
+                 ChunkType::kTransposedWithBufferEncodings);
+        filtered_chunk.chunk = std::move(chunk);
+        filtered_chunk.chunk_begin = chunk_begin;
+        filtered_chunk.zstd_dictionary = zstd_dictionary;
+        if (has_shared_transpose_header) {
+          filtered_chunk.shared_transpose_header = shared_transpose_header;
+        }
+        queue_.push_back(std::move(filtered_chunk));
+        if (queue_.size() > parallelism_) {
+          const Status status = Flush();
+          if (ABSL_PREDICT_FALSE(!status.ok())) return status;
+        }
+      } break;
+    }
+  }
+  return Flush();
+}
+
+Status Filter::Flush() {
+  const auto filter_chunks = [&](std::atomic<size_t>* next_chunk) {
+    for (;;) {
+      const size_t index = next_chunk->fetch_add(1, std::memory_order_relaxed);
+      if (index >= queue_.size()) return;
+      FilterChunk(&queue_[index]);
+    }
+  };
+  std::atomic<size_t> next_chunk{0};
+  const size_t num_helpers =
+      queue_.size() <= 1 ? size_t{0}
+                         : UnsignedMin(parallelism_, queue_.size() - 1);
+  if (num_helpers == 0) {
+    filter_chunks(&next_chunk);
+  } else {
+    absl::BlockingCounter helpers_done(IntCast<int>(num_helpers));
+    for (size_t i = 0; i < num_helpers; ++i) {
+      ThreadPool::global().Schedule([&] {
+        filter_chunks(&next_chunk);
+        helpers_done.DecrementCount();
+      });
+    }
+    filter_chunks(&next_chunk);
+    helpers_done.Wait();
+  }
+  for (const FilteredChunk& filtered_chunk : queue_) {
+    const Status status = WriteChunk(filtered_chunk);
+    if (ABSL_PREDICT_FALSE(!status.ok())) {
+      queue_.clear();
+      return status;
+    }
+  }
+  queue_.clear();
+  return OkStatus();
+}
+
+void Filter::FilterChunk(FilteredChunk* filtered_chunk) const {
+  ChunkDecoder& chunk_decoder = filtered_chunk->chunk_decoder;
+  chunk_decoder.Reset(ChunkDecoder::Options().set_zstd_dictionary(
+      std::move(filtered_chunk->zstd_dictionary)));
+  if (ABSL_PREDICT_FALSE(!chunk_decoder.Decode(
+          filtered_chunk->chunk, filtered_chunk->shared_transpose_header,
+          filtered_chunk->chunk_prefix))) {
+    filtered_chunk->status =
+        Annotate(chunk_decoder.status(),
+                 absl::StrCat("decoding chunk at ",
+                              filtered_chunk->chunk_begin));
+    return;
+  }
+  absl::Span<const absl::string_view> records;
+  if (!chunk_decoder.ReadRecords(&records)) {
+    if (ABSL_PREDICT_FALSE(!chunk_decoder.healthy())) {
+      filtered_chunk->status =
+          Annotate(chunk_decoder.status(),
+                   absl::StrCat("decoding chunk at ",
+                                filtered_chunk->chunk_begin));
+    }
+    return;
+  }
+  bool changed = false;
+  filtered_chunk->records.reserve(records.size());
+  std::string replacement;
+  for (size_t index = 0; index < records.size(); ++index) {
+    switch ((*filter_)(RecordPosition(filtered_chunk->chunk_begin,
+                                      IntCast<uint64_t>(index)),
+                       records[index], &replacement)) {
+      case FilterAction::kKeep:
+        filtered_chunk->records.push_back(records[index]);
+        break;
+      case FilterAction::kDrop:
+        changed = true;
+        break;
+      case FilterAction::kReplace:
+        changed = true;
+        filtered_chunk->replacements.push_back(std::move(replacement));
+        filtered_chunk->records.push_back(
+            filtered_chunk->replacements.back());
+        replacement.clear();
+        break;
+    }
+  }
+  if (!changed && filtered_chunk->copyable) {
+    // Release decoded records early, the chunk is written as it is.
+    filtered_chunk->copy = true;
+    filtered_chunk->records.clear();
+    filtered_chunk->chunk_decoder.Clear();
+  } else {
+    filtered_chunk->chunk = Chunk();
+  }
+}
+
+Status Filter::WriteChunk(const FilteredChunk& filtered_chunk) {
+  if (ABSL_PREDICT_FALSE(!filtered_chunk.status.ok())) {
+    return filtered_chunk.status;
+  }
+  if (filtered_chunk.copy) {
+    if (ABSL_PREDICT_FALSE(!dest_->WriteChunk(filtered_chunk.chunk))) {
+      return dest_->status();
+    }
+  } else if (!filtered_chunk.records.empty()) {
+    if (ABSL_PREDICT_FALSE(!dest_->WriteRecords(filtered_chunk.records))) {
+      return dest_->status();
+    }
+    if (preserve_chunk_boundaries_) {
+      if (ABSL_PREDICT_FALSE(!dest_->CloseChunk())) return dest_->status();
+    }
+  }
+  return OkStatus();
+}
+
+}  // namespace
+
+Status FilterRecords(ChunkReader* src, const RecordFilter& filter,
+                     RecordWriterBase* dest, FilterRecordsOptions options) {
+  if (ABSL_PREDICT_FALSE(!src->healthy())) return src->status();
+  if (ABSL_PREDICT_FALSE(!dest->healthy())) return dest->status();
+  Filter filter_records(&filter, dest, options);
+  return filter_records.AddSource(src);
+}
+
+}  // namespace riegeli
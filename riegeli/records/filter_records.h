@@ -0,0 +1,152 @@
+// Copyright 2019 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef RIEGELI_RECORDS_FILTER_RECORDS_H_
+#define RIEGELI_RECORDS_FILTER_RECORDS_H_
+
+#include <functional>
+#include <string>
+#include <utility>
+
+#include "absl/strings/string_view.h"
+#include "riegeli/base/base.h"
+#include "riegeli/base/status.h"
+#include "riegeli/records/chunk_reader.h"
+#include "riegeli/records/record_position.h"
+#include "riegeli/records/record_writer.h"
+
+namespace riegeli {
+
+class FilterRecordsOptions {
+ public:
+  FilterRecordsOptions() noexcept {}
+
+  // Sets the maximum number of chunks decoded and filtered concurrently,
+  // besides the calling thread. If 0, chunks are filtered in the calling
+  // thread.
+  //
+  // Re-encoding of changed chunks is parallelized by the destination instead
+  // (see `RecordWriterBase::Options::set_parallelism()`).
+  //
+  // Default: 4
+  FilterRecordsOptions& set_parallelism(int parallelism) & {
+    RIEGELI_ASSERT_GE(parallelism, 0)
+        << "Failed precondition of FilterRecordsOptions::set_parallelism(): "
+           "negative parallelism";
+    parallelism_ = parallelism;
+    return *this;
+  }
+  FilterRecordsOptions&& set_parallelism(int parallelism) && {
+    return std::move(set_parallelism(parallelism));
+  }
+  int parallelism() const { return parallelism_; }
+
+  // If `true`, a chunk whose records are all kept unchanged is copied with
+  // `RecordWriterBase::WriteChunk()` instead of being re-encoded, which is
+  // much faster but keeps the encoding and boundaries of the source chunk.
+  //
+  // This must be `false` if the destination uses
+  // `RecordWriterBase::Options::set_chunk_statistics()` or
+  // `RecordWriterBase::Options::set_key_extractor()`.
+  //
+  // Chunks compressed with a Zstd dictionary or referring to a shared
+  // transposition header are always re-encoded, because the dictionary or
+  // header of the source is not written to the destination.
+  //
+  // Default: `true`
+  FilterRecordsOptions& set_copy_unchanged_chunks(
+      bool copy_unchanged_chunks) & {
+    copy_unchanged_chunks_ = copy_unchanged_chunks;
+    return *this;
+  }
+  FilterRecordsOptions&& set_copy_unchanged_chunks(
+      bool copy_unchanged_chunks) && {
+    return std::move(set_copy_unchanged_chunks(copy_unchanged_chunks));
+  }
+  bool copy_unchanged_chunks() const { return copy_unchanged_chunks_; }
+
+  // If `true`, records of each source chunk which is re-encoded are written to
+  // separate chunks of the destination (see `RecordWriterBase::CloseChunk()`),
+  // so that chunk boundaries are preserved as long as
+  // `RecordWriterBase::Options::set_chunk_size()` of the destination does not
+  // split them further.
+  //
+  // If `false`, records of consecutive re-encoded chunks are joined according
+  // to options of the destination.
+  //
+  // Default: `false`
+  FilterRecordsOptions& set_preserve_chunk_boundaries(
+      bool preserve_chunk_boundaries) & {
+    preserve_chunk_boundaries_ = preserve_chunk_boundaries;
+    return *this;
+  }
+  FilterRecordsOptions&& set_preserve_chunk_boundaries(
+      bool preserve_chunk_boundaries) && {
+    return std::move(set_preserve_chunk_boundaries(preserve_chunk_boundaries));
+  }
+  bool preserve_chunk_boundaries() const { return preserve_chunk_boundaries_; }
+
+ private:
+  int parallelism_ = 4;
+  bool copy_unchanged_chunks_ = true;
+  bool preserve_chunk_boundaries_ = false;
+};
+
+// What `FilterRecords()` does with a record.
+enum class FilterAction {
+  // The record is written unchanged.
+  kKeep,
+  // The record is not written.
+  kDrop,
+  // `*replacement` is written instead of the record.
+  kReplace,
+};
+
+// Decides what to do with a record at position `key`. `record` is valid only
+// during the call. `*replacement` is empty on entry, and is used only if
+// `FilterAction::kReplace` is returned.
+//
+// `RecordFilter` is called concurrently from multiple threads for records of
+// different chunks, in an unspecified order.
+using RecordFilter =
+    std::function<FilterAction(const RecordPosition& key,
+                               absl::string_view record,
+                               std::string* replacement)>;
+
+// Rewrites records of a Riegeli/records file read by `*src` to `*dest`,
+// keeping, dropping, or replacing each record as decided by `filter`.
+//
+// Chunks are decoded and filtered concurrently, and written to `*dest` in the
+// order of the source. Records of a chunk which changed are written with
+// `RecordWriterBase::WriteRecords()`, so they are re-encoded according to the
+// options of `*dest`, concurrently if `*dest` has parallelism. Unchanged
+// chunks are copied if `options.copy_unchanged_chunks()`.
+//
+// File metadata of the source are not copied: they can be read beforehand with
+// `RecordReaderBase::ReadSerializedMetadata()` and set with
+// `RecordWriterBase::Options::set_serialized_metadata()`. Chunks describing the
+// layout of the source, like the index, are not copied either.
+//
+// `*dest` is not closed, so more records can be written afterwards.
+//
+// Returns status:
+//  * `status.ok()`  - success
+//  * `!status.ok()` - failure
+Status FilterRecords(ChunkReader* src, const RecordFilter& filter,
+                     RecordWriterBase* dest,
+                     FilterRecordsOptions options = FilterRecordsOptions());
+
+}  // namespace riegeli
+
+#endif  // RIEGELI_RECORDS_FILTER_RECORDS_H_
@@ -0,0 +1,153 @@
+// Copyright 2017 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "riegeli/records/first_keys.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <algorithm>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "absl/base/optimization.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/string_view.h"
+#include "riegeli/base/base.h"
+#include "riegeli/base/canonical_errors.h"
+#include "riegeli/base/memory_estimator.h"
+#include "riegeli/base/status.h"
+#include "riegeli/bytes/chain_reader.h"
+#include "riegeli/bytes/chain_writer.h"
+#include "riegeli/bytes/reader_utils.h"
+#include "riegeli/bytes/writer_utils.h"
+#include "riegeli/chunk_encoding/chunk.h"
+#include "riegeli/chunk_encoding/constants.h"
+
+namespace riegeli {
+
+void FirstKeys::Clear() { keys_.clear(); }
+
+void FirstKeys::Add(absl::string_view key) {
+  RIEGELI_ASSERT(keys_.empty() || absl::string_view(keys_.back()) <= key)
+      << "Failed precondition of FirstKeys::Add(): keys not sorted";
+  keys_.emplace_back(key);
+}
+
+absl::string_view FirstKeys::key(size_t chunk_index) const {
+  RIEGELI_ASSERT_LT(chunk_index, keys_.size())
+      << "Failed precondition of FirstKeys::key(): "
+         "chunk index out of range";
+  return keys_[chunk_index];
+}
+
+size_t FirstKeys::LowerBound(absl::string_view key) const {
+  return IntCast<size_t>(
+      std::lower_bound(keys_.begin(), keys_.end(), key,
+                       [](const std::string& a, absl::string_view b) {
+                         return absl::string_view(a) < b;
+                       }) -
+      keys_.begin());
+}
+
+void FirstKeys::Encode(HashType hash_type, Chunk* chunk) const {
+  chunk->data.Clear();
+  ChainWriter<> data_writer(&chunk->data);
+  WriteVarint64(&data_writer, IntCast<uint64_t>(keys_.size()));
+  absl::string_view previous_key;
+  for (const std::string& key : keys_) {
+    // Consecutive sorted keys often share a prefix, which is stored once.
+    const size_t shared_size =
+        IntCast<size_t>(std::mismatch(previous_key.begin(), previous_key.end(),
+                                      key.begin(), key.end())
+                            .first -
+                        previous_key.begin());
+    WriteVarint64(&data_writer, IntCast<uint64_t>(shared_size));
+    WriteVarint64(&data_writer, IntCast<uint64_t>(key.size() - shared_size));
+    data_writer.Write(absl::string_view(key).substr(shared_size));
+    previous_key = key;
+  }
+  if (!data_writer.Close()) {
+    RIEGELI_ASSERT_UNREACHABLE()
+        << "Writing to a Chain failed: " << data_writer.status();
+  }
+  chunk->header =
+      ChunkHeader(chunk->data, ChunkType::kFirstKeys, 0, 0, hash_type);
+}
+
+Status FirstKeys::Decode(const Chunk& chunk) {
+  Clear();
+  if (ABSL_PREDICT_FALSE(chunk.header.chunk_type() != ChunkType::kFirstKeys)) {
+    return InvalidArgumentError(
+        absl::StrCat("Not a first key chunk, chunk type: ",
+                     static_cast<uint64_t>(chunk.header.chunk_type())));
+  }
+  ChainReader<> data_reader(&chunk.data);
+  uint64_t num_chunks;
+  if (ABSL_PREDICT_FALSE(!ReadVarint64(&data_reader, &num_chunks))) {
+    return DataLossError("Invalid first key chunk: reading header failed");
+  }
+  // Each chunk takes at least 2 bytes.
+  if (ABSL_PREDICT_FALSE(num_chunks > chunk.data.size() / 2)) {
+    return DataLossError(absl::StrCat(
+        "Invalid first key chunk: too many chunks: ", num_chunks));
+  }
+  keys_.reserve(IntCast<size_t>(num_chunks));
+  for (uint64_t i = 0; i < num_chunks; ++i) {
+    uint64_t shared_size;
+    uint64_t suffix_size;
+    if (ABSL_PREDICT_FALSE(
+            !ReadVarint64(&data_reader, &shared_size) ||
+            !ReadVarint64(&data_reader, &suffix_size) ||
+            shared_size > (keys_.empty() ? 0 : keys_.back().size()) ||
+            suffix_size > chunk.data.size())) {
+      Clear();
+      return DataLossError(
+          absl::StrCat("Invalid first key chunk: invalid chunk at index ", i));
+    }
+    std::string suffix;
+    if (ABSL_PREDICT_FALSE(
+            !data_reader.Read(&suffix, IntCast<size_t>(suffix_size)))) {
+      Clear();
+      return DataLossError(
+          absl::StrCat("Invalid first key chunk: invalid chunk at index ", i));
+    }
+    std::string key =
+        keys_.empty() ? std::string()
+                      : keys_.back().substr(0, IntCast<size_t>(shared_size));
+    key.append(suffix);
+    if (ABSL_PREDICT_FALSE(!keys_.empty() && key < keys_.back())) {
+      Clear();
+      return DataLossError(absl::StrCat(
+          "Invalid first key chunk: keys not sorted at index ", i));
+    }
+    keys_.push_back(std::move(key));
+  }
+  if (ABSL_PREDICT_FALSE(!data_reader.VerifyEndAndClose())) {
+    Clear();
+    return DataLossError("Invalid first key chunk: unexpected data at end");
+  }
+  return OkStatus();
+}
+
+void FirstKeys::RegisterSubobjects(MemoryEstimator* memory_estimator) const {
+  memory_estimator->RegisterDynamicMemory(keys_.capacity() *
+                                          sizeof(std::string));
+  for (const std::string& key : keys_) {
+    memory_estimator->RegisterDynamicMemory(key.capacity() + 1);
+  }
+}
+
+}  // namespace riegeli
@@ -0,0 +1,88 @@
+// Copyright 2017 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef RIEGELI_RECORDS_FIRST_KEYS_H_
+#define RIEGELI_RECORDS_FIRST_KEYS_H_
+
+#include <stddef.h>
+
+#include <string>
+#include <vector>
+
+#include "absl/strings/string_view.h"
+#include "riegeli/base/base.h"
+#include "riegeli/base/memory_estimator.h"
+#include "riegeli/base/status.h"
+#include "riegeli/chunk_encoding/chunk.h"
+#include "riegeli/chunk_encoding/constants.h"
+
+namespace riegeli {
+
+// Keys of first records of chunks containing records, in the order of chunks
+// in the index, for a file whose records are sorted by their keys. This is
+// stored in a first key chunk, which is written before the key filter chunk by
+// `RecordWriter` if `set_sorted_keys()` is used, and allows
+// `RecordReader::SeekToKey()` to find the chunk containing a key without
+// reading other chunks.
+class FirstKeys {
+ public:
+  FirstKeys() noexcept {}
+
+  FirstKeys(const FirstKeys&) = default;
+  FirstKeys& operator=(const FirstKeys&) = default;
+
+  FirstKeys(FirstKeys&&) noexcept = default;
+  FirstKeys& operator=(FirstKeys&&) noexcept = default;
+
+  // Makes `*this` equivalent to a newly constructed `FirstKeys`.
+  void Clear();
+
+  // Appends the key of the first record of the next chunk.
+  //
+  // Precondition: `key` is not less than keys added so far
+  void Add(absl::string_view key);
+
+  // Returns the number of chunks with keys.
+  size_t num_chunks() const { return keys_.size(); }
+
+  // Returns the key of the first record of the chunk with the given number.
+  //
+  // Precondition: `chunk_index < num_chunks()`
+  absl::string_view key(size_t chunk_index) const;
+
+  // Returns the number of the first chunk whose first key is not less than
+  // `key`, or `num_chunks()` if there is no such chunk.
+  size_t LowerBound(absl::string_view key) const;
+
+  // Encodes keys as a first key chunk, computing `data_hash` with `hash_type`.
+  void Encode(HashType hash_type, Chunk* chunk) const;
+
+  // Decodes keys from a first key chunk.
+  //
+  // Returns status:
+  //  * `status.ok()`  - success
+  //  * `!status.ok()` - failure (`*this` is cleared)
+  Status Decode(const Chunk& chunk);
+
+  // Registers subobjects with `MemoryEstimator`.
+  void RegisterSubobjects(MemoryEstimator* memory_estimator) const;
+
+ private:
+  // Invariant: keys are sorted
+  std::vector<std::string> keys_;
+};
+
+}  // namespace riegeli
+
+#endif  // RIEGELI_RECORDS_FIRST_KEYS_H_
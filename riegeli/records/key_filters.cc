@@ -0,0 +1,179 @@
+// Copyright 2017 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "riegeli/records/key_filters.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "absl/base/optimization.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/string_view.h"
+#include "riegeli/base/base.h"
+#include "riegeli/base/canonical_errors.h"
+#include "riegeli/base/memory_estimator.h"
+#include "riegeli/base/status.h"
+#include "riegeli/bytes/chain_reader.h"
+#include "riegeli/bytes/chain_writer.h"
+#include "riegeli/bytes/reader_utils.h"
+#include "riegeli/bytes/writer_utils.h"
+#include "riegeli/chunk_encoding/chunk.h"
+#include "riegeli/chunk_encoding/constants.h"
+#include "riegeli/chunk_encoding/hash.h"
+
+namespace riegeli {
+
+namespace {
+
+// The number of hash functions is limited so that a corrupted filter cannot
+// make `MayContain()` arbitrarily slow.
+constexpr int kMaxNumHashes = 30;
+
+// Calls `bit_function(bit)` for each bit of a filter of `num_bits` bits which
+// corresponds to `key_hash`, until it returns `false`. Returns whether all
+// calls returned `true`.
+//
+// Bit positions are derived from `key_hash` by double hashing.
+template <typename BitFunction>
+inline bool ForEachBit(uint64_t key_hash, int num_hashes, uint64_t num_bits,
+                       BitFunction bit_function) {
+  const uint64_t delta = (key_hash >> 32) | (key_hash << 32) | 1;
+  uint64_t h = key_hash;
+  for (int i = 0; i < num_hashes; ++i) {
+    if (!bit_function(IntCast<size_t>(h % num_bits))) return false;
+    h += delta;
+  }
+  return true;
+}
+
+}  // namespace
+
+uint64_t KeyFilters::HashKey(absl::string_view key) {
+  return internal::Hash(key);
+}
+
+void KeyFilters::Clear() { filters_.clear(); }
+
+void KeyFilters::Add(const std::vector<uint64_t>& key_hashes,
+                     int bits_per_key) {
+  RIEGELI_ASSERT_GT(bits_per_key, 0)
+      << "Failed precondition of KeyFilters::Add(): "
+         "non-positive bits per key";
+  Filter filter;
+  // About 0.69 (ln 2) hash functions per bit per key minimize the false
+  // positive rate.
+  filter.num_hashes = SignedMax(
+      SignedMin((bits_per_key * 69 + 50) / 100, kMaxNumHashes), 1);
+  // Small filters have a high false positive rate, so use at least 64 bits.
+  const size_t num_bytes = UnsignedMax(
+      (key_hashes.size() * IntCast<size_t>(bits_per_key) + 7) / 8, size_t{8});
+  filter.bits.assign(num_bytes, '\0');
+  const uint64_t num_bits = uint64_t{num_bytes} * 8;
+  for (const uint64_t key_hash : key_hashes) {
+    ForEachBit(key_hash, filter.num_hashes, num_bits, [&](size_t bit) {
+      filter.bits[bit / 8] |= static_cast<char>(1 << (bit % 8));
+      return true;
+    });
+  }
+  filters_.push_back(std::move(filter));
+}
+
+bool KeyFilters::MayContain(size_t chunk_index, uint64_t key_hash) const {
+  RIEGELI_ASSERT_LT(chunk_index, filters_.size())
+      << "Failed precondition of KeyFilters::MayContain(): "
+         "chunk index out of range";
+  const Filter& filter = filters_[chunk_index];
+  const uint64_t num_bits = uint64_t{filter.bits.size()} * 8;
+  return ForEachBit(key_hash, filter.num_hashes, num_bits, [&](size_t bit) {
+    return (static_cast<unsigned char>(filter.bits[bit / 8]) &
+            (1u << (bit % 8))) != 0;
+  });
+}
+
+void KeyFilters::Encode(HashType hash_type, Chunk* chunk) const {
+  chunk->data.Clear();
+  ChainWriter<> data_writer(&chunk->data);
+  WriteVarint64(&data_writer, IntCast<uint64_t>(filters_.size()));
+  for (const Filter& filter : filters_) {
+    WriteVarint32(&data_writer, IntCast<uint32_t>(filter.num_hashes));
+    WriteVarint64(&data_writer, IntCast<uint64_t>(filter.bits.size()));
+    data_writer.Write(filter.bits);
+  }
+  if (!data_writer.Close()) {
+    RIEGELI_ASSERT_UNREACHABLE()
+        << "Writing to a Chain failed: " << data_writer.status();
+  }
+  chunk->header =
+      ChunkHeader(chunk->data, ChunkType::kKeyFilters, 0, 0, hash_type);
+}
+
+Status KeyFilters::Decode(const Chunk& chunk) {
+  Clear();
+  if (ABSL_PREDICT_FALSE(chunk.header.chunk_type() != ChunkType::kKeyFilters)) {
+    return InvalidArgumentError(absl::StrCat(
+        "Not a key filter chunk, chunk type: ",
+        static_cast<uint64_t>(chunk.header.chunk_type())));
+  }
+  ChainReader<> data_reader(&chunk.data);
+  uint64_t num_chunks;
+  if (ABSL_PREDICT_FALSE(!ReadVarint64(&data_reader, &num_chunks))) {
+    return DataLossError("Invalid key filter chunk: reading header failed");
+  }
+  // Each chunk takes at least 3 bytes.
+  if (ABSL_PREDICT_FALSE(num_chunks > chunk.data.size() / 3)) {
+    return DataLossError(absl::StrCat(
+        "Invalid key filter chunk: too many chunks: ", num_chunks));
+  }
+  filters_.reserve(IntCast<size_t>(num_chunks));
+  for (uint64_t i = 0; i < num_chunks; ++i) {
+    uint32_t num_hashes;
+    uint64_t num_bytes;
+    if (ABSL_PREDICT_FALSE(!ReadVarint32(&data_reader, &num_hashes) ||
+                           !ReadVarint64(&data_reader, &num_bytes) ||
+                           num_hashes == 0 ||
+                           num_hashes > uint32_t{kMaxNumHashes} ||
+                           num_bytes == 0 || num_bytes > chunk.data.size())) {
+      Clear();
+      return DataLossError(
+          absl::StrCat("Invalid key filter chunk: invalid chunk at index ", i));
+    }
+    Filter filter;
+    filter.num_hashes = IntCast<int>(num_hashes);
+    if (ABSL_PREDICT_FALSE(
+            !data_reader.Read(&filter.bits, IntCast<size_t>(num_bytes)))) {
+      Clear();
+      return DataLossError(
+          absl::StrCat("Invalid key filter chunk: invalid chunk at index ", i));
+    }
+    filters_.push_back(std::move(filter));
+  }
+  if (ABSL_PREDICT_FALSE(!data_reader.VerifyEndAndClose())) {
+    Clear();
+    return DataLossError("Invalid key filter chunk: unexpected data at end");
+  }
+  return OkStatus();
+}
+
+void KeyFilters::RegisterSubobjects(MemoryEstimator* memory_estimator) const {
+  memory_estimator->RegisterDynamicMemory(filters_.capacity() * sizeof(Filter));
+  for (const Filter& filter : filters_) {
+    memory_estimator->RegisterDynamicMemory(filter.bits.capacity() + 1);
+  }
+}
+
+}  // namespace riegeli
@@ -0,0 +1,94 @@
+// Copyright 2017 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef RIEGELI_RECORDS_KEY_FILTERS_H_
+#define RIEGELI_RECORDS_KEY_FILTERS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+#include "absl/strings/string_view.h"
+#include "riegeli/base/base.h"
+#include "riegeli/base/memory_estimator.h"
+#include "riegeli/base/status.h"
+#include "riegeli/chunk_encoding/chunk.h"
+#include "riegeli/chunk_encoding/constants.h"
+
+namespace riegeli {
+
+// Bloom filters over record keys, one for each chunk containing records, in the
+// order of chunks in the index. This is stored in a key filter chunk, which is
+// written immediately before the index chunk by `RecordWriter` if
+// `set_key_extractor()` is used, and allows `RecordReader::Lookup()` to read
+// only chunks which might contain a record with the given key.
+class KeyFilters {
+ public:
+  KeyFilters() noexcept {}
+
+  KeyFilters(const KeyFilters&) = default;
+  KeyFilters& operator=(const KeyFilters&) = default;
+
+  KeyFilters(KeyFilters&&) noexcept = default;
+  KeyFilters& operator=(KeyFilters&&) noexcept = default;
+
+  // Returns the hash of a key, which is what filters store.
+  static uint64_t HashKey(absl::string_view key);
+
+  // Makes `*this` equivalent to a newly constructed `KeyFilters`.
+  void Clear();
+
+  // Appends a filter of the next chunk, containing keys with the given hashes.
+  //
+  // Precondition: `bits_per_key > 0`
+  void Add(const std::vector<uint64_t>& key_hashes, int bits_per_key);
+
+  // Returns the number of chunks with filters.
+  size_t num_chunks() const { return filters_.size(); }
+
+  // Returns `false` if the chunk with the given number surely does not contain
+  // a record with a key with `key_hash`, or `true` if it might contain it.
+  //
+  // Precondition: `chunk_index < num_chunks()`
+  bool MayContain(size_t chunk_index, uint64_t key_hash) const;
+
+  // Encodes filters as a key filter chunk, computing `data_hash` with
+  // `hash_type`.
+  void Encode(HashType hash_type, Chunk* chunk) const;
+
+  // Decodes filters from a key filter chunk.
+  //
+  // Returns status:
+  //  * `status.ok()`  - success
+  //  * `!status.ok()` - failure (`*this` is cleared)
+  Status Decode(const Chunk& chunk);
+
+  // Registers subobjects with `MemoryEstimator`.
+  void RegisterSubobjects(MemoryEstimator* memory_estimator) const;
+
+ private:
+  struct Filter {
+    int num_hashes = 0;
+    // Invariant: `!bits.empty()`
+    std::string bits;
+  };
+
+  std::vector<Filter> filters_;
+};
+
+}  // namespace riegeli
+
+#endif  // RIEGELI_RECORDS_KEY_FILTERS_H_
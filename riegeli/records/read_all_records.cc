@@ -0,0 +1,85 @@
+// Copyright 2019 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "riegeli/records/read_all_records.h"
+
+#include <fcntl.h>
+
+#include <memory>
+#include <string>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+#include "absl/base/optimization.h"
+#include "absl/strings/string_view.h"
+#include "absl/types/span.h"
+#include "riegeli/base/base.h"
+#include "riegeli/base/chain.h"
+#include "riegeli/base/recycling_pool.h"
+#include "riegeli/base/status.h"
+#include "riegeli/bytes/chain_reader.h"
+#include "riegeli/bytes/fd_reader.h"
+#include "riegeli/records/record_reader.h"
+
+namespace riegeli {
+
+namespace {
+
+using PooledRecordReader = RecordReader<ChainReader<Chain>>;
+
+}  // namespace
+
+Status ReadAllRecords(Chain data, std::vector<std::string>* records,
+                      RecordReaderBase::Options options) {
+  RecyclingPool<PooledRecordReader>::Handle record_reader =
+      RecyclingPool<PooledRecordReader>::global().Get(
+          [] { return std::make_unique<PooledRecordReader>(); });
+  record_reader->Reset(std::forward_as_tuple(std::move(data)),
+                       std::move(options));
+  absl::Span<const absl::string_view> batch;
+  while (record_reader->ReadRecords(&batch)) {
+    for (const absl::string_view record : batch) {
+      records->emplace_back(record);
+    }
+  }
+  Status status = OkStatus();
+  if (ABSL_PREDICT_FALSE(!record_reader->Close())) {
+    status = record_reader->status();
+  }
+  // Release the data of the file before putting the `RecordReader` back into
+  // the pool. Storage of the chunk decoder is kept.
+  record_reader->Reset();
+  return status;
+}
+
+Status ReadAllRecords(absl::string_view filename,
+                      std::vector<std::string>* records,
+                      RecordReaderBase::Options options) {
+  Chain data;
+  {
+    FdReader<> src(filename, O_RDONLY);
+    Position size;
+    if (ABSL_PREDICT_FALSE(!src.Size(&size))) return src.status();
+    if (ABSL_PREDICT_FALSE(!src.Read(&data, IntCast<size_t>(size)))) {
+      if (ABSL_PREDICT_FALSE(!src.healthy())) return src.status();
+      // The file was truncated while being read. Decode what was read, so
+      // that this is reported like a truncated file.
+    }
+    if (ABSL_PREDICT_FALSE(!src.Close())) return src.status();
+  }
+  return ReadAllRecords(std::move(data), records, std::move(options));
+}
+
+}  // namespace riegeli
@@ -0,0 +1,63 @@
+// Copyright 2019 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef RIEGELI_RECORDS_READ_ALL_RECORDS_H_
+#define RIEGELI_RECORDS_READ_ALL_RECORDS_H_
+
+#include <string>
+#include <vector>
+
+#include "absl/strings/string_view.h"
+#include "riegeli/base/chain.h"
+#include "riegeli/base/status.h"
+#include "riegeli/records/record_reader.h"
+
+namespace riegeli {
+
+// Reads all records of a Riegeli/records file whose contents are `data`, and
+// appends them to `*records`.
+//
+// This is a fast path for reading many small files. The `RecordReader` is
+// taken from a global `RecyclingPool` and reinitialized with `Reset()`, so
+// that storage of its chunk decoder is reused across files instead of being
+// allocated for each file. Together with `Chain::SetBlockRecycling()`, this
+// avoids most allocations beside records themselves.
+//
+// On failure, `*records` contains records read before the failure.
+//
+// Returns status:
+//  * `status.ok()`  - success
+//  * `!status.ok()` - failure
+Status ReadAllRecords(
+    Chain data, std::vector<std::string>* records,
+    RecordReaderBase::Options options = RecordReaderBase::Options());
+
+// Reads all records of the Riegeli/records file named `filename`, and appends
+// them to `*records`.
+//
+// The whole file is read into memory at once, then decoded like by
+// `ReadAllRecords(Chain)`, so this is meant for small files.
+//
+// On failure, `*records` contains records read before the failure.
+//
+// Returns status:
+//  * `status.ok()`  - success
+//  * `!status.ok()` - failure
+Status ReadAllRecords(
+    absl::string_view filename, std::vector<std::string>* records,
+    RecordReaderBase::Options options = RecordReaderBase::Options());
+
+}  // namespace riegeli
+
+#endif  // RIEGELI_RECORDS_READ_ALL_RECORDS_H_
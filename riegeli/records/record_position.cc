@@ -106,6 +106,10 @@ void FutureRecordPosition::FutureChunkBegin::Resolve() const {
       if (length < ChunkHeader::size()) length += internal::kBlockSize;
       pos += length;
     }
+    void operator()(const AlignChunkData&) {
+      // Matches `DefaultChunkWriterBase::AlignChunkData()`.
+      pos = internal::AlignedChunkBegin(pos);
+    }
 
     Position pos;
   };
@@ -33,6 +33,8 @@
 
 namespace riegeli {
 
+class RecordWriterBase;
+
 // `RecordPosition` represents the position of a record in a Riegeli/records
 // file, or a position between records.
 //
@@ -105,8 +107,9 @@ class RecordPosition {
 class FutureRecordPosition {
  public:
   struct PadToBlockBoundary {};
-  using Action =
-      absl::variant<std::shared_future<ChunkHeader>, PadToBlockBoundary>;
+  struct AlignChunkData {};
+  using Action = absl::variant<std::shared_future<ChunkHeader>,
+                               PadToBlockBoundary, AlignChunkData>;
 
   constexpr FutureRecordPosition() noexcept {}
 
@@ -125,6 +128,9 @@ class FutureRecordPosition {
   RecordPosition get() const;
 
  private:
+  // For advancing `record_index_` in `RecordWriterBase::WriteRecords()`.
+  friend class RecordWriterBase;
+
   class FutureChunkBegin;
 
   std::shared_ptr<FutureChunkBegin> future_chunk_begin_;
@@ -134,6 +140,43 @@ class FutureRecordPosition {
   uint64_t record_index_ = 0;
 };
 
+// `ChunkSequencePosition` identifies a record written by a `RecordWriter` by
+// the sequence number of its chunk among chunks containing records written by
+// that `RecordWriter`, counting from 0, and by the index of the record within
+// the chunk.
+//
+// Unlike `FutureRecordPosition`, this is known without waiting for pending
+// chunks to be encoded, and costs no allocation. It can be converted to a
+// `RecordPosition` when the beginning of the chunk is known, e.g. in bulk after
+// `RecordWriter::Close()`, with chunk beginnings reported by
+// `RecordWriterBase::Options::set_chunk_written_callback()`.
+class ChunkSequencePosition {
+ public:
+  constexpr ChunkSequencePosition() noexcept {}
+
+  explicit ChunkSequencePosition(uint64_t chunk_number,
+                                 uint64_t record_index) noexcept
+      : chunk_number_(chunk_number), record_index_(record_index) {}
+
+  ChunkSequencePosition(const ChunkSequencePosition& that) noexcept = default;
+  ChunkSequencePosition& operator=(const ChunkSequencePosition& that) noexcept =
+      default;
+
+  // Sequence number of the chunk containing the record.
+  uint64_t chunk_number() const { return chunk_number_; }
+  // Index of the record within the chunk.
+  uint64_t record_index() const { return record_index_; }
+
+  // Returns the position of the record, given the beginning of its chunk.
+  RecordPosition ToRecordPosition(Position chunk_begin) const {
+    return RecordPosition(chunk_begin, record_index_);
+  }
+
+ private:
+  uint64_t chunk_number_ = 0;
+  uint64_t record_index_ = 0;
+};
+
 // Implementation details follow.
 
 inline RecordPosition::RecordPosition(uint64_t chunk_begin,
@@ -17,47 +17,81 @@
 #include <stddef.h>
 #include <stdint.h>
 
+#include <algorithm>
+#include <deque>
 #include <functional>
+#include <future>
+#include <limits>
+#include <list>
 #include <memory>
 #include <string>
 #include <utility>
 #include <vector>
 
 #include "absl/base/optimization.h"
+#include "absl/base/thread_annotations.h"
+#include "absl/container/flat_hash_map.h"
 #include "absl/strings/str_cat.h"
 #include "absl/strings/string_view.h"
+#include "absl/synchronization/mutex.h"
+#include "absl/time/clock.h"
+#include "absl/time/time.h"
+#include "absl/types/span.h"
 #include "google/protobuf/descriptor.h"
 #include "google/protobuf/descriptor.pb.h"
+#include "google/protobuf/dynamic_message.h"
 #include "google/protobuf/message.h"
 #include "riegeli/base/base.h"
 #include "riegeli/base/canonical_errors.h"
 #include "riegeli/base/chain.h"
+#include "riegeli/base/memory.h"
+#include "riegeli/base/memory_estimator.h"
 #include "riegeli/base/object.h"
+#include "riegeli/base/parallelism.h"
 #include "riegeli/base/status.h"
 #include "riegeli/bytes/chain_backward_writer.h"
 #include "riegeli/bytes/chain_reader.h"
 #include "riegeli/bytes/message_parse.h"
+#include "riegeli/bytes/zstd_dictionary.h"
 #include "riegeli/chunk_encoding/chunk.h"
 #include "riegeli/chunk_encoding/chunk_decoder.h"
+#include "riegeli/chunk_encoding/compiled_field_projection.h"
 #include "riegeli/chunk_encoding/constants.h"
 #include "riegeli/chunk_encoding/field_projection.h"
 #include "riegeli/chunk_encoding/transpose_decoder.h"
+#include "riegeli/records/block.h"
+#include "riegeli/records/chunk_index.h"
 #include "riegeli/records/chunk_reader.h"
+#include "riegeli/records/chunk_statistics.h"
+#include "riegeli/records/first_keys.h"
+#include "riegeli/records/key_filters.h"
 #include "riegeli/records/record_position.h"
+#include "riegeli/records/record_stats.h"
 #include "riegeli/records/records_metadata.pb.h"
 #include "riegeli/records/skipped_region.h"
 
 namespace riegeli {
 
+namespace {
+
+// The position of the file metadata chunk, if any. It follows the file
+// signature, which is a chunk without data after the first block header.
+constexpr Position kMetadataChunkBegin =
+    internal::BlockHeader::size() + ChunkHeader::size();
+
+}  // namespace
+
 class RecordsMetadataDescriptors::ErrorCollector
     : public google::protobuf::DescriptorPool::ErrorCollector {
  public:
   void AddError(const std::string& filename, const std::string& element_name,
                 const google::protobuf::Message* descriptor,
                 ErrorLocation location, const std::string& message) override {
-    descriptors_->Fail(
-        DataLossError(absl::StrCat("Error in file ", filename, ", element ",
-                                   element_name, ": ", message)));
+    if (status_->ok()) {
+      *status_ =
+          DataLossError(absl::StrCat("Error in file ", filename, ", element ",
+                                     element_name, ": ", message));
+    }
   }
 
   void AddWarning(const std::string& filename, const std::string& element_name,
@@ -68,31 +102,141 @@ class RecordsMetadataDescriptors::ErrorCollector
  private:
   friend class RecordsMetadataDescriptors;
 
-  explicit ErrorCollector(RecordsMetadataDescriptors* descriptors)
-      : descriptors_(descriptors) {}
+  explicit ErrorCollector(Status* status) : status_(status) {}
 
-  RecordsMetadataDescriptors* descriptors_;
+  // The first error.
+  Status* status_;
 };
 
-RecordsMetadataDescriptors::RecordsMetadataDescriptors(
-    const RecordsMetadata& metadata)
-    : Object(kInitiallyOpen), record_type_name_(metadata.record_type_name()) {
-  if (record_type_name_.empty() || metadata.file_descriptor().empty()) return;
-  pool_ = std::make_unique<google::protobuf::DescriptorPool>();
-  ErrorCollector error_collector(this);
+// Descriptors built from `file_descriptor` of metadata, shared by
+// `RecordsMetadataDescriptors` objects with the same `file_descriptor`.
+struct RecordsMetadataDescriptors::Pool {
+  google::protobuf::DescriptorPool pool;
+  // `DynamicMessageFactory::GetPrototype()` is thread-safe.
+  mutable google::protobuf::DynamicMessageFactory factory{&pool};
+  // The failure of building `pool`, if any.
+  Status status;
+};
+
+// A process-wide cache of `Pool` objects, keyed by serialized
+// `file_descriptor`, evicting least recently used pools first. An evicted pool
+// remains valid while `RecordsMetadataDescriptors` objects refer to it.
+class RecordsMetadataDescriptors::PoolCache {
+ public:
+  static PoolCache& global();
+
+  // Returns the pool built from `metadata.file_descriptor()`, building it if
+  // it is not cached.
+  std::shared_ptr<const Pool> GetPool(const RecordsMetadata& metadata);
+
+ private:
+  struct Entry {
+    std::string key;
+    std::shared_ptr<const Pool> pool;
+  };
+
+  static constexpr size_t kMaxPools = 16;
+
+  absl::Mutex mutex_;
+  // Entries in the order of usage, most recently used first.
+  std::list<Entry> entries_ ABSL_GUARDED_BY(mutex_);
+  absl::flat_hash_map<absl::string_view, std::list<Entry>::iterator> index_
+      ABSL_GUARDED_BY(mutex_);
+};
+
+constexpr size_t RecordsMetadataDescriptors::PoolCache::kMaxPools;
+
+RecordsMetadataDescriptors::PoolCache&
+RecordsMetadataDescriptors::PoolCache::global() {
+  static NoDestructor<PoolCache> kStaticPoolCache;
+  return *kStaticPoolCache;
+}
+
+std::shared_ptr<const RecordsMetadataDescriptors::Pool>
+RecordsMetadataDescriptors::PoolCache::GetPool(
+    const RecordsMetadata& metadata) {
+  // Serializing descriptors is much cheaper than building a pool from them.
+  // The whole serialized form is the key, so that different descriptors never
+  // share a pool.
+  RecordsMetadata key_metadata;
+  *key_metadata.mutable_file_descriptor() = metadata.file_descriptor();
+  std::string key = key_metadata.SerializeAsString();
+  {
+    absl::MutexLock lock(&mutex_);
+    const absl::flat_hash_map<absl::string_view,
+                              std::list<Entry>::iterator>::iterator iter =
+        index_.find(key);
+    if (iter != index_.end()) {
+      entries_.splice(entries_.begin(), entries_, iter->second);
+      return iter->second->pool;
+    }
+  }
+  // Build the pool without holding the mutex, so that building pools of
+  // different descriptors does not wait. Concurrent callers with the same
+  // descriptors can each build a pool, and one of them gets cached.
+  const std::shared_ptr<Pool> pool = std::make_shared<Pool>();
+  ErrorCollector error_collector(&pool->status);
   for (const google::protobuf::FileDescriptorProto& file_descriptor :
        metadata.file_descriptor()) {
-    if (ABSL_PREDICT_FALSE(pool_->BuildFileCollectingErrors(
+    if (ABSL_PREDICT_FALSE(pool->pool.BuildFileCollectingErrors(
                                file_descriptor, &error_collector) == nullptr)) {
-      return;
+      if (pool->status.ok()) {
+        pool->status = DataLossError(absl::StrCat(
+            "Building file ", file_descriptor.name(), " failed"));
+      }
+      break;
     }
   }
+  absl::MutexLock lock(&mutex_);
+  const absl::flat_hash_map<absl::string_view,
+                            std::list<Entry>::iterator>::iterator iter =
+      index_.find(key);
+  if (iter != index_.end()) {
+    entries_.splice(entries_.begin(), entries_, iter->second);
+    return iter->second->pool;
+  }
+  entries_.push_front(Entry{std::move(key), pool});
+  index_.emplace(entries_.front().key, entries_.begin());
+  if (entries_.size() > kMaxPools) {
+    index_.erase(entries_.back().key);
+    entries_.pop_back();
+  }
+  return pool;
+}
+
+RecordsMetadataDescriptors::RecordsMetadataDescriptors(
+    const RecordsMetadata& metadata)
+    : Object(kInitiallyOpen), record_type_name_(metadata.record_type_name()) {
+  if (record_type_name_.empty() || metadata.file_descriptor().empty()) return;
+  pool_ = PoolCache::global().GetPool(metadata);
+  if (ABSL_PREDICT_FALSE(!pool_->status.ok())) Fail(pool_->status);
 }
 
 const google::protobuf::Descriptor* RecordsMetadataDescriptors::descriptor()
     const {
   if (pool_ == nullptr) return nullptr;
-  return pool_->FindMessageTypeByName(record_type_name_);
+  return pool_->pool.FindMessageTypeByName(record_type_name_);
+}
+
+const google::protobuf::Message* RecordsMetadataDescriptors::prototype()
+    const {
+  const google::protobuf::Descriptor* const message_descriptor = descriptor();
+  if (message_descriptor == nullptr) return nullptr;
+  return pool_->factory.GetPrototype(message_descriptor);
+}
+
+std::vector<FileRange> SplitFile(Position size, size_t num_ranges) {
+  RIEGELI_ASSERT_GT(num_ranges, 0u)
+      << "Failed precondition of SplitFile(): no ranges";
+  std::vector<FileRange> ranges(num_ranges);
+  for (size_t i = 1; i < num_ranges; ++i) {
+    // This avoids overflow of `size * i`.
+    const Position boundary =
+        size / num_ranges * i + size % num_ranges * i / num_ranges;
+    ranges[i - 1].end = boundary;
+    ranges[i].begin = boundary;
+  }
+  return ranges;
 }
 
 RecordReaderBase::RecordReaderBase(InitiallyClosed) noexcept
@@ -106,7 +250,40 @@ RecordReaderBase::RecordReaderBase(RecordReaderBase&& that) noexcept
       chunk_begin_(that.chunk_begin_),
       chunk_decoder_(std::move(that.chunk_decoder_)),
       recoverable_(std::exchange(that.recoverable_, Recoverable::kNo)),
-      recovery_(std::move(that.recovery_)) {}
+      recovery_(std::move(that.recovery_)),
+      parallelism_(that.parallelism_),
+      thread_pool_(that.thread_pool_),
+      task_priority_(that.task_priority_),
+      tail_timeout_(that.tail_timeout_),
+      tail_max_poll_interval_(that.tail_max_poll_interval_),
+      chunk_filter_(std::move(that.chunk_filter_)),
+      key_extractor_(std::move(that.key_extractor_)),
+      range_end_(that.range_end_),
+      stats_collector_(std::move(that.stats_collector_)),
+      chunk_cache_(std::move(that.chunk_cache_)),
+      chunk_cache_key_(std::move(that.chunk_cache_key_)),
+      field_projection_(std::move(that.field_projection_)),
+      project_simple_chunks_(that.project_simple_chunks_),
+      streaming_threshold_(that.streaming_threshold_),
+      transpose_resource_limits_(that.transpose_resource_limits_),
+      read_ahead_(std::move(that.read_ahead_)),
+      seeked_(std::exchange(that.seeked_, false)),
+      prefetched_(std::move(that.prefetched_)),
+      index_loaded_(std::exchange(that.index_loaded_, false)),
+      index_(std::move(that.index_)),
+      key_filters_(std::move(that.key_filters_)),
+      first_keys_(std::move(that.first_keys_)),
+      read_from_beginning_(std::exchange(that.read_from_beginning_, false)),
+      zstd_dictionary_loaded_(
+          std::exchange(that.zstd_dictionary_loaded_, false)),
+      zstd_dictionary_(std::move(that.zstd_dictionary_)),
+      shared_transpose_header_(std::move(that.shared_transpose_header_)),
+      shared_transpose_header_pos_(that.shared_transpose_header_pos_),
+      chunk_prefix_source_(std::move(that.chunk_prefix_source_)),
+      chunk_prefix_source_pos_(that.chunk_prefix_source_pos_),
+      chunk_prefixes_seen_(std::exchange(that.chunk_prefixes_seen_, false)),
+      chunk_prefix_(std::move(that.chunk_prefix_)),
+      chunk_prefix_pos_(that.chunk_prefix_pos_) {}
 
 RecordReaderBase& RecordReaderBase::operator=(
     RecordReaderBase&& that) noexcept {
@@ -115,6 +292,38 @@ RecordReaderBase& RecordReaderBase::operator=(
   chunk_decoder_ = std::move(that.chunk_decoder_);
   recoverable_ = std::exchange(that.recoverable_, Recoverable::kNo);
   recovery_ = std::move(that.recovery_);
+  parallelism_ = that.parallelism_;
+  thread_pool_ = that.thread_pool_;
+  task_priority_ = that.task_priority_;
+  tail_timeout_ = that.tail_timeout_;
+  tail_max_poll_interval_ = that.tail_max_poll_interval_;
+  chunk_filter_ = std::move(that.chunk_filter_);
+  key_extractor_ = std::move(that.key_extractor_);
+  range_end_ = that.range_end_;
+  stats_collector_ = std::move(that.stats_collector_);
+  chunk_cache_ = std::move(that.chunk_cache_);
+  chunk_cache_key_ = std::move(that.chunk_cache_key_);
+  field_projection_ = std::move(that.field_projection_);
+  project_simple_chunks_ = that.project_simple_chunks_;
+  streaming_threshold_ = that.streaming_threshold_;
+  transpose_resource_limits_ = that.transpose_resource_limits_;
+  read_ahead_ = std::move(that.read_ahead_);
+  seeked_ = std::exchange(that.seeked_, false);
+  prefetched_ = std::move(that.prefetched_);
+  index_loaded_ = std::exchange(that.index_loaded_, false);
+  index_ = std::move(that.index_);
+  key_filters_ = std::move(that.key_filters_);
+  first_keys_ = std::move(that.first_keys_);
+  read_from_beginning_ = std::exchange(that.read_from_beginning_, false);
+  zstd_dictionary_loaded_ = std::exchange(that.zstd_dictionary_loaded_, false);
+  zstd_dictionary_ = std::move(that.zstd_dictionary_);
+  shared_transpose_header_ = std::move(that.shared_transpose_header_);
+  shared_transpose_header_pos_ = that.shared_transpose_header_pos_;
+  chunk_prefix_source_ = std::move(that.chunk_prefix_source_);
+  chunk_prefix_source_pos_ = that.chunk_prefix_source_pos_;
+  chunk_prefixes_seen_ = std::exchange(that.chunk_prefixes_seen_, false);
+  chunk_prefix_ = std::move(that.chunk_prefix_);
+  chunk_prefix_pos_ = that.chunk_prefix_pos_;
   return *this;
 }
 
@@ -124,6 +333,38 @@ void RecordReaderBase::Reset(InitiallyClosed) {
   chunk_decoder_.Clear();
   recoverable_ = Recoverable::kNo;
   recovery_ = nullptr;
+  parallelism_ = 0;
+  thread_pool_ = &ThreadPool::global();
+  task_priority_ = ThreadPool::Priority::kNormal;
+  tail_timeout_ = absl::ZeroDuration();
+  tail_max_poll_interval_ = absl::Milliseconds(100);
+  chunk_filter_ = nullptr;
+  key_extractor_ = nullptr;
+  range_end_ = std::numeric_limits<Position>::max();
+  stats_collector_.reset();
+  chunk_cache_.reset();
+  chunk_cache_key_.clear();
+  field_projection_.reset();
+  project_simple_chunks_ = false;
+  streaming_threshold_ = std::numeric_limits<uint64_t>::max();
+  transpose_resource_limits_ = TransposeDecoder::ResourceLimits();
+  read_ahead_.clear();
+  seeked_ = false;
+  prefetched_.clear();
+  index_loaded_ = false;
+  index_.Clear();
+  key_filters_.Clear();
+  first_keys_.Clear();
+  read_from_beginning_ = false;
+  zstd_dictionary_loaded_ = false;
+  zstd_dictionary_ = ZstdDictionary();
+  shared_transpose_header_.Clear();
+  shared_transpose_header_pos_ = 0;
+  chunk_prefix_source_ = Chunk();
+  chunk_prefix_source_pos_ = 0;
+  chunk_prefixes_seen_ = false;
+  chunk_prefix_ = ZstdDictionary();
+  chunk_prefix_pos_ = 0;
 }
 
 void RecordReaderBase::Reset(InitiallyOpen) {
@@ -132,6 +373,38 @@ void RecordReaderBase::Reset(InitiallyOpen) {
   chunk_decoder_.Clear();
   recoverable_ = Recoverable::kNo;
   recovery_ = nullptr;
+  parallelism_ = 0;
+  thread_pool_ = &ThreadPool::global();
+  task_priority_ = ThreadPool::Priority::kNormal;
+  tail_timeout_ = absl::ZeroDuration();
+  tail_max_poll_interval_ = absl::Milliseconds(100);
+  chunk_filter_ = nullptr;
+  key_extractor_ = nullptr;
+  range_end_ = std::numeric_limits<Position>::max();
+  stats_collector_.reset();
+  chunk_cache_.reset();
+  chunk_cache_key_.clear();
+  field_projection_.reset();
+  project_simple_chunks_ = false;
+  streaming_threshold_ = std::numeric_limits<uint64_t>::max();
+  transpose_resource_limits_ = TransposeDecoder::ResourceLimits();
+  read_ahead_.clear();
+  seeked_ = false;
+  prefetched_.clear();
+  index_loaded_ = false;
+  index_.Clear();
+  key_filters_.Clear();
+  first_keys_.Clear();
+  read_from_beginning_ = false;
+  zstd_dictionary_loaded_ = false;
+  zstd_dictionary_ = ZstdDictionary();
+  shared_transpose_header_.Clear();
+  shared_transpose_header_pos_ = 0;
+  chunk_prefix_source_ = Chunk();
+  chunk_prefix_source_pos_ = 0;
+  chunk_prefixes_seen_ = false;
+  chunk_prefix_ = ZstdDictionary();
+  chunk_prefix_pos_ = 0;
 }
 
 void RecordReaderBase::Initialize(ChunkReader* src, Options&& options) {
@@ -141,14 +414,54 @@ void RecordReaderBase::Initialize(ChunkReader* src, Options&& options) {
     Fail(*src);
     return;
   }
+  src->set_verify_data_hashes(options.verify_data_hashes_);
+  src->set_verify_data_hashes_in_background(
+      options.verify_data_hashes_in_background_);
+  if (options.range_.begin > 0 && src->pos() == 0) {
+    if (ABSL_PREDICT_FALSE(!src->SeekToChunkAfter(options.range_.begin))) {
+      recoverable_ = Recoverable::kRecoverChunkReader;
+      Fail(*src);
+      return;
+    }
+  }
+  range_end_ = options.range_.end;
   chunk_begin_ = src->pos();
-  chunk_decoder_.Reset(ChunkDecoder::Options().set_field_projection(
-      std::move(options.field_projection_)));
+  read_from_beginning_ = chunk_begin_ == 0;
+  parallelism_ = options.parallelism_;
+  thread_pool_ = options.thread_pool_;
+  task_priority_ = options.task_priority_;
+  tail_timeout_ = options.tail_timeout_;
+  tail_max_poll_interval_ = options.tail_max_poll_interval_;
+  chunk_filter_ = std::move(options.chunk_filter_);
+  key_extractor_ = std::move(options.key_extractor_);
+  if (options.collect_stats_) {
+    stats_collector_ = std::make_shared<internal::RecordStatsCollector>();
+  }
+  chunk_cache_ = std::move(options.chunk_cache_);
+  chunk_cache_key_ = std::move(options.chunk_cache_key_);
+  if (!options.field_projection_.includes_all()) {
+    field_projection_ = std::make_shared<const CompiledFieldProjection>(
+        options.field_projection_);
+  }
+  project_simple_chunks_ = options.project_simple_chunks_;
+  streaming_threshold_ = options.streaming_threshold_;
+  transpose_resource_limits_ = options.transpose_resource_limits_;
+  chunk_decoder_.Reset(
+      ChunkDecoder::Options()
+          .set_compiled_field_projection(field_projection_)
+          .set_project_simple_chunks(project_simple_chunks_)
+          .set_streaming_threshold(streaming_threshold_)
+          .set_transpose_resource_limits(transpose_resource_limits_));
   recovery_ = std::move(options.recovery_);
 }
 
 void RecordReaderBase::Done() {
   recoverable_ = Recoverable::kNo;
+  // Chunks being decoded in background do not refer to `*this`, so they can
+  // be abandoned.
+  read_ahead_.clear();
+  seeked_ = false;
+  prefetched_.clear();
   if (ABSL_PREDICT_FALSE(!chunk_decoder_.Close())) Fail(chunk_decoder_);
 }
 
@@ -185,15 +498,19 @@ bool RecordReaderBase::ReadSerializedMetadata(Chain* metadata) {
   metadata->Clear();
   if (ABSL_PREDICT_FALSE(!healthy())) return TryRecovery();
   ChunkReader* const src = src_chunk_reader();
-  if (ABSL_PREDICT_FALSE(src->pos() != 0)) {
-    return Fail(FailedPreconditionError(
-        "RecordReaderBase::ReadMetadata() must be called "
-        "while the RecordReader is at the beginning of the file"));
+  if (src->pos() != 0) {
+    if (ABSL_PREDICT_FALSE(!src->SupportsRandomAccess())) {
+      return Fail(FailedPreconditionError(
+          "RecordReaderBase::ReadMetadata() must be called "
+          "while the RecordReader is at the beginning of the file "
+          "unless the file supports random access"));
+    }
+    return ReadMetadataBySeeking(metadata);
   }
 
   chunk_begin_ = src->pos();
   Chunk chunk;
-  if (ABSL_PREDICT_FALSE(!src->ReadChunk(&chunk))) {
+  if (ABSL_PREDICT_FALSE(!ReadChunkOrWait(&chunk))) {
     if (ABSL_PREDICT_FALSE(!src->healthy())) {
       recoverable_ = Recoverable::kRecoverChunkReader;
       Fail(*src);
@@ -219,7 +536,7 @@ bool RecordReaderBase::ReadSerializedMetadata(Chain* metadata) {
     // Missing file metadata chunk, assume empty `RecordsMetadata`.
     return true;
   }
-  if (ABSL_PREDICT_FALSE(!src->ReadChunk(&chunk))) {
+  if (ABSL_PREDICT_FALSE(!ReadChunkOrWait(&chunk))) {
     if (ABSL_PREDICT_FALSE(!src->healthy())) {
       recoverable_ = Recoverable::kRecoverChunkReader;
       Fail(*src);
@@ -234,6 +551,28 @@ bool RecordReaderBase::ReadSerializedMetadata(Chain* metadata) {
   return true;
 }
 
+bool RecordReaderBase::ReadMetadataBySeeking(Chain* metadata) {
+  ChunkReader* const src = src_chunk_reader();
+  // Chunks read ahead remain valid, because the position of `*src` is
+  // restored.
+  const Position pos_before = src->pos();
+  if (ABSL_PREDICT_FALSE(!src->Seek(kMetadataChunkBegin))) return Fail(*src);
+  const ChunkHeader* chunk_header;
+  if (ABSL_PREDICT_FALSE(!src->PullChunkHeader(&chunk_header))) {
+    if (ABSL_PREDICT_FALSE(!src->healthy())) return Fail(*src);
+    // The file ends after the file signature.
+    return src->Seek(pos_before) || Fail(*src);
+  }
+  if (chunk_header->chunk_type() != ChunkType::kFileMetadata) {
+    // Missing file metadata chunk, assume empty `RecordsMetadata`.
+    return src->Seek(pos_before) || Fail(*src);
+  }
+  Chunk chunk;
+  if (ABSL_PREDICT_FALSE(!ReadChunkFrom(src, &chunk))) return Fail(*src);
+  if (ABSL_PREDICT_FALSE(!src->Seek(pos_before))) return Fail(*src);
+  return ParseMetadata(chunk, metadata);
+}
+
 inline bool RecordReaderBase::ParseMetadata(const Chunk& chunk,
                                             Chain* metadata) {
   RIEGELI_ASSERT(chunk.header.chunk_type() == ChunkType::kFileMetadata)
@@ -246,6 +585,7 @@ inline bool RecordReaderBase::ParseMetadata(const Chunk& chunk,
   }
   ChainReader<> data_reader(&chunk.data);
   TransposeDecoder transpose_decoder;
+  transpose_decoder.set_resource_limits(transpose_resource_limits_);
   metadata->Clear();
   ChainBackwardWriter<Chain*> serialized_metadata_writer(
       metadata, ChainBackwardWriterBase::Options().set_size_hint(
@@ -253,7 +593,7 @@ inline bool RecordReaderBase::ParseMetadata(const Chunk& chunk,
   std::vector<size_t> limits;
   const bool ok = transpose_decoder.Decode(
       &data_reader, 1, chunk.header.decoded_data_size(), FieldProjection::All(),
-      &serialized_metadata_writer, &limits);
+      ZstdDictionary(), &serialized_metadata_writer, &limits);
   if (ABSL_PREDICT_FALSE(!serialized_metadata_writer.Close())) {
     return Fail(serialized_metadata_writer);
   }
@@ -311,6 +651,53 @@ template bool RecordReaderBase::ReadRecordSlow(std::string* record,
                                                RecordPosition* key);
 template bool RecordReaderBase::ReadRecordSlow(Chain* record,
                                                RecordPosition* key);
+template bool RecordReaderBase::ReadRecordSlow(Reader** record,
+                                               RecordPosition* key);
+
+template <typename Records>
+bool RecordReaderBase::ReadRecordsSlow(Records* records,
+                                       size_t max_num_records,
+                                       RecordPosition* key) {
+  if (chunk_decoder_.healthy()) {
+    RIEGELI_ASSERT_EQ(chunk_decoder_.index(), chunk_decoder_.num_records())
+        << "Failed precondition of RecordReaderBase::ReadRecordsSlow(): "
+           "records available, use ReadRecords() instead";
+  }
+  if (ABSL_PREDICT_FALSE(max_num_records == 0)) return false;
+  if (ABSL_PREDICT_FALSE(!healthy())) {
+    if (!TryRecovery()) return false;
+    goto again;
+  }
+  for (;;) {
+    if (ABSL_PREDICT_FALSE(!chunk_decoder_.healthy())) {
+      recoverable_ = Recoverable::kRecoverChunkDecoder;
+      Fail(chunk_decoder_);
+      if (!TryRecovery()) return false;
+      goto again;
+    }
+    if (ABSL_PREDICT_FALSE(!ReadChunk())) {
+      if (!TryRecovery()) return false;
+    }
+    // Retrying from here is equivalent to calling `ReadRecords()` again
+    // (not `ReadRecordsSlow()`).
+  again:
+    if (ABSL_PREDICT_TRUE(
+            chunk_decoder_.ReadRecords(records, max_num_records))) {
+      if (key != nullptr) {
+        *key = RecordPosition(chunk_begin_,
+                              chunk_decoder_.index() - records->size());
+      }
+      return true;
+    }
+  }
+}
+
+template bool RecordReaderBase::ReadRecordsSlow(
+    absl::Span<const absl::string_view>* records, size_t max_num_records,
+    RecordPosition* key);
+template bool RecordReaderBase::ReadRecordsSlow(std::vector<Chain>* records,
+                                                size_t max_num_records,
+                                                RecordPosition* key);
 
 bool RecordReaderBase::Recover(SkippedRegion* skipped_region) {
   if (recoverable_ == Recoverable::kNo) return false;
@@ -329,10 +716,15 @@ bool RecordReaderBase::Recover(SkippedRegion* skipped_region) {
   switch (recoverable) {
     case Recoverable::kNo:
       RIEGELI_ASSERT_UNREACHABLE() << "kNo handled above";
-    case Recoverable::kRecoverChunkReader:
+    case Recoverable::kRecoverChunkReader: {
+      const Position failed_chunk_begin = src->pos();
       if (ABSL_PREDICT_FALSE(!src->Recover(skipped_region))) return Fail(*src);
-      return true;
+      return SeekToIndexedChunkAfter(failed_chunk_begin, skipped_region);
+    }
     case Recoverable::kRecoverChunkDecoder: {
+      // Decoding failed, possibly because of corrupted data whose hash was not
+      // verified. Verify hashes of the following chunks.
+      src->set_verify_data_hashes(true);
       const uint64_t index_before = chunk_decoder_.index();
       if (ABSL_PREDICT_FALSE(!chunk_decoder_.Recover())) chunk_decoder_.Clear();
       if (skipped_region != nullptr) {
@@ -348,6 +740,147 @@ bool RecordReaderBase::Recover(SkippedRegion* skipped_region) {
       << "Unknown recoverable method: " << static_cast<int>(recoverable);
 }
 
+bool RecordReaderBase::SeekToIndexedChunkAfter(Position failed_chunk_begin,
+                                               SkippedRegion* skipped_region) {
+  ChunkReader* const src = src_chunk_reader();
+  if (!index_loaded_ || !src->healthy()) return true;
+  size_t low = 0;
+  size_t high = index_.num_chunks();
+  while (low < high) {
+    const size_t middle = low + (high - low) / 2;
+    if (index_.chunk_begin(middle) <= failed_chunk_begin) {
+      low = middle + 1;
+    } else {
+      high = middle;
+    }
+  }
+  if (low == index_.num_chunks()) return true;
+  const Position next_chunk_begin = index_.chunk_begin(low);
+  if (src->pos() <= next_chunk_begin) return true;
+  // Recovery skipped valid chunks, e.g. because the chunk header was invalid
+  // and the rest of its block was skipped.
+  if (ABSL_PREDICT_FALSE(!src->Seek(next_chunk_begin))) {
+    recoverable_ = Recoverable::kRecoverChunkReader;
+    return Fail(*src);
+  }
+  if (skipped_region != nullptr) {
+    *skipped_region = SkippedRegion(skipped_region->begin(), next_chunk_begin,
+                                    skipped_region->message());
+  }
+  return true;
+}
+
+bool RecordReaderBase::FindSkippedRegions(
+    std::vector<SkippedRegion>* skipped_regions) {
+  if (ABSL_PREDICT_FALSE(!healthy())) {
+    SkippedRegion skipped_region;
+    if (ABSL_PREDICT_FALSE(!Recover(&skipped_region))) return false;
+    skipped_regions->push_back(std::move(skipped_region));
+    if (ABSL_PREDICT_FALSE(!healthy())) return false;
+  }
+  ChunkReader* const src = src_chunk_reader();
+  // The position of `src` is changed below, so the current chunk and chunks
+  // read ahead are no longer applicable.
+  read_ahead_.clear();
+  chunk_decoder_.Clear();
+  read_from_beginning_ = false;
+  if (!index_loaded_ && src->SupportsRandomAccess()) {
+    const Position pos_before = src->pos();
+    bool found;
+    if (ABSL_PREDICT_FALSE(!ReadIndexChunk(&found))) {
+      index_.Clear();
+      key_filters_.Clear();
+      first_keys_.Clear();
+      chunk_begin_ = src->pos();
+      return false;
+    }
+    index_loaded_ = found;
+    if (ABSL_PREDICT_FALSE(!src->Seek(pos_before))) {
+      chunk_begin_ = src->pos();
+      recoverable_ = Recoverable::kRecoverChunkReader;
+      return Fail(*src);
+    }
+  }
+  // Hashes are verified in the foreground, so that a failure is reported for
+  // the chunk which was just read.
+  const bool verify_data_hashes = src->verify_data_hashes();
+  const bool verify_data_hashes_in_background =
+      src->verify_data_hashes_in_background();
+  src->set_verify_data_hashes(true);
+  src->set_verify_data_hashes_in_background(false);
+  bool found_invalid = false;
+  for (;;) {
+    const Position chunk_begin = src->pos();
+    Chunk chunk;
+    if (ABSL_PREDICT_TRUE(src->ReadChunk(&chunk))) continue;
+    if (src->healthy()) break;
+    found_invalid = true;
+    SkippedRegion skipped_region;
+    if (ABSL_PREDICT_FALSE(!src->Recover(&skipped_region))) {
+      chunk_begin_ = src->pos();
+      return Fail(*src);
+    }
+    if (ABSL_PREDICT_FALSE(
+            !SeekToIndexedChunkAfter(chunk_begin, &skipped_region))) {
+      chunk_begin_ = src->pos();
+      return false;
+    }
+    skipped_regions->push_back(std::move(skipped_region));
+  }
+  // After finding invalid contents, hashes remain verified, as after
+  // `Recover()`.
+  if (!found_invalid) src->set_verify_data_hashes(verify_data_hashes);
+  src->set_verify_data_hashes_in_background(verify_data_hashes_in_background);
+  chunk_begin_ = src->pos();
+  return true;
+}
+
+RecordStats RecordReaderBase::stats() const {
+  if (stats_collector_ == nullptr) return RecordStats();
+  return stats_collector_->Get();
+}
+
+size_t RecordReaderBase::EstimateMemory() const {
+  MemoryEstimator memory_estimator;
+  memory_estimator.RegisterMemory(sizeof(RecordReaderBase));
+  RegisterSubobjects(&memory_estimator);
+  return memory_estimator.TotalMemory();
+}
+
+void RecordReaderBase::RegisterSubobjects(
+    MemoryEstimator* memory_estimator) const {
+  const ChunkReader* const src = src_chunk_reader();
+  if (src != nullptr) src->RegisterSubobjects(memory_estimator);
+  chunk_decoder_.RegisterSubobjects(memory_estimator);
+  if (stats_collector_ != nullptr &&
+      memory_estimator->RegisterNode(stats_collector_.get())) {
+    memory_estimator->RegisterDynamicMemory(
+        sizeof(internal::RecordStatsCollector));
+  }
+  if (chunk_cache_ != nullptr &&
+      memory_estimator->RegisterNode(chunk_cache_.get())) {
+    memory_estimator->RegisterDynamicMemory(sizeof(ChunkCache));
+    memory_estimator->RegisterMemory(chunk_cache_->memory());
+  }
+  memory_estimator->RegisterDynamicMemory(chunk_cache_key_.capacity() + 1);
+  memory_estimator->RegisterMemory(read_ahead_.size() * sizeof(ReadAheadChunk));
+  index_.RegisterSubobjects(memory_estimator);
+  key_filters_.RegisterSubobjects(memory_estimator);
+  first_keys_.RegisterSubobjects(memory_estimator);
+  const absl::string_view zstd_dictionary = zstd_dictionary_.data();
+  if (!zstd_dictionary.empty() &&
+      memory_estimator->RegisterNode(zstd_dictionary.data())) {
+    memory_estimator->RegisterDynamicMemory(zstd_dictionary.size());
+  }
+  shared_transpose_header_.RegisterSubobjects(memory_estimator);
+  chunk_prefix_source_.data.RegisterSubobjects(memory_estimator);
+  const absl::string_view chunk_prefix = chunk_prefix_.data();
+  if (!chunk_prefix.empty() &&
+      memory_estimator->RegisterNode(chunk_prefix.data())) {
+    memory_estimator->RegisterDynamicMemory(chunk_prefix.size());
+  }
+}
+
 bool RecordReaderBase::SupportsRandomAccess() const {
   const ChunkReader* const src = src_chunk_reader();
   return src != nullptr && src->SupportsRandomAccess();
@@ -360,6 +893,497 @@ bool RecordReaderBase::Size(Position* size) {
   return true;
 }
 
+bool RecordReaderBase::NumRecords(uint64_t* num_records) {
+  if (ABSL_PREDICT_FALSE(!healthy())) return false;
+  if (!index_loaded_) {
+    const RecordPosition pos_before = pos();
+    bool found;
+    if (ABSL_PREDICT_FALSE(!ReadIndexNumRecords(num_records, &found))) {
+      return false;
+    }
+    if (!found && ABSL_PREDICT_FALSE(!LoadIndex())) return false;
+    if (ABSL_PREDICT_FALSE(!Seek(pos_before))) return false;
+    if (found) return true;
+  }
+  *num_records = index_.num_records();
+  return true;
+}
+
+bool RecordReaderBase::GetChunkIndex(ChunkIndex* chunk_index) {
+  if (ABSL_PREDICT_FALSE(!healthy())) return false;
+  if (!index_loaded_) {
+    const RecordPosition pos_before = pos();
+    if (ABSL_PREDICT_FALSE(!LoadIndex())) return false;
+    if (ABSL_PREDICT_FALSE(!Seek(pos_before))) return false;
+  }
+  *chunk_index = index_;
+  return true;
+}
+
+bool RecordReaderBase::SeekToRecordNumber(uint64_t record_number) {
+  if (ABSL_PREDICT_FALSE(!healthy())) return false;
+  if (ABSL_PREDICT_FALSE(!LoadIndex())) return false;
+  if (record_number < index_.num_records()) {
+    return Seek(index_.PositionOfRecord(record_number));
+  }
+  Position size;
+  if (ABSL_PREDICT_FALSE(!Size(&size))) return false;
+  return Seek(size);
+}
+
+bool RecordReaderBase::LoadIndex() {
+  if (index_loaded_) return true;
+  ChunkReader* const src = src_chunk_reader();
+  // The position of `src` is changed below, so the current chunk and chunks
+  // read ahead are no longer applicable.
+  read_ahead_.clear();
+  chunk_decoder_.Clear();
+  read_from_beginning_ = false;
+  bool found;
+  const bool ok = ReadIndexChunk(&found) && (found || BuildIndex());
+  chunk_begin_ = src->pos();
+  if (ABSL_PREDICT_FALSE(!ok)) {
+    index_.Clear();
+    key_filters_.Clear();
+    first_keys_.Clear();
+    return false;
+  }
+  index_loaded_ = true;
+  return true;
+}
+
+bool RecordReaderBase::ReadIndexNumRecords(uint64_t* num_records,
+                                           bool* found) {
+  *found = false;
+  ChunkReader* const src = src_chunk_reader();
+  // The position of `src` is changed below, so the current chunk and chunks
+  // read ahead are no longer applicable.
+  read_ahead_.clear();
+  chunk_decoder_.Clear();
+  read_from_beginning_ = false;
+  Chunk chunk;
+  Position chunk_begin;
+  bool chunk_found;
+  const bool ok = ReadIndexChunkData(&chunk, &chunk_begin, &chunk_found);
+  chunk_begin_ = src->pos();
+  if (ABSL_PREDICT_FALSE(!ok) || !chunk_found) return ok;
+  Position index_begin;
+  {
+    Status status =
+        ChunkIndex::DecodeNumRecords(chunk, &index_begin, num_records);
+    if (ABSL_PREDICT_FALSE(!status.ok())) return Fail(std::move(status));
+  }
+  // An index chunk written by an older version does not store the number of
+  // records. An index chunk which was moved, e.g. by concatenating files,
+  // describes only a part of this file.
+  *found = *num_records > 0 && index_begin == chunk_begin;
+  return true;
+}
+
+bool RecordReaderBase::ReadIndexChunk(bool* found) {
+  *found = false;
+  Chunk chunk;
+  Position chunk_begin;
+  bool chunk_found;
+  if (ABSL_PREDICT_FALSE(
+          !ReadIndexChunkData(&chunk, &chunk_begin, &chunk_found))) {
+    return false;
+  }
+  if (!chunk_found) return true;
+  {
+    Status status = index_.Decode(chunk);
+    if (ABSL_PREDICT_FALSE(!status.ok())) return Fail(std::move(status));
+  }
+  if (ABSL_PREDICT_FALSE(index_.index_begin() != chunk_begin)) {
+    // The index chunk was moved, e.g. by concatenating files, so it describes
+    // only a part of this file.
+    index_.Clear();
+    return true;
+  }
+  *found = true;
+  if (key_extractor_ != nullptr) return ReadKeyFiltersChunk(chunk_begin);
+  return true;
+}
+
+bool RecordReaderBase::ReadIndexChunkData(Chunk* chunk, Position* chunk_begin,
+                                          bool* found) {
+  *found = false;
+  ChunkReader* const src = src_chunk_reader();
+  Position size;
+  if (ABSL_PREDICT_FALSE(!src->Size(&size))) return Fail(*src);
+  if (size == 0) return true;
+  const ChunkHeader* chunk_header;
+  if (ABSL_PREDICT_FALSE(!src->SeekToChunkBefore(size - 1) ||
+                         !src->PullChunkHeader(&chunk_header))) {
+    goto failed;
+  }
+  while (chunk_header->chunk_type() == ChunkType::kPadding && src->pos() > 0) {
+    // With `set_pad_to_block_boundary()` and `set_align_chunk_data()`, padding
+    // follows the index chunk.
+    if (ABSL_PREDICT_FALSE(!src->SeekToChunkBefore(src->pos() - 1) ||
+                           !src->PullChunkHeader(&chunk_header))) {
+      goto failed;
+    }
+  }
+  if (chunk_header->chunk_type() == ChunkType::kIndex) {
+    *chunk_begin = src->pos();
+    if (ABSL_PREDICT_FALSE(!src->ReadChunk(chunk))) goto failed;
+    *found = true;
+  }
+  return true;
+
+failed:
+  if (ABSL_PREDICT_FALSE(!src->healthy())) {
+    recoverable_ = Recoverable::kRecoverChunkReader;
+    return Fail(*src);
+  }
+  // The file is truncated, so it has no valid index chunk.
+  return true;
+}
+
+bool RecordReaderBase::BuildIndex() {
+  ChunkReader* const src = src_chunk_reader();
+  index_.Clear();
+  if (ABSL_PREDICT_FALSE(!src->Seek(0))) goto failed;
+  for (;;) {
+    ChunkHeader chunk_header;
+    Position chunk_begin;
+    if (!src->NextChunkHeader(&chunk_header, &chunk_begin)) {
+      if (ABSL_PREDICT_FALSE(!src->healthy())) goto failed;
+      return true;
+    }
+    index_.Add(chunk_begin, chunk_header.num_records());
+  }
+
+failed:
+  recoverable_ = Recoverable::kRecoverChunkReader;
+  return Fail(*src);
+}
+
+bool RecordReaderBase::ReadKeyFiltersChunk(Position index_begin) {
+  key_filters_.Clear();
+  first_keys_.Clear();
+  if (index_begin == 0) return true;
+  ChunkReader* const src = src_chunk_reader();
+  const ChunkHeader* chunk_header;
+  Position key_filters_begin;
+  if (ABSL_PREDICT_FALSE(!src->SeekToChunkBefore(index_begin - 1) ||
+                         !src->PullChunkHeader(&chunk_header))) {
+    goto failed;
+  }
+  if (chunk_header->chunk_type() != ChunkType::kKeyFilters) return true;
+  key_filters_begin = src->pos();
+  {
+    Chunk chunk;
+    if (ABSL_PREDICT_FALSE(!src->ReadChunk(&chunk))) goto failed;
+    if (ABSL_PREDICT_FALSE(!key_filters_.Decode(chunk).ok() ||
+                           key_filters_.num_chunks() != index_.num_chunks())) {
+      // Invalid filters are not used, and `Lookup()` reads all chunks instead.
+      key_filters_.Clear();
+    }
+  }
+  if (key_filters_begin == 0) return true;
+  if (ABSL_PREDICT_FALSE(!src->SeekToChunkBefore(key_filters_begin - 1) ||
+                         !src->PullChunkHeader(&chunk_header))) {
+    goto failed;
+  }
+  if (chunk_header->chunk_type() != ChunkType::kFirstKeys) return true;
+  {
+    Chunk chunk;
+    if (ABSL_PREDICT_FALSE(!src->ReadChunk(&chunk))) goto failed;
+    if (ABSL_PREDICT_FALSE(!first_keys_.Decode(chunk).ok() ||
+                           first_keys_.num_chunks() != index_.num_chunks())) {
+      // Invalid first keys are not used, and `SeekToKey()` reads first records
+      // of chunks instead.
+      first_keys_.Clear();
+    }
+  }
+  return true;
+
+failed:
+  if (ABSL_PREDICT_FALSE(!src->healthy())) {
+    recoverable_ = Recoverable::kRecoverChunkReader;
+    return Fail(*src);
+  }
+  return true;
+}
+
+bool RecordReaderBase::Lookup(absl::string_view key,
+                              google::protobuf::MessageLite* record) {
+  Chain serialized;
+  if (ABSL_PREDICT_FALSE(!Lookup(key, &serialized))) return false;
+  Status status = ParseFromChain(record, serialized);
+  if (ABSL_PREDICT_FALSE(!status.ok())) return Fail(std::move(status));
+  return true;
+}
+
+bool RecordReaderBase::Lookup(absl::string_view key, Chain* record) {
+  RIEGELI_ASSERT(key_extractor_ != nullptr)
+      << "Failed precondition of RecordReaderBase::Lookup(): "
+         "no key extractor";
+  if (ABSL_PREDICT_FALSE(!healthy())) return false;
+  if (ABSL_PREDICT_FALSE(!LoadIndex())) return false;
+  const bool use_key_filters =
+      key_filters_.num_chunks() == index_.num_chunks();
+  const uint64_t key_hash = KeyFilters::HashKey(key);
+  for (size_t i = 0; i < index_.num_chunks(); ++i) {
+    if (use_key_filters && !key_filters_.MayContain(i, key_hash)) continue;
+    const Position chunk_begin = index_.chunk_begin(i);
+    if (ABSL_PREDICT_FALSE(!Seek(chunk_begin))) return false;
+    for (uint64_t j = 0; j < index_.chunk_num_records(i); ++j) {
+      absl::string_view candidate;
+      RecordPosition candidate_pos;
+      if (ABSL_PREDICT_FALSE(!ReadRecord(&candidate, &candidate_pos))) {
+        if (ABSL_PREDICT_FALSE(!healthy())) return false;
+        break;
+      }
+      // The chunk might have been skipped by `chunk_filter_` or by recovery.
+      if (ABSL_PREDICT_FALSE(candidate_pos.chunk_begin() != chunk_begin)) break;
+      if (key_extractor_(candidate) == key) {
+        *record = Chain(candidate);
+        return true;
+      }
+    }
+  }
+  Position size;
+  if (ABSL_PREDICT_FALSE(!Size(&size))) return false;
+  Seek(size);
+  return false;
+}
+
+bool RecordReaderBase::SeekToKey(absl::string_view key) {
+  RIEGELI_ASSERT(key_extractor_ != nullptr)
+      << "Failed precondition of RecordReaderBase::SeekToKey(): "
+         "no key extractor";
+  if (ABSL_PREDICT_FALSE(!healthy())) return false;
+  if (ABSL_PREDICT_FALSE(!LoadIndex())) return false;
+  size_t chunk_index;
+  if (first_keys_.num_chunks() == index_.num_chunks()) {
+    chunk_index = first_keys_.LowerBound(key);
+  } else if (ABSL_PREDICT_FALSE(!SearchFirstKeys(key, &chunk_index))) {
+    return false;
+  }
+  // Records with keys not less than `key` begin in the chunk preceding
+  // `chunk_index`, or at the beginning of `chunk_index`.
+  if (chunk_index > 0) {
+    const Position chunk_begin = index_.chunk_begin(chunk_index - 1);
+    if (ABSL_PREDICT_FALSE(!Seek(chunk_begin))) return false;
+    for (uint64_t j = 0; j < index_.chunk_num_records(chunk_index - 1); ++j) {
+      absl::string_view candidate;
+      RecordPosition candidate_pos;
+      if (ABSL_PREDICT_FALSE(!ReadRecord(&candidate, &candidate_pos))) {
+        if (ABSL_PREDICT_FALSE(!healthy())) return false;
+        break;
+      }
+      // The chunk might have been skipped by `chunk_filter_` or by recovery.
+      if (ABSL_PREDICT_FALSE(candidate_pos.chunk_begin() != chunk_begin) ||
+          key_extractor_(candidate) >= key) {
+        return Seek(candidate_pos);
+      }
+    }
+  }
+  if (chunk_index < index_.num_chunks()) {
+    return Seek(index_.chunk_begin(chunk_index));
+  }
+  Position size;
+  if (ABSL_PREDICT_FALSE(!Size(&size))) return false;
+  return Seek(size);
+}
+
+bool RecordReaderBase::SearchFirstKeys(absl::string_view key,
+                                       size_t* chunk_index) {
+  size_t low = 0;
+  size_t high = index_.num_chunks();
+  while (low < high) {
+    const size_t middle = low + (high - low) / 2;
+    if (ABSL_PREDICT_FALSE(!Seek(index_.chunk_begin(middle)))) return false;
+    // If the chunk was skipped by `chunk_filter_` or by recovery, the record
+    // read comes from a later chunk, which keeps the search monotonic.
+    absl::string_view candidate;
+    if (!ReadRecord(&candidate)) {
+      if (ABSL_PREDICT_FALSE(!healthy())) return false;
+      high = middle;
+    } else if (key_extractor_(candidate) < key) {
+      low = middle + 1;
+    } else {
+      high = middle;
+    }
+  }
+  *chunk_index = low;
+  return true;
+}
+
+inline bool RecordReaderBase::UpdateZstdDictionary(const Chunk& chunk) {
+  if (chunk.header.chunk_type() == ChunkType::kDictionary) {
+    zstd_dictionary_ = ZstdDictionary(std::string(chunk.data));
+    zstd_dictionary_loaded_ = true;
+  } else if (zstd_dictionary_loaded_ || chunk.header.num_records() == 0) {
+    return true;
+  } else if (read_from_beginning_ || !SupportsRandomAccess()) {
+    // Either the dictionary chunk would have been seen, or it cannot be looked
+    // for. Assume that there is no dictionary.
+    zstd_dictionary_loaded_ = true;
+    return true;
+  } else if (ABSL_PREDICT_FALSE(!LoadZstdDictionary())) {
+    return false;
+  }
+  // Parallel decoding takes the dictionary from `zstd_dictionary_` instead.
+  if (parallelism_ == 0) {
+    chunk_decoder_.Reset(ChunkDecoder::Options()
+                             .set_compiled_field_projection(field_projection_)
+                             .set_project_simple_chunks(project_simple_chunks_)
+                             .set_zstd_dictionary(zstd_dictionary_)
+                             .set_streaming_threshold(streaming_threshold_)
+                             .set_transpose_resource_limits(
+                                 transpose_resource_limits_));
+  }
+  return true;
+}
+
+bool RecordReaderBase::LoadZstdDictionary() {
+  ChunkReader* const src = src_chunk_reader();
+  const Position pos_before = src->pos();
+  zstd_dictionary_loaded_ = true;
+  if (ABSL_PREDICT_FALSE(!src->Seek(0))) goto failed;
+  // The dictionary chunk precedes all chunks containing records.
+  for (;;) {
+    const ChunkHeader* chunk_header;
+    if (!src->PullChunkHeader(&chunk_header)) {
+      if (ABSL_PREDICT_FALSE(!src->healthy())) goto failed;
+      break;
+    }
+    if (chunk_header->num_records() > 0) break;
+    if (chunk_header->chunk_type() == ChunkType::kDictionary) {
+      Chunk chunk;
+      if (ABSL_PREDICT_FALSE(!src->ReadChunk(&chunk))) goto failed;
+      zstd_dictionary_ = ZstdDictionary(std::string(chunk.data));
+      break;
+    }
+    if (ABSL_PREDICT_FALSE(!src->SeekToChunkAfter(src->pos() + 1))) {
+      goto failed;
+    }
+  }
+  if (ABSL_PREDICT_FALSE(!src->Seek(pos_before))) goto failed;
+  return true;
+
+failed:
+  recoverable_ = Recoverable::kRecoverChunkReader;
+  return Fail(*src);
+}
+
+inline bool RecordReaderBase::UpdateSharedTransposeHeader(
+    const Chunk& chunk, Position chunk_begin, Chain* shared_transpose_header,
+    Position* shared_transpose_header_pos) {
+  if (chunk.header.chunk_type() == ChunkType::kSharedTransposeHeader) {
+    *shared_transpose_header = chunk.data;
+    *shared_transpose_header_pos = chunk_begin;
+    return true;
+  }
+  uint64_t distance;
+  if (!ChunkDecoder::SharedTransposeHeaderDistance(chunk, &distance)) {
+    return true;
+  }
+  if (ABSL_PREDICT_FALSE(distance == 0 || distance > chunk_begin)) {
+    shared_transpose_header->Clear();
+    return true;
+  }
+  const Position pos = chunk_begin - distance;
+  if (!shared_transpose_header->empty() &&
+      *shared_transpose_header_pos == pos) {
+    return true;
+  }
+  shared_transpose_header->Clear();
+  // If chunks are read sequentially, the shared header chunk has usually been
+  // seen. Otherwise it is looked for if possible.
+  if (!SupportsRandomAccess()) return true;
+  return LoadSharedTransposeHeader(pos, shared_transpose_header,
+                                   shared_transpose_header_pos);
+}
+
+bool RecordReaderBase::LoadSharedTransposeHeader(
+    Position pos, Chain* shared_transpose_header,
+    Position* shared_transpose_header_pos) {
+  ChunkReader* const src = src_chunk_reader();
+  const Position pos_before = src->pos();
+  if (ABSL_PREDICT_FALSE(!src->Seek(pos))) goto failed;
+  {
+    Chunk chunk;
+    if (ABSL_PREDICT_FALSE(!src->ReadChunk(&chunk))) goto failed;
+    if (chunk.header.chunk_type() == ChunkType::kSharedTransposeHeader) {
+      *shared_transpose_header = std::move(chunk.data);
+      *shared_transpose_header_pos = pos;
+    }
+  }
+  if (ABSL_PREDICT_FALSE(!src->Seek(pos_before))) goto failed;
+  return true;
+
+failed:
+  recoverable_ = Recoverable::kRecoverChunkReader;
+  return Fail(*src);
+}
+
+inline void RecordReaderBase::UpdateChunkPrefixSource(const Chunk& chunk,
+                                                      Position chunk_begin) {
+  if (chunk.header.chunk_type() == ChunkType::kSimpleWithPrefix) {
+    chunk_prefixes_seen_ = true;
+  } else if (chunk.header.chunk_type() == ChunkType::kSimple &&
+             (chunk_prefixes_seen_ || !SupportsRandomAccess())) {
+    // Most files do not use chunk prefixes, so with random access simple
+    // chunks are copied only after a chunk with a prefix has been seen.
+    // Until then the prefix is read with `LoadChunkPrefix()`.
+    chunk_prefix_source_ = chunk;
+    chunk_prefix_source_pos_ = chunk_begin;
+  }
+}
+
+inline bool RecordReaderBase::UpdateChunkPrefix(const Chunk& chunk,
+                                                Position chunk_begin,
+                                                ZstdDictionary* chunk_prefix,
+                                                Position* chunk_prefix_pos) {
+  uint64_t distance;
+  if (!ChunkDecoder::ChunkPrefixDistance(chunk, &distance)) return true;
+  if (ABSL_PREDICT_FALSE(distance == 0 || distance > chunk_begin)) {
+    *chunk_prefix = ZstdDictionary();
+    return true;
+  }
+  const Position pos = chunk_begin - distance;
+  if (!chunk_prefix->empty() && *chunk_prefix_pos == pos) return true;
+  *chunk_prefix = ZstdDictionary();
+  if (chunk_prefix_source_pos_ == pos &&
+      chunk_prefix_source_.header.chunk_type() == ChunkType::kSimple) {
+    if (ChunkDecoder::ChunkPrefix(chunk_prefix_source_, zstd_dictionary_,
+                                  chunk_prefix)) {
+      *chunk_prefix_pos = pos;
+    }
+    return true;
+  }
+  // If chunks are read sequentially, the chunk with the prefix has usually
+  // been seen. Otherwise it is looked for if possible.
+  if (!SupportsRandomAccess()) return true;
+  return LoadChunkPrefix(pos, chunk_prefix, chunk_prefix_pos);
+}
+
+bool RecordReaderBase::LoadChunkPrefix(Position pos,
+                                       ZstdDictionary* chunk_prefix,
+                                       Position* chunk_prefix_pos) {
+  ChunkReader* const src = src_chunk_reader();
+  const Position pos_before = src->pos();
+  if (ABSL_PREDICT_FALSE(!src->Seek(pos))) goto failed;
+  {
+    Chunk chunk;
+    if (ABSL_PREDICT_FALSE(!src->ReadChunk(&chunk))) goto failed;
+    if (ChunkDecoder::ChunkPrefix(chunk, zstd_dictionary_, chunk_prefix)) {
+      *chunk_prefix_pos = pos;
+    }
+  }
+  if (ABSL_PREDICT_FALSE(!src->Seek(pos_before))) goto failed;
+  return true;
+
+failed:
+  recoverable_ = Recoverable::kRecoverChunkReader;
+  return Fail(*src);
+}
+
 bool RecordReaderBase::Seek(RecordPosition new_pos) {
   if (ABSL_PREDICT_FALSE(!healthy())) return TryRecovery();
   ChunkReader* const src = src_chunk_reader();
@@ -372,6 +1396,35 @@ bool RecordReaderBase::Seek(RecordPosition new_pos) {
       goto skip_reading_chunk;
     }
   } else {
+    read_ahead_.clear();
+    seeked_ = true;
+    read_from_beginning_ = false;
+    for (std::deque<PrefetchedChunk>::iterator iter = prefetched_.begin();
+         iter != prefetched_.end(); ++iter) {
+      if (iter->chunk_begin != new_pos.chunk_begin()) continue;
+      PrefetchedChunk prefetched_chunk = std::move(*iter);
+      prefetched_.erase(iter);
+      // Position `*src` after the chunk, as if it was read.
+      if (ABSL_PREDICT_FALSE(!src->Seek(prefetched_chunk.chunk_end))) break;
+      chunk_begin_ = prefetched_chunk.chunk_begin;
+      chunk_decoder_ = prefetched_chunk.chunk_decoder.get();
+      if (ABSL_PREDICT_FALSE(!chunk_decoder_.healthy())) {
+        recoverable_ = Recoverable::kRecoverChunkDecoder;
+        Fail(chunk_decoder_);
+        return TryRecovery();
+      }
+      goto cache_chunk;
+    }
+    if (chunk_cache_ != nullptr && new_pos.record_index() > 0) {
+      const std::shared_ptr<const CachedChunk> cached_chunk =
+          chunk_cache_->Find(chunk_cache_key_, new_pos.chunk_begin());
+      // Position `*src` after the chunk, as if it was read.
+      if (cached_chunk != nullptr && src->Seek(cached_chunk->chunk_end)) {
+        chunk_begin_ = new_pos.chunk_begin();
+        chunk_decoder_.SetDecodedChunk(cached_chunk->decoded);
+        goto skip_reading_chunk;
+      }
+    }
     if (ABSL_PREDICT_FALSE(!src->Seek(new_pos.chunk_begin()))) {
       chunk_begin_ = src->pos();
       chunk_decoder_.Clear();
@@ -388,6 +1441,15 @@ bool RecordReaderBase::Seek(RecordPosition new_pos) {
     }
   }
   if (ABSL_PREDICT_FALSE(!ReadChunk())) return TryRecovery();
+cache_chunk:
+  if (chunk_cache_ != nullptr) {
+    std::shared_ptr<CachedChunk> cached_chunk =
+        std::make_shared<CachedChunk>();
+    cached_chunk->chunk_end = next_chunk_begin(src);
+    cached_chunk->decoded = chunk_decoder_.decoded_chunk();
+    chunk_cache_->Insert(chunk_cache_key_, chunk_begin_,
+                         std::move(cached_chunk));
+  }
 skip_reading_chunk:
   chunk_decoder_.SetIndex(new_pos.record_index());
   return true;
@@ -396,11 +1458,14 @@ skip_reading_chunk:
 bool RecordReaderBase::Seek(Position new_pos) {
   if (ABSL_PREDICT_FALSE(!healthy())) return TryRecovery();
   ChunkReader* const src = src_chunk_reader();
-  if (new_pos >= chunk_begin_ && new_pos <= src->pos()) {
+  if (new_pos >= chunk_begin_ && new_pos <= next_chunk_begin(src)) {
     // Seeking inside or just after the current chunk which has been read,
     // or to the beginning of the current chunk which has been located,
     // or to the end of file which has been reached.
   } else {
+    read_ahead_.clear();
+    seeked_ = true;
+    read_from_beginning_ = false;
     if (ABSL_PREDICT_FALSE(!src->SeekToChunkContaining(new_pos))) {
       chunk_begin_ = src->pos();
       chunk_decoder_.Clear();
@@ -426,10 +1491,10 @@ bool RecordReaderBase::Seek(Position new_pos) {
 }
 
 inline bool RecordReaderBase::ReadChunk() {
+  if (parallelism_ > 0) return ReadChunkFromReadAhead();
   ChunkReader* const src = src_chunk_reader();
-  chunk_begin_ = src->pos();
   Chunk chunk;
-  if (ABSL_PREDICT_FALSE(!src->ReadChunk(&chunk))) {
+  if (ABSL_PREDICT_FALSE(!ReadFilteredChunk(&chunk, &chunk_begin_, true))) {
     chunk_decoder_.Clear();
     if (ABSL_PREDICT_FALSE(!src->healthy())) {
       recoverable_ = Recoverable::kRecoverChunkReader;
@@ -437,11 +1502,372 @@ inline bool RecordReaderBase::ReadChunk() {
     }
     return false;
   }
-  if (ABSL_PREDICT_FALSE(!chunk_decoder_.Decode(chunk))) {
+  UpdateChunkPrefixSource(chunk, chunk_begin_);
+  if (ABSL_PREDICT_FALSE(!UpdateZstdDictionary(chunk)) ||
+      ABSL_PREDICT_FALSE(!UpdateSharedTransposeHeader(
+          chunk, chunk_begin_, &shared_transpose_header_,
+          &shared_transpose_header_pos_)) ||
+      ABSL_PREDICT_FALSE(!UpdateChunkPrefix(chunk, chunk_begin_, &chunk_prefix_,
+                                            &chunk_prefix_pos_))) {
+    chunk_decoder_.Clear();
+    return false;
+  }
+  {
+    internal::RecordStatsCollector::Timer timer(
+        stats_collector_.get(), internal::RecordStatsCollector::Stage::kCoding);
+    if (ABSL_PREDICT_FALSE(
+            !chunk_decoder_.Decode(chunk, shared_transpose_header_,
+                                   chunk_prefix_))) {
+      recoverable_ = Recoverable::kRecoverChunkDecoder;
+      return Fail(chunk_decoder_);
+    }
+  }
+  if (stats_collector_ != nullptr) {
+    stats_collector_->AddRecords(chunk.header.num_records(),
+                                 chunk.header.decoded_data_size());
+  }
+  return true;
+}
+
+bool RecordReaderBase::ReadChunkFromReadAhead() {
+  ChunkReader* const src = src_chunk_reader();
+  // Right after seeking, reading is not known to be sequential, and chunks
+  // read ahead would likely be discarded by the next seek.
+  const size_t max_read_ahead =
+      std::exchange(seeked_, false) ? size_t{1} : IntCast<size_t>(parallelism_);
+  while (read_ahead_.size() < max_read_ahead) {
+    Position chunk_begin;
+    Chunk chunk;
+    // Wait for the source to grow only if no chunks are read ahead, so that
+    // they are not delayed.
+    if (ABSL_PREDICT_FALSE(
+            !ReadFilteredChunk(&chunk, &chunk_begin, read_ahead_.empty()))) {
+      // If some chunks have been read ahead, the failure or end of file is
+      // reported after they are consumed, by trying to read the chunk again.
+      if (!read_ahead_.empty()) break;
+      chunk_begin_ = chunk_begin;
+      chunk_decoder_.Clear();
+      if (ABSL_PREDICT_FALSE(!src->healthy())) {
+        recoverable_ = Recoverable::kRecoverChunkReader;
+        return Fail(*src);
+      }
+      return false;
+    }
+    UpdateChunkPrefixSource(chunk, chunk_begin);
+    if (ABSL_PREDICT_FALSE(!UpdateZstdDictionary(chunk)) ||
+        ABSL_PREDICT_FALSE(!UpdateSharedTransposeHeader(
+            chunk, chunk_begin, &shared_transpose_header_,
+            &shared_transpose_header_pos_)) ||
+        ABSL_PREDICT_FALSE(!UpdateChunkPrefix(chunk, chunk_begin,
+                                              &chunk_prefix_,
+                                              &chunk_prefix_pos_))) {
+      read_ahead_.clear();
+      chunk_begin_ = chunk_begin;
+      chunk_decoder_.Clear();
+      return false;
+    }
+    read_ahead_.push_back(ReadAheadChunk{
+        chunk_begin, DecodeChunkInBackground(std::move(chunk),
+                                             shared_transpose_header_,
+                                             chunk_prefix_)});
+  }
+  ReadAheadChunk& read_ahead_chunk = read_ahead_.front();
+  chunk_begin_ = read_ahead_chunk.chunk_begin;
+  chunk_decoder_ = read_ahead_chunk.chunk_decoder.get();
+  read_ahead_.pop_front();
+  if (ABSL_PREDICT_FALSE(!chunk_decoder_.healthy())) {
     recoverable_ = Recoverable::kRecoverChunkDecoder;
     return Fail(chunk_decoder_);
   }
   return true;
 }
 
+std::future<ChunkDecoder> RecordReaderBase::DecodeChunkInBackground(
+    Chunk&& chunk, const Chain& shared_transpose_header,
+    const ZstdDictionary& chunk_prefix) {
+  struct DecodingChunk {
+    Chunk chunk;
+    std::shared_ptr<const CompiledFieldProjection> field_projection;
+    bool project_simple_chunks;
+    uint64_t streaming_threshold;
+    TransposeDecoder::ResourceLimits transpose_resource_limits;
+    ZstdDictionary zstd_dictionary;
+    Chain shared_transpose_header;
+    ZstdDictionary chunk_prefix;
+    std::shared_ptr<internal::RecordStatsCollector> stats_collector;
+    std::promise<ChunkDecoder> chunk_decoder;
+  };
+
+  DecodingChunk* const decoding_chunk = new DecodingChunk();
+  decoding_chunk->chunk = std::move(chunk);
+  decoding_chunk->field_projection = field_projection_;
+  decoding_chunk->project_simple_chunks = project_simple_chunks_;
+  decoding_chunk->streaming_threshold = streaming_threshold_;
+  decoding_chunk->transpose_resource_limits = transpose_resource_limits_;
+  decoding_chunk->zstd_dictionary = zstd_dictionary_;
+  decoding_chunk->shared_transpose_header = shared_transpose_header;
+  decoding_chunk->chunk_prefix = chunk_prefix;
+  decoding_chunk->stats_collector = stats_collector_;
+  std::future<ChunkDecoder> chunk_decoder =
+      decoding_chunk->chunk_decoder.get_future();
+  thread_pool_->Schedule(
+      [decoding_chunk] {
+        ChunkDecoder chunk_decoder(
+            ChunkDecoder::Options()
+                .set_compiled_field_projection(
+                    std::move(decoding_chunk->field_projection))
+                .set_project_simple_chunks(
+                    decoding_chunk->project_simple_chunks)
+                .set_zstd_dictionary(
+                    std::move(decoding_chunk->zstd_dictionary))
+                .set_streaming_threshold(decoding_chunk->streaming_threshold)
+                .set_transpose_resource_limits(
+                    decoding_chunk->transpose_resource_limits));
+        internal::RecordStatsCollector* const stats_collector =
+            decoding_chunk->stats_collector.get();
+        {
+          internal::RecordStatsCollector::Timer timer(
+              stats_collector, internal::RecordStatsCollector::Stage::kCoding);
+          chunk_decoder.Decode(decoding_chunk->chunk,
+                               decoding_chunk->shared_transpose_header,
+                               decoding_chunk->chunk_prefix);
+        }
+        if (stats_collector != nullptr) {
+          const ChunkHeader& chunk_header = decoding_chunk->chunk.header;
+          stats_collector->AddRecords(chunk_header.num_records(),
+                                      chunk_header.decoded_data_size());
+        }
+        decoding_chunk->chunk_decoder.set_value(std::move(chunk_decoder));
+        delete decoding_chunk;
+      },
+      task_priority_);
+  return chunk_decoder;
+}
+
+bool RecordReaderBase::Prefetch(absl::Span<const RecordPosition> positions) {
+  if (ABSL_PREDICT_FALSE(!healthy())) return false;
+  prefetched_.clear();
+  ChunkReader* const src = src_chunk_reader();
+  std::vector<Position> chunk_begins;
+  chunk_begins.reserve(positions.size());
+  for (const RecordPosition& position : positions) {
+    // The current chunk is already read.
+    if (position.chunk_begin() == chunk_begin_ &&
+        src->pos() > chunk_begin_) {
+      continue;
+    }
+    chunk_begins.push_back(position.chunk_begin());
+  }
+  std::sort(chunk_begins.begin(), chunk_begins.end());
+  chunk_begins.erase(std::unique(chunk_begins.begin(), chunk_begins.end()),
+                     chunk_begins.end());
+  {
+    // Chunks separated by at most a block are hinted together, so that they
+    // are fetched with fewer requests.
+    Reader* const src_reader = src->src_reader();
+    Position range_begin = 0;
+    Position range_end = 0;
+    bool has_range = false;
+    for (const Position chunk_begin : chunk_begins) {
+      const Position chunk_end =
+          SaturatingAdd(chunk_begin, PrefetchLength(chunk_begin));
+      if (has_range &&
+          chunk_begin <= SaturatingAdd(range_end, internal::kBlockSize)) {
+        range_end = UnsignedMax(range_end, chunk_end);
+        continue;
+      }
+      if (has_range) src_reader->Prefetch(range_begin, range_end - range_begin);
+      range_begin = chunk_begin;
+      range_end = chunk_end;
+      has_range = true;
+    }
+    if (has_range) src_reader->Prefetch(range_begin, range_end - range_begin);
+  }
+  if (parallelism_ == 0 || !src->SupportsRandomAccess()) return true;
+  const Position pos_before = src->pos();
+  // Chunks are prefetched out of reading order, so the shared transposition
+  // header and the chunk prefix are resolved into a copy, leaving these used
+  // by chunks read in order unchanged.
+  Chain shared_transpose_header = shared_transpose_header_;
+  Position shared_transpose_header_pos = shared_transpose_header_pos_;
+  ZstdDictionary chunk_prefix = chunk_prefix_;
+  Position chunk_prefix_pos = chunk_prefix_pos_;
+  for (const Position chunk_begin : chunk_begins) {
+    if (chunk_begin >= range_end_) break;
+    if (chunk_cache_ != nullptr &&
+        chunk_cache_->Find(chunk_cache_key_, chunk_begin) != nullptr) {
+      continue;
+    }
+    Chunk chunk;
+    if (ABSL_PREDICT_FALSE(!src->Seek(chunk_begin)) ||
+        ABSL_PREDICT_FALSE(!ReadChunkFrom(src, &chunk))) {
+      if (ABSL_PREDICT_FALSE(!src->healthy())) goto failed;
+      // The source ends, which is reported when the chunk is actually read.
+      break;
+    }
+    const Position chunk_end = src->pos();
+    if (ABSL_PREDICT_FALSE(!UpdateZstdDictionary(chunk)) ||
+        ABSL_PREDICT_FALSE(!UpdateSharedTransposeHeader(
+            chunk, chunk_begin, &shared_transpose_header,
+            &shared_transpose_header_pos)) ||
+        ABSL_PREDICT_FALSE(!UpdateChunkPrefix(chunk, chunk_begin, &chunk_prefix,
+                                              &chunk_prefix_pos))) {
+      if (ABSL_PREDICT_FALSE(!healthy())) return false;
+      // Decoding the chunk would fail, which is reported when the chunk is
+      // actually read.
+      continue;
+    }
+    prefetched_.push_back(PrefetchedChunk{
+        chunk_begin, chunk_end,
+        DecodeChunkInBackground(std::move(chunk), shared_transpose_header,
+                                chunk_prefix)});
+  }
+  if (ABSL_PREDICT_FALSE(!src->Seek(pos_before))) goto failed;
+  return true;
+
+failed:
+  prefetched_.clear();
+  read_ahead_.clear();
+  chunk_decoder_.Clear();
+  chunk_begin_ = src->pos();
+  recoverable_ = Recoverable::kRecoverChunkReader;
+  return Fail(*src);
+}
+
+bool RecordReaderBase::ReadRecordsAt(absl::Span<const RecordPosition> positions,
+                                     std::vector<std::string>* records) {
+  records->clear();
+  records->resize(positions.size());
+  if (ABSL_PREDICT_FALSE(!healthy())) return false;
+  std::vector<size_t> order(positions.size());
+  for (size_t index = 0; index < order.size(); ++index) order[index] = index;
+  std::sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+    return positions[a] < positions[b];
+  });
+  if (ABSL_PREDICT_FALSE(!Prefetch(positions))) return false;
+  bool all_read = true;
+  for (const size_t index : order) {
+    // `Seek()` to another record of the current chunk does not read the chunk
+    // again.
+    if (ABSL_PREDICT_FALSE(!Seek(positions[index]))) return false;
+    if (ABSL_PREDICT_FALSE(!ReadRecord(&(*records)[index]))) {
+      if (ABSL_PREDICT_FALSE(!healthy())) return false;
+      all_read = false;
+    }
+  }
+  return all_read;
+}
+
+inline Position RecordReaderBase::PrefetchLength(Position chunk_begin) const {
+  if (index_loaded_) {
+    // Find the first indexed chunk beginning after `chunk_begin`.
+    size_t low = 0;
+    size_t high = index_.num_chunks();
+    while (low < high) {
+      const size_t middle = low + (high - low) / 2;
+      if (index_.chunk_begin(middle) <= chunk_begin) {
+        low = middle + 1;
+      } else {
+        high = middle;
+      }
+    }
+    if (low > 0 && index_.chunk_begin(low - 1) == chunk_begin) {
+      const Position chunk_end = low < index_.num_chunks()
+                                     ? index_.chunk_begin(low)
+                                     : index_.index_begin();
+      if (chunk_end > chunk_begin) return chunk_end - chunk_begin;
+    }
+  }
+  return internal::kBlockSize;
+}
+
+bool RecordReaderBase::ReadChunkOrWait(Chunk* chunk) {
+  ChunkReader* const src = src_chunk_reader();
+  if (ABSL_PREDICT_TRUE(ReadChunkFrom(src, chunk))) return true;
+  if (tail_timeout_ == absl::ZeroDuration()) return false;
+  const absl::Time deadline = absl::Now() + tail_timeout_;
+  absl::Duration poll_interval = absl::Milliseconds(1);
+  while (src->healthy()) {
+    const absl::Time now = absl::Now();
+    if (now >= deadline) return false;
+    absl::SleepFor(std::min(poll_interval, deadline - now));
+    if (ReadChunkFrom(src, chunk)) return true;
+    poll_interval = std::min(poll_interval * 2, tail_max_poll_interval_);
+  }
+  return false;
+}
+
+bool RecordReaderBase::ReadFilteredChunk(Chunk* chunk, Position* chunk_begin,
+                                         bool wait) {
+  ChunkReader* const src = src_chunk_reader();
+  for (;;) {
+    *chunk_begin = src->pos();
+    if (ABSL_PREDICT_FALSE(*chunk_begin >= range_end_)) return false;
+    if (ABSL_PREDICT_FALSE(*chunk_begin == kMetadataChunkBegin) &&
+        SkipMetadataChunk()) {
+      continue;
+    }
+    if (ABSL_PREDICT_FALSE(wait ? !ReadChunkOrWait(chunk)
+                                : !ReadChunkFrom(src, chunk))) {
+      return false;
+    }
+    if (chunk_filter_ == nullptr ||
+        chunk->header.chunk_type() != ChunkType::kStatistics) {
+      return true;
+    }
+    ChunkStatistics chunk_statistics;
+    if (!chunk_statistics.Decode(*chunk).ok() ||
+        chunk_filter_(chunk_statistics)) {
+      return true;
+    }
+    if (ABSL_PREDICT_FALSE(!SkipFilteredChunk())) return false;
+  }
+}
+
+inline bool RecordReaderBase::SkipFilteredChunk() {
+  ChunkReader* const src = src_chunk_reader();
+  const ChunkHeader* chunk_header;
+  if (ABSL_PREDICT_FALSE(!src->PullChunkHeader(&chunk_header))) return false;
+  // Statistics describe the following chunk only if it contains records.
+  if (chunk_header->num_records() == 0) return true;
+  if (src->SupportsRandomAccess()) {
+    const Position chunk_end = internal::ChunkEnd(*chunk_header, src->pos());
+    Position size;
+    if (ABSL_PREDICT_FALSE(!src->Size(&size))) return false;
+    // If the chunk is truncated, read it instead, so that this is reported
+    // like reaching the end of the source.
+    if (chunk_end <= size) return src->Seek(chunk_end);
+  }
+  Chunk chunk;
+  return ReadChunkFrom(src, &chunk);
+}
+
+inline bool RecordReaderBase::SkipMetadataChunk() {
+  ChunkReader* const src = src_chunk_reader();
+  if (src->pos() != kMetadataChunkBegin || !src->SupportsRandomAccess()) {
+    return false;
+  }
+  const ChunkHeader* chunk_header;
+  if (!src->PullChunkHeader(&chunk_header) ||
+      chunk_header->chunk_type() != ChunkType::kFileMetadata) {
+    return false;
+  }
+  const Position chunk_end = internal::ChunkEnd(*chunk_header, src->pos());
+  Position size;
+  // If the chunk is truncated, read it instead, so that this is reported like
+  // reaching the end of the source.
+  if (!src->Size(&size) || chunk_end > size) return false;
+  return src->Seek(chunk_end);
+}
+
+bool RecordReaderBase::ReadChunkFrom(ChunkReader* src, Chunk* chunk) {
+  if (stats_collector_ == nullptr) return src->ReadChunk(chunk);
+  internal::RecordStatsCollector::Timer timer(
+      stats_collector_.get(), internal::RecordStatsCollector::Stage::kChunkIo);
+  const Position pos_before = src->pos();
+  const bool ok = src->ReadChunk(chunk);
+  if (ok) stats_collector_->AddChunk(src->pos() - pos_before);
+  return ok;
+}
+
 }  // namespace riegeli
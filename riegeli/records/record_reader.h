@@ -15,34 +15,57 @@
 #ifndef RIEGELI_RECORDS_RECORD_READER_H_
 #define RIEGELI_RECORDS_RECORD_READER_H_
 
+#include <deque>
 #include <functional>
+#include <future>
+#include <limits>
 #include <memory>
 #include <string>
 #include <tuple>
 #include <utility>
+#include <vector>
 
 #include "absl/base/optimization.h"
 #include "absl/strings/string_view.h"
+#include "absl/time/time.h"
+#include "absl/types/span.h"
+#include "google/protobuf/arena.h"
 #include "google/protobuf/descriptor.h"
+#include "google/protobuf/message.h"
 #include "google/protobuf/message_lite.h"
 #include "riegeli/base/base.h"
 #include "riegeli/base/chain.h"
 #include "riegeli/base/dependency.h"
+#include "riegeli/base/memory_estimator.h"
 #include "riegeli/base/object.h"
+#include "riegeli/base/parallelism.h"
 #include "riegeli/base/resetter.h"
 #include "riegeli/bytes/reader.h"
+#include "riegeli/bytes/zstd_dictionary.h"
 #include "riegeli/chunk_encoding/chunk.h"
 #include "riegeli/chunk_encoding/chunk_decoder.h"
+#include "riegeli/chunk_encoding/compiled_field_projection.h"
 #include "riegeli/chunk_encoding/field_projection.h"
+#include "riegeli/chunk_encoding/transpose_decoder.h"
+#include "riegeli/records/chunk_cache.h"
+#include "riegeli/records/chunk_index.h"
 #include "riegeli/records/chunk_reader.h"
 #include "riegeli/records/chunk_reader_dependency.h"
+#include "riegeli/records/chunk_statistics.h"
+#include "riegeli/records/first_keys.h"
+#include "riegeli/records/key_filters.h"
 #include "riegeli/records/record_position.h"
+#include "riegeli/records/record_stats.h"
 #include "riegeli/records/records_metadata.pb.h"
 #include "riegeli/records/skipped_region.h"
 
 namespace riegeli {
 
 // Interprets `record_type_name` and `file_descriptor` from metadata.
+//
+// Descriptor pools are cached process-wide by the contents of
+// `file_descriptor`, so that interpreting metadata of many files with the same
+// schema builds the pool once.
 class RecordsMetadataDescriptors : public Object {
  public:
   explicit RecordsMetadataDescriptors(const RecordsMetadata& metadata);
@@ -57,16 +80,43 @@ class RecordsMetadataDescriptors : public Object {
   // object is valid.
   const google::protobuf::Descriptor* descriptor() const;
 
+  // Returns the prototype of a message of the record type, from which messages
+  // can be created with `New()`, or `nullptr` if not available.
+  //
+  // The prototype is valid as long as the `RecordsMetadataDescriptors` object
+  // is valid.
+  const google::protobuf::Message* prototype() const;
+
   // Returns record type full name, or an empty string if not available.
   const std::string& record_type_name() const { return record_type_name_; }
 
  private:
   class ErrorCollector;
+  struct Pool;
+  class PoolCache;
 
   std::string record_type_name_;
-  std::unique_ptr<google::protobuf::DescriptorPool> pool_;
+  std::shared_ptr<const Pool> pool_;
 };
 
+// A range of byte positions of a Riegeli/records file, selecting records of
+// chunks beginning in [`begin`..`end`).
+//
+// Chunk boundaries do not need to be known: ranges sharing an endpoint, e.g.
+// produced by `SplitFile()`, select each record exactly once.
+struct FileRange {
+  Position begin = 0;
+  Position end = std::numeric_limits<Position>::max();
+};
+
+// Splits a file of `size` bytes into `num_ranges` ranges of roughly equal
+// sizes, for reading them independently, e.g. by different workers, with
+// `RecordReaderBase::Options::set_range()`. Ranges are balanced by bytes, so
+// a range smaller than a chunk can contain no records.
+//
+// Precondition: `num_ranges > 0`
+std::vector<FileRange> SplitFile(Position size, size_t num_ranges);
+
 // Template parameter independent part of `RecordReader`.
 class RecordReaderBase : public Object {
  public:
@@ -79,8 +129,16 @@ class RecordReaderBase : public Object {
     // excluded). Excluding data makes reading faster.
     //
     // Projection is effective if the file has been written with
-    // `set_transpose(true)`. Additionally, `set_bucket_fraction()` with a lower
-    // value can make reading with projection faster.
+    // `set_transpose(true)`, or with `set_project_simple_chunks(true)`.
+    // Additionally, `set_bucket_fraction()` with a lower value can make reading
+    // with projection faster.
+    //
+    // Chunks are read from the file whole, because their data hashes cover all
+    // buckets. Only buckets holding included fields are decompressed.
+    //
+    // The projection is compiled once and shared by chunks decoded in
+    // background, so projections with many fields do not slow down decoding of
+    // each chunk.
     //
     // Default: `FieldProjection::All()`.
     Options& set_field_projection(FieldProjection field_projection) & {
@@ -91,6 +149,59 @@ class RecordReaderBase : public Object {
       return std::move(set_field_projection(std::move(field_projection)));
     }
 
+    // If `true`, `set_field_projection()` is applied also to records of chunks
+    // which are not transposed, by parsing each record as a serialized
+    // message. Records which are not valid serialized messages are returned
+    // unchanged.
+    //
+    // This makes reading such chunks with a projection slower, but returned
+    // records smaller, and the same as if the file was written with
+    // `set_transpose(true)`.
+    //
+    // Default: `false`
+    Options& set_project_simple_chunks(bool project_simple_chunks) & {
+      project_simple_chunks_ = project_simple_chunks;
+      return *this;
+    }
+    Options&& set_project_simple_chunks(bool project_simple_chunks) && {
+      return std::move(set_project_simple_chunks(project_simple_chunks));
+    }
+
+    // Sets the decoded data size of a simple chunk from which its records are
+    // decompressed incrementally while they are read, instead of all at once
+    // when the chunk is read. See
+    // `ChunkDecoder::Options::set_streaming_threshold()`.
+    //
+    // This bounds memory used by files written with large chunks, and makes
+    // the first record of such a chunk available sooner. Transposed chunks are
+    // always decoded at once.
+    //
+    // Default: `std::numeric_limits<uint64_t>::max()` (never)
+    Options& set_streaming_threshold(uint64_t streaming_threshold) & {
+      streaming_threshold_ = streaming_threshold;
+      return *this;
+    }
+    Options&& set_streaming_threshold(uint64_t streaming_threshold) && {
+      return std::move(set_streaming_threshold(streaming_threshold));
+    }
+
+    // Sets bounds on resources spent on decoding a transposed chunk, so that
+    // reading an untrusted file fails early instead of spending unbounded
+    // time on a hostile chunk. See
+    // `ChunkDecoder::Options::set_transpose_resource_limits()`.
+    //
+    // Default: `TransposeDecoder::ResourceLimits()` (no limits)
+    Options& set_transpose_resource_limits(
+        const TransposeDecoder::ResourceLimits& transpose_resource_limits) & {
+      transpose_resource_limits_ = transpose_resource_limits;
+      return *this;
+    }
+    Options&& set_transpose_resource_limits(
+        const TransposeDecoder::ResourceLimits& transpose_resource_limits) && {
+      return std::move(
+          set_transpose_resource_limits(transpose_resource_limits));
+    }
+
     // Sets the recovery function to be called after skipping over invalid file
     // contents.
     //
@@ -130,11 +241,280 @@ class RecordReaderBase : public Object {
       return std::move(set_recovery(std::move(recovery)));
     }
 
+    // Sets the maximum number of chunks being decoded in parallel in
+    // background. Larger parallelism can increase throughput, up to a point
+    // where it no longer matters; smaller parallelism reduces memory usage.
+    //
+    // If `parallelism > 0`, chunks are read ahead from the `ChunkReader` and
+    // decoded in background, and are handed to `ReadRecord()` in order.
+    // This helps sequential reading; seeking to a different chunk discards
+    // chunks read ahead. After seeking, only the chunk sought to is read, and
+    // reading ahead resumes when reading moves on to the next chunk.
+    //
+    // Default: 0
+    Options& set_parallelism(int parallelism) & {
+      RIEGELI_ASSERT_GE(parallelism, 0)
+          << "Failed precondition of "
+             "RecordReaderBase::Options::set_parallelism(): "
+             "negative parallelism";
+      parallelism_ = parallelism;
+      return *this;
+    }
+    Options&& set_parallelism(int parallelism) && {
+      return std::move(set_parallelism(parallelism));
+    }
+
+    // Sets the thread pool where chunks are decoded if `parallelism > 0`.
+    //
+    // Chunks are read by the thread calling `ReadRecord()`, which schedules
+    // decoding them, so a NUMA-aware pool (see
+    // `ThreadPool::Options::set_numa_aware()`) decodes them on the node of that
+    // thread.
+    //
+    // The thread pool must outlive the `RecordReader`.
+    //
+    // Default: `&ThreadPool::global()`
+    Options& set_thread_pool(ThreadPool* thread_pool) & {
+      RIEGELI_ASSERT(thread_pool != nullptr)
+          << "Failed precondition of "
+             "RecordReaderBase::Options::set_thread_pool(): "
+             "null thread pool";
+      thread_pool_ = thread_pool;
+      return *this;
+    }
+    Options&& set_thread_pool(ThreadPool* thread_pool) && {
+      return std::move(set_thread_pool(thread_pool));
+    }
+
+    // Sets the priority of decoding tasks in the thread pool if
+    // `parallelism > 0`.
+    //
+    // `ThreadPool::Priority::kHigh` suits latency-sensitive readers which share
+    // the thread pool with background writers.
+    //
+    // Default: `ThreadPool::Priority::kNormal`
+    Options& set_task_priority(ThreadPool::Priority task_priority) & {
+      task_priority_ = task_priority;
+      return *this;
+    }
+    Options&& set_task_priority(ThreadPool::Priority task_priority) && {
+      return std::move(set_task_priority(task_priority));
+    }
+
+    // Sets how long reading waits for the file to grow when it ends, which
+    // allows to follow a file still being written.
+    //
+    // If the file ends, possibly in the middle of a chunk, `ReadRecord()`
+    // polls it with an exponentially increasing interval up to
+    // `set_tail_max_poll_interval()`, until a complete chunk is available or
+    // `tail_timeout` passes without one. A partial chunk read so far is kept by
+    // the `ChunkReader`, so reading resumes from where it stopped rather than
+    // re-reading the file.
+    //
+    // `absl::InfiniteDuration()` waits until more records are available.
+    //
+    // The byte `Reader` must notice that its source has grown after reporting
+    // its end, as e.g. `FdReader` does.
+    //
+    // Default: `absl::ZeroDuration()` (do not wait)
+    Options& set_tail_timeout(absl::Duration tail_timeout) & {
+      RIEGELI_ASSERT_GE(tail_timeout, absl::ZeroDuration())
+          << "Failed precondition of "
+             "RecordReaderBase::Options::set_tail_timeout(): "
+             "negative tail timeout";
+      tail_timeout_ = tail_timeout;
+      return *this;
+    }
+    Options&& set_tail_timeout(absl::Duration tail_timeout) && {
+      return std::move(set_tail_timeout(tail_timeout));
+    }
+
+    // Sets the maximum interval between checks whether the file has grown, if
+    // `tail_timeout > 0`.
+    //
+    // Default: `absl::Milliseconds(100)`
+    Options& set_tail_max_poll_interval(
+        absl::Duration tail_max_poll_interval) & {
+      RIEGELI_ASSERT_GT(tail_max_poll_interval, absl::ZeroDuration())
+          << "Failed precondition of "
+             "RecordReaderBase::Options::set_tail_max_poll_interval(): "
+             "non-positive interval";
+      tail_max_poll_interval_ = tail_max_poll_interval;
+      return *this;
+    }
+    Options&& set_tail_max_poll_interval(
+        absl::Duration tail_max_poll_interval) && {
+      return std::move(set_tail_max_poll_interval(tail_max_poll_interval));
+    }
+
+    // Sets a predicate over chunk statistics, written if
+    // `RecordWriterBase::Options::set_chunk_statistics()` was used. Chunks for
+    // which the predicate returns `false` are skipped without reading them.
+    // This is useful for selecting records by ranges of field values, e.g.
+    // with `ChunkStatistics::MayContain()`.
+    //
+    // Chunks without statistics, or with invalid statistics, are not skipped.
+    //
+    // If `chunk_filter` is `nullptr`, no chunks are skipped.
+    //
+    // Default: `nullptr`
+    Options& set_chunk_filter(
+        std::function<bool(const ChunkStatistics&)> chunk_filter) & {
+      chunk_filter_ = std::move(chunk_filter);
+      return *this;
+    }
+    Options&& set_chunk_filter(
+        std::function<bool(const ChunkStatistics&)> chunk_filter) && {
+      return std::move(set_chunk_filter(std::move(chunk_filter)));
+    }
+
+    // Sets a function computing the key of a record, given its serialized
+    // form, used by `Lookup()` and `SeekToKey()`. This should be the same
+    // function as used with `RecordWriterBase::Options::set_key_extractor()`.
+    //
+    // Default: `nullptr`
+    Options& set_key_extractor(
+        std::function<std::string(absl::string_view)> key_extractor) & {
+      key_extractor_ = std::move(key_extractor);
+      return *this;
+    }
+    Options&& set_key_extractor(
+        std::function<std::string(absl::string_view)> key_extractor) && {
+      return std::move(set_key_extractor(std::move(key_extractor)));
+    }
+
+    // If `false`, hashes of chunk data are not verified, only hashes of block
+    // headers and chunk headers. This saves a pass over chunk data when
+    // corruption is detected by other means, e.g. by the storage layer, or the
+    // file was just written to local storage. Corrupted data are then detected
+    // only if decoding them fails.
+    //
+    // After `Recover()` hashes of chunk data are verified, because the file is
+    // known to be corrupted.
+    //
+    // This calls `ChunkReader::set_verify_data_hashes()`.
+    //
+    // Default: `true`
+    Options& set_verify_data_hashes(bool verify_data_hashes) & {
+      verify_data_hashes_ = verify_data_hashes;
+      return *this;
+    }
+    Options&& set_verify_data_hashes(bool verify_data_hashes) && {
+      return std::move(set_verify_data_hashes(verify_data_hashes));
+    }
+
+    // If `true`, hashes of chunk data are verified in background while the
+    // chunk is being decoded, and a mismatch is reported before records after
+    // the chunk are read, instead of before records of the chunk are read.
+    // This hides verification latency, at the cost of having already returned
+    // records of a corrupted chunk.
+    //
+    // This calls `ChunkReader::set_verify_data_hashes_in_background()`.
+    //
+    // Default: `false`
+    Options& set_verify_data_hashes_in_background(
+        bool verify_data_hashes_in_background) & {
+      verify_data_hashes_in_background_ = verify_data_hashes_in_background;
+      return *this;
+    }
+    Options&& set_verify_data_hashes_in_background(
+        bool verify_data_hashes_in_background) && {
+      return std::move(set_verify_data_hashes_in_background(
+          verify_data_hashes_in_background));
+    }
+
+    // If `true`, `RecordReader` collects `RecordStats` about time spent in
+    // chunk I/O and decoding, available from `stats()`.
+    //
+    // This costs reading clocks a few times per chunk.
+    //
+    // Default: `false`
+    Options& set_collect_stats(bool collect_stats) & {
+      collect_stats_ = collect_stats;
+      return *this;
+    }
+    Options&& set_collect_stats(bool collect_stats) && {
+      return std::move(set_collect_stats(collect_stats));
+    }
+
+    // Restricts reading to records of chunks beginning in
+    // [`range.begin`..`range.end`).
+    //
+    // Reading starts at the first chunk beginning at or after `range.begin`,
+    // found with `ChunkReader::SeekToChunkAfter()`, and ends before the first
+    // chunk beginning at or after `range.end`, as if the file ended there.
+    // `Seek()` can still move the current position outside of the range.
+    //
+    // If the `ChunkReader` is not at the beginning of the file, `range.begin`
+    // is ignored and reading starts at the current position.
+    //
+    // Default: `FileRange()` (the whole file)
+    Options& set_range(FileRange range) & {
+      RIEGELI_ASSERT_LE(range.begin, range.end)
+          << "Failed precondition of RecordReaderBase::Options::set_range(): "
+             "range ends before it begins";
+      range_ = range;
+      return *this;
+    }
+    Options&& set_range(FileRange range) && {
+      return std::move(set_range(range));
+    }
+
+    // Sets a cache of decoded chunks, which can be shared with other
+    // `RecordReader`s, also in other threads.
+    //
+    // `Seek(RecordPosition)` to another chunk looks for the chunk in the cache
+    // before reading and decoding it, and stores the chunk in the cache after
+    // decoding it. Reading records sequentially does not use the cache.
+    //
+    // Chunks of this file are identified in the cache by
+    // `set_chunk_cache_key()`.
+    //
+    // Default: `nullptr` (no cache)
+    Options& set_chunk_cache(std::shared_ptr<ChunkCache> chunk_cache) & {
+      chunk_cache_ = std::move(chunk_cache);
+      return *this;
+    }
+    Options&& set_chunk_cache(std::shared_ptr<ChunkCache> chunk_cache) && {
+      return std::move(set_chunk_cache(std::move(chunk_cache)));
+    }
+
+    // Identifies this file in `set_chunk_cache()`, e.g. by its filename.
+    //
+    // `RecordReader`s sharing a cache must use different keys for different
+    // files, and for the same file read with different
+    // `set_field_projection()`, because chunks are cached after projection.
+    //
+    // Default: ""
+    Options& set_chunk_cache_key(std::string chunk_cache_key) & {
+      chunk_cache_key_ = std::move(chunk_cache_key);
+      return *this;
+    }
+    Options&& set_chunk_cache_key(std::string chunk_cache_key) && {
+      return std::move(set_chunk_cache_key(std::move(chunk_cache_key)));
+    }
+
    private:
     friend class RecordReaderBase;
 
     FieldProjection field_projection_ = FieldProjection::All();
+    bool project_simple_chunks_ = false;
+    uint64_t streaming_threshold_ = std::numeric_limits<uint64_t>::max();
+    TransposeDecoder::ResourceLimits transpose_resource_limits_;
     std::function<bool(const SkippedRegion&)> recovery_;
+    int parallelism_ = 0;
+    ThreadPool* thread_pool_ = &ThreadPool::global();
+    ThreadPool::Priority task_priority_ = ThreadPool::Priority::kNormal;
+    absl::Duration tail_timeout_ = absl::ZeroDuration();
+    absl::Duration tail_max_poll_interval_ = absl::Milliseconds(100);
+    std::function<bool(const ChunkStatistics&)> chunk_filter_;
+    std::function<std::string(absl::string_view)> key_extractor_;
+    bool verify_data_hashes_ = true;
+    bool verify_data_hashes_in_background_ = false;
+    bool collect_stats_ = false;
+    FileRange range_;
+    std::shared_ptr<ChunkCache> chunk_cache_;
+    std::string chunk_cache_key_;
   };
 
   // Returns the Riegeli/records file being read from. Unchanged by `Close()`.
@@ -158,7 +538,12 @@ class RecordReaderBase : public Object {
   // Returns file metadata.
   //
   // `ReadMetadata()` must be called while the `RecordReader` is at the
-  // beginning of the file (calling `CheckFileFormat()` before is allowed).
+  // beginning of the file (calling `CheckFileFormat()` before is allowed),
+  // unless the file supports random access. Then `ReadMetadata()` can be called
+  // at any time: it reads the metadata chunk by seeking to it and back, without
+  // changing the current position. Metadata are read only when requested: when
+  // reading records passes the metadata chunk of a file supporting random
+  // access, the chunk is skipped without reading its data.
   //
   // Record type in metadata can be conveniently interpreted by
   // `RecordsMetadataDescriptors`.
@@ -181,6 +566,12 @@ class RecordReaderBase : public Object {
   // `ReadRecord(absl::string_view*)` the `absl::string_view` is valid until the
   // next non-const operation on this `RecordReader`.
   //
+  // Records of simple chunks without compression are not copied if the source
+  // of the chunk data shares its memory, e.g. `FdMMapReader` or `ChainReader`:
+  // `ReadRecord(absl::string_view*)` points to the source memory unless the
+  // record is split by a block boundary, and `ReadRecord(Chain*)` shares the
+  // source memory unless the record is shorter than copying it costs.
+  //
   // If `key != nullptr`, `*key` is set to the canonical record position on
   // success.
   //
@@ -194,6 +585,82 @@ class RecordReaderBase : public Object {
   bool ReadRecord(std::string* record, RecordPosition* key = nullptr);
   bool ReadRecord(Chain* record, RecordPosition* key = nullptr);
 
+  // Reads the next record as a stream: `*record` is set to a `Reader` of the
+  // record contents, which is valid until the next non-const operation on this
+  // `RecordReader`. The `Reader` must not be closed.
+  //
+  // If the record is not read to its end, the rest of it is skipped by the
+  // next operation. Positions of the `Reader` begin at an unspecified offset,
+  // so only their differences are meaningful.
+  //
+  // This is meant for records too large to be conveniently held in memory,
+  // e.g. written by `RecordWriterBase::OpenRecord()`. Such a record is not
+  // held in memory uncompressed if its chunk is decompressed incrementally,
+  // i.e. the decoded size of the chunk is at least
+  // `Options::set_streaming_threshold()`.
+  //
+  // If `key != nullptr`, `*key` is set to the canonical record position on
+  // success.
+  //
+  // Return values:
+  //  * `true`                      - success (`*record` is set)
+  //  * `false` (when `healthy()`)  - source ends
+  //  * `false` (when `!healthy()`) - failure
+  bool ReadRecordStreaming(Reader** record, RecordPosition* key = nullptr);
+
+  // Reads up to `max_num_records` next records of the current chunk, all its
+  // remaining records by default, reading the next chunk if the current chunk
+  // ends.
+  //
+  // This avoids the overhead of calling `ReadRecord()` for each record when
+  // records are processed in batches anyway.
+  //
+  // For `ReadRecords(absl::Span<const absl::string_view>*)` the array and the
+  // `absl::string_view`s are valid until the next non-const operation on this
+  // `RecordReader`. For `ReadRecords(std::vector<Chain>*)` existing elements of
+  // `*records` are reused.
+  //
+  // If `key != nullptr`, `*key` is set to the canonical position of the first
+  // record on success. Positions of subsequent records are consecutive:
+  // `RecordPosition(key->chunk_begin(), key->record_index() + i)`.
+  //
+  // Return values:
+  //  * `true`                      - success (`*records` is set to at least
+  //                                  one record)
+  //  * `false` (when `healthy()`)  - source ends
+  //  * `false` (when `!healthy()`) - failure
+  bool ReadRecords(
+      absl::Span<const absl::string_view>* records,
+      size_t max_num_records = std::numeric_limits<size_t>::max(),
+      RecordPosition* key = nullptr);
+  bool ReadRecords(std::vector<Chain>* records,
+                   size_t max_num_records = std::numeric_limits<size_t>::max(),
+                   RecordPosition* key = nullptr);
+
+  // Reads up to `max_num_records` next records, parses them to proto messages
+  // of type `T` allocated on `arena`, and appends pointers to the messages to
+  // `*records`.
+  //
+  // Messages allocated on an arena avoid a separate allocation for each of
+  // their submessages and strings. The messages are owned by `arena`. Memory
+  // can be reused by calling `arena->Reset()` after the messages of a batch are
+  // no longer needed. If `arena == nullptr`, the messages are allocated on the
+  // heap and owned by the caller.
+  //
+  // If some records were read before a failure or before the source ended,
+  // `ReadRecords()` returns `true`, and the next call returns `false`.
+  //
+  // If `keys != nullptr`, canonical record positions are appended to `*keys`.
+  //
+  // Return values:
+  //  * `true`                      - success (at least one record appended)
+  //  * `false` (when `healthy()`)  - source ends
+  //  * `false` (when `!healthy()`) - failure
+  template <typename T>
+  bool ReadRecords(google::protobuf::Arena* arena, std::vector<T*>* records,
+                   size_t max_num_records,
+                   std::vector<RecordPosition>* keys = nullptr);
+
   // If `!healthy()` and the failure was caused by invalid file contents, then
   // `Recover()` tries to recover from the failure and allow reading again by
   // skipping over the invalid region.
@@ -207,6 +674,11 @@ class RecordReaderBase : public Object {
   // If `skipped_region != nullptr`, `*skipped_region` is set to the position of
   // the skipped region on success.
   //
+  // If the chunk index has been loaded, e.g. by `SeekToRecordNumber()` or
+  // `GetChunkIndex()`, recovery does not skip past the next indexed chunk after
+  // the invalid region, even if block headers lead further, so that only
+  // invalid contents are skipped.
+  //
   // If a recovery function is set, then `Recover()` is called automatically.
   // Otherwise `Recover()` can be called after one of the following functions
   // returned `false`, and the function can be assumed to have returned `true`
@@ -222,6 +694,25 @@ class RecordReaderBase : public Object {
   //  * `false` - failure not caused by invalid file contents
   bool Recover(SkippedRegion* skipped_region = nullptr);
 
+  // Finds all regions of invalid file contents from the current position to
+  // the end of file in one pass, appending them to `*skipped_regions`, which
+  // is faster than reading records and calling `Recover()` after each failure.
+  //
+  // Chunks are checked by verifying their headers and hashes of their data,
+  // without decoding records. If the file supports random access, the chunk
+  // index is loaded first, if present, so that recovery from each failure
+  // resumes at the next indexed chunk (see `Recover()`). An incomplete chunk
+  // at the end of a truncated file is reported by `Close()` instead.
+  //
+  // If `!healthy()` and `Recover()` is applicable, recovery from the current
+  // failure is performed first. Afterwards the current position is the end of
+  // file; use `Seek()` to read records, skipping the regions found.
+  //
+  // Return values:
+  //  * `true`  - success (`healthy()`)
+  //  * `false` - failure not caused by invalid file contents (`!healthy()`)
+  bool FindSkippedRegions(std::vector<SkippedRegion>* skipped_regions);
+
   // Returns the current position.
   //
   // `pos().numeric()` returns the position as an integer of type `Position`.
@@ -233,6 +724,27 @@ class RecordReaderBase : public Object {
   // `pos()` is unchanged by `Close()`.
   RecordPosition pos() const;
 
+  // Returns statistics collected so far if `Options::set_collect_stats(true)`
+  // was used, otherwise zeros.
+  //
+  // Chunks read ahead if `Options::set_parallelism() > 0` are included when
+  // they are read, and their decoding when it completes.
+  RecordStats stats() const;
+
+  // Estimates the amount of memory used by this `RecordReader`: the current
+  // chunk and its records, the chunk being read, the index, key filters, first
+  // keys, and Zstd dictionary if loaded, and chunks stored in the chunk cache
+  // (counted once per `MemoryEstimator` if the cache is shared).
+  //
+  // Chunks read ahead if `Options::set_parallelism() > 0` are not included
+  // while they are decoded in background. Buffers of the source `Reader` and
+  // memory used internally by compression libraries are not included either.
+  // `GetOwnedMemory()` reports process-wide totals of memory allocated by
+  // Riegeli.
+  size_t EstimateMemory() const;
+  // Registers this `RecordReader` with `MemoryEstimator`.
+  void RegisterSubobjects(MemoryEstimator* memory_estimator) const;
+
   // Returns `true` if this `RecordReader` supports `Seek()` and `Size()`.
   bool SupportsRandomAccess() const;
 
@@ -250,6 +762,47 @@ class RecordReaderBase : public Object {
   bool Seek(RecordPosition new_pos);
   bool Seek(Position new_pos);
 
+  // Hints that chunks containing `positions` are going to be read soon with
+  // `Seek(RecordPosition)`, in any order. The current position is unchanged.
+  //
+  // The source `Reader` is asked to fetch the chunks in background (see
+  // `Reader::Prefetch()`). If the index is loaded (e.g. by `NumRecords()` or
+  // `Lookup()`), whole chunks are covered, otherwise their beginnings.
+  //
+  // If `Options::set_parallelism() > 0` and the file supports random access,
+  // the chunks are also read by this call and decoded in background, and a
+  // later `Seek(RecordPosition)` to one of them takes the decoded chunk
+  // instead of reading it again.
+  //
+  // Chunks prefetched by a previous call which have not been used yet are
+  // discarded.
+  //
+  // Return values:
+  //  * `true`  - success (`healthy()`)
+  //  * `false` - failure (`!healthy()`)
+  bool Prefetch(absl::Span<const RecordPosition> positions);
+
+  // Reads records at `positions`, e.g. obtained by `pos()` for the same file,
+  // into `*records`, in the order of `positions`.
+  //
+  // This is faster than `Seek()` followed by `ReadRecord()` for each position:
+  // positions are visited in the order of the file, so that each chunk is read
+  // and decoded once, and nearby chunks are prefetched together (see
+  // `Prefetch()`).
+  //
+  // Afterwards the current position is after the record at the greatest
+  // position.
+  //
+  // Return values:
+  //  * `true`                      - success (`records->size() ==
+  //                                  positions.size()`, `healthy()`)
+  //  * `false` (when `healthy()`)  - some position is at the end of file,
+  //                                  its record is left empty and the
+  //                                  remaining ones are read
+  //  * `false` (when `!healthy()`) - failure
+  bool ReadRecordsAt(absl::Span<const RecordPosition> positions,
+                     std::vector<std::string>* records);
+
   // Returns the size of the file in bytes, i.e. the position corresponding to
   // its end.
   //
@@ -258,6 +811,92 @@ class RecordReaderBase : public Object {
   //  * `false` - failure (`!healthy()`)
   bool Size(Position* size);
 
+  // Returns the number of records in the file. The current position is
+  // unchanged.
+  //
+  // If the file ends with an index chunk (see
+  // `RecordWriterBase::Options::set_index()`), the number of records stored in
+  // its header is used, without decoding locations of chunks. Otherwise, or if
+  // the index chunk was written by an older version which does not store the
+  // number of records, the index is loaded as for `SeekToRecordNumber()`: it
+  // is read from the index chunk, or built by iterating over chunk headers of
+  // the whole file, seeking over chunk data. The index is kept for later
+  // calls.
+  //
+  // Return values:
+  //  * `true`  - success (`*num_records` is set, `healthy()`)
+  //  * `false` - failure (`!healthy()`)
+  bool NumRecords(uint64_t* num_records);
+
+  // Returns locations of chunks containing records, together with numbers of
+  // records in them. The current position is unchanged.
+  //
+  // This uses the index described in `NumRecords()`.
+  //
+  // Return values:
+  //  * `true`  - success (`*chunk_index` is set, `healthy()`)
+  //  * `false` - failure (`!healthy()`)
+  bool GetChunkIndex(ChunkIndex* chunk_index);
+
+  // Seeks to the record with the given number, counting records from 0 in the
+  // whole file. If `record_number` is not less than the number of records,
+  // seeks to the end of file.
+  //
+  // This uses the index described in `NumRecords()`.
+  //
+  // Return values:
+  //  * `true`  - success (`healthy()`)
+  //  * `false` - failure (`!healthy()`)
+  bool SeekToRecordNumber(uint64_t record_number);
+
+  // Reads a record whose key, as computed by `Options::set_key_extractor()`,
+  // is `key`. If several records have this key, the first one is read.
+  //
+  // This uses the index described in `NumRecords()`. If the file has key
+  // filters (see `RecordWriterBase::Options::set_key_extractor()`), only
+  // chunks whose filters might contain `key` are read, otherwise all chunks
+  // are read.
+  //
+  // Keys are computed from records as returned by `ReadRecord()`, so the field
+  // projection must include fields which the key depends on.
+  //
+  // If a record is found, the current position is after it, otherwise it is at
+  // the end of file.
+  //
+  // Precondition: `Options::set_key_extractor()` was used with a function
+  // other than `nullptr`
+  //
+  // Return values:
+  //  * `true`                      - success (`*record` is set)
+  //  * `false` (when `healthy()`)  - there is no record with this key
+  //  * `false` (when `!healthy()`) - failure
+  bool Lookup(absl::string_view key, google::protobuf::MessageLite* record);
+  bool Lookup(absl::string_view key, Chain* record);
+
+  // Seeks to the first record whose key, as computed by
+  // `Options::set_key_extractor()`, is not less than `key`, or to the end of
+  // file if there is no such record. Keys are compared as byte strings.
+  //
+  // Records must be sorted by their keys, e.g. written with
+  // `RecordWriterBase::Options::set_sorted_keys()` or by
+  // `SortingRecordWriter`.
+  //
+  // This uses the index described in `NumRecords()`. If the file has first
+  // keys of chunks (see `RecordWriterBase::Options::set_sorted_keys()`), they
+  // are searched in memory and only one chunk is read, otherwise chunks are
+  // binary searched by reading their first records.
+  //
+  // Keys are computed from records as returned by `ReadRecord()`, so the field
+  // projection must include fields which the key depends on.
+  //
+  // Precondition: `Options::set_key_extractor()` was used with a function
+  // other than `nullptr`
+  //
+  // Return values:
+  //  * `true`  - success (`healthy()`)
+  //  * `false` - failure (`!healthy()`)
+  bool SeekToKey(absl::string_view key);
+
 #if 0
   // Searches the region between the current position and end of file for a
   // desired record. What is desired is specified by a function, which should
@@ -291,6 +930,21 @@ class RecordReaderBase : public Object {
 
   bool TryRecovery();
 
+  // After `src_chunk_reader()` recovered from a failure of the chunk beginning
+  // at `failed_chunk_begin`, seeks back to the first indexed chunk after it if
+  // recovery skipped that chunk, adjusting `*skipped_region` if not `nullptr`.
+  // Does nothing if `index_` is not loaded.
+  //
+  // Return values:
+  //  * `true`  - success
+  //  * `false` - failure (`!healthy()`)
+  bool SeekToIndexedChunkAfter(Position failed_chunk_begin,
+                               SkippedRegion* skipped_region);
+
+  // Position of the beginning of the next chunk to be read, taking chunks read
+  // ahead into account.
+  Position next_chunk_begin(const ChunkReader* src) const;
+
   // Position of the beginning of the current chunk or end of file, except when
   // `Seek(Position)` failed to locate the chunk containing the position, in
   // which case this is that position.
@@ -323,16 +977,247 @@ class RecordReaderBase : public Object {
   std::function<bool(const SkippedRegion&)> recovery_;
 
  private:
+  // A chunk read ahead, being decoded in background.
+  struct ReadAheadChunk {
+    Position chunk_begin;
+    std::future<ChunkDecoder> chunk_decoder;
+  };
+
+  // A chunk read by `Prefetch()`, being decoded in background.
+  struct PrefetchedChunk {
+    Position chunk_begin;
+    Position chunk_end;
+    std::future<ChunkDecoder> chunk_decoder;
+  };
+
   bool ParseMetadata(const Chunk& chunk, Chain* metadata);
 
+  // Implementation of `ReadSerializedMetadata()` if the `RecordReader` is not
+  // at the beginning of the file and the file supports random access.
+  bool ReadMetadataBySeeking(Chain* metadata);
+
   // Precondition: `!chunk_decoder_.healthy() ||
   //                chunk_decoder_.index() == chunk_decoder_.num_records()`
   template <typename Record>
   bool ReadRecordSlow(Record* record, RecordPosition* key);
 
+  // Precondition: `!chunk_decoder_.healthy() ||
+  //                chunk_decoder_.index() == chunk_decoder_.num_records()`
+  template <typename Records>
+  bool ReadRecordsSlow(Records* records, size_t max_num_records,
+                       RecordPosition* key);
+
   // Reads the next chunk from `chunk_reader_` and decodes it into
   // `chunk_decoder_` and `chunk_begin_`. On failure resets `chunk_decoder_`.
   bool ReadChunk();
+
+  // Implementation of `ReadChunk()` if `parallelism_ > 0`: reads chunks ahead
+  // into `read_ahead_`, and takes the first of them. Right after seeking to
+  // another chunk reads only that chunk.
+  bool ReadChunkFromReadAhead();
+
+  // Schedules decoding `chunk` in `thread_pool_`, with the current dictionary,
+  // and with `shared_transpose_header` and `chunk_prefix`.
+  std::future<ChunkDecoder> DecodeChunkInBackground(
+      Chunk&& chunk, const Chain& shared_transpose_header,
+      const ZstdDictionary& chunk_prefix);
+
+  // Returns the length of the chunk beginning at `chunk_begin` if it is known
+  // from `index_`, otherwise the length of a block.
+  Position PrefetchLength(Position chunk_begin) const;
+
+  // Reads the next chunk from `src_chunk_reader()`. If the source ends and
+  // `tail_timeout_ > absl::ZeroDuration()`, waits for the source to grow.
+  //
+  // Return values are the same as for `ChunkReader::ReadChunk()`.
+  bool ReadChunkOrWait(Chunk* chunk);
+
+  // Calls `src->ReadChunk()`, measuring it for `stats_collector_`.
+  bool ReadChunkFrom(ChunkReader* src, Chunk* chunk);
+
+  // Reads the next chunk from `src_chunk_reader()` which is not skipped by
+  // `chunk_filter_`, setting `*chunk_begin` to its position. If `wait`, uses
+  // `ReadChunkOrWait()`. Chunks beginning at or after `range_end_` are
+  // reported as the end of the source.
+  //
+  // Return values are the same as for `ChunkReader::ReadChunk()`.
+  bool ReadFilteredChunk(Chunk* chunk, Position* chunk_begin, bool wait);
+
+  // Skips the chunk following a statistics chunk rejected by `chunk_filter_`.
+  //
+  // Return values are the same as for `ChunkReader::ReadChunk()`.
+  bool SkipFilteredChunk();
+
+  // Skips the file metadata chunk without reading its data if it begins at the
+  // current position and the file supports random access.
+  //
+  // Returns `true` if the chunk was skipped. Otherwise the chunk, if any, is
+  // read as usual, which also reports failures.
+  bool SkipMetadataChunk();
+
+  // Fills `index_` unless `index_loaded_`, leaving the current position at an
+  // unspecified chunk boundary.
+  bool LoadIndex();
+
+  // Reads only the number of records from the index chunk at the end of file,
+  // if any, leaving the current position at an unspecified chunk boundary.
+  // Sets `*found` to whether the index chunk is present, describes this file,
+  // and stores the number of records.
+  bool ReadIndexNumRecords(uint64_t* num_records, bool* found);
+
+  // Reads `index_` from the index chunk at the end of file, if any. Sets
+  // `*found` to whether the index chunk is present and describes this file.
+  bool ReadIndexChunk(bool* found);
+
+  // Reads the index chunk at the end of file, if any, to `*chunk`, without
+  // decoding it. Sets `*found` to whether the index chunk is present, and
+  // `*chunk_begin` to its position if so.
+  bool ReadIndexChunkData(Chunk* chunk, Position* chunk_begin, bool* found);
+
+  // Builds `index_` by iterating over chunk headers of the whole file.
+  bool BuildIndex();
+
+  // Reads `key_filters_` from the key filter chunk preceding the index chunk
+  // beginning at `index_begin`, and `first_keys_` from the first key chunk
+  // preceding the key filter chunk, if any. Leaves `key_filters_` or
+  // `first_keys_` empty if they are absent or do not describe `index_`.
+  bool ReadKeyFiltersChunk(Position index_begin);
+
+  // Finds the first indexed chunk whose first record has a key not less than
+  // `key`, by binary search reading first records of chunks, for files without
+  // `first_keys_`. Sets `*chunk_index` to its number, or to
+  // `index_.num_chunks()` if there is no such chunk.
+  bool SearchFirstKeys(absl::string_view key, size_t* chunk_index);
+
+  // Updates `zstd_dictionary_` before decoding `chunk`. If `chunk` is a
+  // dictionary chunk, takes the dictionary from it. If `chunk` contains records
+  // and the dictionary chunk has not been seen yet, looks for it with
+  // `LoadZstdDictionary()`.
+  bool UpdateZstdDictionary(const Chunk& chunk);
+
+  // Fills `zstd_dictionary_` from the dictionary chunk near the beginning of
+  // the file, if any, leaving the position of `src_chunk_reader()` unchanged.
+  bool LoadZstdDictionary();
+
+  // Updates `*shared_transpose_header` coming from the chunk beginning at
+  // `*shared_transpose_header_pos` before decoding `chunk` beginning at
+  // `chunk_begin`. If `chunk` is a shared transposition header chunk, takes the
+  // header from it. If `chunk` refers to a shared transposition header chunk
+  // which is not `*shared_transpose_header`, reads it with
+  // `LoadSharedTransposeHeader()`.
+  //
+  // Chunks read in order use `shared_transpose_header_` and
+  // `shared_transpose_header_pos_`, `Prefetch()` uses its own copy.
+  //
+  // If the shared header cannot be found, `*shared_transpose_header` is left
+  // empty, so that decoding `chunk` fails.
+  bool UpdateSharedTransposeHeader(const Chunk& chunk, Position chunk_begin,
+                                   Chain* shared_transpose_header,
+                                   Position* shared_transpose_header_pos);
+
+  // Fills `*shared_transpose_header` and `*shared_transpose_header_pos` from
+  // the shared transposition header chunk beginning at `pos`, leaving the
+  // position of `src_chunk_reader()` unchanged.
+  bool LoadSharedTransposeHeader(Position pos, Chain* shared_transpose_header,
+                                 Position* shared_transpose_header_pos);
+
+  // Remembers `chunk` beginning at `chunk_begin` in `chunk_prefix_source_` if
+  // it is a simple chunk which can be needed as a source of chunk prefixes.
+  // Called for chunks read in order.
+  void UpdateChunkPrefixSource(const Chunk& chunk, Position chunk_begin);
+
+  // Updates `*chunk_prefix` coming from the chunk beginning at
+  // `*chunk_prefix_pos` before decoding `chunk` beginning at `chunk_begin`. If
+  // `chunk` refers to a chunk whose prefix is not `*chunk_prefix`, computes the
+  // prefix from `chunk_prefix_source_` if this is that chunk, or reads it with
+  // `LoadChunkPrefix()`.
+  //
+  // Chunks read in order use `chunk_prefix_` and `chunk_prefix_pos_`,
+  // `Prefetch()` uses its own copy.
+  //
+  // If the chunk prefix cannot be found, `*chunk_prefix` is left empty, so that
+  // decoding `chunk` fails.
+  bool UpdateChunkPrefix(const Chunk& chunk, Position chunk_begin,
+                         ZstdDictionary* chunk_prefix,
+                         Position* chunk_prefix_pos);
+
+  // Fills `*chunk_prefix` and `*chunk_prefix_pos` from the simple chunk
+  // beginning at `pos`, leaving the position of `src_chunk_reader()`
+  // unchanged.
+  bool LoadChunkPrefix(Position pos, ZstdDictionary* chunk_prefix,
+                       Position* chunk_prefix_pos);
+
+  int parallelism_ = 0;
+  ThreadPool* thread_pool_ = &ThreadPool::global();
+  ThreadPool::Priority task_priority_ = ThreadPool::Priority::kNormal;
+  absl::Duration tail_timeout_ = absl::ZeroDuration();
+  absl::Duration tail_max_poll_interval_ = absl::Milliseconds(100);
+  std::function<bool(const ChunkStatistics&)> chunk_filter_;
+  std::function<std::string(absl::string_view)> key_extractor_;
+  // Chunks beginning at or after this position are not read.
+  Position range_end_ = std::numeric_limits<Position>::max();
+  // Collects `RecordStats`, or `nullptr` if stats are not collected. Shared
+  // with chunks being decoded in background, which can outlive `*this`.
+  std::shared_ptr<internal::RecordStatsCollector> stats_collector_;
+  // Cache of decoded chunks used by `Seek(RecordPosition)`, or `nullptr`.
+  std::shared_ptr<ChunkCache> chunk_cache_;
+  std::string chunk_cache_key_;
+  // Used for resetting `chunk_decoder_` when `zstd_dictionary_` changes, and
+  // for decoding chunks in background if `parallelism_ > 0`.
+  // The compiled field projection, or `nullptr` if all fields are included.
+  std::shared_ptr<const CompiledFieldProjection> field_projection_;
+  bool project_simple_chunks_ = false;
+  uint64_t streaming_threshold_ = std::numeric_limits<uint64_t>::max();
+  TransposeDecoder::ResourceLimits transpose_resource_limits_;
+  // Chunks read ahead from `src_chunk_reader()`, following the current chunk.
+  //
+  // Invariant: if `parallelism_ == 0` then `read_ahead_.empty()`
+  std::deque<ReadAheadChunk> read_ahead_;
+  // If `true`, `Seek()` moved to another chunk and no chunk has been read
+  // since then, so reading is not known to be sequential and chunks are not
+  // read ahead yet.
+  bool seeked_ = false;
+  // Chunks read by `Prefetch()` and not yet used by `Seek(RecordPosition)`.
+  std::deque<PrefetchedChunk> prefetched_;
+
+  bool index_loaded_ = false;
+  // Chunks containing records, valid if `index_loaded_`.
+  ChunkIndex index_;
+  // Filters of keys of indexed chunks, read together with `index_` if
+  // `key_extractor_ != nullptr`. Used only if
+  // `key_filters_.num_chunks() == index_.num_chunks()`.
+  KeyFilters key_filters_;
+  // First keys of indexed chunks, read together with `index_` if
+  // `key_extractor_ != nullptr`. Used only if
+  // `first_keys_.num_chunks() == index_.num_chunks()`.
+  FirstKeys first_keys_;
+
+  // If `true`, chunks have been read sequentially from the beginning of the
+  // file, so a dictionary chunk, if any, has been seen.
+  bool read_from_beginning_ = false;
+  bool zstd_dictionary_loaded_ = false;
+  // Dictionary for chunks compressed with Zstd, valid if
+  // `zstd_dictionary_loaded_`.
+  ZstdDictionary zstd_dictionary_;
+  // Data of the shared transposition header chunk read most recently, or empty
+  // if none.
+  Chain shared_transpose_header_;
+  // The position of the chunk `shared_transpose_header_` comes from.
+  Position shared_transpose_header_pos_ = 0;
+  // The simple chunk read most recently, or an empty chunk if none. With
+  // random access, simple chunks are remembered only if
+  // `chunk_prefixes_seen_`.
+  Chunk chunk_prefix_source_;
+  // The position of `chunk_prefix_source_`.
+  Position chunk_prefix_source_pos_ = 0;
+  // If `true`, a chunk with a prefix has been read in order, so the file uses
+  // chunk prefixes.
+  bool chunk_prefixes_seen_ = false;
+  // The prefix for decoding chunks which refer to the simple chunk beginning at
+  // `chunk_prefix_pos_`, or empty if none.
+  ZstdDictionary chunk_prefix_;
+  // The position of the chunk `chunk_prefix_` comes from.
+  Position chunk_prefix_pos_ = 0;
 };
 
 // `RecordReader` reads records of a Riegeli/records file. A record is
@@ -469,6 +1354,13 @@ extern template bool RecordReaderBase::ReadRecordSlow(std::string* record,
                                                       RecordPosition* key);
 extern template bool RecordReaderBase::ReadRecordSlow(Chain* record,
                                                       RecordPosition* key);
+extern template bool RecordReaderBase::ReadRecordSlow(Reader** record,
+                                                      RecordPosition* key);
+extern template bool RecordReaderBase::ReadRecordsSlow(
+    absl::Span<const absl::string_view>* records, size_t max_num_records,
+    RecordPosition* key);
+extern template bool RecordReaderBase::ReadRecordsSlow(
+    std::vector<Chain>* records, size_t max_num_records, RecordPosition* key);
 
 inline bool RecordReaderBase::ReadRecord(google::protobuf::MessageLite* record,
                                          RecordPosition* key) {
@@ -521,19 +1413,92 @@ inline bool RecordReaderBase::ReadRecord(Chain* record, RecordPosition* key) {
   return ReadRecordSlow(record, key);
 }
 
+inline bool RecordReaderBase::ReadRecordStreaming(Reader** record,
+                                                  RecordPosition* key) {
+  if (ABSL_PREDICT_TRUE(chunk_decoder_.ReadRecord(record))) {
+    RIEGELI_ASSERT_GT(chunk_decoder_.index(), 0u)
+        << "ChunkDecoder::ReadRecord() left record index at 0";
+    if (key != nullptr) {
+      *key = RecordPosition(chunk_begin_, chunk_decoder_.index() - 1);
+    }
+    return true;
+  }
+  return ReadRecordSlow(record, key);
+}
+
+inline bool RecordReaderBase::ReadRecords(
+    absl::Span<const absl::string_view>* records, size_t max_num_records,
+    RecordPosition* key) {
+  if (ABSL_PREDICT_TRUE(chunk_decoder_.ReadRecords(records, max_num_records))) {
+    if (key != nullptr) {
+      *key = RecordPosition(chunk_begin_,
+                            chunk_decoder_.index() - records->size());
+    }
+    return true;
+  }
+  return ReadRecordsSlow(records, max_num_records, key);
+}
+
+inline bool RecordReaderBase::ReadRecords(std::vector<Chain>* records,
+                                          size_t max_num_records,
+                                          RecordPosition* key) {
+  if (ABSL_PREDICT_TRUE(chunk_decoder_.ReadRecords(records, max_num_records))) {
+    if (key != nullptr) {
+      *key = RecordPosition(chunk_begin_,
+                            chunk_decoder_.index() - records->size());
+    }
+    return true;
+  }
+  return ReadRecordsSlow(records, max_num_records, key);
+}
+
+template <typename T>
+bool RecordReaderBase::ReadRecords(google::protobuf::Arena* arena,
+                                   std::vector<T*>* records,
+                                   size_t max_num_records,
+                                   std::vector<RecordPosition>* keys) {
+  const size_t size_before = records->size();
+  if (chunk_decoder_.healthy()) {
+    // Reserve space for the remaining records of the current chunk.
+    records->reserve(size_before +
+                     UnsignedMin(max_num_records, chunk_decoder_.num_records() -
+                                                      chunk_decoder_.index()));
+  }
+  while (records->size() - size_before < max_num_records) {
+    T* const record = google::protobuf::Arena::CreateMessage<T>(arena);
+    RecordPosition key;
+    if (ABSL_PREDICT_FALSE(
+            !ReadRecord(record, keys == nullptr ? nullptr : &key))) {
+      if (arena == nullptr) delete record;
+      break;
+    }
+    records->push_back(record);
+    if (keys != nullptr) keys->push_back(key);
+  }
+  return records->size() > size_before;
+}
+
 inline bool RecordReaderBase::TryRecovery() {
   if (recovery_ == nullptr) return false;
   SkippedRegion skipped_region;
   return Recover(&skipped_region) && recovery_(skipped_region);
 }
 
+inline Position RecordReaderBase::next_chunk_begin(
+    const ChunkReader* src) const {
+  if (ABSL_PREDICT_FALSE(!read_ahead_.empty())) {
+    return read_ahead_.front().chunk_begin;
+  }
+  return src->pos();
+}
+
 inline RecordPosition RecordReaderBase::pos() const {
   if (ABSL_PREDICT_TRUE(chunk_decoder_.index() <
                         chunk_decoder_.num_records()) ||
       ABSL_PREDICT_FALSE(recoverable_ == Recoverable::kRecoverChunkDecoder)) {
     return RecordPosition(chunk_begin_, chunk_decoder_.index());
   }
-  return RecordPosition(src_chunk_reader()->pos(), 0);
+  return RecordPosition(next_chunk_begin(src_chunk_reader()), 0);
 }
 
 template <typename Src>
@@ -616,7 +1581,7 @@ inline RecordPosition RecordReader<Src>::pos() const {
       ABSL_PREDICT_FALSE(recoverable_ == Recoverable::kRecoverChunkDecoder)) {
     return RecordPosition(chunk_begin_, chunk_decoder_.index());
   }
-  return RecordPosition(src_->pos(), 0);
+  return RecordPosition(next_chunk_begin(src_.get()), 0);
 }
 
 template <typename Src>
@@ -0,0 +1,64 @@
+// Copyright 2019 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "riegeli/records/record_stats.h"
+
+#include <stdint.h>
+#include <time.h>
+
+#include <atomic>
+
+#include "absl/time/time.h"
+
+namespace riegeli {
+namespace internal {
+
+constexpr int RecordStatsCollector::kNumStages;
+
+absl::Duration RecordStatsCollector::ThreadCpuTime() {
+  struct timespec cpu_time;
+  if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu_time) != 0) {
+    return absl::ZeroDuration();
+  }
+  return absl::DurationFromTimespec(cpu_time);
+}
+
+void RecordStatsCollector::AddTime(Stage stage, absl::Duration wall_time,
+                                   absl::Duration cpu_time) {
+  const int index = static_cast<int>(stage);
+  wall_nanos_[index].fetch_add(absl::ToInt64Nanoseconds(wall_time),
+                               std::memory_order_relaxed);
+  cpu_nanos_[index].fetch_add(absl::ToInt64Nanoseconds(cpu_time),
+                              std::memory_order_relaxed);
+}
+
+RecordStats RecordStatsCollector::Get() const {
+  RecordStats stats;
+  stats.num_chunks = num_chunks_.load(std::memory_order_relaxed);
+  stats.num_records = num_records_.load(std::memory_order_relaxed);
+  stats.decoded_bytes = decoded_bytes_.load(std::memory_order_relaxed);
+  stats.encoded_bytes = encoded_bytes_.load(std::memory_order_relaxed);
+  RecordStats::StageTime* const stage_times[kNumStages] = {
+      &stats.chunk_io, &stats.coding, &stats.hashing};
+  for (int i = 0; i < kNumStages; ++i) {
+    stage_times[i]->wall_time =
+        absl::Nanoseconds(wall_nanos_[i].load(std::memory_order_relaxed));
+    stage_times[i]->cpu_time =
+        absl::Nanoseconds(cpu_nanos_[i].load(std::memory_order_relaxed));
+  }
+  return stats;
+}
+
+}  // namespace internal
+}  // namespace riegeli
@@ -0,0 +1,155 @@
+// Copyright 2019 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef RIEGELI_RECORDS_RECORD_STATS_H_
+#define RIEGELI_RECORDS_RECORD_STATS_H_
+
+#include <stdint.h>
+
+#include <atomic>
+
+#include "absl/time/clock.h"
+#include "absl/time/time.h"
+
+namespace riegeli {
+
+// Cumulative counters of work done by `RecordWriter` or `RecordReader`,
+// collected if `set_collect_stats(true)` is used in their options.
+//
+// This tells whether processing a file is bound by I/O, by compression and
+// transposition, or by hashing.
+struct RecordStats {
+  // Time spent in a stage of processing, summed over threads doing it.
+  struct StageTime {
+    absl::Duration wall_time;
+    absl::Duration cpu_time;
+  };
+
+  // The number of chunks written or read, including chunks with no records.
+  uint64_t num_chunks = 0;
+  // The number of records encoded or decoded.
+  uint64_t num_records = 0;
+  // The total size of records encoded or decoded.
+  uint64_t decoded_bytes = 0;
+  // The number of bytes written or read by the `ChunkWriter` or `ChunkReader`,
+  // including block headers.
+  uint64_t encoded_bytes = 0;
+
+  // `ChunkWriter::WriteChunk()` and `ChunkWriter::Flush()`, or
+  // `ChunkReader::ReadChunk()` including verifying hashes, excluding waiting
+  // for the file to grow.
+  StageTime chunk_io;
+  // `ChunkEncoder::EncodeAndClose()` or `ChunkDecoder::Decode()`, i.e.
+  // transposition and compression, or decompression and transposition.
+  StageTime coding;
+  // Hashing chunk data and headers of encoded chunks, when writing. When
+  // reading, verifying hashes is included in `chunk_io`.
+  StageTime hashing;
+};
+
+namespace internal {
+
+// Thread-safe accumulator of `RecordStats`.
+class RecordStatsCollector {
+ public:
+  enum class Stage { kChunkIo, kCoding, kHashing };
+
+  // Measures wall and CPU time of the current thread from construction to
+  // destruction, and adds it to `stage` of `*collector`. Does nothing if
+  // `collector == nullptr`, so that disabled stats cost only a comparison.
+  class Timer {
+   public:
+    explicit Timer(RecordStatsCollector* collector, Stage stage);
+
+    Timer(const Timer&) = delete;
+    Timer& operator=(const Timer&) = delete;
+
+    ~Timer();
+
+   private:
+    RecordStatsCollector* const collector_;
+    const Stage stage_;
+    absl::Time wall_start_;
+    absl::Duration cpu_start_;
+  };
+
+  RecordStatsCollector() noexcept {}
+
+  RecordStatsCollector(const RecordStatsCollector&) = delete;
+  RecordStatsCollector& operator=(const RecordStatsCollector&) = delete;
+
+  // Adds a chunk of `encoded_bytes` bytes written or read.
+  void AddChunk(uint64_t encoded_bytes);
+
+  // Adds `num_records` records with `decoded_bytes` bytes encoded or decoded.
+  void AddRecords(uint64_t num_records, uint64_t decoded_bytes);
+
+  // Returns a snapshot of the counters.
+  RecordStats Get() const;
+
+ private:
+  static constexpr int kNumStages = 3;
+
+  // Returns CPU time consumed by the current thread.
+  static absl::Duration ThreadCpuTime();
+
+  void AddTime(Stage stage, absl::Duration wall_time, absl::Duration cpu_time);
+
+  std::atomic<uint64_t> num_chunks_{0};
+  std::atomic<uint64_t> num_records_{0};
+  std::atomic<uint64_t> decoded_bytes_{0};
+  std::atomic<uint64_t> encoded_bytes_{0};
+  // Nanoseconds, indexed by `Stage`.
+  std::atomic<int64_t> wall_nanos_[kNumStages] = {};
+  std::atomic<int64_t> cpu_nanos_[kNumStages] = {};
+};
+
+}  // namespace internal
+
+// Implementation details follow.
+
+namespace internal {
+
+inline RecordStatsCollector::Timer::Timer(RecordStatsCollector* collector,
+                                          Stage stage)
+    : collector_(collector), stage_(stage) {
+  if (collector_ != nullptr) {
+    wall_start_ = absl::Now();
+    cpu_start_ = ThreadCpuTime();
+  }
+}
+
+inline RecordStatsCollector::Timer::~Timer() {
+  if (collector_ != nullptr) {
+    collector_->AddTime(stage_, absl::Now() - wall_start_,
+                        ThreadCpuTime() - cpu_start_);
+  }
+}
+
+inline void RecordStatsCollector::AddChunk(uint64_t encoded_bytes) {
+  num_chunks_.fetch_add(1, std::memory_order_relaxed);
+  encoded_bytes_.fetch_add(encoded_bytes, std::memory_order_relaxed);
+}
+
+inline void RecordStatsCollector::AddRecords(uint64_t num_records,
+                                             uint64_t decoded_bytes) {
+  num_records_.fetch_add(num_records, std::memory_order_relaxed);
+  decoded_bytes_.fetch_add(decoded_bytes, std::memory_order_relaxed);
+}
+
+}  // namespace internal
+
+}  // namespace riegeli
+
+#endif  // RIEGELI_RECORDS_RECORD_STATS_H_
@@ -17,8 +17,11 @@
 #include <stddef.h>
 #include <stdint.h>
 
+#include <algorithm>
+#include <atomic>
 #include <cmath>
 #include <deque>
+#include <functional>
 #include <future>
 #include <limits>
 #include <memory>
@@ -28,9 +31,15 @@
 
 #include "absl/base/optimization.h"
 #include "absl/base/thread_annotations.h"
+#include "absl/container/flat_hash_map.h"
 #include "absl/container/flat_hash_set.h"
+#include "absl/strings/str_cat.h"
 #include "absl/strings/string_view.h"
 #include "absl/synchronization/mutex.h"
+#include "absl/time/clock.h"
+#include "absl/time/time.h"
+#include "absl/types/optional.h"
+#include "absl/types/span.h"
 #include "absl/types/variant.h"
 #include "google/protobuf/descriptor.h"
 #include "google/protobuf/descriptor.pb.h"
@@ -38,21 +47,42 @@
 #include "riegeli/base/base.h"
 #include "riegeli/base/canonical_errors.h"
 #include "riegeli/base/chain.h"
+#include "riegeli/base/memory.h"
+#include "riegeli/base/memory_estimator.h"
 #include "riegeli/base/object.h"
 #include "riegeli/base/options_parser.h"
 #include "riegeli/base/parallelism.h"
+#include "riegeli/base/recycling_pool.h"
 #include "riegeli/base/status.h"
+#include "riegeli/base/tracing.h"
 #include "riegeli/bytes/chain_writer.h"
+#include "riegeli/bytes/message_parse.h"
+#include "riegeli/bytes/message_serialize.h"
+#include "riegeli/bytes/writer_utils.h"
+#include "riegeli/bytes/brotli_dictionary.h"
+#include "riegeli/bytes/zstd_dictionary.h"
 #include "riegeli/chunk_encoding/chunk.h"
+#include "riegeli/chunk_encoding/chunk_decoder.h"
 #include "riegeli/chunk_encoding/chunk_encoder.h"
+#include "riegeli/chunk_encoding/compressor.h"
 #include "riegeli/chunk_encoding/compressor_options.h"
 #include "riegeli/chunk_encoding/constants.h"
 #include "riegeli/chunk_encoding/deferred_encoder.h"
 #include "riegeli/chunk_encoding/simple_encoder.h"
 #include "riegeli/chunk_encoding/transpose_encoder.h"
+#include "riegeli/chunk_encoding/transpose_schema.h"
+#include "riegeli/records/chunk_index.h"
+#include "riegeli/records/chunk_reader.h"
+#include "riegeli/records/chunk_statistics.h"
 #include "riegeli/records/chunk_writer.h"
+#include "riegeli/records/first_keys.h"
+#include "riegeli/records/key_filters.h"
 #include "riegeli/records/record_position.h"
+#include "riegeli/records/record_reader.h"
+#include "riegeli/records/record_stats.h"
 #include "riegeli/records/records_metadata.pb.h"
+#include "riegeli/records/resume_records.h"
+#include "riegeli/records/secondary_index.h"
 
 namespace riegeli {
 
@@ -66,14 +96,46 @@ constexpr int RecordWriterBase::Options::kDefaultBrotli;
 constexpr int RecordWriterBase::Options::kMinZstd;
 constexpr int RecordWriterBase::Options::kMaxZstd;
 constexpr int RecordWriterBase::Options::kDefaultZstd;
+constexpr int RecordWriterBase::Options::kMinLz4;
+constexpr int RecordWriterBase::Options::kMaxLz4;
+constexpr int RecordWriterBase::Options::kMinLz4Hc;
+constexpr int RecordWriterBase::Options::kDefaultLz4;
+constexpr int RecordWriterBase::Options::kMaxBrotliWorkers;
+constexpr int RecordWriterBase::Options::kMaxZstdWorkers;
+constexpr uint64_t RecordWriterBase::Options::kMaxZstdJobSize;
+constexpr int RecordWriterBase::Options::kDefaultZstdStrategy;
+constexpr int RecordWriterBase::Options::kMinZstdStrategy;
+constexpr int RecordWriterBase::Options::kMaxZstdStrategy;
+constexpr int RecordWriterBase::Options::kMinZstdLdmHashLog;
+constexpr int RecordWriterBase::Options::kMaxZstdLdmHashLog;
+constexpr int RecordWriterBase::Options::kDefaultZstdLdmHashLog;
+constexpr uint64_t RecordWriterBase::Options::kMaxZstdTargetBlockSize;
 constexpr int RecordWriterBase::Options::kMinWindowLog;
 constexpr int RecordWriterBase::Options::kMaxWindowLog;
 constexpr int RecordWriterBase::Options::kDefaultWindowLog;
 constexpr uint64_t RecordWriterBase::Options::kDefaultChunkSize;
+constexpr int RecordWriterBase::Options::kAutoParallelism;
 #endif
 
 namespace {
 
+// The maximum number of requests waiting for the chunk writer thread with
+// `Options::set_background_writing()` and `parallelism == 0`. This allows a
+// chunk to be encoded while the previous one, together with its statistics
+// chunk, is written.
+constexpr size_t kBackgroundWritingRequests = 4;
+
+// Weight of the previous average in exponentially weighted moving averages of
+// encoding and writing times with `Options::kAutoParallelism`.
+constexpr int kTimeAverageWeight = 7;
+
+// Updates an exponentially weighted moving average with a sample.
+absl::Duration UpdateTimeAverage(absl::Duration average,
+                                 absl::Duration sample) {
+  if (average == absl::ZeroDuration()) return sample;
+  return (average * kTimeAverageWeight + sample) / (kTimeAverageWeight + 1);
+}
+
 class FileDescriptorCollector {
  public:
   explicit FileDescriptorCollector(
@@ -95,6 +157,105 @@ class FileDescriptorCollector {
   absl::flat_hash_set<std::string> files_seen_;
 };
 
+// File descriptors collected for files of the generated pool, which live until
+// the program ends, so that setting the same record type again copies them
+// instead of converting descriptors again.
+struct FileDescriptorsCache {
+  absl::Mutex mutex;
+  absl::flat_hash_map<
+      const google::protobuf::FileDescriptor*,
+      std::shared_ptr<const google::protobuf::RepeatedPtrField<
+          google::protobuf::FileDescriptorProto>>>
+      file_descriptors ABSL_GUARDED_BY(mutex);
+};
+
+// Returns `file_descriptor` with its dependencies, in the order expected by
+// `RecordsMetadata::file_descriptor`.
+//
+// `file_descriptor` must belong to the generated pool.
+std::shared_ptr<const google::protobuf::RepeatedPtrField<
+    google::protobuf::FileDescriptorProto>>
+CachedFileDescriptors(const google::protobuf::FileDescriptor* file_descriptor) {
+  static NoDestructor<FileDescriptorsCache> kFileDescriptorsCache;
+  {
+    absl::MutexLock lock(&kFileDescriptorsCache->mutex);
+    const auto iter =
+        kFileDescriptorsCache->file_descriptors.find(file_descriptor);
+    if (iter != kFileDescriptorsCache->file_descriptors.end()) {
+      return iter->second;
+    }
+  }
+  // Collect outside the lock, so that collecting different types does not
+  // serialize. If another thread collected the same file meanwhile, its result
+  // is kept.
+  const std::shared_ptr<google::protobuf::RepeatedPtrField<
+      google::protobuf::FileDescriptorProto>>
+      file_descriptors = std::make_shared<google::protobuf::RepeatedPtrField<
+          google::protobuf::FileDescriptorProto>>();
+  FileDescriptorCollector collector(file_descriptors.get());
+  collector.AddFile(file_descriptor);
+  absl::MutexLock lock(&kFileDescriptorsCache->mutex);
+  return kFileDescriptorsCache->file_descriptors
+      .emplace(file_descriptor, file_descriptors)
+      .first->second;
+}
+
+// Returns the `TransposeSchema` of records of type `descriptor`.
+std::shared_ptr<const TransposeSchema> TransposeSchemaOfDescriptor(
+    const google::protobuf::Descriptor* descriptor) {
+  const std::shared_ptr<TransposeSchema> schema =
+      std::make_shared<TransposeSchema>();
+  absl::flat_hash_map<const google::protobuf::Descriptor*,
+                      TransposeSchema::Message*>
+      messages;
+  // Message types added to `messages` whose fields are not added yet.
+  std::vector<const google::protobuf::Descriptor*> pending;
+  const auto message_of = [&](const google::protobuf::Descriptor* type) {
+    TransposeSchema::Message*& message = messages[type];
+    if (message == nullptr) {
+      message = schema->AddMessage();
+      pending.push_back(type);
+    }
+    return message;
+  };
+  schema->set_root(message_of(descriptor));
+  while (!pending.empty()) {
+    const google::protobuf::Descriptor* const type = pending.back();
+    pending.pop_back();
+    TransposeSchema::Message* const message = messages[type];
+    for (int i = 0; i < type->field_count(); ++i) {
+      const google::protobuf::FieldDescriptor* const field = type->field(i);
+      if (field->type() == google::protobuf::FieldDescriptor::TYPE_MESSAGE ||
+          field->type() == google::protobuf::FieldDescriptor::TYPE_GROUP) {
+        message->AddMessageField(IntCast<uint32_t>(field->number()),
+                                 message_of(field->message_type()));
+      } else {
+        message->AddNonMessageField(IntCast<uint32_t>(field->number()));
+      }
+    }
+  }
+  return schema;
+}
+
+// Returns the `TransposeSchema` of the record type stored in metadata, or
+// `nullptr` if metadata do not specify it.
+std::shared_ptr<const TransposeSchema> TransposeSchemaOfMetadata(
+    const RecordsMetadata& metadata, const Chain& serialized_metadata) {
+  RecordsMetadata parsed_metadata;
+  if (!serialized_metadata.empty()) {
+    if (ABSL_PREDICT_FALSE(
+            !ParseFromChain(&parsed_metadata, serialized_metadata).ok())) {
+      return nullptr;
+    }
+  }
+  const RecordsMetadataDescriptors descriptors(
+      serialized_metadata.empty() ? metadata : parsed_metadata);
+  const google::protobuf::Descriptor* const descriptor =
+      descriptors.descriptor();
+  if (descriptor == nullptr) return nullptr;
+  return TransposeSchemaOfDescriptor(descriptor);
+}
+
 template <typename Record>
 inline size_t RecordSize(const Record& record) {
   return record.size();
@@ -104,14 +265,151 @@ inline size_t RecordSize(const google::protobuf::MessageLite& record) {
   return record.ByteSizeLong();
 }
 
+inline size_t RecordSize(const google::protobuf::MessageLite* record) {
+  return record->ByteSizeLong();
+}
+
+// Returns the dictionary which chunks compressed with `compressor_options` are
+// compressed with, or an empty `absl::string_view` if there is none.
+absl::string_view DictionaryData(const CompressorOptions& compressor_options) {
+  if (IsCustomCompressionType(compressor_options.compression_type())) {
+    return absl::string_view();
+  }
+  switch (compressor_options.compression_type()) {
+    case CompressionType::kBrotli:
+      return compressor_options.brotli_dictionary().data();
+    case CompressionType::kZstd:
+      return compressor_options.zstd_dictionary().data();
+    case CompressionType::kNone:
+    case CompressionType::kSnappy:
+    case CompressionType::kLz4:
+      return absl::string_view();
+  }
+  RIEGELI_ASSERT_UNREACHABLE()
+      << "Unknown compression type: "
+      << static_cast<unsigned>(compressor_options.compression_type());
+}
+
+// Reads the data of the dictionary chunk of `src`, or leaves `*dictionary`
+// empty if there is none. The dictionary chunk precedes all chunks containing
+// records.
+Status ReadExistingDictionary(ChunkReader* src, std::string* dictionary) {
+  dictionary->clear();
+  if (ABSL_PREDICT_FALSE(!src->Seek(0))) return src->status();
+  for (;;) {
+    const ChunkHeader* chunk_header;
+    if (!src->PullChunkHeader(&chunk_header)) {
+      if (ABSL_PREDICT_FALSE(!src->healthy())) return src->status();
+      return OkStatus();
+    }
+    if (chunk_header->num_records() > 0) return OkStatus();
+    if (chunk_header->chunk_type() == ChunkType::kDictionary) {
+      Chunk chunk;
+      if (ABSL_PREDICT_FALSE(!src->ReadChunk(&chunk))) return src->status();
+      *dictionary = std::string(chunk.data);
+      return OkStatus();
+    }
+    if (ABSL_PREDICT_FALSE(!src->SeekToChunkAfter(src->pos() + 1))) {
+      return src->status();
+    }
+  }
+}
+
+// Verifies that the existing file being appended to is compatible with the
+// options of the new records: the file signature, metadata, and dictionary
+// must match, and the index cannot be extended. Truncates its torn tail if
+// any.
+Status PrepareForAppending(
+    const std::function<std::unique_ptr<ChunkReader>()>& open_existing,
+    HashType hash_type, bool writes_index, const Chain& serialized_metadata,
+    absl::string_view dictionary, ChunkWriter* dest) {
+  const std::unique_ptr<ChunkReader> src = open_existing();
+  if (ABSL_PREDICT_FALSE(src == nullptr)) {
+    return InvalidArgumentError("Opening the file for appending failed");
+  }
+  Position records_end;
+  {
+    const Status status = FindRecordsEnd(src.get(), &records_end);
+    if (ABSL_PREDICT_FALSE(!status.ok())) return status;
+  }
+  if (records_end > 0) {
+    Chunk signature;
+    if (ABSL_PREDICT_FALSE(!src->Seek(0) || !src->ReadChunk(&signature))) {
+      if (ABSL_PREDICT_FALSE(!src->healthy())) return src->status();
+      return DataLossError(
+          "Invalid Riegeli/records file: missing file signature");
+    }
+    // `decoded_data_size` of the file signature stores the hash type.
+    if (ABSL_PREDICT_FALSE(signature.header.decoded_data_size() !=
+                           static_cast<uint64_t>(hash_type))) {
+      return FailedPreconditionError(absl::StrCat(
+          "Hash type of the file being appended to does not match: ",
+          signature.header.decoded_data_size(), " != ",
+          static_cast<uint64_t>(hash_type)));
+    }
+    if (ABSL_PREDICT_FALSE(writes_index)) {
+      return FailedPreconditionError(
+          "An index or key filters cannot be written when appending to "
+          "a non-empty file: they would cover only the appended chunks");
+    }
+    Chain existing_metadata;
+    {
+      RecordReader<ChunkReader*> metadata_reader(src.get());
+      if (ABSL_PREDICT_FALSE(
+              !metadata_reader.ReadSerializedMetadata(&existing_metadata))) {
+        return metadata_reader.status();
+      }
+    }
+    if (ABSL_PREDICT_FALSE(existing_metadata != serialized_metadata)) {
+      return FailedPreconditionError(
+          "Metadata of the file being appended to does not match");
+    }
+    std::string existing_dictionary;
+    {
+      const Status status =
+          ReadExistingDictionary(src.get(), &existing_dictionary);
+      if (ABSL_PREDICT_FALSE(!status.ok())) return status;
+    }
+    if (ABSL_PREDICT_FALSE(existing_dictionary != dictionary)) {
+      return FailedPreconditionError(
+          "Dictionary of the file being appended to does not match");
+    }
+  }
+  if (dest->pos() != records_end) {
+    if (ABSL_PREDICT_FALSE(dest->pos() < records_end)) {
+      return FailedPreconditionError(absl::StrCat(
+          "Destination position ", dest->pos(),
+          " is before the end of the file being appended to: ", records_end));
+    }
+    if (ABSL_PREDICT_FALSE(!dest->SupportsTruncate())) {
+      return UnimplementedError(absl::StrCat(
+          "File being appended to ends with an incomplete chunk at ",
+          records_end, " but ChunkWriter::Truncate() is not supported"));
+    }
+    if (ABSL_PREDICT_FALSE(!dest->Truncate(records_end))) {
+      return dest->status();
+    }
+  }
+  return OkStatus();
+}
+
 }  // namespace
 
 void SetRecordType(RecordsMetadata* metadata,
                    const google::protobuf::Descriptor* descriptor) {
   metadata->set_record_type_name(descriptor->full_name());
+  const google::protobuf::FileDescriptor* const file_descriptor =
+      descriptor->file();
+  if (file_descriptor->pool() ==
+      google::protobuf::DescriptorPool::generated_pool()) {
+    *metadata->mutable_file_descriptor() =
+        *CachedFileDescriptors(file_descriptor);
+    return;
+  }
+  // Descriptors of other pools can be destroyed, so they are not cached.
   metadata->clear_file_descriptor();
   FileDescriptorCollector collector(metadata->mutable_file_descriptor());
-  collector.AddFile(descriptor->file());
+  collector.AddFile(file_descriptor);
 }
 
 Status RecordWriterBase::Options::FromString(absl::string_view text) {
@@ -127,19 +425,109 @@ Status RecordWriterBase::Options::FromString(absl::string_view text) {
   options_parser.AddOption("brotli", ValueParser::CopyTo(&compressor_text));
   options_parser.AddOption("zstd", ValueParser::CopyTo(&compressor_text));
   options_parser.AddOption("snappy", ValueParser::CopyTo(&compressor_text));
+  options_parser.AddOption("lz4", ValueParser::CopyTo(&compressor_text));
+  options_parser.AddOption("custom", ValueParser::CopyTo(&compressor_text));
   options_parser.AddOption("window_log", ValueParser::CopyTo(&compressor_text));
+  options_parser.AddOption("brotli_workers",
+                           ValueParser::CopyTo(&compressor_text));
+  options_parser.AddOption("zstd_workers",
+                           ValueParser::CopyTo(&compressor_text));
+  options_parser.AddOption("zstd_job_size",
+                           ValueParser::CopyTo(&compressor_text));
+  options_parser.AddOption("zstd_strategy",
+                           ValueParser::CopyTo(&compressor_text));
+  options_parser.AddOption("zstd_long", ValueParser::CopyTo(&compressor_text));
+  options_parser.AddOption("zstd_ldm_hash_log",
+                           ValueParser::CopyTo(&compressor_text));
+  options_parser.AddOption("zstd_target_block_size",
+                           ValueParser::CopyTo(&compressor_text));
+  options_parser.AddOption("auto_select",
+                           ValueParser::CopyTo(&compressor_text));
   options_parser.AddOption(
       "chunk_size", ValueParser::Bytes(&chunk_size_, 1,
                                        std::numeric_limits<uint64_t>::max()));
+  options_parser.AddOption(
+      "compressed_chunk_size",
+      ValueParser::Bytes(&compressed_chunk_size_, 1,
+                         std::numeric_limits<uint64_t>::max()));
+  options_parser.AddOption(
+      "max_chunk_memory",
+      ValueParser::Bytes(&max_chunk_memory_, 0,
+                         std::numeric_limits<uint64_t>::max()));
   options_parser.AddOption("bucket_fraction",
                            ValueParser::Real(&bucket_fraction_, 0.0, 1.0));
+  options_parser.AddOption(
+      "bucket_parallelism",
+      ValueParser::Int(&bucket_parallelism_, 0,
+                       std::numeric_limits<int>::max()));
+  options_parser.AddOption(
+      "values_block_size",
+      ValueParser::Bytes(&values_block_size_, 0,
+                         std::numeric_limits<uint64_t>::max()));
+  options_parser.AddOption(
+      "dedup_window",
+      ValueParser::Bytes(&dedup_window_, 0,
+                         std::numeric_limits<uint64_t>::max()));
+  options_parser.AddOption(
+      "numeric_encodings",
+      ValueParser::Enum(&numeric_encodings_,
+                        {{"", true}, {"true", true}, {"false", false}}));
+  options_parser.AddOption(
+      "string_dictionaries",
+      ValueParser::Enum(&string_dictionaries_,
+                        {{"", true}, {"true", true}, {"false", false}}));
+  options_parser.AddOption(
+      "packed_fields",
+      ValueParser::Enum(&packed_fields_,
+                        {{"", true}, {"true", true}, {"false", false}}));
+  options_parser.AddOption(
+      "schema_guided_transpose",
+      ValueParser::Enum(&schema_guided_transpose_,
+                        {{"", true}, {"true", true}, {"false", false}}));
+  options_parser.AddOption(
+      "shared_transpose_header",
+      ValueParser::Enum(&shared_transpose_header_,
+                        {{"", true}, {"true", true}, {"false", false}}));
+  options_parser.AddOption(
+      "chunk_prefix_interval",
+      ValueParser::Bytes(&chunk_prefix_interval_, 0,
+                         std::numeric_limits<uint64_t>::max()));
+  options_parser.AddOption(
+      "hash", ValueParser::Enum(&hash_type_,
+                                {{"highwayhash", HashType::kHighwayHash},
+                                 {"crc32c", HashType::kCrc32c},
+                                 {"highwayhash_tree",
+                                  HashType::kHighwayHashTree}}));
   options_parser.AddOption(
       "pad_to_block_boundary",
       ValueParser::Enum(&pad_to_block_boundary_,
                         {{"", true}, {"true", true}, {"false", false}}));
+  options_parser.AddOption(
+      "align_chunk_data",
+      ValueParser::Enum(&align_chunk_data_,
+                        {{"", true}, {"true", true}, {"false", false}}));
+  options_parser.AddOption(
+      "segment", ValueParser::Enum(&segment_, {{"", true},
+                                               {"true", true},
+                                               {"false", false}}));
+  options_parser.AddOption(
+      "index", ValueParser::Enum(&index_, {{"", true},
+                                           {"true", true},
+                                           {"false", false}}));
   options_parser.AddOption(
       "parallelism",
-      ValueParser::Int(&parallelism_, 0, std::numeric_limits<int>::max()));
+      ValueParser::Or(
+          ValueParser::Enum(&parallelism_, {{"auto", kAutoParallelism}}),
+          ValueParser::Int(&parallelism_, 0,
+                           std::numeric_limits<int>::max())));
+  options_parser.AddOption(
+      "background_writing",
+      ValueParser::Enum(&background_writing_,
+                        {{"", true}, {"true", true}, {"false", false}}));
+  options_parser.AddOption(
+      "max_pending_bytes",
+      ValueParser::Bytes(&max_pending_bytes_, 0,
+                         std::numeric_limits<uint64_t>::max()));
   if (ABSL_PREDICT_FALSE(!options_parser.FromString(text))) {
     return options_parser.status();
   }
@@ -148,12 +536,33 @@ Status RecordWriterBase::Options::FromString(absl::string_view text) {
 
 class RecordWriterBase::Worker : public Object {
  public:
-  explicit Worker(ChunkWriter* chunk_writer, Options&& options)
+  explicit Worker(ChunkWriter* chunk_writer, Options&& options,
+                  internal::RecordStatsCollector* stats_collector)
       : Object(kInitiallyOpen),
         options_(std::move(options)),
         chunk_writer_(RIEGELI_ASSERT_NOTNULL(chunk_writer)),
-        chunk_encoder_(MakeChunkEncoder()) {
+        stats_collector_(stats_collector),
+        write_index_((options_.index_ || options_.key_extractor_ != nullptr) &&
+                     chunk_writer_->pos() == 0 && !options_.segment_),
+        write_statistics_(!options_.chunk_statistics_.empty()),
+        chunk_statistics_(options_.chunk_statistics_),
+        write_key_filters_(write_index_ && options_.key_extractor_ != nullptr),
+        write_first_keys_(write_key_filters_ && options_.sorted_keys_),
+        write_secondary_index_(
+            options_.secondary_index_key_extractor_ != nullptr &&
+            options_.open_secondary_index_ != nullptr && !options_.segment_),
+        collect_records_(write_statistics_ || write_key_filters_ ||
+                         write_secondary_index_),
+        desired_chunk_size_(DesiredChunkSize(options_.chunk_size_)) {
+    RIEGELI_ASSERT(!options_.sorted_keys_ || options_.key_extractor_ != nullptr)
+        << "Failed precondition of "
+           "RecordWriterBase::Options::set_sorted_keys(): "
+           "no key extractor";
     if (ABSL_PREDICT_FALSE(!chunk_writer_->healthy())) Fail(*chunk_writer_);
+    if (options_.transpose_ && options_.schema_guided_transpose_) {
+      transpose_schema_ = TransposeSchemaOfMetadata(
+          options_.metadata(), options_.serialized_metadata_);
+    }
   }
 
   ~Worker();
@@ -163,53 +572,344 @@ class RecordWriterBase::Worker : public Object {
   // Precondition: chunk is not open.
   virtual void OpenChunk() = 0;
 
+  // `size` is `RecordSize(record)`. For a message it must have been computed
+  // after `record` was last modified, so that sizes cached by `ByteSizeLong()`
+  // are reused for serialization.
+  //
+  // Precondition: chunk is open.
+  template <typename Record>
+  bool AddRecord(Record&& record, size_t size);
+  bool AddRecord(const google::protobuf::MessageLite& record, size_t size);
+
   // Precondition: chunk is open.
   template <typename Record>
-  bool AddRecord(Record&& record);
+  bool AddRecords(absl::Span<const Record> records);
+  bool AddRecords(
+      absl::Span<const google::protobuf::MessageLite* const> records);
+  bool AddRecords(absl::Span<const absl::string_view> records);
 
   // Precondition: chunk is open.
   //
   // If the result is `false` then `!healthy()`.
   virtual bool CloseChunk() = 0;
 
+  // Returns `true` if `Options::set_max_chunk_memory()` is used.
+  bool limits_chunk_memory() const { return options_.max_chunk_memory_ > 0; }
+
+  // Returns `true` if `Options::set_max_chunk_memory()` is used and the open
+  // chunk exceeds it.
+  //
+  // Precondition: chunk is open, `chunk_mutex()` is `nullptr` or held.
+  bool ChunkMemoryExceeded() const {
+    return limits_chunk_memory() &&
+           chunk_encoder_->ApproximateMemory() > options_.max_chunk_memory_;
+  }
+
+  // Writes a chunk of records encoded elsewhere, see
+  // `RecordWriterBase::WriteChunk()`.
+  //
+  // Precondition: the open chunk is empty.
+  bool AddEncodedChunk(const Chunk& chunk);
+
+  // Returns an encoder of a record written by `RecordWriterBase::OpenRecord()`.
+  //
+  // Returns `nullptr` on failure (`!healthy()`).
+  std::unique_ptr<SimpleEncoder> MakeRecordEncoder();
+
+  // Encodes and writes a chunk of a record written by
+  // `RecordWriterBase::OpenRecord()`.
+  //
+  // Precondition: the open chunk is empty.
+  bool AddRecordChunk(ChunkEncoder* record_encoder);
+
   bool MaybePadToBlockBoundary();
 
+  // Writes the index chunk, preceded by the key filter chunk if
+  // `Options::set_key_extractor()` was used, preceded by the first key chunk if
+  // `Options::set_sorted_keys()` was used, if `Options::set_index()` or
+  // `Options::set_key_extractor()` was used and the file is written from the
+  // beginning.
+  //
+  // Precondition: chunk is not open.
+  virtual bool WriteIndex() = 0;
+
+  // Writes the secondary index if `Options::set_secondary_index()` was used,
+  // with positions of records resolved using beginnings of written chunks.
+  //
+  // Precondition: the worker was closed successfully.
+  //
+  // Returns status:
+  //  * `status.ok()`  - success
+  //  * `!status.ok()` - failure
+  Status WriteSecondaryIndex();
+
   // Precondition: chunk is not open.
   virtual bool Flush(FlushType flush_type) = 0;
 
   virtual FutureRecordPosition Pos() const = 0;
 
+  // Returns the position of the next record added to the open chunk, or to a
+  // chunk added next if no chunk is open.
+  //
+  // Precondition: `chunk_mutex()` is `nullptr` or held.
+  ChunkSequencePosition SequencePos() const {
+    return ChunkSequencePosition(chunks_closed_,
+                                 chunk_encoder_ == nullptr
+                                     ? uint64_t{0}
+                                     : chunk_encoder_->num_records());
+  }
+
+  // Returns the number of bytes of chunks being encoded or waiting to be
+  // written in background.
+  virtual uint64_t PendingBytes() const { return 0; }
+
+  // Returns the mutex which must be held while the open chunk is accessed, or
+  // `nullptr` if chunks are not closed in background.
+  virtual absl::Mutex* chunk_mutex() { return nullptr; }
+
+  // Called before adding the first record to the open chunk.
+  //
+  // Precondition: `chunk_mutex()` is `nullptr` or held.
+  virtual void ChunkStarted() {}
+
+  // Returns `true` once after the open chunk was closed and a new chunk was
+  // opened in background.
+  //
+  // Precondition: `chunk_mutex()` is `nullptr` or held.
+  virtual bool TakeChunkClosedInBackground() { return false; }
+
+  // Stops closing chunks in background. Afterwards `chunk_mutex()` no longer
+  // needs to be held.
+  virtual void StopClosingChunksInBackground() {}
+
+  // Registers this `Worker` (`sizeof(*this)` of the derived class) and its
+  // subobjects with `MemoryEstimator`.
+  virtual void RegisterUnique(MemoryEstimator* memory_estimator) const = 0;
+
+  // Returns the desired uncompressed size of the next chunk. This is
+  // `Options::set_chunk_size()`, or the size adjusted by `EncodeChunk()` if
+  // `Options::set_compressed_chunk_size()` was used.
+  uint64_t desired_chunk_size() const {
+    return desired_chunk_size_.load(std::memory_order_relaxed);
+  }
+
  protected:
   void Initialize(Position initial_pos);
   virtual bool WriteSignature() = 0;
   virtual bool WriteMetadata() = 0;
+  virtual bool WriteDictionary() = 0;
   virtual bool PadToBlockBoundary() = 0;
+  // Writes a chunk of records with its header already set, and adds it to the
+  // index.
+  virtual bool WriteRecordsChunk(Chunk&& chunk) = 0;
+
+  // Returns `true` if chunks are compressed with a Brotli or Zstd dictionary,
+  // which is then stored in a dictionary chunk.
+  bool HasDictionary() const;
+  // Returns the contents of the dictionary chunk, or empty if there is no
+  // dictionary.
+  absl::string_view DictionaryData() const;
 
   std::unique_ptr<ChunkEncoder> MakeChunkEncoder();
   void EncodeSignature(Chunk* chunk);
   bool EncodeMetadata(Chunk* chunk);
+  void EncodeDictionary(Chunk* chunk);
   bool EncodeChunk(ChunkEncoder* chunk_encoder, Chunk* chunk);
+  // Sets `chunk->header` for the encoded `chunk->data`, and accounts for the
+  // chunk in stats and in the desired chunk size.
+  void FinishChunk(ChunkType chunk_type, uint64_t num_records,
+                   uint64_t decoded_data_size, Chunk* chunk);
+  // Called after a chunk is written, in the thread writing chunks. If the
+  // chunk contains records, adds it to `index_` if `write_index_`, and reports
+  // it to `secondary_index_chunk_begins_` if `write_secondary_index_` and to
+  // `options_.chunk_written_callback_`.
+  void ChunkWritten(Position chunk_begin, const ChunkHeader& chunk_header);
+  void EncodeIndex(Chunk* chunk);
+  // Adds a filter of keys of records added to the open chunk to `key_filters_`,
+  // and the first of these keys to `first_keys_` if `write_first_keys_`, and
+  // forgets them.
+  //
+  // Precondition: `write_key_filters_`
+  void AddKeyFilter();
+  void EncodeKeyFilters(Chunk* chunk);
+  void EncodeFirstKeys(Chunk* chunk);
+  // Writes the key filter chunk if `write_key_filters_`, preceded by the first
+  // key chunk if `write_first_keys_`.
+  //
+  // Return values:
+  //  * `true`  - success (`healthy()`)
+  //  * `false` - failure (`!healthy()`)
+  bool WriteKeyChunks();
+  // Encodes statistics of records added to the open chunk, and forgets them.
+  //
+  // Precondition: `write_statistics_`
+  void EncodeStatistics(Chunk* chunk);
+  // Calls `chunk_writer_->WriteChunk()` or `chunk_writer_->Flush()`, measuring
+  // them for `stats_collector_`.
+  // Writes a chunk, followed by padding aligning data of the next chunk if
+  // `options_.align_chunk_data_`.
+  bool WriteChunk(const Chunk& chunk);
+  // Writes padding aligning data of the next chunk after `chunk` if
+  // `options_.align_chunk_data_`, calling `chunk_writer_` directly.
+  bool MaybeAlignChunkData(const Chunk& chunk);
+  bool FlushChunkWriter(FlushType flush_type);
+  // Registers the open chunk, key filters, and first keys with
+  // `MemoryEstimator`.
+  //
+  // Precondition: `chunk_mutex()` is `nullptr` or held.
+  void RegisterSubobjects(MemoryEstimator* memory_estimator) const;
 
   Options options_;
   // Invariant: `chunk_writer_ != nullptr`
   ChunkWriter* chunk_writer_;
+  // Collects `RecordStats`, or `nullptr` if stats are not collected.
+  internal::RecordStatsCollector* const stats_collector_;
   // Invariant: if chunk is open then `chunk_encoder_ != nullptr`
   std::unique_ptr<ChunkEncoder> chunk_encoder_;
+  // The number of chunks containing records closed or added so far, i.e. the
+  // sequence number of the open chunk. Guarded like the open chunk.
+  uint64_t chunks_closed_ = 0;
+  // The number of chunks containing records written so far. Used by the thread
+  // writing chunks.
+  uint64_t chunks_written_ = 0;
+  // Types of fields of records guiding `TransposeEncoder`, or `nullptr`.
+  std::shared_ptr<const TransposeSchema> transpose_schema_;
+  // If `true`, chunks are added to `index_`, to be written by `WriteIndex()`.
+  const bool write_index_;
+  // Chunks written so far. Used by the thread writing chunks.
+  ChunkIndex index_;
+  // If `true`, a statistics chunk precedes each chunk containing records.
+  const bool write_statistics_;
+  // Statistics of records added to the open chunk, if `write_statistics_`.
+  ChunkStatistics chunk_statistics_;
+  // If `true`, a key filter chunk precedes the index chunk.
+  const bool write_key_filters_;
+  // Hashes of keys of records added to the open chunk, if `write_key_filters_`.
+  std::vector<uint64_t> key_hashes_;
+  // Filters of chunks closed so far, if `write_key_filters_`. Filled when
+  // chunks are closed, and used by the thread writing the index chunk.
+  KeyFilters key_filters_;
+  // If `true`, a first key chunk precedes the key filter chunk, and keys of
+  // records are verified to be sorted.
+  const bool write_first_keys_;
+  // The key of the last record added, if `write_first_keys_`.
+  std::string last_key_;
+  // The key of the first record added to the open chunk, if
+  // `write_first_keys_` and `!key_hashes_.empty()`.
+  std::string chunk_first_key_;
+  // First keys of chunks closed so far, if `write_first_keys_`. Filled and used
+  // like `key_filters_`.
+  FirstKeys first_keys_;
+  // If `true`, keys and sequence positions of records are collected, to be
+  // written by `WriteSecondaryIndex()`.
+  const bool write_secondary_index_;
+  // Keys and positions of records added so far, if `write_secondary_index_`.
+  // Guarded like the open chunk.
+  std::vector<std::pair<std::string, ChunkSequencePosition>>
+      secondary_index_entries_;
+  // Beginnings of chunks containing records written so far, indexed by their
+  // sequence numbers, if `write_secondary_index_`. Used by the thread writing
+  // chunks.
+  std::vector<Position> secondary_index_chunk_begins_;
+  // If `true`, records are passed to `CollectRecord()`.
+  const bool collect_records_;
+
+ private:
+  // Updates statistics and key hashes of the open chunk, and secondary index
+  // entries, with `record`, whose index in the open chunk is `record_index`.
+  void CollectRecord(absl::string_view record, uint64_t record_index);
+  void CollectRecord(const Chain& record, uint64_t record_index);
+
+  template <typename Record>
+  bool AddRecordToChunkEncoder(Record&& record);
+
+  // Ensures that `num_records` does not overflow when `WriteRecordImpl()` keeps
+  // `num_records * sizeof(uint64_t)` under the desired chunk size.
+  static uint64_t DesiredChunkSize(uint64_t chunk_size);
+
+  // Updated by `EncodeChunk()`, which can run in a background thread.
+  std::atomic<uint64_t> desired_chunk_size_;
 };
 
 RecordWriterBase::Worker::~Worker() {}
 
+inline uint64_t RecordWriterBase::Worker::DesiredChunkSize(
+    uint64_t chunk_size) {
+  return UnsignedMax(
+      UnsignedMin(chunk_size, kMaxNumRecords * sizeof(uint64_t)), uint64_t{1});
+}
+
 inline void RecordWriterBase::Worker::Initialize(Position initial_pos) {
-  if (initial_pos == 0) {
+  if (options_.segment_) {
+    // Chunks of a segment are preceded by chunks of other segments, and no
+    // file signature follows them.
+    if (ABSL_PREDICT_FALSE(!PadToBlockBoundary())) return;
+    WriteDictionary();
+  } else if (initial_pos == 0) {
     if (ABSL_PREDICT_FALSE(!WriteSignature())) return;
     if (ABSL_PREDICT_FALSE(!WriteMetadata())) return;
+    if (ABSL_PREDICT_FALSE(!WriteDictionary())) return;
+  } else if (options_.open_existing_ != nullptr) {
+    // Begin appended records at a block boundary, so that they are readable
+    // even if a damaged region precedes them. Repeat the dictionary chunk, so
+    // that reading from the boundary finds it.
+    if (ABSL_PREDICT_FALSE(!PadToBlockBoundary())) return;
+    WriteDictionary();
   } else {
     MaybePadToBlockBoundary();
   }
 }
 
+std::unique_ptr<SimpleEncoder> RecordWriterBase::Worker::MakeRecordEncoder() {
+  if (ABSL_PREDICT_FALSE(!healthy())) return nullptr;
+  if (ABSL_PREDICT_FALSE(collect_records_)) {
+    Fail(FailedPreconditionError(
+        "RecordWriterBase::OpenRecord() cannot be used together with "
+        "chunk statistics, a key extractor, or a secondary index"));
+    return nullptr;
+  }
+  // The algorithm cannot be chosen by sampling a record which is not known
+  // yet.
+  return std::make_unique<SimpleEncoder>(
+      CompressorOptions(options_.compressor_options_)
+          .set_auto_select(absl::nullopt),
+      0);
+}
+
+bool RecordWriterBase::Worker::AddRecordChunk(ChunkEncoder* record_encoder) {
+  ++chunks_closed_;
+  Chunk chunk;
+  if (ABSL_PREDICT_FALSE(!EncodeChunk(record_encoder, &chunk))) return false;
+  return WriteRecordsChunk(std::move(chunk));
+}
+
+bool RecordWriterBase::Worker::AddEncodedChunk(const Chunk& chunk) {
+  if (ABSL_PREDICT_FALSE(!healthy())) return false;
+  if (ABSL_PREDICT_FALSE(collect_records_)) {
+    return Fail(FailedPreconditionError(
+        "RecordWriterBase::WriteChunk() cannot be used together with "
+        "chunk statistics, a key extractor, or a secondary index"));
+  }
+  Chunk written_chunk;
+  written_chunk.data = chunk.data;
+  {
+    internal::RecordStatsCollector::Timer timer(
+        stats_collector_, internal::RecordStatsCollector::Stage::kHashing);
+    written_chunk.header =
+        ChunkHeader(written_chunk.data, chunk.header.chunk_type(),
+                    chunk.header.num_records(),
+                    chunk.header.decoded_data_size(), options_.hash_type_);
+  }
+  if (stats_collector_ != nullptr) {
+    stats_collector_->AddRecords(chunk.header.num_records(),
+                                 chunk.header.decoded_data_size());
+  }
+  if (chunk.header.num_records() > 0) ++chunks_closed_;
+  return WriteRecordsChunk(std::move(written_chunk));
+}
+
 inline bool RecordWriterBase::Worker::MaybePadToBlockBoundary() {
-  if (options_.pad_to_block_boundary_) {
+  if (options_.pad_to_block_boundary_ || options_.segment_) {
     return PadToBlockBoundary();
   } else {
     return true;
@@ -218,12 +918,13 @@ inline bool RecordWriterBase::Worker::MaybePadToBlockBoundary() {
 
 inline std::unique_ptr<ChunkEncoder>
 RecordWriterBase::Worker::MakeChunkEncoder() {
-  std::unique_ptr<ChunkEncoder> chunk_encoder;
-  if (options_.transpose_) {
+  const bool transpose = options_.transpose_;
+  uint64_t bucket_size = 0;
+  if (transpose) {
     const long double long_double_bucket_size =
         std::round(static_cast<long double>(options_.chunk_size_) *
                    static_cast<long double>(options_.bucket_fraction_));
-    const uint64_t bucket_size =
+    bucket_size =
         ABSL_PREDICT_FALSE(
             long_double_bucket_size >=
             static_cast<long double>(std::numeric_limits<uint64_t>::max()))
@@ -231,12 +932,43 @@ RecordWriterBase::Worker::MakeChunkEncoder() {
             : ABSL_PREDICT_TRUE(long_double_bucket_size >= 1.0L)
                   ? static_cast<uint64_t>(long_double_bucket_size)
                   : uint64_t{1};
-    chunk_encoder = std::make_unique<TransposeEncoder>(
-        options_.compressor_options_, bucket_size);
-  } else {
-    chunk_encoder = std::make_unique<SimpleEncoder>(
-        options_.compressor_options_, options_.chunk_size_);
   }
+  const auto make_base_encoder =
+      [transpose, bucket_size,
+       bucket_parallelism = options_.bucket_parallelism_,
+       numeric_encodings = options_.numeric_encodings_,
+       string_dictionaries = options_.string_dictionaries_,
+       packed_fields = options_.packed_fields_,
+       transpose_schema = transpose_schema_,
+       field_groups = options_.field_groups_,
+       chunk_size = options_.chunk_size_,
+       values_block_size = options_.values_block_size_,
+       dedup_window = options_.dedup_window_](
+          const CompressorOptions& compressor_options)
+      -> std::unique_ptr<ChunkEncoder> {
+    if (transpose) {
+      return std::make_unique<TransposeEncoder>(
+          compressor_options, bucket_size, bucket_parallelism,
+          numeric_encodings, string_dictionaries, packed_fields,
+          transpose_schema, field_groups);
+    } else {
+      return std::make_unique<SimpleEncoder>(compressor_options, chunk_size,
+                                             values_block_size, dedup_window);
+    }
+  };
+  if (options_.compressor_options_.auto_select() != absl::nullopt) {
+    // The compression algorithm is chosen when the chunk is encoded, depending
+    // on its records, so encoding must be deferred.
+    return std::make_unique<DeferredEncoder>(
+        [make_base_encoder,
+         compressor_options = options_.compressor_options_](
+            const Chain& records) {
+          return make_base_encoder(
+              internal::ChooseCompressorOptions(compressor_options, records));
+        });
+  }
+  std::unique_ptr<ChunkEncoder> chunk_encoder =
+      make_base_encoder(options_.compressor_options_);
   if (options_.parallelism_ == 0) {
     return chunk_encoder;
   } else {
@@ -245,15 +977,31 @@ RecordWriterBase::Worker::MakeChunkEncoder() {
 }
 
 inline void RecordWriterBase::Worker::EncodeSignature(Chunk* chunk) {
-  chunk->header = ChunkHeader(chunk->data, ChunkType::kFileSignature, 0, 0);
+  // `decoded_data_size` of the file signature stores the hash type.
+  chunk->header = ChunkHeader(chunk->data, ChunkType::kFileSignature, 0,
+                              static_cast<uint64_t>(options_.hash_type_),
+                              options_.hash_type_);
+}
+
+inline bool RecordWriterBase::Worker::HasDictionary() const {
+  return !DictionaryData().empty();
+}
+
+inline absl::string_view RecordWriterBase::Worker::DictionaryData() const {
+  return riegeli::DictionaryData(options_.compressor_options_);
 }
 
 inline bool RecordWriterBase::Worker::EncodeMetadata(Chunk* chunk) {
-  TransposeEncoder transpose_encoder(options_.compressor_options_,
-                                     std::numeric_limits<uint64_t>::max());
+  // Metadata precede the dictionary chunk, so they are compressed without the
+  // dictionary.
+  TransposeEncoder transpose_encoder(
+      CompressorOptions(options_.compressor_options_)
+          .set_brotli_dictionary(BrotliDictionary())
+          .set_zstd_dictionary(ZstdDictionary()),
+      std::numeric_limits<uint64_t>::max());
   if (ABSL_PREDICT_FALSE(
           options_.serialized_metadata_.empty()
-              ? !transpose_encoder.AddRecord(options_.metadata_)
+              ? !transpose_encoder.AddRecord(options_.metadata())
               : !transpose_encoder.AddRecord(options_.serialized_metadata_))) {
     return Fail(transpose_encoder);
   }
@@ -267,12 +1015,117 @@ inline bool RecordWriterBase::Worker::EncodeMetadata(Chunk* chunk) {
   }
   if (ABSL_PREDICT_FALSE(!data_writer.Close())) return Fail(data_writer);
   chunk->header =
-      ChunkHeader(chunk->data, ChunkType::kFileMetadata, 0, decoded_data_size);
+      ChunkHeader(chunk->data, ChunkType::kFileMetadata, 0, decoded_data_size,
+                  options_.hash_type_);
+  return true;
+}
+
+inline void RecordWriterBase::Worker::EncodeDictionary(Chunk* chunk) {
+  chunk->data = Chain(DictionaryData());
+  chunk->header = ChunkHeader(chunk->data, ChunkType::kDictionary, 0, 0,
+                              options_.hash_type_);
+}
+
+inline void RecordWriterBase::Worker::CollectRecord(absl::string_view record,
+                                                    uint64_t record_index) {
+  if (write_statistics_) chunk_statistics_.AddRecord(record);
+  if (write_secondary_index_) {
+    secondary_index_entries_.emplace_back(
+        options_.secondary_index_key_extractor_(record),
+        ChunkSequencePosition(chunks_closed_, record_index));
+  }
+  if (write_key_filters_) {
+    std::string key = options_.key_extractor_(record);
+    key_hashes_.push_back(KeyFilters::HashKey(key));
+    if (write_first_keys_) {
+      if (ABSL_PREDICT_FALSE(key < last_key_)) {
+        Fail(InvalidArgumentError(
+            "Records are not sorted by key, as required by "
+            "RecordWriterBase::Options::set_sorted_keys()"));
+      }
+      if (key_hashes_.size() == 1) chunk_first_key_ = key;
+      last_key_ = std::move(key);
+    }
+  }
+}
+
+inline void RecordWriterBase::Worker::CollectRecord(const Chain& record,
+                                                    uint64_t record_index) {
+  const absl::optional<absl::string_view> flat = record.TryFlat();
+  if (flat != absl::nullopt) {
+    CollectRecord(*flat, record_index);
+    return;
+  }
+  CollectRecord(absl::string_view(std::string(record)), record_index);
+}
+
+template <typename Record>
+inline bool RecordWriterBase::Worker::AddRecord(Record&& record,
+                                                size_t size) {
+  if (collect_records_) CollectRecord(record, chunk_encoder_->num_records());
+  return AddRecordToChunkEncoder(std::forward<Record>(record));
+}
+
+inline bool RecordWriterBase::Worker::AddRecord(
+    const google::protobuf::MessageLite& record, size_t size) {
+  if (ABSL_PREDICT_FALSE(!healthy())) return false;
+  if (!collect_records_) {
+    if (ABSL_PREDICT_FALSE(
+            !chunk_encoder_->AddRecordWithCachedSize(record, size))) {
+      return Fail(*chunk_encoder_);
+    }
+    return true;
+  }
+  // Serialize the record once, for both collecting and encoding.
+  Chain serialized;
+  {
+    Status status =
+        internal::SerializeWithCachedSizesToChain(record, size, &serialized);
+    if (ABSL_PREDICT_FALSE(!status.ok())) return Fail(std::move(status));
+  }
+  CollectRecord(serialized, chunk_encoder_->num_records());
+  return AddRecordToChunkEncoder(std::move(serialized));
+}
+
+template <typename Record>
+inline bool RecordWriterBase::Worker::AddRecords(
+    absl::Span<const Record> records) {
+  for (const Record& record : records) {
+    if (ABSL_PREDICT_FALSE(!AddRecord(record, RecordSize(record)))) {
+      return false;
+    }
+  }
+  return true;
+}
+
+inline bool RecordWriterBase::Worker::AddRecords(
+    absl::Span<const google::protobuf::MessageLite* const> records) {
+  for (const google::protobuf::MessageLite* const record : records) {
+    if (ABSL_PREDICT_FALSE(!AddRecord(*record, RecordSize(*record)))) {
+      return false;
+    }
+  }
+  return true;
+}
+
+inline bool RecordWriterBase::Worker::AddRecords(
+    absl::Span<const absl::string_view> records) {
+  if (collect_records_) {
+    const uint64_t first_record_index = chunk_encoder_->num_records();
+    for (size_t i = 0; i < records.size(); ++i) {
+      CollectRecord(records[i], first_record_index + IntCast<uint64_t>(i));
+    }
+  }
+  if (ABSL_PREDICT_FALSE(!healthy())) return false;
+  if (ABSL_PREDICT_FALSE(!chunk_encoder_->AddRecords(records))) {
+    return Fail(*chunk_encoder_);
+  }
   return true;
 }
 
 template <typename Record>
-inline bool RecordWriterBase::Worker::AddRecord(Record&& record) {
+inline bool RecordWriterBase::Worker::AddRecordToChunkEncoder(
+    Record&& record) {
   if (ABSL_PREDICT_FALSE(!healthy())) return false;
   if (ABSL_PREDICT_FALSE(
           !chunk_encoder_->AddRecord(std::forward<Record>(record)))) {
@@ -288,35 +1141,243 @@ inline bool RecordWriterBase::Worker::EncodeChunk(ChunkEncoder* chunk_encoder,
   uint64_t num_records;
   uint64_t decoded_data_size;
   chunk->data.Clear();
-  ChainWriter<> data_writer(&chunk->data);
-  if (ABSL_PREDICT_FALSE(!chunk_encoder->EncodeAndClose(
-          &data_writer, &chunk_type, &num_records, &decoded_data_size))) {
-    return Fail(*chunk_encoder);
+  {
+    const TraceScope trace("EncodeChunk");
+    internal::RecordStatsCollector::Timer timer(
+        stats_collector_, internal::RecordStatsCollector::Stage::kCoding);
+    ChainWriter<> data_writer(&chunk->data);
+    if (ABSL_PREDICT_FALSE(!chunk_encoder->EncodeAndClose(
+            &data_writer, &chunk_type, &num_records, &decoded_data_size))) {
+      return Fail(*chunk_encoder);
+    }
+    if (ABSL_PREDICT_FALSE(!data_writer.Close())) return Fail(data_writer);
   }
-  if (ABSL_PREDICT_FALSE(!data_writer.Close())) return Fail(data_writer);
-  chunk->header =
-      ChunkHeader(chunk->data, chunk_type, num_records, decoded_data_size);
+  FinishChunk(chunk_type, num_records, decoded_data_size, chunk);
   return true;
 }
 
+inline void RecordWriterBase::Worker::FinishChunk(ChunkType chunk_type,
+                                                  uint64_t num_records,
+                                                  uint64_t decoded_data_size,
+                                                  Chunk* chunk) {
+  {
+    internal::RecordStatsCollector::Timer timer(
+        stats_collector_, internal::RecordStatsCollector::Stage::kHashing);
+    chunk->header = ChunkHeader(chunk->data, chunk_type, num_records,
+                                decoded_data_size, options_.hash_type_);
+  }
+  if (stats_collector_ != nullptr) {
+    stats_collector_->AddRecords(num_records, decoded_data_size);
+  }
+  if (options_.compressed_chunk_size_ > 0 && num_records > 0 &&
+      !chunk->data.empty()) {
+    // Scale the uncompressed size as measured by `WriteRecordImpl()`, i.e.
+    // including `sizeof(uint64_t)` per record, by the ratio of the desired to
+    // the actual compressed size.
+    const long double uncompressed_size =
+        static_cast<long double>(decoded_data_size) +
+        static_cast<long double>(num_records) *
+            static_cast<long double>(sizeof(uint64_t));
+    const long double chunk_size =
+        std::round(uncompressed_size *
+                   static_cast<long double>(options_.compressed_chunk_size_) /
+                   static_cast<long double>(chunk->data.size()));
+    desired_chunk_size_.store(
+        DesiredChunkSize(
+            chunk_size >=
+                    static_cast<long double>(
+                        std::numeric_limits<uint64_t>::max())
+                ? std::numeric_limits<uint64_t>::max()
+                : static_cast<uint64_t>(chunk_size)),
+        std::memory_order_relaxed);
+  }
+}
+
+inline void RecordWriterBase::Worker::ChunkWritten(
+    Position chunk_begin, const ChunkHeader& chunk_header) {
+  if (chunk_header.num_records() == 0) return;
+  if (write_index_) index_.Add(chunk_begin, chunk_header.num_records());
+  if (write_secondary_index_) {
+    secondary_index_chunk_begins_.push_back(chunk_begin);
+  }
+  if (options_.chunk_written_callback_ != nullptr) {
+    options_.chunk_written_callback_(chunks_written_, chunk_begin);
+  }
+  ++chunks_written_;
+}
+
+Status RecordWriterBase::Worker::WriteSecondaryIndex() {
+  if (!write_secondary_index_) return OkStatus();
+  std::stable_sort(
+      secondary_index_entries_.begin(), secondary_index_entries_.end(),
+      [](const std::pair<std::string, ChunkSequencePosition>& a,
+         const std::pair<std::string, ChunkSequencePosition>& b) {
+        return a.first < b.first;
+      });
+  const std::unique_ptr<RecordWriterBase> index_writer =
+      options_.open_secondary_index_();
+  if (ABSL_PREDICT_FALSE(index_writer == nullptr)) {
+    return InvalidArgumentError("Opening the secondary index failed");
+  }
+  for (const std::pair<std::string, ChunkSequencePosition>& entry :
+       secondary_index_entries_) {
+    RIEGELI_ASSERT_LT(entry.second.chunk_number(),
+                      secondary_index_chunk_begins_.size())
+        << "Chunk of a record in the secondary index not written";
+    const Position chunk_begin =
+        secondary_index_chunk_begins_[entry.second.chunk_number()];
+    if (ABSL_PREDICT_FALSE(!index_writer->WriteRecord(MakeSecondaryIndexEntry(
+            entry.first, entry.second.ToRecordPosition(chunk_begin))))) {
+      break;
+    }
+  }
+  secondary_index_entries_ = {};
+  secondary_index_chunk_begins_ = {};
+  if (ABSL_PREDICT_FALSE(!index_writer->Close())) {
+    return Annotate(index_writer->status(), "Writing secondary index failed");
+  }
+  return OkStatus();
+}
+
+inline void RecordWriterBase::Worker::EncodeIndex(Chunk* chunk) {
+  index_.Encode(chunk_writer_->pos(), options_.hash_type_, chunk);
+}
+
+inline void RecordWriterBase::Worker::AddKeyFilter() {
+  // Chunks with no records are not indexed, so they get no filter.
+  if (!key_hashes_.empty()) {
+    key_filters_.Add(key_hashes_, options_.key_filter_bits_per_key_);
+    key_hashes_.clear();
+    if (write_first_keys_) first_keys_.Add(chunk_first_key_);
+  }
+}
+
+inline void RecordWriterBase::Worker::EncodeKeyFilters(Chunk* chunk) {
+  key_filters_.Encode(options_.hash_type_, chunk);
+}
+
+inline void RecordWriterBase::Worker::EncodeFirstKeys(Chunk* chunk) {
+  first_keys_.Encode(options_.hash_type_, chunk);
+}
+
+void RecordWriterBase::Worker::RegisterSubobjects(
+    MemoryEstimator* memory_estimator) const {
+  if (chunk_encoder_ != nullptr) {
+    chunk_encoder_->RegisterUnique(memory_estimator);
+  }
+  memory_estimator->RegisterDynamicMemory(
+      chunk_statistics_.fields().capacity() *
+      sizeof(ChunkStatistics::FieldStatistics));
+  memory_estimator->RegisterDynamicMemory(key_hashes_.capacity() *
+                                          sizeof(uint64_t));
+  key_filters_.RegisterSubobjects(memory_estimator);
+  memory_estimator->RegisterDynamicMemory(last_key_.capacity() + 1);
+  memory_estimator->RegisterDynamicMemory(chunk_first_key_.capacity() + 1);
+  first_keys_.RegisterSubobjects(memory_estimator);
+}
+
+bool RecordWriterBase::Worker::WriteKeyChunks() {
+  if (write_first_keys_) {
+    Chunk first_keys_chunk;
+    EncodeFirstKeys(&first_keys_chunk);
+    if (ABSL_PREDICT_FALSE(!WriteChunk(first_keys_chunk))) {
+      return Fail(*chunk_writer_);
+    }
+  }
+  if (write_key_filters_) {
+    Chunk key_filters_chunk;
+    EncodeKeyFilters(&key_filters_chunk);
+    if (ABSL_PREDICT_FALSE(!WriteChunk(key_filters_chunk))) {
+      return Fail(*chunk_writer_);
+    }
+  }
+  return true;
+}
+
+inline void RecordWriterBase::Worker::EncodeStatistics(Chunk* chunk) {
+  chunk_statistics_.Encode(options_.hash_type_, chunk);
+  chunk_statistics_.ClearValues();
+}
+
+inline bool RecordWriterBase::Worker::WriteChunk(const Chunk& chunk) {
+  if (stats_collector_ == nullptr) {
+    return chunk_writer_->WriteChunk(chunk) && MaybeAlignChunkData(chunk);
+  }
+  internal::RecordStatsCollector::Timer timer(
+      stats_collector_, internal::RecordStatsCollector::Stage::kChunkIo);
+  const Position pos_before = chunk_writer_->pos();
+  const bool ok =
+      chunk_writer_->WriteChunk(chunk) && MaybeAlignChunkData(chunk);
+  stats_collector_->AddChunk(chunk_writer_->pos() - pos_before);
+  return ok;
+}
+
+inline bool RecordWriterBase::Worker::MaybeAlignChunkData(
+    const Chunk& chunk) {
+  // No chunk with data follows the index chunk.
+  if (!options_.align_chunk_data_ ||
+      chunk.header.chunk_type() == ChunkType::kIndex) {
+    return true;
+  }
+  return chunk_writer_->AlignChunkData(options_.hash_type_);
+}
+
+inline bool RecordWriterBase::Worker::FlushChunkWriter(FlushType flush_type) {
+  internal::RecordStatsCollector::Timer timer(
+      stats_collector_, internal::RecordStatsCollector::Stage::kChunkIo);
+  return chunk_writer_->Flush(flush_type);
+}
+
 class RecordWriterBase::SerialWorker : public Worker {
  public:
-  explicit SerialWorker(ChunkWriter* chunk_writer, Options&& options);
+  explicit SerialWorker(ChunkWriter* chunk_writer, Options&& options,
+                        internal::RecordStatsCollector* stats_collector);
 
-  void OpenChunk() override { chunk_encoder_->Clear(); }
+  void OpenChunk() override;
   bool CloseChunk() override;
+  bool WriteIndex() override;
   bool Flush(FlushType flush_type) override;
   FutureRecordPosition Pos() const override;
+  void RegisterUnique(MemoryEstimator* memory_estimator) const override;
 
  protected:
   bool WriteSignature() override;
   bool WriteMetadata() override;
+  bool WriteDictionary() override;
   bool PadToBlockBoundary() override;
+  bool WriteRecordsChunk(Chunk&& chunk) override;
+
+ private:
+  // Implements `CloseChunk()` if `options_.shared_transpose_header_`.
+  bool CloseChunkWithSharedHeader();
+  // Implements `CloseChunk()` if `options_.chunk_prefix_interval_ > 0`.
+  bool CloseChunkWithPrefix();
+
+  // The state machine of the last chunk written with a shared header, or
+  // empty if none, if `options_.shared_transpose_header_`.
+  std::string shared_state_machine_;
+  // The position of the last shared header chunk written, if
+  // `!shared_state_machine_.empty()`.
+  Position shared_header_pos_ = 0;
+  // The Zstd prefix computed from records of the first chunk of the current
+  // run, or empty if the next chunk begins a run, if
+  // `options_.chunk_prefix_interval_ > 0`.
+  ZstdDictionary chunk_prefix_;
+  // The position of the first chunk of the current run, if
+  // `!chunk_prefix_.empty()`.
+  Position chunk_prefix_pos_ = 0;
+  // The number of chunks of the current run written so far, if
+  // `options_.chunk_prefix_interval_ > 0`.
+  uint64_t chunks_in_run_ = 0;
+  // Whether `chunk_encoder_` compresses with `chunk_prefix_`.
+  bool chunk_encoder_has_prefix_ = false;
 };
 
-inline RecordWriterBase::SerialWorker::SerialWorker(ChunkWriter* chunk_writer,
-                                                    Options&& options)
-    : Worker(chunk_writer, std::move(options)) {
+inline RecordWriterBase::SerialWorker::SerialWorker(
+    ChunkWriter* chunk_writer, Options&& options,
+    internal::RecordStatsCollector* stats_collector)
+    : Worker(chunk_writer, std::move(options), stats_collector) {
+  chunk_encoder_ = MakeChunkEncoder();
   Initialize(chunk_writer_->pos());
 }
 
@@ -324,7 +1385,7 @@ bool RecordWriterBase::SerialWorker::WriteSignature() {
   if (ABSL_PREDICT_FALSE(!healthy())) return false;
   Chunk chunk;
   EncodeSignature(&chunk);
-  if (ABSL_PREDICT_FALSE(!chunk_writer_->WriteChunk(chunk))) {
+  if (ABSL_PREDICT_FALSE(!WriteChunk(chunk))) {
     return Fail(*chunk_writer_);
   }
   return true;
@@ -332,25 +1393,212 @@ bool RecordWriterBase::SerialWorker::WriteSignature() {
 
 bool RecordWriterBase::SerialWorker::WriteMetadata() {
   if (ABSL_PREDICT_FALSE(!healthy())) return false;
-  if (options_.metadata_.ByteSizeLong() == 0 &&
+  if (options_.metadata().ByteSizeLong() == 0 &&
       options_.serialized_metadata_.empty()) {
     return true;
   }
   Chunk chunk;
   if (ABSL_PREDICT_FALSE(!EncodeMetadata(&chunk))) return false;
-  if (ABSL_PREDICT_FALSE(!chunk_writer_->WriteChunk(chunk))) {
+  if (ABSL_PREDICT_FALSE(!WriteChunk(chunk))) {
+    return Fail(*chunk_writer_);
+  }
+  return true;
+}
+
+bool RecordWriterBase::SerialWorker::WriteDictionary() {
+  if (ABSL_PREDICT_FALSE(!healthy())) return false;
+  if (!HasDictionary()) return true;
+  Chunk chunk;
+  EncodeDictionary(&chunk);
+  if (ABSL_PREDICT_FALSE(!WriteChunk(chunk))) {
     return Fail(*chunk_writer_);
   }
   return true;
 }
 
+void RecordWriterBase::SerialWorker::OpenChunk() {
+  if (chunk_encoder_has_prefix_ != !chunk_prefix_.empty()) {
+    // The first chunk of a run is compressed as configured, and the remaining
+    // chunks with the prefix instead of the Zstd dictionary.
+    chunk_encoder_has_prefix_ = !chunk_prefix_.empty();
+    if (chunk_encoder_has_prefix_) {
+      chunk_encoder_ = std::make_unique<SimpleEncoder>(
+          CompressorOptions(options_.compressor_options_)
+              .set_zstd_dictionary(chunk_prefix_),
+          options_.chunk_size_);
+    } else {
+      chunk_encoder_ = MakeChunkEncoder();
+    }
+    return;
+  }
+  chunk_encoder_->Clear();
+}
+
 bool RecordWriterBase::SerialWorker::CloseChunk() {
   if (ABSL_PREDICT_FALSE(!healthy())) return false;
+  if (chunk_encoder_->num_records() > 0) ++chunks_closed_;
+  if (options_.shared_transpose_header_) return CloseChunkWithSharedHeader();
+  if (options_.chunk_prefix_interval_ > 0) return CloseChunkWithPrefix();
+  if (write_statistics_) {
+    Chunk statistics_chunk;
+    EncodeStatistics(&statistics_chunk);
+    if (ABSL_PREDICT_FALSE(!WriteChunk(statistics_chunk))) {
+      return Fail(*chunk_writer_);
+    }
+  }
+  if (write_key_filters_) AddKeyFilter();
   Chunk chunk;
   if (ABSL_PREDICT_FALSE(!EncodeChunk(chunk_encoder_.get(), &chunk))) {
     return false;
   }
-  if (ABSL_PREDICT_FALSE(!chunk_writer_->WriteChunk(chunk))) {
+  const Position chunk_begin = chunk_writer_->pos();
+  if (ABSL_PREDICT_FALSE(!WriteChunk(chunk))) {
+    return Fail(*chunk_writer_);
+  }
+  ChunkWritten(chunk_begin, chunk.header);
+  return true;
+}
+
+inline bool RecordWriterBase::SerialWorker::CloseChunkWithSharedHeader() {
+  // Whether the state machine needs a new shared header chunk is known after
+  // encoding the chunk. The shared header chunk is written before the
+  // statistics chunk, which must immediately precede the chunk it describes.
+  Chunk chunk;
+  Chunk shared_header_chunk;
+  uint64_t num_records;
+  uint64_t decoded_data_size;
+  {
+    const TraceScope trace("EncodeChunk");
+    internal::RecordStatsCollector::Timer timer(
+        stats_collector_, internal::RecordStatsCollector::Stage::kCoding);
+    // `MakeChunkEncoder()` returns a `TransposeEncoder` because
+    // `options_.shared_transpose_header_` implies transposing with
+    // `parallelism == 0`, without auto-selecting compression.
+    TransposeEncoder* const transpose_encoder =
+        static_cast<TransposeEncoder*>(chunk_encoder_.get());
+    ChainWriter<> data_writer(&chunk.data);
+    if (ABSL_PREDICT_FALSE(!transpose_encoder->EncodeAndCloseWithSharedHeader(
+            &data_writer, &shared_state_machine_, &shared_header_chunk.data,
+            &num_records, &decoded_data_size))) {
+      return Fail(*transpose_encoder);
+    }
+    if (ABSL_PREDICT_FALSE(!data_writer.Close())) return Fail(data_writer);
+  }
+  if (!shared_header_chunk.data.empty()) {
+    shared_header_chunk.header =
+        ChunkHeader(shared_header_chunk.data, ChunkType::kSharedTransposeHeader,
+                    0, 0, options_.hash_type_);
+    shared_header_pos_ = chunk_writer_->pos();
+    if (ABSL_PREDICT_FALSE(!WriteChunk(shared_header_chunk))) {
+      return Fail(*chunk_writer_);
+    }
+  }
+  if (write_statistics_) {
+    Chunk statistics_chunk;
+    EncodeStatistics(&statistics_chunk);
+    if (ABSL_PREDICT_FALSE(!WriteChunk(statistics_chunk))) {
+      return Fail(*chunk_writer_);
+    }
+  }
+  if (write_key_filters_) AddKeyFilter();
+  const Position chunk_begin = chunk_writer_->pos();
+  char distance[kMaxLengthVarint64];
+  const char* const distance_end =
+      WriteVarint64(distance, chunk_begin - shared_header_pos_);
+  chunk.data.Prepend(
+      absl::string_view(distance, PtrDistance(distance, distance_end)));
+  FinishChunk(ChunkType::kTransposedWithSharedHeader, num_records,
+              decoded_data_size, &chunk);
+  if (ABSL_PREDICT_FALSE(!WriteChunk(chunk))) {
+    return Fail(*chunk_writer_);
+  }
+  ChunkWritten(chunk_begin, chunk.header);
+  return true;
+}
+
+inline bool RecordWriterBase::SerialWorker::CloseChunkWithPrefix() {
+  if (write_statistics_) {
+    Chunk statistics_chunk;
+    EncodeStatistics(&statistics_chunk);
+    if (ABSL_PREDICT_FALSE(!WriteChunk(statistics_chunk))) {
+      return Fail(*chunk_writer_);
+    }
+  }
+  if (write_key_filters_) AddKeyFilter();
+  Chunk chunk;
+  const Position chunk_begin = chunk_writer_->pos();
+  if (chunk_prefix_.empty()) {
+    if (ABSL_PREDICT_FALSE(!EncodeChunk(chunk_encoder_.get(), &chunk))) {
+      return false;
+    }
+  } else {
+    ChunkType chunk_type;
+    uint64_t num_records;
+    uint64_t decoded_data_size;
+    {
+      const TraceScope trace("EncodeChunk");
+      internal::RecordStatsCollector::Timer timer(
+          stats_collector_, internal::RecordStatsCollector::Stage::kCoding);
+      ChainWriter<> data_writer(&chunk.data);
+      if (ABSL_PREDICT_FALSE(!chunk_encoder_->EncodeAndClose(
+              &data_writer, &chunk_type, &num_records, &decoded_data_size))) {
+        return Fail(*chunk_encoder_);
+      }
+      if (ABSL_PREDICT_FALSE(!data_writer.Close())) return Fail(data_writer);
+    }
+    // `chunk_encoder_` is a `SimpleEncoder` without blocks or references
+    // because `options_.chunk_prefix_interval_ > 0` implies this.
+    RIEGELI_ASSERT(chunk_type == ChunkType::kSimple)
+        << "SimpleEncoder without blocks or references "
+           "encoded a chunk of type "
+        << static_cast<unsigned>(chunk_type);
+    char distance[kMaxLengthVarint64];
+    const char* const distance_end =
+        WriteVarint64(distance, chunk_begin - chunk_prefix_pos_);
+    chunk.data.Prepend(
+        absl::string_view(distance, PtrDistance(distance, distance_end)));
+    FinishChunk(ChunkType::kSimpleWithPrefix, num_records, decoded_data_size,
+                &chunk);
+  }
+  if (ABSL_PREDICT_FALSE(!WriteChunk(chunk))) {
+    return Fail(*chunk_writer_);
+  }
+  ChunkWritten(chunk_begin, chunk.header);
+  if (chunk_prefix_.empty()) {
+    // Begin a run if the chunk has records to serve as a prefix.
+    if (ChunkDecoder::ChunkPrefix(
+            chunk, options_.compressor_options_.zstd_dictionary(),
+            &chunk_prefix_)) {
+      chunk_prefix_pos_ = chunk_begin;
+      chunks_in_run_ = 1;
+    }
+  } else {
+    ++chunks_in_run_;
+  }
+  if (chunks_in_run_ >= options_.chunk_prefix_interval_) {
+    chunk_prefix_ = ZstdDictionary();
+    chunks_in_run_ = 0;
+  }
+  return true;
+}
+
+bool RecordWriterBase::SerialWorker::WriteRecordsChunk(Chunk&& chunk) {
+  if (ABSL_PREDICT_FALSE(!healthy())) return false;
+  const Position chunk_begin = chunk_writer_->pos();
+  if (ABSL_PREDICT_FALSE(!WriteChunk(chunk))) {
+    return Fail(*chunk_writer_);
+  }
+  ChunkWritten(chunk_begin, chunk.header);
+  return true;
+}
+
+bool RecordWriterBase::SerialWorker::WriteIndex() {
+  if (ABSL_PREDICT_FALSE(!healthy())) return false;
+  if (!write_index_) return true;
+  if (ABSL_PREDICT_FALSE(!WriteKeyChunks())) return false;
+  Chunk chunk;
+  EncodeIndex(&chunk);
+  if (ABSL_PREDICT_FALSE(!WriteChunk(chunk))) {
     return Fail(*chunk_writer_);
   }
   return true;
@@ -358,15 +1606,22 @@ bool RecordWriterBase::SerialWorker::CloseChunk() {
 
 bool RecordWriterBase::SerialWorker::PadToBlockBoundary() {
   if (ABSL_PREDICT_FALSE(!healthy())) return false;
-  if (ABSL_PREDICT_FALSE(!chunk_writer_->PadToBlockBoundary())) {
+  if (ABSL_PREDICT_FALSE(
+          !chunk_writer_->PadToBlockBoundary(options_.hash_type_))) {
     return Fail(*chunk_writer_);
   }
+  if (options_.align_chunk_data_) {
+    if (ABSL_PREDICT_FALSE(
+            !chunk_writer_->AlignChunkData(options_.hash_type_))) {
+      return Fail(*chunk_writer_);
+    }
+  }
   return true;
 }
 
 bool RecordWriterBase::SerialWorker::Flush(FlushType flush_type) {
   if (ABSL_PREDICT_FALSE(!healthy())) return false;
-  if (ABSL_PREDICT_FALSE(!chunk_writer_->Flush(flush_type))) {
+  if (ABSL_PREDICT_FALSE(!FlushChunkWriter(flush_type))) {
     return Fail(*chunk_writer_);
   }
   return true;
@@ -377,61 +1632,161 @@ FutureRecordPosition RecordWriterBase::SerialWorker::Pos() const {
       RecordPosition(chunk_writer_->pos(), chunk_encoder_->num_records()));
 }
 
+void RecordWriterBase::SerialWorker::RegisterUnique(
+    MemoryEstimator* memory_estimator) const {
+  memory_estimator->RegisterDynamicMemory(sizeof(*this));
+  RegisterSubobjects(memory_estimator);
+  index_.RegisterSubobjects(memory_estimator);
+  memory_estimator->RegisterDynamicMemory(shared_state_machine_.capacity() + 1);
+  memory_estimator->RegisterDynamicMemory(chunk_prefix_.data().size());
+}
+
 // `ParallelWorker` uses parallelism internally, but the class is still only
 // thread-compatible, not thread-safe.
+//
+// If `options_.parallelism_ == 0` (with `options_.background_writing_`), chunks
+// are encoded in the thread closing them, and only written in background.
 class RecordWriterBase::ParallelWorker : public Worker {
  public:
-  explicit ParallelWorker(ChunkWriter* chunk_writer, Options&& options);
+  explicit ParallelWorker(ChunkWriter* chunk_writer, Options&& options,
+                          internal::RecordStatsCollector* stats_collector);
 
   ~ParallelWorker();
 
-  void OpenChunk() override { chunk_encoder_ = MakeChunkEncoder(); }
+  void OpenChunk() override;
   bool CloseChunk() override;
+  bool WriteIndex() override;
   bool Flush(FlushType flush_type) override;
   FutureRecordPosition Pos() const override;
+  uint64_t PendingBytes() const override;
+  absl::Mutex* chunk_mutex() override;
+  void ChunkStarted() override;
+  bool TakeChunkClosedInBackground() override;
+  void StopClosingChunksInBackground() override;
+  void RegisterUnique(MemoryEstimator* memory_estimator) const override;
 
  protected:
   void Done() override;
   bool WriteSignature() override;
   bool WriteMetadata() override;
+  bool WriteDictionary() override;
   bool PadToBlockBoundary() override;
+  bool WriteRecordsChunk(Chunk&& chunk) override;
 
  private:
-  struct ChunkPromises {
-    std::promise<ChunkHeader> chunk_header;
-    std::promise<Chunk> chunk;
-  };
-
   // A request to the chunk writer thread.
   struct DoneRequest {
     std::promise<void> done;
   };
+  // The chunk is stored in the request by the thread encoding it, under
+  // `mutex_`. This avoids a separate synchronization primitive for each chunk:
+  // the chunk writer thread waits for the next request to be ready under the
+  // same `mutex_` it waits on for the next request to be available.
   struct WriteChunkRequest {
     std::shared_future<ChunkHeader> chunk_header;
-    std::future<Chunk> chunk;
+    // Valid if `chunk_ready`.
+    Chunk chunk;
+    bool chunk_ready = false;
   };
   struct PadToBlockBoundaryRequest {};
+  struct WriteIndexRequest {};
   struct FlushRequest {
     FlushType flush_type;
     std::promise<bool> done;
   };
   using ChunkWriterRequest =
       absl::variant<DoneRequest, WriteChunkRequest, PadToBlockBoundaryRequest,
-                    FlushRequest>;
+                    WriteIndexRequest, FlushRequest>;
 
   bool HasCapacityForRequest() const;
 
+  // Adjusts `max_requests_` to the ratio of `encode_time_` to `write_time_`,
+  // with `options_.parallelism_ == Options::kAutoParallelism`.
+  void AdjustMaxRequests() ABSL_EXCLUSIVE_LOCKS_REQUIRED(mutex_);
+
+  // The maximum number of chunks encoded concurrently.
+  const size_t max_parallelism_;
+
+  // Enqueues writing a chunk which is already encoded.
+  bool WriteEncodedChunk(Chunk&& chunk);
+
+  // Enqueues writing a chunk to be encoded in background, and returns the
+  // request where the chunk should be stored with `SetChunk()`.
+  //
+  // The returned pointer remains valid until the chunk is written, because
+  // `std::deque::emplace_back()` and `std::deque::pop_front()` do not
+  // invalidate references to other elements.
+  WriteChunkRequest* EnqueueChunk(std::promise<ChunkHeader>* chunk_header,
+                                  uint64_t pending_bytes);
+
+  // Stores the encoded chunk in `*request`, and replaces `pending_bytes`
+  // accounted by `EnqueueChunk()` with the encoded size. `encode_time` is the
+  // time of encoding a records chunk, or `absl::ZeroDuration()` if it should
+  // not be accounted.
+  //
+  // This is the last access to `*this` from the encoding thread.
+  void SetChunk(WriteChunkRequest* request, Chunk&& chunk,
+                uint64_t pending_bytes, absl::Duration encode_time);
+
+  // Body of the thread closing chunks older than `options_.max_chunk_age_`.
+  void CloseChunksInBackground();
+
+  // Whether `CloseChunksInBackground()` should check `chunk_deadline_` again.
+  bool ChunkDeadlineChanged() const;
+
+  // Chunk encoders waiting to be reused after their chunks are encoded, so that
+  // their buffers do not need to be allocated again for each chunk.
+  RecyclingPool<ChunkEncoder> chunk_encoder_pool_;
+  // Puts `chunk_encoder_` back into `chunk_encoder_pool_`.
+  RecyclingPool<ChunkEncoder>::Recycler chunk_encoder_recycler_;
+
   mutable absl::Mutex mutex_;
   std::deque<ChunkWriterRequest> chunk_writer_requests_ ABSL_GUARDED_BY(mutex_);
   // Position before handling `chunk_writer_requests_`.
   Position pos_before_chunks_ ABSL_GUARDED_BY(mutex_);
+  // Sizes of chunks of `chunk_writer_requests_`: uncompressed while being
+  // encoded, compressed afterwards.
+  uint64_t pending_bytes_ ABSL_GUARDED_BY(mutex_) = 0;
+  // The maximum number of `chunk_writer_requests_`. This is constant unless
+  // `options_.parallelism_ == Options::kAutoParallelism`.
+  size_t max_requests_ ABSL_GUARDED_BY(mutex_);
+  // Averages of encoding and writing a records chunk, or
+  // `absl::ZeroDuration()` if not measured yet. Measured only with
+  // `options_.parallelism_ == Options::kAutoParallelism`.
+  absl::Duration encode_time_ ABSL_GUARDED_BY(mutex_);
+  absl::Duration write_time_ ABSL_GUARDED_BY(mutex_);
+
+  // Used if `options_.max_chunk_age_ < absl::InfiniteDuration()`. While the
+  // thread closing chunks in background runs, `chunk_mutex_` guards the open
+  // chunk and the fields below.
+  mutable absl::Mutex chunk_mutex_;
+  // When the open chunk should be closed, or `absl::InfiniteFuture()` if it is
+  // empty.
+  absl::Time chunk_deadline_ = absl::InfiniteFuture();
+  // `chunk_deadline_` seen by `CloseChunksInBackground()`.
+  absl::Time waited_chunk_deadline_ = absl::InfiniteFuture();
+  bool chunk_closed_in_background_ = false;
+  bool stop_closing_chunks_ = false;
+  bool closing_chunks_ = false;
 };
 
 inline RecordWriterBase::ParallelWorker::ParallelWorker(
-    ChunkWriter* chunk_writer, Options&& options)
-    : Worker(chunk_writer, std::move(options)),
-      pos_before_chunks_(chunk_writer_->pos()) {
-  internal::ThreadPool::global().Schedule([this] {
+    ChunkWriter* chunk_writer, Options&& options,
+    internal::RecordStatsCollector* stats_collector)
+    : Worker(chunk_writer, std::move(options), stats_collector),
+      max_parallelism_(options_.parallelism_ == Options::kAutoParallelism
+                           ? AvailableCpus()
+                           : IntCast<size_t>(options_.parallelism_)),
+      // At most `max_parallelism_` chunks are encoded at a time, or one chunk
+      // in the thread closing it.
+      chunk_encoder_pool_(UnsignedMax(max_parallelism_, size_t{1})),
+      pos_before_chunks_(chunk_writer_->pos()),
+      max_requests_(max_parallelism_ > 0 ? max_parallelism_
+                                         : kBackgroundWritingRequests) {
+  OpenChunk();
+  // The chunk writer thread waits for chunks being encoded, so it does not run
+  // in `options_.thread_pool_`, which might not have a free thread for them.
+  ThreadPool::global().Schedule([this] {
     struct Visitor {
       bool operator()(DoneRequest& request) const {
         request.done.set_value();
@@ -439,20 +1794,43 @@ inline RecordWriterBase::ParallelWorker::ParallelWorker(
       }
 
       bool operator()(WriteChunkRequest& request) const {
-        // If `!healthy()`, the chunk must still be waited for, to ensure that
-        // the chunk encoder thread exits before the chunk writer thread
-        // responds to `DoneRequest`.
-        const Chunk chunk = request.chunk.get();
+        // The chunk is ready: the request was taken only after that, so the
+        // chunk encoder thread no longer accesses `*self`, even if the chunk
+        // writer thread later responds to `DoneRequest`.
+        const Chunk& chunk = request.chunk;
+        *written_bytes = chunk.data.size();
         if (ABSL_PREDICT_FALSE(!self->healthy())) return true;
-        if (ABSL_PREDICT_FALSE(!self->chunk_writer_->WriteChunk(chunk))) {
+        const Position chunk_begin = self->chunk_writer_->pos();
+        if (ABSL_PREDICT_FALSE(!self->WriteChunk(chunk))) {
           self->Fail(*self->chunk_writer_);
+          return true;
         }
+        self->ChunkWritten(chunk_begin, chunk.header);
         return true;
       }
 
       bool operator()(PadToBlockBoundaryRequest& request) const {
         if (ABSL_PREDICT_FALSE(!self->healthy())) return true;
-        if (ABSL_PREDICT_FALSE(!self->chunk_writer_->PadToBlockBoundary())) {
+        if (ABSL_PREDICT_FALSE(!self->chunk_writer_->PadToBlockBoundary(
+                self->options_.hash_type_))) {
+          self->Fail(*self->chunk_writer_);
+          return true;
+        }
+        if (self->options_.align_chunk_data_) {
+          if (ABSL_PREDICT_FALSE(!self->chunk_writer_->AlignChunkData(
+                  self->options_.hash_type_))) {
+            self->Fail(*self->chunk_writer_);
+          }
+        }
+        return true;
+      }
+
+      bool operator()(WriteIndexRequest& request) const {
+        if (ABSL_PREDICT_FALSE(!self->healthy())) return true;
+        if (ABSL_PREDICT_FALSE(!self->WriteKeyChunks())) return true;
+        Chunk chunk;
+        self->EncodeIndex(&chunk);
+        if (ABSL_PREDICT_FALSE(!self->WriteChunk(chunk))) {
           self->Fail(*self->chunk_writer_);
         }
         return true;
@@ -463,8 +1841,7 @@ inline RecordWriterBase::ParallelWorker::ParallelWorker(
           request.done.set_value(false);
           return true;
         }
-        if (ABSL_PREDICT_FALSE(
-                !self->chunk_writer_->Flush(request.flush_type))) {
+        if (ABSL_PREDICT_FALSE(!self->FlushChunkWriter(request.flush_type))) {
           self->Fail(*self->chunk_writer_);
           request.done.set_value(false);
           return true;
@@ -474,28 +1851,55 @@ inline RecordWriterBase::ParallelWorker::ParallelWorker(
       }
 
       ParallelWorker* self;
+      // Set to the size of the chunk written, to be subtracted from
+      // `pending_bytes_`.
+      uint64_t* written_bytes;
     };
 
     mutex_.Lock();
     for (;;) {
       mutex_.Await(absl::Condition(
           +[](std::deque<ChunkWriterRequest>* chunk_writer_requests) {
-            return !chunk_writer_requests->empty();
+            if (chunk_writer_requests->empty()) return false;
+            const WriteChunkRequest* const write_chunk_request =
+                absl::get_if<WriteChunkRequest>(
+                    &chunk_writer_requests->front());
+            return write_chunk_request == nullptr ||
+                   write_chunk_request->chunk_ready;
           },
           &chunk_writer_requests_));
       ChunkWriterRequest& request = chunk_writer_requests_.front();
       mutex_.Unlock();
-      if (ABSL_PREDICT_FALSE(!absl::visit(Visitor{this}, request))) return;
+      uint64_t written_bytes = 0;
+      const absl::Time write_start =
+          options_.parallelism_ == Options::kAutoParallelism
+              ? absl::Now()
+              : absl::InfinitePast();
+      if (ABSL_PREDICT_FALSE(
+              !absl::visit(Visitor{this, &written_bytes}, request))) {
+        return;
+      }
       mutex_.Lock();
+      if (options_.parallelism_ == Options::kAutoParallelism &&
+          absl::holds_alternative<WriteChunkRequest>(request)) {
+        write_time_ = UpdateTimeAverage(write_time_, absl::Now() - write_start);
+        AdjustMaxRequests();
+      }
+      pending_bytes_ -= written_bytes;
       chunk_writer_requests_.pop_front();
       pos_before_chunks_ = chunk_writer_->pos();
     }
   });
   Initialize(pos_before_chunks_);
+  if (options_.max_chunk_age_ < absl::InfiniteDuration()) {
+    closing_chunks_ = true;
+    ThreadPool::global().Schedule([this] { CloseChunksInBackground(); });
+  }
 }
 
 RecordWriterBase::ParallelWorker::~ParallelWorker() {
   if (ABSL_PREDICT_FALSE(!closed())) {
+    StopClosingChunksInBackground();
     // Ask the chunk writer thread to stop working and exit.
     Fail(CancelledError());
     Done();
@@ -503,6 +1907,7 @@ RecordWriterBase::ParallelWorker::~ParallelWorker() {
 }
 
 void RecordWriterBase::ParallelWorker::Done() {
+  StopClosingChunksInBackground();
   std::promise<void> done_promise;
   std::future<void> done_future = done_promise.get_future();
   {
@@ -512,69 +1917,162 @@ void RecordWriterBase::ParallelWorker::Done() {
   done_future.get();
 }
 
+void RecordWriterBase::ParallelWorker::OpenChunk() {
+  RecyclingPool<ChunkEncoder>::Handle chunk_encoder = chunk_encoder_pool_.Get(
+      [&] { return MakeChunkEncoder(); },
+      [](ChunkEncoder* chunk_encoder) { chunk_encoder->Clear(); });
+  chunk_encoder_recycler_ = chunk_encoder.get_deleter();
+  chunk_encoder_.reset(chunk_encoder.release());
+}
+
 bool RecordWriterBase::ParallelWorker::HasCapacityForRequest() const
     ABSL_EXCLUSIVE_LOCKS_REQUIRED(mutex_) {
-  return chunk_writer_requests_.size() < IntCast<size_t>(options_.parallelism_);
+  return chunk_writer_requests_.size() < max_requests_ &&
+         (options_.max_pending_bytes_ == 0 ||
+          pending_bytes_ < options_.max_pending_bytes_);
 }
 
-bool RecordWriterBase::ParallelWorker::WriteSignature() {
-  if (ABSL_PREDICT_FALSE(!healthy())) return false;
-  Chunk chunk;
-  EncodeSignature(&chunk);
-  ChunkPromises chunk_promises;
-  chunk_promises.chunk_header.set_value(chunk.header);
-  chunk_promises.chunk.set_value(std::move(chunk));
+void RecordWriterBase::ParallelWorker::AdjustMaxRequests() {
+  if (encode_time_ == absl::ZeroDuration() ||
+      write_time_ == absl::ZeroDuration()) {
+    return;
+  }
+  // While one chunk is written, about `encode_time_ / write_time_` chunks need
+  // to be encoded concurrently to keep the writer busy. One more request lets
+  // the next chunk start encoding before the current one is written.
+  const double chunks_per_write =
+      std::ceil(absl::FDivDuration(encode_time_, write_time_));
+  max_requests_ =
+      chunks_per_write >= static_cast<double>(max_parallelism_)
+          ? max_parallelism_
+          : UnsignedMin(static_cast<size_t>(chunks_per_write) + 1,
+                        max_parallelism_);
+}
+
+inline bool RecordWriterBase::ParallelWorker::WriteEncodedChunk(
+    Chunk&& chunk) {
+  std::promise<ChunkHeader> chunk_header;
+  chunk_header.set_value(chunk.header);
+  const uint64_t chunk_size = chunk.data.size();
   mutex_.LockWhen(
       absl::Condition(this, &ParallelWorker::HasCapacityForRequest));
   chunk_writer_requests_.emplace_back(
-      WriteChunkRequest{chunk_promises.chunk_header.get_future(),
-                        chunk_promises.chunk.get_future()});
+      WriteChunkRequest{chunk_header.get_future(), std::move(chunk), true});
+  pending_bytes_ += chunk_size;
   mutex_.Unlock();
   return true;
 }
 
+inline RecordWriterBase::ParallelWorker::WriteChunkRequest*
+RecordWriterBase::ParallelWorker::EnqueueChunk(
+    std::promise<ChunkHeader>* chunk_header, uint64_t pending_bytes) {
+  mutex_.LockWhen(
+      absl::Condition(this, &ParallelWorker::HasCapacityForRequest));
+  chunk_writer_requests_.emplace_back(
+      WriteChunkRequest{chunk_header->get_future(), Chunk(), false});
+  WriteChunkRequest* const request =
+      &absl::get<WriteChunkRequest>(chunk_writer_requests_.back());
+  pending_bytes_ += pending_bytes;
+  mutex_.Unlock();
+  return request;
+}
+
+inline void RecordWriterBase::ParallelWorker::SetChunk(
+    WriteChunkRequest* request, Chunk&& chunk, uint64_t pending_bytes,
+    absl::Duration encode_time) {
+  absl::MutexLock lock(&mutex_);
+  if (encode_time != absl::ZeroDuration()) {
+    encode_time_ = UpdateTimeAverage(encode_time_, encode_time);
+  }
+  pending_bytes_ = pending_bytes_ - pending_bytes + chunk.data.size();
+  request->chunk = std::move(chunk);
+  request->chunk_ready = true;
+}
+
+bool RecordWriterBase::ParallelWorker::WriteSignature() {
+  if (ABSL_PREDICT_FALSE(!healthy())) return false;
+  Chunk chunk;
+  EncodeSignature(&chunk);
+  return WriteEncodedChunk(std::move(chunk));
+}
+
 bool RecordWriterBase::ParallelWorker::WriteMetadata() {
   if (ABSL_PREDICT_FALSE(!healthy())) return false;
-  if (options_.metadata_.ByteSizeLong() == 0 &&
+  if (options_.metadata().ByteSizeLong() == 0 &&
       options_.serialized_metadata_.empty()) {
     return true;
   }
-  ChunkPromises* const chunk_promises = new ChunkPromises();
-  mutex_.LockWhen(
-      absl::Condition(this, &ParallelWorker::HasCapacityForRequest));
-  chunk_writer_requests_.emplace_back(
-      WriteChunkRequest{chunk_promises->chunk_header.get_future(),
-                        chunk_promises->chunk.get_future()});
-  mutex_.Unlock();
-  internal::ThreadPool::global().Schedule([this, chunk_promises] {
-    Chunk chunk;
-    EncodeMetadata(&chunk);
-    chunk_promises->chunk_header.set_value(chunk.header);
-    chunk_promises->chunk.set_value(std::move(chunk));
-    delete chunk_promises;
-  });
+  std::promise<ChunkHeader>* const chunk_header =
+      new std::promise<ChunkHeader>();
+  WriteChunkRequest* const request = EnqueueChunk(chunk_header, 0);
+  options_.thread_pool_->Schedule(
+      [this, chunk_header, request] {
+        Chunk chunk;
+        EncodeMetadata(&chunk);
+        chunk_header->set_value(chunk.header);
+        delete chunk_header;
+        SetChunk(request, std::move(chunk), 0, absl::ZeroDuration());
+      },
+      options_.task_priority_);
   return true;
 }
 
+bool RecordWriterBase::ParallelWorker::WriteDictionary() {
+  if (ABSL_PREDICT_FALSE(!healthy())) return false;
+  if (!HasDictionary()) return true;
+  Chunk chunk;
+  EncodeDictionary(&chunk);
+  return WriteEncodedChunk(std::move(chunk));
+}
+
+bool RecordWriterBase::ParallelWorker::WriteRecordsChunk(Chunk&& chunk) {
+  if (ABSL_PREDICT_FALSE(!healthy())) return false;
+  // The chunk writer thread adds the chunk to the index.
+  return WriteEncodedChunk(std::move(chunk));
+}
+
 bool RecordWriterBase::ParallelWorker::CloseChunk() {
   if (ABSL_PREDICT_FALSE(!healthy())) return false;
+  if (chunk_encoder_->num_records() > 0) ++chunks_closed_;
+  chunk_deadline_ = absl::InfiniteFuture();
+  if (write_statistics_) {
+    Chunk statistics_chunk;
+    EncodeStatistics(&statistics_chunk);
+    WriteEncodedChunk(std::move(statistics_chunk));
+  }
+  if (write_key_filters_) AddKeyFilter();
+  if (options_.parallelism_ == 0) {
+    Chunk chunk;
+    const bool encoded = EncodeChunk(chunk_encoder_.get(), &chunk);
+    chunk_encoder_recycler_(chunk_encoder_.release());
+    if (ABSL_PREDICT_FALSE(!encoded)) return false;
+    return WriteEncodedChunk(std::move(chunk));
+  }
   ChunkEncoder* const chunk_encoder = chunk_encoder_.release();
-  ChunkPromises* const chunk_promises = new ChunkPromises();
-  mutex_.LockWhen(
-      absl::Condition(this, &ParallelWorker::HasCapacityForRequest));
-  chunk_writer_requests_.emplace_back(
-      WriteChunkRequest{chunk_promises->chunk_header.get_future(),
-                        chunk_promises->chunk.get_future()});
-  mutex_.Unlock();
-  internal::ThreadPool::global().Schedule(
-      [this, chunk_encoder, chunk_promises] {
+  const uint64_t decoded_data_size = chunk_encoder->decoded_data_size();
+  std::promise<ChunkHeader>* const chunk_header =
+      new std::promise<ChunkHeader>();
+  WriteChunkRequest* const request =
+      EnqueueChunk(chunk_header, decoded_data_size);
+  options_.thread_pool_->Schedule(
+      [this, chunk_encoder, recycler = chunk_encoder_recycler_,
+       decoded_data_size, chunk_header, request] {
+        const absl::Time encode_start =
+            options_.parallelism_ == Options::kAutoParallelism
+                ? absl::Now()
+                : absl::InfinitePast();
         Chunk chunk;
         EncodeChunk(chunk_encoder, &chunk);
-        delete chunk_encoder;
-        chunk_promises->chunk_header.set_value(chunk.header);
-        chunk_promises->chunk.set_value(std::move(chunk));
-        delete chunk_promises;
-      });
+        const absl::Duration encode_time =
+            options_.parallelism_ == Options::kAutoParallelism
+                ? absl::Now() - encode_start
+                : absl::ZeroDuration();
+        recycler(chunk_encoder);
+        chunk_header->set_value(chunk.header);
+        delete chunk_header;
+        SetChunk(request, std::move(chunk), decoded_data_size, encode_time);
+      },
+      options_.task_priority_);
   return true;
 }
 
@@ -587,6 +2085,16 @@ bool RecordWriterBase::ParallelWorker::PadToBlockBoundary() {
   return true;
 }
 
+bool RecordWriterBase::ParallelWorker::WriteIndex() {
+  if (ABSL_PREDICT_FALSE(!healthy())) return false;
+  if (!write_index_) return true;
+  mutex_.LockWhen(
+      absl::Condition(this, &ParallelWorker::HasCapacityForRequest));
+  chunk_writer_requests_.emplace_back(WriteIndexRequest());
+  mutex_.Unlock();
+  return true;
+}
+
 bool RecordWriterBase::ParallelWorker::Flush(FlushType flush_type) {
   std::promise<bool> done_promise;
   std::future<bool> done_future = done_promise.get_future();
@@ -603,17 +2111,30 @@ FutureRecordPosition RecordWriterBase::ParallelWorker::Pos() const {
     void operator()(const DoneRequest&) {}
     void operator()(const WriteChunkRequest& request) {
       actions.emplace_back(request.chunk_header);
+      // Matches `Worker::MaybeAlignChunkData()`. Chunks written with
+      // `WriteChunkRequest` are not index chunks.
+      if (align_chunk_data) {
+        actions.emplace_back(FutureRecordPosition::AlignChunkData());
+      }
     }
     void operator()(const PadToBlockBoundaryRequest&) {
       actions.emplace_back(FutureRecordPosition::PadToBlockBoundary());
+      if (align_chunk_data) {
+        actions.emplace_back(FutureRecordPosition::AlignChunkData());
+      }
     }
+    // `WriteIndexRequest` is pending only while `RecordWriter` is being
+    // closed, when `Pos()` is not called.
+    void operator()(const WriteIndexRequest&) {}
     void operator()(const FlushRequest&) {}
 
+    bool align_chunk_data;
     std::vector<FutureRecordPosition::Action> actions;
   };
-  Visitor visitor;
+  Visitor visitor{options_.align_chunk_data_, {}};
   absl::MutexLock lock(&mutex_);
-  visitor.actions.reserve(chunk_writer_requests_.size());
+  visitor.actions.reserve(chunk_writer_requests_.size() *
+                          (options_.align_chunk_data_ ? 2 : 1));
   for (const ChunkWriterRequest& request : chunk_writer_requests_) {
     absl::visit(visitor, request);
   }
@@ -624,6 +2145,92 @@ FutureRecordPosition RecordWriterBase::ParallelWorker::Pos() const {
       chunk_encoder_ == nullptr ? uint64_t{0} : chunk_encoder_->num_records());
 }
 
+uint64_t RecordWriterBase::ParallelWorker::PendingBytes() const {
+  absl::MutexLock lock(&mutex_);
+  return pending_bytes_;
+}
+
+void RecordWriterBase::ParallelWorker::RegisterUnique(
+    MemoryEstimator* memory_estimator) const {
+  memory_estimator->RegisterDynamicMemory(sizeof(*this));
+  {
+    absl::MutexLock lock(&chunk_mutex_);
+    RegisterSubobjects(memory_estimator);
+  }
+  // `index_` is not included because it is updated by the chunk writer thread
+  // without synchronization. It is small compared to chunks anyway.
+  chunk_encoder_pool_.ForEach([&](const ChunkEncoder& chunk_encoder) {
+    chunk_encoder.RegisterUnique(memory_estimator);
+  });
+  absl::MutexLock lock(&mutex_);
+  uint64_t encoded_bytes = 0;
+  for (const ChunkWriterRequest& request : chunk_writer_requests_) {
+    memory_estimator->RegisterDynamicMemory(sizeof(ChunkWriterRequest));
+    const WriteChunkRequest* const write_chunk_request =
+        absl::get_if<WriteChunkRequest>(&request);
+    if (write_chunk_request != nullptr && write_chunk_request->chunk_ready) {
+      write_chunk_request->chunk.data.RegisterSubobjects(memory_estimator);
+      encoded_bytes += write_chunk_request->chunk.data.size();
+    }
+  }
+  // Chunks being encoded are held by their chunk encoders, which are not
+  // accessible here. Their uncompressed size is a good approximation.
+  memory_estimator->RegisterMemory(
+      IntCast<size_t>(SaturatingSub(pending_bytes_, encoded_bytes)));
+}
+
+absl::Mutex* RecordWriterBase::ParallelWorker::chunk_mutex() {
+  return options_.max_chunk_age_ < absl::InfiniteDuration() ? &chunk_mutex_
+                                                            : nullptr;
+}
+
+void RecordWriterBase::ParallelWorker::ChunkStarted() {
+  if (closing_chunks_) chunk_deadline_ = absl::Now() + options_.max_chunk_age_;
+}
+
+bool RecordWriterBase::ParallelWorker::TakeChunkClosedInBackground() {
+  return std::exchange(chunk_closed_in_background_, false);
+}
+
+void RecordWriterBase::ParallelWorker::StopClosingChunksInBackground() {
+  if (options_.max_chunk_age_ == absl::InfiniteDuration()) return;
+  absl::MutexLock lock(&chunk_mutex_);
+  stop_closing_chunks_ = true;
+  chunk_mutex_.Await(absl::Condition(
+      +[](bool* closing_chunks) { return !*closing_chunks; },
+      &closing_chunks_));
+}
+
+inline bool RecordWriterBase::ParallelWorker::ChunkDeadlineChanged() const {
+  return stop_closing_chunks_ || chunk_deadline_ != waited_chunk_deadline_;
+}
+
+void RecordWriterBase::ParallelWorker::CloseChunksInBackground() {
+  absl::MutexLock lock(&chunk_mutex_);
+  while (!stop_closing_chunks_) {
+    waited_chunk_deadline_ = chunk_deadline_;
+    chunk_mutex_.AwaitWithDeadline(
+        absl::Condition(this, &ParallelWorker::ChunkDeadlineChanged),
+        waited_chunk_deadline_);
+    if (stop_closing_chunks_ || absl::Now() < chunk_deadline_) continue;
+    if (ABSL_PREDICT_TRUE(CloseChunk())) {
+      OpenChunk();
+      if (ABSL_PREDICT_TRUE(MaybePadToBlockBoundary())) {
+        // Do not wait for flushing, so that `WriteRecord()` is not blocked on
+        // `chunk_mutex_` for that long.
+        mutex_.LockWhen(
+            absl::Condition(this, &ParallelWorker::HasCapacityForRequest));
+        chunk_writer_requests_.emplace_back(
+            FlushRequest{FlushType::kFromObject, std::promise<bool>()});
+        mutex_.Unlock();
+      }
+    }
+    chunk_deadline_ = absl::InfiniteFuture();
+    chunk_closed_in_background_ = true;
+  }
+  closing_chunks_ = false;
+}
+
 RecordWriterBase::RecordWriterBase(InitiallyClosed) noexcept
     : Object(kInitiallyClosed) {}
 
@@ -634,28 +2241,44 @@ void RecordWriterBase::Reset(InitiallyClosed) {
   Object::Reset(kInitiallyClosed);
   desired_chunk_size_ = 0;
   chunk_size_so_far_ = 0;
+  last_sequence_pos_ = ChunkSequencePosition();
+  record_encoder_.reset();
   worker_.reset();
+  stats_collector_.reset();
+  chunk_mutex_ = nullptr;
 }
 
 void RecordWriterBase::Reset(InitiallyOpen) {
   Object::Reset(kInitiallyOpen);
   desired_chunk_size_ = 0;
   chunk_size_so_far_ = 0;
+  last_sequence_pos_ = ChunkSequencePosition();
+  record_encoder_.reset();
   worker_.reset();
+  stats_collector_.reset();
+  chunk_mutex_ = nullptr;
 }
 
 RecordWriterBase::RecordWriterBase(RecordWriterBase&& that) noexcept
     : Object(std::move(that)),
       desired_chunk_size_(that.desired_chunk_size_),
       chunk_size_so_far_(that.chunk_size_so_far_),
-      worker_(std::move(that.worker_)) {}
+      last_sequence_pos_(that.last_sequence_pos_),
+      stats_collector_(std::move(that.stats_collector_)),
+      worker_(std::move(that.worker_)),
+      record_encoder_(std::move(that.record_encoder_)),
+      chunk_mutex_(std::exchange(that.chunk_mutex_, nullptr)) {}
 
 RecordWriterBase& RecordWriterBase::operator=(
     RecordWriterBase&& that) noexcept {
   Object::operator=(std::move(that));
   desired_chunk_size_ = that.desired_chunk_size_;
   chunk_size_so_far_ = that.chunk_size_so_far_;
+  last_sequence_pos_ = that.last_sequence_pos_;
+  record_encoder_ = std::move(that.record_encoder_);
   worker_ = std::move(that.worker_);
+  stats_collector_ = std::move(that.stats_collector_);
+  chunk_mutex_ = std::exchange(that.chunk_mutex_, nullptr);
   return *this;
 }
 
@@ -668,15 +2291,72 @@ void RecordWriterBase::Initialize(ChunkWriter* dest, Options&& options) {
     Fail(*dest);
     return;
   }
-  // Ensure that `num_records` does not overflow when `WriteRecordImpl()` keeps
-  // `num_records * sizeof(uint64_t)` under `desired_chunk_size_`.
-  desired_chunk_size_ =
-      UnsignedMin(options.chunk_size_, kMaxNumRecords * sizeof(uint64_t));
-  if (options.parallelism_ == 0) {
-    worker_ = std::make_unique<SerialWorker>(dest, std::move(options));
+  if (options.open_existing_ != nullptr) {
+    Chain serialized_metadata = options.serialized_metadata_;
+    if (serialized_metadata.empty()) {
+      const Status status =
+          SerializeToChain(options.metadata(), &serialized_metadata);
+      if (ABSL_PREDICT_FALSE(!status.ok())) {
+        Fail(status);
+        return;
+      }
+    }
+    const Status status = PrepareForAppending(
+        options.open_existing_, options.hash_type_,
+        options.index_ || options.key_extractor_ != nullptr,
+        serialized_metadata, DictionaryData(options.compressor_options_), dest);
+    if (ABSL_PREDICT_FALSE(!status.ok())) {
+      Fail(status);
+      return;
+    }
+  }
+  if (options.collect_stats_) {
+    stats_collector_ = std::make_unique<internal::RecordStatsCollector>();
+  }
+  if (options.shared_transpose_header_) {
+    if (options.transpose_ &&
+        options.compressor_options_.auto_select() == absl::nullopt) {
+      // A shared header is chosen when the chunk is written, which needs the
+      // state machine of the previous chunk, so chunks are encoded serially.
+      options.parallelism_ = 0;
+      options.background_writing_ = false;
+    } else {
+      options.shared_transpose_header_ = false;
+    }
+  }
+  if (options.chunk_prefix_interval_ > 0) {
+    if (options.chunk_prefix_interval_ > 1 && !options.transpose_ &&
+        options.compressor_options_.compression_type() ==
+            CompressionType::kZstd &&
+        options.compressor_options_.auto_select() == absl::nullopt &&
+        options.values_block_size_ == 0 && options.dedup_window_ == 0) {
+      // A chunk prefix is computed from a chunk when it is written, and the
+      // following chunks refer to its position, so chunks are encoded
+      // serially.
+      options.parallelism_ = 0;
+      options.background_writing_ = false;
+    } else {
+      options.chunk_prefix_interval_ = 0;
+    }
+  }
+  if (options.align_chunk_data_ && dest->pos() > 0 &&
+      options.open_existing_ == nullptr && !options.segment_) {
+    // Chunks written by the worker are followed by alignment, and chunks
+    // written by a previous writer might be not.
+    if (ABSL_PREDICT_FALSE(!dest->AlignChunkData(options.hash_type_))) {
+      Fail(*dest);
+      return;
+    }
+  }
+  if (options.parallelism_ == 0 && !options.background_writing_) {
+    worker_ = std::make_unique<SerialWorker>(dest, std::move(options),
+                                             stats_collector_.get());
   } else {
-    worker_ = std::make_unique<ParallelWorker>(dest, std::move(options));
+    worker_ = std::make_unique<ParallelWorker>(dest, std::move(options),
+                                               stats_collector_.get());
   }
+  desired_chunk_size_ = worker_->desired_chunk_size();
+  chunk_mutex_ = worker_->chunk_mutex();
   if (ABSL_PREDICT_FALSE(!worker_->healthy())) Fail(*worker_);
 }
 
@@ -686,16 +2366,37 @@ void RecordWriterBase::Done() {
                                   "null worker_ but RecordWriterBase healthy()";
     return;
   }
+  if (ABSL_PREDICT_FALSE(record_encoder_ != nullptr)) CloseRecord();
+  if (chunk_mutex_ != nullptr) {
+    worker_->StopClosingChunksInBackground();
+    SyncChunkClosedInBackground();
+    chunk_mutex_ = nullptr;
+  }
   if (chunk_size_so_far_ != 0) {
     if (ABSL_PREDICT_FALSE(!worker_->CloseChunk())) Fail(*worker_);
     chunk_size_so_far_ = 0;
   }
+  if (ABSL_PREDICT_FALSE(!worker_->WriteIndex())) Fail(*worker_);
   if (ABSL_PREDICT_FALSE(!worker_->MaybePadToBlockBoundary())) Fail(*worker_);
-  if (ABSL_PREDICT_FALSE(!worker_->Close())) Fail(*worker_);
+  if (ABSL_PREDICT_FALSE(!worker_->Close())) {
+    Fail(*worker_);
+    return;
+  }
+  if (healthy()) {
+    const Status status = worker_->WriteSecondaryIndex();
+    if (ABSL_PREDICT_FALSE(!status.ok())) Fail(status);
+  }
 }
 
 void RecordWriterBase::DoneBackground() { worker_.reset(); }
 
+inline void RecordWriterBase::SyncChunkClosedInBackground() {
+  if (chunk_mutex_ != nullptr && worker_->TakeChunkClosedInBackground()) {
+    chunk_size_so_far_ = 0;
+    desired_chunk_size_ = worker_->desired_chunk_size();
+  }
+}
+
 template <typename Record>
 bool RecordWriterBase::WriteRecordImpl(Record&& record,
                                        FutureRecordPosition* key) {
@@ -703,21 +2404,30 @@ bool RecordWriterBase::WriteRecordImpl(Record&& record,
   // Decoding a chunk writes records to one array, and their positions to
   // another array. We limit the size of both arrays together, to include
   // attempts to accumulate an unbounded number of empty records.
-  const uint64_t added_size = SaturatingAdd(
-      IntCast<uint64_t>(RecordSize(record)), uint64_t{sizeof(uint64_t)});
+  const size_t size = RecordSize(record);
+  const uint64_t added_size =
+      SaturatingAdd(IntCast<uint64_t>(size), uint64_t{sizeof(uint64_t)});
+  absl::MutexLockMaybe lock(chunk_mutex_);
+  SyncChunkClosedInBackground();
   if (ABSL_PREDICT_FALSE(chunk_size_so_far_ > desired_chunk_size_ ||
                          added_size >
-                             desired_chunk_size_ - chunk_size_so_far_) &&
+                             desired_chunk_size_ - chunk_size_so_far_ ||
+                         worker_->ChunkMemoryExceeded()) &&
       chunk_size_so_far_ > 0) {
     if (ABSL_PREDICT_FALSE(!worker_->CloseChunk())) return Fail(*worker_);
     worker_->OpenChunk();
     chunk_size_so_far_ = 0;
+    desired_chunk_size_ = worker_->desired_chunk_size();
   }
+  if (chunk_size_so_far_ == 0) worker_->ChunkStarted();
   chunk_size_so_far_ += added_size;
   if (key != nullptr) *key = worker_->Pos();
-  if (ABSL_PREDICT_FALSE(!worker_->AddRecord(std::forward<Record>(record)))) {
+  const ChunkSequencePosition sequence_pos = worker_->SequencePos();
+  if (ABSL_PREDICT_FALSE(
+          !worker_->AddRecord(std::forward<Record>(record), size))) {
     return Fail(*worker_);
   }
+  last_sequence_pos_ = sequence_pos;
   return true;
 }
 
@@ -732,8 +2442,144 @@ template bool RecordWriterBase::WriteRecordImpl(const Chain& record,
 template bool RecordWriterBase::WriteRecordImpl(Chain&& record,
                                                 FutureRecordPosition* key);
 
+template <typename Record>
+inline bool RecordWriterBase::WriteRecordsImpl(
+    absl::Span<const Record> records, std::vector<FutureRecordPosition>* keys) {
+  if (keys != nullptr) {
+    keys->clear();
+    keys->reserve(records.size());
+  }
+  if (ABSL_PREDICT_FALSE(!healthy())) return false;
+  absl::MutexLockMaybe lock(chunk_mutex_);
+  SyncChunkClosedInBackground();
+  size_t begin = 0;
+  while (begin < records.size()) {
+    // See `WriteRecordImpl()` for how records are measured.
+    uint64_t added_size =
+        SaturatingAdd(IntCast<uint64_t>(RecordSize(records[begin])),
+                      uint64_t{sizeof(uint64_t)});
+    if (ABSL_PREDICT_FALSE(chunk_size_so_far_ > desired_chunk_size_ ||
+                           added_size >
+                               desired_chunk_size_ - chunk_size_so_far_ ||
+                           worker_->ChunkMemoryExceeded()) &&
+        chunk_size_so_far_ > 0) {
+      if (ABSL_PREDICT_FALSE(!worker_->CloseChunk())) return Fail(*worker_);
+      worker_->OpenChunk();
+      chunk_size_so_far_ = 0;
+      desired_chunk_size_ = worker_->desired_chunk_size();
+    }
+    if (chunk_size_so_far_ == 0) worker_->ChunkStarted();
+    // Take all following records which fit in the open chunk. Memory is
+    // known only after records are added, so if it is limited, records are
+    // added one by one.
+    size_t end = begin;
+    do {
+      chunk_size_so_far_ += added_size;
+      if (++end == records.size() || worker_->limits_chunk_memory()) break;
+      added_size = SaturatingAdd(IntCast<uint64_t>(RecordSize(records[end])),
+                                 uint64_t{sizeof(uint64_t)});
+    } while (chunk_size_so_far_ <= desired_chunk_size_ &&
+             added_size <= desired_chunk_size_ - chunk_size_so_far_);
+    if (keys != nullptr) {
+      const FutureRecordPosition first_key = worker_->Pos();
+      for (size_t i = begin; i < end; ++i) {
+        keys->push_back(first_key);
+        keys->back().record_index_ += IntCast<uint64_t>(i - begin);
+      }
+    }
+    const ChunkSequencePosition sequence_pos = worker_->SequencePos();
+    if (ABSL_PREDICT_FALSE(
+            !worker_->AddRecords(records.subspan(begin, end - begin)))) {
+      if (keys != nullptr) keys->resize(begin);
+      return Fail(*worker_);
+    }
+    last_sequence_pos_ = ChunkSequencePosition(
+        sequence_pos.chunk_number(),
+        sequence_pos.record_index() + IntCast<uint64_t>(end - 1 - begin));
+    begin = end;
+  }
+  return true;
+}
+
+bool RecordWriterBase::WriteRecords(
+    absl::Span<const google::protobuf::MessageLite* const> records,
+    std::vector<FutureRecordPosition>* keys) {
+  return WriteRecordsImpl(records, keys);
+}
+
+bool RecordWriterBase::WriteRecords(absl::Span<const absl::string_view> records,
+                                    std::vector<FutureRecordPosition>* keys) {
+  return WriteRecordsImpl(records, keys);
+}
+
+bool RecordWriterBase::WriteRecords(absl::Span<const Chain> records,
+                                    std::vector<FutureRecordPosition>* keys) {
+  return WriteRecordsImpl(records, keys);
+}
+
+Writer* RecordWriterBase::OpenRecord() {
+  RIEGELI_ASSERT(record_encoder_ == nullptr)
+      << "Failed precondition of RecordWriterBase::OpenRecord(): "
+         "record already open";
+  if (ABSL_PREDICT_FALSE(!healthy())) return nullptr;
+  record_encoder_ = worker_->MakeRecordEncoder();
+  if (ABSL_PREDICT_FALSE(record_encoder_ == nullptr)) {
+    Fail(*worker_);
+    return nullptr;
+  }
+  Writer* const record_writer = record_encoder_->OpenRecord();
+  if (ABSL_PREDICT_FALSE(record_writer == nullptr)) {
+    Fail(*record_encoder_);
+    record_encoder_.reset();
+    return nullptr;
+  }
+  return record_writer;
+}
+
+bool RecordWriterBase::CloseRecord(FutureRecordPosition* key) {
+  RIEGELI_ASSERT(record_encoder_ != nullptr)
+      << "Failed precondition of RecordWriterBase::CloseRecord(): "
+         "no record open";
+  const std::unique_ptr<SimpleEncoder> record_encoder =
+      std::move(record_encoder_);
+  if (ABSL_PREDICT_FALSE(!healthy())) return false;
+  if (ABSL_PREDICT_FALSE(!record_encoder->CloseRecord())) {
+    return Fail(*record_encoder);
+  }
+  absl::MutexLockMaybe lock(chunk_mutex_);
+  SyncChunkClosedInBackground();
+  if (chunk_size_so_far_ != 0) {
+    if (ABSL_PREDICT_FALSE(!worker_->CloseChunk())) return Fail(*worker_);
+    worker_->OpenChunk();
+    chunk_size_so_far_ = 0;
+    desired_chunk_size_ = worker_->desired_chunk_size();
+  }
+  if (key != nullptr) *key = worker_->Pos();
+  const ChunkSequencePosition sequence_pos = worker_->SequencePos();
+  if (ABSL_PREDICT_FALSE(!worker_->AddRecordChunk(record_encoder.get()))) {
+    return Fail(*worker_);
+  }
+  last_sequence_pos_ = sequence_pos;
+  return true;
+}
+
+bool RecordWriterBase::CloseChunk() {
+  if (ABSL_PREDICT_FALSE(!healthy())) return false;
+  absl::MutexLockMaybe lock(chunk_mutex_);
+  SyncChunkClosedInBackground();
+  if (chunk_size_so_far_ != 0) {
+    if (ABSL_PREDICT_FALSE(!worker_->CloseChunk())) return Fail(*worker_);
+    worker_->OpenChunk();
+    chunk_size_so_far_ = 0;
+    desired_chunk_size_ = worker_->desired_chunk_size();
+  }
+  return true;
+}
+
 bool RecordWriterBase::Flush(FlushType flush_type) {
   if (ABSL_PREDICT_FALSE(!healthy())) return false;
+  absl::MutexLockMaybe lock(chunk_mutex_);
+  SyncChunkClosedInBackground();
   if (chunk_size_so_far_ != 0) {
     if (ABSL_PREDICT_FALSE(!worker_->CloseChunk())) return Fail(*worker_);
   }
@@ -744,13 +2590,72 @@ bool RecordWriterBase::Flush(FlushType flush_type) {
   if (chunk_size_so_far_ != 0) {
     worker_->OpenChunk();
     chunk_size_so_far_ = 0;
+    desired_chunk_size_ = worker_->desired_chunk_size();
+  }
+  return true;
+}
+
+bool RecordWriterBase::WriteChunk(const Chunk& chunk,
+                                  FutureRecordPosition* key) {
+  if (ABSL_PREDICT_FALSE(!healthy())) return false;
+  switch (chunk.header.chunk_type()) {
+    case ChunkType::kSimple:
+    case ChunkType::kSimpleWithBlocks:
+    case ChunkType::kSimpleWithReferences:
+    case ChunkType::kTransposed:
+    case ChunkType::kTransposedWithBufferEncodings:
+      break;
+    default:
+      return Fail(InvalidArgumentError(absl::StrCat(
+          "RecordWriterBase::WriteChunk() requires a chunk of records "
+          "which does not refer to other chunks, not chunk type ",
+          static_cast<unsigned>(chunk.header.chunk_type()))));
+  }
+  absl::MutexLockMaybe lock(chunk_mutex_);
+  SyncChunkClosedInBackground();
+  if (chunk_size_so_far_ != 0) {
+    if (ABSL_PREDICT_FALSE(!worker_->CloseChunk())) return Fail(*worker_);
+    worker_->OpenChunk();
+    chunk_size_so_far_ = 0;
+    desired_chunk_size_ = worker_->desired_chunk_size();
+  }
+  if (key != nullptr) *key = worker_->Pos();
+  if (ABSL_PREDICT_FALSE(!worker_->AddEncodedChunk(chunk))) {
+    return Fail(*worker_);
   }
   return true;
 }
 
 FutureRecordPosition RecordWriterBase::Pos() const {
   if (ABSL_PREDICT_FALSE(worker_ == nullptr)) return FutureRecordPosition();
+  absl::MutexLockMaybe lock(chunk_mutex_);
   return worker_->Pos();
 }
 
+uint64_t RecordWriterBase::pending_bytes() const {
+  if (ABSL_PREDICT_FALSE(worker_ == nullptr)) return 0;
+  return worker_->PendingBytes();
+}
+
+RecordStats RecordWriterBase::stats() const {
+  if (stats_collector_ == nullptr) return RecordStats();
+  return stats_collector_->Get();
+}
+
+size_t RecordWriterBase::EstimateMemory() const {
+  MemoryEstimator memory_estimator;
+  memory_estimator.RegisterMemory(sizeof(RecordWriterBase));
+  RegisterSubobjects(&memory_estimator);
+  return memory_estimator.TotalMemory();
+}
+
+void RecordWriterBase::RegisterSubobjects(
+    MemoryEstimator* memory_estimator) const {
+  if (stats_collector_ != nullptr) {
+    memory_estimator->RegisterDynamicMemory(
+        sizeof(internal::RecordStatsCollector));
+  }
+  if (worker_ != nullptr) worker_->RegisterUnique(memory_estimator);
+}
+
 }  // namespace riegeli
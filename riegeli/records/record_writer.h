@@ -17,33 +17,53 @@
 
 #include <stdint.h>
 
+#include <functional>
 #include <memory>
 #include <string>
 #include <tuple>
 #include <utility>
+#include <vector>
 
 #include "absl/base/optimization.h"
 #include "absl/strings/string_view.h"
+#include "absl/synchronization/mutex.h"
+#include "absl/time/time.h"
+#include "absl/types/optional.h"
+#include "absl/types/span.h"
 #include "google/protobuf/descriptor.h"
 #include "google/protobuf/message_lite.h"
 #include "riegeli/base/base.h"
 #include "riegeli/base/chain.h"
+#include "riegeli/base/memory_estimator.h"
 #include "riegeli/base/object.h"
+#include "riegeli/base/parallelism.h"
 #include "riegeli/base/resetter.h"
 #include "riegeli/base/stable_dependency.h"
 #include "riegeli/base/status.h"
 #include "riegeli/bytes/writer.h"
+#include "riegeli/bytes/brotli_dictionary.h"
+#include "riegeli/bytes/zstd_dictionary.h"
+#include "riegeli/chunk_encoding/chunk.h"
 #include "riegeli/chunk_encoding/compressor_options.h"
+#include "riegeli/chunk_encoding/constants.h"
+#include "riegeli/chunk_encoding/field_projection.h"
+#include "riegeli/records/chunk_reader.h"
 #include "riegeli/records/chunk_writer.h"
 #include "riegeli/records/chunk_writer_dependency.h"
 #include "riegeli/records/record_position.h"
+#include "riegeli/records/record_stats.h"
 #include "riegeli/records/records_metadata.pb.h"
 
 namespace riegeli {
 
+class SimpleEncoder;
+
 // Sets `record_type_name` and `file_descriptor` in metadata, based on the
 // message descriptor of the type of records.
 //
+// File descriptors of compiled-in types are converted once per program and
+// cached, so that creating many writers with the same record type is cheap.
+//
 // TODO: This currently includes whole file descriptors. It would be
 // better to prune them to keep only what is needed for the message descriptor.
 void SetRecordType(RecordsMetadata* metadata,
@@ -66,22 +86,73 @@ class RecordWriterBase : public Object {
     //     "brotli" (":" brotli_level)? |
     //     "zstd" (":" zstd_level)? |
     //     "snappy" |
+    //     "lz4" (":" lz4_level)? |
+    //     "custom" ":" custom_name |
     //     "window_log" ":" window_log |
+    //     "brotli_workers" ":" brotli_workers |
+    //     "zstd_workers" ":" zstd_workers |
+    //     "zstd_job_size" ":" zstd_job_size |
+    //     "zstd_strategy" ":" zstd_strategy |
+    //     "zstd_long" (":" ("true" | "false"))? |
+    //     "zstd_ldm_hash_log" ":" zstd_ldm_hash_log |
+    //     "zstd_target_block_size" ":" zstd_target_block_size |
+    //     "auto_select" ":" min_gain |
     //     "chunk_size" ":" chunk_size |
+    //     "compressed_chunk_size" ":" chunk_size |
+    //     "max_chunk_memory" ":" max_chunk_memory |
     //     "bucket_fraction" ":" bucket_fraction |
+    //     "bucket_parallelism" ":" parallelism |
+    //     "dedup_window" ":" dedup_window |
+    //     "numeric_encodings" (":" ("true" | "false"))? |
+    //     "string_dictionaries" (":" ("true" | "false"))? |
+    //     "packed_fields" (":" ("true" | "false"))? |
+    //     "schema_guided_transpose" (":" ("true" | "false"))? |
+    //     "shared_transpose_header" (":" ("true" | "false"))? |
+    //     "chunk_prefix_interval" ":" chunk_prefix_interval |
+    //     "hash" ":" ("highwayhash" | "crc32c" | "highwayhash_tree") |
     //     "pad_to_block_boundary" (":" ("true" | "false"))? |
-    //     "parallelism" ":" parallelism
+    //     "align_chunk_data" (":" ("true" | "false"))? |
+    //     "segment" (":" ("true" | "false"))? |
+    //     "index" (":" ("true" | "false"))? |
+    //     "parallelism" ":" ("auto" | parallelism) |
+    //     "background_writing" (":" ("true" | "false"))? |
+    //     "max_pending_bytes" ":" max_pending_bytes
     //   brotli_level ::= integer 0..11 (default 9)
     //   zstd_level ::= integer -131072..22 (default 9)
+    //   lz4_level ::= integer -65536..12 (default 0)
+    //   custom_name ::= name passed to RegisterCustomCompression()
     //   window_log ::= "auto" or integer 10..31
+    //   brotli_workers ::= integer 0..200
+    //   zstd_workers ::= integer 0..200
+    //   zstd_job_size ::=
+    //     integer expressed as real with optional suffix [BkKMGTPE], 0..1G
+    //   zstd_strategy ::= "auto" | "fast" | "dfast" | "greedy" | "lazy" |
+    //     "lazy2" | "btlazy2" | "btopt" | "btultra" | "btultra2"
+    //   zstd_ldm_hash_log ::= "auto" or integer 6..30
+    //   zstd_target_block_size ::=
+    //     integer expressed as real with optional suffix [BkKMGTPE], 0..128K
+    //   min_gain ::= real 0..1
     //   chunk_size ::=
     //     integer expressed as real with optional suffix [BkKMGTPE], 1..
+    //   max_chunk_memory ::=
+    //     integer expressed as real with optional suffix [BkKMGTPE], 0..
     //   bucket_fraction ::= real 0..1
+    //   dedup_window ::=
+    //     integer expressed as real with optional suffix [BkKMGTPE], 0..
+    //   chunk_prefix_interval ::=
+    //     integer expressed as real with optional suffix [BkKMGTPE], 0..
     //   parallelism ::= integer 0..
+    //   max_pending_bytes ::=
+    //     integer expressed as real with optional suffix [BkKMGTPE], 0..
     // ```
     //
     // An empty string is the same as "default".
     //
+    // Parsing builds an `OptionsParser` and is much more expensive than copying
+    // `Options`, which shares metadata between copies. If writers are created
+    // repeatedly with the same text, parse it once, e.g. at startup, which also
+    // validates it, and copy the resulting `Options` for each writer.
+    //
     // Options are documented below, and also at
     // https://github.com/google/riegeli/blob/master/doc/record_writer_options.md
     //
@@ -150,6 +221,172 @@ class RecordWriterBase : public Object {
       return std::move(set_zstd(compression_level));
     }
 
+    // Brotli dictionary used if compression algorithm is Brotli. This improves
+    // compression density of small records, which otherwise compress poorly
+    // because each chunk is compressed independently.
+    //
+    // The dictionary is stored in a dictionary chunk at the beginning of the
+    // file, and `RecordReader` uses it automatically. When appending to an
+    // existing file, the same dictionary must be used. A file can have either
+    // a Brotli dictionary or a Zstd dictionary, according to its compression
+    // algorithm.
+    //
+    // Default: `BrotliDictionary()` (no dictionary)
+    Options& set_brotli_dictionary(BrotliDictionary brotli_dictionary) & {
+      compressor_options_.set_brotli_dictionary(std::move(brotli_dictionary));
+      return *this;
+    }
+    Options&& set_brotli_dictionary(BrotliDictionary brotli_dictionary) && {
+      return std::move(set_brotli_dictionary(std::move(brotli_dictionary)));
+    }
+
+    // Zstd dictionary used if compression algorithm is Zstd. This improves
+    // compression density of small records, which otherwise compress poorly
+    // because each chunk is compressed independently.
+    //
+    // The dictionary is stored in a dictionary chunk at the beginning of the
+    // file, and `RecordReader` uses it automatically. When appending to an
+    // existing file, the same dictionary must be used.
+    //
+    // A dictionary can be trained on sample records with
+    // `TrainZstdDictionary()`.
+    //
+    // Default: `ZstdDictionary()` (no dictionary)
+    Options& set_zstd_dictionary(ZstdDictionary zstd_dictionary) & {
+      compressor_options_.set_zstd_dictionary(std::move(zstd_dictionary));
+      return *this;
+    }
+    Options&& set_zstd_dictionary(ZstdDictionary zstd_dictionary) && {
+      return std::move(set_zstd_dictionary(std::move(zstd_dictionary)));
+    }
+
+    // Number of background threads compressing a chunk in parallel if
+    // compression algorithm is Brotli. If 0, a chunk is compressed in the
+    // thread encoding it.
+    //
+    // Jobs of the window size (but at least 1M) are compressed independently,
+    // which loses some compression density. This pays off for chunks at least
+    // several times larger than the window size, especially when `parallelism`
+    // is 0.
+    //
+    // Files written with `brotli_workers` positive cannot be read by versions
+    // of Riegeli which do not support this option.
+    //
+    // `brotli_workers` must be between 0 and `kMaxBrotliWorkers` (200).
+    // Default: 0.
+    static constexpr int kMaxBrotliWorkers =
+        CompressorOptions::kMaxBrotliWorkers;
+    Options& set_brotli_workers(int brotli_workers) & {
+      compressor_options_.set_brotli_workers(brotli_workers);
+      return *this;
+    }
+    Options&& set_brotli_workers(int brotli_workers) && {
+      return std::move(set_brotli_workers(brotli_workers));
+    }
+
+    // Number of background threads compressing a chunk in parallel if
+    // compression algorithm is Zstd. If 0, a chunk is compressed in the thread
+    // encoding it.
+    //
+    // This pays off for chunks at least several times larger than the job
+    // size, especially when `parallelism` is 0. Chunks can also be encoded in
+    // parallel with `set_parallelism()`, which is usually more effective for
+    // smaller chunks.
+    //
+    // `zstd_workers` must be between 0 and `kMaxZstdWorkers` (64 in 32-bit
+    // build, 200 in 64-bit build). Default: 0.
+    static constexpr int kMaxZstdWorkers = CompressorOptions::kMaxZstdWorkers;
+    Options& set_zstd_workers(int zstd_workers) & {
+      compressor_options_.set_zstd_workers(zstd_workers);
+      return *this;
+    }
+    Options&& set_zstd_workers(int zstd_workers) && {
+      return std::move(set_zstd_workers(zstd_workers));
+    }
+
+    // Uncompressed size of a job compressed by one Zstd worker, if
+    // `zstd_workers` is positive. 0 means to derive it from compression
+    // parameters. Smaller sizes are increased to 1M.
+    //
+    // `zstd_job_size` must be between 0 and `kMaxZstdJobSize` (512M in 32-bit
+    // build, 1G in 64-bit build). Default: 0.
+    static constexpr uint64_t kMaxZstdJobSize =
+        CompressorOptions::kMaxZstdJobSize;
+    Options& set_zstd_job_size(uint64_t zstd_job_size) & {
+      compressor_options_.set_zstd_job_size(zstd_job_size);
+      return *this;
+    }
+    Options&& set_zstd_job_size(uint64_t zstd_job_size) && {
+      return std::move(set_zstd_job_size(zstd_job_size));
+    }
+
+    // Match finding strategy if compression algorithm is Zstd, between
+    // `kMinZstdStrategy` (1, `ZSTD_fast`) and `kMaxZstdStrategy` (9,
+    // `ZSTD_btultra2`), or `kDefaultZstdStrategy` (0) to derive it from
+    // compression level. Default: `kDefaultZstdStrategy` (0).
+    static constexpr int kDefaultZstdStrategy =
+        CompressorOptions::kDefaultZstdStrategy;
+    static constexpr int kMinZstdStrategy = CompressorOptions::kMinZstdStrategy;
+    static constexpr int kMaxZstdStrategy = CompressorOptions::kMaxZstdStrategy;
+    Options& set_zstd_strategy(int zstd_strategy) & {
+      compressor_options_.set_zstd_strategy(zstd_strategy);
+      return *this;
+    }
+    Options&& set_zstd_strategy(int zstd_strategy) && {
+      return std::move(set_zstd_strategy(zstd_strategy));
+    }
+
+    // If `true` and compression algorithm is Zstd, enables long distance
+    // matching, which finds matches also far in the past. This helps chunks
+    // with long repetitions, especially together with a large `window_log`.
+    //
+    // Default: `false`.
+    Options& set_zstd_long_distance_matching(
+        bool zstd_long_distance_matching) & {
+      compressor_options_.set_zstd_long_distance_matching(
+          zstd_long_distance_matching);
+      return *this;
+    }
+    Options&& set_zstd_long_distance_matching(
+        bool zstd_long_distance_matching) && {
+      return std::move(
+          set_zstd_long_distance_matching(zstd_long_distance_matching));
+    }
+
+    // Logarithm of the size of the hash table used for Zstd long distance
+    // matching, between `kMinZstdLdmHashLog` (6) and `kMaxZstdLdmHashLog`
+    // (30), or `kDefaultZstdLdmHashLog` (0) to derive it from `window_log`.
+    // Default: `kDefaultZstdLdmHashLog` (0).
+    static constexpr int kMinZstdLdmHashLog =
+        CompressorOptions::kMinZstdLdmHashLog;
+    static constexpr int kMaxZstdLdmHashLog =
+        CompressorOptions::kMaxZstdLdmHashLog;
+    static constexpr int kDefaultZstdLdmHashLog =
+        CompressorOptions::kDefaultZstdLdmHashLog;
+    Options& set_zstd_ldm_hash_log(int zstd_ldm_hash_log) & {
+      compressor_options_.set_zstd_ldm_hash_log(zstd_ldm_hash_log);
+      return *this;
+    }
+    Options&& set_zstd_ldm_hash_log(int zstd_ldm_hash_log) && {
+      return std::move(set_zstd_ldm_hash_log(zstd_ldm_hash_log));
+    }
+
+    // Desired size of compressed Zstd blocks, or 0 to let blocks be as large
+    // as possible. Smaller blocks let a streaming reader start decompressing
+    // sooner, at some cost in compression density.
+    //
+    // `zstd_target_block_size` must be between 0 and
+    // `kMaxZstdTargetBlockSize` (128K). Default: 0.
+    static constexpr uint64_t kMaxZstdTargetBlockSize =
+        CompressorOptions::kMaxZstdTargetBlockSize;
+    Options& set_zstd_target_block_size(uint64_t zstd_target_block_size) & {
+      compressor_options_.set_zstd_target_block_size(zstd_target_block_size);
+      return *this;
+    }
+    Options&& set_zstd_target_block_size(uint64_t zstd_target_block_size) && {
+      return std::move(set_zstd_target_block_size(zstd_target_block_size));
+    }
+
     // Changes compression algorithm to Snappy.
     //
     // There are no Snappy compression levels to tune.
@@ -159,6 +396,44 @@ class RecordWriterBase : public Object {
     }
     Options&& set_snappy() && { return std::move(set_snappy()); }
 
+    // Changes compression algorithm to LZ4. Sets compression level which tunes
+    // the tradeoff between compression density and compression speed (higher
+    // = better density but slower). Levels from `kMinLz4Hc` (3) select LZ4-HC,
+    // which compresses much slower but decompresses as fast as LZ4.
+    //
+    // `compression_level` must be between `kMinLz4` (-65536) and `kMaxLz4`
+    // (12). Default: `kDefaultLz4` (0).
+    static constexpr int kMinLz4 = CompressorOptions::kMinLz4;
+    static constexpr int kMaxLz4 = CompressorOptions::kMaxLz4;
+    static constexpr int kMinLz4Hc = CompressorOptions::kMinLz4Hc;
+    static constexpr int kDefaultLz4 = CompressorOptions::kDefaultLz4;
+    Options& set_lz4(int compression_level = kDefaultLz4) & {
+      compressor_options_.set_lz4(compression_level);
+      return *this;
+    }
+    Options&& set_lz4(int compression_level = kDefaultLz4) && {
+      return std::move(set_lz4(compression_level));
+    }
+
+    // Changes compression algorithm to a custom codec registered with
+    // `RegisterCustomCompression()`. Sets compression level which is passed to
+    // the codec.
+    //
+    // `compression_type` must be between `kMinCustomCompressionType` and
+    // `kMaxCustomCompressionType`. Reading the file requires registering the
+    // same codec.
+    Options& set_custom_compression(CompressionType compression_type,
+                                    int compression_level = 0) & {
+      compressor_options_.set_custom_compression(compression_type,
+                                                 compression_level);
+      return *this;
+    }
+    Options&& set_custom_compression(CompressionType compression_type,
+                                     int compression_level = 0) && {
+      return std::move(
+          set_custom_compression(compression_type, compression_level));
+    }
+
     // Logarithm of the LZ77 sliding window size. This tunes the tradeoff
     // between compression density and memory usage (higher = better density but
     // more memory).
@@ -166,8 +441,8 @@ class RecordWriterBase : public Object {
     // Special value `kDefaultWindowLog` (-1) means to keep the default
     // (brotli: 22, zstd: derived from compression level and chunk size).
     //
-    // For `uncompressed` and `snappy`, `window_log` must be
-    // `kDefaultWindowLog` (-1).
+    // For `uncompressed`, `snappy`, `lz4`, and custom codecs, `window_log`
+    // must be `kDefaultWindowLog` (-1).
     //
     // For `brotli`, `window_log` must be `kDefaultWindowLog` (-1) or between
     // `BrotliWriterBase::Options::kMinWindowLog` (10) and
@@ -191,6 +466,29 @@ class RecordWriterBase : public Object {
       return std::move(set_window_log(window_log));
     }
 
+    // If not `absl::nullopt`, each chunk is compressed either with the
+    // compression algorithm set above, or with a faster alternative: Snappy or
+    // none, depending on a sample of its records. A slower algorithm is chosen
+    // only if it makes the sample smaller than the next faster one by at least
+    // `min_gain` times the uncompressed size.
+    //
+    // This avoids paying for strong compression of incompressible data in
+    // files with mixed contents. The chosen algorithm is recorded in each
+    // chunk, so reading needs no configuration.
+    //
+    // Encoding of each chunk is deferred to when the chunk is complete, as with
+    // `set_parallelism()`, which costs some memory copying.
+    //
+    // `min_gain` must be between 0.0 and 1.0.
+    // Default: `absl::nullopt` (always use the algorithm set above).
+    Options& set_auto_select(absl::optional<double> min_gain) & {
+      compressor_options_.set_auto_select(min_gain);
+      return *this;
+    }
+    Options&& set_auto_select(absl::optional<double> min_gain) && {
+      return std::move(set_auto_select(min_gain));
+    }
+
     // Sets the desired uncompressed size of a chunk which groups messages to be
     // transposed, compressed, and written together.
     //
@@ -212,6 +510,44 @@ class RecordWriterBase : public Object {
       return std::move(set_chunk_size(size));
     }
 
+    // If not 0, sets the desired compressed size of a chunk instead of the
+    // uncompressed size. The uncompressed size of the next chunk is adjusted
+    // from the compression ratio observed on the previous chunk, starting from
+    // `set_chunk_size()` for the first chunk.
+    //
+    // This makes compressed chunk sizes more predictable when the compression
+    // ratio varies, e.g. to align chunks with the read granularity of the
+    // storage. With `set_parallelism()` the ratio is observed after a delay.
+    //
+    // Default: 0
+    Options& set_compressed_chunk_size(uint64_t size) & {
+      compressed_chunk_size_ = size;
+      return *this;
+    }
+    Options&& set_compressed_chunk_size(uint64_t size) && {
+      return std::move(set_compressed_chunk_size(size));
+    }
+
+    // If not 0, a chunk is also closed when the approximate memory used by
+    // encoding it (see `ChunkEncoder::ApproximateMemory()`) exceeds this.
+    //
+    // With `transpose(true)` this bounds memory of records with many distinct
+    // fields, whose per-field structures can take much more memory than their
+    // values. With `set_parallelism()` records are encoded later, so only
+    // memory of records buffered before encoding is bounded.
+    //
+    // While this is used, `WriteRecords()` accounts for memory after each
+    // record, which makes it slower.
+    //
+    // Default: 0
+    Options& set_max_chunk_memory(uint64_t max_chunk_memory) & {
+      max_chunk_memory_ = max_chunk_memory;
+      return *this;
+    }
+    Options&& set_max_chunk_memory(uint64_t max_chunk_memory) && {
+      return std::move(set_max_chunk_memory(max_chunk_memory));
+    }
+
     // Sets the desired uncompressed size of a bucket which groups values of
     // several fields of the given wire type to be compressed together,
     // relative to the desired chunk size, on the scale between 0.0 (compress
@@ -240,17 +576,226 @@ class RecordWriterBase : public Object {
       return std::move(set_bucket_fraction(fraction));
     }
 
+    // Sets groups of fields projected together, usually the field projections
+    // most often used for reading. Buffers of fields of different groups, and
+    // of fields in no group, are never compressed in the same bucket, so that
+    // reading with a field projection covering one group decompresses only
+    // buckets of that group. Within a group, buckets are formed according to
+    // `set_bucket_fraction()`. A field included in several groups belongs to
+    // the first one.
+    //
+    // This is meaningful if transpose and compression are enabled. This does
+    // not change the file format.
+    //
+    // Default: no groups
+    Options& set_field_groups(std::vector<FieldProjection> field_groups) & {
+      field_groups_ = std::move(field_groups);
+      return *this;
+    }
+    Options&& set_field_groups(std::vector<FieldProjection> field_groups) && {
+      return std::move(set_field_groups(std::move(field_groups)));
+    }
+
+    // Sets the maximum number of buckets of a single chunk compressed in
+    // parallel in background. This reduces the latency of encoding a large
+    // chunk, e.g. in `Flush()` and `Close()`, independently of
+    // `set_parallelism()` which encodes several chunks in parallel.
+    //
+    // This is meaningful if transpose and compression are enabled, and the
+    // bucket fraction splits a chunk into several buckets. Buckets are
+    // compressed in `ThreadPool::global()`.
+    //
+    // Default: 0
+    Options& set_bucket_parallelism(int bucket_parallelism) & {
+      RIEGELI_ASSERT_GE(bucket_parallelism, 0)
+          << "Failed precondition of "
+             "RecordWriterBase::Options::set_bucket_parallelism(): "
+             "negative bucket parallelism";
+      bucket_parallelism_ = bucket_parallelism;
+      return *this;
+    }
+    Options&& set_bucket_parallelism(int bucket_parallelism) && {
+      return std::move(set_bucket_parallelism(bucket_parallelism));
+    }
+
+    // If not 0, record values of a chunk which is not transposed are
+    // compressed in independent blocks of this uncompressed size, instead of
+    // as a single compressed stream. Reading a record then decompresses only
+    // the block containing it, which makes random access within a large chunk
+    // fast, at the cost of compression density. Files are not readable by
+    // versions of Riegeli which do not support such chunks.
+    //
+    // This is meaningful if transpose is disabled and compression is enabled.
+    //
+    // Default: 0
+    Options& set_values_block_size(uint64_t values_block_size) & {
+      values_block_size_ = values_block_size;
+      return *this;
+    }
+    Options&& set_values_block_size(uint64_t values_block_size) && {
+      return std::move(set_values_block_size(values_block_size));
+    }
+
+    // If not 0, a record of a chunk which is not transposed which is equal to
+    // one of this many preceding records of the chunk is stored as a reference
+    // to it, instead of storing its value again. Duplicates are found by
+    // hashing records. Readers expand references, so this is transparent to
+    // them, and decoding a duplicate does not decompress its value again.
+    // Files are not readable by versions of Riegeli which do not support such
+    // chunks.
+    //
+    // This is meaningful if transpose is disabled and
+    // `set_values_block_size()` is 0.
+    //
+    // Default: 0
+    Options& set_dedup_window(uint64_t dedup_window) & {
+      dedup_window_ = dedup_window;
+      return *this;
+    }
+    Options&& set_dedup_window(uint64_t dedup_window) && {
+      return std::move(set_dedup_window(dedup_window));
+    }
+
+    // If `true`, a varint field of transposed chunks is stored as differences
+    // between consecutive values, as ZigZag encoded differences, or as offsets
+    // from the minimum value, whichever is the shortest, if any is shorter
+    // than the values themselves. This improves compression density of e.g.
+    // timestamps and identifiers which change by small amounts between
+    // records. Files are not readable by versions of Riegeli which do not
+    // support such chunks.
+    //
+    // This is meaningful if transpose is enabled and
+    // `set_shared_transpose_header()` is `false`.
+    //
+    // Default: `false`
+    Options& set_numeric_encodings(bool numeric_encodings) & {
+      numeric_encodings_ = numeric_encodings;
+      return *this;
+    }
+    Options&& set_numeric_encodings(bool numeric_encodings) && {
+      return std::move(set_numeric_encodings(numeric_encodings));
+    }
+
+    // If `true`, a string or bytes field of transposed chunks whose values
+    // repeat is stored as a dictionary of its distinct values and an index
+    // into the dictionary for each value, if this is shorter. This improves
+    // compression density of low-cardinality fields, e.g. enumerations stored
+    // as strings, especially when compression is disabled or its window is
+    // small. Files are not readable by versions of Riegeli which do not
+    // support such chunks.
+    //
+    // This is meaningful if transpose is enabled and
+    // `set_shared_transpose_header()` is `false`.
+    //
+    // Default: `false`
+    Options& set_string_dictionaries(bool string_dictionaries) & {
+      string_dictionaries_ = string_dictionaries;
+      return *this;
+    }
+    Options&& set_string_dictionaries(bool string_dictionaries) && {
+      return std::move(set_string_dictionaries(string_dictionaries));
+    }
+
+    // If `true`, a packed repeated integer field of transposed chunks is split
+    // into the numbers of elements of each value and a sequence of all
+    // elements, which is stored as differences between consecutive elements,
+    // as ZigZag encoded differences, or as offsets from the minimum element,
+    // whichever is the shortest, if this is shorter. Elements of a field are
+    // then adjacent regardless of records they come from. Files are not
+    // readable by versions of Riegeli which do not support such chunks.
+    //
+    // This is meaningful if transpose is enabled and
+    // `set_shared_transpose_header()` is `false`.
+    //
+    // Default: `false`
+    Options& set_packed_fields(bool packed_fields) & {
+      packed_fields_ = packed_fields;
+      return *this;
+    }
+    Options&& set_packed_fields(bool packed_fields) && {
+      return std::move(set_packed_fields(packed_fields));
+    }
+
+    // If `true`, transposed chunks are encoded using the record type stored in
+    // metadata (see `set_metadata()` and `SetRecordType()`): a string, bytes,
+    // or packed repeated field is stored as a string without checking whether
+    // it parses as a submessage. This makes encoding faster, especially for
+    // large binary values, and keeps binary values which happen to parse as
+    // messages from being split into columns. If metadata do not specify the
+    // record type, this has no effect.
+    //
+    // This does not change the file format, and reading does not depend on
+    // the record type.
+    //
+    // This is meaningful if transpose is enabled.
+    //
+    // Default: `false`
+    Options& set_schema_guided_transpose(bool schema_guided_transpose) & {
+      schema_guided_transpose_ = schema_guided_transpose;
+      return *this;
+    }
+    Options&& set_schema_guided_transpose(bool schema_guided_transpose) && {
+      return std::move(set_schema_guided_transpose(schema_guided_transpose));
+    }
+
+    // If `true`, transposed chunks store their state machine in a separate
+    // shared header chunk, which is written only when the state machine
+    // changes, and which following chunks with the same state machine refer
+    // to. This improves compression density and reading speed of small chunks
+    // of records with a similar structure, e.g. written with frequent
+    // `Flush()` calls. Files are not readable by versions of Riegeli which do
+    // not support shared headers.
+    //
+    // This is meaningful if transpose is enabled and the compression algorithm
+    // is not chosen by `set_auto_select()`. Chunks are then encoded serially,
+    // as if `set_parallelism(0)` was used.
+    //
+    // Default: `false`
+    Options& set_shared_transpose_header(bool shared_transpose_header) & {
+      shared_transpose_header_ = shared_transpose_header;
+      return *this;
+    }
+    Options&& set_shared_transpose_header(bool shared_transpose_header) && {
+      return std::move(set_shared_transpose_header(shared_transpose_header));
+    }
+
+    // If positive, chunks are grouped in runs of `chunk_prefix_interval`
+    // chunks, and each chunk of a run except the first is compressed using
+    // records of the first chunk as a Zstd prefix. This improves compression
+    // density of small chunks of similar records, e.g. written with frequent
+    // `Flush()` calls, while reading a chunk needs decoding at most one other
+    // chunk. Files are not readable by versions of Riegeli which do not support
+    // chunk prefixes.
+    //
+    // The first chunk of a run is compressed with the dictionary set by
+    // `set_zstd_dictionary()`, if any, and the remaining chunks only with the
+    // prefix, because Zstd does not use both at once.
+    //
+    // This is meaningful if transpose is disabled, Zstd compression is used
+    // and not chosen by `set_auto_select()`, and `set_values_block_size()` and
+    // `set_dedup_window()` are not used. Chunks are then encoded serially, as
+    // if `set_parallelism(0)` was used.
+    //
+    // Default: 0 (no prefixes)
+    Options& set_chunk_prefix_interval(uint64_t chunk_prefix_interval) & {
+      chunk_prefix_interval_ = chunk_prefix_interval;
+      return *this;
+    }
+    Options&& set_chunk_prefix_interval(uint64_t chunk_prefix_interval) && {
+      return std::move(set_chunk_prefix_interval(chunk_prefix_interval));
+    }
+
     // Sets file metadata to be written at the beginning (if metadata has any
     // fields set).
     //
-    // Metadata are written only when the file is written from the beginning,
-    // not when it is appended to.
+    // Metadata are written only when the file is written from the beginning.
+    // When appending to an existing file, they must match its metadata.
     //
     // Record type in metadata can be conveniently set by `SetRecordType()`.
     //
     // Default: no fields set
     Options& set_metadata(RecordsMetadata metadata) & {
-      metadata_ = std::move(metadata);
+      metadata_ = std::make_shared<const RecordsMetadata>(std::move(metadata));
       serialized_metadata_.Clear();
       return *this;
     }
@@ -262,7 +807,7 @@ class RecordWriterBase : public Object {
     //
     // This is faster if the caller has metadata already serialized.
     Options& set_serialized_metadata(Chain metadata) & {
-      metadata_.Clear();
+      metadata_.reset();
       serialized_metadata_ = std::move(metadata);
       return *this;
     }
@@ -270,6 +815,39 @@ class RecordWriterBase : public Object {
       return std::move(set_serialized_metadata(std::move(metadata)));
     }
 
+    // Sets the algorithm of hashes of chunk data, recorded in the file
+    // signature:
+    //
+    //  * `HashType::kHighwayHash` - 64-bit HighwayHash, readable by all
+    //                               versions of Riegeli
+    //  * `HashType::kCrc32c`      - 32-bit CRC32C, computed with SSE4.2 or
+    //                               ARMv8 CRC instructions if available; files
+    //                               are not readable by versions of Riegeli
+    //                               which do not support it
+    //  * `HashType::kHighwayHashTree` - 64-bit HighwayHash of 1MB segments
+    //                                   combined with HighwayHash; segments
+    //                                   of a large chunk are hashed in
+    //                                   parallel; files are not readable by
+    //                                   versions of Riegeli which do not
+    //                                   support it
+    //
+    // `HashType::kCrc32c` makes writing and reading faster when chunk data are
+    // compressed with a fast algorithm or not compressed, at the cost of a
+    // weaker detection of corruption. `HashType::kHighwayHashTree` reduces the
+    // latency of hashing large chunks.
+    //
+    // When appending to an existing file, or concatenating files, this must
+    // match the file being appended to.
+    //
+    // Default: `HashType::kHighwayHash`
+    Options& set_hash_type(HashType hash_type) & {
+      hash_type_ = hash_type;
+      return *this;
+    }
+    Options&& set_hash_type(HashType hash_type) && {
+      return std::move(set_hash_type(hash_type));
+    }
+
     // If `true`, padding is written to reach a 64KB block boundary when the
     // `RecordWriter` is created, before `Close()`, and before `Flush()`.
     //
@@ -292,16 +870,260 @@ class RecordWriterBase : public Object {
       return std::move(set_pad_to_block_boundary(pad_to_block_boundary));
     }
 
+    // If `true`, padding is written after each chunk so that data of the next
+    // chunk begin at a multiple of 4KB in the file. The data of a chunk which
+    // fits in the rest of its 64KB block are then a contiguous aligned range,
+    // which can be read directly into its final buffer, e.g. with `O_DIRECT`.
+    //
+    // This wastes up to 4KB per chunk, which is worth it for large chunks.
+    //
+    // Default: `false`
+    Options& set_align_chunk_data(bool align_chunk_data) & {
+      align_chunk_data_ = align_chunk_data;
+      return *this;
+    }
+    Options&& set_align_chunk_data(bool align_chunk_data) && {
+      return std::move(set_align_chunk_data(align_chunk_data));
+    }
+
+    // If `true`, a segment of a file is written instead of a whole file, so
+    // that many writers, e.g. on different machines, can write parts of one
+    // file concurrently, to be joined by physical concatenation (or by a
+    // filesystem operation which concatenates files without copying data).
+    //
+    // A segment does not begin with a file signature and file metadata, and
+    // padding is written to reach a 64KB block boundary before `Close()` and
+    // before `Flush()`. Since block headers refer to chunk boundaries by
+    // distances, a segment remains valid at any position which is a multiple
+    // of 64KB. The first part of the file is written with `segment == false`,
+    // `set_pad_to_block_boundary(true)`, and without `set_index()`, then
+    // segments follow in any number. A segment alone is not a valid file.
+    //
+    // `set_index()` and `set_key_extractor()` are ignored for a segment,
+    // because positions in the joined file are not known while the segment is
+    // written. A Brotli or Zstd dictionary is written at the beginning of each
+    // segment.
+    //
+    // Default: `false`
+    Options& set_segment(bool segment) & {
+      segment_ = segment;
+      return *this;
+    }
+    Options&& set_segment(bool segment) && {
+      return std::move(set_segment(segment));
+    }
+
+    // If not `nullptr`, the destination is an existing file being appended to.
+    // `open_existing` is called once when the `RecordWriter` is created, and
+    // returns a `ChunkReader` reading the same file, or `nullptr` on failure.
+    //
+    // Instead of writing the file signature and metadata, the `RecordWriter`
+    // verifies that the file signature is valid and matches `set_hash_type()`,
+    // and that metadata and the dictionary match `set_metadata()` and the
+    // dictionary of the compression algorithm, failing with
+    // `FailedPreconditionError()` otherwise. `set_index()` and
+    // `set_key_extractor()` cannot be used then, because the index and key
+    // filters would cover only the appended chunks.
+    // If the file ends with a torn tail, e.g. because a previous writer
+    // crashed, the end of the last complete chunk is found with
+    // `FindRecordsEnd()` without reading the whole file, and the destination is
+    // truncated there, which requires `ChunkWriter::SupportsTruncate()`.
+    // Appended records then begin at a block boundary, as with
+    // `set_pad_to_block_boundary()`, preceded by a copy of the dictionary chunk
+    // if any.
+    //
+    // The destination must be positioned at the end of the file, e.g. opened
+    // for appending. If the file has no complete chunk, it is written from the
+    // beginning as usual.
+    //
+    // Default: `nullptr` (the file is written from the current destination
+    // position without verifying what precedes it)
+    Options& set_append(
+        std::function<std::unique_ptr<ChunkReader>()> open_existing) & {
+      open_existing_ = std::move(open_existing);
+      return *this;
+    }
+    Options&& set_append(
+        std::function<std::unique_ptr<ChunkReader>()> open_existing) && {
+      return std::move(set_append(std::move(open_existing)));
+    }
+
+    // If `true`, an index chunk is written at the end of the file by `Close()`.
+    // It lists chunks containing records together with their numbers of
+    // records, which lets `RecordReader::SeekToRecordNumber()` and
+    // `RecordReader::NumRecords()` avoid iterating over chunk headers.
+    //
+    // The index is written only when the file is written from the beginning.
+    // This cannot be used together with `set_append()` for a non-empty file.
+    //
+    // Default: `false`
+    Options& set_index(bool index) & {
+      index_ = index;
+      return *this;
+    }
+    Options&& set_index(bool index) && { return std::move(set_index(index)); }
+
+    // Sets proto fields whose ranges of values are stored for each chunk
+    // containing records, in a statistics chunk written immediately before it.
+    // See `ChunkStatistics` for how values are interpreted.
+    //
+    // This lets `RecordReader::Options::set_chunk_filter()` skip chunks without
+    // reading them. If `fields` are empty, statistics chunks are not written.
+    //
+    // Precondition: `fields` are not empty paths and do not end with
+    // `Field::kExistenceOnly`
+    //
+    // Default: no fields
+    Options& set_chunk_statistics(std::vector<Field> fields) & {
+      chunk_statistics_ = std::move(fields);
+      return *this;
+    }
+    Options&& set_chunk_statistics(std::vector<Field> fields) && {
+      return std::move(set_chunk_statistics(std::move(fields)));
+    }
+
+    // Sets a function computing the key of a record, given its serialized
+    // form. A bloom filter of keys of records is stored for each chunk
+    // containing records, in a key filter chunk written immediately before the
+    // index chunk. This implies `set_index(true)`.
+    //
+    // This lets `RecordReader::Lookup()` read only chunks which might contain a
+    // record with the given key.
+    //
+    // If `key_extractor` is `nullptr`, the key filter chunk is not written.
+    //
+    // Default: `nullptr`
+    Options& set_key_extractor(
+        std::function<std::string(absl::string_view)> key_extractor) & {
+      key_extractor_ = std::move(key_extractor);
+      return *this;
+    }
+    Options&& set_key_extractor(
+        std::function<std::string(absl::string_view)> key_extractor) && {
+      return std::move(set_key_extractor(std::move(key_extractor)));
+    }
+
+    // Sets the size of bloom filters written if `set_key_extractor()` is used,
+    // in bits per record. Larger filters make false positives rarer and the
+    // file larger: 10 bits per record give about 1% of false positives.
+    //
+    // Default: 10
+    Options& set_key_filter_bits_per_key(int key_filter_bits_per_key) & {
+      RIEGELI_ASSERT_GT(key_filter_bits_per_key, 0)
+          << "Failed precondition of "
+             "RecordWriterBase::Options::set_key_filter_bits_per_key(): "
+             "non-positive bits per key";
+      key_filter_bits_per_key_ = key_filter_bits_per_key;
+      return *this;
+    }
+    Options&& set_key_filter_bits_per_key(int key_filter_bits_per_key) && {
+      return std::move(set_key_filter_bits_per_key(key_filter_bits_per_key));
+    }
+
+    // If `true`, records are written in the order of their keys computed by
+    // `set_key_extractor()`, compared as byte strings. The key of the first
+    // record of each chunk containing records is stored in a first key chunk,
+    // written immediately before the key filter chunk.
+    //
+    // This lets `RecordReader::SeekToKey()` find the chunk containing a key
+    // using keys loaded together with the index, and read only that chunk.
+    //
+    // Writing a record whose key is less than the key of the previous record
+    // fails the `RecordWriter`.
+    //
+    // Precondition: `set_key_extractor()` is used with a function other than
+    // `nullptr` if `sorted_keys` is `true`
+    //
+    // Default: `false`
+    Options& set_sorted_keys(bool sorted_keys) & {
+      sorted_keys_ = sorted_keys;
+      return *this;
+    }
+    Options&& set_sorted_keys(bool sorted_keys) && {
+      return std::move(set_sorted_keys(sorted_keys));
+    }
+
+    // Sets a function computing the key of a record for a secondary index, and
+    // a function opening the `RecordWriter` of the secondary index, called by
+    // `Close()`.
+    //
+    // Keys are collected while records are written, together with positions
+    // of records, which are known without waiting for chunks being encoded in
+    // background. `Close()` sorts them and writes them as entries of the
+    // secondary index (see `MakeSecondaryIndexEntry()`), so that building the
+    // index does not need to read the file again. Keys are held in memory
+    // until `Close()`.
+    //
+    // The index covers records written by this `RecordWriter` with
+    // `WriteRecord()` and `WriteRecords()`. Like `set_key_extractor()`, it
+    // makes `OpenRecord()` and `WriteChunk()` fail. It is not written for a
+    // segment (see `set_segment()`), or if this `RecordWriter` fails.
+    //
+    // Using `SecondaryIndexEntryKey()` as the key extractor of the secondary
+    // index, with `set_sorted_keys(true)`, lets `RecordReader::SeekToKey()`
+    // find entries of a key in the secondary index.
+    //
+    // If `key_extractor` or `open_index` is `nullptr`, the secondary index is
+    // not written.
+    //
+    // Default: `nullptr`, `nullptr`
+    Options& set_secondary_index(
+        std::function<std::string(absl::string_view)> key_extractor,
+        std::function<std::unique_ptr<RecordWriterBase>()> open_index) & {
+      secondary_index_key_extractor_ = std::move(key_extractor);
+      open_secondary_index_ = std::move(open_index);
+      return *this;
+    }
+    Options&& set_secondary_index(
+        std::function<std::string(absl::string_view)> key_extractor,
+        std::function<std::unique_ptr<RecordWriterBase>()> open_index) && {
+      return std::move(
+          set_secondary_index(std::move(key_extractor), std::move(open_index)));
+    }
+
+    // Sets a function called after each chunk containing records is written,
+    // with the sequence number of the chunk among chunks containing records
+    // written by this `RecordWriter` (see `ChunkSequencePosition`) and the
+    // position of its beginning. Chunks are reported in order of their
+    // sequence numbers.
+    //
+    // With `set_parallelism() != 0` or `set_background_writing()`, the
+    // function is called in a background thread, otherwise in the thread
+    // writing records. It must not call this `RecordWriter`.
+    //
+    // Default: `nullptr`
+    Options& set_chunk_written_callback(
+        std::function<void(uint64_t chunk_number, Position chunk_begin)>
+            chunk_written_callback) & {
+      chunk_written_callback_ = std::move(chunk_written_callback);
+      return *this;
+    }
+    Options&& set_chunk_written_callback(
+        std::function<void(uint64_t chunk_number, Position chunk_begin)>
+            chunk_written_callback) && {
+      return std::move(
+          set_chunk_written_callback(std::move(chunk_written_callback)));
+    }
+
     // Sets the maximum number of chunks being encoded in parallel in
     // background. Larger parallelism can increase throughput, up to a point
     // where it no longer matters; smaller parallelism reduces memory usage.
     //
-    // If `parallelism > 0`, chunks are written to the byte `Writer` in
-    // background and reporting writing errors is delayed.
+    // `kAutoParallelism` (-1) uses up to `AvailableCpus()` threads, which
+    // respects CPU affinity and the CPU quota of the cgroup, and adjusts the
+    // number of chunks in flight to the observed ratio of encoding time to
+    // writing time: an I/O-bound writer keeps few chunks in memory, a
+    // CPU-bound writer encodes more chunks concurrently.
+    //
+    // If `parallelism != 0`, chunks are written to the byte `Writer` in
+    // background and reporting writing errors is delayed. Chunks are written
+    // by one thread in order; to write them concurrently to a file, use
+    // `ConcurrentChunkWriter` as the destination.
     //
     // Default: 0
+    static constexpr int kAutoParallelism = -1;
     Options& set_parallelism(int parallelism) & {
-      RIEGELI_ASSERT_GE(parallelism, 0)
+      RIEGELI_ASSERT(parallelism >= 0 || parallelism == kAutoParallelism)
           << "Failed precondition of "
              "RecordWriterBase::Options::set_parallelism(): "
              "negative parallelism";
@@ -312,17 +1134,179 @@ class RecordWriterBase : public Object {
       return std::move(set_parallelism(parallelism));
     }
 
+    // If `true` and `parallelism` is 0, chunks are encoded in the thread
+    // writing records, but written to the byte `Writer` by a background
+    // thread, so that writing a chunk overlaps with encoding the next one.
+    // At most a few chunks wait to be written, or fewer with
+    // `set_max_pending_bytes()`.
+    //
+    // This gives much of the benefit of `parallelism > 0` when threads for
+    // encoding cannot be afforded, but the writing thread is blocked on I/O.
+    // Reporting writing errors is delayed as with `parallelism > 0`.
+    //
+    // This is ignored if `parallelism != 0`, which writes chunks in background
+    // anyway, or with `set_shared_transpose_header()` or
+    // `set_chunk_prefix_interval()`.
+    //
+    // Default: `false`
+    Options& set_background_writing(bool background_writing) & {
+      background_writing_ = background_writing;
+      return *this;
+    }
+    Options&& set_background_writing(bool background_writing) && {
+      return std::move(set_background_writing(background_writing));
+    }
+
+    // Sets the maximum number of bytes of chunks being encoded or waiting to be
+    // written in background, or 0 for no limit other than `set_parallelism()`.
+    // A chunk being encoded counts with its uncompressed size, and afterwards
+    // with its compressed size.
+    //
+    // When the limit is reached, finishing the next chunk blocks, and thus
+    // `WriteRecord()` blocks, until enough pending chunks are written. The
+    // limit can be exceeded by the size of one chunk.
+    //
+    // This is meaningful if `parallelism > 0` or `background_writing`.
+    //
+    // Default: 0
+    Options& set_max_pending_bytes(uint64_t max_pending_bytes) & {
+      max_pending_bytes_ = max_pending_bytes;
+      return *this;
+    }
+    Options&& set_max_pending_bytes(uint64_t max_pending_bytes) && {
+      return std::move(set_max_pending_bytes(max_pending_bytes));
+    }
+
+    // Sets the maximum time between adding the first record to a chunk and
+    // writing the chunk, even if it did not reach its desired size. The chunk
+    // is then closed and written in background, and the byte `Writer` is
+    // flushed with `FlushType::kFromObject`.
+    //
+    // This bounds the delay after which records become visible to readers of a
+    // file being written, at the cost of smaller chunks if records are written
+    // slowly.
+    //
+    // This is meaningful if `parallelism > 0` or `background_writing`.
+    // `WriteRecord()` does not block for closing a chunk in background, except
+    // when waiting for capacity limited by `set_parallelism()` or
+    // `set_max_pending_bytes()`, or for encoding the chunk if `parallelism` is
+    // 0.
+    //
+    // Default: `absl::InfiniteDuration()`
+    Options& set_max_chunk_age(absl::Duration max_chunk_age) & {
+      RIEGELI_ASSERT_GT(max_chunk_age, absl::ZeroDuration())
+          << "Failed precondition of "
+             "RecordWriterBase::Options::set_max_chunk_age(): "
+             "non-positive max chunk age";
+      max_chunk_age_ = max_chunk_age;
+      return *this;
+    }
+    Options&& set_max_chunk_age(absl::Duration max_chunk_age) && {
+      return std::move(set_max_chunk_age(max_chunk_age));
+    }
+
+    // Sets the thread pool where chunks are encoded if `parallelism > 0`.
+    //
+    // Sharing a pool with a limited number of threads among many
+    // `RecordWriter`s bounds the total number of encoding threads.
+    //
+    // Encoding of a chunk is scheduled by the thread writing its records, so a
+    // NUMA-aware pool (see `ThreadPool::Options::set_numa_aware()`) encodes it
+    // on the node of that thread, where the records were copied to.
+    //
+    // The thread pool must outlive the `RecordWriter`.
+    //
+    // Default: `&ThreadPool::global()`
+    Options& set_thread_pool(ThreadPool* thread_pool) & {
+      RIEGELI_ASSERT(thread_pool != nullptr)
+          << "Failed precondition of "
+             "RecordWriterBase::Options::set_thread_pool(): "
+             "null thread pool";
+      thread_pool_ = thread_pool;
+      return *this;
+    }
+    Options&& set_thread_pool(ThreadPool* thread_pool) && {
+      return std::move(set_thread_pool(thread_pool));
+    }
+
+    // Sets the priority of encoding tasks in the thread pool if
+    // `parallelism > 0`.
+    //
+    // `ThreadPool::Priority::kLow` suits background writers, e.g. compaction,
+    // which share the thread pool with latency-sensitive readers.
+    //
+    // Default: `ThreadPool::Priority::kNormal`
+    Options& set_task_priority(ThreadPool::Priority task_priority) & {
+      task_priority_ = task_priority;
+      return *this;
+    }
+    Options&& set_task_priority(ThreadPool::Priority task_priority) && {
+      return std::move(set_task_priority(task_priority));
+    }
+
+    // If `true`, `RecordWriter` collects `RecordStats` about time spent in
+    // chunk I/O, encoding, and hashing, available from `stats()`.
+    //
+    // This costs reading clocks a few times per chunk.
+    //
+    // Default: `false`
+    Options& set_collect_stats(bool collect_stats) & {
+      collect_stats_ = collect_stats;
+      return *this;
+    }
+    Options&& set_collect_stats(bool collect_stats) && {
+      return std::move(set_collect_stats(collect_stats));
+    }
+
    private:
     friend class RecordWriterBase;
 
+    // Returns metadata set by `set_metadata()`, or empty metadata.
+    const RecordsMetadata& metadata() const {
+      return metadata_ == nullptr ? RecordsMetadata::default_instance()
+                                  : *metadata_;
+    }
+
     bool transpose_ = false;
     CompressorOptions compressor_options_;
     uint64_t chunk_size_ = kDefaultChunkSize;
+    uint64_t compressed_chunk_size_ = 0;
+    uint64_t max_chunk_memory_ = 0;
     double bucket_fraction_ = 1.0;
-    RecordsMetadata metadata_;
+    std::vector<FieldProjection> field_groups_;
+    int bucket_parallelism_ = 0;
+    uint64_t values_block_size_ = 0;
+    uint64_t dedup_window_ = 0;
+    bool numeric_encodings_ = false;
+    bool string_dictionaries_ = false;
+    bool packed_fields_ = false;
+    bool schema_guided_transpose_ = false;
+    bool shared_transpose_header_ = false;
+    uint64_t chunk_prefix_interval_ = 0;
+    // Shared between copies of `Options`, so that copying them is cheap.
+    std::shared_ptr<const RecordsMetadata> metadata_;
     Chain serialized_metadata_;
+    HashType hash_type_ = HashType::kHighwayHash;
     bool pad_to_block_boundary_ = false;
+    bool align_chunk_data_ = false;
+    bool segment_ = false;
+    std::function<std::unique_ptr<ChunkReader>()> open_existing_;
+    bool index_ = false;
+    std::vector<Field> chunk_statistics_;
+    std::function<std::string(absl::string_view)> key_extractor_;
+    int key_filter_bits_per_key_ = 10;
+    bool sorted_keys_ = false;
+    std::function<std::string(absl::string_view)>
+        secondary_index_key_extractor_;
+    std::function<std::unique_ptr<RecordWriterBase>()> open_secondary_index_;
+    std::function<void(uint64_t, Position)> chunk_written_callback_;
     int parallelism_ = 0;
+    bool background_writing_ = false;
+    uint64_t max_pending_bytes_ = 0;
+    absl::Duration max_chunk_age_ = absl::InfiniteDuration();
+    ThreadPool* thread_pool_ = &ThreadPool::global();
+    ThreadPool::Priority task_priority_ = ThreadPool::Priority::kNormal;
+    bool collect_stats_ = false;
   };
 
   ~RecordWriterBase();
@@ -351,9 +1335,108 @@ class RecordWriterBase : public Object {
   bool WriteRecord(const Chain& record, FutureRecordPosition* key = nullptr);
   bool WriteRecord(Chain&& record, FutureRecordPosition* key = nullptr);
 
+  // Writes multiple records. Equivalent to calling `WriteRecord()` for each
+  // record, but per-record bookkeeping is amortized over the batch, and records
+  // going to the same chunk are added to the chunk encoder together.
+  //
+  // `WriteRecords(absl::Span<const google::protobuf::MessageLite* const>)`
+  // writes proto messages pointed to by elements of `records`.
+  //
+  // If `keys != nullptr`, `*keys` is set to canonical positions of records
+  // written, in order. On failure, these are the records written before the
+  // failure.
+  //
+  // Return values:
+  //  * `true`  - success (`healthy()`)
+  //  * `false` - failure (`!healthy()`)
+  bool WriteRecords(
+      absl::Span<const google::protobuf::MessageLite* const> records,
+      std::vector<FutureRecordPosition>* keys = nullptr);
+  bool WriteRecords(absl::Span<const absl::string_view> records,
+                    std::vector<FutureRecordPosition>* keys = nullptr);
+  bool WriteRecords(absl::Span<const Chain> records,
+                    std::vector<FutureRecordPosition>* keys = nullptr);
+
+  // Writes a chunk of records which is already encoded, e.g. read by a
+  // `ChunkReader` from another file, without decoding and encoding it again.
+  //
+  // The open chunk, if any, is closed before. The chunk header is recomputed
+  // for `Options::set_hash_type()`, so the chunk can come from a file with a
+  // different hash type.
+  //
+  // The chunk must be a chunk of records which does not refer to other chunks,
+  // i.e. of type `ChunkType::kSimple`, `ChunkType::kSimpleWithBlocks`,
+  // `ChunkType::kSimpleWithReferences`, `ChunkType::kTransposed`, or
+  // `ChunkType::kTransposedWithBufferEncodings`. If it is compressed with
+  // a Zstd dictionary, this must be the dictionary of this `RecordWriter`
+  // (see `Options::set_zstd_dictionary()`), which is not verified.
+  //
+  // This fails if `Options::set_chunk_statistics()`,
+  // `Options::set_key_extractor()`, or `Options::set_secondary_index()` was
+  // used, because they need the records.
+  //
+  // If `key != nullptr`, `*key` is set to the canonical position of the first
+  // record of the chunk on success.
+  //
+  // Return values:
+  //  * `true`  - success (`healthy()`)
+  //  * `false` - failure (`!healthy()`)
+  bool WriteChunk(const Chunk& chunk, FutureRecordPosition* key = nullptr);
+
+  // Begins writing a record whose contents are written to the returned
+  // `Writer` instead of being passed at once. The record is written by
+  // `CloseRecord()`.
+  //
+  // This is meant for records too large to be conveniently held in memory.
+  // The record is compressed while it is written and is stored alone in a
+  // simple chunk, so it is held in memory only in compressed form. The open
+  // chunk, if any, is closed before that chunk.
+  //
+  // `Options::set_chunk_size()`, `Options::set_transpose()`,
+  // `Options::set_values_block_size()`, `Options::set_dedup_window()`, and
+  // `Options::set_auto_select()` do not apply to such a record: it is
+  // compressed with the algorithm and level set by the remaining options.
+  //
+  // Like `WriteChunk()`, this fails if `Options::set_chunk_statistics()`,
+  // `Options::set_key_extractor()`, or `Options::set_secondary_index()` was
+  // used.
+  //
+  // The `Writer` is valid until `CloseRecord()` and must not be closed. Other
+  // functions of this `RecordWriter` must not be called in the meantime, except
+  // that `Close()` calls `CloseRecord()` if needed.
+  //
+  // Returns `nullptr` on failure (`!healthy()`).
+  //
+  // Precondition: no record was opened or it was closed
+  Writer* OpenRecord();
+
+  // Writes the record begun by `OpenRecord()`, consisting of data written to
+  // its `Writer`.
+  //
+  // If `key != nullptr`, `*key` is set to the canonical record position on
+  // success.
+  //
+  // Return values:
+  //  * `true`  - success (`healthy()`)
+  //  * `false` - failure (`!healthy()`)
+  //
+  // Precondition: a record was opened and not closed
+  bool CloseRecord(FutureRecordPosition* key = nullptr);
+
+  // Finalizes any open chunk, so that the next record begins a new chunk.
+  //
+  // Unlike `Flush()`, this does not push buffered data to the `Writer`, and
+  // does not wait for background writing, so it can be used to control chunk
+  // boundaries without losing parallelism.
+  //
+  // Return values:
+  //  * `true`  - success (`healthy()`)
+  //  * `false` - failure (`!healthy()`)
+  bool CloseChunk();
+
   // Finalizes any open chunk and pushes buffered data to the `Writer`.
-  // If `Options::set_parallelism()` was used, waits for any background writing
-  // to complete.
+  // If `Options::set_parallelism()` or `Options::set_background_writing()` was
+  // used, waits for any background writing to complete.
   //
   // This degrades compression density if used too often.
   //
@@ -382,6 +1465,41 @@ class RecordWriterBase : public Object {
   // file for appending in the case of `Close()`).
   FutureRecordPosition Pos() const;
 
+  // Returns the position of the last record written by `WriteRecord()`,
+  // `WriteRecords()`, or `CloseRecord()`, as the sequence number of its chunk
+  // and its index in the chunk. Unlike resolving `FutureRecordPosition`, this
+  // never waits for chunks being encoded in background.
+  //
+  // With `Options::set_chunk_written_callback()`, this can be converted to the
+  // canonical `RecordPosition` of the record when its chunk is written.
+  ChunkSequencePosition LastSequencePos() const { return last_sequence_pos_; }
+
+  // Returns the number of bytes of chunks being encoded or waiting to be
+  // written in background, counted as for `Options::set_max_pending_bytes()`.
+  //
+  // This is 0 if `Options::set_parallelism()` is 0 and
+  // `Options::set_background_writing()` is `false`.
+  uint64_t pending_bytes() const;
+
+  // Returns statistics collected so far if `Options::set_collect_stats(true)`
+  // was used, otherwise zeros.
+  //
+  // Work done in background is included after it completes, in particular
+  // after `Close()` or `Flush()`.
+  RecordStats stats() const;
+
+  // Estimates the amount of memory used by this `RecordWriter`: records of the
+  // open chunk, chunks being encoded or waiting to be written in background,
+  // chunk encoders kept for reuse, and key filters and first keys to be
+  // written when closing.
+  //
+  // Buffers of the destination `Writer` and memory used internally by
+  // compression libraries are not included. `GetOwnedMemory()` reports
+  // process-wide totals of memory allocated by Riegeli.
+  size_t EstimateMemory() const;
+  // Registers this `RecordWriter` with `MemoryEstimator`.
+  void RegisterSubobjects(MemoryEstimator* memory_estimator) const;
+
  protected:
   explicit RecordWriterBase(InitiallyClosed) noexcept;
   explicit RecordWriterBase(InitiallyOpen) noexcept;
@@ -404,11 +1522,29 @@ class RecordWriterBase : public Object {
 
   template <typename Record>
   bool WriteRecordImpl(Record&& record, FutureRecordPosition* key);
+  template <typename Record>
+  bool WriteRecordsImpl(absl::Span<const Record> records,
+                        std::vector<FutureRecordPosition>* keys);
+
+  // If the open chunk was closed in background, marks it as empty.
+  //
+  // Precondition: `*chunk_mutex_` is held if `chunk_mutex_ != nullptr`
+  void SyncChunkClosedInBackground();
 
   uint64_t desired_chunk_size_ = 0;
   uint64_t chunk_size_so_far_ = 0;
+  ChunkSequencePosition last_sequence_pos_;
   // Invariant: if `!closed()` then `worker_ != nullptr`.
+  // Used by `*worker_`, or `nullptr` if stats are not collected. Declared
+  // before `worker_` so that it outlives it.
+  std::unique_ptr<internal::RecordStatsCollector> stats_collector_;
   std::unique_ptr<Worker> worker_;
+  // Encoder of the record opened by `OpenRecord()`, or `nullptr` if no record
+  // is open.
+  std::unique_ptr<SimpleEncoder> record_encoder_;
+  // The mutex owned by `worker_` which must be held while the open chunk is
+  // accessed, or `nullptr` if chunks are not closed in background.
+  absl::Mutex* chunk_mutex_ = nullptr;
 };
 
 // `RecordWriter` writes records to a Riegeli/records file. A record is
@@ -440,8 +1576,8 @@ class RecordWriterBase : public Object {
 // `DefaultChunkWriter<>` (owned).
 //
 // The byte `Writer` or `ChunkWriter` must not be accessed until the
-// `RecordWriter` is closed or (when parallelism in options is 0) no longer
-// used.
+// `RecordWriter` is closed or (when parallelism in options is 0 and background
+// writing is not used) no longer used.
 template <typename Dest = Writer*>
 class RecordWriter : public RecordWriterBase {
  public:
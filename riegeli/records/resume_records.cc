@@ -0,0 +1,82 @@
+// Copyright 2019 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "riegeli/records/resume_records.h"
+
+#include "absl/base/optimization.h"
+#include "absl/strings/str_cat.h"
+#include "riegeli/base/base.h"
+#include "riegeli/base/canonical_errors.h"
+#include "riegeli/base/status.h"
+#include "riegeli/bytes/writer.h"
+#include "riegeli/chunk_encoding/chunk.h"
+#include "riegeli/records/block.h"
+#include "riegeli/records/chunk_reader.h"
+
+namespace riegeli {
+
+Status FindRecordsEnd(ChunkReader* src, Position* records_end) {
+  if (ABSL_PREDICT_FALSE(!src->healthy())) return src->status();
+  Position search_end;
+  if (ABSL_PREDICT_FALSE(!src->Size(&search_end))) return src->status();
+  while (search_end > 0) {
+    // Begin with the chunk containing the last block boundary before
+    // `search_end`, so that data of all chunks in the last block are verified.
+    const Position block_begin =
+        internal::RoundDownToBlockBoundary(search_end - 1);
+    if (ABSL_PREDICT_FALSE(!src->SeekToChunkBefore(block_begin))) {
+      // The block header or a chunk header is invalid. Search again from the
+      // previous block boundary.
+      if (ABSL_PREDICT_FALSE(!src->Recover())) return src->status();
+      search_end = block_begin;
+      continue;
+    }
+    Position end = src->pos();
+    Chunk chunk;
+    while (src->ReadChunk(&chunk)) end = src->pos();
+    if (ABSL_PREDICT_FALSE(!src->healthy())) {
+      // The chunk at `end` is invalid. Everything from there is the torn tail,
+      // even if recovery cannot skip it. Only a failure not caused by invalid
+      // file contents is reported.
+      if (ABSL_PREDICT_FALSE(!src->Recover() && !IsDataLoss(src->status()))) {
+        return src->status();
+      }
+    }
+    *records_end = end;
+    return OkStatus();
+  }
+  *records_end = 0;
+  return OkStatus();
+}
+
+Status TruncateTornTail(ChunkReader* src, Writer* dest) {
+  if (ABSL_PREDICT_FALSE(!dest->healthy())) return dest->status();
+  if (ABSL_PREDICT_FALSE(!dest->SupportsTruncate())) {
+    return UnimplementedError("Writer::Truncate() not supported");
+  }
+  Position records_end;
+  {
+    const Status status = FindRecordsEnd(src, &records_end);
+    if (ABSL_PREDICT_FALSE(!status.ok())) return status;
+  }
+  if (ABSL_PREDICT_FALSE(!dest->Truncate(records_end))) {
+    if (ABSL_PREDICT_FALSE(!dest->healthy())) return dest->status();
+    return FailedPreconditionError(
+        absl::StrCat("File shrank unexpectedly while resuming: size ",
+                     dest->pos(), " is less than ", records_end));
+  }
+  return OkStatus();
+}
+
+}  // namespace riegeli
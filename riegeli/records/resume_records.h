@@ -0,0 +1,66 @@
+// Copyright 2019 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef RIEGELI_RECORDS_RESUME_RECORDS_H_
+#define RIEGELI_RECORDS_RESUME_RECORDS_H_
+
+#include "riegeli/base/base.h"
+#include "riegeli/base/status.h"
+#include "riegeli/bytes/writer.h"
+#include "riegeli/records/chunk_reader.h"
+
+namespace riegeli {
+
+// Finds the end of the last complete chunk of a Riegeli/records file which
+// might end with a torn tail, e.g. because its writer crashed. This is where
+// writing should be resumed.
+//
+// Instead of reading the whole file, the search begins with the chunk
+// containing the last block boundary, found from the last block header with
+// `ChunkReader::SeekToChunkBefore()`. Chunks from there are read and verified
+// until the first invalid or truncated chunk. If that block header is invalid,
+// the search begins from the previous block boundary instead. Damage in
+// earlier blocks is not detected.
+//
+// If the file has no complete chunk, `*records_end` is set to 0. The file
+// should be known to be a Riegeli/records file, because the whole file would
+// be considered a torn tail.
+//
+// `src` must support random access. Its position is unspecified afterwards.
+//
+// Returns status:
+//  * `status.ok()`  - success (`*records_end` is set)
+//  * `!status.ok()` - failure not caused by invalid file contents
+Status FindRecordsEnd(ChunkReader* src, Position* records_end);
+
+// Prepares a Riegeli/records file which might end with a torn tail for
+// appending: finds the end of the last complete chunk with `FindRecordsEnd()`
+// and truncates `*dest` there. `*src` and `*dest` must access the same file.
+//
+// Afterwards `dest->pos()` is the end of the last complete chunk, and a
+// `RecordWriter` writing to `*dest` continues the file. If a `RecordWriter` is
+// opened on the file independently of `*dest`, e.g. in append mode, the file
+// is already truncated, and `dest->pos()` can be used as `assumed_pos` for a
+// destination which does not know its position.
+//
+// `dest` must support `Truncate()`. `dest` is not closed.
+//
+// Returns status:
+//  * `status.ok()`  - success
+//  * `!status.ok()` - failure
+Status TruncateTornTail(ChunkReader* src, Writer* dest);
+
+}  // namespace riegeli
+
+#endif  // RIEGELI_RECORDS_RESUME_RECORDS_H_
@@ -0,0 +1,169 @@
+// Copyright 2019 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "riegeli/records/sample_records.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include "absl/base/optimization.h"
+#include "absl/strings/string_view.h"
+#include "absl/synchronization/blocking_counter.h"
+#include "absl/synchronization/mutex.h"
+#include "riegeli/base/base.h"
+#include "riegeli/base/canonical_errors.h"
+#include "riegeli/base/parallelism.h"
+#include "riegeli/base/status.h"
+#include "riegeli/chunk_encoding/chunk.h"
+#include "riegeli/records/chunk_reader.h"
+#include "riegeli/records/record_position.h"
+#include "riegeli/records/record_reader.h"
+
+namespace riegeli {
+
+namespace {
+
+struct SampledChunk {
+  Position chunk_begin = 0;
+  uint64_t num_records = 0;
+};
+
+// Maps `seed` and `chunk_begin` to a number uniformly distributed in [0, 1),
+// using the finalizer of SplitMix64.
+inline double ChunkRandom(uint64_t seed, Position chunk_begin) {
+  uint64_t x = seed + (chunk_begin + 1) * uint64_t{0x9e3779b97f4a7c15};
+  x = (x ^ (x >> 30)) * uint64_t{0xbf58476d1ce4e5b9};
+  x = (x ^ (x >> 27)) * uint64_t{0x94d049bb133111eb};
+  x ^= x >> 31;
+  return static_cast<double>(x >> 11) / static_cast<double>(uint64_t{1} << 53);
+}
+
+Status ChooseChunks(RecordReaderBase* src, const SampleRecordsOptions& options,
+                    std::vector<SampledChunk>* chunks) {
+  if (ABSL_PREDICT_FALSE(!src->healthy())) return src->status();
+  ChunkReader* const chunk_reader = src->src_chunk_reader();
+  if (ABSL_PREDICT_FALSE(!chunk_reader->Seek(0))) {
+    return chunk_reader->status();
+  }
+  ChunkHeader chunk_header;
+  Position chunk_begin;
+  while (chunk_reader->NextChunkHeader(&chunk_header, &chunk_begin)) {
+    if (chunk_header.num_records() > 0 &&
+        ChunkRandom(options.seed(), chunk_begin) < options.fraction()) {
+      chunks->push_back(SampledChunk{chunk_begin, chunk_header.num_records()});
+    }
+  }
+  if (ABSL_PREDICT_FALSE(!chunk_reader->healthy())) {
+    return chunk_reader->status();
+  }
+  return OkStatus();
+}
+
+Status ReadSampledChunk(RecordReaderBase* src, const SampledChunk& chunk,
+                        const SampledRecordCallback& callback) {
+  if (ABSL_PREDICT_FALSE(!src->Seek(RecordPosition(chunk.chunk_begin, 0)))) {
+    return src->status();
+  }
+  for (uint64_t i = 0; i < chunk.num_records; ++i) {
+    absl::string_view record;
+    RecordPosition key;
+    if (ABSL_PREDICT_FALSE(!src->ReadRecord(&record, &key))) {
+      if (ABSL_PREDICT_FALSE(!src->healthy())) return src->status();
+      return OkStatus();
+    }
+    // Records can be skipped, e.g. when recovering from invalid contents, so
+    // stop at the end of the chunk rather than after `num_records` records.
+    if (key.chunk_begin() != chunk.chunk_begin) return OkStatus();
+    {
+      const Status status = callback(key, record);
+      if (ABSL_PREDICT_FALSE(!status.ok())) return status;
+    }
+  }
+  return OkStatus();
+}
+
+}  // namespace
+
+Status SampleRecords(
+    std::function<std::unique_ptr<RecordReaderBase>()> open_src,
+    const SampledRecordCallback& callback, SampleRecordsOptions options) {
+  std::vector<SampledChunk> chunks;
+  {
+    const std::unique_ptr<RecordReaderBase> src = open_src();
+    if (ABSL_PREDICT_FALSE(src == nullptr)) {
+      return InvalidArgumentError("Opening the file failed");
+    }
+    const Status status = ChooseChunks(src.get(), options, &chunks);
+    if (ABSL_PREDICT_FALSE(!status.ok())) return status;
+  }
+  if (chunks.empty()) return OkStatus();
+
+  absl::Mutex mutex;
+  Status first_failure;
+  std::atomic<bool> failed{false};
+  const auto read_chunks = [&](std::atomic<size_t>* next_chunk) {
+    std::unique_ptr<RecordReaderBase> src;
+    for (;;) {
+      if (failed.load(std::memory_order_relaxed)) return;
+      const size_t index = next_chunk->fetch_add(1, std::memory_order_relaxed);
+      if (index >= chunks.size()) return;
+      Status status;
+      if (src == nullptr) {
+        src = open_src();
+        if (ABSL_PREDICT_FALSE(src == nullptr)) {
+          status = InvalidArgumentError("Opening the file failed");
+        }
+      }
+      if (ABSL_PREDICT_TRUE(status.ok())) {
+        status = ReadSampledChunk(src.get(), chunks[index], callback);
+      }
+      if (ABSL_PREDICT_FALSE(!status.ok())) {
+        absl::MutexLock lock(&mutex);
+        if (!failed.load(std::memory_order_relaxed)) {
+          first_failure = std::move(status);
+          failed.store(true, std::memory_order_relaxed);
+        }
+        return;
+      }
+    }
+  };
+  std::atomic<size_t> next_chunk{0};
+  const size_t num_helpers =
+      UnsignedMin(UnsignedMax(IntCast<size_t>(options.parallelism()),
+                              size_t{1}),
+                  chunks.size()) -
+      1;
+  if (num_helpers == 0) {
+    read_chunks(&next_chunk);
+  } else {
+    absl::BlockingCounter helpers_done(IntCast<int>(num_helpers));
+    for (size_t i = 0; i < num_helpers; ++i) {
+      ThreadPool::global().Schedule([&] {
+        read_chunks(&next_chunk);
+        helpers_done.DecrementCount();
+      });
+    }
+    read_chunks(&next_chunk);
+    helpers_done.Wait();
+  }
+  return first_failure;
+}
+
+}  // namespace riegeli
@@ -0,0 +1,126 @@
+// Copyright 2019 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef RIEGELI_RECORDS_SAMPLE_RECORDS_H_
+#define RIEGELI_RECORDS_SAMPLE_RECORDS_H_
+
+#include <stdint.h>
+
+#include <functional>
+#include <memory>
+#include <utility>
+
+#include "absl/strings/string_view.h"
+#include "riegeli/base/base.h"
+#include "riegeli/base/status.h"
+#include "riegeli/records/record_position.h"
+#include "riegeli/records/record_reader.h"
+
+namespace riegeli {
+
+class SampleRecordsOptions {
+ public:
+  SampleRecordsOptions() noexcept {}
+
+  // Sets the expected fraction of chunks containing records which are
+  // sampled. All records of a sampled chunk are returned, and other chunks are
+  // not read, so this is also approximately the fraction of bytes read.
+  //
+  // `fraction` must be between 0 and 1.
+  //
+  // Default: 0.01
+  SampleRecordsOptions& set_fraction(double fraction) & {
+    RIEGELI_ASSERT_GE(fraction, 0.0)
+        << "Failed precondition of SampleRecordsOptions::set_fraction(): "
+           "negative fraction";
+    RIEGELI_ASSERT_LE(fraction, 1.0)
+        << "Failed precondition of SampleRecordsOptions::set_fraction(): "
+           "fraction greater than 1";
+    fraction_ = fraction;
+    return *this;
+  }
+  SampleRecordsOptions&& set_fraction(double fraction) && {
+    return std::move(set_fraction(fraction));
+  }
+  double fraction() const { return fraction_; }
+
+  // Sets the seed of the random choice of chunks. Whether a chunk is sampled
+  // depends only on the seed and on the position of the chunk, so the same
+  // seed yields the same sample of the same file, independently of
+  // `parallelism()`.
+  //
+  // Default: 0
+  SampleRecordsOptions& set_seed(uint64_t seed) & {
+    seed_ = seed;
+    return *this;
+  }
+  SampleRecordsOptions&& set_seed(uint64_t seed) && {
+    return std::move(set_seed(seed));
+  }
+  uint64_t seed() const { return seed_; }
+
+  // Sets the maximum number of sampled chunks read concurrently, each by its
+  // own `RecordReader`. If 0, chunks are read in the calling thread.
+  //
+  // Default: 4
+  SampleRecordsOptions& set_parallelism(int parallelism) & {
+    RIEGELI_ASSERT_GE(parallelism, 0)
+        << "Failed precondition of SampleRecordsOptions::set_parallelism(): "
+           "negative parallelism";
+    parallelism_ = parallelism;
+    return *this;
+  }
+  SampleRecordsOptions&& set_parallelism(int parallelism) && {
+    return std::move(set_parallelism(parallelism));
+  }
+  int parallelism() const { return parallelism_; }
+
+ private:
+  double fraction_ = 0.01;
+  uint64_t seed_ = 0;
+  int parallelism_ = 4;
+};
+
+// Receives a sampled record together with its position. `record` is valid
+// only during the call.
+//
+// Returning a failed status stops sampling, and `SampleRecords()` returns that
+// status.
+using SampledRecordCallback =
+    std::function<Status(RecordPosition pos, absl::string_view record)>;
+
+// Reads a random sample of records of a Riegeli/records file, reading only
+// sampled chunks.
+//
+// Chunks are enumerated from their headers, seeking over chunk data, and each
+// chunk containing records is sampled independently with probability
+// `options.fraction()`. Sampled chunks are read concurrently, each by a
+// `RecordReader` returned by `open_src`, which may be called concurrently from
+// multiple threads.
+//
+// `callback` is called for each record of sampled chunks, in the order of
+// records within a chunk, but concurrently from multiple threads for different
+// chunks, in an unspecified order.
+//
+// Returns status:
+//  * `status.ok()`  - success
+//  * `!status.ok()` - failure, or failure returned by `callback`
+Status SampleRecords(
+    std::function<std::unique_ptr<RecordReaderBase>()> open_src,
+    const SampledRecordCallback& callback,
+    SampleRecordsOptions options = SampleRecordsOptions());
+
+}  // namespace riegeli
+
+#endif  // RIEGELI_RECORDS_SAMPLE_RECORDS_H_
@@ -0,0 +1,227 @@
+// Copyright 2019 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "riegeli/records/scan_chunks.h"
+
+#include <stddef.h>
+
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "absl/base/optimization.h"
+#include "absl/strings/str_cat.h"
+#include "absl/synchronization/blocking_counter.h"
+#include "absl/types/span.h"
+#include "riegeli/base/base.h"
+#include "riegeli/base/canonical_errors.h"
+#include "riegeli/base/parallelism.h"
+#include "riegeli/base/status.h"
+#include "riegeli/chunk_encoding/chunk.h"
+#include "riegeli/chunk_encoding/constants.h"
+#include "riegeli/records/block.h"
+#include "riegeli/records/chunk_reader.h"
+#include "riegeli/records/chunk_writer.h"
+#include "riegeli/records/skipped_region.h"
+
+namespace riegeli {
+
+namespace {
+
+// Parts per thread, so that threads scanning parts which are faster to scan,
+// e.g. because they are damaged, do not stay idle.
+constexpr size_t kPartsPerThread = 4;
+
+// A range of the file scanned by a single `ChunkReader`. It contains chunks
+// beginning in [`begin`..`end`).
+struct ScannedPart {
+  Position begin = 0;
+  Position end = 0;
+  std::vector<ScannedChunk> chunks;
+  std::vector<SkippedRegion> skipped_regions;
+  Status status;
+};
+
+Status ScanPart(ChunkReader* src, bool verify_data_hashes, ScannedPart* part) {
+  if (ABSL_PREDICT_FALSE(!src->healthy())) return src->status();
+  src->set_verify_data_hashes(verify_data_hashes);
+  // If seeking fails, recovery below skips to the next valid chunk.
+  if (part->begin > 0) src->SeekToChunkAfter(part->begin);
+  for (;;) {
+    if (ABSL_PREDICT_FALSE(!src->healthy())) {
+      SkippedRegion skipped_region;
+      if (ABSL_PREDICT_FALSE(!src->Recover(&skipped_region))) {
+        return src->status();
+      }
+      part->skipped_regions.push_back(std::move(skipped_region));
+      // Recovering from truncation leaves `*src` closed.
+      if (src->closed()) return OkStatus();
+      // `Recover()` turns verification of data hashes back on.
+      src->set_verify_data_hashes(verify_data_hashes);
+      continue;
+    }
+    const Position chunk_begin = src->pos();
+    if (chunk_begin >= part->end) return OkStatus();
+    Chunk chunk;
+    if (!src->ReadChunk(&chunk)) {
+      if (ABSL_PREDICT_FALSE(!src->healthy())) continue;
+      // The source ends. `Close()` detects whether it is truncated.
+      if (ABSL_PREDICT_FALSE(!src->Close())) continue;
+      return OkStatus();
+    }
+    ScannedChunk scanned_chunk;
+    scanned_chunk.chunk_begin = chunk_begin;
+    scanned_chunk.chunk_end = src->pos();
+    scanned_chunk.chunk_type = chunk.header.chunk_type();
+    scanned_chunk.num_records = chunk.header.num_records();
+    part->chunks.push_back(scanned_chunk);
+  }
+}
+
+}  // namespace
+
+Status ScanChunks(std::function<std::unique_ptr<ChunkReader>()> open_src,
+                  std::vector<ScannedChunk>* chunks,
+                  std::vector<SkippedRegion>* skipped_regions,
+                  ScanChunksOptions options) {
+  chunks->clear();
+  if (skipped_regions != nullptr) skipped_regions->clear();
+  Position num_blocks = 1;
+  {
+    const std::unique_ptr<ChunkReader> src = open_src();
+    if (ABSL_PREDICT_FALSE(src == nullptr)) {
+      return InvalidArgumentError("Opening the file failed");
+    }
+    if (src->SupportsRandomAccess()) {
+      Position size;
+      if (ABSL_PREDICT_FALSE(!src->Size(&size))) return src->status();
+      num_blocks = UnsignedMax((size + internal::kBlockSize - 1) /
+                                   internal::kBlockSize,
+                               Position{1});
+    }
+  }
+  const size_t parallelism = IntCast<size_t>(options.parallelism());
+  const size_t num_parts = IntCast<size_t>(UnsignedMin(
+      num_blocks, Position{UnsignedMax(parallelism, size_t{1}) *
+                           kPartsPerThread}));
+  std::vector<ScannedPart> parts(num_parts);
+  for (size_t i = 0; i < num_parts; ++i) {
+    parts[i].begin = num_blocks * i / num_parts * internal::kBlockSize;
+    parts[i].end =
+        i + 1 == num_parts
+            ? std::numeric_limits<Position>::max()
+            : num_blocks * (i + 1) / num_parts * internal::kBlockSize;
+  }
+  const auto scan_parts = [&](std::atomic<size_t>* next_part) {
+    for (;;) {
+      const size_t index = next_part->fetch_add(1, std::memory_order_relaxed);
+      if (index >= parts.size()) return;
+      ScannedPart& part = parts[index];
+      const std::unique_ptr<ChunkReader> src = open_src();
+      if (ABSL_PREDICT_FALSE(src == nullptr)) {
+        part.status = InvalidArgumentError("Opening the file failed");
+        continue;
+      }
+      part.status = ScanPart(src.get(), options.verify_data_hashes(), &part);
+    }
+  };
+  std::atomic<size_t> next_part{0};
+  const size_t num_helpers =
+      parts.size() <= 1
+          ? size_t{0}
+          : UnsignedMin(UnsignedMax(parallelism, size_t{1}), parts.size()) -
+                1;
+  if (num_helpers == 0) {
+    scan_parts(&next_part);
+  } else {
+    absl::BlockingCounter helpers_done(IntCast<int>(num_helpers));
+    for (size_t i = 0; i < num_helpers; ++i) {
+      ThreadPool::global().Schedule([&] {
+        scan_parts(&next_part);
+        helpers_done.DecrementCount();
+      });
+    }
+    scan_parts(&next_part);
+    helpers_done.Wait();
+  }
+  std::vector<SkippedRegion> all_skipped_regions;
+  for (ScannedPart& part : parts) {
+    if (ABSL_PREDICT_FALSE(!part.status.ok())) {
+      return Annotate(part.status,
+                      absl::StrCat("scanning from position ", part.begin));
+    }
+    for (const ScannedChunk& chunk : part.chunks) {
+      // A part ends at the first chunk beginning at or after its end, which is
+      // where the next part begins, but recovery in a damaged part can
+      // resynchronize differently.
+      if (ABSL_PREDICT_FALSE(!chunks->empty() &&
+                             chunk.chunk_begin < chunks->back().chunk_end)) {
+        continue;
+      }
+      chunks->push_back(chunk);
+    }
+    for (SkippedRegion& skipped_region : part.skipped_regions) {
+      all_skipped_regions.push_back(std::move(skipped_region));
+    }
+  }
+  if (skipped_regions != nullptr) {
+    // A region damaged across a part boundary is reported by both parts.
+    std::stable_sort(all_skipped_regions.begin(), all_skipped_regions.end(),
+                     [](const SkippedRegion& a, const SkippedRegion& b) {
+                       return a.begin() < b.begin();
+                     });
+    for (SkippedRegion& skipped_region : all_skipped_regions) {
+      if (!skipped_regions->empty() &&
+          skipped_region.begin() <= skipped_regions->back().end()) {
+        if (skipped_region.end() > skipped_regions->back().end()) {
+          skipped_regions->back() = SkippedRegion(
+              skipped_regions->back().begin(), skipped_region.end(),
+              skipped_regions->back().message());
+        }
+        continue;
+      }
+      skipped_regions->push_back(std::move(skipped_region));
+    }
+  }
+  return OkStatus();
+}
+
+Status CopyChunks(ChunkReader* src, absl::Span<const ScannedChunk> chunks,
+                  ChunkWriter* dest) {
+  if (ABSL_PREDICT_FALSE(chunks.empty() || chunks.front().chunk_begin != 0 ||
+                         chunks.front().chunk_type !=
+                             ChunkType::kFileSignature)) {
+    return FailedPreconditionError("File signature is missing or invalid");
+  }
+  for (const ScannedChunk& scanned_chunk : chunks) {
+    if (scanned_chunk.chunk_type == ChunkType::kPadding) continue;
+    Chunk chunk;
+    if (ABSL_PREDICT_FALSE(!src->Seek(scanned_chunk.chunk_begin) ||
+                           !src->ReadChunk(&chunk))) {
+      if (ABSL_PREDICT_FALSE(!src->healthy())) return src->status();
+      return DataLossError(absl::StrCat("Chunk at position ",
+                                        scanned_chunk.chunk_begin,
+                                        " is no longer available"));
+    }
+    if (ABSL_PREDICT_FALSE(!dest->WriteChunk(chunk))) return dest->status();
+  }
+  return OkStatus();
+}
+
+}  // namespace riegeli
@@ -0,0 +1,120 @@
+// Copyright 2019 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef RIEGELI_RECORDS_SCAN_CHUNKS_H_
+#define RIEGELI_RECORDS_SCAN_CHUNKS_H_
+
+#include <stdint.h>
+
+#include <functional>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include "absl/types/span.h"
+#include "riegeli/base/base.h"
+#include "riegeli/base/status.h"
+#include "riegeli/chunk_encoding/constants.h"
+#include "riegeli/records/chunk_reader.h"
+#include "riegeli/records/chunk_writer.h"
+#include "riegeli/records/skipped_region.h"
+
+namespace riegeli {
+
+class ScanChunksOptions {
+ public:
+  ScanChunksOptions() noexcept {}
+
+  // Sets the maximum number of parts of the file scanned concurrently, each
+  // with its own `ChunkReader`. If 0, the file is scanned in the calling
+  // thread.
+  //
+  // Default: 4
+  ScanChunksOptions& set_parallelism(int parallelism) & {
+    RIEGELI_ASSERT_GE(parallelism, 0)
+        << "Failed precondition of ScanChunksOptions::set_parallelism(): "
+           "negative parallelism";
+    parallelism_ = parallelism;
+    return *this;
+  }
+  ScanChunksOptions&& set_parallelism(int parallelism) && {
+    return std::move(set_parallelism(parallelism));
+  }
+  int parallelism() const { return parallelism_; }
+
+  // If `false`, hashes of chunk data are not verified, which saves a pass over
+  // chunk data. Block headers and chunk headers are always verified.
+  //
+  // Default: `true`
+  ScanChunksOptions& set_verify_data_hashes(bool verify_data_hashes) & {
+    verify_data_hashes_ = verify_data_hashes;
+    return *this;
+  }
+  ScanChunksOptions&& set_verify_data_hashes(bool verify_data_hashes) && {
+    return std::move(set_verify_data_hashes(verify_data_hashes));
+  }
+  bool verify_data_hashes() const { return verify_data_hashes_; }
+
+ private:
+  int parallelism_ = 4;
+  bool verify_data_hashes_ = true;
+};
+
+// A valid chunk found by `ScanChunks()`.
+struct ScannedChunk {
+  Position chunk_begin = 0;
+  Position chunk_end = 0;
+  ChunkType chunk_type = ChunkType::kPadding;
+  uint64_t num_records = 0;
+};
+
+// Finds valid chunks of a Riegeli/records file, skipping over invalid regions
+// like `ChunkReader::Recover()` does.
+//
+// The file is partitioned at block boundaries, and parts are scanned
+// concurrently, each by a `ChunkReader` returned by `open_src`, which may be
+// called concurrently from multiple threads. A part begins at the first chunk
+// boundary found from its first block header, so a damaged region delays
+// resynchronization only within its own part. If the file does not support
+// random access, it is scanned serially by a single `ChunkReader`.
+//
+// `*chunks` is set to valid chunks in the order of their positions, and
+// `*skipped_regions` (if not `nullptr`) to invalid regions, non-overlapping and
+// in the order of their positions.
+//
+// Returns status:
+//  * `status.ok()`  - success (invalid file contents are not a failure)
+//  * `!status.ok()` - failure not caused by invalid file contents
+Status ScanChunks(std::function<std::unique_ptr<ChunkReader>()> open_src,
+                  std::vector<ScannedChunk>* chunks,
+                  std::vector<SkippedRegion>* skipped_regions = nullptr,
+                  ScanChunksOptions options = ScanChunksOptions());
+
+// Writes chunks found by `ScanChunks()` from `*src` to `*dest`, making a copy
+// of the file without invalid regions. Padding chunks are not copied.
+//
+// The file signature must be valid, because it determines how hashes of other
+// chunks are computed.
+//
+// `dest` is not closed.
+//
+// Returns status:
+//  * `status.ok()`  - success
+//  * `!status.ok()` - failure
+Status CopyChunks(ChunkReader* src, absl::Span<const ScannedChunk> chunks,
+                  ChunkWriter* dest);
+
+}  // namespace riegeli
+
+#endif  // RIEGELI_RECORDS_SCAN_CHUNKS_H_
@@ -0,0 +1,58 @@
+// Copyright 2019 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "riegeli/records/secondary_index.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <string>
+
+#include "absl/base/optimization.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/string_view.h"
+#include "riegeli/records/record_position.h"
+
+namespace riegeli {
+
+namespace {
+
+// Size of a position in `RecordPosition::ToBytes()` format.
+constexpr size_t kSerializedPositionSize = 2 * sizeof(uint64_t);
+
+}  // namespace
+
+std::string MakeSecondaryIndexEntry(absl::string_view key, RecordPosition pos) {
+  return absl::StrCat(key, pos.ToBytes());
+}
+
+bool ParseSecondaryIndexEntry(absl::string_view entry, absl::string_view* key,
+                              RecordPosition* pos) {
+  if (ABSL_PREDICT_FALSE(entry.size() < kSerializedPositionSize)) return false;
+  const size_t key_size = entry.size() - kSerializedPositionSize;
+  if (ABSL_PREDICT_FALSE(!pos->FromBytes(entry.substr(key_size)))) {
+    return false;
+  }
+  *key = entry.substr(0, key_size);
+  return true;
+}
+
+std::string SecondaryIndexEntryKey(absl::string_view entry) {
+  if (ABSL_PREDICT_FALSE(entry.size() < kSerializedPositionSize)) {
+    return std::string(entry);
+  }
+  return std::string(entry.substr(0, entry.size() - kSerializedPositionSize));
+}
+
+}  // namespace riegeli
@@ -0,0 +1,55 @@
+// Copyright 2019 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef RIEGELI_RECORDS_SECONDARY_INDEX_H_
+#define RIEGELI_RECORDS_SECONDARY_INDEX_H_
+
+#include <string>
+
+#include "absl/strings/string_view.h"
+#include "riegeli/records/record_position.h"
+
+namespace riegeli {
+
+// A secondary index maps keys of records to their positions. It is written by
+// `RecordWriter` with `RecordWriterBase::Options::set_secondary_index()` as a
+// separate Riegeli/records file, whose records are entries sorted by key, and
+// for equal keys by position.
+//
+// An entry consists of the key followed by the position of the record in
+// `RecordPosition::ToBytes()` format.
+
+// Makes an entry of a secondary index.
+std::string MakeSecondaryIndexEntry(absl::string_view key, RecordPosition pos);
+
+// Splits an entry of a secondary index into the key and the position.
+//
+// Return values:
+//  * `true`  - success (`*key` and `*pos` are set)
+//  * `false` - failure (`entry` is invalid)
+bool ParseSecondaryIndexEntry(absl::string_view entry, absl::string_view* key,
+                              RecordPosition* pos);
+
+// Returns the key of an entry of a secondary index, or the whole `entry` if it
+// is invalid.
+//
+// This can be used with `RecordWriterBase::Options::set_key_extractor()` and
+// `set_sorted_keys()` for the secondary index file, and with
+// `RecordReaderBase::Options::set_key_extractor()`, so that
+// `RecordReader::SeekToKey()` finds entries of a key.
+std::string SecondaryIndexEntryKey(absl::string_view entry);
+
+}  // namespace riegeli
+
+#endif  // RIEGELI_RECORDS_SECONDARY_INDEX_H_
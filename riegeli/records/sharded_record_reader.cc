@@ -0,0 +1,261 @@
+// Copyright 2017 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "riegeli/records/sharded_record_reader.h"
+
+#include <stddef.h>
+
+#include <deque>
+#include <limits>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "absl/base/optimization.h"
+#include "absl/base/thread_annotations.h"
+#include "absl/strings/str_cat.h"
+#include "absl/synchronization/mutex.h"
+#include "google/protobuf/message_lite.h"
+#include "riegeli/base/base.h"
+#include "riegeli/base/canonical_errors.h"
+#include "riegeli/base/chain.h"
+#include "riegeli/base/object.h"
+#include "riegeli/base/parallelism.h"
+#include "riegeli/base/status.h"
+#include "riegeli/bytes/message_parse.h"
+#include "riegeli/records/record_reader.h"
+
+namespace riegeli {
+
+// Fields other than `index` and `max_buffered_records` are guarded by
+// `State::mutex`.
+struct ShardedRecordReader::Shard {
+  explicit Shard(size_t index, size_t max_buffered_records)
+      : index(index), max_buffered_records(max_buffered_records) {}
+
+  const size_t index;
+  const size_t max_buffered_records;
+  // Records read ahead, not yet returned.
+  std::deque<Chain> records;
+  // If `true`, the background thread stops reading the shard.
+  bool cancelled = false;
+  // If `true`, the background thread finished, and `records` will not grow.
+  bool done = false;
+  // The failure of the shard, valid if `done`.
+  Status status;
+};
+
+struct ShardedRecordReader::State {
+  explicit State(size_t num_shards, ShardOpener open_shard, Options options)
+      : num_shards(num_shards),
+        open_shard(std::move(open_shard)),
+        options(std::move(options)) {}
+
+  // Starts reading shards in the background until `options.parallelism_`
+  // shards are active or all shards are started.
+  void StartShards() ABSL_EXCLUSIVE_LOCKS_REQUIRED(mutex);
+
+  // Body of the background thread which reads `*shard`.
+  void ReadShard(Shard* shard);
+
+  const size_t num_shards;
+  const ShardOpener open_shard;
+  const Options options;
+
+  absl::Mutex mutex;
+  // Shards started and not yet removed, in the order of their indices.
+  std::vector<std::shared_ptr<Shard>> active ABSL_GUARDED_BY(mutex);
+  // The index of the next shard to start.
+  size_t next_shard ABSL_GUARDED_BY(mutex) = 0;
+  // The position in `active` where the next record is looked for first.
+  size_t next_active ABSL_GUARDED_BY(mutex) = 0;
+  // The number of background threads interacting with `*this`.
+  size_t num_running ABSL_GUARDED_BY(mutex) = 0;
+};
+
+void ShardedRecordReader::State::StartShards() {
+  while (next_shard < num_shards &&
+         active.size() < IntCast<size_t>(options.parallelism_)) {
+    std::shared_ptr<Shard> shard = std::make_shared<Shard>(
+        next_shard++, options.max_buffered_records_);
+    active.push_back(shard);
+    ++num_running;
+    ThreadPool::global().Schedule(
+        [this, shard = std::move(shard)] { ReadShard(shard.get()); });
+  }
+}
+
+void ShardedRecordReader::State::ReadShard(Shard* shard) {
+  Status status;
+  std::unique_ptr<RecordReaderBase> reader = open_shard(shard->index);
+  if (ABSL_PREDICT_FALSE(reader == nullptr)) {
+    status = UnknownError("Opening failed");
+  } else {
+    Chain record;
+    while (reader->ReadRecord(&record)) {
+      absl::MutexLock lock(&mutex);
+      mutex.Await(absl::Condition(
+          +[](Shard* shard) {
+            return shard->cancelled ||
+                   shard->records.size() < shard->max_buffered_records;
+          },
+          shard));
+      if (shard->cancelled) break;
+      shard->records.push_back(std::move(record));
+    }
+    if (ABSL_PREDICT_FALSE(!reader->Close())) status = reader->status();
+  }
+  absl::MutexLock lock(&mutex);
+  shard->status = std::move(status);
+  shard->done = true;
+  --num_running;
+}
+
+ShardedRecordReader::ShardedRecordReader() noexcept
+    : Object(kInitiallyClosed) {}
+
+ShardedRecordReader::ShardedRecordReader(size_t num_shards,
+                                         ShardOpener open_shard,
+                                         Options options)
+    : Object(kInitiallyOpen),
+      state_(std::make_unique<State>(num_shards, std::move(open_shard),
+                                     std::move(options))) {
+  absl::MutexLock lock(&state_->mutex);
+  state_->StartShards();
+}
+
+ShardedRecordReader::ShardedRecordReader(ShardedRecordReader&& that) noexcept
+    : Object(std::move(that)),
+      state_(std::move(that.state_)),
+      last_shard_index_(std::exchange(that.last_shard_index_,
+                                      std::numeric_limits<size_t>::max())) {}
+
+ShardedRecordReader& ShardedRecordReader::operator=(
+    ShardedRecordReader&& that) noexcept {
+  if (state_ != nullptr) StopShards();
+  Object::operator=(std::move(that));
+  state_ = std::move(that.state_);
+  last_shard_index_ = std::exchange(that.last_shard_index_,
+                                    std::numeric_limits<size_t>::max());
+  return *this;
+}
+
+ShardedRecordReader::~ShardedRecordReader() {
+  if (state_ != nullptr) StopShards();
+}
+
+void ShardedRecordReader::Done() {
+  if (state_ != nullptr) {
+    StopShards();
+    state_.reset();
+  }
+}
+
+void ShardedRecordReader::StopShards() {
+  absl::MutexLock lock(&state_->mutex);
+  for (const std::shared_ptr<Shard>& shard : state_->active) {
+    shard->cancelled = true;
+  }
+  state_->mutex.Await(absl::Condition(
+      +[](State* state) ABSL_EXCLUSIVE_LOCKS_REQUIRED(state->mutex) {
+        return state->num_running == 0;
+      },
+      state_.get()));
+  state_->active.clear();
+  state_->next_shard = state_->num_shards;
+}
+
+bool ShardedRecordReader::ReadChain(Chain* record) {
+  if (ABSL_PREDICT_FALSE(!healthy())) return false;
+  State* const state = state_.get();
+  absl::MutexLock lock(&state->mutex);
+  for (;;) {
+    if (state->active.empty()) return false;
+    if (state->next_active >= state->active.size()) state->next_active = 0;
+    size_t active_index = state->next_active;
+    switch (state->options.interleaving_) {
+      case Interleaving::kRoundRobin:
+        state->mutex.Await(absl::Condition(
+            +[](Shard* shard) {
+              return !shard->records.empty() || shard->done;
+            },
+            state->active[active_index].get()));
+        break;
+      case Interleaving::kFirstAvailable:
+        state->mutex.Await(absl::Condition(
+            +[](State* state) ABSL_EXCLUSIVE_LOCKS_REQUIRED(state->mutex) {
+              for (const std::shared_ptr<Shard>& shard : state->active) {
+                if (!shard->records.empty() || shard->done) return true;
+              }
+              return false;
+            },
+            state));
+        // Look for the shard starting from `next_active`, so that shards with
+        // records available are served fairly.
+        for (size_t i = 0; i < state->active.size(); ++i) {
+          const size_t candidate = (state->next_active + i) %
+                                   state->active.size();
+          const Shard& shard = *state->active[candidate];
+          if (!shard.records.empty() || shard.done) {
+            active_index = candidate;
+            break;
+          }
+        }
+        break;
+    }
+    Shard* const shard = state->active[active_index].get();
+    if (ABSL_PREDICT_TRUE(!shard->records.empty())) {
+      *record = std::move(shard->records.front());
+      shard->records.pop_front();
+      last_shard_index_ = shard->index;
+      state->next_active = active_index + 1;
+      return true;
+    }
+    if (ABSL_PREDICT_FALSE(!shard->status.ok())) {
+      return Fail(Annotate(shard->status,
+                           absl::StrCat("reading shard ", shard->index)));
+    }
+    // The shard ended. Remove it and start the next shard. `next_active` now
+    // refers to the shard following the removed one.
+    state->active.erase(state->active.begin() + active_index);
+    state->next_active = active_index;
+    state->StartShards();
+  }
+}
+
+bool ShardedRecordReader::ReadRecord(google::protobuf::MessageLite* record) {
+  Chain serialized;
+  if (ABSL_PREDICT_FALSE(!ReadChain(&serialized))) return false;
+  Status status = ParseFromChain(record, serialized);
+  if (ABSL_PREDICT_FALSE(!status.ok())) {
+    return Fail(Annotate(status,
+                         absl::StrCat("parsing a record of shard ",
+                                      last_shard_index_)));
+  }
+  return true;
+}
+
+bool ShardedRecordReader::ReadRecord(std::string* record) {
+  Chain chain;
+  if (ABSL_PREDICT_FALSE(!ReadChain(&chain))) return false;
+  *record = std::string(std::move(chain));
+  return true;
+}
+
+bool ShardedRecordReader::ReadRecord(Chain* record) {
+  return ReadChain(record);
+}
+
+}  // namespace riegeli
@@ -0,0 +1,181 @@
+// Copyright 2017 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef RIEGELI_RECORDS_SHARDED_RECORD_READER_H_
+#define RIEGELI_RECORDS_SHARDED_RECORD_READER_H_
+
+#include <stddef.h>
+
+#include <functional>
+#include <limits>
+#include <memory>
+#include <string>
+#include <utility>
+
+#include "google/protobuf/message_lite.h"
+#include "riegeli/base/base.h"
+#include "riegeli/base/chain.h"
+#include "riegeli/base/object.h"
+#include "riegeli/records/record_reader.h"
+
+namespace riegeli {
+
+// `ShardedRecordReader` reads records from several Riegeli/records files
+// (shards) concurrently, and merges them into a single stream of records.
+//
+// Each shard is read by its own `RecordReader` in a background thread, which
+// stays ahead of the consumer by a bounded number of records. Reading several
+// shards concurrently hides the latency of each shard, and lets decoding of
+// chunks proceed in parallel across shards.
+//
+// Records of a single shard are returned in their order in the shard. The
+// order of records across shards depends on `Options::set_interleaving()`.
+class ShardedRecordReader : public Object {
+ public:
+  // Opens the shard with the given index, `0 <= shard_index < num_shards`.
+  //
+  // Returns the `RecordReader` of the shard, or `nullptr` on failure. The
+  // `RecordReader` may also be returned failed.
+  //
+  // `ShardOpener` may be called concurrently from multiple threads.
+  using ShardOpener =
+      std::function<std::unique_ptr<RecordReaderBase>(size_t shard_index)>;
+
+  // How records from different shards are ordered.
+  enum class Interleaving {
+    // Records are taken from the active shards in turn, one from each shard.
+    // The order of records is deterministic and does not depend on timing.
+    kRoundRobin,
+    // Records are taken from whichever active shard has a record available
+    // first. The order of records depends on timing, but a slow shard does not
+    // stall the others.
+    kFirstAvailable,
+  };
+
+  class Options {
+   public:
+    Options() noexcept {}
+
+    // Sets the maximum number of shards read concurrently. Shards are started
+    // in the order of their indices; when a shard ends, the next shard is
+    // started.
+    //
+    // Default: 4
+    Options& set_parallelism(int parallelism) & {
+      RIEGELI_ASSERT_GT(parallelism, 0)
+          << "Failed precondition of "
+             "ShardedRecordReader::Options::set_parallelism(): "
+             "non-positive parallelism";
+      parallelism_ = parallelism;
+      return *this;
+    }
+    Options&& set_parallelism(int parallelism) && {
+      return std::move(set_parallelism(parallelism));
+    }
+
+    // Sets how records from different shards are ordered.
+    //
+    // Default: `Interleaving::kRoundRobin`
+    Options& set_interleaving(Interleaving interleaving) & {
+      interleaving_ = interleaving;
+      return *this;
+    }
+    Options&& set_interleaving(Interleaving interleaving) && {
+      return std::move(set_interleaving(interleaving));
+    }
+
+    // Sets the maximum number of records read ahead from each active shard
+    // before they are requested.
+    //
+    // Default: 256
+    Options& set_max_buffered_records(size_t max_buffered_records) & {
+      RIEGELI_ASSERT_GT(max_buffered_records, 0u)
+          << "Failed precondition of "
+             "ShardedRecordReader::Options::set_max_buffered_records(): "
+             "zero max_buffered_records";
+      max_buffered_records_ = max_buffered_records;
+      return *this;
+    }
+    Options&& set_max_buffered_records(size_t max_buffered_records) && {
+      return std::move(set_max_buffered_records(max_buffered_records));
+    }
+
+   private:
+    friend class ShardedRecordReader;
+
+    int parallelism_ = 4;
+    Interleaving interleaving_ = Interleaving::kRoundRobin;
+    size_t max_buffered_records_ = 256;
+  };
+
+  // Creates a closed `ShardedRecordReader`.
+  ShardedRecordReader() noexcept;
+
+  // Will read records from `num_shards` shards opened by `open_shard`.
+  ShardedRecordReader(size_t num_shards, ShardOpener open_shard,
+                      Options options = Options());
+
+  ShardedRecordReader(ShardedRecordReader&& that) noexcept;
+  ShardedRecordReader& operator=(ShardedRecordReader&& that) noexcept;
+
+  ~ShardedRecordReader();
+
+  // Reads the next record.
+  //
+  // `ReadRecord(google::protobuf::MessageLite*)` parses raw bytes to a proto
+  // message after reading. The remaining overloads read raw bytes.
+  //
+  // A failure of any shard, including invalid file contents, fails the
+  // `ShardedRecordReader`; the failure message includes the shard index.
+  //
+  // Return values:
+  //  * `true`                      - success (`*record` is set)
+  //  * `false` (when `healthy()`)  - all shards end
+  //  * `false` (when `!healthy()`) - failure
+  bool ReadRecord(google::protobuf::MessageLite* record);
+  bool ReadRecord(std::string* record);
+  bool ReadRecord(Chain* record);
+
+  // Returns the index of the shard of the record returned by the last
+  // successful `ReadRecord()`, or `std::numeric_limits<size_t>::max()` if no
+  // record was read yet.
+  size_t last_shard_index() const { return last_shard_index_; }
+
+ protected:
+  void Done() override;
+
+ private:
+  struct Shard;
+  struct State;
+
+  // Cancels active shards and waits until their background threads stop
+  // interacting with `*state_`.
+  void StopShards();
+
+  // Waits until a record is available in an active shard and takes it,
+  // removing shards which ended and starting subsequent shards.
+  //
+  // Return values:
+  //  * `true`                      - success (`*record` is set)
+  //  * `false` (when `healthy()`)  - all shards end
+  //  * `false` (when `!healthy()`) - failure
+  bool ReadChain(Chain* record);
+
+  std::unique_ptr<State> state_;
+  size_t last_shard_index_ = std::numeric_limits<size_t>::max();
+};
+
+}  // namespace riegeli
+
+#endif  // RIEGELI_RECORDS_SHARDED_RECORD_READER_H_
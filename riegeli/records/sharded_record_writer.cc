@@ -0,0 +1,320 @@
+// Copyright 2017 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "riegeli/records/sharded_record_writer.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <deque>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include "absl/base/optimization.h"
+#include "absl/base/thread_annotations.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/string_view.h"
+#include "absl/synchronization/mutex.h"
+#include "google/protobuf/message_lite.h"
+#include "riegeli/base/base.h"
+#include "riegeli/base/canonical_errors.h"
+#include "riegeli/base/chain.h"
+#include "riegeli/base/object.h"
+#include "riegeli/base/parallelism.h"
+#include "riegeli/base/status.h"
+#include "riegeli/bytes/message_serialize.h"
+#include "riegeli/records/record_writer.h"
+
+namespace riegeli {
+
+// `records` and `scheduled` are guarded by `State::mutex`. `writer` is accessed
+// only by the background task which took the shard from `State::ready`, or
+// after all background tasks finished.
+struct ShardedRecordWriter::Shard {
+  // The `RecordWriter` of the shard, or `nullptr` if not opened yet.
+  std::unique_ptr<RecordWriterBase> writer;
+  // Records queued, not yet passed to `writer`.
+  std::vector<Chain> records;
+  // If `true`, the shard is in `State::ready` or being written.
+  bool scheduled = false;
+};
+
+struct ShardedRecordWriter::State {
+  explicit State(size_t num_shards, ShardOpener open_shard, Options options)
+      : open_shard(std::move(open_shard)),
+        options(std::move(options)),
+        shards(num_shards) {}
+
+  // Queues `record` for the shard with the given index, blocking while
+  // `options.max_pending_bytes_` is reached.
+  //
+  // Returns `false` if a shard failed.
+  bool AddRecord(size_t shard_index, Chain&& record);
+
+  // Adds the shard to `ready` unless it is already scheduled, and starts a
+  // background task unless `options.parallelism_` tasks are running.
+  void ScheduleShard(size_t shard_index) ABSL_EXCLUSIVE_LOCKS_REQUIRED(mutex);
+
+  // Body of a background task which writes records of shards from `ready`
+  // until `ready` is empty.
+  void WriteShards();
+
+  // Opens the shard if it is not opened yet.
+  //
+  // Returns status:
+  //  * `status.ok()`  - success
+  //  * `!status.ok()` - failure
+  Status OpenShard(size_t shard_index);
+
+  const ShardOpener open_shard;
+  const Options options;
+
+  absl::Mutex mutex;
+  std::vector<Shard> shards;
+  // Indices of shards with queued records, waiting for a background task.
+  std::deque<size_t> ready ABSL_GUARDED_BY(mutex);
+  // The total size of `Shard::records`.
+  uint64_t pending_bytes ABSL_GUARDED_BY(mutex) = 0;
+  // The number of background tasks interacting with `*this`.
+  size_t num_running ABSL_GUARDED_BY(mutex) = 0;
+  // The first failure of a shard.
+  Status status ABSL_GUARDED_BY(mutex);
+};
+
+bool ShardedRecordWriter::State::AddRecord(size_t shard_index,
+                                           Chain&& record) {
+  absl::MutexLock lock(&mutex);
+  if (options.max_pending_bytes_ > 0) {
+    mutex.Await(absl::Condition(
+        +[](State* state) ABSL_EXCLUSIVE_LOCKS_REQUIRED(state->mutex) {
+          return state->pending_bytes < state->options.max_pending_bytes_ ||
+                 !state->status.ok();
+        },
+        this));
+  }
+  if (ABSL_PREDICT_FALSE(!status.ok())) return false;
+  pending_bytes += record.size();
+  shards[shard_index].records.push_back(std::move(record));
+  ScheduleShard(shard_index);
+  return true;
+}
+
+void ShardedRecordWriter::State::ScheduleShard(size_t shard_index) {
+  Shard& shard = shards[shard_index];
+  if (shard.scheduled) return;
+  shard.scheduled = true;
+  ready.push_back(shard_index);
+  if (num_running < IntCast<size_t>(options.parallelism_)) {
+    ++num_running;
+    options.thread_pool_->Schedule([this] { WriteShards(); });
+  }
+}
+
+void ShardedRecordWriter::State::WriteShards() {
+  std::vector<Chain> records;
+  mutex.Lock();
+  while (!ready.empty()) {
+    const size_t shard_index = ready.front();
+    ready.pop_front();
+    Shard& shard = shards[shard_index];
+    records.swap(shard.records);
+    mutex.Unlock();
+    uint64_t written_bytes = 0;
+    for (const Chain& record : records) written_bytes += record.size();
+    Status shard_status = OpenShard(shard_index);
+    if (ABSL_PREDICT_TRUE(shard_status.ok()) &&
+        ABSL_PREDICT_FALSE(!shard.writer->WriteRecords(records))) {
+      shard_status = shard.writer->status();
+    }
+    records.clear();
+    mutex.Lock();
+    pending_bytes -= written_bytes;
+    if (ABSL_PREDICT_FALSE(!shard_status.ok()) && status.ok()) {
+      status = Annotate(shard_status,
+                        absl::StrCat("writing shard ", shard_index));
+    }
+    if (shard.records.empty()) {
+      shard.scheduled = false;
+    } else {
+      ready.push_back(shard_index);
+    }
+  }
+  --num_running;
+  mutex.Unlock();
+}
+
+Status ShardedRecordWriter::State::OpenShard(size_t shard_index) {
+  Shard& shard = shards[shard_index];
+  if (shard.writer == nullptr) {
+    shard.writer = open_shard(shard_index);
+    if (ABSL_PREDICT_FALSE(shard.writer == nullptr)) {
+      return UnknownError("Opening failed");
+    }
+  }
+  if (ABSL_PREDICT_FALSE(!shard.writer->healthy())) {
+    return shard.writer->status();
+  }
+  return OkStatus();
+}
+
+ShardedRecordWriter::ShardedRecordWriter() noexcept
+    : Object(kInitiallyClosed) {}
+
+ShardedRecordWriter::ShardedRecordWriter(size_t num_shards,
+                                         ShardOpener open_shard,
+                                         Options options)
+    : Object(kInitiallyOpen),
+      state_(std::make_unique<State>(num_shards, std::move(open_shard),
+                                     std::move(options))) {
+  RIEGELI_ASSERT_GT(num_shards, 0u)
+      << "Failed precondition of ShardedRecordWriter::ShardedRecordWriter(): "
+         "no shards";
+}
+
+ShardedRecordWriter::ShardedRecordWriter(ShardedRecordWriter&& that) noexcept
+    : Object(std::move(that)),
+      state_(std::move(that.state_)),
+      next_shard_index_(std::exchange(that.next_shard_index_, 0)) {}
+
+ShardedRecordWriter& ShardedRecordWriter::operator=(
+    ShardedRecordWriter&& that) noexcept {
+  if (state_ != nullptr) WaitForWrites();
+  Object::operator=(std::move(that));
+  state_ = std::move(that.state_);
+  next_shard_index_ = std::exchange(that.next_shard_index_, 0);
+  return *this;
+}
+
+ShardedRecordWriter::~ShardedRecordWriter() {
+  if (state_ != nullptr) WaitForWrites();
+}
+
+void ShardedRecordWriter::Done() {
+  if (state_ == nullptr) return;
+  WaitForWrites();
+  CheckShards();
+  // Background tasks finished, so `Shard::writer` can be accessed here.
+  for (size_t shard_index = 0; shard_index < state_->shards.size();
+       ++shard_index) {
+    Shard& shard = state_->shards[shard_index];
+    // Open shards without records too, so that every shard is a valid file.
+    Status status = state_->OpenShard(shard_index);
+    if (ABSL_PREDICT_TRUE(status.ok()) &&
+        ABSL_PREDICT_FALSE(!shard.writer->Close())) {
+      status = shard.writer->status();
+    }
+    if (ABSL_PREDICT_FALSE(!status.ok()) && healthy()) {
+      Fail(Annotate(status, absl::StrCat("writing shard ", shard_index)));
+    }
+  }
+  state_.reset();
+}
+
+void ShardedRecordWriter::WaitForWrites() {
+  absl::MutexLock lock(&state_->mutex);
+  state_->mutex.Await(absl::Condition(
+      +[](State* state) ABSL_EXCLUSIVE_LOCKS_REQUIRED(state->mutex) {
+        return state->num_running == 0;
+      },
+      state_.get()));
+}
+
+bool ShardedRecordWriter::CheckShards() {
+  Status status;
+  {
+    absl::MutexLock lock(&state_->mutex);
+    status = state_->status;
+  }
+  if (ABSL_PREDICT_FALSE(!status.ok())) return Fail(std::move(status));
+  return true;
+}
+
+size_t ShardedRecordWriter::num_shards() const {
+  return state_ == nullptr ? 0 : state_->shards.size();
+}
+
+bool ShardedRecordWriter::WriteRecord(
+    size_t shard_index, const google::protobuf::MessageLite& record) {
+  Chain serialized;
+  {
+    Status status = SerializeToChain(record, &serialized);
+    if (ABSL_PREDICT_FALSE(!status.ok())) return Fail(std::move(status));
+  }
+  return WriteRecord(shard_index, std::move(serialized));
+}
+
+bool ShardedRecordWriter::WriteRecord(size_t shard_index,
+                                      absl::string_view record) {
+  return WriteRecord(shard_index, Chain(record));
+}
+
+bool ShardedRecordWriter::WriteRecord(size_t shard_index,
+                                      const Chain& record) {
+  return WriteRecord(shard_index, Chain(record));
+}
+
+bool ShardedRecordWriter::WriteRecord(size_t shard_index, Chain&& record) {
+  if (ABSL_PREDICT_FALSE(!healthy())) return false;
+  RIEGELI_ASSERT_LT(shard_index, state_->shards.size())
+      << "Failed precondition of ShardedRecordWriter::WriteRecord(): "
+         "shard index out of range";
+  if (ABSL_PREDICT_FALSE(!state_->AddRecord(shard_index, std::move(record)))) {
+    return CheckShards();
+  }
+  return true;
+}
+
+bool ShardedRecordWriter::WriteRecord(
+    const google::protobuf::MessageLite& record) {
+  if (ABSL_PREDICT_FALSE(!healthy())) return false;
+  const size_t shard_index = next_shard_index_;
+  next_shard_index_ = (next_shard_index_ + 1) % state_->shards.size();
+  return WriteRecord(shard_index, record);
+}
+
+bool ShardedRecordWriter::WriteRecord(absl::string_view record) {
+  return WriteRecord(Chain(record));
+}
+
+bool ShardedRecordWriter::WriteRecord(const Chain& record) {
+  return WriteRecord(Chain(record));
+}
+
+bool ShardedRecordWriter::WriteRecord(Chain&& record) {
+  if (ABSL_PREDICT_FALSE(!healthy())) return false;
+  const size_t shard_index = next_shard_index_;
+  next_shard_index_ = (next_shard_index_ + 1) % state_->shards.size();
+  return WriteRecord(shard_index, std::move(record));
+}
+
+bool ShardedRecordWriter::Flush(FlushType flush_type) {
+  if (ABSL_PREDICT_FALSE(!healthy())) return false;
+  WaitForWrites();
+  if (ABSL_PREDICT_FALSE(!CheckShards())) return false;
+  // Background tasks finished, and new ones are started only by
+  // `WriteRecord()`, so `Shard::writer` can be accessed here.
+  for (size_t shard_index = 0; shard_index < state_->shards.size();
+       ++shard_index) {
+    Shard& shard = state_->shards[shard_index];
+    if (shard.writer == nullptr) continue;
+    if (ABSL_PREDICT_FALSE(!shard.writer->Flush(flush_type))) {
+      return Fail(Annotate(shard.writer->status(),
+                           absl::StrCat("writing shard ", shard_index)));
+    }
+  }
+  return true;
+}
+
+}  // namespace riegeli
@@ -0,0 +1,200 @@
+// Copyright 2017 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef RIEGELI_RECORDS_SHARDED_RECORD_WRITER_H_
+#define RIEGELI_RECORDS_SHARDED_RECORD_WRITER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <functional>
+#include <memory>
+#include <utility>
+
+#include "absl/strings/string_view.h"
+#include "google/protobuf/message_lite.h"
+#include "riegeli/base/base.h"
+#include "riegeli/base/chain.h"
+#include "riegeli/base/object.h"
+#include "riegeli/base/parallelism.h"
+#include "riegeli/records/record_writer.h"
+
+namespace riegeli {
+
+// `ShardedRecordWriter` writes records to several Riegeli/records files
+// (shards), each record to the shard selected by the caller or by round robin.
+//
+// Records are queued per shard, and written to the `RecordWriter`s of shards by
+// a bounded number of tasks in a shared thread pool, so that writing many
+// shards does not need a background thread per shard. The total size of queued
+// records across all shards is bounded.
+//
+// Records of a single shard are written in the order of `WriteRecord()` calls.
+//
+// `RecordWriter`s of shards should use `RecordWriterBase::Options` with
+// `parallelism` 0, because encoding already runs in the thread pool, and each
+// parallel `RecordWriter` would use its own background thread. Memory used by
+// each shard is then dominated by its open chunk, which is bounded by
+// `RecordWriterBase::Options::set_chunk_size()`.
+class ShardedRecordWriter : public Object {
+ public:
+  // Opens the shard with the given index, `0 <= shard_index < num_shards`.
+  //
+  // Returns the `RecordWriter` of the shard, or `nullptr` on failure. The
+  // `RecordWriter` may also be returned failed.
+  //
+  // A shard is opened when its first record is written, or by `Close()` if no
+  // records were written to it. `ShardOpener` may be called concurrently from
+  // multiple threads.
+  using ShardOpener =
+      std::function<std::unique_ptr<RecordWriterBase>(size_t shard_index)>;
+
+  class Options {
+   public:
+    Options() noexcept {}
+
+    // Sets the maximum number of shards written concurrently.
+    //
+    // Default: 4
+    Options& set_parallelism(int parallelism) & {
+      RIEGELI_ASSERT_GT(parallelism, 0)
+          << "Failed precondition of "
+             "ShardedRecordWriter::Options::set_parallelism(): "
+             "non-positive parallelism";
+      parallelism_ = parallelism;
+      return *this;
+    }
+    Options&& set_parallelism(int parallelism) && {
+      return std::move(set_parallelism(parallelism));
+    }
+
+    // Sets the maximum total size of records queued across all shards and not
+    // yet passed to their `RecordWriter`s, or 0 for no limit.
+    //
+    // When the limit is reached, `WriteRecord()` blocks until enough queued
+    // records are written. The limit can be exceeded by the size of one record.
+    //
+    // Default: 64M
+    Options& set_max_pending_bytes(uint64_t max_pending_bytes) & {
+      max_pending_bytes_ = max_pending_bytes;
+      return *this;
+    }
+    Options&& set_max_pending_bytes(uint64_t max_pending_bytes) && {
+      return std::move(set_max_pending_bytes(max_pending_bytes));
+    }
+
+    // Sets the thread pool where shards are written.
+    //
+    // The thread pool must outlive the `ShardedRecordWriter`.
+    //
+    // Default: `&ThreadPool::global()`
+    Options& set_thread_pool(ThreadPool* thread_pool) & {
+      RIEGELI_ASSERT(thread_pool != nullptr)
+          << "Failed precondition of "
+             "ShardedRecordWriter::Options::set_thread_pool(): "
+             "null thread pool";
+      thread_pool_ = thread_pool;
+      return *this;
+    }
+    Options&& set_thread_pool(ThreadPool* thread_pool) && {
+      return std::move(set_thread_pool(thread_pool));
+    }
+
+   private:
+    friend class ShardedRecordWriter;
+
+    int parallelism_ = 4;
+    uint64_t max_pending_bytes_ = uint64_t{64} << 20;
+    ThreadPool* thread_pool_ = &ThreadPool::global();
+  };
+
+  // Creates a closed `ShardedRecordWriter`.
+  ShardedRecordWriter() noexcept;
+
+  // Will write records to `num_shards` shards opened by `open_shard`.
+  //
+  // Precondition: `num_shards > 0`
+  ShardedRecordWriter(size_t num_shards, ShardOpener open_shard,
+                      Options options = Options());
+
+  ShardedRecordWriter(ShardedRecordWriter&& that) noexcept;
+  ShardedRecordWriter& operator=(ShardedRecordWriter&& that) noexcept;
+
+  ~ShardedRecordWriter();
+
+  // Writes the next record to the shard with the given index.
+  //
+  // `WriteRecord(google::protobuf::MessageLite)` serializes a proto message to
+  // raw bytes beforehand. The remaining overloads accept raw bytes.
+  //
+  // A failure of any shard fails the `ShardedRecordWriter`; the failure message
+  // includes the shard index. Because shards are written in background, the
+  // failure is reported by a later call.
+  //
+  // Precondition: `shard_index < num_shards()`
+  //
+  // Return values:
+  //  * `true`  - success (`healthy()`)
+  //  * `false` - failure (`!healthy()`)
+  bool WriteRecord(size_t shard_index,
+                   const google::protobuf::MessageLite& record);
+  bool WriteRecord(size_t shard_index, absl::string_view record);
+  bool WriteRecord(size_t shard_index, const Chain& record);
+  bool WriteRecord(size_t shard_index, Chain&& record);
+
+  // Writes the next record to the next shard in round robin order.
+  //
+  // Return values:
+  //  * `true`  - success (`healthy()`)
+  //  * `false` - failure (`!healthy()`)
+  bool WriteRecord(const google::protobuf::MessageLite& record);
+  bool WriteRecord(absl::string_view record);
+  bool WriteRecord(const Chain& record);
+  bool WriteRecord(Chain&& record);
+
+  // Waits until queued records are passed to the `RecordWriter`s of shards,
+  // and calls `Flush(flush_type)` on `RecordWriter`s of shards opened so far.
+  //
+  // Return values:
+  //  * `true`  - success (`healthy()`)
+  //  * `false` - failure (`!healthy()`)
+  bool Flush(FlushType flush_type);
+
+  // Returns the number of shards.
+  size_t num_shards() const;
+
+ protected:
+  void Done() override;
+
+ private:
+  struct Shard;
+  struct State;
+
+  // Waits until background tasks stop interacting with `*state_`.
+  void WaitForWrites();
+
+  // Fails `*this` if a shard failed.
+  //
+  // Return values:
+  //  * `true`  - success (`healthy()`)
+  //  * `false` - failure (`!healthy()`)
+  bool CheckShards();
+
+  std::unique_ptr<State> state_;
+  size_t next_shard_index_ = 0;
+};
+
+}  // namespace riegeli
+
+#endif  // RIEGELI_RECORDS_SHARDED_RECORD_WRITER_H_
@@ -0,0 +1,342 @@
+// Copyright 2019 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "riegeli/records/shuffling_record_reader.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <memory>
+#include <random>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "absl/base/optimization.h"
+#include "absl/base/thread_annotations.h"
+#include "absl/strings/str_cat.h"
+#include "absl/synchronization/mutex.h"
+#include "google/protobuf/message_lite.h"
+#include "riegeli/base/base.h"
+#include "riegeli/base/canonical_errors.h"
+#include "riegeli/base/chain.h"
+#include "riegeli/base/object.h"
+#include "riegeli/base/parallelism.h"
+#include "riegeli/base/status.h"
+#include "riegeli/bytes/message_parse.h"
+#include "riegeli/records/chunk_index.h"
+#include "riegeli/records/record_position.h"
+#include "riegeli/records/record_reader.h"
+
+namespace riegeli {
+
+namespace {
+
+struct ShuffledRecord {
+  RecordPosition key;
+  Chain record;
+};
+
+// Permutes `*elements` with the Fisher-Yates shuffle. Unlike `std::shuffle()`,
+// the result does not depend on the standard library implementation.
+template <typename T>
+void Shuffle(std::vector<T>* elements, std::mt19937_64* random) {
+  for (size_t i = elements->size(); i > 1; --i) {
+    using std::swap;
+    swap((*elements)[i - 1], (*elements)[IntCast<size_t>((*random)() % i)]);
+  }
+}
+
+}  // namespace
+
+// A chunk at a position of the permutation, decoded by a background thread.
+struct ShufflingRecordReader::Slot {
+  // Records of the chunk.
+  std::vector<ShuffledRecord> records;
+  // If `true`, the background thread finished decoding the chunk.
+  bool done = false;
+  // The failure of decoding the chunk, valid if `done`.
+  Status status;
+};
+
+struct ShufflingRecordReader::State {
+  explicit State(ReaderOpener open_src, Options options)
+      : open_src(std::move(open_src)),
+        options(std::move(options)),
+        random(this->options.seed_) {}
+
+  // Reads the chunk index with `*src`, permutes chunks, and starts background
+  // threads.
+  //
+  // Returns status:
+  //  * `status.ok()`  - success
+  //  * `!status.ok()` - failure
+  Status Start(RecordReaderBase* src);
+
+  // Body of a background thread which decodes chunks.
+  void DecodeChunks();
+
+  // Reads records of the chunk at the given position of the permutation to
+  // `*records`.
+  Status DecodeChunk(RecordReaderBase* src, size_t permuted_index,
+                     std::vector<ShuffledRecord>* records);
+
+  const ReaderOpener open_src;
+  const Options options;
+  // Set by `Start()`, then constant.
+  ChunkIndex chunk_index;
+  // Numbers of indexed chunks in the order of reading them. Set by `Start()`,
+  // then constant.
+  std::vector<size_t> permutation;
+
+  absl::Mutex mutex;
+  // Chunks being decoded or decoded, indexed by positions in `permutation`.
+  // The slot is emptied when its window is taken by the consumer.
+  std::vector<Slot> slots ABSL_GUARDED_BY(mutex);
+  // The position in `permutation` of the next chunk to decode.
+  size_t next_to_decode ABSL_GUARDED_BY(mutex) = 0;
+  // Chunks before this position in `permutation` may be decoded.
+  size_t decode_limit ABSL_GUARDED_BY(mutex) = 0;
+  // If `true`, background threads stop decoding chunks.
+  bool cancelled ABSL_GUARDED_BY(mutex) = false;
+  // The number of background threads interacting with `*this`.
+  size_t num_running ABSL_GUARDED_BY(mutex) = 0;
+
+  // The remaining fields are accessed only by the consumer.
+
+  // Orders chunks and records.
+  std::mt19937_64 random;
+  // Shuffled records of the current window.
+  std::vector<ShuffledRecord> window;
+  // The position in `window` of the next record to return.
+  size_t next_in_window = 0;
+  // The position in `permutation` of the first chunk of the next window.
+  size_t next_window = 0;
+};
+
+Status ShufflingRecordReader::State::Start(RecordReaderBase* src) {
+  if (ABSL_PREDICT_FALSE(!src->GetChunkIndex(&chunk_index))) {
+    return src->status();
+  }
+  permutation.resize(chunk_index.num_chunks());
+  for (size_t i = 0; i < permutation.size(); ++i) permutation[i] = i;
+  Shuffle(&permutation, &random);
+
+  absl::MutexLock lock(&mutex);
+  slots.resize(permutation.size());
+  // Decode the first window and the window following it.
+  decode_limit = UnsignedMin(SaturatingAdd(options.window_chunks_,
+                                           options.window_chunks_),
+                             permutation.size());
+  const size_t num_threads = UnsignedMin(
+      IntCast<size_t>(options.parallelism_), permutation.size());
+  for (size_t i = 0; i < num_threads; ++i) {
+    ++num_running;
+    ThreadPool::global().Schedule([this] { DecodeChunks(); });
+  }
+  return OkStatus();
+}
+
+void ShufflingRecordReader::State::DecodeChunks() {
+  std::unique_ptr<RecordReaderBase> src;
+  for (;;) {
+    size_t permuted_index;
+    {
+      absl::MutexLock lock(&mutex);
+      mutex.Await(absl::Condition(
+          +[](State* state) ABSL_EXCLUSIVE_LOCKS_REQUIRED(state->mutex) {
+            return state->cancelled ||
+                   state->next_to_decode >= state->permutation.size() ||
+                   state->next_to_decode < state->decode_limit;
+          },
+          this));
+      if (cancelled || next_to_decode >= permutation.size()) break;
+      permuted_index = next_to_decode++;
+    }
+    Status status;
+    std::vector<ShuffledRecord> records;
+    if (src == nullptr) {
+      src = open_src();
+      if (ABSL_PREDICT_FALSE(src == nullptr)) {
+        status = UnknownError("Opening failed");
+      }
+    }
+    if (ABSL_PREDICT_TRUE(status.ok())) {
+      status = DecodeChunk(src.get(), permuted_index, &records);
+    }
+    absl::MutexLock lock(&mutex);
+    Slot& slot = slots[permuted_index];
+    slot.records = std::move(records);
+    slot.done = true;
+    if (ABSL_PREDICT_FALSE(!status.ok())) {
+      slot.status = std::move(status);
+      // Chunks after a failed chunk are not needed: the consumer fails when it
+      // reaches the failed chunk, and waits only for chunks before it, which
+      // were already taken by background threads.
+      cancelled = true;
+      break;
+    }
+  }
+  absl::MutexLock lock(&mutex);
+  --num_running;
+}
+
+Status ShufflingRecordReader::State::DecodeChunk(
+    RecordReaderBase* src, size_t permuted_index,
+    std::vector<ShuffledRecord>* records) {
+  const size_t chunk_number = permutation[permuted_index];
+  const Position chunk_begin = chunk_index.chunk_begin(chunk_number);
+  const uint64_t num_records = chunk_index.chunk_num_records(chunk_number);
+  if (ABSL_PREDICT_FALSE(!src->Seek(RecordPosition(chunk_begin, 0)))) {
+    return src->status();
+  }
+  records->reserve(IntCast<size_t>(num_records));
+  for (uint64_t i = 0; i < num_records; ++i) {
+    ShuffledRecord record;
+    if (ABSL_PREDICT_FALSE(!src->ReadRecord(&record.record, &record.key))) {
+      if (ABSL_PREDICT_FALSE(!src->healthy())) {
+        return src->status();
+      }
+      break;
+    }
+    // Records can be skipped, e.g. when recovering from invalid contents, so
+    // stop at the end of the chunk rather than after `num_records` records.
+    if (record.key.chunk_begin() != chunk_begin) break;
+    records->push_back(std::move(record));
+  }
+  return OkStatus();
+}
+
+ShufflingRecordReader::ShufflingRecordReader() noexcept
+    : Object(kInitiallyClosed) {}
+
+ShufflingRecordReader::ShufflingRecordReader(ReaderOpener open_src,
+                                             Options options)
+    : Object(kInitiallyOpen),
+      state_(std::make_unique<State>(std::move(open_src),
+                                     std::move(options))) {
+  Status status;
+  {
+    const std::unique_ptr<RecordReaderBase> src = state_->open_src();
+    if (ABSL_PREDICT_FALSE(src == nullptr)) {
+      status = UnknownError("Opening failed");
+    } else {
+      status = state_->Start(src.get());
+    }
+  }
+  if (ABSL_PREDICT_FALSE(!status.ok())) Fail(std::move(status));
+}
+
+ShufflingRecordReader::ShufflingRecordReader(
+    ShufflingRecordReader&& that) noexcept
+    : Object(std::move(that)), state_(std::move(that.state_)) {}
+
+ShufflingRecordReader& ShufflingRecordReader::operator=(
+    ShufflingRecordReader&& that) noexcept {
+  if (state_ != nullptr) StopDecoding();
+  Object::operator=(std::move(that));
+  state_ = std::move(that.state_);
+  return *this;
+}
+
+ShufflingRecordReader::~ShufflingRecordReader() {
+  if (state_ != nullptr) StopDecoding();
+}
+
+void ShufflingRecordReader::Done() {
+  if (state_ != nullptr) {
+    StopDecoding();
+    state_.reset();
+  }
+}
+
+void ShufflingRecordReader::StopDecoding() {
+  absl::MutexLock lock(&state_->mutex);
+  state_->cancelled = true;
+  state_->mutex.Await(absl::Condition(
+      +[](State* state) ABSL_EXCLUSIVE_LOCKS_REQUIRED(state->mutex) {
+        return state->num_running == 0;
+      },
+      state_.get()));
+  state_->slots.clear();
+}
+
+bool ShufflingRecordReader::ReadChain(Chain* record, RecordPosition* key) {
+  if (ABSL_PREDICT_FALSE(!healthy())) return false;
+  State* const state = state_.get();
+  while (state->next_in_window == state->window.size()) {
+    if (state->next_window == state->permutation.size()) return false;
+    const size_t window_end =
+        UnsignedMin(SaturatingAdd(state->next_window,
+                                  state->options.window_chunks_),
+                    state->permutation.size());
+    state->window.clear();
+    state->next_in_window = 0;
+    {
+      absl::MutexLock lock(&state->mutex);
+      for (size_t i = state->next_window; i < window_end; ++i) {
+        Slot* const slot = &state->slots[i];
+        state->mutex.Await(absl::Condition(
+            +[](Slot* slot) { return slot->done; }, slot));
+        if (ABSL_PREDICT_FALSE(!slot->status.ok())) {
+          return Fail(std::move(slot->status));
+        }
+        for (ShuffledRecord& shuffled_record : slot->records) {
+          state->window.push_back(std::move(shuffled_record));
+        }
+        *slot = Slot();
+      }
+      // Let background threads decode the window following the next one.
+      state->decode_limit =
+          UnsignedMin(SaturatingAdd(window_end, state->options.window_chunks_),
+                      state->permutation.size());
+    }
+    state->next_window = window_end;
+    Shuffle(&state->window, &state->random);
+  }
+  ShuffledRecord& shuffled_record = state->window[state->next_in_window++];
+  *record = std::move(shuffled_record.record);
+  if (key != nullptr) *key = shuffled_record.key;
+  return true;
+}
+
+bool ShufflingRecordReader::ReadRecord(google::protobuf::MessageLite* record,
+                                       RecordPosition* key) {
+  Chain serialized;
+  RecordPosition serialized_key;
+  if (ABSL_PREDICT_FALSE(!ReadChain(&serialized, &serialized_key))) {
+    return false;
+  }
+  Status status = ParseFromChain(record, serialized);
+  if (ABSL_PREDICT_FALSE(!status.ok())) {
+    return Fail(Annotate(status, absl::StrCat("parsing a record at ",
+                                              serialized_key.ToString())));
+  }
+  if (key != nullptr) *key = serialized_key;
+  return true;
+}
+
+bool ShufflingRecordReader::ReadRecord(std::string* record,
+                                       RecordPosition* key) {
+  Chain chain;
+  if (ABSL_PREDICT_FALSE(!ReadChain(&chain, key))) return false;
+  *record = std::string(std::move(chain));
+  return true;
+}
+
+bool ShufflingRecordReader::ReadRecord(Chain* record, RecordPosition* key) {
+  return ReadChain(record, key);
+}
+
+}  // namespace riegeli
@@ -0,0 +1,176 @@
+// Copyright 2019 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef RIEGELI_RECORDS_SHUFFLING_RECORD_READER_H_
+#define RIEGELI_RECORDS_SHUFFLING_RECORD_READER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <functional>
+#include <memory>
+#include <string>
+#include <utility>
+
+#include "google/protobuf/message_lite.h"
+#include "riegeli/base/base.h"
+#include "riegeli/base/chain.h"
+#include "riegeli/base/object.h"
+#include "riegeli/records/record_position.h"
+#include "riegeli/records/record_reader.h"
+
+namespace riegeli {
+
+// `ShufflingRecordReader` reads all records of a Riegeli/records file in a
+// pseudo-random order determined by a seed.
+//
+// Chunks are read in a random permutation of the chunk index (see
+// `RecordReaderBase::GetChunkIndex()`). Consecutive chunks of the permutation
+// are grouped into windows of `Options::set_window_chunks()` chunks, and
+// records of a window are returned in a random order. Chunks are decoded
+// concurrently in background threads, each with its own `RecordReader`, ahead
+// of the window being returned by at most one window.
+//
+// Compared to a shuffle buffer of records, this needs memory for only two
+// windows of chunks, and records are still spread over the whole file, because
+// chunks of a window come from random places in the file. Records of a single
+// chunk are returned close to each other though, so smaller chunks (see
+// `RecordWriterBase::Options::set_chunk_size()`) and larger windows improve
+// the quality of the shuffle.
+//
+// The order of records depends only on the seed and on the file, not on
+// parallelism or timing.
+class ShufflingRecordReader : public Object {
+ public:
+  // Opens the file being read.
+  //
+  // Returns a `RecordReader` of the file, or `nullptr` on failure. The
+  // `RecordReader` may also be returned failed.
+  //
+  // `ReaderOpener` may be called concurrently from multiple threads.
+  using ReaderOpener = std::function<std::unique_ptr<RecordReaderBase>()>;
+
+  class Options {
+   public:
+    Options() noexcept {}
+
+    // Sets the seed of the permutation of chunks and of the order of records
+    // within windows.
+    //
+    // Default: 0
+    Options& set_seed(uint64_t seed) & {
+      seed_ = seed;
+      return *this;
+    }
+    Options&& set_seed(uint64_t seed) && { return std::move(set_seed(seed)); }
+
+    // Sets the number of chunks whose records are shuffled together.
+    //
+    // Default: 16
+    Options& set_window_chunks(size_t window_chunks) & {
+      RIEGELI_ASSERT_GT(window_chunks, 0u)
+          << "Failed precondition of "
+             "ShufflingRecordReader::Options::set_window_chunks(): "
+             "zero window_chunks";
+      window_chunks_ = window_chunks;
+      return *this;
+    }
+    Options&& set_window_chunks(size_t window_chunks) && {
+      return std::move(set_window_chunks(window_chunks));
+    }
+
+    // Sets the maximum number of chunks decoded concurrently.
+    //
+    // Default: 4
+    Options& set_parallelism(int parallelism) & {
+      RIEGELI_ASSERT_GT(parallelism, 0)
+          << "Failed precondition of "
+             "ShufflingRecordReader::Options::set_parallelism(): "
+             "non-positive parallelism";
+      parallelism_ = parallelism;
+      return *this;
+    }
+    Options&& set_parallelism(int parallelism) && {
+      return std::move(set_parallelism(parallelism));
+    }
+
+   private:
+    friend class ShufflingRecordReader;
+
+    uint64_t seed_ = 0;
+    size_t window_chunks_ = 16;
+    int parallelism_ = 4;
+  };
+
+  // Creates a closed `ShufflingRecordReader`.
+  ShufflingRecordReader() noexcept;
+
+  // Will read records of the file opened by `open_src`.
+  //
+  // The chunk index is read by the first `RecordReader` returned by
+  // `open_src`, in the constructor.
+  explicit ShufflingRecordReader(ReaderOpener open_src,
+                                 Options options = Options());
+
+  ShufflingRecordReader(ShufflingRecordReader&& that) noexcept;
+  ShufflingRecordReader& operator=(ShufflingRecordReader&& that) noexcept;
+
+  ~ShufflingRecordReader();
+
+  // Reads the next record.
+  //
+  // `ReadRecord(google::protobuf::MessageLite*)` parses raw bytes to a proto
+  // message after reading. The remaining overloads read raw bytes.
+  //
+  // If `key != nullptr`, `*key` is set to the canonical record position on
+  // success.
+  //
+  // A failure of reading any chunk, including invalid file contents, fails the
+  // `ShufflingRecordReader`.
+  //
+  // Return values:
+  //  * `true`                      - success (`*record` is set)
+  //  * `false` (when `healthy()`)  - all records were returned
+  //  * `false` (when `!healthy()`) - failure
+  bool ReadRecord(google::protobuf::MessageLite* record,
+                  RecordPosition* key = nullptr);
+  bool ReadRecord(std::string* record, RecordPosition* key = nullptr);
+  bool ReadRecord(Chain* record, RecordPosition* key = nullptr);
+
+ protected:
+  void Done() override;
+
+ private:
+  struct Slot;
+  struct State;
+
+  // Cancels decoding of chunks and waits until background threads stop
+  // interacting with `*state_`.
+  void StopDecoding();
+
+  // Takes the next record of the current window, moving to the next window
+  // when the current window ends.
+  //
+  // Return values:
+  //  * `true`                      - success (`*record` and `*key` are set)
+  //  * `false` (when `healthy()`)  - all records were returned
+  //  * `false` (when `!healthy()`) - failure
+  bool ReadChain(Chain* record, RecordPosition* key);
+
+  std::unique_ptr<State> state_;
+};
+
+}  // namespace riegeli
+
+#endif  // RIEGELI_RECORDS_SHUFFLING_RECORD_READER_H_
@@ -0,0 +1,485 @@
+// Copyright 2017 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "riegeli/records/sort_records.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <functional>
+#include <memory>
+#include <string>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+#include "absl/base/optimization.h"
+#include "absl/base/thread_annotations.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/string_view.h"
+#include "absl/synchronization/mutex.h"
+#include "absl/types/span.h"
+#include "google/protobuf/message_lite.h"
+#include "riegeli/base/base.h"
+#include "riegeli/base/canonical_errors.h"
+#include "riegeli/base/chain.h"
+#include "riegeli/base/errno_mapping.h"
+#include "riegeli/base/object.h"
+#include "riegeli/base/parallelism.h"
+#include "riegeli/base/status.h"
+#include "riegeli/bytes/fd_reader.h"
+#include "riegeli/bytes/fd_writer.h"
+#include "riegeli/bytes/message_serialize.h"
+#include "riegeli/records/record_reader.h"
+#include "riegeli/records/record_writer.h"
+
+namespace riegeli {
+
+struct SortingRecordWriter::Entry {
+  // The key of `record`, or empty if records are ordered by their serialized
+  // form.
+  std::string key;
+  std::string record;
+};
+
+namespace {
+
+// A source of `MergeSortedRecords()` positioned at its current record.
+struct MergeSource {
+  std::unique_ptr<RecordReaderBase> reader;
+  // Valid until the next call to `reader->ReadRecord()`.
+  absl::string_view record;
+  std::string key;
+};
+
+// Reads the next record of `*src`.
+//
+// Returns status:
+//  * `status.ok() && *has_record`  - `src->record` and `src->key` are set
+//  * `status.ok() && !*has_record` - the source ends
+//  * `!status.ok()`                - failure
+Status ReadNextRecord(const SortKeyExtractor& key, MergeSource* src,
+                      bool* has_record) {
+  if (ABSL_PREDICT_FALSE(!src->reader->ReadRecord(&src->record))) {
+    *has_record = false;
+    if (ABSL_PREDICT_FALSE(!src->reader->healthy())) {
+      return src->reader->status();
+    }
+    return OkStatus();
+  }
+  if (key != nullptr) src->key = key(src->record);
+  *has_record = true;
+  return OkStatus();
+}
+
+// Creates an empty run in `temp_directory`.
+//
+// Returns status:
+//  * `status.ok()`  - success (`*path` and `*fd` are set)
+//  * `!status.ok()` - failure
+Status CreateRun(absl::string_view temp_directory, std::string* path,
+                 int* fd) {
+  *path = absl::StrCat(temp_directory, "/riegeli_sort_XXXXXX");
+  *fd = mkstemp(&(*path)[0]);
+  if (ABSL_PREDICT_FALSE(*fd < 0)) {
+    const int error_number = errno;
+    return ErrnoToCanonicalStatus(
+        error_number, absl::StrCat("mkstemp() failed in ", temp_directory));
+  }
+  return OkStatus();
+}
+
+}  // namespace
+
+struct SortingRecordWriter::State {
+  explicit State(SortKeyExtractor key, Options options)
+      : key(std::move(key)),
+        options(std::move(options)),
+        max_buffer_bytes(UnsignedMax(
+            this->options.memory_budget_ /
+                (IntCast<uint64_t>(this->options.parallelism_) + 1),
+            uint64_t{1})) {}
+
+  // Sorts `*entries` by keys, keeping the order of entries with equal keys.
+  void SortEntries(std::vector<Entry>* entries) const;
+
+  // Sorts `*entries` and writes them to a run already created as `fd`.
+  //
+  // Returns status:
+  //  * `status.ok()`  - success
+  //  * `!status.ok()` - failure
+  Status WriteRun(int fd, std::vector<Entry>* entries) const;
+
+  // Merges runs with the given indices in `run_files` into `dest`, and deletes
+  // them.
+  //
+  // Returns status:
+  //  * `status.ok()`  - success
+  //  * `!status.ok()` - failure
+  Status MergeRuns(absl::Span<const size_t> run_indices,
+                   RecordWriterBase* dest);
+
+  // Deletes the run with the given index in `run_files` unless it is already
+  // deleted.
+  void DeleteRun(size_t run_index);
+
+  const SortKeyExtractor key;
+  const Options options;
+  const uint64_t max_buffer_bytes;
+
+  // `buffer`, `buffer_bytes`, and `run_files` are accessed only by the
+  // `SortingRecordWriter`, not by background tasks.
+
+  // Records not yet written to a run.
+  std::vector<Entry> buffer;
+  // The approximate memory used by `buffer`.
+  uint64_t buffer_bytes = 0;
+  // Paths of runs, in the order of their records, or empty for runs already
+  // deleted.
+  std::vector<std::string> run_files;
+
+  absl::Mutex mutex;
+  // The number of background tasks interacting with `*this`.
+  size_t num_running ABSL_GUARDED_BY(mutex) = 0;
+  // The first failure of writing a run in background.
+  Status status ABSL_GUARDED_BY(mutex);
+};
+
+void SortingRecordWriter::State::SortEntries(
+    std::vector<Entry>* entries) const {
+  if (key == nullptr) {
+    std::stable_sort(entries->begin(), entries->end(),
+                     [](const Entry& a, const Entry& b) {
+                       return a.record < b.record;
+                     });
+  } else {
+    std::stable_sort(
+        entries->begin(), entries->end(),
+        [](const Entry& a, const Entry& b) { return a.key < b.key; });
+  }
+}
+
+Status SortingRecordWriter::State::WriteRun(
+    int fd, std::vector<Entry>* entries) const {
+  SortEntries(entries);
+  RecordWriter<FdWriter<>> writer(std::forward_as_tuple(fd),
+                                  options.run_options_);
+  for (Entry& entry : *entries) {
+    if (ABSL_PREDICT_FALSE(!writer.WriteRecord(std::move(entry.record)))) {
+      break;
+    }
+  }
+  entries->clear();
+  if (ABSL_PREDICT_FALSE(!writer.Close())) return writer.status();
+  return OkStatus();
+}
+
+Status SortingRecordWriter::State::MergeRuns(
+    absl::Span<const size_t> run_indices, RecordWriterBase* dest) {
+  Status status = MergeSortedRecords(
+      run_indices.size(),
+      [&](size_t src_index) -> std::unique_ptr<RecordReaderBase> {
+        return std::make_unique<RecordReader<FdReader<>>>(std::forward_as_tuple(
+            run_files[run_indices[src_index]], O_RDONLY));
+      },
+      key, dest);
+  for (const size_t run_index : run_indices) DeleteRun(run_index);
+  return status;
+}
+
+void SortingRecordWriter::State::DeleteRun(size_t run_index) {
+  std::string& path = run_files[run_index];
+  if (path.empty()) return;
+  unlink(path.c_str());
+  path.clear();
+}
+
+SortingRecordWriter::SortingRecordWriter() noexcept
+    : Object(kInitiallyClosed) {}
+
+SortingRecordWriter::SortingRecordWriter(RecordWriterBase* dest,
+                                         SortKeyExtractor key, Options options)
+    : Object(kInitiallyOpen),
+      dest_(RIEGELI_ASSERT_NOTNULL(dest)),
+      state_(std::make_unique<State>(std::move(key), std::move(options))) {}
+
+SortingRecordWriter::SortingRecordWriter(SortingRecordWriter&& that) noexcept
+    : Object(std::move(that)),
+      dest_(std::exchange(that.dest_, nullptr)),
+      state_(std::move(that.state_)) {}
+
+SortingRecordWriter& SortingRecordWriter::operator=(
+    SortingRecordWriter&& that) noexcept {
+  if (state_ != nullptr) {
+    WaitForRuns();
+    DeleteRuns();
+  }
+  Object::operator=(std::move(that));
+  dest_ = std::exchange(that.dest_, nullptr);
+  state_ = std::move(that.state_);
+  return *this;
+}
+
+SortingRecordWriter::~SortingRecordWriter() {
+  if (state_ != nullptr) {
+    WaitForRuns();
+    DeleteRuns();
+  }
+}
+
+void SortingRecordWriter::Done() {
+  if (state_ == nullptr) return;
+  if (ABSL_PREDICT_TRUE(healthy())) {
+    if (state_->run_files.empty()) {
+      // All records fit in memory.
+      state_->SortEntries(&state_->buffer);
+      for (Entry& entry : state_->buffer) {
+        if (ABSL_PREDICT_FALSE(!dest_->WriteRecord(std::move(entry.record)))) {
+          Fail(*dest_);
+          break;
+        }
+      }
+    } else if (state_->buffer.empty() || SpillBuffer()) {
+      WaitForRuns();
+      if (CheckRuns()) MergeAllRuns();
+    }
+  }
+  WaitForRuns();
+  DeleteRuns();
+  state_.reset();
+}
+
+bool SortingRecordWriter::MergeAllRuns() {
+  std::vector<size_t> runs(state_->run_files.size());
+  for (size_t i = 0; i < runs.size(); ++i) runs[i] = i;
+  // Merge groups of consecutive runs, so that records with equal keys stay in
+  // the order of `WriteRecord()` calls.
+  const size_t max_merge_width = state_->options.max_merge_width_;
+  while (runs.size() > max_merge_width) {
+    std::vector<size_t> merged_runs;
+    for (size_t begin = 0; begin < runs.size(); begin += max_merge_width) {
+      const size_t end = UnsignedMin(begin + max_merge_width, runs.size());
+      if (end - begin == 1) {
+        merged_runs.push_back(runs[begin]);
+        continue;
+      }
+      std::string path;
+      int fd;
+      {
+        Status status = CreateRun(state_->options.temp_directory_, &path, &fd);
+        if (ABSL_PREDICT_FALSE(!status.ok())) return Fail(std::move(status));
+      }
+      merged_runs.push_back(state_->run_files.size());
+      state_->run_files.push_back(std::move(path));
+      RecordWriter<FdWriter<>> writer(std::forward_as_tuple(fd),
+                                      state_->options.run_options_);
+      Status status = state_->MergeRuns(
+          absl::MakeConstSpan(runs.data() + begin, end - begin), &writer);
+      if (ABSL_PREDICT_TRUE(status.ok()) &&
+          ABSL_PREDICT_FALSE(!writer.Close())) {
+        status = writer.status();
+      }
+      if (ABSL_PREDICT_FALSE(!status.ok())) {
+        return Fail(Annotate(status, "merging runs"));
+      }
+    }
+    runs = std::move(merged_runs);
+  }
+  Status status = state_->MergeRuns(runs, dest_);
+  if (ABSL_PREDICT_FALSE(!status.ok())) {
+    return Fail(Annotate(status, "merging runs"));
+  }
+  return true;
+}
+
+bool SortingRecordWriter::SpillBuffer() {
+  const size_t parallelism = IntCast<size_t>(state_->options.parallelism_);
+  if (parallelism > 0) {
+    absl::MutexLock lock(&state_->mutex);
+    state_->mutex.Await(absl::Condition(
+        +[](State* state) ABSL_EXCLUSIVE_LOCKS_REQUIRED(state->mutex) {
+          return state->num_running <
+                     IntCast<size_t>(state->options.parallelism_) ||
+                 !state->status.ok();
+        },
+        state_.get()));
+  }
+  if (ABSL_PREDICT_FALSE(!CheckRuns())) return false;
+  std::string path;
+  int fd;
+  {
+    Status status = CreateRun(state_->options.temp_directory_, &path, &fd);
+    if (ABSL_PREDICT_FALSE(!status.ok())) return Fail(std::move(status));
+  }
+  const size_t run_index = state_->run_files.size();
+  state_->run_files.push_back(std::move(path));
+  std::vector<Entry> entries;
+  entries.swap(state_->buffer);
+  state_->buffer_bytes = 0;
+  if (parallelism == 0) {
+    Status status = state_->WriteRun(fd, &entries);
+    if (ABSL_PREDICT_FALSE(!status.ok())) {
+      return Fail(Annotate(status, absl::StrCat("writing run ", run_index)));
+    }
+    return true;
+  }
+  {
+    absl::MutexLock lock(&state_->mutex);
+    ++state_->num_running;
+  }
+  State* const state = state_.get();
+  state_->options.thread_pool_->Schedule(
+      [state, run_index, fd, entries = std::move(entries)]() mutable {
+        Status status = state->WriteRun(fd, &entries);
+        absl::MutexLock lock(&state->mutex);
+        if (ABSL_PREDICT_FALSE(!status.ok()) && state->status.ok()) {
+          state->status =
+              Annotate(status, absl::StrCat("writing run ", run_index));
+        }
+        --state->num_running;
+      });
+  return true;
+}
+
+void SortingRecordWriter::WaitForRuns() {
+  absl::MutexLock lock(&state_->mutex);
+  state_->mutex.Await(absl::Condition(
+      +[](State* state) ABSL_EXCLUSIVE_LOCKS_REQUIRED(state->mutex) {
+        return state->num_running == 0;
+      },
+      state_.get()));
+}
+
+bool SortingRecordWriter::CheckRuns() {
+  Status status;
+  {
+    absl::MutexLock lock(&state_->mutex);
+    status = state_->status;
+  }
+  if (ABSL_PREDICT_FALSE(!status.ok())) return Fail(std::move(status));
+  return true;
+}
+
+void SortingRecordWriter::DeleteRuns() {
+  for (size_t run_index = 0; run_index < state_->run_files.size();
+       ++run_index) {
+    state_->DeleteRun(run_index);
+  }
+}
+
+size_t SortingRecordWriter::num_runs() const {
+  return state_ == nullptr ? 0 : state_->run_files.size();
+}
+
+bool SortingRecordWriter::WriteRecord(
+    const google::protobuf::MessageLite& record) {
+  Chain serialized;
+  {
+    Status status = SerializeToChain(record, &serialized);
+    if (ABSL_PREDICT_FALSE(!status.ok())) return Fail(std::move(status));
+  }
+  return WriteRecord(std::string(std::move(serialized)));
+}
+
+bool SortingRecordWriter::WriteRecord(absl::string_view record) {
+  return WriteRecord(std::string(record));
+}
+
+bool SortingRecordWriter::WriteRecord(const Chain& record) {
+  return WriteRecord(std::string(record));
+}
+
+bool SortingRecordWriter::WriteRecord(std::string&& record) {
+  if (ABSL_PREDICT_FALSE(!healthy())) return false;
+  Entry entry;
+  if (state_->key != nullptr) entry.key = state_->key(record);
+  entry.record = std::move(record);
+  const uint64_t entry_bytes =
+      sizeof(Entry) + entry.key.size() + entry.record.size();
+  if (!state_->buffer.empty() &&
+      state_->buffer_bytes + entry_bytes > state_->max_buffer_bytes) {
+    if (ABSL_PREDICT_FALSE(!SpillBuffer())) return false;
+  }
+  state_->buffer_bytes += entry_bytes;
+  state_->buffer.push_back(std::move(entry));
+  return true;
+}
+
+Status MergeSortedRecords(
+    size_t num_srcs,
+    std::function<std::unique_ptr<RecordReaderBase>(size_t src_index)> open_src,
+    const SortKeyExtractor& key, RecordWriterBase* dest) {
+  if (ABSL_PREDICT_FALSE(!dest->healthy())) return dest->status();
+  std::vector<MergeSource> srcs(num_srcs);
+  // A min-heap of indices of sources which did not end, ordered by their
+  // current keys, then by their indices.
+  std::vector<size_t> heap;
+  heap.reserve(num_srcs);
+  const auto greater = [&](size_t a, size_t b) {
+    const absl::string_view a_key =
+        key == nullptr ? srcs[a].record : absl::string_view(srcs[a].key);
+    const absl::string_view b_key =
+        key == nullptr ? srcs[b].record : absl::string_view(srcs[b].key);
+    const int ordering = a_key.compare(b_key);
+    return ordering != 0 ? ordering > 0 : a > b;
+  };
+  for (size_t src_index = 0; src_index < num_srcs; ++src_index) {
+    MergeSource& src = srcs[src_index];
+    src.reader = open_src(src_index);
+    if (ABSL_PREDICT_FALSE(src.reader == nullptr)) {
+      return InvalidArgumentError(
+          absl::StrCat("Opening source ", src_index, " failed"));
+    }
+    bool has_record;
+    Status status = ReadNextRecord(key, &src, &has_record);
+    if (ABSL_PREDICT_FALSE(!status.ok())) {
+      return Annotate(status, absl::StrCat("reading source ", src_index));
+    }
+    if (has_record) heap.push_back(src_index);
+  }
+  std::make_heap(heap.begin(), heap.end(), greater);
+  while (!heap.empty()) {
+    std::pop_heap(heap.begin(), heap.end(), greater);
+    const size_t src_index = heap.back();
+    MergeSource& src = srcs[src_index];
+    if (ABSL_PREDICT_FALSE(!dest->WriteRecord(src.record))) {
+      return dest->status();
+    }
+    bool has_record;
+    Status status = ReadNextRecord(key, &src, &has_record);
+    if (ABSL_PREDICT_FALSE(!status.ok())) {
+      return Annotate(status, absl::StrCat("reading source ", src_index));
+    }
+    if (has_record) {
+      std::push_heap(heap.begin(), heap.end(), greater);
+    } else {
+      heap.pop_back();
+    }
+  }
+  for (size_t src_index = 0; src_index < num_srcs; ++src_index) {
+    MergeSource& src = srcs[src_index];
+    if (ABSL_PREDICT_FALSE(!src.reader->Close())) {
+      return Annotate(src.reader->status(),
+                      absl::StrCat("closing source ", src_index));
+    }
+  }
+  return OkStatus();
+}
+
+}  // namespace riegeli
@@ -0,0 +1,268 @@
+// Copyright 2017 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef RIEGELI_RECORDS_SORT_RECORDS_H_
+#define RIEGELI_RECORDS_SORT_RECORDS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <functional>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "absl/strings/string_view.h"
+#include "google/protobuf/message_lite.h"
+#include "riegeli/base/base.h"
+#include "riegeli/base/chain.h"
+#include "riegeli/base/object.h"
+#include "riegeli/base/parallelism.h"
+#include "riegeli/base/status.h"
+#include "riegeli/records/record_reader.h"
+#include "riegeli/records/record_writer.h"
+
+namespace riegeli {
+
+// Computes the sort key of a record, given its serialized form. Records are
+// ordered by their keys compared as byte strings.
+//
+// If `nullptr`, records are ordered by their serialized form.
+using SortKeyExtractor = std::function<std::string(absl::string_view record)>;
+
+// `SortingRecordWriter` writes records to a `RecordWriter` in the order of
+// their keys, sorting them externally if they do not fit in memory.
+//
+// Records are buffered up to a memory budget. When the buffer is full, it is
+// sorted and written to a temporary Riegeli/records file (a run) in background,
+// while further records are buffered. `Close()` merges the runs into the
+// destination. If all records fit in the buffer, no runs are written.
+//
+// Records with equal keys are written in the order of `WriteRecord()` calls.
+class SortingRecordWriter : public Object {
+ public:
+  class Options {
+   public:
+    Options() noexcept {}
+
+    // Sets the memory used for buffering records, shared by the buffer being
+    // filled and the buffers being sorted and written in background.
+    //
+    // The budget is approximate: the sizes of records and their keys are
+    // counted, and the buffer can exceed its part of the budget by the size of
+    // one record.
+    //
+    // Default: 256M
+    Options& set_memory_budget(uint64_t memory_budget) & {
+      RIEGELI_ASSERT_GT(memory_budget, 0u)
+          << "Failed precondition of "
+             "SortingRecordWriter::Options::set_memory_budget(): "
+             "zero memory budget";
+      memory_budget_ = memory_budget;
+      return *this;
+    }
+    Options&& set_memory_budget(uint64_t memory_budget) && {
+      return std::move(set_memory_budget(memory_budget));
+    }
+
+    // Sets the directory where runs are written. Runs are deleted when they
+    // are merged, or when the `SortingRecordWriter` is closed or destroyed.
+    //
+    // Default: "/tmp"
+    Options& set_temp_directory(std::string temp_directory) & {
+      temp_directory_ = std::move(temp_directory);
+      return *this;
+    }
+    Options&& set_temp_directory(std::string temp_directory) && {
+      return std::move(set_temp_directory(std::move(temp_directory)));
+    }
+
+    // Sets options of `RecordWriter`s of runs.
+    //
+    // Runs are read once, so cheap compression (`set_uncompressed()` or
+    // `set_snappy()`) is usually best. `set_parallelism()` of these options
+    // should remain 0, because runs are already written in background.
+    //
+    // Default: `RecordWriterBase::Options().set_snappy()`
+    Options& set_run_options(RecordWriterBase::Options run_options) & {
+      run_options_ = std::move(run_options);
+      return *this;
+    }
+    Options&& set_run_options(RecordWriterBase::Options run_options) && {
+      return std::move(set_run_options(std::move(run_options)));
+    }
+
+    // Sets the maximum number of runs sorted and written concurrently in
+    // background. If 0, runs are sorted and written in the calling thread.
+    //
+    // The memory budget is divided between the buffer being filled and
+    // `parallelism` buffers being sorted, so higher parallelism makes runs
+    // smaller.
+    //
+    // Default: 2
+    Options& set_parallelism(int parallelism) & {
+      RIEGELI_ASSERT_GE(parallelism, 0)
+          << "Failed precondition of "
+             "SortingRecordWriter::Options::set_parallelism(): "
+             "negative parallelism";
+      parallelism_ = parallelism;
+      return *this;
+    }
+    Options&& set_parallelism(int parallelism) && {
+      return std::move(set_parallelism(parallelism));
+    }
+
+    // Sets the maximum number of runs merged at once. If there are more runs,
+    // groups of consecutive runs are first merged into longer runs.
+    //
+    // Each merged run keeps a file open and a chunk decoded in memory.
+    //
+    // Default: 64
+    Options& set_max_merge_width(size_t max_merge_width) & {
+      RIEGELI_ASSERT_GE(max_merge_width, 2u)
+          << "Failed precondition of "
+             "SortingRecordWriter::Options::set_max_merge_width(): "
+             "merge width smaller than 2";
+      max_merge_width_ = max_merge_width;
+      return *this;
+    }
+    Options&& set_max_merge_width(size_t max_merge_width) && {
+      return std::move(set_max_merge_width(max_merge_width));
+    }
+
+    // Sets the thread pool where runs are sorted and written.
+    //
+    // The thread pool must outlive the `SortingRecordWriter`.
+    //
+    // Default: `&ThreadPool::global()`
+    Options& set_thread_pool(ThreadPool* thread_pool) & {
+      RIEGELI_ASSERT(thread_pool != nullptr)
+          << "Failed precondition of "
+             "SortingRecordWriter::Options::set_thread_pool(): "
+             "null thread pool";
+      thread_pool_ = thread_pool;
+      return *this;
+    }
+    Options&& set_thread_pool(ThreadPool* thread_pool) && {
+      return std::move(set_thread_pool(thread_pool));
+    }
+
+   private:
+    friend class SortingRecordWriter;
+
+    uint64_t memory_budget_ = uint64_t{256} << 20;
+    std::string temp_directory_ = "/tmp";
+    RecordWriterBase::Options run_options_ =
+        RecordWriterBase::Options().set_snappy();
+    int parallelism_ = 2;
+    size_t max_merge_width_ = 64;
+    ThreadPool* thread_pool_ = &ThreadPool::global();
+  };
+
+  // Creates a closed `SortingRecordWriter`.
+  SortingRecordWriter() noexcept;
+
+  // Will write sorted records to `dest`, ordered by keys computed by `key`.
+  //
+  // `dest` must outlive the `SortingRecordWriter`. It is not closed; sorted
+  // records are written to it by `Close()`.
+  SortingRecordWriter(RecordWriterBase* dest, SortKeyExtractor key,
+                      Options options = Options());
+
+  SortingRecordWriter(SortingRecordWriter&& that) noexcept;
+  SortingRecordWriter& operator=(SortingRecordWriter&& that) noexcept;
+
+  ~SortingRecordWriter();
+
+  // Adds the next record.
+  //
+  // `WriteRecord(google::protobuf::MessageLite)` serializes a proto message to
+  // raw bytes beforehand. The remaining overloads accept raw bytes.
+  //
+  // Because runs are written in background, a failure to write a run is
+  // reported by a later call.
+  //
+  // Return values:
+  //  * `true`  - success (`healthy()`)
+  //  * `false` - failure (`!healthy()`)
+  bool WriteRecord(const google::protobuf::MessageLite& record);
+  bool WriteRecord(absl::string_view record);
+  bool WriteRecord(std::string&& record);
+  bool WriteRecord(const Chain& record);
+
+  // Returns the number of runs written so far.
+  size_t num_runs() const;
+
+ protected:
+  // Merges the runs and writes all records to `dest`, sorted.
+  void Done() override;
+
+ private:
+  struct Entry;
+  struct State;
+
+  // Hands the buffer over to be sorted and written as a run.
+  //
+  // Return values:
+  //  * `true`  - success (`healthy()`)
+  //  * `false` - failure (`!healthy()`)
+  bool SpillBuffer();
+
+  // Merges all runs into `*dest_`, first merging groups of runs if there are
+  // more than `Options::set_max_merge_width()`.
+  //
+  // Return values:
+  //  * `true`  - success (`healthy()`)
+  //  * `false` - failure (`!healthy()`)
+  bool MergeAllRuns();
+
+  // Waits until background tasks stop interacting with `*state_`.
+  void WaitForRuns();
+
+  // Fails `*this` if writing a run failed.
+  //
+  // Return values:
+  //  * `true`  - success (`healthy()`)
+  //  * `false` - failure (`!healthy()`)
+  bool CheckRuns();
+
+  // Deletes runs which were not deleted yet.
+  void DeleteRuns();
+
+  RecordWriterBase* dest_ = nullptr;
+  std::unique_ptr<State> state_;
+};
+
+// Merges Riegeli/records sources, each already sorted by `key`, writing to
+// `dest` all their records in the order of their keys. Records with equal keys
+// are written in the order of the indices of their sources.
+//
+// All sources are opened by `open_src` at the beginning, in the order of their
+// indices, `0 <= src_index < num_srcs`, and are read concurrently. `open_src`
+// may return `nullptr` or a failed `RecordReader`.
+//
+// `dest` is not closed.
+//
+// Returns status:
+//  * `status.ok()`  - success
+//  * `!status.ok()` - failure
+Status MergeSortedRecords(
+    size_t num_srcs,
+    std::function<std::unique_ptr<RecordReaderBase>(size_t src_index)> open_src,
+    const SortKeyExtractor& key, RecordWriterBase* dest);
+
+}  // namespace riegeli
+
+#endif  // RIEGELI_RECORDS_SORT_RECORDS_H_
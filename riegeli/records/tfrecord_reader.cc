@@ -0,0 +1,219 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "riegeli/records/tfrecord_reader.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <cstring>
+#include <limits>
+#include <string>
+
+#include "absl/base/optimization.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/string_view.h"
+#include "crc32c/crc32c.h"
+#include "google/protobuf/message_lite.h"
+#include "riegeli/base/base.h"
+#include "riegeli/base/canonical_errors.h"
+#include "riegeli/base/chain.h"
+#include "riegeli/base/endian.h"
+#include "riegeli/base/status.h"
+#include "riegeli/bytes/message_parse.h"
+#include "riegeli/bytes/reader.h"
+#include "riegeli/bytes/zlib_reader.h"
+
+namespace riegeli {
+
+namespace {
+
+// The size of the record length together with its checksum.
+constexpr size_t kHeaderSize = sizeof(uint64_t) + sizeof(uint32_t);
+
+// TFRecord files store CRC32C checksums masked, because computing the CRC of a
+// string containing embedded CRCs is problematic.
+inline uint32_t MaskCrc(uint32_t crc) {
+  return ((crc >> 15) | (crc << 17)) + 0xa282ead8;
+}
+
+inline uint32_t ReadChecksum(const char* src) {
+  uint32_t word;
+  std::memcpy(&word, src, sizeof(word));
+  return ReadLittleEndian32(word);
+}
+
+// Returns `true` if `data` begins like a gzip or zlib stream.
+bool LooksCompressed(absl::string_view data) {
+  if (data.size() < 2) return false;
+  const uint8_t byte0 = static_cast<uint8_t>(data[0]);
+  const uint8_t byte1 = static_cast<uint8_t>(data[1]);
+  if (byte0 == 0x1f && byte1 == 0x8b) return true;
+  return (byte0 & 0x0f) == 8 && ((uint32_t{byte0} << 8) | byte1) % 31 == 0;
+}
+
+// Detects whether the file read by `*src` is compressed.
+//
+// A TFRecord file begins with the length of the first record followed by its
+// masked checksum, which a compressed stream is unlikely to match.
+TFRecordReaderBase::Compression DetectCompression(Reader* src) {
+  if (!src->Pull(kHeaderSize)) {
+    // Too short to hold a record. If it is not a compressed stream reading
+    // reports it as truncated.
+    return LooksCompressed(absl::string_view(src->cursor(), src->available()))
+               ? TFRecordReaderBase::Compression::kZlib
+               : TFRecordReaderBase::Compression::kNone;
+  }
+  return MaskCrc(crc32c::Crc32c(src->cursor(), sizeof(uint64_t))) ==
+                 ReadChecksum(src->cursor() + sizeof(uint64_t))
+             ? TFRecordReaderBase::Compression::kNone
+             : TFRecordReaderBase::Compression::kZlib;
+}
+
+}  // namespace
+
+void TFRecordReaderBase::Initialize(Reader* src, Compression compression,
+                                    bool verify_checksums) {
+  RIEGELI_ASSERT(src != nullptr)
+      << "Failed precondition of TFRecordReader: null Reader pointer";
+  verify_checksums_ = verify_checksums;
+  if (compression == Compression::kAutodetect) {
+    compression = DetectCompression(src);
+  }
+  compression_ = compression;
+  if (compression_ == Compression::kZlib) {
+    decompressor_.Reset(src, ZlibReaderBase::Options().set_header(
+                                 ZlibReaderBase::Header::kZlibOrGzip));
+  }
+}
+
+void TFRecordReaderBase::Done() {
+  if (compression_ == Compression::kZlib) {
+    if (ABSL_PREDICT_FALSE(!decompressor_.Close())) Fail(decompressor_);
+  }
+  record_ = Chain();
+}
+
+inline bool TFRecordReaderBase::FailTruncated(Reader* src) {
+  if (ABSL_PREDICT_FALSE(!src->healthy())) return Fail(*src);
+  return Fail(DataLossError("Truncated TFRecord file"));
+}
+
+inline bool TFRecordReaderBase::ReadLength(Reader* src, uint64_t* length) {
+  if (ABSL_PREDICT_FALSE(!src->Pull(kHeaderSize))) {
+    if (ABSL_PREDICT_FALSE(!src->healthy())) return Fail(*src);
+    if (ABSL_PREDICT_FALSE(src->available() > 0)) return FailTruncated(src);
+    return false;
+  }
+  const char* const cursor = src->cursor();
+  if (verify_checksums_ &&
+      ABSL_PREDICT_FALSE(MaskCrc(crc32c::Crc32c(cursor, sizeof(uint64_t))) !=
+                         ReadChecksum(cursor + sizeof(uint64_t)))) {
+    return Fail(DataLossError(absl::StrCat(
+        "Corrupted TFRecord length at position ", src->pos())));
+  }
+  uint64_t word;
+  std::memcpy(&word, cursor, sizeof(word));
+  *length = ReadLittleEndian64(word);
+  src->set_cursor(cursor + kHeaderSize);
+  if (ABSL_PREDICT_FALSE(*length > std::numeric_limits<size_t>::max() -
+                                       sizeof(uint32_t))) {
+    return Fail(ResourceExhaustedError(
+        absl::StrCat("TFRecord too large: ", *length)));
+  }
+  return true;
+}
+
+inline bool TFRecordReaderBase::VerifyChecksum(Reader* src, uint32_t checksum) {
+  if (ABSL_PREDICT_FALSE(!src->Pull(sizeof(uint32_t)))) {
+    return FailTruncated(src);
+  }
+  if (verify_checksums_ &&
+      ABSL_PREDICT_FALSE(MaskCrc(checksum) != ReadChecksum(src->cursor()))) {
+    return Fail(DataLossError(absl::StrCat(
+        "Corrupted TFRecord contents at position ", src->pos())));
+  }
+  src->set_cursor(src->cursor() + sizeof(uint32_t));
+  return true;
+}
+
+bool TFRecordReaderBase::ReadRecord(google::protobuf::MessageLite* record) {
+  if (ABSL_PREDICT_FALSE(!ReadRecord(&record_))) return false;
+  const Status status = ParseFromChain(record, record_);
+  if (ABSL_PREDICT_FALSE(!status.ok())) {
+    return Fail(DataLossError(absl::StrCat(
+        "Failed to parse TFRecord ending at position ", pos(), ": ",
+        status.message())));
+  }
+  return true;
+}
+
+bool TFRecordReaderBase::ReadRecord(absl::string_view* record) {
+  if (ABSL_PREDICT_FALSE(!healthy())) return false;
+  Reader* const src = reader();
+  uint64_t length;
+  if (ABSL_PREDICT_FALSE(!ReadLength(src, &length))) return false;
+  // Pull the checksum together with the contents, so that reading the checksum
+  // does not invalidate `*record`.
+  if (ABSL_PREDICT_FALSE(
+          !src->Pull(IntCast<size_t>(length) + sizeof(uint32_t)))) {
+    return FailTruncated(src);
+  }
+  const absl::string_view contents(src->cursor(), IntCast<size_t>(length));
+  if (verify_checksums_ &&
+      ABSL_PREDICT_FALSE(
+          MaskCrc(crc32c::Crc32c(contents.data(), contents.size())) !=
+          ReadChecksum(contents.data() + contents.size()))) {
+    return Fail(DataLossError(absl::StrCat(
+        "Corrupted TFRecord contents at position ", src->pos())));
+  }
+  src->set_cursor(contents.data() + contents.size() + sizeof(uint32_t));
+  *record = contents;
+  return true;
+}
+
+bool TFRecordReaderBase::ReadRecord(std::string* record) {
+  if (ABSL_PREDICT_FALSE(!healthy())) return false;
+  Reader* const src = reader();
+  uint64_t length;
+  if (ABSL_PREDICT_FALSE(!ReadLength(src, &length))) return false;
+  record->clear();
+  if (ABSL_PREDICT_FALSE(!src->Read(record, IntCast<size_t>(length)))) {
+    return FailTruncated(src);
+  }
+  return VerifyChecksum(
+      src, verify_checksums_ ? crc32c::Crc32c(record->data(), record->size())
+                             : uint32_t{0});
+}
+
+bool TFRecordReaderBase::ReadRecord(Chain* record) {
+  if (ABSL_PREDICT_FALSE(!healthy())) return false;
+  Reader* const src = reader();
+  uint64_t length;
+  if (ABSL_PREDICT_FALSE(!ReadLength(src, &length))) return false;
+  record->Clear();
+  if (ABSL_PREDICT_FALSE(!src->Read(record, IntCast<size_t>(length)))) {
+    return FailTruncated(src);
+  }
+  uint32_t checksum = 0;
+  if (verify_checksums_) {
+    for (const absl::string_view block : record->blocks()) {
+      checksum = crc32c::Extend(
+          checksum, reinterpret_cast<const uint8_t*>(block.data()),
+          block.size());
+    }
+  }
+  return VerifyChecksum(src, checksum);
+}
+
+}  // namespace riegeli
@@ -0,0 +1,340 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef RIEGELI_RECORDS_TFRECORD_READER_H_
+#define RIEGELI_RECORDS_TFRECORD_READER_H_
+
+#include <stdint.h>
+
+#include <string>
+#include <tuple>
+#include <utility>
+
+#include "absl/base/optimization.h"
+#include "absl/strings/string_view.h"
+#include "google/protobuf/message_lite.h"
+#include "riegeli/base/base.h"
+#include "riegeli/base/chain.h"
+#include "riegeli/base/dependency.h"
+#include "riegeli/base/object.h"
+#include "riegeli/base/resetter.h"
+#include "riegeli/bytes/reader.h"
+#include "riegeli/bytes/zlib_reader.h"
+
+namespace riegeli {
+
+// Template parameter independent part of `TFRecordReader`.
+class TFRecordReaderBase : public Object {
+ public:
+  enum class Compression {
+    // Detect from the beginning of the file whether it is compressed.
+    kAutodetect,
+    // Not compressed.
+    kNone,
+    // Compressed with zlib or gzip, like TensorFlow's `ZLIB` and `GZIP`
+    // compression types.
+    kZlib,
+  };
+
+  class Options {
+   public:
+    Options() noexcept {}
+
+    // Sets the compression of the file.
+    //
+    // Default: `Compression::kAutodetect`
+    Options& set_compression(Compression compression) & {
+      compression_ = compression;
+      return *this;
+    }
+    Options&& set_compression(Compression compression) && {
+      return std::move(set_compression(compression));
+    }
+
+    // If `false`, checksums of record lengths and record contents are not
+    // verified. This makes reading faster, but corruption is not detected.
+    //
+    // Default: `true`
+    Options& set_verify_checksums(bool verify_checksums) & {
+      verify_checksums_ = verify_checksums;
+      return *this;
+    }
+    Options&& set_verify_checksums(bool verify_checksums) && {
+      return std::move(set_verify_checksums(verify_checksums));
+    }
+
+   private:
+    template <typename Src>
+    friend class TFRecordReader;
+
+    Compression compression_ = Compression::kAutodetect;
+    bool verify_checksums_ = true;
+  };
+
+  // Returns the Riegeli/bytes `Reader` of the file. Unchanged by `Close()`.
+  virtual Reader* src_reader() = 0;
+  virtual const Reader* src_reader() const = 0;
+
+  // Returns the compression of the file, detected if it was
+  // `Compression::kAutodetect`.
+  Compression compression() const { return compression_; }
+
+  // Reads the next record.
+  //
+  // `ReadRecord(google::protobuf::MessageLite*)` parses raw bytes to a proto
+  // message after reading. The remaining overloads read raw bytes. For
+  // `ReadRecord(absl::string_view*)` the `absl::string_view` is valid until
+  // the next non-const operation on this `TFRecordReader`.
+  //
+  // Return values:
+  //  * `true`                      - success (`*record` is set)
+  //  * `false` (when `healthy()`)  - source ends
+  //  * `false` (when `!healthy()`) - failure
+  bool ReadRecord(google::protobuf::MessageLite* record);
+  bool ReadRecord(absl::string_view* record);
+  bool ReadRecord(std::string* record);
+  bool ReadRecord(Chain* record);
+
+  // Returns the position of the next record in the uncompressed file.
+  Position pos() const;
+
+ protected:
+  explicit TFRecordReaderBase(InitiallyClosed) noexcept
+      : Object(kInitiallyClosed) {}
+  explicit TFRecordReaderBase(InitiallyOpen) noexcept
+      : Object(kInitiallyOpen) {}
+
+  TFRecordReaderBase(TFRecordReaderBase&& that) noexcept;
+  TFRecordReaderBase& operator=(TFRecordReaderBase&& that) noexcept;
+
+  void Reset(InitiallyClosed);
+  void Reset(InitiallyOpen);
+  void Initialize(Reader* src, Compression compression, bool verify_checksums);
+
+  void Done() override;
+
+ private:
+  // Returns the `Reader` of uncompressed data.
+  Reader* reader();
+  const Reader* reader() const;
+
+  // Reads the length of the next record.
+  //
+  // Return values:
+  //  * `true`                      - success (`*length` is set)
+  //  * `false` (when `healthy()`)  - source ends
+  //  * `false` (when `!healthy()`) - failure
+  bool ReadLength(Reader* src, uint64_t* length);
+
+  // Reads the checksum of record contents, and compares it with `checksum`.
+  //
+  // Return values:
+  //  * `true`  - success (`healthy()`)
+  //  * `false` - failure (`!healthy()`)
+  bool VerifyChecksum(Reader* src, uint32_t checksum);
+
+  ABSL_ATTRIBUTE_COLD bool FailTruncated(Reader* src);
+
+  Compression compression_ = Compression::kNone;
+  bool verify_checksums_ = true;
+  // Decompresses the file if `compression_ == Compression::kZlib`.
+  ZlibReader<> decompressor_;
+  // Buffer for `ReadRecord(google::protobuf::MessageLite*)`.
+  Chain record_;
+};
+
+// `TFRecordReader` reads records of a TFRecord file, i.e. the format of
+// TensorFlow's `tensorflow::io::RecordReader`, from a Riegeli/bytes `Reader`.
+//
+// Each record is stored as its length (8 bytes, little endian), the masked
+// CRC32C of the length (4 bytes), the record contents, and the masked CRC32C of
+// the contents (4 bytes).
+//
+// The `Src` template parameter specifies the type of the object providing and
+// possibly owning the byte `Reader`. `Src` must support
+// `Dependency<Reader*, Src>`, e.g. `Reader*` (not owned, default),
+// `std::unique_ptr<Reader>` (owned), `FdReader<>` (owned).
+//
+// The byte `Reader` must not be accessed until the `TFRecordReader` is closed
+// or no longer used.
+template <typename Src = Reader*>
+class TFRecordReader : public TFRecordReaderBase {
+ public:
+  // Creates a closed `TFRecordReader`.
+  TFRecordReader() noexcept : TFRecordReaderBase(kInitiallyClosed) {}
+
+  // Will read from the byte `Reader` provided by `src`.
+  explicit TFRecordReader(const Src& src, Options options = Options());
+  explicit TFRecordReader(Src&& src, Options options = Options());
+
+  // Will read from the byte `Reader` provided by a `Src` constructed from
+  // elements of `src_args`. This avoids constructing a temporary `Src` and
+  // moving from it.
+  template <typename... SrcArgs>
+  explicit TFRecordReader(std::tuple<SrcArgs...> src_args,
+                          Options options = Options());
+
+  TFRecordReader(TFRecordReader&& that) noexcept;
+  TFRecordReader& operator=(TFRecordReader&& that) noexcept;
+
+  // Makes `*this` equivalent to a newly constructed `TFRecordReader`. This
+  // avoids constructing a temporary `TFRecordReader` and moving from it.
+  void Reset();
+  void Reset(const Src& src, Options options = Options());
+  void Reset(Src&& src, Options options = Options());
+  template <typename... SrcArgs>
+  void Reset(std::tuple<SrcArgs...> src_args, Options options = Options());
+
+  // Returns the object providing and possibly owning the byte `Reader`.
+  // Unchanged by `Close()`.
+  Src& src() { return src_.manager(); }
+  const Src& src() const { return src_.manager(); }
+  Reader* src_reader() override { return src_.get(); }
+  const Reader* src_reader() const override { return src_.get(); }
+
+ protected:
+  void Done() override;
+
+ private:
+  // The object providing and possibly owning the byte `Reader`.
+  Dependency<Reader*, Src> src_;
+};
+
+// Implementation details follow.
+
+inline TFRecordReaderBase::TFRecordReaderBase(
+    TFRecordReaderBase&& that) noexcept
+    : Object(std::move(that)),
+      compression_(that.compression_),
+      verify_checksums_(that.verify_checksums_),
+      decompressor_(std::move(that.decompressor_)),
+      record_(std::move(that.record_)) {}
+
+inline TFRecordReaderBase& TFRecordReaderBase::operator=(
+    TFRecordReaderBase&& that) noexcept {
+  Object::operator=(std::move(that));
+  compression_ = that.compression_;
+  verify_checksums_ = that.verify_checksums_;
+  decompressor_ = std::move(that.decompressor_);
+  record_ = std::move(that.record_);
+  return *this;
+}
+
+inline void TFRecordReaderBase::Reset(InitiallyClosed) {
+  Object::Reset(kInitiallyClosed);
+  compression_ = Compression::kNone;
+  verify_checksums_ = true;
+  decompressor_.Reset();
+  record_.Clear();
+}
+
+inline void TFRecordReaderBase::Reset(InitiallyOpen) {
+  Object::Reset(kInitiallyOpen);
+  compression_ = Compression::kNone;
+  verify_checksums_ = true;
+  decompressor_.Reset();
+  record_.Clear();
+}
+
+inline Reader* TFRecordReaderBase::reader() {
+  if (compression_ == Compression::kZlib) return &decompressor_;
+  return src_reader();
+}
+
+inline const Reader* TFRecordReaderBase::reader() const {
+  if (compression_ == Compression::kZlib) return &decompressor_;
+  return src_reader();
+}
+
+inline Position TFRecordReaderBase::pos() const {
+  const Reader* const src = reader();
+  if (ABSL_PREDICT_FALSE(src == nullptr)) return 0;
+  return src->pos();
+}
+
+template <typename Src>
+inline TFRecordReader<Src>::TFRecordReader(const Src& src, Options options)
+    : TFRecordReaderBase(kInitiallyOpen), src_(src) {
+  Initialize(src_.get(), options.compression_, options.verify_checksums_);
+}
+
+template <typename Src>
+inline TFRecordReader<Src>::TFRecordReader(Src&& src, Options options)
+    : TFRecordReaderBase(kInitiallyOpen), src_(std::move(src)) {
+  Initialize(src_.get(), options.compression_, options.verify_checksums_);
+}
+
+template <typename Src>
+template <typename... SrcArgs>
+inline TFRecordReader<Src>::TFRecordReader(std::tuple<SrcArgs...> src_args,
+                                           Options options)
+    : TFRecordReaderBase(kInitiallyOpen), src_(std::move(src_args)) {
+  Initialize(src_.get(), options.compression_, options.verify_checksums_);
+}
+
+template <typename Src>
+inline TFRecordReader<Src>::TFRecordReader(TFRecordReader&& that) noexcept
+    : TFRecordReaderBase(std::move(that)), src_(std::move(that.src_)) {}
+
+template <typename Src>
+inline TFRecordReader<Src>& TFRecordReader<Src>::operator=(
+    TFRecordReader&& that) noexcept {
+  TFRecordReaderBase::operator=(std::move(that));
+  src_ = std::move(that.src_);
+  return *this;
+}
+
+template <typename Src>
+inline void TFRecordReader<Src>::Reset() {
+  TFRecordReaderBase::Reset(kInitiallyClosed);
+  src_.Reset();
+}
+
+template <typename Src>
+inline void TFRecordReader<Src>::Reset(const Src& src, Options options) {
+  TFRecordReaderBase::Reset(kInitiallyOpen);
+  src_.Reset(src);
+  Initialize(src_.get(), options.compression_, options.verify_checksums_);
+}
+
+template <typename Src>
+inline void TFRecordReader<Src>::Reset(Src&& src, Options options) {
+  TFRecordReaderBase::Reset(kInitiallyOpen);
+  src_.Reset(std::move(src));
+  Initialize(src_.get(), options.compression_, options.verify_checksums_);
+}
+
+template <typename Src>
+template <typename... SrcArgs>
+inline void TFRecordReader<Src>::Reset(std::tuple<SrcArgs...> src_args,
+                                       Options options) {
+  TFRecordReaderBase::Reset(kInitiallyOpen);
+  src_.Reset(std::move(src_args));
+  Initialize(src_.get(), options.compression_, options.verify_checksums_);
+}
+
+template <typename Src>
+void TFRecordReader<Src>::Done() {
+  TFRecordReaderBase::Done();
+  if (src_.is_owning()) {
+    if (ABSL_PREDICT_FALSE(!src_->Close())) Fail(*src_);
+  }
+}
+
+template <typename Src>
+struct Resetter<TFRecordReader<Src>> : ResetterByReset<TFRecordReader<Src>> {};
+
+}  // namespace riegeli
+
+#endif  // RIEGELI_RECORDS_TFRECORD_READER_H_
@@ -0,0 +1,142 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "riegeli/records/tfrecord_writer.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <cstring>
+#include <utility>
+
+#include "absl/base/optimization.h"
+#include "absl/strings/string_view.h"
+#include "crc32c/crc32c.h"
+#include "google/protobuf/message_lite.h"
+#include "riegeli/base/base.h"
+#include "riegeli/base/chain.h"
+#include "riegeli/base/endian.h"
+#include "riegeli/base/status.h"
+#include "riegeli/bytes/message_serialize.h"
+#include "riegeli/bytes/writer.h"
+#include "riegeli/bytes/zlib_writer.h"
+
+namespace riegeli {
+
+namespace {
+
+// The size of the record length together with its checksum.
+constexpr size_t kHeaderSize = sizeof(uint64_t) + sizeof(uint32_t);
+
+// TFRecord files store CRC32C checksums masked, because computing the CRC of a
+// string containing embedded CRCs is problematic.
+inline uint32_t MaskCrc(uint32_t crc) {
+  return ((crc >> 15) | (crc << 17)) + 0xa282ead8;
+}
+
+inline void WriteChecksumTo(uint32_t checksum, char* dest) {
+  const uint32_t word = WriteLittleEndian32(MaskCrc(checksum));
+  std::memcpy(dest, &word, sizeof(word));
+}
+
+}  // namespace
+
+void TFRecordWriterBase::Initialize(Writer* dest, Compression compression,
+                                    ZlibWriterBase::Options zlib_options) {
+  RIEGELI_ASSERT(dest != nullptr)
+      << "Failed precondition of TFRecordWriter: null Writer pointer";
+  compression_ = compression;
+  switch (compression_) {
+    case Compression::kNone:
+      return;
+    case Compression::kZlib:
+      compressor_.Reset(dest, std::move(zlib_options)
+                                  .set_header(ZlibWriterBase::Header::kZlib));
+      return;
+    case Compression::kGzip:
+      compressor_.Reset(dest, std::move(zlib_options)
+                                  .set_header(ZlibWriterBase::Header::kGzip));
+      return;
+  }
+  RIEGELI_ASSERT_UNREACHABLE()
+      << "Unknown compression: " << static_cast<int>(compression_);
+}
+
+void TFRecordWriterBase::Done() {
+  if (compression_ != Compression::kNone) {
+    if (ABSL_PREDICT_FALSE(!compressor_.Close())) Fail(compressor_);
+  }
+  record_ = Chain();
+}
+
+inline bool TFRecordWriterBase::WriteLength(Writer* dest, size_t length) {
+  if (ABSL_PREDICT_FALSE(!dest->Push(kHeaderSize))) return Fail(*dest);
+  char* const cursor = dest->cursor();
+  const uint64_t word = WriteLittleEndian64(IntCast<uint64_t>(length));
+  std::memcpy(cursor, &word, sizeof(word));
+  WriteChecksumTo(crc32c::Crc32c(cursor, sizeof(word)), cursor + sizeof(word));
+  dest->set_cursor(cursor + kHeaderSize);
+  return true;
+}
+
+inline bool TFRecordWriterBase::WriteChecksum(Writer* dest, uint32_t checksum) {
+  if (ABSL_PREDICT_FALSE(!dest->Push(sizeof(uint32_t)))) return Fail(*dest);
+  WriteChecksumTo(checksum, dest->cursor());
+  dest->set_cursor(dest->cursor() + sizeof(uint32_t));
+  return true;
+}
+
+bool TFRecordWriterBase::WriteRecord(
+    const google::protobuf::MessageLite& record) {
+  if (ABSL_PREDICT_FALSE(!healthy())) return false;
+  record_.Clear();
+  const Status status = SerializeToChain(record, &record_);
+  if (ABSL_PREDICT_FALSE(!status.ok())) return Fail(status);
+  return WriteRecord(record_);
+}
+
+bool TFRecordWriterBase::WriteRecord(absl::string_view record) {
+  if (ABSL_PREDICT_FALSE(!healthy())) return false;
+  Writer* const dest = writer();
+  if (ABSL_PREDICT_FALSE(!WriteLength(dest, record.size()))) return false;
+  if (ABSL_PREDICT_FALSE(!dest->Write(record))) return Fail(*dest);
+  return WriteChecksum(dest, crc32c::Crc32c(record.data(), record.size()));
+}
+
+bool TFRecordWriterBase::WriteRecord(const Chain& record) {
+  if (ABSL_PREDICT_FALSE(!healthy())) return false;
+  Writer* const dest = writer();
+  if (ABSL_PREDICT_FALSE(!WriteLength(dest, record.size()))) return false;
+  if (ABSL_PREDICT_FALSE(!dest->Write(record))) return Fail(*dest);
+  uint32_t checksum = 0;
+  for (const absl::string_view block : record.blocks()) {
+    checksum = crc32c::Extend(
+        checksum, reinterpret_cast<const uint8_t*>(block.data()), block.size());
+  }
+  return WriteChecksum(dest, checksum);
+}
+
+bool TFRecordWriterBase::Flush(FlushType flush_type) {
+  if (ABSL_PREDICT_FALSE(!healthy())) return false;
+  if (compression_ != Compression::kNone) {
+    if (ABSL_PREDICT_FALSE(!compressor_.Flush(flush_type))) {
+      return Fail(compressor_);
+    }
+    return true;
+  }
+  Writer* const dest = dest_writer();
+  if (ABSL_PREDICT_FALSE(!dest->Flush(flush_type))) return Fail(*dest);
+  return true;
+}
+
+}  // namespace riegeli
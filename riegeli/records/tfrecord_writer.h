@@ -0,0 +1,327 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef RIEGELI_RECORDS_TFRECORD_WRITER_H_
+#define RIEGELI_RECORDS_TFRECORD_WRITER_H_
+
+#include <tuple>
+#include <utility>
+
+#include "absl/base/optimization.h"
+#include "absl/strings/string_view.h"
+#include "google/protobuf/message_lite.h"
+#include "riegeli/base/base.h"
+#include "riegeli/base/chain.h"
+#include "riegeli/base/dependency.h"
+#include "riegeli/base/object.h"
+#include "riegeli/base/resetter.h"
+#include "riegeli/bytes/writer.h"
+#include "riegeli/bytes/zlib_writer.h"
+
+namespace riegeli {
+
+// Template parameter independent part of `TFRecordWriter`.
+class TFRecordWriterBase : public Object {
+ public:
+  enum class Compression {
+    // Not compressed.
+    kNone,
+    // Compressed with zlib, like TensorFlow's `ZLIB` compression type.
+    kZlib,
+    // Compressed with gzip, like TensorFlow's `GZIP` compression type.
+    kGzip,
+  };
+
+  class Options {
+   public:
+    Options() noexcept {}
+
+    // Sets the compression of the file.
+    //
+    // Default: `Compression::kNone`
+    Options& set_compression(Compression compression) & {
+      compression_ = compression;
+      return *this;
+    }
+    Options&& set_compression(Compression compression) && {
+      return std::move(set_compression(compression));
+    }
+
+    // Options for `ZlibWriter` used if the file is compressed, e.g.
+    // `set_compression_level()` and `set_parallelism()`. Its header is
+    // determined by `set_compression()`.
+    //
+    // Default: `ZlibWriterBase::Options()`
+    Options& set_zlib_options(const ZlibWriterBase::Options& zlib_options) & {
+      zlib_options_ = zlib_options;
+      return *this;
+    }
+    Options&& set_zlib_options(const ZlibWriterBase::Options& zlib_options) && {
+      return std::move(set_zlib_options(zlib_options));
+    }
+
+   private:
+    template <typename Dest>
+    friend class TFRecordWriter;
+
+    Compression compression_ = Compression::kNone;
+    ZlibWriterBase::Options zlib_options_;
+  };
+
+  // Returns the Riegeli/bytes `Writer` of the file. Unchanged by `Close()`.
+  virtual Writer* dest_writer() = 0;
+  virtual const Writer* dest_writer() const = 0;
+
+  // Writes the next record.
+  //
+  // `WriteRecord(const google::protobuf::MessageLite&)` serializes a proto
+  // message to raw bytes beforehand. The remaining overloads accept raw bytes.
+  //
+  // Return values:
+  //  * `true`  - success (`healthy()`)
+  //  * `false` - failure (`!healthy()`)
+  bool WriteRecord(const google::protobuf::MessageLite& record);
+  bool WriteRecord(absl::string_view record);
+  bool WriteRecord(const Chain& record);
+
+  // Pushes buffered data to the destination.
+  //
+  // If the file is compressed, this finishes a deflate block, which makes
+  // compression slightly worse.
+  //
+  // Return values:
+  //  * `true`  - success (`healthy()`)
+  //  * `false` - failure (`!healthy()`)
+  bool Flush(FlushType flush_type);
+
+  // Returns the position after the last record in the uncompressed file.
+  Position pos() const;
+
+ protected:
+  explicit TFRecordWriterBase(InitiallyClosed) noexcept
+      : Object(kInitiallyClosed) {}
+  explicit TFRecordWriterBase(InitiallyOpen) noexcept
+      : Object(kInitiallyOpen) {}
+
+  TFRecordWriterBase(TFRecordWriterBase&& that) noexcept;
+  TFRecordWriterBase& operator=(TFRecordWriterBase&& that) noexcept;
+
+  void Reset(InitiallyClosed);
+  void Reset(InitiallyOpen);
+  void Initialize(Writer* dest, Compression compression,
+                  ZlibWriterBase::Options zlib_options);
+
+  void Done() override;
+
+ private:
+  // Returns the `Writer` of uncompressed data.
+  Writer* writer();
+  const Writer* writer() const;
+
+  // Writes the length of the next record together with its checksum.
+  bool WriteLength(Writer* dest, size_t length);
+
+  // Writes the checksum of record contents.
+  bool WriteChecksum(Writer* dest, uint32_t checksum);
+
+  Compression compression_ = Compression::kNone;
+  // Compresses the file if `compression_ != Compression::kNone`.
+  ZlibWriter<> compressor_;
+  // Buffer for `WriteRecord(const google::protobuf::MessageLite&)`.
+  Chain record_;
+};
+
+// `TFRecordWriter` writes records of a TFRecord file, i.e. the format of
+// TensorFlow's `tensorflow::io::RecordWriter`, to a Riegeli/bytes `Writer`.
+//
+// The `Dest` template parameter specifies the type of the object providing and
+// possibly owning the byte `Writer`. `Dest` must support
+// `Dependency<Writer*, Dest>`, e.g. `Writer*` (not owned, default),
+// `std::unique_ptr<Writer>` (owned), `FdWriter<>` (owned).
+//
+// The byte `Writer` must not be accessed until the `TFRecordWriter` is closed
+// or no longer used.
+template <typename Dest = Writer*>
+class TFRecordWriter : public TFRecordWriterBase {
+ public:
+  // Creates a closed `TFRecordWriter`.
+  TFRecordWriter() noexcept : TFRecordWriterBase(kInitiallyClosed) {}
+
+  // Will write to the byte `Writer` provided by `dest`.
+  explicit TFRecordWriter(const Dest& dest, Options options = Options());
+  explicit TFRecordWriter(Dest&& dest, Options options = Options());
+
+  // Will write to the byte `Writer` provided by a `Dest` constructed from
+  // elements of `dest_args`. This avoids constructing a temporary `Dest` and
+  // moving from it.
+  template <typename... DestArgs>
+  explicit TFRecordWriter(std::tuple<DestArgs...> dest_args,
+                          Options options = Options());
+
+  TFRecordWriter(TFRecordWriter&& that) noexcept;
+  TFRecordWriter& operator=(TFRecordWriter&& that) noexcept;
+
+  // Makes `*this` equivalent to a newly constructed `TFRecordWriter`. This
+  // avoids constructing a temporary `TFRecordWriter` and moving from it.
+  void Reset();
+  void Reset(const Dest& dest, Options options = Options());
+  void Reset(Dest&& dest, Options options = Options());
+  template <typename... DestArgs>
+  void Reset(std::tuple<DestArgs...> dest_args, Options options = Options());
+
+  // Returns the object providing and possibly owning the byte `Writer`.
+  // Unchanged by `Close()`.
+  Dest& dest() { return dest_.manager(); }
+  const Dest& dest() const { return dest_.manager(); }
+  Writer* dest_writer() override { return dest_.get(); }
+  const Writer* dest_writer() const override { return dest_.get(); }
+
+ protected:
+  void Done() override;
+
+ private:
+  // The object providing and possibly owning the byte `Writer`.
+  Dependency<Writer*, Dest> dest_;
+};
+
+// Implementation details follow.
+
+inline TFRecordWriterBase::TFRecordWriterBase(
+    TFRecordWriterBase&& that) noexcept
+    : Object(std::move(that)),
+      compression_(that.compression_),
+      compressor_(std::move(that.compressor_)),
+      record_(std::move(that.record_)) {}
+
+inline TFRecordWriterBase& TFRecordWriterBase::operator=(
+    TFRecordWriterBase&& that) noexcept {
+  Object::operator=(std::move(that));
+  compression_ = that.compression_;
+  compressor_ = std::move(that.compressor_);
+  record_ = std::move(that.record_);
+  return *this;
+}
+
+inline void TFRecordWriterBase::Reset(InitiallyClosed) {
+  Object::Reset(kInitiallyClosed);
+  compression_ = Compression::kNone;
+  compressor_.Reset();
+  record_.Clear();
+}
+
+inline void TFRecordWriterBase::Reset(InitiallyOpen) {
+  Object::Reset(kInitiallyOpen);
+  compression_ = Compression::kNone;
+  compressor_.Reset();
+  record_.Clear();
+}
+
+inline Writer* TFRecordWriterBase::writer() {
+  if (compression_ != Compression::kNone) return &compressor_;
+  return dest_writer();
+}
+
+inline const Writer* TFRecordWriterBase::writer() const {
+  if (compression_ != Compression::kNone) return &compressor_;
+  return dest_writer();
+}
+
+inline Position TFRecordWriterBase::pos() const {
+  const Writer* const dest = writer();
+  if (ABSL_PREDICT_FALSE(dest == nullptr)) return 0;
+  return dest->pos();
+}
+
+template <typename Dest>
+inline TFRecordWriter<Dest>::TFRecordWriter(const Dest& dest, Options options)
+    : TFRecordWriterBase(kInitiallyOpen), dest_(dest) {
+  Initialize(dest_.get(), options.compression_,
+             std::move(options.zlib_options_));
+}
+
+template <typename Dest>
+inline TFRecordWriter<Dest>::TFRecordWriter(Dest&& dest, Options options)
+    : TFRecordWriterBase(kInitiallyOpen), dest_(std::move(dest)) {
+  Initialize(dest_.get(), options.compression_,
+             std::move(options.zlib_options_));
+}
+
+template <typename Dest>
+template <typename... DestArgs>
+inline TFRecordWriter<Dest>::TFRecordWriter(std::tuple<DestArgs...> dest_args,
+                                            Options options)
+    : TFRecordWriterBase(kInitiallyOpen), dest_(std::move(dest_args)) {
+  Initialize(dest_.get(), options.compression_,
+             std::move(options.zlib_options_));
+}
+
+template <typename Dest>
+inline TFRecordWriter<Dest>::TFRecordWriter(TFRecordWriter&& that) noexcept
+    : TFRecordWriterBase(std::move(that)), dest_(std::move(that.dest_)) {}
+
+template <typename Dest>
+inline TFRecordWriter<Dest>& TFRecordWriter<Dest>::operator=(
+    TFRecordWriter&& that) noexcept {
+  TFRecordWriterBase::operator=(std::move(that));
+  dest_ = std::move(that.dest_);
+  return *this;
+}
+
+template <typename Dest>
+inline void TFRecordWriter<Dest>::Reset() {
+  TFRecordWriterBase::Reset(kInitiallyClosed);
+  dest_.Reset();
+}
+
+template <typename Dest>
+inline void TFRecordWriter<Dest>::Reset(const Dest& dest, Options options) {
+  TFRecordWriterBase::Reset(kInitiallyOpen);
+  dest_.Reset(dest);
+  Initialize(dest_.get(), options.compression_,
+             std::move(options.zlib_options_));
+}
+
+template <typename Dest>
+inline void TFRecordWriter<Dest>::Reset(Dest&& dest, Options options) {
+  TFRecordWriterBase::Reset(kInitiallyOpen);
+  dest_.Reset(std::move(dest));
+  Initialize(dest_.get(), options.compression_,
+             std::move(options.zlib_options_));
+}
+
+template <typename Dest>
+template <typename... DestArgs>
+inline void TFRecordWriter<Dest>::Reset(std::tuple<DestArgs...> dest_args,
+                                        Options options) {
+  TFRecordWriterBase::Reset(kInitiallyOpen);
+  dest_.Reset(std::move(dest_args));
+  Initialize(dest_.get(), options.compression_,
+             std::move(options.zlib_options_));
+}
+
+template <typename Dest>
+void TFRecordWriter<Dest>::Done() {
+  TFRecordWriterBase::Done();
+  if (dest_.is_owning()) {
+    if (ABSL_PREDICT_FALSE(!dest_->Close())) Fail(*dest_);
+  }
+}
+
+template <typename Dest>
+struct Resetter<TFRecordWriter<Dest>> : ResetterByReset<TFRecordWriter<Dest>> {
+};
+
+}  // namespace riegeli
+
+#endif  // RIEGELI_RECORDS_TFRECORD_WRITER_H_
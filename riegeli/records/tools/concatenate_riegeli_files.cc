@@ -0,0 +1,113 @@
+// Copyright 2019 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <iostream>
+#include <memory>
+#include <string>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+#include "absl/base/optimization.h"
+#include "absl/flags/flag.h"
+#include "absl/flags/parse.h"
+#include "absl/flags/usage.h"
+#include "absl/strings/string_view.h"
+#include "riegeli/base/base.h"
+#include "riegeli/base/status.h"
+#include "riegeli/bytes/fd_reader.h"
+#include "riegeli/bytes/fd_writer.h"
+#include "riegeli/chunk_encoding/compressor_options.h"
+#include "riegeli/records/chunk_reader.h"
+#include "riegeli/records/chunk_writer.h"
+#include "riegeli/records/concatenate_records.h"
+
+ABSL_FLAG(std::string, output, "", "Output file. Required.");
+ABSL_FLAG(bool, index, false,
+          "If true, write an index chunk describing the output.");
+ABSL_FLAG(uint64_t, min_chunk_size, 0,
+          "If positive, re-encode runs of chunks smaller than this together "
+          "into chunks of about this size. Other chunks are copied.");
+ABSL_FLAG(std::string, compression, "",
+          "Compression of re-encoded chunks, in the format of "
+          "CompressorOptions::FromString(), e.g. \"zstd:5\".");
+ABSL_FLAG(bool, transpose, false, "If true, transpose re-encoded chunks.");
+ABSL_FLAG(int, parallelism, 0,
+          "The maximum number of chunks re-encoded concurrently.");
+
+namespace riegeli {
+namespace tools {
+namespace {
+
+bool ConcatenateFiles(const std::vector<char*>& inputs,
+                      absl::string_view output) {
+  ConcatenateRecordsOptions options;
+  options.set_index(absl::GetFlag(FLAGS_index))
+      .set_min_chunk_size(absl::GetFlag(FLAGS_min_chunk_size))
+      .set_transpose(absl::GetFlag(FLAGS_transpose))
+      .set_parallelism(absl::GetFlag(FLAGS_parallelism));
+  {
+    CompressorOptions compressor_options;
+    const Status status =
+        compressor_options.FromString(absl::GetFlag(FLAGS_compression));
+    if (ABSL_PREDICT_FALSE(!status.ok())) {
+      std::cerr << status.message() << std::endl;
+      return false;
+    }
+    options.set_compressor_options(std::move(compressor_options));
+  }
+  DefaultChunkWriter<FdWriter<>> chunk_writer(
+      std::forward_as_tuple(output, O_WRONLY | O_CREAT | O_TRUNC));
+  const Status status = ConcatenateRecords(
+      inputs.size(),
+      [&](size_t src_index) -> std::unique_ptr<ChunkReader> {
+        return std::make_unique<DefaultChunkReader<FdReader<>>>(
+            std::forward_as_tuple(inputs[src_index], O_RDONLY));
+      },
+      &chunk_writer, std::move(options));
+  if (ABSL_PREDICT_FALSE(!status.ok())) {
+    std::cerr << status.message() << std::endl;
+    return false;
+  }
+  if (ABSL_PREDICT_FALSE(!chunk_writer.Close())) {
+    std::cerr << chunk_writer.status().message() << std::endl;
+    return false;
+  }
+  return true;
+}
+
+const char kUsage[] =
+    "Usage: concatenate_riegeli_files --output=OUTPUT (OPTION|INPUT)...\n"
+    "\n"
+    "Concatenates Riegeli/records files without decoding their chunks.\n";
+
+}  // namespace
+}  // namespace tools
+}  // namespace riegeli
+
+int main(int argc, char** argv) {
+  absl::SetProgramUsageMessage(riegeli::tools::kUsage);
+  std::vector<char*> args = absl::ParseCommandLine(argc, argv);
+  const std::string output = absl::GetFlag(FLAGS_output);
+  if (output.empty()) {
+    std::cerr << "--output is required" << std::endl;
+    return 1;
+  }
+  args.erase(args.begin());
+  return riegeli::tools::ConcatenateFiles(args, output) ? 0 : 1;
+}
@@ -0,0 +1,144 @@
+// Copyright 2019 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <fcntl.h>
+#include <stddef.h>
+
+#include <atomic>
+#include <iostream>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#include "absl/base/optimization.h"
+#include "absl/flags/flag.h"
+#include "absl/flags/parse.h"
+#include "absl/flags/usage.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/string_view.h"
+#include "absl/synchronization/blocking_counter.h"
+#include "riegeli/base/base.h"
+#include "riegeli/base/parallelism.h"
+#include "riegeli/base/status.h"
+#include "riegeli/bytes/fd_reader.h"
+#include "riegeli/bytes/fd_writer.h"
+#include "riegeli/records/record_writer.h"
+#include "riegeli/records/tfrecord_reader.h"
+
+ABSL_FLAG(std::string, output_suffix, ".riegeli",
+          "Suffix appended to the name of each input to form its output.");
+ABSL_FLAG(std::string, options, "",
+          "Riegeli/records writer options, in the format of "
+          "RecordWriterBase::Options::FromString().");
+ABSL_FLAG(int, parallelism, 1,
+          "The maximum number of files converted concurrently.");
+ABSL_FLAG(bool, verify_checksums, true,
+          "If false, checksums of TFRecords are not verified.");
+
+namespace riegeli {
+namespace tools {
+namespace {
+
+Status ConvertFile(absl::string_view input, absl::string_view output,
+                   const RecordWriterBase::Options& record_writer_options,
+                   bool verify_checksums) {
+  TFRecordReader<FdReader<>> tfrecord_reader(
+      std::forward_as_tuple(input, O_RDONLY),
+      TFRecordReaderBase::Options().set_verify_checksums(verify_checksums));
+  RecordWriter<FdWriter<>> record_writer(
+      std::forward_as_tuple(output, O_WRONLY | O_CREAT | O_TRUNC),
+      record_writer_options);
+  absl::string_view record;
+  while (tfrecord_reader.ReadRecord(&record)) {
+    if (ABSL_PREDICT_FALSE(!record_writer.WriteRecord(record))) {
+      return record_writer.status();
+    }
+  }
+  if (ABSL_PREDICT_FALSE(!tfrecord_reader.Close())) {
+    return tfrecord_reader.status();
+  }
+  if (ABSL_PREDICT_FALSE(!record_writer.Close())) {
+    return record_writer.status();
+  }
+  return OkStatus();
+}
+
+bool ConvertFiles(const std::vector<char*>& inputs) {
+  RecordWriterBase::Options record_writer_options;
+  {
+    const Status status =
+        record_writer_options.FromString(absl::GetFlag(FLAGS_options));
+    if (ABSL_PREDICT_FALSE(!status.ok())) {
+      std::cerr << status.message() << std::endl;
+      return false;
+    }
+  }
+  const std::string output_suffix = absl::GetFlag(FLAGS_output_suffix);
+  const bool verify_checksums = absl::GetFlag(FLAGS_verify_checksums);
+  std::vector<Status> statuses(inputs.size());
+  const auto convert_files = [&](std::atomic<size_t>* next_input) {
+    for (;;) {
+      const size_t index = next_input->fetch_add(1, std::memory_order_relaxed);
+      if (index >= inputs.size()) return;
+      statuses[index] =
+          ConvertFile(inputs[index], absl::StrCat(inputs[index], output_suffix),
+                      record_writer_options, verify_checksums);
+    }
+  };
+  std::atomic<size_t> next_input{0};
+  const int parallelism = absl::GetFlag(FLAGS_parallelism);
+  const size_t num_helpers =
+      inputs.size() <= 1 || parallelism <= 1
+          ? size_t{0}
+          : UnsignedMin(IntCast<size_t>(parallelism), inputs.size()) - 1;
+  if (num_helpers == 0) {
+    convert_files(&next_input);
+  } else {
+    absl::BlockingCounter helpers_done(IntCast<int>(num_helpers));
+    for (size_t i = 0; i < num_helpers; ++i) {
+      ThreadPool::global().Schedule([&] {
+        convert_files(&next_input);
+        helpers_done.DecrementCount();
+      });
+    }
+    convert_files(&next_input);
+    helpers_done.Wait();
+  }
+  bool ok = true;
+  for (size_t index = 0; index < inputs.size(); ++index) {
+    if (ABSL_PREDICT_FALSE(!statuses[index].ok())) {
+      std::cerr << inputs[index] << ": " << statuses[index].message()
+                << std::endl;
+      ok = false;
+    }
+  }
+  return ok;
+}
+
+const char kUsage[] =
+    "Usage: convert_tfrecord_files (OPTION|INPUT)...\n"
+    "\n"
+    "Converts TFRecord files, possibly compressed with zlib or gzip, to "
+    "Riegeli/records files.\n";
+
+}  // namespace
+}  // namespace tools
+}  // namespace riegeli
+
+int main(int argc, char** argv) {
+  absl::SetProgramUsageMessage(riegeli::tools::kUsage);
+  std::vector<char*> args = absl::ParseCommandLine(argc, argv);
+  args.erase(args.begin());
+  return riegeli::tools::ConvertFiles(args) ? 0 : 1;
+}
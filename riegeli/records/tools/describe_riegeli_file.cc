@@ -16,10 +16,14 @@
 #include <stddef.h>
 #include <stdint.h>
 
+#include <algorithm>
+#include <atomic>
 #include <iostream>
 #include <limits>
 #include <string>
+#include <thread>
 #include <tuple>
+#include <utility>
 #include <vector>
 
 #include "absl/base/optimization.h"
@@ -29,12 +33,15 @@
 #include "absl/strings/escaping.h"
 #include "absl/strings/str_cat.h"
 #include "absl/strings/string_view.h"
+#include "absl/synchronization/blocking_counter.h"
+#include "absl/time/time.h"
 #include "google/protobuf/io/zero_copy_stream_impl.h"
 #include "google/protobuf/text_format.h"
 #include "riegeli/base/base.h"
 #include "riegeli/base/canonical_errors.h"
 #include "riegeli/base/chain.h"
 #include "riegeli/base/object.h"
+#include "riegeli/base/parallelism.h"
 #include "riegeli/base/status.h"
 #include "riegeli/bytes/chain_backward_writer.h"
 #include "riegeli/bytes/chain_reader.h"
@@ -44,11 +51,14 @@
 #include "riegeli/bytes/null_backward_writer.h"
 #include "riegeli/bytes/reader.h"
 #include "riegeli/bytes/reader_utils.h"
+#include "riegeli/bytes/zstd_dictionary.h"
 #include "riegeli/chunk_encoding/chunk.h"
 #include "riegeli/chunk_encoding/constants.h"
 #include "riegeli/chunk_encoding/decompressor.h"
 #include "riegeli/chunk_encoding/field_projection.h"
 #include "riegeli/chunk_encoding/transpose_decoder.h"
+#include "riegeli/chunk_encoding/transposed_chunk_layout.h"
+#include "riegeli/records/block.h"
 #include "riegeli/records/chunk_reader.h"
 #include "riegeli/records/records_metadata.pb.h"
 #include "riegeli/records/skipped_region.h"
@@ -58,6 +68,18 @@ ABSL_FLAG(bool, show_records_metadata, true,
           "If true, show parsed file metadata.");
 ABSL_FLAG(bool, show_record_sizes, false,
           "If true, show the list of record sizes in each chunk.");
+ABSL_FLAG(bool, show_field_sizes, false,
+          "If true, show compressed and uncompressed sizes of each bucket and "
+          "each field in transposed chunks, and the time of decompressing each "
+          "bucket.");
+ABSL_FLAG(bool, headers_only, false,
+          "If true, read only chunk headers and the compression type, "
+          "skipping over chunk data. This is much faster for large files but "
+          "ignores show_records_metadata, show_record_sizes, and "
+          "show_field_sizes.");
+ABSL_FLAG(int, parallelism, 0,
+          "If positive, describe up to this many chunks concurrently in "
+          "addition to reading the file. The output order is unchanged.");
 
 namespace riegeli {
 namespace tools {
@@ -79,7 +101,7 @@ Status DescribeFileMetadataChunk(const Chunk& chunk,
   std::vector<size_t> limits;
   const bool ok = transpose_decoder.Decode(
       &data_reader, 1, chunk.header.decoded_data_size(), FieldProjection::All(),
-      &serialized_metadata_writer, &limits);
+      ZstdDictionary(), &serialized_metadata_writer, &limits);
   if (ABSL_PREDICT_FALSE(!serialized_metadata_writer.Close())) {
     return serialized_metadata_writer.status();
   }
@@ -96,6 +118,7 @@ Status DescribeFileMetadataChunk(const Chunk& chunk,
 }
 
 Status DescribeSimpleChunk(const Chunk& chunk,
+                           const ZstdDictionary& zstd_dictionary,
                            summary::SimpleChunk* simple_chunk) {
   // Based on `SimpleDecoder::Decode()`.
   ChainReader<> chunk_reader(&chunk.data);
@@ -121,7 +144,7 @@ Status DescribeSimpleChunk(const Chunk& chunk,
     }
     internal::Decompressor<LimitingReader<>> sizes_decompressor(
         std::forward_as_tuple(&chunk_reader, chunk_reader.pos() + sizes_size),
-        compression_type);
+        compression_type, zstd_dictionary);
     if (ABSL_PREDICT_FALSE(!sizes_decompressor.healthy())) {
       return sizes_decompressor.status();
     }
@@ -144,6 +167,7 @@ Status DescribeSimpleChunk(const Chunk& chunk,
 }
 
 Status DescribeTransposedChunk(const Chunk& chunk,
+                               const ZstdDictionary& zstd_dictionary,
                                summary::TransposedChunk* transposed_chunk) {
   ChainReader<> chunk_reader(&chunk.data);
   if (absl::GetFlag(FLAGS_show_record_sizes)) {
@@ -152,9 +176,15 @@ Status DescribeTransposedChunk(const Chunk& chunk,
     NullBackwardWriter dest_writer(NullBackwardWriter::kInitiallyOpen);
     std::vector<size_t> limits;
     const bool ok =
-        transpose_decoder.Decode(&chunk_reader, chunk.header.num_records(),
-                                 chunk.header.decoded_data_size(),
-                                 FieldProjection::All(), &dest_writer, &limits);
+        chunk.header.chunk_type() == ChunkType::kTransposedWithBufferEncodings
+            ? transpose_decoder.DecodeWithBufferEncodings(
+                  &chunk_reader, chunk.header.num_records(),
+                  chunk.header.decoded_data_size(), FieldProjection::All(),
+                  zstd_dictionary, &dest_writer, &limits)
+            : transpose_decoder.Decode(
+                  &chunk_reader, chunk.header.num_records(),
+                  chunk.header.decoded_data_size(), FieldProjection::All(),
+                  zstd_dictionary, &dest_writer, &limits);
     if (ABSL_PREDICT_FALSE(!dest_writer.Close())) return dest_writer.status();
     if (ABSL_PREDICT_FALSE(!ok)) return transpose_decoder.status();
     if (ABSL_PREDICT_FALSE(!chunk_reader.VerifyEndAndClose())) {
@@ -168,7 +198,7 @@ Status DescribeTransposedChunk(const Chunk& chunk,
       transposed_chunk->add_record_sizes(next_limit - prev_limit);
       prev_limit = next_limit;
     }
-  } else {
+  } else if (!absl::GetFlag(FLAGS_show_field_sizes)) {
     // Based on `TransposeDecoder::Decode()`.
     uint8_t compression_type_byte;
     if (ABSL_PREDICT_FALSE(!ReadByte(&chunk_reader, &compression_type_byte))) {
@@ -177,9 +207,232 @@ Status DescribeTransposedChunk(const Chunk& chunk,
     transposed_chunk->set_compression_type(
         static_cast<summary::CompressionType>(compression_type_byte));
   }
+  if (absl::GetFlag(FLAGS_show_field_sizes)) {
+    TransposedChunkLayout layout;
+    {
+      const Status status = DescribeTransposedChunkLayout(
+          chunk.data,
+          chunk.header.chunk_type() ==
+              ChunkType::kTransposedWithBufferEncodings,
+          zstd_dictionary, &layout);
+      if (ABSL_PREDICT_FALSE(!status.ok())) return status;
+    }
+    transposed_chunk->set_compression_type(
+        static_cast<summary::CompressionType>(layout.compression_type));
+    transposed_chunk->set_header_size(layout.header_size);
+    transposed_chunk->set_transitions_size(layout.transitions_size);
+    for (const TransposedChunkLayout::Bucket& bucket : layout.buckets) {
+      summary::TransposedBucket* const bucket_summary =
+          transposed_chunk->add_bucket();
+      bucket_summary->set_compressed_size(bucket.compressed_size);
+      bucket_summary->set_uncompressed_size(bucket.uncompressed_size);
+      bucket_summary->set_decompression_micros(
+          absl::ToDoubleMicroseconds(bucket.decompression_time));
+    }
+    for (const TransposedChunkLayout::Buffer& buffer : layout.buffers) {
+      summary::TransposedField* const field_summary =
+          transposed_chunk->add_field();
+      if (!buffer.nonproto) {
+        field_summary->set_field_number(buffer.tag >> 3);
+        field_summary->set_wire_type(buffer.tag & 7);
+      }
+      field_summary->set_bucket(buffer.bucket_index);
+      field_summary->set_uncompressed_size(buffer.uncompressed_size);
+      const TransposedChunkLayout::Bucket& bucket =
+          layout.buckets[buffer.bucket_index];
+      field_summary->set_compressed_size(
+          bucket.uncompressed_size == 0
+              ? uint64_t{0}
+              : static_cast<uint64_t>(
+                    static_cast<double>(bucket.compressed_size) *
+                    static_cast<double>(buffer.uncompressed_size) /
+                    static_cast<double>(bucket.uncompressed_size)));
+    }
+  }
   return OkStatus();
 }
 
+// A chunk read from the file, together with what is needed to describe it
+// independently of other chunks.
+struct ChunkDescription {
+  Chunk chunk;
+  // The dictionary from the most recent dictionary chunk before `chunk`.
+  ZstdDictionary zstd_dictionary;
+  summary::Chunk chunk_summary;
+  // Error messages, each terminated with a newline.
+  std::string errors;
+};
+
+void DescribeChunk(ChunkDescription* description) {
+  const Chunk& chunk = description->chunk;
+  summary::Chunk& chunk_summary = description->chunk_summary;
+  Status status;
+  switch (chunk.header.chunk_type()) {
+    case ChunkType::kFileMetadata:
+      if (absl::GetFlag(FLAGS_show_records_metadata)) {
+        status = DescribeFileMetadataChunk(
+            chunk, chunk_summary.mutable_file_metadata_chunk());
+      }
+      break;
+    case ChunkType::kSimple:
+      status = DescribeSimpleChunk(chunk, description->zstd_dictionary,
+                                   chunk_summary.mutable_simple_chunk());
+      break;
+    case ChunkType::kTransposed:
+    case ChunkType::kTransposedWithBufferEncodings:
+      status =
+          DescribeTransposedChunk(chunk, description->zstd_dictionary,
+                                  chunk_summary.mutable_transposed_chunk());
+      break;
+    case ChunkType::kTransposedWithSharedHeader: {
+      // Record sizes would need the shared header chunk, so only the
+      // compression type is shown.
+      ChainReader<> chunk_reader(&chunk.data);
+      uint64_t distance;
+      uint8_t compression_type_byte;
+      if (ABSL_PREDICT_FALSE(!ReadVarint64(&chunk_reader, &distance) ||
+                             !ReadByte(&chunk_reader,
+                                       &compression_type_byte))) {
+        status = DataLossError("Reading compression type failed");
+        break;
+      }
+      chunk_summary.mutable_transposed_chunk()->set_compression_type(
+          static_cast<summary::CompressionType>(compression_type_byte));
+      break;
+    }
+    case ChunkType::kSimpleWithPrefix: {
+      // Record sizes would need the chunk with the prefix, so only the
+      // compression type is shown.
+      ChainReader<> chunk_reader(&chunk.data);
+      uint64_t distance;
+      uint8_t compression_type_byte;
+      if (ABSL_PREDICT_FALSE(!ReadVarint64(&chunk_reader, &distance) ||
+                             !ReadByte(&chunk_reader,
+                                       &compression_type_byte))) {
+        status = DataLossError("Reading compression type failed");
+        break;
+      }
+      chunk_summary.mutable_simple_chunk()->set_compression_type(
+          static_cast<summary::CompressionType>(compression_type_byte));
+      break;
+    }
+    default:
+      break;
+  }
+  if (ABSL_PREDICT_FALSE(!status.ok())) {
+    absl::StrAppend(&description->errors, status.message(), "\n");
+  }
+}
+
+// Calls `DescribeChunk()` for each element of `descriptions`, using up to
+// `parallelism` worker threads in addition to the current thread.
+void DescribeChunks(std::vector<ChunkDescription>* descriptions,
+                    size_t parallelism) {
+  const auto describe_chunks = [descriptions](std::atomic<size_t>* next_chunk) {
+    for (;;) {
+      const size_t index = next_chunk->fetch_add(1, std::memory_order_relaxed);
+      if (index >= descriptions->size()) return;
+      DescribeChunk(&(*descriptions)[index]);
+    }
+  };
+  std::atomic<size_t> next_chunk{0};
+  const size_t num_helpers =
+      descriptions->size() <= 1
+          ? size_t{0}
+          : UnsignedMin(parallelism, descriptions->size() - 1);
+  if (num_helpers == 0) {
+    describe_chunks(&next_chunk);
+  } else {
+    absl::BlockingCounter helpers_done(IntCast<int>(num_helpers));
+    for (size_t i = 0; i < num_helpers; ++i) {
+      ThreadPool::global().Schedule([&] {
+        describe_chunks(&next_chunk);
+        helpers_done.DecrementCount();
+      });
+    }
+    describe_chunks(&next_chunk);
+    helpers_done.Wait();
+  }
+}
+
+void PrintChunkSummary(const google::protobuf::TextFormat::Printer& printer,
+                       const summary::Chunk& chunk_summary) {
+  std::cout << "  chunk {\n";
+  {
+    google::protobuf::io::OstreamOutputStream out(&std::cout);
+    printer.Print(chunk_summary, &out);
+  }
+  std::cout << "  }" << std::endl;
+}
+
+void SetChunkHeaderSummary(const ChunkHeader& chunk_header,
+                           Position chunk_begin,
+                           summary::Chunk* chunk_summary) {
+  chunk_summary->set_chunk_begin(chunk_begin);
+  chunk_summary->set_chunk_type(
+      static_cast<summary::ChunkType>(chunk_header.chunk_type()));
+  chunk_summary->set_data_size(chunk_header.data_size());
+  chunk_summary->set_num_records(chunk_header.num_records());
+  chunk_summary->set_decoded_data_size(chunk_header.decoded_data_size());
+}
+
+// Reads only chunk headers, and the compression type of simple and transposed
+// chunks, which is their first data byte. Chunk data are skipped by seeking.
+void DescribeChunkHeaders(
+    absl::string_view filename,
+    const google::protobuf::TextFormat::Printer& printer,
+    DefaultChunkReader<FdReader<>>* chunk_reader) {
+  // Reads single bytes at scattered positions, so a large buffer would only
+  // waste reading.
+  FdReader<> data_reader(filename, O_RDONLY,
+                         FdReaderBase::Options().set_buffer_size(64));
+  for (;;) {
+    const Position chunk_begin = chunk_reader->pos();
+    const ChunkHeader* chunk_header;
+    if (ABSL_PREDICT_FALSE(!chunk_reader->PullChunkHeader(&chunk_header))) {
+      SkippedRegion skipped_region;
+      if (chunk_reader->Recover(&skipped_region)) {
+        std::cerr << skipped_region.message() << "\n";
+        continue;
+      }
+      break;
+    }
+    summary::Chunk chunk_summary;
+    SetChunkHeaderSummary(*chunk_header, chunk_begin, &chunk_summary);
+    if (chunk_header->chunk_type() == ChunkType::kSimple ||
+        chunk_header->chunk_type() == ChunkType::kTransposed ||
+        chunk_header->chunk_type() ==
+            ChunkType::kTransposedWithBufferEncodings) {
+      // The position of the first data byte, after any block header which
+      // precedes it.
+      const Position data_begin =
+          internal::AddWithOverhead(chunk_begin, ChunkHeader::size() + 1) - 1;
+      uint8_t compression_type_byte;
+      if (ABSL_PREDICT_FALSE(!data_reader.Seek(data_begin) ||
+                             !ReadByte(&data_reader, &compression_type_byte))) {
+        std::cerr << (data_reader.healthy()
+                          ? absl::string_view("Reading compression type failed")
+                          : data_reader.status().message())
+                  << "\n";
+      } else if (chunk_header->chunk_type() == ChunkType::kSimple) {
+        chunk_summary.mutable_simple_chunk()->set_compression_type(
+            static_cast<summary::CompressionType>(compression_type_byte));
+      } else {
+        chunk_summary.mutable_transposed_chunk()->set_compression_type(
+            static_cast<summary::CompressionType>(compression_type_byte));
+      }
+    }
+    const Position chunk_end = internal::ChunkEnd(*chunk_header, chunk_begin);
+    PrintChunkSummary(printer, chunk_summary);
+    // If seeking fails, the next `PullChunkHeader()` fails too and recovery is
+    // attempted there.
+    chunk_reader->Seek(chunk_end);
+  }
+  if (!data_reader.Close()) {
+    std::cerr << data_reader.status().message() << std::endl;
+  }
+}
+
 void DescribeFile(absl::string_view filename) {
   std::cout << "file {\n"
                "  filename: \""
@@ -194,59 +447,50 @@ void DescribeFile(absl::string_view filename) {
   printer.SetInitialIndentLevel(2);
   printer.SetUseShortRepeatedPrimitives(true);
   printer.SetUseUtf8StringEscaping(true);
-  for (;;) {
-    const Position chunk_begin = chunk_reader.pos();
-    Chunk chunk;
-    if (ABSL_PREDICT_FALSE(!chunk_reader.ReadChunk(&chunk))) {
-      SkippedRegion skipped_region;
-      if (chunk_reader.Recover(&skipped_region)) {
-        std::cerr << skipped_region.message() << "\n";
-        continue;
+  if (absl::GetFlag(FLAGS_headers_only)) {
+    DescribeChunkHeaders(filename, printer, &chunk_reader);
+  } else {
+    const size_t parallelism =
+        IntCast<size_t>(std::max(absl::GetFlag(FLAGS_parallelism), 0));
+    // Enough chunks are read ahead to keep all threads busy despite uneven
+    // chunk sizes.
+    const size_t max_batch_size = parallelism == 0 ? 1 : parallelism * 4;
+    std::vector<ChunkDescription> batch;
+    batch.reserve(max_batch_size);
+    const auto flush_batch = [&] {
+      DescribeChunks(&batch, parallelism);
+      for (const ChunkDescription& description : batch) {
+        std::cerr << description.errors;
+        PrintChunkSummary(printer, description.chunk_summary);
       }
-      break;
-    }
-    summary::Chunk chunk_summary;
-    chunk_summary.set_chunk_begin(chunk_begin);
-    chunk_summary.set_chunk_type(
-        static_cast<summary::ChunkType>(chunk.header.chunk_type()));
-    chunk_summary.set_data_size(chunk.header.data_size());
-    chunk_summary.set_num_records(chunk.header.num_records());
-    chunk_summary.set_decoded_data_size(chunk.header.decoded_data_size());
-    switch (chunk.header.chunk_type()) {
-      case ChunkType::kFileMetadata:
-        if (absl::GetFlag(FLAGS_show_records_metadata)) {
-          {
-            const Status status = DescribeFileMetadataChunk(
-                chunk, chunk_summary.mutable_file_metadata_chunk());
-            if (ABSL_PREDICT_FALSE(!status.ok())) {
-              std::cerr << status.message() << "\n";
-            }
-          }
-        }
-        break;
-      case ChunkType::kSimple: {
-        const Status status =
-            DescribeSimpleChunk(chunk, chunk_summary.mutable_simple_chunk());
-        if (ABSL_PREDICT_FALSE(!status.ok())) {
-          std::cerr << status.message() << "\n";
-        }
-      } break;
-      case ChunkType::kTransposed: {
-        const Status status = DescribeTransposedChunk(
-            chunk, chunk_summary.mutable_transposed_chunk());
-        if (ABSL_PREDICT_FALSE(!status.ok())) {
-          std::cerr << status.message() << "\n";
+      batch.clear();
+    };
+    ZstdDictionary zstd_dictionary;
+    for (;;) {
+      const Position chunk_begin = chunk_reader.pos();
+      Chunk chunk;
+      if (ABSL_PREDICT_FALSE(!chunk_reader.ReadChunk(&chunk))) {
+        SkippedRegion skipped_region;
+        if (chunk_reader.Recover(&skipped_region)) {
+          std::cerr << skipped_region.message() << "\n";
+          continue;
         }
-      } break;
-      default:
         break;
+      }
+      // Dictionaries apply to the following chunks, so they are tracked while
+      // reading rather than while describing chunks out of order.
+      if (chunk.header.chunk_type() == ChunkType::kDictionary) {
+        zstd_dictionary = ZstdDictionary(std::string(chunk.data));
+      }
+      batch.emplace_back();
+      ChunkDescription& description = batch.back();
+      SetChunkHeaderSummary(chunk.header, chunk_begin,
+                            &description.chunk_summary);
+      description.chunk = std::move(chunk);
+      description.zstd_dictionary = zstd_dictionary;
+      if (batch.size() == max_batch_size) flush_batch();
     }
-    std::cout << "  chunk {\n";
-    {
-      google::protobuf::io::OstreamOutputStream out(&std::cout);
-      printer.Print(chunk_summary, &out);
-    }
-    std::cout << "  }" << std::endl;
+    flush_batch();
   }
   std::cout << "}" << std::endl;
   if (!chunk_reader.Close()) {
@@ -0,0 +1,139 @@
+// Copyright 2019 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <fcntl.h>
+
+#include <iostream>
+#include <string>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+#include "absl/base/optimization.h"
+#include "absl/flags/flag.h"
+#include "absl/flags/parse.h"
+#include "absl/flags/usage.h"
+#include "absl/strings/str_split.h"
+#include "absl/strings/string_view.h"
+#include "riegeli/base/base.h"
+#include "riegeli/base/chain.h"
+#include "riegeli/base/status.h"
+#include "riegeli/bytes/fd_reader.h"
+#include "riegeli/bytes/fd_writer.h"
+#include "riegeli/records/chunk_reader.h"
+#include "riegeli/records/filter_records.h"
+#include "riegeli/records/record_position.h"
+#include "riegeli/records/record_reader.h"
+#include "riegeli/records/record_writer.h"
+
+ABSL_FLAG(std::string, output, "", "Output file. Required.");
+ABSL_FLAG(std::string, drop_containing, "",
+          "Comma-separated strings. Records containing any of them are "
+          "dropped.");
+ABSL_FLAG(std::string, options, "",
+          "Riegeli/records writer options of the output, in the format of "
+          "RecordWriterBase::Options::FromString(), applied to chunks which "
+          "changed.");
+ABSL_FLAG(int, parallelism, 4,
+          "The maximum number of chunks filtered concurrently.");
+ABSL_FLAG(bool, copy_unchanged_chunks, true,
+          "If true, chunks with no records dropped are copied without "
+          "re-encoding.");
+
+namespace riegeli {
+namespace tools {
+namespace {
+
+Status FilterFile(absl::string_view input, absl::string_view output) {
+  RecordWriterBase::Options record_writer_options;
+  {
+    const Status status =
+        record_writer_options.FromString(absl::GetFlag(FLAGS_options));
+    if (ABSL_PREDICT_FALSE(!status.ok())) return status;
+  }
+  {
+    RecordReader<FdReader<>> record_reader(
+        std::forward_as_tuple(input, O_RDONLY));
+    Chain metadata;
+    if (ABSL_PREDICT_FALSE(!record_reader.ReadSerializedMetadata(&metadata))) {
+      return record_reader.status();
+    }
+    if (ABSL_PREDICT_FALSE(!record_reader.Close())) {
+      return record_reader.status();
+    }
+    record_writer_options.set_serialized_metadata(std::move(metadata));
+  }
+  const std::vector<std::string> drop_containing =
+      absl::StrSplit(absl::GetFlag(FLAGS_drop_containing), ',',
+                     absl::SkipEmpty());
+  DefaultChunkReader<FdReader<>> chunk_reader(
+      std::forward_as_tuple(input, O_RDONLY));
+  RecordWriter<FdWriter<>> record_writer(
+      std::forward_as_tuple(output, O_WRONLY | O_CREAT | O_TRUNC),
+      std::move(record_writer_options));
+  {
+    const Status status = FilterRecords(
+        &chunk_reader,
+        [&](const RecordPosition& key, absl::string_view record,
+            std::string* replacement) {
+          for (const std::string& needle : drop_containing) {
+            if (record.find(needle) != absl::string_view::npos) {
+              return FilterAction::kDrop;
+            }
+          }
+          return FilterAction::kKeep;
+        },
+        &record_writer,
+        FilterRecordsOptions()
+            .set_parallelism(absl::GetFlag(FLAGS_parallelism))
+            .set_copy_unchanged_chunks(
+                absl::GetFlag(FLAGS_copy_unchanged_chunks)));
+    if (ABSL_PREDICT_FALSE(!status.ok())) return status;
+  }
+  if (ABSL_PREDICT_FALSE(!chunk_reader.Close())) return chunk_reader.status();
+  if (ABSL_PREDICT_FALSE(!record_writer.Close())) {
+    return record_writer.status();
+  }
+  return OkStatus();
+}
+
+const char kUsage[] =
+    "Usage: filter_riegeli_file --output=OUTPUT (OPTION|INPUT)\n"
+    "\n"
+    "Rewrites a Riegeli/records file without records selected by options, "
+    "copying chunks which are left unchanged.\n";
+
+}  // namespace
+}  // namespace tools
+}  // namespace riegeli
+
+int main(int argc, char** argv) {
+  absl::SetProgramUsageMessage(riegeli::tools::kUsage);
+  std::vector<char*> args = absl::ParseCommandLine(argc, argv);
+  const std::string output = absl::GetFlag(FLAGS_output);
+  if (output.empty()) {
+    std::cerr << "--output is required" << std::endl;
+    return 1;
+  }
+  if (args.size() != 2) {
+    std::cerr << "Exactly one input is required" << std::endl;
+    return 1;
+  }
+  const riegeli::Status status = riegeli::tools::FilterFile(args[1], output);
+  if (ABSL_PREDICT_FALSE(!status.ok())) {
+    std::cerr << status.message() << std::endl;
+    return 1;
+  }
+  return 0;
+}
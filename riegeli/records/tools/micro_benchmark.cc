@@ -0,0 +1,582 @@
+// Copyright 2019 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Micro-benchmarks of operations on the read path and of byte adapters.
+//
+// All benchmarks use a synthetic corpus of serialized proto messages generated
+// from a fixed seed, so results are reproducible across runs and machines.
+//
+// Usage (`--benchmark_filter` selects benchmarks by a regex):
+//   bazel run -c opt //riegeli/records/tools:micro_benchmark --
+//       --benchmark_filter=Decode
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <limits>
+#include <memory>
+#include <random>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "absl/base/optimization.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/string_view.h"
+#include "absl/types/span.h"
+#include "benchmark/benchmark.h"
+#include "riegeli/base/base.h"
+#include "riegeli/base/chain.h"
+#include "riegeli/base/status.h"
+#include "riegeli/bytes/array_writer.h"
+#include "riegeli/bytes/brotli_reader.h"
+#include "riegeli/bytes/brotli_writer.h"
+#include "riegeli/bytes/chain_backward_writer.h"
+#include "riegeli/bytes/chain_reader.h"
+#include "riegeli/bytes/chain_writer.h"
+#include "riegeli/bytes/reader.h"
+#include "riegeli/bytes/reader_utils.h"
+#include "riegeli/bytes/snappy_reader.h"
+#include "riegeli/bytes/snappy_writer.h"
+#include "riegeli/bytes/string_reader.h"
+#include "riegeli/bytes/string_writer.h"
+#include "riegeli/bytes/varint.h"
+#include "riegeli/bytes/writer.h"
+#include "riegeli/bytes/writer_utils.h"
+#include "riegeli/bytes/zlib_reader.h"
+#include "riegeli/bytes/zlib_writer.h"
+#include "riegeli/bytes/zstd_dictionary.h"
+#include "riegeli/bytes/zstd_reader.h"
+#include "riegeli/bytes/zstd_writer.h"
+#include "riegeli/chunk_encoding/chunk.h"
+#include "riegeli/chunk_encoding/chunk_decoder.h"
+#include "riegeli/chunk_encoding/chunk_encoder.h"
+#include "riegeli/chunk_encoding/compressor_options.h"
+#include "riegeli/chunk_encoding/constants.h"
+#include "riegeli/chunk_encoding/field_projection.h"
+#include "riegeli/chunk_encoding/hash.h"
+#include "riegeli/chunk_encoding/simple_encoder.h"
+#include "riegeli/chunk_encoding/transpose_decoder.h"
+#include "riegeli/chunk_encoding/transpose_encoder.h"
+
+namespace riegeli {
+namespace {
+
+// Parameters of the synthetic corpus.
+constexpr uint64_t kSeed = 0x52656769656c6921;
+constexpr size_t kNumRecords = 10000;
+
+// Size of reads and writes by byte adapter benchmarks.
+constexpr size_t kIoSize = 64 << 10;
+
+void AppendVarint(uint64_t value, std::string* dest) {
+  char buffer[kMaxLengthVarint64];
+  dest->append(buffer, PtrDistance(buffer, WriteVarint64(buffer, value)));
+}
+
+void AppendTag(uint32_t field_number, uint32_t wire_type, std::string* dest) {
+  AppendVarint((uint64_t{field_number} << 3) | wire_type, dest);
+}
+
+void AppendFixed(uint64_t value, size_t size, std::string* dest) {
+  for (size_t i = 0; i < size; ++i) {
+    dest->push_back(static_cast<char>(value >> (i * 8)));
+  }
+}
+
+void AppendLengthDelimited(uint32_t field_number, absl::string_view value,
+                           std::string* dest) {
+  AppendTag(field_number, 2, dest);
+  AppendVarint(value.size(), dest);
+  dest->append(value.data(), value.size());
+}
+
+std::string RandomString(size_t min_size, size_t max_size,
+                         std::mt19937_64* random) {
+  std::string result(std::uniform_int_distribution<size_t>(
+                         min_size, max_size)(*random),
+                     '\0');
+  std::uniform_int_distribution<int> letter('a', 'z');
+  for (char& c : result) c = static_cast<char>(letter(*random));
+  return result;
+}
+
+// Generates a serialized message of this shape:
+// ```
+//   message Record {
+//     uint64 id = 1;
+//     Kind kind = 2;            // 8 values
+//     string name = 3;          // 8 to 64 letters
+//     Detail detail = 4;
+//     repeated uint32 tags = 5; // 0 to 5 values, not packed
+//     fixed32 checksum = 6;
+//   }
+//   message Detail {
+//     fixed64 timestamp = 1;
+//     int64 value = 2;
+//     string note = 3;          // 0 to 16 letters
+//   }
+// ```
+std::string MakeRecord(uint64_t id, std::mt19937_64* random) {
+  std::string detail;
+  AppendTag(1, 1, &detail);
+  AppendFixed(uint64_t{1500000000000000} + id * 1000, 8, &detail);
+  AppendTag(2, 0, &detail);
+  AppendVarint(std::uniform_int_distribution<uint64_t>(0, 1 << 20)(*random),
+               &detail);
+  AppendLengthDelimited(3, RandomString(0, 16, random), &detail);
+
+  std::string record;
+  AppendTag(1, 0, &record);
+  AppendVarint(id, &record);
+  AppendTag(2, 0, &record);
+  AppendVarint(std::uniform_int_distribution<uint64_t>(0, 7)(*random), &record);
+  AppendLengthDelimited(3, RandomString(8, 64, random), &record);
+  AppendLengthDelimited(4, detail, &record);
+  const size_t num_tags = std::uniform_int_distribution<size_t>(0, 5)(*random);
+  for (size_t i = 0; i < num_tags; ++i) {
+    AppendTag(5, 0, &record);
+    AppendVarint(std::uniform_int_distribution<uint64_t>(0, 1000)(*random),
+                 &record);
+  }
+  AppendTag(6, 5, &record);
+  AppendFixed((*random)(), 4, &record);
+  return record;
+}
+
+const std::vector<std::string>& Corpus() {
+  static const std::vector<std::string>* const corpus = [] {
+    std::vector<std::string>* const corpus = new std::vector<std::string>();
+    std::mt19937_64 random(kSeed);
+    corpus->reserve(kNumRecords);
+    for (size_t i = 0; i < kNumRecords; ++i) {
+      corpus->push_back(MakeRecord(i, &random));
+    }
+    return corpus;
+  }();
+  return *corpus;
+}
+
+// Concatenated records of the corpus.
+const Chain& FlatCorpus() {
+  static const Chain* const flat_corpus = [] {
+    Chain* const flat_corpus = new Chain();
+    for (const std::string& record : Corpus()) flat_corpus->Append(record);
+    return flat_corpus;
+  }();
+  return *flat_corpus;
+}
+
+// Compression selected by a benchmark argument.
+CompressorOptions CompressionFromArg(int64_t arg) {
+  switch (arg) {
+    case 0:
+      return CompressorOptions().set_uncompressed();
+    case 1:
+      return CompressorOptions().set_brotli();
+    case 2:
+      return CompressorOptions().set_zstd();
+    case 3:
+      return CompressorOptions().set_snappy();
+  }
+  RIEGELI_ASSERT_UNREACHABLE() << "Unknown compression argument: " << arg;
+}
+
+const char* CompressionName(int64_t arg) {
+  switch (arg) {
+    case 0:
+      return "uncompressed";
+    case 1:
+      return "brotli";
+    case 2:
+      return "zstd";
+    case 3:
+      return "snappy";
+  }
+  RIEGELI_ASSERT_UNREACHABLE() << "Unknown compression argument: " << arg;
+}
+
+// Encodes the corpus as a chunk. Returns `false` and reports a benchmark error
+// on failure.
+bool EncodeCorpus(bool transpose, int64_t compression, Chunk* chunk,
+                  benchmark::State* state) {
+  std::unique_ptr<ChunkEncoder> chunk_encoder;
+  if (transpose) {
+    chunk_encoder = std::make_unique<TransposeEncoder>(
+        CompressionFromArg(compression), std::numeric_limits<uint64_t>::max());
+  } else {
+    chunk_encoder = std::make_unique<SimpleEncoder>(
+        CompressionFromArg(compression), FlatCorpus().size());
+  }
+  for (const std::string& record : Corpus()) {
+    if (ABSL_PREDICT_FALSE(!chunk_encoder->AddRecord(record))) {
+      state->SkipWithError(
+          std::string(chunk_encoder->status().message()).c_str());
+      return false;
+    }
+  }
+  ChunkType chunk_type;
+  uint64_t num_records;
+  uint64_t decoded_data_size;
+  chunk->data.Clear();
+  ChainWriter<> data_writer(&chunk->data);
+  if (ABSL_PREDICT_FALSE(!chunk_encoder->EncodeAndClose(
+          &data_writer, &chunk_type, &num_records, &decoded_data_size))) {
+    state->SkipWithError(
+        std::string(chunk_encoder->status().message()).c_str());
+    return false;
+  }
+  if (ABSL_PREDICT_FALSE(!data_writer.Close())) {
+    state->SkipWithError(std::string(data_writer.status().message()).c_str());
+    return false;
+  }
+  chunk->header =
+      ChunkHeader(chunk->data, chunk_type, num_records, decoded_data_size);
+  return true;
+}
+
+void SetCorpusCounters(benchmark::State* state) {
+  state->SetBytesProcessed(IntCast<int64_t>(FlatCorpus().size()) *
+                           state->iterations());
+  state->SetItemsProcessed(IntCast<int64_t>(kNumRecords) * state->iterations());
+}
+
+// Arguments: transpose (0 or 1), compression (see `CompressionFromArg()`).
+void BM_ChunkDecoderDecode(benchmark::State& state) {
+  Chunk chunk;
+  if (!EncodeCorpus(state.range(0) != 0, state.range(1), &chunk, &state)) {
+    return;
+  }
+  state.SetLabel(absl::StrCat(state.range(0) != 0 ? "transpose," : "",
+                              CompressionName(state.range(1))));
+  ChunkDecoder chunk_decoder;
+  for (auto _ : state) {
+    if (ABSL_PREDICT_FALSE(!chunk_decoder.Decode(chunk))) {
+      state.SkipWithError(
+          std::string(chunk_decoder.status().message()).c_str());
+      return;
+    }
+    absl::string_view record;
+    while (chunk_decoder.ReadRecord(&record)) {
+      benchmark::DoNotOptimize(record.data());
+    }
+  }
+  SetCorpusCounters(&state);
+}
+BENCHMARK(BM_ChunkDecoderDecode)
+    ->Apply([](benchmark::internal::Benchmark* benchmark) {
+      for (int transpose = 0; transpose <= 1; ++transpose) {
+        for (int compression = 0; compression <= 3; ++compression) {
+          benchmark->Args({transpose, compression});
+        }
+      }
+    })
+    ->ArgNames({"transpose", "compression"});
+
+// Arguments: compression (see `CompressionFromArg()`), projection (0: all
+// fields, 1: `id` only, 2: `detail.value` only).
+void BM_TransposeDecoderDecode(benchmark::State& state) {
+  Chunk chunk;
+  if (!EncodeCorpus(true, state.range(0), &chunk, &state)) return;
+  FieldProjection field_projection = FieldProjection::All();
+  switch (state.range(1)) {
+    case 1:
+      field_projection = FieldProjection({Field({1})});
+      break;
+    case 2:
+      field_projection = FieldProjection({Field({4, 2})});
+      break;
+  }
+  state.SetLabel(CompressionName(state.range(0)));
+  TransposeDecoder transpose_decoder;
+  Chain decoded;
+  std::vector<size_t> limits;
+  for (auto _ : state) {
+    decoded.Clear();
+    ChainReader<> src(&chunk.data);
+    ChainBackwardWriter<> dest(&decoded);
+    if (ABSL_PREDICT_FALSE(!transpose_decoder.Decode(
+            &src, chunk.header.num_records(),
+            chunk.header.decoded_data_size(), field_projection,
+            ZstdDictionary(), &dest, &limits))) {
+      state.SkipWithError(
+          std::string(transpose_decoder.status().message()).c_str());
+      return;
+    }
+    if (ABSL_PREDICT_FALSE(!dest.Close())) {
+      state.SkipWithError(std::string(dest.status().message()).c_str());
+      return;
+    }
+    benchmark::DoNotOptimize(decoded);
+  }
+  SetCorpusCounters(&state);
+}
+BENCHMARK(BM_TransposeDecoderDecode)
+    ->Apply([](benchmark::internal::Benchmark* benchmark) {
+      for (int compression = 0; compression <= 3; ++compression) {
+        for (int projection = 0; projection <= 2; ++projection) {
+          benchmark->Args({compression, projection});
+        }
+      }
+    })
+    ->ArgNames({"compression", "projection"});
+
+// Total size of data appended by `Chain::Append()` benchmarks.
+constexpr size_t kChainSize = 1 << 20;
+
+// Argument: size of each appended piece.
+void BM_ChainAppendStringView(benchmark::State& state) {
+  const std::string piece(IntCast<size_t>(state.range(0)), 'a');
+  for (auto _ : state) {
+    Chain chain;
+    for (size_t size = 0; size < kChainSize; size += piece.size()) {
+      chain.Append(piece);
+    }
+    benchmark::DoNotOptimize(chain);
+  }
+  state.SetBytesProcessed(int64_t{kChainSize} * state.iterations());
+}
+BENCHMARK(BM_ChainAppendStringView)->Range(16, 64 << 10);
+
+// Argument: size of each appended piece.
+void BM_ChainAppendChain(benchmark::State& state) {
+  const Chain piece(std::string(IntCast<size_t>(state.range(0)), 'a'));
+  for (auto _ : state) {
+    Chain chain;
+    for (size_t size = 0; size < kChainSize; size += piece.size()) {
+      chain.Append(piece);
+    }
+    benchmark::DoNotOptimize(chain);
+  }
+  state.SetBytesProcessed(int64_t{kChainSize} * state.iterations());
+}
+BENCHMARK(BM_ChainAppendChain)->Range(16, 64 << 10);
+
+// Argument: size of each appended piece.
+void BM_ChainAppendString(benchmark::State& state) {
+  for (auto _ : state) {
+    Chain chain;
+    for (size_t size = 0; size < kChainSize;
+         size += IntCast<size_t>(state.range(0))) {
+      chain.Append(std::string(IntCast<size_t>(state.range(0)), 'a'));
+    }
+    benchmark::DoNotOptimize(chain);
+  }
+  state.SetBytesProcessed(int64_t{kChainSize} * state.iterations());
+}
+BENCHMARK(BM_ChainAppendString)->Range(16, 64 << 10);
+
+// Number of varints read by varint benchmarks.
+constexpr size_t kNumVarints = 4096;
+
+// Returns `kNumVarints` encoded varints with values of up to `max_bits` bits.
+std::string MakeVarints(int max_bits) {
+  std::mt19937_64 random(kSeed);
+  std::string varints;
+  for (size_t i = 0; i < kNumVarints; ++i) {
+    const int bits = std::uniform_int_distribution<int>(1, max_bits)(random);
+    AppendVarint(random() >> (64 - bits), &varints);
+  }
+  return varints;
+}
+
+// Argument: maximum number of bits of values.
+void BM_ReadVarint64FromArray(benchmark::State& state) {
+  const std::string varints = MakeVarints(IntCast<int>(state.range(0)));
+  for (auto _ : state) {
+    const char* cursor = varints.data();
+    const char* const limit = varints.data() + varints.size();
+    uint64_t value;
+    while (ReadVarint64(&cursor, limit, &value)) {
+      benchmark::DoNotOptimize(value);
+    }
+  }
+  state.SetItemsProcessed(int64_t{kNumVarints} * state.iterations());
+}
+BENCHMARK(BM_ReadVarint64FromArray)->Arg(7)->Arg(32)->Arg(64);
+
+// Argument: maximum number of bits of values.
+void BM_ReadVarint64FromReader(benchmark::State& state) {
+  const std::string varints = MakeVarints(IntCast<int>(state.range(0)));
+  for (auto _ : state) {
+    StringReader<> reader(varints);
+    uint64_t value;
+    while (ReadVarint64(&reader, &value)) {
+      benchmark::DoNotOptimize(value);
+    }
+  }
+  state.SetItemsProcessed(int64_t{kNumVarints} * state.iterations());
+}
+BENCHMARK(BM_ReadVarint64FromReader)->Arg(7)->Arg(32)->Arg(64);
+
+// Argument: maximum number of bits of values.
+void BM_ReadVarint32FromArray(benchmark::State& state) {
+  const std::string varints = MakeVarints(IntCast<int>(state.range(0)));
+  for (auto _ : state) {
+    const char* cursor = varints.data();
+    const char* const limit = varints.data() + varints.size();
+    uint32_t value;
+    while (ReadVarint32(&cursor, limit, &value)) {
+      benchmark::DoNotOptimize(value);
+    }
+  }
+  state.SetItemsProcessed(int64_t{kNumVarints} * state.iterations());
+}
+BENCHMARK(BM_ReadVarint32FromArray)->Arg(7)->Arg(32);
+
+// Argument: size of hashed data.
+void BM_Hash(benchmark::State& state) {
+  const std::string data(IntCast<size_t>(state.range(0)), 'a');
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(internal::Hash(data));
+  }
+  state.SetBytesProcessed(state.range(0) * state.iterations());
+}
+BENCHMARK(BM_Hash)->Range(64, 1 << 20);
+
+// Argument: size of hashed data, split into fragments of 4 KiB.
+void BM_HashChain(benchmark::State& state) {
+  Chain data;
+  const std::string fragment(4 << 10, 'a');
+  while (data.size() < IntCast<size_t>(state.range(0))) {
+    data.Append(Chain(fragment));
+  }
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(internal::Hash(data));
+  }
+  state.SetBytesProcessed(IntCast<int64_t>(data.size()) * state.iterations());
+}
+BENCHMARK(BM_HashChain)->Range(64 << 10, 1 << 20);
+
+// Writes the flat corpus to `*dest` in pieces of `kIoSize`, and closes it.
+void WriteCorpus(Writer* dest, benchmark::State* state) {
+  Chain::BlockIterator iter = FlatCorpus().blocks().begin();
+  for (; iter != FlatCorpus().blocks().end(); ++iter) {
+    absl::string_view block = *iter;
+    while (!block.empty()) {
+      const absl::string_view piece =
+          block.substr(0, UnsignedMin(block.size(), kIoSize));
+      if (ABSL_PREDICT_FALSE(!dest->Write(piece))) {
+        state->SkipWithError(std::string(dest->status().message()).c_str());
+        return;
+      }
+      block.remove_prefix(piece.size());
+    }
+  }
+  if (ABSL_PREDICT_FALSE(!dest->Close())) {
+    state->SkipWithError(std::string(dest->status().message()).c_str());
+  }
+}
+
+// Reads `*src` fully in pieces of `kIoSize`, and closes it.
+void ReadAll(Reader* src, benchmark::State* state) {
+  char buffer[kIoSize];
+  while (src->Read(buffer, sizeof(buffer))) {
+    benchmark::DoNotOptimize(buffer);
+  }
+  if (ABSL_PREDICT_FALSE(!src->Close())) {
+    state->SkipWithError(std::string(src->status().message()).c_str());
+  }
+}
+
+void BM_StringWriter(benchmark::State& state) {
+  std::string dest;
+  for (auto _ : state) {
+    dest.clear();
+    StringWriter<> writer(&dest);
+    WriteCorpus(&writer, &state);
+  }
+  SetCorpusCounters(&state);
+}
+BENCHMARK(BM_StringWriter);
+
+void BM_ChainWriter(benchmark::State& state) {
+  for (auto _ : state) {
+    Chain dest;
+    ChainWriter<> writer(&dest);
+    WriteCorpus(&writer, &state);
+  }
+  SetCorpusCounters(&state);
+}
+BENCHMARK(BM_ChainWriter);
+
+void BM_ArrayWriter(benchmark::State& state) {
+  std::string dest(FlatCorpus().size(), '\0');
+  for (auto _ : state) {
+    ArrayWriter<> writer(absl::Span<char>(&dest[0], dest.size()));
+    WriteCorpus(&writer, &state);
+  }
+  SetCorpusCounters(&state);
+}
+BENCHMARK(BM_ArrayWriter);
+
+// Compresses the flat corpus with `Compressing<ChainWriter<>>`.
+template <template <typename> class CompressingWriter>
+Chain Compress(benchmark::State* state) {
+  Chain compressed;
+  CompressingWriter<ChainWriter<>> writer{ChainWriter<>(&compressed)};
+  WriteCorpus(&writer, state);
+  return compressed;
+}
+
+template <template <typename> class CompressingWriter>
+void BM_CompressingWriter(benchmark::State& state) {
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(Compress<CompressingWriter>(&state));
+  }
+  SetCorpusCounters(&state);
+}
+BENCHMARK_TEMPLATE(BM_CompressingWriter, BrotliWriter);
+BENCHMARK_TEMPLATE(BM_CompressingWriter, SnappyWriter);
+BENCHMARK_TEMPLATE(BM_CompressingWriter, ZlibWriter);
+BENCHMARK_TEMPLATE(BM_CompressingWriter, ZstdWriter);
+
+void BM_StringReader(benchmark::State& state) {
+  const std::string src(FlatCorpus());
+  for (auto _ : state) {
+    StringReader<> reader(src);
+    ReadAll(&reader, &state);
+  }
+  SetCorpusCounters(&state);
+}
+BENCHMARK(BM_StringReader);
+
+void BM_ChainReader(benchmark::State& state) {
+  for (auto _ : state) {
+    ChainReader<> reader(&FlatCorpus());
+    ReadAll(&reader, &state);
+  }
+  SetCorpusCounters(&state);
+}
+BENCHMARK(BM_ChainReader);
+
+template <template <typename> class CompressingWriter,
+          template <typename> class DecompressingReader>
+void BM_DecompressingReader(benchmark::State& state) {
+  const Chain compressed = Compress<CompressingWriter>(&state);
+  for (auto _ : state) {
+    DecompressingReader<ChainReader<>> reader{ChainReader<>(&compressed)};
+    ReadAll(&reader, &state);
+  }
+  SetCorpusCounters(&state);
+}
+BENCHMARK_TEMPLATE(BM_DecompressingReader, BrotliWriter, BrotliReader);
+BENCHMARK_TEMPLATE(BM_DecompressingReader, SnappyWriter, SnappyReader);
+BENCHMARK_TEMPLATE(BM_DecompressingReader, ZlibWriter, ZlibReader);
+BENCHMARK_TEMPLATE(BM_DecompressingReader, ZstdWriter, ZstdReader);
+
+}  // namespace
+}  // namespace riegeli
+
+BENCHMARK_MAIN();
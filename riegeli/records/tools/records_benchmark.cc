@@ -19,10 +19,12 @@
 #include <fcntl.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/types.h>
 #include <time.h>
+#include <unistd.h>
 
 #include <algorithm>
 #include <array>
@@ -32,7 +34,9 @@
 #include <iostream>
 #include <iterator>
 #include <memory>
+#include <random>
 #include <string>
+#include <thread>
 #include <tuple>
 #include <utility>
 #include <vector>
@@ -41,10 +45,14 @@
 #include "absl/flags/flag.h"
 #include "absl/flags/parse.h"
 #include "absl/flags/usage.h"
+#include "absl/strings/ascii.h"
+#include "absl/strings/match.h"
+#include "absl/strings/numbers.h"
 #include "absl/strings/str_cat.h"
 #include "absl/strings/str_format.h"
 #include "absl/strings/str_split.h"
 #include "absl/strings/string_view.h"
+#include "absl/strings/strip.h"
 #include "riegeli/base/base.h"
 #include "riegeli/base/errno_mapping.h"
 #include "riegeli/base/options_parser.h"
@@ -52,9 +60,13 @@
 #include "riegeli/bytes/fd_reader.h"
 #include "riegeli/bytes/fd_writer.h"
 #include "riegeli/bytes/writer_utils.h"
+#include "riegeli/chunk_encoding/field_projection.h"
 #include "riegeli/records/chunk_reader.h"
+#include "riegeli/records/record_position.h"
 #include "riegeli/records/record_reader.h"
 #include "riegeli/records/record_writer.h"
+#include "riegeli/records/sharded_record_writer.h"
+#include "riegeli/records/skipped_region.h"
 #include "riegeli/records/tools/tfrecord_recognizer.h"
 #include "tensorflow/core/lib/core/errors.h"
 #include "tensorflow/core/lib/core/status.h"
@@ -76,17 +88,66 @@ ABSL_FLAG(std::string, riegeli_benchmarks,
           "zstd:1 "
           "zstd:5 "
           "zstd:9 "
+          "zstd:9,zstd_strategy:btultra2 "
+          "zstd:9,window_log:27,zstd_long "
+          "zstd:9,zstd_target_block_size:16K "
           "snappy "
+          "lz4 "
+          "lz4:9 "
           "transpose,uncompressed "
           "transpose,brotli:9 "
           "transpose,brotli:9,parallelism:10 "
           "transpose,zstd:9 "
           "transpose,snappy",
           "Whitespace-separated Riegeli RecordWriter options");
+ABSL_FLAG(std::string, corpora, "",
+          "Whitespace-separated corpora to benchmark in addition to FILEs: "
+          "NAME=FILE[,FILE]... for records read from files, or "
+          "synthetic:(random|text|proto) for generated records");
+ABSL_FLAG(uint64_t, synthetic_record_size, 100,
+          "Approximate size of generated records, in bytes");
+ABSL_FLAG(std::string, parallelism_sweep, "",
+          "Whitespace-separated parallelism values; if not empty, each Riegeli "
+          "benchmark without explicit parallelism is run for each value, with "
+          "the same RecordWriter and RecordReader parallelism");
+ABSL_FLAG(std::string, bucket_fraction_sweep, "",
+          "Whitespace-separated bucket fractions; if not empty, each "
+          "transposed Riegeli benchmark without explicit bucket_fraction is "
+          "run for each value, to weigh compressed size against the cost of "
+          "reading with --projections");
+ABSL_FLAG(std::string, projections, "",
+          "Whitespace-separated field projections to additionally read Riegeli "
+          "files with, each a comma-separated list of field paths, each a "
+          "dot-separated list of field numbers, e.g. \"1,2.3\"");
+ABSL_FLAG(std::string, read_benchmarks, "",
+          "Whitespace-separated read path scenarios to run on each Riegeli "
+          "file, with FdReader and FdMMapReader: "
+          "seek_record_position (Seek(RecordPosition) to random records), "
+          "seek_fraction (Seek(Position) to random fractions of the file), "
+          "seek_to_key (SeekToKey() in a copy of the file with sorted keys), "
+          "recover (reading with recovery a copy of the file with injected "
+          "corruption)");
+ABSL_FLAG(std::string, thread_counts, "",
+          "Whitespace-separated thread counts; if not empty, each Riegeli "
+          "file is also processed by multiple threads for each count: "
+          "independent_readers (each thread reads the file with its own "
+          "RecordReader), parallel_reader (one RecordReader with that "
+          "parallelism), sharded_writers (a ShardedRecordWriter with that "
+          "parallelism writes the records to that many shards); aggregate "
+          "throughput and scaling efficiency relative to the first count are "
+          "reported");
+ABSL_FLAG(uint64_t, random_reads, 1000,
+          "Number of random accesses in each repetition of a read path "
+          "scenario");
+ABSL_FLAG(uint64_t, corruptions, 10,
+          "Number of corrupted bytes injected for the recover scenario");
 ABSL_FLAG(uint64_t, max_size, uint64_t{100} * 1000 * 1000,
-          "Maximum size of records to read, in bytes");
+          "Maximum size of records to read or generate for each corpus, "
+          "in bytes");
 ABSL_FLAG(std::string, output_dir, "/tmp",
           "Directory to write files to (files are named record_benchmark_*)");
+ABSL_FLAG(std::string, output_json, "",
+          "If not empty, file to write results to in JSON format");
 ABSL_FLAG(int32_t, repetitions, 5, "Number of times to repeat each benchmark");
 
 namespace {
@@ -138,6 +199,40 @@ uint64_t RealTimeNow_ns() {
          riegeli::IntCast<uint64_t>(time_info.tv_nsec);
 }
 
+// Resets the peak resident set size reported by `PeakRss_bytes()`, if the
+// system supports this.
+void ResetPeakRss() {
+  const int fd = open("/proc/self/clear_refs", O_WRONLY);
+  if (fd < 0) return;
+  // Writing "5" resets the peak resident set size (Linux 4.0 and newer).
+  if (write(fd, "5", 1) < 0) {
+    // Not supported: the peak covers the lifetime of the process.
+  }
+  close(fd);
+}
+
+// Returns the peak resident set size since the last `ResetPeakRss()`, or since
+// the process started if resetting is not supported.
+uint64_t PeakRss_bytes() {
+  riegeli::FdReader<> status_reader("/proc/self/status", O_RDONLY);
+  std::string status;
+  if (status_reader.ReadAll(&status) && status_reader.Close()) {
+    for (absl::string_view line : absl::StrSplit(status, '\n')) {
+      if (!absl::ConsumePrefix(&line, "VmHWM:")) continue;
+      line = absl::StripAsciiWhitespace(line);
+      uint64_t peak_rss_kb;
+      if (absl::ConsumeSuffix(&line, "kB") &&
+          absl::SimpleAtoi(absl::StripAsciiWhitespace(line), &peak_rss_kb)) {
+        return peak_rss_kb * 1024;
+      }
+      break;
+    }
+  }
+  struct rusage usage;
+  RIEGELI_CHECK_EQ(getrusage(RUSAGE_SELF, &usage), 0);
+  return riegeli::IntCast<uint64_t>(usage.ru_maxrss) * 1024;
+}
+
 class Stats {
  public:
   void Add(double value);
@@ -159,56 +254,313 @@ double Stats::Median() {
   return samples_[middle];
 }
 
+// Measures real time spent in consecutive stages of writing or reading.
+class StageTimer {
+ public:
+  // Ends the current stage, if any, and begins the stage called `name`.
+  void Begin(absl::string_view name);
+
+  // Ends the current stage.
+  void End();
+
+  // Returns names of stages with their durations, in the order of stages.
+  const std::vector<std::pair<std::string, uint64_t>>& stages_ns() const {
+    return stages_ns_;
+  }
+
+ private:
+  std::vector<std::pair<std::string, uint64_t>> stages_ns_;
+  bool running_ = false;
+  uint64_t begin_ns_ = 0;
+};
+
+void StageTimer::Begin(absl::string_view name) {
+  End();
+  stages_ns_.emplace_back(std::string(name), 0);
+  running_ = true;
+  begin_ns_ = RealTimeNow_ns();
+}
+
+void StageTimer::End() {
+  if (!running_) return;
+  stages_ns_.back().second = RealTimeNow_ns() - begin_ns_;
+  running_ = false;
+}
+
+// Measurements of repetitions of writing or reading a file.
+class Measurement {
+ public:
+  void Add(uint64_t cpu_time_ns, uint64_t real_time_ns,
+           const StageTimer& stage_timer);
+
+  bool empty() const { return empty_; }
+  Stats& cpu_time_s() { return cpu_time_s_; }
+  Stats& real_time_s() { return real_time_s_; }
+  std::vector<std::pair<std::string, Stats>>& stages_s() { return stages_s_; }
+
+ private:
+  bool empty_ = true;
+  Stats cpu_time_s_;
+  Stats real_time_s_;
+  std::vector<std::pair<std::string, Stats>> stages_s_;
+};
+
+void Measurement::Add(uint64_t cpu_time_ns, uint64_t real_time_ns,
+                      const StageTimer& stage_timer) {
+  empty_ = false;
+  cpu_time_s_.Add(static_cast<double>(cpu_time_ns) / 1e9);
+  real_time_s_.Add(static_cast<double>(real_time_ns) / 1e9);
+  for (const std::pair<std::string, uint64_t>& stage :
+       stage_timer.stages_ns()) {
+    auto iter = std::find_if(
+        stages_s_.begin(), stages_s_.end(),
+        [&](const std::pair<std::string, Stats>& stage_s) {
+          return stage_s.first == stage.first;
+        });
+    if (iter == stages_s_.end()) {
+      stages_s_.emplace_back(stage.first, Stats());
+      iter = std::prev(stages_s_.end());
+    }
+    iter->second.Add(static_cast<double>(stage.second) / 1e9);
+  }
+}
+
+// Appends `value` to `*dest` as a JSON string.
+void AppendJsonString(absl::string_view value, std::string* dest) {
+  dest->push_back('"');
+  for (const char ch : value) {
+    switch (ch) {
+      case '"':
+        dest->append("\\\"");
+        break;
+      case '\\':
+        dest->append("\\\\");
+        break;
+      case '\n':
+        dest->append("\\n");
+        break;
+      case '\t':
+        dest->append("\\t");
+        break;
+      default:
+        if (static_cast<unsigned char>(ch) < 0x20) {
+          absl::StrAppendFormat(dest, "\\u%04x",
+                                static_cast<unsigned char>(ch));
+        } else {
+          dest->push_back(ch);
+        }
+    }
+  }
+  dest->push_back('"');
+}
+
+// Parses a field projection in the format of `--projections`.
+bool ParseFieldProjection(absl::string_view text,
+                          riegeli::FieldProjection* field_projection) {
+  for (const absl::string_view path :
+       absl::StrSplit(text, ',', absl::SkipEmpty())) {
+    riegeli::Field field;
+    for (const absl::string_view tag_text : absl::StrSplit(path, '.')) {
+      uint32_t tag;
+      if (ABSL_PREDICT_FALSE(!absl::SimpleAtoi(tag_text, &tag) || tag == 0 ||
+                             tag > (uint32_t{1} << 29) - 1)) {
+        return false;
+      }
+      field.AddTag(tag);
+    }
+    field_projection->AddField(std::move(field));
+  }
+  return true;
+}
+
+void AppendVarint(uint64_t value, std::string* dest) {
+  while (value >= 0x80) {
+    dest->push_back(static_cast<char>(value | 0x80));
+    value >>= 7;
+  }
+  dest->push_back(static_cast<char>(value));
+}
+
+// Generates records of the synthetic corpus `kind` until `*size_limiter`
+// rejects them.
+//
+// Kinds:
+//  * "random" - incompressible bytes
+//  * "text"   - words from a small vocabulary
+//  * "proto"  - serialized protocol buffers with text, numbers, and random
+//               bytes, suitable for field projection
+bool GenerateRecords(absl::string_view kind, size_t record_size,
+                     std::vector<std::string>* records,
+                     SizeLimiter* size_limiter) {
+  static constexpr const char* kWords[] = {
+      "the",    "of",     "and",   "record", "chunk", "riegeli", "file",
+      "reader", "writer", "block", "data",   "value", "key",     "index"};
+  std::mt19937_64 random(42);
+  const auto append_random = [&](size_t length, std::string* dest) {
+    for (size_t i = 0; i < length; ++i) {
+      dest->push_back(static_cast<char>(random()));
+    }
+  };
+  const auto append_text = [&](size_t length, std::string* dest) {
+    const size_t limit = dest->size() + length;
+    while (dest->size() < limit) {
+      if (!dest->empty()) dest->push_back(' ');
+      dest->append(kWords[random() % (sizeof(kWords) / sizeof(kWords[0]))]);
+    }
+  };
+  if (kind != "random" && kind != "text" && kind != "proto") return false;
+  for (uint64_t id = 0;; ++id) {
+    std::string record;
+    if (kind == "random") {
+      append_random(record_size, &record);
+    } else if (kind == "text") {
+      append_text(record_size, &record);
+    } else {
+      // message Record {
+      //   uint64 id = 1;
+      //   string text = 2;
+      //   message Payload { uint64 length = 1; bytes data = 2; }
+      //   Payload payload = 3;
+      // }
+      std::string text;
+      append_text(record_size / 2, &text);
+      std::string data;
+      append_random(record_size / 4, &data);
+      std::string payload;
+      AppendVarint((1 << 3) | 0, &payload);
+      AppendVarint(data.size(), &payload);
+      AppendVarint((2 << 3) | 2, &payload);
+      AppendVarint(data.size(), &payload);
+      payload.append(data);
+      AppendVarint((1 << 3) | 0, &record);
+      AppendVarint(id, &record);
+      AppendVarint((2 << 3) | 2, &record);
+      AppendVarint(text.size(), &record);
+      record.append(text);
+      AppendVarint((3 << 3) | 2, &record);
+      AppendVarint(payload.size(), &record);
+      record.append(payload);
+    }
+    if (ABSL_PREDICT_FALSE(!size_limiter->Accept(
+            riegeli::LengthVarint64(record.size()) + record.size()))) {
+      return true;
+    }
+    records->push_back(std::move(record));
+  }
+}
+
 class Benchmarks {
  public:
   static bool ReadFile(const std::string& filename,
                        std::vector<std::string>* records,
                        SizeLimiter* size_limiter);
 
-  explicit Benchmarks(std::vector<std::string> records, std::string output_dir,
-                      int repetitions);
+  explicit Benchmarks(std::string output_dir, int repetitions,
+                      size_t random_reads, size_t corruptions);
 
   void RegisterTFRecord(absl::string_view tfrecord_options);
-  void RegisterRiegeli(absl::string_view riegeli_options);
+  void RegisterRiegeli(absl::string_view riegeli_options,
+                       const std::vector<std::string>& bucket_fraction_sweep,
+                       const std::vector<int>& parallelism_sweep);
+  void RegisterProjection(absl::string_view projection);
+  void RegisterReadScenario(absl::string_view scenario);
+  void RegisterThreadCount(int thread_count);
+
+  void RunAll(absl::string_view corpus_name, std::vector<std::string> records);
 
-  void RunAll();
+  // Returns results of all benchmarks run so far in JSON format.
+  std::string ResultsJson() const;
 
  private:
+  struct RiegeliBenchmark {
+    std::string name;
+    riegeli::RecordWriterBase::Options record_writer_options;
+    int read_parallelism;
+  };
+
   static void WriteTFRecord(
       const std::string& filename,
       const tensorflow::io::RecordWriterOptions& record_writer_options,
-      const std::vector<std::string>& records);
+      const std::vector<std::string>& records, StageTimer* stage_timer);
   static bool ReadTFRecord(
       const std::string& filename,
       const tensorflow::io::RecordReaderOptions& record_reader_options,
-      std::vector<std::string>* records, SizeLimiter* size_limiter = nullptr);
+      std::vector<std::string>* records, StageTimer* stage_timer,
+      SizeLimiter* size_limiter = nullptr);
 
   static void WriteRiegeli(
       absl::string_view filename,
       riegeli::RecordWriterBase::Options record_writer_options,
-      const std::vector<std::string>& records);
+      const std::vector<std::string>& records, StageTimer* stage_timer);
   static bool ReadRiegeli(
       absl::string_view filename,
       riegeli::RecordReaderBase::Options record_reader_options,
-      std::vector<std::string>* records, SizeLimiter* size_limiter = nullptr);
+      std::vector<std::string>* records, StageTimer* stage_timer,
+      SizeLimiter* size_limiter = nullptr);
 
+  // Benchmarks writing records to a file and reading them back, checking that
+  // the same records are read.
+  //
+  // If `write_records` is `nullptr`, the file is expected to be written
+  // already, and only reading is benchmarked, without checking the records.
   void RunOne(
-      const std::string& name,
-      std::function<void(const std::string&, const std::vector<std::string>&)>
+      const std::string& name, const std::string& format,
+      const std::string& options, const std::string& projection,
+      const std::string& filename,
+      std::function<void(const std::string&, const std::vector<std::string>&,
+                         StageTimer*)>
           write_records,
-      std::function<void(const std::string&, std::vector<std::string>*)>
+      std::function<void(const std::string&, std::vector<std::string>*,
+                         StageTimer*)>
           read_records);
 
+  // Runs read path scenarios on the file written by `riegeli_benchmark`.
+  void RunReadScenarios(const std::string& name,
+                        const RiegeliBenchmark& riegeli_benchmark,
+                        const std::string& filename);
+
+  // Benchmarks `operations` performed on a `RecordReader<Src>` reading
+  // `filename`. `operations` returns the number of operations performed.
+  template <typename Src>
+  void RunReadScenario(
+      const std::string& name, absl::string_view reader_name,
+      const std::string& options, const std::string& scenario,
+      const std::string& filename,
+      const riegeli::RecordReaderBase::Options& record_reader_options,
+      const std::function<size_t(riegeli::RecordReaderBase*)>& operations,
+      const size_t* skipped_regions = nullptr);
+
+  // Runs multi-threaded modes for each of `thread_counts_` on the file written
+  // by `riegeli_benchmark`.
+  void RunScalingModes(const std::string& name,
+                       const RiegeliBenchmark& riegeli_benchmark,
+                       const std::string& filename);
+
+  // Benchmarks `run` with each of `thread_counts_`. `run` processes
+  // `original_size_` bytes, or `original_size_` bytes per thread if
+  // `bytes_per_thread`.
+  void RunScalingMode(const std::string& name, const std::string& options,
+                      absl::string_view mode, bool bytes_per_thread,
+                      const std::function<void(int)>& run);
+
   static std::string Filename(std::string name);
 
-  std::vector<std::string> records_;
-  size_t original_size_;
   std::string output_dir_;
   int repetitions_;
+  size_t random_reads_;
+  size_t corruptions_;
   std::vector<std::pair<std::string, const char*>> tfrecord_benchmarks_;
-  std::vector<std::pair<std::string, riegeli::RecordWriterBase::Options>>
-      riegeli_benchmarks_;
+  std::vector<RiegeliBenchmark> riegeli_benchmarks_;
+  std::vector<std::pair<std::string, riegeli::FieldProjection>> projections_;
+  std::vector<std::string> read_scenarios_;
+  std::vector<int> thread_counts_;
   int max_name_width_ = 0;
+  // Set by `RunAll()` for the current corpus.
+  std::string corpus_name_;
+  std::vector<std::string> records_;
+  size_t original_size_ = 0;
+  // JSON objects describing results, one for each benchmark run so far.
+  std::vector<std::string> results_json_;
 };
 
 bool Benchmarks::ReadFile(const std::string& filename,
@@ -219,6 +571,7 @@ bool Benchmarks::ReadFile(const std::string& filename,
     std::cerr << "Could not open file: " << file_reader.status() << std::endl;
     std::exit(1);
   }
+  StageTimer stage_timer;
   {
     riegeli::TFRecordRecognizer tfrecord_recognizer(&file_reader);
     tensorflow::io::RecordReaderOptions record_reader_options;
@@ -228,7 +581,7 @@ bool Benchmarks::ReadFile(const std::string& filename,
       RIEGELI_CHECK(file_reader.Close()) << file_reader.status();
       std::cout << "Reading TFRecord: " << filename << std::endl;
       return ReadTFRecord(filename, record_reader_options, records,
-                          size_limiter);
+                          &stage_timer, size_limiter);
     }
   }
   RIEGELI_CHECK(file_reader.Seek(0)) << file_reader.status();
@@ -239,7 +592,7 @@ bool Benchmarks::ReadFile(const std::string& filename,
       RIEGELI_CHECK(file_reader.Close()) << file_reader.status();
       std::cout << "Reading Riegeli/records: " << filename << std::endl;
       return ReadRiegeli(filename, riegeli::RecordReaderBase::Options(),
-                         records, size_limiter);
+                         records, &stage_timer, size_limiter);
     }
   }
   std::cerr << "Unknown file format: " << filename << std::endl;
@@ -249,7 +602,8 @@ bool Benchmarks::ReadFile(const std::string& filename,
 void Benchmarks::WriteTFRecord(
     const std::string& filename,
     const tensorflow::io::RecordWriterOptions& record_writer_options,
-    const std::vector<std::string>& records) {
+    const std::vector<std::string>& records, StageTimer* stage_timer) {
+  stage_timer->Begin("open");
   tensorflow::Env* const env = tensorflow::Env::Default();
   std::unique_ptr<tensorflow::WritableFile> file_writer;
   {
@@ -259,18 +613,23 @@ void Benchmarks::WriteTFRecord(
   }
   tensorflow::io::RecordWriter record_writer(file_writer.get(),
                                              record_writer_options);
+  stage_timer->Begin("write");
   for (const std::string& record : records) {
     const tensorflow::Status status = record_writer.WriteRecord(record);
     RIEGELI_CHECK(status.ok()) << status;
   }
+  stage_timer->Begin("close");
   const tensorflow::Status status = record_writer.Close();
   RIEGELI_CHECK(status.ok()) << status;
+  stage_timer->End();
 }
 
 bool Benchmarks::ReadTFRecord(
     const std::string& filename,
     const tensorflow::io::RecordReaderOptions& record_reader_options,
-    std::vector<std::string>* records, SizeLimiter* size_limiter) {
+    std::vector<std::string>* records, StageTimer* stage_timer,
+    SizeLimiter* size_limiter) {
+  stage_timer->Begin("open");
   tensorflow::Env* const env = tensorflow::Env::Default();
   std::unique_ptr<tensorflow::RandomAccessFile> file_reader;
   {
@@ -280,6 +639,7 @@ bool Benchmarks::ReadTFRecord(
   }
   tensorflow::io::SequentialRecordReader record_reader(file_reader.get(),
                                                        record_reader_options);
+  stage_timer->Begin("read");
   tensorflow::tstring record;
   for (;;) {
     const tensorflow::Status status = record_reader.ReadRecord(&record);
@@ -294,29 +654,37 @@ bool Benchmarks::ReadTFRecord(
     }
     records->push_back(std::move(record));
   }
+  stage_timer->End();
   return true;
 }
 
 void Benchmarks::WriteRiegeli(
     absl::string_view filename,
     riegeli::RecordWriterBase::Options record_writer_options,
-    const std::vector<std::string>& records) {
+    const std::vector<std::string>& records, StageTimer* stage_timer) {
+  stage_timer->Begin("open");
   riegeli::RecordWriter<riegeli::FdWriter<>> record_writer(
       std::forward_as_tuple(filename, O_WRONLY | O_CREAT | O_TRUNC),
       std::move(record_writer_options));
+  stage_timer->Begin("write");
   for (const std::string& record : records) {
     RIEGELI_CHECK(record_writer.WriteRecord(record)) << record_writer.status();
   }
+  stage_timer->Begin("close");
   RIEGELI_CHECK(record_writer.Close()) << record_writer.status();
+  stage_timer->End();
 }
 
 bool Benchmarks::ReadRiegeli(
     absl::string_view filename,
     riegeli::RecordReaderBase::Options record_reader_options,
-    std::vector<std::string>* records, SizeLimiter* size_limiter) {
+    std::vector<std::string>* records, StageTimer* stage_timer,
+    SizeLimiter* size_limiter) {
+  stage_timer->Begin("open");
   riegeli::RecordReader<riegeli::FdReader<>> record_reader(
       std::forward_as_tuple(filename, O_RDONLY),
       std::move(record_reader_options));
+  stage_timer->Begin("read");
   std::string record;
   while (record_reader.ReadRecord(&record)) {
     if (size_limiter != nullptr &&
@@ -326,7 +694,9 @@ bool Benchmarks::ReadRiegeli(
     }
     records->push_back(std::move(record));
   }
+  stage_timer->Begin("close");
   RIEGELI_CHECK(record_reader.Close()) << record_reader.status();
+  stage_timer->End();
   return true;
 }
 
@@ -340,16 +710,12 @@ std::string Benchmarks::Filename(std::string name) {
   return name;
 }
 
-Benchmarks::Benchmarks(std::vector<std::string> records, std::string output_dir,
-                       int repetitions)
-    : records_(std::move(records)),
-      original_size_(0),
-      output_dir_(std::move(output_dir)),
-      repetitions_(repetitions) {
-  for (const std::string& record : records_) {
-    original_size_ += riegeli::LengthVarint64(record.size()) + record.size();
-  }
-}
+Benchmarks::Benchmarks(std::string output_dir, int repetitions,
+                       size_t random_reads, size_t corruptions)
+    : output_dir_(std::move(output_dir)),
+      repetitions_(repetitions),
+      random_reads_(random_reads),
+      corruptions_(corruptions) {}
 
 void Benchmarks::RegisterTFRecord(absl::string_view tfrecord_options) {
   max_name_width_ =
@@ -374,80 +740,547 @@ void Benchmarks::RegisterTFRecord(absl::string_view tfrecord_options) {
   tfrecord_benchmarks_.emplace_back(tfrecord_options, compression);
 }
 
-void Benchmarks::RegisterRiegeli(absl::string_view riegeli_options) {
-  max_name_width_ =
-      std::max(max_name_width_,
-               riegeli::IntCast<int>(absl::string_view("riegeli ").size() +
-                                     riegeli_options.size()));
-  riegeli::RecordWriterBase::Options options;
-  RIEGELI_CHECK_EQ(options.FromString(riegeli_options), riegeli::OkStatus());
-  riegeli_benchmarks_.emplace_back(riegeli_options, std::move(options));
+void Benchmarks::RegisterRiegeli(
+    absl::string_view riegeli_options,
+    const std::vector<std::string>& bucket_fraction_sweep,
+    const std::vector<int>& parallelism_sweep) {
+  std::vector<std::string> layouts;
+  if (bucket_fraction_sweep.empty() ||
+      !absl::StrContains(riegeli_options, "transpose") ||
+      absl::StrContains(riegeli_options, "bucket_fraction")) {
+    layouts.emplace_back(riegeli_options);
+  } else {
+    for (const std::string& bucket_fraction : bucket_fraction_sweep) {
+      layouts.push_back(absl::StrCat(riegeli_options,
+                                     riegeli_options.empty() ? "" : ",",
+                                     "bucket_fraction:", bucket_fraction));
+    }
+  }
+  std::vector<std::pair<std::string, int>> variants;
+  for (std::string& layout : layouts) {
+    if (parallelism_sweep.empty() ||
+        absl::StrContains(layout, "parallelism")) {
+      variants.emplace_back(std::move(layout), 0);
+    } else {
+      for (const int parallelism : parallelism_sweep) {
+        variants.emplace_back(
+            absl::StrCat(layout, layout.empty() ? "" : ",", "parallelism:",
+                         parallelism),
+            parallelism);
+      }
+    }
+  }
+  for (std::pair<std::string, int>& variant : variants) {
+    max_name_width_ =
+        std::max(max_name_width_,
+                 riegeli::IntCast<int>(absl::string_view("riegeli ").size() +
+                                       variant.first.size()));
+    riegeli::RecordWriterBase::Options options;
+    RIEGELI_CHECK_EQ(options.FromString(variant.first), riegeli::OkStatus());
+    riegeli_benchmarks_.push_back(RiegeliBenchmark{
+        std::move(variant.first), std::move(options), variant.second});
+  }
+}
+
+void Benchmarks::RegisterProjection(absl::string_view projection) {
+  riegeli::FieldProjection field_projection;
+  RIEGELI_CHECK(ParseFieldProjection(projection, &field_projection))
+      << "Invalid field projection: " << projection;
+  for (const RiegeliBenchmark& riegeli_benchmark : riegeli_benchmarks_) {
+    max_name_width_ = std::max(
+        max_name_width_,
+        riegeli::IntCast<int>(absl::string_view("riegeli  projection:").size() +
+                              riegeli_benchmark.name.size() +
+                              projection.size()));
+  }
+  projections_.emplace_back(std::string(projection),
+                            std::move(field_projection));
+}
+
+void Benchmarks::RegisterReadScenario(absl::string_view scenario) {
+  RIEGELI_CHECK(scenario == "seek_record_position" ||
+                scenario == "seek_fraction" || scenario == "seek_to_key" ||
+                scenario == "recover")
+      << "Unknown read benchmark: " << scenario;
+  read_scenarios_.emplace_back(scenario);
+}
+
+void Benchmarks::RegisterThreadCount(int thread_count) {
+  RIEGELI_CHECK_GT(thread_count, 0) << "Invalid thread count: " << thread_count;
+  thread_counts_.push_back(thread_count);
 }
 
-void Benchmarks::RunAll() {
+void Benchmarks::RunAll(absl::string_view corpus_name,
+                        std::vector<std::string> records) {
+  corpus_name_ = std::string(corpus_name);
+  records_ = std::move(records);
+  original_size_ = 0;
+  for (const std::string& record : records_) {
+    original_size_ += riegeli::LengthVarint64(record.size()) + record.size();
+  }
+  absl::PrintF("Corpus: %s\n", corpus_name_);
   absl::PrintF("Original uncompressed size: %.3f MB\n",
                static_cast<double>(original_size_) / 1000000.0);
   absl::PrintF("Creating files %s/record_benchmark_*\n", output_dir_);
-  absl::PrintF("%-*s  Compr.    Write       Read\n", max_name_width_, "");
-  absl::PrintF("%-*s  ratio    CPU Real   CPU Real\n", max_name_width_, "");
-  absl::PrintF("%-*s    %%     MB/s MB/s  MB/s MB/s\n", max_name_width_,
+  absl::PrintF("%-*s  Compr.    Write       Read Decoded\n", max_name_width_,
+               "");
+  absl::PrintF("%-*s  ratio    CPU Real   CPU Real    size\n", max_name_width_,
+               "");
+  absl::PrintF("%-*s    %%     MB/s MB/s  MB/s MB/s      %%\n", max_name_width_,
                "Format");
   absl::PrintF(
-      "%s\n", std::string(riegeli::IntCast<size_t>(max_name_width_ + 30), '-'));
+      "%s\n", std::string(riegeli::IntCast<size_t>(max_name_width_ + 38), '-'));
 
   for (const std::pair<std::string, const char*>& tfrecord_options :
        tfrecord_benchmarks_) {
+    const std::string name = absl::StrCat("tfrecord ", tfrecord_options.first);
     RunOne(
-        absl::StrCat("tfrecord ", tfrecord_options.first),
+        name, "tfrecord", tfrecord_options.first, "",
+        absl::StrCat(output_dir_, "/record_benchmark_", Filename(name)),
         [&](const std::string& filename,
-            const std::vector<std::string>& records) {
+            const std::vector<std::string>& records, StageTimer* stage_timer) {
           WriteTFRecord(
               filename,
               tensorflow::io::RecordWriterOptions::CreateRecordWriterOptions(
                   tfrecord_options.second),
-              records);
+              records, stage_timer);
         },
-        [&](const std::string& filename, std::vector<std::string>* records) {
+        [&](const std::string& filename, std::vector<std::string>* records,
+            StageTimer* stage_timer) {
           return ReadTFRecord(
               filename,
               tensorflow::io::RecordReaderOptions::CreateRecordReaderOptions(
                   tfrecord_options.second),
-              records);
+              records, stage_timer);
         });
   }
-  for (const std::pair<std::string, riegeli::RecordWriterBase::Options>&
-           riegeli_options : riegeli_benchmarks_) {
+  for (const RiegeliBenchmark& riegeli_benchmark : riegeli_benchmarks_) {
+    const std::string name = absl::StrCat("riegeli ", riegeli_benchmark.name);
+    const std::string filename =
+        absl::StrCat(output_dir_, "/record_benchmark_", Filename(name));
     RunOne(
-        absl::StrCat("riegeli ", riegeli_options.first),
+        name, "riegeli", riegeli_benchmark.name, "", filename,
         [&](const std::string& filename,
-            const std::vector<std::string>& records) {
-          WriteRiegeli(filename, riegeli_options.second, records);
+            const std::vector<std::string>& records, StageTimer* stage_timer) {
+          WriteRiegeli(filename, riegeli_benchmark.record_writer_options,
+                       records, stage_timer);
         },
-        [&](const std::string& filename, std::vector<std::string>* records) {
-          return ReadRiegeli(filename, riegeli::RecordReaderBase::Options(),
-                             records);
+        [&](const std::string& filename, std::vector<std::string>* records,
+            StageTimer* stage_timer) {
+          return ReadRiegeli(filename,
+                             riegeli::RecordReaderBase::Options()
+                                 .set_parallelism(
+                                     riegeli_benchmark.read_parallelism),
+                             records, stage_timer);
         });
+    for (const std::pair<std::string, riegeli::FieldProjection>& projection :
+         projections_) {
+      RunOne(absl::StrCat(name, " projection:", projection.first), "riegeli",
+             riegeli_benchmark.name, projection.first, filename, nullptr,
+             [&](const std::string& filename, std::vector<std::string>* records,
+                 StageTimer* stage_timer) {
+               return ReadRiegeli(
+                   filename,
+                   riegeli::RecordReaderBase::Options()
+                       .set_field_projection(projection.second)
+                       .set_parallelism(riegeli_benchmark.read_parallelism),
+                   records, stage_timer);
+             });
+    }
+  }
+  if (!read_scenarios_.empty() && !records_.empty()) {
+    absl::PrintF("\n%-*s  Reader  %-20s %7s %9s %9s\n", max_name_width_,
+                 "Format", "Scenario", "Ops", "Real us", "CPU us");
+    absl::PrintF("%s\n", std::string(riegeli::IntCast<size_t>(
+                                         max_name_width_ + 58),
+                                     '-'));
+    for (const RiegeliBenchmark& riegeli_benchmark : riegeli_benchmarks_) {
+      const std::string name =
+          absl::StrCat("riegeli ", riegeli_benchmark.name);
+      RunReadScenarios(
+          name, riegeli_benchmark,
+          absl::StrCat(output_dir_, "/record_benchmark_", Filename(name)));
+    }
+  }
+  if (!thread_counts_.empty() && !records_.empty()) {
+    absl::PrintF("\n%-*s  %-19s %7s %9s %9s %6s\n", max_name_width_, "Format",
+                 "Mode", "Threads", "Real MB/s", "CPU MB/s", "Eff. %");
+    absl::PrintF("%s\n", std::string(riegeli::IntCast<size_t>(
+                                         max_name_width_ + 57),
+                                     '-'));
+    for (const RiegeliBenchmark& riegeli_benchmark : riegeli_benchmarks_) {
+      const std::string name =
+          absl::StrCat("riegeli ", riegeli_benchmark.name);
+      RunScalingModes(
+          name, riegeli_benchmark,
+          absl::StrCat(output_dir_, "/record_benchmark_", Filename(name)));
+    }
+  }
+  std::cout << std::endl;
+}
+
+void Benchmarks::RunScalingModes(const std::string& name,
+                                 const RiegeliBenchmark& riegeli_benchmark,
+                                 const std::string& filename) {
+  const auto read_file = [&](int parallelism) {
+    riegeli::RecordReader<riegeli::FdReader<>> record_reader(
+        std::forward_as_tuple(filename, O_RDONLY),
+        riegeli::RecordReaderBase::Options().set_parallelism(parallelism));
+    absl::string_view record;
+    size_t num_records = 0;
+    while (record_reader.ReadRecord(&record)) ++num_records;
+    RIEGELI_CHECK(record_reader.Close()) << record_reader.status();
+    RIEGELI_CHECK_EQ(num_records, records_.size())
+        << "Unexpected number of records in " << filename;
+  };
+  RunScalingMode(name, riegeli_benchmark.name, "independent_readers", true,
+                 [&](int thread_count) {
+                   std::vector<std::thread> threads;
+                   threads.reserve(riegeli::IntCast<size_t>(thread_count));
+                   for (int i = 0; i < thread_count; ++i) {
+                     threads.emplace_back([&] {
+                       read_file(riegeli_benchmark.read_parallelism);
+                     });
+                   }
+                   for (std::thread& thread : threads) thread.join();
+                 });
+  RunScalingMode(name, riegeli_benchmark.name, "parallel_reader", false,
+                 read_file);
+  // Encoding already runs in the thread pool of `ShardedRecordWriter`, so
+  // shards are written without their own parallelism.
+  riegeli::RecordWriterBase::Options shard_options =
+      riegeli_benchmark.record_writer_options;
+  shard_options.set_parallelism(0);
+  RunScalingMode(
+      name, riegeli_benchmark.name, "sharded_writers", false,
+      [&](int thread_count) {
+        riegeli::ShardedRecordWriter sharded_writer(
+            riegeli::IntCast<size_t>(thread_count),
+            [&](size_t shard_index) {
+              return std::make_unique<
+                  riegeli::RecordWriter<riegeli::FdWriter<>>>(
+                  std::forward_as_tuple(
+                      absl::StrCat(filename, "_shard_", shard_index),
+                      O_WRONLY | O_CREAT | O_TRUNC),
+                  shard_options);
+            },
+            riegeli::ShardedRecordWriter::Options().set_parallelism(
+                thread_count));
+        for (const std::string& record : records_) {
+          RIEGELI_CHECK(sharded_writer.WriteRecord(record))
+              << sharded_writer.status();
+        }
+        RIEGELI_CHECK(sharded_writer.Close()) << sharded_writer.status();
+      });
+}
+
+void Benchmarks::RunScalingMode(const std::string& name,
+                                const std::string& options,
+                                absl::string_view mode, bool bytes_per_thread,
+                                const std::function<void(int)>& run) {
+  // Throughput per thread of the first thread count, as the baseline of
+  // scaling efficiency.
+  double baseline_mb_per_s_per_thread = 0.0;
+  for (const int thread_count : thread_counts_) {
+    const double bytes =
+        static_cast<double>(original_size_) *
+        (bytes_per_thread ? static_cast<double>(thread_count) : 1.0);
+    Stats real_time_s;
+    Stats cpu_time_s;
+    for (int i = 0; i < repetitions_ + 1; ++i) {
+      const uint64_t cpu_time_before_ns = CpuTimeNow_ns();
+      const uint64_t real_time_before_ns = RealTimeNow_ns();
+      run(thread_count);
+      const uint64_t cpu_time_after_ns = CpuTimeNow_ns();
+      const uint64_t real_time_after_ns = RealTimeNow_ns();
+      if (i == 0) {
+        // Warm-up.
+      } else {
+        real_time_s.Add(
+            static_cast<double>(real_time_after_ns - real_time_before_ns) /
+            1e9);
+        cpu_time_s.Add(
+            static_cast<double>(cpu_time_after_ns - cpu_time_before_ns) / 1e9);
+      }
+    }
+    const double real_mb_per_s = bytes / real_time_s.Median() / 1e6;
+    const double cpu_mb_per_s = bytes / cpu_time_s.Median() / 1e6;
+    const double mb_per_s_per_thread =
+        real_mb_per_s / static_cast<double>(thread_count);
+    if (thread_count == thread_counts_.front()) {
+      baseline_mb_per_s_per_thread = mb_per_s_per_thread;
+    }
+    const double efficiency =
+        mb_per_s_per_thread / baseline_mb_per_s_per_thread;
+    absl::PrintF("%-*s  %-19s %7d %9.0f %9.0f %6.1f\n", max_name_width_, name,
+                 mode, thread_count, real_mb_per_s, cpu_mb_per_s,
+                 efficiency * 100.0);
+
+    std::string json = "{\"corpus\": ";
+    AppendJsonString(corpus_name_, &json);
+    absl::StrAppend(&json, ", \"name\": ");
+    AppendJsonString(name, &json);
+    absl::StrAppend(&json, ", \"format\": \"riegeli\", \"options\": ");
+    AppendJsonString(options, &json);
+    absl::StrAppend(&json, ", \"mode\": ");
+    AppendJsonString(mode, &json);
+    absl::StrAppendFormat(
+        &json,
+        ", \"threads\": %d, \"bytes\": %.0f, \"cpu_time_s\": %.6f, "
+        "\"real_time_s\": %.6f, \"cpu_mb_per_s\": %.3f, "
+        "\"real_mb_per_s\": %.3f, \"scaling_efficiency\": %.6f}",
+        thread_count, bytes, cpu_time_s.Median(), real_time_s.Median(),
+        cpu_mb_per_s, real_mb_per_s, efficiency);
+    results_json_.push_back(std::move(json));
+  }
+}
+
+void Benchmarks::RunReadScenarios(const std::string& name,
+                                  const RiegeliBenchmark& riegeli_benchmark,
+                                  const std::string& filename) {
+  // Positions of all records, for choosing records to seek to.
+  std::vector<riegeli::RecordPosition> positions;
+  riegeli::Position size;
+  {
+    riegeli::RecordReader<riegeli::FdReader<>> record_reader(
+        std::forward_as_tuple(filename, O_RDONLY));
+    absl::string_view record;
+    riegeli::RecordPosition key;
+    while (record_reader.ReadRecord(&record, &key)) positions.push_back(key);
+    RIEGELI_CHECK(record_reader.Size(&size)) << record_reader.status();
+    RIEGELI_CHECK(record_reader.Close()) << record_reader.status();
+  }
+  RIEGELI_CHECK_EQ(positions.size(), records_.size())
+      << "Unexpected number of records in " << filename;
+  // The same random choices are used for both readers.
+  std::mt19937_64 random(42);
+  std::vector<size_t> indices(random_reads_);
+  for (size_t& index : indices) index = random() % records_.size();
+  std::vector<riegeli::Position> fraction_positions(random_reads_);
+  for (riegeli::Position& pos : fraction_positions) {
+    pos = random() % (size + 1);
+  }
+  const riegeli::RecordReaderBase::Options record_reader_options =
+      riegeli::RecordReaderBase::Options().set_parallelism(
+          riegeli_benchmark.read_parallelism);
+
+  for (const std::string& scenario : read_scenarios_) {
+    std::string scenario_filename = filename;
+    riegeli::RecordReaderBase::Options scenario_options =
+        record_reader_options;
+    std::function<size_t(riegeli::RecordReaderBase*)> operations;
+    size_t skipped_regions = 0;
+    if (scenario == "seek_record_position") {
+      operations = [&](riegeli::RecordReaderBase* record_reader) {
+        absl::string_view record;
+        for (const size_t index : indices) {
+          RIEGELI_CHECK(record_reader->Seek(positions[index]))
+              << record_reader->status();
+          RIEGELI_CHECK(record_reader->ReadRecord(&record))
+              << record_reader->status();
+          RIEGELI_CHECK(record == records_[index])
+              << "Record read after seeking does not match for " << name;
+        }
+        return indices.size();
+      };
+    } else if (scenario == "seek_fraction") {
+      operations = [&](riegeli::RecordReaderBase* record_reader) {
+        absl::string_view record;
+        for (const riegeli::Position pos : fraction_positions) {
+          RIEGELI_CHECK(record_reader->Seek(pos)) << record_reader->status();
+          // Seeking past the last record leaves nothing to read.
+          RIEGELI_CHECK(record_reader->ReadRecord(&record) ||
+                        record_reader->healthy())
+              << record_reader->status();
+        }
+        return fraction_positions.size();
+      };
+    } else if (scenario == "seek_to_key") {
+      // Each record is prefixed with its key, which is its index in
+      // fixed-width hexadecimal, so that records are sorted by keys.
+      static constexpr size_t kKeySize = 16;
+      const auto key = [](size_t index) {
+        return absl::StrFormat("%016x", index);
+      };
+      const auto key_extractor = [](absl::string_view record) {
+        return std::string(record.substr(0, kKeySize));
+      };
+      scenario_filename = absl::StrCat(filename, "_sorted");
+      {
+        riegeli::RecordWriterBase::Options record_writer_options =
+            riegeli_benchmark.record_writer_options;
+        record_writer_options.set_key_extractor(key_extractor)
+            .set_sorted_keys(true);
+        riegeli::RecordWriter<riegeli::FdWriter<>> record_writer(
+            std::forward_as_tuple(scenario_filename,
+                                  O_WRONLY | O_CREAT | O_TRUNC),
+            std::move(record_writer_options));
+        for (size_t index = 0; index < records_.size(); ++index) {
+          RIEGELI_CHECK(record_writer.WriteRecord(
+              absl::StrCat(key(index), records_[index])))
+              << record_writer.status();
+        }
+        RIEGELI_CHECK(record_writer.Close()) << record_writer.status();
+      }
+      scenario_options.set_key_extractor(key_extractor);
+      operations = [&, key](riegeli::RecordReaderBase* record_reader) {
+        absl::string_view record;
+        for (const size_t index : indices) {
+          const std::string record_key = key(index);
+          RIEGELI_CHECK(record_reader->SeekToKey(record_key))
+              << record_reader->status();
+          RIEGELI_CHECK(record_reader->ReadRecord(&record))
+              << record_reader->status();
+          RIEGELI_CHECK(record.substr(0, kKeySize) == record_key &&
+                        record.substr(kKeySize) == records_[index])
+              << "Record read after seeking to a key does not match for "
+              << name;
+        }
+        return indices.size();
+      };
+    } else if (scenario == "recover") {
+      scenario_filename = absl::StrCat(filename, "_corrupted");
+      {
+        riegeli::FdReader<> file_reader(filename, O_RDONLY);
+        std::string contents;
+        RIEGELI_CHECK(file_reader.ReadAll(&contents)) << file_reader.status();
+        RIEGELI_CHECK(file_reader.Close()) << file_reader.status();
+        // Keep the file signature intact, so that the file is recognized.
+        static constexpr size_t kIntactPrefix = 64;
+        if (contents.size() > kIntactPrefix) {
+          for (size_t i = 0; i < corruptions_; ++i) {
+            contents[kIntactPrefix +
+                     random() % (contents.size() - kIntactPrefix)] ^= 0x5a;
+          }
+        }
+        riegeli::FdWriter<> file_writer(scenario_filename,
+                                        O_WRONLY | O_CREAT | O_TRUNC);
+        RIEGELI_CHECK(file_writer.Write(contents)) << file_writer.status();
+        RIEGELI_CHECK(file_writer.Close()) << file_writer.status();
+      }
+      scenario_options.set_recovery(
+          [&skipped_regions](const riegeli::SkippedRegion&) {
+            ++skipped_regions;
+            return true;
+          });
+      operations = [&](riegeli::RecordReaderBase* record_reader) {
+        skipped_regions = 0;
+        size_t num_records = 0;
+        absl::string_view record;
+        while (record_reader->ReadRecord(&record)) ++num_records;
+        RIEGELI_CHECK(record_reader->healthy()) << record_reader->status();
+        return num_records;
+      };
+    }
+    const size_t* const skipped_regions_ptr =
+        scenario == "recover" ? &skipped_regions : nullptr;
+    RunReadScenario<riegeli::FdReader<>>(
+        name, "fd", riegeli_benchmark.name, scenario, scenario_filename,
+        scenario_options, operations, skipped_regions_ptr);
+    RunReadScenario<riegeli::FdMMapReader<>>(
+        name, "mmap", riegeli_benchmark.name, scenario, scenario_filename,
+        scenario_options, operations, skipped_regions_ptr);
+  }
+}
+
+template <typename Src>
+void Benchmarks::RunReadScenario(
+    const std::string& name, absl::string_view reader_name,
+    const std::string& options, const std::string& scenario,
+    const std::string& filename,
+    const riegeli::RecordReaderBase::Options& record_reader_options,
+    const std::function<size_t(riegeli::RecordReaderBase*)>& operations,
+    const size_t* skipped_regions) {
+  Measurement reading;
+  size_t num_operations = 0;
+  for (int i = 0; i < repetitions_ + 1; ++i) {
+    StageTimer stage_timer;
+    stage_timer.Begin("open");
+    riegeli::RecordReader<Src> record_reader(
+        std::forward_as_tuple(filename, O_RDONLY), record_reader_options);
+    stage_timer.Begin("operations");
+    const uint64_t cpu_time_before_ns = CpuTimeNow_ns();
+    const uint64_t real_time_before_ns = RealTimeNow_ns();
+    num_operations = operations(&record_reader);
+    const uint64_t cpu_time_after_ns = CpuTimeNow_ns();
+    const uint64_t real_time_after_ns = RealTimeNow_ns();
+    stage_timer.Begin("close");
+    RIEGELI_CHECK(record_reader.Close()) << record_reader.status();
+    stage_timer.End();
+    if (i == 0) {
+      // Warm-up.
+    } else {
+      reading.Add(cpu_time_after_ns - cpu_time_before_ns,
+                  real_time_after_ns - real_time_before_ns, stage_timer);
+    }
   }
+  const double ops = static_cast<double>(
+      riegeli::UnsignedMax(num_operations, size_t{1}));
+  const double real_us_per_op = reading.real_time_s().Median() / ops * 1e6;
+  const double cpu_us_per_op = reading.cpu_time_s().Median() / ops * 1e6;
+  absl::PrintF("%-*s  %-6s  %-20s %7u %9.3f %9.3f\n", max_name_width_, name,
+               reader_name, scenario, num_operations, real_us_per_op,
+               cpu_us_per_op);
+
+  std::string json = "{\"corpus\": ";
+  AppendJsonString(corpus_name_, &json);
+  absl::StrAppend(&json, ", \"name\": ");
+  AppendJsonString(name, &json);
+  absl::StrAppend(&json, ", \"format\": \"riegeli\", \"options\": ");
+  AppendJsonString(options, &json);
+  absl::StrAppend(&json, ", \"reader\": ");
+  AppendJsonString(reader_name, &json);
+  absl::StrAppend(&json, ", \"scenario\": ");
+  AppendJsonString(scenario, &json);
+  absl::StrAppendFormat(&json,
+                        ", \"operations\": %u, \"cpu_time_s\": %.6f, "
+                        "\"real_time_s\": %.6f, \"cpu_us_per_op\": %.3f, "
+                        "\"real_us_per_op\": %.3f",
+                        num_operations, reading.cpu_time_s().Median(),
+                        reading.real_time_s().Median(), cpu_us_per_op,
+                        real_us_per_op);
+  if (skipped_regions != nullptr) {
+    absl::StrAppendFormat(&json, ", \"skipped_regions\": %u",
+                          *skipped_regions);
+  }
+  absl::StrAppend(&json, ", \"stages_s\": {");
+  bool first = true;
+  for (std::pair<std::string, Stats>& stage_s : reading.stages_s()) {
+    if (!first) absl::StrAppend(&json, ", ");
+    first = false;
+    AppendJsonString(stage_s.first, &json);
+    absl::StrAppendFormat(&json, ": %.6f", stage_s.second.Median());
+  }
+  absl::StrAppend(&json, "}}");
+  results_json_.push_back(std::move(json));
 }
 
 void Benchmarks::RunOne(
-    const std::string& name,
-    std::function<void(const std::string&, const std::vector<std::string>&)>
+    const std::string& name, const std::string& format,
+    const std::string& options, const std::string& projection,
+    const std::string& filename,
+    std::function<void(const std::string&, const std::vector<std::string>&,
+                       StageTimer*)>
         write_records,
-    std::function<void(const std::string&, std::vector<std::string>*)>
+    std::function<void(const std::string&, std::vector<std::string>*,
+                       StageTimer*)>
         read_records) {
-  const std::string filename =
-      absl::StrCat(output_dir_, "/record_benchmark_", Filename(name));
-
+  ResetPeakRss();
   Stats compression;
   Stats writing_cpu_speed;
   Stats writing_real_speed;
   Stats reading_cpu_speed;
   Stats reading_real_speed;
-  for (int i = 0; i < repetitions_ + 1; ++i) {
+  Measurement writing;
+  Measurement reading;
+  // Total size of records read, which is smaller than `original_size_` when
+  // reading with a field projection.
+  size_t decoded_size = 0;
+  for (int i = 0; write_records != nullptr && i < repetitions_ + 1; ++i) {
+    StageTimer stage_timer;
     const uint64_t cpu_time_before_ns = CpuTimeNow_ns();
     const uint64_t real_time_before_ns = RealTimeNow_ns();
-    write_records(filename, records_);
+    write_records(filename, records_, &stage_timer);
     const uint64_t cpu_time_after_ns = CpuTimeNow_ns();
     const uint64_t real_time_after_ns = RealTimeNow_ns();
     if (i == 0) {
@@ -462,19 +1295,31 @@ void Benchmarks::RunOne(
           static_cast<double>(original_size_) /
           static_cast<double>(real_time_after_ns - real_time_before_ns) *
           1000.0);
+      writing.Add(cpu_time_after_ns - cpu_time_before_ns,
+                  real_time_after_ns - real_time_before_ns, stage_timer);
     }
   }
+  if (write_records == nullptr) {
+    compression.Add(static_cast<double>(FileSize(filename)) /
+                    static_cast<double>(original_size_) * 100.0);
+  }
   for (int i = 0; i < repetitions_ + 1; ++i) {
+    StageTimer stage_timer;
     std::vector<std::string> decoded_records;
     const uint64_t cpu_time_before_ns = CpuTimeNow_ns();
     const uint64_t real_time_before_ns = RealTimeNow_ns();
-    read_records(filename, &decoded_records);
+    read_records(filename, &decoded_records, &stage_timer);
     const uint64_t cpu_time_after_ns = CpuTimeNow_ns();
     const uint64_t real_time_after_ns = RealTimeNow_ns();
     if (i == 0) {
       // Warm-up and correctness check.
-      RIEGELI_CHECK(decoded_records == records_)
-          << "Decoded records do not match for " << name;
+      for (const std::string& record : decoded_records) {
+        decoded_size += riegeli::LengthVarint64(record.size()) + record.size();
+      }
+      if (write_records != nullptr) {
+        RIEGELI_CHECK(decoded_records == records_)
+            << "Decoded records do not match for " << name;
+      }
     } else {
       reading_cpu_speed.Add(
           static_cast<double>(original_size_) /
@@ -483,25 +1328,84 @@ void Benchmarks::RunOne(
           static_cast<double>(original_size_) /
           static_cast<double>(real_time_after_ns - real_time_before_ns) *
           1000.0);
+      reading.Add(cpu_time_after_ns - cpu_time_before_ns,
+                  real_time_after_ns - real_time_before_ns, stage_timer);
     }
   }
+  const uint64_t peak_rss = PeakRss_bytes();
 
   absl::PrintF("%-*s %7.3f", max_name_width_, name, compression.Median());
-  for (const std::array<Stats*, 2>& stats_cpu_real :
-       {std::array<Stats*, 2>{{&writing_cpu_speed, &writing_real_speed}},
-        std::array<Stats*, 2>{{&reading_cpu_speed, &reading_real_speed}}}) {
-    absl::PrintF(" ");
-    for (Stats* const stats : stats_cpu_real) {
-      absl::PrintF(" %4.0f", stats->Median());
-    }
+  if (write_records != nullptr) {
+    absl::PrintF("  %4.0f %4.0f", writing_cpu_speed.Median(),
+                 writing_real_speed.Median());
+  } else {
+    absl::PrintF("  %4s %4s", "-", "-");
   }
+  absl::PrintF("  %4.0f %4.0f", reading_cpu_speed.Median(),
+               reading_real_speed.Median());
+  absl::PrintF(" %7.3f", static_cast<double>(decoded_size) /
+                             static_cast<double>(original_size_) * 100.0);
   std::cout << std::endl;
+
+  std::string json = "{\"corpus\": ";
+  AppendJsonString(corpus_name_, &json);
+  absl::StrAppend(&json, ", \"name\": ");
+  AppendJsonString(name, &json);
+  absl::StrAppend(&json, ", \"format\": ");
+  AppendJsonString(format, &json);
+  absl::StrAppend(&json, ", \"options\": ");
+  AppendJsonString(options, &json);
+  absl::StrAppend(&json, ", \"projection\": ");
+  AppendJsonString(projection, &json);
+  absl::StrAppendFormat(&json,
+                        ", \"records\": %u, \"original_size\": %u, "
+                        "\"compressed_size\": %u, \"compression_ratio\": %.6f, "
+                        "\"decoded_size\": %u",
+                        records_.size(), original_size_, FileSize(filename),
+                        compression.Median() / 100.0, decoded_size);
+  for (const std::pair<const char*, Measurement*>& stage :
+       {std::pair<const char*, Measurement*>("write", &writing),
+        std::pair<const char*, Measurement*>("read", &reading)}) {
+    if (stage.second->empty()) continue;
+    Stats& speed_cpu = stage.second == &writing ? writing_cpu_speed
+                                                : reading_cpu_speed;
+    Stats& speed_real = stage.second == &writing ? writing_real_speed
+                                                 : reading_real_speed;
+    absl::StrAppendFormat(
+        &json,
+        ", \"%s\": {\"cpu_time_s\": %.6f, \"real_time_s\": %.6f, "
+        "\"cpu_mb_per_s\": %.3f, \"real_mb_per_s\": %.3f, \"stages_s\": {",
+        stage.first, stage.second->cpu_time_s().Median(),
+        stage.second->real_time_s().Median(), speed_cpu.Median(),
+        speed_real.Median());
+    bool first = true;
+    for (std::pair<std::string, Stats>& stage_s : stage.second->stages_s()) {
+      if (!first) absl::StrAppend(&json, ", ");
+      first = false;
+      AppendJsonString(stage_s.first, &json);
+      absl::StrAppendFormat(&json, ": %.6f", stage_s.second.Median());
+    }
+    absl::StrAppend(&json, "}}");
+  }
+  absl::StrAppendFormat(&json, ", \"peak_rss_bytes\": %u}", peak_rss);
+  results_json_.push_back(std::move(json));
+}
+
+std::string Benchmarks::ResultsJson() const {
+  std::string json =
+      absl::StrFormat("{\"repetitions\": %d, \"benchmarks\": [", repetitions_);
+  for (size_t i = 0; i < results_json_.size(); ++i) {
+    absl::StrAppend(&json, i == 0 ? "\n  " : ",\n  ", results_json_[i]);
+  }
+  absl::StrAppend(&json, "\n]}\n");
+  return json;
 }
 
 const char kUsage[] =
     "Usage: records_benchmark (OPTION|FILE)...\n"
     "\n"
-    "FILEs may be TFRecord or Riegeli/records files.\n";
+    "FILEs may be TFRecord or Riegeli/records files. They form a corpus called "
+    "\"files\". More corpora can be specified with --corpora.\n";
 
 template <typename Function>
 void ForEachWord(absl::string_view words, Function f) {
@@ -516,26 +1420,108 @@ void ForEachWord(absl::string_view words, Function f) {
 int main(int argc, char** argv) {
   absl::SetProgramUsageMessage(kUsage);
   const std::vector<char*> args = absl::ParseCommandLine(argc, argv);
-  std::vector<std::string> records;
-  if (args.size() <= 1) {
+  // Pairs of corpus names and specifications: a list of files, or the kind of
+  // a synthetic corpus.
+  std::vector<std::pair<std::string, std::vector<std::string>>> corpora;
+  if (args.size() > 1) {
+    corpora.emplace_back(
+        "files", std::vector<std::string>(args.begin() + 1, args.end()));
+  }
+  ForEachWord(absl::GetFlag(FLAGS_corpora), [&](absl::string_view corpus) {
+    if (absl::StartsWith(corpus, "synthetic:")) {
+      corpora.emplace_back(std::string(corpus), std::vector<std::string>());
+      return;
+    }
+    const size_t equals = corpus.find('=');
+    if (equals == absl::string_view::npos) {
+      std::cerr << "Invalid corpus: " << corpus << std::endl;
+      std::exit(1);
+    }
+    corpora.emplace_back(
+        std::string(corpus.substr(0, equals)),
+        absl::StrSplit(corpus.substr(equals + 1), ',', absl::SkipEmpty()));
+  });
+  if (corpora.empty()) {
     std::cerr << kUsage << std::endl;
     return 1;
   }
-  std::cout << std::endl;
-  SizeLimiter size_limiter(
-      riegeli::IntCast<size_t>(absl::GetFlag(FLAGS_max_size)));
-  for (size_t i = 1; i < args.size(); ++i) {
-    if (!Benchmarks::ReadFile(args[i], &records, &size_limiter)) break;
-  }
-  Benchmarks benchmarks(std::move(records), absl::GetFlag(FLAGS_output_dir),
-                        absl::GetFlag(FLAGS_repetitions));
+  std::vector<int> parallelism_sweep;
+  ForEachWord(absl::GetFlag(FLAGS_parallelism_sweep),
+              [&](absl::string_view parallelism_text) {
+                int parallelism;
+                RIEGELI_CHECK(
+                    absl::SimpleAtoi(parallelism_text, &parallelism) &&
+                    parallelism >= 0)
+                    << "Invalid parallelism: " << parallelism_text;
+                parallelism_sweep.push_back(parallelism);
+              });
+  std::vector<std::string> bucket_fraction_sweep;
+  ForEachWord(absl::GetFlag(FLAGS_bucket_fraction_sweep),
+              [&](absl::string_view bucket_fraction_text) {
+                double bucket_fraction;
+                RIEGELI_CHECK(
+                    absl::SimpleAtod(bucket_fraction_text, &bucket_fraction) &&
+                    bucket_fraction >= 0.0 && bucket_fraction <= 1.0)
+                    << "Invalid bucket fraction: " << bucket_fraction_text;
+                bucket_fraction_sweep.emplace_back(bucket_fraction_text);
+              });
+  Benchmarks benchmarks(
+      absl::GetFlag(FLAGS_output_dir), absl::GetFlag(FLAGS_repetitions),
+      riegeli::IntCast<size_t>(absl::GetFlag(FLAGS_random_reads)),
+      riegeli::IntCast<size_t>(absl::GetFlag(FLAGS_corruptions)));
   ForEachWord(absl::GetFlag(FLAGS_tfrecord_benchmarks),
               [&](absl::string_view tfrecord_options) {
                 benchmarks.RegisterTFRecord(tfrecord_options);
               });
   ForEachWord(absl::GetFlag(FLAGS_riegeli_benchmarks),
               [&](absl::string_view riegeli_options) {
-                benchmarks.RegisterRiegeli(riegeli_options);
+                benchmarks.RegisterRiegeli(riegeli_options,
+                                           bucket_fraction_sweep,
+                                           parallelism_sweep);
+              });
+  ForEachWord(absl::GetFlag(FLAGS_projections),
+              [&](absl::string_view projection) {
+                benchmarks.RegisterProjection(projection);
+              });
+  ForEachWord(absl::GetFlag(FLAGS_read_benchmarks),
+              [&](absl::string_view scenario) {
+                benchmarks.RegisterReadScenario(scenario);
+              });
+  ForEachWord(absl::GetFlag(FLAGS_thread_counts),
+              [&](absl::string_view thread_count_text) {
+                int thread_count;
+                RIEGELI_CHECK(absl::SimpleAtoi(thread_count_text,
+                                               &thread_count) &&
+                              thread_count > 0)
+                    << "Invalid thread count: " << thread_count_text;
+                benchmarks.RegisterThreadCount(thread_count);
               });
-  benchmarks.RunAll();
+  for (const std::pair<std::string, std::vector<std::string>>& corpus :
+       corpora) {
+    std::cout << std::endl;
+    std::vector<std::string> records;
+    SizeLimiter size_limiter(
+        riegeli::IntCast<size_t>(absl::GetFlag(FLAGS_max_size)));
+    if (absl::StartsWith(corpus.first, "synthetic:")) {
+      RIEGELI_CHECK(GenerateRecords(
+          absl::string_view(corpus.first).substr(
+              absl::string_view("synthetic:").size()),
+          riegeli::IntCast<size_t>(absl::GetFlag(FLAGS_synthetic_record_size)),
+          &records, &size_limiter))
+          << "Unknown synthetic corpus: " << corpus.first;
+    } else {
+      for (const std::string& filename : corpus.second) {
+        if (!Benchmarks::ReadFile(filename, &records, &size_limiter)) break;
+      }
+    }
+    benchmarks.RunAll(corpus.first, std::move(records));
+  }
+  const std::string output_json = absl::GetFlag(FLAGS_output_json);
+  if (!output_json.empty()) {
+    riegeli::FdWriter<> json_writer(output_json, O_WRONLY | O_CREAT | O_TRUNC);
+    RIEGELI_CHECK(json_writer.Write(benchmarks.ResultsJson()))
+        << json_writer.status();
+    RIEGELI_CHECK(json_writer.Close()) << json_writer.status();
+    std::cout << "Results written to " << output_json << std::endl;
+  }
 }
@@ -0,0 +1,127 @@
+// Copyright 2019 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <iostream>
+#include <memory>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#include "absl/base/optimization.h"
+#include "absl/flags/flag.h"
+#include "absl/flags/parse.h"
+#include "absl/flags/usage.h"
+#include "absl/strings/string_view.h"
+#include "riegeli/base/base.h"
+#include "riegeli/base/status.h"
+#include "riegeli/bytes/fd_reader.h"
+#include "riegeli/bytes/fd_writer.h"
+#include "riegeli/records/chunk_reader.h"
+#include "riegeli/records/chunk_writer.h"
+#include "riegeli/records/scan_chunks.h"
+#include "riegeli/records/skipped_region.h"
+
+ABSL_FLAG(int, parallelism, 4,
+          "The maximum number of parts of a file scanned concurrently.");
+ABSL_FLAG(bool, verify_data_hashes, true,
+          "If false, verify only block headers and chunk headers.");
+ABSL_FLAG(bool, show_chunks, false, "If true, show each valid chunk.");
+ABSL_FLAG(std::string, repaired_output, "",
+          "If not empty, write a copy of the file without invalid regions "
+          "there. Requires a single FILE.");
+
+namespace riegeli {
+namespace tools {
+namespace {
+
+bool ScanFile(absl::string_view filename) {
+  std::cout << "file: " << filename << "\n";
+  std::vector<ScannedChunk> chunks;
+  std::vector<SkippedRegion> skipped_regions;
+  const auto open_src = [filename]() -> std::unique_ptr<ChunkReader> {
+    return std::make_unique<DefaultChunkReader<FdReader<>>>(
+        std::forward_as_tuple(filename, O_RDONLY));
+  };
+  {
+    const Status status = ScanChunks(
+        open_src, &chunks, &skipped_regions,
+        ScanChunksOptions()
+            .set_parallelism(absl::GetFlag(FLAGS_parallelism))
+            .set_verify_data_hashes(absl::GetFlag(FLAGS_verify_data_hashes)));
+    if (ABSL_PREDICT_FALSE(!status.ok())) {
+      std::cerr << status.message() << std::endl;
+      return false;
+    }
+  }
+  uint64_t num_records = 0;
+  for (const ScannedChunk& chunk : chunks) {
+    num_records += chunk.num_records;
+    if (absl::GetFlag(FLAGS_show_chunks)) {
+      std::cout << "  chunk [" << chunk.chunk_begin << ", " << chunk.chunk_end
+                << "): type " << static_cast<char>(chunk.chunk_type) << ", "
+                << chunk.num_records << " records\n";
+    }
+  }
+  Position skipped_bytes = 0;
+  for (const SkippedRegion& skipped_region : skipped_regions) {
+    skipped_bytes += skipped_region.length();
+    std::cout << "  skipped " << skipped_region << "\n";
+  }
+  std::cout << "  " << chunks.size() << " valid chunks, " << num_records
+            << " records, " << skipped_regions.size() << " skipped regions, "
+            << skipped_bytes << " skipped bytes" << std::endl;
+  const std::string repaired_output = absl::GetFlag(FLAGS_repaired_output);
+  if (repaired_output.empty()) return true;
+  DefaultChunkReader<FdReader<>> chunk_reader(
+      std::forward_as_tuple(filename, O_RDONLY));
+  DefaultChunkWriter<FdWriter<>> chunk_writer(
+      std::forward_as_tuple(repaired_output, O_WRONLY | O_CREAT | O_TRUNC));
+  const Status status = CopyChunks(&chunk_reader, chunks, &chunk_writer);
+  if (ABSL_PREDICT_FALSE(!status.ok())) {
+    std::cerr << status.message() << std::endl;
+    return false;
+  }
+  if (ABSL_PREDICT_FALSE(!chunk_writer.Close())) {
+    std::cerr << chunk_writer.status().message() << std::endl;
+    return false;
+  }
+  return true;
+}
+
+const char kUsage[] =
+    "Usage: scan_riegeli_file (OPTION|FILE)...\n"
+    "\n"
+    "Finds valid chunks and invalid regions of Riegeli/records files.\n";
+
+}  // namespace
+}  // namespace tools
+}  // namespace riegeli
+
+int main(int argc, char** argv) {
+  absl::SetProgramUsageMessage(riegeli::tools::kUsage);
+  const std::vector<char*> args = absl::ParseCommandLine(argc, argv);
+  if (!absl::GetFlag(FLAGS_repaired_output).empty() && args.size() != 2) {
+    std::cerr << "--repaired_output requires a single FILE" << std::endl;
+    return 1;
+  }
+  bool ok = true;
+  for (size_t i = 1; i < args.size(); ++i) {
+    if (!riegeli::tools::ScanFile(args[i])) ok = false;
+  }
+  return ok ? 0 : 1;
+}
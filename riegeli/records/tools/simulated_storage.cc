@@ -0,0 +1,158 @@
+// Copyright 2019 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "riegeli/records/tools/simulated_storage.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+
+#include "absl/base/optimization.h"
+#include "absl/strings/string_view.h"
+#include "absl/time/clock.h"
+#include "absl/time/time.h"
+#include "riegeli/base/base.h"
+#include "riegeli/bytes/buffered_reader.h"
+#include "riegeli/bytes/buffered_writer.h"
+#include "riegeli/bytes/reader.h"
+#include "riegeli/bytes/writer.h"
+
+namespace riegeli {
+
+namespace internal {
+
+void SimulateRequest(const SimulatedStorageOptions& options, size_t length) {
+  absl::Duration delay = options.latency();
+  if (options.bandwidth() > 0.0) {
+    delay += absl::Seconds(static_cast<double>(length) / options.bandwidth());
+  }
+  if (delay > absl::ZeroDuration()) absl::SleepFor(delay);
+  SimulatedStorageStats* const stats = options.stats();
+  if (stats != nullptr) {
+    stats->requests.fetch_add(1, std::memory_order_relaxed);
+    stats->bytes.fetch_add(length, std::memory_order_relaxed);
+    stats->delay_ns.fetch_add(
+        IntCast<uint64_t>(absl::ToInt64Nanoseconds(delay)),
+        std::memory_order_relaxed);
+  }
+}
+
+}  // namespace internal
+
+void SimulatedStorageReaderBase::Initialize(Reader* src) {
+  RIEGELI_ASSERT(src != nullptr)
+      << "Failed precondition of SimulatedStorageReader: null Reader pointer";
+  if (ABSL_PREDICT_FALSE(!src->healthy())) {
+    Fail(*src);
+    return;
+  }
+  random_access_ = src->SupportsRandomAccess();
+  limit_pos_ = src->pos();
+}
+
+void SimulatedStorageReaderBase::SyncPos(Reader* src) {
+  if (random_access_ && available() > 0) {
+    if (ABSL_PREDICT_FALSE(!src->Seek(pos()))) {
+      if (ABSL_PREDICT_FALSE(!src->healthy())) Fail(*src);
+    }
+  }
+}
+
+bool SimulatedStorageReaderBase::ReadInternal(char* dest, size_t min_length,
+                                              size_t max_length) {
+  RIEGELI_ASSERT_GT(min_length, 0u)
+      << "Failed precondition of BufferedReader::ReadInternal(): "
+         "nothing to read";
+  RIEGELI_ASSERT_GE(max_length, min_length)
+      << "Failed precondition of BufferedReader::ReadInternal(): "
+         "max_length < min_length";
+  RIEGELI_ASSERT(healthy())
+      << "Failed precondition of BufferedReader::ReadInternal(): " << status();
+  Reader* const src = src_reader();
+  RIEGELI_ASSERT_EQ(src->pos(), limit_pos_)
+      << "SimulatedStorageReader source changed position unexpectedly";
+  const bool ok = src->Read(dest, max_length);
+  const size_t length_read = IntCast<size_t>(src->pos() - limit_pos_);
+  internal::SimulateRequest(options_, length_read);
+  limit_pos_ += length_read;
+  if (ABSL_PREDICT_FALSE(!ok)) {
+    if (ABSL_PREDICT_FALSE(!src->healthy())) return Fail(*src);
+  }
+  return length_read >= min_length;
+}
+
+bool SimulatedStorageReaderBase::SeekSlow(Position new_pos) {
+  RIEGELI_ASSERT(new_pos < start_pos() || new_pos > limit_pos_)
+      << "Failed precondition of Reader::SeekSlow(): "
+         "position in the buffer, use Seek() instead";
+  if (ABSL_PREDICT_FALSE(!healthy())) return false;
+  if (!random_access_) return BufferedReader::SeekSlow(new_pos);
+  ClearBuffer();
+  Reader* const src = src_reader();
+  const bool ok = src->Seek(new_pos);
+  limit_pos_ = src->pos();
+  if (ABSL_PREDICT_FALSE(!ok)) {
+    if (ABSL_PREDICT_FALSE(!src->healthy())) return Fail(*src);
+    return false;
+  }
+  return true;
+}
+
+bool SimulatedStorageReaderBase::Size(Position* size) {
+  if (ABSL_PREDICT_FALSE(!healthy())) return false;
+  Reader* const src = src_reader();
+  if (ABSL_PREDICT_FALSE(!src->Size(size))) {
+    if (ABSL_PREDICT_FALSE(!src->healthy())) return Fail(*src);
+    return false;
+  }
+  // Getting the size is a request to storage which transfers no data.
+  internal::SimulateRequest(options_, 0);
+  return true;
+}
+
+void SimulatedStorageWriterBase::Initialize(Writer* dest) {
+  RIEGELI_ASSERT(dest != nullptr)
+      << "Failed precondition of SimulatedStorageWriter: null Writer pointer";
+  if (ABSL_PREDICT_FALSE(!dest->healthy())) {
+    Fail(*dest);
+    return;
+  }
+  start_pos_ = dest->pos();
+}
+
+bool SimulatedStorageWriterBase::WriteInternal(absl::string_view src) {
+  RIEGELI_ASSERT(!src.empty())
+      << "Failed precondition of BufferedWriter::WriteInternal(): "
+         "nothing to write";
+  RIEGELI_ASSERT(healthy())
+      << "Failed precondition of BufferedWriter::WriteInternal(): " << status();
+  RIEGELI_ASSERT_EQ(written_to_buffer(), 0u)
+      << "Failed precondition of BufferedWriter::WriteInternal(): "
+         "buffer not empty";
+  Writer* const dest = dest_writer();
+  if (ABSL_PREDICT_FALSE(!dest->Write(src))) return Fail(*dest);
+  internal::SimulateRequest(options_, src.size());
+  start_pos_ += src.size();
+  return true;
+}
+
+bool SimulatedStorageWriterBase::Flush(FlushType flush_type) {
+  if (ABSL_PREDICT_FALSE(!PushInternal())) return false;
+  Writer* const dest = dest_writer();
+  if (ABSL_PREDICT_FALSE(!dest->Flush(flush_type))) return Fail(*dest);
+  return true;
+}
+
+}  // namespace riegeli
@@ -0,0 +1,562 @@
+// Copyright 2019 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef RIEGELI_RECORDS_TOOLS_SIMULATED_STORAGE_H_
+#define RIEGELI_RECORDS_TOOLS_SIMULATED_STORAGE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <tuple>
+#include <utility>
+
+#include "absl/base/optimization.h"
+#include "absl/strings/string_view.h"
+#include "absl/time/time.h"
+#include "riegeli/base/base.h"
+#include "riegeli/base/dependency.h"
+#include "riegeli/base/object.h"
+#include "riegeli/base/resetter.h"
+#include "riegeli/bytes/buffered_reader.h"
+#include "riegeli/bytes/buffered_writer.h"
+#include "riegeli/bytes/reader.h"
+#include "riegeli/bytes/writer.h"
+
+namespace riegeli {
+
+// Counters of requests made to simulated storage, shared by all
+// `SimulatedStorageReader`s and `SimulatedStorageWriter`s given the same
+// `SimulatedStorageStats`.
+struct SimulatedStorageStats {
+  // Number of reads from or writes to the underlying `Reader` or `Writer`.
+  std::atomic<uint64_t> requests{0};
+  // Number of bytes transferred by these requests.
+  std::atomic<uint64_t> bytes{0};
+  // Sum of delays injected for these requests, in nanoseconds.
+  std::atomic<uint64_t> delay_ns{0};
+};
+
+// Parameters of simulated storage, common to `SimulatedStorageReader` and
+// `SimulatedStorageWriter`.
+class SimulatedStorageOptions {
+ public:
+  SimulatedStorageOptions() noexcept {}
+
+  // Delay of each request, independent of its size, e.g. a round trip to a
+  // remote server.
+  //
+  // Default: `absl::ZeroDuration()`
+  SimulatedStorageOptions& set_latency(absl::Duration latency) & {
+    RIEGELI_ASSERT(latency >= absl::ZeroDuration())
+        << "Failed precondition of "
+           "SimulatedStorageOptions::set_latency(): "
+           "negative latency";
+    latency_ = latency;
+    return *this;
+  }
+  SimulatedStorageOptions&& set_latency(absl::Duration latency) && {
+    return std::move(set_latency(latency));
+  }
+  absl::Duration latency() const { return latency_; }
+
+  // Throughput of each stream, in bytes per second, adding a delay
+  // proportional to the size of each request. The limit applies to each
+  // `SimulatedStorageReader` or `SimulatedStorageWriter` separately, like
+  // per-connection limits of remote storage, so concurrent streams transfer
+  // data in parallel.
+  //
+  // 0 means no limit.
+  //
+  // Default: 0
+  SimulatedStorageOptions& set_bandwidth(double bandwidth) & {
+    RIEGELI_ASSERT_GE(bandwidth, 0.0)
+        << "Failed precondition of "
+           "SimulatedStorageOptions::set_bandwidth(): "
+           "negative bandwidth";
+    bandwidth_ = bandwidth;
+    return *this;
+  }
+  SimulatedStorageOptions&& set_bandwidth(double bandwidth) && {
+    return std::move(set_bandwidth(bandwidth));
+  }
+  double bandwidth() const { return bandwidth_; }
+
+  // Tunes how much data is transferred in a single request, unless a larger
+  // read or write bypasses the buffer.
+  //
+  // Default: 64K
+  SimulatedStorageOptions& set_buffer_size(size_t buffer_size) & {
+    RIEGELI_ASSERT_GT(buffer_size, 0u)
+        << "Failed precondition of "
+           "SimulatedStorageOptions::set_buffer_size(): "
+           "zero buffer size";
+    buffer_size_ = buffer_size;
+    return *this;
+  }
+  SimulatedStorageOptions&& set_buffer_size(size_t buffer_size) && {
+    return std::move(set_buffer_size(buffer_size));
+  }
+  size_t buffer_size() const { return buffer_size_; }
+
+  // If not `nullptr`, requests are counted in `*stats`, which must outlive
+  // readers and writers using it.
+  //
+  // Default: `nullptr`
+  SimulatedStorageOptions& set_stats(SimulatedStorageStats* stats) & {
+    stats_ = stats;
+    return *this;
+  }
+  SimulatedStorageOptions&& set_stats(SimulatedStorageStats* stats) && {
+    return std::move(set_stats(stats));
+  }
+  SimulatedStorageStats* stats() const { return stats_; }
+
+ private:
+  absl::Duration latency_ = absl::ZeroDuration();
+  double bandwidth_ = 0.0;
+  size_t buffer_size_ = kDefaultBufferSize;
+  SimulatedStorageStats* stats_ = nullptr;
+};
+
+namespace internal {
+
+// Blocks the calling thread for the time a request transferring `length`
+// bytes takes with `options`, and counts the request.
+void SimulateRequest(const SimulatedStorageOptions& options, size_t length);
+
+}  // namespace internal
+
+// Template parameter independent part of `SimulatedStorageReader`.
+class SimulatedStorageReaderBase : public BufferedReader {
+ public:
+  // Returns the original `Reader`. Unchanged by `Close()`.
+  virtual Reader* src_reader() = 0;
+  virtual const Reader* src_reader() const = 0;
+
+  bool SupportsRandomAccess() const override { return random_access_; }
+  bool Size(Position* size) override;
+
+ protected:
+  SimulatedStorageReaderBase() noexcept {}
+
+  explicit SimulatedStorageReaderBase(SimulatedStorageOptions options);
+
+  SimulatedStorageReaderBase(SimulatedStorageReaderBase&& that) noexcept;
+  SimulatedStorageReaderBase& operator=(
+      SimulatedStorageReaderBase&& that) noexcept;
+
+  void Reset();
+  void Reset(SimulatedStorageOptions options);
+  void Initialize(Reader* src);
+
+  bool ReadInternal(char* dest, size_t min_length, size_t max_length) override;
+  bool SeekSlow(Position new_pos) override;
+
+  // Sets the position of `*src` to `pos()` if random access is supported.
+  void SyncPos(Reader* src);
+
+ private:
+  SimulatedStorageOptions options_;
+  bool random_access_ = false;
+
+  // Invariant if `healthy()`: `limit_pos_ == src_reader()->pos()`
+};
+
+// A `Reader` which reads from another `Reader` like from remote storage:
+// reading is buffered, and each read from the original `Reader` is delayed by
+// `SimulatedStorageOptions::latency()` and by its size divided by
+// `SimulatedStorageOptions::bandwidth()`.
+//
+// This makes benchmarks of read-ahead, prefetching, and parallel decoding
+// reproducible on local files. Seeking is not delayed by itself, like a ranged
+// request, but discards buffered data.
+//
+// `SimulatedStorageReader` supports random access if the original `Reader`
+// does.
+//
+// The `Src` template parameter specifies the type of the object providing and
+// possibly owning the original `Reader`. `Src` must support
+// `Dependency<Reader*, Src>`, e.g. `Reader*` (not owned, default),
+// `std::unique_ptr<Reader>` (owned), `FdReader<>` (owned).
+//
+// The original `Reader` must not be accessed until the `SimulatedStorageReader`
+// is closed or no longer used.
+template <typename Src = Reader*>
+class SimulatedStorageReader : public SimulatedStorageReaderBase {
+ public:
+  // Creates a closed `SimulatedStorageReader`.
+  SimulatedStorageReader() noexcept {}
+
+  // Will read from the original `Reader` provided by `src`.
+  explicit SimulatedStorageReader(
+      const Src& src,
+      SimulatedStorageOptions options = SimulatedStorageOptions());
+  explicit SimulatedStorageReader(
+      Src&& src, SimulatedStorageOptions options = SimulatedStorageOptions());
+
+  // Will read from the original `Reader` provided by a `Src` constructed from
+  // elements of `src_args`. This avoids constructing a temporary `Src` and
+  // moving from it.
+  template <typename... SrcArgs>
+  explicit SimulatedStorageReader(
+      std::tuple<SrcArgs...> src_args,
+      SimulatedStorageOptions options = SimulatedStorageOptions());
+
+  SimulatedStorageReader(SimulatedStorageReader&& that) noexcept;
+  SimulatedStorageReader& operator=(SimulatedStorageReader&& that) noexcept;
+
+  // Makes `*this` equivalent to a newly constructed `SimulatedStorageReader`.
+  // This avoids constructing a temporary `SimulatedStorageReader` and moving
+  // from it.
+  void Reset();
+  void Reset(const Src& src,
+             SimulatedStorageOptions options = SimulatedStorageOptions());
+  void Reset(Src&& src,
+             SimulatedStorageOptions options = SimulatedStorageOptions());
+  template <typename... SrcArgs>
+  void Reset(std::tuple<SrcArgs...> src_args,
+             SimulatedStorageOptions options = SimulatedStorageOptions());
+
+  // Returns the object providing and possibly owning the original `Reader`.
+  // Unchanged by `Close()`.
+  Src& src() { return src_.manager(); }
+  const Src& src() const { return src_.manager(); }
+  Reader* src_reader() override { return src_.get(); }
+  const Reader* src_reader() const override { return src_.get(); }
+
+ protected:
+  void Done() override;
+
+ private:
+  // The object providing and possibly owning the original `Reader`.
+  Dependency<Reader*, Src> src_;
+};
+
+// Template parameter independent part of `SimulatedStorageWriter`.
+class SimulatedStorageWriterBase : public BufferedWriter {
+ public:
+  // Returns the original `Writer`. Unchanged by `Close()`.
+  virtual Writer* dest_writer() = 0;
+  virtual const Writer* dest_writer() const = 0;
+
+  bool Flush(FlushType flush_type) override;
+
+ protected:
+  SimulatedStorageWriterBase() noexcept {}
+
+  explicit SimulatedStorageWriterBase(SimulatedStorageOptions options);
+
+  SimulatedStorageWriterBase(SimulatedStorageWriterBase&& that) noexcept;
+  SimulatedStorageWriterBase& operator=(
+      SimulatedStorageWriterBase&& that) noexcept;
+
+  void Reset();
+  void Reset(SimulatedStorageOptions options);
+  void Initialize(Writer* dest);
+
+  bool WriteInternal(absl::string_view src) override;
+
+ private:
+  SimulatedStorageOptions options_;
+
+  // Invariant if `healthy()`: `start_pos_ == dest_writer()->pos()`
+};
+
+// A `Writer` which writes to another `Writer` like to remote storage: writing
+// is buffered, and each write to the original `Writer` is delayed by
+// `SimulatedStorageOptions::latency()` and by its size divided by
+// `SimulatedStorageOptions::bandwidth()`.
+//
+// `SimulatedStorageWriter` does not support random access.
+//
+// The `Dest` template parameter specifies the type of the object providing and
+// possibly owning the original `Writer`. `Dest` must support
+// `Dependency<Writer*, Dest>`, e.g. `Writer*` (not owned, default),
+// `std::unique_ptr<Writer>` (owned), `FdWriter<>` (owned).
+//
+// The original `Writer` must not be accessed until the `SimulatedStorageWriter`
+// is closed or no longer used, except that it is allowed to read the
+// destination of the original `Writer` immediately after `Flush()`.
+template <typename Dest = Writer*>
+class SimulatedStorageWriter : public SimulatedStorageWriterBase {
+ public:
+  // Creates a closed `SimulatedStorageWriter`.
+  SimulatedStorageWriter() noexcept {}
+
+  // Will write to the original `Writer` provided by `dest`.
+  explicit SimulatedStorageWriter(
+      const Dest& dest,
+      SimulatedStorageOptions options = SimulatedStorageOptions());
+  explicit SimulatedStorageWriter(
+      Dest&& dest, SimulatedStorageOptions options = SimulatedStorageOptions());
+
+  // Will write to the original `Writer` provided by a `Dest` constructed from
+  // elements of `dest_args`. This avoids constructing a temporary `Dest` and
+  // moving from it.
+  template <typename... DestArgs>
+  explicit SimulatedStorageWriter(
+      std::tuple<DestArgs...> dest_args,
+      SimulatedStorageOptions options = SimulatedStorageOptions());
+
+  SimulatedStorageWriter(SimulatedStorageWriter&& that) noexcept;
+  SimulatedStorageWriter& operator=(SimulatedStorageWriter&& that) noexcept;
+
+  // Makes `*this` equivalent to a newly constructed `SimulatedStorageWriter`.
+  // This avoids constructing a temporary `SimulatedStorageWriter` and moving
+  // from it.
+  void Reset();
+  void Reset(const Dest& dest,
+             SimulatedStorageOptions options = SimulatedStorageOptions());
+  void Reset(Dest&& dest,
+             SimulatedStorageOptions options = SimulatedStorageOptions());
+  template <typename... DestArgs>
+  void Reset(std::tuple<DestArgs...> dest_args,
+             SimulatedStorageOptions options = SimulatedStorageOptions());
+
+  // Returns the object providing and possibly owning the original `Writer`.
+  // Unchanged by `Close()`.
+  Dest& dest() { return dest_.manager(); }
+  const Dest& dest() const { return dest_.manager(); }
+  Writer* dest_writer() override { return dest_.get(); }
+  const Writer* dest_writer() const override { return dest_.get(); }
+
+ protected:
+  void Done() override;
+
+ private:
+  // The object providing and possibly owning the original `Writer`.
+  Dependency<Writer*, Dest> dest_;
+};
+
+// Implementation details follow.
+
+inline SimulatedStorageReaderBase::SimulatedStorageReaderBase(
+    SimulatedStorageOptions options)
+    : BufferedReader(options.buffer_size()), options_(options) {}
+
+inline SimulatedStorageReaderBase::SimulatedStorageReaderBase(
+    SimulatedStorageReaderBase&& that) noexcept
+    : BufferedReader(std::move(that)),
+      options_(that.options_),
+      random_access_(that.random_access_) {}
+
+inline SimulatedStorageReaderBase& SimulatedStorageReaderBase::operator=(
+    SimulatedStorageReaderBase&& that) noexcept {
+  BufferedReader::operator=(std::move(that));
+  options_ = that.options_;
+  random_access_ = that.random_access_;
+  return *this;
+}
+
+inline void SimulatedStorageReaderBase::Reset() {
+  BufferedReader::Reset();
+  options_ = SimulatedStorageOptions();
+  random_access_ = false;
+}
+
+inline void SimulatedStorageReaderBase::Reset(SimulatedStorageOptions options) {
+  BufferedReader::Reset(options.buffer_size());
+  options_ = options;
+  random_access_ = false;
+}
+
+template <typename Src>
+inline SimulatedStorageReader<Src>::SimulatedStorageReader(
+    const Src& src, SimulatedStorageOptions options)
+    : SimulatedStorageReaderBase(options), src_(src) {
+  Initialize(src_.get());
+}
+
+template <typename Src>
+inline SimulatedStorageReader<Src>::SimulatedStorageReader(
+    Src&& src, SimulatedStorageOptions options)
+    : SimulatedStorageReaderBase(options), src_(std::move(src)) {
+  Initialize(src_.get());
+}
+
+template <typename Src>
+template <typename... SrcArgs>
+inline SimulatedStorageReader<Src>::SimulatedStorageReader(
+    std::tuple<SrcArgs...> src_args, SimulatedStorageOptions options)
+    : SimulatedStorageReaderBase(options), src_(std::move(src_args)) {
+  Initialize(src_.get());
+}
+
+template <typename Src>
+inline SimulatedStorageReader<Src>::SimulatedStorageReader(
+    SimulatedStorageReader&& that) noexcept
+    : SimulatedStorageReaderBase(std::move(that)),
+      src_(std::move(that.src_)) {}
+
+template <typename Src>
+inline SimulatedStorageReader<Src>& SimulatedStorageReader<Src>::operator=(
+    SimulatedStorageReader&& that) noexcept {
+  SimulatedStorageReaderBase::operator=(std::move(that));
+  src_ = std::move(that.src_);
+  return *this;
+}
+
+template <typename Src>
+inline void SimulatedStorageReader<Src>::Reset() {
+  SimulatedStorageReaderBase::Reset();
+  src_.Reset();
+}
+
+template <typename Src>
+inline void SimulatedStorageReader<Src>::Reset(
+    const Src& src, SimulatedStorageOptions options) {
+  SimulatedStorageReaderBase::Reset(options);
+  src_.Reset(src);
+  Initialize(src_.get());
+}
+
+template <typename Src>
+inline void SimulatedStorageReader<Src>::Reset(
+    Src&& src, SimulatedStorageOptions options) {
+  SimulatedStorageReaderBase::Reset(options);
+  src_.Reset(std::move(src));
+  Initialize(src_.get());
+}
+
+template <typename Src>
+template <typename... SrcArgs>
+inline void SimulatedStorageReader<Src>::Reset(
+    std::tuple<SrcArgs...> src_args, SimulatedStorageOptions options) {
+  SimulatedStorageReaderBase::Reset(options);
+  src_.Reset(std::move(src_args));
+  Initialize(src_.get());
+}
+
+template <typename Src>
+void SimulatedStorageReader<Src>::Done() {
+  if (ABSL_PREDICT_TRUE(healthy())) SyncPos(src_.get());
+  SimulatedStorageReaderBase::Done();
+  if (src_.is_owning()) {
+    if (ABSL_PREDICT_FALSE(!src_->Close())) Fail(*src_);
+  }
+}
+
+inline SimulatedStorageWriterBase::SimulatedStorageWriterBase(
+    SimulatedStorageOptions options)
+    : BufferedWriter(options.buffer_size()), options_(options) {}
+
+inline SimulatedStorageWriterBase::SimulatedStorageWriterBase(
+    SimulatedStorageWriterBase&& that) noexcept
+    : BufferedWriter(std::move(that)), options_(that.options_) {}
+
+inline SimulatedStorageWriterBase& SimulatedStorageWriterBase::operator=(
+    SimulatedStorageWriterBase&& that) noexcept {
+  BufferedWriter::operator=(std::move(that));
+  options_ = that.options_;
+  return *this;
+}
+
+inline void SimulatedStorageWriterBase::Reset() {
+  BufferedWriter::Reset();
+  options_ = SimulatedStorageOptions();
+}
+
+inline void SimulatedStorageWriterBase::Reset(SimulatedStorageOptions options) {
+  BufferedWriter::Reset(options.buffer_size());
+  options_ = options;
+}
+
+template <typename Dest>
+inline SimulatedStorageWriter<Dest>::SimulatedStorageWriter(
+    const Dest& dest, SimulatedStorageOptions options)
+    : SimulatedStorageWriterBase(options), dest_(dest) {
+  Initialize(dest_.get());
+}
+
+template <typename Dest>
+inline SimulatedStorageWriter<Dest>::SimulatedStorageWriter(
+    Dest&& dest, SimulatedStorageOptions options)
+    : SimulatedStorageWriterBase(options), dest_(std::move(dest)) {
+  Initialize(dest_.get());
+}
+
+template <typename Dest>
+template <typename... DestArgs>
+inline SimulatedStorageWriter<Dest>::SimulatedStorageWriter(
+    std::tuple<DestArgs...> dest_args, SimulatedStorageOptions options)
+    : SimulatedStorageWriterBase(options), dest_(std::move(dest_args)) {
+  Initialize(dest_.get());
+}
+
+template <typename Dest>
+inline SimulatedStorageWriter<Dest>::SimulatedStorageWriter(
+    SimulatedStorageWriter&& that) noexcept
+    : SimulatedStorageWriterBase(std::move(that)),
+      dest_(std::move(that.dest_)) {}
+
+template <typename Dest>
+inline SimulatedStorageWriter<Dest>& SimulatedStorageWriter<Dest>::operator=(
+    SimulatedStorageWriter&& that) noexcept {
+  SimulatedStorageWriterBase::operator=(std::move(that));
+  dest_ = std::move(that.dest_);
+  return *this;
+}
+
+template <typename Dest>
+inline void SimulatedStorageWriter<Dest>::Reset() {
+  SimulatedStorageWriterBase::Reset();
+  dest_.Reset();
+}
+
+template <typename Dest>
+inline void SimulatedStorageWriter<Dest>::Reset(
+    const Dest& dest, SimulatedStorageOptions options) {
+  SimulatedStorageWriterBase::Reset(options);
+  dest_.Reset(dest);
+  Initialize(dest_.get());
+}
+
+template <typename Dest>
+inline void SimulatedStorageWriter<Dest>::Reset(
+    Dest&& dest, SimulatedStorageOptions options) {
+  SimulatedStorageWriterBase::Reset(options);
+  dest_.Reset(std::move(dest));
+  Initialize(dest_.get());
+}
+
+template <typename Dest>
+template <typename... DestArgs>
+inline void SimulatedStorageWriter<Dest>::Reset(
+    std::tuple<DestArgs...> dest_args, SimulatedStorageOptions options) {
+  SimulatedStorageWriterBase::Reset(options);
+  dest_.Reset(std::move(dest_args));
+  Initialize(dest_.get());
+}
+
+template <typename Dest>
+void SimulatedStorageWriter<Dest>::Done() {
+  PushInternal();
+  SimulatedStorageWriterBase::Done();
+  if (dest_.is_owning()) {
+    if (ABSL_PREDICT_FALSE(!dest_->Close())) Fail(*dest_);
+  }
+}
+
+template <typename Src>
+struct Resetter<SimulatedStorageReader<Src>>
+    : ResetterByReset<SimulatedStorageReader<Src>> {};
+
+template <typename Dest>
+struct Resetter<SimulatedStorageWriter<Dest>>
+    : ResetterByReset<SimulatedStorageWriter<Dest>> {};
+
+}  // namespace riegeli
+
+#endif  // RIEGELI_RECORDS_TOOLS_SIMULATED_STORAGE_H_
@@ -0,0 +1,395 @@
+// Copyright 2019 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Benchmarks reading and writing Riegeli/records files stored on simulated
+// remote storage with configurable latency and bandwidth, to evaluate
+// read-ahead, prefetching, and parallel decoding under reproducible
+// conditions.
+
+// Make file offsets 64-bit even on 32-bit systems.
+#undef _FILE_OFFSET_BITS
+#define _FILE_OFFSET_BITS 64
+
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+#include "absl/base/optimization.h"
+#include "absl/flags/flag.h"
+#include "absl/flags/parse.h"
+#include "absl/flags/usage.h"
+#include "absl/strings/numbers.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/str_format.h"
+#include "absl/strings/str_split.h"
+#include "absl/strings/string_view.h"
+#include "absl/strings/strip.h"
+#include "absl/time/time.h"
+#include "riegeli/base/base.h"
+#include "riegeli/base/errno_mapping.h"
+#include "riegeli/base/status.h"
+#include "riegeli/bytes/fd_reader.h"
+#include "riegeli/bytes/fd_writer.h"
+#include "riegeli/bytes/prefetching_reader.h"
+#include "riegeli/bytes/reader.h"
+#include "riegeli/records/record_reader.h"
+#include "riegeli/records/record_writer.h"
+#include "riegeli/records/tools/simulated_storage.h"
+
+ABSL_FLAG(absl::Duration, latency, absl::Milliseconds(10),
+          "Simulated delay of each storage request");
+ABSL_FLAG(double, bandwidth, 100e6,
+          "Simulated throughput of each storage stream, in bytes per second, "
+          "or 0 for no limit");
+ABSL_FLAG(uint64_t, storage_buffer_size, uint64_t{1} << 20,
+          "Size of each storage request, unless a larger read or write "
+          "bypasses the buffer, in bytes");
+ABSL_FLAG(std::string, writer_options, "default",
+          "RecordWriter options for writing the generated file");
+ABSL_FLAG(std::string, readers,
+          "parallelism:0 "
+          "parallelism:4 "
+          "prefetch:4 "
+          "parallelism:4,prefetch:4",
+          "Whitespace-separated reader configurations, each a comma-separated "
+          "list of: parallelism:N (RecordReader parallelism), prefetch:N "
+          "(PrefetchingReader between RecordReader and storage, reading ahead "
+          "up to N buffers)");
+ABSL_FLAG(std::string, workloads, "sequential sharded random",
+          "Whitespace-separated workloads: sequential (one RecordReader reads "
+          "the file), sharded (--shards RecordReaders in separate threads read "
+          "ranges of the file), random (Seek(Position) to random fractions of "
+          "the file, reading one record after each)");
+ABSL_FLAG(uint64_t, shards, 8, "Number of ranges for the sharded workload");
+ABSL_FLAG(uint64_t, random_reads, 100,
+          "Number of random accesses in each repetition of the random "
+          "workload");
+ABSL_FLAG(uint64_t, num_records, 100000,
+          "Number of records to generate if no FILE is given");
+ABSL_FLAG(uint64_t, record_size, 1000,
+          "Approximate size of generated records, in bytes");
+ABSL_FLAG(std::string, output_dir, "/tmp",
+          "Directory to write the generated file to (it is named "
+          "storage_benchmark.riegeli)");
+ABSL_FLAG(int32_t, repetitions, 3, "Number of times to repeat each benchmark");
+
+namespace {
+
+uint64_t FileSize(const std::string& filename) {
+  struct stat stat_info;
+  RIEGELI_CHECK_EQ(stat(filename.c_str(), &stat_info), 0)
+      << riegeli::ErrnoToCanonicalStatus(errno, "stat() failed").message();
+  return riegeli::IntCast<uint64_t>(stat_info.st_size);
+}
+
+uint64_t RealTimeNow_ns() {
+  struct timespec time_info;
+  RIEGELI_CHECK_EQ(clock_gettime(CLOCK_MONOTONIC, &time_info), 0);
+  return riegeli::IntCast<uint64_t>(time_info.tv_sec) * uint64_t{1000000000} +
+         riegeli::IntCast<uint64_t>(time_info.tv_nsec);
+}
+
+riegeli::SimulatedStorageOptions StorageOptions(
+    riegeli::SimulatedStorageStats* stats) {
+  return riegeli::SimulatedStorageOptions()
+      .set_latency(absl::GetFlag(FLAGS_latency))
+      .set_bandwidth(absl::GetFlag(FLAGS_bandwidth))
+      .set_buffer_size(
+          riegeli::IntCast<size_t>(absl::GetFlag(FLAGS_storage_buffer_size)))
+      .set_stats(stats);
+}
+
+// How records are read from storage.
+struct ReaderConfig {
+  std::string name;
+  int parallelism = 0;
+  // If positive, a `PrefetchingReader` reads up to this many buffers ahead.
+  size_t prefetch = 0;
+};
+
+// Parses a reader configuration in the format of `--readers`.
+bool ParseReaderConfig(absl::string_view text, ReaderConfig* config) {
+  config->name = std::string(text);
+  for (absl::string_view option :
+       absl::StrSplit(text, ',', absl::SkipEmpty())) {
+    if (absl::ConsumePrefix(&option, "parallelism:")) {
+      if (ABSL_PREDICT_FALSE(!absl::SimpleAtoi(option, &config->parallelism) ||
+                             config->parallelism < 0)) {
+        return false;
+      }
+    } else if (absl::ConsumePrefix(&option, "prefetch:")) {
+      if (ABSL_PREDICT_FALSE(!absl::SimpleAtoi(option, &config->prefetch))) {
+        return false;
+      }
+    } else {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Opens `filename` for reading through simulated storage.
+std::unique_ptr<riegeli::Reader> OpenStorage(
+    const std::string& filename, const ReaderConfig& config,
+    riegeli::SimulatedStorageStats* stats) {
+  std::unique_ptr<riegeli::Reader> reader =
+      std::make_unique<riegeli::SimulatedStorageReader<riegeli::FdReader<>>>(
+          std::forward_as_tuple(filename, O_RDONLY), StorageOptions(stats));
+  if (config.prefetch > 0) {
+    reader = std::make_unique<
+        riegeli::PrefetchingReader<std::unique_ptr<riegeli::Reader>>>(
+        std::move(reader),
+        riegeli::PrefetchingReaderBase::Options()
+            .set_buffer_size(riegeli::IntCast<size_t>(
+                absl::GetFlag(FLAGS_storage_buffer_size)))
+            .set_max_pending(config.prefetch));
+  }
+  return reader;
+}
+
+// Totals of one repetition of a workload.
+struct Totals {
+  uint64_t records = 0;
+  uint64_t record_bytes = 0;
+};
+
+// Reads records in `range` of `filename`, or only `random_reads` records at
+// random positions if `random_reads > 0`.
+Totals ReadRecords(const std::string& filename, const ReaderConfig& config,
+                   riegeli::FileRange range, size_t random_reads,
+                   riegeli::SimulatedStorageStats* stats) {
+  riegeli::RecordReader<std::unique_ptr<riegeli::Reader>> record_reader(
+      OpenStorage(filename, config, stats),
+      riegeli::RecordReaderBase::Options()
+          .set_parallelism(config.parallelism)
+          .set_range(range));
+  Totals totals;
+  std::string record;
+  if (random_reads == 0) {
+    while (record_reader.ReadRecord(&record)) {
+      ++totals.records;
+      totals.record_bytes += record.size();
+    }
+  } else {
+    const uint64_t file_size = FileSize(filename);
+    std::mt19937_64 random(42);
+    for (size_t i = 0; i < random_reads; ++i) {
+      RIEGELI_CHECK(record_reader.Seek(
+          riegeli::IntCast<riegeli::Position>(random() % (file_size + 1))))
+          << record_reader.status();
+      // Seeking past the last chunk reaches the end, which reads nothing.
+      if (record_reader.ReadRecord(&record)) {
+        totals.record_bytes += record.size();
+      }
+      ++totals.records;
+    }
+  }
+  RIEGELI_CHECK(record_reader.Close()) << record_reader.status();
+  return totals;
+}
+
+// Runs one repetition of `workload`.
+Totals RunWorkload(absl::string_view workload, const std::string& filename,
+                   const ReaderConfig& config,
+                   riegeli::SimulatedStorageStats* stats) {
+  if (workload == "sequential") {
+    return ReadRecords(filename, config, riegeli::FileRange(), 0, stats);
+  }
+  if (workload == "sharded") {
+    const std::vector<riegeli::FileRange> ranges = riegeli::SplitFile(
+        FileSize(filename),
+        riegeli::IntCast<size_t>(absl::GetFlag(FLAGS_shards)));
+    std::vector<Totals> shard_totals(ranges.size());
+    std::vector<std::thread> threads;
+    threads.reserve(ranges.size());
+    for (size_t i = 0; i < ranges.size(); ++i) {
+      threads.emplace_back([&, i] {
+        shard_totals[i] = ReadRecords(filename, config, ranges[i], 0, stats);
+      });
+    }
+    Totals totals;
+    for (size_t i = 0; i < ranges.size(); ++i) {
+      threads[i].join();
+      totals.records += shard_totals[i].records;
+      totals.record_bytes += shard_totals[i].record_bytes;
+    }
+    return totals;
+  }
+  if (workload == "random") {
+    return ReadRecords(
+        filename, config, riegeli::FileRange(),
+        riegeli::UnsignedMax(
+            riegeli::IntCast<size_t>(absl::GetFlag(FLAGS_random_reads)),
+            size_t{1}),
+        stats);
+  }
+  RIEGELI_CHECK_UNREACHABLE() << "Unknown workload: " << workload;
+}
+
+void PrintHeader() {
+  absl::PrintF("%-10s  %-26s %9s %9s %9s %10s %9s %9s\n", "Workload",
+               "Reader", "Records", "Real s", "MB/s", "us/record",
+               "Requests", "Delay s");
+  absl::PrintF("%s\n", std::string(100, '-'));
+}
+
+void PrintResult(absl::string_view workload, absl::string_view reader_name,
+                 const Totals& totals, double real_time_s,
+                 const riegeli::SimulatedStorageStats& stats) {
+  absl::PrintF(
+      "%-10s  %-26s %9u %9.3f %9.3f %10.3f %9u %9.3f\n", workload, reader_name,
+      totals.records, real_time_s,
+      static_cast<double>(totals.record_bytes) / 1e6 / real_time_s,
+      real_time_s * 1e6 /
+          static_cast<double>(riegeli::UnsignedMax(totals.records, 1u)),
+      stats.requests.load(std::memory_order_relaxed),
+      static_cast<double>(stats.delay_ns.load(std::memory_order_relaxed)) /
+          1e9);
+}
+
+// Writes generated records to `filename` through simulated storage.
+void WriteRecords(const std::string& filename) {
+  riegeli::RecordWriterBase::Options record_writer_options;
+  {
+    const riegeli::Status status =
+        record_writer_options.FromString(absl::GetFlag(FLAGS_writer_options));
+    RIEGELI_CHECK(status.ok())
+        << "Invalid --writer_options: " << status.message();
+  }
+  static constexpr const char* kWords[] = {
+      "the",    "of",     "and",   "record", "chunk", "riegeli", "file",
+      "reader", "writer", "block", "data",   "value", "key",     "index"};
+  const size_t record_size =
+      riegeli::IntCast<size_t>(absl::GetFlag(FLAGS_record_size));
+  std::mt19937_64 random(42);
+  std::vector<std::string> records(
+      riegeli::IntCast<size_t>(absl::GetFlag(FLAGS_num_records)));
+  for (std::string& record : records) {
+    while (record.size() < record_size) {
+      if (!record.empty()) record.push_back(' ');
+      record.append(kWords[random() % (sizeof(kWords) / sizeof(kWords[0]))]);
+    }
+  }
+  riegeli::SimulatedStorageStats stats;
+  const uint64_t time_before_ns = RealTimeNow_ns();
+  riegeli::RecordWriter<riegeli::SimulatedStorageWriter<riegeli::FdWriter<>>>
+      record_writer(
+          std::forward_as_tuple(
+              std::forward_as_tuple(filename, O_WRONLY | O_CREAT | O_TRUNC),
+              StorageOptions(&stats)),
+          std::move(record_writer_options));
+  Totals totals;
+  for (const std::string& record : records) {
+    RIEGELI_CHECK(record_writer.WriteRecord(record)) << record_writer.status();
+    ++totals.records;
+    totals.record_bytes += record.size();
+  }
+  RIEGELI_CHECK(record_writer.Close()) << record_writer.status();
+  const uint64_t time_after_ns = RealTimeNow_ns();
+  PrintResult("write", absl::GetFlag(FLAGS_writer_options), totals,
+              static_cast<double>(time_after_ns - time_before_ns) / 1e9,
+              stats);
+}
+
+const char kUsage[] =
+    "Usage: storage_benchmark (OPTION|FILE)...\n"
+    "\n"
+    "Reads Riegeli/records FILEs through simulated storage with --latency and "
+    "--bandwidth. Without FILEs, a file is generated in --output_dir, written "
+    "through simulated storage first.\n";
+
+template <typename Function>
+void ForEachWord(absl::string_view words, Function f) {
+  for (const absl::string_view word :
+       absl::StrSplit(words, absl::ByAnyChar("\t\n "), absl::SkipEmpty())) {
+    f(word);
+  }
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  absl::SetProgramUsageMessage(kUsage);
+  const std::vector<char*> args = absl::ParseCommandLine(argc, argv);
+  std::vector<ReaderConfig> reader_configs;
+  ForEachWord(absl::GetFlag(FLAGS_readers), [&](absl::string_view text) {
+    ReaderConfig config;
+    RIEGELI_CHECK(ParseReaderConfig(text, &config))
+        << "Invalid reader configuration: " << text;
+    reader_configs.push_back(std::move(config));
+  });
+  std::vector<std::string> workloads;
+  ForEachWord(absl::GetFlag(FLAGS_workloads), [&](absl::string_view workload) {
+    RIEGELI_CHECK(workload == "sequential" || workload == "sharded" ||
+                  workload == "random")
+        << "Unknown workload: " << workload;
+    workloads.emplace_back(workload);
+  });
+  const int repetitions = absl::GetFlag(FLAGS_repetitions);
+  RIEGELI_CHECK_GT(repetitions, 0) << "Invalid --repetitions";
+  absl::PrintF("Latency %s, bandwidth %.3f MB/s, request size %u\n\n",
+               absl::FormatDuration(absl::GetFlag(FLAGS_latency)),
+               absl::GetFlag(FLAGS_bandwidth) / 1e6,
+               absl::GetFlag(FLAGS_storage_buffer_size));
+  PrintHeader();
+  std::vector<std::string> filenames(args.begin() + 1, args.end());
+  if (filenames.empty()) {
+    filenames.push_back(
+        absl::StrCat(absl::GetFlag(FLAGS_output_dir),
+                     "/storage_benchmark.riegeli"));
+    WriteRecords(filenames.back());
+  }
+  for (const std::string& filename : filenames) {
+    if (args.size() > 2) std::cout << filename << std::endl;
+    for (const std::string& workload : workloads) {
+      for (const ReaderConfig& config : reader_configs) {
+        std::vector<double> real_times_s;
+        Totals totals;
+        riegeli::SimulatedStorageStats stats;
+        for (int i = 0; i < repetitions; ++i) {
+          // Requests are reported for the last repetition.
+          stats.requests = 0;
+          stats.bytes = 0;
+          stats.delay_ns = 0;
+          const uint64_t time_before_ns = RealTimeNow_ns();
+          totals = RunWorkload(workload, filename, config, &stats);
+          const uint64_t time_after_ns = RealTimeNow_ns();
+          real_times_s.push_back(
+              static_cast<double>(time_after_ns - time_before_ns) / 1e9);
+        }
+        const size_t middle = real_times_s.size() / 2;
+        std::nth_element(
+            real_times_s.begin(),
+            real_times_s.begin() + riegeli::IntCast<ptrdiff_t>(middle),
+            real_times_s.end());
+        PrintResult(workload, config.name, totals, real_times_s[middle],
+                    stats);
+      }
+    }
+  }
+  std::cout << std::endl;
+}
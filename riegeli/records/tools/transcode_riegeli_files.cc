@@ -0,0 +1,136 @@
+// Copyright 2019 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <fcntl.h>
+
+#include <iostream>
+#include <string>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+#include "absl/base/optimization.h"
+#include "absl/flags/flag.h"
+#include "absl/flags/parse.h"
+#include "absl/flags/usage.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/string_view.h"
+#include "riegeli/base/base.h"
+#include "riegeli/base/chain.h"
+#include "riegeli/base/status.h"
+#include "riegeli/bytes/fd_reader.h"
+#include "riegeli/bytes/fd_writer.h"
+#include "riegeli/records/chunk_reader.h"
+#include "riegeli/records/filter_records.h"
+#include "riegeli/records/record_position.h"
+#include "riegeli/records/record_reader.h"
+#include "riegeli/records/record_writer.h"
+
+ABSL_FLAG(std::string, output_suffix, ".transcoded",
+          "Suffix appended to the name of each input to form its output.");
+ABSL_FLAG(std::string, options, "",
+          "Riegeli/records writer options of outputs, in the format of "
+          "RecordWriterBase::Options::FromString(), e.g. "
+          "\"transpose,zstd:5\".");
+ABSL_FLAG(int, parallelism, 4,
+          "The maximum number of chunks decoded concurrently, and the default "
+          "parallelism of encoding, overridden by --options.");
+ABSL_FLAG(bool, preserve_chunk_boundaries, false,
+          "If true, records of each input chunk are written to separate "
+          "output chunks.");
+
+namespace riegeli {
+namespace tools {
+namespace {
+
+Status TranscodeFile(absl::string_view input, absl::string_view output,
+                     RecordWriterBase::Options record_writer_options) {
+  {
+    RecordReader<FdReader<>> record_reader(
+        std::forward_as_tuple(input, O_RDONLY));
+    Chain metadata;
+    if (ABSL_PREDICT_FALSE(!record_reader.ReadSerializedMetadata(&metadata))) {
+      return record_reader.status();
+    }
+    if (ABSL_PREDICT_FALSE(!record_reader.Close())) {
+      return record_reader.status();
+    }
+    record_writer_options.set_serialized_metadata(std::move(metadata));
+  }
+  DefaultChunkReader<FdReader<>> chunk_reader(
+      std::forward_as_tuple(input, O_RDONLY));
+  RecordWriter<FdWriter<>> record_writer(
+      std::forward_as_tuple(output, O_WRONLY | O_CREAT | O_TRUNC),
+      std::move(record_writer_options));
+  {
+    const Status status = FilterRecords(
+        &chunk_reader,
+        [](const RecordPosition& key, absl::string_view record,
+           std::string* replacement) { return FilterAction::kKeep; },
+        &record_writer,
+        FilterRecordsOptions()
+            .set_parallelism(absl::GetFlag(FLAGS_parallelism))
+            .set_copy_unchanged_chunks(false)
+            .set_preserve_chunk_boundaries(
+                absl::GetFlag(FLAGS_preserve_chunk_boundaries)));
+    if (ABSL_PREDICT_FALSE(!status.ok())) return status;
+  }
+  if (ABSL_PREDICT_FALSE(!chunk_reader.Close())) return chunk_reader.status();
+  if (ABSL_PREDICT_FALSE(!record_writer.Close())) {
+    return record_writer.status();
+  }
+  return OkStatus();
+}
+
+bool TranscodeFiles(const std::vector<char*>& inputs) {
+  RecordWriterBase::Options record_writer_options;
+  record_writer_options.set_parallelism(absl::GetFlag(FLAGS_parallelism));
+  {
+    const Status status =
+        record_writer_options.FromString(absl::GetFlag(FLAGS_options));
+    if (ABSL_PREDICT_FALSE(!status.ok())) {
+      std::cerr << status.message() << std::endl;
+      return false;
+    }
+  }
+  const std::string output_suffix = absl::GetFlag(FLAGS_output_suffix);
+  bool ok = true;
+  for (const char* input : inputs) {
+    const Status status =
+        TranscodeFile(input, absl::StrCat(input, output_suffix),
+                      record_writer_options);
+    if (ABSL_PREDICT_FALSE(!status.ok())) {
+      std::cerr << input << ": " << status.message() << std::endl;
+      ok = false;
+    }
+  }
+  return ok;
+}
+
+const char kUsage[] =
+    "Usage: transcode_riegeli_files (OPTION|INPUT)...\n"
+    "\n"
+    "Re-encodes Riegeli/records files with different writer options, e.g. "
+    "compression or transposition, preserving records and file metadata.\n";
+
+}  // namespace
+}  // namespace tools
+}  // namespace riegeli
+
+int main(int argc, char** argv) {
+  absl::SetProgramUsageMessage(riegeli::tools::kUsage);
+  std::vector<char*> args = absl::ParseCommandLine(argc, argv);
+  args.erase(args.begin());
+  return riegeli::tools::TranscodeFiles(args) ? 0 : 1;
+}
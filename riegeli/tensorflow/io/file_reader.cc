@@ -17,6 +17,7 @@
 #include <stddef.h>
 
 #include <cstring>
+#include <future>
 #include <limits>
 #include <memory>
 #include <string>
@@ -27,7 +28,9 @@
 #include "absl/strings/string_view.h"
 #include "absl/types/span.h"
 #include "riegeli/base/base.h"
+#include "riegeli/base/buffer.h"
 #include "riegeli/base/chain.h"
+#include "riegeli/base/parallelism.h"
 #include "riegeli/base/status.h"
 #include "riegeli/bytes/backward_writer.h"
 #include "riegeli/bytes/reader.h"
@@ -358,8 +361,7 @@ inline bool FileReaderBase::ReadToDest(char* dest, size_t length,
     return FailOverflow();
   }
   absl::string_view result;
-  const ::tensorflow::Status status = src->Read(
-      IntCast<::tensorflow::uint64>(limit_pos_), length, &result, dest);
+  const ::tensorflow::Status status = ReadFile(src, length, &result, dest);
   RIEGELI_ASSERT_LE(result.size(), length)
       << "RandomAccessFile::Read() read more than requested";
   if (result.data() != dest) std::memcpy(dest, result.data(), result.size());
@@ -389,8 +391,7 @@ inline bool FileReaderBase::ReadToBuffer(absl::Span<char> flat_buffer,
   }
   absl::string_view result;
   const ::tensorflow::Status status =
-      src->Read(IntCast<::tensorflow::uint64>(limit_pos_), flat_buffer.size(),
-                &result, flat_buffer.data());
+      ReadFile(src, flat_buffer.size(), &result, flat_buffer.data());
   RIEGELI_ASSERT_LE(result.size(), flat_buffer.size())
       << "RandomAccessFile::Read() read more than requested";
   if (result.data() != flat_buffer.data()) {
@@ -419,6 +420,113 @@ inline bool FileReaderBase::ReadToBuffer(absl::Span<char> flat_buffer,
   return true;
 }
 
+::tensorflow::Status FileReaderBase::ReadFile(
+    ::tensorflow::RandomAccessFile* src, size_t length,
+    absl::string_view* result, char* scratch) {
+  if (parallelism_ > 0) {
+    return ReadFromReadAhead(src, length, result, scratch);
+  }
+  return src->Read(IntCast<::tensorflow::uint64>(limit_pos_), length, result,
+                   scratch);
+}
+
+::tensorflow::Status FileReaderBase::ReadFromReadAhead(
+    ::tensorflow::RandomAccessFile* src, size_t length,
+    absl::string_view* result, char* scratch) {
+  Position pos = limit_pos_;
+  size_t length_read = 0;
+  while (length_read < length) {
+    if (pos < current_pos_ || pos >= current_pos_ + current_.length) {
+      if (!read_ahead_.empty() && read_ahead_.front().pos == pos) {
+        // Reading is sequential. Widen the window.
+        const size_t max_length = UnsignedMax(
+            buffer_size_, max_read_ahead_ / IntCast<size_t>(parallelism_));
+        read_ahead_length_ = UnsignedMin(
+            SaturatingAdd(read_ahead_length_, read_ahead_length_), max_length);
+      } else {
+        // Reading is not sequential, or a range was read partially. Collapse
+        // the window.
+        CancelReadAhead();
+      }
+      ScheduleReadAhead(src, pos);
+      ReadAheadRequest& request = read_ahead_.front();
+      current_pos_ = request.pos;
+      current_ = request.block.get();
+      read_ahead_.pop_front();
+      // Keep `parallelism_` ranges in flight while `current_` is consumed.
+      ScheduleReadAhead(src, pos);
+    }
+    const size_t offset = IntCast<size_t>(pos - current_pos_);
+    const size_t length_to_copy =
+        UnsignedMin(current_.length - offset, length - length_read);
+    if (
+        // `std::memcpy(_, nullptr, 0)` is undefined.
+        length_to_copy > 0) {
+      std::memcpy(scratch + length_read, current_.data.GetData() + offset,
+                  length_to_copy);
+    }
+    pos += length_to_copy;
+    length_read += length_to_copy;
+    if (pos == current_pos_ + current_.length && !current_.status.ok()) {
+      // The range is incomplete because the file ends or reading failed.
+      // Ranges read ahead beyond this are not useful, and the failure might be
+      // transient or the file might grow before it is read again.
+      const ::tensorflow::Status status = current_.status;
+      CancelReadAhead();
+      *result = absl::string_view(scratch, length_read);
+      return status;
+    }
+  }
+  *result = absl::string_view(scratch, length_read);
+  return ::tensorflow::Status::OK();
+}
+
+void FileReaderBase::ScheduleReadAhead(::tensorflow::RandomAccessFile* src,
+                                       Position pos) {
+  if (!read_ahead_.empty()) {
+    pos = read_ahead_.back().pos + read_ahead_.back().length;
+  }
+  while (read_ahead_.size() < IntCast<size_t>(parallelism_)) {
+    const size_t length = IntCast<size_t>(UnsignedMin(
+        Position{read_ahead_length_},
+        Position{std::numeric_limits<::tensorflow::uint64>::max()} - pos));
+    if (ABSL_PREDICT_FALSE(length == 0)) break;
+    std::promise<ReadAheadBlock>* const promise =
+        new std::promise<ReadAheadBlock>();
+    read_ahead_.push_back(ReadAheadRequest{pos, length, promise->get_future()});
+    ThreadPool::global().Schedule([src, pos, length, promise] {
+      ReadAheadBlock block;
+      block.data = Buffer(length);
+      char* const data = block.data.GetData();
+      absl::string_view result;
+      block.status =
+          src->Read(IntCast<::tensorflow::uint64>(pos), length, &result, data);
+      RIEGELI_ASSERT_LE(result.size(), length)
+          << "RandomAccessFile::Read() read more than requested";
+      if (result.data() != data && !result.empty()) {
+        std::memcpy(data, result.data(), result.size());
+      }
+      block.length = result.size();
+      promise->set_value(std::move(block));
+      delete promise;
+    });
+    pos += length;
+  }
+}
+
+void FileReaderBase::CancelReadAhead() {
+  for (ReadAheadRequest& request : read_ahead_) request.block.wait();
+  read_ahead_.clear();
+  current_ = ReadAheadBlock();
+  current_pos_ = 0;
+  read_ahead_length_ = buffer_size_;
+}
+
+void FileReaderBase::Done() {
+  CancelReadAhead();
+  Reader::Done();
+}
+
 bool FileReaderBase::SeekSlow(Position new_pos) {
   RIEGELI_ASSERT(new_pos < start_pos() || new_pos > limit_pos_)
       << "Failed precondition of Reader::SeekSlow(): "
@@ -17,6 +17,8 @@
 
 #include <stddef.h>
 
+#include <deque>
+#include <future>
 #include <memory>
 #include <string>
 #include <tuple>
@@ -27,6 +29,7 @@
 #include "absl/strings/string_view.h"
 #include "absl/types/span.h"
 #include "riegeli/base/base.h"
+#include "riegeli/base/buffer.h"
 #include "riegeli/base/chain.h"
 #include "riegeli/base/dependency.h"
 #include "riegeli/base/object.h"
@@ -88,6 +91,45 @@ class FileReaderBase : public Reader {
       return std::move(set_buffer_size(buffer_size));
     }
 
+    // If 0, data are read synchronously with `RandomAccessFile::Read()` when
+    // requested.
+    //
+    // If greater than 0, up to this many ranges following the current position
+    // are read ahead concurrently in background threads. This hides latency of
+    // remote filesystems, at the cost of memory and of reading data which might
+    // not be needed.
+    //
+    // The read ahead window adapts to the access pattern. A range initially
+    // has `buffer_size()` bytes, and its length doubles whenever reading
+    // proceeds sequentially to the next range, up to
+    // `max_read_ahead() / parallelism()`. Seeking outside of the data read
+    // ahead discards them and shrinks ranges back to `buffer_size()`.
+    //
+    // Default: 0
+    Options& set_parallelism(int parallelism) & {
+      RIEGELI_ASSERT_GE(parallelism, 0)
+          << "Failed precondition of "
+             "FileReaderBase::Options::set_parallelism(): "
+             "negative parallelism";
+      parallelism_ = parallelism;
+      return *this;
+    }
+    Options&& set_parallelism(int parallelism) && {
+      return std::move(set_parallelism(parallelism));
+    }
+
+    // Tunes how much data can be read ahead if `parallelism() > 0`. Each range
+    // has at least `buffer_size()` bytes anyway.
+    //
+    // Default: 16M
+    Options& set_max_read_ahead(size_t max_read_ahead) & {
+      max_read_ahead_ = max_read_ahead;
+      return *this;
+    }
+    Options&& set_max_read_ahead(size_t max_read_ahead) && {
+      return std::move(set_max_read_ahead(max_read_ahead));
+    }
+
    private:
     template <typename Src>
     friend class FileReader;
@@ -95,6 +137,8 @@ class FileReaderBase : public Reader {
     ::tensorflow::Env* env_ = nullptr;
     Position initial_pos_ = 0;
     size_t buffer_size_ = kDefaultBufferSize;
+    int parallelism_ = 0;
+    size_t max_read_ahead_ = size_t{16} << 20;
   };
 
   // Returns the `::tensorflow::RandomAccessFile` being read from. If the
@@ -112,13 +156,14 @@ class FileReaderBase : public Reader {
  protected:
   FileReaderBase() noexcept : Reader(kInitiallyClosed) {}
 
-  explicit FileReaderBase(size_t buffer_size);
+  explicit FileReaderBase(size_t buffer_size, int parallelism,
+                          size_t max_read_ahead);
 
   FileReaderBase(FileReaderBase&& that) noexcept;
   FileReaderBase& operator=(FileReaderBase&& that) noexcept;
 
   void Reset();
-  void Reset(size_t buffer_size);
+  void Reset(size_t buffer_size, int parallelism, size_t max_read_ahead);
   void Initialize(::tensorflow::RandomAccessFile* src, ::tensorflow::Env* env,
                   Position initial_pos);
   bool InitializeFilename(::tensorflow::RandomAccessFile* src,
@@ -129,6 +174,14 @@ class FileReaderBase : public Reader {
   ABSL_ATTRIBUTE_COLD bool FailOperation(const ::tensorflow::Status& status,
                                          absl::string_view operation);
 
+  // Waits for ranges being read ahead and discards them, together with
+  // `current_`.
+  //
+  // This must be called before the `::tensorflow::RandomAccessFile` is
+  // deleted, because background reads refer to it.
+  void CancelReadAhead();
+
+  void Done() override;
   bool PullSlow(size_t min_length, size_t recommended_length) override;
   using Reader::ReadSlow;
   bool ReadSlow(char* dest, size_t length) override;
@@ -171,6 +224,40 @@ class FileReaderBase : public Reader {
   // Discards buffer contents.
   void ClearBuffer();
 
+  // Reads `length` bytes from `*src`, from the physical file position which is
+  // `limit_pos_`, like `::tensorflow::RandomAccessFile::Read()`, but using data
+  // read ahead if `parallelism_ > 0`.
+  ::tensorflow::Status ReadFile(::tensorflow::RandomAccessFile* src,
+                                size_t length, absl::string_view* result,
+                                char* scratch);
+
+  // Result of reading a range ahead in the background.
+  struct ReadAheadBlock {
+    Buffer data;
+    // The length read.
+    size_t length = 0;
+    // Status of `::tensorflow::RandomAccessFile::Read()`. If `status.ok()`,
+    // the whole range was read.
+    ::tensorflow::Status status;
+  };
+
+  struct ReadAheadRequest {
+    Position pos;
+    size_t length;
+    std::future<ReadAheadBlock> block;
+  };
+
+  // Implements `ReadFile()` if `parallelism_ > 0`.
+  ::tensorflow::Status ReadFromReadAhead(::tensorflow::RandomAccessFile* src,
+                                         size_t length,
+                                         absl::string_view* result,
+                                         char* scratch);
+
+  // Schedules reading ranges following the last range being read ahead, or
+  // following `pos` if nothing is being read ahead, until `parallelism_`
+  // ranges are being read ahead.
+  void ScheduleReadAhead(::tensorflow::RandomAccessFile* src, Position pos);
+
   std::string filename_;
   // Invariant:
   //   if `healthy() && !filename_.empty()` then `file_system_ != nullptr`
@@ -182,6 +269,17 @@ class FileReaderBase : public Reader {
   // are in memory managed by the `::tensorflow::RandomAccessFile`. In any case
   // `start_` points to them.
   ChainBlock buffer_;
+  int parallelism_ = 0;
+  size_t max_read_ahead_ = 0;
+  // Length of ranges to be read ahead next. It grows during sequential reading
+  // and is reset after seeking.
+  size_t read_ahead_length_ = 0;
+  // Ranges being read ahead, in the order of positions, each beginning where
+  // the previous one ends.
+  std::deque<ReadAheadRequest> read_ahead_;
+  // The range read ahead which is being consumed, beginning at `current_pos_`.
+  ReadAheadBlock current_;
+  Position current_pos_ = 0;
 
   // Invariants if `!buffer_.empty()`:
   //   `start_ == buffer_.data()`
@@ -222,6 +320,8 @@ class FileReader : public FileReaderBase {
   FileReader(FileReader&& that) noexcept;
   FileReader& operator=(FileReader&& that) noexcept;
 
+  ~FileReader() { CancelReadAhead(); }
+
   // Makes `*this` equivalent to a newly constructed `FileReader`. This avoids
   // constructing a temporary `FileReader` and moving from it.
   void Reset();
@@ -256,40 +356,67 @@ class FileReader : public FileReaderBase {
 
 // Implementation details follow.
 
-inline FileReaderBase::FileReaderBase(size_t buffer_size)
-    : Reader(kInitiallyOpen), buffer_size_(buffer_size) {}
+inline FileReaderBase::FileReaderBase(size_t buffer_size, int parallelism,
+                                      size_t max_read_ahead)
+    : Reader(kInitiallyOpen),
+      buffer_size_(buffer_size),
+      parallelism_(parallelism),
+      max_read_ahead_(max_read_ahead),
+      read_ahead_length_(buffer_size) {}
 
 inline FileReaderBase::FileReaderBase(FileReaderBase&& that) noexcept
     : Reader(std::move(that)),
       filename_(std::move(that.filename_)),
       file_system_(that.file_system_),
       buffer_size_(that.buffer_size_),
-      buffer_(std::move(that.buffer_)) {}
+      buffer_(std::move(that.buffer_)),
+      parallelism_(that.parallelism_),
+      max_read_ahead_(that.max_read_ahead_),
+      read_ahead_length_(that.read_ahead_length_),
+      read_ahead_(std::move(that.read_ahead_)),
+      current_(std::move(that.current_)),
+      current_pos_(that.current_pos_) {}
 
 inline FileReaderBase& FileReaderBase::operator=(
     FileReaderBase&& that) noexcept {
+  CancelReadAhead();
   Reader::operator=(std::move(that));
   filename_ = std::move(that.filename_);
   file_system_ = that.file_system_;
   buffer_size_ = that.buffer_size_;
   buffer_ = std::move(that.buffer_);
+  parallelism_ = that.parallelism_;
+  max_read_ahead_ = that.max_read_ahead_;
+  read_ahead_length_ = that.read_ahead_length_;
+  read_ahead_ = std::move(that.read_ahead_);
+  current_ = std::move(that.current_);
+  current_pos_ = that.current_pos_;
   return *this;
 }
 
 inline void FileReaderBase::Reset() {
+  CancelReadAhead();
   Reader::Reset(kInitiallyClosed);
   filename_.clear();
   file_system_ = nullptr;
   buffer_size_ = 0;
   buffer_.Clear();
+  parallelism_ = 0;
+  max_read_ahead_ = 0;
+  read_ahead_length_ = 0;
 }
 
-inline void FileReaderBase::Reset(size_t buffer_size) {
+inline void FileReaderBase::Reset(size_t buffer_size, int parallelism,
+                                  size_t max_read_ahead) {
+  CancelReadAhead();
   Reader::Reset(kInitiallyOpen);
   filename_.clear();
   file_system_ = nullptr;
   buffer_size_ = buffer_size;
   buffer_.Clear();
+  parallelism_ = parallelism;
+  max_read_ahead_ = max_read_ahead;
+  read_ahead_length_ = buffer_size;
 }
 
 inline void FileReaderBase::Initialize(::tensorflow::RandomAccessFile* src,
@@ -303,13 +430,17 @@ inline void FileReaderBase::Initialize(::tensorflow::RandomAccessFile* src,
 
 template <typename Src>
 inline FileReader<Src>::FileReader(const Src& src, Options options)
-    : FileReaderBase(options.buffer_size_), src_(src) {
+    : FileReaderBase(options.buffer_size_, options.parallelism_,
+                     options.max_read_ahead_),
+      src_(src) {
   Initialize(src_.get(), options.env_, options.initial_pos_);
 }
 
 template <typename Src>
 inline FileReader<Src>::FileReader(Src&& src, Options options)
-    : FileReaderBase(options.buffer_size_), src_(std::move(src)) {
+    : FileReaderBase(options.buffer_size_, options.parallelism_,
+                     options.max_read_ahead_),
+      src_(std::move(src)) {
   Initialize(src_.get(), options.env_, options.initial_pos_);
 }
 
@@ -317,13 +448,16 @@ template <typename Src>
 template <typename... SrcArgs>
 inline FileReader<Src>::FileReader(std::tuple<SrcArgs...> src_args,
                                    Options options)
-    : FileReaderBase(options.buffer_size_), src_(std::move(src_args)) {
+    : FileReaderBase(options.buffer_size_, options.parallelism_,
+                     options.max_read_ahead_),
+      src_(std::move(src_args)) {
   Initialize(src_.get(), options.env_, options.initial_pos_);
 }
 
 template <typename Src>
 inline FileReader<Src>::FileReader(absl::string_view filename, Options options)
-    : FileReaderBase(options.buffer_size_) {
+    : FileReaderBase(options.buffer_size_, options.parallelism_,
+                     options.max_read_ahead_) {
   Initialize(filename, options.env_, options.initial_pos_);
 }
 
@@ -335,14 +469,16 @@ inline void FileReader<Src>::Reset() {
 
 template <typename Src>
 inline void FileReader<Src>::Reset(const Src& src, Options options) {
-  FileReaderBase::Reset(options.buffer_size_);
+  FileReaderBase::Reset(options.buffer_size_, options.parallelism_,
+                        options.max_read_ahead_);
   src_.Reset(src);
   Initialize(src_.get(), options.env_, options.initial_pos_);
 }
 
 template <typename Src>
 inline void FileReader<Src>::Reset(Src&& src, Options options) {
-  FileReaderBase::Reset(options.buffer_size_);
+  FileReaderBase::Reset(options.buffer_size_, options.parallelism_,
+                        options.max_read_ahead_);
   src_.Reset(std::move(src));
   Initialize(src_.get(), options.env_, options.initial_pos_);
 }
@@ -351,7 +487,8 @@ template <typename Src>
 template <typename... SrcArgs>
 inline void FileReader<Src>::Reset(std::tuple<SrcArgs...> src_args,
                                    Options options) {
-  FileReaderBase::Reset(options.buffer_size_);
+  FileReaderBase::Reset(options.buffer_size_, options.parallelism_,
+                        options.max_read_ahead_);
   src_.Reset(std::move(src_args));
   Initialize(src_.get(), options.env_, options.initial_pos_);
 }
@@ -359,7 +496,8 @@ inline void FileReader<Src>::Reset(std::tuple<SrcArgs...> src_args,
 template <typename Src>
 inline void FileReader<Src>::Reset(absl::string_view filename,
                                    Options options) {
-  FileReaderBase::Reset(options.buffer_size_);
+  FileReaderBase::Reset(options.buffer_size_, options.parallelism_,
+                        options.max_read_ahead_);
   src_.Reset();  // In case `OpenFile()` fails.
   Initialize(filename, options.env_, options.initial_pos_);
 }
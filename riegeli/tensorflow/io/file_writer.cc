@@ -24,9 +24,11 @@
 #include "absl/base/optimization.h"
 #include "absl/strings/str_cat.h"
 #include "absl/strings/string_view.h"
+#include "absl/synchronization/mutex.h"
 #include "riegeli/base/base.h"
 #include "riegeli/base/buffer.h"
 #include "riegeli/base/chain.h"
+#include "riegeli/base/parallelism.h"
 #include "riegeli/base/status.h"
 #include "riegeli/bytes/writer.h"
 #include "tensorflow/core/lib/core/errors.h"
@@ -170,6 +172,53 @@ bool FileWriterBase::WriteInternal(absl::string_view src) {
                          std::numeric_limits<Position>::max() - start_pos_)) {
     return FailOverflow();
   }
+  if (max_pending_ > 0) {
+    if (write_behind_ == nullptr) {
+      write_behind_ = std::make_unique<WriteBehind>();
+      write_behind_->max_pending = max_pending_;
+    }
+    WriteBehind* const write_behind = write_behind_.get();
+    ::tensorflow::Status status;
+    {
+      absl::MutexLock lock(&write_behind->mutex);
+      write_behind->mutex.Await(
+          absl::Condition(write_behind, &WriteBehind::HasCapacity));
+      status = write_behind->status;
+      if (ABSL_PREDICT_TRUE(status.ok())) {
+        // TODO: When `absl::string_view` becomes C++17 `std::string_view`:
+        // write_behind->pending.emplace_back(src);
+        write_behind->pending.emplace_back(src.data(), src.size());
+        write_behind->pending_length += src.size();
+        if (!write_behind->appending) {
+          write_behind->appending = true;
+          ThreadPool::global().Schedule([dest, write_behind] {
+            write_behind->mutex.Lock();
+            while (!write_behind->pending.empty() &&
+                   write_behind->status.ok()) {
+              const std::string data = std::move(write_behind->pending.front());
+              write_behind->pending.pop_front();
+              write_behind->mutex.Unlock();
+              const ::tensorflow::Status append_status = dest->Append(data);
+              write_behind->mutex.Lock();
+              write_behind->pending_length -= data.size();
+              if (ABSL_PREDICT_FALSE(!append_status.ok())) {
+                write_behind->status = append_status;
+              }
+            }
+            write_behind->pending.clear();
+            write_behind->pending_length = 0;
+            write_behind->appending = false;
+            write_behind->mutex.Unlock();
+          });
+        }
+      }
+    }
+    if (ABSL_PREDICT_FALSE(!status.ok())) {
+      return FailOperation(status, "WritableFile::Append(string_view)");
+    }
+    start_pos_ += src.size();
+    return true;
+  }
   {
     const ::tensorflow::Status status = dest->Append(src);
     if (ABSL_PREDICT_FALSE(!status.ok())) {
@@ -180,8 +229,29 @@ bool FileWriterBase::WriteInternal(absl::string_view src) {
   return true;
 }
 
+bool FileWriterBase::WaitForWrites() {
+  if (write_behind_ == nullptr) return healthy();
+  ::tensorflow::Status status;
+  {
+    absl::MutexLock lock(&write_behind_->mutex);
+    write_behind_->mutex.Await(
+        absl::Condition(write_behind_.get(), &WriteBehind::Idle));
+    status = write_behind_->status;
+  }
+  if (ABSL_PREDICT_FALSE(!status.ok()) && ABSL_PREDICT_TRUE(healthy())) {
+    FailOperation(status, "WritableFile::Append(string_view)");
+  }
+  return healthy();
+}
+
+void FileWriterBase::Done() {
+  WaitForWrites();
+  Writer::Done();
+}
+
 bool FileWriterBase::Flush(FlushType flush_type) {
   if (ABSL_PREDICT_FALSE(!PushInternal())) return false;
+  if (ABSL_PREDICT_FALSE(!WaitForWrites())) return false;
   ::tensorflow::WritableFile* const dest = dest_file();
   switch (flush_type) {
     case FlushType::kFromObject:
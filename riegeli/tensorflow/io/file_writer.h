@@ -17,6 +17,7 @@
 
 #include <stddef.h>
 
+#include <deque>
 #include <memory>
 #include <string>
 #include <tuple>
@@ -24,7 +25,9 @@
 
 #include "absl/base/attributes.h"
 #include "absl/base/optimization.h"
+#include "absl/base/thread_annotations.h"
 #include "absl/strings/string_view.h"
+#include "absl/synchronization/mutex.h"
 #include "riegeli/base/base.h"
 #include "riegeli/base/buffer.h"
 #include "riegeli/base/chain.h"
@@ -91,6 +94,27 @@ class FileWriterBase : public Writer {
       return std::move(set_buffer_size(buffer_size));
     }
 
+    // If 0, data are appended synchronously with `WritableFile::Append()` when
+    // the buffer is full.
+    //
+    // If greater than 0, full buffers are appended in a background thread, so
+    // that writing does not wait for the filesystem, which improves throughput
+    // of remote filesystems with high latency. Appends are issued in order,
+    // one at a time, because a `::tensorflow::WritableFile` is sequential.
+    // Writing waits while at least this many bytes are pending, which bounds
+    // memory used for data copied for background appends. An append failure
+    // is reported by a later operation, at the latest by `Flush()` or
+    // `Close()`.
+    //
+    // Default: 0
+    Options& set_max_pending(size_t max_pending) & {
+      max_pending_ = max_pending;
+      return *this;
+    }
+    Options&& set_max_pending(size_t max_pending) && {
+      return std::move(set_max_pending(max_pending));
+    }
+
    private:
     template <typename Dest>
     friend class FileWriter;
@@ -98,6 +122,7 @@ class FileWriterBase : public Writer {
     ::tensorflow::Env* env_ = nullptr;
     bool append_ = false;
     size_t buffer_size_ = kDefaultBufferSize;
+    size_t max_pending_ = 0;
   };
 
   // Returns the `::tensorflow::WritableFile` being written to. Unchanged by
@@ -113,13 +138,13 @@ class FileWriterBase : public Writer {
  protected:
   FileWriterBase() noexcept : Writer(kInitiallyClosed) {}
 
-  explicit FileWriterBase(size_t buffer_size);
+  explicit FileWriterBase(size_t buffer_size, size_t max_pending);
 
   FileWriterBase(FileWriterBase&& that) noexcept;
   FileWriterBase& operator=(FileWriterBase&& that) noexcept;
 
   void Reset();
-  void Reset(size_t buffer_size);
+  void Reset(size_t buffer_size, size_t max_pending);
   void Initialize(::tensorflow::WritableFile* dest);
   void InitializeFilename(::tensorflow::WritableFile* dest);
   std::unique_ptr<::tensorflow::WritableFile> OpenFile(
@@ -128,6 +153,17 @@ class FileWriterBase : public Writer {
   ABSL_ATTRIBUTE_COLD bool FailOperation(const ::tensorflow::Status& status,
                                          absl::string_view operation);
 
+  // Waits until background appends finish. Fails `*this` if an append failed.
+  //
+  // This must be called before the `::tensorflow::WritableFile` is closed or
+  // deleted, because background appends refer to it.
+  //
+  // Return values:
+  //  * `true`  - success (`healthy()`)
+  //  * `false` - failure (`!healthy()`)
+  bool WaitForWrites();
+
+  void Done() override;
   bool PushSlow(size_t min_length, size_t recommended_length) override;
 
   // Writes buffered data to the destination, but unlike `PushSlow()`, does not
@@ -154,11 +190,35 @@ class FileWriterBase : public Writer {
   // and write the data directly than to write the data through `buffer_`.
   size_t LengthToWriteDirectly() const;
 
+  // State shared with the background task appending pending data.
+  struct WriteBehind {
+    bool HasCapacity() const {
+      return pending_length < max_pending || !status.ok();
+    }
+    bool Idle() const { return !appending; }
+
+    size_t max_pending = 0;
+    absl::Mutex mutex;
+    // Data to be appended, in order.
+    std::deque<std::string> pending ABSL_GUARDED_BY(mutex);
+    // Total length of `pending` and of data being appended.
+    size_t pending_length ABSL_GUARDED_BY(mutex) = 0;
+    // Whether a background task is appending `pending`.
+    bool appending ABSL_GUARDED_BY(mutex) = false;
+    // The first failure of a background append. Data pending after it are
+    // discarded.
+    ::tensorflow::Status status ABSL_GUARDED_BY(mutex);
+  };
+
   std::string filename_;
   // Invariant: if `healthy()` then `buffer_size_ > 0`
   size_t buffer_size_ = 0;
   // Buffered data to be written.
   Buffer buffer_;
+  size_t max_pending_ = 0;
+  // Created when data are first appended in the background, if
+  // `max_pending_ > 0`.
+  std::unique_ptr<WriteBehind> write_behind_;
 };
 
 // A `Writer` which writes to a `::tensorflow::WritableFile`.
@@ -197,6 +257,8 @@ class FileWriter : public FileWriterBase {
   FileWriter(FileWriter&& that) noexcept;
   FileWriter& operator=(FileWriter&& that) noexcept;
 
+  ~FileWriter() { WaitForWrites(); }
+
   // Makes `*this` equivalent to a newly constructed `FileWriter`. This avoids
   // constructing a temporary `FileWriter` and moving from it.
   void Reset();
@@ -227,35 +289,49 @@ class FileWriter : public FileWriterBase {
 
 // Implementation details follow.
 
-inline FileWriterBase::FileWriterBase(size_t buffer_size)
-    : Writer(kInitiallyOpen), buffer_size_(buffer_size), buffer_(buffer_size) {}
+inline FileWriterBase::FileWriterBase(size_t buffer_size, size_t max_pending)
+    : Writer(kInitiallyOpen),
+      buffer_size_(buffer_size),
+      buffer_(buffer_size),
+      max_pending_(max_pending) {}
 
 inline FileWriterBase::FileWriterBase(FileWriterBase&& that) noexcept
     : Writer(std::move(that)),
       filename_(std::move(that.filename_)),
       buffer_size_(that.buffer_size_),
-      buffer_(std::move(that.buffer_)) {}
+      buffer_(std::move(that.buffer_)),
+      max_pending_(that.max_pending_),
+      write_behind_(std::move(that.write_behind_)) {}
 
 inline FileWriterBase& FileWriterBase::operator=(
     FileWriterBase&& that) noexcept {
+  WaitForWrites();
   Writer::operator=(std::move(that));
   filename_ = std::move(that.filename_);
   buffer_size_ = that.buffer_size_;
   buffer_ = std::move(that.buffer_);
+  max_pending_ = that.max_pending_;
+  write_behind_ = std::move(that.write_behind_);
   return *this;
 }
 
 inline void FileWriterBase::Reset() {
+  WaitForWrites();
   Writer::Reset(kInitiallyClosed);
   filename_.clear();
   buffer_size_ = 0;
+  max_pending_ = 0;
+  write_behind_.reset();
 }
 
-inline void FileWriterBase::Reset(size_t buffer_size) {
+inline void FileWriterBase::Reset(size_t buffer_size, size_t max_pending) {
+  WaitForWrites();
   Writer::Reset(kInitiallyOpen);
   filename_.clear();
   buffer_size_ = buffer_size;
   buffer_.Resize(buffer_size);
+  max_pending_ = max_pending;
+  write_behind_.reset();
 }
 
 inline void FileWriterBase::Initialize(::tensorflow::WritableFile* dest) {
@@ -267,13 +343,15 @@ inline void FileWriterBase::Initialize(::tensorflow::WritableFile* dest) {
 
 template <typename Dest>
 inline FileWriter<Dest>::FileWriter(const Dest& dest, Options options)
-    : FileWriterBase(options.buffer_size_), dest_(dest) {
+    : FileWriterBase(options.buffer_size_, options.max_pending_),
+      dest_(dest) {
   Initialize(dest_.get());
 }
 
 template <typename Dest>
 inline FileWriter<Dest>::FileWriter(Dest&& dest, Options options)
-    : FileWriterBase(options.buffer_size_), dest_(std::move(dest)) {
+    : FileWriterBase(options.buffer_size_, options.max_pending_),
+      dest_(std::move(dest)) {
   Initialize(dest_.get());
 }
 
@@ -281,13 +359,14 @@ template <typename Dest>
 template <typename... DestArgs>
 inline FileWriter<Dest>::FileWriter(std::tuple<DestArgs...> dest_args,
                                     Options options)
-    : FileWriterBase(options.buffer_size_), dest_(std::move(dest_args)) {
+    : FileWriterBase(options.buffer_size_, options.max_pending_),
+      dest_(std::move(dest_args)) {
   Initialize(dest_.get());
 }
 
 template <typename Dest>
 inline FileWriter<Dest>::FileWriter(absl::string_view filename, Options options)
-    : FileWriterBase(options.buffer_size_) {
+    : FileWriterBase(options.buffer_size_, options.max_pending_) {
   Initialize(filename, options.env_, options.append_);
 }
 
@@ -312,14 +391,14 @@ inline void FileWriter<Dest>::Reset() {
 
 template <typename Dest>
 inline void FileWriter<Dest>::Reset(const Dest& dest, Options options) {
-  FileWriterBase::Reset(options.buffer_size_);
+  FileWriterBase::Reset(options.buffer_size_, options.max_pending_);
   dest_.Reset(dest);
   Initialize(dest_.get());
 }
 
 template <typename Dest>
 inline void FileWriter<Dest>::Reset(Dest&& dest, Options options) {
-  FileWriterBase::Reset(options.buffer_size_);
+  FileWriterBase::Reset(options.buffer_size_, options.max_pending_);
   dest_.Reset(std::move(dest));
   Initialize(dest_.get());
 }
@@ -328,7 +407,7 @@ template <typename Dest>
 template <typename... DestArgs>
 inline void FileWriter<Dest>::Reset(std::tuple<DestArgs...> dest_args,
                                     Options options) {
-  FileWriterBase::Reset(options.buffer_size_);
+  FileWriterBase::Reset(options.buffer_size_, options.max_pending_);
   dest_.Reset(std::move(dest_args));
   Initialize(dest_.get());
 }
@@ -336,7 +415,7 @@ inline void FileWriter<Dest>::Reset(std::tuple<DestArgs...> dest_args,
 template <typename Dest>
 inline void FileWriter<Dest>::Reset(absl::string_view filename,
                                     Options options) {
-  FileWriterBase::Reset(options.buffer_size_);
+  FileWriterBase::Reset(options.buffer_size_, options.max_pending_);
   dest_.Reset();  // In case `OpenFile()` fails.
   Initialize(filename, options.env_, options.append_);
 }
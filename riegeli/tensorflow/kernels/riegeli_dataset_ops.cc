@@ -13,7 +13,9 @@
 // limitations under the License.
 
 #include <stddef.h>
+#include <stdint.h>
 
+#include <deque>
 #include <memory>
 #include <string>
 #include <tuple>
@@ -21,16 +23,23 @@
 #include <vector>
 
 #include "absl/base/thread_annotations.h"
+#include "absl/strings/numbers.h"
 #include "absl/strings/str_cat.h"
+#include "absl/strings/str_split.h"
 #include "absl/synchronization/mutex.h"
+#include "absl/strings/string_view.h"
 #include "absl/types/optional.h"
+#include "absl/types/span.h"
 #include "riegeli/base/base.h"
+#include "riegeli/base/parallelism.h"
 #include "riegeli/base/status.h"
+#include "riegeli/chunk_encoding/field_projection.h"
 #include "riegeli/records/record_position.h"
 #include "riegeli/records/record_reader.h"
 #include "riegeli/records/skipped_region.h"
 #include "riegeli/tensorflow/io/file_reader.h"
 #include "tensorflow/core/framework/allocator.h"
+#include "tensorflow/core/framework/attr_value.pb.h"
 #include "tensorflow/core/framework/dataset.h"
 #include "tensorflow/core/framework/kernel_def_builder.h"
 #include "tensorflow/core/framework/op_kernel.h"
@@ -58,9 +67,275 @@ namespace riegeli {
 namespace tensorflow {
 namespace {
 
+// Reads elements of a `RiegeliDataset` from a single file, either when they
+// are requested, or ahead in a background thread.
+class FileIterator {
+ public:
+  struct Element {
+    // If not OK, reading failed, and `tensor` is not meaningful.
+    ::tensorflow::Status status;
+    ::tensorflow::Tensor tensor;
+    // If `true`, the file ends, and other fields are not meaningful.
+    bool end = false;
+    // The position of the next record after this element.
+    RecordPosition pos;
+  };
+
+  // The file is not opened until `Start()` or `Next()` is called, so that
+  // restoring iterator state does not read ahead from files which might not be
+  // needed.
+  //
+  // If `buffer_size > 0`, up to `buffer_size` elements are read ahead in a
+  // background thread.
+  explicit FileIterator(size_t file_index, const std::string& filename,
+                        ::tensorflow::Env* env,
+                        RecordReaderBase::Options record_reader_options,
+                        bool batched, size_t buffer_size,
+                        RecordPosition initial_pos);
+
+  FileIterator(const FileIterator&) = delete;
+  FileIterator& operator=(const FileIterator&) = delete;
+
+  // Waits for the background thread, if any.
+  ~FileIterator();
+
+  // Opens the file and starts reading ahead, if this has not been done yet.
+  void Start();
+
+  // Sets `*element` to the next element. After the file ends, keeps returning
+  // `element->end == true`.
+  void Next(Element* element);
+
+  // Returns the index of the file in the dataset.
+  size_t file_index() const { return file_index_; }
+
+  // Returns the position of the next record to be returned by `Next()`.
+  RecordPosition pos() const ABSL_LOCKS_EXCLUDED(mu_);
+
+ private:
+  void ReadElement(Element* element);
+  void ReadInBackground();
+  bool HasCapacity() const ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_);
+  bool HasElement() const ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_);
+  bool BackgroundDone() const ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_);
+
+  const size_t file_index_;
+  const std::string filename_;
+  ::tensorflow::Env* const env_;
+  // Moved to `reader_` by `Start()`.
+  RecordReaderBase::Options record_reader_options_;
+  const bool batched_;
+  const size_t buffer_size_;
+  bool started_ = false;
+  // `absl::nullopt` means not started yet. Accessed by the background thread
+  // if `buffer_size_ > 0`.
+  absl::optional<RecordReader<tensorflow::FileReader<>>> reader_;
+
+  mutable absl::Mutex mu_;
+  // Read by the background thread if `buffer_size_ > 0`.
+  RecordPosition pos_ ABSL_GUARDED_BY(mu_);
+  // Elements read ahead. An element with `end == true` stays there.
+  std::deque<Element> buffer_ ABSL_GUARDED_BY(mu_);
+  bool cancelled_ ABSL_GUARDED_BY(mu_) = false;
+  bool background_done_ ABSL_GUARDED_BY(mu_) = false;
+};
+
+FileIterator::FileIterator(size_t file_index, const std::string& filename,
+                           ::tensorflow::Env* env,
+                           RecordReaderBase::Options record_reader_options,
+                           bool batched, size_t buffer_size,
+                           RecordPosition initial_pos)
+    : file_index_(file_index),
+      filename_(filename),
+      env_(env),
+      record_reader_options_(std::move(record_reader_options)),
+      batched_(batched),
+      buffer_size_(buffer_size),
+      pos_(initial_pos) {}
+
+FileIterator::~FileIterator() {
+  if (!started_ || buffer_size_ == 0) return;
+  absl::MutexLock l(&mu_);
+  cancelled_ = true;
+  mu_.Await(absl::Condition(this, &FileIterator::BackgroundDone));
+}
+
+void FileIterator::Start() {
+  if (started_) return;
+  started_ = true;
+  reader_.emplace(
+      std::forward_as_tuple(
+          filename_, tensorflow::FileReaderBase::Options().set_env(env_)),
+      std::move(record_reader_options_));
+  const RecordPosition initial_pos = pos();
+  if (initial_pos != RecordPosition()) {
+    // This seeks directly to the chunk containing `initial_pos`, and decodes
+    // only that chunk.
+    reader_->Seek(initial_pos);
+    // Any errors from seeking will be reported during reading.
+  }
+  if (buffer_size_ > 0) {
+    ThreadPool::global().Schedule([this] { ReadInBackground(); });
+  }
+}
+
+void FileIterator::Next(Element* element) {
+  Start();
+  if (buffer_size_ == 0) {
+    ReadElement(element);
+  } else {
+    absl::MutexLock l(&mu_);
+    mu_.Await(absl::Condition(this, &FileIterator::HasElement));
+    if (buffer_.front().end) {
+      element->end = true;
+      return;
+    }
+    *element = std::move(buffer_.front());
+    buffer_.pop_front();
+  }
+  if (!element->end) {
+    absl::MutexLock l(&mu_);
+    pos_ = element->pos;
+  }
+}
+
+RecordPosition FileIterator::pos() const {
+  absl::MutexLock l(&mu_);
+  return pos_;
+}
+
+void FileIterator::ReadElement(Element* element) {
+  if (reader_->closed()) {
+    element->end = true;
+    return;
+  }
+  if (batched_) {
+    absl::Span<const absl::string_view> records;
+    if (TF_PREDICT_TRUE(reader_->ReadRecords(&records))) {
+      element->tensor = ::tensorflow::Tensor(
+          ::tensorflow::cpu_allocator(), ::tensorflow::DT_STRING,
+          {IntCast<::tensorflow::int64>(records.size())});
+      auto values = element->tensor.vec<::tensorflow::tstring>();
+      for (size_t i = 0; i < records.size(); ++i) {
+        values(i).assign(records[i].data(), records[i].size());
+      }
+      element->pos = reader_->pos();
+      return;
+    }
+  } else {
+    absl::string_view record;
+    if (TF_PREDICT_TRUE(reader_->ReadRecord(&record))) {
+      element->tensor = ::tensorflow::Tensor(::tensorflow::cpu_allocator(),
+                                             ::tensorflow::DT_STRING, {});
+      element->tensor.scalar<::tensorflow::tstring>()().assign(record.data(),
+                                                               record.size());
+      element->pos = reader_->pos();
+      return;
+    }
+  }
+  SkippedRegion skipped_region;
+  if (reader_->Recover(&skipped_region)) {
+    // File has invalid contents: return an error. Further iteration will
+    // resume reading the file after the invalid region has been skipped.
+    element->status = ::tensorflow::errors::DataLoss(
+        "Skipping invalid region of a Riegeli/records file: ",
+        skipped_region.ToString());
+    element->pos = reader_->pos();
+    return;
+  }
+  if (TF_PREDICT_FALSE(!reader_->Close())) {
+    // Failed to read the file: return an error. Further iteration will move on
+    // to the next file, if any.
+    const Status status = reader_->status();
+    element->status = ::tensorflow::Status(
+        static_cast<::tensorflow::error::Code>(status.code()),
+        status.message());
+    element->pos = pos();
+    return;
+  }
+  // We have reached the end of the file.
+  element->end = true;
+}
+
+void FileIterator::ReadInBackground() {
+  for (;;) {
+    {
+      absl::MutexLock l(&mu_);
+      mu_.Await(absl::Condition(this, &FileIterator::HasCapacity));
+      if (cancelled_) break;
+    }
+    Element element;
+    ReadElement(&element);
+    const bool end = element.end;
+    {
+      absl::MutexLock l(&mu_);
+      buffer_.push_back(std::move(element));
+    }
+    if (end) break;
+  }
+  absl::MutexLock l(&mu_);
+  background_done_ = true;
+}
+
+bool FileIterator::HasCapacity() const {
+  return cancelled_ || buffer_.size() < buffer_size_;
+}
+
+bool FileIterator::HasElement() const { return !buffer_.empty(); }
+
+bool FileIterator::BackgroundDone() const { return background_done_; }
+
+// Parses fields of the `field_projection` attr. Each field is a sequence of
+// field tags separated by '.', descending from the root message. An empty list
+// includes all fields.
+::tensorflow::Status ParseFieldProjection(
+    const std::vector<std::string>& fields, FieldProjection* field_projection) {
+  if (fields.empty()) {
+    *field_projection = FieldProjection::All();
+    return ::tensorflow::Status::OK();
+  }
+  *field_projection = FieldProjection();
+  for (const std::string& field_string : fields) {
+    Field field;
+    if (!field_string.empty()) {
+      for (const absl::string_view tag_string :
+           absl::StrSplit(field_string, '.')) {
+        uint32_t tag;
+        if (TF_PREDICT_FALSE(!absl::SimpleAtoi(tag_string, &tag) ||
+                             tag > (uint32_t{1} << 29) - 1)) {
+          return ::tensorflow::errors::InvalidArgument(
+              "Invalid field of `field_projection`: \"", field_string, "\"");
+        }
+        field.AddTag(tag);
+      }
+    }
+    field_projection->AddField(std::move(field));
+  }
+  return ::tensorflow::Status::OK();
+}
+
 class RiegeliDatasetOp : public ::tensorflow::data::DatasetOpKernel {
  public:
-  using DatasetOpKernel::DatasetOpKernel;
+  explicit RiegeliDatasetOp(::tensorflow::OpKernelConstruction* ctx)
+      : DatasetOpKernel(ctx) {
+    OP_REQUIRES_OK(ctx,
+                   ctx->GetAttr("num_parallel_reads", &num_parallel_reads_));
+    OP_REQUIRES(ctx, num_parallel_reads_ > 0,
+                ::tensorflow::errors::InvalidArgument(
+                    "`num_parallel_reads` must be positive."));
+    OP_REQUIRES_OK(ctx, ctx->GetAttr("block_length", &block_length_));
+    OP_REQUIRES(ctx, block_length_ > 0,
+                ::tensorflow::errors::InvalidArgument(
+                    "`block_length` must be positive."));
+    OP_REQUIRES_OK(ctx, ctx->GetAttr("buffer_size", &buffer_size_));
+    OP_REQUIRES(ctx, buffer_size_ >= 0,
+                ::tensorflow::errors::InvalidArgument(
+                    "`buffer_size` must not be negative."));
+    OP_REQUIRES_OK(ctx, ctx->GetAttr("batched", &batched_));
+    OP_REQUIRES_OK(ctx, ctx->GetAttr("field_projection", &field_projection_));
+    OP_REQUIRES_OK(ctx, ParseFieldProjection(field_projection_,
+                                             &parsed_field_projection_));
+  }
 
   void MakeDataset(::tensorflow::OpKernelContext* ctx,
                    ::tensorflow::data::DatasetBase** output) override {
@@ -76,16 +351,31 @@ class RiegeliDatasetOp : public ::tensorflow::data::DatasetOpKernel {
       filenames.push_back(filenames_tensor->flat<::tensorflow::tstring>()(i));
     }
 
-    *output = new Dataset(ctx, std::move(filenames));
+    *output = new Dataset(ctx, std::move(filenames), num_parallel_reads_,
+                          block_length_, buffer_size_, batched_,
+                          field_projection_, parsed_field_projection_);
   }
 
  private:
   class Dataset : public ::tensorflow::data::DatasetBase {
    public:
     explicit Dataset(::tensorflow::OpKernelContext* ctx,
-                     std::vector<std::string> filenames)
+                     std::vector<std::string> filenames,
+                     ::tensorflow::int64 num_parallel_reads,
+                     ::tensorflow::int64 block_length,
+                     ::tensorflow::int64 buffer_size, bool batched,
+                     std::vector<std::string> field_projection,
+                     FieldProjection parsed_field_projection)
         : DatasetBase(::tensorflow::data::DatasetContext(ctx)),
-          filenames_(std::move(filenames)) {}
+          filenames_(std::move(filenames)),
+          num_parallel_reads_(num_parallel_reads),
+          block_length_(block_length),
+          buffer_size_(buffer_size),
+          batched_(batched),
+          field_projection_(std::move(field_projection)),
+          parsed_field_projection_(std::move(parsed_field_projection)),
+          output_shapes_({batched_ ? ::tensorflow::PartialTensorShape({-1})
+                                   : ::tensorflow::PartialTensorShape({})}) {}
 
     std::unique_ptr<::tensorflow::data::IteratorBase> MakeIteratorInternal(
         const std::string& prefix) const override {
@@ -101,9 +391,7 @@ class RiegeliDatasetOp : public ::tensorflow::data::DatasetOpKernel {
 
     const std::vector<::tensorflow::PartialTensorShape>& output_shapes()
         const override {
-      static const std::vector<::tensorflow::PartialTensorShape>* const shapes =
-          new std::vector<::tensorflow::PartialTensorShape>({{}});
-      return *shapes;
+      return output_shapes_;
     }
 
     std::string DebugString() const override {
@@ -124,15 +412,37 @@ class RiegeliDatasetOp : public ::tensorflow::data::DatasetOpKernel {
         DatasetGraphDefBuilder* b, ::tensorflow::Node** output) const override {
       ::tensorflow::Node* filenames = nullptr;
       TF_RETURN_IF_ERROR(b->AddVector(filenames_, &filenames));
-      TF_RETURN_IF_ERROR(b->AddDataset(this, {filenames}, output));
+      ::tensorflow::AttrValue num_parallel_reads;
+      b->BuildAttrValue(num_parallel_reads_, &num_parallel_reads);
+      ::tensorflow::AttrValue block_length;
+      b->BuildAttrValue(block_length_, &block_length);
+      ::tensorflow::AttrValue buffer_size;
+      b->BuildAttrValue(buffer_size_, &buffer_size);
+      ::tensorflow::AttrValue batched;
+      b->BuildAttrValue(batched_, &batched);
+      ::tensorflow::AttrValue field_projection;
+      b->BuildAttrValue(field_projection_, &field_projection);
+      TF_RETURN_IF_ERROR(b->AddDataset(
+          this, {filenames},
+          {{"num_parallel_reads", num_parallel_reads},
+           {"block_length", block_length},
+           {"buffer_size", buffer_size},
+           {"batched", batched},
+           {"field_projection", field_projection}},
+          output));
       return ::tensorflow::Status::OK();
     }
 
    private:
+    // Files are read in a cycle of `num_parallel_reads_` files, taking
+    // `block_length_` elements from each file in turn. When a file ends, the
+    // next file takes its place in the cycle. This is deterministic, like
+    // `tf.data.Dataset.interleave()`.
     class Iterator : public ::tensorflow::data::DatasetIterator<Dataset> {
      public:
       explicit Iterator(const Params& params)
-          : DatasetIterator<Dataset>(params) {}
+          : DatasetIterator<Dataset>(params),
+            files_(IntCast<size_t>(params.dataset->num_parallel_reads_)) {}
 
       ::tensorflow::Status GetNextInternal(
           ::tensorflow::data::IteratorContext* ctx,
@@ -140,55 +450,48 @@ class RiegeliDatasetOp : public ::tensorflow::data::DatasetOpKernel {
           bool* end_of_sequence) override ABSL_LOCKS_EXCLUDED(mu_) {
         absl::MutexLock l(&mu_);
         for (;;) {
-          if (reader_.has_value()) {
-            // We are currently processing a file, so try to read the next
-            // record.
-            ::tensorflow::Tensor result_tensor(::tensorflow::cpu_allocator(),
-                                               ::tensorflow::DT_STRING, {});
-            absl::string_view value;
-            if (TF_PREDICT_TRUE(reader_->ReadRecord(&value))) {
-              result_tensor.scalar<::tensorflow::tstring>()().assign(
-                  value.data(), value.size());
-              out_tensors->push_back(std::move(result_tensor));
-              *end_of_sequence = false;
-              return ::tensorflow::Status::OK();
+          // Open files which take free places in the cycle, and start files
+          // restored from a checkpoint, so that they are read ahead as soon as
+          // possible.
+          bool any_file_open = false;
+          for (std::unique_ptr<FileIterator>& file : files_) {
+            if (file == nullptr &&
+                next_file_index_ < dataset()->filenames_.size()) {
+              file = OpenFile(ctx, next_file_index_++, RecordPosition());
             }
-            SkippedRegion skipped_region;
-            if (reader_->Recover(&skipped_region)) {
-              // File has invalid contents: return an error. Further iteration
-              // will resume reading the file after the invalid region has been
-              // skipped.
-              *end_of_sequence = false;
-              return ::tensorflow::errors::DataLoss(
-                  "Skipping invalid region of a Riegeli/records file: ",
-                  skipped_region.ToString());
+            if (file != nullptr) {
+              file->Start();
+              any_file_open = true;
             }
-            if (TF_PREDICT_FALSE(!reader_->Close())) {
-              // Failed to read the file: return an error.
-              const Status status = reader_->status();
-              // Further iteration will move on to the next file, if any.
-              reader_.reset();
-              ++current_file_index_;
-              *end_of_sequence =
-                  current_file_index_ == dataset()->filenames_.size();
-              return ::tensorflow::Status(
-                  static_cast<::tensorflow::error::Code>(status.code()),
-                  status.message());
-            }
-            // We have reached the end of the current file, so move on to the
-            // next file, if any.
-            reader_.reset();
-            ++current_file_index_;
           }
 
           // Iteration ends when there are no more files to process.
-          if (current_file_index_ == dataset()->filenames_.size()) {
+          if (!any_file_open) {
             *end_of_sequence = true;
             return ::tensorflow::Status::OK();
           }
 
-          // Actually move on to next file.
-          OpenFile(ctx);
+          std::unique_ptr<FileIterator>& file = files_[cycle_index_];
+          if (file == nullptr) {
+            AdvanceCycle();
+            continue;
+          }
+          FileIterator::Element element;
+          file->Next(&element);
+          if (element.end) {
+            // We have reached the end of the current file, so move on to the
+            // next file, if any.
+            file.reset();
+            AdvanceCycle();
+            continue;
+          }
+          *end_of_sequence = false;
+          if (TF_PREDICT_FALSE(!element.status.ok())) return element.status;
+          out_tensors->push_back(std::move(element.tensor));
+          if (++block_index_ == IntCast<size_t>(dataset()->block_length_)) {
+            AdvanceCycle();
+          }
+          return ::tensorflow::Status::OK();
         }
       }
 
@@ -198,11 +501,22 @@ class RiegeliDatasetOp : public ::tensorflow::data::DatasetOpKernel {
           ABSL_LOCKS_EXCLUDED(mu_) {
         absl::MutexLock l(&mu_);
         TF_RETURN_IF_ERROR(writer->WriteScalar(
-            full_name("current_file_index"),
-            IntCast<::tensorflow::int64>(current_file_index_)));
-        if (reader_.has_value()) {
-          TF_RETURN_IF_ERROR(writer->WriteScalar(full_name("current_pos"),
-                                                 reader_->pos().ToBytes()));
+            full_name("next_file_index"),
+            IntCast<::tensorflow::int64>(next_file_index_)));
+        TF_RETURN_IF_ERROR(
+            writer->WriteScalar(full_name("cycle_index"),
+                                IntCast<::tensorflow::int64>(cycle_index_)));
+        TF_RETURN_IF_ERROR(
+            writer->WriteScalar(full_name("block_index"),
+                                IntCast<::tensorflow::int64>(block_index_)));
+        for (size_t i = 0; i < files_.size(); ++i) {
+          if (files_[i] == nullptr) continue;
+          TF_RETURN_IF_ERROR(writer->WriteScalar(
+              full_name(absl::StrCat("file_index_", i)),
+              IntCast<::tensorflow::int64>(files_[i]->file_index())));
+          TF_RETURN_IF_ERROR(
+              writer->WriteScalar(full_name(absl::StrCat("pos_", i)),
+                                  files_[i]->pos().ToBytes()));
         }
         return ::tensorflow::Status::OK();
       }
@@ -212,63 +526,162 @@ class RiegeliDatasetOp : public ::tensorflow::data::DatasetOpKernel {
           ::tensorflow::data::IteratorStateReader* reader) override
           ABSL_LOCKS_EXCLUDED(mu_) {
         absl::MutexLock l(&mu_);
-        current_file_index_ = 0;
-        reader_.reset();
-
-        ::tensorflow::int64 current_file_index;
-        TF_RETURN_IF_ERROR(reader->ReadScalar(full_name("current_file_index"),
-                                              &current_file_index));
-        if (TF_PREDICT_FALSE(current_file_index < 0 ||
-                             IntCast<::tensorflow::uint64>(current_file_index) >
-                                 dataset()->filenames_.size())) {
-          return ::tensorflow::errors::Internal(
-              "current_file_index out of range");
-        }
-        current_file_index_ = IntCast<size_t>(current_file_index);
+        next_file_index_ = 0;
+        cycle_index_ = 0;
+        block_index_ = 0;
+        // Files already at the restored positions are kept, together with
+        // their decoded chunks and elements read ahead. This makes restoring
+        // state saved by this iterator cheap.
+        std::vector<std::unique_ptr<FileIterator>> previous_files(
+            files_.size());
+        previous_files.swap(files_);
 
-        if (reader->Contains(full_name("current_pos"))) {
-          if (TF_PREDICT_FALSE(current_file_index_ ==
-                               dataset()->filenames_.size())) {
-            return ::tensorflow::errors::Internal(
-                "current_file_index out of range");
+        if (reader->Contains(full_name("current_file_index"))) {
+          // The state was saved before files were read in a cycle.
+          ::tensorflow::int64 current_file_index;
+          TF_RETURN_IF_ERROR(reader->ReadScalar(
+              full_name("current_file_index"), &current_file_index));
+          TF_RETURN_IF_ERROR(CheckFileIndex(current_file_index, true));
+          next_file_index_ = IntCast<size_t>(current_file_index);
+          if (reader->Contains(full_name("current_pos"))) {
+            TF_RETURN_IF_ERROR(CheckFileIndex(current_file_index, false));
+            RecordPosition pos;
+            TF_RETURN_IF_ERROR(
+                ReadRecordPosition(reader, full_name("current_pos"), &pos));
+            files_[0] = ReuseOrOpenFile(ctx, next_file_index_++, pos,
+                                        &previous_files[0]);
           }
-          ::tensorflow::tstring current_pos;
-          TF_RETURN_IF_ERROR(
-              reader->ReadScalar(full_name("current_pos"), &current_pos));
+          return ::tensorflow::Status::OK();
+        }
+
+        ::tensorflow::int64 next_file_index;
+        TF_RETURN_IF_ERROR(reader->ReadScalar(full_name("next_file_index"),
+                                              &next_file_index));
+        TF_RETURN_IF_ERROR(CheckFileIndex(next_file_index, true));
+        next_file_index_ = IntCast<size_t>(next_file_index);
+        ::tensorflow::int64 cycle_index;
+        TF_RETURN_IF_ERROR(
+            reader->ReadScalar(full_name("cycle_index"), &cycle_index));
+        if (TF_PREDICT_FALSE(cycle_index < 0 ||
+                             IntCast<::tensorflow::uint64>(cycle_index) >=
+                                 files_.size())) {
+          return ::tensorflow::errors::Internal("cycle_index out of range");
+        }
+        cycle_index_ = IntCast<size_t>(cycle_index);
+        ::tensorflow::int64 block_index;
+        TF_RETURN_IF_ERROR(
+            reader->ReadScalar(full_name("block_index"), &block_index));
+        if (TF_PREDICT_FALSE(block_index < 0 ||
+                             block_index >= dataset()->block_length_)) {
+          return ::tensorflow::errors::Internal("block_index out of range");
+        }
+        block_index_ = IntCast<size_t>(block_index);
+        for (size_t i = 0; i < files_.size(); ++i) {
+          const std::string file_index_name =
+              full_name(absl::StrCat("file_index_", i));
+          if (!reader->Contains(file_index_name)) continue;
+          ::tensorflow::int64 file_index;
+          TF_RETURN_IF_ERROR(reader->ReadScalar(file_index_name, &file_index));
+          TF_RETURN_IF_ERROR(CheckFileIndex(file_index, false));
           RecordPosition pos;
-          if (TF_PREDICT_FALSE(!pos.FromBytes(current_pos))) {
-            return ::tensorflow::errors::Internal(
-                "current_pos is not a valid RecordPosition");
-          }
-          OpenFile(ctx);
-          reader_->Seek(pos);
-          // Any errors from seeking will be reported during reading.
+          TF_RETURN_IF_ERROR(ReadRecordPosition(
+              reader, full_name(absl::StrCat("pos_", i)), &pos));
+          files_[i] = ReuseOrOpenFile(ctx, IntCast<size_t>(file_index), pos,
+                                      &previous_files[i]);
         }
         return ::tensorflow::Status::OK();
       }
 
      private:
-      void OpenFile(::tensorflow::data::IteratorContext* ctx)
+      std::unique_ptr<FileIterator> OpenFile(
+          ::tensorflow::data::IteratorContext* ctx, size_t file_index,
+          RecordPosition initial_pos) ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_) {
+        return std::make_unique<FileIterator>(
+            file_index, dataset()->filenames_[file_index], ctx->env(),
+            RecordReaderBase::Options().set_field_projection(
+                dataset()->parsed_field_projection_),
+            dataset()->batched_, IntCast<size_t>(dataset()->buffer_size_),
+            initial_pos);
+      }
+
+      // Returns `*previous_file` if it is at `pos` of the same file, otherwise
+      // opens the file.
+      std::unique_ptr<FileIterator> ReuseOrOpenFile(
+          ::tensorflow::data::IteratorContext* ctx, size_t file_index,
+          RecordPosition pos, std::unique_ptr<FileIterator>* previous_file)
           ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_) {
-        reader_.emplace(std::forward_as_tuple(
-            dataset()->filenames_[current_file_index_],
-            tensorflow::FileReaderBase::Options().set_env(ctx->env())));
+        if (*previous_file != nullptr &&
+            (*previous_file)->file_index() == file_index &&
+            (*previous_file)->pos() == pos) {
+          return std::move(*previous_file);
+        }
+        return OpenFile(ctx, file_index, pos);
+      }
+
+      void AdvanceCycle() ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_) {
+        block_index_ = 0;
+        cycle_index_ = (cycle_index_ + 1) % files_.size();
+      }
+
+      // Checks that `file_index` is a valid index of a file, or the number of
+      // files if `allow_end`.
+      ::tensorflow::Status CheckFileIndex(::tensorflow::int64 file_index,
+                                          bool allow_end) const {
+        const size_t num_files = dataset()->filenames_.size();
+        if (TF_PREDICT_FALSE(
+                file_index < 0 ||
+                IntCast<::tensorflow::uint64>(file_index) > num_files ||
+                (!allow_end &&
+                 IntCast<::tensorflow::uint64>(file_index) == num_files))) {
+          return ::tensorflow::errors::Internal("file index out of range");
+        }
+        return ::tensorflow::Status::OK();
+      }
+
+      static ::tensorflow::Status ReadRecordPosition(
+          ::tensorflow::data::IteratorStateReader* reader,
+          const std::string& name, RecordPosition* pos) {
+        ::tensorflow::tstring serialized;
+        TF_RETURN_IF_ERROR(reader->ReadScalar(name, &serialized));
+        if (TF_PREDICT_FALSE(!pos->FromBytes(serialized))) {
+          return ::tensorflow::errors::Internal(
+              name, " is not a valid RecordPosition");
+        }
+        return ::tensorflow::Status::OK();
       }
 
       // Invariants:
-      //   `current_file_index_ <= dataset()->filenames_.size()`
-      //   if `current_file_index_ == dataset()->filenames_.size()` then
-      //       `!reader_.has_value()`
+      //   `next_file_index_ <= dataset()->filenames_.size()`
+      //   `cycle_index_ < files_.size()`
+      //   `block_index_ < dataset()->block_length_`
 
       absl::Mutex mu_;
-      size_t current_file_index_ ABSL_GUARDED_BY(mu_) = 0;
-      // `absl::nullopt` means not open yet.
-      absl::optional<RecordReader<tensorflow::FileReader<>>> reader_
-          ABSL_GUARDED_BY(mu_);
+      size_t next_file_index_ ABSL_GUARDED_BY(mu_) = 0;
+      // Files being read, `nullptr` at free places in the cycle.
+      std::vector<std::unique_ptr<FileIterator>> files_ ABSL_GUARDED_BY(mu_);
+      size_t cycle_index_ ABSL_GUARDED_BY(mu_) = 0;
+      // The number of elements taken from `files_[cycle_index_]` in the
+      // current block.
+      size_t block_index_ ABSL_GUARDED_BY(mu_) = 0;
     };
 
     const std::vector<std::string> filenames_;
+    const ::tensorflow::int64 num_parallel_reads_;
+    const ::tensorflow::int64 block_length_;
+    const ::tensorflow::int64 buffer_size_;
+    const bool batched_;
+    // The `field_projection` attr, and its parsed form.
+    const std::vector<std::string> field_projection_;
+    const FieldProjection parsed_field_projection_;
+    const std::vector<::tensorflow::PartialTensorShape> output_shapes_;
   };
+
+  ::tensorflow::int64 num_parallel_reads_ = 1;
+  ::tensorflow::int64 block_length_ = 1;
+  ::tensorflow::int64 buffer_size_ = 0;
+  bool batched_ = false;
+  std::vector<std::string> field_projection_;
+  FieldProjection parsed_field_projection_;
 };
 
 REGISTER_KERNEL_BUILDER(Name("RiegeliDataset").Device(::tensorflow::DEVICE_CPU),
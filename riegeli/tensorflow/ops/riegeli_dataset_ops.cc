@@ -21,6 +21,11 @@ namespace tensorflow {
 REGISTER_OP("RiegeliDataset")
     .Input("filenames: string")
     .Output("handle: variant")
+    .Attr("num_parallel_reads: int = 1")
+    .Attr("block_length: int = 1")
+    .Attr("buffer_size: int = 0")
+    .Attr("batched: bool = false")
+    .Attr("field_projection: list(string) = []")
     .SetIsStateful()
     .SetShapeFn(::tensorflow::shape_inference::ScalarShape)
     .Doc(R"doc(
@@ -28,6 +33,20 @@ Creates a dataset that emits the records from one or more Riegeli/records files.
 
 filenames: A scalar or vector containing the name(s) of the file(s) to be
   read.
+num_parallel_reads: The number of files read in a cycle. Elements are taken
+  from files of the cycle in turn. When a file ends, the next file takes its
+  place.
+block_length: The number of consecutive elements taken from a file of the
+  cycle before moving on to the next file.
+buffer_size: If positive, each file of the cycle is read ahead in a background
+  thread, buffering up to this many elements, so that files are read and
+  decoded concurrently.
+batched: If false, each element is a scalar containing a record. If true, each
+  element is a vector containing records of a chunk.
+field_projection: If not empty, the set of fields to be included in returned
+  records, allowing to exclude the remaining fields. Projection is effective if
+  files have been written with transposition. Each field is a sequence of proto
+  field tags descending from the root message, separated by '.', e.g. "1.3".
 )doc");
 
 }  // namespace tensorflow